@@ -0,0 +1,87 @@
+/*
+ * compressworker.c - A program to compress data for other machines that are
+ * writing WIM files.
+ *
+ * Copyright 2022 Eric Biggers
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This program runs a compression worker, to which a program writing a WIM file
+ * can send the data to compress after calling
+ * wimlib_set_output_compression_workers(), or that wimlib-imagex can use with
+ * its --compress-workers option.  For example, on each of the machines that
+ * should compress the data:
+ *
+ *    $ ./compressworker 7637
+ *
+ * and then on the machine writing the WIM file:
+ *
+ *    $ wimcapture dir dir.wim --solid --compress-workers=host1:7637,host2:7637
+ *
+ * The optional second argument is the number of chunks to compress at a time,
+ * which defaults to the number of processors.
+ */
+
+#include <wimlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Windows compatibility defines for string encoding.  Compression workers
+ * aren't supported on Windows, but this still builds there.
+ */
+#ifdef _WIN32
+#  include <wchar.h>
+#  define main		wmain
+   typedef wchar_t	tchar;
+#  define TS		"ls"
+#  define tstrtoul	wcstoul
+#else
+   typedef char		tchar;
+#  define TS		"s"
+#  define tstrtoul	strtoul
+#endif
+
+int main(int argc, tchar **argv)
+{
+	unsigned num_threads = 0;
+	int ret;
+
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: compressworker [HOST:]PORT [NUM_THREADS]\n");
+		return 2;
+	}
+	if (argc == 3)
+		num_threads = tstrtoul(argv[2], NULL, 10);
+
+	/* Print messages about connections that fail.  */
+	wimlib_set_print_errors(true);
+
+	/* Serve connections until an error occurs.  */
+	ret = wimlib_serve_compression(argv[1], num_threads, 0);
+
+	fprintf(stderr, "wimlib error %d: %" TS "\n",
+		ret, wimlib_get_error_string((enum wimlib_error_code)ret));
+	return ret;
+}
@@ -196,7 +196,9 @@
  * users are free to use <i>different</i> ::WIMStruct's from different threads
  * concurrently.  It is even allowed for multiple ::WIMStruct's to be backed by
  * the same on-disk WIM file, although "overwrites" should never be done in such
- * a scenario.
+ * a scenario.  A ::WIMStruct given to one of the asynchronous functions, such
+ * as wimlib_write_async(), is in use by the library until the operation has
+ * completed; see @ref G_async.
  *
  * In addition, several functions change global state and should only be called
  * when a single thread is active in the library.  These functions are:
@@ -363,6 +365,21 @@
  * more information about the API design.
  */
 
+/** @defgroup G_async Asynchronous operations
+ *
+ * @brief Extract or write WIMs without blocking the calling thread.
+ *
+ * wimlib_extract_image_async(), wimlib_write_async(), and
+ * wimlib_overwrite_async() start the same operations as their synchronous
+ * counterparts on a thread owned by the library, and return a handle to the
+ * operation.  The handle can be polled with wimlib_poll_operation(), waited on
+ * with wimlib_wait_operation(), and cancelled with wimlib_cancel_operation().
+ * A completion function may also be given; it is called on the library's
+ * thread when the operation finishes.  This allows applications with an event
+ * loop, such as a GUI or a service, to run long operations without dedicating
+ * a thread of their own to each one.
+ */
+
 /** @defgroup G_nonstandalone_wims Creating and handling non-standalone WIMs
  *
  * @brief Create and handle non-standalone WIMs, such as split and delta WIMs.
@@ -474,6 +491,9 @@ typedef struct WIMStruct WIMStruct;
 #define WIMLIB_WIMSTRUCT_DECLARED
 #endif
 
+/** Opaque handle to an asynchronous operation; see @ref G_async.  */
+struct wimlib_operation;
+
 #ifdef _WIN32
 typedef wchar_t wimlib_tchar;
 #else
@@ -583,7 +603,8 @@ enum wimlib_compression_type {
 	 * produce a better compression ratio, and work more quickly, than the
 	 * implementation in Microsoft's WIMGAPI (as of Windows 8.1).  There is
 	 * limited support for non-default compression levels, but compression
-	 * will be noticeably faster if you choose a level < 35.
+	 * will be noticeably faster if you choose a level < 35, and much faster
+	 * (using lazy rather than near-optimal parsing) at levels < 25.
 	 *
 	 * If using wimlib_create_compressor() to create an LZMS compressor
 	 * directly, the @p max_block_size parameter may be any positive value
@@ -798,6 +819,18 @@ enum wimlib_progress_msg {
 	 *	  build of the library only.
 	 */
 	WIMLIB_PROGRESS_MSG_HANDLE_ERROR = 31,
+
+	/** Sent periodically while a directory tree is being scanned, if a
+	 * progress interval has been set with wimlib_set_progress_interval().
+	 * @p info will point to ::wimlib_progress_info.scan, whose counts
+	 * cover everything scanned so far and whose @p cur_path member is the
+	 * path most recently scanned.  Unlike
+	 * ::WIMLIB_PROGRESS_MSG_SCAN_DENTRY, this doesn't require
+	 * ::WIMLIB_ADD_FLAG_VERBOSE, so programs which only display how much
+	 * has been scanned can avoid receiving a message for every file.
+	 *
+	 * Since wimlib v1.15.0.  */
+	WIMLIB_PROGRESS_MSG_SCAN_PROGRESS = 32,
 };
 
 /** Valid return values from user-provided progress functions
@@ -876,11 +909,18 @@ union wimlib_progress_info {
 		/** Since wimlib v1.13.4: Like @p completed_bytes, but counts
 		 * the compressed size.  */
 		uint64_t completed_compressed_bytes;
+
+		/** Since wimlib v1.15.0: the number of bytes of @p
+		 * completed_bytes that were stored uncompressed without trying
+		 * to compress them, because they were captured from files that
+		 * matched [CompressionExclusionList] in the capture
+		 * configuration file.  */
+		uint64_t completed_excluded_bytes;
 	} write_streams;
 
 	/** Valid on messages ::WIMLIB_PROGRESS_MSG_SCAN_BEGIN,
-	 * ::WIMLIB_PROGRESS_MSG_SCAN_DENTRY, and
-	 * ::WIMLIB_PROGRESS_MSG_SCAN_END.  */
+	 * ::WIMLIB_PROGRESS_MSG_SCAN_DENTRY, ::WIMLIB_PROGRESS_MSG_SCAN_PROGRESS,
+	 * and ::WIMLIB_PROGRESS_MSG_SCAN_END.  */
 	struct wimlib_progress_info_scan {
 
 		/** Top-level directory being scanned; or, when capturing an NTFS
@@ -890,7 +930,8 @@ union wimlib_progress_info {
 		const wimlib_tchar *source;
 
 		/** Path to the file (or directory) that has been scanned, valid
-		 * on ::WIMLIB_PROGRESS_MSG_SCAN_DENTRY.  When capturing an NTFS
+		 * on ::WIMLIB_PROGRESS_MSG_SCAN_DENTRY and
+		 * ::WIMLIB_PROGRESS_MSG_SCAN_PROGRESS.  When capturing an NTFS
 		 * volume with ::WIMLIB_ADD_FLAG_NTFS, this path will be
 		 * relative to the root of the NTFS volume.  */
 		const wimlib_tchar *cur_path;
@@ -948,6 +989,14 @@ union wimlib_progress_info {
 		/** The number of bytes of file data detected so far, not
 		 * counting excluded/unsupported files.  */
 		uint64_t num_bytes_scanned;
+
+		/** The number of bytes, of @p num_bytes_scanned, of file data
+		 * in files found to be unchanged from the template image set
+		 * with wimlib_set_capture_template(), or whose checksums were
+		 * found in the hash cache set with
+		 * wimlib_set_capture_hash_cache(), whose data is already
+		 * present, so that it won't need to be read.  */
+		uint64_t num_bytes_unchanged;
 	} scan;
 
 	/** Valid on messages
@@ -1708,6 +1757,26 @@ typedef int (*wimlib_iterate_dir_tree_callback_t)(const struct wimlib_dir_entry
 typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resource_entry *resource,
 						      void *user_ctx);
 
+/**
+ * Type of a callback function to wimlib_iterate_dir_tree_batched().  It
+ * receives @p num_entries directory entries, in the order in which
+ * wimlib_iterate_dir_tree() would pass them one at a time.  The entries and the
+ * array of pointers to them are only valid until the callback returns.  Must
+ * return 0 on success.
+ */
+typedef int (*wimlib_iterate_dir_tree_batch_callback_t)(const struct wimlib_dir_entry * const *entries,
+							size_t num_entries,
+							void *user_ctx);
+
+/**
+ * Type of a callback function to wimlib_iterate_lookup_table_batched().  It
+ * receives an array of @p num_resources entries, which is only valid until the
+ * callback returns.  Must return 0 on success.
+ */
+typedef int (*wimlib_iterate_lookup_table_batch_callback_t)(const struct wimlib_resource_entry *resources,
+							    size_t num_resources,
+							    void *user_ctx);
+
 /** For wimlib_iterate_dir_tree(): Iterate recursively on children rather than
  * just on the specified path. */
 #define WIMLIB_ITERATE_DIR_TREE_FLAG_RECURSIVE 0x00000001
@@ -1723,6 +1792,15 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * the @ref wimlib_resource_entry::is_missing "is_missing" flag.  */
 #define WIMLIB_ITERATE_DIR_TREE_FLAG_RESOURCES_NEEDED  0x00000004
 
+/** Don't fill in the streams of each ::wimlib_dir_entry:
+ * @ref wimlib_dir_entry::num_named_streams "num_named_streams" will be 0 and
+ * the first stream entry will be zeroed.  This saves looking up the file data
+ * of each file when it isn't needed.  */
+#define WIMLIB_ITERATE_DIR_TREE_FLAG_NO_STREAMS		0x00000008
+
+/** Don't fill in the security descriptor of each ::wimlib_dir_entry.  */
+#define WIMLIB_ITERATE_DIR_TREE_FLAG_NO_SECURITY_DESCRIPTORS	0x00000010
+
 
 /** @} */
 /** @addtogroup G_modifying_wims
@@ -1886,6 +1964,42 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  */
 #define WIMLIB_ADD_FLAG_FILE_PATHS_UNNEEDED	0x00010000
 
+/**
+ * Read the data of each large file with several overlapped reads in flight at
+ * once, rather than with one read at a time, when the data is read while
+ * writing the WIM archive.  The reads are still issued in file order and files
+ * are still read in the order of their location on disk, so this is usually
+ * much faster on solid-state drives and harmless on hard disks that reorder
+ * queued requests.  Currently this only makes a difference on Windows.
+ */
+#define WIMLIB_ADD_FLAG_OVERLAPPED_READS	0x00020000
+
+/**
+ * UNIX-like systems only: Capture the contents of a tar archive rather than a
+ * directory tree.  The source path names the archive, which may be a named pipe
+ * or standard input (e.g. "/dev/stdin") as well as a file.  Archives in the
+ * POSIX ustar and pax formats and the GNU format are understood, except for
+ * multi-volume archives and GNU sparse files.  The archive isn't unpacked:
+ * the data of the files archived in a regular file is read from the archive
+ * when the WIM archive is written, while the data of the files archived in a
+ * pipe is read into memory as the archive is scanned.
+ *
+ * This flag cannot be combined with ::WIMLIB_ADD_FLAG_NTFS.
+ * ::WIMLIB_ADD_FLAG_UNIX_DATA makes the owners and modes of the archived
+ * files, and the device nodes, FIFOs, and sockets in the archive, be captured.
+ */
+#define WIMLIB_ADD_FLAG_TAR			0x00040000
+
+/**
+ * Linux only: Look up where the data of each regular file starts on disk while
+ * scanning, so that when the WIM archive is written, the files are read in the
+ * order of their location on disk rather than in the order of their paths.
+ * This makes capturing from a hard disk much faster, at the cost of opening
+ * each file while scanning.  (On Windows, files are always read in the order of
+ * their location on disk.)
+ */
+#define WIMLIB_ADD_FLAG_DISK_ORDER		0x00080000
+
 /** @} */
 /** @addtogroup G_modifying_wims
  * @{ */
@@ -2032,6 +2146,18 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * only allows the Administrator to create symbolic links.  */
 #define WIMLIB_EXTRACT_FLAG_STRICT_SYMLINKS             0x00008000
 
+/**
+ * Write the extracted files' data in an order closer to the order of the files
+ * in the directory tree, rather than strictly in the order in which the data is
+ * stored in the WIM file.  The data is still read in the WIM file's order, but
+ * within each window of up to 64 MiB of data that isn't in solid resources, the
+ * reads are reordered so that files are written in directory order.  This
+ * trades short seeks in the WIM file for fewer seeks on the target, which helps
+ * when extracting to a hard disk, and for less fragmentation of the Master File
+ * Table in the NTFS-3G extraction mode.  Ignored when extracting from a pipe.
+ */
+#define WIMLIB_EXTRACT_FLAG_TARGET_ORDER		0x00020000
+
 /**
  * For wimlib_extract_paths() and wimlib_extract_pathlist() only:  Treat the
  * paths to extract as wildcard patterns ("globs") which may contain the
@@ -2075,6 +2201,20 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  */
 #define WIMLIB_EXTRACT_FLAG_WIMBOOT			0x00400000
 
+/**
+ * Write the extracted files to a tar archive rather than to the filesystem.
+ * The target is then the path to the archive to create, or "-" for standard
+ * output.  The archive is written sequentially, with the data of the files in
+ * the order it's read from the WIM archive, and is in the POSIX pax format,
+ * which GNU tar, bsdtar and others can read.  Hard links and symbolic links are
+ * archived as such; with ::WIMLIB_EXTRACT_FLAG_UNIX_DATA, so are UNIX owners
+ * and modes, special files, and extended attributes.  This flag can't be
+ * combined with ::WIMLIB_EXTRACT_FLAG_NTFS or ::WIMLIB_EXTRACT_FLAG_TO_STDOUT,
+ * nor used to extract all images at once.  Currently only supported on
+ * UNIX-like systems.
+ */
+#define WIMLIB_EXTRACT_FLAG_TAR				0x00800000
+
 /**
  * Since wimlib v1.8.2 and Windows-only: compress the extracted files using
  * System Compression, when possible.  This only works on either Windows 10 or
@@ -2097,6 +2237,31 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * 32768 byte chunks.  */
 #define WIMLIB_EXTRACT_FLAG_COMPACT_LZX			0x08000000
 
+/**
+ * Don't preallocate space for the data of extracted files.  By default, since
+ * the size of each file is known before its data is written, the space for it
+ * is allocated up front (with posix_fallocate() on UNIX-like systems, by setting
+ * the allocation size on Windows, and by presizing the data attribute in the
+ * NTFS-3G extraction mode), which avoids fragmenting the file as it grows.  This
+ * flag may be useful if preallocation is slow on the target filesystem, e.g.
+ * because it is emulated by writing zeroes.  Sparse files are never
+ * preallocated, regardless of this flag.
+ */
+#define WIMLIB_EXTRACT_FLAG_NO_PREALLOCATE		0x10000000
+
+/**
+ * When a blob is extracted to several files which aren't hard links of each
+ * other, write its data to only the first one, then make the others clones of
+ * it.  On filesystems which support sharing blocks between files, such as btrfs
+ * and XFS on Linux, the files then share their blocks, which saves both time
+ * and disk space when an image contains many identical files.  Elsewhere, the
+ * data is copied from the first file, which usually still saves time since it
+ * needn't be decompressed again.  Files whose data is at most 1 MiB are written
+ * separately anyway.  Currently only supported on UNIX-like systems; ignored
+ * elsewhere.
+ */
+#define WIMLIB_EXTRACT_FLAG_CLONE_DUPLICATES		0x20000000
+
 /** @} */
 /** @addtogroup G_mounting_wim_images
  * @{ */
@@ -2153,6 +2318,32 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * called.  */
 #define WIMLIB_OPEN_FLAG_WRITE_ACCESS			0x00000004
 
+/** Since wimlib v1.15.0: Map the WIM file into memory and read it through the
+ * mapping, rather than with explicit read calls.  This can reduce the CPU time
+ * spent copying data when the WIM file is fully or mostly in the page cache,
+ * especially when extracting uncompressed data, exporting without
+ * recompression, or verifying the integrity table.  This flag is only a hint:
+ * it is ignored on platforms that do not support memory mapping, and if the
+ * file cannot be mapped then it is just read normally.
+ *
+ * Warning: while the WIM file is mapped, if another process truncates it, then
+ * this process may be terminated by a SIGBUS signal rather than receiving an
+ * error.  Don't use this flag on WIM files that may be modified concurrently.
+ */
+#define WIMLIB_OPEN_FLAG_MMAP				0x00000008
+
+/** Since wimlib v1.15.0: Read the WIM file bypassing the operating system's
+ * file cache (with <c>O_DIRECT</c> on Linux), in large aligned blocks which are
+ * read ahead by a separate thread.  This can be faster, and avoids evicting other data from the
+ * cache, when a large WIM file is read once from start to end, e.g. when
+ * applying all of its images or exporting them without recompression.  It is
+ * likely slower when the WIM file is read in small pieces from many places.
+ * This flag is only a hint: it is ignored if the file can't be opened this way,
+ * e.g. because the filesystem doesn't support it, and it is currently ignored
+ * on Windows.  It takes precedence over
+ * ::WIMLIB_OPEN_FLAG_MMAP.  */
+#define WIMLIB_OPEN_FLAG_UNBUFFERED			0x00000010
+
 /** @} */
 /** @addtogroup G_mounting_wim_images
  * @{ */
@@ -2197,6 +2388,26 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * ::WIMLIB_PROGRESS_MSG_UPDATE_END_COMMAND messages.  */
 #define WIMLIB_UPDATE_FLAG_SEND_PROGRESS		0x00000001
 
+/** @} */
+/** @addtogroup G_general
+ * @{ */
+
+/** Skip the file data which an earlier wimlib_verify_wim() with this flag
+ * found to be intact and which hasn't been moved or rewritten since then, and
+ * after a successful verification, record all the file data as verified.  The
+ * record is kept in a cache file named after the WIM file with
+ * <c>.verify-cache</c> appended.  It is ignored if the WIM file has since been
+ * replaced by a different file, as for example wimlib_overwrite() does when it
+ * rebuilds the WIM; data appended to the WIM file is still verified.  Note that
+ * this can't detect corruption of data which wasn't otherwise modified, so a
+ * full verification should still be done from time to time.  This flag has no
+ * effect when the WIM was not opened from a file.  */
+#define WIMLIB_VERIFY_FLAG_USE_CACHE			0x00000001
+
+/** With ::WIMLIB_VERIFY_FLAG_USE_CACHE, verify all the file data regardless of
+ * what the cache says, but still record it in the cache afterwards.  */
+#define WIMLIB_VERIFY_FLAG_FORCE			0x00000002
+
 /** @} */
 /** @addtogroup G_writing_and_overwriting_wims
  * @{ */
@@ -2225,6 +2436,12 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * <b>--pipable</b> option of <b>wimcapture</b> for more information.  Beware:
  * WIMs written with this flag will not be compatible with Microsoft's software.
  *
+ * A pipable WIM file can still be opened with wimlib_open_wim() and then
+ * accessed randomly like any other WIM file, even if it was written to a pipe:
+ * its blob table, XML data, and a copy of its header are located at the end.
+ * So, for example, wimlib_extract_paths() only reads the data needed for the
+ * specified paths.
+ *
  * For ::WIMStruct's created with wimlib_open_wim(), the default behavior is to
  * write the WIM as pipable if and only if it was pipable before.  For
  * ::WIMStruct's created with wimlib_create_new_wim(), the default behavior is
@@ -2256,6 +2473,11 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * resources from being re-used.  Otherwise, solid resources are re-used
  * somewhat more liberally than normal compressed resources.
  *
+ * Data that wimlib itself already compressed with the same compression type,
+ * chunk size, compression level, and solid status, as recorded in the WIM
+ * file's XML data, is re-used even with ::WIMLIB_WRITE_FLAG_RECOMPRESS, since
+ * recompressing it would produce the same result.
+ *
  * ::WIMLIB_WRITE_FLAG_RECOMPRESS does <b>not</b> cause recompression of data
  * that would not otherwise be written.  For example, a call to
  * wimlib_overwrite() with ::WIMLIB_WRITE_FLAG_RECOMPRESS will not, by itself,
@@ -2277,6 +2499,10 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * overwrite the WIM file via a temporary file instead of in-place.  This is
  * necessary on POSIX systems; it will, for example, avoid problems with delayed
  * allocation on ext4.
+ *
+ * Where supported (currently Linux), the data is also flushed to disk as it is
+ * written, so that the final wait for the data to reach the disk is short and
+ * the data written doesn't accumulate in memory.
  */
 #define WIMLIB_WRITE_FLAG_FSYNC				0x00000020
 
@@ -2404,6 +2630,85 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  */
 #define WIMLIB_WRITE_FLAG_UNSAFE_COMPACT		0x00008000
 
+/**
+ * Since wimlib v1.15.0: before compressing each chunk of file data, estimate
+ * the entropy of a sample of it, and store the chunk uncompressed without
+ * trying to compress it if it looks like already-compressed data (for example,
+ * the contents of cabinet files, ZIP archives, or JPEG images).  This can save
+ * a lot of time when much of the data is already compressed, at the cost of
+ * occasionally storing a chunk uncompressed that could have been compressed
+ * slightly.  Data that is copied without recompression is not affected.
+ */
+#define WIMLIB_WRITE_FLAG_SKIP_INCOMPRESSIBLE		0x00010000
+
+/**
+ * Since wimlib v1.15.0: for wimlib_split() only: write several parts of the
+ * split WIM at the same time, rather than one after another.  This can be much
+ * faster when the parts are on fast or different storage, but on a single hard
+ * disk it usually just causes extra seeking.  This only takes effect when the
+ * data can be copied without being recompressed; otherwise the parts are
+ * written one at a time as usual.  While several parts are being written, no
+ * ::WIMLIB_PROGRESS_MSG_WRITE_STREAMS messages are sent for them.
+ */
+#define WIMLIB_WRITE_FLAG_CONCURRENT_PARTS		0x00020000
+
+/**
+ * Since wimlib v1.15.0: when writing solid resources, use the largest chunk
+ * size, up to 1 GiB, that the available memory allows, rather than the size
+ * set with wimlib_set_output_pack_chunk_size(), which becomes the minimum.  The
+ * size is never more than needed to hold all the data being compressed.  This
+ * gives the best compression ratio for large images, at the cost of using
+ * fewer compression threads and much more memory --- with LZMS, about 14 times
+ * the chunk size per thread.  Note that Microsoft's WIM software is not
+ * compatible with LZMS chunk sizes larger than 64 MiB.
+ */
+#define WIMLIB_WRITE_FLAG_AUTO_SOLID_CHUNK_SIZE		0x00040000
+
+/**
+ * Since wimlib v1.15.0: when arranging file data for solid compression, also
+ * look at the contents of the files rather than only at their names, so that
+ * similar files are compressed together even if their names differ, e.g.
+ * different versions of the same library.  This is done by reading the start
+ * of each file an extra time, so it makes writing the WIM file somewhat
+ * slower.  Data which is already in a WIM file is still arranged by name only.
+ * This flag has no effect with ::WIMLIB_WRITE_FLAG_NO_SOLID_SORT.
+ */
+#define WIMLIB_WRITE_FLAG_SOLID_SORT_SIMILARITY		0x00080000
+
+/**
+ * For wimlib_overwrite() only: after appending the changes to the WIM file,
+ * compact it in place, moving resources from the end of the file into the
+ * holes left by deleted images and earlier appends and then truncating the
+ * file.  Unlike ::WIMLIB_WRITE_FLAG_UNSAFE_COMPACT, this can be interrupted
+ * safely: the compaction proceeds in steps, each of which only writes to space
+ * that the WIM file doesn't use and then commits its changes by updating the
+ * header, so the WIM file remains valid throughout.  Calling
+ * wimlib_overwrite() with this flag again continues an interrupted compaction.
+ * Only enough extra disk space for one more copy of the blob table and XML data
+ * is needed.
+ *
+ * The compaction is not always complete: a hole is left if no resource after
+ * it fits into it.  Also, while the compaction is in progress the WIM file
+ * doesn't have an integrity table; it is written at the end, if requested or
+ * if the WIM file had one.  The WIM file must not be read by other processes
+ * while it is being compacted.
+ *
+ * This flag implies ::WIMLIB_WRITE_FLAG_SOFT_DELETE and
+ * ::WIMLIB_WRITE_FLAG_FSYNC and cannot be combined with
+ * ::WIMLIB_WRITE_FLAG_RECOMPRESS.  If the WIM file can't be updated in place,
+ * then wimlib_overwrite() fails with ::WIMLIB_ERR_COMPACTION_NOT_POSSIBLE.
+ */
+#define WIMLIB_WRITE_FLAG_SAFE_COMPACT			0x00100000
+
+/**
+ * Since wimlib v1.15.0: Write the WIM file bypassing the operating system's
+ * file cache, like ::WIMLIB_OPEN_FLAG_UNBUFFERED does for reading.  The data is
+ * collected in a large aligned buffer and written out in big blocks.  This only
+ * applies when writing to a named file, and is ignored when compacting.  It is
+ * only a hint: it is ignored if the file can't be opened this way.
+ */
+#define WIMLIB_WRITE_FLAG_UNBUFFERED			0x00200000
+
 /** @} */
 /** @addtogroup G_general
  * @{ */
@@ -2621,6 +2926,8 @@ enum wimlib_error_code {
 	WIMLIB_ERR_SNAPSHOT_FAILURE                   = 89,
 	WIMLIB_ERR_INVALID_XATTR                      = 90,
 	WIMLIB_ERR_SET_XATTR                          = 91,
+	WIMLIB_ERR_INVALID_TAR_ARCHIVE                = 92,
+	WIMLIB_ERR_NETWORK                            = 93,
 };
 
 
@@ -2732,6 +3039,15 @@ wimlib_add_image(WIMStruct *wim,
  * source parameter of wimlib_add_image().  The rest of the parameters are the
  * same as wimlib_add_image().  See the documentation for <b>wimcapture</b> for
  * full details on how this mode works.
+ *
+ * Since wimlib v1.15.0: on UNIX-like systems, sources on different filesystems
+ * may be scanned at the same time by the threads of the pool set with
+ * wimlib_set_thread_pool_size(), which hides the latency of each filesystem
+ * when there are many sources.  The resulting image is the same.  The progress
+ * function may then be called from those threads, but never from more than one
+ * of them at a time.  This isn't done when a capture template or hash cache is
+ * set, or with ::WIMLIB_ADD_FLAG_NTFS, ::WIMLIB_ADD_FLAG_TAR, or
+ * ::WIMLIB_ADD_FLAG_WIMBOOT.
  */
 WIMLIBAPI int
 wimlib_add_image_multisource(WIMStruct *wim,
@@ -3373,9 +3689,29 @@ wimlib_get_xml_data(WIMStruct *wim, void **buf_ret, size_t *bufsize_ret);
  * @ingroup G_general
  *
  * Initialization function for wimlib.  Call before using any other wimlib
- * function (except possibly wimlib_set_print_errors()).  If not done manually,
- * this function will be called automatically with a flags argument of 0.  This
- * function does nothing if called again after it has already successfully run.
+ * function (except possibly wimlib_set_print_errors(),
+ * wimlib_set_thread_pool_size(), wimlib_set_compressor_cache_size(), and
+ * wimlib_set_open_wim_cache_size()).  If not done manually, this function will
+ * be called automatically with a flags argument of 0.  This function does nothing if called again after it has
+ * already successfully run.
+ *
+ * If the environment variable @c WIMLIB_TRACE is set to a file path when this
+ * function runs, then a timeline of the library's main operations, such as
+ * writing blobs, compressing batches of chunks, and reading resources, is
+ * written to that file in the JSON format of the Chrome trace viewer, with each
+ * operation shown on the thread that did it.  The file is completed by
+ * wimlib_global_cleanup().
+ *
+ * This function also detects the features of the CPU and chooses which
+ * implementation of each optimized routine, such as SHA-1 hashing or LZX
+ * decoding, to use.  For testing and benchmarking, the environment variable
+ * @c WIMLIB_CPU_FEATURES can change this.  It is a comma-separated list in
+ * which "-FEATURE" disables a CPU feature, e.g. "-avx2"; "+FEATURE" re-enables
+ * a feature the CPU has, e.g. "-*,+sse4.2"; and "ROUTINE=IMPL" selects an
+ * implementation by name, e.g. "sha1=ssse3".  The routines are sha1,
+ * sha1_multi, lz_extend, lzx_parse, xpress_parse, lzx_decode, xpress_decode,
+ * lzms_x86_filter, and zero_scan.  An implementation that the CPU doesn't
+ * support is never selected.  Since wimlib v1.15.0.
  *
  * @param init_flags
  *	Bitwise OR of flags prefixed with WIMLIB_INIT_FLAG.
@@ -3394,7 +3730,10 @@ wimlib_global_init(int init_flags);
  * @ingroup G_general
  *
  * Cleanup function for wimlib.  You are not required to call this function, but
- * it will release any global resources allocated by the library.
+ * it will release any global resources allocated by the library, such as the
+ * thread pool, the compressor cache (see wimlib_set_compressor_cache_size()),
+ * and the open WIM cache (see wimlib_set_open_wim_cache_size()).  It first
+ * waits for any asynchronous operations (see @ref G_async) to complete.
  */
 WIMLIBAPI void
 wimlib_global_cleanup(void);
@@ -3467,6 +3806,25 @@ wimlib_iterate_dir_tree(WIMStruct *wim, int image, const wimlib_tchar *path,
 			int flags,
 			wimlib_iterate_dir_tree_callback_t cb, void *user_ctx);
 
+/**
+ * @ingroup G_wim_information
+ *
+ * Same as wimlib_iterate_dir_tree(), but pass the directory entries to the
+ * callback function in batches rather than one at a time.  This saves a
+ * function call per file, and lets the callback process many files at once,
+ * which is worthwhile when listing large images.
+ *
+ * The parameters and return values are the same as those of
+ * wimlib_iterate_dir_tree(), except that @p cb is a
+ * ::wimlib_iterate_dir_tree_batch_callback_t.  No batch contains entries from
+ * more than one image.
+ */
+WIMLIBAPI int
+wimlib_iterate_dir_tree_batched(WIMStruct *wim, int image,
+				const wimlib_tchar *path, int flags,
+				wimlib_iterate_dir_tree_batch_callback_t cb,
+				void *user_ctx);
+
 /**
  * @ingroup G_wim_information
  *
@@ -3501,6 +3859,21 @@ wimlib_iterate_lookup_table(WIMStruct *wim, int flags,
 			    wimlib_iterate_lookup_table_callback_t cb,
 			    void *user_ctx);
 
+/**
+ * @ingroup G_wim_information
+ *
+ * Same as wimlib_iterate_lookup_table(), but pass the blobs to the callback
+ * function in batches rather than one at a time.
+ *
+ * The parameters and return value are the same as those of
+ * wimlib_iterate_lookup_table(), except that @p cb is a
+ * ::wimlib_iterate_lookup_table_batch_callback_t.
+ */
+WIMLIBAPI int
+wimlib_iterate_lookup_table_batched(WIMStruct *wim, int flags,
+				    wimlib_iterate_lookup_table_batch_callback_t cb,
+				    void *user_ctx);
+
 /**
  * @ingroup G_nonstandalone_wims
  *
@@ -3651,6 +4024,12 @@ wimlib_load_text_file(const wimlib_tchar *path,
  * Calling this function daemonizes the process, unless
  * ::WIMLIB_MOUNT_FLAG_DEBUG was specified or an early error occurs.
  *
+ * A read-only mount of an image which isn't already loaded reads the image's
+ * directories only as they are accessed, so that the mount is ready almost at
+ * once even for an image with millions of files.  The link count of a file
+ * with hard links then only counts the links in the directories accessed so
+ * far.
+ *
  * It is safe to mount multiple images from the same WIM file read-only at the
  * same time, but only if different ::WIMStruct's are used.  It is @b not safe
  * to mount multiple images from the same WIM file read-write at the same time.
@@ -3757,6 +4136,102 @@ wimlib_open_wim_with_progress(const wimlib_tchar *wim_file,
 			      wimlib_progress_func_t progfunc,
 			      void *progctx);
 
+/**
+ * @ingroup G_creating_and_opening_wims
+ *
+ * Set the maximum amount of memory that wimlib may keep in a cache of the
+ * metadata of opened WIM files.  When this is nonzero, the uncompressed blob
+ * table, XML data, and image metadata resources of each WIM file opened from a
+ * filename are kept in the cache after they are read, and a later
+ * wimlib_open_wim() of the same file, or a later use of one of its images by
+ * any ::WIMStruct for the file, copies them from the cache instead of reading
+ * and decompressing them again.  The least recently used data is released when
+ * the cache would exceed its size.
+ *
+ * This helps programs that open the same WIM files many times, such as servers
+ * that open a WIM file for each request.  Each ::WIMStruct still has its own
+ * copy of the data, so ::WIMStructs sharing the cache can be used and modified
+ * independently, including from different threads.
+ *
+ * Data is only shared between ::WIMStructs that opened the same file, as
+ * identified by its device and inode numbers, in the same state, as identified
+ * by its size, last modification time, and GUID.  After a file changes, its
+ * old data is no longer used and is released when the file is next opened.
+ *
+ * The cache is shared by the whole process and is emptied by
+ * wimlib_global_cleanup().  This can be called before wimlib_global_init().
+ *
+ * @param max_memory
+ *	The maximum size of the cache in bytes, or 0 to disable the cache (the
+ *	default).  Making the cache smaller releases cached data as needed.
+ *
+ * @return 0
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_set_open_wim_cache_size(uint64_t max_memory);
+
+/**
+ * @ingroup G_creating_and_opening_wims
+ *
+ * A set of callbacks through which wimlib_open_wim_with_io() reads a WIM file
+ * that is not a local file, e.g. one in an object store which supports ranged
+ * reads.  Only the parts of the file which are actually needed are read, e.g.
+ * just the resources containing the files being extracted, and sequential
+ * reads are announced in advance through the @p prefetch callback, if any.
+ *
+ * @p read_at may be called from multiple threads at the same time.
+ */
+struct wimlib_io_provider {
+	/** Read exactly @p size bytes at offset @p offset in the file into @p
+	 * buf.  Return 0 on success, or -1 on failure (e.g. if the region is
+	 * beyond the end of the file or a network request failed), optionally
+	 * with errno set.  */
+	int (*read_at)(void *ctx, void *buf, size_t size, uint64_t offset);
+
+	/** Optional: a hint that the specified region of the file will be read
+	 * soon, e.g. so that fetching it can be started asynchronously.  */
+	void (*prefetch)(void *ctx, uint64_t offset, uint64_t size);
+
+	/** Optional: called when the ::WIMStruct no longer needs the file,
+	 * i.e. when it is freed, or if wimlib_open_wim_with_io() fails with
+	 * an error other than ::WIMLIB_ERR_INVALID_PARAM.  */
+	void (*close)(void *ctx);
+
+	/** The size of the file in bytes  */
+	uint64_t size;
+
+	/** Context passed to the callbacks  */
+	void *ctx;
+};
+
+/**
+ * @ingroup G_creating_and_opening_wims
+ *
+ * Same as wimlib_open_wim_with_progress(), but reads the WIM file through the
+ * callbacks in @p io rather than from a file on disk.  The contents of @p io
+ * are copied, but @p io->ctx must remain valid until the ::WIMStruct is freed.
+ *
+ * The resulting ::WIMStruct has no filename, so it can't be overwritten in
+ * place with wimlib_overwrite() or mounted read-write, and
+ * ::WIMLIB_OPEN_FLAG_WRITE_ACCESS and ::WIMLIB_OPEN_FLAG_MMAP may not be
+ * specified.  Otherwise it can be used like any other ::WIMStruct, e.g. to
+ * extract, export, or write its images.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p io, its @p read_at callback, or @p wim_ret was @c NULL, or an
+ *	unsupported flag was specified in @p open_flags.
+ *
+ * This function can also fail with any of the errors of wimlib_open_wim().
+ */
+WIMLIBAPI int
+wimlib_open_wim_with_io(const struct wimlib_io_provider *io,
+			int open_flags,
+			WIMStruct **wim_ret,
+			wimlib_progress_func_t progfunc,
+			void *progctx);
+
 /**
  * @ingroup G_writing_and_overwriting_wims
  *
@@ -3768,7 +4243,8 @@ wimlib_open_wim_with_progress(const wimlib_tchar *wim_file,
  *	temporary file to the original.
  *   2. Appending: append updates to the new original WIM file, then overwrite
  *	its header such that those changes become visible to new readers.
- *   3. Compaction: normally should not be used; see
+ *   3. Compaction: append updates, then move resources down to fill the
+ *	holes and truncate the file; see ::WIMLIB_WRITE_FLAG_SAFE_COMPACT and
  *	::WIMLIB_WRITE_FLAG_UNSAFE_COMPACT for details.
  *
  * Append mode is often much faster than a full rebuild, but it wastes some
@@ -3989,6 +4465,38 @@ wimlib_reference_template_image(WIMStruct *wim, int new_image,
 				WIMStruct *template_wim, int template_image,
 				int flags);
 
+/**
+ * @ingroup G_general
+ *
+ * Limit how often a ::WIMStruct's progress function is sent the messages which
+ * report gradual progress, so that reporting progress costs little even when
+ * the progress function is slow, e.g. because it is called through a
+ * scripting language binding.
+ *
+ * With an interval set, the messages ::WIMLIB_PROGRESS_MSG_WRITE_STREAMS,
+ * ::WIMLIB_PROGRESS_MSG_EXTRACT_STREAMS, and
+ * ::WIMLIB_PROGRESS_MSG_VERIFY_STREAMS are sent at most once per interval,
+ * except that the message reporting that all the data has been processed is
+ * always sent.  In addition, ::WIMLIB_PROGRESS_MSG_SCAN_PROGRESS is sent at
+ * most once per interval while directory trees are scanned.  Other messages
+ * are not affected; in particular, ::WIMLIB_PROGRESS_MSG_SCAN_DENTRY is still
+ * sent for every file if ::WIMLIB_ADD_FLAG_VERBOSE is specified.
+ *
+ * @param wim
+ *	The ::WIMStruct whose progress messages to limit.
+ * @param interval_ms
+ *	The minimum time between the messages, in milliseconds, or 0 for the
+ *	default behavior, which is to send the messages after fixed amounts of
+ *	data have been processed and not to send
+ *	::WIMLIB_PROGRESS_MSG_SCAN_PROGRESS.
+ *
+ * @return 0
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_set_progress_interval(WIMStruct *wim, unsigned int interval_ms);
+
 /**
  * @ingroup G_general
  *
@@ -4056,6 +4564,169 @@ WIMLIBAPI int
 wimlib_resolve_image(WIMStruct *wim,
 		     const wimlib_tchar *image_name_or_num);
 
+/**
+ * @ingroup G_modifying_wims
+ *
+ * Since wimlib v1.15.0: set an image which later captures into the specified
+ * ::WIMStruct are to be based on, for fast incremental captures.  This works
+ * like wimlib_reference_template_image(), except that each file is compared
+ * with the file at the same path in the template image as soon as it has been
+ * scanned, so the checksums of unchanged files are known without any extra
+ * pass over the new image.  The resulting image is the same either way.
+ *
+ * This affects all subsequent calls to wimlib_add_image(),
+ * wimlib_add_image_multisource(), and wimlib_update_image() with add commands
+ * on @p wim.  The path of a scanned file in the template image is its path in
+ * the image being updated.  The number of bytes of file data of unchanged
+ * files which needn't be read because the data is already present is reported
+ * in ::wimlib_progress_info_scan.num_bytes_unchanged.
+ *
+ * @param wim
+ *	The ::WIMStruct into which files will be captured.
+ * @param template_wim
+ *	The ::WIMStruct containing the template image, or @c NULL to stop using
+ *	a template image.  This can be, but does not have to be, the same
+ *	::WIMStruct as @p wim.  It must not be freed while it is set as the
+ *	template of @p wim.
+ * @param template_image
+ *	The 1-based index in @p template_wim of the template image.  Ignored if
+ *	@p template_wim is @c NULL.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_IMAGE
+ *	@p template_image does not exist in @p template_wim.
+ * @retval ::WIMLIB_ERR_METADATA_NOT_FOUND
+ *	@p template_wim does not contain image metadata; for example, it
+ *	represents a non-first part of a split WIM.
+ *
+ * The metadata resource of the template image is read when the next capture
+ * begins, and any error reading it is returned from that capture.
+ */
+WIMLIBAPI int
+wimlib_set_capture_template(WIMStruct *wim, WIMStruct *template_wim,
+			    int template_image);
+
+/**
+ * @ingroup G_modifying_wims
+ *
+ * Since wimlib v1.15.0: set a file in which to cache the SHA-1 message digests
+ * of files captured into the specified ::WIMStruct.  Files are identified by
+ * their device and inode numbers (on Windows, their volume serial numbers and
+ * file IDs), and the cached message digest of a file is used only if its size,
+ * last write time, and last change time are unchanged.  A file whose message
+ * digest is found in the cache and whose data is already present in the WIM,
+ * for example from an earlier capture of the same directory tree, is then
+ * deduplicated without its data being read at all.
+ *
+ * The cache file is read by this function and rewritten, to add the message
+ * digests of the newly captured files, each time @p wim is successfully written
+ * with wimlib_write(), wimlib_write_to_fd(), or wimlib_overwrite().  Problems
+ * reading or writing the cache file are reported as warnings only.  A missing
+ * cache file is treated as an empty cache.
+ *
+ * This affects all subsequent calls to wimlib_add_image(),
+ * wimlib_add_image_multisource(), and wimlib_update_image() with add commands
+ * on @p wim, except captures of NTFS volumes with ::WIMLIB_ADD_FLAG_NTFS.  The
+ * number of bytes of file data which needn't be read is reported in
+ * ::wimlib_progress_info_scan.num_bytes_unchanged.
+ *
+ * The cache relies on the operating system changing the timestamps of every
+ * file whose contents change, like other tools that skip unchanged files do.
+ *
+ * @param wim
+ *	The ::WIMStruct into which files will be captured.
+ * @param path
+ *	The path to the cache file, or @c NULL to stop using a hash cache.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_NOMEM
+ *	Failed to allocate needed memory.
+ */
+WIMLIBAPI int
+wimlib_set_capture_hash_cache(WIMStruct *wim, const wimlib_tchar *path);
+
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Since wimlib v1.15.0: set the number of threads to use when decompressing
+ * data from the specified ::WIMStruct.  This affects all subsequent operations
+ * that read compressed data from the WIM file, such as wimlib_extract_image(),
+ * wimlib_verify_wim(), and wimlib_write() when not raw-copying resources.
+ *
+ * Chunks of each compressed resource are read by the calling thread and
+ * decompressed concurrently by the worker threads, then passed on in their
+ * original order.  This only helps when resources span multiple chunks, which
+ * is nearly always the case for solid resources.  This includes data read from
+ * a pipe, such as by wimlib_extract_image_from_pipe(); the chunks are still
+ * read from the pipe in order by the calling thread.
+ *
+ * wimlib_verify_wim() also uses this many threads to compute the SHA-1 message
+ * digests of the blobs, hashing several blobs at the same time.
+ *
+ * Each thread needs buffers for both the compressed and uncompressed data of
+ * the chunks it is working on, which for solid resources with the default
+ * chunk size of 64 MiB is about 128 MiB per thread.  As with compression, the
+ * number of threads is reduced if needed to fit in the available memory.
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the number of decompression threads.
+ * @param num_threads
+ *	The number of threads to use for decompressing data, or 0 to choose the
+ *	number of threads automatically based on the number of available CPUs.
+ *	The default is 1, which means to decompress the data in the calling
+ *	thread, except that while wimlib_write() or wimlib_overwrite()
+ *	recompresses data from the WIM file, the data is decompressed with as
+ *	many threads as are used for the compression, unless this function was
+ *	called.
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_set_decompression_threads(WIMStruct *wim, unsigned num_threads);
+
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Since wimlib v1.15.0: set a directory in which to cache the uncompressed data
+ * of blobs extracted from the specified ::WIMStruct.  Each blob is stored in a
+ * file named after its SHA-1 message digest, so the same directory can be
+ * shared by any number of WIM files and processes.  When a later extraction
+ * needs a blob that is in the cache, its data is copied from there instead of
+ * being read and decompressed from the WIM file.  Where the operating system
+ * and filesystem support it, e.g. on Linux with btrfs or XFS, the data is
+ * reflinked rather than copied.  Cached data is verified against the message
+ * digest like data read from a WIM file, and deleted if it is corrupted.
+ *
+ * Only blobs of at least 4096 bytes are cached.  The directory also contains an
+ * index file recording when each blob was last used; when an extraction
+ * finishes and the cached data exceeds @p max_size bytes, the least recently
+ * used blobs are deleted.  Problems adding blobs to the cache are reported as
+ * warnings only.  Extraction to a pipe doesn't use the cache.
+ *
+ * This affects all subsequent calls to wimlib_extract_image(),
+ * wimlib_extract_paths(), and wimlib_extract_pathlist() on @p wim.
+ *
+ * @param wim
+ *	The ::WIMStruct from which blobs will be extracted.
+ * @param dir
+ *	The path to the cache directory, which is created if it doesn't exist,
+ *	or @c NULL to stop using a blob cache.
+ * @param max_size
+ *	The maximum total size, in bytes, of the data in the cache.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_MKDIR
+ *	The cache directory doesn't exist and couldn't be created.
+ * @retval ::WIMLIB_ERR_NOMEM
+ *	Failed to allocate needed memory.
+ */
+WIMLIBAPI int
+wimlib_set_extract_blob_cache(WIMStruct *wim, const wimlib_tchar *dir,
+			      uint64_t max_size);
+
 /**
  * @ingroup G_general
  *
@@ -4196,6 +4867,68 @@ wimlib_set_memory_allocator(void *(*malloc_func)(size_t),
 			    void (*free_func)(void *),
 			    void *(*realloc_func)(void *, size_t));
 
+/**
+ * @ingroup G_general
+ *
+ * Set a limit on the total memory which wimlib plans to use at once, across all
+ * ::WIMStructs and threads in the process.
+ *
+ * The budget is taken into account whenever wimlib decides how much memory to
+ * use for something: the numbers of compression and decompression threads and
+ * the sizes of their chunk batches, the chunk cache of mounted images, and the
+ * caches enabled with wimlib_set_compressor_cache_size() and
+ * wimlib_set_open_wim_cache_size().  When the memory in use, as reported by
+ * wimlib_get_memory_usage(), approaches the budget, new operations use fewer
+ * threads and smaller buffers, and the caches stop growing.
+ *
+ * The budget is a target rather than a hard limit: memory which is needed to
+ * perform an operation at all, such as the metadata of the images being
+ * worked on, is still allocated when the budget has been exceeded.  It only has
+ * an effect when the memory usage is being tracked; see
+ * wimlib_get_memory_usage().
+ *
+ * This setting is global and not per-WIM.  It can be called before
+ * wimlib_global_init().
+ *
+ * @param max_memory
+ *	The memory budget in bytes, or 0 for no budget (the default).
+ *
+ * @return 0
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_set_memory_budget(uint64_t max_memory);
+
+/**
+ * @ingroup G_general
+ *
+ * Get the amount of memory which wimlib currently has allocated, across all
+ * ::WIMStructs and threads in the process.  This includes everything allocated
+ * through wimlib's memory allocator, such as loaded image metadata, blob
+ * tables, XML data, compressors, decompressors, and cached data.  It doesn't
+ * include memory used by external libraries, such as @c libxml2 or @c
+ * libntfs-3g, or the stacks of threads.
+ *
+ * The memory usage can only be tracked while the default memory allocator is in
+ * use, and only on platforms where the C library can report the size of an
+ * allocation (currently Windows and systems with @c malloc_usable_size()).  It
+ * is no longer tracked after wimlib_set_memory_allocator() has been called with
+ * custom functions.
+ *
+ * @param usage_ret
+ *	On success, the number of bytes allocated is written here.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_UNSUPPORTED
+ *	The memory usage isn't being tracked.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_get_memory_usage(uint64_t *usage_ret);
+
 /**
  * @ingroup G_writing_and_overwriting_wims
  *
@@ -4236,65 +4969,335 @@ wimlib_set_output_pack_chunk_size(WIMStruct *wim, uint32_t chunk_size);
 /**
  * @ingroup G_writing_and_overwriting_wims
  *
- * Set a ::WIMStruct's output compression type.  This is the compression type
- * that will be used for writing non-solid resources in subsequent calls to
- * wimlib_write() or wimlib_overwrite().
+ * Since wimlib v1.15.0: set the minimum uncompressed size of each solid
+ * resource when data is written in solid mode.  If enough data is being
+ * compressed and enough threads are available, the data is split into several
+ * solid resources, each at least this large, which are read and compressed in
+ * parallel and then written one after another.  This keeps the compression
+ * threads busy when a single reader can't, but similar files that end up in
+ * different resources are no longer compressed together, so larger values give
+ * a better compression ratio.  The split is never made so that a resource holds
+ * fewer than four chunks.  It's also not done when any of the data must be read
+ * from a WIM file, or with ::WIMLIB_WRITE_FLAG_SEND_DONE_WITH_FILE_MESSAGES.
+ *
+ * Since the number of resources depends on the number of threads, the layout
+ * of the resulting WIM file then depends on the number of threads too, unlike
+ * when the data is written as a single solid resource.
  *
  * @param wim
- *	The ::WIMStruct for which to set the output compression type.
- * @param ctype
- *	The compression type to set.  If this compression type is incompatible
- *	with the current output chunk size, then the output chunk size will be
- *	reset to the default for the new compression type.
- *
- * @return 0 on success; a ::wimlib_error_code value on failure.
+ *	The ::WIMStruct for which to set the minimum solid resource size.
+ * @param size
+ *	The minimum size in bytes, or 0 to always write all the data in a single
+ *	solid resource.  The default is 0.  A good value to start from is
+ *	268435456 (256 MiB).
  *
- * @retval ::WIMLIB_ERR_INVALID_COMPRESSION_TYPE
- *	@p ctype did not specify a valid compression type.
+ * @return 0
  */
 WIMLIBAPI int
-wimlib_set_output_compression_type(WIMStruct *wim,
-				   enum wimlib_compression_type ctype);
+wimlib_set_output_pack_min_resource_size(WIMStruct *wim, uint64_t size);
 
 /**
  * @ingroup G_writing_and_overwriting_wims
  *
- * Similar to wimlib_set_output_compression_type(), but set the compression type
- * for writing solid resources.  This cannot be ::WIMLIB_COMPRESSION_TYPE_NONE.
+ * Since wimlib v1.15.0: set the size above which blobs are not put in solid
+ * resources when data is written in solid mode.  Each such blob is instead
+ * written in a non-solid resource of its own, after the solid resources,
+ * compressed with the compression type and chunk size set by
+ * wimlib_set_output_compression_type() and wimlib_set_output_chunk_size().
+ * Small files still get the compression ratio of solid compression, while
+ * large files keep the fast random access of non-solid resources, e.g. when
+ * the image is mounted, and don't have to be decompressed along with other
+ * data to extract them.
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the maximum size of blobs in solid
+ *	resources.
+ * @param size
+ *	The maximum uncompressed size in bytes of a blob in a solid resource, or
+ *	0 to put all blobs in solid resources.  The default is 0.
+ *
+ * @return 0
  */
 WIMLIBAPI int
-wimlib_set_output_pack_compression_type(WIMStruct *wim,
-					enum wimlib_compression_type ctype);
+wimlib_set_output_pack_max_blob_size(WIMStruct *wim, uint64_t size);
 
 /**
- * @ingroup G_general
- *
- * Set whether wimlib can print error and warning messages to the error file,
- * which defaults to standard error.  Error and warning messages may provide
- * information that cannot be determined only from returned error codes.
- *
- * By default, error messages are not printed.
+ * @ingroup G_writing_and_overwriting_wims
  *
- * This setting applies globally (it is not per-WIM).
+ * Since wimlib v1.15.0: have the data that subsequent calls to wimlib_write()
+ * or wimlib_overwrite() compress be compressed by compression workers on other
+ * machines instead of by local threads.  Each worker is a
+ * process which runs wimlib_serve_compression().  The chunks are sent to the
+ * workers in batches over TCP, and the compressed chunks are written in the
+ * original order, so the resulting WIM file is the same as if the data had
+ * been compressed locally.  This is meant for slow compression settings, such
+ * as LZMS or LZX at a high compression level, for which the total number of
+ * threads of the workers outweighs the cost of sending the data to them.
+ * To use the local processors as well, also run a worker on the local machine
+ * and include it in the list.
+ *
+ * Workers which can't be reached when a write begins are skipped with a
+ * warning.  If none can be reached, the data is compressed locally as usual.
+ * If a connection to a worker fails during the write, the chunks being
+ * compressed on it are given to the other workers, and if there are none left,
+ * the remaining data is compressed locally.  Data is only sent to the workers
+ * when at least a few megabytes of it need to be compressed, and the workers
+ * use the compression level that was set with
+ * wimlib_set_default_compression_level().
+ *
+ * This is not supported on Windows.
  *
- * This can be called before wimlib_global_init().
+ * @param wim
+ *	The ::WIMStruct for which to set the compression workers.
+ * @param workers
+ *	A comma-separated list of the addresses of the workers, each of the form
+ *	"host:port", or "[address]:port" for an IPv6 address.  If the port is
+ *	omitted, it defaults to 7637.  NULL or an empty string means to compress
+ *	all data locally, which is the default.
  *
- * @param show_messages
- *	@c true if messages are to be printed; @c false if messages are not to
- *	be printed.
+ * @return 0 on success; a ::wimlib_error_code value on failure.
  *
- * @return 0
+ * @retval ::WIMLIB_ERR_NOMEM
+ *	Failed to allocate memory.
+ * @retval ::WIMLIB_ERR_UNSUPPORTED
+ *	@p workers is not empty, and this is the Windows version of wimlib.
  */
 WIMLIBAPI int
-wimlib_set_print_errors(bool show_messages);
+wimlib_set_output_compression_workers(WIMStruct *wim, const wimlib_tchar *workers);
 
 /**
- * @ingroup G_modifying_wims
+ * @ingroup G_writing_and_overwriting_wims
  *
- * Set basic information about a WIM.
+ * Since wimlib v1.15.0: run a compression worker, which compresses data on
+ * behalf of other processes that have been told about it with
+ * wimlib_set_output_compression_workers().  This listens for connections on
+ * @p address and handles each one on a thread of its own, with the compression
+ * type, chunk size and compression level requested by the connecting process.
+ * It only returns on error.
  *
- * @param wim
- *	Pointer to the ::WIMStruct for a WIM.
+ * There is no authentication or encryption, so the worker should only be
+ * reachable from the machines that are trusted to use it.
+ *
+ * This is not supported on Windows.
+ *
+ * @param address
+ *	The local address to listen on, of the form "host:port", or ":port" or
+ *	just "port" to listen on all addresses.  If the port is omitted, it
+ *	defaults to 7637.
+ * @param num_threads
+ *	The number of connections that each connecting process is asked to
+ *	open, which is the number of chunks that the worker compresses for it at
+ *	a time.  0 means the number of processors.
+ * @param flags
+ *	Reserved; must be 0.
+ *
+ * @return a ::wimlib_error_code value.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p address is invalid, or @p flags is not 0.
+ * @retval ::WIMLIB_ERR_NETWORK
+ *	@p address couldn't be resolved or listened on, or accepting a
+ *	connection failed.
+ * @retval ::WIMLIB_ERR_UNSUPPORTED
+ *	This is the Windows version of wimlib.
+ */
+WIMLIBAPI int
+wimlib_serve_compression(const wimlib_tchar *address, unsigned num_threads,
+			 int flags);
+
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Set a ::WIMStruct's output compression type.  This is the compression type
+ * that will be used for writing non-solid resources in subsequent calls to
+ * wimlib_write() or wimlib_overwrite().
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the output compression type.
+ * @param ctype
+ *	The compression type to set.  If this compression type is incompatible
+ *	with the current output chunk size, then the output chunk size will be
+ *	reset to the default for the new compression type.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_COMPRESSION_TYPE
+ *	@p ctype did not specify a valid compression type.
+ */
+WIMLIBAPI int
+wimlib_set_output_compression_type(WIMStruct *wim,
+				   enum wimlib_compression_type ctype);
+
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Similar to wimlib_set_output_compression_type(), but set the compression type
+ * for writing solid resources.  This cannot be ::WIMLIB_COMPRESSION_TYPE_NONE.
+ */
+WIMLIBAPI int
+wimlib_set_output_pack_compression_type(WIMStruct *wim,
+					enum wimlib_compression_type ctype);
+
+/**
+ * @ingroup G_general
+ *
+ * Set whether wimlib can print error and warning messages to the error file,
+ * which defaults to standard error.  Error and warning messages may provide
+ * information that cannot be determined only from returned error codes.
+ *
+ * By default, error messages are not printed.
+ *
+ * This setting applies globally (it is not per-WIM).
+ *
+ * This can be called before wimlib_global_init().
+ *
+ * @param show_messages
+ *	@c true if messages are to be printed; @c false if messages are not to
+ *	be printed.
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_set_print_errors(bool show_messages);
+
+/**
+ * @ingroup G_general
+ *
+ * Set the number of threads in the pool of threads which wimlib uses for all
+ * work it does in parallel, such as compressing and decompressing chunks and
+ * calculating integrity checksums.  The pool is shared by all operations in the
+ * process, so doing several of them at the same time doesn't use more threads
+ * than this.  The per-operation thread counts, such as the @p num_threads
+ * argument of wimlib_write(), are limited to the size of the pool.
+ *
+ * The pool is started the first time it is needed, so this setting only takes
+ * effect if it is made before then, e.g. before wimlib_global_init(), or after
+ * wimlib_global_cleanup(), which stops the pool.
+ *
+ * This setting applies globally (it is not per-WIM).
+ *
+ * @param num_threads
+ *	The number of threads in the pool, or 0 to use one thread per
+ *	processor (the default).
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p num_threads is too large.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_set_thread_pool_size(unsigned num_threads);
+
+/**
+ * @ingroup G_general
+ *
+ * The time spent in one stage of wimlib's work and the amount of data it
+ * processed, as returned in a ::wimlib_perf_counters.
+ */
+struct wimlib_perf_counter {
+	/** Total time spent in this stage, in nanoseconds.  Time spent by
+	 * different threads at the same time is added together.  */
+	uint64_t nanoseconds;
+
+	/** Total number of bytes processed by this stage.  */
+	uint64_t bytes;
+
+	/** Number of separate pieces of work, e.g. read() calls or compressed
+	 * chunks, that the above are totals of.  */
+	uint64_t count;
+};
+
+/**
+ * @ingroup G_general
+ *
+ * Counters of where wimlib spends its time, as returned by
+ * wimlib_get_perf_counters().  The stages overlap in places: for example,
+ * reading a metadata resource includes reading and decompressing it.
+ */
+struct wimlib_perf_counters {
+	/** Reading from files, including both WIM files and files being
+	 * captured.  */
+	struct wimlib_perf_counter read;
+
+	/** Writing to files, including both WIM files and extracted files.  */
+	struct wimlib_perf_counter write;
+
+	/** Flushing newly written WIM files to disk.  */
+	struct wimlib_perf_counter fsync;
+
+	/** Calculating SHA-1 message digests.  */
+	struct wimlib_perf_counter hash;
+
+	/** Compressing chunks, in all threads.  @p bytes is the uncompressed
+	 * size.  */
+	struct wimlib_perf_counter compress;
+
+	/** Decompressing chunks, in all threads.  @p bytes is the uncompressed
+	 * size.  */
+	struct wimlib_perf_counter decompress;
+
+	/** Reading and parsing metadata resources, i.e. loading images.  */
+	struct wimlib_perf_counter metadata_read;
+
+	/** Building metadata resources from images being written.  */
+	struct wimlib_perf_counter metadata_write;
+
+	/** Waiting for compressor threads to finish chunks while writing.  A
+	 * large value relative to @p compress means compression was the
+	 * bottleneck; a small one means something else, such as reading, was.
+	 * @p count is the number of waits and @p bytes is always 0.  */
+	struct wimlib_perf_counter compress_wait;
+
+	uint64_t reserved[32];
+};
+
+/**
+ * @ingroup G_general
+ *
+ * Enable or disable counting where wimlib spends its time, as returned by
+ * wimlib_get_perf_counters().  Counting is disabled by default.  While enabled,
+ * it adds a small constant cost to each piece of work counted, e.g. each read
+ * from a file, which is normally negligible.
+ *
+ * The counters are global, not per-WIM, and disabling them doesn't reset them.
+ * This can be called before wimlib_global_init().
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI void
+wimlib_set_perf_counters_enabled(bool enable);
+
+/**
+ * @ingroup G_general
+ *
+ * Get the current values of wimlib's performance counters; see
+ * wimlib_set_perf_counters_enabled().  The values are cumulative over all work
+ * done in the process since the counters were last reset.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI void
+wimlib_get_perf_counters(struct wimlib_perf_counters *counters);
+
+/**
+ * @ingroup G_general
+ *
+ * Reset all of wimlib's performance counters to 0.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI void
+wimlib_reset_perf_counters(void);
+
+/**
+ * @ingroup G_modifying_wims
+ *
+ * Set basic information about a WIM.
+ *
+ * @param wim
+ *	Pointer to the ::WIMStruct for a WIM.
  * @param info
  *	Pointer to a ::wimlib_wim_info structure that contains the information
  *	to set.  Only the information explicitly specified in the @p which flags
@@ -4353,7 +5356,11 @@ wimlib_set_wim_info(WIMStruct *wim, const struct wimlib_wim_info *info,
  * ::WIMLIB_PROGRESS_MSG_SPLIT_BEGIN_PART and
  * ::WIMLIB_PROGRESS_MSG_SPLIT_END_PART.  Since wimlib v1.13.4 it will also
  * receive ::WIMLIB_PROGRESS_MSG_WRITE_STREAMS messages while writing each part;
- * these messages will report the progress of the current part only.
+ * these messages will report the progress of the current part only.  With
+ * ::WIMLIB_WRITE_FLAG_CONCURRENT_PARTS, the parts being written at the same time
+ * each get their ::WIMLIB_PROGRESS_MSG_SPLIT_BEGIN_PART message before any of
+ * them is written and their ::WIMLIB_PROGRESS_MSG_SPLIT_END_PART message after
+ * all of them have been written.
  */
 WIMLIBAPI int
 wimlib_split(WIMStruct *wim,
@@ -4378,7 +5385,8 @@ wimlib_split(WIMStruct *wim,
  *	and reference the other parts using wimlib_reference_resource_files()
  *	before calling this function.
  * @param verify_flags
- *	Reserved; must be 0.
+ *	Bitwise OR of zero or more of the flags ::WIMLIB_VERIFY_FLAG_USE_CACHE
+ *	and ::WIMLIB_VERIFY_FLAG_FORCE.
  *
  * @return 0 if the WIM file was successfully verified; a ::wimlib_error_code
  * value if it failed verification or another error occurred.
@@ -4491,6 +5499,9 @@ wimlib_unmount_image_with_progress(const wimlib_tchar *dir,
  *	there was another problem with the provided parameters.
  * @retval ::WIMLIB_ERR_INVALID_REPARSE_DATA
  *	While executing an add command, a reparse point had invalid data.
+ * @retval ::WIMLIB_ERR_INVALID_TAR_ARCHIVE
+ *	An add command with ::WIMLIB_ADD_FLAG_TAR specified read a tar archive
+ *	which was invalid or in an unsupported format.
  * @retval ::WIMLIB_ERR_IS_DIRECTORY
  *	An add command attempted to replace a directory with a non-directory; or
  *	a delete command without ::WIMLIB_DELETE_FLAG_RECURSIVE attempted to
@@ -4616,6 +5627,154 @@ wimlib_write(WIMStruct *wim,
 	     int write_flags,
 	     unsigned num_threads);
 
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Statistics about a delta WIM written by wimlib_write_delta().  All sizes are
+ * uncompressed sizes.
+ */
+struct wimlib_delta_stats {
+	/** Number of blobs written to the delta WIM  */
+	uint64_t num_blobs_written;
+
+	/** Total size of the blobs written to the delta WIM  */
+	uint64_t bytes_written;
+
+	/** Number of blobs omitted from the delta WIM because the base WIM
+	 * already contains them  */
+	uint64_t num_blobs_omitted;
+
+	/** Total size of the blobs omitted from the delta WIM  */
+	uint64_t bytes_omitted;
+
+	uint64_t reserved[4];
+};
+
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Since wimlib v1.15.0: write a "delta" WIM which contains the image(s) of @p
+ * wim, but only the file data that is missing from @p base_wim.  This is the
+ * same as wimlib_write(), except that all blobs which @p base_wim also contains
+ * are left out of the new WIM file, regardless of where they come from.  To use
+ * the delta WIM later, the base WIM must be referenced with
+ * wimlib_reference_resource_files(), as for other delta WIMs.
+ *
+ * This is useful for distributing updates: for example, if @p wim is a new
+ * version of an image and @p base_wim is the previous version, the delta WIM
+ * only contains the files which changed.  If @p wim was opened from a WIM file,
+ * the data that is written is copied from it without being recompressed when
+ * the compression settings allow it, so the write mostly reduces to copying
+ * the new data.  The blobs are matched by their SHA-1 message digests directly
+ * in the blob tables of the two WIMs, so newly added files are only left out
+ * when they are checksummed anyway, e.g. because another file has the same
+ * size.
+ *
+ * @param wim
+ *	Pointer to the ::WIMStruct being persisted.
+ * @param base_wim
+ *	Pointer to the ::WIMStruct for the WIM the delta is to be based on.  It
+ *	must not be modified, and must not be the same as @p wim.
+ * @param path
+ *	The path to the on-disk file to write.
+ * @param image
+ *	The image(s) to write, as for wimlib_write().
+ * @param write_flags
+ *	Bitwise OR of flags prefixed with @c WIMLIB_WRITE_FLAG.
+ * @param num_threads
+ *	The number of threads to use for compressing data, or 0 to have the
+ *	library automatically choose an appropriate number.
+ * @param stats_ret
+ *	If not @c NULL, statistics about the blobs which were written and
+ *	omitted are returned here on success.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.  The possible
+ * error codes are the same as those of wimlib_write(), and also
+ * ::WIMLIB_ERR_INVALID_PARAM if @p base_wim was @c NULL or the same as @p wim.
+ */
+WIMLIBAPI int
+wimlib_write_delta(WIMStruct *wim, WIMStruct *base_wim,
+		   const wimlib_tchar *path,
+		   int image,
+		   int write_flags,
+		   unsigned num_threads,
+		   struct wimlib_delta_stats *stats_ret);
+
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * An estimate of the result of writing a WIM, returned by
+ * wimlib_estimate_write().  All sizes are in bytes.
+ */
+struct wimlib_write_estimate {
+	/** Number of blobs that would be written, after deduplication and
+	 * filtering  */
+	uint64_t num_blobs;
+
+	/** Total uncompressed size of those blobs  */
+	uint64_t uncompressed_bytes;
+
+	/** Compressed size of the data that would be copied from WIM files
+	 * without being recompressed  */
+	uint64_t raw_copy_bytes;
+
+	/** Uncompressed size of the data that would be compressed  */
+	uint64_t bytes_to_compress;
+
+	/** How much of that data was compressed to make the estimate  */
+	uint64_t sampled_bytes;
+
+	/** Estimated size of the new WIM file  */
+	uint64_t estimated_size;
+
+	/** Estimated time to compress the data, in milliseconds, not counting
+	 * the time to read it  */
+	uint64_t estimated_compression_ms;
+
+	uint64_t reserved[9];
+};
+
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Since wimlib v1.15.0: estimate the size of the WIM file that wimlib_write()
+ * would produce with the same arguments, and the time needed to compress its
+ * data, without writing anything.  The output compression settings of @p wim
+ * are used, e.g. as set by wimlib_set_output_compression_type(), so this can
+ * also estimate the result of rebuilding a WIM with wimlib_overwrite() and
+ * ::WIMLIB_WRITE_FLAG_REBUILD.
+ *
+ * The blobs to write are determined and deduplicated just as for a write.
+ * Those that would be copied from WIM files without being recompressed are
+ * counted with their current compressed size.  The compressed size of the rest
+ * is estimated by compressing chunks sampled evenly from them, about 1/64 of
+ * the data but at least 8 MiB.  Each sample is at most 256 KiB, so the
+ * estimate is less accurate in solid mode, whose chunks are much larger.  The
+ * metadata resources of new or modified images are not counted.  Duplicate
+ * files which are only found when their data is checksummed during the write
+ * are counted as separate blobs.
+ *
+ * @param wim
+ *	Pointer to the ::WIMStruct to estimate writing.
+ * @param image
+ *	The image(s) to write, as for wimlib_write().
+ * @param write_flags
+ *	Bitwise OR of flags prefixed with @c WIMLIB_WRITE_FLAG, as would be
+ *	given to wimlib_write().
+ * @param num_threads
+ *	The number of compression threads to estimate the time for, or 0 for
+ *	the default number.
+ * @param estimate_ret
+ *	The estimate is returned here on success.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure, which may be
+ * an error reading the data being sampled.
+ */
+WIMLIBAPI int
+wimlib_estimate_write(WIMStruct *wim, int image, int write_flags,
+		      unsigned num_threads,
+		      struct wimlib_write_estimate *estimate_ret);
+
 /**
  * @ingroup G_writing_and_overwriting_wims
  *
@@ -4643,6 +5802,225 @@ wimlib_write_to_fd(WIMStruct *wim,
 		   int write_flags,
 		   unsigned num_threads);
 
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Write several WIMs to new files, sharing the work of compressing the file
+ * data they have in common.  This is equivalent to calling wimlib_write() with
+ * ::WIMLIB_ALL_IMAGES for each WIM in turn, except that file data which is
+ * needed by more than one of the WIMs and which must be compressed, rather than
+ * just copied, is read and compressed only once.  This is useful after
+ * exporting different images of the same source WIM into each of @p wims.
+ *
+ * The shared data is first written to temporary files in the directory of
+ * <tt>paths[0]</tt>, which are deleted before this function returns.  Progress
+ * messages for writing them are sent to the progress function of
+ * <tt>wims[0]</tt>.  The data is only shared if all the WIMs use the same
+ * output compression settings and are not pipable; otherwise, or if there is
+ * no such data, the WIMs are just written one by one.  In solid mode, data
+ * which is shared by only a few WIMs may also be compressed separately for each
+ * of them, since each set of WIMs sharing data needs its own solid resources.
+ *
+ * @param wims
+ *	Array of @p num_wims distinct pointers to the ::WIMStruct for the WIMs.
+ * @param paths
+ *	Array of @p num_wims paths, each being the path to write the WIM at the
+ *	same index of @p wims to.
+ * @param num_wims
+ *	Number of WIMs to write, which must be between 1 and 64.
+ * @param write_flags
+ *	Bitwise OR of flags prefixed with @c WIMLIB_WRITE_FLAG, used for writing
+ *	all the WIMs.
+ * @param num_threads
+ *	The number of threads to use for compressing data, or 0 to have the
+ *	library automatically choose an appropriate number.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.  The possible
+ * error codes include those that can be returned by wimlib_write() as well as
+ * the following:
+ *
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p num_wims was 0 or greater than 64, or the same ::WIMStruct was given
+ *	more than once.
+ *
+ * If writing one of the WIMs fails, the WIMs before it have already been
+ * written and the later ones are not written.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_write_multiple(WIMStruct * const *wims,
+		      const wimlib_tchar * const *paths,
+		      unsigned num_wims,
+		      int write_flags,
+		      unsigned num_threads);
+
+/**
+ * @ingroup G_async
+ *
+ * Type of a function called when an asynchronous operation completes.
+ *
+ * @param op
+ *	The operation which completed.  It must not be freed by this function.
+ * @param result
+ *	The return value of the operation: 0 on success, or a
+ *	::wimlib_error_code value on failure.  This is
+ *	::WIMLIB_ERR_ABORTED_BY_PROGRESS if the operation was cancelled.
+ * @param ctx
+ *	The context pointer which was given when the operation was started.
+ */
+typedef void (*wimlib_completion_func_t)(struct wimlib_operation *op,
+					 int result, void *ctx);
+
+/**
+ * @ingroup G_async
+ *
+ * Start extracting an image from a WIM, like wimlib_extract_image(), but on a
+ * thread owned by the library, and return without waiting for the extraction
+ * to finish.
+ *
+ * Until the operation has completed, @p wim is in use by the library and must
+ * not be accessed or freed by the caller.  Progress messages are sent to the
+ * progress function registered with @p wim, if any, but they are sent on the
+ * library's thread.  At most a few operations run at once, one per processor;
+ * any more are queued and started in order as earlier ones complete.
+ *
+ * @param wim
+ *	Pointer to the ::WIMStruct for the WIM.
+ * @param image
+ *	The image to extract, as for wimlib_extract_image().
+ * @param target
+ *	The directory or NTFS volume to extract the image to.  This string is
+ *	copied, so it need not remain valid after this function returns.
+ * @param extract_flags
+ *	Bitwise OR of flags prefixed with WIMLIB_EXTRACT_FLAG.
+ * @param completion_func
+ *	If not @c NULL, a function to call on the library's thread when the
+ *	operation completes, before waiters are woken.
+ * @param completion_ctx
+ *	A pointer which is passed to @p completion_func.
+ * @param op_ret
+ *	On success, a pointer to the handle for the new operation is written
+ *	here.  It must eventually be freed with wimlib_free_operation().
+ *
+ * @return 0 if the operation was started; a ::wimlib_error_code value on
+ * failure.  Errors in the extraction itself are not returned here, but rather
+ * are the result of the operation.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p wim, @p target, or @p op_ret was @c NULL.
+ * @retval ::WIMLIB_ERR_NOMEM
+ *	Failed to allocate needed memory.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_extract_image_async(WIMStruct *wim, int image,
+			   const wimlib_tchar *target, int extract_flags,
+			   wimlib_completion_func_t completion_func,
+			   void *completion_ctx,
+			   struct wimlib_operation **op_ret);
+
+/**
+ * @ingroup G_async
+ *
+ * Start writing a WIM, like wimlib_write(), but on a thread owned by the
+ * library, and return without waiting for the write to finish.  The
+ * requirements and behavior are otherwise the same as for
+ * wimlib_extract_image_async(); in particular, @p wim must not be accessed by
+ * the caller until the operation has completed.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_write_async(WIMStruct *wim, const wimlib_tchar *path, int image,
+		   int write_flags, unsigned num_threads,
+		   wimlib_completion_func_t completion_func,
+		   void *completion_ctx,
+		   struct wimlib_operation **op_ret);
+
+/**
+ * @ingroup G_async
+ *
+ * Start overwriting a WIM, like wimlib_overwrite(), but on a thread owned by
+ * the library, and return without waiting for the write to finish.  The
+ * requirements and behavior are otherwise the same as for
+ * wimlib_extract_image_async().
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_overwrite_async(WIMStruct *wim, int write_flags, unsigned num_threads,
+		       wimlib_completion_func_t completion_func,
+		       void *completion_ctx,
+		       struct wimlib_operation **op_ret);
+
+/**
+ * @ingroup G_async
+ *
+ * Check whether an asynchronous operation has completed, without blocking.
+ *
+ * @param op
+ *	The operation to check.
+ * @param result_ret
+ *	If not @c NULL and the operation has completed, its result (0 or a
+ *	::wimlib_error_code value) is written here.
+ *
+ * @return @c true if the operation has completed, including the call to its
+ * completion function if it has one; otherwise @c false.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI bool
+wimlib_poll_operation(struct wimlib_operation *op, int *result_ret);
+
+/**
+ * @ingroup G_async
+ *
+ * Wait for an asynchronous operation to complete, including the call to its
+ * completion function if it has one.  This must not be called from a progress
+ * function or completion function.
+ *
+ * @return The result of the operation: 0 on success, or a ::wimlib_error_code
+ * value on failure.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_wait_operation(struct wimlib_operation *op);
+
+/**
+ * @ingroup G_async
+ *
+ * Request that an asynchronous operation be cancelled.  This does not wait.
+ * An operation which has not started yet will not be started, and a running
+ * operation is aborted at its next progress message, as if the progress
+ * function had returned ::WIMLIB_PROGRESS_STATUS_ABORT.  A cancelled operation
+ * completes with the result ::WIMLIB_ERR_ABORTED_BY_PROGRESS, unless it had
+ * already finished.  As with any aborted write, a WIM file being written may be
+ * left incomplete, although wimlib_overwrite() in its default mode leaves the
+ * original WIM intact.
+ *
+ * This may be called from any thread, including from a progress function.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI void
+wimlib_cancel_operation(struct wimlib_operation *op);
+
+/**
+ * @ingroup G_async
+ *
+ * Free the handle to an asynchronous operation, first waiting for it to
+ * complete if it has not already.  To stop the operation rather than waiting
+ * for it, call wimlib_cancel_operation() first.  If @p op is @c NULL, this
+ * does nothing.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI void
+wimlib_free_operation(struct wimlib_operation *op);
+
 /**
  * @defgroup G_compression Compression and decompression functions
  *
@@ -4664,6 +6042,7 @@ struct wimlib_compressor;
 
 /** Opaque decompressor handle.  */
 struct wimlib_decompressor;
+struct wimlib_chunked_decompressor;
 
 /**
  * Set the default compression level for the specified compression type.  This
@@ -4697,6 +6076,38 @@ struct wimlib_decompressor;
 WIMLIBAPI int
 wimlib_set_default_compression_level(int ctype, unsigned int compression_level);
 
+/**
+ * Set the maximum amount of memory that wimlib may keep in a cache of freed
+ * compressors and decompressors for reuse.  When this is nonzero,
+ * wimlib_free_compressor() and wimlib_free_decompressor() keep the internal
+ * state in the cache, and a later wimlib_create_compressor() or
+ * wimlib_create_decompressor() call with the same compression type, maximum
+ * block size, and compression level and flags reuses it instead of allocating
+ * new state.  The least recently freed states are released when the cache
+ * would exceed its size.
+ *
+ * Since wimlib's WIM writing and reading code creates its compressors and
+ * decompressors with these functions, this helps programs that write or read
+ * many small WIM files, where allocating and page-faulting the compressors'
+ * memory (which can be tens of MiB each for LZX and LZMS at high compression
+ * levels) would otherwise take much of the time.
+ *
+ * The cache is shared by the whole process and is emptied by
+ * wimlib_global_cleanup().  This can be called before wimlib_global_init().
+ *
+ * @param max_memory
+ *	The maximum size of the cache in bytes, as measured by
+ *	wimlib_get_compressor_needed_memory() for compressors, or 0 to disable
+ *	the cache (the default).  Making the cache smaller releases cached states
+ *	as needed.
+ *
+ * @return 0
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_set_compressor_cache_size(uint64_t max_memory);
+
 /**
  * Return the approximate number of bytes needed to allocate a compressor with
  * wimlib_create_compressor() for the specified compression type, maximum block
@@ -4712,6 +6123,14 @@ wimlib_get_compressor_needed_memory(enum wimlib_compression_type ctype,
 
 #define WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE	0x80000000
 
+/**
+ * Flag for the @p compression_level parameter of wimlib_create_compressor():
+ * allow the compressor to compress parts of one large buffer in parallel, using
+ * the library's thread pool.  See wimlib_create_compressor() for details.
+ * Since wimlib v1.15.0.
+ */
+#define WIMLIB_COMPRESSOR_FLAG_PARALLEL		0x40000000
+
 /**
  * Allocate a compressor for the specified compression type using the specified
  * parameters.  This function is part of wimlib's compression API; it is not
@@ -4765,6 +6184,22 @@ wimlib_get_compressor_needed_memory(enum wimlib_compression_type ctype,
  *	may have been written to but will have been restored exactly to its
  *	original state.  This mode is designed to save some memory when using
  *	large buffer sizes.
+ *	<br/>
+ *	Since wimlib v1.15.0, this parameter can also be OR-ed with the flag
+ *	::WIMLIB_COMPRESSOR_FLAG_PARALLEL.  This allows the compressor to split
+ *	a large buffer into segments which are compressed in parallel, using the
+ *	library's thread pool (see wimlib_set_thread_pool_size()), which lowers
+ *	the time taken to compress one buffer at the cost of a slightly worse
+ *	compression ratio.  For LZX, each segment is parsed knowing only the
+ *	128 KiB of data just before it, so matches can refer back into that
+ *	much of the previous segment but no further.  The compressed data is
+ *	still in the normal format.  Currently this only has
+ *	an effect for LZX with buffers of at least 512 KiB and compression
+ *	levels above 34, and for LZMS with buffers of at least 1 MiB.  For LZMS,
+ *	only the construction of the suffix array used for match-finding is
+ *	parallelized, so the compressed data doesn't change.  The memory for
+ *	the extra parallel contexts is allocated the first time it is needed
+ *	and is not included in wimlib_get_compressor_needed_memory().
  * @param compressor_ret
  *	A location into which to return the pointer to the allocated compressor.
  *	The allocated compressor can be used for any number of calls to
@@ -4811,6 +6246,69 @@ wimlib_compress(const void *uncompressed_data, size_t uncompressed_size,
 		void *compressed_data, size_t compressed_size_avail,
 		struct wimlib_compressor *compressor);
 
+/**
+ * One buffer of data to compress with wimlib_compress_batch() or to decompress
+ * with wimlib_decompress_batch().
+ */
+struct wimlib_codec_batch_item {
+	/** The data to compress or decompress  */
+	const void *in_data;
+
+	/** Size, in bytes, of @p in_data  */
+	size_t in_size;
+
+	/** Buffer into which to write the compressed or uncompressed data  */
+	void *out_data;
+
+	/** For wimlib_compress_batch(), the number of bytes available in @p
+	 * out_data.  For wimlib_decompress_batch(), the exact size of the data
+	 * when uncompressed.  */
+	size_t out_size;
+
+	/** Set on return to what wimlib_compress() or wimlib_decompress()
+	 * would have returned for this buffer: the size of the compressed
+	 * data, or 0 if it didn't fit in @p out_size bytes; or 0 if the
+	 * decompression succeeded and 1 if it failed.  */
+	size_t result;
+};
+
+/**
+ * Compress many buffers of data, in parallel.  This is the same as calling
+ * wimlib_compress() for each item in turn, with the same results, except that
+ * the items are compressed by up to @p num_threads threads of the library's
+ * thread pool (see wimlib_set_thread_pool_size()), one of which is the calling
+ * thread.  Each other thread uses a compressor of its own with the same
+ * parameters as @p compressor, which is created for the call unless one is
+ * available from the cache enabled by wimlib_set_compressor_cache_size().  This
+ * is best suited to many small buffers, e.g. the chunks of a file being
+ * compressed for WOF.
+ *
+ * @param items
+ *	The buffers to compress.  The @p result of each is set on return.
+ * @param num_items
+ *	The number of items in @p items.
+ * @param num_threads
+ *	The maximum number of threads to use, or 0 to use as many as there are
+ *	processors.  The thread pool's size is also a limit.
+ * @param compressor
+ *	A compressor previously allocated with wimlib_create_compressor().  If
+ *	wimlib_get_compressor_stats() is supported, the statistics of the work
+ *	done by all threads are added to it.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.  Whether each
+ * buffer could be compressed is indicated by its @p result instead.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p compressor was @c NULL, or @p items was @c NULL while @p num_items
+ *	wasn't 0.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_compress_batch(struct wimlib_codec_batch_item *items, size_t num_items,
+		      unsigned int num_threads,
+		      struct wimlib_compressor *compressor);
+
 /**
  * Free a compressor previously allocated with wimlib_create_compressor().
  *
@@ -4820,6 +6318,95 @@ wimlib_compress(const void *uncompressed_data, size_t uncompressed_size,
 WIMLIBAPI void
 wimlib_free_compressor(struct wimlib_compressor *compressor);
 
+/**
+ * Statistics about the decisions a compressor has made, as returned by
+ * wimlib_get_compressor_stats().  All counts are totals over every call to
+ * wimlib_compress() made with the compressor since it was created.
+ *
+ * The histograms are indexed by the base 2 logarithm, rounded down, of the
+ * match length or match offset; e.g. @p match_len_hist[3] counts the matches of
+ * length 8 through 15.  Matches which reuse a recent offset are not included in
+ * @p match_offset_hist, and delta matches (LZMS) are included in neither
+ * histogram.
+ */
+struct wimlib_compressor_stats {
+	/** Number of calls to wimlib_compress()  */
+	uint64_t num_calls;
+
+	/** Total number of bytes passed to wimlib_compress()  */
+	uint64_t uncompressed_bytes;
+
+	/** Total number of bytes of compressed data returned by
+	 * wimlib_compress(), not counting calls which returned 0  */
+	uint64_t compressed_bytes;
+
+	/** Number of calls to wimlib_compress() which returned 0 because the
+	 * data didn't compress to the space available  */
+	uint64_t num_incompressible;
+
+	/** Number of blocks, i.e. sets of entropy codes, emitted.  For XPRESS
+	 * this is the number of successful calls; LZMS doesn't have blocks.  */
+	uint64_t num_blocks;
+
+	/** Of @p num_blocks, the number of LZX verbatim blocks  */
+	uint64_t num_verbatim_blocks;
+
+	/** Of @p num_blocks, the number of LZX aligned offset blocks  */
+	uint64_t num_aligned_blocks;
+
+	/** Number of passes of the near-optimal parsing algorithm, summed over
+	 * all blocks.  This is 0 at compression levels which don't use it.  */
+	uint64_t num_optimization_passes;
+
+	/** Number of literal bytes emitted  */
+	uint64_t num_literals;
+
+	/** Number of matches emitted, including repeat offset and delta
+	 * matches  */
+	uint64_t num_matches;
+
+	/** Of @p num_matches, the number which reused a recent offset  */
+	uint64_t num_repeat_offset_matches;
+
+	/** Of @p num_matches, the number of LZMS delta matches  */
+	uint64_t num_delta_matches;
+
+	/** Total number of bytes covered by matches  */
+	uint64_t match_bytes;
+
+	/** Histogram of match lengths  */
+	uint64_t match_len_hist[32];
+
+	/** Histogram of match offsets  */
+	uint64_t match_offset_hist[32];
+
+	uint64_t reserved[32];
+};
+
+/**
+ * Get statistics about the compressed data that a compressor has produced.
+ * This is meant for tuning, e.g. to see how the choice of compression level and
+ * chunk size plays out on a particular kind of data; it isn't needed for normal
+ * compression.
+ *
+ * @param compressor
+ *	A compressor previously allocated with wimlib_create_compressor().
+ * @param stats
+ *	The structure into which to return the statistics.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_UNSUPPORTED
+ *	wimlib was not configured with <c>--enable-compressor-stats</c>.
+ *	Recording the statistics slows down compression slightly, so it is
+ *	disabled by default.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_get_compressor_stats(const struct wimlib_compressor *compressor,
+			    struct wimlib_compressor_stats *stats);
+
 /**
  * Allocate a decompressor for the specified compression type.  This function is
  * part of wimlib's compression API; it is not necessary to call this to process
@@ -4890,6 +6477,36 @@ wimlib_decompress(const void *compressed_data, size_t compressed_size,
 		  void *uncompressed_data, size_t uncompressed_size,
 		  struct wimlib_decompressor *decompressor);
 
+/**
+ * Decompress many buffers of data, in parallel.  This is the same as calling
+ * wimlib_decompress() for each item in turn, except that the items are
+ * decompressed by up to @p num_threads threads of the library's thread pool,
+ * as described for wimlib_compress_batch().
+ *
+ * @param items
+ *	The buffers to decompress.  The @p result of each is set on return.
+ * @param num_items
+ *	The number of items in @p items.
+ * @param num_threads
+ *	The maximum number of threads to use, or 0 to use as many as there are
+ *	processors.  The thread pool's size is also a limit.
+ * @param decompressor
+ *	A decompressor previously allocated with wimlib_create_decompressor().
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.  Whether each
+ * buffer could be decompressed is indicated by its @p result instead.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p decompressor was @c NULL, or @p items was @c NULL while @p num_items
+ *	wasn't 0.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_decompress_batch(struct wimlib_codec_batch_item *items,
+			size_t num_items, unsigned int num_threads,
+			struct wimlib_decompressor *decompressor);
+
 /**
  * Free a decompressor previously allocated with wimlib_create_decompressor().
  *
@@ -4899,6 +6516,110 @@ wimlib_decompress(const void *compressed_data, size_t compressed_size,
 WIMLIBAPI void
 wimlib_free_decompressor(struct wimlib_decompressor *decompressor);
 
+/**
+ * Allocate a decompressor for data in the chunked format used by WIM resources
+ * and by files compressed with Windows' WOF (Windows Overlay Filter, also known
+ * as "System Compression").  The data is decompressed incrementally with
+ * wimlib_chunked_decompress(), so it doesn't need to be in memory all at once.
+ *
+ * The data consists of a chunk table followed by the chunks of compressed data,
+ * each of which decompresses to @p chunk_size bytes, except that the last one
+ * may be shorter.  The chunk table contains the offset of each chunk except the
+ * first relative to the end of the chunk table, as a 4-byte little endian
+ * integer, or an 8-byte one if the uncompressed size is greater than 4 GiB.  A
+ * chunk whose compressed size is equal to its uncompressed size is stored
+ * uncompressed.  This isn't the format of the solid resources of WIM files.
+ *
+ * Only the chunk table and two chunks' worth of data are held in memory, in
+ * addition to the memory of the decompressor itself.
+ *
+ * @param ctype
+ *	The compression type of the chunks, as one of the
+ *	::wimlib_compression_type constants other than
+ *	::WIMLIB_COMPRESSION_TYPE_NONE.
+ * @param chunk_size
+ *	The uncompressed size of each chunk but the last, e.g. 4096 for WOF's
+ *	XPRESS4K format or 32768 for its LZX format.
+ * @param compressed_size
+ *	The size of the compressed data, including the chunk table.
+ * @param uncompressed_size
+ *	The size of the data when uncompressed.
+ * @param decompressor_ret
+ *	A location into which to return the pointer to the allocated chunked
+ *	decompressor, which must be freed with
+ *	wimlib_free_chunked_decompressor().
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_COMPRESSION_TYPE
+ *	@p ctype was not a supported compression type.
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p chunk_size was invalid for the compression type, @p compressed_size
+ *	was too small to even hold the chunk table, or @p decompressor_ret was
+ *	@c NULL.
+ * @retval ::WIMLIB_ERR_NOMEM
+ *	Insufficient memory to allocate the decompressor.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_create_chunked_decompressor(enum wimlib_compression_type ctype,
+				   uint32_t chunk_size,
+				   uint64_t compressed_size,
+				   uint64_t uncompressed_size,
+				   struct wimlib_chunked_decompressor **decompressor_ret);
+
+/**
+ * Decompress the next part of the data being decompressed by a chunked
+ * decompressor.  This consumes as much of the compressed data in @p in as
+ * possible, and writes as much uncompressed data to @p out as is available and
+ * fits, returning when either is exhausted.  The input can be split into pieces
+ * of any size, and any compressed data which isn't consumed must be passed again
+ * in the next call.  Once all @p uncompressed_size bytes have been written, any
+ * further input is left unconsumed.
+ *
+ * @param decompressor
+ *	A decompressor allocated with wimlib_create_chunked_decompressor().
+ * @param in
+ *	The next part of the compressed data.
+ * @param in_size
+ *	Size, in bytes, of @p in.
+ * @param in_used_ret
+ *	A location into which to return the number of bytes of @p in consumed.
+ * @param out
+ *	Buffer into which to write the next part of the uncompressed data.
+ * @param out_size
+ *	Number of bytes available in @p out.
+ * @param out_written_ret
+ *	A location into which to return the number of bytes written to @p out.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.  After a
+ * failure, the decompressor can only be freed.
+ *
+ * @retval ::WIMLIB_ERR_DECOMPRESSION
+ *	The chunk table or a chunk is invalid.  The data before the invalid chunk
+ *	has still been written.
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	A parameter was @c NULL.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI int
+wimlib_chunked_decompress(struct wimlib_chunked_decompressor *decompressor,
+			  const void *in, size_t in_size, size_t *in_used_ret,
+			  void *out, size_t out_size, size_t *out_written_ret);
+
+/**
+ * Free a decompressor allocated with wimlib_create_chunked_decompressor().
+ *
+ * @param decompressor
+ *	The decompressor to free.  If @c NULL, no action is taken.
+ *
+ * Since wimlib v1.15.0.
+ */
+WIMLIBAPI void
+wimlib_free_chunked_decompressor(struct wimlib_chunked_decompressor *decompressor);
+
 
 /**
  * @}
@@ -1,6 +1,7 @@
 #ifndef _WIMLIB_APPLY_H
 #define _WIMLIB_APPLY_H
 
+#include "wimlib/blob_cache.h"
 #include "wimlib/compiler.h"
 #include "wimlib/file_io.h"
 #include "wimlib/list.h"
@@ -66,20 +67,34 @@ struct apply_ctx {
 	/* Features supported by the extraction mode (with booleans)  */
 	struct wim_features supported_features;
 
+	/* Maximum number of targets that extract_blob_list() passes a blob to
+	 * at once.  A blob with more targets is first extracted to a temporary
+	 * file, then copied from it to each target in turn.  This is
+	 * MAX_OPEN_FILES unless the extraction backend raises it.  */
+	unsigned max_open_files;
+
+	/* Set if all images of the WIM are being extracted at once.  Then the
+	 * root dentry of each image is extracted as a directory in @target
+	 * whose name is the root's extraction name, and no image is selected.
+	 */
+	bool all_images;
+
 	/* The members below should not be used outside of extract.c  */
 	const struct apply_operations *apply_ops;
 	u64 next_progress;
+	struct progress_throttle progress_throttle;
 	unsigned long invalid_sequence;
 	unsigned long num_blobs_remaining;
 	struct list_head blob_list;
 	const struct read_blob_callbacks *saved_cbs;
 	struct filedes tmpfile_fd;
 	tchar *tmpfile_name;
+	struct blob_cache_writer cache_writer;
 	unsigned int count_until_file_progress;
 };
 
-/* Maximum number of UNIX file descriptors, NTFS attributes, or Windows file
- * handles that can be opened simultaneously to extract a blob to multiple
+/* Default maximum number of UNIX file descriptors, NTFS attributes, or Windows
+ * file handles that can be opened simultaneously to extract a blob to multiple
  * destinations.  */
 #ifndef __APPLE__
 #define MAX_OPEN_FILES 512
@@ -266,12 +281,20 @@ struct apply_operations {
 	 * that form a single tree, not multiple trees.
 	 */
 	bool single_tree_only;
+
+	/*
+	 * Set this if the extraction backend supports extracting all images at
+	 * once; see apply_ctx.all_images.  Otherwise they are extracted one by
+	 * one.
+	 */
+	bool supports_all_images;
 };
 
 #ifdef _WIN32
   extern const struct apply_operations win32_apply_ops;
 #else
   extern const struct apply_operations unix_apply_ops;
+  extern const struct apply_operations tar_apply_ops;
 #endif
 
 #ifdef WITH_NTFS_3G
@@ -0,0 +1,35 @@
+/*
+ * arena.h
+ *
+ * A memory arena from which many small objects can be allocated cheaply and
+ * then freed all at once.
+ */
+
+#ifndef _WIMLIB_ARENA_H
+#define _WIMLIB_ARENA_H
+
+#include "wimlib/types.h"
+
+struct arena_chunk;
+
+/*
+ * Objects are allocated from the current chunk by advancing a pointer, and
+ * individual objects are never freed; arena_destroy() frees every chunk.  An
+ * all-zeroes struct is a valid empty arena.
+ */
+struct mem_arena {
+	struct arena_chunk *chunks;
+	u8 *next;
+	u8 *end;
+};
+
+void *
+arena_alloc(struct mem_arena *arena, size_t size);
+
+void *
+arena_zalloc(struct mem_arena *arena, size_t size);
+
+void
+arena_destroy(struct mem_arena *arena);
+
+#endif /* _WIMLIB_ARENA_H */
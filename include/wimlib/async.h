@@ -0,0 +1,13 @@
+/*
+ * async.h
+ *
+ * Library-owned threads that run asynchronous extract and write operations.
+ */
+
+#ifndef _WIMLIB_ASYNC_H
+#define _WIMLIB_ASYNC_H
+
+void
+async_cleanup(void);
+
+#endif /* _WIMLIB_ASYNC_H */
@@ -0,0 +1,68 @@
+#ifndef _WIMLIB_BLOB_CACHE_H
+#define _WIMLIB_BLOB_CACHE_H
+
+#include "wimlib/file_io.h"
+#include "wimlib/types.h"
+
+struct blob_cache_entry;
+struct blob_descriptor;
+
+/*
+ * A directory of the uncompressed data of blobs extracted earlier, named by
+ * their SHA-1 message digests, as set with wimlib_set_extract_blob_cache() (see
+ * blob_cache.c).
+ */
+struct blob_cache {
+	/* Path to the cache directory, and a buffer for the paths of the files
+	 * in it  */
+	tchar *dir;
+	size_t dir_nchars;
+	tchar *path_buf;
+
+	/* The maximum total size of the cached data, in bytes  */
+	u64 max_size;
+
+	/* Set after failing to create a file in the cache, so that blobs
+	 * aren't added anymore  */
+	bool add_failed;
+
+	/* The blobs found in or added to the cache since its index was last
+	 * saved  */
+	struct blob_cache_entry *used;
+	size_t num_used;
+	size_t used_alloc;
+};
+
+/* A blob being added to the cache while it's extracted  */
+struct blob_cache_writer {
+	struct filedes fd;
+	tchar *tmpfile;
+};
+
+const tchar *
+blob_cache_lookup(struct blob_cache *cache, const struct blob_descriptor *blob);
+
+void
+blob_cache_remove(struct blob_cache *cache, const struct blob_descriptor *blob);
+
+void
+blob_cache_begin_add(struct blob_cache *cache,
+		     const struct blob_descriptor *blob,
+		     struct blob_cache_writer *writer);
+
+void
+blob_cache_write(struct blob_cache_writer *writer, const void *data,
+		 size_t size);
+
+void
+blob_cache_end_add(struct blob_cache *cache,
+		   const struct blob_descriptor *blob,
+		   struct blob_cache_writer *writer, bool ok);
+
+void
+save_blob_cache_index(struct blob_cache *cache);
+
+void
+free_blob_cache(struct blob_cache *cache);
+
+#endif /* _WIMLIB_BLOB_CACHE_H */
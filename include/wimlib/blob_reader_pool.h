@@ -0,0 +1,35 @@
+/*
+ * blob_reader_pool.h
+ *
+ * Reading the data of upcoming blobs from files using multiple threads.
+ */
+
+#ifndef _WIMLIB_BLOB_READER_POOL_H
+#define _WIMLIB_BLOB_READER_POOL_H
+
+#include "wimlib/types.h"
+
+struct blob_descriptor;
+struct blob_reader_pool;
+
+/* Maximum number of threads a blob reader pool will use.  */
+#define MAX_BLOB_READER_THREADS		16
+
+int
+new_blob_reader_pool(unsigned num_threads, struct blob_reader_pool **pool_ret);
+
+void
+blob_reader_pool_destroy(struct blob_reader_pool *pool);
+
+bool
+blob_reader_pool_can_read(const struct blob_descriptor *blob);
+
+bool
+blob_reader_pool_submit(struct blob_reader_pool *pool,
+			const struct blob_descriptor *blob, size_t idx);
+
+bool
+blob_reader_pool_take(struct blob_reader_pool *pool, size_t idx,
+		      void **buf_ret, int *status_ret, u8 *hash_ret);
+
+#endif /* _WIMLIB_BLOB_READER_POOL_H */
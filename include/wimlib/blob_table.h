@@ -19,13 +19,19 @@ enum blob_location {
 	BLOB_IN_WIM,
 
 	/* The blob's data is available as the contents of the file named by
-	 * @file_on_disk.  */
+	 * @file_on_disk, starting at @file_offset, which is nonzero only for a
+	 * member of an archive such as a tar file.  */
 	BLOB_IN_FILE_ON_DISK,
 
 	/* The blob's data is available as the contents of the in-memory buffer
 	 * pointed to by @attached_buffer.  */
 	BLOB_IN_ATTACHED_BUFFER,
 
+	/* The blob's data is the metadata resource of the image
+	 * @generated_imd, which is generated as it is read.  This is only used
+	 * temporarily while writing the metadata resource.  */
+	BLOB_IN_GENERATED_METADATA,
+
 #ifdef WITH_FUSE
 	/* The blob's data is available as the contents of the file with name
 	 * @staging_file_name relative to the open directory file descriptor
@@ -154,6 +160,17 @@ struct blob_descriptor {
 	/* Only used by wimlib_export_image() */
 	u16 was_exported : 1;
 
+	/* 1 iff this blob was captured from a file that matched
+	 * [CompressionExclusionList] in the capture configuration file, so it
+	 * is to be stored uncompressed in newly written resources.  */
+	u16 compression_excluded : 1;
+
+	/* For blobs read from the blob table of a WIM file: the index of the
+	 * blob's entry in the table.  When the WIM file is appended to, the
+	 * blobs already in it keep this order in the new blob table, so that
+	 * only the new blobs need to be sorted.  */
+	u32 blob_table_pos;
+
 	/* Specification of where this blob's data is located.  Which member of
 	 * this union is valid is determined by the @blob_location field.  */
 	union {
@@ -179,16 +196,31 @@ struct blob_descriptor {
 						struct windows_file *windows_file;
 					};
 					struct wim_inode *file_inode;
+					u64 file_offset;
+
+					/* BLOB_IN_FILE_ON_DISK only: where the
+					 * file's data starts on disk, in bytes,
+					 * if known; see
+					 * WIMLIB_ADD_FLAG_DISK_ORDER.  */
+					u64 file_disk_offset;
 				};
 
 				/* BLOB_IN_ATTACHED_BUFFER */
 				void *attached_buffer;
 
+				/* BLOB_IN_GENERATED_METADATA */
+				struct wim_image_metadata *generated_imd;
+
 			#ifdef WITH_FUSE
 				/* BLOB_IN_STAGING_FILE  */
 				struct {
 					char *staging_file_name;
 					int staging_dir_fd;
+
+					/* If not NULL, parts of the data are
+					 * still only in the original blob; see
+					 * 'struct staging_origin'.  */
+					struct staging_origin *staging_origin;
 				};
 			#endif
 
@@ -259,12 +291,62 @@ struct blob_descriptor {
 
 		/* Links blobs being extracted.  */
 		struct list_head extraction_list;
-
-		/* Links blobs being exported.  */
-		struct list_head export_blob_list;
 	};
 };
 
+#ifdef WITH_FUSE
+
+/* Size of the extents in which a lazily staged blob's data is copied from its
+ * original blob to its staging file  */
+#define STAGING_EXTENT_SIZE	65536
+
+/*
+ * When a stream in a read-write mounted image is opened for writing, its data
+ * isn't extracted to a staging file right away.  Instead, a sparse staging file
+ * is created and the stream's original blob is remembered here.  An extent of
+ * the staging file is filled from the original blob only when a write
+ * overwrites part of it; until then, reads of that extent go to the original
+ * blob.  So, for example, appending to a large file doesn't require
+ * decompressing any of the file's existing data.
+ */
+struct staging_origin {
+	/* A copy of the descriptor of the stream's original blob, which is
+	 * located in a WIM file  */
+	struct blob_descriptor *blob;
+
+	/* Only the first @size bytes of the stream may still come from @blob.
+	 * This shrinks when the stream is truncated.  */
+	u64 size;
+
+	/* Bitmap of the extents of the first @size bytes which are valid in the
+	 * staging file  */
+	machine_word_t *filled;
+
+	/* Whether the stream has been written to or truncated since it was
+	 * staged  */
+	bool modified;
+};
+
+static inline bool
+staging_extent_filled(const struct staging_origin *origin, u64 idx)
+{
+	return (origin->filled[idx / WORDBITS] >> (idx % WORDBITS)) & 1;
+}
+
+static inline void
+set_staging_extent_filled(struct staging_origin *origin, u64 idx)
+{
+	origin->filled[idx / WORDBITS] |= (machine_word_t)1 << (idx % WORDBITS);
+}
+
+struct staging_origin *
+new_staging_origin(const struct blob_descriptor *blob, u64 size);
+
+void
+free_staging_origin(struct staging_origin *origin);
+
+#endif /* WITH_FUSE */
+
 struct blob_table *
 new_blob_table(size_t capacity);
 
@@ -323,6 +405,7 @@ for_blob_in_table_sorted_by_sequential_order(struct blob_table *table,
 					     int (*visitor)(struct blob_descriptor *, void *),
 					     void *arg);
 
+struct wim_image_metadata;
 struct wimlib_resource_entry;
 
 void
@@ -337,6 +420,18 @@ int
 sort_blob_list_by_sequential_order(struct list_head *blob_list,
 				   size_t list_head_offset);
 
+int
+blob_list_to_array(struct list_head *blob_list, size_t list_head_offset,
+		   struct blob_descriptor ***blobs_ret, size_t *num_blobs_ret);
+
+void
+blob_array_to_list(struct blob_descriptor **blobs, size_t num_blobs,
+		   struct list_head *blob_list, size_t list_head_offset);
+
+void
+sort_blobs_by_sequential_order(struct blob_descriptor **blobs,
+			       size_t num_blobs);
+
 int
 cmp_blobs_by_sequential_order(const void *p1, const void *p2);
 
@@ -390,6 +485,24 @@ blob_is_in_file(const struct blob_descriptor *blob)
 	   ;
 }
 
+/* Return true if the data of @blob may be read while other blobs are being read
+ * by other threads, i.e. if it is in a file which is read through its own
+ * handle, or in memory.  */
+static inline bool
+blob_can_be_read_concurrently(const struct blob_descriptor *blob)
+{
+	switch (blob->blob_location) {
+	case BLOB_IN_FILE_ON_DISK:
+	case BLOB_IN_ATTACHED_BUFFER:
+#ifdef _WIN32
+	case BLOB_IN_WINDOWS_FILE:
+#endif
+		return true;
+	default:
+		return false;
+	}
+}
+
 #ifdef _WIN32
 const wchar_t *
 get_windows_file_path(const struct windows_file *file);
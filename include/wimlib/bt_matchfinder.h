@@ -75,23 +75,6 @@
 #undef TEMPLATED
 #define TEMPLATED(name)		CONCAT(name, MF_SUFFIX)
 
-#ifndef _WIMLIB_BT_MATCHFINDER_H
-#define _WIMLIB_BT_MATCHFINDER_H
-
-/* Non-templated definitions  */
-
-/* Representation of a match found by the bt_matchfinder  */
-struct lz_match {
-
-	/* The number of bytes matched.  */
-	u32 length;
-
-	/* The offset back from the current position that was matched.  */
-	u32 offset;
-};
-
-#endif /* _WIMLIB_BT_MATCHFINDER_H */
-
 struct TEMPLATED(bt_matchfinder) {
 
 	/* The hash table for finding length 2 matches, if enabled  */
@@ -0,0 +1,43 @@
+/*
+ * chunk_cache.h
+ *
+ * A cache of decompressed chunks of a WIM file's resources.
+ */
+
+#ifndef _WIMLIB_CHUNK_CACHE_H
+#define _WIMLIB_CHUNK_CACHE_H
+
+#include "wimlib/types.h"
+
+struct chunk_cache;
+struct wimlib_decompressor;
+
+/* Default limit on the memory used by the decompressed chunks in a chunk
+ * cache.  This is enough to hold two chunks of the largest size allowed in
+ * solid resources.  */
+#define DEFAULT_CHUNK_CACHE_SIZE	(128U << 20)
+
+int
+new_chunk_cache(size_t max_bytes, struct chunk_cache **cache_ret);
+
+void
+free_chunk_cache(struct chunk_cache *cache);
+
+bool
+chunk_cache_read_chunk(struct chunk_cache *cache, u64 res_offset, u64 chunk_idx,
+		       u32 skip, u32 size, void *buf);
+
+void
+chunk_cache_add_chunk(struct chunk_cache *cache, u64 res_offset, u64 chunk_idx,
+		      u8 *data, u32 size);
+
+struct wimlib_decompressor *
+chunk_cache_get_decompressor(struct chunk_cache *cache, int ctype,
+			     u32 max_block_size);
+
+void
+chunk_cache_put_decompressor(struct chunk_cache *cache, int ctype,
+			     u32 max_block_size,
+			     struct wimlib_decompressor *decompressor);
+
+#endif /* _WIMLIB_CHUNK_CACHE_H */
@@ -7,19 +7,41 @@
 #ifndef _WIMLIB_CHUNK_COMPRESSOR_H
 #define _WIMLIB_CHUNK_COMPRESSOR_H
 
+#include "wimlib.h"
 #include "wimlib/types.h"
 
+/*
+ * Return the number of consecutive chunks which the chunk compressors compress
+ * as a group (see compressor_start_group()), counting from the first chunk.
+ * This depends only on the compression type and chunk size, so that the
+ * compressed data is the same whichever chunk compressor is used and however
+ * many threads it has.  Only LZX makes use of groups; they span up to 512 KiB
+ * and 16 chunks.
+ */
+static inline unsigned
+chunks_per_compressor_group(int ctype, u32 chunk_size)
+{
+	if (ctype != WIMLIB_COMPRESSION_TYPE_LZX || chunk_size > 262144)
+		return 1;
+	return min(16, 524288 / chunk_size);
+}
+
 /* Interface for chunk compression.  Users can submit chunks of data to be
  * compressed, then retrieve them later in order.  This interface can be
  * implemented either in serial (having the calling thread compress the chunks
- * itself) or in parallel (having other threads asynchronously compress the
- * chunks).  */
+ * itself), in parallel (having other threads asynchronously compress the
+ * chunks), or remotely (having compression workers on other machines compress
+ * the chunks).  */
 struct chunk_compressor {
 	/* Variables set by the chunk compressor when it is created.  */
 	int out_ctype;
 	u32 out_chunk_size;
 	unsigned num_threads;
 
+	/* If set, chunks that data_seems_incompressible() are stored
+	 * uncompressed without running the compressor on them.  */
+	bool skip_incompressible;
+
 	/* Free the chunk compressor.  */
 	void (*destroy)(struct chunk_compressor *);
 
@@ -66,10 +88,18 @@ struct chunk_compressor {
 int
 new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 			      unsigned num_threads, u64 max_memory,
+			      bool skip_incompressible,
 			      struct chunk_compressor **compressor_ret);
 
 int
-new_serial_chunk_compressor(int out_ctype, u32 out_chunk_size,
+new_serial_chunk_compressor(int out_ctype, u32 out_chunk_size, bool parallel,
+			    bool skip_incompressible,
+			    struct chunk_compressor **compressor_ret);
+
+int
+new_remote_chunk_compressor(int out_ctype, u32 out_chunk_size,
+			    const tchar *workers, u64 max_memory,
+			    bool skip_incompressible,
 			    struct chunk_compressor **compressor_ret);
 
 #endif /* _WIMLIB_CHUNK_COMPRESSOR_H  */
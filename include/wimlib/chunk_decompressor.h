@@ -0,0 +1,78 @@
+/*
+ * chunk_decompressor.h
+ *
+ * Interface for parallel chunk decompression.
+ */
+
+#ifndef _WIMLIB_CHUNK_DECOMPRESSOR_H
+#define _WIMLIB_CHUNK_DECOMPRESSOR_H
+
+#include "wimlib/types.h"
+
+/* Interface for chunk decompression.  Users can submit chunks of compressed
+ * data to be decompressed by other threads, then retrieve the uncompressed data
+ * later in order.  This is the counterpart of 'struct chunk_compressor'; there
+ * is no serial implementation, since the serial case is handled directly by
+ * read_compressed_wim_resource().  */
+struct chunk_decompressor {
+	/* Variables set by the chunk decompressor when it is created.  */
+	int in_ctype;
+	u32 in_chunk_size;
+	unsigned num_threads;
+
+	/* Free the chunk decompressor.  There must not be any chunks pending,
+	 * i.e. ->get_decompression_result() must have returned %false.  */
+	void (*destroy)(struct chunk_decompressor *);
+
+	/* Try to borrow a buffer into which the compressed data for the next
+	 * chunk should be read.  The buffer has space for @in_chunk_size bytes.
+	 *
+	 * Only one buffer can be borrowed at a time.
+	 *
+	 * Returns a pointer to the buffer, or NULL if no buffer is available.
+	 * If no buffer is available, you must call ->get_decompression_result()
+	 * to retrieve a decompressed chunk before trying again.  */
+	void *(*get_chunk_buffer)(struct chunk_decompressor *);
+
+	/* Signals to the chunk decompressor that the buffer which was loaned
+	 * out from ->get_chunk_buffer() has finished being filled and contains
+	 * the specified number of bytes of compressed data (argument 2), which
+	 * decompress to the specified number of bytes (argument 3).  If the two
+	 * sizes are equal, then the chunk is stored uncompressed.  */
+	void (*signal_chunk_filled)(struct chunk_decompressor *, u32, u32);
+
+	/* Get the next chunk of decompressed data.
+	 *
+	 * The compressed data and its size are returned in the locations
+	 * pointed to by arguments 2-3, and the uncompressed data and its size
+	 * are returned in the locations pointed to by arguments 4-5.  Both
+	 * buffers are internal to the chunk decompressor, and they cannot be
+	 * accessed beyond the next call to ->get_chunk_buffer() or ->destroy().
+	 * Thus, several chunks can be retrieved and then processed together.
+	 * The caller may modify the uncompressed data buffer in place.
+	 *
+	 * Chunks will be returned in the same order in which they were
+	 * submitted for decompression.
+	 *
+	 * If the chunk could not be decompressed, then *(argument 6) is set to
+	 * %true and the contents of the uncompressed data buffer are
+	 * unspecified.  The caller can still retry the decompression itself,
+	 * e.g. to recover as much data as possible.
+	 *
+	 * The return value is %true if a chunk was successfully retrieved, or
+	 * %false if there are no chunks currently being decompressed.  */
+	bool (*get_decompression_result)(struct chunk_decompressor *,
+					 const void **, u32 *, void **, u32 *,
+					 bool *);
+
+	/* Returns %true if ->get_decompression_result() can retrieve a chunk
+	 * right away, without waiting for any decompression to finish.  */
+	bool (*result_ready)(struct chunk_decompressor *);
+};
+
+int
+new_parallel_chunk_decompressor(int in_ctype, u32 in_chunk_size,
+				unsigned num_threads, u64 max_memory,
+				struct chunk_decompressor **decompressor_ret);
+
+#endif /* _WIMLIB_CHUNK_DECOMPRESSOR_H  */
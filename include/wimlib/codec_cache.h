@@ -0,0 +1,22 @@
+/*
+ * codec_cache.h
+ *
+ * A library-wide cache of freed compressors and decompressors for reuse.
+ */
+
+#ifndef _WIMLIB_CODEC_CACHE_H
+#define _WIMLIB_CODEC_CACHE_H
+
+#include "wimlib/types.h"
+
+void *
+codec_cache_get(const void *ops, size_t max_block_size, unsigned int params);
+
+bool
+codec_cache_put(const void *ops, size_t max_block_size, unsigned int params,
+		u64 size, void *private, void (*free_private)(void *));
+
+void
+codec_cache_cleanup(void);
+
+#endif /* _WIMLIB_CODEC_CACHE_H */
@@ -16,4 +16,7 @@ void
 make_canonical_huffman_code(unsigned num_syms, unsigned max_codeword_len,
 			    const u32 freqs[], u8 lens[], u32 codewords[]);
 
+bool
+data_seems_incompressible(const void *data, size_t size);
+
 #endif /* _WIMLIB_COMPRESS_COMMON_H */
@@ -9,6 +9,8 @@
 
 #include "wimlib/types.h"
 
+struct wimlib_compressor_stats;
+
 struct compressor_ops {
 
 	u64 (*get_needed_memory)(size_t max_block_size,
@@ -18,6 +20,7 @@ struct compressor_ops {
 	int (*create_compressor)(size_t max_block_size,
 				 unsigned int compression_level,
 				 bool destructive,
+				 bool parallel,
 				 void **private_ret);
 
 	size_t (*compress)(const void *uncompressed_data,
@@ -26,11 +29,29 @@ struct compressor_ops {
 			   size_t compressed_size_avail,
 			   void *private);
 
+	/* Optional: start a new group of buffers, in which each buffer after
+	 * the first may be compressed using what the compressor learned from
+	 * the one before it; or with !in_group, compress each buffer on its own
+	 * again, which is the default.  See compressor_start_group().  */
+	void (*start_group)(void *private, bool in_group);
+
 	void (*free_compressor)(void *private);
+
+	/* Return the compressor's statistics.  Only used, and only set, if
+	 * ENABLE_COMPRESSOR_STATS is defined.  */
+	struct wimlib_compressor_stats *(*get_stats)(void *private);
 };
 
 extern const struct compressor_ops lzx_compressor_ops;
 extern const struct compressor_ops xpress_compressor_ops;
 extern const struct compressor_ops lzms_compressor_ops;
 
+unsigned int
+get_default_compression_level(int ctype);
+
+struct wimlib_compressor;
+
+void
+compressor_start_group(struct wimlib_compressor *c);
+
 #endif /* _WIMLIB_COMPRESSOR_OPS_H */
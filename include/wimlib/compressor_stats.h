@@ -0,0 +1,58 @@
+/*
+ * compressor_stats.h
+ *
+ * Recording of the statistics returned by wimlib_get_compressor_stats().  This
+ * is only compiled in if wimlib was configured with --enable-compressor-stats;
+ * otherwise COMPRESSOR_STATS() discards its argument, so compressors don't need
+ * to have a 'stats' member at all.
+ */
+
+#ifndef _WIMLIB_COMPRESSOR_STATS_H
+#define _WIMLIB_COMPRESSOR_STATS_H
+
+#include "wimlib.h"
+#include "wimlib/bitops.h"
+#include "wimlib/types.h"
+
+#ifdef ENABLE_COMPRESSOR_STATS
+#  define COMPRESSOR_STATS(stmt)	do { stmt; } while (0)
+#else
+#  define COMPRESSOR_STATS(stmt)	do { } while (0)
+#endif
+
+static forceinline void
+stats_add_literals(struct wimlib_compressor_stats *stats, u32 count)
+{
+	stats->num_literals += count;
+}
+
+/* Record a match which uses an explicit offset.  */
+static forceinline void
+stats_add_match(struct wimlib_compressor_stats *stats, u32 length, u32 offset)
+{
+	stats->num_matches++;
+	stats->match_bytes += length;
+	stats->match_len_hist[bsr32(length)]++;
+	stats->match_offset_hist[bsr32(offset)]++;
+}
+
+/* Record a match which reuses a recent offset.  */
+static forceinline void
+stats_add_repeat_match(struct wimlib_compressor_stats *stats, u32 length)
+{
+	stats->num_matches++;
+	stats->num_repeat_offset_matches++;
+	stats->match_bytes += length;
+	stats->match_len_hist[bsr32(length)]++;
+}
+
+/* Record an LZMS delta match.  */
+static forceinline void
+stats_add_delta_match(struct wimlib_compressor_stats *stats, u32 length)
+{
+	stats->num_matches++;
+	stats->num_delta_matches++;
+	stats->match_bytes += length;
+}
+
+#endif /* _WIMLIB_COMPRESSOR_STATS_H */
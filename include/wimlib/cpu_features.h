@@ -9,8 +9,57 @@
 #define X86_CPU_FEATURE_AVX		0x00000008
 #define X86_CPU_FEATURE_BMI2		0x00000010
 #define X86_CPU_FEATURE_SHA		0x00000020
+#define X86_CPU_FEATURE_AVX2		0x00000040
+#define X86_CPU_FEATURE_AVX512F		0x00000080
+#define X86_CPU_FEATURE_AVX512BW	0x00000100
 
 #define ARM_CPU_FEATURE_SHA1		0x00000001
+#define ARM_CPU_FEATURE_SVE		0x00000002
+#define ARM_CPU_FEATURE_SVE2		0x00000004
+
+/* A generic function pointer type; each kernel casts it to its own type.  */
+typedef void (*cpu_func_t)(void);
+
+/* One implementation of a kernel, usable if the CPU has all of @features.  */
+struct cpu_impl {
+	const char *name;
+	cpu_func_t func;
+	u32 features;
+};
+
+/*
+ * A function, or "kernel", that has implementations optimized for different
+ * CPU features.  @impls lists them in order of preference and ends with the
+ * portable implementation, whose @features is 0.  resolve_cpu_kernel() chooses
+ * one of them and passes it to @select, which installs it.
+ */
+struct cpu_kernel {
+	const char *name;
+	const struct cpu_impl *impls;
+	size_t num_impls;
+	void (*select)(const struct cpu_impl *impl);
+};
+
+const struct cpu_impl *
+resolve_cpu_kernel(const struct cpu_kernel *kernel);
+
+bool
+get_cpu_impl_override(const char *kernel_name,
+		      const char **impl_name_ret, size_t *impl_namelen_ret);
+
+/* The kernels, and init_cpu_dispatch() which resolves them all  */
+extern const struct cpu_kernel sha1_blocks_kernel;
+extern const struct cpu_kernel sha1_blocks_multi_kernel;
+extern const struct cpu_kernel lz_extend_kernel;
+extern const struct cpu_kernel lzx_parse_kernel;
+extern const struct cpu_kernel xpress_parse_kernel;
+extern const struct cpu_kernel lzx_decode_kernel;
+extern const struct cpu_kernel xpress_decode_kernel;
+extern const struct cpu_kernel lzms_x86_filter_kernel;
+extern const struct cpu_kernel zero_scan_kernel;
+
+void
+init_cpu_dispatch(void);
 
 #if (defined(__i386__) || defined(__x86_64__)) || \
     (defined(__aarch64__) && defined(__linux__)) || \
@@ -7,10 +7,12 @@
 #ifndef _WIMLIB_DECOMPRESSOR_OPS_H
 #define _WIMLIB_DECOMPRESSOR_OPS_H
 
-#include <stddef.h>
+#include "wimlib/types.h"
 
 struct decompressor_ops {
 
+	u64 (*get_needed_memory)(size_t max_block_size);
+
 	int (*create_decompressor)(size_t max_block_size, void **private_ret);
 
 	int (*decompress)(const void *compressed_data,
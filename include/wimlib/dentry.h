@@ -40,9 +40,15 @@ struct wim_dentry {
 	 * to all dentries in a hard link group.  */
 	struct wim_inode *d_inode;
 
-	/* Node for the parent's balanced binary search tree of child dentries
-	 * keyed by filename (root i_children).  */
-	struct avl_tree_node d_index_node;
+	union {
+		/* Node for the parent's balanced binary search tree of child
+		 * dentries keyed by filename (root i_children).  */
+		struct avl_tree_node d_index_node;
+
+		/* Index of this dentry in the parent's i_child_array, if the
+		 * parent's children are in an array instead  */
+		u32 d_child_index;
+	};
 
 	/* The parent of this directory entry. (The root is its own parent.)  */
 	struct wim_dentry *d_parent;
@@ -81,6 +87,17 @@ struct wim_dentry {
 	/* Used by wimlib_update_image()  */
 	u16 d_is_orphan : 1;
 
+	/* Set if this dentry, or its d_name and d_short_name, were allocated
+	 * from the image's arena by read_dentry_tree() rather than on the heap,
+	 * so must not be freed individually.  Names in the arena may be shared
+	 * with other dentries, so they must not be modified either.  */
+	u16 d_in_arena : 1;
+	u16 d_names_in_arena : 1;
+
+	/* Set if this dentry or any of its descendants may have d_full_path
+	 * set.  */
+	u16 d_paths_cached : 1;
+
 	union {
 		/* The subdir offset is only used while reading and writing this
 		 * dentry.  See the corresponding field in `struct
@@ -130,11 +147,117 @@ int
 for_dentry_in_tree(struct wim_dentry *root,
 		   int (*visitor)(struct wim_dentry *, void *), void *args);
 
+/* The child dentries of a directory inode that has i_children_in_array set,
+ * in collation order  */
+struct dentry_array {
+	u32 count;
+	struct wim_dentry *entries[];
+};
+
+#define child_entry(node) avl_tree_entry((node), struct wim_dentry, d_index_node)
+
+/* Get the first child dentry of the @dir directory inode in collation order,
+ * or NULL if it has no children.  */
+static inline struct wim_dentry *
+inode_first_child(const struct wim_inode *dir)
+{
+	const struct avl_tree_node *node;
+
+	if (dir->i_children_in_array)
+		return dir->i_child_array->entries[0];
+	node = avl_tree_first_in_order(dir->i_children);
+	return node ? child_entry(node) : NULL;
+}
+
+static inline struct wim_dentry *
+dentry_first_child(const struct wim_dentry *dentry)
+{
+	return inode_first_child(dentry->d_inode);
+}
+
+/* Get the next sibling of @dentry, which must not be the root, in collation
+ * order, or NULL if it's the last one.  */
+static inline struct wim_dentry *
+dentry_next_sibling(const struct wim_dentry *dentry)
+{
+	const struct wim_inode *dir = dentry->d_parent->d_inode;
+	const struct avl_tree_node *node;
+
+	if (dir->i_children_in_array) {
+		if (dentry->d_child_index + 1 >= dir->i_child_array->count)
+			return NULL;
+		return dir->i_child_array->entries[dentry->d_child_index + 1];
+	}
+	node = avl_tree_next_in_order(&dentry->d_index_node);
+	return node ? child_entry(node) : NULL;
+}
+
+/* Get the previous sibling of @dentry, which must not be the root, in
+ * collation order, or NULL if it's the first one.  */
+static inline struct wim_dentry *
+dentry_prev_sibling(const struct wim_dentry *dentry)
+{
+	const struct wim_inode *dir = dentry->d_parent->d_inode;
+	const struct avl_tree_node *node;
+
+	if (dir->i_children_in_array) {
+		if (dentry->d_child_index == 0)
+			return NULL;
+		return dir->i_child_array->entries[dentry->d_child_index - 1];
+	}
+	node = avl_tree_prev_in_order(&dentry->d_index_node);
+	return node ? child_entry(node) : NULL;
+}
+
+/* State for for_inode_child() and for_inode_child_postorder().  The next child
+ * is found before the loop body runs, so the body may unlink the current one.
+ */
+struct dentry_child_iter {
+	struct wim_dentry * const *pos;
+	struct wim_dentry * const *end;
+	struct avl_tree_node *node;
+};
+
+static inline struct dentry_child_iter
+dentry_child_iter_start(const struct wim_inode *dir, bool postorder)
+{
+	struct dentry_child_iter iter = { 0 };
+
+	if (dir->i_children_in_array) {
+		iter.pos = dir->i_child_array->entries;
+		iter.end = iter.pos + dir->i_child_array->count;
+	} else if (postorder) {
+		iter.node = avl_tree_first_in_postorder(dir->i_children);
+	} else {
+		iter.node = avl_tree_first_in_order(dir->i_children);
+	}
+	return iter;
+}
+
+static inline struct wim_dentry *
+dentry_child_iter_next(struct dentry_child_iter *iter, bool postorder)
+{
+	struct avl_tree_node *node = iter->node;
+
+	if (iter->pos != iter->end)
+		return *iter->pos++;
+	if (!node)
+		return NULL;
+	if (postorder) {
+		iter->node = avl_tree_next_in_postorder(node,
+							avl_get_parent(node));
+	} else {
+		iter->node = avl_tree_next_in_order(node);
+	}
+	return child_entry(node);
+}
+
 /* Iterate through each @child dentry of the @dir directory inode in
  * collation order.  */
 #define for_inode_child(child, dir)					\
-	avl_tree_for_each_in_order((child), (dir)->i_children,		\
-				   struct wim_dentry, d_index_node)
+	for (struct dentry_child_iter _iter =				\
+		dentry_child_iter_start((dir), false);			\
+	     ((child) = dentry_child_iter_next(&_iter, false)) != NULL; )
 
 /* Iterate through each @child dentry of the @parent dentry in
  * collation order.  */
@@ -144,8 +267,9 @@ for_dentry_in_tree(struct wim_dentry *root,
 /* Iterate through each @child dentry of the @dir directory inode in
  * postorder (safe for freeing the child dentries).  */
 #define for_inode_child_postorder(child, dir)				\
-	avl_tree_for_each_in_postorder((child), (dir)->i_children,	\
-				       struct wim_dentry, d_index_node)
+	for (struct dentry_child_iter _iter =				\
+		dentry_child_iter_start((dir), true);			\
+	     ((child) = dentry_child_iter_next(&_iter, true)) != NULL; )
 
 /* Iterate through each @child dentry of the @parent dentry in
  * postorder (safe for freeing the child dentries).  */
@@ -154,8 +278,7 @@ for_dentry_in_tree(struct wim_dentry *root,
 
 /* Get any child dentry of the @dir directory inode.  Requires
  * inode_has_children(@dir) == true.  */
-#define inode_any_child(dir)	\
-	avl_tree_entry((dir)->i_children, struct wim_dentry, d_index_node)
+#define inode_any_child(dir)	inode_first_child(dir)
 
 /* Get any child dentry of the @parent dentry.  Requires
  * dentry_has_children(@parent) == true.  */
@@ -186,6 +309,9 @@ int
 dentry_set_name_utf16le(struct wim_dentry *dentry, const utf16lechar *name,
 			size_t name_nbytes);
 
+int
+dentry_move_names_to_heap(struct wim_dentry *dentry);
+
 struct wim_dentry *
 get_dentry(WIMStruct *wim, const tchar *path, CASE_SENSITIVITY_TYPE case_type);
 
@@ -239,13 +365,24 @@ rename_wim_path(WIMStruct *wim, const tchar *from, const tchar *to,
 		CASE_SENSITIVITY_TYPE case_type, bool noreplace,
 		struct update_command_journal *j);
 
+struct mem_arena;
 
 int
 read_dentry_tree(const u8 *buf, size_t buf_len,
-		 u64 root_offset, struct wim_dentry **root_ret);
+		 u64 root_offset, struct mem_arena *arena,
+		 const tchar * const *paths, size_t num_paths,
+		 struct wim_dentry **root_ret);
+
+int
+read_dentry_subdir(const u8 *buf, size_t buf_len, struct mem_arena *arena,
+		   struct wim_dentry *dir);
+
+int
+scan_dentry_tree_hashes(const u8 *buf, size_t buf_len, u64 root_offset,
+			int (*visitor)(const u8 *hash, void *ctx), void *ctx);
 
 u8 *
-write_dentry_tree(struct wim_dentry *root, u8 *p);
+write_dentry(const struct wim_dentry * restrict dentry, u8 * restrict p);
 
 static inline bool
 dentry_is_root(const struct wim_dentry *dentry)
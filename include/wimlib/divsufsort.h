@@ -4,7 +4,7 @@
 #include "wimlib/types.h"
 
 void
-divsufsort(const u8 *T, u32 *SA, u32 n, u32 *tmp);
+divsufsort(const u8 *T, u32 *SA, u32 n, u32 *tmp, unsigned num_tasks);
 
 #define DIVSUFSORT_TMP_LEN (256 + (256 * 256))
 
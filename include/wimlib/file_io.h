@@ -5,13 +5,41 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+#include "wimlib/types.h"
+
+struct chunk_span;
+struct integrity_stream;
+struct pipe_buffer;
+struct unbuffered_io;
+struct wimlib_io_provider;
+
 /* Wrapper around a file descriptor that keeps track of offset (including in
  * pipes, which don't support lseek()) and a cached flag that tells whether the
- * file descriptor is a pipe or not.  */
+ * file descriptor is a pipe or not.  Optionally, the file can also be mapped
+ * into memory with filedes_map(), in which case reads of the mapped region are
+ * served from the mapping, and a pipe can be read ahead by a separate thread
+ * with filedes_start_pipe_buffer().  Also optionally, all data written to the
+ * file can be passed to an integrity stream (see integrity.c), and the data
+ * written can be flushed to disk as the write proceeds with
+ * filedes_start_write_behind().  Or, a regular file can be opened with
+ * filedes_open() for unbuffered I/O, in which case @unbuffered is set and all
+ * reads and writes go through it.
+ *
+ * Alternatively, a file which is only read can be provided by the library user
+ * through callbacks (see wimlib_open_wim_with_io()), in which case @io is set
+ * and @fd is -1.  Code which uses @fd directly must check for this.  */
 struct filedes {
 	int fd;
 	unsigned int is_pipe : 1;
 	off_t offset;
+	const u8 *map;
+	u64 map_size;
+	struct pipe_buffer *pipe_buffer;
+	struct wimlib_io_provider *io;
+	struct integrity_stream *integrity_stream;
+	unsigned int write_behind : 1;
+	u64 write_behind_offset;
+	struct unbuffered_io *unbuffered;
 };
 
 int
@@ -26,6 +54,38 @@ full_write(struct filedes *fd, const void *buf, size_t n);
 int
 full_pwrite(struct filedes *fd, const void *buf, size_t count, off_t offset);
 
+int
+full_pwritev(struct filedes *fd, const struct chunk_span *spans,
+	     size_t num_spans, off_t offset);
+
+/* The amount of data, in bytes, which sequential reads try to keep requested
+ * from the operating system ahead of the current read position.  */
+#define READ_AHEAD_SIZE		(16U << 20)
+
+void
+filedes_prefetch(struct filedes *fd, off_t offset, u64 size);
+
+/* State for keeping the data ahead of a sequential read of a region of a file
+ * requested from the operating system; see read_ahead_advance().  */
+struct read_ahead {
+	u64 next_offset;
+	u64 end_offset;
+};
+
+static inline void
+read_ahead_init(struct read_ahead *ra, u64 offset, u64 size)
+{
+	ra->next_offset = offset;
+	ra->end_offset = offset + size;
+
+	/* Leave small regions to the operating system's own read-ahead.  */
+	if (size < READ_AHEAD_SIZE / 16)
+		ra->next_offset = ra->end_offset;
+}
+
+void
+read_ahead_advance(struct filedes *fd, struct read_ahead *ra, u64 cur_offset);
+
 #ifndef _WIN32
 #  define O_BINARY 0
 #endif
@@ -36,24 +96,81 @@ filedes_seek(struct filedes *fd, off_t offset);
 bool
 filedes_is_seekable(struct filedes *fd);
 
+int
+filedes_map(struct filedes *fd, u64 size);
+
+void
+filedes_unmap(struct filedes *fd);
+
+void
+filedes_start_pipe_buffer(struct filedes *fd);
+
+void
+filedes_start_write_behind(struct filedes *fd);
+
+/* If the specified region of the file is mapped into memory, return a pointer
+ * to it; otherwise return NULL.  */
+static inline const void *
+filedes_mapped_data(const struct filedes *fd, u64 offset, u64 size)
+{
+	if (fd->map && offset <= fd->map_size && size <= fd->map_size - offset)
+		return fd->map + offset;
+	return NULL;
+}
+
 static inline void filedes_init(struct filedes *fd, int raw_fd)
 {
 	fd->fd = raw_fd;
 	fd->offset = 0;
 	fd->is_pipe = 0;
+	fd->map = NULL;
+	fd->map_size = 0;
+	fd->pipe_buffer = NULL;
+	fd->io = NULL;
+	fd->integrity_stream = NULL;
+	fd->write_behind = 0;
+	fd->write_behind_offset = 0;
+	fd->unbuffered = NULL;
 }
 
 static inline void filedes_invalidate(struct filedes *fd)
 {
 	fd->fd = -1;
+	fd->map = NULL;
+	fd->map_size = 0;
+	fd->pipe_buffer = NULL;
+	fd->io = NULL;
+	fd->integrity_stream = NULL;
+	fd->write_behind = 0;
+	fd->unbuffered = NULL;
 }
 
-#define filedes_close(f) close((f)->fd)
+int
+filedes_open(struct filedes *fd, const tchar *path, int open_flags,
+	     mode_t mode, bool unbuffered);
+
+int
+filedes_sync(struct filedes *fd);
+
+int
+filedes_truncate(struct filedes *fd, u64 size);
+
+void
+filedes_forget_cached_data(struct filedes *fd);
+
+int
+filedes_init_io(struct filedes *fd, const struct wimlib_io_provider *io);
+
+int
+filedes_close(struct filedes *fd);
+
+int
+create_temporary_file(struct filedes *fd_ret, tchar **name_ret);
 
 static inline bool
 filedes_valid(const struct filedes *fd)
 {
-	return fd->fd != -1;
+	return fd->fd != -1 || fd->io != NULL;
 }
 
 #endif /* _WIMLIB_FILE_IO_H */
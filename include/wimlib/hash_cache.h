@@ -0,0 +1,53 @@
+#ifndef _WIMLIB_HASH_CACHE_H
+#define _WIMLIB_HASH_CACHE_H
+
+#include "wimlib/types.h"
+
+struct hash_cache_entry;
+struct pending_hash;
+struct scan_params;
+struct wim_inode;
+
+/*
+ * The identity of a file on disk together with the attributes which change
+ * whenever its contents do.  Timestamps are WIM timestamps.
+ */
+struct hash_cache_key {
+	u64 dev;
+	u64 ino;
+	u64 size;
+	u64 last_write_time;
+	u64 change_time;
+};
+
+/*
+ * The SHA-1 message digests of the files captured earlier, as recorded in the
+ * file set with wimlib_set_capture_hash_cache() (see hash_cache.c).
+ */
+struct hash_cache {
+	/* Path to the cache file  */
+	tchar *path;
+
+	/* The entries of the cache file, sorted by file identity  */
+	struct hash_cache_entry *entries;
+	size_t num_entries;
+
+	/* Files scanned since the cache was last saved whose SHA-1 message
+	 * digests weren't in the cache, so will be known only once their data
+	 * has been written  */
+	struct pending_hash *pending;
+	size_t num_pending;
+	size_t pending_alloc;
+};
+
+int
+apply_capture_hash_cache(struct scan_params *params, struct wim_inode *inode,
+			 const struct hash_cache_key *key);
+
+void
+save_capture_hash_cache(WIMStruct *wim);
+
+void
+free_capture_hash_cache(struct hash_cache *cache);
+
+#endif /* _WIMLIB_HASH_CACHE_H */
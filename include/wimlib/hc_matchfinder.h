@@ -123,8 +123,14 @@
 
 #include "wimlib/matchfinder_common.h"
 
-#define HC_MATCHFINDER_HASH3_ORDER	15
-#define HC_MATCHFINDER_HASH4_ORDER	16
+/* The hash table sizes may be overridden by defining these before including
+ * this header, e.g. by a compressor that works with much larger buffers.  */
+#ifndef HC_MATCHFINDER_HASH3_ORDER
+#  define HC_MATCHFINDER_HASH3_ORDER	15
+#endif
+#ifndef HC_MATCHFINDER_HASH4_ORDER
+#  define HC_MATCHFINDER_HASH4_ORDER	16
+#endif
 
 /* TEMPLATED functions and structures have MF_SUFFIX appended to their name.  */
 #undef TEMPLATED
@@ -9,6 +9,7 @@
 struct avl_tree_node;
 struct blob_descriptor;
 struct blob_table;
+struct dentry_array;
 struct wim_dentry;
 struct wim_inode_extra;
 struct wim_security_data;
@@ -106,11 +107,17 @@ struct wim_inode {
 	/* Windows file attribute flags (FILE_ATTRIBUTE_*).  */
 	u32 i_attributes;
 
-	/* Root of a balanced binary search tree storing the child directory
-	 * entries of this inode, if any, indexed by filename.  If this inode is
-	 * not a directory or if it has no children then this will be an empty
-	 * tree (NULL).  */
-	struct avl_tree_node *i_children;
+	/* The child directory entries of this inode, if any, indexed by
+	 * filename.  If this inode is not a directory or if it has no children
+	 * then this will be NULL.  Otherwise this is normally the root of a
+	 * balanced binary search tree.  But for a directory read from a WIM
+	 * image, it's an array sorted in collation order (i_children_in_array
+	 * is set) until the directory is first modified, since that's cheaper
+	 * to build, search, and iterate through.  */
+	union {
+		struct avl_tree_node *i_children;
+		struct dentry_array *i_child_array;
+	};
 
 	/* List of dentries that are aliases for this inode.  There will be
 	 * i_nlink dentries in this list.  */
@@ -122,7 +129,7 @@ struct wim_inode {
 	struct hlist_node i_hlist_node;
 
 	/* Number of dentries that are aliases for this inode.  */
-	u32 i_nlink : 30;
+	u32 i_nlink : 27;
 
 	/* Flag used by some code to mark this inode as visited.  It will be 0
 	 * by default, and it always must be cleared after use.  */
@@ -131,6 +138,15 @@ struct wim_inode {
 	/* Cached value  */
 	u32 i_can_externally_back : 1;
 
+	/* Set if this inode, or its i_extra, were allocated from the image's
+	 * arena by read_dentry_tree() rather than on the heap, so must not be
+	 * freed individually.  */
+	u32 i_in_arena : 1;
+	u32 i_extra_in_arena : 1;
+
+	/* Set if the children are in i_child_array rather than i_children  */
+	u32 i_children_in_array : 1;
+
 	/* If not NULL, a pointer to the extra data that was read from the
 	 * dentry.  This should be a series of tagged items, each of which
 	 * represents a bit of extra metadata, such as the file's object ID.
@@ -267,6 +283,11 @@ struct wim_inode_extra {
 struct wim_inode *
 new_inode(struct wim_dentry *dentry, bool set_timestamps);
 
+struct mem_arena;
+
+struct wim_inode *
+new_inode_in_arena(struct wim_dentry *dentry, struct mem_arena *arena);
+
 /* Iterate through each alias of the specified inode.  */
 #define inode_for_each_dentry(dentry, inode) \
 	hlist_for_each_entry((dentry), &(inode)->i_alias_list, d_alias_node)
@@ -430,4 +451,27 @@ inode_unref_blobs(struct wim_inode *inode, struct blob_table *blob_table);
 int
 dentry_tree_fix_inodes(struct wim_dentry *root, struct hlist_head *inode_list);
 
+/* State for dentry_children_fix_inodes()  */
+struct lazy_inode_fixup {
+	/* Open-addressed hash table of the first inode read for each hard link
+	 * group, with 'mask + 1' slots (a power of 2), or NULL  */
+	struct lazy_inode_fixup_slot {
+		u64 ino;
+		struct wim_inode *inode;
+	} *slots;
+	size_t mask;
+	size_t count;
+
+	/* Number to give the next new inode  */
+	u64 next_ino;
+};
+
+void
+dentry_children_fix_inodes(struct wim_dentry *dir,
+			   struct lazy_inode_fixup *fixup,
+			   struct hlist_head *inode_list);
+
+void
+lazy_inode_fixup_destroy(struct lazy_inode_fixup *fixup);
+
 #endif /* _WIMLIB_INODE_H  */
@@ -39,6 +39,10 @@ inode_table_new_dentry(struct wim_inode_table *table, const tchar *name,
 void
 enlarge_inode_table(struct wim_inode_table *table);
 
+void
+inode_table_move_inodes(struct wim_inode_table *dst,
+			struct wim_inode_table *src);
+
 void
 inode_table_prepare_inode_list(struct wim_inode_table *table,
 			       struct hlist_head *head);
@@ -10,6 +10,7 @@
 #define WIM_INTEGRITY_NONEXISTENT -2
 
 struct integrity_table;
+struct integrity_stream;
 
 int
 read_integrity_table(WIMStruct *wim, u64 num_checked_bytes,
@@ -21,7 +22,24 @@ int
 write_integrity_table(WIMStruct *wim,
 		      off_t new_blob_table_end,
 		      off_t old_blob_table_end,
-		      struct integrity_table *old_table);
+		      struct integrity_table *old_table,
+		      const struct integrity_stream *stream);
+
+int
+new_integrity_stream(struct integrity_stream **stream_ret);
+
+void
+free_integrity_stream(struct integrity_stream *stream);
+
+void
+integrity_stream_write(struct integrity_stream *stream, const void *buf,
+		       size_t count, u64 offset);
+
+void
+integrity_stream_rewind(struct integrity_stream *stream, u64 offset);
+
+void
+integrity_stream_finish(struct integrity_stream *stream, u64 end);
 
 int
 check_wim_integrity(WIMStruct *wim);
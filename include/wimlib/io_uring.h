@@ -0,0 +1,64 @@
+/*
+ * io_uring.h
+ *
+ * A minimal interface to Linux's io_uring, used to issue batches of system
+ * calls with a single call into the kernel.
+ */
+
+#ifndef _WIMLIB_IO_URING_H
+#define _WIMLIB_IO_URING_H
+
+#include "wimlib/types.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_STATX) && \
+	defined(HAVE_SYS_SYSCALL_H)
+#  define WITH_IO_URING 1
+#endif
+
+struct io_ring;
+struct statx;
+
+/* Operations which a ring can be required to support; see io_ring_create()  */
+#define IO_RING_OP_STATX	0x1
+#define IO_RING_OP_CLOSE	0x2
+
+/* Called for each completed operation with the value the corresponding system
+ * call would have returned, or the negated errno value if it failed.  */
+typedef void (*io_ring_complete_t)(void *ctx, u64 user_data, int res);
+
+#ifdef WITH_IO_URING
+
+struct io_ring *
+io_ring_create(unsigned entries, int required_ops);
+
+void
+io_ring_destroy(struct io_ring *ring);
+
+void
+io_ring_prep_statx(struct io_ring *ring, int dirfd, const char *path,
+		   int flags, struct statx *buf, u64 user_data);
+
+void
+io_ring_prep_close(struct io_ring *ring, int fd, u64 user_data);
+
+int
+io_ring_run(struct io_ring *ring, io_ring_complete_t complete, void *ctx);
+
+#else /* WITH_IO_URING */
+
+/* Without io_uring, there is never a ring, so callers always fall back to
+ * making the system calls themselves.  */
+static inline struct io_ring *
+io_ring_create(unsigned entries, int required_ops)
+{
+	return NULL;
+}
+
+static inline void
+io_ring_destroy(struct io_ring *ring)
+{
+}
+
+#endif /* !WITH_IO_URING */
+
+#endif /* _WIMLIB_IO_URING_H */
@@ -31,7 +31,7 @@
 #ifndef _LCPIT_MATCHFINDER_H
 #define _LCPIT_MATCHFINDER_H
 
-#include "wimlib/types.h"
+#include "wimlib/matchfinder_common.h"
 
 struct lcpit_matchfinder {
 	bool huge_mode;
@@ -45,11 +45,7 @@ struct lcpit_matchfinder {
 	u32 nice_match_len;
 	u32 next[2];
 	u32 orig_nice_match_len;
-};
-
-struct lz_match {
-	u32 length;
-	u32 offset;
+	bool parallel;
 };
 
 u64
@@ -57,7 +53,7 @@ lcpit_matchfinder_get_needed_memory(size_t max_bufsize);
 
 bool
 lcpit_matchfinder_init(struct lcpit_matchfinder *mf, size_t max_bufsize,
-		       u32 min_match_len, u32 nice_match_len);
+		       u32 min_match_len, u32 nice_match_len, bool parallel);
 
 void
 lcpit_matchfinder_load_buffer(struct lcpit_matchfinder *mf, const u8 *T, u32 n);
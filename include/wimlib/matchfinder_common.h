@@ -31,6 +31,17 @@
 #include "wimlib/bitops.h"
 #include "wimlib/unaligned.h"
 
+/* Representation of a match found by the bt_matchfinder or the
+ * lcpit_matchfinder  */
+struct lz_match {
+
+	/* The number of bytes matched.  */
+	u32 length;
+
+	/* The offset back from the current position that was matched.  */
+	u32 offset;
+};
+
 /*
  * Given a 32-bit value that was loaded with the platform's native endianness,
  * return a 32-bit value whose high-order 8 bits are 0 and whose low-order 24
@@ -77,9 +88,24 @@ lz_hash(u32 seq, unsigned num_bits)
 	return (u32)(seq * 0x1E35A7BD) >> (32 - num_bits);
 }
 
+#if defined(__i386__) || defined(__x86_64__)
+/*
+ * The vectorized part of lz_extend() for long matches, or NULL if the CPU has
+ * no suitable vector instructions.  It is selected by the "lz_extend" kernel.
+ */
+#define HAVE_LZ_EXTEND_WIDE
+typedef unsigned (*lz_extend_wide_func_t)(const u8 *strptr,
+					  const u8 *matchptr,
+					  unsigned len, unsigned max_len);
+extern lz_extend_wide_func_t lz_extend_wide;
+#endif
+
 /*
  * Return the number of bytes at @matchptr that match the bytes at @strptr, up
  * to a maximum of @max_len.  Initially, @start_len bytes are matched.
+ *
+ * Most matches end within the first few words, which are compared inline.
+ * Longer matches are extended with vector instructions when available.
  */
 static forceinline unsigned
 lz_extend(const u8 * const strptr, const u8 * const matchptr,
@@ -104,6 +130,11 @@ lz_extend(const u8 * const strptr, const u8 * const matchptr,
 			COMPARE_WORD_STEP
 			COMPARE_WORD_STEP
 		#undef COMPARE_WORD_STEP
+		#ifdef HAVE_LZ_EXTEND_WIDE
+			if (lz_extend_wide != NULL && max_len - len >= 32)
+				return (*lz_extend_wide)(strptr, matchptr,
+							 len, max_len);
+		#endif
 		}
 
 		while (len + WORDBYTES <= max_len) {
@@ -0,0 +1,39 @@
+/*
+ * message_queue.h
+ *
+ * A simple blocking queue for passing messages between threads.
+ */
+
+#ifndef _WIMLIB_MESSAGE_QUEUE_H
+#define _WIMLIB_MESSAGE_QUEUE_H
+
+#include "wimlib/list.h"
+#include "wimlib/threads.h"
+
+/* A queue of messages, each of which is linked into the queue through a
+ * 'struct list_head' embedded in it.  Any number of threads may put messages
+ * into the queue and get messages from it.  */
+struct message_queue {
+	struct list_head list;
+	struct mutex lock;
+	struct condvar msg_avail_cond;
+	struct condvar space_avail_cond;
+	bool terminating;
+};
+
+int
+message_queue_init(struct message_queue *q);
+
+void
+message_queue_destroy(struct message_queue *q);
+
+void
+message_queue_put(struct message_queue *q, struct list_head *msg_node);
+
+struct list_head *
+message_queue_get(struct message_queue *q);
+
+void
+message_queue_terminate(struct message_queue *q);
+
+#endif /* _WIMLIB_MESSAGE_QUEUE_H */
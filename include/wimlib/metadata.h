@@ -1,6 +1,7 @@
 #ifndef _WIMLIB_METADATA_H
 #define _WIMLIB_METADATA_H
 
+#include "wimlib/arena.h"
 #include "wimlib/blob_table.h"
 #include "wimlib/list.h"
 #include "wimlib/types.h"
@@ -28,7 +29,8 @@ struct wim_image_metadata {
 	u32 refcnt;
 
 	/* Number of WIMStructs that have this image selected as their
-	 * current_image.  This will always be <= 'refcnt' and may be 0.  */
+	 * current_image, plus the number of holds on it taken with
+	 * hold_wim_image().  This may be 0.  */
 	u32 selected_refcnt;
 
 	/* Pointer to the root dentry of this image, or NULL if this image is
@@ -51,6 +53,11 @@ struct wim_image_metadata {
 	 * if this image is completely empty or is not currently loaded.  */
 	struct hlist_head inode_list;
 
+	/* Arena from which the dentries and inodes read from the metadata
+	 * resource were allocated.  It is destroyed when the image is
+	 * unloaded, after the dentry tree has been freed.  */
+	struct mem_arena arena;
+
 	/* Linked list of 'struct blob_descriptor's for blobs that are
 	 * referenced by this image's dentry tree, but have not had their SHA-1
 	 * message digests calculated yet and therefore have not been inserted
@@ -61,6 +68,16 @@ struct wim_image_metadata {
 	/* Are the filecount/bytecount stats (in the XML info) out of date for
 	 * this image?  */
 	bool stats_outdated;
+
+	/* If this image was loaded from a metadata resource and has been
+	 * changed since, then the WIMStruct containing that resource (of which
+	 * a reference is held), and the resource's header and SHA-1 message
+	 * digest.  Otherwise NULL.  This lets an append to that WIM file reuse
+	 * the resource if the image still serializes to exactly the same
+	 * bytes.  */
+	WIMStruct *orig_metadata_wim;
+	struct wim_reshdr orig_metadata_reshdr;
+	u8 orig_metadata_hash[SHA1_HASH_SIZE];
 };
 
 /* Retrieve the metadata of the image in @wim currently selected with
@@ -105,16 +122,6 @@ is_image_unchanged_from_wim(const struct wim_image_metadata *imd,
 	return !is_image_dirty(imd) && imd->metadata_blob->rdesc->wim == wim;
 }
 
-/* Mark the metadata for the specified WIM image "dirty" following changes to
- * the image's directory tree.  This records that the metadata no longer matches
- * the version in the WIM file (if any) and that its stats are out of date.  */
-static inline void
-mark_image_dirty(struct wim_image_metadata *imd)
-{
-	blob_release_location(imd->metadata_blob);
-	imd->stats_outdated = true;
-}
-
 /* Return true iff the specified image is currently loaded into memory.  */
 static inline bool
 is_image_loaded(const struct wim_image_metadata *imd)
@@ -150,6 +157,9 @@ can_unload_image(const struct wim_image_metadata *imd)
 #define image_for_each_unhashed_blob_safe(blob, tmp, imd) \
 	list_for_each_entry_safe(blob, tmp, &(imd)->unhashed_blobs, unhashed_list)
 
+void
+mark_image_dirty(struct wim_image_metadata *imd);
+
 void
 put_image_metadata(struct wim_image_metadata *imd);
 
@@ -0,0 +1,46 @@
+/*
+ * open_wim_cache.h
+ *
+ * A library-wide cache of the uncompressed metadata of opened WIM files.
+ */
+
+#ifndef _WIMLIB_OPEN_WIM_CACHE_H
+#define _WIMLIB_OPEN_WIM_CACHE_H
+
+#include <sys/stat.h>
+
+#include "wimlib/guid.h"
+#include "wimlib/types.h"
+
+/*
+ * The identity of the state of a WIM file: the file itself, the attributes
+ * which change whenever it is written to, and the GUID from its header.  Data
+ * is only shared between WIMStructs whose files have the same identity.
+ */
+struct open_wim_id {
+	u64 dev;
+	u64 ino;
+	u64 size;
+	u64 mtime;
+	u8 guid[GUID_SIZE];
+
+	/* false if the file can't be identified, e.g. because it is a pipe, or
+	 * if this WIMStruct has changed the file  */
+	bool valid;
+};
+
+void
+open_wim_cache_set_id(WIMStruct *wim, const struct stat *stbuf);
+
+bool
+open_wim_cache_lookup(const WIMStruct *wim, u64 offset_in_wim, u64 size_in_wim,
+		      u64 uncompressed_size, void **buf_ret);
+
+void
+open_wim_cache_insert(const WIMStruct *wim, u64 offset_in_wim, u64 size_in_wim,
+		      u64 uncompressed_size, const void *buf);
+
+void
+open_wim_cache_cleanup(void);
+
+#endif /* _WIMLIB_OPEN_WIM_CACHE_H */
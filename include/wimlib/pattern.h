@@ -3,6 +3,7 @@
 
 #include "wimlib/types.h"
 
+struct string_list;
 struct wim_dentry;
 
 /* Flags for match_path() and match_pattern_list() */
@@ -22,6 +23,34 @@ struct wim_dentry;
 bool
 match_path(const tchar *path, const tchar *pattern, int match_flags);
 
+/*
+ * A list of path patterns which have been grouped so that a path can be matched
+ * against them without trying every pattern.  Patterns which can only match
+ * paths with a particular first component (if they start with a path separator)
+ * or filename (otherwise) are put in buckets by the hash of that name: those in
+ * bucket 'i' are patterns[bucket_start[i]] through
+ * patterns[bucket_start[i + 1] - 1].  The remaining patterns, which contain
+ * wildcards where it matters, come after the last bucket and are tried for every
+ * path.
+ */
+struct pattern_index {
+	const tchar **patterns;
+	size_t *bucket_start;
+	size_t num_buckets;
+	size_t num_patterns;
+};
+
+int
+build_pattern_index(const struct string_list *list,
+		    struct pattern_index *index);
+
+void
+free_pattern_index(struct pattern_index *index);
+
+bool
+match_pattern_index(const tchar *path, const struct pattern_index *index,
+		    int match_flags);
+
 int
 expand_path_pattern(struct wim_dentry *root, const tchar *pattern,
 		    int (*consume_dentry)(struct wim_dentry *, void *),
@@ -0,0 +1,64 @@
+/*
+ * perf_counters.h
+ *
+ * Optional counters of the time spent in, and the amount of data processed by,
+ * each stage of the library's work.
+ */
+
+#ifndef _WIMLIB_PERF_COUNTERS_H
+#define _WIMLIB_PERF_COUNTERS_H
+
+#include "wimlib/compiler.h"
+#include "wimlib/types.h"
+
+enum perf_stage {
+	PERF_READ,
+	PERF_WRITE,
+	PERF_FSYNC,
+	PERF_HASH,
+	PERF_COMPRESS,
+	PERF_DECOMPRESS,
+	PERF_METADATA_READ,
+	PERF_METADATA_WRITE,
+	PERF_COMPRESS_WAIT,
+	NUM_PERF_STAGES,
+};
+
+struct perf_counter {
+	u64 ns;
+	u64 bytes;
+	u64 count;
+};
+
+extern bool perf_counters_enabled;
+extern struct perf_counter perf_counters[NUM_PERF_STAGES];
+
+u64
+perf_now(void);
+
+/*
+ * Call perf_start() before doing the work of a stage and perf_end() after, with
+ * the value perf_start() returned.  When the counters are disabled this costs
+ * just a test of a global variable.
+ */
+static forceinline u64
+perf_start(void)
+{
+	if (likely(!__atomic_load_n(&perf_counters_enabled, __ATOMIC_RELAXED)))
+		return 0;
+	return perf_now();
+}
+
+static forceinline void
+perf_end(enum perf_stage stage, u64 start, u64 bytes)
+{
+	struct perf_counter *c = &perf_counters[stage];
+
+	if (likely(start == 0))
+		return;
+	__atomic_fetch_add(&c->ns, perf_now() - start, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->count, 1, __ATOMIC_RELAXED);
+}
+
+#endif /* _WIMLIB_PERF_COUNTERS_H */
@@ -3,6 +3,7 @@
 
 #include "wimlib.h"
 #include "wimlib/paths.h"
+#include "wimlib/perf_counters.h"
 #include "wimlib/types.h"
 
 /* If specified, call the user-provided progress function and check its result.
@@ -56,6 +57,42 @@ set_next_progress(u64 completed_bytes, u64 total_bytes, u64 *next_progress_p)
 	}
 }
 
+/* Time-based rate-limiting of progress messages, as configured by
+ * wimlib_set_progress_interval()  */
+struct progress_throttle {
+	u64 interval_ns;	/* 0 if disabled */
+	u64 next_time;
+};
+
+static inline void
+progress_throttle_init(struct progress_throttle *throttle, u32 interval_ms)
+{
+	throttle->interval_ns = (u64)interval_ms * 1000000;
+	throttle->next_time = interval_ms ? perf_now() + throttle->interval_ns : 0;
+}
+
+static inline bool
+progress_throttle_enabled(const struct progress_throttle *throttle)
+{
+	return throttle->interval_ns != 0;
+}
+
+/* Return true if a progress message may be sent now.  @final means that the
+ * message reports the end of the work, so it must always be sent.  */
+static inline bool
+progress_throttle_due(struct progress_throttle *throttle, bool final)
+{
+	u64 now;
+
+	if (!throttle->interval_ns)
+		return true;
+	now = perf_now();
+	if (now < throttle->next_time && !final)
+		return false;
+	throttle->next_time = now + throttle->interval_ns;
+	return true;
+}
+
 /* Windows: temporarily remove the stream name from the path  */
 static inline tchar *
 progress_get_streamless_path(const tchar *path)
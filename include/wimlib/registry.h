@@ -16,19 +16,27 @@ enum hive_status {
 	HIVE_ITERATION_STOPPED,
 };
 
+/* Read @size bytes at @offset of a hive file into @buf.  Returns 0 or a wimlib
+ * error code.  */
+typedef int (*hive_read_t)(void *ctx, u64 offset, size_t size, void *buf);
+
 enum hive_status
-hive_validate(const void *hive_mem, size_t hive_size);
+hive_open(hive_read_t read, void *read_ctx, u64 hive_size,
+	  struct regf **regf_ret);
+
+void
+hive_close(struct regf *regf);
 
 enum hive_status
-hive_get_string(const struct regf *regf, const tchar *key_name,
+hive_get_string(struct regf *regf, const tchar *key_name,
 		const tchar *value_name, tchar **value_ret);
 
 enum hive_status
-hive_get_number(const struct regf *regf, const tchar *key_name,
+hive_get_number(struct regf *regf, const tchar *key_name,
 		const tchar *value_name, s64 *value_ret);
 
 enum hive_status
-hive_list_subkeys(const struct regf *regf, const tchar *key_name,
+hive_list_subkeys(struct regf *regf, const tchar *key_name,
 		  tchar ***subkeys_ret);
 
 void
@@ -55,8 +55,18 @@ struct wim_resource_descriptor {
 	/* Compression chunk size of this resource.  Irrelevant if the resource
 	 * is uncompressed.  */
 	u32 chunk_size;
+
+	/* If this resource is compressed and a part of it has been read, the
+	 * offsets of its chunks from the start of the chunk data, followed by
+	 * the offset of the end of the last chunk; otherwise NULL.  See
+	 * get_cached_chunk_offsets().  */
+	u64 *chunk_offsets;
 };
 
+/* Limit on the memory each WIMStruct uses for the chunk offsets cached in the
+ * descriptors of its resources  */
+#define MAX_CACHED_CHUNK_OFFSETS_SIZE	(64U << 20)
+
 /* On-disk version of a WIM resource header.  */
 struct wim_reshdr_disk {
 	/* Size of the resource as it appears in the WIM file (possibly
@@ -171,13 +181,41 @@ get_chunk_entry_size(u64 res_size, bool is_alt)
 
 /* Functions to read blobs  */
 
+bool
+can_read_partial_wim_blob_concurrently(const struct blob_descriptor *blob);
+
+void
+free_cached_chunk_offsets(struct wim_resource_descriptor *rdesc);
+
 int
 read_partial_wim_blob_into_buf(const struct blob_descriptor *blob,
 			       u64 offset, size_t size, void *buf);
 
+int
+prefetch_partial_wim_blob(const struct blob_descriptor *blob,
+			  u64 offset, u64 size);
+
+#ifdef WITH_FUSE
+int
+read_partial_staging_blob(const struct blob_descriptor *blob,
+			  struct filedes *fd, u64 offset, size_t size,
+			  void *buf);
+#endif
+
 int
 read_blob_into_buf(const struct blob_descriptor *blob, void *buf);
 
+int
+read_blob_prefix_into_buf(const struct blob_descriptor *blob, u64 size,
+			  void *buf);
+
+bool
+can_read_partial_blob(const struct blob_descriptor *blob);
+
+int
+read_partial_blob_into_buf(const struct blob_descriptor *blob,
+			   u64 offset, size_t size, void *buf);
+
 int
 read_blob_into_alloc_buf(const struct blob_descriptor *blob, void **buf_ret);
 
@@ -190,7 +228,14 @@ wim_reshdr_to_hash(const struct wim_reshdr *reshdr, WIMStruct *wim,
 		   u8 hash[SHA1_HASH_SIZE]);
 
 int
-skip_wim_resource(const struct wim_resource_descriptor *rdesc);
+skip_wim_resource(struct wim_resource_descriptor *rdesc);
+
+/* A span of data which is passed, along with the spans that follow it in the
+ * data, in one call to a vectored chunk callback.  'size' is nonzero.  */
+struct chunk_span {
+	const void *data;
+	size_t size;
+};
 
 /*
  * Callback function for reading chunks.  Called whenever the next chunk of
@@ -200,6 +245,16 @@ skip_wim_resource(const struct wim_resource_descriptor *rdesc);
  */
 struct consume_chunk_callback {
 	int (*func)(const void *chunk, size_t size, void *ctx);
+
+	/* Optional; like 'func', but passes several consecutive chunks at once.
+	 * Readers which have more than one chunk ready use this if present.  */
+	int (*func_vec)(const struct chunk_span *spans, size_t num_spans,
+			void *ctx);
+
+	/* Optional; like read_blob_callbacks.get_chunk_dest(), but for the next
+	 * chunk passed to 'func'.  */
+	int (*get_dest)(void **buf_ret, size_t *size_ret, void *ctx);
+
 	void *ctx;
 };
 
@@ -211,6 +266,35 @@ consume_chunk(const struct consume_chunk_callback *cb,
 	return (*cb->func)(chunk, size, cb->ctx);
 }
 
+/* Pass several consecutive chunks of data to the specified consume_chunk
+ * callback, using its vectored variant if it has one.  */
+static inline int
+consume_chunks(const struct consume_chunk_callback *cb,
+	       const struct chunk_span *spans, size_t num_spans)
+{
+	if (cb->func_vec)
+		return (*cb->func_vec)(spans, num_spans, cb->ctx);
+	for (size_t i = 0; i < num_spans; i++) {
+		int ret = consume_chunk(cb, spans[i].data, spans[i].size);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Get the buffer, if any, into which the next chunk of data for the specified
+ * consume_chunk callback should be placed; see struct read_blob_callbacks
+ * below.  */
+static inline int
+get_consume_chunk_dest(const struct consume_chunk_callback *cb,
+		       void **buf_ret, size_t *size_ret)
+{
+	*buf_ret = NULL;
+	if (!cb->get_dest)
+		return 0;
+	return (*cb->get_dest)(buf_ret, size_ret, cb->ctx);
+}
+
 /* Callback functions for reading blobs  */
 struct read_blob_callbacks {
 
@@ -227,6 +311,16 @@ struct read_blob_callbacks {
 	int (*continue_blob)(const struct blob_descriptor *blob, u64 offset,
 			     const void *chunk, size_t size, void *ctx);
 
+	/* Optional.  Like continue_blob(), but passes several consecutive
+	 * chunks of the blob's data at once, the first of which begins at
+	 * 'offset'.  This is used instead of continue_blob(), if present, when
+	 * the reader has more than one chunk ready, so that the consumer can
+	 * process them as a batch, e.g. with a single vectored write.
+	 * 'num_spans' is guaranteed to be nonzero.  */
+	int (*continue_blob_vec)(const struct blob_descriptor *blob, u64 offset,
+				 const struct chunk_span *spans,
+				 size_t num_spans, void *ctx);
+
 	/* Called when a blob has been successfully read (status=0), or when
 	 * begin_blob() was successfully called but an error occurred before the
 	 * blob was fully read (status != 0; in this case the implementation
@@ -234,6 +328,19 @@ struct read_blob_callbacks {
 	 * success, or a positive wimlib error code on failure.  */
 	int (*end_blob)(struct blob_descriptor *blob, int status, void *ctx);
 
+	/* Optional.  Called when the reader could place the next chunk of
+	 * data, beginning at 'offset' in the blob, directly into a buffer of
+	 * the consumer's choosing rather than into one of its own, which
+	 * continue_blob() would then have to copy from.  On input, '*size_ret'
+	 * is the size of the chunk the reader wants to place; on output, it's
+	 * the size of the buffer returned in '*buf_ret', at most the input
+	 * size.  If '*buf_ret' is left NULL, there is no such buffer.  After
+	 * filling the buffer, the reader passes it to continue_blob() as
+	 * usual.  Must return 0 on success, or a positive wimlib error code on
+	 * failure.  */
+	int (*get_chunk_dest)(const struct blob_descriptor *blob, u64 offset,
+			      void **buf_ret, size_t *size_ret, void *ctx);
+
 	/* Parameter passed to each of the callback functions.  */
 	void *ctx;
 };
@@ -259,6 +366,39 @@ call_continue_blob(const struct blob_descriptor *blob, u64 offset,
 	return (*cbs->continue_blob)(blob, offset, chunk, size, cbs->ctx);
 }
 
+/* Call cbs->continue_blob_vec() if present, or else call cbs->continue_blob()
+ * (if present) on each of the chunks in turn.  */
+static inline int
+call_continue_blob_vec(const struct blob_descriptor *blob, u64 offset,
+		       const struct chunk_span *spans, size_t num_spans,
+		       const struct read_blob_callbacks *cbs)
+{
+	if (cbs->continue_blob_vec)
+		return (*cbs->continue_blob_vec)(blob, offset, spans,
+						 num_spans, cbs->ctx);
+	for (size_t i = 0; i < num_spans; i++) {
+		int ret = call_continue_blob(blob, offset, spans[i].data,
+					     spans[i].size, cbs);
+		if (ret)
+			return ret;
+		offset += spans[i].size;
+	}
+	return 0;
+}
+
+/* Call cbs->get_chunk_dest() if present.  */
+static inline int
+call_get_chunk_dest(const struct blob_descriptor *blob, u64 offset,
+		    void **buf_ret, size_t *size_ret,
+		    const struct read_blob_callbacks *cbs)
+{
+	*buf_ret = NULL;
+	if (!cbs->get_chunk_dest)
+		return 0;
+	return (*cbs->get_chunk_dest)(blob, offset, buf_ret, size_ret,
+				      cbs->ctx);
+}
+
 /* Call cbs->end_blob() if present.  */
 static inline int
 call_end_blob(struct blob_descriptor *blob, int status,
@@ -277,7 +417,8 @@ call_end_blob(struct blob_descriptor *blob, int status,
 
 int
 read_blob_list(struct list_head *blob_list, size_t list_head_offset,
-	       const struct read_blob_callbacks *cbs, int flags);
+	       const struct read_blob_callbacks *cbs, int flags,
+	       unsigned num_reader_threads);
 
 int
 read_blob_with_cbs(struct blob_descriptor *blob,
@@ -287,6 +428,32 @@ int
 read_blob_with_sha1(struct blob_descriptor *blob,
 		    const struct read_blob_callbacks *cbs, bool recover_data);
 
+int
+report_sha1_mismatch(struct blob_descriptor *blob,
+		     const u8 actual_hash[SHA1_HASH_SIZE], bool recover_data);
+
+/* Hashing of data on a task pool worker, overlapped with reading it  */
+
+struct hash_pipeline;
+
+struct hash_pipeline *
+new_hash_pipeline(struct sha1_ctx *sha_ctx);
+
+void
+free_hash_pipeline(struct hash_pipeline *p);
+
+int
+hash_pipeline_update(struct hash_pipeline *p, const void *data, size_t size);
+
+void
+hash_pipeline_flush(struct hash_pipeline *p);
+
+void
+hash_pipeline_wait(struct hash_pipeline *p);
+
+void
+hash_pipeline_finish(struct hash_pipeline *p);
+
 int
 extract_blob_prefix_to_fd(struct blob_descriptor *blob, u64 size,
 			  struct filedes *fd);
@@ -303,10 +470,27 @@ sha1_blob(struct blob_descriptor *blob);
 /* Functions to read/write metadata resources.  */
 
 int
-read_metadata_resource(struct wim_image_metadata *imd);
+read_metadata_resource(struct wim_image_metadata *imd,
+		       const tchar * const *paths, size_t num_paths);
+
+int
+read_metadata_resource_lazily(struct wim_image_metadata *imd, void **buf_ret);
+
+int
+read_metadata_resources(struct wim_image_metadata **imds, size_t num_imds);
+
+int
+scan_metadata_resource_hashes(const struct blob_descriptor *metadata_blob,
+			      int (*visitor)(const u8 *hash, void *ctx),
+			      void *ctx);
+
+int
+write_metadata_resource(WIMStruct *wim, int image, int write_resource_flags,
+			unsigned num_threads, bool appending);
 
 int
-write_metadata_resource(WIMStruct *wim, int image, int write_resource_flags);
+read_generated_metadata(const struct wim_image_metadata *imd, u64 size,
+			const struct consume_chunk_callback *cb);
 
 /* Definitions specific to pipable WIM resources.  */
 
@@ -0,0 +1,63 @@
+/*
+ * ring_buffer.h
+ *
+ * A bounded lock-free queue of pointers for passing work between threads.
+ */
+
+#ifndef _WIMLIB_RING_BUFFER_H
+#define _WIMLIB_RING_BUFFER_H
+
+#include "wimlib/threads.h"
+#include "wimlib/types.h"
+
+#define RING_BUFFER_CACHELINE_SIZE 64
+
+struct ring_slot {
+	size_t seq;
+	void *item;
+};
+
+/*
+ * A fixed-capacity queue of non-NULL pointers.  Any number of threads may put
+ * items into the queue and get items from it at the same time.  Putting and
+ * getting items never takes a lock; a thread only sleeps, using an event count,
+ * when it has to wait for the queue to become nonempty (or nonfull).
+ *
+ * The head and tail positions are kept in separate cache lines so that
+ * producers and consumers don't contend with each other.
+ */
+struct ring_buffer {
+	struct ring_slot *slots;
+	size_t mask;
+	struct event_count not_empty;
+	struct event_count not_full;
+
+	u8 _pad1[RING_BUFFER_CACHELINE_SIZE];
+	size_t head;	/* next position to get an item from */
+	u8 _pad2[RING_BUFFER_CACHELINE_SIZE - sizeof(size_t)];
+	size_t tail;	/* next position to put an item into */
+	u8 _pad3[RING_BUFFER_CACHELINE_SIZE - sizeof(size_t)];
+};
+
+int
+ring_buffer_init(struct ring_buffer *rb, size_t capacity);
+
+void
+ring_buffer_destroy(struct ring_buffer *rb);
+
+bool
+ring_buffer_try_put(struct ring_buffer *rb, void *item);
+
+void *
+ring_buffer_try_get(struct ring_buffer *rb);
+
+void
+ring_buffer_put(struct ring_buffer *rb, void *item);
+
+void *
+ring_buffer_get(struct ring_buffer *rb);
+
+bool
+ring_buffer_empty(const struct ring_buffer *rb);
+
+#endif /* _WIMLIB_RING_BUFFER_H */
@@ -4,12 +4,16 @@
 #include "wimlib.h"
 #include "wimlib/inode_table.h"
 #include "wimlib/list.h"
+#include "wimlib/pattern.h"
 #include "wimlib/progress.h"
 #include "wimlib/security.h"
 #include "wimlib/textfile.h"
 #include "wimlib/util.h"
 
 struct blob_table;
+struct hash_cache;
+struct io_ring;
+struct scan_hasher;
 struct wim_dentry;
 struct wim_inode;
 
@@ -21,9 +25,41 @@ struct capture_config {
 	/* List of path patterns to include, overriding exclusion_pats  */
 	struct string_list exclusion_exception_pats;
 
+	/* List of path patterns whose data is to be stored uncompressed  */
+	struct string_list compression_exclusion_pats;
+
+	/* The above lists, indexed for matching each scanned path  */
+	struct pattern_index exclusion_index;
+	struct pattern_index exclusion_exception_index;
+	struct pattern_index compression_exclusion_index;
+
 	void *buf;
 };
 
+/* The image with which scanned files are compared, if one was set with
+ * wimlib_set_capture_template(); see template.c.  */
+struct capture_template {
+
+	/* The template image, held loaded during the scan  */
+	struct wim_image_metadata *imd;
+
+	/* The blob table of the WIM containing the template image  */
+	struct blob_table *blob_table;
+
+	/* The dentry in the template image at the path at which the scanned
+	 * tree is being added, or NULL if there is none  */
+	struct wim_dentry *root;
+
+	/* The directory in the template image which was looked up last, or
+	 * NULL if it doesn't exist, and its path relative to @root.  Files are
+	 * mostly scanned directory by directory, so this is usually the parent
+	 * of the next file.  */
+	struct wim_dentry *dir;
+	tchar *dir_path;
+	size_t dir_path_nchars;
+	size_t dir_path_alloc_nchars;
+};
+
 /* Scan parameters: common parameters to implementations of building an
  * in-memory dentry tree from an external directory structure.  */
 struct scan_params {
@@ -47,6 +83,15 @@ struct scan_params {
 	/* The capture configuration in effect, or NULL if none.  */
 	struct capture_config *config;
 
+	/* The template image in effect, or NULL if none.  */
+	struct capture_template *template;
+
+	/* The hash cache in effect, or NULL if none.  */
+	struct hash_cache *hash_cache;
+
+	/* The background hashing of the scanned files, or NULL if none.  */
+	struct scan_hasher *hasher;
+
 	/* Flags that affect the scan operation (WIMLIB_ADD_FLAG_*) */
 	int add_flags;
 
@@ -57,6 +102,10 @@ struct scan_params {
 	/* Progress data.  */
 	union wimlib_progress_info progress;
 
+	/* Limits how often WIMLIB_PROGRESS_MSG_SCAN_PROGRESS is sent; if not
+	 * enabled, that message isn't sent at all.  */
+	struct progress_throttle progress_throttle;
+
 	/* Path to the file or directory currently being scanned */
 	tchar *cur_path;
 	size_t cur_path_nchars;
@@ -69,13 +118,14 @@ struct scan_params {
 	/* Can be used by the scan implementation.  */
 	u64 capture_root_ino;
 	u64 capture_root_dev;
+	struct io_ring *io_ring;
 };
 
 /* scan.c */
 
 int
 do_scan_progress(struct scan_params *params, int status,
-		 const struct wim_inode *inode);
+		 struct wim_inode *inode);
 
 int
 mangle_pat(tchar *pat, const tchar *path, unsigned long line_no);
@@ -94,6 +144,24 @@ match_pattern_list(const tchar *path, const struct string_list *list,
 int
 try_exclude(const struct scan_params *params);
 
+void
+start_scan_hasher(struct scan_params *params);
+
+void
+finish_scan_hasher(struct scan_params *params, bool scan_succeeded);
+
+/* template.c */
+
+int
+begin_capture_template(struct capture_template *template, WIMStruct *wim,
+		       const tchar *wim_target_path);
+
+void
+end_capture_template(struct capture_template *template);
+
+void
+apply_capture_template(struct scan_params *params, struct wim_inode *inode);
+
 typedef int (*scan_tree_t)(struct wim_dentry **, const tchar *,
 			   struct scan_params *);
 
@@ -117,6 +185,11 @@ int
 unix_build_dentry_tree(struct wim_dentry **root_ret,
 		       const tchar *root_disk_path, struct scan_params *params);
 #define platform_default_scan_tree unix_build_dentry_tree
+
+/* tar_capture.c */
+int
+tar_build_dentry_tree(struct wim_dentry **root_ret, const tchar *tar_path,
+		      struct scan_params *params);
 #endif
 
 #ifdef ENABLE_TEST_SUPPORT
@@ -137,9 +210,12 @@ report_scan_error(struct scan_params *params, int error_code)
 bool
 should_ignore_filename(const tchar *name, int name_nchars);
 
+void
+discard_scanned_tree(struct scan_params *params, struct wim_dentry *tree);
+
 void
 attach_scanned_tree(struct wim_dentry *parent, struct wim_dentry *child,
-		    struct blob_table *blob_table);
+		    struct scan_params *params);
 
 int
 pathbuf_init(struct scan_params *params, const tchar *root_path);
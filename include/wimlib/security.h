@@ -4,14 +4,25 @@
 #include "wimlib/types.h"
 
 struct wim_security_data;
-struct avl_tree_node;
+struct sd_set_slot;
 
-/* Map from SHA1 message digests of security descriptors to security IDs, which
- * are themselves indices into the table of security descriptors in the 'struct
- * wim_security_data'. */
+/* Map from security descriptors to security IDs, which are themselves indices
+ * into the table of security descriptors in the 'struct wim_security_data'.
+ * The index isn't built until the first descriptor is added. */
 struct wim_sd_set {
 	struct wim_security_data *sd;
-	struct avl_tree_node *root;
+
+	/* Open-addressed hash table of the indexed security IDs, with
+	 * @capacity slots (a power of 2), or NULL if not built yet  */
+	struct sd_set_slot *slots;
+	u32 capacity;
+
+	/* The number of descriptors of @sd which have been indexed  */
+	u32 num_indexed;
+
+	/* The security ID which was returned last, or -1 if none  */
+	s32 last_id;
+
 	s32 orig_num_entries;
 };
 
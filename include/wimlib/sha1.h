@@ -54,6 +54,17 @@ sha1_final(struct sha1_ctx *ctx, u8 hash[SHA1_HASH_SIZE]);
 void
 sha1(const void *data, size_t len, u8 hash[SHA1_HASH_SIZE]);
 
+/* Maximum number of messages which the multi-buffer functions hash at once  */
+#define SHA1_MAX_LANES	16
+
+void
+sha1_update_multi(struct sha1_ctx *const ctxs[], const void *const data[],
+		  unsigned num, size_t len);
+
+void
+sha1_multi(const void *const data[], const size_t lens[], unsigned num,
+	   u8 hashes[][SHA1_HASH_SIZE]);
+
 extern const u8 zero_hash[SHA1_HASH_SIZE];
 
 #define SHA1_HASH_STRING_LEN	(2 * SHA1_HASH_SIZE + 1)
@@ -0,0 +1,31 @@
+#ifndef _WIMLIB_TAR_H
+#define _WIMLIB_TAR_H
+
+#include "wimlib/types.h"
+
+#define TAR_BLOCK_SIZE		512
+
+/* The header of a member of a tar archive, in the ustar format.  The GNU format
+ * uses the same layout except for the fields after 'gname'.  Numeric fields
+ * are in octal ASCII, or in the GNU base-256 format if they don't fit.  */
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+#endif /* _WIMLIB_TAR_H */
@@ -0,0 +1,100 @@
+/*
+ * task_pool.h
+ *
+ * A library-wide pool of threads which runs tasks in parallel.
+ */
+
+#ifndef _WIMLIB_TASK_POOL_H
+#define _WIMLIB_TASK_POOL_H
+
+#include "wimlib/list.h"
+#include "wimlib/ring_buffer.h"
+#include "wimlib/threads.h"
+
+struct pool_thread;
+struct task_batch;
+
+/* A task to be run by the task pool.  A task must not wait for any other task,
+ * except as allowed by task_pool_run_batch(), since all tasks in the library
+ * share the same threads.  */
+struct pool_task {
+	struct list_head list;
+	void (*run)(struct pool_task *task);
+
+	/* Private to the task pool  */
+	struct pool_thread *queue_thread;
+	struct task_batch *batch;
+};
+
+void
+task_pool_submit(struct pool_task *task);
+
+void
+task_pool_run_batch(struct pool_task *tasks[], unsigned num_tasks);
+
+unsigned
+task_pool_num_threads(void);
+
+void
+task_pool_cleanup(void);
+
+struct worker_group;
+
+/* One of the workers of a worker group; see below.  */
+struct group_worker {
+	struct pool_task task;
+	struct worker_group *group;
+	void *ctx;
+	struct list_head idle_list;
+};
+
+/*
+ * A worker group processes items (e.g. chunks to compress) which are submitted
+ * to it, using up to a fixed number of workers at once, each with its own
+ * context (e.g. a compressor).  A worker runs as a task on the task pool which
+ * processes items until none are left, so it never waits for anything, and the
+ * number of threads stays bounded by the size of the task pool no matter how
+ * many worker groups are active at the same time.
+ *
+ * The submitted items are kept in a lock-free ring buffer.  The lock only
+ * protects the idle workers, so it is only taken when a worker runs out of
+ * items or when an item is submitted while some worker is idle.
+ */
+struct worker_group {
+	void (*process)(void *item, void *worker_ctx);
+	struct ring_buffer items;
+	struct mutex lock;
+	struct condvar idle_cond;
+	struct list_head idle_workers;
+	unsigned num_idle_workers;
+	struct group_worker *workers;
+	unsigned num_workers;
+	unsigned num_busy_workers;
+};
+
+int
+worker_group_init(struct worker_group *group, unsigned num_workers,
+		  size_t max_items,
+		  void (*process)(void *item, void *worker_ctx),
+		  void *const worker_ctxs[]);
+
+void
+worker_group_submit(struct worker_group *group, void *item);
+
+bool
+worker_group_try_submit(struct worker_group *group, void *item);
+
+void
+worker_group_destroy(struct worker_group *group);
+
+/* Return true if none of the group's workers are running, i.e. all submitted
+ * items have been started and finished.  This is only a hint, since items may
+ * be submitted concurrently.  */
+static inline bool
+worker_group_all_idle(const struct worker_group *group)
+{
+	return __atomic_load_n(&group->num_idle_workers, __ATOMIC_RELAXED) ==
+		group->num_workers;
+}
+
+#endif /* _WIMLIB_TASK_POOL_H */
@@ -15,9 +15,35 @@
 #define WIMLIB_CMP_FLAG_WINDOWS_MODE	0x00000004
 #define WIMLIB_CMP_FLAG_EXT4		0x00000008
 
+/* Parameters for the trees generated by WIMLIB_ADD_FLAG_GENERATE_TEST_DATA;
+ * see wimlib_set_test_data_params().  */
+struct wimlib_test_data_params {
+	/* The number of files and directories to generate, not counting the
+	 * root directory.  If 0, a tree of random size and shape is generated
+	 * and the other parameters are ignored.  */
+	u64 num_files;
+
+	/* The maximum number of entries in each directory.  0 means 64.  */
+	u32 max_dir_entries;
+
+	/* The maximum length of each filename, in UTF-16 code units.  0 means
+	 * the default, which is also the upper limit.  */
+	u32 max_name_len;
+
+	/* The size of each data stream is chosen uniformly at random from
+	 * [0, max_stream_size], so 0 generates metadata only.  */
+	u64 max_stream_size;
+
+	/* The percentage of data streams which duplicate another stream.  */
+	u32 dedup_percent;
+};
+
 WIMLIBAPI void
 wimlib_seed_random(u64 seed);
 
+WIMLIBAPI int
+wimlib_set_test_data_params(const struct wimlib_test_data_params *params);
+
 WIMLIBAPI int
 wimlib_compare_images(WIMStruct *wim1, int image1,
 		      WIMStruct *wim2, int image2, int cmp_flags);
@@ -33,6 +59,18 @@ WIMLIBAPI int
 wimlib_utf16le_to_utf8(const utf16lechar *in, size_t in_nbytes,
 		       char **out_ret, size_t *out_nbytes_ret);
 
+#define WIMLIB_MATCHFINDER_HC		0
+#define WIMLIB_MATCHFINDER_BT		1
+#define WIMLIB_MATCHFINDER_LCPIT	2
+
+WIMLIBAPI u64
+wimlib_get_matchfinder_needed_memory(int matchfinder, size_t max_bufsize);
+
+WIMLIBAPI int
+wimlib_run_matchfinder(int matchfinder, const void *in, size_t in_nbytes,
+		       u32 nice_len, u32 max_search_depth,
+		       u64 *num_matches_ret, u64 *total_len_ret);
+
 #endif /* ENABLE_TEST_SUPPORT */
 
 #endif /* _WIMLIB_TEST_SUPPORT_H */
@@ -29,6 +29,25 @@ struct condvar { pthread_cond_t pthread_cond; };
 
 #endif /* !_WIN32 */
 
+/*
+ * An event count, which lets a thread sleep until a condition that is updated
+ * without locks (e.g. "a lock-free queue is nonempty") may have become true.  A
+ * waiter calls event_count_prepare_wait(), re-checks the condition, and then
+ * either calls event_count_cancel_wait() or sleeps in event_count_wait().  A
+ * thread that makes the condition true calls event_count_notify_all(), which
+ * costs only a memory barrier when no thread is waiting.  On Linux, waiting is
+ * done directly with futexes; elsewhere it falls back to a mutex and condition
+ * variable, which are only touched when some thread is waiting.
+ */
+struct event_count {
+	unsigned seq;
+	unsigned num_waiters;
+#ifndef __linux__
+	struct mutex lock;
+	struct condvar cond;
+#endif
+};
+
 bool thread_create(struct thread *t, void *(*thrproc)(void *), void *arg);
 void thread_join(struct thread *t);
 bool mutex_init(struct mutex *m);
@@ -40,5 +59,11 @@ void condvar_destroy(struct condvar *c);
 void condvar_wait(struct condvar *c, struct mutex *m);
 void condvar_signal(struct condvar *c);
 void condvar_broadcast(struct condvar *c);
+bool event_count_init(struct event_count *ec);
+void event_count_destroy(struct event_count *ec);
+unsigned event_count_prepare_wait(struct event_count *ec);
+void event_count_cancel_wait(struct event_count *ec);
+void event_count_wait(struct event_count *ec, unsigned seq);
+void event_count_notify_all(struct event_count *ec);
 
 #endif /* _WIMLIB_THREADS_H */
@@ -0,0 +1,45 @@
+/*
+ * trace.h
+ *
+ * Optional tracing of the library's main operations, as a timeline in the
+ * Chrome trace event format.
+ */
+
+#ifndef _WIMLIB_TRACE_H
+#define _WIMLIB_TRACE_H
+
+#include "wimlib/perf_counters.h"
+
+extern bool trace_enabled;
+
+void
+trace_init(void);
+
+void
+trace_cleanup(void);
+
+void
+trace_event(const char *name, u64 start);
+
+/*
+ * Call trace_begin() at the start of an operation to be traced and trace_end()
+ * at the end, with the value trace_begin() returned.  This records one event
+ * spanning the operation, on the timeline of the calling thread.  When tracing
+ * is disabled this costs just a test of a global variable.
+ */
+static forceinline u64
+trace_begin(void)
+{
+	if (likely(!trace_enabled))
+		return 0;
+	return perf_now();
+}
+
+static forceinline void
+trace_end(const char *name, u64 start)
+{
+	if (unlikely(start != 0))
+		trace_event(name, start);
+}
+
+#endif /* _WIMLIB_TRACE_H */
@@ -68,9 +68,20 @@ wimlib_aligned_malloc(size_t size, size_t alignment);
 void
 wimlib_aligned_free(void *ptr);
 
+void *
+wimlib_large_malloc(size_t size);
+
 void *
 memdup(const void *mem, size_t size);
 
+#ifdef _WIN32
+/* The replacement realpath() already allocates with MALLOC().  */
+#  define wimlib_realpath(path)	realpath((path), NULL)
+#else
+char *
+wimlib_realpath(const char *path);
+#endif
+
 #define MALLOC		wimlib_malloc
 #define FREE		wimlib_free_memory
 #define REALLOC		wimlib_realloc
@@ -79,6 +90,7 @@ memdup(const void *mem, size_t size);
 #define WCSDUP		wimlib_wcsdup
 #define ALIGNED_MALLOC	wimlib_aligned_malloc
 #define ALIGNED_FREE	wimlib_aligned_free
+#define LARGE_MALLOC	wimlib_large_malloc
 
 /*******************
  * String utilities
@@ -136,6 +148,10 @@ cmp_u64(u64 n1, u64 n2)
 	return 0;
 }
 
+/* Are all bytes in the specified buffer zero? */
+bool
+is_all_zeroes(const u8 *p, size_t size);
+
 /************************
  * System information
  ************************/
@@ -143,7 +159,13 @@ cmp_u64(u64 n1, u64 n2)
 unsigned
 get_available_cpus(void);
 
+u64
+get_physical_memory(void);
+
 u64
 get_available_memory(void);
 
+u64
+get_memory_budget_remaining(void);
+
 #endif /* _WIMLIB_UTIL_H */
@@ -0,0 +1,41 @@
+#ifndef _WIMLIB_VERIFY_CACHE_H
+#define _WIMLIB_VERIFY_CACHE_H
+
+#include <stdbool.h>
+
+#include "wimlib/types.h"
+
+struct blob_descriptor;
+struct verify_cache_entry;
+
+/*
+ * The blobs of a WIM file which an earlier wimlib_verify_wim() found to be
+ * intact, as recorded in a file alongside the WIM file (see verify_cache.c).
+ */
+struct verify_cache {
+	/* Path to the cache file, or NULL if the WIM can't have a cache  */
+	tchar *path;
+
+	/* Identity of the WIM file  */
+	u64 dev;
+	u64 ino;
+
+	/* The entries loaded from the cache file, sorted  */
+	struct verify_cache_entry *entries;
+	size_t num_entries;
+};
+
+int
+load_verify_cache(struct verify_cache *cache, WIMStruct *wim, bool ignore_old);
+
+bool
+verify_cache_contains(const struct verify_cache *cache,
+		      const struct blob_descriptor *blob, const WIMStruct *wim);
+
+void
+save_verify_cache(const struct verify_cache *cache, WIMStruct *wim);
+
+void
+destroy_verify_cache(struct verify_cache *cache);
+
+#endif /* _WIMLIB_VERIFY_CACHE_H */
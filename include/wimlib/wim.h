@@ -9,10 +9,36 @@
 #include "wimlib/file_io.h"
 #include "wimlib/header.h"
 #include "wimlib/list.h"
+#include "wimlib/open_wim_cache.h"
 
+struct blob_cache;
+struct blob_table;
+struct chunk_cache;
+struct chunk_decompressor;
+struct hash_cache;
 struct wim_image_metadata;
 struct wim_xml_info;
-struct blob_table;
+
+/*
+ * The compression settings with which wimlib compressed all the file data
+ * resources in the first @end_offset bytes of a WIM file, as recorded in the
+ * WIMLIB_COMPRESSION element of its XML data.  wimlib_overwrite() with
+ * WIMLIB_WRITE_FLAG_RECOMPRESS uses this to reuse resources which would just be
+ * recompressed the same way.
+ *
+ * If @appendable is set, then no file data resources were written after
+ * @end_offset by later writes, so an append that compresses its new data with
+ * the same settings may move @end_offset past that data.
+ */
+struct wim_compression_fingerprint {
+	bool valid;
+	bool solid;
+	bool appendable;
+	u8 ctype;
+	u32 chunk_size;
+	u32 level;
+	u64 end_offset;
+};
 
 /*
  * WIMStruct - represents a WIM, or a part of a non-standalone WIM
@@ -113,6 +139,27 @@ struct WIMStruct {
 	u8 decompressor_ctype;
 	u32 decompressor_max_block_size;
 
+	/* The number of threads to use for decompressing data from this WIM
+	 * file, as set by wimlib_set_decompression_threads(); 0 means to use
+	 * the number of available CPUs.  If more than one thread is to be used,
+	 * then the cached parallel chunk decompressor, if any, is stored in
+	 * @parallel_decompressor, analogous to @decompressor.  */
+	unsigned num_decompression_threads;
+	struct chunk_decompressor *parallel_decompressor;
+
+	/* If non-NULL, the cache of decompressed chunks to use for small reads
+	 * from this WIM file in random order; see read_cached_wim_resource().
+	 * This is only enabled while an image is mounted.  */
+	struct chunk_cache *chunk_cache;
+
+	/* The memory used by the chunk offsets cached in the descriptors of
+	 * this WIMStruct's resources  */
+	u64 cached_chunk_offsets_size;
+
+	/* The identity of the backing file, for sharing its metadata with other
+	 * WIMStructs through the open WIM cache (see open_wim_cache.c)  */
+	struct open_wim_id cache_id;
+
 	/* Temporary field; use sparingly  */
 	void *private;
 
@@ -126,6 +173,15 @@ struct WIMStruct {
 	 * with WIMLIB_WRITE_FLAG_UNSAFE_COMPACT  */
 	u8 being_compacted : 1;
 
+	/* 1 if num_decompression_threads was set by
+	 * wimlib_set_decompression_threads(), otherwise 0  */
+	u8 decompression_threads_set : 1;
+
+	/* 1 if num_decompression_threads was raised for the duration of a
+	 * write which recompresses data from this WIM file; see
+	 * raise_decompression_threads()  */
+	u8 decompression_threads_raised : 1;
+
 	/* If this WIM is backed by a file, then this is the compression type
 	 * for non-solid resources in that file.  */
 	u8 compression_type;
@@ -152,10 +208,57 @@ struct WIMStruct {
 	 * wimlib_set_output_pack_chunk_size().  */
 	u32 out_solid_chunk_size;
 
+	/* Minimum uncompressed size of each solid resource when the data to be
+	 * written in solid mode is split into several resources so that they
+	 * can be produced in parallel, or 0 to never split it; can be set with
+	 * wimlib_set_output_pack_min_resource_size().  */
+	u64 out_solid_min_res_size;
+
+	/* Size above which blobs are written in non-solid resources, with the
+	 * non-solid compression type and chunk size, when writing in solid
+	 * mode, or 0 to write all blobs in solid resources; can be set with
+	 * wimlib_set_output_pack_max_blob_size().  */
+	u64 out_solid_max_blob_size;
+
+	/* Comma-separated list of the compression workers to which the data
+	 * being compressed is sent, or NULL to compress all of it locally; can
+	 * be set with wimlib_set_output_compression_workers().  */
+	tchar *out_compression_workers;
+
+	/* While wimlib_write_delta() runs: the WIM whose blobs are omitted from
+	 * the output, and the statistics about how much was omitted  */
+	WIMStruct *out_delta_base;
+	struct wimlib_delta_stats *out_delta_stats;
+
+	/* The compression fingerprint of the backing file, if any  */
+	struct wim_compression_fingerprint compression_fp;
+
+	/* The compression fingerprint to record in the WIM file being written.
+	 * It is set up when the file data is written.  */
+	struct wim_compression_fingerprint out_compression_fp;
+
+	/* If non-NULL, the WIMStruct containing the image with which files are
+	 * compared while they're being scanned into this WIMStruct, and the
+	 * number of that image; set by wimlib_set_capture_template().  */
+	WIMStruct *capture_template_wim;
+	int capture_template_image;
+
+	/* If non-NULL, the cache of the SHA-1 message digests of captured files
+	 * set by wimlib_set_capture_hash_cache()  */
+	struct hash_cache *hash_cache;
+
+	/* If non-NULL, the directory from which extracted blobs are copied and
+	 * to which they're added, set by wimlib_set_extract_blob_cache()  */
+	struct blob_cache *blob_cache;
+
 	/* Currently registered progress function for this WIMStruct, or NULL if
 	 * no progress function is currently registered for this WIMStruct.  */
 	wimlib_progress_func_t progfunc;
 	void *progctx;
+
+	/* The minimum time between gradual progress messages, in milliseconds,
+	 * as set by wimlib_set_progress_interval(); 0 if not set  */
+	u32 progress_interval_ms;
 };
 
 /*
@@ -207,9 +310,29 @@ write_wim_header_flags(u32 hdr_flags, struct filedes *out_fd);
 int
 select_wim_image(WIMStruct *wim, int image);
 
+int
+select_wim_image_for_paths(WIMStruct *wim, int image,
+			   const tchar * const *paths, size_t num_paths,
+			   bool *partial_ret);
+
+int
+select_wim_image_lazily(WIMStruct *wim, int image, void **buf_ret);
+
 void
 deselect_current_wim_image(WIMStruct *wim);
 
+int
+hold_wim_image(WIMStruct *wim, int image, struct wim_image_metadata **imd_ret);
+
+int
+load_wim_images(WIMStruct *wim, int first_image, int last_image);
+
+int
+load_wim_images_ahead(WIMStruct *wim, int image, int last_image);
+
+void
+release_wim_image(struct wim_image_metadata *imd);
+
 int
 for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *));
 
@@ -222,6 +345,7 @@ delete_wim_image(WIMStruct *wim, int image);
 /* Internal open flags (pass to open_wim_as_WIMStruct(), not wimlib_open_wim())
  */
 #define WIMLIB_OPEN_FLAG_FROM_PIPE	0x80000000
+#define WIMLIB_OPEN_FLAG_FROM_IO	0x40000000
 
 int
 open_wim_as_WIMStruct(const void *wim_filename_or_fd, int open_flags,
@@ -34,6 +34,9 @@ win32_global_init(int init_flags);
 void
 win32_global_cleanup(void);
 
+void
+vss_release_cached_snapshots(void);
+
 int
 fsync(int fd);
 
@@ -9,7 +9,9 @@
 #include "wimlib/win32_common.h"
 
 /* A reference counter for a VSS snapshot.  This is embedded in another data
- * structure only visible to win32_vss.c.  */
+ * structure only visible to win32_vss.c.  A snapshot may be shared by the
+ * files of several sources and may be released from any thread, so the counter
+ * is updated atomically.  */
 struct vss_snapshot {
 	size_t refcnt;
 };
@@ -22,7 +24,7 @@ static inline struct vss_snapshot *
 vss_get_snapshot(struct vss_snapshot *snapshot)
 {
 	if (snapshot)
-		snapshot->refcnt++;
+		__atomic_add_fetch(&snapshot->refcnt, 1, __ATOMIC_RELAXED);
 	return snapshot;
 }
 
@@ -31,7 +33,8 @@ vss_get_snapshot(struct vss_snapshot *snapshot)
 static inline void
 vss_put_snapshot(struct vss_snapshot *snapshot)
 {
-	if (snapshot && --snapshot->refcnt == 0)
+	if (snapshot &&
+	    __atomic_sub_fetch(&snapshot->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
 		vss_delete_snapshot(snapshot);
 }
 
@@ -28,7 +28,13 @@
 	WIMLIB_WRITE_FLAG_SOLID				| \
 	WIMLIB_WRITE_FLAG_SEND_DONE_WITH_FILE_MESSAGES	| \
 	WIMLIB_WRITE_FLAG_NO_SOLID_SORT			| \
-	WIMLIB_WRITE_FLAG_UNSAFE_COMPACT)
+	WIMLIB_WRITE_FLAG_UNSAFE_COMPACT		| \
+	WIMLIB_WRITE_FLAG_SAFE_COMPACT			| \
+	WIMLIB_WRITE_FLAG_SKIP_INCOMPRESSIBLE		| \
+	WIMLIB_WRITE_FLAG_CONCURRENT_PARTS		| \
+	WIMLIB_WRITE_FLAG_AUTO_SOLID_CHUNK_SIZE		| \
+	WIMLIB_WRITE_FLAG_SOLID_SORT_SIMILARITY		| \
+	WIMLIB_WRITE_FLAG_UNBUFFERED)
 
 #if defined(HAVE_SYS_FILE_H) && defined(HAVE_FLOCK)
 int
@@ -49,6 +55,7 @@ unlock_wim_for_append(WIMStruct *wim)
 
 struct filedes;
 struct list_head;
+struct wim_image_metadata;
 struct wim_reshdr;
 
 int
@@ -71,6 +78,17 @@ write_wim_resource_from_buffer(const void *buf,
 			       u32 out_chunk_size,
 			       struct wim_reshdr *out_reshdr,
 			       u8 *hash_ret,
-			       int write_resource_flags);
+			       int write_resource_flags,
+			       unsigned num_threads);
+
+int
+write_generated_metadata_resource(struct wim_image_metadata *imd,
+				  u64 size, const u8 *hash,
+				  struct filedes *out_fd,
+				  int out_ctype,
+				  u32 out_chunk_size,
+				  struct wim_reshdr *out_reshdr,
+				  int write_resource_flags,
+				  unsigned num_threads);
 
 #endif /* _WIMLIB_WRITE_H */
@@ -58,6 +58,7 @@ xml_print_image_info(struct wim_xml_info *info, int image);
 
 /*****************************************************************************/
 
+struct wim_compression_fingerprint;
 struct wim_reshdr;
 
 #define WIM_TOTALBYTES_USE_EXISTING  ((u64)(-1))
@@ -67,8 +68,9 @@ int
 read_wim_xml_data(WIMStruct *wim);
 
 int
-write_wim_xml_data(WIMStruct *wim, int image,
-		   u64 total_bytes, struct wim_reshdr *out_reshdr,
+write_wim_xml_data(WIMStruct *wim, int image, u64 total_bytes,
+		   const struct wim_compression_fingerprint *fp,
+		   struct wim_reshdr *out_reshdr,
 		   int write_resource_flags);
 
 #endif /* _WIMLIB_XML_H */
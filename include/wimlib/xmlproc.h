@@ -19,6 +19,12 @@ struct xml_node {
 	struct xml_node *parent;	/* parent, or NULL if none */
 	struct list_head children;	/* children; only used for ELEMENT */
 	struct list_head sibling_link;
+
+	/* For an ELEMENT on which xml_element_cache_output() was called: the
+	 * element as last serialized, or NULL if it has changed since then.  */
+	bool cache_output;
+	tchar *cached_output;
+	size_t cached_output_len;
 };
 
 /* Iterate through the children of an xml_node.  Does nothing if passed NULL. */
@@ -31,6 +37,17 @@ xml_node_is_element(const struct xml_node *node, const tchar *name)
 	return node->type == XML_ELEMENT_NODE && !tstrcmp(node->name, name);
 }
 
+/*
+ * Keep the serialized form of @element after writing it, and reuse it on later
+ * writes until the element or anything under it is changed.  This is for large
+ * elements that usually stay unchanged between writes of the document.
+ */
+static inline void
+xml_element_cache_output(struct xml_node *element)
+{
+	element->cache_output = true;
+}
+
 struct xml_node *
 xml_new_element(struct xml_node *parent, const tchar *name);
 
@@ -163,13 +163,19 @@ static void imagex_flush_output(void)
 enum {
 	IMAGEX_ALLOW_OTHER_OPTION,
 	IMAGEX_BLOBS_OPTION,
+	IMAGEX_BLOB_CACHE_OPTION,
+	IMAGEX_BLOB_CACHE_SIZE_OPTION,
 	IMAGEX_BOOT_OPTION,
+	IMAGEX_CACHE_OPTION,
 	IMAGEX_CHECK_OPTION,
 	IMAGEX_CHUNK_SIZE_OPTION,
+	IMAGEX_CLONE_DUPLICATES_OPTION,
 	IMAGEX_COMMAND_OPTION,
 	IMAGEX_COMMIT_OPTION,
 	IMAGEX_COMPACT_OPTION,
 	IMAGEX_COMPRESS_OPTION,
+	IMAGEX_COMPRESS_WORKERS_OPTION,
+	IMAGEX_CONCURRENT_OPTION,
 	IMAGEX_CONFIG_OPTION,
 	IMAGEX_CREATE_OPTION,
 	IMAGEX_DEBUG_OPTION,
@@ -177,9 +183,12 @@ enum {
 	IMAGEX_DEREFERENCE_OPTION,
 	IMAGEX_DEST_DIR_OPTION,
 	IMAGEX_DETAILED_OPTION,
+	IMAGEX_DISK_ORDER_OPTION,
+	IMAGEX_ESTIMATE_OPTION,
 	IMAGEX_EXTRACT_XML_OPTION,
 	IMAGEX_FLAGS_OPTION,
 	IMAGEX_FORCE_OPTION,
+	IMAGEX_HASH_CACHE_OPTION,
 	IMAGEX_HEADER_OPTION,
 	IMAGEX_IMAGE_PROPERTY_OPTION,
 	IMAGEX_INCLUDE_INTEGRITY_OPTION,
@@ -193,10 +202,12 @@ enum {
 	IMAGEX_NO_ACLS_OPTION,
 	IMAGEX_NO_ATTRIBUTES_OPTION,
 	IMAGEX_NO_GLOBS_OPTION,
+	IMAGEX_NO_PREALLOCATE_OPTION,
 	IMAGEX_NO_REPLACE_OPTION,
 	IMAGEX_NO_SOLID_SORT_OPTION,
 	IMAGEX_NULLGLOB_OPTION,
 	IMAGEX_ONE_FILE_ONLY_OPTION,
+	IMAGEX_OVERLAPPED_READS_OPTION,
 	IMAGEX_PATH_OPTION,
 	IMAGEX_PIPABLE_OPTION,
 	IMAGEX_PRESERVE_DIR_STRUCTURE_OPTION,
@@ -206,6 +217,8 @@ enum {
 	IMAGEX_RECURSIVE_OPTION,
 	IMAGEX_REF_OPTION,
 	IMAGEX_RPFIX_OPTION,
+	IMAGEX_SAFE_COMPACT_OPTION,
+	IMAGEX_SKIP_INCOMPRESSIBLE_OPTION,
 	IMAGEX_SNAPSHOT_OPTION,
 	IMAGEX_SOFT_OPTION,
 	IMAGEX_SOLID_CHUNK_SIZE_OPTION,
@@ -215,6 +228,8 @@ enum {
 	IMAGEX_STAGING_DIR_OPTION,
 	IMAGEX_STREAMS_INTERFACE_OPTION,
 	IMAGEX_STRICT_ACLS_OPTION,
+	IMAGEX_TAR_OPTION,
+	IMAGEX_TARGET_ORDER_OPTION,
 	IMAGEX_THREADS_OPTION,
 	IMAGEX_TO_STDOUT_OPTION,
 	IMAGEX_UNIX_DATA_OPTION,
@@ -235,12 +250,19 @@ static const struct option apply_options[] = {
 	{T("no-acls"),     no_argument,       NULL, IMAGEX_NO_ACLS_OPTION},
 	{T("strict-acls"), no_argument,       NULL, IMAGEX_STRICT_ACLS_OPTION},
 	{T("no-attributes"), no_argument,     NULL, IMAGEX_NO_ATTRIBUTES_OPTION},
+	{T("no-preallocate"), no_argument,    NULL, IMAGEX_NO_PREALLOCATE_OPTION},
+	{T("clone-duplicates"), no_argument,  NULL, IMAGEX_CLONE_DUPLICATES_OPTION},
+	{T("target-order"), no_argument,      NULL, IMAGEX_TARGET_ORDER_OPTION},
 	{T("rpfix"),       no_argument,       NULL, IMAGEX_RPFIX_OPTION},
 	{T("norpfix"),     no_argument,       NULL, IMAGEX_NORPFIX_OPTION},
 	{T("include-invalid-names"), no_argument,       NULL, IMAGEX_INCLUDE_INVALID_NAMES_OPTION},
 	{T("wimboot"),     no_argument,       NULL, IMAGEX_WIMBOOT_OPTION},
 	{T("compact"),     required_argument, NULL, IMAGEX_COMPACT_OPTION},
 	{T("recover-data"), no_argument,      NULL, IMAGEX_RECOVER_DATA_OPTION},
+	{T("tar"),         no_argument,       NULL, IMAGEX_TAR_OPTION},
+	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
+	{T("blob-cache"),  required_argument, NULL, IMAGEX_BLOB_CACHE_OPTION},
+	{T("blob-cache-size"), required_argument, NULL, IMAGEX_BLOB_CACHE_SIZE_OPTION},
 	{NULL, 0, NULL, 0},
 };
 
@@ -256,6 +278,8 @@ static const struct option capture_or_append_options[] = {
 	{T("solid-compress"),required_argument, NULL, IMAGEX_SOLID_COMPRESS_OPTION},
 	{T("solid-chunk-size"),required_argument, NULL, IMAGEX_SOLID_CHUNK_SIZE_OPTION},
 	{T("no-solid-sort"), no_argument,     NULL, IMAGEX_NO_SOLID_SORT_OPTION},
+	{T("skip-incompressible"), no_argument, NULL, IMAGEX_SKIP_INCOMPRESSIBLE_OPTION},
+	{T("compress-workers"), required_argument, NULL, IMAGEX_COMPRESS_WORKERS_OPTION},
 	{T("config"),      required_argument, NULL, IMAGEX_CONFIG_OPTION},
 	{T("dereference"), no_argument,       NULL, IMAGEX_DEREFERENCE_OPTION},
 	{T("flags"),       required_argument, NULL, IMAGEX_FLAGS_OPTION},
@@ -273,10 +297,14 @@ static const struct option capture_or_append_options[] = {
 	{T("pipable"),     no_argument,       NULL, IMAGEX_PIPABLE_OPTION},
 	{T("not-pipable"), no_argument,       NULL, IMAGEX_NOT_PIPABLE_OPTION},
 	{T("update-of"),   required_argument, NULL, IMAGEX_UPDATE_OF_OPTION},
+	{T("hash-cache"),  required_argument, NULL, IMAGEX_HASH_CACHE_OPTION},
 	{T("delta-from"),  required_argument, NULL, IMAGEX_DELTA_FROM_OPTION},
 	{T("wimboot"),     no_argument,       NULL, IMAGEX_WIMBOOT_OPTION},
 	{T("unsafe-compact"), no_argument,    NULL, IMAGEX_UNSAFE_COMPACT_OPTION},
 	{T("snapshot"),    no_argument,       NULL, IMAGEX_SNAPSHOT_OPTION},
+	{T("overlapped-reads"), no_argument,  NULL, IMAGEX_OVERLAPPED_READS_OPTION},
+	{T("disk-order"),  no_argument,       NULL, IMAGEX_DISK_ORDER_OPTION},
+	{T("tar"),         no_argument,       NULL, IMAGEX_TAR_OPTION},
 	{T("create"),      no_argument,       NULL, IMAGEX_CREATE_OPTION},
 	{NULL, 0, NULL, 0},
 };
@@ -285,6 +313,7 @@ static const struct option delete_options[] = {
 	{T("check"), no_argument, NULL, IMAGEX_CHECK_OPTION},
 	{T("include-integrity"), no_argument, NULL, IMAGEX_INCLUDE_INTEGRITY_OPTION},
 	{T("soft"),  no_argument, NULL, IMAGEX_SOFT_OPTION},
+	{T("safe-compact"), no_argument, NULL, IMAGEX_SAFE_COMPACT_OPTION},
 	{T("unsafe-compact"), no_argument, NULL, IMAGEX_UNSAFE_COMPACT_OPTION},
 	{NULL, 0, NULL, 0},
 };
@@ -310,7 +339,10 @@ static const struct option export_options[] = {
 	{T("solid-compress"),required_argument, NULL, IMAGEX_SOLID_COMPRESS_OPTION},
 	{T("solid-chunk-size"),required_argument, NULL, IMAGEX_SOLID_CHUNK_SIZE_OPTION},
 	{T("no-solid-sort"), no_argument,     NULL, IMAGEX_NO_SOLID_SORT_OPTION},
+	{T("skip-incompressible"), no_argument, NULL, IMAGEX_SKIP_INCOMPRESSIBLE_OPTION},
+	{T("compress-workers"), required_argument, NULL, IMAGEX_COMPRESS_WORKERS_OPTION},
 	{T("ref"),         required_argument, NULL, IMAGEX_REF_OPTION},
+	{T("delta-from"),  required_argument, NULL, IMAGEX_DELTA_FROM_OPTION},
 	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
 	{T("rebuild"),     no_argument,       NULL, IMAGEX_REBUILD_OPTION},
 	{T("pipable"),     no_argument,       NULL, IMAGEX_PIPABLE_OPTION},
@@ -329,6 +361,9 @@ static const struct option extract_options[] = {
 	{T("no-acls"),     no_argument,       NULL, IMAGEX_NO_ACLS_OPTION},
 	{T("strict-acls"), no_argument,       NULL, IMAGEX_STRICT_ACLS_OPTION},
 	{T("no-attributes"), no_argument,     NULL, IMAGEX_NO_ATTRIBUTES_OPTION},
+	{T("no-preallocate"), no_argument,    NULL, IMAGEX_NO_PREALLOCATE_OPTION},
+	{T("clone-duplicates"), no_argument,  NULL, IMAGEX_CLONE_DUPLICATES_OPTION},
+	{T("target-order"), no_argument,      NULL, IMAGEX_TARGET_ORDER_OPTION},
 	{T("dest-dir"),    required_argument, NULL, IMAGEX_DEST_DIR_OPTION},
 	{T("to-stdout"),   no_argument,       NULL, IMAGEX_TO_STDOUT_OPTION},
 	{T("include-invalid-names"), no_argument, NULL, IMAGEX_INCLUDE_INVALID_NAMES_OPTION},
@@ -339,6 +374,10 @@ static const struct option extract_options[] = {
 	{T("wimboot"),     no_argument,       NULL, IMAGEX_WIMBOOT_OPTION},
 	{T("compact"),     required_argument, NULL, IMAGEX_COMPACT_OPTION},
 	{T("recover-data"), no_argument,      NULL, IMAGEX_RECOVER_DATA_OPTION},
+	{T("tar"),         required_argument, NULL, IMAGEX_TAR_OPTION},
+	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
+	{T("blob-cache"),  required_argument, NULL, IMAGEX_BLOB_CACHE_OPTION},
+	{T("blob-cache-size"), required_argument, NULL, IMAGEX_BLOB_CACHE_SIZE_OPTION},
 	{NULL, 0, NULL, 0},
 };
 
@@ -372,6 +411,7 @@ static const struct option mount_options[] = {
 	{T("staging-dir"),       required_argument, NULL, IMAGEX_STAGING_DIR_OPTION},
 	{T("unix-data"),         no_argument,       NULL, IMAGEX_UNIX_DATA_OPTION},
 	{T("allow-other"),       no_argument,       NULL, IMAGEX_ALLOW_OTHER_OPTION},
+	{T("threads"),           required_argument, NULL, IMAGEX_THREADS_OPTION},
 	{NULL, 0, NULL, 0},
 };
 #endif
@@ -388,15 +428,20 @@ static const struct option optimize_options[] = {
 	{T("solid-compress"),required_argument, NULL, IMAGEX_SOLID_COMPRESS_OPTION},
 	{T("solid-chunk-size"),required_argument, NULL, IMAGEX_SOLID_CHUNK_SIZE_OPTION},
 	{T("no-solid-sort"), no_argument,     NULL, IMAGEX_NO_SOLID_SORT_OPTION},
+	{T("skip-incompressible"), no_argument, NULL, IMAGEX_SKIP_INCOMPRESSIBLE_OPTION},
+	{T("compress-workers"), required_argument, NULL, IMAGEX_COMPRESS_WORKERS_OPTION},
 	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
 	{T("pipable"),     no_argument,       NULL, IMAGEX_PIPABLE_OPTION},
 	{T("not-pipable"), no_argument,       NULL, IMAGEX_NOT_PIPABLE_OPTION},
+	{T("safe-compact"), no_argument,      NULL, IMAGEX_SAFE_COMPACT_OPTION},
 	{T("unsafe-compact"), no_argument,    NULL, IMAGEX_UNSAFE_COMPACT_OPTION},
+	{T("estimate"),    no_argument,       NULL, IMAGEX_ESTIMATE_OPTION},
 	{NULL, 0, NULL, 0},
 };
 
 static const struct option split_options[] = {
 	{T("check"), no_argument, NULL, IMAGEX_CHECK_OPTION},
+	{T("concurrent"), no_argument, NULL, IMAGEX_CONCURRENT_OPTION},
 	{T("include-integrity"), no_argument, NULL, IMAGEX_INCLUDE_INTEGRITY_OPTION},
 	{NULL, 0, NULL, 0},
 };
@@ -448,6 +493,9 @@ static const struct option update_options[] = {
 static const struct option verify_options[] = {
 	{T("ref"), required_argument, NULL, IMAGEX_REF_OPTION},
 	{T("nocheck"), no_argument, NULL, IMAGEX_NOCHECK_OPTION},
+	{T("cache"), no_argument, NULL, IMAGEX_CACHE_OPTION},
+	{T("force"), no_argument, NULL, IMAGEX_FORCE_OPTION},
+	{T("threads"), required_argument, NULL, IMAGEX_THREADS_OPTION},
 
 	{NULL, 0, NULL, 0},
 };
@@ -1087,8 +1135,17 @@ imagex_progress_func(enum wimlib_progress_msg msg,
 			info->write_streams.total_bytes >> unit_shift,
 			unit_name,
 			percent_done);
-		if (info->write_streams.completed_bytes >= info->write_streams.total_bytes)
+		if (info->write_streams.completed_bytes >= info->write_streams.total_bytes) {
 			imagex_printf(T("\n"));
+			if (info->write_streams.completed_excluded_bytes) {
+				unit_shift = get_unit(info->write_streams.completed_excluded_bytes,
+						      &unit_name);
+				imagex_printf(T("Stored %"PRIu64" %"TS" uncompressed "
+						"due to [CompressionExclusionList]\n"),
+					      info->write_streams.completed_excluded_bytes >> unit_shift,
+					      unit_name);
+			}
+		}
 		break;
 	case WIMLIB_PROGRESS_MSG_SCAN_BEGIN:
 		imagex_printf(T("Scanning \"%"TS"\""), info->scan.source);
@@ -1134,6 +1191,14 @@ imagex_progress_func(enum wimlib_progress_msg msg,
 	case WIMLIB_PROGRESS_MSG_SCAN_END:
 		report_scan_progress(&info->scan, true);
 		imagex_printf(T("\n"));
+		if (info->scan.num_bytes_unchanged) {
+			unit_shift = get_unit(info->scan.num_bytes_unchanged,
+					      &unit_name);
+			imagex_printf(T("%"PRIu64" %"TS" of file data "
+					"unchanged and already present\n"),
+				      info->scan.num_bytes_unchanged >> unit_shift,
+				      unit_name);
+		}
 		break;
 	case WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY:
 		unit_shift = get_unit(info->integrity.total_bytes, &unit_name);
@@ -1171,7 +1236,9 @@ imagex_progress_func(enum wimlib_progress_msg msg,
 			info->extract.image_name,
 			info->extract.wimfile_name,
 			((info->extract.extract_flags & WIMLIB_EXTRACT_FLAG_NTFS) ?
-			 T("NTFS volume") : T("directory")),
+			 T("NTFS volume") :
+			 (info->extract.extract_flags & WIMLIB_EXTRACT_FLAG_TAR) ?
+			 T("tar archive") : T("directory")),
 			info->extract.target);
 		break;
 	case WIMLIB_PROGRESS_MSG_EXTRACT_FILE_STRUCTURE:
@@ -1332,6 +1399,48 @@ parse_chunk_size(const tchar *optarg)
 	return chunk_size;
 }
 
+/* Parse a size in bytes with optional K, M, or G suffix.  Returns UINT64_MAX
+ * on error.  */
+static uint64_t
+parse_memory_size(const tchar *optarg)
+{
+	tchar *tmp;
+	uint64_t size = tstrtoull(optarg, &tmp, 10);
+	unsigned shift = 0;
+
+	if (tmp == optarg || size == UINT64_MAX)
+		goto out_invalid;
+	if (*tmp) {
+		if (*tmp == T('k') || *tmp == T('K'))
+			shift = 10;
+		else if (*tmp == T('m') || *tmp == T('M'))
+			shift = 20;
+		else if (*tmp == T('g') || *tmp == T('G'))
+			shift = 30;
+		else
+			goto out_invalid;
+		tmp++;
+		if (*tmp == T('i') && *(tmp + 1) == T('B'))
+			tmp += 2;
+		if (*tmp)
+			goto out_invalid;
+	}
+	if (size > (UINT64_MAX >> shift) - 1) {
+		imagex_error(T("Invalid memory size; the value is too large!"));
+		return UINT64_MAX;
+	}
+	return size << shift;
+
+out_invalid:
+	imagex_error(T("Invalid memory size \"%"TS"\"; must be a non-negative "
+		       "integer\n"
+		       "       with optional K, M, or G suffix"), optarg);
+	return UINT64_MAX;
+}
+
+/* Default maximum size of the --blob-cache directory: 10 GiB  */
+#define DEFAULT_BLOB_CACHE_SIZE ((uint64_t)10 << 30)
+
 
 /*
  * Parse an option passed to an update command.
@@ -1558,6 +1667,10 @@ imagex_apply(int argc, tchar **argv, int cmd)
 	const tchar *target;
 	const tchar *image_num_or_name = NULL;
 	int extract_flags = 0;
+	unsigned num_threads = 0;
+	bool threads_specified = false;
+	const tchar *blob_cache_dir = NULL;
+	uint64_t blob_cache_size = DEFAULT_BLOB_CACHE_SIZE;
 
 	STRING_LIST(refglobs);
 
@@ -1586,6 +1699,15 @@ imagex_apply(int argc, tchar **argv, int cmd)
 		case IMAGEX_NO_ATTRIBUTES_OPTION:
 			extract_flags |= WIMLIB_EXTRACT_FLAG_NO_ATTRIBUTES;
 			break;
+		case IMAGEX_NO_PREALLOCATE_OPTION:
+			extract_flags |= WIMLIB_EXTRACT_FLAG_NO_PREALLOCATE;
+			break;
+		case IMAGEX_CLONE_DUPLICATES_OPTION:
+			extract_flags |= WIMLIB_EXTRACT_FLAG_CLONE_DUPLICATES;
+			break;
+		case IMAGEX_TARGET_ORDER_OPTION:
+			extract_flags |= WIMLIB_EXTRACT_FLAG_TARGET_ORDER;
+			break;
 		case IMAGEX_NORPFIX_OPTION:
 			extract_flags |= WIMLIB_EXTRACT_FLAG_NORPFIX;
 			break;
@@ -1607,6 +1729,23 @@ imagex_apply(int argc, tchar **argv, int cmd)
 		case IMAGEX_RECOVER_DATA_OPTION:
 			extract_flags |= WIMLIB_EXTRACT_FLAG_RECOVER_DATA;
 			break;
+		case IMAGEX_TAR_OPTION:
+			extract_flags |= WIMLIB_EXTRACT_FLAG_TAR;
+			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX)
+				goto out_err;
+			threads_specified = true;
+			break;
+		case IMAGEX_BLOB_CACHE_OPTION:
+			blob_cache_dir = optarg;
+			break;
+		case IMAGEX_BLOB_CACHE_SIZE_OPTION:
+			blob_cache_size = parse_memory_size(optarg);
+			if (blob_cache_size == UINT64_MAX)
+				goto out_err;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -1634,6 +1773,16 @@ imagex_apply(int argc, tchar **argv, int cmd)
 		if (ret)
 			goto out_free_refglobs;
 
+		if (threads_specified)
+			wimlib_set_decompression_threads(wim, num_threads);
+
+		if (blob_cache_dir) {
+			ret = wimlib_set_extract_blob_cache(wim, blob_cache_dir,
+							    blob_cache_size);
+			if (ret)
+				goto out_wimlib_free;
+		}
+
 		wimlib_get_wim_info(wim, &info);
 
 		if (argc >= 3) {
@@ -1671,8 +1820,14 @@ imagex_apply(int argc, tchar **argv, int cmd)
 			goto out_wimlib_free;
 	}
 
+	if ((extract_flags & WIMLIB_EXTRACT_FLAG_TAR) && !tstrcmp(target, T("-"))) {
+		/* Writing the archive to standard output  */
+		imagex_output_to_stderr();
+		set_fd_to_binary_mode(STDOUT_FILENO);
+	}
+
 #ifndef _WIN32
-	{
+	if (!(extract_flags & WIMLIB_EXTRACT_FLAG_TAR)) {
 		/* Interpret a regular file or block device target as an NTFS
 		 * volume.  */
 		struct stat stbuf;
@@ -1725,6 +1880,7 @@ out_free_refglobs:
 
 out_usage:
 	usage(CMD_APPLY, stderr);
+out_err:
 	ret = -1;
 	goto out_free_refglobs;
 }
@@ -1751,6 +1907,7 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 	uint32_t chunk_size = UINT32_MAX;
 	uint32_t solid_chunk_size = UINT32_MAX;
 	int solid_ctype = WIMLIB_COMPRESSION_TYPE_INVALID;
+	const tchar *compress_workers = NULL;
 	const tchar *wimfile;
 	int wim_fd;
 	const tchar *name;
@@ -1764,6 +1921,7 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 	const tchar *template_wimfile = NULL;
 	const tchar *template_image_name_or_num = NULL;
 	int template_image = WIMLIB_NO_IMAGE;
+	const tchar *hash_cache_file = NULL;
 
 	int ret;
 	unsigned num_threads = 0;
@@ -1810,6 +1968,10 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 				goto out_err;
 			break;
 		case IMAGEX_SOLID_CHUNK_SIZE_OPTION:
+			if (!tstrcmp(optarg, T("auto"))) {
+				write_flags |= WIMLIB_WRITE_FLAG_AUTO_SOLID_CHUNK_SIZE;
+				break;
+			}
 			solid_chunk_size = parse_chunk_size(optarg);
 			if (solid_chunk_size == UINT32_MAX)
 				goto out_err;
@@ -1825,6 +1987,9 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		case IMAGEX_NO_SOLID_SORT_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_NO_SOLID_SORT;
 			break;
+		case IMAGEX_SKIP_INCOMPRESSIBLE_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_SKIP_INCOMPRESSIBLE;
+			break;
 		case IMAGEX_FLAGS_OPTION: {
 			tchar *p = alloca((6 + tstrlen(optarg) + 1) * sizeof(tchar));
 			tsprintf(p, T("FLAGS=%"TS), optarg);
@@ -1849,6 +2014,9 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 			if (num_threads == UINT_MAX)
 				goto out_err;
 			break;
+		case IMAGEX_COMPRESS_WORKERS_OPTION:
+			compress_workers = optarg;
+			break;
 		case IMAGEX_REBUILD_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_REBUILD;
 			break;
@@ -1898,6 +2066,9 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 			imagex_printf(T("[WARNING] '--update-of' is unreliable on Windows!\n"));
 		#endif
 			break;
+		case IMAGEX_HASH_CACHE_OPTION:
+			hash_cache_file = optarg;
+			break;
 		case IMAGEX_DELTA_FROM_OPTION:
 			ret = string_list_append(&base_wimfiles, optarg);
 			if (ret)
@@ -1913,6 +2084,15 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		case IMAGEX_SNAPSHOT_OPTION:
 			add_flags |= WIMLIB_ADD_FLAG_SNAPSHOT;
 			break;
+		case IMAGEX_OVERLAPPED_READS_OPTION:
+			add_flags |= WIMLIB_ADD_FLAG_OVERLAPPED_READS;
+			break;
+		case IMAGEX_DISK_ORDER_OPTION:
+			add_flags |= WIMLIB_ADD_FLAG_DISK_ORDER;
+			break;
+		case IMAGEX_TAR_OPTION:
+			add_flags |= WIMLIB_ADD_FLAG_TAR;
+			break;
 		case IMAGEX_CREATE_OPTION:
 			if (cmd == CMD_CAPTURE) {
 				imagex_error(T("'--create' is only valid for 'wimappend', not 'wimcapture'"));
@@ -2126,11 +2306,17 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		if (ret)
 			goto out_free_wim;
 	}
+	if (compress_workers) {
+		ret = wimlib_set_output_compression_workers(wim,
+							    compress_workers);
+		if (ret)
+			goto out_free_wim;
+	}
 
 #ifndef _WIN32
 	/* Detect if source is regular file or block device and set NTFS volume
 	 * capture mode.  */
-	if (!source_list) {
+	if (!source_list && !(add_flags & WIMLIB_ADD_FLAG_TAR)) {
 		struct stat stbuf;
 
 		if (tstat(source, &stbuf) == 0) {
@@ -2201,6 +2387,12 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		base_wims = NULL;
 	}
 
+	if (hash_cache_file) {
+		ret = wimlib_set_capture_hash_cache(wim, hash_cache_file);
+		if (ret)
+			goto out_free_base_wims;
+	}
+
 	/* If capturing or appending as an update of an existing (template) image,
 	 * open the WIM if needed and parse the image index.  */
 	if (template_image_name_or_num) {
@@ -2249,6 +2441,16 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 							template_wimfile);
 		if (ret)
 			goto out_free_template_wim;
+
+		/* Compare the files with the template image as they are
+		 * scanned.  */
+		imagex_printf(T("Using image %d "
+				"from \"%"TS"\" as template\n"),
+				template_image, template_wimfile);
+		ret = wimlib_set_capture_template(wim, template_wim,
+						  template_image);
+		if (ret)
+			goto out_free_template_wim;
 	}
 
 	ret = wimlib_add_image_multisource(wim,
@@ -2260,10 +2462,8 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 	if (ret)
 		goto out_free_template_wim;
 
-	if (image_properties.num_strings || template_image_name_or_num) {
-		/* User asked to set additional image properties, or an image on
-		 * which the added one is to be based has been specified with
-		 * --update-of.  */
+	if (image_properties.num_strings) {
+		/* User asked to set additional image properties.  */
 		struct wimlib_wim_info info;
 
 		wimlib_get_wim_info(wim, &info);
@@ -2272,20 +2472,6 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 					     info.image_count, NULL);
 		if (ret)
 			goto out_free_template_wim;
-
-		/* Reference template image if the user provided one.  */
-		if (template_image_name_or_num) {
-			imagex_printf(T("Using image %d "
-					"from \"%"TS"\" as template\n"),
-					template_image, template_wimfile);
-			ret = wimlib_reference_template_image(wim,
-							      info.image_count,
-							      template_wim,
-							      template_image,
-							      0);
-			if (ret)
-				goto out_free_template_wim;
-		}
 	}
 
 	/* Write the new WIM or overwrite the existing WIM with the new image
@@ -2354,6 +2540,9 @@ imagex_delete(int argc, tchar **argv, int cmd)
 		case IMAGEX_SOFT_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_SOFT_DELETE;
 			break;
+		case IMAGEX_SAFE_COMPACT_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_SAFE_COMPACT;
+			break;
 		case IMAGEX_UNSAFE_COMPACT_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_UNSAFE_COMPACT;
 			break;
@@ -2802,6 +2991,9 @@ imagex_export(int argc, tchar **argv, int cmd)
 	uint32_t chunk_size = UINT32_MAX;
 	uint32_t solid_chunk_size = UINT32_MAX;
 	int solid_ctype = WIMLIB_COMPRESSION_TYPE_INVALID;
+	const tchar *compress_workers = NULL;
+	const tchar *delta_from_wimfile = NULL;
+	WIMStruct *base_wim = NULL;
 
 	for_opt(c, export_options) {
 		switch (c) {
@@ -2831,12 +3023,19 @@ imagex_export(int argc, tchar **argv, int cmd)
 		case IMAGEX_NO_SOLID_SORT_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_NO_SOLID_SORT;
 			break;
+		case IMAGEX_SKIP_INCOMPRESSIBLE_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_SKIP_INCOMPRESSIBLE;
+			break;
 		case IMAGEX_CHUNK_SIZE_OPTION:
 			chunk_size = parse_chunk_size(optarg);
 			if (chunk_size == UINT32_MAX)
 				goto out_err;
 			break;
 		case IMAGEX_SOLID_CHUNK_SIZE_OPTION:
+			if (!tstrcmp(optarg, T("auto"))) {
+				write_flags |= WIMLIB_WRITE_FLAG_AUTO_SOLID_CHUNK_SIZE;
+				break;
+			}
 			solid_chunk_size = parse_chunk_size(optarg);
 			if (solid_chunk_size == UINT32_MAX)
 				goto out_err;
@@ -2856,6 +3055,12 @@ imagex_export(int argc, tchar **argv, int cmd)
 			if (num_threads == UINT_MAX)
 				goto out_err;
 			break;
+		case IMAGEX_COMPRESS_WORKERS_OPTION:
+			compress_workers = optarg;
+			break;
+		case IMAGEX_DELTA_FROM_OPTION:
+			delta_from_wimfile = optarg;
+			break;
 		case IMAGEX_REBUILD_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_REBUILD;
 			break;
@@ -2919,6 +3124,13 @@ imagex_export(int argc, tchar **argv, int cmd)
 		wim_is_new = false;
 		/* Destination file exists. */
 
+		if (delta_from_wimfile) {
+			imagex_error(T("'--delta-from' is only valid when "
+				       "exporting to a new WIM file!"));
+			ret = -1;
+			goto out_free_src_wim;
+		}
+
 		if (!S_ISREG(stbuf.st_mode) && !S_ISBLK(stbuf.st_mode)) {
 			imagex_error(T("\"%"TS"\" is not a regular file "
 				       "or block device"), dest_wimfile);
@@ -2967,6 +3179,13 @@ imagex_export(int argc, tchar **argv, int cmd)
 			goto out_free_src_wim;
 		}
 
+		if (delta_from_wimfile && !dest_wimfile) {
+			imagex_error(T("'--delta-from' is not valid when "
+				       "exporting to standard output!"));
+			ret = -1;
+			goto out_free_src_wim;
+		}
+
 		/* dest_wimfile is not an existing file, so create a new WIM. */
 
 		if (compression_type == WIMLIB_COMPRESSION_TYPE_INVALID) {
@@ -3017,6 +3236,12 @@ imagex_export(int argc, tchar **argv, int cmd)
 		if (ret)
 			goto out_free_dest_wim;
 	}
+	if (compress_workers) {
+		ret = wimlib_set_output_compression_workers(dest_wim,
+							    compress_workers);
+		if (ret)
+			goto out_free_dest_wim;
+	}
 
 	image = wimlib_resolve_image(src_wim, src_image_num_or_name);
 	ret = verify_image_exists(image, src_image_num_or_name, src_wimfile);
@@ -3050,7 +3275,26 @@ imagex_export(int argc, tchar **argv, int cmd)
 		goto out_free_dest_wim;
 	}
 
-	if (!wim_is_new)
+	if (delta_from_wimfile) {
+		struct wimlib_delta_stats stats;
+		const tchar *unit_name;
+		unsigned unit_shift;
+
+		ret = wimlib_open_wim(delta_from_wimfile, open_flags, &base_wim);
+		if (ret)
+			goto out_free_dest_wim;
+		ret = wimlib_write_delta(dest_wim, base_wim, dest_wimfile,
+					 WIMLIB_ALL_IMAGES, write_flags,
+					 num_threads, &stats);
+		if (ret)
+			goto out_free_base_wim;
+		unit_shift = get_unit(stats.bytes_omitted, &unit_name);
+		imagex_printf(T("Omitted %"PRIu64" blobs (%"PRIu64" %"TS") "
+				"already in \"%"TS"\"\n"),
+			      stats.num_blobs_omitted,
+			      stats.bytes_omitted >> unit_shift, unit_name,
+			      delta_from_wimfile);
+	} else if (!wim_is_new)
 		ret = wimlib_overwrite(dest_wim, write_flags, num_threads);
 	else if (dest_wimfile)
 		ret = wimlib_write(dest_wim, dest_wimfile, WIMLIB_ALL_IMAGES,
@@ -3059,6 +3303,8 @@ imagex_export(int argc, tchar **argv, int cmd)
 		ret = wimlib_write_to_fd(dest_wim, dest_wim_fd,
 					 WIMLIB_ALL_IMAGES, write_flags,
 					 num_threads);
+out_free_base_wim:
+	wimlib_free(base_wim);
 out_free_dest_wim:
 	wimlib_free(dest_wim);
 out_free_src_wim:
@@ -3090,6 +3336,10 @@ imagex_extract(int argc, tchar **argv, int cmd)
 			    WIMLIB_EXTRACT_FLAG_GLOB_PATHS |
 			    WIMLIB_EXTRACT_FLAG_STRICT_GLOB;
 	int notlist_extract_flags = WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE;
+	unsigned num_threads = 0;
+	bool threads_specified = false;
+	const tchar *blob_cache_dir = NULL;
+	uint64_t blob_cache_size = DEFAULT_BLOB_CACHE_SIZE;
 
 	STRING_LIST(refglobs);
 
@@ -3120,6 +3370,15 @@ imagex_extract(int argc, tchar **argv, int cmd)
 		case IMAGEX_NO_ATTRIBUTES_OPTION:
 			extract_flags |= WIMLIB_EXTRACT_FLAG_NO_ATTRIBUTES;
 			break;
+		case IMAGEX_NO_PREALLOCATE_OPTION:
+			extract_flags |= WIMLIB_EXTRACT_FLAG_NO_PREALLOCATE;
+			break;
+		case IMAGEX_CLONE_DUPLICATES_OPTION:
+			extract_flags |= WIMLIB_EXTRACT_FLAG_CLONE_DUPLICATES;
+			break;
+		case IMAGEX_TARGET_ORDER_OPTION:
+			extract_flags |= WIMLIB_EXTRACT_FLAG_TARGET_ORDER;
+			break;
 		case IMAGEX_DEST_DIR_OPTION:
 			dest_dir = optarg;
 			break;
@@ -3152,6 +3411,28 @@ imagex_extract(int argc, tchar **argv, int cmd)
 		case IMAGEX_RECOVER_DATA_OPTION:
 			extract_flags |= WIMLIB_EXTRACT_FLAG_RECOVER_DATA;
 			break;
+		case IMAGEX_TAR_OPTION:
+			extract_flags |= WIMLIB_EXTRACT_FLAG_TAR;
+			dest_dir = optarg;
+			if (!tstrcmp(dest_dir, T("-"))) {
+				imagex_output_to_stderr();
+				set_fd_to_binary_mode(STDOUT_FILENO);
+			}
+			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX)
+				goto out_err;
+			threads_specified = true;
+			break;
+		case IMAGEX_BLOB_CACHE_OPTION:
+			blob_cache_dir = optarg;
+			break;
+		case IMAGEX_BLOB_CACHE_SIZE_OPTION:
+			blob_cache_size = parse_memory_size(optarg);
+			if (blob_cache_size == UINT64_MAX)
+				goto out_err;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -3180,6 +3461,16 @@ imagex_extract(int argc, tchar **argv, int cmd)
 	if (ret)
 		goto out_free_refglobs;
 
+	if (threads_specified)
+		wimlib_set_decompression_threads(wim, num_threads);
+
+	if (blob_cache_dir) {
+		ret = wimlib_set_extract_blob_cache(wim, blob_cache_dir,
+						    blob_cache_size);
+		if (ret)
+			goto out_wimlib_free;
+	}
+
 	image = wimlib_resolve_image(wim, image_num_or_name);
 	ret = verify_image_exists_and_is_single(image,
 						image_num_or_name,
@@ -3199,6 +3490,21 @@ imagex_extract(int argc, tchar **argv, int cmd)
 		extract_flags &= ~WIMLIB_EXTRACT_FLAG_GLOB_PATHS;
 	}
 
+	if (extract_flags & WIMLIB_EXTRACT_FLAG_TAR) {
+		/* Each extraction below would write a new archive.  */
+		int num_listfiles = 0;
+
+		for (int i = 0; i < argc; i++)
+			if (argv[i][0] == T('@'))
+				num_listfiles++;
+		if (num_listfiles > 1 || (num_listfiles == 1 && argc > 1)) {
+			imagex_error(T("With --tar, give either paths or one "
+				       "@LISTFILE, not both"));
+			ret = -1;
+			goto out_wimlib_free;
+		}
+	}
+
 	while (argc != 0 && ret == 0) {
 		int num_paths;
 
@@ -3582,6 +3888,8 @@ imagex_mount_rw_or_ro(int argc, tchar **argv, int cmd)
 	struct wimlib_wim_info info;
 	int image;
 	int ret;
+	unsigned num_threads = 0;
+	bool threads_specified = false;
 
 	STRING_LIST(refglobs);
 
@@ -3625,6 +3933,12 @@ imagex_mount_rw_or_ro(int argc, tchar **argv, int cmd)
 		case IMAGEX_UNIX_DATA_OPTION:
 			mount_flags |= WIMLIB_MOUNT_FLAG_UNIX_DATA;
 			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX)
+				goto out_err;
+			threads_specified = true;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -3641,6 +3955,9 @@ imagex_mount_rw_or_ro(int argc, tchar **argv, int cmd)
 	if (ret)
 		goto out_free_refglobs;
 
+	if (threads_specified)
+		wimlib_set_decompression_threads(wim, num_threads);
+
 	wimlib_get_wim_info(wim, &info);
 
 	if (argc >= 3) {
@@ -3688,6 +4005,7 @@ out_free_refglobs:
 
 out_usage:
 	usage(cmd, stderr);
+out_err:
 	ret = -1;
 	goto out_free_refglobs;
 }
@@ -3704,6 +4022,7 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 	uint32_t chunk_size = UINT32_MAX;
 	uint32_t solid_chunk_size = UINT32_MAX;
 	int solid_ctype = WIMLIB_COMPRESSION_TYPE_INVALID;
+	const tchar *compress_workers = NULL;
 	int ret;
 	WIMStruct *wim;
 	struct wimlib_wim_info info;
@@ -3711,6 +4030,7 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 	off_t old_size;
 	off_t new_size;
 	unsigned num_threads = 0;
+	bool estimate = false;
 
 	for_opt(c, optimize_options) {
 		switch (c) {
@@ -3738,6 +4058,10 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 				goto out_err;
 			break;
 		case IMAGEX_SOLID_CHUNK_SIZE_OPTION:
+			if (!tstrcmp(optarg, T("auto"))) {
+				write_flags |= WIMLIB_WRITE_FLAG_AUTO_SOLID_CHUNK_SIZE;
+				break;
+			}
 			solid_chunk_size = parse_chunk_size(optarg);
 			if (solid_chunk_size == UINT32_MAX)
 				goto out_err;
@@ -3757,20 +4081,33 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 		case IMAGEX_NO_SOLID_SORT_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_NO_SOLID_SORT;
 			break;
+		case IMAGEX_SKIP_INCOMPRESSIBLE_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_SKIP_INCOMPRESSIBLE;
+			break;
 		case IMAGEX_THREADS_OPTION:
 			num_threads = parse_num_threads(optarg);
 			if (num_threads == UINT_MAX)
 				goto out_err;
 			break;
+		case IMAGEX_COMPRESS_WORKERS_OPTION:
+			compress_workers = optarg;
+			break;
 		case IMAGEX_PIPABLE_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_PIPABLE;
 			break;
 		case IMAGEX_NOT_PIPABLE_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_NOT_PIPABLE;
 			break;
+		case IMAGEX_SAFE_COMPACT_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_SAFE_COMPACT;
+			break;
 		case IMAGEX_UNSAFE_COMPACT_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_UNSAFE_COMPACT;
 			break;
+		case IMAGEX_ESTIMATE_OPTION:
+			estimate = true;
+			open_flags &= ~WIMLIB_OPEN_FLAG_WRITE_ACCESS;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -3781,6 +4118,13 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 	if (argc != 1)
 		goto out_usage;
 
+	if (estimate && (write_flags & (WIMLIB_WRITE_FLAG_SAFE_COMPACT |
+					WIMLIB_WRITE_FLAG_UNSAFE_COMPACT))) {
+		imagex_error(T("'--estimate' cannot be combined with "
+			       "compaction!"));
+		goto out_err;
+	}
+
 	wimfile = argv[0];
 
 	ret = wimlib_open_wim_with_progress(wimfile, open_flags, &wim,
@@ -3818,6 +4162,12 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 		if (ret)
 			goto out_wimlib_free;
 	}
+	if (compress_workers) {
+		ret = wimlib_set_output_compression_workers(wim,
+							    compress_workers);
+		if (ret)
+			goto out_wimlib_free;
+	}
 
 	old_size = file_get_size(wimfile);
 	tprintf(T("\"%"TS"\" original size: "), wimfile);
@@ -3826,6 +4176,29 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 	else
 		tprintf(T("%"PRIu64" KiB\n"), old_size >> 10);
 
+	if (estimate) {
+		struct wimlib_write_estimate est;
+
+		ret = wimlib_estimate_write(wim, WIMLIB_ALL_IMAGES,
+					    write_flags, num_threads, &est);
+		if (ret) {
+			imagex_error(T("Estimating the optimization of "
+				       "\"%"TS"\" failed."), wimfile);
+			goto out_wimlib_free;
+		}
+		tprintf(T("\"%"TS"\" estimated optimized size: %"PRIu64" KiB\n"),
+			wimfile, est.estimated_size >> 10);
+		tprintf(T("Estimated from compressing %"PRIu64" KiB of the "
+			  "%"PRIu64" KiB to compress\n"),
+			est.sampled_bytes >> 10, est.bytes_to_compress >> 10);
+		tprintf(T("Data copied without recompression: %"PRIu64" KiB\n"),
+			est.raw_copy_bytes >> 10);
+		tprintf(T("Estimated compression time: %"PRIu64".%u seconds\n"),
+			est.estimated_compression_ms / 1000,
+			(unsigned)(est.estimated_compression_ms % 1000 / 100));
+		goto out_wimlib_free;
+	}
+
 	ret = wimlib_overwrite(wim, write_flags, num_threads);
 	if (ret) {
 		imagex_error(T("Optimization of \"%"TS"\" failed."), wimfile);
@@ -3879,6 +4252,9 @@ imagex_split(int argc, tchar **argv, int cmd)
 		case IMAGEX_INCLUDE_INTEGRITY_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_CHECK_INTEGRITY;
 			break;
+		case IMAGEX_CONCURRENT_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_CONCURRENT_PARTS;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -4234,6 +4610,8 @@ imagex_verify(int argc, tchar **argv, int cmd)
 	WIMStruct *wim;
 	int open_flags = WIMLIB_OPEN_FLAG_CHECK_INTEGRITY;
 	int verify_flags = 0;
+	unsigned num_threads = 0;
+	bool threads_specified = false;
 	STRING_LIST(refglobs);
 	int c;
 
@@ -4247,6 +4625,18 @@ imagex_verify(int argc, tchar **argv, int cmd)
 		case IMAGEX_NOCHECK_OPTION:
 			open_flags &= ~WIMLIB_OPEN_FLAG_CHECK_INTEGRITY;
 			break;
+		case IMAGEX_CACHE_OPTION:
+			verify_flags |= WIMLIB_VERIFY_FLAG_USE_CACHE;
+			break;
+		case IMAGEX_FORCE_OPTION:
+			verify_flags |= WIMLIB_VERIFY_FLAG_FORCE;
+			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX)
+				goto out_err;
+			threads_specified = true;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -4273,6 +4663,9 @@ imagex_verify(int argc, tchar **argv, int cmd)
 	if (ret)
 		goto out_free_refglobs;
 
+	if (threads_specified)
+		wimlib_set_decompression_threads(wim, num_threads);
+
 	ret = wim_reference_globs(wim, &refglobs, open_flags);
 	if (ret)
 		goto out_wimlib_free;
@@ -4301,6 +4694,7 @@ out_free_refglobs:
 
 out_usage:
 	usage(CMD_VERIFY, stderr);
+out_err:
 	ret = -1;
 	goto out_free_refglobs;
 }
@@ -4358,8 +4752,10 @@ T(
 "                    [--boot] [--check] [--nocheck] [--config=FILE]\n"
 "                    [--threads=NUM_THREADS] [--no-acls] [--strict-acls]\n"
 "                    [--rpfix] [--norpfix] [--update-of=[WIMFILE:]IMAGE]\n"
-"                    [--delta-from=WIMFILE] [--wimboot] [--unix-data]\n"
-"                    [--dereference] [--snapshot] [--create]\n"
+"                    [--hash-cache=FILE] [--delta-from=WIMFILE]\n"
+"                    [--wimboot] [--unix-data] [--dereference] [--snapshot]\n"
+"                    [--overlapped-reads] [--disk-order] [--tar]\n"
+"                    [--create]\n"
 ),
 [CMD_APPLY] =
 T(
@@ -4367,7 +4763,10 @@ T(
 "                    [--check] [--ref=\"GLOB\"] [--no-acls] [--strict-acls]\n"
 "                    [--no-attributes] [--rpfix] [--norpfix]\n"
 "                    [--include-invalid-names] [--wimboot] [--unix-data]\n"
-"                    [--compact=FORMAT] [--recover-data]\n"
+"                    [--compact=FORMAT] [--recover-data] [--no-preallocate]\n"
+"                    [--clone-duplicates] [--target-order] [--tar]\n"
+"                    [--threads=NUM_THREADS] [--blob-cache=DIR]\n"
+"                    [--blob-cache-size=SIZE]\n"
 ),
 [CMD_CAPTURE] =
 T(
@@ -4375,9 +4774,10 @@ T(
 "                    [--compress=TYPE] [--boot] [--check] [--nocheck]\n"
 "                    [--config=FILE] [--threads=NUM_THREADS]\n"
 "                    [--no-acls] [--strict-acls] [--rpfix] [--norpfix]\n"
-"                    [--update-of=[WIMFILE:]IMAGE] [--delta-from=WIMFILE]\n"
-"                    [--wimboot] [--unix-data] [--dereference] [--solid]\n"
-"                    [--snapshot]\n"
+"                    [--update-of=[WIMFILE:]IMAGE] [--hash-cache=FILE]\n"
+"                    [--delta-from=WIMFILE] [--wimboot] [--unix-data]\n"
+"                    [--dereference] [--solid] [--snapshot]\n"
+"                    [--overlapped-reads] [--disk-order] [--tar]\n"
 ),
 [CMD_DELETE] =
 T(
@@ -4393,7 +4793,7 @@ T(
 "                        [DEST_IMAGE_NAME [DEST_IMAGE_DESC]]\n"
 "                    [--boot] [--check] [--nocheck] [--compress=TYPE]\n"
 "                    [--ref=\"GLOB\"] [--threads=NUM_THREADS] [--rebuild]\n"
-"                    [--wimboot] [--solid]\n"
+"                    [--wimboot] [--solid] [--delta-from=WIMFILE]\n"
 ),
 [CMD_EXTRACT] =
 T(
@@ -4402,6 +4802,10 @@ T(
 "                    [--to-stdout] [--no-acls] [--strict-acls]\n"
 "                    [--no-attributes] [--include-invalid-names] [--no-globs]\n"
 "                    [--nullglob] [--preserve-dir-structure] [--recover-data]\n"
+"                    [--no-preallocate] [--clone-duplicates]\n"
+"                    [--target-order] [--tar=ARCHIVE]\n"
+"                    [--threads=NUM_THREADS] [--blob-cache=DIR]\n"
+"                    [--blob-cache-size=SIZE]\n"
 ),
 [CMD_INFO] =
 T(
@@ -4420,24 +4824,27 @@ T(
 "    %"TS" WIMFILE [IMAGE] DIRECTORY\n"
 "                    [--check] [--streams-interface=INTERFACE]\n"
 "                    [--ref=\"GLOB\"] [--allow-other] [--unix-data]\n"
+"                    [--threads=NUM_THREADS]\n"
 ),
 [CMD_MOUNTRW] =
 T(
 "    %"TS" WIMFILE [IMAGE] DIRECTORY\n"
 "                    [--check] [--streams-interface=INTERFACE]\n"
 "                    [--staging-dir=CMD_DIR] [--allow-other] [--unix-data]\n"
+"                    [--threads=NUM_THREADS]\n"
 ),
 #endif
 [CMD_OPTIMIZE] =
 T(
 "    %"TS" WIMFILE\n"
 "                    [--recompress] [--compress=TYPE] [--threads=NUM_THREADS]\n"
-"                    [--check] [--nocheck] [--solid]\n"
+"                    [--check] [--nocheck] [--solid] [--estimate]\n"
 "\n"
 ),
 [CMD_SPLIT] =
 T(
 "    %"TS" WIMFILE SPLIT_WIM_PART_1 PART_SIZE_MB [--check]\n"
+"                    [--concurrent]\n"
 ),
 #if WIM_MOUNTING_SUPPORTED
 [CMD_UNMOUNT] =
@@ -4456,12 +4863,14 @@ T(
 ),
 [CMD_VERIFY] =
 T(
-"    %"TS" WIMFILE [--ref=\"GLOB\"]\n"
+"    %"TS" WIMFILE [--ref=\"GLOB\"] [--nocheck] [--cache [--force]]\n"
+"                    [--threads=NUM_THREADS]\n"
 ),
 };
 
 static const tchar *invocation_name;
 static int invocation_cmd = CMD_NONE;
+static bool print_stats;
 
 static const tchar *get_cmd_string(int cmd, bool only_short_form)
 {
@@ -4521,6 +4930,37 @@ do_common_options(int *argc_p, tchar **argv, int cmd)
 					(argc - i) * sizeof(argv[i]));
 				argc--;
 				i--;
+			} else if (!tstrcmp(p, T("stats"))) {
+				print_stats = true;
+				wimlib_set_perf_counters_enabled(true);
+				memmove(&argv[i], &argv[i + 1],
+					(argc - i) * sizeof(argv[i]));
+				argc--;
+				i--;
+			} else if (!tstrncmp(p, T("max-memory"), 10) &&
+				   (p[10] == T('=') || p[10] == T('\0'))) {
+				const tchar *arg;
+				int nargs = 1;
+				uint64_t max_memory;
+
+				if (p[10] == T('=')) {
+					arg = &p[11];
+				} else if (i + 1 < argc) {
+					arg = argv[i + 1];
+					nargs = 2;
+				} else {
+					imagex_error(T("--max-memory requires "
+						       "an argument"));
+					exit(2);
+				}
+				max_memory = parse_memory_size(arg);
+				if (max_memory == UINT64_MAX)
+					exit(2);
+				wimlib_set_memory_budget(max_memory);
+				memmove(&argv[i], &argv[i + nargs],
+					(argc - i - nargs + 1) * sizeof(argv[i]));
+				argc -= nargs;
+				i--;
 			} else if (!*p) /* reached "--", no more options */
 				break;
 		}
@@ -4529,6 +4969,45 @@ do_common_options(int *argc_p, tchar **argv, int cmd)
 	*argc_p = argc;
 }
 
+/* Print the counters of where wimlib spent its time, for --stats.  This goes
+ * to standard error so that it can't mix with data written to standard
+ * output.  */
+static void
+print_perf_counters(void)
+{
+	struct wimlib_perf_counters counters;
+	const struct {
+		const tchar *name;
+		const struct wimlib_perf_counter *counter;
+	} stages[] = {
+		{ T("Read"),           &counters.read },
+		{ T("Write"),          &counters.write },
+		{ T("Fsync"),          &counters.fsync },
+		{ T("Hash"),           &counters.hash },
+		{ T("Compress"),       &counters.compress },
+		{ T("Decompress"),     &counters.decompress },
+		{ T("Metadata read"),  &counters.metadata_read },
+		{ T("Metadata write"), &counters.metadata_write },
+		{ T("Compress wait"),  &counters.compress_wait },
+	};
+
+	wimlib_get_perf_counters(&counters);
+
+	imagex_flush_output();
+
+	tfprintf(stderr, T("\n%-16"TS" %12"TS" %14"TS" %12"TS"\n"),
+		 T("Stage"), T("Time"), T("Bytes"), T("Count"));
+	for (size_t i = 0; i < ARRAY_LEN(stages); i++) {
+		const struct wimlib_perf_counter *c = stages[i].counter;
+		const tchar *unit_name;
+		unsigned unit_shift = get_unit(c->bytes, &unit_name);
+
+		tfprintf(stderr, T("%-16"TS" %10.3f s %8"PRIu64" %-5"TS" %12"PRIu64"\n"),
+			 stages[i].name, c->nanoseconds / 1e9,
+			 c->bytes >> unit_shift, unit_name, c->count);
+	}
+}
+
 static void
 print_usage_string(int cmd, FILE *fp)
 {
@@ -4673,6 +5152,9 @@ main(int argc, tchar **argv)
 	/* Call the command handler function.  */
 	ret = imagex_commands[cmd].func(argc, argv, cmd);
 
+	if (print_stats)
+		print_perf_counters();
+
 	/* Check for error writing to standard output, especially since for some
 	 * commands, writing to standard output is part of the program's actual
 	 * behavior and not just for informational purposes.  */
@@ -0,0 +1,120 @@
+/*
+ * arena.c
+ *
+ * A memory arena from which many small objects can be allocated cheaply and
+ * then freed all at once.
+ *
+ * This is used for the dentries and inodes of an image that are read from its
+ * metadata resource.  An image can have hundreds of thousands of files, and
+ * allocating each dentry, inode, and name separately would cost several heap
+ * allocations per file when the image is loaded, another walk over all of them
+ * when it is freed, and lots of heap fragmentation.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include "wimlib/arena.h"
+#include "wimlib/util.h"
+
+/* Size of the chunks from which small objects are allocated  */
+#define ARENA_CHUNK_SIZE	65536
+
+#define ARENA_ALIGNMENT		8
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	u8 data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+/*
+ * Allocate @size bytes, aligned to 8 bytes, from the arena.  The memory is
+ * uninitialized.  Returns NULL if out of memory.
+ */
+void *
+arena_alloc(struct mem_arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	void *p;
+
+	size = ALIGN(size, ARENA_ALIGNMENT);
+
+	if (likely(size <= (size_t)(arena->end - arena->next))) {
+		p = arena->next;
+		arena->next += size;
+		return p;
+	}
+
+	if (size > ARENA_CHUNK_SIZE / 4) {
+		/* Give a large object its own chunk, and keep using the
+		 * current chunk for the small objects that follow.  */
+		chunk = MALLOC(sizeof(*chunk) + size);
+		if (!chunk)
+			return NULL;
+		if (arena->chunks) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = NULL;
+			arena->chunks = chunk;
+		}
+		return chunk->data;
+	}
+
+	chunk = MALLOC(sizeof(*chunk) + ARENA_CHUNK_SIZE);
+	if (!chunk)
+		return NULL;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->next = chunk->data + size;
+	arena->end = chunk->data + ARENA_CHUNK_SIZE;
+	return chunk->data;
+}
+
+/* Like arena_alloc(), but zero the memory.  */
+void *
+arena_zalloc(struct mem_arena *arena, size_t size)
+{
+	void *p = arena_alloc(arena, size);
+
+	if (p)
+		memset(p, 0, size);
+	return p;
+}
+
+/* Free all memory that was allocated from the arena, and make it empty.  */
+void
+arena_destroy(struct mem_arena *arena)
+{
+	struct arena_chunk *chunk = arena->chunks;
+
+	while (chunk) {
+		struct arena_chunk *next = chunk->next;
+
+		FREE(chunk);
+		chunk = next;
+	}
+	arena->chunks = NULL;
+	arena->next = NULL;
+	arena->end = NULL;
+}
@@ -0,0 +1,369 @@
+/*
+ * async.c
+ *
+ * Asynchronous versions of wimlib_extract_image(), wimlib_write(), and
+ * wimlib_overwrite().  Each operation is queued and run by one of a small set
+ * of threads owned by the library.  These are separate from the task pool,
+ * since an operation waits for the tasks it submits, and tasks must never wait
+ * for other tasks.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib.h"
+#include "wimlib/async.h"
+#include "wimlib/error.h"
+#include "wimlib/list.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
+
+/* The most threads that will be created to run operations.  The actual limit
+ * is the number of processors, but at least 2.  */
+#define MAX_ASYNC_RUNNERS	64
+
+enum async_op_type {
+	ASYNC_EXTRACT_IMAGE,
+	ASYNC_WRITE,
+	ASYNC_OVERWRITE,
+};
+
+struct wimlib_operation {
+	enum async_op_type type;
+	WIMStruct *wim;
+	int image;
+	tchar *path;
+	int flags;
+	unsigned num_threads;
+
+	wimlib_completion_func_t completion_func;
+	void *completion_ctx;
+
+	/* The progress function registered with @wim, which async_progress()
+	 * forwards messages to while the operation runs  */
+	wimlib_progress_func_t progfunc;
+	void *progctx;
+
+	/* Set by wimlib_cancel_operation(); read without the lock  */
+	bool cancelled;
+
+	/* The following are protected by 'async_lock'  */
+	bool done;
+	int result;
+	struct list_head queue_list;
+};
+
+static struct mutex async_lock = MUTEX_INITIALIZER;
+
+/* Signalled when an operation is queued or the runners should exit  */
+static struct condvar async_queue_cond;
+
+/* Broadcast when an operation completes  */
+static struct condvar async_done_cond;
+
+static bool async_initialized;
+static bool async_stopping;
+static LIST_HEAD(async_queue);
+static struct thread async_runners[MAX_ASYNC_RUNNERS];
+static unsigned async_num_runners;
+static unsigned async_num_idle;
+static unsigned async_num_queued;
+
+static enum wimlib_progress_status
+async_progress(enum wimlib_progress_msg msg, union wimlib_progress_info *info,
+	       void *progctx)
+{
+	struct wimlib_operation *op = progctx;
+
+	if (__atomic_load_n(&op->cancelled, __ATOMIC_RELAXED))
+		return WIMLIB_PROGRESS_STATUS_ABORT;
+	if (op->progfunc)
+		return op->progfunc(msg, info, op->progctx);
+	return WIMLIB_PROGRESS_STATUS_CONTINUE;
+}
+
+static int
+run_operation(struct wimlib_operation *op)
+{
+	WIMStruct *wim = op->wim;
+	int ret;
+
+	if (__atomic_load_n(&op->cancelled, __ATOMIC_RELAXED))
+		return WIMLIB_ERR_ABORTED_BY_PROGRESS;
+
+	/* Interpose on the WIM's progress function so that the operation can be
+	 * cancelled at any point where it reports progress.  */
+	op->progfunc = wim->progfunc;
+	op->progctx = wim->progctx;
+	wim->progfunc = async_progress;
+	wim->progctx = op;
+
+	switch (op->type) {
+	case ASYNC_EXTRACT_IMAGE:
+		ret = wimlib_extract_image(wim, op->image, op->path, op->flags);
+		break;
+	case ASYNC_WRITE:
+		ret = wimlib_write(wim, op->path, op->image, op->flags,
+				   op->num_threads);
+		break;
+	default:
+		ret = wimlib_overwrite(wim, op->flags, op->num_threads);
+		break;
+	}
+
+	wim->progfunc = op->progfunc;
+	wim->progctx = op->progctx;
+	return ret;
+}
+
+static void *
+async_runner(void *_ignored)
+{
+	mutex_lock(&async_lock);
+	for (;;) {
+		struct wimlib_operation *op;
+		int ret;
+
+		while (list_empty(&async_queue) && !async_stopping)
+			condvar_wait(&async_queue_cond, &async_lock);
+		if (list_empty(&async_queue))
+			break;
+		op = list_first_entry(&async_queue, struct wimlib_operation,
+				      queue_list);
+		list_del(&op->queue_list);
+		async_num_queued--;
+		async_num_idle--;
+		mutex_unlock(&async_lock);
+
+		ret = run_operation(op);
+		if (op->completion_func)
+			(*op->completion_func)(op, ret, op->completion_ctx);
+
+		mutex_lock(&async_lock);
+		op->result = ret;
+		op->done = true;
+		async_num_idle++;
+		condvar_broadcast(&async_done_cond);
+	}
+	mutex_unlock(&async_lock);
+	return NULL;
+}
+
+/* Queue @op, starting a new runner thread if every idle runner is already
+ * going to take one of the queued operations and the limit hasn't been
+ * reached.  */
+static int
+submit_operation(struct wimlib_operation *op)
+{
+	int ret = 0;
+
+	mutex_lock(&async_lock);
+	if (!async_initialized) {
+		if (!condvar_init(&async_queue_cond)) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto out_unlock;
+		}
+		if (!condvar_init(&async_done_cond)) {
+			condvar_destroy(&async_queue_cond);
+			ret = WIMLIB_ERR_NOMEM;
+			goto out_unlock;
+		}
+		async_initialized = true;
+	}
+	if (async_num_idle <= async_num_queued &&
+	    async_num_runners < min(max(get_available_cpus(), 2),
+				    MAX_ASYNC_RUNNERS))
+	{
+		if (thread_create(&async_runners[async_num_runners],
+				  async_runner, NULL)) {
+			async_num_runners++;
+			async_num_idle++;
+		} else if (async_num_runners == 0) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto out_unlock;
+		}
+		/* Else just wait for an existing runner.  */
+	}
+	list_add_tail(&op->queue_list, &async_queue);
+	async_num_queued++;
+	condvar_signal(&async_queue_cond);
+out_unlock:
+	mutex_unlock(&async_lock);
+	return ret;
+}
+
+static int
+start_operation(enum async_op_type type, WIMStruct *wim, int image,
+		const tchar *path, int flags, unsigned num_threads,
+		wimlib_completion_func_t completion_func, void *completion_ctx,
+		struct wimlib_operation **op_ret)
+{
+	struct wimlib_operation *op;
+	int ret;
+
+	if (!wim || !op_ret)
+		return WIMLIB_ERR_INVALID_PARAM;
+	if (type != ASYNC_OVERWRITE && !path)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	ret = wimlib_global_init(0);
+	if (ret)
+		return ret;
+
+	op = CALLOC(1, sizeof(*op));
+	if (!op)
+		return WIMLIB_ERR_NOMEM;
+	op->type = type;
+	op->wim = wim;
+	op->image = image;
+	op->flags = flags;
+	op->num_threads = num_threads;
+	op->completion_func = completion_func;
+	op->completion_ctx = completion_ctx;
+	if (path) {
+		op->path = TSTRDUP(path);
+		if (!op->path) {
+			FREE(op);
+			return WIMLIB_ERR_NOMEM;
+		}
+	}
+
+	ret = submit_operation(op);
+	if (ret) {
+		FREE(op->path);
+		FREE(op);
+		return ret;
+	}
+	*op_ret = op;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_extract_image_async(WIMStruct *wim, int image, const tchar *target,
+			   int extract_flags,
+			   wimlib_completion_func_t completion_func,
+			   void *completion_ctx,
+			   struct wimlib_operation **op_ret)
+{
+	return start_operation(ASYNC_EXTRACT_IMAGE, wim, image, target,
+			       extract_flags, 0, completion_func,
+			       completion_ctx, op_ret);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_write_async(WIMStruct *wim, const tchar *path, int image,
+		   int write_flags, unsigned num_threads,
+		   wimlib_completion_func_t completion_func,
+		   void *completion_ctx,
+		   struct wimlib_operation **op_ret)
+{
+	return start_operation(ASYNC_WRITE, wim, image, path, write_flags,
+			       num_threads, completion_func, completion_ctx,
+			       op_ret);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_overwrite_async(WIMStruct *wim, int write_flags, unsigned num_threads,
+		       wimlib_completion_func_t completion_func,
+		       void *completion_ctx,
+		       struct wimlib_operation **op_ret)
+{
+	return start_operation(ASYNC_OVERWRITE, wim, 0, NULL, write_flags,
+			       num_threads, completion_func, completion_ctx,
+			       op_ret);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI bool
+wimlib_poll_operation(struct wimlib_operation *op, int *result_ret)
+{
+	bool done;
+
+	mutex_lock(&async_lock);
+	done = op->done;
+	if (done && result_ret)
+		*result_ret = op->result;
+	mutex_unlock(&async_lock);
+	return done;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_wait_operation(struct wimlib_operation *op)
+{
+	int ret;
+
+	mutex_lock(&async_lock);
+	while (!op->done)
+		condvar_wait(&async_done_cond, &async_lock);
+	ret = op->result;
+	mutex_unlock(&async_lock);
+	return ret;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_cancel_operation(struct wimlib_operation *op)
+{
+	__atomic_store_n(&op->cancelled, true, __ATOMIC_RELAXED);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_free_operation(struct wimlib_operation *op)
+{
+	if (!op)
+		return;
+	wimlib_wait_operation(op);
+	FREE(op->path);
+	FREE(op);
+}
+
+/* Wait for all queued and running operations to complete, then stop the runner
+ * threads.  The operations' handles remain valid until freed.  */
+void
+async_cleanup(void)
+{
+	mutex_lock(&async_lock);
+	if (!async_initialized) {
+		mutex_unlock(&async_lock);
+		return;
+	}
+	async_stopping = true;
+	condvar_broadcast(&async_queue_cond);
+	mutex_unlock(&async_lock);
+
+	for (unsigned i = 0; i < async_num_runners; i++)
+		thread_join(&async_runners[i]);
+
+	/* Only one thread may be active in the library now.  */
+	condvar_destroy(&async_queue_cond);
+	condvar_destroy(&async_done_cond);
+	async_num_runners = 0;
+	async_num_idle = 0;
+	async_num_queued = 0;
+	async_stopping = false;
+	async_initialized = false;
+}
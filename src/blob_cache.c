@@ -0,0 +1,604 @@
+/*
+ * blob_cache.c
+ *
+ * A directory of the uncompressed data of blobs extracted earlier, so that
+ * later extractions of the same blobs can copy them from there instead of
+ * reading and decompressing them again.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_FILE_H
+#  include <sys/file.h>
+#endif
+#include <unistd.h>
+
+#include "wimlib/blob_cache.h"
+#include "wimlib/blob_table.h"
+#include "wimlib/endianness.h"
+#include "wimlib/error.h"
+#include "wimlib/file_io.h"
+#include "wimlib/paths.h"
+#include "wimlib/sha1.h"
+#include "wimlib/timestamp.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
+#include "wimlib/win32.h" /* win32_rename_replacement() */
+
+/*
+ * The data of each cached blob is in a file in the cache directory named after
+ * the blob's SHA-1 message digest in hexadecimal, so the cache can be shared by
+ * any number of WIM files.  Files are only added under their final names after
+ * their data has been extracted and verified, by renaming a temporary file.
+ * Data read back from the cache is verified again, like data read from a WIM
+ * file; a file that turns out to be corrupted is deleted.
+ *
+ * The index file in the directory records the size and time of last use of
+ * each cached blob.  It's updated once at the end of each extraction, while
+ * holding a lock on the lock file (where file locking is available) so that
+ * concurrent extractions can share the directory.  If the total size of the
+ * blobs then exceeds the limit, the least recently used blobs are deleted.  A
+ * file which is missing from the index, e.g. because a process was
+ * interrupted, is still used, and is added to the index again when it is.
+ */
+
+#define BLOB_CACHE_INDEX_NAME	T("index")
+#define BLOB_CACHE_LOCK_NAME	T("lock")
+#define BLOB_CACHE_MAGIC	0x45484341434C4257ULL	/* "WBLCACHE" */
+#define BLOB_CACHE_VERSION	1
+
+/* Space for the longest file name in the cache directory: a message digest
+ * followed by a temporary file suffix  */
+#define BLOB_CACHE_MAX_NAME_LEN	(SHA1_HASH_STRING_LEN + 16)
+
+/* Smaller blobs aren't worth a file of their own  */
+#define BLOB_CACHE_MIN_BLOB_SIZE	4096
+
+struct blob_cache_header {
+	le64 magic;
+	le32 version;
+	le32 entry_size;
+	le64 num_entries;
+} __attribute__((packed));
+
+/* An entry of the index.  In the list of blobs used since the index was last
+ * saved, a @size of 0 means that the blob's file was deleted.  */
+struct blob_cache_entry {
+	u8 hash[SHA1_HASH_SIZE];
+	le64 size;
+	le64 last_used;
+} __attribute__((packed));
+
+static int
+cmp_blob_cache_entries_by_hash(const void *p1, const void *p2)
+{
+	const struct blob_cache_entry *entry1 = p1;
+	const struct blob_cache_entry *entry2 = p2;
+
+	return hashes_cmp(entry1->hash, entry2->hash);
+}
+
+static int
+cmp_blob_cache_entries_by_last_used(const void *p1, const void *p2)
+{
+	const struct blob_cache_entry *entry1 = p1;
+	const struct blob_cache_entry *entry2 = p2;
+
+	return cmp_u64(le64_to_cpu(entry1->last_used),
+		       le64_to_cpu(entry2->last_used));
+}
+
+/* Return the path to the file @name in the cache directory.  It's valid until
+ * the next call.  */
+static const tchar *
+blob_cache_path(struct blob_cache *cache, const tchar *name)
+{
+	tchar *p = cache->path_buf + cache->dir_nchars;
+
+	*p++ = OS_PREFERRED_PATH_SEPARATOR;
+	tstrcpy(p, name);
+	return cache->path_buf;
+}
+
+static const tchar *
+blob_cache_hash_path(struct blob_cache *cache, const u8 hash[SHA1_HASH_SIZE])
+{
+	tchar name[SHA1_HASH_STRING_LEN];
+
+	sprint_hash(hash, name);
+	return blob_cache_path(cache, name);
+}
+
+static bool
+blob_is_cacheable(const struct blob_descriptor *blob)
+{
+	return !blob->unhashed && blob->size >= BLOB_CACHE_MIN_BLOB_SIZE;
+}
+
+/* Remember that the blob with the message digest @hash was used, or deleted if
+ * @size is 0, for when the index is saved.  */
+static void
+blob_cache_record_use(struct blob_cache *cache, const u8 hash[SHA1_HASH_SIZE],
+		      u64 size)
+{
+	struct blob_cache_entry *entry;
+
+	if (cache->num_used == cache->used_alloc) {
+		size_t new_alloc = max(cache->used_alloc * 2, 64);
+		struct blob_cache_entry *new_used;
+
+		new_used = REALLOC(cache->used, new_alloc * sizeof(new_used[0]));
+		if (!new_used)
+			return; /* The index just won't know about it.  */
+		cache->used = new_used;
+		cache->used_alloc = new_alloc;
+	}
+	entry = &cache->used[cache->num_used++];
+	copy_hash(entry->hash, hash);
+	entry->size = cpu_to_le64(size);
+	entry->last_used = cpu_to_le64(now_as_wim_timestamp());
+}
+
+/*
+ * Look up @blob in the cache.  If its data is there, return the path to the
+ * file containing it, which is valid until the next call to a blob_cache
+ * function; otherwise return NULL.
+ */
+const tchar *
+blob_cache_lookup(struct blob_cache *cache, const struct blob_descriptor *blob)
+{
+	const tchar *path;
+	struct stat st;
+	bool found;
+	int raw_fd;
+
+	if (!blob_is_cacheable(blob))
+		return NULL;
+	path = blob_cache_hash_path(cache, blob->hash);
+	raw_fd = topen(path, O_RDONLY | O_BINARY);
+	if (raw_fd < 0)
+		return NULL;
+	found = !fstat(raw_fd, &st) && S_ISREG(st.st_mode) &&
+		st.st_size == blob->size;
+	close(raw_fd);
+	if (!found)
+		return NULL;
+	blob_cache_record_use(cache, blob->hash, blob->size);
+	return path;
+}
+
+/* Delete the file for @blob from the cache, after its data was found to be
+ * corrupted.  */
+void
+blob_cache_remove(struct blob_cache *cache, const struct blob_descriptor *blob)
+{
+	const tchar *path = blob_cache_hash_path(cache, blob->hash);
+
+	if (tunlink(path) && errno != ENOENT) {
+		WARNING_WITH_ERRNO("Can't delete \"%"TS"\"", path);
+		return;
+	}
+	blob_cache_record_use(cache, blob->hash, 0);
+}
+
+/*
+ * Start adding @blob, which is about to be extracted from a WIM file, to the
+ * cache.  If it isn't worth caching, or a file can't be created for it, then
+ * @writer is left inactive and the other blob_cache_*() calls for it do
+ * nothing.  Failing to add a blob isn't an error, but it stops further blobs
+ * from being added.
+ */
+void
+blob_cache_begin_add(struct blob_cache *cache,
+		     const struct blob_descriptor *blob,
+		     struct blob_cache_writer *writer)
+{
+	tchar name[BLOB_CACHE_MAX_NAME_LEN];
+	const tchar *path;
+	int raw_fd;
+
+	filedes_invalidate(&writer->fd);
+	writer->tmpfile = NULL;
+
+	if (cache->add_failed || blob->blob_location != BLOB_IN_WIM ||
+	    !blob_is_cacheable(blob) || blob->size > cache->max_size)
+		return;
+
+	sprint_hash(blob->hash, name);
+	tmemcpy(&name[SHA1_HASH_STRING_LEN - 1], T(".tmp"), 4);
+	get_random_alnum_chars(&name[SHA1_HASH_STRING_LEN + 3], 8);
+	name[SHA1_HASH_STRING_LEN + 11] = T('\0');
+	path = blob_cache_path(cache, name);
+
+	raw_fd = topen(path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644);
+	if (raw_fd < 0) {
+		WARNING_WITH_ERRNO("Can't create \"%"TS"\"; not adding any "
+				   "more blobs to the blob cache", path);
+		cache->add_failed = true;
+		return;
+	}
+	writer->tmpfile = TSTRDUP(path);
+	if (!writer->tmpfile) {
+		close(raw_fd);
+		tunlink(path);
+		return;
+	}
+	filedes_init(&writer->fd, raw_fd);
+}
+
+static void
+blob_cache_discard(struct blob_cache_writer *writer)
+{
+	filedes_close(&writer->fd);
+	filedes_invalidate(&writer->fd);
+	tunlink(writer->tmpfile);
+	FREE(writer->tmpfile);
+	writer->tmpfile = NULL;
+}
+
+/* Write the next @size bytes of the blob being added to the cache.  */
+void
+blob_cache_write(struct blob_cache_writer *writer, const void *data,
+		 size_t size)
+{
+	if (!filedes_valid(&writer->fd))
+		return;
+	if (full_write(&writer->fd, data, size)) {
+		WARNING_WITH_ERRNO("Error writing \"%"TS"\"", writer->tmpfile);
+		blob_cache_discard(writer);
+	}
+}
+
+/* Finish adding @blob to the cache.  Unless @ok, i.e. the blob was extracted
+ * successfully and its data was verified, the data written is discarded.  */
+void
+blob_cache_end_add(struct blob_cache *cache,
+		   const struct blob_descriptor *blob,
+		   struct blob_cache_writer *writer, bool ok)
+{
+	const tchar *path;
+
+	if (!filedes_valid(&writer->fd))
+		return;
+	if (!ok) {
+		blob_cache_discard(writer);
+		return;
+	}
+	if (filedes_close(&writer->fd)) {
+		WARNING_WITH_ERRNO("Error writing \"%"TS"\"", writer->tmpfile);
+		filedes_invalidate(&writer->fd);
+		blob_cache_discard(writer);
+		return;
+	}
+	filedes_invalidate(&writer->fd);
+	path = blob_cache_hash_path(cache, blob->hash);
+	if (trename(writer->tmpfile, path)) {
+		WARNING_WITH_ERRNO("Failed to rename \"%"TS"\" to \"%"TS"\"",
+				   writer->tmpfile, path);
+		tunlink(writer->tmpfile);
+	} else {
+		blob_cache_record_use(cache, blob->hash, blob->size);
+	}
+	FREE(writer->tmpfile);
+	writer->tmpfile = NULL;
+}
+
+/* Read the entries of the index file.  Problems with it are reported as
+ * warnings, and then it's treated as empty.  */
+static void
+read_blob_cache_index(struct blob_cache *cache,
+		      struct blob_cache_entry **entries_ret,
+		      size_t *num_entries_ret)
+{
+	const tchar *path = blob_cache_path(cache, BLOB_CACHE_INDEX_NAME);
+	struct blob_cache_header hdr;
+	struct blob_cache_entry *entries;
+	struct filedes fd;
+	struct stat st;
+	u64 num_entries;
+	int raw_fd;
+
+	*entries_ret = NULL;
+	*num_entries_ret = 0;
+
+	raw_fd = topen(path, O_RDONLY | O_BINARY);
+	if (raw_fd < 0) {
+		if (errno != ENOENT)
+			WARNING_WITH_ERRNO("Can't open \"%"TS"\"", path);
+		return;
+	}
+	filedes_init(&fd, raw_fd);
+
+	if (fstat(raw_fd, &st) || full_read(&fd, &hdr, sizeof(hdr)))
+		goto bad_index;
+	if (le64_to_cpu(hdr.magic) != BLOB_CACHE_MAGIC ||
+	    le32_to_cpu(hdr.version) != BLOB_CACHE_VERSION ||
+	    le32_to_cpu(hdr.entry_size) != sizeof(struct blob_cache_entry))
+		goto bad_index;
+	num_entries = le64_to_cpu(hdr.num_entries);
+	if (num_entries > ((u64)st.st_size - sizeof(hdr)) /
+			  sizeof(struct blob_cache_entry))
+		goto bad_index;
+	entries = MALLOC(num_entries * sizeof(entries[0]));
+	if (!entries) {
+		WARNING("Not enough memory to load \"%"TS"\"", path);
+		goto out_close;
+	}
+	if (full_read(&fd, entries, num_entries * sizeof(entries[0]))) {
+		FREE(entries);
+		goto bad_index;
+	}
+	*entries_ret = entries;
+	*num_entries_ret = num_entries;
+	goto out_close;
+
+bad_index:
+	WARNING("Ignoring invalid blob cache index \"%"TS"\"", path);
+out_close:
+	filedes_close(&fd);
+}
+
+static void
+write_blob_cache_index(struct blob_cache *cache,
+		       const struct blob_cache_entry *entries,
+		       size_t num_entries)
+{
+	tchar tmpname[ARRAY_LEN(BLOB_CACHE_INDEX_NAME) + 9];
+	tchar *tmpfile;
+	struct blob_cache_header hdr;
+	struct filedes fd;
+	int raw_fd;
+	int ret;
+
+	hdr.magic = cpu_to_le64(BLOB_CACHE_MAGIC);
+	hdr.version = cpu_to_le32(BLOB_CACHE_VERSION);
+	hdr.entry_size = cpu_to_le32(sizeof(struct blob_cache_entry));
+	hdr.num_entries = cpu_to_le64(num_entries);
+
+	/* Write a temporary file and rename it over the old index, so that an
+	 * interrupted write can't leave a truncated index behind.  */
+	tmemcpy(tmpname, BLOB_CACHE_INDEX_NAME,
+		ARRAY_LEN(BLOB_CACHE_INDEX_NAME) - 1);
+	get_random_alnum_chars(&tmpname[ARRAY_LEN(BLOB_CACHE_INDEX_NAME) - 1],
+			       9);
+	tmpname[ARRAY_LEN(tmpname) - 1] = T('\0');
+	tmpfile = TSTRDUP(blob_cache_path(cache, tmpname));
+	if (!tmpfile) {
+		WARNING("Not enough memory to save the blob cache index");
+		return;
+	}
+
+	raw_fd = topen(tmpfile, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644);
+	if (raw_fd < 0) {
+		WARNING_WITH_ERRNO("Can't create \"%"TS"\"", tmpfile);
+		goto out_free_tmpfile;
+	}
+	filedes_init(&fd, raw_fd);
+	ret = full_write(&fd, &hdr, sizeof(hdr));
+	if (!ret)
+		ret = full_write(&fd, entries, num_entries * sizeof(entries[0]));
+	if (filedes_close(&fd) && !ret)
+		ret = WIMLIB_ERR_WRITE;
+	if (ret) {
+		WARNING_WITH_ERRNO("Error writing \"%"TS"\"", tmpfile);
+		tunlink(tmpfile);
+		goto out_free_tmpfile;
+	}
+	if (trename(tmpfile, blob_cache_path(cache, BLOB_CACHE_INDEX_NAME))) {
+		WARNING_WITH_ERRNO("Failed to rename \"%"TS"\" to \"%"TS"\"",
+				   tmpfile, cache->path_buf);
+		tunlink(tmpfile);
+	}
+out_free_tmpfile:
+	FREE(tmpfile);
+}
+
+/* Return a file descriptor which holds the lock on the cache directory, or -1
+ * if it couldn't be locked.  */
+static int
+lock_blob_cache(struct blob_cache *cache)
+{
+#if defined(HAVE_SYS_FILE_H) && defined(HAVE_FLOCK)
+	const tchar *path = blob_cache_path(cache, BLOB_CACHE_LOCK_NAME);
+	int raw_fd = topen(path, O_RDWR | O_CREAT, 0644);
+
+	if (raw_fd < 0) {
+		WARNING_WITH_ERRNO("Can't open \"%"TS"\"", path);
+		return -1;
+	}
+	if (flock(raw_fd, LOCK_EX)) {
+		WARNING_WITH_ERRNO("Can't lock \"%"TS"\"", path);
+		close(raw_fd);
+		return -1;
+	}
+	return raw_fd;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Merge the entries for the blobs used since the index was last saved, sorted
+ * by message digest, into the index entries @entries, also sorted by message
+ * digest.  A blob used more than once keeps its last use, unless it was
+ * deleted.  Returns the new number of entries, or (size_t)-1 if out of memory.
+ */
+static size_t
+merge_used_blobs(struct blob_cache *cache,
+		 struct blob_cache_entry **entries_p, size_t num_entries)
+{
+	const struct blob_cache_entry *used = cache->used;
+	const struct blob_cache_entry *old = *entries_p;
+	struct blob_cache_entry *merged;
+	size_t i = 0, j = 0, n = 0;
+
+	merged = MALLOC((num_entries + cache->num_used) * sizeof(merged[0]));
+	if (!merged)
+		return (size_t)-1;
+
+	while (i < num_entries || j < cache->num_used) {
+		struct blob_cache_entry entry;
+		int res;
+
+		if (i == num_entries)
+			res = 1;
+		else if (j == cache->num_used)
+			res = -1;
+		else
+			res = hashes_cmp(old[i].hash, used[j].hash);
+
+		if (res < 0) {
+			merged[n++] = old[i++];
+			continue;
+		}
+		if (res == 0)
+			i++;
+		entry = used[j++];
+		while (j < cache->num_used &&
+		       hashes_equal(used[j].hash, entry.hash)) {
+			if (entry.size != 0)
+				entry = used[j];
+			j++;
+		}
+		if (entry.size != 0)
+			merged[n++] = entry;
+	}
+	FREE(*entries_p);
+	*entries_p = merged;
+	return n;
+}
+
+/*
+ * Save the blobs found in or added to the cache since the index was last saved
+ * to the index, then delete the least recently used blobs until the cache is
+ * within its size limit.  Problems are reported as warnings only.
+ */
+void
+save_blob_cache_index(struct blob_cache *cache)
+{
+	struct blob_cache_entry *entries;
+	size_t num_entries;
+	size_t num_kept;
+	u64 total_size = 0;
+	int lock_fd;
+
+	if (!cache->num_used)
+		return;
+
+	lock_fd = lock_blob_cache(cache);
+	read_blob_cache_index(cache, &entries, &num_entries);
+	qsort(entries, num_entries, sizeof(entries[0]),
+	      cmp_blob_cache_entries_by_hash);
+	qsort(cache->used, cache->num_used, sizeof(cache->used[0]),
+	      cmp_blob_cache_entries_by_hash);
+	num_entries = merge_used_blobs(cache, &entries, num_entries);
+	if (num_entries == (size_t)-1) {
+		WARNING("Not enough memory to save the blob cache index");
+		goto out;
+	}
+
+	for (size_t i = 0; i < num_entries; i++)
+		total_size += le64_to_cpu(entries[i].size);
+
+	/* Evict the least recently used blobs.  */
+	num_kept = num_entries;
+	if (total_size > cache->max_size) {
+		qsort(entries, num_entries, sizeof(entries[0]),
+		      cmp_blob_cache_entries_by_last_used);
+		num_kept = 0;
+		for (size_t i = 0; i < num_entries; i++) {
+			const tchar *path;
+
+			if (total_size <= cache->max_size) {
+				entries[num_kept++] = entries[i];
+				continue;
+			}
+			path = blob_cache_hash_path(cache, entries[i].hash);
+			if (tunlink(path) && errno != ENOENT) {
+				WARNING_WITH_ERRNO("Can't delete \"%"TS"\"",
+						   path);
+				entries[num_kept++] = entries[i];
+				continue;
+			}
+			total_size -= le64_to_cpu(entries[i].size);
+		}
+	}
+	write_blob_cache_index(cache, entries, num_kept);
+out:
+	if (lock_fd >= 0)
+		close(lock_fd);
+	FREE(entries);
+	cache->num_used = 0;
+}
+
+void
+free_blob_cache(struct blob_cache *cache)
+{
+	if (cache) {
+		FREE(cache->used);
+		FREE(cache->path_buf);
+		FREE(cache->dir);
+		FREE(cache);
+	}
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_extract_blob_cache(WIMStruct *wim, const tchar *dir,
+			      uint64_t max_size)
+{
+	struct blob_cache *cache = NULL;
+
+	if (!wim)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (dir) {
+		if (tmkdir(dir, 0755) && errno != EEXIST) {
+			ERROR_WITH_ERRNO("Can't create blob cache directory "
+					 "\"%"TS"\"", dir);
+			return WIMLIB_ERR_MKDIR;
+		}
+		cache = CALLOC(1, sizeof(*cache));
+		if (!cache)
+			return WIMLIB_ERR_NOMEM;
+		cache->dir_nchars = tstrlen(dir);
+		cache->dir = TSTRDUP(dir);
+		cache->path_buf = MALLOC((cache->dir_nchars + 1 +
+					  BLOB_CACHE_MAX_NAME_LEN) *
+					 sizeof(tchar));
+		if (!cache->dir || !cache->path_buf) {
+			free_blob_cache(cache);
+			return WIMLIB_ERR_NOMEM;
+		}
+		tmemcpy(cache->path_buf, dir, cache->dir_nchars);
+		cache->max_size = max_size;
+	}
+
+	free_blob_cache(wim->blob_cache);
+	wim->blob_cache = cache;
+	return 0;
+}
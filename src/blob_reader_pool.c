@@ -0,0 +1,321 @@
+/*
+ * blob_reader_pool.c
+ *
+ * Reading the data of upcoming blobs from files using multiple threads.
+ *
+ * When capturing many small files, the time to read the file data is dominated
+ * by the latency of opening and reading each file, not by the throughput of the
+ * storage device.  A blob reader pool hides this latency by having several
+ * threads read the upcoming small blobs of a blob list into memory, while the
+ * thread walking the blob list (see read_blob_list()) is still busy with
+ * earlier blobs.  The data is then handed back in the original order.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib/assert.h"
+#include "wimlib/blob_reader_pool.h"
+#include "wimlib/blob_table.h"
+#include "wimlib/error.h"
+#include "wimlib/list.h"
+#include "wimlib/message_queue.h"
+#include "wimlib/resource.h"
+#include "wimlib/sha1.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+
+/* Only blobs at most this large are read by the reader threads.  Larger blobs
+ * are left to the thread consuming them, since reading them is limited by
+ * throughput rather than by per-file latency, and sequential reads of them are
+ * already prefetched (see read_ahead_advance()).  */
+#define MAX_POOL_BLOB_SIZE		(1U << 20)
+
+/* Limits on the number of blobs, and the number of bytes of blob data, that can
+ * be submitted but not yet taken back at any one time.  */
+#define MAX_PENDING_READS		256
+#define MAX_BUFFERED_BYTES		(32U << 20)
+
+struct blob_read_request {
+	struct list_head list;
+
+	/* A copy of the blob descriptor, made when the request was submitted,
+	 * so that the reader threads never access the blob descriptors in the
+	 * blob list which the consuming thread may be modifying.  The location
+	 * data it refers to (e.g. the file path) stays valid until the consuming
+	 * thread reaches the blob.  */
+	struct blob_descriptor blob;
+
+	/* Index of the blob in the blob list  */
+	size_t idx;
+
+	/* Result of the read, valid once @done is set  */
+	void *buf;
+	int status;
+	bool done;
+
+	/* SHA-1 message digest of the data, valid if @hashed is set  */
+	u8 hash[SHA1_HASH_SIZE];
+	bool hashed;
+};
+
+struct blob_reader_pool {
+	struct message_queue request_queue;
+	struct mutex done_lock;
+	struct condvar done_cond;
+	bool done_lock_initialized;
+
+	struct thread threads[MAX_BLOB_READER_THREADS];
+	unsigned num_started_threads;
+
+	/* Ring buffer of submitted requests, oldest first  */
+	struct blob_read_request requests[MAX_PENDING_READS];
+	size_t head;
+	size_t num_pending;
+	u64 buffered_bytes;
+};
+
+static void *
+blob_reader_thread_proc(void *arg)
+{
+	struct blob_reader_pool *pool = arg;
+	struct list_head *node;
+
+	while ((node = message_queue_get(&pool->request_queue)) != NULL) {
+		struct blob_read_request *req =
+			list_entry(node, struct blob_read_request, list);
+		void *buf = NULL;
+		int status;
+
+		status = read_blob_into_alloc_buf(&req->blob, &buf);
+
+		mutex_lock(&pool->done_lock);
+		req->buf = buf;
+		req->status = status;
+		req->done = true;
+		condvar_broadcast(&pool->done_cond);
+		mutex_unlock(&pool->done_lock);
+	}
+	return NULL;
+}
+
+/* Create a pool of @num_threads threads for reading blobs.  */
+int
+new_blob_reader_pool(unsigned num_threads, struct blob_reader_pool **pool_ret)
+{
+	struct blob_reader_pool *pool;
+	int ret;
+
+	wimlib_assert(num_threads != 0);
+	num_threads = min(num_threads, MAX_BLOB_READER_THREADS);
+
+	pool = CALLOC(1, sizeof(*pool));
+	if (!pool)
+		return WIMLIB_ERR_NOMEM;
+
+	ret = message_queue_init(&pool->request_queue);
+	if (ret)
+		goto err;
+
+	ret = WIMLIB_ERR_NOMEM;
+	if (!mutex_init(&pool->done_lock))
+		goto err;
+	if (!condvar_init(&pool->done_cond)) {
+		mutex_destroy(&pool->done_lock);
+		goto err;
+	}
+	pool->done_lock_initialized = true;
+
+	for (pool->num_started_threads = 0;
+	     pool->num_started_threads < num_threads;
+	     pool->num_started_threads++)
+	{
+		if (!thread_create(&pool->threads[pool->num_started_threads],
+				   blob_reader_thread_proc, pool))
+		{
+			if (pool->num_started_threads >= 1)
+				break;
+			goto err;
+		}
+	}
+
+	*pool_ret = pool;
+	return 0;
+
+err:
+	blob_reader_pool_destroy(pool);
+	return ret;
+}
+
+/* Stop the reader threads and free the pool, including any blob data that was
+ * read but never taken.  */
+void
+blob_reader_pool_destroy(struct blob_reader_pool *pool)
+{
+	if (pool->num_started_threads) {
+		message_queue_terminate(&pool->request_queue);
+		for (unsigned i = 0; i < pool->num_started_threads; i++)
+			thread_join(&pool->threads[i]);
+	}
+	for (size_t i = 0; i < pool->num_pending; i++)
+		FREE(pool->requests[(pool->head + i) % MAX_PENDING_READS].buf);
+	if (pool->done_lock_initialized) {
+		condvar_destroy(&pool->done_cond);
+		mutex_destroy(&pool->done_lock);
+	}
+	message_queue_destroy(&pool->request_queue);
+	FREE(pool);
+}
+
+/* Return true if the specified blob is suitable for reading by a blob reader
+ * pool: it must be small, and it must be located in a file which can be read
+ * independently by another thread.  */
+bool
+blob_reader_pool_can_read(const struct blob_descriptor *blob)
+{
+	if (blob->size == 0 || blob->size > MAX_POOL_BLOB_SIZE)
+		return false;
+	switch (blob->blob_location) {
+	case BLOB_IN_FILE_ON_DISK:
+#ifdef _WIN32
+	case BLOB_IN_WINDOWS_FILE:
+#endif
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Submit the specified blob, which is at index @idx in the blob list being
+ * read, to be read by the pool.  Blobs must be submitted in increasing order of
+ * index, and blob_reader_pool_can_read() must have returned true for the blob.
+ *
+ * Returns false, without submitting the blob, if the pool is full.
+ */
+bool
+blob_reader_pool_submit(struct blob_reader_pool *pool,
+			const struct blob_descriptor *blob, size_t idx)
+{
+	struct blob_read_request *req;
+
+	if (pool->num_pending == MAX_PENDING_READS ||
+	    pool->buffered_bytes + blob->size > MAX_BUFFERED_BYTES)
+		return false;
+
+	req = &pool->requests[(pool->head + pool->num_pending) %
+			      MAX_PENDING_READS];
+	req->blob = *blob;
+	req->idx = idx;
+	req->buf = NULL;
+	req->status = 0;
+	req->done = false;
+	req->hashed = false;
+	pool->num_pending++;
+	pool->buffered_bytes += blob->size;
+	message_queue_put(&pool->request_queue, &req->list);
+	return true;
+}
+
+/*
+ * Calculate the SHA-1 message digest of the request at the head of the ring,
+ * which must be done, along with those of any following requests whose reads
+ * have already finished, so that several blobs can be hashed at once with
+ * multi-buffer SHA-1.
+ */
+static void
+hash_done_requests(struct blob_reader_pool *pool)
+{
+	const void *data[SHA1_MAX_LANES];
+	size_t lens[SHA1_MAX_LANES];
+	u8 hashes[SHA1_MAX_LANES][SHA1_HASH_SIZE];
+	struct blob_read_request *reqs[SHA1_MAX_LANES];
+	unsigned num = 0;
+
+	mutex_lock(&pool->done_lock);
+	for (size_t i = 0; i < pool->num_pending && num < SHA1_MAX_LANES; i++) {
+		struct blob_read_request *req =
+			&pool->requests[(pool->head + i) % MAX_PENDING_READS];
+
+		if (!req->done)
+			break;
+		if (req->status || req->hashed)
+			continue;
+		reqs[num] = req;
+		data[num] = req->buf;
+		lens[num] = req->blob.size;
+		num++;
+	}
+	mutex_unlock(&pool->done_lock);
+
+	sha1_multi(data, lens, num, hashes);
+
+	for (unsigned i = 0; i < num; i++) {
+		copy_hash(reqs[i]->hash, hashes[i]);
+		reqs[i]->hashed = true;
+	}
+}
+
+/*
+ * Take back the result of reading the blob at index @idx in the blob list,
+ * waiting for it to be read if needed.  Any results for blobs with lower
+ * indices are discarded.
+ *
+ * Returns false if the blob was not submitted to the pool.  Otherwise returns
+ * true and sets *status_ret to the status of the read.  If the status is 0,
+ * then *buf_ret is set to a buffer containing the blob's data, which the caller
+ * must free, and if @hash_ret is not NULL then the SHA-1 message digest of the
+ * data is written to it.
+ */
+bool
+blob_reader_pool_take(struct blob_reader_pool *pool, size_t idx,
+		      void **buf_ret, int *status_ret, u8 *hash_ret)
+{
+	while (pool->num_pending) {
+		struct blob_read_request *req = &pool->requests[pool->head];
+
+		if (req->idx > idx)
+			break;
+
+		mutex_lock(&pool->done_lock);
+		while (!req->done)
+			condvar_wait(&pool->done_cond, &pool->done_lock);
+		mutex_unlock(&pool->done_lock);
+
+		if (req->idx == idx && hash_ret && !req->status) {
+			if (!req->hashed)
+				hash_done_requests(pool);
+			copy_hash(hash_ret, req->hash);
+		}
+
+		pool->head = (pool->head + 1) % MAX_PENDING_READS;
+		pool->num_pending--;
+		pool->buffered_bytes -= req->blob.size;
+
+		if (req->idx == idx) {
+			*buf_ret = req->buf;
+			*status_ret = req->status;
+			return true;
+		}
+		FREE(req->buf);
+	}
+	return false;
+}
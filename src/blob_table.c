@@ -122,12 +122,30 @@ clone_blob_descriptor(const struct blob_descriptor *old)
 		list_add(&new->rdesc_node, &new->rdesc->blob_list);
 		break;
 
-	case BLOB_IN_FILE_ON_DISK:
 #ifdef WITH_FUSE
 	case BLOB_IN_STAGING_FILE:
+		new->staging_origin = NULL;
+		if (old->staging_origin) {
+			new->staging_origin = new_staging_origin(
+						old->staging_origin->blob,
+						old->staging_origin->size);
+			if (!new->staging_origin) {
+				new->blob_location = BLOB_NONEXISTENT;
+				goto out_free;
+			}
+			new->staging_origin->modified =
+				old->staging_origin->modified;
+			memcpy(new->staging_origin->filled,
+			       old->staging_origin->filled,
+			       DIV_ROUND_UP(old->staging_origin->size,
+					    (u64)STAGING_EXTENT_SIZE * WORDBITS) *
+			       WORDBYTES);
+		}
 		STATIC_ASSERT((void*)&old->file_on_disk ==
 			      (void*)&old->staging_file_name);
+		/* fall through */
 #endif
+	case BLOB_IN_FILE_ON_DISK:
 		new->file_on_disk = TSTRDUP(old->file_on_disk);
 		if (new->file_on_disk == NULL)
 			goto out_free;
@@ -168,17 +186,20 @@ blob_release_location(struct blob_descriptor *blob)
 
 		list_del(&blob->rdesc_node);
 		if (list_empty(&rdesc->blob_list)) {
+			free_cached_chunk_offsets(rdesc);
 			wim_decrement_refcnt(rdesc->wim);
 			FREE(rdesc);
 		}
 		break;
 	}
-	case BLOB_IN_FILE_ON_DISK:
 #ifdef WITH_FUSE
 	case BLOB_IN_STAGING_FILE:
+		free_staging_origin(blob->staging_origin);
 		STATIC_ASSERT((void*)&blob->file_on_disk ==
 			      (void*)&blob->staging_file_name);
+		/* fall through */
 #endif
+	case BLOB_IN_FILE_ON_DISK:
 	case BLOB_IN_ATTACHED_BUFFER:
 		STATIC_ASSERT((void*)&blob->file_on_disk ==
 			      (void*)&blob->attached_buffer);
@@ -296,6 +317,40 @@ blob_decrement_num_opened_fds(struct blob_descriptor *blob)
 	if (--blob->num_opened_fds == 0 && blob->refcnt == 0)
 		finalize_blob(blob);
 }
+
+/* Create a staging origin for the first @size bytes of the data of @blob, which
+ * must be located in a WIM file, with no extents filled yet.  */
+struct staging_origin *
+new_staging_origin(const struct blob_descriptor *blob, u64 size)
+{
+	struct staging_origin *origin;
+	u64 num_words = DIV_ROUND_UP(size, (u64)STAGING_EXTENT_SIZE * WORDBITS);
+
+	origin = MALLOC(sizeof(*origin));
+	if (!origin)
+		return NULL;
+	origin->blob = clone_blob_descriptor(blob);
+	origin->size = size;
+	origin->modified = false;
+	origin->filled = NULL;
+	if (num_words == (size_t)num_words)
+		origin->filled = CALLOC(num_words, WORDBYTES);
+	if (!origin->filled || !origin->blob) {
+		free_staging_origin(origin);
+		return NULL;
+	}
+	return origin;
+}
+
+void
+free_staging_origin(struct staging_origin *origin)
+{
+	if (origin) {
+		free_blob_descriptor(origin->blob);
+		FREE(origin->filled);
+		FREE(origin);
+	}
+}
 #endif
 
 static void
@@ -350,6 +405,15 @@ blob_table_unlink(struct blob_table *table, struct blob_descriptor *blob)
 	table->num_blobs--;
 }
 
+/* Prefetch the hash bucket in which the blob with the given SHA-1 message digest
+ * would be.  This hides most of the latency of looking up or inserting many
+ * blobs in a large table, when their digests are known in advance.  */
+static inline void
+prefetch_blob_bucket(const struct blob_table *table, const u8 *hash)
+{
+	prefetchw(&table->array[load_size_t_unaligned(hash) & table->mask]);
+}
+
 /* Given a SHA-1 message digest, return the corresponding blob descriptor from
  * the specified blob table, or NULL if there is none.  */
 struct blob_descriptor *
@@ -376,6 +440,10 @@ for_blob_in_table(struct blob_table *table,
 	int ret;
 
 	for (size_t i = 0; i <= table->mask; i++) {
+		/* The blobs are in no particular order in memory, so fetch the
+		 * first blob of a later bucket in advance.  */
+		if (i + 4 <= table->mask && table->array[i + 4].first)
+			prefetchw(table->array[i + 4].first);
 		hlist_for_each_entry_safe(blob, tmp, &table->array[i],
 					  hash_list)
 		{
@@ -459,9 +527,22 @@ cmp_blobs_by_sequential_order(const void *p1, const void *p2)
 #ifdef WITH_FUSE
 	case BLOB_IN_STAGING_FILE:
 #endif
-		/* Compare files by path: just a heuristic that will place files
-		 * in the same directory next to each other.  */
-		return tstrcmp(blob1->file_on_disk, blob2->file_on_disk);
+		/* Files whose location on disk is known are read in that
+		 * order, after the files whose location isn't known.
+		 * Otherwise, compare files by path: just a heuristic that will
+		 * place files in the same directory next to each other.  The
+		 * members of an archive are read in the order they're stored in
+		 * it.  */
+		if (blob1->blob_location == BLOB_IN_FILE_ON_DISK) {
+			v = cmp_u64(blob1->file_disk_offset,
+				    blob2->file_disk_offset);
+			if (v)
+				return v;
+		}
+		v = tstrcmp(blob1->file_on_disk, blob2->file_on_disk);
+		if (v || blob1->blob_location != BLOB_IN_FILE_ON_DISK)
+			return v;
+		return cmp_u64(blob1->file_offset, blob2->file_offset);
 #ifdef _WIN32
 	case BLOB_IN_WINDOWS_FILE:
 		return cmp_windows_files(blob1->windows_file, blob2->windows_file);
@@ -516,14 +597,185 @@ sort_blob_list(struct list_head *blob_list, size_t list_head_offset,
 	return 0;
 }
 
+/* A blob along with its position in the WIM file that contains it  */
+struct blob_sort_key {
+	u64 res_offset;
+	u64 offset_in_res;
+	struct blob_descriptor *blob;
+};
+
+/* Return the byte of the key that is sorted by in LSD radix sort pass @pass
+ * (0-15), where pass 0 is for the least significant byte.  */
+static forceinline unsigned
+sort_key_byte(const struct blob_sort_key *key, unsigned pass)
+{
+	if (pass < 8)
+		return (key->offset_in_res >> (pass * 8)) & 0xFF;
+	return (key->res_offset >> ((pass - 8) * 8)) & 0xFF;
+}
+
+/*
+ * Sort blobs that are all located in the same WIM file into the order given by
+ * cmp_blobs_by_sequential_order(), i.e. by resource offset and then by offset
+ * in the resource, using a least-significant-digit radix sort of these two
+ * offsets.  Extracting or writing an image with millions of small files may
+ * require sorting millions of blobs, and qsort() with
+ * cmp_blobs_by_sequential_order() is slow at that since every comparison
+ * dereferences two blobs, two resource descriptors and two WIMStructs.  Passes
+ * over bytes that are the same in every key, e.g. the high bytes of the
+ * offsets, are skipped, so typically only a few passes are needed.
+ *
+ * Returns false if out of memory or if some blob is not in the same WIM file
+ * as the first, in which case the caller must sort the blobs in some other
+ * way.
+ */
+static bool
+radix_sort_blobs_in_wim(struct blob_descriptor **blobs, size_t num_blobs)
+{
+	struct blob_sort_key *keys, *tmp, *src, *dst;
+	WIMStruct *wim;
+	size_t counts[256];
+
+	if (blobs[0]->blob_location != BLOB_IN_WIM)
+		return false;
+	wim = blobs[0]->rdesc->wim;
+
+	keys = MALLOC(2 * num_blobs * sizeof(keys[0]));
+	if (!keys)
+		return false;
+	tmp = &keys[num_blobs];
+
+	for (size_t i = 0; i < num_blobs; i++) {
+		const struct blob_descriptor *blob = blobs[i];
+
+		if (blob->blob_location != BLOB_IN_WIM ||
+		    blob->rdesc->wim != wim) {
+			FREE(keys);
+			return false;
+		}
+		keys[i].res_offset = blob->rdesc->offset_in_wim;
+		keys[i].offset_in_res = blob->offset_in_res;
+		keys[i].blob = blobs[i];
+	}
+
+	src = keys;
+	dst = tmp;
+	for (unsigned pass = 0; pass < 16; pass++) {
+		size_t sum = 0;
+
+		memset(counts, 0, sizeof(counts));
+		for (size_t i = 0; i < num_blobs; i++)
+			counts[sort_key_byte(&src[i], pass)]++;
+
+		/* All keys have the same byte here?  */
+		if (counts[sort_key_byte(&src[0], pass)] == num_blobs)
+			continue;
+
+		for (unsigned b = 0; b < 256; b++) {
+			size_t count = counts[b];
+
+			counts[b] = sum;
+			sum += count;
+		}
+		for (size_t i = 0; i < num_blobs; i++)
+			dst[counts[sort_key_byte(&src[i], pass)]++] = src[i];
+		swap(src, dst);
+	}
+
+	for (size_t i = 0; i < num_blobs; i++)
+		blobs[i] = src[i].blob;
+	FREE(keys);
+	return true;
+}
+
+/* Sort an array of blobs in an order optimized for sequential reading.  */
+void
+sort_blobs_by_sequential_order(struct blob_descriptor **blobs, size_t num_blobs)
+{
+	if (num_blobs <= 1)
+		return;
+	if (!radix_sort_blobs_in_wim(blobs, num_blobs))
+		qsort(blobs, num_blobs, sizeof(blobs[0]),
+		      cmp_blobs_by_sequential_order);
+}
+
+/*
+ * Gather the blobs in the list @blob_list, linked through the list_head at
+ * @list_head_offset in each blob, into a newly allocated array in a single pass
+ * over the list.  Walking a long list of scattered blobs is slow, so code that
+ * makes several passes over the blobs should make them over such an array.
+ *
+ * The array, which the caller must free, is returned in *blobs_ret, and its
+ * length in *num_blobs_ret.  If the list is empty, *blobs_ret may be NULL.
+ * Returns 0 or WIMLIB_ERR_NOMEM.
+ */
+int
+blob_list_to_array(struct list_head *blob_list, size_t list_head_offset,
+		   struct blob_descriptor ***blobs_ret, size_t *num_blobs_ret)
+{
+	struct list_head *cur;
+	struct blob_descriptor **array = NULL;
+	size_t num_blobs = 0;
+	size_t num_alloc = 0;
+
+	list_for_each(cur, blob_list) {
+		if (num_blobs == num_alloc) {
+			struct blob_descriptor **new_array;
+
+			num_alloc = max(num_alloc * 2, 64);
+			new_array = REALLOC(array, num_alloc * sizeof(array[0]));
+			if (!new_array) {
+				FREE(array);
+				return WIMLIB_ERR_NOMEM;
+			}
+			array = new_array;
+		}
+		array[num_blobs++] =
+			(struct blob_descriptor *)((u8 *)cur - list_head_offset);
+	}
+	*blobs_ret = array;
+	*num_blobs_ret = num_blobs;
+	return 0;
+}
+
+/* Make @blob_list contain the @num_blobs blobs in @blobs, in order, linked
+ * through the list_head at @list_head_offset in each blob.  */
+void
+blob_array_to_list(struct blob_descriptor **blobs, size_t num_blobs,
+		   struct list_head *blob_list, size_t list_head_offset)
+{
+	INIT_LIST_HEAD(blob_list);
+	for (size_t i = 0; i < num_blobs; i++) {
+		if (i + 8 < num_blobs)
+			prefetchw((u8 *)blobs[i + 8] + list_head_offset);
+		list_add_tail((struct list_head *)
+			       ((u8 *)blobs[i] + list_head_offset),
+			      blob_list);
+	}
+}
+
 /* Sort the specified list of blobs in an order optimized for sequential
  * reading.  */
 int
 sort_blob_list_by_sequential_order(struct list_head *blob_list,
 				   size_t list_head_offset)
 {
-	return sort_blob_list(blob_list, list_head_offset,
-			      cmp_blobs_by_sequential_order);
+	struct blob_descriptor **array;
+	size_t num_blobs;
+	int ret;
+
+	ret = blob_list_to_array(blob_list, list_head_offset,
+				 &array, &num_blobs);
+	if (ret)
+		return ret;
+
+	if (num_blobs > 1) {
+		sort_blobs_by_sequential_order(array, num_blobs);
+		blob_array_to_list(array, num_blobs, blob_list,
+				   list_head_offset);
+	}
+	FREE(array);
+	return 0;
 }
 
 static int
@@ -553,8 +805,7 @@ for_blob_in_table_sorted_by_sequential_order(struct blob_table *table,
 
 	wimlib_assert(p == blob_array + num_blobs);
 
-	qsort(blob_array, num_blobs, sizeof(blob_array[0]),
-	      cmp_blobs_by_sequential_order);
+	sort_blobs_by_sequential_order(blob_array, num_blobs);
 	ret = 0;
 	for (size_t i = 0; i < num_blobs; i++) {
 		ret = visitor(blob_array[i], arg);
@@ -750,6 +1001,7 @@ free_solid_rdescs(struct wim_resource_descriptor **rdescs, size_t num_rdescs)
 	if (rdescs) {
 		for (size_t i = 0; i < num_rdescs; i++) {
 			if (list_empty(&rdescs[i]->blob_list)) {
+				free_cached_chunk_offsets(rdescs[i]);
 				rdescs[i]->wim->refcnt--;
 				FREE(rdescs[i]);
 			}
@@ -909,6 +1161,12 @@ read_blob_table(WIMStruct *wim)
 		struct wim_reshdr reshdr;
 		u16 part_number;
 
+		/* Each entry is looked up and inserted in the hash table, at a
+		 * random position.  Fetch the buckets of upcoming entries in
+		 * advance.  */
+		if (i + 16 < num_entries)
+			prefetch_blob_bucket(table, disk_entry[16].hash);
+
 		/* Get the resource header  */
 		get_wim_reshdr(&disk_entry->reshdr, &reshdr);
 
@@ -921,6 +1179,7 @@ read_blob_table(WIMStruct *wim)
 		cur_blob = new_blob_descriptor();
 		if (!cur_blob)
 			goto oom;
+		cur_blob->blob_table_pos = i;
 
 		/* Get the part number, reference count, and hash.  */
 		part_number = le16_to_cpu(disk_entry->part_number);
@@ -1221,7 +1480,8 @@ write_blob_table_from_blob_list(struct list_head *blob_list,
 					     0,
 					     out_reshdr,
 					     NULL,
-					     write_resource_flags);
+					     write_resource_flags,
+					     1);
 	FREE(table_buf);
 	return ret;
 }
@@ -1363,49 +1623,106 @@ blob_to_wimlib_resource_entry(const struct blob_descriptor *blob,
 	wentry->is_metadata = blob->is_metadata;
 }
 
+#define ITERATE_BLOB_BATCH_SIZE 256
+
 struct iterate_blob_context {
 	wimlib_iterate_lookup_table_callback_t cb;
+	wimlib_iterate_lookup_table_batch_callback_t batch_cb;
 	void *user_ctx;
+
+	/* In batched mode, the entries not yet passed to the callback  */
+	struct wimlib_resource_entry *batch;
+	size_t batch_len;
 };
 
+static int
+flush_blob_batch(struct iterate_blob_context *ctx)
+{
+	size_t n = ctx->batch_len;
+
+	if (n == 0)
+		return 0;
+	ctx->batch_len = 0;
+	return (*ctx->batch_cb)(ctx->batch, n, ctx->user_ctx);
+}
+
 static int
 do_iterate_blob(struct blob_descriptor *blob, void *_ctx)
 {
 	struct iterate_blob_context *ctx = _ctx;
 	struct wimlib_resource_entry entry;
 
+	if (ctx->batch) {
+		blob_to_wimlib_resource_entry(blob,
+					      &ctx->batch[ctx->batch_len++]);
+		if (ctx->batch_len == ITERATE_BLOB_BATCH_SIZE)
+			return flush_blob_batch(ctx);
+		return 0;
+	}
 	blob_to_wimlib_resource_entry(blob, &entry);
 	return (*ctx->cb)(&entry, ctx->user_ctx);
 }
 
-/* API function documented in wimlib.h  */
-WIMLIBAPI int
-wimlib_iterate_lookup_table(WIMStruct *wim, int flags,
-			    wimlib_iterate_lookup_table_callback_t cb,
-			    void *user_ctx)
+static int
+iterate_lookup_table(WIMStruct *wim, struct iterate_blob_context *ctx)
 {
-	if (flags != 0)
-		return WIMLIB_ERR_INVALID_PARAM;
+	int ret;
 
-	struct iterate_blob_context ctx = {
-		.cb = cb,
-		.user_ctx = user_ctx,
-	};
 	if (wim_has_metadata(wim)) {
-		int ret;
 		for (int i = 0; i < wim->hdr.image_count; i++) {
 			struct blob_descriptor *blob;
 			struct wim_image_metadata *imd = wim->image_metadata[i];
 
-			ret = do_iterate_blob(imd->metadata_blob, &ctx);
+			ret = do_iterate_blob(imd->metadata_blob, ctx);
 			if (ret)
 				return ret;
 			image_for_each_unhashed_blob(blob, imd) {
-				ret = do_iterate_blob(blob, &ctx);
+				ret = do_iterate_blob(blob, ctx);
 				if (ret)
 					return ret;
 			}
 		}
 	}
-	return for_blob_in_table(wim->blob_table, do_iterate_blob, &ctx);
+	return for_blob_in_table(wim->blob_table, do_iterate_blob, ctx);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_iterate_lookup_table(WIMStruct *wim, int flags,
+			    wimlib_iterate_lookup_table_callback_t cb,
+			    void *user_ctx)
+{
+	if (flags != 0)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	struct iterate_blob_context ctx = {
+		.cb = cb,
+		.user_ctx = user_ctx,
+	};
+	return iterate_lookup_table(wim, &ctx);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_iterate_lookup_table_batched(WIMStruct *wim, int flags,
+				    wimlib_iterate_lookup_table_batch_callback_t cb,
+				    void *user_ctx)
+{
+	int ret;
+
+	if (flags != 0)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	struct iterate_blob_context ctx = {
+		.batch_cb = cb,
+		.user_ctx = user_ctx,
+	};
+	ctx.batch = MALLOC(ITERATE_BLOB_BATCH_SIZE * sizeof(ctx.batch[0]));
+	if (!ctx.batch)
+		return WIMLIB_ERR_NOMEM;
+	ret = iterate_lookup_table(wim, &ctx);
+	if (ret == 0)
+		ret = flush_blob_batch(&ctx);
+	FREE(ctx.batch);
+	return ret;
 }
@@ -0,0 +1,274 @@
+/*
+ * chunk_cache.c
+ *
+ * A cache of decompressed chunks of a WIM file's resources.
+ *
+ * Reading a small range of data from a compressed resource normally requires
+ * reading part of the resource's chunk table and decompressing every chunk that
+ * overlaps the range.  That is fine when data is read sequentially in large
+ * pieces, but a mounted WIM image is read in small pieces in whatever order the
+ * kernel and the applications choose, so the same chunks tend to be read and
+ * decompressed over and over.  This is especially bad in solid resources, whose
+ * chunks are usually 64 MiB.
+ *
+ * So, a WIMStruct can have a chunk cache, which keeps the most recently used
+ * decompressed chunks, up to a limit on their total size.  (The chunk tables
+ * needed to find the chunks are cached in the resource descriptors instead.)
+ * Resources are identified by their offset in the WIM file, which unlike a
+ * resource descriptor stays valid for as long as the WIM file is open.
+ *
+ * A chunk cache may be used by multiple threads at once, e.g. by a mounted image
+ * serving several readers.  So, data is only ever copied out of the cache while
+ * its lock is held, and the cache also keeps the idle decompressors of the
+ * threads reading through it, so that each can decompress using its own.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include "wimlib.h"
+#include "wimlib/chunk_cache.h"
+#include "wimlib/list.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+
+/* Number of hash buckets for cached chunks (a power of 2)  */
+#define CHUNK_HASH_ORDER	12
+
+/* Maximum number of idle decompressors kept  */
+#define MAX_IDLE_DECOMPRESSORS	16
+
+struct cached_chunk {
+	/* Link in the cache's LRU list, most recently used first  */
+	struct list_head lru_list;
+
+	/* Link in the hash bucket for (res_offset, chunk_idx)  */
+	struct hlist_node hash_node;
+
+	u64 res_offset;
+	u64 chunk_idx;
+	u32 size;
+	u8 *data;
+};
+
+struct idle_decompressor {
+	struct wimlib_decompressor *decompressor;
+	int ctype;
+	u32 max_block_size;
+};
+
+struct chunk_cache {
+	/* Protects everything below  */
+	struct mutex lock;
+
+	struct list_head chunk_lru;
+	size_t num_bytes;
+	size_t max_bytes;
+	unsigned num_idle_decompressors;
+	struct idle_decompressor idle_decompressors[MAX_IDLE_DECOMPRESSORS];
+	struct hlist_head buckets[1 << CHUNK_HASH_ORDER];
+};
+
+static inline struct hlist_head *
+chunk_bucket(struct chunk_cache *cache, u64 res_offset, u64 chunk_idx)
+{
+	u64 hash = hash_u64(hash_u64(res_offset) + chunk_idx);
+
+	return &cache->buckets[hash >> (64 - CHUNK_HASH_ORDER)];
+}
+
+/* Create a chunk cache which holds up to @max_bytes of decompressed data.  */
+int
+new_chunk_cache(size_t max_bytes, struct chunk_cache **cache_ret)
+{
+	struct chunk_cache *cache;
+
+	cache = MALLOC(sizeof(*cache));
+	if (!cache)
+		return WIMLIB_ERR_NOMEM;
+
+	if (!mutex_init(&cache->lock)) {
+		FREE(cache);
+		return WIMLIB_ERR_NOMEM;
+	}
+	INIT_LIST_HEAD(&cache->chunk_lru);
+	cache->num_bytes = 0;
+	cache->max_bytes = max_bytes;
+	cache->num_idle_decompressors = 0;
+	for (size_t i = 0; i < ARRAY_LEN(cache->buckets); i++)
+		INIT_HLIST_HEAD(&cache->buckets[i]);
+
+	*cache_ret = cache;
+	return 0;
+}
+
+static void
+evict_chunk(struct chunk_cache *cache, struct cached_chunk *chunk)
+{
+	list_del(&chunk->lru_list);
+	hlist_del(&chunk->hash_node);
+	cache->num_bytes -= chunk->size;
+	FREE(chunk->data);
+	FREE(chunk);
+}
+
+void
+free_chunk_cache(struct chunk_cache *cache)
+{
+	if (!cache)
+		return;
+	while (!list_empty(&cache->chunk_lru))
+		evict_chunk(cache, list_first_entry(&cache->chunk_lru,
+						    struct cached_chunk,
+						    lru_list));
+	for (unsigned i = 0; i < cache->num_idle_decompressors; i++)
+		wimlib_free_decompressor(
+			cache->idle_decompressors[i].decompressor);
+	mutex_destroy(&cache->lock);
+	FREE(cache);
+}
+
+static struct cached_chunk *
+lookup_chunk(struct chunk_cache *cache, u64 res_offset, u64 chunk_idx)
+{
+	struct cached_chunk *chunk;
+
+	hlist_for_each_entry(chunk, chunk_bucket(cache, res_offset, chunk_idx),
+			     hash_node)
+	{
+		if (chunk->res_offset == res_offset &&
+		    chunk->chunk_idx == chunk_idx)
+			return chunk;
+	}
+	return NULL;
+}
+
+/* If the specified chunk is cached, copy @size bytes of its decompressed data,
+ * starting at @skip bytes into it, to @buf and return true.  Otherwise return
+ * false.  @buf may be NULL to only check whether the chunk is cached.  */
+bool
+chunk_cache_read_chunk(struct chunk_cache *cache, u64 res_offset, u64 chunk_idx,
+		       u32 skip, u32 size, void *buf)
+{
+	struct cached_chunk *chunk;
+
+	mutex_lock(&cache->lock);
+	chunk = lookup_chunk(cache, res_offset, chunk_idx);
+	if (chunk) {
+		list_move(&chunk->lru_list, &cache->chunk_lru);
+		if (buf)
+			memcpy(buf, &chunk->data[skip], size);
+	}
+	mutex_unlock(&cache->lock);
+	return chunk != NULL;
+}
+
+/* Add the decompressed data of a chunk to the cache.  The cache takes ownership
+ * of @data, which must have been allocated with MALLOC(), even if it can't be
+ * cached or another thread has cached the chunk in the meantime, in which case
+ * it is freed.  The least recently used chunks are evicted to make room, but the
+ * new chunk itself is always kept as long as it isn't larger than the whole
+ * cache.  */
+void
+chunk_cache_add_chunk(struct chunk_cache *cache, u64 res_offset, u64 chunk_idx,
+		      u8 *data, u32 size)
+{
+	struct cached_chunk *chunk;
+
+	if (size > cache->max_bytes)
+		goto out_free_data;
+
+	chunk = MALLOC(sizeof(*chunk));
+	if (!chunk)
+		goto out_free_data;
+
+	mutex_lock(&cache->lock);
+	if (lookup_chunk(cache, res_offset, chunk_idx)) {
+		mutex_unlock(&cache->lock);
+		FREE(chunk);
+		goto out_free_data;
+	}
+	while (cache->num_bytes + size > cache->max_bytes)
+		evict_chunk(cache, list_last_entry(&cache->chunk_lru,
+						   struct cached_chunk,
+						   lru_list));
+	chunk->res_offset = res_offset;
+	chunk->chunk_idx = chunk_idx;
+	chunk->size = size;
+	chunk->data = data;
+	list_add(&chunk->lru_list, &cache->chunk_lru);
+	hlist_add_head(&chunk->hash_node,
+		       chunk_bucket(cache, res_offset, chunk_idx));
+	cache->num_bytes += size;
+	mutex_unlock(&cache->lock);
+	return;
+
+out_free_data:
+	FREE(data);
+}
+
+/* Take an idle decompressor for the specified compression type and chunk size
+ * from the cache, or return NULL if there is none.  */
+struct wimlib_decompressor *
+chunk_cache_get_decompressor(struct chunk_cache *cache, int ctype,
+			     u32 max_block_size)
+{
+	struct wimlib_decompressor *decompressor = NULL;
+
+	mutex_lock(&cache->lock);
+	for (unsigned i = 0; i < cache->num_idle_decompressors; i++) {
+		struct idle_decompressor *idle = &cache->idle_decompressors[i];
+
+		if (idle->ctype == ctype &&
+		    idle->max_block_size == max_block_size)
+		{
+			decompressor = idle->decompressor;
+			*idle = cache->idle_decompressors[
+					--cache->num_idle_decompressors];
+			break;
+		}
+	}
+	mutex_unlock(&cache->lock);
+	return decompressor;
+}
+
+/* Give a decompressor which is no longer being used back to the cache, or free
+ * it if the cache already holds the maximum number of idle decompressors.  */
+void
+chunk_cache_put_decompressor(struct chunk_cache *cache, int ctype,
+			     u32 max_block_size,
+			     struct wimlib_decompressor *decompressor)
+{
+	mutex_lock(&cache->lock);
+	if (cache->num_idle_decompressors < MAX_IDLE_DECOMPRESSORS) {
+		struct idle_decompressor *idle =
+		    &cache->idle_decompressors[cache->num_idle_decompressors++];
+
+		idle->decompressor = decompressor;
+		idle->ctype = ctype;
+		idle->max_block_size = max_block_size;
+		decompressor = NULL;
+	}
+	mutex_unlock(&cache->lock);
+	wimlib_free_decompressor(decompressor);
+}
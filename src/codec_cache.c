@@ -0,0 +1,201 @@
+/*
+ * codec_cache.c
+ *
+ * A library-wide cache of freed compressors and decompressors for reuse.
+ *
+ * Creating a compressor can be expensive: e.g. the near-optimal LZX compressor
+ * allocates tens of MiB, which must then be page-faulted in again.  A program
+ * that writes many small WIM files would pay that cost for every resource, so
+ * when the cache is enabled with wimlib_set_compressor_cache_size(),
+ * wimlib_free_compressor() and wimlib_free_decompressor() hand the internal
+ * state to this cache instead of freeing it, and the next
+ * wimlib_create_compressor() or wimlib_create_decompressor() call with the same
+ * parameters takes it back.  The least recently cached entries are freed when
+ * the cache would exceed its size.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib.h"
+#include "wimlib/codec_cache.h"
+#include "wimlib/list.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+
+struct cached_codec {
+	/* Link in 'cache_list', most recently cached first  */
+	struct list_head list;
+
+	/* The parameters the state was created with  */
+	const void *ops;
+	size_t max_block_size;
+	unsigned int params;
+
+	u64 size;
+	void *private;
+	void (*free_private)(void *);
+};
+
+static struct mutex cache_lock = MUTEX_INITIALIZER;
+static LIST_HEAD(cache_list);
+static u64 cache_size;
+static u64 max_cache_size;
+
+static void
+free_cached_codec(struct cached_codec *entry)
+{
+	if (entry->free_private)
+		entry->free_private(entry->private);
+	FREE(entry);
+}
+
+/* Remove entries from 'cache_list', oldest first, until at most @limit bytes
+ * are cached, and return them in @evicted.  Called with 'cache_lock' held.  */
+static void
+evict_cached_codecs(u64 limit, struct list_head *evicted)
+{
+	while (cache_size > limit) {
+		struct cached_codec *entry =
+			list_last_entry(&cache_list, struct cached_codec, list);
+
+		list_del(&entry->list);
+		cache_size -= entry->size;
+		list_add(&entry->list, evicted);
+	}
+}
+
+static void
+free_evicted_codecs(struct list_head *evicted)
+{
+	struct cached_codec *entry, *tmp;
+
+	list_for_each_entry_safe(entry, tmp, evicted, list)
+		free_cached_codec(entry);
+}
+
+/* Return the most that may be cached right now: the cache's size limit, reduced
+ * if the memory budget doesn't allow it to grow that large.  Called with
+ * 'cache_lock' held.  */
+static u64
+effective_max_cache_size(void)
+{
+	u64 remaining = get_memory_budget_remaining();
+
+	if (remaining < max_cache_size - cache_size)
+		return cache_size + remaining;
+	return max_cache_size;
+}
+
+/*
+ * Take a cached compressor or decompressor state that was created by @ops with
+ * the given @max_block_size and @params (the compression level and flags, which
+ * must match exactly), or return NULL if there is none.
+ */
+void *
+codec_cache_get(const void *ops, size_t max_block_size, unsigned int params)
+{
+	struct cached_codec *entry;
+	void *private = NULL;
+
+	mutex_lock(&cache_lock);
+	list_for_each_entry(entry, &cache_list, list) {
+		if (entry->ops == ops &&
+		    entry->max_block_size == max_block_size &&
+		    entry->params == params)
+		{
+			list_del(&entry->list);
+			cache_size -= entry->size;
+			private = entry->private;
+			FREE(entry);
+			break;
+		}
+	}
+	mutex_unlock(&cache_lock);
+	return private;
+}
+
+/*
+ * Offer a compressor or decompressor state, which uses about @size bytes, to
+ * the cache.  Returns true if it was cached, or false if the caller must free
+ * it itself, e.g. because the cache is disabled or too small.
+ */
+bool
+codec_cache_put(const void *ops, size_t max_block_size, unsigned int params,
+		u64 size, void *private, void (*free_private)(void *))
+{
+	struct cached_codec *entry;
+	LIST_HEAD(evicted);
+	u64 limit;
+
+	mutex_lock(&cache_lock);
+	limit = effective_max_cache_size();
+	if (size > limit)
+		goto out_not_cached;
+	entry = MALLOC(sizeof(*entry));
+	if (!entry)
+		goto out_not_cached;
+	entry->ops = ops;
+	entry->max_block_size = max_block_size;
+	entry->params = params;
+	entry->size = size;
+	entry->private = private;
+	entry->free_private = free_private;
+
+	evict_cached_codecs(limit - size, &evicted);
+	list_add(&entry->list, &cache_list);
+	cache_size += size;
+	mutex_unlock(&cache_lock);
+
+	free_evicted_codecs(&evicted);
+	return true;
+
+out_not_cached:
+	mutex_unlock(&cache_lock);
+	return false;
+}
+
+/* Free everything in the cache.  Called by wimlib_global_cleanup().  */
+void
+codec_cache_cleanup(void)
+{
+	LIST_HEAD(evicted);
+
+	mutex_lock(&cache_lock);
+	evict_cached_codecs(0, &evicted);
+	mutex_unlock(&cache_lock);
+
+	free_evicted_codecs(&evicted);
+}
+
+WIMLIBAPI int
+wimlib_set_compressor_cache_size(uint64_t max_memory)
+{
+	LIST_HEAD(evicted);
+
+	mutex_lock(&cache_lock);
+	max_cache_size = max_memory;
+	evict_cached_codecs(max_memory, &evicted);
+	mutex_unlock(&cache_lock);
+
+	free_evicted_codecs(&evicted);
+	return 0;
+}
@@ -26,9 +26,14 @@
 #  include "config.h"
 #endif
 
+#include <string.h>
+
 #include "wimlib.h"
+#include "wimlib/codec_cache.h"
 #include "wimlib/error.h"
 #include "wimlib/compressor_ops.h"
+#include "wimlib/perf_counters.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/util.h"
 
 struct wimlib_compressor {
@@ -36,6 +41,19 @@ struct wimlib_compressor {
 	void *private;
 	enum wimlib_compression_type ctype;
 	size_t max_block_size;
+	unsigned int compression_level;
+	bool destructive;
+	bool parallel;
+
+	/* Set while the compressor is compressing a group of buffers; see
+	 * compressor_start_group()  */
+	bool in_group;
+
+	/* The compressed data of an all-zero buffer of @zero_usize bytes, if
+	 * @zero_cdata isn't NULL; see compress_zeroes()  */
+	u8 *zero_cdata;
+	size_t zero_usize;
+	size_t zero_csize;
 };
 
 static const struct compressor_ops * const compressor_ops[] = {
@@ -73,6 +91,16 @@ wimlib_set_default_compression_level(int ctype, unsigned int compression_level)
 	return 0;
 }
 
+/* Return the compression level that a compressor for @ctype created with level
+ * 0 would currently use.  */
+unsigned int
+get_default_compression_level(int ctype)
+{
+	if (compressor_ctype_valid(ctype) && default_compression_levels[ctype])
+		return default_compression_levels[ctype];
+	return DEFAULT_COMPRESSION_LEVEL;
+}
+
 WIMLIBAPI u64
 wimlib_get_compressor_needed_memory(enum wimlib_compression_type ctype,
 				    size_t max_block_size,
@@ -83,7 +111,8 @@ wimlib_get_compressor_needed_memory(enum wimlib_compression_type ctype,
 	u64 size;
 
 	destructive = (compression_level & WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE);
-	compression_level &= ~WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE;
+	compression_level &= ~(WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE |
+			       WIMLIB_COMPRESSOR_FLAG_PARALLEL);
 
 	if (!compressor_ctype_valid(ctype))
 		return 0;
@@ -114,6 +143,16 @@ wimlib_get_compressor_needed_memory(enum wimlib_compression_type ctype,
 	return size + sizeof(struct wimlib_compressor);
 }
 
+/* The parameters that a cached compressor must have been created with to be
+ * reused for @c  */
+static unsigned int
+compressor_cache_params(const struct wimlib_compressor *c)
+{
+	return c->compression_level |
+		(c->destructive ? WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE : 0) |
+		(c->parallel ? WIMLIB_COMPRESSOR_FLAG_PARALLEL : 0);
+}
+
 WIMLIBAPI int
 wimlib_create_compressor(enum wimlib_compression_type ctype,
 			 size_t max_block_size,
@@ -121,6 +160,7 @@ wimlib_create_compressor(enum wimlib_compression_type ctype,
 			 struct wimlib_compressor **c_ret)
 {
 	bool destructive;
+	bool parallel;
 	struct wimlib_compressor *c;
 	int ret;
 
@@ -129,7 +169,9 @@ wimlib_create_compressor(enum wimlib_compression_type ctype,
 		return ret;
 
 	destructive = (compression_level & WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE);
-	compression_level &= ~WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE;
+	parallel = (compression_level & WIMLIB_COMPRESSOR_FLAG_PARALLEL);
+	compression_level &= ~(WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE |
+			       WIMLIB_COMPRESSOR_FLAG_PARALLEL);
 
 	if (!compressor_ctype_valid(ctype))
 		return WIMLIB_ERR_INVALID_COMPRESSION_TYPE;
@@ -150,44 +192,287 @@ wimlib_create_compressor(enum wimlib_compression_type ctype,
 	c->private = NULL;
 	c->ctype = ctype;
 	c->max_block_size = max_block_size;
+	c->in_group = false;
+	c->zero_cdata = NULL;
 	if (c->ops->create_compressor) {
 		if (compression_level == 0)
 			compression_level = default_compression_levels[ctype];
 		if (compression_level == 0)
 			compression_level = DEFAULT_COMPRESSION_LEVEL;
 
-		ret = c->ops->create_compressor(max_block_size,
-						compression_level,
-						destructive,
-						&c->private);
-		if (ret) {
-			FREE(c);
-			return ret;
+		c->compression_level = compression_level;
+		c->destructive = destructive;
+		c->parallel = parallel;
+		c->private = codec_cache_get(c->ops, max_block_size,
+					     compressor_cache_params(c));
+		if (!c->private) {
+			ret = c->ops->create_compressor(max_block_size,
+							compression_level,
+							destructive,
+							parallel,
+							&c->private);
+			if (ret) {
+				FREE(c);
+				return ret;
+			}
 		}
+		/* A compressor reused from the cache may have been used in a
+		 * group of buffers.  */
+		if (c->ops->start_group)
+			c->ops->start_group(c->private, false);
+	#ifdef ENABLE_COMPRESSOR_STATS
+		/* A compressor reused from the cache starts with fresh
+		 * statistics too.  */
+		if (c->ops->get_stats)
+			memset(c->ops->get_stats(c->private), 0,
+			       sizeof(struct wimlib_compressor_stats));
+	#endif
 	}
 	*c_ret = c;
 	return 0;
 }
 
+/*
+ * Start a new group of buffers to compress with @c, ending the previous group
+ * if any.  Each buffer compressed in a group after the first may be compressed
+ * using statistics gathered from the one before it, so its compressed data
+ * depends on that buffer too: groups must be formed the same way every time
+ * for the output to be reproducible.  The chunk compressors use groups of
+ * chunks_per_compressor_group() consecutive chunks.
+ */
+void
+compressor_start_group(struct wimlib_compressor *c)
+{
+	if (c->ops->start_group) {
+		c->ops->start_group(c->private, true);
+		c->in_group = true;
+	}
+}
+
+/*
+ * Compress the all-zero buffer of @usize bytes with @c.  Such buffers are
+ * common, e.g. in the holes of sparse files, and are slow to compress since
+ * the whole buffer matches itself everywhere.  But compressing one always gives
+ * the same result, so it is only compressed once and then copied.
+ *
+ * In a group of buffers, the result would depend on the buffers before it, and
+ * compressing it would change the result for the ones after it.  So then it is
+ * compressed once with a separate compressor, and the group continues as if the
+ * all-zero buffer weren't there.  Either way, the output only depends on the
+ * data compressed.
+ *
+ * Returns false if the compression couldn't be done this way, in which case it
+ * must be done normally.
+ */
+static bool
+compress_zeroes(size_t usize, void *out, size_t out_avail,
+		struct wimlib_compressor *c, size_t *csize_ret)
+{
+	if (!c->zero_cdata || c->zero_usize != usize) {
+		struct wimlib_compressor *zc = c;
+		u8 *zeroes, *cdata;
+		size_t csize;
+
+		zeroes = CALLOC(1, usize);
+		cdata = MALLOC(usize);
+		if (!zeroes || !cdata)
+			goto fail;
+		if (c->in_group &&
+		    wimlib_create_compressor(c->ctype, c->max_block_size,
+					     compressor_cache_params(c), &zc))
+			goto fail;
+		csize = zc->ops->compress(zeroes, usize, cdata, usize - 1,
+					  zc->private);
+		if (zc != c)
+			wimlib_free_compressor(zc);
+		FREE(zeroes);
+		FREE(c->zero_cdata);
+		c->zero_cdata = cdata;
+		c->zero_usize = usize;
+		c->zero_csize = csize;
+		goto done;
+	fail:
+		FREE(zeroes);
+		FREE(cdata);
+		return false;
+	}
+done:
+	/* A result of 0 means it couldn't be compressed at all.  */
+	if (c->zero_csize == 0 || c->zero_csize > out_avail) {
+		*csize_ret = 0;
+	} else {
+		memcpy(out, c->zero_cdata, c->zero_csize);
+		*csize_ret = c->zero_csize;
+	}
+	return true;
+}
+
 WIMLIBAPI size_t
 wimlib_compress(const void *uncompressed_data, size_t uncompressed_size,
 		void *compressed_data, size_t compressed_size_avail,
 		struct wimlib_compressor *c)
 {
+	u64 start;
+	size_t csize;
+
 	if (unlikely(uncompressed_size == 0 || uncompressed_size > c->max_block_size))
 		return 0;
 
-	return c->ops->compress(uncompressed_data, uncompressed_size,
-				compressed_data, compressed_size_avail,
-				c->private);
+	start = perf_start();
+	if (uncompressed_size < 2 ||
+	    !is_all_zeroes(uncompressed_data, uncompressed_size) ||
+	    !compress_zeroes(uncompressed_size, compressed_data,
+			     compressed_size_avail, c, &csize))
+		csize = c->ops->compress(uncompressed_data, uncompressed_size,
+					 compressed_data, compressed_size_avail,
+					 c->private);
+	perf_end(PERF_COMPRESS, start, uncompressed_size);
+
+#ifdef ENABLE_COMPRESSOR_STATS
+	if (c->ops->get_stats) {
+		struct wimlib_compressor_stats *stats =
+			c->ops->get_stats(c->private);
+
+		stats->num_calls++;
+		stats->uncompressed_bytes += uncompressed_size;
+		stats->compressed_bytes += csize;
+		stats->num_incompressible += (csize == 0);
+	}
+#endif
+	return csize;
+}
+
+WIMLIBAPI int
+wimlib_get_compressor_stats(const struct wimlib_compressor *c,
+			    struct wimlib_compressor_stats *stats)
+{
+#ifdef ENABLE_COMPRESSOR_STATS
+	if (!c || !stats)
+		return WIMLIB_ERR_INVALID_PARAM;
+	memset(stats, 0, sizeof(*stats));
+	if (c->ops->get_stats)
+		*stats = *c->ops->get_stats(c->private);
+	return 0;
+#else
+	return WIMLIB_ERR_UNSUPPORTED;
+#endif
+}
+
+/* Maximum number of compressors which wimlib_compress_batch() uses at once  */
+#define MAX_BATCH_TASKS		64
+
+struct compress_batch_task {
+	struct pool_task base;
+
+	/* The compressor to use, or NULL if it must be created like @proto  */
+	struct wimlib_compressor *c;
+	const struct wimlib_compressor *proto;
+
+	struct wimlib_codec_batch_item *items;
+	size_t num_items;
+	size_t *next_item;
+};
+
+static void
+compress_batch_task_run(struct pool_task *_task)
+{
+	struct compress_batch_task *task = (struct compress_batch_task *)_task;
+	size_t i;
+
+	/* If another compressor can't be created, the tasks which have one
+	 * just do more of the items; the first task always has one.  */
+	if (!task->c &&
+	    wimlib_create_compressor(task->proto->ctype,
+				     task->proto->max_block_size,
+				     compressor_cache_params(task->proto),
+				     &task->c))
+		return;
+
+	while ((i = __atomic_fetch_add(task->next_item, 1, __ATOMIC_RELAXED)) <
+	       task->num_items)
+	{
+		struct wimlib_codec_batch_item *item = &task->items[i];
+
+		item->result = wimlib_compress(item->in_data, item->in_size,
+					       item->out_data, item->out_size,
+					       task->c);
+	}
+}
+
+#ifdef ENABLE_COMPRESSOR_STATS
+/* Add the statistics of @src, which must be of the same type, to those of
+ * @dst.  */
+static void
+add_compressor_stats(struct wimlib_compressor *dst,
+		     const struct wimlib_compressor *src)
+{
+	if (dst->ops->get_stats) {
+		u64 *d = (u64 *)dst->ops->get_stats(dst->private);
+		const u64 *s = (const u64 *)src->ops->get_stats(src->private);
+
+		for (size_t i = 0;
+		     i < sizeof(struct wimlib_compressor_stats) / sizeof(u64); i++)
+			d[i] += s[i];
+	}
+}
+#endif
+
+WIMLIBAPI int
+wimlib_compress_batch(struct wimlib_codec_batch_item *items, size_t num_items,
+		      unsigned int num_threads, struct wimlib_compressor *c)
+{
+	struct compress_batch_task tasks[MAX_BATCH_TASKS];
+	struct pool_task *task_ptrs[MAX_BATCH_TASKS];
+	size_t next_item = 0;
+	size_t num_tasks;
+
+	if (!c || (num_items && !items))
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+	num_tasks = min(num_threads, task_pool_num_threads());
+	num_tasks = min(num_tasks, num_items);
+	num_tasks = min(num_tasks, MAX_BATCH_TASKS);
+	num_tasks = max(num_tasks, 1);
+
+	for (size_t k = 0; k < num_tasks; k++) {
+		tasks[k].base.run = compress_batch_task_run;
+		tasks[k].c = (k == 0) ? c : NULL;
+		tasks[k].proto = c;
+		tasks[k].items = items;
+		tasks[k].num_items = num_items;
+		tasks[k].next_item = &next_item;
+		task_ptrs[k] = &tasks[k].base;
+	}
+	task_pool_run_batch(task_ptrs, num_tasks);
+
+	/* With the codec cache enabled, freeing the other compressors keeps
+	 * them for the next batch.  */
+	for (size_t k = 1; k < num_tasks; k++) {
+		if (tasks[k].c) {
+		#ifdef ENABLE_COMPRESSOR_STATS
+			add_compressor_stats(c, tasks[k].c);
+		#endif
+			wimlib_free_compressor(tasks[k].c);
+		}
+	}
+	return 0;
 }
 
 WIMLIBAPI void
 wimlib_free_compressor(struct wimlib_compressor *c)
 {
 	if (c) {
-		if (c->ops->free_compressor)
+		if (c->ops->free_compressor &&
+		    !codec_cache_put(c->ops, c->max_block_size,
+				     compressor_cache_params(c),
+				     c->ops->get_needed_memory(c->max_block_size,
+							       c->compression_level,
+							       c->destructive),
+				     c->private, c->ops->free_compressor))
 			c->ops->free_compressor(c->private);
+		FREE(c->zero_cdata);
 		FREE(c);
 	}
 }
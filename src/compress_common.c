@@ -34,7 +34,10 @@
 #include <string.h>
 
 #include "wimlib/assert.h"
+#include "wimlib/bitops.h"
 #include "wimlib/compress_common.h"
+#include "wimlib/cpu_features.h"
+#include "wimlib/matchfinder_common.h"
 #include "wimlib/util.h"
 
 /*
@@ -126,7 +129,8 @@ heap_sort(u32 A[], unsigned length)
  *	frequency, which are not well defined per se but will be set to 0.
  *
  * @symout[num_syms]
- *	The output array, described above.
+ *	The output array, described above.  The entries past the ones that are
+ *	counted in the return value are used as scratch space.
  *
  * Returns the number of entries in 'symout' that were filled.  This is the
  * number of symbols that have nonzero frequency.
@@ -138,6 +142,7 @@ sort_symbols(unsigned num_syms, const u32 freqs[], u8 lens[], u32 symout[])
 	unsigned i;
 	unsigned num_used_syms;
 	unsigned num_counters;
+	unsigned last_counter_start;
 	unsigned counters[GET_NUM_COUNTERS(MAX_NUM_SYMS)];
 
 	/*
@@ -172,23 +177,24 @@ sort_symbols(unsigned num_syms, const u32 freqs[], u8 lens[], u32 symout[])
 	}
 
 	/*
-	 * Sort nonzero-frequency symbols using the counters.  At the same time,
-	 * set the codeword lengths of zero-frequency symbols to 0.
+	 * Sort the symbols using the counters.  Symbols with zero frequency are
+	 * placed after all the others, which avoids a hard-to-predict branch
+	 * in this loop.  Their codeword lengths are set to 0 afterwards.
 	 */
+	last_counter_start = counters[num_counters - 1];
+	counters[0] = num_used_syms;
 	for (sym = 0; sym < num_syms; sym++) {
 		u32 freq = freqs[sym];
 
-		if (freq != 0) {
-			symout[counters[MIN(freq, num_counters - 1)]++] =
-				sym | (freq << NUM_SYMBOL_BITS);
-		} else {
-			lens[sym] = 0;
-		}
+		symout[counters[MIN(freq, num_counters - 1)]++] =
+			sym | (freq << NUM_SYMBOL_BITS);
 	}
+	for (i = num_used_syms; i < num_syms; i++)
+		lens[symout[i]] = 0;
 
 	/* Sort the symbols counted in the last counter. */
-	heap_sort(symout + counters[num_counters - 2],
-		  counters[num_counters - 1] - counters[num_counters - 2]);
+	heap_sort(symout + last_counter_start,
+		  num_used_syms - last_counter_start);
 
 	return num_used_syms;
 }
@@ -284,8 +290,7 @@ build_tree(u32 A[], unsigned sym_count)
 
 /*
  * Given the stripped-down Huffman tree constructed by build_tree(), determine
- * the number of codewords that should be assigned each possible length, taking
- * into account the length-limited constraint.
+ * the number of codewords that should be assigned each possible length.
  *
  * @A
  *	The array produced by build_tree(), containing parent index information
@@ -306,8 +311,12 @@ build_tree(u32 A[], unsigned sym_count)
  *
  * @max_codeword_len
  *	The maximum permissible codeword length.
+ *
+ * Returns true if successful, or false if the Huffman tree is too deep to meet
+ * the length-limited constraint.  In the latter case, 'len_counts' is left in
+ * an undefined state and compute_limited_length_counts() must be used instead.
  */
-static void
+static bool
 compute_length_counts(u32 A[], unsigned root_idx, unsigned len_counts[],
 		      unsigned max_codeword_len)
 {
@@ -330,10 +339,6 @@ compute_length_counts(u32 A[], unsigned root_idx, unsigned len_counts[],
 	 *     being leaves.  This causes the loss of one codeword for the
 	 *     current depth and the addition of two codewords for the current
 	 *     depth plus one.
-	 *
-	 * (3) We can handle the length-limited constraint fairly easily by
-	 *     simply using the largest length available when a depth exceeds
-	 *     max_codeword_len.
 	 */
 
 	for (len = 0; len <= max_codeword_len; len++)
@@ -350,7 +355,10 @@ compute_length_counts(u32 A[], unsigned root_idx, unsigned len_counts[],
 		unsigned parent = A[node] >> NUM_SYMBOL_BITS;
 		unsigned parent_depth = A[parent] >> NUM_SYMBOL_BITS;
 		unsigned depth = parent_depth + 1;
-		unsigned len = depth;
+
+		/* The children of this node would be too deep?  */
+		if (unlikely(depth >= max_codeword_len))
+			return false;
 
 		/*
 		 * Set the depth of this node so that it is available when its
@@ -358,24 +366,143 @@ compute_length_counts(u32 A[], unsigned root_idx, unsigned len_counts[],
 		 */
 		A[node] = (A[node] & SYMBOL_MASK) | (depth << NUM_SYMBOL_BITS);
 
-		/*
-		 * If needed, decrease the length to meet the length-limited
-		 * constraint.  This is not the optimal method for generating
-		 * length-limited Huffman codes!  But it should be good enough.
-		 */
-		if (len >= max_codeword_len) {
-			len = max_codeword_len;
-			do {
-				len--;
-			} while (len_counts[len] == 0);
-		}
-
 		/*
 		 * Account for the fact that we have a non-leaf node at the
 		 * current depth.
 		 */
-		len_counts[len]--;
-		len_counts[len + 1] += 2;
+		len_counts[depth]--;
+		len_counts[depth + 1] += 2;
+	}
+	return true;
+}
+
+/*
+ * Determine the number of codewords that should be assigned each possible
+ * length so that the code is optimal given the length-limited constraint.  This
+ * is only needed when the Huffman code itself is too long, which is rare.
+ *
+ * This uses the package-merge algorithm.  Consider 'max_codeword_len' lists,
+ * one per codeword length.  The deepest list is just the leaves (the symbols)
+ * sorted by frequency.  Each shallower list is the leaves merged with
+ * "packages" formed by pairing up consecutive items of the list below it.  The
+ * optimal code then takes the first (2 * num_used_syms - 2) items of the
+ * shallowest list, expanding each package into the two items it was formed
+ * from.  Each symbol's codeword length is the number of lists in which its leaf
+ * was taken.  Since the leaves taken from a list are always the lowest
+ * frequency ones, it's sufficient to remember which items of each list are
+ * leaves, which is done with a bitmap per list.
+ *
+ * @A
+ *	The symbols, sorted primarily by frequency and secondarily by symbol
+ *	value, in the low NUM_SYMBOL_BITS bits of each entry
+ *
+ * @freqs
+ *	The frequency of each symbol
+ *
+ * @num_used_syms
+ *	The number of entries in 'A'.  This must be at least 2 and at most
+ *	1 << max_codeword_len.
+ *
+ * @len_counts
+ *	An array of length ('max_codeword_len' + 1) in which the number of
+ *	codewords having each length <= max_codeword_len will be returned.
+ *
+ * @max_codeword_len
+ *	The maximum permissible codeword length.
+ */
+static void
+compute_limited_length_counts(const u32 A[], const u32 freqs[],
+			      unsigned num_used_syms, unsigned len_counts[],
+			      unsigned max_codeword_len)
+{
+	enum { MAX_ITEMS = 2 * MAX_NUM_SYMS };
+	/* Greater than any real weight, but can be doubled without overflow */
+	const u32 sentinel = 0x40000000;
+	u32 leaf_weights[MAX_NUM_SYMS + 1];
+	u32 weights[2][MAX_ITEMS + 2];
+	u32 is_leaf[MAX_CODEWORD_LEN][DIV_ROUND_UP(MAX_ITEMS, 32)];
+	unsigned num_leaves_taken[MAX_CODEWORD_LEN + 1];
+	const u32 *prev;
+	u32 *cur;
+	unsigned prev_len;
+	unsigned num_taken;
+	unsigned len;
+	unsigned k;
+
+	for (k = 0; k < num_used_syms; k++)
+		leaf_weights[k] = freqs[A[k] & SYMBOL_MASK];
+	leaf_weights[num_used_syms] = sentinel;
+
+	/* The deepest list, for codeword length 'max_codeword_len'  */
+	cur = weights[0];
+	memcpy(cur, leaf_weights, num_used_syms * sizeof(cur[0]));
+	prev_len = num_used_syms;
+
+	/*
+	 * Build the shallower lists, for lengths 'max_codeword_len - 1' to 1.
+	 * Sentinels past the end of the leaves and of the previous list avoid
+	 * having to check for either running out.  Leaves win ties.  No more
+	 * than (2 * num_used_syms - 2) items are ever taken from a list, so
+	 * any items beyond that are not generated.
+	 */
+	for (len = max_codeword_len - 1; len >= 1; len--) {
+		unsigned num_items = MIN(num_used_syms + prev_len / 2,
+					 2 * num_used_syms - 2);
+		unsigned leaf = 0, pkg = 0, n;
+		u32 *bitmap = is_leaf[len];
+		u32 bits = 0;
+
+		cur[prev_len] = sentinel;
+		cur[prev_len + 1] = sentinel;
+		prev = cur;
+		cur = weights[(max_codeword_len - len) & 1];
+
+		for (n = 0; n < num_items; n++) {
+			u32 pkg_weight = prev[2 * pkg] + prev[2 * pkg + 1];
+
+			if (leaf_weights[leaf] <= pkg_weight) {
+				cur[n] = leaf_weights[leaf++];
+				bits |= (u32)1 << (n % 32);
+			} else {
+				cur[n] = pkg_weight;
+				pkg++;
+			}
+			if (n % 32 == 31) {
+				bitmap[n / 32] = bits;
+				bits = 0;
+			}
+		}
+		bitmap[n / 32] = bits;
+		prev_len = num_items;
+	}
+
+	/*
+	 * Walk back down from the shallowest list, finding how many items and
+	 * how many leaves are taken from each list.
+	 */
+	num_taken = 2 * num_used_syms - 2;
+	for (len = 1; len < max_codeword_len; len++) {
+		unsigned num_leaves = 0;
+
+		for (k = 0; k < num_taken; k++)
+			num_leaves += (is_leaf[len][k / 32] >> (k % 32)) & 1;
+		num_leaves_taken[len] = num_leaves;
+		num_taken = 2 * (num_taken - num_leaves);
+	}
+	num_leaves_taken[max_codeword_len] = num_taken;
+
+	/*
+	 * The k'th lowest frequency symbol has a codeword length equal to the
+	 * number of lists from which more than k leaves were taken.
+	 */
+	for (len = 0; len <= max_codeword_len; len++)
+		len_counts[len] = 0;
+	for (k = 0; k < num_used_syms; k++) {
+		unsigned sym_len = 0;
+
+		for (len = 1; len <= max_codeword_len; len++)
+			sym_len += (k < num_leaves_taken[len]);
+		len_counts[sym_len]++;
 	}
 }
 
@@ -478,9 +605,8 @@ gen_codewords(u32 A[], u8 lens[], const unsigned len_counts[],
  * This function builds a length-limited canonical Huffman code.
  *
  * A length-limited Huffman code contains no codewords longer than some
- * specified length, and has exactly (with some algorithms) or approximately
- * (with the algorithm used here) the minimum weighted path length from the
- * root, given this constraint.
+ * specified length, and has the minimum weighted path length from the root,
+ * given this constraint.
  *
  * A canonical Huffman code satisfies the properties that a longer codeword
  * never lexicographically precedes a shorter codeword, and the lexicographic
@@ -558,8 +684,10 @@ gen_codewords(u32 A[], u8 lens[], const unsigned len_counts[],
  * sometimes shortening the longest codeword that is generated.
  *
  * There also is the issue of how codewords longer than @max_codeword_len are
- * dealt with.  Fortunately, for LZMS this is irrelevant because for the LZMS
- * alphabets no codeword can ever exceed LZMS_MAX_CODEWORD_LEN (= 15).  Since
+ * dealt with.  When the Huffman tree is too deep, we discard it and use the
+ * package-merge algorithm instead, which finds an optimal length-limited code.
+ * This cannot break LZMS's requirement, because for the LZMS alphabets no
+ * codeword can ever exceed LZMS_MAX_CODEWORD_LEN (= 15).  Since
  * the LZMS algorithm regularly halves all frequencies, the frequencies cannot
  * become high enough for a length 16 codeword to be generated.  Specifically, I
  * think that if ties are broken in favor of non-leaves (as we do), the lowest
@@ -663,9 +791,169 @@ make_canonical_huffman_code(unsigned num_syms, unsigned max_codeword_len,
 	{
 		unsigned len_counts[MAX_CODEWORD_LEN + 1];
 
-		compute_length_counts(A, num_used_syms - 2,
-				      len_counts, max_codeword_len);
+		if (!compute_length_counts(A, num_used_syms - 2,
+					   len_counts, max_codeword_len))
+			compute_limited_length_counts(A, freqs, num_used_syms,
+						      len_counts,
+						      max_codeword_len);
 
 		gen_codewords(A, lens, len_counts, max_codeword_len, num_syms);
 	}
 }
+
+#define ENTROPY_FRAC_BITS	8
+#define ENTROPY_SAMPLE_SIZE	65536
+#define ENTROPY_PIECE_SIZE	64
+
+/* Return log2(v) as a fixed-point number with ENTROPY_FRAC_BITS fractional
+ * bits.  'v' must be nonzero and less than 2**31.  */
+static u32
+log2_fixed(u32 v)
+{
+	unsigned int_part = bsr32(v);
+	u64 m = (u64)v << (31 - int_part);
+	u32 res = int_part << ENTROPY_FRAC_BITS;
+
+	/* 'm' is now in [1, 2) with 31 fractional bits.  Each squaring yields
+	 * the next bit of the logarithm.  */
+	for (int bit = ENTROPY_FRAC_BITS - 1; bit >= 0; bit--) {
+		m = (m * m) >> 31;
+		if (m >= ((u64)1 << 32)) {
+			m >>= 1;
+			res |= (u32)1 << bit;
+		}
+	}
+	return res;
+}
+
+/*
+ * Guess whether the given data is incompressible, e.g. because it's already
+ * compressed (cabinet files, ZIP archives, JPEG images, etc.), by estimating
+ * its order-0 entropy from a sample of up to 64 KiB of it.  This is meant to be
+ * much cheaper than actually trying to compress the data, so it doesn't look
+ * for matches at all; it only says the data is incompressible when its bytes
+ * are so close to uniformly distributed that the compressor would almost
+ * certainly have to store it uncompressed anyway.
+ */
+bool
+data_seems_incompressible(const void *data, size_t size)
+{
+	const u8 *p = data;
+	u32 freqs[256] = { 0 };
+	u32 num_sampled;
+	u64 bits;
+	u32 log2_n;
+
+	if (size < 1024)
+		return false;
+
+	if (size <= ENTROPY_SAMPLE_SIZE) {
+		for (size_t i = 0; i < size; i++)
+			freqs[p[i]]++;
+		num_sampled = size;
+	} else {
+		size_t stride = size / (ENTROPY_SAMPLE_SIZE / ENTROPY_PIECE_SIZE);
+
+		for (u32 piece = 0;
+		     piece < ENTROPY_SAMPLE_SIZE / ENTROPY_PIECE_SIZE; piece++)
+		{
+			const u8 *q = p + piece * stride;
+
+			for (u32 i = 0; i < ENTROPY_PIECE_SIZE; i++)
+				freqs[q[i]]++;
+		}
+		num_sampled = ENTROPY_SAMPLE_SIZE;
+	}
+
+	/* bits = sum(freq * log2(n / freq)) over all bytes seen  */
+	log2_n = log2_fixed(num_sampled);
+	bits = 0;
+	for (unsigned sym = 0; sym < 256; sym++)
+		if (freqs[sym])
+			bits += (u64)freqs[sym] * (log2_n - log2_fixed(freqs[sym]));
+
+	/* Incompressible if more than 7.9 bits per byte  */
+	return bits * 10 > (u64)num_sampled * (79 << ENTROPY_FRAC_BITS);
+}
+
+#ifdef HAVE_LZ_EXTEND_WIDE
+#include <immintrin.h>
+
+/*
+ * The part of lz_extend() for long matches: compare 32 bytes at a time.  At
+ * least 32 bytes must remain before @max_len.  The last, partial vector is
+ * handled by comparing the final 32 bytes again, which works because any bytes
+ * it shares with the vectors already compared are known to match.
+ */
+static unsigned __attribute__((target("avx2")))
+lz_extend_avx2(const u8 *strptr, const u8 *matchptr,
+	       unsigned len, unsigned max_len)
+{
+	u32 mask;
+
+	for (;;) {
+		if (len + 32 > max_len)
+			len = max_len - 32;
+		mask = ~(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const void *)&strptr[len]),
+			_mm256_loadu_si256((const void *)&matchptr[len])));
+		if (mask != 0)
+			return len + bsf32(mask);
+		len += 32;
+		if (len >= max_len)
+			return max_len;
+	}
+}
+
+/*
+ * Like lz_extend_avx2(), but compare 64 bytes at a time.  The last, partial
+ * vector is loaded with a mask, which doesn't touch the bytes past @max_len.
+ */
+static unsigned __attribute__((target("avx512f,avx512bw")))
+lz_extend_avx512(const u8 *strptr, const u8 *matchptr,
+		 unsigned len, unsigned max_len)
+{
+	for (;;) {
+		unsigned remaining = max_len - len;
+		__mmask64 valid = (remaining >= 64) ? ~(__mmask64)0 :
+			((__mmask64)1 << remaining) - 1;
+		__mmask64 differ = _mm512_mask_cmpneq_epi8_mask(valid,
+			_mm512_maskz_loadu_epi8(valid, &strptr[len]),
+			_mm512_maskz_loadu_epi8(valid, &matchptr[len]));
+
+		if (differ != 0)
+			return len + bsf64(differ);
+		if (remaining <= 64)
+			return max_len;
+		len += 64;
+	}
+}
+
+lz_extend_wide_func_t lz_extend_wide;
+
+/*
+ * Most matches are short and are compared without this, so the 512-bit version
+ * would rarely pay for the lower clock rate that 512-bit instructions cause on
+ * some CPUs.  So it isn't preferred, but it can be selected with
+ * WIMLIB_CPU_FEATURES=lz_extend=avx512 for comparison.
+ */
+static const struct cpu_impl lz_extend_impls[] = {
+	{ "avx2", (cpu_func_t)lz_extend_avx2, X86_CPU_FEATURE_AVX2 },
+	{ "avx512", (cpu_func_t)lz_extend_avx512,
+	  X86_CPU_FEATURE_AVX512F | X86_CPU_FEATURE_AVX512BW },
+	{ "generic", NULL, 0 },
+};
+
+static void
+lz_extend_select(const struct cpu_impl *impl)
+{
+	lz_extend_wide = (lz_extend_wide_func_t)impl->func;
+}
+
+const struct cpu_kernel lz_extend_kernel = {
+	.name = "lz_extend",
+	.impls = lz_extend_impls,
+	.num_impls = ARRAY_LEN(lz_extend_impls),
+	.select = lz_extend_select,
+};
+#endif /* HAVE_LZ_EXTEND_WIDE */
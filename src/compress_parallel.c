@@ -31,26 +31,16 @@
 
 #include "wimlib/assert.h"
 #include "wimlib/chunk_compressor.h"
+#include "wimlib/compress_common.h"
+#include "wimlib/compressor_ops.h"
 #include "wimlib/error.h"
 #include "wimlib/list.h"
-#include "wimlib/threads.h"
+#include "wimlib/perf_counters.h"
+#include "wimlib/ring_buffer.h"
+#include "wimlib/task_pool.h"
+#include "wimlib/trace.h"
 #include "wimlib/util.h"
 
-struct message_queue {
-	struct list_head list;
-	struct mutex lock;
-	struct condvar msg_avail_cond;
-	struct condvar space_avail_cond;
-	bool terminating;
-};
-
-struct compressor_thread_data {
-	struct thread thread;
-	struct message_queue *chunks_to_compress_queue;
-	struct message_queue *compressed_chunks_queue;
-	struct wimlib_compressor *compressor;
-};
-
 #define MAX_CHUNKS_PER_MSG 16
 
 struct message {
@@ -63,16 +53,24 @@ struct message {
 	struct list_head list;
 	bool complete;
 	struct list_head submission_list;
+	struct parallel_chunk_compressor *ctx;
 };
 
 struct parallel_chunk_compressor {
 	struct chunk_compressor base;
 
-	struct message_queue chunks_to_compress_queue;
-	struct message_queue compressed_chunks_queue;
-	struct compressor_thread_data *thread_data;
-	unsigned num_thread_data;
-	unsigned num_started_threads;
+	struct worker_group workers;
+	struct ring_buffer compressed_chunks_queue;
+
+	/* The compressor of each worker, or NULL if the worker hasn't needed
+	 * one yet.  Only the first one is created up front; the others are
+	 * created by the workers when they are first used, so when the data
+	 * can't be read (or written) fast enough to keep all workers busy, the
+	 * memory for the compressors of the workers which are never needed is
+	 * never allocated.  */
+	struct wimlib_compressor **compressors;
+	unsigned num_compressors;
+	int compressor_flags;
 
 	struct message *msgs;
 	size_t num_messages;
@@ -82,74 +80,14 @@ struct parallel_chunk_compressor {
 	struct message *next_submit_msg;
 	struct message *next_ready_msg;
 	size_t next_chunk_idx;
-};
-
-
-
-static int
-message_queue_init(struct message_queue *q)
-{
-	if (!mutex_init(&q->lock))
-		goto err;
-	if (!condvar_init(&q->msg_avail_cond))
-		goto err_destroy_lock;
-	if (!condvar_init(&q->space_avail_cond))
-		goto err_destroy_msg_avail_cond;
-	INIT_LIST_HEAD(&q->list);
-	return 0;
-
-err_destroy_msg_avail_cond:
-	condvar_destroy(&q->msg_avail_cond);
-err_destroy_lock:
-	mutex_destroy(&q->lock);
-err:
-	return WIMLIB_ERR_NOMEM;
-}
-
-static void
-message_queue_destroy(struct message_queue *q)
-{
-	if (q->list.next != NULL) {
-		mutex_destroy(&q->lock);
-		condvar_destroy(&q->msg_avail_cond);
-		condvar_destroy(&q->space_avail_cond);
-	}
-}
-
-static void
-message_queue_put(struct message_queue *q, struct message *msg)
-{
-	mutex_lock(&q->lock);
-	list_add_tail(&msg->list, &q->list);
-	condvar_signal(&q->msg_avail_cond);
-	mutex_unlock(&q->lock);
-}
 
-static struct message *
-message_queue_get(struct message_queue *q)
-{
-	struct message *msg;
+	/* Messages hold a multiple of this many chunks, so that no group of
+	 * chunks_per_compressor_group() spans two messages.  Only the last
+	 * message can end in the middle of a group.  */
+	unsigned chunks_per_group;
+};
 
-	mutex_lock(&q->lock);
-	while (list_empty(&q->list) && !q->terminating)
-		condvar_wait(&q->msg_avail_cond, &q->lock);
-	if (!q->terminating) {
-		msg = list_entry(q->list.next, struct message, list);
-		list_del(&msg->list);
-	} else
-		msg = NULL;
-	mutex_unlock(&q->lock);
-	return msg;
-}
 
-static void
-message_queue_terminate(struct message_queue *q)
-{
-	mutex_lock(&q->lock);
-	q->terminating = true;
-	condvar_broadcast(&q->msg_avail_cond);
-	mutex_unlock(&q->lock);
-}
 
 static int
 init_message(struct message *msg, size_t num_chunks, u32 out_chunk_size)
@@ -204,9 +142,21 @@ allocate_messages(size_t count, size_t chunks_per_msg, u32 out_chunk_size)
 static void
 compress_chunks(struct message *msg, struct wimlib_compressor *compressor)
 {
+	bool skip_incompressible = msg->ctx->base.skip_incompressible;
+	unsigned chunks_per_group = msg->ctx->chunks_per_group;
+	u64 trace_start = trace_begin();
 
 	for (size_t i = 0; i < msg->num_filled_chunks; i++) {
 		wimlib_assert(msg->uncompressed_chunk_sizes[i] != 0);
+		if (i % chunks_per_group == 0)
+			compressor_start_group(compressor);
+		if (skip_incompressible &&
+		    data_seems_incompressible(msg->uncompressed_chunks[i],
+					      msg->uncompressed_chunk_sizes[i]))
+		{
+			msg->compressed_chunk_sizes[i] = 0;
+			continue;
+		}
 		msg->compressed_chunk_sizes[i] =
 			wimlib_compress(msg->uncompressed_chunks[i],
 					msg->uncompressed_chunk_sizes[i],
@@ -214,19 +164,32 @@ compress_chunks(struct message *msg, struct wimlib_compressor *compressor)
 					msg->uncompressed_chunk_sizes[i] - 1,
 					compressor);
 	}
+	trace_end("compress_chunks", trace_start);
 }
 
-static void *
-compressor_thread_proc(void *arg)
+/* Compress a message on the task pool, using the worker's compressor, which is
+ * created if this is the first message the worker has processed.  If this
+ * fails, the chunks are stored uncompressed, which is always allowed.  */
+static void
+compressor_worker_process(void *item, void *worker_ctx)
 {
-	struct compressor_thread_data *params = arg;
-	struct message *msg;
-
-	while ((msg = message_queue_get(params->chunks_to_compress_queue)) != NULL) {
-		compress_chunks(msg, params->compressor);
-		message_queue_put(params->compressed_chunks_queue, msg);
+	struct message *msg = item;
+	struct parallel_chunk_compressor *ctx = msg->ctx;
+	struct wimlib_compressor **compressor_p = worker_ctx;
+
+	if (!*compressor_p &&
+	    wimlib_create_compressor(ctx->base.out_ctype,
+				     ctx->base.out_chunk_size,
+				     ctx->compressor_flags, compressor_p))
+		*compressor_p = NULL;
+
+	if (*compressor_p) {
+		compress_chunks(msg, *compressor_p);
+	} else {
+		for (size_t i = 0; i < msg->num_filled_chunks; i++)
+			msg->compressed_chunk_sizes[i] = 0;
 	}
-	return NULL;
+	ring_buffer_put(&ctx->compressed_chunks_queue, msg);
 }
 
 static void
@@ -238,21 +201,15 @@ parallel_chunk_compressor_destroy(struct chunk_compressor *_ctx)
 	if (ctx == NULL)
 		return;
 
-	if (ctx->num_started_threads != 0) {
-		message_queue_terminate(&ctx->chunks_to_compress_queue);
-
-		for (i = 0; i < ctx->num_started_threads; i++)
-			thread_join(&ctx->thread_data[i].thread);
-	}
+	worker_group_destroy(&ctx->workers);
 
-	message_queue_destroy(&ctx->chunks_to_compress_queue);
-	message_queue_destroy(&ctx->compressed_chunks_queue);
+	ring_buffer_destroy(&ctx->compressed_chunks_queue);
 
-	if (ctx->thread_data != NULL)
-		for (i = 0; i < ctx->num_thread_data; i++)
-			wimlib_free_compressor(ctx->thread_data[i].compressor);
+	if (ctx->compressors != NULL)
+		for (i = 0; i < ctx->num_compressors; i++)
+			wimlib_free_compressor(ctx->compressors[i]);
 
-	FREE(ctx->thread_data);
+	FREE(ctx->compressors);
 
 	free_messages(ctx->msgs, ctx->num_messages);
 
@@ -266,7 +223,7 @@ submit_compression_msg(struct parallel_chunk_compressor *ctx)
 
 	msg->complete = false;
 	list_add_tail(&msg->submission_list, &ctx->submitted_msgs);
-	message_queue_put(&ctx->chunks_to_compress_queue, msg);
+	worker_group_submit(&ctx->workers, msg);
 	ctx->next_submit_msg = NULL;
 }
 
@@ -303,8 +260,16 @@ parallel_chunk_compressor_signal_chunk_filled(struct chunk_compressor *_ctx, u32
 
 	msg = ctx->next_submit_msg;
 	msg->uncompressed_chunk_sizes[msg->num_filled_chunks] = usize;
-	if (++msg->num_filled_chunks == msg->num_alloc_chunks)
+	if (++msg->num_filled_chunks == msg->num_alloc_chunks) {
+		submit_compression_msg(ctx);
+	} else if (msg->num_filled_chunks % ctx->chunks_per_group == 0 &&
+		   worker_group_all_idle(&ctx->workers)) {
+		/* The chunks are being read more slowly than they can be
+		 * compressed, so don't leave the workers waiting until the
+		 * message is full.  Since the message ends at a group
+		 * boundary, this doesn't change the compressed data.  */
 		submit_compression_msg(ctx);
+	}
 }
 
 static bool
@@ -327,7 +292,13 @@ parallel_chunk_compressor_get_compression_result(struct chunk_compressor *_ctx,
 		while (!(msg = list_entry(ctx->submitted_msgs.next,
 					  struct message,
 					  submission_list))->complete)
-			message_queue_get(&ctx->compressed_chunks_queue)->complete = true;
+		{
+			u64 start = perf_start();
+
+			((struct message *)
+			 ring_buffer_get(&ctx->compressed_chunks_queue))->complete = true;
+			perf_end(PERF_COMPRESS_WAIT, start, 0);
+		}
 
 		ctx->next_ready_msg = msg;
 		ctx->next_chunk_idx = 0;
@@ -353,6 +324,7 @@ parallel_chunk_compressor_get_compression_result(struct chunk_compressor *_ctx,
 int
 new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 			      unsigned num_threads, u64 max_memory,
+			      bool skip_incompressible,
 			      struct chunk_compressor **compressor_ret)
 {
 	u64 approx_mem_required;
@@ -362,12 +334,18 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 	unsigned i;
 	int ret;
 	unsigned desired_num_threads;
+	unsigned chunks_per_group;
+	void **worker_ctxs;
 
 	wimlib_assert(out_chunk_size > 0);
 
 	if (num_threads == 0)
 		num_threads = get_available_cpus();
 
+	/* The compression is done on the library-wide task pool, so there's no
+	 * point in using more compressors than it has threads.  */
+	num_threads = min(num_threads, task_pool_num_threads());
+
 	if (num_threads == 1)
 		return -1;
 
@@ -391,6 +369,10 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 		chunks_per_msg = 1;
 		msgs_per_thread = 1;
 	}
+	chunks_per_group = chunks_per_compressor_group(out_ctype,
+						       out_chunk_size);
+	STATIC_ASSERT(MAX_CHUNKS_PER_MSG % 16 == 0);
+	chunks_per_msg = ALIGN(chunks_per_msg, chunks_per_group);
 	for (;;) {
 		approx_mem_required =
 			(u64)chunks_per_msg *
@@ -405,8 +387,8 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 		if (approx_mem_required <= max_memory)
 			break;
 
-		if (chunks_per_msg > 1)
-			chunks_per_msg--;
+		if (chunks_per_msg > chunks_per_group)
+			chunks_per_msg -= chunks_per_group;
 		else if (msgs_per_thread > 1)
 			msgs_per_thread--;
 		else if (num_threads > 1)
@@ -431,67 +413,69 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 
 	ctx->base.out_ctype = out_ctype;
 	ctx->base.out_chunk_size = out_chunk_size;
+	ctx->chunks_per_group = chunks_per_group;
 	ctx->base.destroy = parallel_chunk_compressor_destroy;
 	ctx->base.get_chunk_buffer = parallel_chunk_compressor_get_chunk_buffer;
 	ctx->base.signal_chunk_filled = parallel_chunk_compressor_signal_chunk_filled;
 	ctx->base.get_compression_result = parallel_chunk_compressor_get_compression_result;
 
-	ctx->num_thread_data = num_threads;
+	/* Each message is either available, being filled, being compressed, or
+	 * compressed, so neither queue of messages can hold more than all of
+	 * them.  */
+	ctx->num_messages = num_threads * msgs_per_thread;
 
-	ret = message_queue_init(&ctx->chunks_to_compress_queue);
+	ret = ring_buffer_init(&ctx->compressed_chunks_queue, ctx->num_messages);
 	if (ret)
 		goto err;
 
-	ret = message_queue_init(&ctx->compressed_chunks_queue);
+	ret = WIMLIB_ERR_NOMEM;
+	ctx->compressors = CALLOC(num_threads, sizeof(ctx->compressors[0]));
+	if (ctx->compressors == NULL)
+		goto err;
+	ctx->num_compressors = num_threads;
+
+	/* LZMS compressors can build their suffix arrays on threads of the task
+	 * pool which would otherwise be idle, e.g. when there are fewer big
+	 * solid chunks left than threads.  Unlike parallel LZX, this doesn't
+	 * change the compressed data.  */
+	ctx->compressor_flags = WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE;
+	if (out_ctype == WIMLIB_COMPRESSION_TYPE_LZMS)
+		ctx->compressor_flags |= WIMLIB_COMPRESSOR_FLAG_PARALLEL;
+
+	/* Create one compressor now, so that invalid parameters are reported
+	 * and at least one worker can always compress.  */
+	ret = wimlib_create_compressor(out_ctype, out_chunk_size,
+				       ctx->compressor_flags,
+				       &ctx->compressors[0]);
 	if (ret)
 		goto err;
 
 	ret = WIMLIB_ERR_NOMEM;
-	ctx->thread_data = CALLOC(num_threads, sizeof(ctx->thread_data[0]));
-	if (ctx->thread_data == NULL)
+	worker_ctxs = MALLOC(num_threads * sizeof(worker_ctxs[0]));
+	if (worker_ctxs == NULL)
+		goto err;
+	for (i = 0; i < num_threads; i++)
+		worker_ctxs[i] = &ctx->compressors[i];
+	ret = worker_group_init(&ctx->workers, num_threads, ctx->num_messages,
+				compressor_worker_process, worker_ctxs);
+	FREE(worker_ctxs);
+	if (ret)
 		goto err;
 
-	for (i = 0; i < num_threads; i++) {
-		struct compressor_thread_data *dat;
-
-		dat = &ctx->thread_data[i];
-
-		dat->chunks_to_compress_queue = &ctx->chunks_to_compress_queue;
-		dat->compressed_chunks_queue = &ctx->compressed_chunks_queue;
-		ret = wimlib_create_compressor(out_ctype, out_chunk_size,
-					       WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE,
-					       &dat->compressor);
-		if (ret)
-			goto err;
-	}
-
-	for (ctx->num_started_threads = 0;
-	     ctx->num_started_threads < num_threads;
-	     ctx->num_started_threads++)
-	{
-		if (!thread_create(&ctx->thread_data[ctx->num_started_threads].thread,
-				   compressor_thread_proc,
-				   &ctx->thread_data[ctx->num_started_threads]))
-		{
-			ret = WIMLIB_ERR_NOMEM;
-			if (ctx->num_started_threads >= 2)
-				break;
-			goto err;
-		}
-	}
-
-	ctx->base.num_threads = ctx->num_started_threads;
+	ctx->base.num_threads = num_threads;
+	ctx->base.skip_incompressible = skip_incompressible;
 
 	ret = WIMLIB_ERR_NOMEM;
-	ctx->num_messages = ctx->num_started_threads * msgs_per_thread;
 	ctx->msgs = allocate_messages(ctx->num_messages,
 				      chunks_per_msg, out_chunk_size);
 	if (ctx->msgs == NULL)
 		goto err;
 
 	INIT_LIST_HEAD(&ctx->available_msgs);
-	for (size_t i = 0; i < ctx->num_messages; i++)
+	for (size_t i = 0; i < ctx->num_messages; i++) {
+		ctx->msgs[i].ctx = ctx;
 		list_add_tail(&ctx->msgs[i].list, &ctx->available_msgs);
+	}
 
 	INIT_LIST_HEAD(&ctx->submitted_msgs);
 
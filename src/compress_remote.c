@@ -0,0 +1,1096 @@
+/*
+ * compress_remote.c
+ *
+ * Compress chunks of data (remote version), on compression workers which are
+ * reached over TCP, as well as the worker side of the protocol.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * The chunks are sent in batches over TCP connections to the workers, which
+ * are processes that run wimlib_serve_compression().  Each worker tells the
+ * client how many connections to open to it, normally one per thread, and each
+ * connection has a batch compressed at a time, so the number of chunks being
+ * compressed at once is the total number of threads of the workers.
+ *
+ * The protocol is as follows.  All integers are 32-bit little endian.
+ *
+ * - The client sends a hello: REMOTE_MAGIC, REMOTE_VERSION, the compression
+ *   type, the chunk size, the compression level, and the REMOTE_FLAG_* flags.
+ *   The worker replies with a status, which is 0 or a wimlib error code, and
+ *   the number of connections that the client should open to it.
+ *
+ * - For each batch, the client sends the number of chunks, then the
+ *   uncompressed size and the data of each chunk.  After it has received the
+ *   whole batch, the worker compresses the chunks in order, starting a group
+ *   (see compressor_start_group()) every chunks_per_compressor_group() chunks
+ *   counting from the first chunk of the batch, and sends back the compressed
+ *   size and the compressed data of each chunk.  A compressed size of 0 means
+ *   that the chunk is to be stored uncompressed.  Batches start at group
+ *   boundaries, so the compressed data is the same as with the serial and
+ *   parallel chunk compressors.
+ *
+ * - A batch of 0 chunks ends the connection.
+ *
+ * If a connection fails, its batch is handed over to the other connections;
+ * if it was the last one, the remaining batches are compressed locally.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#ifndef _WIN32
+#  include <netdb.h>
+#  include <netinet/in.h>
+#  include <netinet/tcp.h>
+#  include <sys/socket.h>
+#  include <unistd.h>
+#endif
+
+#include "wimlib.h"
+#include "wimlib/assert.h"
+#include "wimlib/chunk_compressor.h"
+#include "wimlib/compress_common.h"
+#include "wimlib/compressor_ops.h"
+#include "wimlib/endianness.h"
+#include "wimlib/error.h"
+#include "wimlib/list.h"
+#include "wimlib/perf_counters.h"
+#include "wimlib/ring_buffer.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+
+#ifdef _WIN32
+
+int
+new_remote_chunk_compressor(int out_ctype, u32 out_chunk_size,
+			    const tchar *workers, u64 max_memory,
+			    bool skip_incompressible,
+			    struct chunk_compressor **compressor_ret)
+{
+	return WIMLIB_ERR_UNSUPPORTED;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_serve_compression(const tchar *address, unsigned num_threads, int flags)
+{
+	return WIMLIB_ERR_UNSUPPORTED;
+}
+
+#else /* _WIN32 */
+
+#define REMOTE_MAGIC		0x4352574c	/* "LWRC" */
+#define REMOTE_VERSION		1
+#define REMOTE_DEFAULT_PORT	"7637"
+
+/* Set in the hello if chunks that data_seems_incompressible() are to be stored
+ * uncompressed without running the compressor on them  */
+#define REMOTE_FLAG_SKIP_INCOMPRESSIBLE	0x00000001
+
+#define REMOTE_MAX_CHUNKS_PER_BATCH	64
+
+/* Limits on the number of connections, so that a bad reply can't make the
+ * client open too many  */
+#define REMOTE_MAX_CONNS_PER_WORKER	256
+#define REMOTE_MAX_CONNS		1024
+
+#ifdef MSG_NOSIGNAL
+#  define REMOTE_SEND_FLAGS		MSG_NOSIGNAL
+#else
+#  define REMOTE_SEND_FLAGS		0
+#endif
+
+/* Send all @size bytes at @buf over the socket @fd.  */
+static int
+remote_send(int fd, const void *buf, size_t size)
+{
+	const u8 *p = buf;
+
+	while (size) {
+		ssize_t ret = send(fd, p, size, REMOTE_SEND_FLAGS);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return WIMLIB_ERR_NETWORK;
+		}
+		p += ret;
+		size -= ret;
+	}
+	return 0;
+}
+
+/* Receive exactly @size bytes into @buf from the socket @fd.  */
+static int
+remote_recv(int fd, void *buf, size_t size)
+{
+	u8 *p = buf;
+
+	while (size) {
+		ssize_t ret = recv(fd, p, size, 0);
+
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			return WIMLIB_ERR_NETWORK;
+		}
+		p += ret;
+		size -= ret;
+	}
+	return 0;
+}
+
+static int
+remote_send_u32(int fd, u32 v)
+{
+	le32 v_le = cpu_to_le32(v);
+
+	return remote_send(fd, &v_le, sizeof(v_le));
+}
+
+static int
+remote_recv_u32(int fd, u32 *v_ret)
+{
+	le32 v_le;
+	int ret;
+
+	ret = remote_recv(fd, &v_le, sizeof(v_le));
+	*v_ret = le32_to_cpu(v_le);
+	return ret;
+}
+
+static void
+remote_set_socket_options(int fd)
+{
+	int one = 1;
+
+	/* The batches are sent with several calls, so don't have the last
+	 * bytes of each wait for acknowledgment of the previous ones.  Also
+	 * detect a worker that went away without closing its connection.  */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+/*
+ * Split @address, of the form "host:port", "[host]:port" or "host", into its
+ * host and port, which are returned as pointers into @buf.  The port defaults
+ * to REMOTE_DEFAULT_PORT.  If @passive, the host may be empty, and @address may
+ * also be just a port number.  An empty host is returned as NULL.  Returns
+ * false if the address is invalid or too long.
+ */
+static bool
+remote_parse_address(const char *address, bool passive, char *buf,
+		     size_t bufsize, const char **host_ret,
+		     const char **port_ret)
+{
+	char *host = buf;
+	char *port = NULL;
+	char *p;
+
+	if (strlen(address) >= bufsize)
+		return false;
+	strcpy(buf, address);
+
+	if (*host == '[') {
+		/* Bracketed IPv6 address  */
+		p = strchr(++host, ']');
+		if (p == NULL || (p[1] != ':' && p[1] != '\0'))
+			return false;
+		*p = '\0';
+		if (p[1] == ':')
+			port = p + 2;
+	} else if ((p = strchr(host, ':')) != NULL) {
+		/* "host:port", unless it's an IPv6 address without a port  */
+		if (strchr(p + 1, ':') == NULL) {
+			*p = '\0';
+			port = p + 1;
+		}
+	} else if (passive && strspn(host, "0123456789") == strlen(host)) {
+		port = host;
+		host = NULL;
+	}
+
+	if (host && *host == '\0') {
+		if (!passive)
+			return false;
+		host = NULL;
+	}
+	if (port == NULL || *port == '\0')
+		port = REMOTE_DEFAULT_PORT;
+	*host_ret = host;
+	*port_ret = port;
+	return true;
+}
+
+/*----------------------------------------------------------------------------*
+ *                                Client side                                 *
+ *----------------------------------------------------------------------------*/
+
+struct remote_batch {
+	u8 *uncompressed_chunks[REMOTE_MAX_CHUNKS_PER_BATCH];
+	u8 *compressed_chunks[REMOTE_MAX_CHUNKS_PER_BATCH];
+	u32 uncompressed_chunk_sizes[REMOTE_MAX_CHUNKS_PER_BATCH];
+	u32 compressed_chunk_sizes[REMOTE_MAX_CHUNKS_PER_BATCH];
+	size_t num_filled_chunks;
+	size_t num_alloc_chunks;
+	struct list_head list;
+	bool complete;
+	struct list_head submission_list;
+};
+
+struct remote_connection {
+	struct remote_chunk_compressor *ctx;
+
+	/* The socket, or -1 once the connection has failed  */
+	int fd;
+
+	/* The worker's address, as it was given  */
+	const char *worker;
+
+	/* Compressor for the batches that are compressed locally because all
+	 * connections failed, or NULL if not needed yet  */
+	struct wimlib_compressor *local_compressor;
+
+	struct thread thread;
+	bool thread_started;
+};
+
+struct remote_chunk_compressor {
+	struct chunk_compressor base;
+
+	struct remote_connection *conns;
+	unsigned num_conns;
+
+	/* Copy of the list of workers, in which each address is terminated by a
+	 * null character  */
+	char *workers;
+
+	/* Batches waiting for a connection, then, when the chunk compressor is
+	 * destroyed, a pointer to the chunk compressor itself for each
+	 * connection thread, which tells it to exit  */
+	struct ring_buffer pending_batches;
+
+	/* Batches whose chunks have been compressed  */
+	struct ring_buffer compressed_batches;
+
+	/* Number of connections that haven't failed, protected by @lock  */
+	unsigned num_live_conns;
+	struct mutex lock;
+
+	unsigned compression_level;
+
+	struct remote_batch *batches;
+	size_t num_batches;
+
+	struct list_head available_batches;
+	struct list_head submitted_batches;
+	struct remote_batch *next_submit_batch;
+	struct remote_batch *next_ready_batch;
+	size_t next_chunk_idx;
+
+	/* Batches hold a multiple of this many chunks, so that no group of
+	 * chunks_per_compressor_group() spans two batches.  Only the last batch
+	 * can end in the middle of a group.  */
+	unsigned chunks_per_group;
+};
+
+/* Have a batch compressed over the connection @conn.  */
+static int
+remote_compress_batch(struct remote_connection *conn,
+		      struct remote_batch *batch)
+{
+	int fd = conn->fd;
+	int ret;
+
+	ret = remote_send_u32(fd, batch->num_filled_chunks);
+	for (size_t i = 0; i < batch->num_filled_chunks && !ret; i++) {
+		ret = remote_send_u32(fd, batch->uncompressed_chunk_sizes[i]);
+		if (!ret)
+			ret = remote_send(fd, batch->uncompressed_chunks[i],
+					  batch->uncompressed_chunk_sizes[i]);
+	}
+
+	for (size_t i = 0; i < batch->num_filled_chunks && !ret; i++) {
+		u32 csize;
+
+		ret = remote_recv_u32(fd, &csize);
+		if (ret)
+			break;
+		if (csize >= batch->uncompressed_chunk_sizes[i])
+			return WIMLIB_ERR_NETWORK;
+		batch->compressed_chunk_sizes[i] = csize;
+		if (csize)
+			ret = remote_recv(fd, batch->compressed_chunks[i],
+					  csize);
+	}
+	return ret;
+}
+
+/* Compress a batch in this process, storing its chunks uncompressed if the
+ * compressor can't be created.  */
+static void
+local_compress_batch(struct remote_connection *conn, struct remote_batch *batch)
+{
+	struct remote_chunk_compressor *ctx = conn->ctx;
+
+	if (!conn->local_compressor &&
+	    wimlib_create_compressor(ctx->base.out_ctype,
+				     ctx->base.out_chunk_size,
+				     ctx->compression_level |
+					WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE,
+				     &conn->local_compressor))
+		conn->local_compressor = NULL;
+
+	for (size_t i = 0; i < batch->num_filled_chunks; i++) {
+		batch->compressed_chunk_sizes[i] = 0;
+		if (!conn->local_compressor)
+			continue;
+		if (i % ctx->chunks_per_group == 0)
+			compressor_start_group(conn->local_compressor);
+		if (ctx->base.skip_incompressible &&
+		    data_seems_incompressible(batch->uncompressed_chunks[i],
+					      batch->uncompressed_chunk_sizes[i]))
+			continue;
+		batch->compressed_chunk_sizes[i] =
+			wimlib_compress(batch->uncompressed_chunks[i],
+					batch->uncompressed_chunk_sizes[i],
+					batch->compressed_chunks[i],
+					batch->uncompressed_chunk_sizes[i] - 1,
+					conn->local_compressor);
+	}
+}
+
+/* Close a connection that failed.  Returns true if it was the last one.  */
+static bool
+remote_connection_failed(struct remote_connection *conn)
+{
+	struct remote_chunk_compressor *ctx = conn->ctx;
+	unsigned num_live_conns;
+
+	close(conn->fd);
+	conn->fd = -1;
+
+	mutex_lock(&ctx->lock);
+	num_live_conns = --ctx->num_live_conns;
+	mutex_unlock(&ctx->lock);
+
+	if (num_live_conns == 0) {
+		WARNING("Lost the connection to compression worker \"%s\", "
+			"which was the last one.\n"
+			"          Compressing the remaining data locally.",
+			conn->worker);
+		return true;
+	}
+	WARNING("Lost a connection to compression worker \"%s\".\n"
+		"          Its data will be compressed by the other workers.",
+		conn->worker);
+	return false;
+}
+
+static void *
+remote_connection_thrproc(void *arg)
+{
+	struct remote_connection *conn = arg;
+	struct remote_chunk_compressor *ctx = conn->ctx;
+	struct remote_batch *batch;
+
+	while ((batch = ring_buffer_get(&ctx->pending_batches)) != (void *)ctx) {
+		if (conn->fd >= 0) {
+			if (remote_compress_batch(conn, batch) == 0) {
+				ring_buffer_put(&ctx->compressed_batches, batch);
+				continue;
+			}
+			if (!remote_connection_failed(conn)) {
+				ring_buffer_put(&ctx->pending_batches, batch);
+				return NULL;
+			}
+		}
+		local_compress_batch(conn, batch);
+		ring_buffer_put(&ctx->compressed_batches, batch);
+	}
+	return NULL;
+}
+
+/* Open a connection to @worker and send it the hello.  Returns the socket, or
+ * -1 on failure; the number of connections requested by the worker is returned
+ * in *num_conns_ret.  */
+static int
+remote_connect(const char *worker, const le32 hello[6], u32 *num_conns_ret)
+{
+	char buf[256];
+	const char *host, *port;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res, *ai;
+	u32 status;
+	int fd = -1;
+	int ret;
+
+	if (!remote_parse_address(worker, false, buf, sizeof(buf),
+				  &host, &port)) {
+		WARNING("\"%s\" isn't a valid compression worker address",
+			worker);
+		return -1;
+	}
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret) {
+		WARNING("Can't resolve compression worker \"%s\": %s",
+			worker, gai_strerror(ret));
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		WARNING_WITH_ERRNO("Can't connect to compression worker \"%s\"",
+				   worker);
+		return -1;
+	}
+	remote_set_socket_options(fd);
+
+	if (remote_send(fd, hello, 6 * sizeof(hello[0])) ||
+	    remote_recv_u32(fd, &status) ||
+	    remote_recv_u32(fd, num_conns_ret)) {
+		WARNING("Compression worker \"%s\" didn't reply", worker);
+		goto err;
+	}
+	if (status) {
+		WARNING("Compression worker \"%s\" refused the connection: %"TS,
+			worker, wimlib_get_error_string(status));
+		goto err;
+	}
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+/* Connect to each of the comma-separated workers in @ctx->workers, opening as
+ * many connections to each one as it requested.  */
+static int
+remote_connect_all(struct remote_chunk_compressor *ctx, const le32 hello[6])
+{
+	size_t num_workers = 1;
+	char *worker;
+
+	for (const char *p = ctx->workers; *p; p++)
+		num_workers += (*p == ',');
+
+	ctx->conns = CALLOC(min(num_workers * REMOTE_MAX_CONNS_PER_WORKER,
+				REMOTE_MAX_CONNS), sizeof(ctx->conns[0]));
+	if (ctx->conns == NULL)
+		return WIMLIB_ERR_NOMEM;
+
+	worker = ctx->workers;
+	while (worker) {
+		char *next = strchr(worker, ',');
+		u32 num_conns;
+		int fd;
+
+		if (next)
+			*next++ = '\0';
+		worker += strspn(worker, " \t");
+		if (*worker == '\0' || ctx->num_conns == REMOTE_MAX_CONNS)
+			goto next_worker;
+
+		fd = remote_connect(worker, hello, &num_conns);
+		if (fd < 0)
+			goto next_worker;
+		num_conns = max(1, min(num_conns, REMOTE_MAX_CONNS_PER_WORKER));
+		num_conns = min(num_conns, REMOTE_MAX_CONNS - ctx->num_conns);
+		for (;;) {
+			struct remote_connection *conn =
+				&ctx->conns[ctx->num_conns++];
+			u32 unused;
+
+			conn->ctx = ctx;
+			conn->fd = fd;
+			conn->worker = worker;
+			if (--num_conns == 0)
+				break;
+			fd = remote_connect(worker, hello, &unused);
+			if (fd < 0)
+				break;
+		}
+	next_worker:
+		worker = next;
+	}
+
+	if (ctx->num_conns == 0)
+		return WIMLIB_ERR_NETWORK;
+	return 0;
+}
+
+static void
+remote_chunk_compressor_destroy(struct chunk_compressor *_ctx)
+{
+	struct remote_chunk_compressor *ctx = (struct remote_chunk_compressor *)_ctx;
+
+	if (ctx == NULL)
+		return;
+
+	if (ctx->conns) {
+		for (unsigned i = 0; i < ctx->num_conns; i++)
+			if (ctx->conns[i].thread_started)
+				ring_buffer_put(&ctx->pending_batches, ctx);
+		for (unsigned i = 0; i < ctx->num_conns; i++) {
+			struct remote_connection *conn = &ctx->conns[i];
+
+			if (conn->thread_started)
+				thread_join(&conn->thread);
+			if (conn->fd >= 0) {
+				remote_send_u32(conn->fd, 0);
+				close(conn->fd);
+			}
+			wimlib_free_compressor(conn->local_compressor);
+		}
+		FREE(ctx->conns);
+	}
+
+	ring_buffer_destroy(&ctx->pending_batches);
+	ring_buffer_destroy(&ctx->compressed_batches);
+	mutex_destroy(&ctx->lock);
+
+	if (ctx->batches) {
+		for (size_t i = 0; i < ctx->num_batches; i++) {
+			for (size_t j = 0; j < ctx->batches[i].num_alloc_chunks; j++) {
+				FREE(ctx->batches[i].uncompressed_chunks[j]);
+				FREE(ctx->batches[i].compressed_chunks[j]);
+			}
+		}
+		FREE(ctx->batches);
+	}
+	FREE(ctx->workers);
+	FREE(ctx);
+}
+
+static void
+submit_remote_batch(struct remote_chunk_compressor *ctx)
+{
+	struct remote_batch *batch = ctx->next_submit_batch;
+
+	batch->complete = false;
+	list_add_tail(&batch->submission_list, &ctx->submitted_batches);
+	ring_buffer_put(&ctx->pending_batches, batch);
+	ctx->next_submit_batch = NULL;
+}
+
+static void *
+remote_chunk_compressor_get_chunk_buffer(struct chunk_compressor *_ctx)
+{
+	struct remote_chunk_compressor *ctx = (struct remote_chunk_compressor *)_ctx;
+	struct remote_batch *batch;
+
+	if (ctx->next_submit_batch) {
+		batch = ctx->next_submit_batch;
+	} else {
+		if (list_empty(&ctx->available_batches))
+			return NULL;
+
+		batch = list_entry(ctx->available_batches.next,
+				   struct remote_batch, list);
+		list_del(&batch->list);
+		ctx->next_submit_batch = batch;
+		batch->num_filled_chunks = 0;
+	}
+
+	return batch->uncompressed_chunks[batch->num_filled_chunks];
+}
+
+static void
+remote_chunk_compressor_signal_chunk_filled(struct chunk_compressor *_ctx,
+					    u32 usize)
+{
+	struct remote_chunk_compressor *ctx = (struct remote_chunk_compressor *)_ctx;
+	struct remote_batch *batch;
+
+	wimlib_assert(usize > 0);
+	wimlib_assert(usize <= ctx->base.out_chunk_size);
+	wimlib_assert(ctx->next_submit_batch);
+
+	batch = ctx->next_submit_batch;
+	batch->uncompressed_chunk_sizes[batch->num_filled_chunks] = usize;
+	if (++batch->num_filled_chunks == batch->num_alloc_chunks) {
+		submit_remote_batch(ctx);
+	} else if (batch->num_filled_chunks % ctx->chunks_per_group == 0 &&
+		   ring_buffer_empty(&ctx->pending_batches)) {
+		/* As in the parallel chunk compressor, don't keep the workers
+		 * waiting for the batch to be filled if they have nothing else
+		 * to do.  */
+		submit_remote_batch(ctx);
+	}
+}
+
+static bool
+remote_chunk_compressor_get_compression_result(struct chunk_compressor *_ctx,
+					       const void **cdata_ret,
+					       u32 *csize_ret, u32 *usize_ret)
+{
+	struct remote_chunk_compressor *ctx = (struct remote_chunk_compressor *)_ctx;
+	struct remote_batch *batch;
+
+	if (ctx->next_submit_batch)
+		submit_remote_batch(ctx);
+
+	if (ctx->next_ready_batch) {
+		batch = ctx->next_ready_batch;
+	} else {
+		if (list_empty(&ctx->submitted_batches))
+			return false;
+
+		while (!(batch = list_entry(ctx->submitted_batches.next,
+					    struct remote_batch,
+					    submission_list))->complete)
+		{
+			u64 start = perf_start();
+
+			((struct remote_batch *)
+			 ring_buffer_get(&ctx->compressed_batches))->complete = true;
+			perf_end(PERF_COMPRESS_WAIT, start, 0);
+		}
+
+		ctx->next_ready_batch = batch;
+		ctx->next_chunk_idx = 0;
+	}
+
+	if (batch->compressed_chunk_sizes[ctx->next_chunk_idx]) {
+		*cdata_ret = batch->compressed_chunks[ctx->next_chunk_idx];
+		*csize_ret = batch->compressed_chunk_sizes[ctx->next_chunk_idx];
+	} else {
+		*cdata_ret = batch->uncompressed_chunks[ctx->next_chunk_idx];
+		*csize_ret = batch->uncompressed_chunk_sizes[ctx->next_chunk_idx];
+	}
+	*usize_ret = batch->uncompressed_chunk_sizes[ctx->next_chunk_idx];
+
+	if (++ctx->next_chunk_idx == batch->num_filled_chunks) {
+		list_del(&batch->submission_list);
+		list_add_tail(&batch->list, &ctx->available_batches);
+		ctx->next_ready_batch = NULL;
+	}
+	return true;
+}
+
+/*
+ * Create a chunk compressor that has the chunks compressed by the compression
+ * workers in the comma-separated list @workers, each given as "host:port".
+ * Workers that can't be reached are skipped with a warning.  Returns
+ * WIMLIB_ERR_NETWORK if none of them can be.
+ */
+int
+new_remote_chunk_compressor(int out_ctype, u32 out_chunk_size,
+			    const tchar *workers, u64 max_memory,
+			    bool skip_incompressible,
+			    struct chunk_compressor **compressor_ret)
+{
+	struct remote_chunk_compressor *ctx;
+	unsigned chunks_per_group;
+	size_t chunks_per_batch;
+	u64 batch_size;
+	le32 hello[6];
+	int ret;
+
+	wimlib_assert(out_chunk_size > 0);
+
+	if (max_memory == 0)
+		max_memory = get_available_memory();
+
+	ctx = CALLOC(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return WIMLIB_ERR_NOMEM;
+
+	ctx->base.out_ctype = out_ctype;
+	ctx->base.out_chunk_size = out_chunk_size;
+	ctx->base.skip_incompressible = skip_incompressible;
+	ctx->base.destroy = remote_chunk_compressor_destroy;
+	ctx->base.get_chunk_buffer = remote_chunk_compressor_get_chunk_buffer;
+	ctx->base.signal_chunk_filled = remote_chunk_compressor_signal_chunk_filled;
+	ctx->base.get_compression_result = remote_chunk_compressor_get_compression_result;
+	ctx->compression_level = get_default_compression_level(out_ctype);
+	INIT_LIST_HEAD(&ctx->available_batches);
+	INIT_LIST_HEAD(&ctx->submitted_batches);
+
+	ret = WIMLIB_ERR_NOMEM;
+	if (!mutex_init(&ctx->lock))
+		goto err;
+	ctx->workers = STRDUP(workers);
+	if (ctx->workers == NULL)
+		goto err;
+
+	hello[0] = cpu_to_le32(REMOTE_MAGIC);
+	hello[1] = cpu_to_le32(REMOTE_VERSION);
+	hello[2] = cpu_to_le32(out_ctype);
+	hello[3] = cpu_to_le32(out_chunk_size);
+	hello[4] = cpu_to_le32(ctx->compression_level);
+	hello[5] = cpu_to_le32(skip_incompressible ?
+			       REMOTE_FLAG_SKIP_INCOMPRESSIBLE : 0);
+	ret = remote_connect_all(ctx, hello);
+	if (ret)
+		goto err;
+	ctx->num_live_conns = ctx->num_conns;
+
+	/* Send about 1 MiB per batch, so that the round trips take little
+	 * time compared to the compression, and have two batches per
+	 * connection, so that each connection has another batch ready when it
+	 * finishes one.  Use less memory if needed, even if that leaves some
+	 * connections idle.  */
+	chunks_per_group = chunks_per_compressor_group(out_ctype,
+						       out_chunk_size);
+	STATIC_ASSERT(REMOTE_MAX_CHUNKS_PER_BATCH % 16 == 0);
+	chunks_per_batch = max(1, 1048576 / out_chunk_size);
+	chunks_per_batch = ALIGN(chunks_per_batch, chunks_per_group);
+	chunks_per_batch = min(chunks_per_batch, REMOTE_MAX_CHUNKS_PER_BATCH);
+	ctx->chunks_per_group = chunks_per_group;
+
+	batch_size = (u64)chunks_per_batch * (2 * (u64)out_chunk_size - 1);
+	ctx->num_batches = 2 * (size_t)ctx->num_conns;
+	if (ctx->num_batches * batch_size > max_memory / 2) {
+		ctx->num_batches = max(2, max_memory / 2 / batch_size);
+		WARNING("Limiting to %zu chunks being compressed at a time "
+			"to fit in available memory!",
+			ctx->num_batches * chunks_per_batch);
+	}
+
+	ret = ring_buffer_init(&ctx->pending_batches,
+			       ctx->num_batches + ctx->num_conns);
+	if (ret)
+		goto err;
+	ret = ring_buffer_init(&ctx->compressed_batches, ctx->num_batches);
+	if (ret)
+		goto err;
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx->batches = CALLOC(ctx->num_batches, sizeof(ctx->batches[0]));
+	if (ctx->batches == NULL)
+		goto err;
+	for (size_t i = 0; i < ctx->num_batches; i++) {
+		struct remote_batch *batch = &ctx->batches[i];
+
+		batch->num_alloc_chunks = chunks_per_batch;
+		for (size_t j = 0; j < chunks_per_batch; j++) {
+			batch->uncompressed_chunks[j] = MALLOC(out_chunk_size);
+			batch->compressed_chunks[j] = MALLOC(out_chunk_size - 1);
+			if (batch->uncompressed_chunks[j] == NULL ||
+			    batch->compressed_chunks[j] == NULL)
+				goto err;
+		}
+		list_add_tail(&batch->list, &ctx->available_batches);
+	}
+
+	for (unsigned i = 0; i < ctx->num_conns; i++) {
+		struct remote_connection *conn = &ctx->conns[i];
+
+		if (!thread_create(&conn->thread, remote_connection_thrproc,
+				   conn)) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto err;
+		}
+		conn->thread_started = true;
+	}
+
+	ctx->base.num_threads = ctx->num_conns;
+	*compressor_ret = &ctx->base;
+	return 0;
+
+err:
+	remote_chunk_compressor_destroy(&ctx->base);
+	return ret;
+}
+
+/*----------------------------------------------------------------------------*
+ *                                Worker side                                 *
+ *----------------------------------------------------------------------------*/
+
+struct remote_server_conn {
+	int fd;
+	u32 num_threads;
+	struct thread thread;
+	bool done;
+	struct list_head list;
+};
+
+/* The batch being handled on a connection of the worker  */
+struct remote_server_batch {
+	u8 *chunks[REMOTE_MAX_CHUNKS_PER_BATCH];
+	u32 chunk_sizes[REMOTE_MAX_CHUNKS_PER_BATCH];
+	u8 *cdata;
+};
+
+static struct mutex remote_server_lock = MUTEX_INITIALIZER;
+
+/* Receive the next batch on the connection @fd.  Returns its number of chunks
+ * in *num_chunks_ret, which is 0 if the client is done.  */
+static int
+remote_server_recv_batch(int fd, u32 chunk_size, struct remote_server_batch *b,
+			 u32 *num_chunks_ret)
+{
+	u32 num_chunks;
+	int ret;
+
+	ret = remote_recv_u32(fd, &num_chunks);
+	if (ret)
+		return ret;
+	if (num_chunks > REMOTE_MAX_CHUNKS_PER_BATCH)
+		return WIMLIB_ERR_NETWORK;
+
+	for (u32 i = 0; i < num_chunks; i++) {
+		ret = remote_recv_u32(fd, &b->chunk_sizes[i]);
+		if (ret)
+			return ret;
+		if (b->chunk_sizes[i] == 0 || b->chunk_sizes[i] > chunk_size)
+			return WIMLIB_ERR_NETWORK;
+		if (b->chunks[i] == NULL) {
+			b->chunks[i] = MALLOC(chunk_size);
+			if (b->chunks[i] == NULL)
+				return WIMLIB_ERR_NOMEM;
+		}
+		ret = remote_recv(fd, b->chunks[i], b->chunk_sizes[i]);
+		if (ret)
+			return ret;
+	}
+	*num_chunks_ret = num_chunks;
+	return 0;
+}
+
+/* Handle one connection of the worker, from the hello to the end.  */
+static int
+remote_server_handle_conn(struct remote_server_conn *conn)
+{
+	int fd = conn->fd;
+	le32 hello_le[6];
+	u32 hello[6];
+	int ctype;
+	u32 chunk_size;
+	bool skip_incompressible;
+	unsigned chunks_per_group;
+	struct wimlib_compressor *compressor = NULL;
+	struct remote_server_batch batch = {};
+	u32 num_chunks;
+	int status;
+	int ret;
+
+	ret = remote_recv(fd, hello_le, sizeof(hello_le));
+	if (ret)
+		return ret;
+	for (int i = 0; i < ARRAY_LEN(hello); i++)
+		hello[i] = le32_to_cpu(hello_le[i]);
+	if (hello[0] != REMOTE_MAGIC)
+		return WIMLIB_ERR_NETWORK;
+
+	ctype = hello[2];
+	chunk_size = hello[3];
+	skip_incompressible = (hello[5] & REMOTE_FLAG_SKIP_INCOMPRESSIBLE);
+	if (hello[1] != REMOTE_VERSION || (hello[5] & ~REMOTE_FLAG_SKIP_INCOMPRESSIBLE))
+		status = WIMLIB_ERR_UNSUPPORTED;
+	else if (hello[4] == 0 || hello[4] > 0xFFFFFF ||
+		 chunk_size < 2 || chunk_size > (1U << 30))
+		status = WIMLIB_ERR_INVALID_PARAM;
+	else
+		status = wimlib_create_compressor(ctype, chunk_size,
+						  hello[4] |
+						  WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE,
+						  &compressor);
+	if (!status) {
+		batch.cdata = MALLOC(chunk_size - 1);
+		if (batch.cdata == NULL)
+			status = WIMLIB_ERR_NOMEM;
+	}
+
+	ret = remote_send_u32(fd, status);
+	if (!ret)
+		ret = remote_send_u32(fd, conn->num_threads);
+	if (ret || status)
+		goto out;
+
+	chunks_per_group = chunks_per_compressor_group(ctype, chunk_size);
+	while (!(ret = remote_server_recv_batch(fd, chunk_size, &batch,
+						&num_chunks)) &&
+	       num_chunks != 0)
+	{
+		for (u32 i = 0; i < num_chunks && !ret; i++) {
+			u32 csize = 0;
+
+			if (i % chunks_per_group == 0)
+				compressor_start_group(compressor);
+			if (!skip_incompressible ||
+			    !data_seems_incompressible(batch.chunks[i],
+						       batch.chunk_sizes[i]))
+				csize = wimlib_compress(batch.chunks[i],
+							batch.chunk_sizes[i],
+							batch.cdata,
+							batch.chunk_sizes[i] - 1,
+							compressor);
+			ret = remote_send_u32(fd, csize);
+			if (!ret && csize)
+				ret = remote_send(fd, batch.cdata, csize);
+		}
+		if (ret)
+			break;
+	}
+out:
+	for (int i = 0; i < REMOTE_MAX_CHUNKS_PER_BATCH; i++)
+		FREE(batch.chunks[i]);
+	FREE(batch.cdata);
+	wimlib_free_compressor(compressor);
+	return ret;
+}
+
+static void *
+remote_server_thrproc(void *arg)
+{
+	struct remote_server_conn *conn = arg;
+
+	remote_server_handle_conn(conn);
+	close(conn->fd);
+	mutex_lock(&remote_server_lock);
+	conn->done = true;
+	mutex_unlock(&remote_server_lock);
+	return NULL;
+}
+
+/* Join the threads of the connections that have ended, or of all of them if
+ * @all.  */
+static void
+remote_server_reap(struct list_head *conns, bool all)
+{
+	struct remote_server_conn *conn, *tmp;
+
+	list_for_each_entry_safe(conn, tmp, conns, list) {
+		bool done;
+
+		mutex_lock(&remote_server_lock);
+		done = conn->done;
+		mutex_unlock(&remote_server_lock);
+		if (done || all) {
+			thread_join(&conn->thread);
+			list_del(&conn->list);
+			FREE(conn);
+		}
+	}
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_serve_compression(const tchar *address, unsigned num_threads, int flags)
+{
+	char buf[256];
+	const char *host, *port;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	struct addrinfo *res, *ai;
+	LIST_HEAD(conns);
+	int listen_fd = -1;
+	int one = 1;
+	int ret;
+
+	if (flags != 0 || address == NULL)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	ret = wimlib_global_init(0);
+	if (ret)
+		return ret;
+
+	if (!remote_parse_address(address, true, buf, sizeof(buf),
+				  &host, &port))
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret) {
+		ERROR("Can't resolve \"%s\": %s", address, gai_strerror(ret));
+		return WIMLIB_ERR_NETWORK;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		listen_fd = socket(ai->ai_family, ai->ai_socktype,
+				   ai->ai_protocol);
+		if (listen_fd < 0)
+			continue;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR,
+			   &one, sizeof(one));
+		if (bind(listen_fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(listen_fd, 64) == 0)
+			break;
+		close(listen_fd);
+		listen_fd = -1;
+	}
+	freeaddrinfo(res);
+	if (listen_fd < 0) {
+		ERROR_WITH_ERRNO("Can't listen on \"%s\"", address);
+		return WIMLIB_ERR_NETWORK;
+	}
+
+	for (;;) {
+		struct remote_server_conn *conn;
+		int fd;
+
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			ERROR_WITH_ERRNO("Error accepting a connection");
+			ret = WIMLIB_ERR_NETWORK;
+			break;
+		}
+		remote_set_socket_options(fd);
+
+		remote_server_reap(&conns, false);
+
+		conn = CALLOC(1, sizeof(*conn));
+		if (conn == NULL) {
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		conn->num_threads = num_threads;
+		if (!thread_create(&conn->thread, remote_server_thrproc, conn)) {
+			close(fd);
+			FREE(conn);
+			continue;
+		}
+		list_add_tail(&conn->list, &conns);
+	}
+
+	remote_server_reap(&conns, true);
+	close(listen_fd);
+	return ret;
+}
+
+#endif /* !_WIN32 */
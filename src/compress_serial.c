@@ -30,6 +30,8 @@
 #include "wimlib.h"
 #include "wimlib/assert.h"
 #include "wimlib/chunk_compressor.h"
+#include "wimlib/compress_common.h"
+#include "wimlib/compressor_ops.h"
 #include "wimlib/util.h"
 
 struct serial_chunk_compressor {
@@ -40,6 +42,8 @@ struct serial_chunk_compressor {
 	u32 usize;
 	u8 *result_data;
 	u32 result_size;
+	unsigned chunks_per_group;
+	u64 num_chunks;
 };
 
 static void
@@ -76,8 +80,14 @@ serial_chunk_compressor_signal_chunk_filled(struct chunk_compressor *_ctx, u32 u
 	wimlib_assert(usize <= ctx->base.out_chunk_size);
 
 	ctx->usize = usize;
-	csize = wimlib_compress(ctx->udata, usize, ctx->cdata, usize - 1,
-				ctx->compressor);
+	if (ctx->num_chunks++ % ctx->chunks_per_group == 0)
+		compressor_start_group(ctx->compressor);
+	if (ctx->base.skip_incompressible &&
+	    data_seems_incompressible(ctx->udata, usize))
+		csize = 0;
+	else
+		csize = wimlib_compress(ctx->udata, usize, ctx->cdata,
+					usize - 1, ctx->compressor);
 	if (csize) {
 		ctx->result_data = ctx->cdata;
 		ctx->result_size = csize;
@@ -106,10 +116,12 @@ serial_chunk_compressor_get_compression_result(struct chunk_compressor *_ctx,
 }
 
 int
-new_serial_chunk_compressor(int out_ctype, u32 out_chunk_size,
+new_serial_chunk_compressor(int out_ctype, u32 out_chunk_size, bool parallel,
+			    bool skip_incompressible,
 			    struct chunk_compressor **compressor_ret)
 {
 	struct serial_chunk_compressor *ctx;
+	int compressor_flags;
 	int ret;
 
 	wimlib_assert(out_chunk_size > 0);
@@ -121,14 +133,21 @@ new_serial_chunk_compressor(int out_ctype, u32 out_chunk_size,
 	ctx->base.out_ctype = out_ctype;
 	ctx->base.out_chunk_size = out_chunk_size;
 	ctx->base.num_threads = 1;
+	ctx->base.skip_incompressible = skip_incompressible;
 	ctx->base.destroy = serial_chunk_compressor_destroy;
 	ctx->base.get_chunk_buffer = serial_chunk_compressor_get_chunk_buffer;
 	ctx->base.signal_chunk_filled = serial_chunk_compressor_signal_chunk_filled;
 	ctx->base.get_compression_result = serial_chunk_compressor_get_compression_result;
 
+	/* Even with a single compressor, an LZMS compressor can build its
+	 * suffix arrays on the threads of the task pool (see
+	 * new_parallel_chunk_compressor()).  */
+	compressor_flags = WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE;
+	if (parallel && out_ctype == WIMLIB_COMPRESSION_TYPE_LZMS)
+		compressor_flags |= WIMLIB_COMPRESSOR_FLAG_PARALLEL;
+
 	ret = wimlib_create_compressor(out_ctype, out_chunk_size,
-				       WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE,
-				       &ctx->compressor);
+				       compressor_flags, &ctx->compressor);
 	if (ret)
 		goto err;
 
@@ -139,6 +158,8 @@ new_serial_chunk_compressor(int out_ctype, u32 out_chunk_size,
 		goto err;
 	}
 	ctx->result_data = NULL;
+	ctx->chunks_per_group = chunks_per_compressor_group(out_ctype,
+							    out_chunk_size);
 
 	*compressor_ret = &ctx->base;
 	return 0;
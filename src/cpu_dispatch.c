@@ -0,0 +1,85 @@
+/*
+ * cpu_dispatch.c
+ *
+ * Selection of the CPU-specific implementations of the library's kernels.  All
+ * kernels are resolved once, when the library is initialized, after the CPU
+ * features have been detected.  Until then, each kernel uses its portable
+ * implementation.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include "wimlib/cpu_features.h"
+#include "wimlib/error.h"
+#include "wimlib/matchfinder_common.h"
+#include "wimlib/util.h"
+
+static const struct cpu_kernel * const cpu_kernels[] = {
+	&sha1_blocks_kernel,
+	&sha1_blocks_multi_kernel,
+#ifdef HAVE_LZ_EXTEND_WIDE
+	&lz_extend_kernel,
+#endif
+	&lzx_parse_kernel,
+	&xpress_parse_kernel,
+	&lzx_decode_kernel,
+	&xpress_decode_kernel,
+	&lzms_x86_filter_kernel,
+	&zero_scan_kernel,
+};
+
+/* Copy an ASCII name into a tchar buffer, for use in a message.  */
+static const tchar *
+name_to_tstr(tchar buf[32], const char *name, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && i < 31; i++)
+		buf[i] = (unsigned char)name[i];
+	buf[i] = T('\0');
+	return buf;
+}
+
+void
+init_cpu_dispatch(void)
+{
+	for (size_t i = 0; i < ARRAY_LEN(cpu_kernels); i++) {
+		const struct cpu_kernel *kernel = cpu_kernels[i];
+		const struct cpu_impl *impl = resolve_cpu_kernel(kernel);
+		const char *name;
+		size_t namelen;
+		tchar buf1[32], buf2[32], buf3[32];
+
+		if (!get_cpu_impl_override(kernel->name, &name, &namelen))
+			continue;
+		if (namelen == strlen(impl->name) &&
+		    memcmp(name, impl->name, namelen) == 0)
+			continue;
+		WARNING("WIMLIB_CPU_FEATURES: \"%"TS"\" isn't an implementation "
+			"of \"%"TS"\" that this CPU supports; using \"%"TS"\"",
+			name_to_tstr(buf1, name, namelen),
+			name_to_tstr(buf2, kernel->name, strlen(kernel->name)),
+			name_to_tstr(buf3, impl->name, strlen(impl->name)));
+	}
+}
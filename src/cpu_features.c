@@ -29,14 +29,13 @@
 #  include "config.h"
 #endif
 
-#include "wimlib/cpu_features.h"
-
-#if CPU_FEATURES_ENABLED
+#include <stdlib.h>
+#include <string.h>
 
+#include "wimlib/cpu_features.h"
 #include "wimlib/util.h"
 
-#include <stdlib.h>
-#include <string.h>
+#if CPU_FEATURES_ENABLED
 
 #if defined(__i386__) || defined(__x86_64__)
 
@@ -110,8 +109,14 @@ get_cpu_features(void)
 
 	/* EAX=7, ECX=0: Extended Features */
 	cpuid(7, 0, &a, &b, &c, &d);
+	if ((b & (1 << 5)) && (features & X86_CPU_FEATURE_AVX))
+		features |= X86_CPU_FEATURE_AVX2;
 	if (b & (1 << 8))
 		features |= X86_CPU_FEATURE_BMI2;
+	if ((b & (1 << 16)) && ((xcr0 & 0xE6) == 0xE6))
+		features |= X86_CPU_FEATURE_AVX512F;
+	if ((b & (1 << 30)) && (features & X86_CPU_FEATURE_AVX512F))
+		features |= X86_CPU_FEATURE_AVX512BW;
 	if (b & (1 << 29))
 		features |= X86_CPU_FEATURE_SHA;
 
@@ -190,6 +195,10 @@ get_cpu_features(void)
 
 	if (hwcap & (1 << 5))	/* HWCAP_SHA1 */
 		features |= ARM_CPU_FEATURE_SHA1;
+	if (hwcap & (1 << 22))	/* HWCAP_SVE */
+		features |= ARM_CPU_FEATURE_SVE;
+	if (hwcap2 & (1 << 1))	/* HWCAP2_SVE2 */
+		features |= ARM_CPU_FEATURE_SVE2;
 
 	return features;
 }
@@ -236,6 +245,14 @@ get_cpu_features(void)
 
 	if (IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE))
 		features |= ARM_CPU_FEATURE_SHA1;
+#ifdef PF_ARM_SVE_INSTRUCTIONS_AVAILABLE
+	if (IsProcessorFeaturePresent(PF_ARM_SVE_INSTRUCTIONS_AVAILABLE))
+		features |= ARM_CPU_FEATURE_SVE;
+#endif
+#ifdef PF_ARM_SVE2_INSTRUCTIONS_AVAILABLE
+	if (IsProcessorFeaturePresent(PF_ARM_SVE2_INSTRUCTIONS_AVAILABLE))
+		features |= ARM_CPU_FEATURE_SVE2;
+#endif
 
 	return features;
 }
@@ -253,11 +270,16 @@ static const struct {
 	{"sse4.1",	X86_CPU_FEATURE_SSE4_1},
 	{"sse4.2",	X86_CPU_FEATURE_SSE4_2},
 	{"avx",		X86_CPU_FEATURE_AVX},
+	{"avx2",	X86_CPU_FEATURE_AVX2},
 	{"bmi2",	X86_CPU_FEATURE_BMI2},
+	{"avx512f",	X86_CPU_FEATURE_AVX512F},
+	{"avx512bw",	X86_CPU_FEATURE_AVX512BW},
 	{"sha",		X86_CPU_FEATURE_SHA},
 	{"sha1",	X86_CPU_FEATURE_SHA},
 #elif defined(__aarch64__)
 	{"sha1",	ARM_CPU_FEATURE_SHA1},
+	{"sve",		ARM_CPU_FEATURE_SVE},
+	{"sve2",	ARM_CPU_FEATURE_SVE2},
 #else
 #  error "CPU_FEATURES_ENABLED was set but no features are defined!"
 #endif
@@ -279,20 +301,107 @@ u32 cpu_features;
 
 void init_cpu_features(void)
 {
+	const u32 detected = get_cpu_features();
 	char *p, *sep;
 
-	cpu_features = get_cpu_features();
+	cpu_features = detected;
 
 	/*
 	 * Allow disabling CPU features via an environmental variable for
 	 * testing purposes.  Syntax is comma-separated list of feature names.
 	 */
 	p = getenv("WIMLIB_DISABLE_CPU_FEATURES");
+	if (p != NULL) {
+		for (; (sep = strchr(p, ',')) != NULL; p = sep + 1)
+			cpu_features &= ~find_cpu_feature(p, sep - p);
+		cpu_features &= ~find_cpu_feature(p, strlen(p));
+	}
+
+	/*
+	 * WIMLIB_CPU_FEATURES is a comma-separated list of edits applied in
+	 * order: "-NAME" disables a feature, and "+NAME" re-enables a feature
+	 * that the CPU actually has, e.g. "-*,+sse4.2".  Entries of the form
+	 * "KERNEL=IMPL" are handled by get_cpu_impl_override() instead.
+	 */
+	p = getenv("WIMLIB_CPU_FEATURES");
 	if (likely(p == NULL))
 		return;
-	for (; (sep = strchr(p, ',')) != NULL; p = sep + 1)
-		cpu_features &= ~find_cpu_feature(p, sep - p);
-	cpu_features &= ~find_cpu_feature(p, strlen(p));
+	for (;;) {
+		size_t len;
+
+		sep = strchr(p, ',');
+		len = sep ? sep - p : strlen(p);
+		if (len > 1 && p[0] == '-')
+			cpu_features &= ~find_cpu_feature(p + 1, len - 1);
+		else if (len > 1 && p[0] == '+')
+			cpu_features |= find_cpu_feature(p + 1, len - 1) &
+					detected;
+		if (!sep)
+			break;
+		p = sep + 1;
+	}
 }
 
 #endif /* CPU_FEATURES_ENABLED */
+
+/*
+ * If WIMLIB_CPU_FEATURES contains an entry "KERNEL=IMPL" for the kernel named
+ * @kernel_name, return the name of the implementation it requests.  The last
+ * such entry wins.
+ */
+bool
+get_cpu_impl_override(const char *kernel_name,
+		      const char **impl_name_ret, size_t *impl_namelen_ret)
+{
+	const char *p = getenv("WIMLIB_CPU_FEATURES");
+	const size_t kernel_namelen = strlen(kernel_name);
+	bool found = false;
+
+	while (p != NULL) {
+		const char *sep = strchr(p, ',');
+		size_t len = sep ? sep - p : strlen(p);
+
+		if (len > kernel_namelen && p[kernel_namelen] == '=' &&
+		    memcmp(p, kernel_name, kernel_namelen) == 0) {
+			*impl_name_ret = p + kernel_namelen + 1;
+			*impl_namelen_ret = len - kernel_namelen - 1;
+			found = true;
+		}
+		p = sep ? sep + 1 : NULL;
+	}
+	return found;
+}
+
+/*
+ * Choose the implementation of @kernel to use and install it.  This is the
+ * first one in the list that the CPU supports, unless WIMLIB_CPU_FEATURES names
+ * a different one that the CPU supports.  Returns the chosen implementation.
+ */
+const struct cpu_impl *
+resolve_cpu_kernel(const struct cpu_kernel *kernel)
+{
+	const struct cpu_impl *impl = NULL;
+	const char *name;
+	size_t namelen;
+
+	if (get_cpu_impl_override(kernel->name, &name, &namelen)) {
+		for (size_t i = 0; i < kernel->num_impls; i++) {
+			const struct cpu_impl *candidate = &kernel->impls[i];
+
+			if (namelen == strlen(candidate->name) &&
+			    memcmp(name, candidate->name, namelen) == 0 &&
+			    (cpu_features & candidate->features) ==
+			    candidate->features) {
+				impl = candidate;
+				break;
+			}
+		}
+	}
+	if (!impl) {
+		impl = kernel->impls;
+		while ((cpu_features & impl->features) != impl->features)
+			impl++;
+	}
+	(*kernel->select)(impl);
+	return impl;
+}
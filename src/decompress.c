@@ -26,14 +26,27 @@
 #  include "config.h"
 #endif
 
+#include <string.h>
+
 #include "wimlib.h"
+#include "wimlib/codec_cache.h"
 #include "wimlib/decompressor_ops.h"
+#include "wimlib/perf_counters.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/util.h"
 
 struct wimlib_decompressor {
 	const struct decompressor_ops *ops;
+	enum wimlib_compression_type ctype;
 	size_t max_block_size;
 	void *private;
+
+	/* The compressed data, if @zero_cdata isn't NULL, of the last buffer
+	 * which decompressed to @zero_usize zero bytes; see
+	 * remember_zero_chunk()  */
+	u8 *zero_cdata;
+	size_t zero_csize;
+	size_t zero_usize;
 };
 
 static const struct decompressor_ops * const decompressor_ops[] = {
@@ -75,9 +88,11 @@ wimlib_create_decompressor(enum wimlib_compression_type ctype,
 	if (dec == NULL)
 		return WIMLIB_ERR_NOMEM;
 	dec->ops = decompressor_ops[ctype];
+	dec->ctype = ctype;
 	dec->max_block_size = max_block_size;
-	dec->private = NULL;
-	if (dec->ops->create_decompressor) {
+	dec->zero_cdata = NULL;
+	dec->private = codec_cache_get(dec->ops, max_block_size, 0);
+	if (!dec->private && dec->ops->create_decompressor) {
 		ret = dec->ops->create_decompressor(max_block_size,
 						    &dec->private);
 		if (ret) {
@@ -89,25 +104,161 @@ wimlib_create_decompressor(enum wimlib_compression_type ctype,
 	return 0;
 }
 
+/*
+ * All-zero buffers, e.g. the holes of sparse files, are common and compress to
+ * the same data every time; see compress_zeroes() in compress.c.  Some of the
+ * decompressors are slow on them, though, so remember the compressed data of
+ * the last buffer which decompressed to all zeroes, and produce the zeroes
+ * directly when the same compressed data comes along again.
+ *
+ * Only highly compressed buffers are checked for being all zeroes, so usually
+ * this costs nothing.
+ */
+static void
+remember_zero_chunk(const void *cdata, size_t csize, const void *udata,
+		    size_t usize, struct wimlib_decompressor *dec)
+{
+	u8 *copy;
+
+	if (csize > usize / 64 || !is_all_zeroes(udata, usize))
+		return;
+	copy = MALLOC(csize);
+	if (!copy)
+		return;
+	FREE(dec->zero_cdata);
+	dec->zero_cdata = memcpy(copy, cdata, csize);
+	dec->zero_csize = csize;
+	dec->zero_usize = usize;
+}
+
+static bool
+is_zero_chunk(const void *cdata, size_t csize, size_t usize,
+	      const struct wimlib_decompressor *dec)
+{
+	return dec->zero_cdata && csize == dec->zero_csize &&
+		usize == dec->zero_usize &&
+		memcmp(cdata, dec->zero_cdata, csize) == 0;
+}
+
 WIMLIBAPI int
 wimlib_decompress(const void *compressed_data, size_t compressed_size,
 		  void *uncompressed_data, size_t uncompressed_size,
 		  struct wimlib_decompressor *dec)
 {
+	u64 start;
+	int ret;
+
 	if (unlikely(uncompressed_size > dec->max_block_size))
 		return -2;
 
-	return dec->ops->decompress(compressed_data, compressed_size,
-				    uncompressed_data, uncompressed_size,
-				    dec->private);
+	start = perf_start();
+	if (is_zero_chunk(compressed_data, compressed_size, uncompressed_size,
+			  dec)) {
+		memset(uncompressed_data, 0, uncompressed_size);
+		ret = 0;
+	} else {
+		ret = dec->ops->decompress(compressed_data, compressed_size,
+					   uncompressed_data, uncompressed_size,
+					   dec->private);
+		if (ret == 0)
+			remember_zero_chunk(compressed_data, compressed_size,
+					    uncompressed_data, uncompressed_size,
+					    dec);
+	}
+	perf_end(PERF_DECOMPRESS, start, uncompressed_size);
+	return ret;
+}
+
+/* Maximum number of decompressors which wimlib_decompress_batch() uses at
+ * once  */
+#define MAX_BATCH_TASKS		64
+
+struct decompress_batch_task {
+	struct pool_task base;
+
+	/* The decompressor to use, or NULL if it must be created like @proto */
+	struct wimlib_decompressor *dec;
+	const struct wimlib_decompressor *proto;
+
+	struct wimlib_codec_batch_item *items;
+	size_t num_items;
+	size_t *next_item;
+};
+
+static void
+decompress_batch_task_run(struct pool_task *_task)
+{
+	struct decompress_batch_task *task = (struct decompress_batch_task *)_task;
+	size_t i;
+
+	/* If another decompressor can't be created, the tasks which have one
+	 * just do more of the items; the first task always has one.  */
+	if (!task->dec &&
+	    wimlib_create_decompressor(task->proto->ctype,
+				       task->proto->max_block_size,
+				       &task->dec))
+		return;
+
+	while ((i = __atomic_fetch_add(task->next_item, 1, __ATOMIC_RELAXED)) <
+	       task->num_items)
+	{
+		struct wimlib_codec_batch_item *item = &task->items[i];
+
+		item->result = (wimlib_decompress(item->in_data, item->in_size,
+						  item->out_data,
+						  item->out_size,
+						  task->dec) != 0);
+	}
+}
+
+WIMLIBAPI int
+wimlib_decompress_batch(struct wimlib_codec_batch_item *items,
+			size_t num_items, unsigned int num_threads,
+			struct wimlib_decompressor *dec)
+{
+	struct decompress_batch_task tasks[MAX_BATCH_TASKS];
+	struct pool_task *task_ptrs[MAX_BATCH_TASKS];
+	size_t next_item = 0;
+	size_t num_tasks;
+
+	if (!dec || (num_items && !items))
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+	num_tasks = min(num_threads, task_pool_num_threads());
+	num_tasks = min(num_tasks, num_items);
+	num_tasks = min(num_tasks, MAX_BATCH_TASKS);
+	num_tasks = max(num_tasks, 1);
+
+	for (size_t k = 0; k < num_tasks; k++) {
+		tasks[k].base.run = decompress_batch_task_run;
+		tasks[k].dec = (k == 0) ? dec : NULL;
+		tasks[k].proto = dec;
+		tasks[k].items = items;
+		tasks[k].num_items = num_items;
+		tasks[k].next_item = &next_item;
+		task_ptrs[k] = &tasks[k].base;
+	}
+	task_pool_run_batch(task_ptrs, num_tasks);
+
+	/* With the codec cache enabled, freeing the other decompressors keeps
+	 * them for the next batch.  */
+	for (size_t k = 1; k < num_tasks; k++)
+		wimlib_free_decompressor(tasks[k].dec);
+	return 0;
 }
 
 WIMLIBAPI void
 wimlib_free_decompressor(struct wimlib_decompressor *dec)
 {
 	if (dec) {
-		if (dec->ops->free_decompressor)
+		if (dec->ops->free_decompressor &&
+		    !codec_cache_put(dec->ops, dec->max_block_size, 0,
+				     dec->ops->get_needed_memory(dec->max_block_size),
+				     dec->private, dec->ops->free_decompressor))
 			dec->ops->free_decompressor(dec->private);
+		FREE(dec->zero_cdata);
 		FREE(dec);
 	}
 }
@@ -0,0 +1,266 @@
+/*
+ * decompress_chunked.c
+ *
+ * Incremental decompression of data in the chunked format of WIM resources and
+ * WOF-compressed files.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include "wimlib.h"
+#include "wimlib/resource.h"
+#include "wimlib/unaligned.h"
+#include "wimlib/util.h"
+
+/*
+ * The data consists of a chunk table followed by the chunks.  Each chunk except
+ * the last holds chunk_size bytes of uncompressed data.  The chunk table has an
+ * entry for each chunk but the first, giving the offset of that chunk from the
+ * end of the chunk table.  The entries are 4 bytes long, or 8 bytes if the
+ * uncompressed data is larger than 4 GiB.  A chunk whose compressed size is the
+ * same as its uncompressed size is stored uncompressed.
+ *
+ * The data is fed in pieces of any size.  Only the chunk table and one chunk of
+ * compressed and one of uncompressed data are held in memory at a time, and a
+ * chunk which arrives in one piece, or whose output fits in one piece, isn't
+ * copied through them at all.
+ */
+struct wimlib_chunked_decompressor {
+	struct wimlib_decompressor *decompressor;
+	u32 chunk_size;
+	u64 data_size;		/* compressed size excluding the chunk table */
+	u64 uncompressed_size;
+	u64 num_chunks;
+	u32 entry_size;
+
+	/* The chunk table, and how much of it has been read  */
+	u8 *table;
+	size_t table_size;
+	size_t table_filled;
+
+	/* The next chunk to decompress, and if its sizes are known, its
+	 * compressed and uncompressed sizes  */
+	u64 chunk_idx;
+	u32 cur_csize;
+	u32 cur_usize;
+
+	/* The compressed data of the next chunk read so far, if it didn't
+	 * arrive in one piece  */
+	u8 *cbuf;
+	u32 cbuf_filled;
+
+	/* Uncompressed data of the last chunk which hasn't been returned yet */
+	u8 *ubuf;
+	u32 ubuf_pos;
+	u32 ubuf_end;
+};
+
+WIMLIBAPI int
+wimlib_create_chunked_decompressor(enum wimlib_compression_type ctype,
+				   uint32_t chunk_size,
+				   uint64_t compressed_size,
+				   uint64_t uncompressed_size,
+				   struct wimlib_chunked_decompressor **cd_ret)
+{
+	struct wimlib_chunked_decompressor *cd;
+	u64 table_size;
+	int ret;
+
+	if (!cd_ret || chunk_size == 0)
+		return WIMLIB_ERR_INVALID_PARAM;
+	if (ctype == WIMLIB_COMPRESSION_TYPE_NONE)
+		return WIMLIB_ERR_INVALID_COMPRESSION_TYPE;
+
+	cd = CALLOC(1, sizeof(*cd));
+	if (!cd)
+		return WIMLIB_ERR_NOMEM;
+
+	ret = wimlib_create_decompressor(ctype, chunk_size, &cd->decompressor);
+	if (ret)
+		goto err;
+
+	ret = WIMLIB_ERR_INVALID_PARAM;
+	cd->chunk_size = chunk_size;
+	cd->uncompressed_size = uncompressed_size;
+	cd->num_chunks = DIV_ROUND_UP(uncompressed_size, chunk_size);
+	cd->entry_size = get_chunk_entry_size(uncompressed_size, false);
+	table_size = (cd->num_chunks ? cd->num_chunks - 1 : 0) * cd->entry_size;
+	if (table_size > compressed_size || table_size > SIZE_MAX)
+		goto err;
+	cd->table_size = table_size;
+	cd->data_size = compressed_size - table_size;
+
+	ret = WIMLIB_ERR_NOMEM;
+	cd->table = MALLOC(max(table_size, 1));
+	cd->cbuf = MALLOC(chunk_size);
+	cd->ubuf = MALLOC(chunk_size);
+	if (!cd->table || !cd->cbuf || !cd->ubuf)
+		goto err;
+
+	*cd_ret = cd;
+	return 0;
+
+err:
+	wimlib_free_chunked_decompressor(cd);
+	return ret;
+}
+
+static u64
+get_chunk_offset(const struct wimlib_chunked_decompressor *cd, u64 idx)
+{
+	if (idx == 0)
+		return 0;
+	if (idx == cd->num_chunks)
+		return cd->data_size;
+	if (cd->entry_size == 4)
+		return get_unaligned_le32(&cd->table[(idx - 1) * 4]);
+	return le64_to_cpu(load_le64_unaligned(&cd->table[(idx - 1) * 8]));
+}
+
+/* Look up the sizes of the next chunk in the chunk table.  */
+static int
+get_chunk_sizes(struct wimlib_chunked_decompressor *cd)
+{
+	u64 start = get_chunk_offset(cd, cd->chunk_idx);
+	u64 end = get_chunk_offset(cd, cd->chunk_idx + 1);
+	u32 usize = cd->chunk_size;
+
+	if (cd->chunk_idx == cd->num_chunks - 1)
+		usize = MODULO_NONZERO(cd->uncompressed_size, cd->chunk_size);
+
+	if (end <= start || end > cd->data_size || end - start > usize)
+		return WIMLIB_ERR_DECOMPRESSION;
+	cd->cur_csize = end - start;
+	cd->cur_usize = usize;
+	return 0;
+}
+
+WIMLIBAPI int
+wimlib_chunked_decompress(struct wimlib_chunked_decompressor *cd,
+			  const void *in, size_t in_size, size_t *in_used_ret,
+			  void *out, size_t out_size, size_t *out_written_ret)
+{
+	const u8 *in_p = in;
+	const u8 *in_end = in_p + in_size;
+	u8 *out_p = out;
+	u8 *out_end = out_p + out_size;
+	int ret = 0;
+
+	if (!cd || (in_size && !in) || (out_size && !out) ||
+	    !in_used_ret || !out_written_ret)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	for (;;) {
+		const u8 *cdata;
+		u8 *udata;
+		size_t n;
+
+		/* Return the data of the last chunk first.  */
+		n = min(cd->ubuf_end - cd->ubuf_pos, (size_t)(out_end - out_p));
+		memcpy(out_p, &cd->ubuf[cd->ubuf_pos], n);
+		out_p += n;
+		cd->ubuf_pos += n;
+		if (cd->ubuf_pos != cd->ubuf_end)
+			break;
+
+		if (cd->chunk_idx == cd->num_chunks)
+			break;
+
+		if (cd->table_filled != cd->table_size) {
+			n = min(cd->table_size - cd->table_filled,
+				(size_t)(in_end - in_p));
+			memcpy(&cd->table[cd->table_filled], in_p, n);
+			in_p += n;
+			cd->table_filled += n;
+			if (cd->table_filled != cd->table_size)
+				break;
+		}
+
+		if (cd->cur_csize == 0) {
+			ret = get_chunk_sizes(cd);
+			if (ret)
+				break;
+		}
+
+		/* Gather the compressed chunk, unless it's all in the input. */
+		if (cd->cbuf_filled == 0 &&
+		    (size_t)(in_end - in_p) >= cd->cur_csize) {
+			cdata = in_p;
+			in_p += cd->cur_csize;
+		} else {
+			n = min(cd->cur_csize - cd->cbuf_filled,
+				(size_t)(in_end - in_p));
+			memcpy(&cd->cbuf[cd->cbuf_filled], in_p, n);
+			in_p += n;
+			cd->cbuf_filled += n;
+			if (cd->cbuf_filled != cd->cur_csize)
+				break;
+			cdata = cd->cbuf;
+		}
+
+		/* Decompress it straight into the output if it fits.  */
+		if ((size_t)(out_end - out_p) >= cd->cur_usize) {
+			udata = out_p;
+			out_p += cd->cur_usize;
+		} else {
+			udata = cd->ubuf;
+			cd->ubuf_pos = 0;
+			cd->ubuf_end = cd->cur_usize;
+		}
+
+		if (cd->cur_csize == cd->cur_usize) {
+			memcpy(udata, cdata, cd->cur_usize);
+		} else if (wimlib_decompress(cdata, cd->cur_csize,
+					     udata, cd->cur_usize,
+					     cd->decompressor)) {
+			/* Don't return the garbage.  */
+			if (udata == cd->ubuf)
+				cd->ubuf_end = 0;
+			else
+				out_p -= cd->cur_usize;
+			ret = WIMLIB_ERR_DECOMPRESSION;
+			break;
+		}
+
+		cd->chunk_idx++;
+		cd->cur_csize = 0;
+		cd->cbuf_filled = 0;
+	}
+
+	*in_used_ret = in_p - (const u8 *)in;
+	*out_written_ret = out_p - (u8 *)out;
+	return ret;
+}
+
+WIMLIBAPI void
+wimlib_free_chunked_decompressor(struct wimlib_chunked_decompressor *cd)
+{
+	if (cd) {
+		wimlib_free_decompressor(cd->decompressor);
+		FREE(cd->table);
+		FREE(cd->cbuf);
+		FREE(cd->ubuf);
+		FREE(cd);
+	}
+}
@@ -39,6 +39,13 @@
 
 #include "wimlib/decompress_common.h"
 
+/* The number of independently counted and sorted parts of the alphabet in
+ * make_huffman_decode_table()  */
+#define NUM_SYM_PARTS	4
+
+/* The largest 'max_codeword_len' that any format uses (LZX)  */
+#define MAX_DECODE_CODEWORD_LEN	16
+
 /*
  * make_huffman_decode_table() -
  *
@@ -130,6 +137,8 @@ make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
 	u16 * const len_counts = &working_space[0];
 	u16 * const offsets = &working_space[1 * (max_codeword_len + 1)];
 	u16 * const sorted_syms = &working_space[2 * (max_codeword_len + 1)];
+	u16 part_counts[NUM_SYM_PARTS][MAX_DECODE_CODEWORD_LEN + 1];
+	unsigned part_size;
 	s32 remainder = 1;
 	void *entry_ptr = decode_table;
 	unsigned codeword_len = 1;
@@ -139,11 +148,27 @@ make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
 	unsigned subtable_bits;
 	unsigned subtable_prefix;
 
-	/* Count how many codewords have each length, including 0.  */
-	for (unsigned len = 0; len <= max_codeword_len; len++)
+	/*
+	 * Count how many codewords have each length, including 0.
+	 *
+	 * The symbols are split into NUM_SYM_PARTS contiguous parts which are
+	 * counted, and later sorted, as independent streams.  Otherwise, runs
+	 * of symbols with the same length would make each increment wait for
+	 * the previous one to the same counter.  The last part also gets any
+	 * leftover symbols.
+	 */
+	part_size = num_syms / NUM_SYM_PARTS;
+	memset(part_counts, 0, sizeof(part_counts));
+	for (unsigned i = 0; i < part_size; i++)
+		for (unsigned p = 0; p < NUM_SYM_PARTS; p++)
+			part_counts[p][lens[p * part_size + i]]++;
+	for (unsigned sym = NUM_SYM_PARTS * part_size; sym < num_syms; sym++)
+		part_counts[NUM_SYM_PARTS - 1][lens[sym]]++;
+	for (unsigned len = 0; len <= max_codeword_len; len++) {
 		len_counts[len] = 0;
-	for (unsigned sym = 0; sym < num_syms; sym++)
-		len_counts[lens[sym]]++;
+		for (unsigned p = 0; p < NUM_SYM_PARTS; p++)
+			len_counts[len] += part_counts[p][len];
+	}
 
 	/* It is already guaranteed that all lengths are <= max_codeword_len,
 	 * but it cannot be assumed they form a complete prefix code.  A
@@ -184,9 +209,28 @@ make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
 	for (unsigned len = 0; len < max_codeword_len; len++)
 		offsets[len + 1] = offsets[len] + len_counts[len];
 
-	/* Use the 'offsets' array to sort the symbols. */
-	for (unsigned sym = 0; sym < num_syms; sym++)
-		sorted_syms[offsets[lens[sym]]++] = sym;
+	/* Use the 'offsets' array to sort the symbols.  Each part's symbols of
+	 * a given length go after those of the previous parts, so turn the
+	 * per-part counts into per-part offsets.  */
+	for (unsigned len = 0; len <= max_codeword_len; len++) {
+		unsigned offset = offsets[len];
+
+		for (unsigned p = 0; p < NUM_SYM_PARTS; p++) {
+			unsigned count = part_counts[p][len];
+
+			part_counts[p][len] = offset;
+			offset += count;
+		}
+	}
+	for (unsigned i = 0; i < part_size; i++) {
+		for (unsigned p = 0; p < NUM_SYM_PARTS; p++) {
+			unsigned sym = p * part_size + i;
+
+			sorted_syms[part_counts[p][lens[sym]]++] = sym;
+		}
+	}
+	for (unsigned sym = NUM_SYM_PARTS * part_size; sym < num_syms; sym++)
+		sorted_syms[part_counts[NUM_SYM_PARTS - 1][lens[sym]]++] = sym;
 
 	/*
 	 * Fill the root table entries for codewords no longer than table_bits.
@@ -198,7 +242,7 @@ make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
 	 * word accesses (2 or 4 entries/store), then change to 16-bit accesses
 	 * (1 entry/store).
 	 */
-	sym_idx = offsets[0];
+	sym_idx = len_counts[0];
 
 #ifdef __SSE2__
 	/* Fill entries one 128-bit vector (8 entries) at a time. */
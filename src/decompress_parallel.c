@@ -0,0 +1,447 @@
+/*
+ * decompress_parallel.c
+ *
+ * Decompress chunks of data (parallel version).
+ */
+
+/*
+ * Copyright (C) 2013-2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wimlib.h"
+#include "wimlib/assert.h"
+#include "wimlib/chunk_decompressor.h"
+#include "wimlib/error.h"
+#include "wimlib/list.h"
+#include "wimlib/ring_buffer.h"
+#include "wimlib/task_pool.h"
+#include "wimlib/util.h"
+
+#define MAX_CHUNKS_PER_MSG 16
+
+struct message {
+	u8 *compressed_chunks[MAX_CHUNKS_PER_MSG];
+	u8 *uncompressed_chunks[MAX_CHUNKS_PER_MSG];
+	u32 compressed_chunk_sizes[MAX_CHUNKS_PER_MSG];
+	u32 uncompressed_chunk_sizes[MAX_CHUNKS_PER_MSG];
+	bool chunk_failed[MAX_CHUNKS_PER_MSG];
+	size_t num_filled_chunks;
+	size_t num_alloc_chunks;
+	struct list_head list;
+	bool complete;
+	struct list_head submission_list;
+	struct parallel_chunk_decompressor *ctx;
+};
+
+struct parallel_chunk_decompressor {
+	struct chunk_decompressor base;
+
+	struct worker_group workers;
+	struct ring_buffer decompressed_chunks_queue;
+	struct wimlib_decompressor **decompressors;
+	unsigned num_decompressors;
+
+	struct message *msgs;
+	size_t num_messages;
+
+	struct list_head available_msgs;
+	struct list_head submitted_msgs;
+	struct message *next_submit_msg;
+	struct message *next_ready_msg;
+	size_t next_chunk_idx;
+};
+
+static int
+init_message(struct message *msg, size_t num_chunks, u32 in_chunk_size)
+{
+	msg->num_alloc_chunks = num_chunks;
+	for (size_t i = 0; i < num_chunks; i++) {
+		msg->compressed_chunks[i] = MALLOC(in_chunk_size);
+		msg->uncompressed_chunks[i] = MALLOC(in_chunk_size);
+		if (msg->compressed_chunks[i] == NULL ||
+		    msg->uncompressed_chunks[i] == NULL)
+			return WIMLIB_ERR_NOMEM;
+	}
+	return 0;
+}
+
+static void
+destroy_message(struct message *msg)
+{
+	for (size_t i = 0; i < msg->num_alloc_chunks; i++) {
+		FREE(msg->compressed_chunks[i]);
+		FREE(msg->uncompressed_chunks[i]);
+	}
+}
+
+static void
+free_messages(struct message *msgs, size_t num_messages)
+{
+	if (msgs) {
+		for (size_t i = 0; i < num_messages; i++)
+			destroy_message(&msgs[i]);
+		FREE(msgs);
+	}
+}
+
+static struct message *
+allocate_messages(size_t count, size_t chunks_per_msg, u32 in_chunk_size)
+{
+	struct message *msgs;
+
+	msgs = CALLOC(count, sizeof(struct message));
+	if (msgs == NULL)
+		return NULL;
+	for (size_t i = 0; i < count; i++) {
+		if (init_message(&msgs[i], chunks_per_msg, in_chunk_size)) {
+			free_messages(msgs, count);
+			return NULL;
+		}
+	}
+	return msgs;
+}
+
+static void
+decompress_chunks(struct message *msg, struct wimlib_decompressor *decompressor)
+{
+	for (size_t i = 0; i < msg->num_filled_chunks; i++) {
+		u32 csize = msg->compressed_chunk_sizes[i];
+		u32 usize = msg->uncompressed_chunk_sizes[i];
+
+		if (csize == usize) {
+			/* Chunk is stored uncompressed.  */
+			msg->chunk_failed[i] = false;
+			continue;
+		}
+		msg->chunk_failed[i] =
+			(wimlib_decompress(msg->compressed_chunks[i], csize,
+					   msg->uncompressed_chunks[i], usize,
+					   decompressor) != 0);
+	}
+}
+
+/* Decompress a message on the task pool, using the worker's decompressor.  */
+static void
+decompressor_worker_process(void *item, void *decompressor)
+{
+	struct message *msg = item;
+	struct parallel_chunk_decompressor *ctx = msg->ctx;
+
+	decompress_chunks(msg, decompressor);
+	ring_buffer_put(&ctx->decompressed_chunks_queue, msg);
+}
+
+static void
+parallel_chunk_decompressor_destroy(struct chunk_decompressor *_ctx)
+{
+	struct parallel_chunk_decompressor *ctx = (struct parallel_chunk_decompressor *)_ctx;
+	unsigned i;
+
+	if (ctx == NULL)
+		return;
+
+	worker_group_destroy(&ctx->workers);
+
+	ring_buffer_destroy(&ctx->decompressed_chunks_queue);
+
+	if (ctx->decompressors != NULL)
+		for (i = 0; i < ctx->num_decompressors; i++)
+			wimlib_free_decompressor(ctx->decompressors[i]);
+
+	FREE(ctx->decompressors);
+
+	free_messages(ctx->msgs, ctx->num_messages);
+
+	FREE(ctx);
+}
+
+static void
+submit_decompression_msg(struct parallel_chunk_decompressor *ctx)
+{
+	struct message *msg = ctx->next_submit_msg;
+
+	msg->complete = false;
+	list_add_tail(&msg->submission_list, &ctx->submitted_msgs);
+	worker_group_submit(&ctx->workers, msg);
+	ctx->next_submit_msg = NULL;
+}
+
+static void *
+parallel_chunk_decompressor_get_chunk_buffer(struct chunk_decompressor *_ctx)
+{
+	struct parallel_chunk_decompressor *ctx = (struct parallel_chunk_decompressor *)_ctx;
+	struct message *msg;
+
+	if (ctx->next_submit_msg) {
+		msg = ctx->next_submit_msg;
+	} else {
+		if (list_empty(&ctx->available_msgs))
+			return NULL;
+
+		msg = list_entry(ctx->available_msgs.next, struct message, list);
+		list_del(&msg->list);
+		ctx->next_submit_msg = msg;
+		msg->num_filled_chunks = 0;
+	}
+
+	return msg->compressed_chunks[msg->num_filled_chunks];
+}
+
+static void
+parallel_chunk_decompressor_signal_chunk_filled(struct chunk_decompressor *_ctx,
+						u32 csize, u32 usize)
+{
+	struct parallel_chunk_decompressor *ctx = (struct parallel_chunk_decompressor *)_ctx;
+	struct message *msg;
+
+	wimlib_assert(csize > 0);
+	wimlib_assert(csize <= usize);
+	wimlib_assert(usize <= ctx->base.in_chunk_size);
+	wimlib_assert(ctx->next_submit_msg);
+
+	msg = ctx->next_submit_msg;
+	msg->compressed_chunk_sizes[msg->num_filled_chunks] = csize;
+	msg->uncompressed_chunk_sizes[msg->num_filled_chunks] = usize;
+	if (++msg->num_filled_chunks == msg->num_alloc_chunks)
+		submit_decompression_msg(ctx);
+}
+
+static bool
+parallel_chunk_decompressor_get_decompression_result(struct chunk_decompressor *_ctx,
+						     const void **cdata_ret,
+						     u32 *csize_ret,
+						     void **udata_ret,
+						     u32 *usize_ret,
+						     bool *failed_ret)
+{
+	struct parallel_chunk_decompressor *ctx = (struct parallel_chunk_decompressor *)_ctx;
+	struct message *msg;
+	size_t i;
+
+	if (ctx->next_submit_msg) {
+		if (ctx->next_submit_msg->num_filled_chunks) {
+			submit_decompression_msg(ctx);
+		} else {
+			/* A chunk buffer was taken but never filled, e.g.
+			 * because reading the chunk failed.  Don't submit the
+			 * empty message; it would never be fully consumed.  */
+			list_add(&ctx->next_submit_msg->list,
+				 &ctx->available_msgs);
+			ctx->next_submit_msg = NULL;
+		}
+	}
+
+	if (ctx->next_ready_msg) {
+		msg = ctx->next_ready_msg;
+	} else {
+		if (list_empty(&ctx->submitted_msgs))
+			return false;
+
+		while (!(msg = list_entry(ctx->submitted_msgs.next,
+					  struct message,
+					  submission_list))->complete)
+			((struct message *)
+			 ring_buffer_get(&ctx->decompressed_chunks_queue))->complete = true;
+
+		ctx->next_ready_msg = msg;
+		ctx->next_chunk_idx = 0;
+	}
+
+	i = ctx->next_chunk_idx;
+	*cdata_ret = msg->compressed_chunks[i];
+	*csize_ret = msg->compressed_chunk_sizes[i];
+	if (msg->compressed_chunk_sizes[i] == msg->uncompressed_chunk_sizes[i])
+		*udata_ret = msg->compressed_chunks[i];
+	else
+		*udata_ret = msg->uncompressed_chunks[i];
+	*usize_ret = msg->uncompressed_chunk_sizes[i];
+	*failed_ret = msg->chunk_failed[i];
+
+	if (++ctx->next_chunk_idx == msg->num_filled_chunks) {
+		list_del(&msg->submission_list);
+		list_add_tail(&msg->list, &ctx->available_msgs);
+		ctx->next_ready_msg = NULL;
+	}
+	return true;
+}
+
+static bool
+parallel_chunk_decompressor_result_ready(struct chunk_decompressor *_ctx)
+{
+	struct parallel_chunk_decompressor *ctx = (struct parallel_chunk_decompressor *)_ctx;
+
+	/* The rest of a message's chunks are ready once its first one is.  */
+	return ctx->next_ready_msg != NULL;
+}
+
+/*
+ * Create a chunk decompressor that uses @num_threads threads (0 means the
+ * number of available CPUs) to decompress chunks with compression type
+ * @in_ctype and maximum uncompressed size @in_chunk_size.  The buffers are
+ * limited to approximately @max_memory bytes (0 means the amount of available
+ * physical memory), which may result in fewer threads being used.
+ *
+ * Returns 0 on success, a positive wimlib error code on failure, or a negative
+ * value if only a single thread would be used, in which case the caller should
+ * decompress the data itself instead.
+ */
+int
+new_parallel_chunk_decompressor(int in_ctype, u32 in_chunk_size,
+				unsigned num_threads, u64 max_memory,
+				struct chunk_decompressor **decompressor_ret)
+{
+	u64 approx_mem_required;
+	size_t chunks_per_msg;
+	size_t msgs_per_thread;
+	struct parallel_chunk_decompressor *ctx;
+	unsigned i;
+	int ret;
+	unsigned desired_num_threads;
+
+	wimlib_assert(in_chunk_size > 0);
+
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+
+	/* The decompression is done on the library-wide task pool, so there's
+	 * no point in using more decompressors than it has threads.  */
+	num_threads = min(num_threads, task_pool_num_threads());
+
+	if (num_threads == 1)
+		return -1;
+
+	if (max_memory == 0)
+		max_memory = get_available_memory();
+
+	desired_num_threads = num_threads;
+
+	if (in_chunk_size < ((u32)1 << 23)) {
+		/* Relatively small chunks.  Use 2 messages per thread, each
+		 * with at least 2 chunks.  Use more chunks per message if there
+		 * are lots of threads and/or the chunks are very small.  */
+		chunks_per_msg = 2;
+		chunks_per_msg += num_threads * (65536 / in_chunk_size) / 16;
+		chunks_per_msg = max(chunks_per_msg, 2);
+		chunks_per_msg = min(chunks_per_msg, MAX_CHUNKS_PER_MSG);
+		msgs_per_thread = 2;
+	} else {
+		/* Big chunks: Just have one buffer per thread --- more would
+		 * just waste memory.  */
+		chunks_per_msg = 1;
+		msgs_per_thread = 1;
+	}
+	for (;;) {
+		/* Each chunk needs a compressed and an uncompressed buffer.  */
+		approx_mem_required =
+			(u64)chunks_per_msg *
+			(u64)msgs_per_thread *
+			(u64)num_threads *
+			(u64)in_chunk_size * 2
+			+ 1000000;
+		if (approx_mem_required <= max_memory)
+			break;
+
+		if (chunks_per_msg > 1)
+			chunks_per_msg--;
+		else if (msgs_per_thread > 1)
+			msgs_per_thread--;
+		else if (num_threads > 1)
+			num_threads--;
+		else
+			break;
+	}
+
+	if (num_threads < desired_num_threads) {
+		WARNING("Wanted to use %u decompression threads, but limiting "
+			"to %u to fit in available memory!",
+			desired_num_threads, num_threads);
+	}
+
+	if (num_threads == 1)
+		return -2;
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx = CALLOC(1, sizeof(*ctx));
+	if (ctx == NULL)
+		goto err;
+
+	ctx->base.in_ctype = in_ctype;
+	ctx->base.in_chunk_size = in_chunk_size;
+	ctx->base.destroy = parallel_chunk_decompressor_destroy;
+	ctx->base.get_chunk_buffer = parallel_chunk_decompressor_get_chunk_buffer;
+	ctx->base.signal_chunk_filled = parallel_chunk_decompressor_signal_chunk_filled;
+	ctx->base.get_decompression_result = parallel_chunk_decompressor_get_decompression_result;
+	ctx->base.result_ready = parallel_chunk_decompressor_result_ready;
+
+	/* Each message is either available, being filled, being decompressed, or
+	 * decompressed, so neither queue of messages can hold more than all of
+	 * them.  */
+	ctx->num_messages = num_threads * msgs_per_thread;
+
+	ret = ring_buffer_init(&ctx->decompressed_chunks_queue,
+			       ctx->num_messages);
+	if (ret)
+		goto err;
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx->decompressors = CALLOC(num_threads, sizeof(ctx->decompressors[0]));
+	if (ctx->decompressors == NULL)
+		goto err;
+	ctx->num_decompressors = num_threads;
+
+	for (i = 0; i < num_threads; i++) {
+		ret = wimlib_create_decompressor(in_ctype, in_chunk_size,
+						 &ctx->decompressors[i]);
+		if (ret)
+			goto err;
+	}
+
+	ret = worker_group_init(&ctx->workers, num_threads, ctx->num_messages,
+				decompressor_worker_process,
+				(void *const *)ctx->decompressors);
+	if (ret)
+		goto err;
+
+	ctx->base.num_threads = num_threads;
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx->msgs = allocate_messages(ctx->num_messages,
+				      chunks_per_msg, in_chunk_size);
+	if (ctx->msgs == NULL)
+		goto err;
+
+	INIT_LIST_HEAD(&ctx->available_msgs);
+	for (size_t i = 0; i < ctx->num_messages; i++) {
+		ctx->msgs[i].ctx = ctx;
+		list_add_tail(&ctx->msgs[i].list, &ctx->available_msgs);
+	}
+
+	INIT_LIST_HEAD(&ctx->submitted_msgs);
+
+	*decompressor_ret = &ctx->base;
+	return 0;
+
+err:
+	parallel_chunk_decompressor_destroy(&ctx->base);
+	return ret;
+}
@@ -61,6 +61,7 @@
 
 #include <errno.h>
 
+#include "wimlib/arena.h"
 #include "wimlib/assert.h"
 #include "wimlib/dentry.h"
 #include "wimlib/inode.h"
@@ -68,6 +69,7 @@
 #include "wimlib/endianness.h"
 #include "wimlib/metadata.h"
 #include "wimlib/paths.h"
+#include "wimlib/unaligned.h"
 
 /* On-disk format of a WIM dentry (directory entry), located in the metadata
  * resource for a WIM image.  */
@@ -222,19 +224,25 @@ struct wim_extra_stream_entry_on_disk {
 	utf16lechar name[];
 } __attribute__((packed));
 
+static void invalidate_full_paths(struct wim_dentry *dentry);
+
 static void
 do_dentry_set_name(struct wim_dentry *dentry, utf16lechar *name,
 		   size_t name_nbytes)
 {
-	FREE(dentry->d_name);
+	invalidate_full_paths(dentry);
+	if (!dentry->d_names_in_arena)
+		FREE(dentry->d_name);
 	dentry->d_name = name;
 	dentry->d_name_nbytes = name_nbytes;
 
 	if (dentry_has_short_name(dentry)) {
-		FREE(dentry->d_short_name);
+		if (!dentry->d_names_in_arena)
+			FREE(dentry->d_short_name);
 		dentry->d_short_name = NULL;
 		dentry->d_short_name_nbytes = 0;
 	}
+	dentry->d_names_in_arena = 0;
 }
 
 /*
@@ -271,6 +279,39 @@ dentry_set_name_utf16le(struct wim_dentry *dentry, const utf16lechar *name,
 }
 
 
+/*
+ * If the long and short names of the dentry were allocated from an arena, copy
+ * them to the heap, so that the caller can take ownership of them and free them
+ * individually.
+ *
+ * Returns 0 or WIMLIB_ERR_NOMEM.
+ */
+int
+dentry_move_names_to_heap(struct wim_dentry *dentry)
+{
+	utf16lechar *name = NULL, *short_name = NULL;
+
+	if (!dentry->d_names_in_arena)
+		return 0;
+	if (dentry_has_long_name(dentry)) {
+		name = utf16le_dupz(dentry->d_name, dentry->d_name_nbytes);
+		if (!name)
+			return WIMLIB_ERR_NOMEM;
+	}
+	if (dentry_has_short_name(dentry)) {
+		short_name = utf16le_dupz(dentry->d_short_name,
+					  dentry->d_short_name_nbytes);
+		if (!short_name) {
+			FREE(name);
+			return WIMLIB_ERR_NOMEM;
+		}
+	}
+	dentry->d_name = name;
+	dentry->d_short_name = short_name;
+	dentry->d_names_in_arena = 0;
+	return 0;
+}
+
 /*
  * Set the name of a WIM dentry from a 'tchar' string.
  *
@@ -386,40 +427,118 @@ dentry_out_total_length(const struct wim_dentry *dentry)
 	return len;
 }
 
+/*
+ * The dentry trees are traversed without recursion, by following the parent
+ * pointers of the dentries and of the nodes of the AVL trees of children (or
+ * the indices into the arrays of children).  This needs no memory beyond the
+ * tree itself however deep the tree is.
+ */
+
 /* Internal version of for_dentry_in_tree() that omits the NULL check  */
 static int
-do_for_dentry_in_tree(struct wim_dentry *dentry,
+do_for_dentry_in_tree(struct wim_dentry *root,
 		      int (*visitor)(struct wim_dentry *, void *), void *arg)
 {
+	struct wim_dentry *dentry = root;
+	struct wim_dentry *next;
 	int ret;
-	struct wim_dentry *child;
-
-	ret = (*visitor)(dentry, arg);
-	if (unlikely(ret))
-		return ret;
 
-	for_dentry_child(child, dentry) {
-		ret = do_for_dentry_in_tree(child, visitor, arg);
+	for (;;) {
+		ret = (*visitor)(dentry, arg);
 		if (unlikely(ret))
 			return ret;
+
+		/* Go to the first child, if any ...  */
+		next = dentry_first_child(dentry);
+		if (next) {
+			dentry = next;
+			continue;
+		}
+
+		/* ... otherwise to the next sibling of the dentry or of its
+		 * nearest ancestor which has one.  */
+		for (;;) {
+			if (dentry == root)
+				return 0;
+			next = dentry_next_sibling(dentry);
+			if (next) {
+				dentry = next;
+				break;
+			}
+			dentry = dentry->d_parent;
+		}
 	}
-	return 0;
+}
+
+/* Return the first child of @dir in a postorder traversal of its AVL tree of
+ * children, or just its first child if they are in an array.  */
+static struct wim_dentry *
+first_child_in_postorder(const struct wim_inode *dir)
+{
+	const struct avl_tree_node *node;
+
+	if (dir->i_children_in_array)
+		return dir->i_child_array->entries[0];
+	node = avl_tree_first_in_postorder(dir->i_children);
+	return node ? child_entry(node) : NULL;
+}
+
+/* Return the sibling after @dentry in the order of first_child_in_postorder(),
+ * or NULL if there is none.  */
+static struct wim_dentry *
+next_sibling_in_postorder(const struct wim_dentry *dentry)
+{
+	const struct avl_tree_node *node;
+
+	if (dentry->d_parent->d_inode->i_children_in_array)
+		return dentry_next_sibling(dentry);
+	node = avl_tree_next_in_postorder(&dentry->d_index_node,
+					  avl_get_parent(&dentry->d_index_node));
+	return node ? child_entry(node) : NULL;
+}
+
+/* Return the first dentry to visit in a postorder traversal of the tree rooted
+ * at @dentry.  */
+static struct wim_dentry *
+first_dentry_in_postorder(struct wim_dentry *dentry)
+{
+	struct wim_dentry *child;
+
+	while ((child = first_child_in_postorder(dentry->d_inode)))
+		dentry = child;
+	return dentry;
 }
 
 /* Internal version of for_dentry_in_tree_depth() that omits the NULL check  */
 static int
-do_for_dentry_in_tree_depth(struct wim_dentry *dentry,
+do_for_dentry_in_tree_depth(struct wim_dentry *root,
 			    int (*visitor)(struct wim_dentry *, void *), void *arg)
 {
+	struct wim_dentry *dentry = first_dentry_in_postorder(root);
+	struct wim_dentry *next;
 	int ret;
-	struct wim_dentry *child;
 
-	for_dentry_child_postorder(child, dentry) {
-		ret = do_for_dentry_in_tree_depth(child, visitor, arg);
+	for (;;) {
+		/* Find the next dentry before visiting this one, which may free
+		 * it.  After the siblings before it in the postorder of the AVL
+		 * tree comes the parent.  */
+		if (dentry == root) {
+			next = NULL;
+		} else {
+			next = next_sibling_in_postorder(dentry);
+			if (next)
+				next = first_dentry_in_postorder(next);
+			else
+				next = dentry->d_parent;
+		}
+
+		ret = (*visitor)(dentry, arg);
 		if (unlikely(ret))
 			return ret;
+		if (!next)
+			return 0;
+		dentry = next;
 	}
-	return unlikely((*visitor)(dentry, arg));
 }
 
 /*
@@ -466,6 +585,13 @@ for_dentry_in_tree_depth(struct wim_dentry *root,
  *
  * The full name will be saved in the cached value 'dentry->d_full_path'.
  *
+ * The path is built by appending the dentry's name to its parent's full path,
+ * which is calculated first if needed and stays cached.  So when many paths in
+ * the same directories are needed, each one costs only the length of its last
+ * component rather than a walk up to the root.  The cached paths are freed
+ * again when a dentry is linked, unlinked, or renamed; see
+ * invalidate_full_paths().
+ *
  * Whenever possible, use dentry_full_path() instead of calling this and
  * accessing d_full_path directly.
  *
@@ -474,36 +600,74 @@ for_dentry_in_tree_depth(struct wim_dentry *root,
 int
 calculate_dentry_full_path(struct wim_dentry *dentry)
 {
-	size_t ulen;
-	const struct wim_dentry *d;
+	struct wim_dentry *parent = dentry->d_parent;
+	const tchar *parent_path = T("");
+	size_t parent_len = 0;
+	const tchar *name;
+	size_t name_nbytes;
+	size_t name_nchars;
+	tchar *path;
+	int ret;
 
 	if (dentry->d_full_path)
 		return 0;
 
-	ulen = 0;
-	d = dentry;
-	do {
-		ulen += d->d_name_nbytes / sizeof(utf16lechar);
-		ulen++;
-		d = d->d_parent;  /* assumes d == d->d_parent for root  */
-	} while (!dentry_is_root(d));
-
-	utf16lechar ubuf[ulen];
-	utf16lechar *p = &ubuf[ulen];
+	/* The root's path is just the separator, so it isn't used as a prefix.
+	 * (This also covers unlinked dentries, which are their own parents.) */
+	if (!dentry_is_root(parent)) {
+		ret = calculate_dentry_full_path(parent);
+		if (ret)
+			return ret;
+		parent_path = parent->d_full_path;
+		parent_len = tstrlen(parent_path);
+	}
 
-	d = dentry;
-	do {
-		p -= d->d_name_nbytes / sizeof(utf16lechar);
-		if (d->d_name_nbytes)
-			memcpy(p, d->d_name, d->d_name_nbytes);
-		*--p = cpu_to_le16(WIM_PATH_SEPARATOR);
-		d = d->d_parent;  /* assumes d == d->d_parent for root  */
-	} while (!dentry_is_root(d));
+	ret = utf16le_get_tstr(dentry->d_name, dentry->d_name_nbytes,
+			       &name, &name_nbytes);
+	if (ret)
+		return ret;
+	name_nchars = name_nbytes / sizeof(tchar);
+
+	path = MALLOC((parent_len + 1 + name_nchars + 1) * sizeof(tchar));
+	if (path) {
+		tmemcpy(path, parent_path, parent_len);
+		path[parent_len] = WIM_PATH_SEPARATOR;
+		tmemcpy(&path[parent_len + 1], name, name_nchars);
+		path[parent_len + 1 + name_nchars] = T('\0');
+		dentry->d_full_path = path;
+
+		/* Remember which subtrees contain cached paths.  */
+		for (struct wim_dentry *d = dentry; !d->d_paths_cached;
+		     d = d->d_parent)
+		{
+			d->d_paths_cached = 1;
+			if (dentry_is_root(d))
+				break;
+		}
+	} else {
+		ret = WIMLIB_ERR_NOMEM;
+	}
+	utf16le_put_tstr(name);
+	return ret;
+}
 
-	wimlib_assert(p == ubuf);
+static int
+free_full_path(struct wim_dentry *dentry, void *_ignore)
+{
+	FREE(dentry->d_full_path);
+	dentry->d_full_path = NULL;
+	dentry->d_paths_cached = 0;
+	return 0;
+}
 
-	return utf16le_to_tstr(ubuf, ulen * sizeof(utf16lechar),
-			       &dentry->d_full_path, NULL);
+/* Free the cached full paths of @dentry and its descendants, since they are
+ * wrong after @dentry is linked, unlinked, or renamed.  Nothing needs to be
+ * done if no path was cached in the subtree since it was last invalidated.  */
+static void
+invalidate_full_paths(struct wim_dentry *dentry)
+{
+	if (dentry->d_paths_cached)
+		for_dentry_in_tree(dentry, free_full_path, NULL);
 }
 
 /*
@@ -616,8 +780,10 @@ get_dentry_child_with_utf16le_name(const struct wim_dentry *dir,
 				   size_t name_nbytes,
 				   CASE_SENSITIVITY_TYPE case_type)
 {
+	const struct wim_inode *inode = dir->d_inode;
 	struct wim_dentry wanted;
-	struct avl_tree_node *cur = dir->d_inode->i_children;
+	struct avl_tree_node *cur = NULL;
+	u32 lo = 0, hi = 0;
 	struct wim_dentry *ci_match = NULL;
 
 	wanted.d_name = (utf16lechar *)name;
@@ -626,13 +792,24 @@ get_dentry_child_with_utf16le_name(const struct wim_dentry *dir,
 	if (unlikely(wanted.d_name_nbytes != name_nbytes))
 		return NULL; /* overflow */
 
+	if (inode->i_children_in_array)
+		hi = inode->i_child_array->count;
+	else
+		cur = inode->i_children;
+
 	/* Note: we can't use avl_tree_lookup_node() here because we need to
-	 * save case-insensitive matches. */
-	while (cur) {
+	 * save case-insensitive matches.  The children are searched in the
+	 * same way whether they are in a tree or in a sorted array. */
+	while (cur || lo < hi) {
 		struct wim_dentry *child;
+		u32 mid = lo + (hi - lo) / 2;
 		int res;
 
-		child = avl_tree_entry(cur, struct wim_dentry, d_index_node);
+		if (cur)
+			child = avl_tree_entry(cur, struct wim_dentry,
+					       d_index_node);
+		else
+			child = inode->i_child_array->entries[mid];
 
 		res = dentry_compare_names(&wanted, child, true);
 		if (!res) {
@@ -644,10 +821,12 @@ get_dentry_child_with_utf16le_name(const struct wim_dentry *dir,
 				return child; /* case-sensitive match found */
 		}
 
-		if (res < 0)
-			cur = cur->left;
+		if (cur)
+			cur = (res < 0) ? cur->left : cur->right;
+		else if (res < 0)
+			hi = mid;
 		else
-			cur = cur->right;
+			lo = mid + 1;
 	}
 
 	/* No case-sensitive match; use a case-insensitive match if possible. */
@@ -955,10 +1134,13 @@ free_dentry(struct wim_dentry *dentry)
 {
 	if (dentry) {
 		d_disassociate(dentry);
-		FREE(dentry->d_name);
-		FREE(dentry->d_short_name);
+		if (!dentry->d_names_in_arena) {
+			FREE(dentry->d_name);
+			FREE(dentry->d_short_name);
+		}
 		FREE(dentry->d_full_path);
-		FREE(dentry);
+		if (!dentry->d_in_arena)
+			FREE(dentry);
 	}
 }
 
@@ -1018,13 +1200,11 @@ dentry_get_first_ci_match(struct wim_dentry *dentry)
 	struct wim_dentry *ci_match = dentry;
 
 	for (;;) {
-		struct avl_tree_node *node;
 		struct wim_dentry *prev;
 
-		node = avl_tree_prev_in_order(&ci_match->d_index_node);
-		if (!node)
+		prev = dentry_prev_sibling(ci_match);
+		if (!prev)
 			break;
-		prev = avl_tree_entry(node, struct wim_dentry, d_index_node);
 		if (dentry_compare_names(prev, dentry, true))
 			break;
 		ci_match = prev;
@@ -1044,12 +1224,9 @@ struct wim_dentry *
 dentry_get_next_ci_match(struct wim_dentry *dentry, struct wim_dentry *ci_match)
 {
 	do {
-		struct avl_tree_node *node;
-
-		node = avl_tree_next_in_order(&ci_match->d_index_node);
-		if (!node)
+		ci_match = dentry_next_sibling(ci_match);
+		if (!ci_match)
 			return NULL;
-		ci_match = avl_tree_entry(node, struct wim_dentry, d_index_node);
 	} while (ci_match == dentry);
 
 	if (dentry_compare_names(ci_match, dentry, true))
@@ -1058,6 +1235,23 @@ dentry_get_next_ci_match(struct wim_dentry *dentry, struct wim_dentry *ci_match)
 	return ci_match;
 }
 
+/* If the children of the directory @dir are in a sorted array, move them into
+ * an AVL tree so that the directory can be modified.  The array itself was
+ * allocated from the image's arena, so it is just abandoned.  */
+static void
+children_to_tree(struct wim_inode *dir)
+{
+	struct dentry_array *array = dir->i_child_array;
+
+	if (!dir->i_children_in_array)
+		return;
+	dir->i_children_in_array = 0;
+	dir->i_children = NULL;
+	for (u32 i = 0; i < array->count; i++)
+		avl_tree_insert(&dir->i_children, &array->entries[i]->d_index_node,
+				collate_dentry_names);
+}
+
 /*
  * Link a dentry into a directory.
  *
@@ -1080,11 +1274,13 @@ dentry_add_child(struct wim_dentry *parent, struct wim_dentry *child)
 	wimlib_assert(parent != child);
 	wimlib_assert(inode_is_directory(dir));
 
+	children_to_tree(dir);
 	duplicate = avl_tree_insert(&dir->i_children, &child->d_index_node,
 				    collate_dentry_names);
 	if (duplicate)
 		return avl_tree_entry(duplicate, struct wim_dentry, d_index_node);
 
+	invalidate_full_paths(child);
 	child->d_parent = parent;
 	return NULL;
 }
@@ -1099,8 +1295,10 @@ unlink_dentry(struct wim_dentry *dentry)
 	if (unlikely(dentry->d_parent == dentry))
 		return;
 
+	children_to_tree(dentry->d_parent->d_inode);
 	avl_tree_remove(&dentry->d_parent->d_inode->i_children,
 			&dentry->d_index_node);
+	invalidate_full_paths(dentry);
 
 	/* Not actually necessary, but to be safe don't retain the now-obsolete
 	 * parent pointer.  */
@@ -1108,16 +1306,19 @@ unlink_dentry(struct wim_dentry *dentry)
 }
 
 static int
-read_extra_data(const u8 *p, const u8 *end, struct wim_inode *inode)
+read_extra_data(const u8 *p, const u8 *end, struct wim_inode *inode,
+		struct mem_arena *arena)
 {
 	while (((uintptr_t)p & 7) && p < end)
 		p++;
 
 	if (unlikely(p < end)) {
-		inode->i_extra = MALLOC(sizeof(struct wim_inode_extra) +
-					end - p);
+		inode->i_extra = arena_alloc(arena,
+					     sizeof(struct wim_inode_extra) +
+					     end - p);
 		if (!inode->i_extra)
 			return WIMLIB_ERR_NOMEM;
+		inode->i_extra_in_arena = 1;
 		inode->i_extra->size = end - p;
 		memcpy(inode->i_extra->data, p, end - p);
 	}
@@ -1316,12 +1517,115 @@ setup_inode_streams(const u8 *p, const u8 *end, struct wim_inode *inode,
 	return 0;
 }
 
+/* A name which has been copied into the arena by read_dentry_tree()  */
+struct interned_name {
+	const utf16lechar *name;
+	u32 hash;
+	u16 nbytes;
+};
+
+/* State for read_dentry_tree()  */
+struct dentry_reader {
+	/* The arena from which the dentries, inodes, names, and extra data are
+	 * allocated  */
+	struct mem_arena *arena;
+
+	/* Hash table of the names which have been read, so that each distinct
+	 * name is only stored once.  Images often have many files with the
+	 * same names, e.g. the localized resources in each of many directories,
+	 * and the same short names.  The names are never modified in place, so
+	 * dentries can share them.  */
+	struct interned_name *names;
+	size_t names_capacity;	/* Power of 2, or 0 if the table is unused  */
+	size_t num_names;
+};
+
+static u32
+hash_name(const u8 *name, size_t nbytes)
+{
+	u64 hash = nbytes;
+
+	for (size_t i = 0; i < nbytes; i += 2)
+		hash = hash_u64(hash + get_unaligned_le16(&name[i]));
+	return hash >> 32;
+}
+
+/* Double the size of the table of names, or create it.  Returns false if out of
+ * memory.  */
+static bool
+grow_name_table(struct dentry_reader *reader)
+{
+	size_t new_capacity = max(reader->names_capacity * 2, 1024);
+	struct interned_name *new_names;
+
+	new_names = CALLOC(new_capacity, sizeof(new_names[0]));
+	if (!new_names)
+		return false;
+	for (size_t i = 0; i < reader->names_capacity; i++) {
+		const struct interned_name *entry = &reader->names[i];
+		size_t j = entry->hash & (new_capacity - 1);
+
+		if (!entry->name)
+			continue;
+		while (new_names[j].name)
+			j = (j + 1) & (new_capacity - 1);
+		new_names[j] = *entry;
+	}
+	FREE(reader->names);
+	reader->names = new_names;
+	reader->names_capacity = new_capacity;
+	return true;
+}
+
+/* Get a null-terminated copy in the arena of the name of @nbytes bytes at
+ * @name, reusing an identical name that was already read if there is one.  */
+static utf16lechar *
+intern_name(struct dentry_reader *reader, const u8 *name, size_t nbytes)
+{
+	const u32 hash = hash_name(name, nbytes);
+	struct interned_name *entry = NULL;
+	utf16lechar *dup;
+
+	/* Keep the table at most half full.  If it can't be grown, just don't
+	 * share this name.  */
+	if (reader->num_names >= reader->names_capacity / 2 &&
+	    !grow_name_table(reader))
+		goto copy;
+
+	for (size_t i = hash & (reader->names_capacity - 1); ;
+	     i = (i + 1) & (reader->names_capacity - 1))
+	{
+		entry = &reader->names[i];
+		if (!entry->name)
+			break;
+		if (entry->hash == hash && entry->nbytes == nbytes &&
+		    !memcmp(entry->name, name, nbytes))
+			return (utf16lechar *)entry->name;
+	}
+copy:
+	dup = arena_alloc(reader->arena, nbytes + sizeof(utf16lechar));
+	if (dup) {
+		memcpy(dup, name, nbytes);
+		dup[nbytes / sizeof(utf16lechar)] = 0;
+		if (entry) {
+			entry->name = dup;
+			entry->hash = hash;
+			entry->nbytes = nbytes;
+			reader->num_names++;
+		}
+	}
+	return dup;
+}
+
 /* Read a dentry, including all extra stream entries that follow it, from an
- * uncompressed metadata resource buffer.  */
+ * uncompressed metadata resource buffer.  The dentry, its inode, and their
+ * names and extra data are allocated from the reader's arena.  */
 static int
 read_dentry(const u8 * restrict buf, size_t buf_len,
-	    u64 *offset_p, struct wim_dentry **dentry_ret)
+	    u64 *offset_p, struct dentry_reader *reader,
+	    struct wim_dentry **dentry_ret)
 {
+	struct mem_arena *arena = reader->arena;
 	u64 offset = *offset_p;
 	u64 length;
 	const u8 *p;
@@ -1367,11 +1671,16 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
 
 	/* Allocate new dentry structure, along with a preliminary inode.  */
-	ret = new_dentry_with_new_inode(NULL, false, &dentry);
-	if (ret)
-		return ret;
+	dentry = arena_zalloc(arena, sizeof(struct wim_dentry));
+	if (!dentry)
+		return WIMLIB_ERR_NOMEM;
+	dentry->d_in_arena = 1;
+	dentry->d_names_in_arena = 1;
+	dentry->d_parent = dentry;
 
-	inode = dentry->d_inode;
+	inode = new_inode_in_arena(dentry, arena);
+	if (!inode)
+		return WIMLIB_ERR_NOMEM;
 
 	/* Read more fields: some into the dentry, and some into the inode.  */
 	inode->i_attributes = le32_to_cpu(disk_dentry->attributes);
@@ -1419,7 +1728,7 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 	/* Read the filename if present.  Note: if the filename is empty, there
 	 * is no null terminator following it.  */
 	if (name_nbytes) {
-		dentry->d_name = utf16le_dupz(p, name_nbytes);
+		dentry->d_name = intern_name(reader, p, name_nbytes);
 		if (unlikely(!dentry->d_name)) {
 			ret = WIMLIB_ERR_NOMEM;
 			goto err_free_dentry;
@@ -1431,7 +1740,8 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 	/* Read the short filename if present.  Note: if there is no short
 	 * filename, there is no null terminator following it. */
 	if (short_name_nbytes) {
-		dentry->d_short_name = utf16le_dupz(p, short_name_nbytes);
+		dentry->d_short_name = intern_name(reader, p,
+						   short_name_nbytes);
 		if (unlikely(!dentry->d_short_name)) {
 			ret = WIMLIB_ERR_NOMEM;
 			goto err_free_dentry;
@@ -1442,7 +1752,7 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 
 	/* Read extra data at end of dentry (but before extra stream entries).
 	 * This may contain tagged metadata items.  */
-	ret = read_extra_data(p, &buf[offset + length], inode);
+	ret = read_extra_data(p, &buf[offset + length], inode, arena);
 	if (ret)
 		goto err_free_dentry;
 
@@ -1523,31 +1833,53 @@ should_ignore_dentry(struct wim_dentry *dir, const struct wim_dentry *dentry)
 	return false;
 }
 
+/* Warn about and free a child of a directory which has the same case-sensitive
+ * name as the child @duplicate that is being kept.  */
+static void
+ignore_duplicate_dentry(struct wim_dentry *child, struct wim_dentry *duplicate)
+{
+	/* We already found a dentry with this same case-sensitive long name.
+	 * Only keep the first one.  */
+	WARNING("Ignoring duplicate file \"%"TS"\" "
+		"(the WIM image already contains a file "
+		"at that path with the exact same name)",
+		dentry_full_path(duplicate));
+	free_dentry(child);
+}
+
+/*
+ * Read the children of @dir and link them into it.  WIM images normally store
+ * the children of each directory in collation order, so usually they can just
+ * be put into a sorted array, which is much cheaper than inserting each one
+ * into an AVL tree.  If they're out of order, an AVL tree is used instead.
+ */
 static int
-read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
-			   struct wim_dentry * restrict dir, unsigned depth)
+read_dentry_children(const u8 * restrict buf, size_t buf_len,
+		     struct wim_dentry * restrict dir,
+		     struct dentry_reader *reader)
 {
+	struct wim_dentry *stack_children[64];
+	struct wim_dentry **children = stack_children;
+	size_t capacity = ARRAY_LEN(stack_children);
+	size_t count = 0;
+	bool sorted = true;
 	u64 cur_offset = dir->d_subdir_offset;
-
-	/* Disallow extremely deep or cyclic directory structures  */
-	if (unlikely(depth >= 16384)) {
-		ERROR("Directory structure too deep!");
-		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
-	}
+	struct dentry_array *array;
+	int ret;
 
 	for (;;) {
 		struct wim_dentry *child;
 		struct wim_dentry *duplicate;
-		int ret;
+		int res;
 
 		/* Read next child of @dir.  */
-		ret = read_dentry(buf, buf_len, &cur_offset, &child);
+		ret = read_dentry(buf, buf_len, &cur_offset, reader, &child);
 		if (ret)
-			return ret;
+			goto out;
 
 		/* Check for end of directory.  */
 		if (child == NULL)
-			return 0;
+			break;
 
 		/* Ignore dentries with bad names.  */
 		if (unlikely(should_ignore_dentry(dir, child))) {
@@ -1555,37 +1887,226 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
 			continue;
 		}
 
-		/* Link the child into the directory.  */
-		duplicate = dentry_add_child(dir, child);
-		if (unlikely(duplicate)) {
-			/* We already found a dentry with this same
-			 * case-sensitive long name.  Only keep the first one.
-			 */
-			WARNING("Ignoring duplicate file \"%"TS"\" "
-				"(the WIM image already contains a file "
-				"at that path with the exact same name)",
-				dentry_full_path(duplicate));
-			free_dentry(child);
+		if (!sorted) {
+			duplicate = dentry_add_child(dir, child);
+			if (unlikely(duplicate))
+				ignore_duplicate_dentry(child, duplicate);
 			continue;
 		}
 
-		/* If this child is a directory that itself has children, call
-		 * this procedure recursively.  */
-		if (child->d_subdir_offset != 0) {
-			if (likely(dentry_is_directory(child))) {
-				ret = read_dentry_tree_recursive(buf,
-								 buf_len,
-								 child,
-								 depth + 1);
-				if (ret)
-					return ret;
-			} else {
-				WARNING("Ignoring children of "
-					"non-directory file \"%"TS"\"",
-					dentry_full_path(child));
+		res = count ? collate_dentry_names(&children[count - 1]->d_index_node,
+						   &child->d_index_node) : -1;
+		if (unlikely(res == 0)) {
+			ignore_duplicate_dentry(child, children[count - 1]);
+		} else if (likely(res < 0)) {
+			if (unlikely(count == capacity)) {
+				struct wim_dentry **new_children;
+
+				new_children = MALLOC(2 * capacity *
+						      sizeof(children[0]));
+				if (!new_children) {
+					free_dentry(child);
+					ret = WIMLIB_ERR_NOMEM;
+					goto out;
+				}
+				memcpy(new_children, children,
+				       count * sizeof(children[0]));
+				if (children != stack_children)
+					FREE(children);
+				children = new_children;
+				capacity *= 2;
 			}
+			/* Set the parent now, for dentry_full_path().  */
+			child->d_parent = dir;
+			children[count++] = child;
+		} else {
+			/* Out of order; switch to an AVL tree.  */
+			for (size_t i = 0; i < count; i++)
+				dentry_add_child(dir, children[i]);
+			count = 0;
+			sorted = false;
+			duplicate = dentry_add_child(dir, child);
+			if (unlikely(duplicate))
+				ignore_duplicate_dentry(child, duplicate);
 		}
 	}
+
+	if (count) {
+		array = arena_alloc(reader->arena, sizeof(*array) +
+				    count * sizeof(array->entries[0]));
+		if (!array) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto out;
+		}
+		array->count = count;
+		for (size_t i = 0; i < count; i++) {
+			array->entries[i] = children[i];
+			children[i]->d_child_index = i;
+		}
+		dir->d_inode->i_child_array = array;
+		dir->d_inode->i_children_in_array = 1;
+		count = 0;
+	}
+out:
+	/* On failure, free the children which didn't get linked in.  */
+	for (size_t i = 0; i < count; i++)
+		free_dentry(children[i]);
+	if (children != stack_children)
+		FREE(children);
+	return ret;
+}
+
+static int
+read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
+			   struct wim_dentry * restrict dir,
+			   struct dentry_reader *reader, unsigned depth,
+			   bool recursive)
+{
+	struct wim_dentry *child;
+	int ret;
+
+	/* Disallow extremely deep or cyclic directory structures  */
+	if (unlikely(depth >= 16384)) {
+		ERROR("Directory structure too deep!");
+		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+	}
+
+	ret = read_dentry_children(buf, buf_len, dir, reader);
+	if (ret || !recursive)
+		return ret;
+
+	/* For each child that is a directory that itself has children, call
+	 * this procedure recursively.  */
+	for_dentry_child(child, dir) {
+		if (child->d_subdir_offset == 0)
+			continue;
+		if (likely(dentry_is_directory(child))) {
+			ret = read_dentry_tree_recursive(buf, buf_len, child,
+							 reader, depth + 1,
+							 true);
+			if (ret)
+				return ret;
+		} else {
+			WARNING("Ignoring children of non-directory file "
+				"\"%"TS"\"", dentry_full_path(child));
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read the parts of the subtree rooted at @dir that haven't been read yet: all
+ * of them if @recursive, otherwise just the children of @dir.  This relies on
+ * directories always being read one full level at a time, so that a directory
+ * that has any children linked in has had all of them read.
+ */
+static int
+read_unread_children(const u8 *buf, size_t buf_len, struct wim_dentry *dir,
+		     struct dentry_reader *reader, unsigned depth, bool recursive)
+{
+	struct wim_dentry *child;
+	int ret;
+
+	if (dir->d_subdir_offset == 0 || !dentry_is_directory(dir))
+		return 0;
+
+	if (!dentry_has_children(dir))
+		return read_dentry_tree_recursive(buf, buf_len, dir, reader,
+						  depth, recursive);
+	if (recursive) {
+		if (unlikely(depth >= 16384)) {
+			ERROR("Directory structure too deep!");
+			return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+		}
+		for_dentry_child(child, dir) {
+			ret = read_unread_children(buf, buf_len, child, reader,
+						   depth + 1, true);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read the directories needed to look up @path in the partially read tree
+ * rooted at @root, using the same rules as get_dentry() with
+ * WIMLIB_CASE_PLATFORM_DEFAULT, then read the full subtree rooted at the file
+ * @path names.  It is not an error for @path not to exist; the later lookup
+ * will report it.
+ */
+static int
+read_dentry_tree_path(const u8 *buf, size_t buf_len, struct wim_dentry *root,
+		      struct dentry_reader *reader, const tchar *path)
+{
+	const utf16lechar *path_utf16le;
+	const utf16lechar *name_start, *name_end;
+	struct wim_dentry *cur_dentry = root;
+	unsigned depth = 0;
+	int ret;
+
+	ret = tstr_get_utf16le(path, &path_utf16le);
+	if (ret)
+		return ret;
+
+	name_start = path_utf16le;
+	for (;;) {
+		while (*name_start == cpu_to_le16(WIM_PATH_SEPARATOR))
+			name_start++;
+
+		if (!*name_start) {
+			ret = read_unread_children(buf, buf_len, cur_dentry,
+						   reader, depth, true);
+			break;
+		}
+
+		if (!dentry_is_directory(cur_dentry))
+			break;
+
+		ret = read_unread_children(buf, buf_len, cur_dentry, reader,
+					   depth, false);
+		if (ret)
+			break;
+
+		name_end = name_start;
+		do {
+			++name_end;
+		} while (*name_end != cpu_to_le16(WIM_PATH_SEPARATOR) && *name_end);
+
+		cur_dentry = get_dentry_child_with_utf16le_name(cur_dentry,
+								name_start,
+								(u8*)name_end - (u8*)name_start,
+								WIMLIB_CASE_PLATFORM_DEFAULT);
+		if (!cur_dentry)
+			break;
+		name_start = name_end;
+		depth++;
+	}
+	tstr_put_utf16le(path_utf16le);
+	return ret;
+}
+
+/*
+ * Read the children of @dir from the metadata resource in @buf, allocating them
+ * from @arena, if it is a directory which has children that haven't been read.
+ * Their own children aren't read.  This allows a tree which read_dentry_tree()
+ * read only partially to be read one directory at a time, as it is needed.
+ */
+int
+read_dentry_subdir(const u8 *buf, size_t buf_len, struct mem_arena *arena,
+		   struct wim_dentry *dir)
+{
+	struct dentry_reader reader = {
+		.arena = arena,
+	};
+	int ret;
+
+	if (dir->d_subdir_offset == 0 || !dentry_is_directory(dir) ||
+	    dentry_has_children(dir))
+		return 0;
+	ret = read_dentry_children(buf, buf_len, dir, &reader);
+	FREE(reader.names);
+	return ret;
 }
 
 /*
@@ -1600,6 +2121,23 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
  * @root_offset
  *	Offset in the metadata resource of the root of the dentry tree.
  *
+ * @arena:
+ *	The image's arena, from which the dentries, inodes, names, and extra
+ *	data are allocated.  Identical names are only allocated once, and are
+ *	shared by the dentries.  The tree must be freed with free_dentry_tree()
+ *	before the arena is destroyed.
+ *
+ * @paths, @num_paths:
+ *	If @paths is NULL, the whole tree is read.  Otherwise, only the
+ *	directories needed to look up each of the @num_paths paths (which must
+ *	be canonicalized with canonicalize_wim_path()) are read, along with the
+ *	full subtree rooted at each path.  The siblings of a directory on the
+ *	way to a path are read, but their own children are not.  The resulting
+ *	tree is only good for looking up and processing those paths; e.g. link
+ *	counts of inodes that have links elsewhere in the image may be low.
+ *	With no paths, only the root dentry is read; read_dentry_subdir() can
+ *	then read the rest of the tree on demand.
+ *
  * @root_ret:
  *	On success, either NULL or a pointer to the root dentry is written to
  *	this location.  The former case only occurs in the unexpected case that
@@ -1612,14 +2150,19 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
  */
 int
 read_dentry_tree(const u8 *buf, size_t buf_len,
-		 u64 root_offset, struct wim_dentry **root_ret)
+		 u64 root_offset, struct mem_arena *arena,
+		 const tchar * const *paths, size_t num_paths,
+		 struct wim_dentry **root_ret)
 {
 	int ret;
 	struct wim_dentry *root;
+	struct dentry_reader reader = {
+		.arena = arena,
+	};
 
-	ret = read_dentry(buf, buf_len, &root_offset, &root);
+	ret = read_dentry(buf, buf_len, &root_offset, &reader, &root);
 	if (ret)
-		return ret;
+		goto out;
 
 	if (likely(root != NULL)) {
 		if (unlikely(dentry_has_long_name(root) ||
@@ -1636,8 +2179,16 @@ read_dentry_tree(const u8 *buf, size_t buf_len,
 			goto err_free_dentry_tree;
 		}
 
-		if (likely(root->d_subdir_offset != 0)) {
-			ret = read_dentry_tree_recursive(buf, buf_len, root, 0);
+		if (paths) {
+			for (size_t i = 0; i < num_paths; i++) {
+				ret = read_dentry_tree_path(buf, buf_len, root,
+							    &reader, paths[i]);
+				if (ret)
+					goto err_free_dentry_tree;
+			}
+		} else if (likely(root->d_subdir_offset != 0)) {
+			ret = read_dentry_tree_recursive(buf, buf_len, root,
+							 &reader, 0, true);
 			if (ret)
 				goto err_free_dentry_tree;
 		}
@@ -1646,13 +2197,206 @@ read_dentry_tree(const u8 *buf, size_t buf_len,
 			"treating as an empty image.");
 	}
 	*root_ret = root;
-	return 0;
+	ret = 0;
+	goto out;
 
 err_free_dentry_tree:
 	free_dentry_tree(root, NULL);
+out:
+	FREE(reader.names);
 	return ret;
 }
 
+/*
+ * Validate the serialized dentry at *offset_p, including its extra stream
+ * entries, the same way read_dentry() would, and pass the SHA-1 message digest
+ * of each of its nonempty streams to @visitor unless the dentry would be
+ * ignored when reading the tree.  If the dentry turns out to be invalid,
+ * @visitor may already have been called on some of its streams.  On success, *offset_p is advanced to the next
+ * dentry in the directory, and *disk_dentry_ret is set to the dentry, or to
+ * NULL if it would be ignored or the end of the directory was reached (in which
+ * case *end_ret is set to true).
+ */
+static int
+scan_dentry(const u8 *buf, size_t buf_len, u64 *offset_p, bool is_root,
+	    int (*visitor)(const u8 *hash, void *ctx), void *ctx,
+	    const struct wim_dentry_on_disk **disk_dentry_ret, bool *end_ret)
+{
+	u64 offset = *offset_p;
+	const struct wim_dentry_on_disk *disk_dentry;
+	const utf16lechar *name;
+	u64 length;
+	u16 name_nbytes;
+	u16 short_name_nbytes;
+	unsigned num_extra_streams;
+	bool ignore = false;
+	int ret;
+
+	*disk_dentry_ret = NULL;
+	*end_ret = false;
+
+	if (unlikely(offset + sizeof(u64) > buf_len ||
+		     offset + sizeof(u64) < offset))
+		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+
+	disk_dentry = (const struct wim_dentry_on_disk *)&buf[offset];
+	length = ALIGN(le64_to_cpu(disk_dentry->length), 8);
+	if (length <= 8) {
+		*end_ret = true;
+		return 0;
+	}
+	if (unlikely(length < sizeof(struct wim_dentry_on_disk)))
+		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+	if (unlikely(offset + length > buf_len ||
+		     offset + length < offset))
+		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+
+	short_name_nbytes = le16_to_cpu(disk_dentry->short_name_nbytes);
+	name_nbytes = le16_to_cpu(disk_dentry->name_nbytes);
+	if (unlikely((short_name_nbytes & 1) | (name_nbytes & 1)))
+		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+	if (unlikely(length < dentry_min_len_with_names(name_nbytes,
+							short_name_nbytes)))
+		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+
+	/* Apply the same rules as should_ignore_dentry().  */
+	if (!is_root) {
+		name = (const utf16lechar *)(disk_dentry + 1);
+		if (name_nbytes == 0)
+			ignore = true;
+		else if ((name_nbytes == 2 || name_nbytes == 4) &&
+			 name[0] == cpu_to_le16('.') &&
+			 (name_nbytes == 2 || name[1] == cpu_to_le16('.')))
+			ignore = true;
+		for (unsigned i = 0; i < name_nbytes / 2 && !ignore; i++)
+			if (name[i] == cpu_to_le16('\0'))
+				ignore = true;
+	}
+
+	if (!ignore && !is_zero_hash(disk_dentry->main_hash)) {
+		ret = (*visitor)(disk_dentry->main_hash, ctx);
+		if (ret)
+			return ret;
+	}
+	offset += length;
+
+	/* Validate the extra stream entries as setup_inode_streams() does.  */
+	num_extra_streams = le16_to_cpu(disk_dentry->num_extra_streams);
+	for (unsigned i = 0; i < num_extra_streams; i++) {
+		const struct wim_extra_stream_entry_on_disk *disk_strm;
+		u16 strm_name_nbytes;
+
+		if (buf_len - offset < sizeof(struct wim_extra_stream_entry_on_disk))
+			return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+		disk_strm = (const struct wim_extra_stream_entry_on_disk *)
+				&buf[offset];
+		length = ALIGN(le64_to_cpu(disk_strm->length), 8);
+		if (length < sizeof(struct wim_extra_stream_entry_on_disk) ||
+		    length > buf_len - offset)
+			return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+		strm_name_nbytes = le16_to_cpu(disk_strm->name_nbytes);
+		if (strm_name_nbytes != 0 &&
+		    ((strm_name_nbytes & 1) ||
+		     sizeof(struct wim_extra_stream_entry_on_disk) +
+				strm_name_nbytes > length))
+			return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+		if (!ignore && !is_zero_hash(disk_strm->hash)) {
+			ret = (*visitor)(disk_strm->hash, ctx);
+			if (ret)
+				return ret;
+		}
+		offset += length;
+	}
+
+	*offset_p = offset;
+	if (!ignore)
+		*disk_dentry_ret = disk_dentry;
+	return 0;
+}
+
+static bool
+disk_dentry_is_directory(const struct wim_dentry_on_disk *disk_dentry)
+{
+	return (le32_to_cpu(disk_dentry->attributes) &
+		(FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT))
+			== FILE_ATTRIBUTE_DIRECTORY;
+}
+
+static int
+scan_dentry_tree_recursive(const u8 *buf, size_t buf_len, u64 cur_offset,
+			   unsigned depth,
+			   int (*visitor)(const u8 *hash, void *ctx), void *ctx)
+{
+	if (unlikely(depth >= 16384)) {
+		ERROR("Directory structure too deep!");
+		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+	}
+
+	for (;;) {
+		const struct wim_dentry_on_disk *child;
+		bool end;
+		u64 subdir_offset;
+		int ret;
+
+		ret = scan_dentry(buf, buf_len, &cur_offset, false,
+				  visitor, ctx, &child, &end);
+		if (ret)
+			return ret;
+		if (end)
+			return 0;
+		if (!child)
+			continue;
+		subdir_offset = le64_to_cpu(child->subdir_offset);
+		if (subdir_offset != 0 && disk_dentry_is_directory(child)) {
+			ret = scan_dentry_tree_recursive(buf, buf_len,
+							 subdir_offset,
+							 depth + 1,
+							 visitor, ctx);
+			if (ret)
+				return ret;
+		}
+	}
+}
+
+/*
+ * Call @visitor on the SHA-1 message digest of each nonempty stream of each
+ * file in a tree of dentries in a WIM metadata resource, once per link, without
+ * actually reading the tree into memory.  The arguments are as for
+ * read_dentry_tree(), and the same validation is done.  The only difference
+ * from walking the tree read by read_dentry_tree() is that files with the same
+ * name as an earlier file in their directory, which only corrupted metadata
+ * resources contain, are not ignored.
+ *
+ * Return values:
+ *	WIMLIB_ERR_SUCCESS (0)
+ *	WIMLIB_ERR_INVALID_METADATA_RESOURCE
+ *	or an error returned by @visitor
+ */
+int
+scan_dentry_tree_hashes(const u8 *buf, size_t buf_len, u64 root_offset,
+			int (*visitor)(const u8 *hash, void *ctx), void *ctx)
+{
+	const struct wim_dentry_on_disk *root;
+	bool end;
+	u64 subdir_offset;
+	int ret;
+
+	ret = scan_dentry(buf, buf_len, &root_offset, true, visitor, ctx,
+			  &root, &end);
+	if (ret || end)
+		return ret;
+
+	if (unlikely(!disk_dentry_is_directory(root))) {
+		ERROR("The root of the WIM image is not a directory!");
+		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+	}
+	subdir_offset = le64_to_cpu(root->subdir_offset);
+	if (subdir_offset == 0)
+		return 0;
+	return scan_dentry_tree_recursive(buf, buf_len, subdir_offset, 0,
+					  visitor, ctx);
+}
+
 static u8 *
 write_extra_stream_entry(u8 * restrict p, const utf16lechar * restrict name,
 			 const u8 * restrict hash)
@@ -1785,14 +2529,16 @@ write_dentry_streams(const struct wim_inode *inode,
  * This includes any extra stream entries that may follow the dentry itself.
  *
  * @dentry:
- *	The dentry to write.
+ *	The dentry to write.  Its subdir offset must have been set by
+ *	calculate_subdir_offsets().
  *
  * @p:
- *	The memory location to which to write the data.
+ *	The memory location to which to write the data.  This must be 8-byte
+ *	aligned and have room for dentry_out_total_length() bytes.
  *
  * Returns a pointer to the byte following the last written.
  */
-static u8 *
+u8 *
 write_dentry(const struct wim_dentry * restrict dentry, u8 * restrict p)
 {
 	const struct wim_inode *inode;
@@ -1858,51 +2604,3 @@ write_dentry(const struct wim_dentry * restrict dentry, u8 * restrict p)
 	 */
 	return write_dentry_streams(inode, disk_dentry, p);
 }
-
-static int
-write_dir_dentries(struct wim_dentry *dir, void *_pp)
-{
-	if (dir->d_subdir_offset != 0) {
-		u8 **pp = _pp;
-		u8 *p = *pp;
-		struct wim_dentry *child;
-
-		/* write child dentries */
-		for_dentry_child(child, dir)
-			p = write_dentry(child, p);
-
-		/* write end of directory entry */
-		*(u64*)p = 0;
-		p += 8;
-		*pp = p;
-	}
-	return 0;
-}
-
-/*
- * Write a directory tree to the metadata resource.
- *
- * @root:
- *	The root of a dentry tree on which calculate_subdir_offsets() has been
- *	called.  This cannot be NULL; if the dentry tree is empty, the caller is
- *	expected to first generate a dummy root directory.
- *
- * @p:
- *	Pointer to a buffer with enough space for the dentry tree.  This size
- *	must have been obtained by calculate_subdir_offsets().
- *
- * Returns a pointer to the byte following the last written.
- */
-u8 *
-write_dentry_tree(struct wim_dentry *root, u8 *p)
-{
-	/* write root dentry and end-of-directory entry following it */
-	p = write_dentry(root, p);
-	*(u64*)p = 0;
-	p += 8;
-
-	/* write the rest of the dentry tree */
-	for_dentry_in_tree(root, write_dir_dentries, &p);
-
-	return p;
-}
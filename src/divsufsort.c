@@ -29,6 +29,7 @@
 #endif
 
 #include "wimlib/divsufsort.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/util.h"
 
 #define DIVSUFSORT_ASSERT(expr)
@@ -1388,12 +1389,94 @@ trsort(int *ISA, int *SA, int n, int depth) {
 
 /*---------------------------------------------------------------------------*/
 
+/* XXX Modified from original: the type B* substrings are sorted in parallel on
+ * the task pool instead of with OpenMP.  As in the original, each task takes
+ * the next bucket to sort from a shared cursor and uses its own part of the
+ * temporary buffer.  */
+
+#define SSSORT_MAX_TASKS 16
+
+struct sssort_ctx {
+  const unsigned char *T;
+  const int *PAb;
+  int *SA;
+  const int *bucket_B;
+  int n;
+  int m;
+  struct mutex lock;
+  int c0, c1, j;
+};
+
+struct sssort_task {
+  struct pool_task base;
+  struct sssort_ctx *ctx;
+  int *buf;
+  int bufsize;
+};
+
+static void
+sssort_task_run(struct pool_task *_task) {
+  struct sssort_task *task = (struct sssort_task *)_task;
+  struct sssort_ctx *ctx = task->ctx;
+  const int *bucket_B = ctx->bucket_B;
+  int d0, d1, k = 0, l;
+
+  for(;;) {
+    mutex_lock(&ctx->lock);
+    if(0 < (l = ctx->j)) {
+      d0 = ctx->c0, d1 = ctx->c1;
+      do {
+        k = BUCKET_BSTAR(d0, d1);
+        if(--d1 <= d0) {
+          d1 = ALPHABET_SIZE - 1;
+          if(--d0 < 0) { break; }
+        }
+      } while(((l - k) <= 1) && (0 < (l = k)));
+      ctx->c0 = d0, ctx->c1 = d1, ctx->j = k;
+    }
+    mutex_unlock(&ctx->lock);
+    if(l == 0) { break; }
+    sssort(ctx->T, ctx->PAb, ctx->SA + k, ctx->SA + l,
+           task->buf, task->bufsize, 2, ctx->n, *(ctx->SA + k) == (ctx->m - 1));
+  }
+}
+
+/* Sort the type B* substrings like the serial loop in sort_typeBstar() does,
+ * but with up to @num_tasks tasks.  Returns false if not done.  */
+static bool
+sssort_parallel(const unsigned char *T, const int *PAb, int *SA,
+                const int *bucket_B, int *buf, int bufsize,
+                int n, int m, unsigned num_tasks) {
+  struct sssort_ctx ctx;
+  struct sssort_task tasks[SSSORT_MAX_TASKS];
+  struct pool_task *task_ptrs[SSSORT_MAX_TASKS];
+  unsigned i;
+
+  if(SSSORT_MAX_TASKS < num_tasks) { num_tasks = SSSORT_MAX_TASKS; }
+  if(num_tasks <= 1 || !mutex_init(&ctx.lock)) { return false; }
+
+  ctx.T = T, ctx.PAb = PAb, ctx.SA = SA, ctx.bucket_B = bucket_B;
+  ctx.n = n, ctx.m = m;
+  ctx.c0 = ALPHABET_SIZE - 2, ctx.c1 = ALPHABET_SIZE - 1, ctx.j = m;
+  bufsize /= (int)num_tasks;
+  for(i = 0; i < num_tasks; ++i) {
+    tasks[i].base.run = sssort_task_run;
+    tasks[i].ctx = &ctx;
+    tasks[i].buf = buf + i * bufsize;
+    tasks[i].bufsize = bufsize;
+    task_ptrs[i] = &tasks[i].base;
+  }
+  task_pool_run_batch(task_ptrs, num_tasks);
+  mutex_destroy(&ctx.lock);
+  return true;
+}
+
 /* Sorts suffixes of type B*. */
 static
 int
 sort_typeBstar(const unsigned char *T, int *SA,
                int *bucket_A, int *bucket_B,
-               int n) {
+               int n, unsigned num_tasks) {
   int *PAb, *ISAb, *buf;
   int i, j, k, t, m, bufsize;
   int c0, c1;
@@ -1449,12 +1532,14 @@ note:
 
     /* Sort the type B* substrings using sssort. */
     buf = SA + m, bufsize = n - (2 * m);
-    for(c0 = ALPHABET_SIZE - 2, j = m; 0 < j; --c0) {
-      for(c1 = ALPHABET_SIZE - 1; c0 < c1; j = i, --c1) {
-        i = BUCKET_BSTAR(c0, c1);
-        if(1 < (j - i)) {
-          sssort(T, PAb, SA + i, SA + j,
-                 buf, bufsize, 2, n, *(SA + i) == (m - 1));
+    if(!sssort_parallel(T, PAb, SA, bucket_B, buf, bufsize, n, m, num_tasks)) {
+      for(c0 = ALPHABET_SIZE - 2, j = m; 0 < j; --c0) {
+        for(c1 = ALPHABET_SIZE - 1; c0 < c1; j = i, --c1) {
+          i = BUCKET_BSTAR(c0, c1);
+          if(1 < (j - i)) {
+            sssort(T, PAb, SA + i, SA + j,
+                   buf, bufsize, 2, n, *(SA + i) == (m - 1));
+          }
         }
       }
     }
@@ -1574,9 +1659,9 @@ construct_SA(const unsigned char *T, int *SA,
 /*- Function -*/
 
 /* XXX Modified from original: use provided temporary space instead of
- * allocating it.  */
+ * allocating it, and sort with up to @num_tasks tasks.  */
 void
-divsufsort(const u8 *T, u32 *SA, u32 n, u32 *tmp)
+divsufsort(const u8 *T, u32 *SA, u32 n, u32 *tmp, unsigned num_tasks)
 {
   u32 *bucket_A = tmp;
   u32 *bucket_B = tmp + BUCKET_A_SIZE;
@@ -1597,7 +1682,7 @@ divsufsort(const u8 *T, u32 *SA, u32 n, u32 *tmp)
       break;
 
     default:
-      m = sort_typeBstar(T, SA, bucket_A, bucket_B, n);
+      m = sort_typeBstar(T, SA, bucket_A, bucket_B, n, num_tasks);
       construct_SA(T, SA, bucket_A, bucket_B, n, m);
       break;
   }
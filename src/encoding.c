@@ -24,6 +24,10 @@
 #include <errno.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 #include "wimlib/encoding.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
@@ -259,10 +263,120 @@ convert_string(const u8 * const in, const size_t in_nbytes,
 	return 0;
 }
 
+/*
+ * Fast paths for strings that are entirely ASCII, which nearly all filenames
+ * and XML documents are.  Such strings need no decoding, just widening or
+ * narrowing of each character; and checking for them is much cheaper than
+ * decoding each codepoint, since it can be done many characters at a time.
+ */
+
+static forceinline bool
+utf8_is_ascii(const u8 *in, size_t in_nbytes)
+{
+	size_t i = 0;
+	u8 bits = 0;
+
+#ifdef __SSE2__
+	__m128i v = _mm_setzero_si128();
+
+	for (; i + 16 <= in_nbytes; i += 16)
+		v = _mm_or_si128(v, _mm_loadu_si128((const __m128i *)&in[i]));
+	if (_mm_movemask_epi8(v))
+		return false;
+#endif
+	for (; i < in_nbytes; i++)
+		bits |= in[i];
+	return bits < 0x80;
+}
+
+static forceinline bool
+utf16le_is_ascii(const u8 *in, size_t in_nbytes)
+{
+	size_t i = 0;
+	u16 bits = 0;
+
+	if (in_nbytes % 2)
+		return false;
+#ifdef __SSE2__
+	__m128i v = _mm_setzero_si128();
+
+	for (; i + 16 <= in_nbytes; i += 16)
+		v = _mm_or_si128(v, _mm_loadu_si128((const __m128i *)&in[i]));
+	v = _mm_and_si128(v, _mm_set1_epi16((s16)0xFF80));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+		return false;
+#endif
+	for (; i < in_nbytes; i += 2)
+		bits |= get_unaligned_le16(&in[i]);
+	return bits < 0x80;
+}
+
+/* Convert an ASCII string from UTF-8 to UTF-16LE.  */
+static int
+ascii_utf8_to_utf16le(const u8 *in, size_t in_nbytes,
+		      u8 **out_ret, size_t *out_nbytes_ret)
+{
+	u8 *out = MALLOC(2 * in_nbytes + 2);
+	size_t i = 0;
+
+	if (unlikely(!out))
+		return WIMLIB_ERR_NOMEM;
+#ifdef __SSE2__
+	for (; i + 16 <= in_nbytes; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&in[i]);
+
+		_mm_storeu_si128((__m128i *)&out[2 * i],
+				 _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+		_mm_storeu_si128((__m128i *)&out[2 * i + 16],
+				 _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+	}
+#endif
+	for (; i < in_nbytes; i++)
+		put_unaligned_le16(in[i], &out[2 * i]);
+	put_unaligned_le16(0, &out[2 * in_nbytes]);
+
+	*out_ret = out;
+	if (out_nbytes_ret)
+		*out_nbytes_ret = 2 * in_nbytes;
+	return 0;
+}
+
+/* Convert an ASCII string from UTF-16LE to UTF-8.  */
+static int
+ascii_utf16le_to_utf8(const u8 *in, size_t in_nbytes,
+		      u8 **out_ret, size_t *out_nbytes_ret)
+{
+	size_t out_nbytes = in_nbytes / 2;
+	u8 *out = MALLOC(out_nbytes + 1);
+	size_t i = 0;
+
+	if (unlikely(!out))
+		return WIMLIB_ERR_NOMEM;
+#ifdef __SSE2__
+	for (; i + 16 <= out_nbytes; i += 16) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)&in[2 * i]);
+		__m128i hi = _mm_loadu_si128((const __m128i *)&in[2 * i + 16]);
+
+		_mm_storeu_si128((__m128i *)&out[i], _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; i < out_nbytes; i++)
+		out[i] = in[2 * i];
+	out[out_nbytes] = '\0';
+
+	*out_ret = out;
+	if (out_nbytes_ret)
+		*out_nbytes_ret = out_nbytes;
+	return 0;
+}
+
 int
 utf8_to_utf16le(const char *in, size_t in_nbytes,
 		utf16lechar **out_ret, size_t *out_nbytes_ret)
 {
+	if (utf8_is_ascii((const u8 *)in, in_nbytes))
+		return ascii_utf8_to_utf16le((const u8 *)in, in_nbytes,
+					     (u8 **)out_ret, out_nbytes_ret);
 	return convert_string((const u8 *)in, in_nbytes,
 			      (u8 **)out_ret, out_nbytes_ret,
 			      WIMLIB_ERR_INVALID_UTF8_STRING,
@@ -273,6 +387,9 @@ int
 utf16le_to_utf8(const utf16lechar *in, size_t in_nbytes,
 		char **out_ret, size_t *out_nbytes_ret)
 {
+	if (utf16le_is_ascii((const u8 *)in, in_nbytes))
+		return ascii_utf16le_to_utf8((const u8 *)in, in_nbytes,
+					     (u8 **)out_ret, out_nbytes_ret);
 	return convert_string((const u8 *)in, in_nbytes,
 			      (u8 **)out_ret, out_nbytes_ret,
 			      WIMLIB_ERR_INVALID_UTF16_STRING,
@@ -363,6 +480,60 @@ init_upcase(void)
 		upcase[i] += i;
 }
 
+/*
+ * Return the length, in characters, of a prefix of the UTF-16LE strings @s1 and
+ * @s2, each at least @n characters long, over which they are known to compare
+ * equal, case-insensitively if @ignore_case.  This isn't necessarily the
+ * longest such prefix; the caller must compare the rest one character at a
+ * time.
+ *
+ * Filenames in the same directory often share a long prefix, so this quickly
+ * skips over it 8 characters at a time.  For case-insensitive comparisons, this
+ * relies on upcase[] only changing 'a' through 'z' among ASCII characters; so
+ * it stops at the first group of characters which isn't all ASCII.
+ */
+static forceinline size_t
+utf16le_equal_prefix_len(const utf16lechar *s1, const utf16lechar *s2,
+			 size_t n, bool ignore_case)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i nonascii_mask = _mm_set1_epi16((s16)0xFF80);
+	const __m128i before_a = _mm_set1_epi16('a' - 1);
+	const __m128i after_z = _mm_set1_epi16('z' + 1);
+	const __m128i case_bit = _mm_set1_epi16(0x20);
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)&s1[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&s2[i]);
+
+		if (ignore_case) {
+			__m128i nonascii = _mm_and_si128(_mm_or_si128(a, b),
+							 nonascii_mask);
+			__m128i lower_a, lower_b;
+
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(nonascii,
+							      zero)) != 0xFFFF)
+				break;
+			lower_a = _mm_and_si128(_mm_cmpgt_epi16(a, before_a),
+						_mm_cmplt_epi16(a, after_z));
+			lower_b = _mm_and_si128(_mm_cmpgt_epi16(b, before_a),
+						_mm_cmplt_epi16(b, after_z));
+			a = _mm_sub_epi16(a, _mm_and_si128(lower_a, case_bit));
+			b = _mm_sub_epi16(b, _mm_and_si128(lower_b, case_bit));
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(a, b)) != 0xFFFF)
+			break;
+	}
+#else
+	for (; i + 4 <= n; i += 4)
+		if (load_u64_unaligned(&s1[i]) != load_u64_unaligned(&s2[i]))
+			break;
+#endif
+	return i;
+}
+
 /*
  * Compare UTF-16LE strings case-sensitively (%ignore_case == false) or
  * case-insensitively (%ignore_case == true).
@@ -378,16 +549,17 @@ cmp_utf16le_strings(const utf16lechar *s1, size_t n1,
 		    bool ignore_case)
 {
 	size_t n = min(n1, n2);
+	size_t i = utf16le_equal_prefix_len(s1, s2, n, ignore_case);
 
 	if (ignore_case) {
-		for (size_t i = 0; i < n; i++) {
+		for (; i < n; i++) {
 			u16 c1 = upcase[le16_to_cpu(s1[i])];
 			u16 c2 = upcase[le16_to_cpu(s2[i])];
 			if (c1 != c2)
 				return (c1 < c2) ? -1 : 1;
 		}
 	} else {
-		for (size_t i = 0; i < n; i++) {
+		for (; i < n; i++) {
 			u16 c1 = le16_to_cpu(s1[i]);
 			u16 c2 = le16_to_cpu(s2[i]);
 			if (c1 != c2)
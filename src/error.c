@@ -331,6 +331,12 @@ static const tchar * const error_strings[] = {
 		= T("An extended attribute entry in the WIM image is invalid"),
 	[WIMLIB_ERR_SET_XATTR]
 		= T("Failed to set an extended attribute on an extracted file"),
+	[WIMLIB_ERR_INVALID_TAR_ARCHIVE]
+		= T("The tar archive being captured is invalid or uses an "
+		    "unsupported format"),
+	[WIMLIB_ERR_NETWORK]
+		= T("A network connection failed, or the other end of it "
+		    "didn't follow the protocol"),
 #ifdef ENABLE_TEST_SUPPORT
 	[WIMLIB_ERR_IMAGES_ARE_DIFFERENT]
 		= T("A difference was detected between the two images being compared"),
@@ -28,6 +28,7 @@
 #include "wimlib/error.h"
 #include "wimlib/inode.h"
 #include "wimlib/metadata.h"
+#include "wimlib/resource.h"
 #include "wimlib/xml.h"
 
 static int
@@ -51,13 +52,57 @@ blob_rollback_export(struct blob_descriptor *blob, void *_blob_table)
 	return 0;
 }
 
+/* Export the blob @src_blob, which has the SHA-1 message digest @hash and may
+ * be NULL if it isn't present in the source WIM, into the destination WIM if
+ * it isn't already there, and add @nlink references to it.  Return NULL if out
+ * of memory or if the blob is missing.  */
+static struct blob_descriptor *
+export_blob(const u8 *hash, struct blob_descriptor *src_blob,
+	    struct blob_table *src_blob_table,
+	    struct blob_table *dest_blob_table, bool gift, u32 nlink)
+{
+	struct blob_descriptor *dest_blob;
+
+	/* Search for the blob (via SHA-1 message digest) in the destination
+	 * WIM.  */
+	dest_blob = lookup_blob(dest_blob_table, hash);
+	if (!dest_blob) {
+		/* Blob not yet present in destination WIM.  Export the blob
+		 * from the source WIM into the destination WIM.  */
+		if (!src_blob)
+			return NULL;
+
+		if (gift) {
+			dest_blob = src_blob;
+			blob_table_unlink(src_blob_table, src_blob);
+		} else {
+			dest_blob = clone_blob_descriptor(src_blob);
+			if (!dest_blob)
+				return NULL;
+		}
+		dest_blob->refcnt = 0;
+		dest_blob->out_refcnt = 0;
+		dest_blob->was_exported = 1;
+		blob_table_insert(dest_blob_table, dest_blob);
+	}
+
+	/* Blob is present in destination WIM (either pre-existing, already
+	 * exported, or just exported above).  Increment its reference count
+	 * appropriately.   Note: we use 'refcnt' for the raw reference count,
+	 * but 'out_refcnt' for references arising just from the export
+	 * operation; this is used to roll back a failed export if needed.  */
+	dest_blob->refcnt += nlink;
+	dest_blob->out_refcnt += nlink;
+	return dest_blob;
+}
+
 static int
 inode_export_blobs(struct wim_inode *inode, struct blob_table *src_blob_table,
 		   struct blob_table *dest_blob_table, bool gift)
 {
 	unsigned i;
 	const u8 *hash;
-	struct blob_descriptor *src_blob, *dest_blob;
+	struct blob_descriptor *src_blob;
 
 	for (i = 0; i < inode->i_num_streams; i++) {
 
@@ -66,40 +111,95 @@ inode_export_blobs(struct wim_inode *inode, struct blob_table *src_blob_table,
 		if (is_zero_hash(hash))  /* Empty stream?  */
 			continue;
 
-		/* Search for the blob (via SHA-1 message digest) in the
-		 * destination WIM.  */
-		dest_blob = lookup_blob(dest_blob_table, hash);
-		if (!dest_blob) {
-			/* Blob not yet present in destination WIM.  Search for
-			 * it in the source WIM, then export it into the
-			 * destination WIM.  */
+		src_blob = NULL;
+		if (!lookup_blob(dest_blob_table, hash)) {
 			src_blob = stream_blob(&inode->i_streams[i],
 					       src_blob_table);
 			if (!src_blob)
 				return blob_not_found_error(inode, hash);
+		}
+		if (!export_blob(hash, src_blob, src_blob_table,
+				 dest_blob_table, gift, inode->i_nlink))
+			return WIMLIB_ERR_NOMEM;
+	}
+	return 0;
+}
+
+struct export_hash_ctx {
+	struct blob_table *src_blob_table;
+	struct blob_table *dest_blob_table;
+	bool gift;
+};
 
-			if (gift) {
-				dest_blob = src_blob;
-				blob_table_unlink(src_blob_table, src_blob);
-			} else {
-				dest_blob = clone_blob_descriptor(src_blob);
-				if (!dest_blob)
-					return WIMLIB_ERR_NOMEM;
+static int
+export_blob_by_hash(const u8 *hash, void *_ctx)
+{
+	const struct export_hash_ctx *ctx = _ctx;
+	struct blob_descriptor *src_blob = NULL;
+
+	if (!lookup_blob(ctx->dest_blob_table, hash)) {
+		src_blob = lookup_blob(ctx->src_blob_table, hash);
+		if (!src_blob) {
+			if (wimlib_print_errors) {
+				tchar hashstr[SHA1_HASH_STRING_LEN];
+
+				sprint_hash(hash, hashstr);
+				ERROR("Blob not found\n"
+				      "        SHA-1 message digest of missing "
+				      "blob:\n"
+				      "        %"TS"", hashstr);
 			}
-			dest_blob->refcnt = 0;
-			dest_blob->out_refcnt = 0;
-			dest_blob->was_exported = 1;
-			blob_table_insert(dest_blob_table, dest_blob);
+			return WIMLIB_ERR_RESOURCE_NOT_FOUND;
 		}
+	}
+	if (!export_blob(hash, src_blob, ctx->src_blob_table,
+			 ctx->dest_blob_table, ctx->gift, 1))
+		return WIMLIB_ERR_NOMEM;
+	return 0;
+}
 
-		/* Blob is present in destination WIM (either pre-existing,
-		 * already exported, or just exported above).  Increment its
-		 * reference count appropriately.   Note: we use 'refcnt' for
-		 * the raw reference count, but 'out_refcnt' for references
-		 * arising just from the export operation; this is used to roll
-		 * back a failed export if needed.  */
-		dest_blob->refcnt += inode->i_nlink;
-		dest_blob->out_refcnt += inode->i_nlink;
+/*
+ * Export the blobs referenced by the specified image into the destination WIM.
+ *
+ * If the image isn't loaded and is unchanged from its metadata resource, then
+ * the hashes of the streams are just scanned from the serialized dentries of
+ * the metadata resource, rather than loading the image.  The metadata resource
+ * itself doesn't need to be parsed when the destination WIM is written, since
+ * it can be copied as-is; so an export of unloaded images never has to build
+ * their dentry trees.
+ */
+static int
+export_image_blobs(WIMStruct *src_wim, int src_image,
+		   struct blob_table *dest_blob_table, bool gift)
+{
+	struct wim_image_metadata *src_imd =
+				src_wim->image_metadata[src_image - 1];
+	struct wim_inode *inode;
+	int ret;
+
+	if (!is_image_loaded(src_imd) && !is_image_dirty(src_imd)) {
+		struct export_hash_ctx ctx = {
+			.src_blob_table = src_wim->blob_table,
+			.dest_blob_table = dest_blob_table,
+			.gift = gift,
+		};
+
+		return scan_metadata_resource_hashes(src_imd->metadata_blob,
+						     export_blob_by_hash, &ctx);
+	}
+
+	/* Load metadata for source image into memory.  */
+	ret = select_wim_image(src_wim, src_image);
+	if (ret)
+		return ret;
+
+	/* Iterate through inodes in the source image and export their blobs
+	 * into the destination WIM.  */
+	image_for_each_inode(inode, src_imd) {
+		ret = inode_export_blobs(inode, src_wim->blob_table,
+					 dest_blob_table, gift);
+		if (ret)
+			return ret;
 	}
 	return 0;
 }
@@ -206,7 +306,6 @@ wimlib_export_image(WIMStruct *src_wim,
 	{
 		const tchar *next_dest_name, *next_dest_description;
 		struct wim_image_metadata *src_imd;
-		struct wim_inode *inode;
 
 		/* Determine destination image name and description.  */
 
@@ -224,23 +323,13 @@ wimlib_export_image(WIMStruct *src_wim,
 		else
 			next_dest_description = wimlib_get_image_description(src_wim, src_image);
 
-		/* Load metadata for source image into memory.  */
-		ret = select_wim_image(src_wim, src_image);
+		ret = export_image_blobs(src_wim, src_image,
+					 dest_wim->blob_table,
+					 export_flags & WIMLIB_EXPORT_FLAG_GIFT);
 		if (ret)
 			goto out_rollback;
 
-		src_imd = wim_get_current_image_metadata(src_wim);
-
-		/* Iterate through inodes in the source image and export their
-		 * blobs into the destination WIM.  */
-		image_for_each_inode(inode, src_imd) {
-			ret = inode_export_blobs(inode,
-						 src_wim->blob_table,
-						 dest_wim->blob_table,
-						 export_flags & WIMLIB_EXPORT_FLAG_GIFT);
-			if (ret)
-				goto out_rollback;
-		}
+		src_imd = src_wim->image_metadata[src_image - 1];
 
 		/* Export XML information into the destination WIM.  */
 		ret = xml_export_image(src_wim->xml_info, src_image,
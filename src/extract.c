@@ -47,11 +47,13 @@
 
 #include "wimlib/apply.h"
 #include "wimlib/assert.h"
+#include "wimlib/blob_cache.h"
 #include "wimlib/blob_table.h"
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
+#include "wimlib/file_io.h"
 #include "wimlib/metadata.h"
 #include "wimlib/object_id.h"
 #include "wimlib/pathlist.h"
@@ -60,6 +62,7 @@
 #include "wimlib/reparse.h"
 #include "wimlib/resource.h"
 #include "wimlib/security.h"
+#include "wimlib/trace.h"
 #include "wimlib/unix_data.h"
 #include "wimlib/wim.h"
 #include "wimlib/win32.h" /* for realpath() equivalent */
@@ -89,10 +92,14 @@
 	 WIMLIB_EXTRACT_FLAG_NO_ATTRIBUTES		|	\
 	 WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE  |	\
 	 WIMLIB_EXTRACT_FLAG_WIMBOOT			|	\
+	 WIMLIB_EXTRACT_FLAG_TAR			|	\
 	 WIMLIB_EXTRACT_FLAG_COMPACT_XPRESS4K		|	\
 	 WIMLIB_EXTRACT_FLAG_COMPACT_XPRESS8K		|	\
 	 WIMLIB_EXTRACT_FLAG_COMPACT_XPRESS16K		|	\
-	 WIMLIB_EXTRACT_FLAG_COMPACT_LZX			\
+	 WIMLIB_EXTRACT_FLAG_COMPACT_LZX		|	\
+	 WIMLIB_EXTRACT_FLAG_NO_PREALLOCATE		|	\
+	 WIMLIB_EXTRACT_FLAG_CLONE_DUPLICATES		|	\
+	 WIMLIB_EXTRACT_FLAG_TARGET_ORDER			\
 	 )
 
 /* Send WIMLIB_PROGRESS_MSG_EXTRACT_FILE_STRUCTURE or
@@ -143,27 +150,6 @@ end_file_metadata_phase(struct apply_ctx *ctx)
 	return end_file_phase(ctx, WIMLIB_PROGRESS_MSG_EXTRACT_METADATA);
 }
 
-/* Are all bytes in the specified buffer zero? */
-static bool
-is_all_zeroes(const u8 *p, const size_t size)
-{
-	const u8 * const end = p + size;
-
-	for (; (uintptr_t)p % WORDBYTES && p != end; p++)
-		if (*p)
-			return false;
-
-	for (; end - p >= WORDBYTES; p += WORDBYTES)
-		if (*(const machine_word_t *)p)
-			return false;
-
-	for (; p != end; p++)
-		if (*p)
-			return false;
-
-	return true;
-}
-
 /*
  * Sparse regions should be detected at the granularity of the filesystem block
  * size.  For now just assume 4096 bytes, which is the default block size on
@@ -378,67 +364,32 @@ out:
 	return ret;
 }
 
-/* Creates a temporary file opened for writing.  The open file descriptor is
- * returned in @fd_ret and its name is returned in @name_ret (dynamically
- * allocated).  */
-static int
-create_temporary_file(struct filedes *fd_ret, tchar **name_ret)
-{
-	tchar *name;
-	int raw_fd;
-
-#ifdef _WIN32
-retry:
-	name = _wtempnam(NULL, L"wimlib");
-	if (!name) {
-		ERROR_WITH_ERRNO("Failed to create temporary filename");
-		return WIMLIB_ERR_NOMEM;
-	}
-	raw_fd = _wopen(name, O_WRONLY | O_CREAT | O_EXCL | O_BINARY |
-			_O_SHORT_LIVED, 0600);
-	if (raw_fd < 0 && errno == EEXIST) {
-		FREE(name);
-		goto retry;
-	}
-#else /* _WIN32 */
-	const char *tmpdir = getenv("TMPDIR");
-	if (!tmpdir)
-		tmpdir = P_tmpdir;
-	name = MALLOC(strlen(tmpdir) + 1 + 6 + 6 + 1);
-	if (!name)
-		return WIMLIB_ERR_NOMEM;
-	sprintf(name, "%s/wimlibXXXXXX", tmpdir);
-	raw_fd = mkstemp(name);
-#endif /* !_WIN32 */
-
-	if (raw_fd < 0) {
-		ERROR_WITH_ERRNO("Failed to create temporary file "
-				 "\"%"TS"\"", name);
-		FREE(name);
-		return WIMLIB_ERR_OPEN;
-	}
-
-	filedes_init(fd_ret, raw_fd);
-	*name_ret = name;
-	return 0;
-}
-
 static int
 begin_extract_blob(struct blob_descriptor *blob, void *_ctx)
 {
 	struct apply_ctx *ctx = _ctx;
+	int ret;
 
-	if (unlikely(blob->out_refcnt > MAX_OPEN_FILES))
-		return create_temporary_file(&ctx->tmpfile_fd, &ctx->tmpfile_name);
+	if (ctx->wim->blob_cache)
+		blob_cache_begin_add(ctx->wim->blob_cache, blob,
+				     &ctx->cache_writer);
 
-	return call_begin_blob(blob, ctx->saved_cbs);
+	if (unlikely(blob->out_refcnt > ctx->max_open_files))
+		ret = create_temporary_file(&ctx->tmpfile_fd, &ctx->tmpfile_name);
+	else
+		ret = call_begin_blob(blob, ctx->saved_cbs);
+	if (ret)
+		blob_cache_end_add(ctx->wim->blob_cache, blob,
+				   &ctx->cache_writer, false);
+	return ret;
 }
 
+/* Account for @size bytes, starting at @offset, of @blob having been read for
+ * extraction, and report progress if it's due.  */
 static int
-extract_chunk(const struct blob_descriptor *blob, u64 offset,
-	      const void *chunk, size_t size, void *_ctx)
+extract_chunk_progress(const struct blob_descriptor *blob, u64 offset,
+		       u64 size, struct apply_ctx *ctx)
 {
-	struct apply_ctx *ctx = _ctx;
 	union wimlib_progress_info *progress = &ctx->progress;
 	bool last = (offset + size == blob->size);
 	int ret;
@@ -462,8 +413,11 @@ extract_chunk(const struct blob_descriptor *blob, u64 offset,
 			}
 		}
 	}
-	if (progress->extract.completed_bytes >= ctx->next_progress) {
-
+	if (progress->extract.completed_bytes >= ctx->next_progress &&
+	    progress_throttle_due(&ctx->progress_throttle,
+				  progress->extract.completed_bytes >=
+				  progress->extract.total_bytes))
+	{
 		ret = extract_progress(ctx, WIMLIB_PROGRESS_MSG_EXTRACT_STREAMS);
 		if (ret)
 			return ret;
@@ -472,25 +426,96 @@ extract_chunk(const struct blob_descriptor *blob, u64 offset,
 				  progress->extract.total_bytes,
 				  &ctx->next_progress);
 	}
+	return 0;
+}
+
+/* Write a chunk of the current blob to the temporary file, when the blob has
+ * more extraction targets than can be open at once.  */
+static int
+extract_chunk_to_tmpfile(const void *chunk, size_t size, struct apply_ctx *ctx)
+{
+	int ret = full_write(&ctx->tmpfile_fd, chunk, size);
+
+	if (ret) {
+		ERROR_WITH_ERRNO("Error writing data to "
+				 "temporary file \"%"TS"\"",
+				 ctx->tmpfile_name);
+	}
+	return ret;
+}
+
+static int
+extract_chunk(const struct blob_descriptor *blob, u64 offset,
+	      const void *chunk, size_t size, void *_ctx)
+{
+	struct apply_ctx *ctx = _ctx;
+	int ret;
+
+	ret = extract_chunk_progress(blob, offset, size, ctx);
+	if (ret)
+		return ret;
+
+	blob_cache_write(&ctx->cache_writer, chunk, size);
 
 	if (unlikely(filedes_valid(&ctx->tmpfile_fd))) {
 		/* Just extracting to temporary file for now.  */
-		ret = full_write(&ctx->tmpfile_fd, chunk, size);
-		if (ret) {
-			ERROR_WITH_ERRNO("Error writing data to "
-					 "temporary file \"%"TS"\"",
-					 ctx->tmpfile_name);
-		}
-		return ret;
+		return extract_chunk_to_tmpfile(chunk, size, ctx);
 	}
 
 	return call_continue_blob(blob, offset, chunk, size, ctx->saved_cbs);
 }
 
+static int
+extract_chunks(const struct blob_descriptor *blob, u64 offset,
+	       const struct chunk_span *spans, size_t num_spans, void *_ctx)
+{
+	struct apply_ctx *ctx = _ctx;
+	u64 size = 0;
+	int ret;
+
+	for (size_t i = 0; i < num_spans; i++)
+		size += spans[i].size;
+
+	ret = extract_chunk_progress(blob, offset, size, ctx);
+	if (ret)
+		return ret;
+
+	for (size_t i = 0; i < num_spans; i++)
+		blob_cache_write(&ctx->cache_writer, spans[i].data,
+				 spans[i].size);
+
+	if (unlikely(filedes_valid(&ctx->tmpfile_fd))) {
+		for (size_t i = 0; i < num_spans; i++) {
+			ret = extract_chunk_to_tmpfile(spans[i].data,
+						       spans[i].size, ctx);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	return call_continue_blob_vec(blob, offset, spans, num_spans,
+				      ctx->saved_cbs);
+}
+
+static int
+extract_get_chunk_dest(const struct blob_descriptor *blob, u64 offset,
+		       void **buf_ret, size_t *size_ret, void *_ctx)
+{
+	struct apply_ctx *ctx = _ctx;
+
+	if (unlikely(filedes_valid(&ctx->tmpfile_fd))) {
+		*buf_ret = NULL;
+		return 0;
+	}
+	return call_get_chunk_dest(blob, offset, buf_ret, size_ret,
+				   ctx->saved_cbs);
+}
+
 /* Copy the blob's data from the temporary file to each of its targets.
  *
  * This is executed only in the very uncommon case that a blob is being
- * extracted to more than MAX_OPEN_FILES targets!  */
+ * extracted to more than ctx->max_open_files targets!  */
 static int
 extract_from_tmpfile(const tchar *tmpfile_name,
 		     const struct blob_descriptor *orig_blob,
@@ -503,6 +528,7 @@ extract_from_tmpfile(const tchar *tmpfile_name,
 	memcpy(&tmpfile_blob, orig_blob, sizeof(struct blob_descriptor));
 	tmpfile_blob.blob_location = BLOB_IN_FILE_ON_DISK;
 	tmpfile_blob.file_on_disk = (tchar *)tmpfile_name;
+	tmpfile_blob.file_offset = 0;
 	tmpfile_blob.out_refcnt = 1;
 
 	for (u32 i = 0; i < orig_blob->out_refcnt; i++) {
@@ -528,6 +554,10 @@ end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 {
 	struct apply_ctx *ctx = _ctx;
 
+	/* Only add the blob to the cache if its data was verified.  */
+	blob_cache_end_add(ctx->wim->blob_cache, blob, &ctx->cache_writer,
+			   !status && !blob->corrupted);
+
 	if ((ctx->extract_flags & WIMLIB_EXTRACT_FLAG_RECOVER_DATA) &&
 	    !status && blob->corrupted) {
 		const struct blob_extraction_target *targets =
@@ -554,6 +584,177 @@ end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 	return call_end_blob(blob, status, ctx->saved_cbs);
 }
 
+/* The maximum amount of data, in bytes, among which the reads of blobs may be
+ * reordered by WIMLIB_EXTRACT_FLAG_TARGET_ORDER  */
+#define TARGET_ORDER_WINDOW_SIZE	(64 << 20)
+
+struct target_ordered_blob {
+	struct blob_descriptor *blob;
+	size_t target_pos;
+};
+
+static int
+cmp_blobs_by_source_order(const void *p1, const void *p2)
+{
+	const struct target_ordered_blob *b1 = p1, *b2 = p2;
+
+	return cmp_blobs_by_sequential_order(&b1->blob, &b2->blob);
+}
+
+static int
+cmp_blobs_by_target_order(const void *p1, const void *p2)
+{
+	const struct target_ordered_blob *b1 = p1, *b2 = p2;
+
+	return cmp_u64(b1->target_pos, b2->target_pos);
+}
+
+/* Reading the blobs in a solid resource out of order would mean decompressing
+ * some of its chunks many times.  */
+static bool
+blob_is_movable(const struct blob_descriptor *blob)
+{
+	return !(blob->blob_location == BLOB_IN_WIM &&
+		 (blob->rdesc->flags & WIM_RESHDR_FLAG_SOLID));
+}
+
+/*
+ * Sort the blobs to extract for WIMLIB_EXTRACT_FLAG_TARGET_ORDER.  The list
+ * starts out in the order in which the blobs are first needed by the dentries
+ * being extracted, which is the order of the target directory tree.  The blobs
+ * are sorted by their location in the WIM file as usual, then each run of up to
+ * TARGET_ORDER_WINDOW_SIZE bytes of blobs that aren't in solid resources is
+ * sorted back into target order.  So the reads only jump around within a
+ * bounded region of the WIM file, while most of the files are written in the
+ * order of their directories.
+ */
+static int
+sort_blob_list_by_target_order(struct list_head *blob_list)
+{
+	struct target_ordered_blob *blobs;
+	struct blob_descriptor *blob;
+	size_t num_blobs = 0;
+	size_t i;
+
+	list_for_each_entry(blob, blob_list, extraction_list)
+		num_blobs++;
+	if (num_blobs <= 1)
+		return 0;
+
+	blobs = MALLOC(num_blobs * sizeof(blobs[0]));
+	if (!blobs)
+		return WIMLIB_ERR_NOMEM;
+	i = 0;
+	list_for_each_entry(blob, blob_list, extraction_list) {
+		blobs[i].blob = blob;
+		blobs[i].target_pos = i;
+		i++;
+	}
+
+	qsort(blobs, num_blobs, sizeof(blobs[0]), cmp_blobs_by_source_order);
+
+	for (i = 0; i < num_blobs; ) {
+		size_t start = i;
+		u64 window_size = 0;
+
+		while (i < num_blobs && blob_is_movable(blobs[i].blob) &&
+		       (i == start || window_size + blobs[i].blob->size <=
+				      TARGET_ORDER_WINDOW_SIZE))
+			window_size += blobs[i++].blob->size;
+		if (i == start)
+			i++;
+		else
+			qsort(&blobs[start], i - start, sizeof(blobs[0]),
+			      cmp_blobs_by_target_order);
+	}
+
+	INIT_LIST_HEAD(blob_list);
+	for (i = 0; i < num_blobs; i++)
+		list_add_tail(&blobs[i].blob->extraction_list, blob_list);
+	FREE(blobs);
+	return 0;
+}
+
+static int
+hash_cached_blob_chunk(const struct blob_descriptor *blob, u64 offset,
+		       const void *chunk, size_t size, void *sha_ctx)
+{
+	sha1_update(sha_ctx, chunk, size);
+	return 0;
+}
+
+/* Check that the file in the blob cache for @blob, which @cached_blob
+ * describes, can be read and has the right SHA-1 message digest.  */
+static bool
+cached_blob_is_intact(struct blob_descriptor *cached_blob,
+		      const struct blob_descriptor *blob)
+{
+	struct sha1_ctx sha_ctx;
+	struct read_blob_callbacks cbs = {
+		.continue_blob	= hash_cached_blob_chunk,
+		.ctx		= &sha_ctx,
+	};
+	u8 hash[SHA1_HASH_SIZE];
+
+	sha1_init(&sha_ctx);
+	if (read_blob_with_cbs(cached_blob, &cbs, false))
+		return false;
+	sha1_final(&sha_ctx, hash);
+	return hashes_equal(hash, blob->hash);
+}
+
+/*
+ * Extract the blobs whose data is in the blob cache from there, moving them
+ * from ctx->blob_list to @done_list so that they aren't read from the WIM file.
+ * Each file in the cache is checked before any of its data is extracted.  If
+ * it's gone, unreadable, or corrupted, then it's deleted from the cache and the
+ * blob is left to be read from the WIM file instead.
+ */
+static int
+extract_blobs_from_cache(struct apply_ctx *ctx,
+			 const struct read_blob_callbacks *cbs,
+			 struct list_head *done_list)
+{
+	struct blob_cache *cache = ctx->wim->blob_cache;
+	struct blob_descriptor *blob, *tmp;
+	int ret;
+
+	list_for_each_entry_safe(blob, tmp, &ctx->blob_list, extraction_list) {
+		struct blob_descriptor cached_blob;
+		const tchar *path = blob_cache_lookup(cache, blob);
+
+		if (!path)
+			continue;
+		memcpy(&cached_blob, blob, sizeof(struct blob_descriptor));
+		cached_blob.blob_location = BLOB_IN_FILE_ON_DISK;
+		cached_blob.file_on_disk = (tchar *)path;
+		cached_blob.file_offset = 0;
+		cached_blob.corrupted = 0;
+		if (!cached_blob_is_intact(&cached_blob, blob)) {
+			/* A file which was evicted from the cache after it was
+			 * looked up is just a cache miss.  */
+			if (taccess(path, F_OK) == 0 || errno != ENOENT)
+				WARNING("Deleting corrupted blob cache file "
+					"\"%"TS"\"; reading the data from the "
+					"WIM file instead", path);
+			blob_cache_remove(cache, blob);
+			continue;
+		}
+		ret = read_blob_with_sha1(&cached_blob, cbs, false);
+		if (ret) {
+			if (cached_blob.corrupted) {
+				blob_cache_remove(cache, blob);
+				ERROR("Deleted the corrupted blob cache file; "
+				      "extracting again will read the data "
+				      "from the WIM file");
+			}
+			return ret;
+		}
+		list_move_tail(&blob->extraction_list, done_list);
+	}
+	return 0;
+}
+
 /*
  * Read the list of blobs to extract and feed their data into the specified
  * callback functions.
@@ -565,7 +766,7 @@ end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
  * This also works if the WIM is being read from a pipe.
  *
  * This also will split up blobs that will need to be extracted to more than
- * MAX_OPEN_FILES locations, as measured by the 'out_refcnt' of each blob.
+ * ctx->max_open_files locations, as measured by the 'out_refcnt' of each blob.
  * Therefore, the apply_operations implementation need not worry about running
  * out of file descriptors, unless it might open more than one file descriptor
  * per 'blob_extraction_target' (e.g. Win32 currently might because the
@@ -577,23 +778,50 @@ extract_blob_list(struct apply_ctx *ctx, const struct read_blob_callbacks *cbs)
 	struct read_blob_callbacks wrapper_cbs = {
 		.begin_blob	= begin_extract_blob,
 		.continue_blob	= extract_chunk,
+		.continue_blob_vec = extract_chunks,
 		.end_blob	= end_extract_blob,
+		.get_chunk_dest	= extract_get_chunk_dest,
 		.ctx		= ctx,
 	};
+	u64 trace_start = trace_begin();
+	LIST_HEAD(cached_blobs);
+	int ret;
+
 	ctx->saved_cbs = cbs;
 	if (ctx->extract_flags & WIMLIB_EXTRACT_FLAG_FROM_PIPE) {
-		return read_blobs_from_pipe(ctx, &wrapper_cbs);
+		ret = read_blobs_from_pipe(ctx, &wrapper_cbs);
 	} else {
 		int flags = VERIFY_BLOB_HASHES;
 
+		if (ctx->wim->blob_cache) {
+			ret = extract_blobs_from_cache(ctx, &wrapper_cbs,
+						       &cached_blobs);
+			if (ret)
+				goto out;
+		}
+
 		if (ctx->extract_flags & WIMLIB_EXTRACT_FLAG_RECOVER_DATA)
 			flags |= RECOVER_DATA;
 
-		return read_blob_list(&ctx->blob_list,
-				      offsetof(struct blob_descriptor,
-					       extraction_list),
-				      &wrapper_cbs, flags);
+		if (ctx->extract_flags & WIMLIB_EXTRACT_FLAG_TARGET_ORDER) {
+			ret = sort_blob_list_by_target_order(&ctx->blob_list);
+			if (ret)
+				goto out;
+			flags |= BLOB_LIST_ALREADY_SORTED;
+		}
+
+		ret = read_blob_list(&ctx->blob_list,
+				     offsetof(struct blob_descriptor,
+					      extraction_list),
+				     &wrapper_cbs, flags, 0);
 	}
+out:
+	/* The blobs extracted from the cache still have to be freed.  */
+	list_splice_tail(&cached_blobs, &ctx->blob_list);
+	if (ctx->wim->blob_cache)
+		save_blob_cache_index(ctx->wim->blob_cache);
+	trace_end("extract_blob_list", trace_start);
+	return ret;
 }
 
 /* Extract a WIM dentry to standard output.
@@ -725,6 +953,7 @@ dentry_delete_from_list(struct wim_dentry *dentry, void *_ignore)
 	if (will_extract_dentry(dentry)) {
 		list_del(&dentry->d_extraction_list_node);
 		dentry_reset_extraction_list_node(dentry);
+		dentry->d_inode->i_visited = 0;
 	}
 	return 0;
 }
@@ -956,6 +1185,10 @@ skip_dentry:
  *
  * ctx->supported_features must be filled in.
  *
+ * This also clears the 'i_visited' marks left by dentry_list_get_features(),
+ * both on the dentries which remain in the list and on those which are deleted
+ * from it.
+ *
  * Possible error codes: WIMLIB_ERR_NOMEM, WIMLIB_ERR_INVALID_UTF16_STRING
  */
 static int
@@ -978,6 +1211,7 @@ dentry_list_calculate_extraction_names(struct list_head *dentry_list,
 			break;
 
 		dentry = list_entry(cur, struct wim_dentry, d_extraction_list_node);
+		dentry->d_inode->i_visited = 0;
 
 		ret = dentry_calculate_extraction_name(dentry, ctx);
 		if (ret)
@@ -1024,6 +1258,9 @@ dentry_resolve_streams(struct wim_dentry *dentry, int extract_flags,
  * For each dentry to be extracted, resolve all streams in the corresponding
  * inode and set 'out_refcnt' in all referenced blob_descriptors to 0.
  *
+ * This also links each dentry into the extraction alias list of its inode,
+ * whose head was cleared by dentry_list_get_features().
+ *
  * Possible error codes: WIMLIB_ERR_RESOURCE_NOT_FOUND, WIMLIB_ERR_NOMEM.
  */
 static int
@@ -1039,6 +1276,8 @@ dentry_list_resolve_streams(struct list_head *dentry_list,
 					     ctx->wim->blob_table);
 		if (ret)
 			return ret;
+		dentry->d_next_extraction_alias = dentry->d_inode->i_first_extraction_alias;
+		dentry->d_inode->i_first_extraction_alias = dentry;
 	}
 	return 0;
 }
@@ -1194,6 +1433,9 @@ dentry_ref_streams(struct wim_dentry *dentry, struct apply_ctx *ctx)
  * information.
  *
  * ctx->supported_features must be filled in.
+ *
+ * The inodes are left marked 'i_visited'; destroy_dentry_list() clears the
+ * marks.
  */
 static int
 dentry_list_ref_streams(struct list_head *dentry_list, struct apply_ctx *ctx)
@@ -1206,25 +1448,9 @@ dentry_list_ref_streams(struct list_head *dentry_list, struct apply_ctx *ctx)
 		if (ret)
 			return ret;
 	}
-	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
-		dentry->d_inode->i_visited = 0;
 	return 0;
 }
 
-static void
-dentry_list_build_inode_alias_lists(struct list_head *dentry_list)
-{
-	struct wim_dentry *dentry;
-
-	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
-		dentry->d_inode->i_first_extraction_alias = NULL;
-
-	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
-		dentry->d_next_extraction_alias = dentry->d_inode->i_first_extraction_alias;
-		dentry->d_inode->i_first_extraction_alias = dentry;
-	}
-}
-
 static void
 inode_tally_features(const struct wim_inode *inode,
 		     struct wim_features *features)
@@ -1285,18 +1511,21 @@ dentry_tally_features(struct wim_dentry *dentry, struct wim_features *features)
 	}
 }
 
-/* Tally the features necessary to extract the specified dentries.  */
+/*
+ * Tally the features necessary to extract the specified dentries, and clear the
+ * heads of the inodes' extraction alias lists.  The inodes are left marked
+ * 'i_visited' until dentry_list_calculate_extraction_names().
+ */
 static void
 dentry_list_get_features(struct list_head *dentry_list,
 			 struct wim_features *features)
 {
 	struct wim_dentry *dentry;
 
-	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
 		dentry_tally_features(dentry, features);
-
-	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
-		dentry->d_inode->i_visited = 0;
+		dentry->d_inode->i_first_extraction_alias = NULL;
+	}
 }
 
 static int
@@ -1470,13 +1699,95 @@ select_apply_operations(int extract_flags)
 #ifdef _WIN32
 	return &win32_apply_ops;
 #else
+	if (extract_flags & WIMLIB_EXTRACT_FLAG_TAR)
+		return &tar_apply_ops;
 	return &unix_apply_ops;
 #endif
 }
 
+static const tchar * const filename_forbidden_chars =
+#ifdef _WIN32
+T("<>:\"/\\|?*");
+#else
+T("/");
+#endif
+
+/* This function checks if it is okay to use a WIM image's name as a directory
+ * name.  */
+static bool
+image_name_ok_as_dir(const tchar *image_name)
+{
+	return image_name && *image_name &&
+		!tstrpbrk(image_name, filename_forbidden_chars) &&
+		tstrcmp(image_name, T(".")) &&
+		tstrcmp(image_name, T("..")) &&
+		tstrlen(image_name) <= 128;
+}
+
+/* Get the name of the subdirectory which @image is extracted to when all images
+ * are extracted, in a buffer with room for 129 characters.  */
+static void
+get_image_dir_name(const WIMStruct *wim, int image, tchar *buf)
+{
+	const tchar *image_name = wimlib_get_image_name(wim, image);
+
+	if (image_name_ok_as_dir(image_name)) {
+		tstrcpy(buf, image_name);
+	} else {
+		/* Image name is empty or contains forbidden characters.  Use
+		 * image number instead.  */
+		tsprintf(buf, T("%d"), image);
+	}
+}
+
+/* When extracting all images at once, send @msg, which must be
+ * WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_BEGIN or WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_END,
+ * for each image in turn.  */
+static int
+extract_images_progress(struct apply_ctx *ctx, enum wimlib_progress_msg msg)
+{
+	const WIMStruct *wim = ctx->wim;
+	tchar buf[ctx->target_nchars + 1 + 128 + 1];
+	int ret = 0;
+
+	if (!ctx->progfunc)
+		return 0;
+
+	tmemcpy(buf, ctx->target, ctx->target_nchars);
+	buf[ctx->target_nchars] = OS_PREFERRED_PATH_SEPARATOR;
+	for (int image = 1; image <= wim->hdr.image_count && !ret; image++) {
+		get_image_dir_name(wim, image, &buf[ctx->target_nchars + 1]);
+		ctx->progress.extract.image = image;
+		ctx->progress.extract.image_name =
+			wimlib_get_image_name(wim, image);
+		ctx->progress.extract.target = buf;
+		ret = extract_progress(ctx, msg);
+	}
+	ctx->progress.extract.image = WIMLIB_ALL_IMAGES;
+	ctx->progress.extract.image_name = NULL;
+	ctx->progress.extract.target = ctx->target;
+	return ret;
+}
+
+static int
+extract_trees_progress(struct apply_ctx *ctx, bool begin)
+{
+	if (ctx->all_images)
+		return extract_images_progress(ctx,
+				(begin ? WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_BEGIN :
+					 WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_END));
+	if (ctx->extract_flags & WIMLIB_EXTRACT_FLAG_IMAGEMODE)
+		return extract_progress(ctx,
+				(begin ? WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_BEGIN :
+					 WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_END));
+	return extract_progress(ctx,
+				(begin ? WIMLIB_PROGRESS_MSG_EXTRACT_TREE_BEGIN :
+					 WIMLIB_PROGRESS_MSG_EXTRACT_TREE_END));
+}
+
 static int
 extract_trees(WIMStruct *wim, struct wim_dentry **trees, size_t num_trees,
-	      const tchar *target, int extract_flags)
+	      const tchar *target, int extract_flags, bool all_images)
 {
 	const struct apply_operations *ops;
 	struct apply_ctx *ctx;
@@ -1513,9 +1824,13 @@ extract_trees(WIMStruct *wim, struct wim_dentry **trees, size_t num_trees,
 	ctx->target = target;
 	ctx->target_nchars = tstrlen(target);
 	ctx->extract_flags = extract_flags;
+	ctx->max_open_files = MAX_OPEN_FILES;
+	ctx->all_images = all_images;
 	if (ctx->wim->progfunc) {
 		ctx->progfunc = ctx->wim->progfunc;
 		ctx->progctx = ctx->wim->progctx;
+		progress_throttle_init(&ctx->progress_throttle,
+				       ctx->wim->progress_interval_ms);
 		ctx->progress.extract.image = wim->current_image;
 		ctx->progress.extract.extract_flags = (extract_flags &
 						       WIMLIB_EXTRACT_MASK_PUBLIC);
@@ -1523,9 +1838,14 @@ extract_trees(WIMStruct *wim, struct wim_dentry **trees, size_t num_trees,
 		ctx->progress.extract.image_name = wimlib_get_image_name(wim,
 									 wim->current_image);
 		ctx->progress.extract.target = target;
+		if (ctx->all_images) {
+			ctx->progress.extract.image = WIMLIB_ALL_IMAGES;
+			ctx->progress.extract.image_name = NULL;
+		}
 	}
 	INIT_LIST_HEAD(&ctx->blob_list);
 	filedes_invalidate(&ctx->tmpfile_fd);
+	filedes_invalidate(&ctx->cache_writer.fd);
 	ctx->apply_ops = ops;
 
 	ret = (*ops->get_supported_features)(target, &ctx->supported_features);
@@ -1534,7 +1854,8 @@ extract_trees(WIMStruct *wim, struct wim_dentry **trees, size_t num_trees,
 
 	build_dentry_list(&dentry_list, trees, num_trees,
 			  !(extract_flags &
-			    WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE));
+			    WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE) &&
+			  !all_images);
 
 	dentry_list_get_features(&dentry_list, &ctx->required_features);
 
@@ -1556,8 +1877,6 @@ extract_trees(WIMStruct *wim, struct wim_dentry **trees, size_t num_trees,
 	if (ret)
 		goto out_cleanup;
 
-	dentry_list_build_inode_alias_lists(&dentry_list);
-
 	ret = dentry_list_ref_streams(&dentry_list, ctx);
 	if (ret)
 		goto out_cleanup;
@@ -1583,10 +1902,7 @@ extract_trees(WIMStruct *wim, struct wim_dentry **trees, size_t num_trees,
 		}
 	}
 
-	ret = extract_progress(ctx,
-			       ((extract_flags & WIMLIB_EXTRACT_FLAG_IMAGEMODE) ?
-				       WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_BEGIN :
-				       WIMLIB_PROGRESS_MSG_EXTRACT_TREE_BEGIN));
+	ret = extract_trees_progress(ctx, true);
 	if (ret)
 		goto out_cleanup;
 
@@ -1604,10 +1920,7 @@ extract_trees(WIMStruct *wim, struct wim_dentry **trees, size_t num_trees,
 			goto out_cleanup;
 	}
 
-	ret = extract_progress(ctx,
-			       ((extract_flags & WIMLIB_EXTRACT_FLAG_IMAGEMODE) ?
-				       WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_END :
-				       WIMLIB_PROGRESS_MSG_EXTRACT_TREE_END));
+	ret = extract_trees_progress(ctx, false);
 out_cleanup:
 	destroy_blob_list(&ctx->blob_list);
 	destroy_dentry_list(&dentry_list);
@@ -1663,6 +1976,18 @@ check_extract_flags(const WIMStruct *wim, int *extract_flags_p)
 	}
 #endif
 
+	if (extract_flags & WIMLIB_EXTRACT_FLAG_TAR) {
+#ifdef _WIN32
+		ERROR("Extracting to a tar archive is only supported on "
+		      "UNIX-like systems!");
+		return WIMLIB_ERR_UNSUPPORTED;
+#else
+		if (extract_flags & (WIMLIB_EXTRACT_FLAG_NTFS |
+				     WIMLIB_EXTRACT_FLAG_TO_STDOUT))
+			return WIMLIB_ERR_INVALID_PARAM;
+#endif
+	}
+
 	if (extract_flags & WIMLIB_EXTRACT_FLAG_WIMBOOT) {
 #ifdef _WIN32
 		if (!wim->filename)
@@ -1770,14 +2095,170 @@ append_matched_dentries(WIMStruct *wim, const tchar *orig_pattern,
 	return 0;
 }
 
+/* Canonicalize the paths to extract.  */
+static int
+canonicalize_extract_paths(const tchar * const *paths, size_t num_paths,
+			   tchar ***canonical_paths_ret)
+{
+	tchar **canonical_paths;
+
+	canonical_paths = CALLOC(num_paths, sizeof(canonical_paths[0]));
+	if (!canonical_paths)
+		return WIMLIB_ERR_NOMEM;
+	for (size_t i = 0; i < num_paths; i++) {
+		canonical_paths[i] = canonicalize_wim_path(paths[i]);
+		if (!canonical_paths[i]) {
+			while (i--)
+				FREE(canonical_paths[i]);
+			FREE(canonical_paths);
+			return WIMLIB_ERR_NOMEM;
+		}
+	}
+	*canonical_paths_ret = canonical_paths;
+	return 0;
+}
+
+/* Return true if the path patterns can only match the files that get_dentry()
+ * would find for them, so that a partially loaded image suffices to expand
+ * them.  This requires that they contain no wildcards and that matching is
+ * case sensitive.  */
+static bool
+patterns_are_literal(tchar * const *patterns, size_t num_patterns)
+{
+	if (default_ignore_case)
+		return false;
+	for (size_t i = 0; i < num_patterns; i++)
+		if (tstrchr(patterns[i], T('*')) || tstrchr(patterns[i], T('?')))
+			return false;
+	return true;
+}
+
+struct sorted_path {
+	const tchar *path;
+	size_t idx;
+};
+
+static int
+cmp_sorted_paths(const void *p1, const void *p2)
+{
+	return tstrcmp(((const struct sorted_path *)p1)->path,
+		       ((const struct sorted_path *)p2)->path);
+}
+
+/*
+ * Look up the canonicalized paths @paths, which must not be treated as
+ * patterns, in the currently selected image.  Set trees[i] to the dentry for
+ * paths[i], or to NULL if it doesn't exist.
+ *
+ * Rather than looking up each path starting from the root, the paths are sorted
+ * so that paths which share directories are adjacent, and each path is looked
+ * up starting from the deepest directory that it shares with the previous one.
+ * So when extracting a long list of files, each directory is looked up about
+ * once rather than once per file in it.
+ */
+static int
+lookup_extract_paths(WIMStruct *wim, tchar * const *paths, size_t num_paths,
+		     struct wim_dentry **trees)
+{
+	struct sorted_path *sorted;
+	size_t max_len = 0;
+	struct wim_dentry **dentries = NULL;
+	size_t *ends = NULL;
+	tchar *name = NULL;
+	const tchar *prev = T("");
+	size_t prev_depth = 0;
+	int ret = WIMLIB_ERR_NOMEM;
+
+	if (num_paths == 0)
+		return 0;
+
+	sorted = MALLOC(num_paths * sizeof(sorted[0]));
+	if (!sorted)
+		goto out;
+	for (size_t i = 0; i < num_paths; i++) {
+		sorted[i].path = paths[i];
+		sorted[i].idx = i;
+		max_len = max(max_len, tstrlen(paths[i]));
+	}
+	qsort(sorted, num_paths, sizeof(sorted[0]), cmp_sorted_paths);
+
+	/* For the previous path: dentries[d] is the dentry reached after its
+	 * first d components, and ends[d] the end of its d'th component.  */
+	dentries = MALLOC((max_len / 2 + 2) * sizeof(dentries[0]));
+	ends = MALLOC((max_len / 2 + 2) * sizeof(ends[0]));
+	name = MALLOC((max_len + 1) * sizeof(name[0]));
+	if (!dentries || !ends || !name)
+		goto out;
+	dentries[0] = wim_get_current_root_dentry(wim);
+	ends[0] = 0;
+
+	for (size_t i = 0; i < num_paths; i++) {
+		const tchar *path = sorted[i].path;
+		size_t common = 0;
+		size_t depth = 0;
+		size_t pos;
+
+		while (path[common] && path[common] == prev[common])
+			common++;
+		while (depth < prev_depth && ends[depth + 1] <= common &&
+		       (path[ends[depth + 1]] == WIM_PATH_SEPARATOR ||
+			path[ends[depth + 1]] == T('\0')))
+			depth++;
+
+		for (pos = ends[depth]; ; depth++) {
+			struct wim_dentry *dir = dentries[depth];
+			size_t len;
+
+			while (path[pos] == WIM_PATH_SEPARATOR)
+				pos++;
+			if (!path[pos])
+				break;
+			len = 0;
+			while (path[pos + len] &&
+			       path[pos + len] != WIM_PATH_SEPARATOR)
+				len++;
+			tmemcpy(name, &path[pos], len);
+			name[len] = T('\0');
+			pos += len;
+			dentries[depth + 1] = dir ?
+				get_dentry_child_with_name(dir, name,
+						WIMLIB_CASE_PLATFORM_DEFAULT) :
+				NULL;
+			ends[depth + 1] = pos;
+		}
+		trees[sorted[i].idx] = dentries[depth];
+		prev = path;
+		prev_depth = depth;
+	}
+	ret = 0;
+out:
+	FREE(name);
+	FREE(ends);
+	FREE(dentries);
+	FREE(sorted);
+	return ret;
+}
+
+static void
+free_canonical_paths(tchar **canonical_paths, size_t num_paths)
+{
+	if (canonical_paths) {
+		for (size_t i = 0; i < num_paths; i++)
+			FREE(canonical_paths[i]);
+		FREE(canonical_paths);
+	}
+}
+
 static int
 do_wimlib_extract_paths(WIMStruct *wim, int image, const tchar *target,
 			const tchar * const *paths, size_t num_paths,
 			int extract_flags)
 {
 	int ret;
-	struct wim_dentry **trees;
+	struct wim_dentry **trees = NULL;
 	size_t num_trees;
+	tchar **canonical_paths = NULL;
+	bool partial = false;
 
 	if (wim == NULL || target == NULL || target[0] == T('\0') ||
 	    (num_paths != 0 && paths == NULL))
@@ -1787,25 +2268,46 @@ do_wimlib_extract_paths(WIMStruct *wim, int image, const tchar *target,
 	if (ret)
 		return ret;
 
-	ret = select_wim_image(wim, image);
+	if (num_paths) {
+		ret = canonicalize_extract_paths(paths, num_paths,
+						 &canonical_paths);
+		if (ret)
+			return ret;
+	}
+
+	if ((extract_flags & WIMLIB_EXTRACT_FLAG_IMAGEMODE) ||
+	    !canonical_paths ||
+	    ((extract_flags & WIMLIB_EXTRACT_FLAG_GLOB_PATHS) &&
+	     !patterns_are_literal(canonical_paths, num_paths)))
+	{
+		ret = select_wim_image(wim, image);
+	} else {
+		/* Extracting specific paths.  If the image isn't loaded yet,
+		 * just load the parts of it needed for those paths.  */
+		ret = select_wim_image_for_paths(wim, image,
+						 (const tchar * const *)canonical_paths,
+						 num_paths, &partial);
+	}
 	if (ret)
-		return ret;
+		goto out;
 
 	ret = wim_checksum_unhashed_blobs(wim);
 	if (ret)
-		return ret;
+		goto out;
 
 	if ((extract_flags & (WIMLIB_EXTRACT_FLAG_NTFS |
+			      WIMLIB_EXTRACT_FLAG_TAR |
 			      WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE)) ==
 	    (WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE))
 	{
 		ret = mkdir_if_needed(target);
 		if (ret)
-			return ret;
+			goto out;
 	}
 
-	if (extract_flags & WIMLIB_EXTRACT_FLAG_GLOB_PATHS) {
-
+	if ((extract_flags & WIMLIB_EXTRACT_FLAG_GLOB_PATHS) &&
+	    !patterns_are_literal(canonical_paths, num_paths))
+	{
 		struct append_dentry_ctx append_dentry_ctx = {
 			.dentries = NULL,
 			.num_dentries = 0,
@@ -1818,46 +2320,63 @@ do_wimlib_extract_paths(WIMStruct *wim, int image, const tchar *target,
 						      &append_dentry_ctx);
 			if (ret) {
 				trees = append_dentry_ctx.dentries;
-				goto out_free_trees;
+				goto out;
 			}
 		}
 		trees = append_dentry_ctx.dentries;
 		num_trees = append_dentry_ctx.num_dentries;
 	} else {
 		trees = MALLOC(num_paths * sizeof(trees[0]));
-		if (trees == NULL)
-			return WIMLIB_ERR_NOMEM;
+		if (trees == NULL) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto out;
+		}
 
-		for (size_t i = 0; i < num_paths; i++) {
+		ret = lookup_extract_paths(wim, canonical_paths, num_paths,
+					   trees);
+		if (ret)
+			goto out;
 
-			tchar *path = canonicalize_wim_path(paths[i]);
-			if (path == NULL) {
-				ret = WIMLIB_ERR_NOMEM;
-				goto out_free_trees;
+		/* Literal paths as patterns match either one file or none; in
+		 * the latter case, handle them as append_matched_dentries()
+		 * would.  */
+		num_trees = 0;
+		for (size_t i = 0; i < num_paths; i++) {
+			if (trees[i]) {
+				trees[num_trees++] = trees[i];
+				continue;
 			}
-
-			trees[i] = get_dentry(wim, path,
-					      WIMLIB_CASE_PLATFORM_DEFAULT);
-			FREE(path);
-			if (trees[i] == NULL) {
-				  ERROR("Path \"%"TS"\" does not exist "
-					"in WIM image %d",
-					paths[i], wim->current_image);
-				  ret = WIMLIB_ERR_PATH_DOES_NOT_EXIST;
-				  goto out_free_trees;
+			if (!(extract_flags & WIMLIB_EXTRACT_FLAG_GLOB_PATHS)) {
+				ERROR("Path \"%"TS"\" does not exist "
+				      "in WIM image %d",
+				      paths[i], wim->current_image);
+				ret = WIMLIB_ERR_PATH_DOES_NOT_EXIST;
+				goto out;
+			}
+			if (extract_flags & WIMLIB_EXTRACT_FLAG_STRICT_GLOB) {
+				ERROR("No matches for path pattern \"%"TS"\"",
+				      paths[i]);
+				ret = WIMLIB_ERR_PATH_DOES_NOT_EXIST;
+				goto out;
 			}
+			WARNING("No matches for path pattern \"%"TS"\"",
+				paths[i]);
 		}
-		num_trees = num_paths;
 	}
 
 	if (num_trees == 0) {
 		ret = 0;
-		goto out_free_trees;
+		goto out;
 	}
 
-	ret = extract_trees(wim, trees, num_trees, target, extract_flags);
-out_free_trees:
+	ret = extract_trees(wim, trees, num_trees, target, extract_flags,
+			    false);
+out:
 	FREE(trees);
+	/* A partially loaded image must not stay selected.  */
+	if (partial)
+		deselect_current_wim_image(wim);
+	free_canonical_paths(canonical_paths, num_paths);
 	return ret;
 }
 
@@ -1870,23 +2389,94 @@ extract_single_image(WIMStruct *wim, int image,
 	return do_wimlib_extract_paths(wim, image, target, &path, 1, extract_flags);
 }
 
-static const tchar * const filename_forbidden_chars =
-#ifdef _WIN32
-T("<>:\"/\\|?*");
-#else
-T("/");
-#endif
+struct image_roots {
+	/* Filler directory which the images' root dentries are linked into  */
+	struct wim_dentry *parent;
+	struct wim_image_metadata **imds;
+	struct wim_dentry **roots;
+	int num_held;
+	int num_linked;
+};
 
-/* This function checks if it is okay to use a WIM image's name as a directory
- * name.  */
-static bool
-image_name_ok_as_dir(const tchar *image_name)
+static void
+unlink_linked_roots(struct image_roots *r)
 {
-	return image_name && *image_name &&
-		!tstrpbrk(image_name, filename_forbidden_chars) &&
-		tstrcmp(image_name, T(".")) &&
-		tstrcmp(image_name, T("..")) &&
-		tstrlen(image_name) <= 128;
+	for (int i = 0; i < r->num_linked; i++) {
+		unlink_dentry(r->roots[i]);
+		dentry_set_name(r->roots[i], NULL);
+	}
+	r->num_linked = 0;
+	free_dentry(r->parent);
+	r->parent = NULL;
+}
+
+static void
+unlink_image_roots(struct image_roots *r)
+{
+	unlink_linked_roots(r);
+	for (int i = 0; i < r->num_held; i++)
+		release_wim_image(r->imds[i]);
+	FREE(r->imds);
+	FREE(r->roots);
+}
+
+/*
+ * Prepare to extract all images at once: load all the images, then temporarily
+ * give each image's root dentry the name of the subdirectory it is extracted to
+ * and link it into a filler directory.  The extraction code then sees the roots
+ * as ordinary directories at the top of the extraction, and each blob which is
+ * shared by several images is read and decompressed only once.
+ *
+ * r->parent is left NULL if the images can't be extracted this way, because one
+ * of them is empty, its root is named, or two images map to the same
+ * subdirectory.  unlink_image_roots() must be called in any case.
+ */
+static int
+link_image_roots(WIMStruct *wim, struct image_roots *r)
+{
+	int num_images = wim->hdr.image_count;
+	tchar name[129];
+	int ret;
+
+	memset(r, 0, sizeof(*r));
+	r->imds = CALLOC(num_images, sizeof(r->imds[0]));
+	r->roots = CALLOC(num_images, sizeof(r->roots[0]));
+	if (!r->imds || !r->roots)
+		return WIMLIB_ERR_NOMEM;
+
+	/* All the images are held at once anyway, so load them all together.  */
+	ret = load_wim_images(wim, 1, num_images);
+	if (ret)
+		return ret;
+
+	for (int i = 0; i < num_images; i++) {
+		ret = hold_wim_image(wim, i + 1, &r->imds[i]);
+		if (ret)
+			return ret;
+		r->num_held++;
+		r->roots[i] = r->imds[i]->root_dentry;
+		if (!r->roots[i] || r->roots[i]->d_name_nbytes ||
+		    r->roots[i]->d_short_name_nbytes)
+			return 0;
+	}
+
+	ret = new_filler_directory(&r->parent);
+	if (ret)
+		return ret;
+
+	for (int i = 0; i < num_images; i++) {
+		get_image_dir_name(wim, i + 1, name);
+		ret = dentry_set_name(r->roots[i], name);
+		if (ret)
+			return ret;
+		if (dentry_add_child(r->parent, r->roots[i])) {
+			dentry_set_name(r->roots[i], NULL);
+			unlink_linked_roots(r);
+			return 0;
+		}
+		r->num_linked++;
+	}
+	return 0;
 }
 
 /* Extracts all images from the WIM to the directory @target, with the images
@@ -1898,27 +2488,52 @@ extract_all_images(WIMStruct *wim, const tchar *target, int extract_flags)
 	tchar buf[output_path_len + 1 + 128 + 1];
 	int ret;
 	int image;
-	const tchar *image_name;
 
 	if (extract_flags & WIMLIB_EXTRACT_FLAG_NTFS) {
 		ERROR("Cannot extract multiple images in NTFS extraction mode.");
 		return WIMLIB_ERR_INVALID_PARAM;
 	}
 
+	if (extract_flags & WIMLIB_EXTRACT_FLAG_TAR) {
+		ERROR("Cannot extract multiple images to one tar archive.");
+		return WIMLIB_ERR_INVALID_PARAM;
+	}
+
 	ret = mkdir_if_needed(target);
 	if (ret)
 		return ret;
+
+	if (wim->hdr.image_count > 1 &&
+	    select_apply_operations(extract_flags)->supports_all_images)
+	{
+		struct image_roots roots;
+		int flags = extract_flags | WIMLIB_EXTRACT_FLAG_IMAGEMODE;
+
+		ret = check_extract_flags(wim, &flags);
+		if (ret)
+			return ret;
+		ret = link_image_roots(wim, &roots);
+		if (!ret && roots.parent) {
+			ret = wim_checksum_unhashed_blobs(wim);
+			if (!ret)
+				ret = extract_trees(wim, roots.roots,
+						    roots.num_linked, target,
+						    flags, true);
+			unlink_image_roots(&roots);
+			return ret;
+		}
+		unlink_image_roots(&roots);
+		if (ret)
+			return ret;
+	}
+
 	tmemcpy(buf, target, output_path_len);
 	buf[output_path_len] = OS_PREFERRED_PATH_SEPARATOR;
 	for (image = 1; image <= wim->hdr.image_count; image++) {
-		image_name = wimlib_get_image_name(wim, image);
-		if (image_name_ok_as_dir(image_name)) {
-			tstrcpy(buf + output_path_len + 1, image_name);
-		} else {
-			/* Image name is empty or contains forbidden characters.
-			 * Use image number instead. */
-			tsprintf(buf + output_path_len + 1, T("%d"), image);
-		}
+		ret = load_wim_images_ahead(wim, image, wim->hdr.image_count);
+		if (ret)
+			return ret;
+		get_image_dir_name(wim, image, buf + output_path_len + 1);
 		ret = extract_single_image(wim, image, buf, extract_flags);
 		if (ret)
 			return ret;
@@ -2028,6 +2643,10 @@ wimlib_extract_image_from_pipe_with_progress(int pipe_fd,
 	in_fd = &pwm->in_fd;
 	wimlib_assert(in_fd->offset == WIM_HEADER_DISK_SIZE);
 
+	/* Everything else is read from the pipe sequentially, so keep reading
+	 * it ahead in another thread while the data is being processed.  */
+	filedes_start_pipe_buffer(in_fd);
+
 	/* As mentioned, the WIMStruct we created from the pipe does not have
 	 * XML data yet.  Fix this by reading the extra copy of the XML data
 	 * that directly follows the header in pipable WIMs.  (Note: see
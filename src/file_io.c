@@ -24,10 +24,29 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#ifdef HAVE_MMAP
+#  include <sys/mman.h>
+#endif
+#ifndef _WIN32
+#  include <poll.h>
+#endif
+#ifdef HAVE_PWRITEV
+#  include <sys/uio.h>
+#endif
 
+#include "wimlib.h"
 #include "wimlib/error.h"
 #include "wimlib/file_io.h"
+#include "wimlib/integrity.h"
+#include "wimlib/perf_counters.h"
+#include "wimlib/resource.h"
+#include "wimlib/threads.h"
 #include "wimlib/util.h"
 
 #ifdef _WIN32
@@ -38,18 +57,738 @@
 #  define pwrite win32_pwrite
 #endif
 
+#ifndef _WIN32
+
+/* Size of the buffer which a pipe reader thread fills ahead of the reads  */
+#define PIPE_BUFFER_SIZE	(32U << 20)
+
+/* Maximum number of bytes a pipe reader thread reads at a time  */
+#define PIPE_BUFFER_MAX_READ	(1U << 20)
+
+/* How often, in milliseconds, a pipe reader thread which is waiting for data
+ * checks whether it has been asked to stop  */
+#define PIPE_BUFFER_POLL_MS	100
+
 /*
- * Wrapper around read() that checks for errors and keeps retrying until all
- * requested bytes have been read or until end-of file has occurred.
+ * A ring buffer which a dedicated thread fills with the data arriving on a
+ * pipe, so that reading from the pipe overlaps with processing the data read
+ * from it (e.g. decompressing and extracting a pipable WIM).  This way a
+ * momentary delay on either side, e.g. due to a network connection, stalls
+ * neither.
+ */
+struct pipe_buffer {
+	struct thread thread;
+	struct mutex lock;
+	struct condvar cond;
+
+	/* Everything below is protected by @lock  */
+	u8 *data;
+	size_t head;
+	size_t count;
+	bool stop_requested;
+	bool finished;
+
+	/* Once @finished: the error (or WIMLIB_ERR_UNEXPECTED_END_OF_FILE) that
+	 * ended the reading, and the corresponding errno  */
+	int status;
+	int status_errno;
+};
+
+static void *
+pipe_buffer_thread_proc(void *arg)
+{
+	struct filedes *fd = arg;
+	struct pipe_buffer *pb = fd->pipe_buffer;
+
+	mutex_lock(&pb->lock);
+	for (;;) {
+		struct pollfd pfd = { .fd = fd->fd, .events = POLLIN };
+		size_t tail, n;
+		ssize_t ret;
+
+		while (pb->count == PIPE_BUFFER_SIZE && !pb->stop_requested)
+			condvar_wait(&pb->cond, &pb->lock);
+		if (pb->stop_requested)
+			break;
+
+		/* The consumer never touches the free space, so it can be
+		 * filled without holding the lock.  */
+		tail = (pb->head + pb->count) % PIPE_BUFFER_SIZE;
+		n = min(PIPE_BUFFER_SIZE - pb->count, PIPE_BUFFER_SIZE - tail);
+		n = min(n, PIPE_BUFFER_MAX_READ);
+		mutex_unlock(&pb->lock);
+
+		/* Don't block in read() indefinitely, since the buffer may be
+		 * stopped before all data has been sent.  */
+		if (poll(&pfd, 1, PIPE_BUFFER_POLL_MS) == 0) {
+			mutex_lock(&pb->lock);
+			continue;
+		}
+		ret = read(fd->fd, &pb->data[tail], n);
+
+		mutex_lock(&pb->lock);
+		if (ret > 0) {
+			if (pb->count == 0)
+				condvar_broadcast(&pb->cond);
+			pb->count += ret;
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret == 0) {
+			pb->status = WIMLIB_ERR_UNEXPECTED_END_OF_FILE;
+			pb->status_errno = EINVAL;
+		} else {
+			pb->status = WIMLIB_ERR_READ;
+			pb->status_errno = errno;
+		}
+		break;
+	}
+	pb->finished = true;
+	condvar_broadcast(&pb->cond);
+	mutex_unlock(&pb->lock);
+	return NULL;
+}
+
+/* full_read() from a pipe which has a pipe buffer  */
+static int
+pipe_buffer_read(struct filedes *fd, void *buf, size_t count)
+{
+	struct pipe_buffer *pb = fd->pipe_buffer;
+	int ret = 0;
+
+	mutex_lock(&pb->lock);
+	while (count) {
+		size_t n;
+
+		while (pb->count == 0 && !pb->finished)
+			condvar_wait(&pb->cond, &pb->lock);
+		if (pb->count == 0) {
+			ret = pb->status;
+			errno = pb->status_errno;
+			break;
+		}
+		n = min(count, min(pb->count, PIPE_BUFFER_SIZE - pb->head));
+		memcpy(buf, &pb->data[pb->head], n);
+		if (pb->count == PIPE_BUFFER_SIZE)
+			condvar_broadcast(&pb->cond);
+		pb->head = (pb->head + n) % PIPE_BUFFER_SIZE;
+		pb->count -= n;
+		buf += n;
+		count -= n;
+		fd->offset += n;
+	}
+	mutex_unlock(&pb->lock);
+	return ret;
+}
+
+/*
+ * Start a thread which reads ahead from the pipe @fd into a large buffer, from
+ * which full_read() (and thus full_pread()) will then take the data.  This is
+ * only an optimization, so on failure the pipe is just left to be read
+ * directly.  The thread is stopped by filedes_close().
+ */
+void
+filedes_start_pipe_buffer(struct filedes *fd)
+{
+	struct pipe_buffer *pb;
+
+	if (!fd->is_pipe || fd->pipe_buffer)
+		return;
+
+	pb = CALLOC(1, sizeof(*pb));
+	if (!pb)
+		return;
+	pb->data = MALLOC(PIPE_BUFFER_SIZE);
+	if (!pb->data)
+		goto err_free_pb;
+	if (!mutex_init(&pb->lock))
+		goto err_free_data;
+	if (!condvar_init(&pb->cond))
+		goto err_destroy_lock;
+
+	fd->pipe_buffer = pb;
+	if (!thread_create(&pb->thread, pipe_buffer_thread_proc, fd)) {
+		fd->pipe_buffer = NULL;
+		goto err_destroy_cond;
+	}
+	return;
+
+err_destroy_cond:
+	condvar_destroy(&pb->cond);
+err_destroy_lock:
+	mutex_destroy(&pb->lock);
+err_free_data:
+	FREE(pb->data);
+err_free_pb:
+	FREE(pb);
+}
+
+static void
+filedes_stop_pipe_buffer(struct filedes *fd)
+{
+	struct pipe_buffer *pb = fd->pipe_buffer;
+
+	if (!pb)
+		return;
+	mutex_lock(&pb->lock);
+	pb->stop_requested = true;
+	condvar_broadcast(&pb->cond);
+	mutex_unlock(&pb->lock);
+	thread_join(&pb->thread);
+	condvar_destroy(&pb->cond);
+	mutex_destroy(&pb->lock);
+	FREE(pb->data);
+	FREE(pb);
+	fd->pipe_buffer = NULL;
+}
+
+#else /* !_WIN32 */
+
+static int
+pipe_buffer_read(struct filedes *fd, void *buf, size_t count)
+{
+	return WIMLIB_ERR_READ;
+}
+
+void
+filedes_start_pipe_buffer(struct filedes *fd)
+{
+}
+
+static void
+filedes_stop_pipe_buffer(struct filedes *fd)
+{
+}
+
+#endif /* _WIN32 */
+
+/* Read from a file provided through wimlib_open_wim_with_io().  */
+static int
+io_read(struct filedes *fd, void *buf, size_t count, u64 offset)
+{
+	if (count == 0)
+		return 0;
+	if (offset > fd->io->size || count > fd->io->size - offset) {
+		errno = EINVAL;
+		return WIMLIB_ERR_UNEXPECTED_END_OF_FILE;
+	}
+	errno = 0;
+	if (fd->io->read_at(fd->io->ctx, buf, count, offset) != 0) {
+		if (errno == 0)
+			errno = EIO;
+		return WIMLIB_ERR_READ;
+	}
+	return 0;
+}
+
+/*
+ * Unbuffered I/O
  *
- * Return values:
- *	WIMLIB_ERR_SUCCESS			(0)
- *	WIMLIB_ERR_READ				(errno set)
- *	WIMLIB_ERR_UNEXPECTED_END_OF_FILE	(errno set to EINVAL)
+ * A regular file opened with filedes_open() in unbuffered mode is read and
+ * written bypassing the operating system's file cache, with O_DIRECT.  For a
+ * large WIM file which is read or written once, this saves copying all the data
+ * through the cache and keeps the file from pushing everything else out of
+ * memory.  But the operating system then only accepts reads and writes of
+ * whole, aligned blocks to and from aligned buffers.  So here the reads are
+ * served from a few large aligned windows of the file, the next of which is
+ * read by a separate thread while the current one is consumed, and the writes
+ * are combined in a large aligned buffer, which is written out once it is full
+ * or once a write which doesn't continue it arrives.
  */
-int
-full_read(struct filedes *fd, void *buf, size_t count)
+
+/* The alignment of the offsets, sizes, and buffers of unbuffered I/O.  This is
+ * the largest sector size in common use.  */
+#define UNBUFFERED_ALIGNMENT	4096
+
+/* The size of each read window, and of the write buffer  */
+#define UNBUFFERED_WINDOW_SIZE	(8U << 20)
+
+/* The number of read windows: enough for the one being consumed, the next one
+ * being read ahead, and one more for a reader elsewhere in the file.  */
+#define UNBUFFERED_NUM_WINDOWS	3
+
+enum {
+	WINDOW_EMPTY,
+	WINDOW_FILLING,
+	WINDOW_VALID,
+};
+
+struct unbuffered_window {
+	u8 *data;
+
+	/* Offset of the window in the file; a multiple of
+	 * UNBUFFERED_WINDOW_SIZE  */
+	u64 offset;
+
+	/* Number of bytes of the window that were read; less than
+	 * UNBUFFERED_WINDOW_SIZE only at the end of the file  */
+	size_t size;
+
+	int state;
+	u64 last_use;
+};
+
+struct unbuffered_io {
+	struct thread thread;
+	struct mutex lock;
+	struct condvar cond;
+
+	/* Everything below is protected by @lock  */
+	bool thread_started;
+	bool thread_failed;
+	bool stop_requested;
+
+	struct unbuffered_window windows[UNBUFFERED_NUM_WINDOWS];
+	u64 use_count;
+
+	/* Offset of the window the read-ahead thread is to read next, or
+	 * UINT64_MAX if none  */
+	u64 read_ahead_offset;
+
+	/* The write buffer, followed by one extra block for reading the data
+	 * which the last block written must keep.  While @wbuf_active, it holds
+	 * the @wbuf_len bytes to be written at @wbuf_offset, which is aligned.
+	 * The data before the first byte written is read from the file.  */
+	u8 *wbuf;
+	u64 wbuf_offset;
+	size_t wbuf_len;
+	bool wbuf_active;
+
+	/* The size of the file, not counting the write buffer  */
+	u64 file_size;
+};
+
+static struct unbuffered_io *
+new_unbuffered_io(void)
+{
+	struct unbuffered_io *ub = CALLOC(1, sizeof(*ub));
+
+	if (!ub)
+		return NULL;
+	if (!mutex_init(&ub->lock))
+		goto err_free_ub;
+	if (!condvar_init(&ub->cond))
+		goto err_destroy_lock;
+	ub->read_ahead_offset = UINT64_MAX;
+	return ub;
+
+err_destroy_lock:
+	mutex_destroy(&ub->lock);
+err_free_ub:
+	FREE(ub);
+	return NULL;
+}
+
+static void
+free_unbuffered_io(struct unbuffered_io *ub)
+{
+	for (int i = 0; i < UNBUFFERED_NUM_WINDOWS; i++)
+		ALIGNED_FREE(ub->windows[i].data);
+	ALIGNED_FREE(ub->wbuf);
+	condvar_destroy(&ub->cond);
+	mutex_destroy(&ub->lock);
+	FREE(ub);
+}
+
+/* Read up to @count bytes at @offset in the unbuffered file, where all three
+ * are aligned.  Returns the number of bytes read, which is less than @count
+ * only at the end of the file, or -1 with errno set.  */
+static ssize_t
+unbuffered_pread(int raw_fd, u8 *buf, size_t count, u64 offset)
+{
+	size_t done = 0;
+
+	while (done < count) {
+		ssize_t ret = pread(raw_fd, &buf[done], count - done,
+				    offset + done);
+		if (unlikely(ret <= 0)) {
+			if (ret == 0)
+				break;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += ret;
+		/* Only the end of the file can end in the middle of a block. */
+		if (ret % UNBUFFERED_ALIGNMENT)
+			break;
+	}
+	return done;
+}
+
+static int
+unbuffered_pwrite(int raw_fd, const u8 *buf, size_t count, u64 offset)
 {
+	while (count) {
+		ssize_t ret = pwrite(raw_fd, buf, count, offset);
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			return WIMLIB_ERR_WRITE;
+		}
+		buf += ret;
+		count -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+static struct unbuffered_window *
+find_window(struct unbuffered_io *ub, u64 offset)
+{
+	for (int i = 0; i < UNBUFFERED_NUM_WINDOWS; i++) {
+		struct unbuffered_window *w = &ub->windows[i];
+
+		if (w->state != WINDOW_EMPTY && w->offset == offset)
+			return w;
+	}
+	return NULL;
+}
+
+/* Return the window to reuse for new data: an empty one if any, otherwise the
+ * least recently used one which isn't being filled, or NULL if all are.  */
+static struct unbuffered_window *
+choose_window_to_reuse(struct unbuffered_io *ub)
+{
+	struct unbuffered_window *best = NULL;
+
+	for (int i = 0; i < UNBUFFERED_NUM_WINDOWS; i++) {
+		struct unbuffered_window *w = &ub->windows[i];
+
+		if (w->state == WINDOW_EMPTY)
+			return w;
+		if (w->state == WINDOW_VALID &&
+		    (!best || w->last_use < best->last_use))
+			best = w;
+	}
+	return best;
+}
+
+/*
+ * Read the window of the file at @offset, unless it is already present or being
+ * read.  Called with the lock held, which is released while reading, so that
+ * other threads can use the other windows meanwhile.
+ */
+static int
+load_window(struct filedes *fd, u64 offset)
+{
+	struct unbuffered_io *ub = fd->unbuffered;
+	struct unbuffered_window *w;
+	ssize_t ret;
+	int saved_errno;
+
+	for (;;) {
+		if (find_window(ub, offset))
+			return 0;
+		w = choose_window_to_reuse(ub);
+		if (w)
+			break;
+		condvar_wait(&ub->cond, &ub->lock);
+	}
+	if (!w->data) {
+		w->data = ALIGNED_MALLOC(UNBUFFERED_WINDOW_SIZE,
+					 UNBUFFERED_ALIGNMENT);
+		if (!w->data)
+			return WIMLIB_ERR_NOMEM;
+	}
+	w->offset = offset;
+	w->state = WINDOW_FILLING;
+	w->last_use = ++ub->use_count;
+	mutex_unlock(&ub->lock);
+
+	ret = unbuffered_pread(fd->fd, w->data, UNBUFFERED_WINDOW_SIZE, offset);
+	saved_errno = errno;
+
+	mutex_lock(&ub->lock);
+	condvar_broadcast(&ub->cond);
+	if (ret < 0) {
+		w->state = WINDOW_EMPTY;
+		errno = saved_errno;
+		return WIMLIB_ERR_READ;
+	}
+	w->size = ret;
+	w->state = WINDOW_VALID;
+	return 0;
+}
+
+static void *
+unbuffered_read_ahead_thread_proc(void *arg)
+{
+	struct filedes *fd = arg;
+	struct unbuffered_io *ub = fd->unbuffered;
+
+	mutex_lock(&ub->lock);
+	for (;;) {
+		u64 offset;
+
+		while (ub->read_ahead_offset == UINT64_MAX &&
+		       !ub->stop_requested)
+			condvar_wait(&ub->cond, &ub->lock);
+		if (ub->stop_requested)
+			break;
+		offset = ub->read_ahead_offset;
+		ub->read_ahead_offset = UINT64_MAX;
+
+		/* Errors are reported when the window is read for real.  */
+		(void)load_window(fd, offset);
+	}
+	mutex_unlock(&ub->lock);
+	return NULL;
+}
+
+/* Have the read-ahead thread read the window of the file at @offset, if it
+ * isn't present yet.  Called with the lock held.  */
+static void
+request_read_ahead(struct filedes *fd, u64 offset)
+{
+	struct unbuffered_io *ub = fd->unbuffered;
+
+	if (find_window(ub, offset) || ub->thread_failed)
+		return;
+	if (!ub->thread_started) {
+		if (!thread_create(&ub->thread,
+				   unbuffered_read_ahead_thread_proc, fd)) {
+			ub->thread_failed = true;
+			return;
+		}
+		ub->thread_started = true;
+	}
+	ub->read_ahead_offset = offset;
+	condvar_broadcast(&ub->cond);
+}
+
+/* Discard the read windows, e.g. because the file is being written.  Called
+ * with the lock held.  */
+static void
+drop_windows(struct unbuffered_io *ub)
+{
+	ub->read_ahead_offset = UINT64_MAX;
+	for (int i = 0; i < UNBUFFERED_NUM_WINDOWS; i++) {
+		while (ub->windows[i].state == WINDOW_FILLING)
+			condvar_wait(&ub->cond, &ub->lock);
+		ub->windows[i].state = WINDOW_EMPTY;
+	}
+}
+
+/* Read the block of the file at the aligned @offset into @block, with zeroes
+ * for anything beyond the end of the file.  */
+static int
+read_block(struct filedes *fd, u8 *block, u64 offset)
+{
+	ssize_t ret = 0;
+
+	if (offset < fd->unbuffered->file_size) {
+		ret = unbuffered_pread(fd->fd, block, UNBUFFERED_ALIGNMENT,
+				       offset);
+		if (ret < 0)
+			return WIMLIB_ERR_WRITE;
+	}
+	memset(&block[ret], 0, UNBUFFERED_ALIGNMENT - ret);
+	return 0;
+}
+
+/* Write out the write buffer, if it is in use.  Called with the lock held.  */
+static int
+flush_write_buffer(struct filedes *fd)
+{
+	struct unbuffered_io *ub = fd->unbuffered;
+	u64 end = ub->wbuf_offset + ub->wbuf_len;
+	size_t padded_len = ALIGN(ub->wbuf_len, UNBUFFERED_ALIGNMENT);
+	int ret;
+
+	if (!ub->wbuf_active)
+		return 0;
+
+	/* Complete the last block with the data already in the file.  */
+	if (padded_len != ub->wbuf_len) {
+		u64 block_offset = ub->wbuf_offset + padded_len -
+				   UNBUFFERED_ALIGNMENT;
+		u8 *block = &ub->wbuf[UNBUFFERED_WINDOW_SIZE];
+
+		ret = read_block(fd, block, block_offset);
+		if (ret)
+			return ret;
+		memcpy(&ub->wbuf[ub->wbuf_len], &block[end - block_offset],
+		       padded_len - ub->wbuf_len);
+	}
+
+	ret = unbuffered_pwrite(fd->fd, ub->wbuf, padded_len, ub->wbuf_offset);
+	if (ret)
+		return ret;
+	ub->wbuf_active = false;
+
+	/* Cut off the padding if it extended the file.  */
+	end = max(end, ub->file_size);
+	if (ub->wbuf_offset + padded_len > end && ftruncate(fd->fd, end))
+		return WIMLIB_ERR_WRITE;
+	ub->file_size = end;
+	return 0;
+}
+
+/* Start a new write buffer for writing at @offset.  Called with the lock held.
+ */
+static int
+start_write_buffer(struct filedes *fd, u64 offset)
+{
+	struct unbuffered_io *ub = fd->unbuffered;
+	int ret;
+
+	if (!ub->wbuf) {
+		ub->wbuf = ALIGNED_MALLOC(UNBUFFERED_WINDOW_SIZE +
+					  UNBUFFERED_ALIGNMENT,
+					  UNBUFFERED_ALIGNMENT);
+		if (!ub->wbuf)
+			return WIMLIB_ERR_NOMEM;
+	}
+	ub->wbuf_offset = offset & ~(u64)(UNBUFFERED_ALIGNMENT - 1);
+	ub->wbuf_len = offset - ub->wbuf_offset;
+	if (ub->wbuf_len) {
+		ret = read_block(fd, ub->wbuf, ub->wbuf_offset);
+		if (ret)
+			return ret;
+	}
+	ub->wbuf_active = true;
+	return 0;
+}
+
+/* full_pread() from a file opened for unbuffered I/O  */
+static int
+unbuffered_read(struct filedes *fd, void *buf, size_t count, u64 offset)
+{
+	struct unbuffered_io *ub = fd->unbuffered;
+	int ret;
+
+	mutex_lock(&ub->lock);
+	ret = flush_write_buffer(fd);
+	while (!ret && count) {
+		u64 window_offset = offset & ~(u64)(UNBUFFERED_WINDOW_SIZE - 1);
+		struct unbuffered_window *w = find_window(ub, window_offset);
+		size_t pos, n;
+
+		if (!w) {
+			ret = load_window(fd, window_offset);
+			continue;
+		}
+		if (w->state == WINDOW_FILLING) {
+			condvar_wait(&ub->cond, &ub->lock);
+			continue;
+		}
+		pos = offset - window_offset;
+		if (pos >= w->size) {
+			errno = EINVAL;
+			ret = WIMLIB_ERR_UNEXPECTED_END_OF_FILE;
+			break;
+		}
+		n = min(count, w->size - pos);
+		memcpy(buf, &w->data[pos], n);
+		w->last_use = ++ub->use_count;
+		buf += n;
+		count -= n;
+		offset += n;
+
+		/* Once a read gets past the middle of a window, read the next
+		 * window in the background.  */
+		if (pos + n >= UNBUFFERED_WINDOW_SIZE / 2 &&
+		    w->size == UNBUFFERED_WINDOW_SIZE)
+			request_read_ahead(fd, window_offset +
+					       UNBUFFERED_WINDOW_SIZE);
+	}
+	mutex_unlock(&ub->lock);
+	return ret;
+}
+
+/* full_pwrite() to a file opened for unbuffered I/O  */
+static int
+unbuffered_write(struct filedes *fd, const void *buf, size_t count, u64 offset)
+{
+	struct unbuffered_io *ub = fd->unbuffered;
+	int ret = 0;
+
+	mutex_lock(&ub->lock);
+	drop_windows(ub);
+	while (count) {
+		size_t n;
+
+		if (!ub->wbuf_active ||
+		    offset != ub->wbuf_offset + ub->wbuf_len ||
+		    ub->wbuf_len == UNBUFFERED_WINDOW_SIZE) {
+			ret = flush_write_buffer(fd);
+			if (ret)
+				break;
+			ret = start_write_buffer(fd, offset);
+			if (ret)
+				break;
+		}
+		n = min(count, UNBUFFERED_WINDOW_SIZE - ub->wbuf_len);
+		memcpy(&ub->wbuf[ub->wbuf_len], buf, n);
+		ub->wbuf_len += n;
+		buf += n;
+		count -= n;
+		offset += n;
+	}
+	mutex_unlock(&ub->lock);
+	return ret;
+}
+
+/* filedes_prefetch() for a file opened for unbuffered I/O: have the first
+ * window of the region which isn't present yet read in the background.  */
+static void
+unbuffered_prefetch(struct filedes *fd, u64 offset, u64 size)
+{
+	struct unbuffered_io *ub = fd->unbuffered;
+	u64 window_offset = offset & ~(u64)(UNBUFFERED_WINDOW_SIZE - 1);
+
+	mutex_lock(&ub->lock);
+	while (window_offset < offset + size && find_window(ub, window_offset))
+		window_offset += UNBUFFERED_WINDOW_SIZE;
+	if (window_offset < offset + size)
+		request_read_ahead(fd, window_offset);
+	mutex_unlock(&ub->lock);
+}
+
+/* Write out any buffered data, stop the read-ahead thread, and free the
+ * unbuffered I/O state, leaving @fd to be closed as usual.  */
+static int
+unbuffered_close(struct filedes *fd)
+{
+	struct unbuffered_io *ub = fd->unbuffered;
+	int ret;
+
+	mutex_lock(&ub->lock);
+	ret = flush_write_buffer(fd);
+	ub->stop_requested = true;
+	condvar_broadcast(&ub->cond);
+	mutex_unlock(&ub->lock);
+	if (ub->thread_started)
+		thread_join(&ub->thread);
+	free_unbuffered_io(ub);
+	fd->unbuffered = NULL;
+	return ret;
+}
+
+static int
+do_full_read(struct filedes *fd, void *buf, size_t count)
+{
+	if (fd->pipe_buffer)
+		return pipe_buffer_read(fd, buf, count);
+
+	if (fd->io) {
+		int ret = io_read(fd, buf, count, fd->offset);
+
+		if (ret == 0)
+			fd->offset += count;
+		return ret;
+	}
+
+	if (fd->unbuffered) {
+		int ret = unbuffered_read(fd, buf, count, fd->offset);
+
+		if (ret == 0)
+			fd->offset += count;
+		return ret;
+	}
+
 	while (count) {
 		ssize_t ret = read(fd->fd, buf, count);
 		if (unlikely(ret <= 0)) {
@@ -68,6 +807,25 @@ full_read(struct filedes *fd, void *buf, size_t count)
 	return 0;
 }
 
+/*
+ * Wrapper around read() that checks for errors and keeps retrying until all
+ * requested bytes have been read or until end-of file has occurred.
+ *
+ * Return values:
+ *	WIMLIB_ERR_SUCCESS			(0)
+ *	WIMLIB_ERR_READ				(errno set)
+ *	WIMLIB_ERR_UNEXPECTED_END_OF_FILE	(errno set to EINVAL)
+ */
+int
+full_read(struct filedes *fd, void *buf, size_t count)
+{
+	u64 start = perf_start();
+	int ret = do_full_read(fd, buf, count);
+
+	perf_end(PERF_READ, start, count);
+	return ret;
+}
+
 static int
 pipe_read(struct filedes *fd, void *buf, size_t count, off_t offset)
 {
@@ -88,34 +846,35 @@ pipe_read(struct filedes *fd, void *buf, size_t count, off_t offset)
 		size_t bytes_to_read = min(offset - fd->offset, BUFFER_SIZE);
 		u8 dummy[bytes_to_read];
 
-		ret = full_read(fd, dummy, bytes_to_read);
+		ret = do_full_read(fd, dummy, bytes_to_read);
 		if (ret)
 			return ret;
 	}
 
 	/* Do the actual read.  */
-	return full_read(fd, buf, count);
+	return do_full_read(fd, buf, count);
 }
 
-/*
- * Wrapper around pread() that checks for errors and keeps retrying until all
- * requested bytes have been read or until end-of file has occurred.  This also
- * transparently handle reading from pipe files, but the caller needs to be sure
- * the requested offset is greater than or equal to the current offset, or else
- * WIMLIB_ERR_RESOURCE_ORDER will be returned.
- *
- * Return values:
- *	WIMLIB_ERR_SUCCESS			(0)
- *	WIMLIB_ERR_READ				(errno set)
- *	WIMLIB_ERR_UNEXPECTED_END_OF_FILE	(errno set to EINVAL)
- *	WIMLIB_ERR_RESOURCE_ORDER		(errno set to ESPIPE)
- */
-int
-full_pread(struct filedes *fd, void *buf, size_t count, off_t offset)
+static int
+do_full_pread(struct filedes *fd, void *buf, size_t count, off_t offset)
 {
+	const void *mapped;
+
 	if (fd->is_pipe)
 		goto is_pipe;
 
+	if (fd->io)
+		return io_read(fd, buf, count, offset);
+
+	if (fd->unbuffered)
+		return unbuffered_read(fd, buf, count, offset);
+
+	mapped = filedes_mapped_data(fd, offset, count);
+	if (mapped) {
+		memcpy(buf, mapped, count);
+		return 0;
+	}
+
 	while (count) {
 		ssize_t ret = pread(fd->fd, buf, count, offset);
 		if (unlikely(ret <= 0)) {
@@ -142,16 +901,41 @@ is_pipe:
 }
 
 /*
- * Wrapper around write() that checks for errors and keeps retrying until all
- * requested bytes have been written.
+ * Wrapper around pread() that checks for errors and keeps retrying until all
+ * requested bytes have been read or until end-of file has occurred.  This also
+ * transparently handle reading from pipe files, but the caller needs to be sure
+ * the requested offset is greater than or equal to the current offset, or else
+ * WIMLIB_ERR_RESOURCE_ORDER will be returned.
  *
  * Return values:
  *	WIMLIB_ERR_SUCCESS			(0)
- *	WIMLIB_ERR_WRITE			(errno set)
+ *	WIMLIB_ERR_READ				(errno set)
+ *	WIMLIB_ERR_UNEXPECTED_END_OF_FILE	(errno set to EINVAL)
+ *	WIMLIB_ERR_RESOURCE_ORDER		(errno set to ESPIPE)
  */
 int
-full_write(struct filedes *fd, const void *buf, size_t count)
+full_pread(struct filedes *fd, void *buf, size_t count, off_t offset)
+{
+	u64 start = perf_start();
+	int ret = do_full_pread(fd, buf, count, offset);
+
+	perf_end(PERF_READ, start, count);
+	return ret;
+}
+
+static int
+do_full_write(struct filedes *fd, const void *buf, size_t count)
 {
+	if (fd->integrity_stream)
+		integrity_stream_write(fd->integrity_stream, buf, count,
+				       fd->offset);
+	if (fd->unbuffered) {
+		int ret = unbuffered_write(fd, buf, count, fd->offset);
+
+		if (ret == 0)
+			fd->offset += count;
+		return ret;
+	}
 	while (count) {
 		ssize_t ret = write(fd->fd, buf, count);
 		if (unlikely(ret < 0)) {
@@ -166,18 +950,115 @@ full_write(struct filedes *fd, const void *buf, size_t count)
 	return 0;
 }
 
+/*
+ * The size of the regions in which data written to a file with write-behind
+ * enabled is flushed to disk.  Writeback of each region is started as soon as
+ * it has been written, and is waited for when the next region has been written,
+ * so at most about twice this much written data is waiting to be flushed.
+ */
+#define WRITE_BEHIND_SIZE	(8U << 20)
 
 /*
- * Wrapper around pwrite() that checks for errors and keeps retrying until all
+ * Make sure that the data written to the file ahead of the last
+ * WRITE_BEHIND_SIZE bytes is being flushed to disk, and drop the regions which
+ * have been flushed from the page cache.
+ *
+ * Errors in writing back the data are returned here, since a later fsync() of
+ * the file will not report them again.
+ */
+static int
+filedes_write_behind(struct filedes *fd)
+{
+#ifdef HAVE_SYNC_FILE_RANGE
+	/* Data rewritten before the current region is synced by the fsync().  */
+	if (fd->offset < fd->write_behind_offset)
+		fd->write_behind_offset = fd->offset;
+
+	while (fd->offset - fd->write_behind_offset >= WRITE_BEHIND_SIZE) {
+		off_t start = fd->write_behind_offset;
+
+		if (sync_file_range(fd->fd, start, WRITE_BEHIND_SIZE,
+				    SYNC_FILE_RANGE_WRITE))
+			goto err;
+		if (start >= WRITE_BEHIND_SIZE) {
+			start -= WRITE_BEHIND_SIZE;
+			if (sync_file_range(fd->fd, start, WRITE_BEHIND_SIZE,
+					    SYNC_FILE_RANGE_WAIT_BEFORE |
+					    SYNC_FILE_RANGE_WRITE |
+					    SYNC_FILE_RANGE_WAIT_AFTER))
+				goto err;
+#ifdef HAVE_POSIX_FADVISE
+			(void)posix_fadvise(fd->fd, start, WRITE_BEHIND_SIZE,
+					    POSIX_FADV_DONTNEED);
+#endif
+		}
+		fd->write_behind_offset += WRITE_BEHIND_SIZE;
+	}
+	return 0;
+
+err:
+	/* Not supported for this file?  Then leave it all to the fsync().  */
+	if (errno == EINVAL || errno == ENOSYS || errno == ESPIPE) {
+		fd->write_behind = 0;
+		return 0;
+	}
+	return WIMLIB_ERR_WRITE;
+#else
+	fd->write_behind = 0;
+	return 0;
+#endif
+}
+
+/*
+ * Start flushing the data written to the file from its current offset onwards
+ * to disk while the writing continues, so that a final fsync() has little left
+ * to do and the written data doesn't build up in the page cache.  This is only
+ * done for regular files, and only where the operating system supports starting
+ * writeback of part of a file without waiting for it.
+ */
+void
+filedes_start_write_behind(struct filedes *fd)
+{
+#ifdef HAVE_SYNC_FILE_RANGE
+	struct stat st;
+
+	if (fd->io || fd->is_pipe || fd->unbuffered ||
+	    fstat(fd->fd, &st) || !S_ISREG(st.st_mode))
+		return;
+	fd->write_behind = 1;
+	fd->write_behind_offset = fd->offset;
+#endif
+}
+
+/*
+ * Wrapper around write() that checks for errors and keeps retrying until all
  * requested bytes have been written.
  *
  * Return values:
- *	WIMLIB_ERR_SUCCESS	(0)
- *	WIMLIB_ERR_WRITE	(errno set)
+ *	WIMLIB_ERR_SUCCESS			(0)
+ *	WIMLIB_ERR_WRITE			(errno set)
  */
 int
-full_pwrite(struct filedes *fd, const void *buf, size_t count, off_t offset)
+full_write(struct filedes *fd, const void *buf, size_t count)
 {
+	u64 start = perf_start();
+	int ret = do_full_write(fd, buf, count);
+
+	if (!ret && fd->write_behind)
+		ret = filedes_write_behind(fd);
+	perf_end(PERF_WRITE, start, count);
+	return ret;
+}
+
+
+static int
+do_full_pwrite(struct filedes *fd, const void *buf, size_t count, off_t offset)
+{
+	if (fd->integrity_stream)
+		integrity_stream_write(fd->integrity_stream, buf, count,
+				       offset);
+	if (fd->unbuffered)
+		return unbuffered_write(fd, buf, count, offset);
 	while (count) {
 		ssize_t ret = pwrite(fd->fd, buf, count, offset);
 		if (unlikely(ret < 0)) {
@@ -192,15 +1073,416 @@ full_pwrite(struct filedes *fd, const void *buf, size_t count, off_t offset)
 	return 0;
 }
 
+/*
+ * Wrapper around pwrite() that checks for errors and keeps retrying until all
+ * requested bytes have been written.
+ *
+ * Return values:
+ *	WIMLIB_ERR_SUCCESS	(0)
+ *	WIMLIB_ERR_WRITE	(errno set)
+ */
+int
+full_pwrite(struct filedes *fd, const void *buf, size_t count, off_t offset)
+{
+	u64 start = perf_start();
+	int ret = do_full_pwrite(fd, buf, count, offset);
+
+	perf_end(PERF_WRITE, start, count);
+	return ret;
+}
+
+#ifdef HAVE_PWRITEV
+/* The most buffers passed to one pwritev().  POSIX only guarantees that
+ * IOV_MAX is at least 16.  */
+#define PWRITEV_MAX_SPANS	16
+#endif
+
+static int
+do_full_pwritev(struct filedes *fd, const struct chunk_span *spans,
+		size_t num_spans, off_t offset)
+{
+#ifdef HAVE_PWRITEV
+	if (!fd->integrity_stream && !fd->unbuffered) {
+		struct iovec iov[PWRITEV_MAX_SPANS];
+		size_t n = 0;
+
+		while (n || num_spans) {
+			ssize_t ret;
+			size_t done;
+
+			while (n < ARRAY_LEN(iov) && num_spans) {
+				iov[n].iov_base = (void *)spans->data;
+				iov[n].iov_len = spans->size;
+				n++;
+				spans++;
+				num_spans--;
+			}
+			ret = pwritev(fd->fd, iov, n, offset);
+			if (unlikely(ret < 0)) {
+				if (errno == EINTR)
+					continue;
+				return WIMLIB_ERR_WRITE;
+			}
+			offset += ret;
+
+			/* Drop the buffers that were fully written, and
+			 * advance into the one that was partially written, if
+			 * any.  */
+			for (done = 0;
+			     done < n && (size_t)ret >= iov[done].iov_len;
+			     done++)
+				ret -= iov[done].iov_len;
+			if (done < n) {
+				iov[done].iov_base =
+					(u8 *)iov[done].iov_base + ret;
+				iov[done].iov_len -= ret;
+			}
+			n -= done;
+			memmove(iov, &iov[done], n * sizeof(iov[0]));
+		}
+		return 0;
+	}
+#endif /* HAVE_PWRITEV */
+	for (size_t i = 0; i < num_spans; i++) {
+		int ret = do_full_pwrite(fd, spans[i].data, spans[i].size,
+					 offset);
+		if (ret)
+			return ret;
+		offset += spans[i].size;
+	}
+	return 0;
+}
+
+/*
+ * Like full_pwrite(), but writes the data of @num_spans buffers one after
+ * another, starting at @offset.  If possible, this is done with vectored
+ * writes rather than with one write per buffer.
+ *
+ * Return values:
+ *	WIMLIB_ERR_SUCCESS	(0)
+ *	WIMLIB_ERR_WRITE	(errno set)
+ */
+int
+full_pwritev(struct filedes *fd, const struct chunk_span *spans,
+	     size_t num_spans, off_t offset)
+{
+	u64 start = perf_start();
+	u64 count = 0;
+	int ret;
+
+	for (size_t i = 0; i < num_spans; i++)
+		count += spans[i].size;
+	ret = do_full_pwritev(fd, spans, num_spans, offset);
+	perf_end(PERF_WRITE, start, count);
+	return ret;
+}
+
+/*
+ * Tell the operating system that the specified region of the file will be read
+ * soon, so that it can start reading it into memory asynchronously.  This is
+ * only a hint; it does nothing if not supported or if the file is a pipe.
+ */
+void
+filedes_prefetch(struct filedes *fd, off_t offset, u64 size)
+{
+	if (fd->io) {
+		if (fd->io->prefetch && size != 0)
+			fd->io->prefetch(fd->io->ctx, offset, size);
+		return;
+	}
+	if (fd->unbuffered) {
+		if (size != 0)
+			unbuffered_prefetch(fd, offset, size);
+		return;
+	}
+#ifdef HAVE_POSIX_FADVISE
+	if (fd->is_pipe || size == 0)
+		return;
+	(void)posix_fadvise(fd->fd, offset, size, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/*
+ * Called during a sequential read of the region of the file set up by
+ * read_ahead_init(), when the read has reached @cur_offset.  If less than half
+ * of READ_AHEAD_SIZE bytes beyond @cur_offset have been prefetched, then
+ * prefetch the next READ_AHEAD_SIZE bytes (limited to the end of the region).
+ * This keeps the I/O for the upcoming data in flight while the current data is
+ * being processed, which matters most when the file is on a slow or
+ * high-latency device such as a network share.
+ */
+void
+read_ahead_advance(struct filedes *fd, struct read_ahead *ra, u64 cur_offset)
+{
+	u64 size;
+
+	if (ra->next_offset >= ra->end_offset ||
+	    cur_offset + READ_AHEAD_SIZE / 2 < ra->next_offset)
+		return;
+
+	ra->next_offset = max(ra->next_offset, cur_offset);
+	size = min(READ_AHEAD_SIZE, ra->end_offset - ra->next_offset);
+	filedes_prefetch(fd, ra->next_offset, size);
+	ra->next_offset += size;
+}
+
+/*
+ * Map the first @size bytes of the file into memory, read-only, so that reads
+ * of that region can be served directly from the page cache without copying.
+ * The mapping is advised for sequential access.  Mapping is only an
+ * optimization, so if it isn't supported or fails, the file descriptor is
+ * simply left unmapped and reads continue to use pread().
+ *
+ * Note that if the file is truncated while it is mapped, then accessing the
+ * mapped pages beyond the new end of the file will raise SIGBUS.
+ *
+ * Returns 0, or WIMLIB_ERR_UNSUPPORTED if memory mapping isn't supported on
+ * this platform or can't be used for this file.
+ */
+int
+filedes_map(struct filedes *fd, u64 size)
+{
+#ifdef HAVE_MMAP
+	void *map;
+
+	if (fd->is_pipe || fd->unbuffered || size == 0 || size > SIZE_MAX)
+		return WIMLIB_ERR_UNSUPPORTED;
+
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd->fd, 0);
+	if (map == MAP_FAILED)
+		return WIMLIB_ERR_UNSUPPORTED;
+#ifdef MADV_SEQUENTIAL
+	(void)madvise(map, size, MADV_SEQUENTIAL);
+#endif
+	fd->map = map;
+	fd->map_size = size;
+	return 0;
+#else
+	return WIMLIB_ERR_UNSUPPORTED;
+#endif
+}
+
+/* Undo filedes_map(), if the file is currently mapped.  */
+void
+filedes_unmap(struct filedes *fd)
+{
+#ifdef HAVE_MMAP
+	if (fd->map)
+		munmap((void *)fd->map, fd->map_size);
+#endif
+	fd->map = NULL;
+	fd->map_size = 0;
+}
+
+/* Unbuffered I/O isn't supported on Windows, where win32_pread() can't be used
+ * by the read-ahead thread and another thread at the same time.  */
+static int
+open_unbuffered(const tchar *path, int open_flags, mode_t mode)
+{
+#if defined(O_DIRECT) && !defined(_WIN32)
+	return topen(path, open_flags | O_DIRECT, mode);
+#else
+	errno = EINVAL;
+	return -1;
+#endif
+}
+
+/*
+ * Open the file @path with the specified open() flags and mode, and set up @fd
+ * for it.  If @unbuffered, then a regular file is opened for unbuffered I/O if
+ * the operating system and the filesystem support it; otherwise it is opened
+ * normally, so this is only a hint.  Returns 0, or -1 with errno set.
+ */
+int
+filedes_open(struct filedes *fd, const tchar *path, int open_flags,
+	     mode_t mode, bool unbuffered)
+{
+	struct unbuffered_io *ub = NULL;
+	int raw_fd = -1;
+
+	if (unbuffered)
+		ub = new_unbuffered_io();
+	if (ub) {
+		struct stat st;
+
+		raw_fd = open_unbuffered(path, open_flags, mode);
+		if (raw_fd < 0 && errno != EINVAL) {
+			free_unbuffered_io(ub);
+			return -1;
+		}
+		if (raw_fd >= 0 &&
+		    (fstat(raw_fd, &st) || !S_ISREG(st.st_mode))) {
+			close(raw_fd);
+			raw_fd = -1;
+		}
+		if (raw_fd >= 0) {
+			ub->file_size = st.st_size;
+		} else {
+			free_unbuffered_io(ub);
+			ub = NULL;
+		}
+	}
+	if (raw_fd < 0)
+		raw_fd = topen(path, open_flags | O_BINARY, mode);
+	if (raw_fd < 0)
+		return -1;
+	filedes_init(fd, raw_fd);
+	fd->unbuffered = ub;
+	return 0;
+}
+
+/* Write any data buffered for the file to disk, like fsync().  Returns 0, or -1
+ * with errno set.  */
+int
+filedes_sync(struct filedes *fd)
+{
+	if (fd->unbuffered) {
+		int ret;
+
+		mutex_lock(&fd->unbuffered->lock);
+		ret = flush_write_buffer(fd);
+		mutex_unlock(&fd->unbuffered->lock);
+		if (ret)
+			return -1;
+	}
+	return fsync(fd->fd);
+}
+
+/* Set the size of the file, like ftruncate().  Returns 0, or -1 with errno
+ * set.  */
+int
+filedes_truncate(struct filedes *fd, u64 size)
+{
+	struct unbuffered_io *ub = fd->unbuffered;
+	int ret = 0;
+
+	if (!ub)
+		return ftruncate(fd->fd, size);
+
+	mutex_lock(&ub->lock);
+	drop_windows(ub);
+	if (flush_write_buffer(fd) || ftruncate(fd->fd, size))
+		ret = -1;
+	else
+		ub->file_size = size;
+	mutex_unlock(&ub->lock);
+	return ret;
+}
+
+/* Forget any data of the file which has been read and kept in memory, since the
+ * file has been (or is about to be) modified through another file descriptor.
+ */
+void
+filedes_forget_cached_data(struct filedes *fd)
+{
+	struct unbuffered_io *ub = fd->unbuffered;
+
+	filedes_unmap(fd);
+	if (ub) {
+		mutex_lock(&ub->lock);
+		drop_windows(ub);
+		mutex_unlock(&ub->lock);
+	}
+}
+
+/*
+ * Set up @fd to read the file provided through the specified callbacks, which
+ * are copied.  The file is then read through full_read() and full_pread() as
+ * usual, except that it can't be mapped into memory or otherwise accessed
+ * through a file descriptor.  filedes_close() calls the close callback.
+ */
+int
+filedes_init_io(struct filedes *fd, const struct wimlib_io_provider *io)
+{
+	filedes_init(fd, -1);
+	fd->io = memdup(io, sizeof(*io));
+	if (!fd->io)
+		return WIMLIB_ERR_NOMEM;
+	return 0;
+}
+
+int
+filedes_close(struct filedes *fd)
+{
+	filedes_stop_pipe_buffer(fd);
+	filedes_unmap(fd);
+	if (fd->io) {
+		if (fd->io->close)
+			fd->io->close(fd->io->ctx);
+		FREE(fd->io);
+		fd->io = NULL;
+		return 0;
+	}
+	if (fd->unbuffered && unbuffered_close(fd)) {
+		int saved_errno = errno;
+
+		close(fd->fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return close(fd->fd);
+}
+
+/* Creates a temporary file opened for reading and writing.  The open file
+ * descriptor is returned in @fd_ret and its name is returned in @name_ret
+ * (dynamically allocated).  */
+int
+create_temporary_file(struct filedes *fd_ret, tchar **name_ret)
+{
+	tchar *name;
+	int raw_fd;
+
+#ifdef _WIN32
+retry:
+	name = _wtempnam(NULL, L"wimlib");
+	if (!name) {
+		ERROR_WITH_ERRNO("Failed to create temporary filename");
+		return WIMLIB_ERR_NOMEM;
+	}
+	raw_fd = _wopen(name, O_RDWR | O_CREAT | O_EXCL | O_BINARY |
+			_O_SHORT_LIVED, 0600);
+	if (raw_fd < 0 && errno == EEXIST) {
+		FREE(name);
+		goto retry;
+	}
+#else /* _WIN32 */
+	const char *tmpdir = getenv("TMPDIR");
+	if (!tmpdir)
+		tmpdir = P_tmpdir;
+	name = MALLOC(strlen(tmpdir) + 1 + 6 + 6 + 1);
+	if (!name)
+		return WIMLIB_ERR_NOMEM;
+	sprintf(name, "%s/wimlibXXXXXX", tmpdir);
+	raw_fd = mkstemp(name);
+#endif /* !_WIN32 */
+
+	if (raw_fd < 0) {
+		ERROR_WITH_ERRNO("Failed to create temporary file "
+				 "\"%"TS"\"", name);
+		FREE(name);
+		return WIMLIB_ERR_OPEN;
+	}
+
+	filedes_init(fd_ret, raw_fd);
+	*name_ret = name;
+	return 0;
+}
+
 off_t filedes_seek(struct filedes *fd, off_t offset)
 {
 	if (fd->is_pipe) {
 		errno = ESPIPE;
 		return -1;
 	}
+	if (fd->io) {
+		fd->offset = offset;
+		return offset;
+	}
 	if (fd->offset != offset) {
 		if (lseek(fd->fd, offset, SEEK_SET) == -1)
 			return -1;
+		if (fd->integrity_stream && offset < fd->offset)
+			integrity_stream_rewind(fd->integrity_stream, offset);
 		fd->offset = offset;
 	}
 	return offset;
@@ -208,5 +1490,7 @@ off_t filedes_seek(struct filedes *fd, off_t offset)
 
 bool filedes_is_seekable(struct filedes *fd)
 {
+	if (fd->io)
+		return true;
 	return !fd->is_pipe && lseek(fd->fd, 0, SEEK_CUR) != -1;
 }
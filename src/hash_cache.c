@@ -0,0 +1,470 @@
+/*
+ * hash_cache.c
+ *
+ * A record of the SHA-1 message digests of files captured earlier, so that
+ * later captures of the same files can deduplicate their data without reading
+ * it.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wimlib/blob_table.h"
+#include "wimlib/endianness.h"
+#include "wimlib/error.h"
+#include "wimlib/file_io.h"
+#include "wimlib/hash_cache.h"
+#include "wimlib/inode.h"
+#include "wimlib/metadata.h"
+#include "wimlib/scan.h"
+#include "wimlib/sha1.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
+#include "wimlib/win32.h" /* win32_rename_replacement() */
+
+/*
+ * The cache file consists of a header followed by one entry for each file
+ * whose data was captured.  An entry identifies a file by its device (or
+ * volume) and inode number (or file ID), and records the file's size, last
+ * write time, and last change time as of the capture together with the SHA-1
+ * message digest of its unnamed data stream.  A later capture uses the digest
+ * only if the size and both timestamps are unchanged, which is the same
+ * heuristic that tools such as 'make' and 'rsync' rely on.  The change time
+ * can't be set by applications on UNIX, so it catches files whose last write
+ * time was restored after their contents were modified.
+ *
+ * A digest from the cache is trusted only as far as deduplication goes: if no
+ * blob with that digest is present already, then the data is read anyway when
+ * it's written, and a digest which no longer matches gets reported then.
+ *
+ * The digest of a file missing from the cache isn't known until the file's
+ * data is written, so the files scanned are remembered until the WIM is
+ * written, then the cache file is rewritten to include them.
+ */
+
+#define HASH_CACHE_MAGIC	0x4548434148534857ULL	/* "WHSHACHE" */
+#define HASH_CACHE_VERSION	1
+
+struct hash_cache_header {
+	le64 magic;
+	le32 version;
+	le32 entry_size;
+	le64 num_entries;
+} __attribute__((packed));
+
+struct hash_cache_entry {
+	le64 dev;
+	le64 ino;
+	le64 size;
+	le64 last_write_time;
+	le64 change_time;
+	u8 hash[SHA1_HASH_SIZE];
+} __attribute__((packed));
+
+/* A file scanned with a cache miss  */
+struct pending_hash {
+	const struct wim_inode *inode;
+	struct hash_cache_key key;
+};
+
+static int
+cmp_hash_cache_entries(const void *p1, const void *p2)
+{
+	const struct hash_cache_entry *entry1 = p1;
+	const struct hash_cache_entry *entry2 = p2;
+	int res;
+
+	res = cmp_u64(le64_to_cpu(entry1->dev), le64_to_cpu(entry2->dev));
+	if (res)
+		return res;
+	return cmp_u64(le64_to_cpu(entry1->ino), le64_to_cpu(entry2->ino));
+}
+
+static int
+cmp_pending_hashes(const void *p1, const void *p2)
+{
+	const struct pending_hash *pending1 = p1;
+	const struct pending_hash *pending2 = p2;
+
+	return cmp_u64((uintptr_t)pending1->inode, (uintptr_t)pending2->inode);
+}
+
+static void
+read_hash_cache_file(struct hash_cache *cache)
+{
+	struct hash_cache_header hdr;
+	struct filedes fd;
+	struct stat st;
+	int raw_fd;
+	u64 num_entries;
+
+	raw_fd = topen(cache->path, O_RDONLY | O_BINARY);
+	if (raw_fd < 0) {
+		if (errno != ENOENT)
+			WARNING_WITH_ERRNO("Can't open \"%"TS"\"", cache->path);
+		return;
+	}
+	filedes_init(&fd, raw_fd);
+
+	if (fstat(raw_fd, &st) || full_read(&fd, &hdr, sizeof(hdr)))
+		goto bad_cache;
+	if (le64_to_cpu(hdr.magic) != HASH_CACHE_MAGIC ||
+	    le32_to_cpu(hdr.version) != HASH_CACHE_VERSION ||
+	    le32_to_cpu(hdr.entry_size) != sizeof(struct hash_cache_entry))
+		goto bad_cache;
+
+	num_entries = le64_to_cpu(hdr.num_entries);
+	if (num_entries > ((u64)st.st_size - sizeof(hdr)) /
+			  sizeof(struct hash_cache_entry))
+		goto bad_cache;
+	cache->entries = MALLOC(num_entries * sizeof(cache->entries[0]));
+	if (!cache->entries) {
+		WARNING("Not enough memory to load \"%"TS"\"", cache->path);
+		goto out_close;
+	}
+	if (full_read(&fd, cache->entries,
+		      num_entries * sizeof(cache->entries[0]))) {
+		FREE(cache->entries);
+		cache->entries = NULL;
+		goto bad_cache;
+	}
+	cache->num_entries = num_entries;
+	qsort(cache->entries, num_entries, sizeof(cache->entries[0]),
+	      cmp_hash_cache_entries);
+	goto out_close;
+
+bad_cache:
+	WARNING("Ignoring invalid hash cache \"%"TS"\"", cache->path);
+out_close:
+	filedes_close(&fd);
+}
+
+static void
+make_hash_cache_entry(struct hash_cache_entry *entry,
+		      const struct hash_cache_key *key, const u8 *hash)
+{
+	entry->dev = cpu_to_le64(key->dev);
+	entry->ino = cpu_to_le64(key->ino);
+	entry->size = cpu_to_le64(key->size);
+	entry->last_write_time = cpu_to_le64(key->last_write_time);
+	entry->change_time = cpu_to_le64(key->change_time);
+	if (hash)
+		copy_hash(entry->hash, hash);
+}
+
+/* Return the entry for the file @key if the file is unchanged since the entry
+ * was made, otherwise NULL.  */
+static const struct hash_cache_entry *
+lookup_hash_cache_entry(const struct hash_cache *cache,
+			const struct hash_cache_key *key)
+{
+	struct hash_cache_entry needle;
+	const struct hash_cache_entry *entry;
+
+	if (!cache->num_entries)
+		return NULL;
+	make_hash_cache_entry(&needle, key, NULL);
+	entry = bsearch(&needle, cache->entries, cache->num_entries,
+			sizeof(cache->entries[0]), cmp_hash_cache_entries);
+	if (entry &&
+	    le64_to_cpu(entry->size) == key->size &&
+	    le64_to_cpu(entry->last_write_time) == key->last_write_time &&
+	    le64_to_cpu(entry->change_time) == key->change_time)
+		return entry;
+	return NULL;
+}
+
+static int
+add_pending_hash(struct hash_cache *cache, const struct wim_inode *inode,
+		 const struct hash_cache_key *key)
+{
+	if (cache->num_pending == cache->pending_alloc) {
+		size_t new_alloc = max(cache->pending_alloc * 2, (size_t)64);
+		struct pending_hash *new_pending;
+
+		new_pending = REALLOC(cache->pending,
+				      new_alloc * sizeof(cache->pending[0]));
+		if (!new_pending)
+			return WIMLIB_ERR_NOMEM;
+		cache->pending = new_pending;
+		cache->pending_alloc = new_alloc;
+	}
+	cache->pending[cache->num_pending].inode = inode;
+	cache->pending[cache->num_pending].key = *key;
+	cache->num_pending++;
+	return 0;
+}
+
+/*
+ * Called by the scan implementations after scanning the data streams of the
+ * regular file @inode, which is the file @key on disk, when a hash cache is in
+ * use.  If the cache has the SHA-1 message digest of the file's unnamed data
+ * stream, then the blob is hashed and deduplicated right away, as with an
+ * unchanged file in a template image.  Otherwise, the file is remembered so
+ * that its digest can be added to the cache once it's known.
+ */
+int
+apply_capture_hash_cache(struct scan_params *params, struct wim_inode *inode,
+			 const struct hash_cache_key *key)
+{
+	struct hash_cache *cache = params->hash_cache;
+	const struct wim_inode_stream *strm;
+	const struct hash_cache_entry *entry;
+	struct blob_descriptor *blob, **back_ptr;
+
+	if (inode->i_nlink != 1)
+		return 0;
+	strm = inode_get_unnamed_data_stream(inode);
+	if (!strm)
+		return 0;
+	blob = stream_blob_resolved(strm);
+	if (!blob || !blob->unhashed || blob->size != key->size)
+		return 0;
+
+	entry = lookup_hash_cache_entry(cache, key);
+	if (!entry)
+		return add_pending_hash(cache, inode, key);
+
+	back_ptr = retrieve_pointer_to_unhashed_blob(blob);
+	copy_hash(blob->hash, entry->hash);
+	if (after_blob_hashed(blob, back_ptr, params->blob_table,
+			      inode) != blob) {
+		params->progress.scan.num_bytes_unchanged += blob->size;
+		free_blob_descriptor(blob);
+	}
+	return 0;
+}
+
+/*
+ * Collect the entries for the pending files of @cache which are in the images
+ * of @wim and have been hashed, sorted by file identity.  A pending file is
+ * recognized again by its inode, which exists until its image is freed, so the
+ * inodes of the images that are loaded are looked up among the pending files
+ * rather than the other way around.
+ */
+static struct hash_cache_entry *
+collect_new_hash_cache_entries(struct hash_cache *cache, WIMStruct *wim,
+			       size_t *num_entries_ret)
+{
+	struct hash_cache_entry *entries;
+	size_t num_entries = 0;
+
+	entries = MALLOC(cache->num_pending * sizeof(entries[0]));
+	if (!entries)
+		return NULL;
+
+	qsort(cache->pending, cache->num_pending, sizeof(cache->pending[0]),
+	      cmp_pending_hashes);
+
+	for (int i = 0; i < wim->hdr.image_count; i++) {
+		struct wim_image_metadata *imd = wim->image_metadata[i];
+		struct wim_inode *inode;
+
+		if (!is_image_loaded(imd))
+			continue;
+		image_for_each_inode(inode, imd) {
+			struct pending_hash needle = { .inode = inode };
+			const struct pending_hash *pending;
+			const struct wim_inode_stream *strm;
+			const struct blob_descriptor *blob;
+
+			pending = bsearch(&needle, cache->pending,
+					  cache->num_pending,
+					  sizeof(cache->pending[0]),
+					  cmp_pending_hashes);
+			if (!pending)
+				continue;
+			strm = inode_get_unnamed_data_stream(inode);
+			if (!strm || !strm->stream_resolved)
+				continue;
+			blob = stream_blob_resolved(strm);
+			if (!blob || blob->unhashed ||
+			    blob->size != pending->key.size ||
+			    inode->i_last_write_time !=
+					pending->key.last_write_time)
+				continue;
+			make_hash_cache_entry(&entries[num_entries++],
+					      &pending->key, blob->hash);
+		}
+	}
+	qsort(entries, num_entries, sizeof(entries[0]), cmp_hash_cache_entries);
+	*num_entries_ret = num_entries;
+	return entries;
+}
+
+/* Merge the sorted arrays of entries @old and @new, with an entry in @new
+ * replacing the entry for the same file in @old.  */
+static size_t
+merge_hash_cache_entries(struct hash_cache_entry *out,
+			 const struct hash_cache_entry *old, size_t num_old,
+			 const struct hash_cache_entry *new, size_t num_new)
+{
+	size_t i = 0, j = 0, n = 0;
+
+	while (i < num_old || j < num_new) {
+		int res;
+
+		if (i == num_old)
+			res = 1;
+		else if (j == num_new)
+			res = -1;
+		else
+			res = cmp_hash_cache_entries(&old[i], &new[j]);
+
+		if (res < 0) {
+			out[n++] = old[i++];
+		} else {
+			if (res == 0)
+				i++;
+			out[n++] = new[j++];
+		}
+	}
+	return n;
+}
+
+static void
+write_hash_cache_file(const struct hash_cache *cache)
+{
+	struct hash_cache_header hdr;
+	struct filedes fd;
+	size_t path_len;
+	int raw_fd;
+	int ret;
+
+	hdr.magic = cpu_to_le64(HASH_CACHE_MAGIC);
+	hdr.version = cpu_to_le32(HASH_CACHE_VERSION);
+	hdr.entry_size = cpu_to_le32(sizeof(struct hash_cache_entry));
+	hdr.num_entries = cpu_to_le64(cache->num_entries);
+
+	/* Write a temporary file and rename it over the old cache, so that an
+	 * interrupted write can't leave a truncated cache behind.  */
+	path_len = tstrlen(cache->path);
+	tchar tmpfile[path_len + 10];
+	tmemcpy(tmpfile, cache->path, path_len);
+	get_random_alnum_chars(tmpfile + path_len, 9);
+	tmpfile[path_len + 9] = T('\0');
+
+	raw_fd = topen(tmpfile, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644);
+	if (raw_fd < 0) {
+		WARNING_WITH_ERRNO("Can't create \"%"TS"\"", tmpfile);
+		return;
+	}
+	filedes_init(&fd, raw_fd);
+	ret = full_write(&fd, &hdr, sizeof(hdr));
+	if (!ret)
+		ret = full_write(&fd, cache->entries,
+				 cache->num_entries * sizeof(cache->entries[0]));
+	if (filedes_close(&fd) && !ret)
+		ret = WIMLIB_ERR_WRITE;
+	if (ret) {
+		WARNING_WITH_ERRNO("Error writing \"%"TS"\"", tmpfile);
+		tunlink(tmpfile);
+		return;
+	}
+	if (trename(tmpfile, cache->path)) {
+		WARNING_WITH_ERRNO("Failed to rename \"%"TS"\" to \"%"TS"\"",
+				   tmpfile, cache->path);
+		tunlink(tmpfile);
+	}
+}
+
+/*
+ * Add the SHA-1 message digests of the files scanned with cache misses since
+ * the last call to the hash cache of @wim, if any, and rewrite the cache file.
+ * This is called after @wim has been written successfully, when the digests of
+ * all the files added to it are known.  Failing to update the cache isn't an
+ * error, since at worst it makes the next capture read more data.
+ */
+void
+save_capture_hash_cache(WIMStruct *wim)
+{
+	struct hash_cache *cache = wim->hash_cache;
+	struct hash_cache_entry *new_entries, *merged;
+	size_t num_new;
+
+	if (!cache || !cache->num_pending)
+		return;
+
+	new_entries = collect_new_hash_cache_entries(cache, wim, &num_new);
+	cache->num_pending = 0;
+	if (!new_entries)
+		goto out_nomem;
+	merged = MALLOC((cache->num_entries + num_new) * sizeof(merged[0]));
+	if (!merged) {
+		FREE(new_entries);
+		goto out_nomem;
+	}
+	cache->num_entries = merge_hash_cache_entries(merged, cache->entries,
+						      cache->num_entries,
+						      new_entries, num_new);
+	FREE(new_entries);
+	FREE(cache->entries);
+	cache->entries = merged;
+	write_hash_cache_file(cache);
+	return;
+
+out_nomem:
+	WARNING("Not enough memory to update \"%"TS"\"", cache->path);
+}
+
+void
+free_capture_hash_cache(struct hash_cache *cache)
+{
+	if (cache) {
+		FREE(cache->pending);
+		FREE(cache->entries);
+		FREE(cache->path);
+		FREE(cache);
+	}
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_capture_hash_cache(WIMStruct *wim, const tchar *path)
+{
+	struct hash_cache *cache = NULL;
+
+	if (!wim)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (path) {
+		cache = CALLOC(1, sizeof(*cache));
+		if (!cache)
+			return WIMLIB_ERR_NOMEM;
+		cache->path = TSTRDUP(path);
+		if (!cache->path) {
+			FREE(cache);
+			return WIMLIB_ERR_NOMEM;
+		}
+		read_hash_cache_file(cache);
+	}
+
+	free_capture_hash_cache(wim->hash_cache);
+	wim->hash_cache = cache;
+	return 0;
+}
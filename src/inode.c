@@ -30,6 +30,7 @@
 
 #include <errno.h>
 
+#include "wimlib/arena.h"
 #include "wimlib/assert.h"
 #include "wimlib/blob_table.h"
 #include "wimlib/dentry.h"
@@ -44,16 +45,10 @@
  */
 const utf16lechar NO_STREAM_NAME[1];
 
-/* Allocate a new inode and associate the specified dentry with it.  */
-struct wim_inode *
-new_inode(struct wim_dentry *dentry, bool set_timestamps)
+static void
+init_inode(struct wim_inode *inode, struct wim_dentry *dentry,
+	   bool set_timestamps)
 {
-	struct wim_inode *inode;
-
-	inode = CALLOC(1, sizeof(struct wim_inode));
-	if (!inode)
-		return NULL;
-
 	inode->i_security_id = -1;
 	/*inode->i_nlink = 0;*/
 	inode->i_rp_flags = WIM_RP_FLAG_NOT_FIXED;
@@ -66,6 +61,35 @@ new_inode(struct wim_dentry *dentry, bool set_timestamps)
 		inode->i_last_write_time = now;
 	}
 	d_associate(dentry, inode);
+}
+
+/* Allocate a new inode and associate the specified dentry with it.  */
+struct wim_inode *
+new_inode(struct wim_dentry *dentry, bool set_timestamps)
+{
+	struct wim_inode *inode;
+
+	inode = CALLOC(1, sizeof(struct wim_inode));
+	if (!inode)
+		return NULL;
+
+	init_inode(inode, dentry, set_timestamps);
+	return inode;
+}
+
+/* Like new_inode() with set_timestamps=false, but allocate the inode from
+ * @arena.  Such an inode must not outlive the arena.  */
+struct wim_inode *
+new_inode_in_arena(struct wim_dentry *dentry, struct mem_arena *arena)
+{
+	struct wim_inode *inode;
+
+	inode = arena_zalloc(arena, sizeof(struct wim_inode));
+	if (!inode)
+		return NULL;
+
+	inode->i_in_arena = 1;
+	init_inode(inode, dentry, false);
 	return inode;
 }
 
@@ -83,11 +107,12 @@ free_inode(struct wim_inode *inode)
 		destroy_stream(&inode->i_streams[i]);
 	if (inode->i_streams != inode->i_embedded_streams)
 		FREE(inode->i_streams);
-	if (inode->i_extra)
+	if (!inode->i_extra_in_arena)
 		FREE(inode->i_extra);
 	if (!hlist_unhashed(&inode->i_hlist_node))
 		hlist_del(&inode->i_hlist_node);
-	FREE(inode);
+	if (!inode->i_in_arena)
+		FREE(inode);
 }
 
 static inline void
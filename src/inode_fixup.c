@@ -23,13 +23,22 @@
 #  include "config.h"
 #endif
 
+#include "wimlib/bitops.h"
 #include "wimlib/dentry.h"
 #include "wimlib/error.h"
 #include "wimlib/inode.h"
-#include "wimlib/inode_table.h"
+#include "wimlib/util.h"
 
 struct inode_fixup_params {
-	struct wim_inode_table inode_table;
+	/* Open-addressed hash table of the inodes which have a nonzero inode
+	 * number, with 'mask + 1' slots (a power of 2)  */
+	struct wim_inode **slots;
+	size_t mask;
+
+	/* List of the resulting inodes which aren't in the table  */
+	struct hlist_head *inode_list;
+
+	size_t num_hard_link_dentries;
 	unsigned long num_dir_hard_links;
 	unsigned long num_inconsistent_inodes;
 };
@@ -57,23 +66,37 @@ inodes_consistent(const struct wim_inode *inode_1,
 			    inode_get_hash_of_unnamed_data_stream(inode_2));
 }
 
+/* Inodes with inode number 0 have only one link, so go straight to the inode
+ * list.  Count the others.  */
+static int
+list_unlinked_inode(struct wim_dentry *dentry, void *_params)
+{
+	struct inode_fixup_params *params = _params;
+	struct wim_inode *d_inode = dentry->d_inode;
+
+	if (d_inode->i_ino == 0)
+		hlist_add_head(&d_inode->i_hlist_node, params->inode_list);
+	else
+		params->num_hard_link_dentries++;
+	return 0;
+}
+
 static int
 inode_table_insert(struct wim_dentry *dentry, void *_params)
 {
 	struct inode_fixup_params *params = _params;
-	struct wim_inode_table *table = &params->inode_table;
 	struct wim_inode *d_inode = dentry->d_inode;
 	size_t pos;
 	struct wim_inode *inode;
 
-	if (d_inode->i_ino == 0) {
-		hlist_add_head(&d_inode->i_hlist_node, &table->extra_inodes);
+	if (d_inode->i_ino == 0) /* Already listed */
 		return 0;
-	}
 
 	/* Try adding this dentry to an existing inode.  */
-	pos = hash_inode(table, d_inode->i_ino, 0);
-	hlist_for_each_entry(inode, &table->array[pos], i_hlist_node) {
+	for (pos = hash_u64(d_inode->i_ino) & params->mask;
+	     (inode = params->slots[pos]) != NULL;
+	     pos = (pos + 1) & params->mask)
+	{
 		if (inode->i_ino != d_inode->i_ino) {
 			continue;
 		}
@@ -106,32 +129,20 @@ inode_table_insert(struct wim_dentry *dentry, void *_params)
 		return 0;
 	}
 
-	/* Keep this dentry's inode.  */
-	hlist_add_head(&d_inode->i_hlist_node, &table->array[pos]);
-	if (++table->filled > table->capacity)
-		enlarge_inode_table(table);
+	/* Keep this dentry's inode.  The table was sized so that it can't
+	 * fill up.  */
+	params->slots[pos] = d_inode;
 	return 0;
 }
 
+/* Move the inodes from the hash table to the inode list.  */
 static void
-hlist_move_all(struct hlist_head *src, struct hlist_head *dest)
+build_inode_list(struct inode_fixup_params *params)
 {
-	struct hlist_node *node;
-
-	while ((node = src->first) != NULL) {
-		hlist_del(node);
-		hlist_add_head(node, dest);
-	}
-}
-
-/* Move the inodes from the 'struct wim_inode_table' to the 'inode_list'.  */
-static void
-build_inode_list(struct wim_inode_table *inode_table,
-		 struct hlist_head *inode_list)
-{
-	hlist_move_all(&inode_table->extra_inodes, inode_list);
-	for (size_t i = 0; i < inode_table->capacity; i++)
-		hlist_move_all(&inode_table->array[i], inode_list);
+	for (size_t i = 0; i <= params->mask; i++)
+		if (params->slots[i])
+			hlist_add_head(&params->slots[i]->i_hlist_node,
+				       params->inode_list);
 }
 
 /* Re-assign inode numbers to the inodes in the list.  */
@@ -165,6 +176,10 @@ reassign_inode_numbers(struct hlist_head *inode_list)
  *   install.wim for Windows 7.  I try to work around this in the same way
  *   the Microsoft implementation works around this.
  *
+ * Writers such as wimlib set 'hard_link_group_id' to 0 for all files which
+ * aren't hard linked, so in images without hard links, no inode numbers need to
+ * be looked up at all.
+ *
  * Returns 0 or WIMLIB_ERR_NOMEM.  On success, the resulting inodes will be
  * appended to the @inode_list, and they will have consistent numbers in their
  * i_ino fields.
@@ -173,30 +188,156 @@ int
 dentry_tree_fix_inodes(struct wim_dentry *root, struct hlist_head *inode_list)
 {
 	struct inode_fixup_params params;
-	int ret;
-
-	/* We use a hash table to map inode numbers to inodes.  */
-
-	ret = init_inode_table(&params.inode_table, 64);
-	if (ret)
-		return ret;
 
+	params.inode_list = inode_list;
+	params.num_hard_link_dentries = 0;
 	params.num_dir_hard_links = 0;
 	params.num_inconsistent_inodes = 0;
 
-	for_dentry_in_tree(root, inode_table_insert, &params);
+	for_dentry_in_tree(root, list_unlinked_inode, &params);
+
+	if (params.num_hard_link_dentries) {
+		size_t num_slots;
+
+		/* We use a hash table to map inode numbers to inodes.  It's
+		 * sized so that it is at most half full.  */
+		if (params.num_hard_link_dentries > SIZE_MAX / 4 / sizeof(void *))
+			return WIMLIB_ERR_NOMEM;
+		num_slots = roundup_pow_of_2(max(params.num_hard_link_dentries * 2,
+						 16));
+		params.slots = CALLOC(num_slots, sizeof(params.slots[0]));
+		if (!params.slots)
+			return WIMLIB_ERR_NOMEM;
+		params.mask = num_slots - 1;
 
-	/* Generate the resulting list of inodes, and if needed reassign
-	 * the inode numbers.  */
-	build_inode_list(&params.inode_table, inode_list);
-	destroy_inode_table(&params.inode_table);
+		for_dentry_in_tree(root, inode_table_insert, &params);
+
+		/* Generate the resulting list of inodes.  */
+		build_inode_list(&params);
+		FREE(params.slots);
+	}
 
 	if (unlikely(params.num_dir_hard_links))
 		WARNING("Ignoring %lu directory hard links",
 			params.num_dir_hard_links);
 
+	/* If needed, reassign the inode numbers.  */
 	if (unlikely(params.num_inconsistent_inodes ||
 		     params.num_dir_hard_links))
 		reassign_inode_numbers(inode_list);
 	return 0;
 }
+
+/* Grow the table of a lazy_inode_fixup, or create it.  Returns false if out of
+ * memory.  */
+static bool
+grow_lazy_inode_fixup_table(struct lazy_inode_fixup *fixup)
+{
+	size_t new_mask = fixup->mask ? fixup->mask * 2 + 1 : 255;
+	struct lazy_inode_fixup_slot *new_slots;
+
+	new_slots = CALLOC(new_mask + 1, sizeof(new_slots[0]));
+	if (!new_slots)
+		return false;
+	if (fixup->slots) {
+		for (size_t i = 0; i <= fixup->mask; i++) {
+			size_t pos;
+
+			if (!fixup->slots[i].inode)
+				continue;
+			pos = hash_u64(fixup->slots[i].ino) & new_mask;
+			while (new_slots[pos].inode)
+				pos = (pos + 1) & new_mask;
+			new_slots[pos] = fixup->slots[i];
+		}
+	}
+	FREE(fixup->slots);
+	fixup->slots = new_slots;
+	fixup->mask = new_mask;
+	return true;
+}
+
+/* Return the inode for @dentry's hard link group which was read before, or
+ * NULL if there is none, in which case the group is remembered if possible.  */
+static struct wim_inode *
+lazy_inode_fixup_lookup(struct lazy_inode_fixup *fixup,
+			struct wim_dentry *dentry)
+{
+	struct wim_inode *d_inode = dentry->d_inode;
+	struct lazy_inode_fixup_slot *slot;
+	size_t pos;
+
+	if (fixup->slots) {
+		for (pos = hash_u64(d_inode->i_ino) & fixup->mask;
+		     (slot = &fixup->slots[pos])->inode != NULL;
+		     pos = (pos + 1) & fixup->mask)
+		{
+			if (slot->ino == d_inode->i_ino &&
+			    inodes_consistent(slot->inode, d_inode))
+				return slot->inode;
+		}
+	}
+
+	/* Keep the table at most half full.  If it can't be grown, this
+	 * dentry's later links just won't be found.  */
+	if (fixup->count >= (fixup->slots ? (fixup->mask + 1) / 2 : 0) &&
+	    !grow_lazy_inode_fixup_table(fixup))
+		return NULL;
+	for (pos = hash_u64(d_inode->i_ino) & fixup->mask;
+	     fixup->slots[pos].inode != NULL;
+	     pos = (pos + 1) & fixup->mask)
+		;
+	fixup->slots[pos].ino = d_inode->i_ino;
+	fixup->slots[pos].inode = d_inode;
+	fixup->count++;
+	return NULL;
+}
+
+/*
+ * Like dentry_tree_fix_inodes(), but for a dentry tree which is being read one
+ * directory at a time: fix up the inodes of the children of @dir, which must
+ * have just been read.  @fixup remembers the hard link groups seen so far, so
+ * that a dentry is combined with the links to its inode in the directories read
+ * before.  Links in directories which haven't been read yet are of course not
+ * counted, so link counts may be low.
+ *
+ * The new inodes are appended to @inode_list and numbered sequentially starting
+ * at fixup->next_ino, so they can always be told apart from the inodes read
+ * before.  Directories are never combined.
+ */
+void
+dentry_children_fix_inodes(struct wim_dentry *dir,
+			   struct lazy_inode_fixup *fixup,
+			   struct hlist_head *inode_list)
+{
+	struct wim_dentry *child;
+
+	for_dentry_child(child, dir) {
+		struct wim_inode *d_inode = child->d_inode;
+		struct wim_inode *inode;
+
+		if (d_inode->i_ino != 0 &&
+		    !(d_inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			inode = lazy_inode_fixup_lookup(fixup, child);
+			if (inode) {
+				/* Transfer this dentry to the existing
+				 * inode.  */
+				d_disassociate(child);
+				d_associate(child, inode);
+				continue;
+			}
+		}
+		d_inode->i_ino = fixup->next_ino++;
+		hlist_add_head(&d_inode->i_hlist_node, inode_list);
+	}
+}
+
+void
+lazy_inode_fixup_destroy(struct lazy_inode_fixup *fixup)
+{
+	FREE(fixup->slots);
+	fixup->slots = NULL;
+	fixup->mask = 0;
+	fixup->count = 0;
+}
@@ -159,6 +159,36 @@ inode_table_new_dentry(struct wim_inode_table *table, const tchar *name,
 	return 0;
 }
 
+/*
+ * Move the inodes of the table @src into the table @dst, leaving @src empty.
+ * This is for combining the results of scans that were done with separate
+ * tables, so no hard links are detected between the inodes of the two tables;
+ * they should come from different filesystems.
+ */
+void
+inode_table_move_inodes(struct wim_inode_table *dst,
+			struct wim_inode_table *src)
+{
+	struct wim_inode *inode;
+	struct hlist_node *tmp;
+
+	for (size_t i = 0; i < src->capacity; i++) {
+		hlist_for_each_entry_safe(inode, tmp, &src->array[i], i_hlist_node) {
+			hlist_del(&inode->i_hlist_node);
+			hlist_add_head(&inode->i_hlist_node,
+				       &dst->array[hash_inode(dst, inode->i_ino,
+							      inode->i_devno)]);
+			if (++dst->filled > dst->capacity)
+				enlarge_inode_table(dst);
+		}
+	}
+	hlist_for_each_entry_safe(inode, tmp, &src->extra_inodes, i_hlist_node) {
+		hlist_del(&inode->i_hlist_node);
+		hlist_add_head(&inode->i_hlist_node, &dst->extra_inodes);
+	}
+	src->filled = 0;
+}
+
 /*
  * Following the allocation of dentries with hard link detection using
  * inode_table_new_dentry(), this function will assign consecutive inode numbers
@@ -35,6 +35,8 @@
 #include "wimlib/progress.h"
 #include "wimlib/resource.h"
 #include "wimlib/sha1.h"
+#include "wimlib/task_pool.h"
+#include "wimlib/util.h"
 #include "wimlib/wim.h"
 #include "wimlib/write.h"
 
@@ -62,8 +64,15 @@ calculate_chunk_sha1(struct filedes *in_fd, size_t this_chunk_size,
 	struct sha1_ctx ctx;
 	size_t bytes_remaining;
 	size_t bytes_to_read;
+	const void *mapped;
 	int ret;
 
+	mapped = filedes_mapped_data(in_fd, offset, this_chunk_size);
+	if (mapped) {
+		sha1(mapped, this_chunk_size, sha1_md);
+		return 0;
+	}
+
 	bytes_remaining = this_chunk_size;
 	sha1_init(&ctx);
 	do {
@@ -82,6 +91,250 @@ calculate_chunk_sha1(struct filedes *in_fd, size_t this_chunk_size,
 	return 0;
 }
 
+/* Amount of data read from each chunk at a time by calculate_chunk_sha1s() */
+#define MULTI_CHUNK_READ_SIZE	262144
+
+/*
+ * Calculate the SHA-1 message digests of @num_chunks consecutive chunks of the
+ * file, each @chunk_size bytes, starting at @offset.  This hashes the chunks in
+ * parallel using multi-buffer SHA-1, which is faster than hashing them one at a
+ * time.  @num_chunks can be at most SHA1_MAX_LANES.
+ */
+static int
+calculate_chunk_sha1s(struct filedes *in_fd, size_t chunk_size, off_t offset,
+		      unsigned num_chunks, u8 sha1_mds[][SHA1_HASH_SIZE])
+{
+	struct sha1_ctx ctxs[SHA1_MAX_LANES];
+	struct sha1_ctx *ctx_ptrs[SHA1_MAX_LANES];
+	const void *data[SHA1_MAX_LANES];
+	const u8 *mapped;
+	u8 *buf;
+	unsigned i;
+	int ret;
+
+	wimlib_assert(num_chunks <= SHA1_MAX_LANES);
+
+	for (i = 0; i < num_chunks; i++) {
+		sha1_init(&ctxs[i]);
+		ctx_ptrs[i] = &ctxs[i];
+	}
+
+	mapped = filedes_mapped_data(in_fd, offset, (u64)chunk_size * num_chunks);
+	if (mapped) {
+		for (i = 0; i < num_chunks; i++)
+			data[i] = mapped + (size_t)i * chunk_size;
+		sha1_update_multi(ctx_ptrs, data, num_chunks, chunk_size);
+		goto out_final;
+	}
+
+	buf = MALLOC((size_t)num_chunks * MULTI_CHUNK_READ_SIZE);
+	if (!buf) {
+		/* Fall back to hashing one chunk at a time.  */
+		for (i = 0; i < num_chunks; i++) {
+			ret = calculate_chunk_sha1(in_fd, chunk_size,
+						   offset + (off_t)i * chunk_size,
+						   sha1_mds[i]);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	for (size_t pos = 0; pos < chunk_size; pos += MULTI_CHUNK_READ_SIZE) {
+		size_t bytes_to_read = min(chunk_size - pos,
+					   MULTI_CHUNK_READ_SIZE);
+
+		for (i = 0; i < num_chunks; i++) {
+			data[i] = &buf[(size_t)i * MULTI_CHUNK_READ_SIZE];
+			ret = full_pread(in_fd, &buf[(size_t)i * MULTI_CHUNK_READ_SIZE],
+					 bytes_to_read,
+					 offset + (off_t)i * chunk_size + pos);
+			if (ret) {
+				ERROR_WITH_ERRNO("Read error while calculating "
+						 "integrity checksums");
+				FREE(buf);
+				return ret;
+			}
+		}
+		sha1_update_multi(ctx_ptrs, data, num_chunks, bytes_to_read);
+	}
+	FREE(buf);
+out_final:
+	for (i = 0; i < num_chunks; i++)
+		sha1_final(&ctxs[i], sha1_mds[i]);
+	return 0;
+}
+
+/* A run of consecutive chunks, all of the same size, whose SHA-1 message
+ * digests are calculated together by one call to calculate_chunk_sha1s()  */
+struct integrity_chunk_group {
+	struct integrity_hasher *hasher;
+	u64 offset;
+	size_t chunk_size;
+	u32 first_chunk;
+	u32 num_chunks;
+	int status;
+	bool done;
+};
+
+/*
+ * Calculates the SHA-1 message digests of groups of integrity chunks, using
+ * the task pool if possible.  Since the chunks are independent, each worker
+ * simply takes the next group that hasn't been taken yet, reads it, and hashes
+ * it; the reads issued by the different workers overlap with each other and
+ * with the hashing.  The thread which created the hasher waits for the groups
+ * in order, so that it can report progress in order.
+ */
+struct integrity_hasher {
+	struct filedes *in_fd;
+	u8 (*sha1sums)[SHA1_HASH_SIZE];
+	struct integrity_chunk_group *groups;
+	size_t num_groups;
+	bool parallel;
+	struct mutex lock;
+	struct condvar done_cond;
+	struct worker_group workers;
+};
+
+static void
+hash_chunk_group(struct integrity_hasher *h, struct integrity_chunk_group *g)
+{
+	g->status = calculate_chunk_sha1s(h->in_fd, g->chunk_size, g->offset,
+					  g->num_chunks,
+					  &h->sha1sums[g->first_chunk]);
+}
+
+static void
+integrity_hasher_process(void *item, void *_ignored)
+{
+	struct integrity_chunk_group *g = item;
+	struct integrity_hasher *h = g->hasher;
+
+	hash_chunk_group(h, g);
+	mutex_lock(&h->lock);
+	g->done = true;
+	condvar_broadcast(&h->done_cond);
+	mutex_unlock(&h->lock);
+}
+
+/* Start calculating the SHA-1 message digests of the specified groups of
+ * chunks, writing them into @sha1sums at the groups' chunk indices.  If the
+ * task pool can't be used, then each group is instead hashed by the calling
+ * thread when integrity_hasher_wait() is called for it.  */
+static void
+integrity_hasher_start(struct integrity_hasher *h, struct filedes *in_fd,
+		       u8 (*sha1sums)[SHA1_HASH_SIZE],
+		       struct integrity_chunk_group *groups, size_t num_groups)
+{
+	unsigned num_workers = min(task_pool_num_threads(), num_groups);
+
+	h->in_fd = in_fd;
+	h->sha1sums = sha1sums;
+	h->groups = groups;
+	h->num_groups = num_groups;
+	h->parallel = false;
+
+#ifdef _WIN32
+	/* win32_pread() seeks, reads, and restores the file position, so it
+	 * can't be called by several threads on one file at the same time.  */
+	num_workers = 1;
+#endif
+	if (num_workers <= 1)
+		return;
+	if (!mutex_init(&h->lock))
+		return;
+	if (!condvar_init(&h->done_cond))
+		goto err_destroy_lock;
+	if (worker_group_init(&h->workers, num_workers, num_groups,
+			      integrity_hasher_process, NULL))
+		goto err_destroy_cond;
+	h->parallel = true;
+	for (size_t i = 0; i < num_groups; i++) {
+		groups[i].hasher = h;
+		worker_group_submit(&h->workers, &groups[i]);
+	}
+	return;
+
+err_destroy_cond:
+	condvar_destroy(&h->done_cond);
+err_destroy_lock:
+	mutex_destroy(&h->lock);
+}
+
+/* Wait for the SHA-1 message digests of the group at index @i to be available,
+ * and return the status of calculating them.  Groups must be waited for in
+ * order.  */
+static int
+integrity_hasher_wait(struct integrity_hasher *h, size_t i)
+{
+	struct integrity_chunk_group *g = &h->groups[i];
+
+	if (!h->parallel) {
+		hash_chunk_group(h, g);
+		return g->status;
+	}
+	mutex_lock(&h->lock);
+	while (!g->done)
+		condvar_wait(&h->done_cond, &h->lock);
+	mutex_unlock(&h->lock);
+	return g->status;
+}
+
+/* Stop the integrity hasher, abandoning any groups not yet started.  */
+static void
+integrity_hasher_finish(struct integrity_hasher *h)
+{
+	if (!h->parallel)
+		return;
+	worker_group_destroy(&h->workers);
+	condvar_destroy(&h->done_cond);
+	mutex_destroy(&h->lock);
+}
+
+/*
+ * Divide the chunks of the region being checked into groups for calculating
+ * their SHA-1 message digests, skipping chunks for which @known (if non-NULL)
+ * says the digest is already known.  Groups are made small enough to keep all
+ * threads busy, but no bigger than the number of chunks that can be hashed at
+ * once.
+ *
+ * @groups must have space for @num_chunks groups.  Returns the number of
+ * groups.
+ */
+static size_t
+make_chunk_groups(struct integrity_chunk_group *groups, u32 num_chunks,
+		  size_t chunk_size, size_t last_chunk_size, const bool *known)
+{
+	u32 max_group_size = DIV_ROUND_UP(num_chunks, task_pool_num_threads());
+	size_t num_groups = 0;
+	struct integrity_chunk_group *g = NULL;
+	u64 offset = WIM_HEADER_DISK_SIZE;
+
+	max_group_size = max(1, min(max_group_size, SHA1_MAX_LANES));
+
+	for (u32 i = 0; i < num_chunks; i++) {
+		size_t this_chunk_size = (i == num_chunks - 1) ?
+					 last_chunk_size : chunk_size;
+
+		if (known && known[i]) {
+			g = NULL;
+		} else if (g && g->chunk_size == this_chunk_size &&
+			   g->num_chunks < max_group_size) {
+			g->num_chunks++;
+		} else {
+			g = &groups[num_groups++];
+			g->offset = offset;
+			g->chunk_size = this_chunk_size;
+			g->first_chunk = i;
+			g->num_chunks = 1;
+			g->status = 0;
+			g->done = false;
+		}
+		offset += this_chunk_size;
+	}
+	return num_groups;
+}
+
 
 /*
  * read_integrity_table: -  Reads the integrity table from a WIM file.
@@ -139,6 +392,275 @@ read_integrity_table(WIMStruct *wim, u64 num_checked_bytes,
 	return 0;
 }
 
+/*
+ * An integrity stream calculates the SHA-1 message digests of the integrity
+ * chunks of a WIM file while the file is being written, from the data passed to
+ * full_write() and full_pwrite(), so that the integrity table can be built
+ * without reading the file back.
+ *
+ * Most data is written sequentially, but some is written out of order.  For
+ * example, the chunk table of a compressed resource is written over space
+ * reserved for it at the start of the resource after the rest of the resource
+ * has been written, and a resource that didn't compress may be rewritten
+ * uncompressed.  Therefore the stream keeps the most recently written few
+ * chunks' worth of data in a window, where out-of-order writes can still update
+ * it, and only hashes a chunk when it leaves the window.  A write to a chunk
+ * which already left the window, or data which was never written (e.g. because
+ * it was already there, as when appending), just make the affected chunks
+ * unknown; calculate_integrity_table() reads those back from the file.
+ */
+
+/* Number of chunks of data kept in an integrity stream's window  */
+#define INTEGRITY_STREAM_WINDOW_CHUNKS 3
+
+struct integrity_stream_chunk {
+	u8 sha1[SHA1_HASH_SIZE];
+	bool valid;
+};
+
+struct integrity_stream {
+	/* The chunks which have left the window.  The window holds the chunks
+	 * with indices num_chunks through num_chunks + WINDOW_CHUNKS - 1, the
+	 * chunk with index i being in slot i % WINDOW_CHUNKS.  */
+	struct integrity_stream_chunk *chunks;
+	u32 num_chunks;
+	u32 num_alloc_chunks;
+	u8 *window;
+	bool window_gap[INTEGRITY_STREAM_WINDOW_CHUNKS];
+
+	/* Offset of the byte following the last byte written to the file  */
+	u64 written_end;
+
+	/* If nonzero, integrity_stream_finish() was called with this end
+	 * offset, and the stream no longer accepts data.  */
+	u64 end;
+
+	/* Set if memory couldn't be allocated; the stream is then unusable.  */
+	bool failed;
+};
+
+static inline u64
+stream_chunk_offset(u64 i)
+{
+	return WIM_HEADER_DISK_SIZE + i * INTEGRITY_CHUNK_SIZE;
+}
+
+static inline u8 *
+stream_chunk_data(struct integrity_stream *stream, u64 i)
+{
+	return &stream->window[(i % INTEGRITY_STREAM_WINDOW_CHUNKS) *
+			       INTEGRITY_CHUNK_SIZE];
+}
+
+static inline bool *
+stream_chunk_gap(struct integrity_stream *stream, u64 i)
+{
+	return &stream->window_gap[i % INTEGRITY_STREAM_WINDOW_CHUNKS];
+}
+
+/* Allocate a new integrity stream.  The caller then sets it as the
+ * integrity_stream of the file descriptor being written to.  */
+int
+new_integrity_stream(struct integrity_stream **stream_ret)
+{
+	struct integrity_stream *stream;
+
+	stream = CALLOC(1, sizeof(*stream));
+	if (!stream)
+		return WIMLIB_ERR_NOMEM;
+	stream->window = MALLOC((size_t)INTEGRITY_STREAM_WINDOW_CHUNKS *
+				INTEGRITY_CHUNK_SIZE);
+	if (!stream->window) {
+		FREE(stream);
+		return WIMLIB_ERR_NOMEM;
+	}
+	stream->written_end = WIM_HEADER_DISK_SIZE;
+	*stream_ret = stream;
+	return 0;
+}
+
+void
+free_integrity_stream(struct integrity_stream *stream)
+{
+	if (stream) {
+		FREE(stream->chunks);
+		FREE(stream->window);
+		FREE(stream);
+	}
+}
+
+/* Record the SHA-1 message digest of the first @size bytes of the first chunk
+ * in the window (or that it is unknown, if @valid is false), then move the
+ * window forward by one chunk.  Data between the new end of the window and
+ * @gap_end was skipped over and will never be written.  */
+static void
+integrity_stream_advance(struct integrity_stream *stream, size_t size,
+			 bool valid, u64 gap_end)
+{
+	u32 i = stream->num_chunks;
+	struct integrity_stream_chunk *chunk;
+
+	if (i == stream->num_alloc_chunks) {
+		u32 new_num_alloc_chunks = max(64, stream->num_alloc_chunks * 2);
+		struct integrity_stream_chunk *new_chunks;
+
+		new_chunks = REALLOC(stream->chunks, new_num_alloc_chunks *
+				     sizeof(stream->chunks[0]));
+		if (!new_chunks) {
+			stream->failed = true;
+			return;
+		}
+		stream->chunks = new_chunks;
+		stream->num_alloc_chunks = new_num_alloc_chunks;
+	}
+
+	chunk = &stream->chunks[i];
+	chunk->valid = valid && !*stream_chunk_gap(stream, i);
+	if (chunk->valid)
+		sha1(stream_chunk_data(stream, i), size, chunk->sha1);
+
+	stream->num_chunks++;
+
+	/* The slot now holds the chunk that just entered the window.  */
+	*stream_chunk_gap(stream, i) =
+		stream_chunk_offset(i + INTEGRITY_STREAM_WINDOW_CHUNKS) < gap_end;
+}
+
+/* Called by full_write() and full_pwrite() for each write of @count bytes from
+ * @buf to the file at @offset.  */
+void
+integrity_stream_write(struct integrity_stream *stream, const void *buf,
+		       size_t count, u64 offset)
+{
+	u64 end = offset + count;
+	u64 gap_end = 0;
+
+	if (stream->failed || stream->end || end <= WIM_HEADER_DISK_SIZE)
+		return;
+
+	/* The header isn't covered by the integrity table.  */
+	if (offset < WIM_HEADER_DISK_SIZE) {
+		buf += WIM_HEADER_DISK_SIZE - offset;
+		offset = WIM_HEADER_DISK_SIZE;
+	}
+
+	/* If this write starts after the end of the data written so far, then
+	 * the data in between was skipped over.  */
+	if (offset > stream->written_end) {
+		gap_end = offset;
+		for (u64 i = stream->num_chunks;
+		     i < stream->num_chunks + INTEGRITY_STREAM_WINDOW_CHUNKS &&
+		     stream_chunk_offset(i) < gap_end; i++)
+		{
+			if (stream_chunk_offset(i + 1) > stream->written_end)
+				*stream_chunk_gap(stream, i) = true;
+		}
+	}
+
+	stream->written_end = max(stream->written_end, end);
+
+	while (offset < end) {
+		u64 i = (offset - WIM_HEADER_DISK_SIZE) / INTEGRITY_CHUNK_SIZE;
+		u64 chunk_end = stream_chunk_offset(i + 1);
+		size_t n = min(end, chunk_end) - offset;
+
+		/* Move the window forward until this chunk is in it.  */
+		while (i >= stream->num_chunks + INTEGRITY_STREAM_WINDOW_CHUNKS) {
+			integrity_stream_advance(stream, INTEGRITY_CHUNK_SIZE,
+						 true, gap_end);
+			if (stream->failed)
+				return;
+		}
+
+		if (i < stream->num_chunks) {
+			/* This chunk was already hashed.  */
+			stream->chunks[i].valid = false;
+		} else {
+			memcpy(stream_chunk_data(stream, i) +
+			       (offset - stream_chunk_offset(i)), buf, n);
+		}
+		buf += n;
+		offset += n;
+	}
+}
+
+/*
+ * Called by filedes_seek() when the file position is moved back to @offset.
+ * This only happens when the data from @offset onwards is about to be written
+ * again (see write_blob_uncompressed()), so the stream forgets about it and
+ * moves its window back if needed.  The part of the chunk containing @offset
+ * which is before @offset is only still known if that chunk is in the window.
+ */
+void
+integrity_stream_rewind(struct integrity_stream *stream, u64 offset)
+{
+	u64 i;
+
+	if (stream->failed || stream->end || offset >= stream->written_end)
+		return;
+	if (offset < WIM_HEADER_DISK_SIZE)
+		offset = WIM_HEADER_DISK_SIZE;
+	i = (offset - WIM_HEADER_DISK_SIZE) / INTEGRITY_CHUNK_SIZE;
+
+	for (u64 j = max(i + 1, stream->num_chunks);
+	     j < stream->num_chunks + INTEGRITY_STREAM_WINDOW_CHUNKS; j++)
+		*stream_chunk_gap(stream, j) = false;
+
+	if (i < stream->num_chunks) {
+		stream->num_chunks = i;
+		for (u64 j = i; j < i + INTEGRITY_STREAM_WINDOW_CHUNKS; j++)
+			*stream_chunk_gap(stream, j) = false;
+		*stream_chunk_gap(stream, i) =
+			(offset != stream_chunk_offset(i));
+	}
+	stream->written_end = offset;
+}
+
+/* Stop collecting data in the integrity stream, and calculate the SHA-1 message
+ * digests of the chunks remaining in the window, given that the region covered
+ * by the integrity table ends at @end.  */
+void
+integrity_stream_finish(struct integrity_stream *stream, u64 end)
+{
+	if (stream->failed || stream->end)
+		return;
+
+	/* If the last chunk already left the window, it was hashed as a full
+	 * chunk, which may be wrong.  */
+	if (end > WIM_HEADER_DISK_SIZE) {
+		u64 last = (end - WIM_HEADER_DISK_SIZE - 1) / INTEGRITY_CHUNK_SIZE;
+
+		if (last < stream->num_chunks)
+			stream->chunks[last].valid = false;
+	}
+
+	while (stream_chunk_offset(stream->num_chunks) < end &&
+	       !stream->failed) {
+		u64 chunk_end = min(end, stream_chunk_offset(stream->num_chunks + 1));
+
+		integrity_stream_advance(stream,
+				chunk_end - stream_chunk_offset(stream->num_chunks),
+				chunk_end <= stream->written_end, 0);
+	}
+	stream->end = end;
+}
+
+/* If the integrity stream (which may be NULL) calculated the SHA-1 message
+ * digest of the chunk with index @i, for an integrity table with chunk size
+ * @chunk_size covering the region ending at @end, then copy it to @hash and
+ * return true.  Otherwise return false.  */
+static bool
+integrity_stream_get_sha1(const struct integrity_stream *stream, u32 i,
+			  size_t chunk_size, u64 end, u8 hash[SHA1_HASH_SIZE])
+{
+	if (!stream || stream->failed || stream->end != end ||
+	    chunk_size != INTEGRITY_CHUNK_SIZE || i >= stream->num_chunks ||
+	    !stream->chunks[i].valid)
+		return false;
+	copy_hash(hash, stream->chunks[i].sha1);
+	return true;
+}
+
 /*
  * calculate_integrity_table():
  *
@@ -160,6 +682,11 @@ read_integrity_table(WIMStruct *wim, u64 num_checked_bytes,
  *	If @old_table is non-NULL, the byte after the last byte that was checked
  *	in the old table.  Must be less than or equal to new_check_end.
  *
+ * @stream:
+ *	If non-NULL, an integrity stream which collected the data written to the
+ *	file, and from which the SHA1 message digests of chunks are reused where
+ *	possible.  integrity_stream_finish() must have been called on it.
+ *
  * @integrity_table_ret:
  *	On success, a pointer to the calculated integrity table is written into
  *	this location.
@@ -175,6 +702,7 @@ calculate_integrity_table(struct filedes *in_fd,
 			  off_t new_check_end,
 			  const struct integrity_table *old_table,
 			  off_t old_check_end,
+			  const struct integrity_stream *stream,
 			  struct integrity_table **integrity_table_ret,
 			  wimlib_progress_func_t progfunc,
 			  void *progctx)
@@ -212,7 +740,11 @@ calculate_integrity_table(struct filedes *in_fd,
 	new_table->size = new_table_size;
 	new_table->chunk_size = chunk_size;
 
-	u64 offset = WIM_HEADER_DISK_SIZE;
+	struct integrity_chunk_group *groups;
+	bool *known;
+	size_t num_groups;
+	size_t g = 0;
+	struct integrity_hasher hasher;
 	union wimlib_progress_info progress;
 
 	progress.integrity.total_bytes      = new_check_bytes;
@@ -227,12 +759,22 @@ calculate_integrity_table(struct filedes *in_fd,
 	if (ret)
 		goto out_free_new_table;
 
+	groups = MALLOC(new_num_chunks * sizeof(groups[0]));
+	known = MALLOC(new_num_chunks * sizeof(known[0]));
+	if (!groups || !known) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out_free_groups;
+	}
+
 	for (u32 i = 0; i < new_num_chunks; i++) {
 		size_t this_chunk_size;
+
 		if (i == new_num_chunks - 1)
 			this_chunk_size = new_last_chunk_size;
 		else
 			this_chunk_size = chunk_size;
+
+		known[i] = true;
 		if (old_table &&
 		    ((this_chunk_size == chunk_size && i < old_num_chunks - 1) ||
 		      (i == old_num_chunks - 1 && this_chunk_size == old_last_chunk_size)))
@@ -240,25 +782,61 @@ calculate_integrity_table(struct filedes *in_fd,
 			/* Can use SHA1 message digest from old integrity table
 			 * */
 			copy_hash(new_table->sha1sums[i], old_table->sha1sums[i]);
-		} else {
-			/* Calculate the SHA1 message digest of this chunk */
-			ret = calculate_chunk_sha1(in_fd, this_chunk_size,
-						   offset, new_table->sha1sums[i]);
+		} else if (!integrity_stream_get_sha1(stream, i, chunk_size,
+						      new_check_end,
+						      new_table->sha1sums[i]))
+		{
+			/* SHA1 message digest of this chunk needs to be
+			 * calculated */
+			known[i] = false;
+		}
+	}
+
+	num_groups = make_chunk_groups(groups, new_num_chunks, chunk_size,
+				       new_last_chunk_size, known);
+
+	integrity_hasher_start(&hasher, in_fd, new_table->sha1sums,
+			       groups, num_groups);
+
+	for (u32 i = 0; i < new_num_chunks; ) {
+		size_t this_chunk_size;
+		u32 n = 1;
+
+		if (i == new_num_chunks - 1)
+			this_chunk_size = new_last_chunk_size;
+		else
+			this_chunk_size = chunk_size;
+
+		if (g < num_groups && groups[g].first_chunk == i) {
+			/* Wait for the SHA1 message digests of the next group
+			 * of chunks to be calculated */
+			ret = integrity_hasher_wait(&hasher, g);
 			if (ret)
-				goto out_free_new_table;
+				goto out_finish_hasher;
+			n = groups[g++].num_chunks;
 		}
-		offset += this_chunk_size;
 
-		progress.integrity.completed_chunks++;
-		progress.integrity.completed_bytes += this_chunk_size;
-		ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_CALC_INTEGRITY,
-				    &progress, progctx);
-		if (ret)
-			goto out_free_new_table;
+		for (u32 j = 0; j < n; j++, i++) {
+			progress.integrity.completed_chunks++;
+			progress.integrity.completed_bytes += this_chunk_size;
+			ret = call_progress(progfunc,
+					    WIMLIB_PROGRESS_MSG_CALC_INTEGRITY,
+					    &progress, progctx);
+			if (ret)
+				goto out_finish_hasher;
+		}
 	}
+	integrity_hasher_finish(&hasher);
+	FREE(known);
+	FREE(groups);
 	*integrity_table_ret = new_table;
 	return 0;
 
+out_finish_hasher:
+	integrity_hasher_finish(&hasher);
+out_free_groups:
+	FREE(known);
+	FREE(groups);
 out_free_new_table:
 	FREE(new_table);
 	return ret;
@@ -292,12 +870,18 @@ out_free_new_table:
  * @old_table
  *	Pointer to the old integrity table read into memory, or NULL if not
  *	specified.
+ *
+ * @stream
+ *	Integrity stream which collected the data written to the WIM file, or
+ *	NULL if not used.  integrity_stream_finish() must have been called on it
+ *	with @new_blob_table_end.
  */
 int
 write_integrity_table(WIMStruct *wim,
 		      off_t new_blob_table_end,
 		      off_t old_blob_table_end,
-		      struct integrity_table *old_table)
+		      struct integrity_table *old_table,
+		      const struct integrity_stream *stream)
 {
 	struct integrity_table *new_table;
 	int ret;
@@ -306,7 +890,7 @@ write_integrity_table(WIMStruct *wim,
 	wimlib_assert(old_blob_table_end <= new_blob_table_end);
 
 	ret = calculate_integrity_table(&wim->out_fd, new_blob_table_end,
-					old_table, old_blob_table_end,
+					old_table, old_blob_table_end, stream,
 					&new_table, wim->progfunc, wim->progctx);
 	if (ret)
 		return ret;
@@ -325,7 +909,8 @@ write_integrity_table(WIMStruct *wim,
 					     0,
 					     &wim->out_hdr.integrity_table_reshdr,
 					     NULL,
-					     0);
+					     0,
+					     1);
 	FREE(new_table);
 	return ret;
 }
@@ -358,8 +943,10 @@ verify_integrity(struct filedes *in_fd, const tchar *filename,
 		 wimlib_progress_func_t progfunc, void *progctx)
 {
 	int ret;
-	u64 offset = WIM_HEADER_DISK_SIZE;
-	u8 sha1_md[SHA1_HASH_SIZE];
+	struct integrity_chunk_group *groups;
+	u8 (*sha1sums)[SHA1_HASH_SIZE];
+	size_t num_groups;
+	struct integrity_hasher hasher;
 	union wimlib_progress_info progress;
 
 	progress.integrity.total_bytes      = bytes_to_check;
@@ -374,31 +961,50 @@ verify_integrity(struct filedes *in_fd, const tchar *filename,
 	if (ret)
 		return ret;
 
-	for (u32 i = 0; i < table->num_entries; i++) {
-		size_t this_chunk_size;
-		if (i == table->num_entries - 1)
-			this_chunk_size = MODULO_NONZERO(bytes_to_check,
-							 table->chunk_size);
-		else
-			this_chunk_size = table->chunk_size;
+	groups = MALLOC(table->num_entries * sizeof(groups[0]));
+	sha1sums = MALLOC(table->num_entries * sizeof(sha1sums[0]));
+	if (!groups || !sha1sums) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out_free;
+	}
+	num_groups = make_chunk_groups(groups, table->num_entries,
+				       table->chunk_size,
+				       MODULO_NONZERO(bytes_to_check,
+						      table->chunk_size),
+				       NULL);
+
+	integrity_hasher_start(&hasher, in_fd, sha1sums, groups, num_groups);
 
-		ret = calculate_chunk_sha1(in_fd, this_chunk_size, offset, sha1_md);
+	for (size_t g = 0; g < num_groups; g++) {
+		ret = integrity_hasher_wait(&hasher, g);
 		if (ret)
-			return ret;
+			goto out_finish_hasher;
 
-		if (!hashes_equal(sha1_md, table->sha1sums[i]))
-			return WIM_INTEGRITY_NOT_OK;
+		for (u32 j = 0; j < groups[g].num_chunks; j++) {
+			u32 i = groups[g].first_chunk + j;
 
-		offset += this_chunk_size;
-		progress.integrity.completed_chunks++;
-		progress.integrity.completed_bytes += this_chunk_size;
+			if (!hashes_equal(sha1sums[i], table->sha1sums[i])) {
+				ret = WIM_INTEGRITY_NOT_OK;
+				goto out_finish_hasher;
+			}
 
-		ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY,
-				    &progress, progctx);
-		if (ret)
-			return ret;
+			progress.integrity.completed_chunks++;
+			progress.integrity.completed_bytes += groups[g].chunk_size;
+
+			ret = call_progress(progfunc,
+					    WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY,
+					    &progress, progctx);
+			if (ret)
+				goto out_finish_hasher;
+		}
 	}
-	return WIM_INTEGRITY_OK;
+	ret = WIM_INTEGRITY_OK;
+out_finish_hasher:
+	integrity_hasher_finish(&hasher);
+out_free:
+	FREE(sha1sums);
+	FREE(groups);
+	return ret;
 }
 
 
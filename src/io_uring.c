@@ -0,0 +1,349 @@
+/*
+ * io_uring.c
+ *
+ * A minimal interface to Linux's io_uring, used to issue batches of system
+ * calls with a single call into the kernel.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib/io_uring.h"
+
+#ifdef WITH_IO_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "wimlib/assert.h"
+#include "wimlib/util.h"
+
+/*
+ * This talks to the kernel directly rather than through liburing, since only a
+ * few operations are needed and the library would be another dependency.  Only
+ * one thread may use a ring at a time.  The operations are prepared in the
+ * submission queue, then io_ring_run() submits all of them and waits for all of
+ * them to complete, so the completion queue (which the kernel makes twice as
+ * large as the submission queue) can never overflow.
+ */
+struct io_ring {
+	int fd;
+
+	/* The submission queue  */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+
+	/* The index just past the last prepared submission queue entry  */
+	unsigned sqe_tail;
+
+	/* The completion queue  */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* The mappings of the rings into memory  */
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		   unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Return true if the kernel supports all the operations in @required_ops.  */
+static bool
+io_ring_check_ops(int fd, int required_ops)
+{
+	static const struct {
+		int flag;
+		u8 opcode;
+	} ops[] = {
+		{ IO_RING_OP_STATX, IORING_OP_STATX },
+		{ IO_RING_OP_CLOSE, IORING_OP_CLOSE },
+	};
+	const unsigned max_ops = 256;
+	struct io_uring_probe *probe;
+	bool ok = false;
+
+	probe = CALLOC(1, sizeof(*probe) +
+			  max_ops * sizeof(struct io_uring_probe_op));
+	if (!probe)
+		return false;
+	if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, max_ops))
+		goto out;
+	for (size_t i = 0; i < ARRAY_LEN(ops); i++) {
+		if (!(required_ops & ops[i].flag))
+			continue;
+		if (ops[i].opcode > probe->last_op ||
+		    !(probe->ops[ops[i].opcode].flags & IO_URING_OP_SUPPORTED))
+			goto out;
+	}
+	ok = true;
+out:
+	FREE(probe);
+	return ok;
+}
+
+static void *
+io_ring_mmap(int fd, size_t size, off_t offset)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+/*
+ * Create a ring with room for @entries operations at once, which must support
+ * the IO_RING_OP_* operations in @required_ops.  Return NULL if this isn't
+ * possible for any reason, e.g. because the kernel is too old or because
+ * io_uring is disabled; callers must then make the system calls themselves.
+ */
+struct io_ring *
+io_ring_create(unsigned entries, int required_ops)
+{
+	struct io_uring_params p = { 0 };
+	struct io_ring *ring;
+	u8 *sq_ring;
+	u8 *cq_ring;
+
+	ring = CALLOC(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		goto err_free;
+
+	if (!io_ring_check_ops(ring->fd, required_ops))
+		goto err_close;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+	ring->cq_ring_size = p.cq_off.cqes +
+			     p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_size = max(ring->sq_ring_size,
+					 ring->cq_ring_size);
+		ring->cq_ring_size = 0;
+	}
+	ring->sq_ring = io_ring_mmap(ring->fd, ring->sq_ring_size,
+				     IORING_OFF_SQ_RING);
+	if (!ring->sq_ring)
+		goto err_close;
+	if (ring->cq_ring_size) {
+		ring->cq_ring = io_ring_mmap(ring->fd, ring->cq_ring_size,
+					     IORING_OFF_CQ_RING);
+		if (!ring->cq_ring)
+			goto err_unmap_sq_ring;
+	} else {
+		ring->cq_ring = ring->sq_ring;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = io_ring_mmap(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+	if (!ring->sqes)
+		goto err_unmap_cq_ring;
+
+	sq_ring = ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq_ring + p.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(sq_ring + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sqe_tail = *ring->sq_tail;
+
+	/* The submission queue entries are always used in order.  */
+	for (unsigned i = 0; i < p.sq_entries; i++)
+		((u32 *)(sq_ring + p.sq_off.array))[i] = i;
+
+	cq_ring = ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq_ring + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq_ring + p.cq_off.cqes);
+	return ring;
+
+err_unmap_cq_ring:
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+err_unmap_sq_ring:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+err_close:
+	close(ring->fd);
+err_free:
+	FREE(ring);
+	return NULL;
+}
+
+void
+io_ring_destroy(struct io_ring *ring)
+{
+	if (!ring)
+		return;
+	wimlib_assert(ring->sqe_tail == *ring->sq_head);
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	FREE(ring);
+}
+
+/* Return the number of operations which can still be prepared before the next
+ * call to io_ring_run().  */
+static unsigned
+io_ring_space(const struct io_ring *ring)
+{
+	return ring->sq_entries - (ring->sqe_tail - *ring->sq_head);
+}
+
+static struct io_uring_sqe *
+io_ring_get_sqe(struct io_ring *ring, u8 opcode, u64 user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	wimlib_assert(io_ring_space(ring) > 0);
+	sqe = &ring->sqes[ring->sqe_tail++ & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->user_data = user_data;
+	return sqe;
+}
+
+/* Prepare an operation equivalent to statx(@dirfd, @path, @flags,
+ * STATX_BASIC_STATS, @buf).  @path and @buf must remain valid until
+ * io_ring_run() returns.  */
+void
+io_ring_prep_statx(struct io_ring *ring, int dirfd, const char *path,
+		   int flags, struct statx *buf, u64 user_data)
+{
+	struct io_uring_sqe *sqe = io_ring_get_sqe(ring, IORING_OP_STATX,
+						   user_data);
+
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (uintptr_t)buf;
+	sqe->statx_flags = flags;
+}
+
+/* Prepare an operation equivalent to close(@fd).  */
+void
+io_ring_prep_close(struct io_ring *ring, int fd, u64 user_data)
+{
+	struct io_uring_sqe *sqe = io_ring_get_sqe(ring, IORING_OP_CLOSE,
+						   user_data);
+
+	sqe->fd = fd;
+}
+
+/*
+ * Submit all the prepared operations, and wait for all of them to complete,
+ * calling @complete for each of them.  The operations may run in any order and
+ * in parallel.  Return 0 if all the operations were submitted, or a negated
+ * errno value if the kernel refused to accept some of them.  In the latter case,
+ * @complete is not called for the operations which weren't accepted, and the
+ * caller must do them itself if needed.
+ */
+int
+io_ring_run(struct io_ring *ring, io_ring_complete_t complete, void *ctx)
+{
+	unsigned inflight = 0;
+	int err = 0;
+
+	/* Make the prepared entries visible to the kernel.  */
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	for (;;) {
+		unsigned to_submit = ring->sqe_tail -
+			__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		unsigned cq_head;
+		int ret;
+
+		if (to_submit == 0 && inflight == 0)
+			break;
+
+		/* The kernel stops without waiting if it couldn't submit all
+		 * the entries, so asking it to wait for all of them is safe. */
+		ret = sys_io_uring_enter(ring->fd, to_submit,
+					 to_submit + inflight,
+					 IORING_ENTER_GETEVENTS);
+		if (ret >= 0) {
+			inflight += ret;
+		} else if (errno == EINTR ||
+			   ((errno == EAGAIN || errno == EBUSY) && inflight)) {
+			/* Retry, after reaping any completions.  */
+		} else if (to_submit) {
+			/* Take back the entries the kernel didn't accept, then
+			 * just wait for the ones it did.  */
+			err = errno ? -errno : -EIO;
+			ring->sqe_tail = __atomic_load_n(ring->sq_head,
+							 __ATOMIC_ACQUIRE);
+			__atomic_store_n(ring->sq_tail, ring->sqe_tail,
+					 __ATOMIC_RELEASE);
+			continue;
+		} else {
+			wimlib_assert(0);
+			break;
+		}
+
+		cq_head = *ring->cq_head;
+		while (cq_head != __atomic_load_n(ring->cq_tail,
+						  __ATOMIC_ACQUIRE))
+		{
+			const struct io_uring_cqe *cqe =
+				&ring->cqes[cq_head++ & ring->cq_mask];
+
+			(*complete)(ctx, cqe->user_data, cqe->res);
+			inflight--;
+		}
+		__atomic_store_n(ring->cq_head, cq_head, __ATOMIC_RELEASE);
+	}
+	return err;
+}
+
+#endif /* WITH_IO_URING */
@@ -81,10 +81,181 @@ get_default_stream_type(const struct wim_inode *inode)
 	return STREAM_TYPE_DATA;
 }
 
+/*
+ * State of an iteration through a directory tree.  The entries built for the
+ * callback are stored one after another in a buffer which is reused throughout
+ * the iteration; in batched mode they accumulate there until it is full.
+ */
+struct iterate_dir_tree_ctx {
+	WIMStruct *wim;
+	const tchar *path;
+	int flags;
+	wimlib_iterate_dir_tree_callback_t cb;
+	wimlib_iterate_dir_tree_batch_callback_t batch_cb;
+	void *user_ctx;
+
+	/* Full path of the dentry being visited, built up as the tree is
+	 * descended  */
+	tchar *full_path;
+	size_t full_path_len;
+	size_t full_path_alloc;
+
+	/* The entries not yet passed to the callback  */
+	u8 *buf;
+	size_t buf_size;
+	size_t buf_used;
+	const struct wimlib_dir_entry **entries;
+	size_t num_entries;
+	size_t entries_alloc;
+};
+
+#define ITERATE_DIR_TREE_BUF_SIZE	65536
+
+static int
+ensure_full_path_space(struct iterate_dir_tree_ctx *ctx, size_t len)
+{
+	tchar *p;
+	size_t alloc;
+
+	if (len < ctx->full_path_alloc)
+		return 0;
+	alloc = max(len + 1, max(2 * ctx->full_path_alloc, 256));
+	p = REALLOC(ctx->full_path, alloc * sizeof(tchar));
+	if (!p)
+		return WIMLIB_ERR_NOMEM;
+	ctx->full_path = p;
+	ctx->full_path_alloc = alloc;
+	return 0;
+}
+
+/* Set the full path to that of the dentry at which the iteration starts.  */
+static int
+set_starting_full_path(struct iterate_dir_tree_ctx *ctx,
+		       struct wim_dentry *dentry)
+{
+	size_t len;
+	int ret;
+
+	ret = calculate_dentry_full_path(dentry);
+	if (ret)
+		return ret;
+	len = tstrlen(dentry->d_full_path);
+	ret = ensure_full_path_space(ctx, len);
+	if (ret == 0) {
+		tmemcpy(ctx->full_path, dentry->d_full_path, len + 1);
+		ctx->full_path_len = len;
+	}
+	FREE(dentry->d_full_path);
+	dentry->d_full_path = NULL;
+	return ret;
+}
+
+/* Replace everything after the first @parent_len characters of the full path
+ * with the name of a child of the directory whose path they are.  */
+static int
+set_child_full_path(struct iterate_dir_tree_ctx *ctx, size_t parent_len,
+		    bool parent_is_root, const tchar *name, size_t name_nchars)
+{
+	size_t pos = parent_len;
+	int ret;
+
+	ret = ensure_full_path_space(ctx, parent_len + 1 + name_nchars);
+	if (ret)
+		return ret;
+	if (!parent_is_root)
+		ctx->full_path[pos++] = WIM_PATH_SEPARATOR;
+	tmemcpy(&ctx->full_path[pos], name, name_nchars);
+	pos += name_nchars;
+	ctx->full_path[pos] = T('\0');
+	ctx->full_path_len = pos;
+	return 0;
+}
+
+static void
+release_wimlib_dentry_strings(const struct wimlib_dir_entry *wdentry)
+{
+	utf16le_put_tstr(wdentry->filename);
+	utf16le_put_tstr(wdentry->dos_name);
+	for (unsigned i = 1; i <= wdentry->num_named_streams; i++)
+		utf16le_put_tstr(wdentry->streams[i].stream_name);
+}
+
+/* Pass the pending entries to the callback and empty the buffer.  */
+static int
+flush_wimlib_dentries(struct iterate_dir_tree_ctx *ctx)
+{
+	int ret = 0;
+
+	if (ctx->num_entries == 0)
+		return 0;
+	if (ctx->batch_cb)
+		ret = (*ctx->batch_cb)(ctx->entries, ctx->num_entries,
+				       ctx->user_ctx);
+	else
+		ret = (*ctx->cb)(ctx->entries[0], ctx->user_ctx);
+	for (size_t i = 0; i < ctx->num_entries; i++)
+		release_wimlib_dentry_strings(ctx->entries[i]);
+	ctx->num_entries = 0;
+	ctx->buf_used = 0;
+	return ret;
+}
+
+/* Get zeroed space in the buffer for a new entry of @size bytes, passing the
+ * pending entries to the callback first if they leave too little room.  */
+static int
+alloc_wimlib_dentry(struct iterate_dir_tree_ctx *ctx, size_t size,
+		    struct wimlib_dir_entry **wdentry_ret)
+{
+	int ret;
+
+	if (ctx->buf_size - ctx->buf_used < size) {
+		ret = flush_wimlib_dentries(ctx);
+		if (ret)
+			return ret;
+		if (ctx->buf_size < size) {
+			size_t new_size = max(size, ITERATE_DIR_TREE_BUF_SIZE);
+			u8 *buf = REALLOC(ctx->buf, new_size);
+
+			if (!buf)
+				return WIMLIB_ERR_NOMEM;
+			ctx->buf = buf;
+			ctx->buf_size = new_size;
+		}
+	}
+	if (ctx->num_entries == ctx->entries_alloc) {
+		size_t new_alloc = max(2 * ctx->entries_alloc, 64);
+		const struct wimlib_dir_entry **entries;
+
+		entries = REALLOC(ctx->entries, new_alloc * sizeof(entries[0]));
+		if (!entries)
+			return WIMLIB_ERR_NOMEM;
+		ctx->entries = entries;
+		ctx->entries_alloc = new_alloc;
+	}
+	*wdentry_ret = (struct wimlib_dir_entry *)&ctx->buf[ctx->buf_used];
+	memset(*wdentry_ret, 0, size);
+	ctx->buf_used += size;
+	return 0;
+}
+
+/*
+ * Build the entry for @dentry at the end of the buffer.  If @parent_len is
+ * nonzero, the first @parent_len characters of the full path are the path of
+ * the dentry's parent; otherwise the full path is already that of the dentry.
+ */
 static int
-init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
-		   WIMStruct *wim, int flags)
+init_wimlib_dentry(struct iterate_dir_tree_ctx *ctx, struct wim_dentry *dentry,
+		   unsigned depth, size_t parent_len)
 {
+	WIMStruct *wim = ctx->wim;
+	int flags = ctx->flags;
+	struct wimlib_dir_entry *wdentry;
+	const tchar *filename;
+	size_t filename_nbytes;
+	const tchar *dos_name;
+	unsigned num_streams = 1;
+	size_t streams_end;
+	tchar *full_path;
 	int ret;
 	const struct wim_inode *inode = dentry->d_inode;
 	const struct wim_inode_stream *strm;
@@ -93,24 +264,53 @@ init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
 	u32 object_id_len;
 
 	ret = utf16le_get_tstr(dentry->d_name, dentry->d_name_nbytes,
-			       &wdentry->filename, NULL);
+			       &filename, &filename_nbytes);
 	if (ret)
 		return ret;
 
+	if (parent_len) {
+		ret = set_child_full_path(ctx, parent_len,
+					  dentry_is_root(dentry->d_parent),
+					  filename,
+					  filename_nbytes / sizeof(tchar));
+		if (ret)
+			goto err_put_filename;
+	}
+
 	ret = utf16le_get_tstr(dentry->d_short_name, dentry->d_short_name_nbytes,
-			       &wdentry->dos_name, NULL);
+			       &dos_name, NULL);
 	if (ret)
-		return ret;
+		goto err_put_filename;
 
-	ret = calculate_dentry_full_path(dentry);
+	if (!(flags & WIMLIB_ITERATE_DIR_TREE_FLAG_NO_STREAMS)) {
+		for (unsigned i = 0; i < inode->i_num_streams; i++)
+			if (stream_is_named_data_stream(&inode->i_streams[i]))
+				num_streams++;
+	}
+
+	streams_end = sizeof(*wdentry) +
+		      num_streams * sizeof(struct wimlib_stream_entry);
+	ret = alloc_wimlib_dentry(ctx,
+				  ALIGN(streams_end + (ctx->full_path_len + 1) *
+						sizeof(tchar), 8),
+				  &wdentry);
 	if (ret)
-		return ret;
-	wdentry->full_path = dentry->d_full_path;
+		goto err_put_dos_name;
+	ctx->entries[ctx->num_entries++] = wdentry;
 
-	for (struct wim_dentry *d = dentry; !dentry_is_root(d); d = d->d_parent)
-		wdentry->depth++;
+	/* From here on the strings are released with the entry.  */
+	wdentry->filename = filename;
+	wdentry->dos_name = dos_name;
+
+	full_path = (tchar *)((u8 *)wdentry + streams_end);
+	tmemcpy(full_path, ctx->full_path, ctx->full_path_len + 1);
+	wdentry->full_path = full_path;
 
-	if (inode_has_security_descriptor(inode)) {
+	wdentry->depth = depth;
+
+	if (inode_has_security_descriptor(inode) &&
+	    !(flags & WIMLIB_ITERATE_DIR_TREE_FLAG_NO_SECURITY_DESCRIPTORS))
+	{
 		struct wim_security_data *sd;
 
 		sd = wim_get_current_security_data(wim);
@@ -146,6 +346,9 @@ init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
 		       min(object_id_len, sizeof(wdentry->object_id)));
 	}
 
+	if (flags & WIMLIB_ITERATE_DIR_TREE_FLAG_NO_STREAMS)
+		return 0;
+
 	strm = inode_get_unnamed_stream(inode, get_default_stream_type(inode));
 	if (strm) {
 		ret = stream_to_wimlib_stream_entry(inode, strm,
@@ -172,111 +375,131 @@ init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
 			return ret;
 	}
 	return 0;
-}
 
-static void
-free_wimlib_dentry(struct wimlib_dir_entry *wdentry)
-{
-	utf16le_put_tstr(wdentry->filename);
-	utf16le_put_tstr(wdentry->dos_name);
-	for (unsigned i = 1; i <= wdentry->num_named_streams; i++)
-		utf16le_put_tstr(wdentry->streams[i].stream_name);
-	FREE(wdentry);
+err_put_dos_name:
+	utf16le_put_tstr(dos_name);
+err_put_filename:
+	utf16le_put_tstr(filename);
+	return ret;
 }
 
 static int
-do_iterate_dir_tree(WIMStruct *wim,
+do_iterate_dir_tree(struct iterate_dir_tree_ctx *ctx,
 		    struct wim_dentry *dentry, int flags,
-		    wimlib_iterate_dir_tree_callback_t cb,
-		    void *user_ctx)
+		    unsigned depth, size_t parent_len)
 {
-	struct wimlib_dir_entry *wdentry;
-	int ret = WIMLIB_ERR_NOMEM;
-
-
-	wdentry = CALLOC(1, sizeof(struct wimlib_dir_entry) +
-				  (1 + dentry->d_inode->i_num_streams) *
-					sizeof(struct wimlib_stream_entry));
-	if (wdentry == NULL)
-		goto out;
-
-	ret = init_wimlib_dentry(wdentry, dentry, wim, flags);
-	if (ret)
-		goto out_free_wimlib_dentry;
+	int ret;
 
 	if (!(flags & WIMLIB_ITERATE_DIR_TREE_FLAG_CHILDREN)) {
-		ret = (*cb)(wdentry, user_ctx);
+		ret = init_wimlib_dentry(ctx, dentry, depth, parent_len);
 		if (ret)
-			goto out_free_wimlib_dentry;
+			return ret;
+		if (!ctx->batch_cb) {
+			ret = flush_wimlib_dentries(ctx);
+			if (ret)
+				return ret;
+		}
 	}
 
 	if (flags & (WIMLIB_ITERATE_DIR_TREE_FLAG_RECURSIVE |
 		     WIMLIB_ITERATE_DIR_TREE_FLAG_CHILDREN))
 	{
 		struct wim_dentry *child;
+		size_t len = ctx->full_path_len;
 
-		ret = 0;
 		for_dentry_child(child, dentry) {
-			ret = do_iterate_dir_tree(wim, child,
+			ret = do_iterate_dir_tree(ctx, child,
 						  flags & ~WIMLIB_ITERATE_DIR_TREE_FLAG_CHILDREN,
-						  cb, user_ctx);
+						  depth + 1, len);
 			if (ret)
-				break;
+				return ret;
 		}
 	}
-out_free_wimlib_dentry:
-	FREE(dentry->d_full_path);
-	dentry->d_full_path = NULL;
-	free_wimlib_dentry(wdentry);
-out:
-	return ret;
+	return 0;
 }
 
-struct image_iterate_dir_tree_ctx {
-	const tchar *path;
-	int flags;
-	wimlib_iterate_dir_tree_callback_t cb;
-	void *user_ctx;
-};
-
-
 static int
 image_do_iterate_dir_tree(WIMStruct *wim)
 {
-	struct image_iterate_dir_tree_ctx *ctx = wim->private;
+	struct iterate_dir_tree_ctx *ctx = wim->private;
 	struct wim_dentry *dentry;
+	unsigned depth = 0;
+	int ret;
 
 	dentry = get_dentry(wim, ctx->path, WIMLIB_CASE_PLATFORM_DEFAULT);
 	if (dentry == NULL)
 		return WIMLIB_ERR_PATH_DOES_NOT_EXIST;
-	return do_iterate_dir_tree(wim, dentry, ctx->flags, ctx->cb, ctx->user_ctx);
+
+	ret = set_starting_full_path(ctx, dentry);
+	if (ret)
+		return ret;
+	for (struct wim_dentry *d = dentry; !dentry_is_root(d); d = d->d_parent)
+		depth++;
+
+	ret = do_iterate_dir_tree(ctx, dentry, ctx->flags, depth, 0);
+
+	/* The entries may refer to this image's metadata, so don't keep them
+	 * past it.  */
+	if (ret == 0)
+		ret = flush_wimlib_dentries(ctx);
+	for (size_t i = 0; i < ctx->num_entries; i++)
+		release_wimlib_dentry_strings(ctx->entries[i]);
+	ctx->num_entries = 0;
+	ctx->buf_used = 0;
+	return ret;
 }
 
-/* API function documented in wimlib.h  */
-WIMLIBAPI int
-wimlib_iterate_dir_tree(WIMStruct *wim, int image, const tchar *_path,
-			int flags,
-			wimlib_iterate_dir_tree_callback_t cb, void *user_ctx)
+static int
+iterate_dir_tree(WIMStruct *wim, int image, const tchar *_path, int flags,
+		 wimlib_iterate_dir_tree_callback_t cb,
+		 wimlib_iterate_dir_tree_batch_callback_t batch_cb,
+		 void *user_ctx)
 {
 	tchar *path;
 	int ret;
 
 	if (flags & ~(WIMLIB_ITERATE_DIR_TREE_FLAG_RECURSIVE |
 		      WIMLIB_ITERATE_DIR_TREE_FLAG_CHILDREN |
-		      WIMLIB_ITERATE_DIR_TREE_FLAG_RESOURCES_NEEDED))
+		      WIMLIB_ITERATE_DIR_TREE_FLAG_RESOURCES_NEEDED |
+		      WIMLIB_ITERATE_DIR_TREE_FLAG_NO_STREAMS |
+		      WIMLIB_ITERATE_DIR_TREE_FLAG_NO_SECURITY_DESCRIPTORS))
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	path = canonicalize_wim_path(_path);
 	if (path == NULL)
 		return WIMLIB_ERR_NOMEM;
-	struct image_iterate_dir_tree_ctx ctx = {
+	struct iterate_dir_tree_ctx ctx = {
+		.wim = wim,
 		.path = path,
 		.flags = flags,
 		.cb = cb,
+		.batch_cb = batch_cb,
 		.user_ctx = user_ctx,
 	};
 	wim->private = &ctx;
 	ret = for_image(wim, image, image_do_iterate_dir_tree);
+	FREE(ctx.full_path);
+	FREE(ctx.buf);
+	FREE(ctx.entries);
 	FREE(path);
 	return ret;
 }
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_iterate_dir_tree(WIMStruct *wim, int image, const tchar *path,
+			int flags,
+			wimlib_iterate_dir_tree_callback_t cb, void *user_ctx)
+{
+	return iterate_dir_tree(wim, image, path, flags, cb, NULL, user_ctx);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_iterate_dir_tree_batched(WIMStruct *wim, int image, const tchar *path,
+				int flags,
+				wimlib_iterate_dir_tree_batch_callback_t cb,
+				void *user_ctx)
+{
+	return iterate_dir_tree(wim, image, path, flags, NULL, cb, user_ctx);
+}
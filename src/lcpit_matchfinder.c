@@ -36,6 +36,7 @@
 
 #include "wimlib/divsufsort.h"
 #include "wimlib/lcpit_matchfinder.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/util.h"
 
 #define LCP_BITS		6
@@ -55,6 +56,21 @@
 
 #define PREFETCH_SAFETY		5
 
+/* In parallel mode, the minimum buffer size for which the arrays are built by
+ * multiple tasks, and the most tasks to use  */
+#define PARALLEL_MIN_BUFSIZE	(1 << 20)
+#define MAX_PARALLEL_TASKS	16
+
+/*
+ * Parts of the LCP array are built by different tasks at the same time.  A task
+ * reads the entries of SA_and_LCP for the ranks whose LCP values belong to
+ * other tasks, but only their SA bits, which never change.  Relaxed atomic
+ * accesses make this well-defined, and they compile to ordinary loads and
+ * stores.
+ */
+#define LOAD_RELAXED(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE_RELAXED(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
 /*
  * Build the LCP (Longest Common Prefix) array in linear time.
  *
@@ -81,6 +97,10 @@
  *    LCP value, and this caps the depth of the LCP-interval tree, without
  *    usually hurting the compression ratio too much.
  *
+ *  - Only process the suffix positions in [start, end), so that the work can
+ *    be divided among tasks.  A task starting in the middle just starts with
+ *    h = 0, which is always a valid lower bound; it only redoes a little work.
+ *
  * References:
  *
  *	Kasai et al.  2001.  Linear-Time Longest-Common-Prefix Computation in
@@ -90,14 +110,15 @@
 static void
 build_LCP(u32 SA_and_LCP[restrict], const u32 ISA[restrict],
 	  const u8 T[restrict], const u32 n,
-	  const u32 min_lcp, const u32 max_lcp)
+	  const u32 min_lcp, const u32 max_lcp, const u32 start, const u32 end)
 {
 	u32 h = 0;
-	for (u32 i = 0; i < n; i++) {
+	for (u32 i = start; i < end; i++) {
 		const u32 r = ISA[i];
 		prefetchw(&SA_and_LCP[ISA[i + PREFETCH_SAFETY]]);
 		if (r > 0) {
-			const u32 j = SA_and_LCP[r - 1] & POS_MASK;
+			const u32 j = LOAD_RELAXED(&SA_and_LCP[r - 1]) &
+				      POS_MASK;
 			const u32 lim = min(n - i, n - j);
 			while (h < lim && T[i + h] == T[j + h])
 				h++;
@@ -106,7 +127,9 @@ build_LCP(u32 SA_and_LCP[restrict], const u32 ISA[restrict],
 				stored_lcp = 0;
 			else if (stored_lcp > max_lcp)
 				stored_lcp = max_lcp;
-			SA_and_LCP[r] |= stored_lcp << LCP_SHIFT;
+			STORE_RELAXED(&SA_and_LCP[r],
+				      LOAD_RELAXED(&SA_and_LCP[r]) |
+				      (stored_lcp << LCP_SHIFT));
 			if (h > 0)
 				h--;
 		}
@@ -391,14 +414,16 @@ expand_SA(void *p, u32 n)
 static void
 build_LCP_huge(u64 SA_and_LCP64[restrict], const u32 ISA[restrict],
 	       const u8 T[restrict], const u32 n,
-	       const u32 min_lcp, const u32 max_lcp)
+	       const u32 min_lcp, const u32 max_lcp,
+	       const u32 start, const u32 end)
 {
 	u32 h = 0;
-	for (u32 i = 0; i < n; i++) {
+	for (u32 i = start; i < end; i++) {
 		const u32 r = ISA[i];
 		prefetchw(&SA_and_LCP64[ISA[i + PREFETCH_SAFETY]]);
 		if (r > 0) {
-			const u32 j = SA_and_LCP64[r - 1] & HUGE_POS_MASK;
+			const u32 j = LOAD_RELAXED(&SA_and_LCP64[r - 1]) &
+				      HUGE_POS_MASK;
 			const u32 lim = min(n - i, n - j);
 			while (h < lim && T[i + h] == T[j + h])
 				h++;
@@ -407,7 +432,9 @@ build_LCP_huge(u64 SA_and_LCP64[restrict], const u32 ISA[restrict],
 				stored_lcp = 0;
 			else if (stored_lcp > max_lcp)
 				stored_lcp = max_lcp;
-			SA_and_LCP64[r] |= (u64)stored_lcp << HUGE_LCP_SHIFT;
+			STORE_RELAXED(&SA_and_LCP64[r],
+				      LOAD_RELAXED(&SA_and_LCP64[r]) |
+				      ((u64)stored_lcp << HUGE_LCP_SHIFT));
 			if (h > 0)
 				h--;
 		}
@@ -580,20 +607,21 @@ lcpit_matchfinder_get_needed_memory(size_t max_bufsize)
  * @max_bufsize - maximum buffer size to support
  * @min_match_len - minimum match length in bytes
  * @nice_match_len - only consider this many bytes of each match
+ * @parallel - whether lcpit_matchfinder_load_buffer() may use the task pool
  *
  * Returns true if successfully initialized; false if out of memory.
  */
 bool
 lcpit_matchfinder_init(struct lcpit_matchfinder *mf, size_t max_bufsize,
-		       u32 min_match_len, u32 nice_match_len)
+		       u32 min_match_len, u32 nice_match_len, bool parallel)
 {
 	if (lcpit_matchfinder_get_needed_memory(max_bufsize) > SIZE_MAX)
 		return false;
 	if (max_bufsize > MAX_HUGE_BUFSIZE - PREFETCH_SAFETY)
 		return false;
 
-	mf->pos_data = MALLOC(get_pos_data_size(max_bufsize));
-	mf->intervals = MALLOC(get_intervals_size(max_bufsize));
+	mf->pos_data = LARGE_MALLOC(get_pos_data_size(max_bufsize));
+	mf->intervals = LARGE_MALLOC(get_intervals_size(max_bufsize));
 	if (!mf->pos_data || !mf->intervals) {
 		lcpit_matchfinder_destroy(mf);
 		return false;
@@ -601,6 +629,7 @@ lcpit_matchfinder_init(struct lcpit_matchfinder *mf, size_t max_bufsize,
 
 	mf->min_match_len = min_match_len;
 	mf->orig_nice_match_len = nice_match_len;
+	mf->parallel = parallel;
 	return true;
 }
 
@@ -629,13 +658,16 @@ lcpit_matchfinder_init(struct lcpit_matchfinder *mf, size_t max_bufsize,
  *	Issue 2, 2007 Article No. 4.
  */
 static void
-build_SA(u32 SA[], const u8 T[], u32 n, u32 *tmp)
+build_SA(u32 SA[], const u8 T[], u32 n, u32 *tmp, unsigned num_tasks)
 {
 	/* Note: divsufsort() requires a fixed amount of temporary space.  The
 	 * implementation of divsufsort() has been modified from the original to
 	 * use the provided temporary space instead of allocating its own, since
-	 * we don't want to have to deal with malloc() failures here.  */
-	divsufsort(T, SA, n, tmp);
+	 * we don't want to have to deal with malloc() failures here.  It has
+	 * also been modified to sort the type B* substrings, usually the most
+	 * time-consuming step, with multiple tasks; this is the only part of
+	 * the original algorithm that parallelizes well.  */
+	divsufsort(T, SA, n, tmp, num_tasks);
 }
 
 /*
@@ -645,12 +677,74 @@ build_SA(u32 SA[], const u8 T[], u32 n, u32 *tmp)
  * the inverse suffix array is a mapping from suffix position to suffix rank.
  */
 static void
-build_ISA(u32 ISA[restrict], const u32 SA[restrict], u32 n)
+build_ISA(u32 ISA[restrict], const u32 SA[restrict], u32 start, u32 end)
 {
-	for (u32 r = 0; r < n; r++)
+	for (u32 r = start; r < end; r++)
 		ISA[SA[r]] = r;
 }
 
+/* One part of either building ISA, building LCP, or building LCP in huge mode
+ * (depending on the function @run) for the buffer @T of length @n  */
+struct load_task {
+	struct pool_task base;
+	struct lcpit_matchfinder *mf;
+	const u8 *T;
+	u32 n;
+	u32 start;
+	u32 end;
+};
+
+static void
+build_ISA_task(struct pool_task *_task)
+{
+	struct load_task *task = (struct load_task *)_task;
+
+	build_ISA(task->mf->pos_data, task->mf->intervals,
+		  task->start, task->end);
+}
+
+static void
+build_LCP_task(struct pool_task *_task)
+{
+	struct load_task *task = (struct load_task *)_task;
+	struct lcpit_matchfinder *mf = task->mf;
+
+	build_LCP(mf->intervals, mf->pos_data, task->T, task->n,
+		  mf->min_match_len, mf->nice_match_len,
+		  task->start, task->end);
+}
+
+static void
+build_LCP_huge_task(struct pool_task *_task)
+{
+	struct load_task *task = (struct load_task *)_task;
+	struct lcpit_matchfinder *mf = task->mf;
+
+	build_LCP_huge(mf->intervals64, mf->pos_data, task->T, task->n,
+		       mf->min_match_len, mf->nice_match_len,
+		       task->start, task->end);
+}
+
+/* Run @run over [0, n) split into @num_tasks parts of about the same size.  */
+static void
+run_load_tasks(struct lcpit_matchfinder *mf, const u8 *T, u32 n,
+	       unsigned num_tasks, void (*run)(struct pool_task *))
+{
+	struct load_task tasks[MAX_PARALLEL_TASKS];
+	struct pool_task *task_ptrs[MAX_PARALLEL_TASKS];
+
+	for (unsigned i = 0; i < num_tasks; i++) {
+		tasks[i].base.run = run;
+		tasks[i].mf = mf;
+		tasks[i].T = T;
+		tasks[i].n = n;
+		tasks[i].start = ((u64)n * i) / num_tasks;
+		tasks[i].end = ((u64)n * (i + 1)) / num_tasks;
+		task_ptrs[i] = &tasks[i].base;
+	}
+	task_pool_run_batch(task_ptrs, num_tasks);
+}
+
 /*
  * Prepare the LCP-interval tree matchfinder for a new input buffer.
  *
@@ -662,20 +756,34 @@ build_ISA(u32 ISA[restrict], const u32 SA[restrict], u32 n)
 void
 lcpit_matchfinder_load_buffer(struct lcpit_matchfinder *mf, const u8 *T, u32 n)
 {
+	unsigned num_tasks = 1;
+
+	/* In parallel mode, building SA, ISA, and LCP is split among tasks,
+	 * which use whichever threads of the task pool are idle.  Building the
+	 * LCP-interval tree is inherently sequential, though.  */
+	if (mf->parallel && n >= PARALLEL_MIN_BUFSIZE)
+		num_tasks = min(task_pool_num_threads(), MAX_PARALLEL_TASKS);
+
 	/* intervals[] temporarily stores SA and LCP packed together.
 	 * pos_data[] temporarily stores ISA.
 	 * pos_data[] is also used as the temporary space for divsufsort().  */
 
-	build_SA(mf->intervals, T, n, mf->pos_data);
-	build_ISA(mf->pos_data, mf->intervals, n);
+	build_SA(mf->intervals, T, n, mf->pos_data, num_tasks);
+	if (num_tasks > 1)
+		run_load_tasks(mf, T, n, num_tasks, build_ISA_task);
+	else
+		build_ISA(mf->pos_data, mf->intervals, 0, n);
 	if (n <= MAX_NORMAL_BUFSIZE) {
 		mf->nice_match_len = min(mf->orig_nice_match_len, LCP_MAX);
 		for (u32 i = 0; i < PREFETCH_SAFETY; i++) {
 			mf->intervals[n + i] = 0;
 			mf->pos_data[n + i] = 0;
 		}
-		build_LCP(mf->intervals, mf->pos_data, T, n,
-			  mf->min_match_len, mf->nice_match_len);
+		if (num_tasks > 1)
+			run_load_tasks(mf, T, n, num_tasks, build_LCP_task);
+		else
+			build_LCP(mf->intervals, mf->pos_data, T, n,
+				  mf->min_match_len, mf->nice_match_len, 0, n);
 		build_LCPIT(mf->intervals, mf->pos_data, n);
 		mf->huge_mode = false;
 	} else {
@@ -685,8 +793,13 @@ lcpit_matchfinder_load_buffer(struct lcpit_matchfinder *mf, const u8 *T, u32 n)
 			mf->pos_data[n + i] = 0;
 		}
 		expand_SA(mf->intervals, n);
-		build_LCP_huge(mf->intervals64, mf->pos_data, T, n,
-			       mf->min_match_len, mf->nice_match_len);
+		if (num_tasks > 1)
+			run_load_tasks(mf, T, n, num_tasks,
+				       build_LCP_huge_task);
+		else
+			build_LCP_huge(mf->intervals64, mf->pos_data, T, n,
+				       mf->min_match_len, mf->nice_match_len,
+				       0, n);
 		build_LCPIT_huge(mf->intervals64, mf->pos_data, n);
 		mf->huge_mode = true;
 	}
@@ -26,6 +26,7 @@
 #include "wimlib/cpu_features.h"
 #include "wimlib/lzms_common.h"
 #include "wimlib/unaligned.h"
+#include "wimlib/util.h"
 
 #ifdef __x86_64__
 #  include <emmintrin.h>
@@ -378,6 +379,30 @@ lzms_dilute_symbol_frequencies(u32 freqs[], unsigned num_syms)
 }
 
 
+/* Whether lzms_x86_filter() searches for opcodes with SSE4.2.  This is set by
+ * the "lzms_x86_filter" kernel.  */
+static bool lzms_x86_filter_use_sse4_2;
+
+static const struct cpu_impl lzms_x86_filter_impls[] = {
+#ifdef __x86_64__
+	{ "sse4.2", NULL, X86_CPU_FEATURE_SSE4_2 },
+#endif
+	{ "generic", NULL, 0 },
+};
+
+static void
+lzms_x86_filter_select(const struct cpu_impl *impl)
+{
+	lzms_x86_filter_use_sse4_2 = (impl->features != 0);
+}
+
+const struct cpu_kernel lzms_x86_filter_kernel = {
+	.name = "lzms_x86_filter",
+	.impls = lzms_x86_filter_impls,
+	.num_impls = ARRAY_LEN(lzms_x86_filter_impls),
+	.select = lzms_x86_filter_select,
+};
+
 #ifdef __x86_64__
 static forceinline u8 *
 find_next_opcode_sse4_2(u8 *p)
@@ -614,7 +639,7 @@ lzms_x86_filter(u8 data[restrict], s32 size,
 	tail_ptr = &data[size - 16];
 
 #ifdef __x86_64__
-	if (cpu_features & X86_CPU_FEATURE_SSE4_2) {
+	if (lzms_x86_filter_use_sse4_2) {
 		u8 saved_byte = *tail_ptr;
 		*tail_ptr = 0xE8;
 		for (;;) {
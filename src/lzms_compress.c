@@ -30,6 +30,7 @@
 
 #include "wimlib/compress_common.h"
 #include "wimlib/compressor_ops.h"
+#include "wimlib/compressor_stats.h"
 #include "wimlib/error.h"
 #include "wimlib/lcpit_matchfinder.h"
 #include "wimlib/lzms_common.h"
@@ -37,6 +38,31 @@
 #include "wimlib/unaligned.h"
 #include "wimlib/util.h"
 
+/*
+ * Hash chains matchfinders for the fast algorithm: one with the default hash
+ * table sizes, for small buffers, and one with much larger hash tables, for
+ * buffers larger than FAST_MAX_SMALL_BUFSIZE.  With large buffers the chains
+ * would otherwise get so long that the search depth limit would be reached
+ * before finding the good matches.
+ */
+#define FAST_MAX_SMALL_BUFSIZE	1048576
+
+#define mf_pos_t	u32
+#define MF_SUFFIX	_small
+#include "wimlib/hc_matchfinder.h"
+
+#undef MF_SUFFIX
+#undef HC_MATCHFINDER_HASH3_ORDER
+#undef HC_MATCHFINDER_HASH4_ORDER
+#define MF_SUFFIX	_large
+#define HC_MATCHFINDER_HASH3_ORDER	16
+#define HC_MATCHFINDER_HASH4_ORDER	22
+#include "wimlib/hc_matchfinder.h"
+
+#define CALL_HC_MF(large, c, funcname, ...)				     \
+	((large) ? CONCAT(funcname, _large)((c)->hc_mf_large, ##__VA_ARGS__) : \
+		   CONCAT(funcname, _small)((c)->hc_mf_small, ##__VA_ARGS__))
+
 /*
  * MAX_FAST_LENGTH is the maximum match length for which the length slot can be
  * looked up directly in 'fast_length_slot_tab' and the length cost can be
@@ -50,6 +76,14 @@
  */
 #define MAX_FAST_LENGTH		255
 
+/*
+ * At compression levels <= MAX_FAST_LEVEL, a much faster algorithm is used:
+ * lazy parsing with a hash chains matchfinder rather than near-optimal parsing
+ * with the LCP-interval tree matchfinder.  The output is still ordinary LZMS;
+ * it just doesn't use delta matches, and the choice of matches is simpler.
+ */
+#define MAX_FAST_LEVEL		24
+
 /* NUM_OPTIM_NODES is the maximum number of bytes the parsing algorithm will
  * step forward before forcing the pending items to be encoded.  If this value
  * is increased, then there will be fewer forced flushes, but the probability
@@ -72,6 +106,19 @@
  * LZMS_NUM_DELTA_POWER_SYMS)  */
 #define NUM_POWERS_TO_CONSIDER	6
 
+/*
+ * The search for explicit offset delta matches is suspended in regions of the
+ * input where it isn't paying off.  Every DELTA_SEGMENT_SIZE bytes, if fewer
+ * than DELTA_SEGMENT_SIZE / DELTA_MIN_USE_RATIO bytes were coded with delta
+ * matches, the search is suspended for DELTA_IDLE_SEGMENTS segments, then
+ * retried.  Repeat offset delta matches are always considered, since they are
+ * cheap to check.  This is only done below level 100; at higher levels the
+ * search is never suspended.
+ */
+#define DELTA_SEGMENT_SIZE	32768
+#define DELTA_MIN_USE_RATIO	256
+#define DELTA_IDLE_SEGMENTS	4
+
 /* This structure tracks the state of writing bits as a series of 16-bit coding
  * units, starting at the end of the output buffer and proceeding backwards.  */
 struct lzms_output_bitstream {
@@ -256,9 +303,16 @@ struct lzms_optimum_node {
 /* The main compressor structure  */
 struct lzms_compressor {
 
-	/* The matchfinder for LZ matches  */
+	/* The matchfinder for LZ matches, if not using the fast algorithm  */
 	struct lcpit_matchfinder mf;
 
+	/* The matchfinder for LZ matches and its parameters, if using the fast
+	 * algorithm.  At most one of the matchfinders is allocated.  */
+	struct hc_matchfinder_small *hc_mf_small;
+	struct hc_matchfinder_large *hc_mf_large;
+	u32 fast_nice_len;
+	u32 fast_max_search_depth;
+
 	/* The preprocessed buffer of data being compressed  */
 	u8 *in_buffer;
 
@@ -286,10 +340,30 @@ struct lzms_compressor {
 	 */
 	bool use_delta_matches;
 
+	/* If true, the search for explicit offset delta matches may be
+	 * suspended where it isn't paying off (see DELTA_SEGMENT_SIZE).  */
+	bool adaptive_delta_search;
+
+	/* If true, the compressor is currently searching for explicit offset
+	 * delta matches  */
+	bool delta_search_active;
+
+	/* The position at which to next reconsider whether to search for
+	 * explicit offset delta matches, the number of bytes coded with delta
+	 * matches since the last time, and while the search is suspended, the
+	 * number of segments left before it is retried  */
+	u32 delta_segment_end;
+	u32 delta_match_bytes;
+	u32 delta_idle_segments;
+
 	/* If true, the compressor need not preserve the input buffer if it
 	 * compresses the data successfully.  */
 	bool destructive;
 
+#ifdef ENABLE_COMPRESSOR_STATS
+	struct wimlib_compressor_stats stats;
+#endif
+
 	/* 'last_target_usages' is a large array that is only needed for
 	 * preprocessing, so it is in union with fields that don't need to be
 	 * initialized until after preprocessing.  */
@@ -841,12 +915,15 @@ lzms_encode_item(struct lzms_compressor *c, u32 length, u32 source)
 		/* Literal  */
 		unsigned literal = source;
 		lzms_encode_literal_symbol(c, literal);
+		COMPRESSOR_STATS(stats_add_literals(&c->stats, 1));
 	} else {
 		/* Match  */
 
 		/* Match bit: 0 = LZ match, 1 = delta match  */
 		int match_bit = (source & DELTA_SOURCE_TAG) != 0;
 		lzms_encode_match_bit(c, match_bit);
+		if (match_bit)
+			c->delta_match_bytes += length;
 
 		if (!match_bit) {
 			/* LZ match  */
@@ -859,6 +936,9 @@ lzms_encode_item(struct lzms_compressor *c, u32 length, u32 source)
 				/* Explicit offset LZ match  */
 				u32 offset = source - (LZMS_NUM_LZ_REPS - 1);
 				lzms_encode_lz_offset(c, offset);
+				COMPRESSOR_STATS(stats_add_match(&c->stats,
+								 length,
+								 offset));
 			} else {
 				/* Repeat offset LZ match  */
 				int rep_idx = source;
@@ -866,11 +946,15 @@ lzms_encode_item(struct lzms_compressor *c, u32 length, u32 source)
 					lzms_encode_lz_rep_bit(c, 1, i);
 				if (rep_idx < LZMS_NUM_LZ_REP_DECISIONS)
 					lzms_encode_lz_rep_bit(c, 0, rep_idx);
+				COMPRESSOR_STATS(stats_add_repeat_match(&c->stats,
+									length));
 			}
 		} else {
 			/* Delta match  */
 
 			source &= ~DELTA_SOURCE_TAG;
+			COMPRESSOR_STATS(stats_add_delta_match(&c->stats,
+							       length));
 
 			/* Delta bit: 0 = explicit offset, 1 = repeat offset  */
 			int delta_bit = (source < LZMS_NUM_DELTA_REPS);
@@ -1191,12 +1275,73 @@ lzms_init_delta_matchfinder(struct lzms_compressor *c)
 	 * initially; it doesn't really matter.  */
 	for (u32 i = 0; i < NUM_POWERS_TO_CONSIDER; i++)
 		c->next_delta_hashes[i] = 0;
+
+	c->delta_search_active = true;
+	c->delta_segment_end = DELTA_SEGMENT_SIZE;
+	c->delta_match_bytes = 0;
+}
+
+/*
+ * Called when parsing reaches the end of a segment of DELTA_SEGMENT_SIZE bytes:
+ * suspend the search for explicit offset delta matches if it found too little
+ * in the segment just finished, or resume it if it has been suspended long
+ * enough.  While suspended, the hash table isn't updated either; its entries
+ * only become older, and any candidate found in it is verified anyway.
+ */
+static void
+lzms_update_delta_search(struct lzms_compressor *c, u32 pos)
+{
+	c->delta_segment_end = pos + DELTA_SEGMENT_SIZE;
+	if (c->delta_search_active) {
+		if (c->delta_match_bytes <
+		    DELTA_SEGMENT_SIZE / DELTA_MIN_USE_RATIO) {
+			c->delta_search_active = false;
+			c->delta_idle_segments = DELTA_IDLE_SEGMENTS;
+		}
+	} else if (--c->delta_idle_segments == 0) {
+		c->delta_search_active = true;
+	}
+	c->delta_match_bytes = 0;
+}
+
+/*
+ * Subtract each byte of @b from the corresponding byte of @a, modulo 256,
+ * without letting borrows cross byte boundaries.  This computes the delta
+ * values of a whole word's worth of positions at once.
+ */
+static forceinline machine_word_t
+lzms_bytewise_sub(machine_word_t a, machine_word_t b)
+{
+	const machine_word_t high_bits = (~(machine_word_t)0 / 0xFF) * 0x80;
+
+	return ((a | high_bits) - (b & ~high_bits)) ^ ((a ^ ~b) & high_bits);
+}
+
+/*
+ * Return the delta values, in a delta context with the specified @span, of the
+ * WORDBYTES bytes beginning at @p, arranged in the word as the bytes
+ * themselves would be by load_word_unaligned().
+ */
+static forceinline machine_word_t
+lzms_load_delta_word(const u8 *p, u32 span)
+{
+	return lzms_bytewise_sub(load_word_unaligned(p),
+				 load_word_unaligned(p - span));
+}
+
+/* Like lzms_load_delta_word(), but for the 4 bytes beginning at @p.  */
+static forceinline u32
+lzms_load_delta_u32(const u8 *p, u32 span)
+{
+	return lzms_bytewise_sub(load_u32_unaligned(p),
+				 load_u32_unaligned(p - span));
 }
 
 /*
  * Compute a DELTA_HASH_ORDER-bit hash code for the first
  * NBYTES_HASHED_FOR_DELTA bytes of the sequence beginning at @p when taken in a
- * delta context with the specified @span.
+ * delta context with the specified @span.  At least 4 bytes must be available
+ * at @p.
  */
 static forceinline u32
 lzms_delta_hash(const u8 *p, const u32 pos, u32 span)
@@ -1208,23 +1353,38 @@ lzms_delta_hash(const u8 *p, const u32 pos, u32 span)
 	 * of the current position.  */
 
 	STATIC_ASSERT(NBYTES_HASHED_FOR_DELTA == 3);
-	u8 d0 = *(p + 0) - *(p + 0 - span);
-	u8 d1 = *(p + 1) - *(p + 1 - span);
-	u8 d2 = *(p + 2) - *(p + 2 - span);
 	u32 v = ((span + (pos & (span - 1))) << 24) |
-		((u32)d2 << 16) | ((u32)d1 << 8) | d0;
+		loaded_u32_to_u24(lzms_load_delta_u32(p, span));
 	return lz_hash(v, DELTA_HASH_ORDER);
 }
 
 /*
  * Given a match between @in_next and @matchptr in a delta context with the
  * specified @span and having the initial @len, extend the match as far as
- * possible, up to a limit of @max_len.
+ * possible, up to a limit of @max_len.  Like lz_extend(), this compares a word
+ * at a time, but it compares delta values rather than the bytes themselves.
  */
 static forceinline u32
 lzms_extend_delta_match(const u8 *in_next, const u8 *matchptr,
 			u32 len, u32 max_len, u32 span)
 {
+	machine_word_t v_word;
+
+	if (UNALIGNED_ACCESS_IS_FAST) {
+		while (len + WORDBYTES <= max_len) {
+			v_word = lzms_load_delta_word(in_next + len, span) ^
+				 lzms_load_delta_word(matchptr + len, span);
+			if (v_word != 0) {
+				if (CPU_IS_LITTLE_ENDIAN())
+					len += bsfw(v_word) >> 3;
+				else
+					len += (WORDBITS - 1 - bsrw(v_word)) >> 3;
+				return len;
+			}
+			len += WORDBYTES;
+		}
+	}
+
 	while (len < max_len &&
 	       (u8)(*(in_next + len) - *(in_next + len - span)) ==
 	       (u8)(*(matchptr + len) - *(matchptr + len - span)))
@@ -1265,7 +1425,7 @@ static const u8 *
 lzms_skip_bytes(struct lzms_compressor *c, u32 count, const u8 *in_next)
 {
 	lcpit_matchfinder_skip_bytes(&c->mf, count);
-	if (c->use_delta_matches)
+	if (c->delta_search_active)
 		lzms_delta_matchfinder_skip_bytes(c, in_next, count);
 	return in_next + count;
 }
@@ -1306,6 +1466,9 @@ lzms_near_optimal_parse(struct lzms_compressor *c)
 	struct lzms_optimum_node *cur_node;
 	struct lzms_optimum_node *end_node;
 
+	/* This is the only parsing pass.  */
+	COMPRESSOR_STATS(c->stats.num_optimization_passes++);
+
 	/* Set initial length costs for lengths <= MAX_FAST_LENGTH.  */
 	lzms_update_fast_length_costs(c);
 
@@ -1323,6 +1486,10 @@ begin:
 	if (in_next == in_end)
 		return;
 
+	if (c->adaptive_delta_search &&
+	    in_next - c->in_buffer >= c->delta_segment_end)
+		lzms_update_delta_search(c, in_next - c->in_buffer);
+
 	/* The following loop runs once for each per byte in the input buffer,
 	 * except in a few shortcut cases.  */
 	for (;;) {
@@ -1710,8 +1877,8 @@ begin:
 		}
 
 		/* Explicit offset delta matches  */
-		if (c->use_delta_matches &&
-		    likely(in_end - in_next >= NBYTES_HASHED_FOR_DELTA + 1))
+		if (c->delta_search_active &&
+		    likely(in_end - in_next >= NBYTES_HASHED_FOR_DELTA + 2))
 		{
 			const u32 pos = in_next - c->in_buffer;
 
@@ -1746,12 +1913,9 @@ begin:
 				/* Check the first 3 bytes before entering the
 				 * extension loop.  */
 				STATIC_ASSERT(NBYTES_HASHED_FOR_DELTA == 3);
-				if (((u8)(*(in_next + 0) - *(in_next + 0 - span)) !=
-				     (u8)(*(matchptr + 0) - *(matchptr + 0 - span))) ||
-				    ((u8)(*(in_next + 1) - *(in_next + 1 - span)) !=
-				     (u8)(*(matchptr + 1) - *(matchptr + 1 - span))) ||
-				    ((u8)(*(in_next + 2) - *(in_next + 2 - span)) !=
-				     (u8)(*(matchptr + 2) - *(matchptr + 2 - span))))
+				if (loaded_u32_to_u24(
+					lzms_load_delta_u32(in_next, span) ^
+					lzms_load_delta_u32(matchptr, span)))
 					continue;
 
 				/* Extend the delta match to its full length.  */
@@ -2008,6 +2172,253 @@ begin:
 	}
 }
 
+/******************************************************************************
+ *                              Lazy parsing                                  *
+ ******************************************************************************/
+
+/*
+ * Fast heuristic scoring for lazy parsing: how "good" is this match?  Like the
+ * scoring in the LZX compressor, this is mainly determined by the length, but
+ * close matches and repeat offset matches are favored since they need fewer
+ * bits.  LZMS offsets can be much larger, so distant matches are penalized more.
+ */
+static forceinline u32
+lzms_explicit_offset_match_score(u32 len, u32 offset)
+{
+	u32 score = len;
+
+	if (offset < 65536)
+		score++;
+	if (offset < 4096)
+		score++;
+	if (offset < 256)
+		score++;
+	return score;
+}
+
+static forceinline u32
+lzms_repeat_offset_match_score(u32 rep_len)
+{
+	return rep_len + 3;
+}
+
+/*
+ * Return the length of the longest repeat offset LZ match at @in_next, or 0 if
+ * there is none.  At least LZMS_NUM_LZ_REPS bytes must precede @in_next, and
+ * @max_len must be at least 2.
+ */
+static forceinline u32
+lzms_find_longest_rep_match(const u8 *in_next, u32 max_len,
+			    const struct lzms_adaptive_state *state,
+			    u32 *rep_idx_ret)
+{
+	const u16 next_2_bytes = load_u16_unaligned(in_next);
+	u32 best_len = 0;
+
+	for (int rep_idx = 0; rep_idx < LZMS_NUM_LZ_REPS; rep_idx++) {
+		const u8 *matchptr = in_next - state->recent_lz_offsets[rep_idx];
+		u32 len;
+
+		if (load_u16_unaligned(matchptr) != next_2_bytes)
+			continue;
+		len = lz_extend(in_next, matchptr, 2, max_len);
+		if (len > best_len) {
+			best_len = len;
+			*rep_idx_ret = rep_idx;
+		}
+	}
+	return best_len;
+}
+
+/*
+ * Encode an item chosen by the lazy parser and advance the LRU queues past it.
+ * Only the LRU queues of @state are maintained, since the lazy parser doesn't
+ * evaluate costs.
+ */
+static forceinline void
+lzms_lazy_choose_literal(struct lzms_compressor *c,
+			 struct lzms_adaptive_state *state, u8 literal)
+{
+	lzms_encode_item(c, 1, literal);
+	state->upcoming_lz_offset = 0;
+	state->upcoming_delta_pair = 0;
+	lzms_update_lru_queues(state);
+}
+
+static forceinline void
+lzms_lazy_choose_explicit_match(struct lzms_compressor *c,
+				struct lzms_adaptive_state *state,
+				u32 len, u32 offset)
+{
+	lzms_encode_item(c, len, offset + LZMS_NUM_LZ_REPS - 1);
+	state->upcoming_lz_offset = offset;
+	state->upcoming_delta_pair = 0;
+	lzms_update_lru_queues(state);
+}
+
+static forceinline void
+lzms_lazy_choose_rep_match(struct lzms_compressor *c,
+			   struct lzms_adaptive_state *state,
+			   u32 len, int rep_idx)
+{
+	lzms_encode_item(c, len, rep_idx);
+	state->upcoming_lz_offset = state->recent_lz_offsets[rep_idx];
+	state->upcoming_delta_pair = 0;
+	for (int i = rep_idx; i < LZMS_NUM_LZ_REPS; i++)
+		state->recent_lz_offsets[i] = state->recent_lz_offsets[i + 1];
+	lzms_update_lru_queues(state);
+}
+
+/*
+ * The lazy parsing routine used at low compression levels.  Before it chooses a
+ * match, it checks whether there's a better match at the next position; if so,
+ * it chooses a literal instead and continues from the next position.  Repeat
+ * offset matches are considered favorably, and matches of at least nice_len
+ * bytes are chosen immediately.
+ *
+ * Since the queue of recent offsets is only updated after a delay of one item,
+ * the repeat offsets at the next position depend on whether a literal is chosen
+ * at the current one; so the lookahead uses a copy of the state that assumes
+ * the literal.
+ */
+static forceinline void
+lzms_lazy_parse(struct lzms_compressor *c, bool large)
+{
+	const u8 * const in_begin = c->in_buffer;
+	const u8 *in_next = in_begin;
+	const u8 * const in_end = in_begin + c->in_nbytes;
+	u32 max_len = c->in_nbytes;
+	u32 nice_len = min(c->fast_nice_len, max_len);
+	struct lzms_adaptive_state state;
+	struct lzms_adaptive_state next_state;
+	u32 next_hashes[2] = {0, 0};
+
+	lzms_init_adaptive_state(&state);
+	CALL_HC_MF(large, c, hc_matchfinder_init);
+
+	while (in_next != in_end) {
+		u32 cur_len, cur_offset, cur_score;
+		u32 next_len, next_offset, next_score;
+		u32 rep_len, rep_score;
+		u32 rep_idx;
+		u32 skip_len;
+
+		if (unlikely(max_len > in_end - in_next)) {
+			max_len = in_end - in_next;
+			nice_len = min(nice_len, max_len);
+		}
+
+		cur_len = CALL_HC_MF(large, c, hc_matchfinder_longest_match,
+				     in_begin, in_next, 2, max_len, nice_len,
+				     c->fast_max_search_depth, next_hashes,
+				     &cur_offset);
+		rep_len = 0;
+		if (likely(in_next - in_begin >= LZMS_NUM_LZ_REPS && max_len >= 2))
+			rep_len = lzms_find_longest_rep_match(in_next, max_len,
+							      &state, &rep_idx);
+		in_next++;
+
+		/* Choose a repeat offset match immediately if it's at least as
+		 * good as the explicit offset match.  */
+		if (rep_len != 0 &&
+		    (cur_len < 3 ||
+		     lzms_repeat_offset_match_score(rep_len) >=
+		     lzms_explicit_offset_match_score(cur_len, cur_offset)))
+		{
+			lzms_lazy_choose_rep_match(c, &state, rep_len, rep_idx);
+			skip_len = rep_len - 1;
+			goto skip_match;
+		}
+
+		/* Choose a literal if there's no match, or only a distant
+		 * length 3 match.  */
+		if (cur_len < 3 || (cur_len == 3 && cur_offset >= 8192)) {
+			lzms_lazy_choose_literal(c, &state, *(in_next - 1));
+			continue;
+		}
+		cur_score = lzms_explicit_offset_match_score(cur_len, cur_offset);
+
+	have_cur_match:
+		/* Choose a very long match immediately.  Otherwise, see if
+		 * there's a better match at the next position.  */
+		if (cur_len >= nice_len) {
+			lzms_lazy_choose_explicit_match(c, &state, cur_len,
+							cur_offset);
+			skip_len = cur_len - 1;
+			goto skip_match;
+		}
+
+		if (unlikely(max_len > in_end - in_next)) {
+			max_len = in_end - in_next;
+			nice_len = min(nice_len, max_len);
+		}
+
+		next_len = CALL_HC_MF(large, c, hc_matchfinder_longest_match,
+				      in_begin, in_next, cur_len - 2, max_len,
+				      nice_len, c->fast_max_search_depth / 2,
+				      next_hashes, &next_offset);
+		next_score = 0;
+		if (next_len > cur_len - 2)
+			next_score = lzms_explicit_offset_match_score(next_len,
+								      next_offset);
+		next_state = state;
+		next_state.upcoming_lz_offset = 0;
+		next_state.upcoming_delta_pair = 0;
+		lzms_update_lru_queues(&next_state);
+		rep_len = 0;
+		if (max_len >= 2)
+			rep_len = lzms_find_longest_rep_match(in_next, max_len,
+							      &next_state,
+							      &rep_idx);
+		in_next++;
+
+		if (rep_len != 0 &&
+		    (rep_score = lzms_repeat_offset_match_score(rep_len)) >=
+		    next_score)
+		{
+			if (rep_score > cur_score) {
+				/* The next match is better, and it's a repeat
+				 * offset match.  */
+				lzms_lazy_choose_literal(c, &state,
+							 *(in_next - 2));
+				lzms_lazy_choose_rep_match(c, &state, rep_len,
+							   rep_idx);
+				skip_len = rep_len - 1;
+				goto skip_match;
+			}
+		} else if (next_score > cur_score) {
+			/* The next match is better, and it's an explicit
+			 * offset match.  */
+			lzms_lazy_choose_literal(c, &state, *(in_next - 2));
+			cur_len = next_len;
+			cur_offset = next_offset;
+			cur_score = next_score;
+			goto have_cur_match;
+		}
+
+		/* The original match was better; choose it.  */
+		lzms_lazy_choose_explicit_match(c, &state, cur_len, cur_offset);
+		skip_len = cur_len - 2;
+
+	skip_match:
+		CALL_HC_MF(large, c, hc_matchfinder_skip_bytes,
+			   in_begin, in_next, in_end, skip_len, next_hashes);
+		in_next += skip_len;
+	}
+}
+
+static void
+lzms_lazy_parse_small(struct lzms_compressor *c)
+{
+	lzms_lazy_parse(c, false);
+}
+
+static void
+lzms_lazy_parse_large(struct lzms_compressor *c)
+{
+	lzms_lazy_parse(c, true);
+}
+
 static void
 lzms_init_states_and_probabilities(struct lzms_compressor *c)
 {
@@ -2113,15 +2524,20 @@ lzms_get_needed_memory(size_t max_bufsize, unsigned compression_level,
 	if (!destructive)
 		size += max_bufsize; /* in_buffer */
 
-	/* mf */
-	size += lcpit_matchfinder_get_needed_memory(max_bufsize);
+	/* mf or hc_mf_* */
+	if (compression_level > MAX_FAST_LEVEL)
+		size += lcpit_matchfinder_get_needed_memory(max_bufsize);
+	else if (max_bufsize <= FAST_MAX_SMALL_BUFSIZE)
+		size += hc_matchfinder_size_small(max_bufsize);
+	else
+		size += hc_matchfinder_size_large(max_bufsize);
 
 	return size;
 }
 
 static int
 lzms_create_compressor(size_t max_bufsize, unsigned compression_level,
-		       bool destructive, void **c_ret)
+		       bool destructive, bool parallel, void **c_ret)
 {
 	struct lzms_compressor *c;
 	u32 nice_match_len;
@@ -2141,6 +2557,8 @@ lzms_create_compressor(size_t max_bufsize, unsigned compression_level,
 	nice_match_len = min(((u64)compression_level * 63) / 50, MAX_FAST_LENGTH);
 
 	c->use_delta_matches = (compression_level >= 35);
+	c->adaptive_delta_search = c->use_delta_matches &&
+				   (compression_level < 100);
 	c->try_lzmatch_lit_lzrep0 = (compression_level >= 45);
 	c->try_lit_lzrep0 = (compression_level >= 60);
 	c->try_lzrep_lit_lzrep0 = (compression_level >= 60);
@@ -2151,8 +2569,31 @@ lzms_create_compressor(size_t max_bufsize, unsigned compression_level,
 			goto oom1;
 	}
 
-	if (!lcpit_matchfinder_init(&c->mf, max_bufsize, 2, nice_match_len))
-		goto oom2;
+	c->hc_mf_small = NULL;
+	c->hc_mf_large = NULL;
+	if (compression_level <= MAX_FAST_LEVEL) {
+		/* Fast compression: use lazy parsing.  Scale max_search_depth
+		 * and nice_len with the compression level.  The lazy parser
+		 * halves the search depth for its lookahead, so it must be at
+		 * least 2.  */
+		c->fast_max_search_depth = max((60 * compression_level) / 20, 2);
+		c->fast_nice_len = max((80 * compression_level) / 20, 3);
+		if (max_bufsize <= FAST_MAX_SMALL_BUFSIZE) {
+			c->hc_mf_small = LARGE_MALLOC(
+				hc_matchfinder_size_small(max_bufsize));
+			if (!c->hc_mf_small)
+				goto oom2;
+		} else {
+			c->hc_mf_large = LARGE_MALLOC(
+				hc_matchfinder_size_large(max_bufsize));
+			if (!c->hc_mf_large)
+				goto oom2;
+		}
+	} else {
+		if (!lcpit_matchfinder_init(&c->mf, max_bufsize, 2,
+					    nice_match_len, parallel))
+			goto oom2;
+	}
 
 	lzms_init_fast_length_slot_tab(c);
 	lzms_init_offset_slot_tabs(c);
@@ -2189,7 +2630,10 @@ lzms_compress(const void *restrict in, size_t in_nbytes,
 	lzms_x86_filter(c->in_buffer, in_nbytes, c->last_target_usages, false);
 
 	/* Prepare the matchfinders.  */
-	lcpit_matchfinder_load_buffer(&c->mf, c->in_buffer, c->in_nbytes);
+	if (!c->hc_mf_small && !c->hc_mf_large)
+		lcpit_matchfinder_load_buffer(&c->mf, c->in_buffer,
+					      c->in_nbytes);
+	c->delta_search_active = false;
 	if (c->use_delta_matches)
 		lzms_init_delta_matchfinder(c);
 
@@ -2200,7 +2644,12 @@ lzms_compress(const void *restrict in, size_t in_nbytes,
 	lzms_init_huffman_codes(c, lzms_get_num_offset_slots(c->in_nbytes));
 
 	/* The main loop: parse and encode.  */
-	lzms_near_optimal_parse(c);
+	if (c->hc_mf_small)
+		lzms_lazy_parse_small(c);
+	else if (c->hc_mf_large)
+		lzms_lazy_parse_large(c);
+	else
+		lzms_near_optimal_parse(c);
 
 	/* Return the compressed data size or 0.  */
 	result = lzms_finalize(c);
@@ -2216,13 +2665,31 @@ lzms_free_compressor(void *_c)
 
 	if (!c->destructive)
 		FREE(c->in_buffer);
-	lcpit_matchfinder_destroy(&c->mf);
+	if (c->hc_mf_small || c->hc_mf_large) {
+		FREE(c->hc_mf_small);
+		FREE(c->hc_mf_large);
+	} else {
+		lcpit_matchfinder_destroy(&c->mf);
+	}
 	ALIGNED_FREE(c);
 }
 
+#ifdef ENABLE_COMPRESSOR_STATS
+static struct wimlib_compressor_stats *
+lzms_get_stats(void *_c)
+{
+	struct lzms_compressor *c = _c;
+
+	return &c->stats;
+}
+#endif
+
 const struct compressor_ops lzms_compressor_ops = {
 	.get_needed_memory  = lzms_get_needed_memory,
 	.create_compressor  = lzms_create_compressor,
 	.compress	    = lzms_compress,
 	.free_compressor    = lzms_free_compressor,
+#ifdef ENABLE_COMPRESSOR_STATS
+	.get_stats	    = lzms_get_stats,
+#endif
 };
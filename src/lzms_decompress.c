@@ -310,6 +310,8 @@ struct lzms_huffman_rebuild_info {
 	unsigned rebuild_freq;
 	u32 *codewords;
 	u32 *freqs;
+	u8 *lens;
+	u8 *new_lens;
 	u16 *decode_table;
 	unsigned table_bits;
 };
@@ -326,26 +328,31 @@ struct lzms_decompressor {
 	DECODE_TABLE(literal_decode_table, LZMS_NUM_LITERAL_SYMS,
 		     LZMS_LITERAL_TABLEBITS, LZMS_MAX_CODEWORD_LENGTH);
 	u32 literal_freqs[LZMS_NUM_LITERAL_SYMS];
+	u8 literal_lens[LZMS_NUM_LITERAL_SYMS];
 	struct lzms_huffman_rebuild_info literal_rebuild_info;
 
 	DECODE_TABLE(lz_offset_decode_table, LZMS_MAX_NUM_OFFSET_SYMS,
 		     LZMS_LZ_OFFSET_TABLEBITS, LZMS_MAX_CODEWORD_LENGTH);
 	u32 lz_offset_freqs[LZMS_MAX_NUM_OFFSET_SYMS];
+	u8 lz_offset_lens[LZMS_MAX_NUM_OFFSET_SYMS];
 	struct lzms_huffman_rebuild_info lz_offset_rebuild_info;
 
 	DECODE_TABLE(length_decode_table, LZMS_NUM_LENGTH_SYMS,
 		     LZMS_LENGTH_TABLEBITS, LZMS_MAX_CODEWORD_LENGTH);
 	u32 length_freqs[LZMS_NUM_LENGTH_SYMS];
+	u8 length_lens[LZMS_NUM_LENGTH_SYMS];
 	struct lzms_huffman_rebuild_info length_rebuild_info;
 
 	DECODE_TABLE(delta_offset_decode_table, LZMS_MAX_NUM_OFFSET_SYMS,
 		     LZMS_DELTA_OFFSET_TABLEBITS, LZMS_MAX_CODEWORD_LENGTH);
 	u32 delta_offset_freqs[LZMS_MAX_NUM_OFFSET_SYMS];
+	u8 delta_offset_lens[LZMS_MAX_NUM_OFFSET_SYMS];
 	struct lzms_huffman_rebuild_info delta_offset_rebuild_info;
 
 	DECODE_TABLE(delta_power_decode_table, LZMS_NUM_DELTA_POWER_SYMS,
 		     LZMS_DELTA_POWER_TABLEBITS, LZMS_MAX_CODEWORD_LENGTH);
 	u32 delta_power_freqs[LZMS_NUM_DELTA_POWER_SYMS];
+	u8 delta_power_lens[LZMS_NUM_DELTA_POWER_SYMS];
 	struct lzms_huffman_rebuild_info delta_power_rebuild_info;
 
 	/* Temporary space for lzms_build_huffman_code() */
@@ -354,6 +361,7 @@ struct lzms_decompressor {
 		DECODE_TABLE_WORKING_SPACE(working_space, LZMS_MAX_NUM_SYMS,
 					   LZMS_MAX_CODEWORD_LENGTH);
 	};
+	u8 new_lens[LZMS_MAX_NUM_SYMS];
 
 	}; // struct
 
@@ -515,13 +523,13 @@ lzms_build_huffman_code(struct lzms_huffman_rebuild_info *rebuild_info)
 	make_canonical_huffman_code(rebuild_info->num_syms,
 				    LZMS_MAX_CODEWORD_LENGTH,
 				    rebuild_info->freqs,
-				    (u8 *)rebuild_info->decode_table,
+				    rebuild_info->lens,
 				    rebuild_info->codewords);
 
 	make_huffman_decode_table(rebuild_info->decode_table,
 				  rebuild_info->num_syms,
 				  rebuild_info->table_bits,
-				  (u8 *)rebuild_info->decode_table,
+				  rebuild_info->lens,
 				  LZMS_MAX_CODEWORD_LENGTH,
 				  (u16 *)rebuild_info->codewords);
 
@@ -531,13 +539,15 @@ lzms_build_huffman_code(struct lzms_huffman_rebuild_info *rebuild_info)
 static void
 lzms_init_huffman_code(struct lzms_huffman_rebuild_info *rebuild_info,
 		       unsigned num_syms, unsigned rebuild_freq,
-		       u32 *codewords, u32 *freqs,
+		       u32 *codewords, u32 *freqs, u8 *lens, u8 *new_lens,
 		       u16 *decode_table, unsigned table_bits)
 {
 	rebuild_info->num_syms = num_syms;
 	rebuild_info->rebuild_freq = rebuild_freq;
 	rebuild_info->codewords = codewords;
 	rebuild_info->freqs = freqs;
+	rebuild_info->lens = lens;
+	rebuild_info->new_lens = new_lens;
 	rebuild_info->decode_table = decode_table;
 	rebuild_info->table_bits = table_bits;
 	lzms_init_symbol_frequencies(freqs, num_syms);
@@ -552,6 +562,8 @@ lzms_init_huffman_codes(struct lzms_decompressor *d, unsigned num_offset_slots)
 			       LZMS_LITERAL_CODE_REBUILD_FREQ,
 			       d->codewords,
 			       d->literal_freqs,
+			       d->literal_lens,
+			       d->new_lens,
 			       d->literal_decode_table,
 			       LZMS_LITERAL_TABLEBITS);
 
@@ -560,6 +572,8 @@ lzms_init_huffman_codes(struct lzms_decompressor *d, unsigned num_offset_slots)
 			       LZMS_LZ_OFFSET_CODE_REBUILD_FREQ,
 			       d->codewords,
 			       d->lz_offset_freqs,
+			       d->lz_offset_lens,
+			       d->new_lens,
 			       d->lz_offset_decode_table,
 			       LZMS_LZ_OFFSET_TABLEBITS);
 
@@ -568,6 +582,8 @@ lzms_init_huffman_codes(struct lzms_decompressor *d, unsigned num_offset_slots)
 			       LZMS_LENGTH_CODE_REBUILD_FREQ,
 			       d->codewords,
 			       d->length_freqs,
+			       d->length_lens,
+			       d->new_lens,
 			       d->length_decode_table,
 			       LZMS_LENGTH_TABLEBITS);
 
@@ -576,6 +592,8 @@ lzms_init_huffman_codes(struct lzms_decompressor *d, unsigned num_offset_slots)
 			       LZMS_DELTA_OFFSET_CODE_REBUILD_FREQ,
 			       d->codewords,
 			       d->delta_offset_freqs,
+			       d->delta_offset_lens,
+			       d->new_lens,
 			       d->delta_offset_decode_table,
 			       LZMS_DELTA_OFFSET_TABLEBITS);
 
@@ -584,14 +602,40 @@ lzms_init_huffman_codes(struct lzms_decompressor *d, unsigned num_offset_slots)
 			       LZMS_DELTA_POWER_CODE_REBUILD_FREQ,
 			       d->codewords,
 			       d->delta_power_freqs,
+			       d->delta_power_lens,
+			       d->new_lens,
 			       d->delta_power_decode_table,
 			       LZMS_DELTA_POWER_TABLEBITS);
 }
 
+/*
+ * Rebuild an adaptive Huffman code from the current symbol frequencies.  The
+ * new codeword lengths often turn out to be the same as the old ones, since
+ * the frequencies had been diluted and the data is often similar to what came
+ * before.  The code and therefore the decode table are then unchanged, so
+ * there is no need to spend much more time on rebuilding the decode table.
+ */
 static noinline void
 lzms_rebuild_huffman_code(struct lzms_huffman_rebuild_info *rebuild_info)
 {
-	lzms_build_huffman_code(rebuild_info);
+	make_canonical_huffman_code(rebuild_info->num_syms,
+				    LZMS_MAX_CODEWORD_LENGTH,
+				    rebuild_info->freqs,
+				    rebuild_info->new_lens,
+				    rebuild_info->codewords);
+
+	if (memcmp(rebuild_info->new_lens, rebuild_info->lens,
+		   rebuild_info->num_syms) != 0) {
+		memcpy(rebuild_info->lens, rebuild_info->new_lens,
+		       rebuild_info->num_syms);
+		make_huffman_decode_table(rebuild_info->decode_table,
+					  rebuild_info->num_syms,
+					  rebuild_info->table_bits,
+					  rebuild_info->lens,
+					  LZMS_MAX_CODEWORD_LENGTH,
+					  (u16 *)rebuild_info->codewords);
+	}
+	rebuild_info->num_syms_until_rebuild = rebuild_info->rebuild_freq;
 	lzms_dilute_symbol_frequencies(rebuild_info->freqs, rebuild_info->num_syms);
 }
 
@@ -692,6 +736,66 @@ lzms_decode_delta_power(struct lzms_decompressor *d,
 					  &d->delta_power_rebuild_info);
 }
 
+/*
+ * Byte-wise (a + b - c) of the bytes in machine words, modulo 256 in each byte.
+ * The high bit of each byte is handled separately so that no carry or borrow
+ * crosses into the next byte.
+ */
+static forceinline machine_word_t
+lzms_delta_word(machine_word_t a, machine_word_t b, machine_word_t c)
+{
+	const machine_word_t h = repeat_byte(0x80);
+	machine_word_t sum;
+
+	sum = ((a & ~h) + (b & ~h)) ^ ((a ^ b) & h);
+	return ((sum | h) - (c & ~h)) ^ ((sum ^ ~c) & h);
+}
+
+/*
+ * Copy a delta match of length @length to @out_next, whose source is @offset
+ * bytes back and whose span is @span.  Each output byte is the byte @offset
+ * back plus the difference between the bytes @span back from each of them.
+ * The caller must have checked that the match is valid.  Returns the new
+ * output pointer.
+ *
+ * Since 'offset >= span', every byte of a word-sized block of output depends
+ * only on bytes at least @span back.  So when @span is at least a word, whole
+ * words can be computed at once.
+ */
+static forceinline u8 *
+lzms_copy_delta_match(u8 *out_next, u32 length, u32 offset, u32 span)
+{
+	const u8 *matchptr = out_next - offset;
+
+	if (UNALIGNED_ACCESS_IS_FAST && span >= WORDBYTES) {
+		while (length >= WORDBYTES) {
+			store_word_unaligned(
+				lzms_delta_word(
+					load_word_unaligned(matchptr),
+					load_word_unaligned(out_next - span),
+					load_word_unaligned(matchptr - span)),
+				out_next);
+			out_next += WORDBYTES;
+			matchptr += WORDBYTES;
+			length -= WORDBYTES;
+		}
+		if (length == 0)
+			return out_next;
+	}
+	do {
+		*out_next = *matchptr + *(out_next - span) - *(matchptr - span);
+		out_next++;
+		matchptr++;
+	} while (--length);
+	return out_next;
+}
+
+static u64
+lzms_get_decompressor_needed_memory(size_t max_block_size)
+{
+	return sizeof(struct lzms_decompressor);
+}
+
 static int
 lzms_create_decompressor(size_t max_bufsize, void **d_ret)
 {
@@ -842,7 +946,6 @@ lzms_decompress(const void * const restrict in, const size_t in_nbytes,
 			u32 raw_offset;
 			u32 span;
 			u32 offset;
-			const u8 *matchptr;
 			u32 length;
 			u64 pair;
 
@@ -908,13 +1011,8 @@ lzms_decompress(const void * const restrict in, const size_t in_nbytes,
 			if (unlikely(length > out_end - out_next))
 				return -1;
 
-			matchptr = out_next - offset;
-			do {
-				*out_next = *matchptr + *(out_next - span) -
-					    *(matchptr - span);
-				out_next++;
-				matchptr++;
-			} while (--length);
+			out_next = lzms_copy_delta_match(out_next, length,
+							 offset, span);
 		}
 	}
 
@@ -931,6 +1029,7 @@ lzms_free_decompressor(void *_d)
 }
 
 const struct decompressor_ops lzms_decompressor_ops = {
+	.get_needed_memory    = lzms_get_decompressor_needed_memory,
 	.create_decompressor  = lzms_create_decompressor,
 	.decompress	      = lzms_decompress,
 	.free_decompressor    = lzms_free_decompressor,
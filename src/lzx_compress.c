@@ -70,6 +70,14 @@
  */
 #define MAX_FAST_LEVEL				34
 
+/*
+ * At levels >= MIN_LAZY2_LEVEL (but <= MAX_FAST_LEVEL), the faster algorithm
+ * also looks two positions ahead before choosing a match ("lazy2" parsing).
+ * This bridges part of the gap in compression ratio to the slower algorithm at
+ * a fraction of its cost.
+ */
+#define MIN_LAZY2_LEVEL				25
+
 /*
  * The compressor-side limits on the codeword lengths (in bits) for each Huffman
  * code.  To make outputting bits slightly faster, some of these limits are
@@ -171,6 +179,23 @@
  */
 #define CONSIDER_GAP_MATCHES			1
 
+/*
+ * With WIMLIB_COMPRESSOR_FLAG_PARALLEL, a buffer is split into segments of at
+ * least this size, and at most LZX_MAX_SEGMENTS of them, which are parsed in
+ * parallel.  Each segment boundary may be moved by up to
+ * LZX_SEGMENT_SPLIT_SEARCH bytes to a place where the data seems to change.
+ */
+#define LZX_MIN_SEGMENT_SIZE			262144
+#define LZX_MAX_SEGMENTS			8
+#define LZX_SEGMENT_SPLIT_SEARCH		16384
+
+/*
+ * Up to this many bytes preceding each segment are run through its helper's
+ * matchfinder first, so that most of the matches that would cross the segment
+ * boundary can still be found.
+ */
+#define LZX_SEGMENT_DICT_SIZE			131072
+
 /******************************************************************************/
 /*                                  Includes                                  */
 /*----------------------------------------------------------------------------*/
@@ -179,13 +204,21 @@
 #  include "config.h"
 #endif
 
+#include "wimlib/assert.h"
 #include "wimlib/compress_common.h"
 #include "wimlib/compressor_ops.h"
+#include "wimlib/compressor_stats.h"
+#include "wimlib/cpu_features.h"
 #include "wimlib/error.h"
 #include "wimlib/lzx_common.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/unaligned.h"
 #include "wimlib/util.h"
 
+#if defined(__i386__) || defined(__x86_64__)
+#  include <immintrin.h>
+#endif
+
 /* Note: BT_MATCHFINDER_HASH2_ORDER must be defined before including
  * bt_matchfinder.h. */
 
@@ -361,6 +394,36 @@ struct lzx_costs {
 };
 
 struct lzx_output_bitstream;
+struct lzx_compressor;
+
+/* A block which a helper compressor has parsed, but which hasn't been written
+ * yet.  See lzx_compress_parallel().  */
+struct lzx_parsed_block {
+	const u8 *begin;
+	u32 size;
+	u32 first_seq;	/* index of the block's first sequence in 'seqs' */
+};
+
+/* A segment of the input buffer which is parsed by a helper compressor, in
+ * parallel with the other segments.  See lzx_compress_parallel().  */
+struct lzx_segment {
+	struct pool_task task;
+	struct lzx_compressor *helper;
+	const u8 *begin;
+	u32 size;
+	u32 dict_size;	/* bytes before 'begin' that matches may refer to */
+
+	/* The blocks which the helper has parsed so far, and their sequences */
+	struct lzx_parsed_block *blocks;
+	u32 num_blocks;
+	u32 max_blocks;
+	struct lzx_sequence *seqs;
+	u32 num_seqs;
+	u32 max_seqs;
+
+	/* Set if there wasn't room to save a block  */
+	bool overflow;
+};
 
 /* The main LZX compressor structure */
 struct lzx_compressor {
@@ -373,6 +436,24 @@ struct lzx_compressor {
 	 * compresses the data successfully */
 	bool destructive;
 
+	/* If true, then large buffers may be split into segments which are
+	 * parsed in parallel (WIMLIB_COMPRESSOR_FLAG_PARALLEL) */
+	bool parallel;
+
+	/* The segments for parallel parsing, with their helper compressors.
+	 * These are allocated when first needed.  */
+	struct lzx_segment *segments;
+	unsigned num_segments;
+
+	/* If this is a helper compressor, then the segment it is parsing;
+	 * otherwise NULL.  A helper saves its blocks in the segment rather than
+	 * writing them.  */
+	struct lzx_segment *segment;
+
+	/* The parameters the compressor was created with, for creating helpers */
+	size_t max_bufsize;
+	unsigned compression_level;
+
 	/* Pointer to the compress() implementation chosen at allocation time */
 	void (*impl)(struct lzx_compressor *, const u8 *, size_t,
 		     struct lzx_output_bitstream *);
@@ -397,6 +478,9 @@ struct lzx_compressor {
 	/* The number of optimization passes per block */
 	unsigned num_optim_passes;
 
+	/* For lazy parsing: whether to look two positions ahead too */
+	bool lazy2;
+
 	/* The symbol frequency counters for the current block */
 	struct lzx_freqs freqs;
 
@@ -409,6 +493,18 @@ struct lzx_compressor {
 	struct lzx_codes codes[2];
 	unsigned codes_index;
 
+	/* In a group of buffers (see lzx_start_group()): the codeword lengths
+	 * of the last block of the previous buffer in the group, if
+	 * 'cost_hint_valid'.  A single optimization pass gives better results
+	 * when it starts from these rather than from default costs only.  */
+	bool in_group;
+	bool cost_hint_valid;
+	struct lzx_lens cost_hint;
+
+#ifdef ENABLE_COMPRESSOR_STATS
+	struct wimlib_compressor_stats stats;
+#endif
+
 	/* The matches and literals that the compressor has chosen for the
 	 * current block.  The required length of this array is limited by the
 	 * maximum number of matches that can ever be chosen for a single block,
@@ -504,6 +600,24 @@ lzx_is_16_bit(size_t max_bufsize)
 	return max_bufsize <= 32768;
 }
 
+/*
+ * The number of main symbols when the window order is LZX_MIN_WINDOW_ORDER,
+ * which it always is for a 16-bit compressor: 30 offset slots, since the
+ * largest match offset is 32765.
+ */
+#define LZX_MIN_WINDOW_NUM_MAIN_SYMS	(LZX_NUM_CHARS + 30 * LZX_NUM_LEN_HEADERS)
+
+/*
+ * Return the number of main symbols.  For a 16-bit compressor this is a
+ * compile-time constant, which gives the loops in the cost model built for each
+ * optimization pass of the near-optimal parser constant bounds.
+ */
+static forceinline unsigned
+lzx_num_main_syms(const struct lzx_compressor *c, bool is_16_bit)
+{
+	return is_16_bit ? LZX_MIN_WINDOW_NUM_MAIN_SYMS : c->num_main_syms;
+}
+
 /*
  * Return the offset slot for the specified adjusted match offset.
  */
@@ -680,15 +794,15 @@ lzx_flush_output(struct lzx_output_bitstream *os)
  * code and produces as output a set of tables that map symbols to codewords and
  * codeword lengths.
  */
-static void
-lzx_build_huffman_codes(struct lzx_compressor *c)
+static forceinline void
+lzx_build_huffman_codes(struct lzx_compressor *c, bool is_16_bit)
 {
 	const struct lzx_freqs *freqs = &c->freqs;
 	struct lzx_codes *codes = &c->codes[c->codes_index];
 
 	STATIC_ASSERT(MAIN_CODEWORD_LIMIT >= 9 &&
 		      MAIN_CODEWORD_LIMIT <= LZX_MAX_MAIN_CODEWORD_LEN);
-	make_canonical_huffman_code(c->num_main_syms,
+	make_canonical_huffman_code(lzx_num_main_syms(c, is_16_bit),
 				    MAIN_CODEWORD_LIMIT,
 				    freqs->main,
 				    codes->lens.main,
@@ -1175,6 +1289,43 @@ lzx_choose_verbatim_or_aligned(const struct lzx_freqs * freqs,
 		return LZX_BLOCKTYPE_VERBATIM;
 }
 
+#ifdef ENABLE_COMPRESSOR_STATS
+/* Record a block which is being flushed in the compressor's statistics.  */
+static void
+lzx_update_stats(struct lzx_compressor *c, int block_type,
+		 const struct lzx_sequence sequences[])
+{
+	struct wimlib_compressor_stats *stats = &c->stats;
+	const struct lzx_sequence *seq;
+
+	stats->num_blocks++;
+	if (block_type == LZX_BLOCKTYPE_ALIGNED)
+		stats->num_aligned_blocks++;
+	else
+		stats->num_verbatim_blocks++;
+
+	for (seq = sequences; ; seq++) {
+		unsigned matchlen = seq->litrunlen_and_matchlen &
+				    SEQ_MATCHLEN_MASK;
+		u32 adjusted_offset = seq->adjusted_offset_and_mainsym >>
+				      SEQ_MAINSYM_BITS;
+		unsigned mainsym = seq->adjusted_offset_and_mainsym &
+				   SEQ_MAINSYM_MASK;
+
+		stats_add_literals(stats, seq->litrunlen_and_matchlen >>
+					  SEQ_MATCHLEN_BITS);
+		if (matchlen == 0)
+			break;
+		if ((mainsym - LZX_NUM_CHARS) / LZX_NUM_LEN_HEADERS <
+		    LZX_NUM_RECENT_OFFSETS)
+			stats_add_repeat_match(stats, matchlen);
+		else
+			stats_add_match(stats, matchlen, adjusted_offset -
+							 LZX_OFFSET_ADJUSTMENT);
+	}
+}
+#endif /* ENABLE_COMPRESSOR_STATS */
+
 /*
  * Flush an LZX block:
  *
@@ -1192,10 +1343,12 @@ lzx_flush_block(struct lzx_compressor *c, struct lzx_output_bitstream *os,
 {
 	int block_type;
 
-	lzx_build_huffman_codes(c);
+	lzx_build_huffman_codes(c, false);
 
 	block_type = lzx_choose_verbatim_or_aligned(&c->freqs,
 						    &c->codes[c->codes_index]);
+	COMPRESSOR_STATS(lzx_update_stats(c, block_type,
+					  &c->chosen_sequences[seq_idx]));
 	lzx_write_compressed_block(block_begin,
 				   block_type,
 				   block_size,
@@ -1503,6 +1656,174 @@ lzx_record_item_list(struct lzx_compressor *c, u32 block_size, bool is_16_bit)
 	return lzx_walk_item_list(c, block_size, is_16_bit, true);
 }
 
+/*
+ * Relax the edges for the match lengths 'len' through 'end_len', all of which
+ * have the same offset: for each length, if the path through 'cur_node' with
+ * that match reaches the node 'len' bytes later more cheaply than the best
+ * path found so far, then update that node.  'base_cost' is the cost to reach
+ * 'cur_node' plus the part of the match's cost which doesn't depend on the
+ * length, 'cost_row' is the row of 'c->costs.match_cost' for the match's
+ * offset slot, and 'item_hi' is the high bits of the item.  Repeat offset
+ * matches also win ties ('allow_equal'); explicit offset matches don't.
+ *
+ * Each length updates a different node, so the lengths can be processed in
+ * any order and in parallel.  When there are enough of them, a vectorized
+ * implementation selected by the "lzx_parse" kernel handles them in groups and
+ * returns the first length it didn't handle.  This gives the same result as
+ * the scalar loop.
+ */
+typedef unsigned (*lzx_relax_wide_func_t)(struct lzx_optimum_node *cur_node,
+					  u32 base_cost, const u16 *cost_row,
+					  u32 item_hi, unsigned len,
+					  unsigned end_len, bool allow_equal);
+
+static lzx_relax_wide_func_t lzx_relax_wide;
+
+#if defined(__i386__) || defined(__x86_64__)
+#define LZX_RELAX_WIDE_MIN_LENS		8
+
+/* Relax 8 lengths at a time.  Each 256-bit vector holds 4 optimum nodes.  */
+static unsigned __attribute__((target("avx2")))
+lzx_relax_avx2(struct lzx_optimum_node *cur_node, u32 base_cost,
+	       const u16 *cost_row, u32 item_hi, unsigned len, unsigned end_len,
+	       bool allow_equal)
+{
+	const __m256i base = _mm256_set1_epi32(base_cost);
+	const __m256i step = _mm256_set1_epi32(8);
+	__m256i items = _mm256_add_epi32(_mm256_set1_epi32(item_hi | len),
+					 _mm256_setr_epi32(0, 1, 2, 3,
+							   4, 5, 6, 7));
+
+	STATIC_ASSERT(sizeof(*cur_node) == 8);
+	for (; len + 7 <= end_len; len += 8) {
+		__m256i *p = (__m256i *)(cur_node + len);
+		__m256i costs = _mm256_add_epi32(base, _mm256_cvtepu16_epi32(
+			_mm_loadu_si128((const void *)
+					&cost_row[len - LZX_MIN_MATCH_LEN])));
+		__m256i lo = _mm256_unpacklo_epi32(costs, items);
+		__m256i hi = _mm256_unpackhi_epi32(costs, items);
+		__m256i new[2], old[2];
+
+		/* Interleave the costs and items like the nodes are.  */
+		new[0] = _mm256_permute2x128_si256(lo, hi, 0x20);
+		new[1] = _mm256_permute2x128_si256(lo, hi, 0x31);
+		old[0] = _mm256_loadu_si256(p);
+		old[1] = _mm256_loadu_si256(p + 1);
+
+		for (int i = 0; i < 2; i++) {
+			__m256i take;
+
+			/* Compare the costs as unsigned, then copy each cost's
+			 * result to its item.  */
+			if (allow_equal)
+				take = _mm256_cmpeq_epi32(
+					_mm256_min_epu32(new[i], old[i]), new[i]);
+			else
+				take = _mm256_xor_si256(_mm256_cmpeq_epi32(
+					_mm256_max_epu32(new[i], old[i]), new[i]),
+					_mm256_set1_epi32(-1));
+			take = _mm256_shuffle_epi32(take, _MM_SHUFFLE(2, 2, 0, 0));
+			_mm256_storeu_si256(p + i,
+					    _mm256_blendv_epi8(old[i], new[i], take));
+		}
+		items = _mm256_add_epi32(items, step);
+	}
+	return len;
+}
+
+/* Like lzx_relax_avx2(), but relax 16 lengths at a time.  */
+static unsigned __attribute__((target("avx512f")))
+lzx_relax_avx512(struct lzx_optimum_node *cur_node, u32 base_cost,
+		 const u16 *cost_row, u32 item_hi, unsigned len,
+		 unsigned end_len, bool allow_equal)
+{
+	const __m512i base = _mm512_set1_epi32(base_cost);
+	const __m512i step = _mm512_set1_epi32(16);
+	const __m512i idx0 = _mm512_setr_epi64(0, 1, 8, 9, 2, 3, 10, 11);
+	const __m512i idx1 = _mm512_setr_epi64(4, 5, 12, 13, 6, 7, 14, 15);
+	__m512i items = _mm512_add_epi32(_mm512_set1_epi32(item_hi | len),
+					 _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+							   8, 9, 10, 11, 12, 13,
+							   14, 15));
+
+	for (; len + 15 <= end_len; len += 16) {
+		__m512i *p = (__m512i *)(cur_node + len);
+		__m512i costs = _mm512_add_epi32(base, _mm512_cvtepu16_epi32(
+			_mm256_loadu_si256((const void *)
+					   &cost_row[len - LZX_MIN_MATCH_LEN])));
+		__m512i lo = _mm512_unpacklo_epi32(costs, items);
+		__m512i hi = _mm512_unpackhi_epi32(costs, items);
+		__m512i new[2];
+
+		new[0] = _mm512_permutex2var_epi64(lo, idx0, hi);
+		new[1] = _mm512_permutex2var_epi64(lo, idx1, hi);
+
+		for (int i = 0; i < 2; i++) {
+			__m512i old = _mm512_loadu_si512(p + i);
+			__mmask16 take;
+
+			if (allow_equal)
+				take = _mm512_cmple_epu32_mask(new[i], old);
+			else
+				take = _mm512_cmplt_epu32_mask(new[i], old);
+			take &= 0x5555;
+			take |= take << 1;
+			_mm512_storeu_si512(p + i,
+					    _mm512_mask_mov_epi32(old, take, new[i]));
+		}
+		items = _mm512_add_epi32(items, step);
+	}
+	return len;
+}
+#endif /* x86 */
+
+static forceinline void
+lzx_relax_lengths(struct lzx_optimum_node *cur_node, u32 base_cost,
+		  const u16 *cost_row, u32 item_hi, unsigned len,
+		  unsigned end_len, bool allow_equal)
+{
+#ifdef LZX_RELAX_WIDE_MIN_LENS
+	if (end_len + 1 - len >= LZX_RELAX_WIDE_MIN_LENS &&
+	    lzx_relax_wide != NULL)
+		len = (*lzx_relax_wide)(cur_node, base_cost, cost_row, item_hi,
+					len, end_len, allow_equal);
+#endif
+	for (; len <= end_len; len++) {
+		u32 cost = base_cost + cost_row[len - LZX_MIN_MATCH_LEN];
+
+		if (allow_equal ? cost <= (cur_node + len)->cost :
+				  cost < (cur_node + len)->cost) {
+			(cur_node + len)->cost = cost;
+			(cur_node + len)->item = item_hi | len;
+		}
+	}
+}
+
+/*
+ * The 512-bit version isn't preferred, for the same reason as lz_extend's, but
+ * it can be selected with WIMLIB_CPU_FEATURES=lzx_parse=avx512.
+ */
+static const struct cpu_impl lzx_parse_impls[] = {
+#if defined(__i386__) || defined(__x86_64__)
+	{ "avx2", (cpu_func_t)lzx_relax_avx2, X86_CPU_FEATURE_AVX2 },
+	{ "avx512", (cpu_func_t)lzx_relax_avx512, X86_CPU_FEATURE_AVX512F },
+#endif
+	{ "generic", NULL, 0 },
+};
+
+static void
+lzx_parse_select(const struct cpu_impl *impl)
+{
+	lzx_relax_wide = (lzx_relax_wide_func_t)impl->func;
+}
+
+const struct cpu_kernel lzx_parse_kernel = {
+	.name = "lzx_parse",
+	.impls = lzx_parse_impls,
+	.num_impls = ARRAY_LEN(lzx_parse_impls),
+	.select = lzx_parse_select,
+};
+
 /*
  * Find an inexpensive path through the graph of possible match/literal choices
  * for the current block.  The nodes of the graph are
@@ -1630,7 +1951,12 @@ lzx_find_min_cost_path(struct lzx_compressor * const restrict c,
 		if (num_matches) {
 			struct lz_match *end_matches = cache_ptr + num_matches;
 			unsigned next_len = LZX_MIN_MATCH_LEN;
-			unsigned max_len = min(block_end - in_next, LZX_MAX_MATCH_LEN);
+			/* A repeat offset match is always considered at the
+			 * minimum length, even at the last byte of the block. */
+			unsigned max_len = max(min(block_end - in_next,
+						   LZX_MAX_MATCH_LEN),
+					       LZX_MIN_MATCH_LEN);
+			unsigned rep_len;
 			const u8 *matchptr;
 
 			/* Consider rep0 matches. */
@@ -1638,20 +1964,16 @@ lzx_find_min_cost_path(struct lzx_compressor * const restrict c,
 			if (load_u16_unaligned(matchptr) != load_u16_unaligned(in_next))
 				goto rep0_done;
 			STATIC_ASSERT(LZX_MIN_MATCH_LEN == 2);
-			do {
-				u32 cost = cur_node->cost +
-					   c->costs.match_cost[0][
-							next_len - LZX_MIN_MATCH_LEN];
-				if (cost <= (cur_node + next_len)->cost) {
-					(cur_node + next_len)->cost = cost;
-					(cur_node + next_len)->item =
-						(0 << OPTIMUM_OFFSET_SHIFT) | next_len;
-				}
-				if (unlikely(++next_len > max_len)) {
-					cache_ptr = end_matches;
-					goto done_matches;
-				}
-			} while (in_next[next_len - 1] == matchptr[next_len - 1]);
+			rep_len = lz_extend(in_next, matchptr, next_len, max_len);
+			lzx_relax_lengths(cur_node, cur_node->cost,
+					  c->costs.match_cost[0],
+					  0 << OPTIMUM_OFFSET_SHIFT,
+					  next_len, rep_len, true);
+			next_len = rep_len + 1;
+			if (unlikely(next_len > max_len)) {
+				cache_ptr = end_matches;
+				goto done_matches;
+			}
 
 		rep0_done:
 
@@ -1664,20 +1986,16 @@ lzx_find_min_cost_path(struct lzx_compressor * const restrict c,
 			for (unsigned len = 2; len < next_len - 1; len++)
 				if (matchptr[len] != in_next[len])
 					goto rep1_done;
-			do {
-				u32 cost = cur_node->cost +
-					   c->costs.match_cost[1][
-							next_len - LZX_MIN_MATCH_LEN];
-				if (cost <= (cur_node + next_len)->cost) {
-					(cur_node + next_len)->cost = cost;
-					(cur_node + next_len)->item =
-						(1 << OPTIMUM_OFFSET_SHIFT) | next_len;
-				}
-				if (unlikely(++next_len > max_len)) {
-					cache_ptr = end_matches;
-					goto done_matches;
-				}
-			} while (in_next[next_len - 1] == matchptr[next_len - 1]);
+			rep_len = lz_extend(in_next, matchptr, next_len, max_len);
+			lzx_relax_lengths(cur_node, cur_node->cost,
+					  c->costs.match_cost[1],
+					  1 << OPTIMUM_OFFSET_SHIFT,
+					  next_len, rep_len, true);
+			next_len = rep_len + 1;
+			if (unlikely(next_len > max_len)) {
+				cache_ptr = end_matches;
+				goto done_matches;
+			}
 
 		rep1_done:
 
@@ -1690,20 +2008,16 @@ lzx_find_min_cost_path(struct lzx_compressor * const restrict c,
 			for (unsigned len = 2; len < next_len - 1; len++)
 				if (matchptr[len] != in_next[len])
 					goto rep2_done;
-			do {
-				u32 cost = cur_node->cost +
-					   c->costs.match_cost[2][
-							next_len - LZX_MIN_MATCH_LEN];
-				if (cost <= (cur_node + next_len)->cost) {
-					(cur_node + next_len)->cost = cost;
-					(cur_node + next_len)->item =
-						(2 << OPTIMUM_OFFSET_SHIFT) | next_len;
-				}
-				if (unlikely(++next_len > max_len)) {
-					cache_ptr = end_matches;
-					goto done_matches;
-				}
-			} while (in_next[next_len - 1] == matchptr[next_len - 1]);
+			rep_len = lz_extend(in_next, matchptr, next_len, max_len);
+			lzx_relax_lengths(cur_node, cur_node->cost,
+					  c->costs.match_cost[2],
+					  2 << OPTIMUM_OFFSET_SHIFT,
+					  next_len, rep_len, true);
+			next_len = rep_len + 1;
+			if (unlikely(next_len > max_len)) {
+				cache_ptr = end_matches;
+				goto done_matches;
+			}
 
 		rep2_done:
 
@@ -1717,23 +2031,17 @@ lzx_find_min_cost_path(struct lzx_compressor * const restrict c,
 				u32 adjusted_offset = offset + LZX_OFFSET_ADJUSTMENT;
 				unsigned offset_slot = lzx_get_offset_slot(c, adjusted_offset, is_16_bit);
 				u32 base_cost = cur_node->cost;
-				u32 cost;
 
 			#if CONSIDER_ALIGNED_COSTS
 				if (offset >= LZX_MIN_ALIGNED_OFFSET)
 					base_cost += c->costs.aligned[adjusted_offset &
 								      LZX_ALIGNED_OFFSET_BITMASK];
 			#endif
-				do {
-					cost = base_cost +
-					       c->costs.match_cost[offset_slot][
-								next_len - LZX_MIN_MATCH_LEN];
-					if (cost < (cur_node + next_len)->cost) {
-						(cur_node + next_len)->cost = cost;
-						(cur_node + next_len)->item =
-							(adjusted_offset << OPTIMUM_OFFSET_SHIFT) | next_len;
-					}
-				} while (++next_len <= cache_ptr->length);
+				lzx_relax_lengths(cur_node, base_cost,
+						  c->costs.match_cost[offset_slot],
+						  adjusted_offset << OPTIMUM_OFFSET_SHIFT,
+						  next_len, cache_ptr->length, false);
+				next_len = cache_ptr->length + 1;
 
 				if (++cache_ptr == end_matches) {
 				#if CONSIDER_GAP_MATCHES
@@ -1752,8 +2060,11 @@ lzx_find_min_cost_path(struct lzx_compressor * const restrict c,
 										 LZX_MAX_MATCH_LEN));
 							unsigned rep0_len = lz_extend(strptr, matchptr, 2, limit);
 							u8 lit = strptr[-1];
-							cost += c->costs.main[lit] +
-								c->costs.match_cost[0][rep0_len - LZX_MIN_MATCH_LEN];
+							u32 cost = base_cost +
+								   c->costs.match_cost[offset_slot][
+									next_len - 1 - LZX_MIN_MATCH_LEN] +
+								   c->costs.main[lit] +
+								   c->costs.match_cost[0][rep0_len - LZX_MIN_MATCH_LEN];
 							unsigned total_len = next_len + rep0_len;
 							if (cost < (cur_node + total_len)->cost) {
 								(cur_node + total_len)->cost = cost;
@@ -1846,11 +2157,11 @@ lzx_find_min_cost_path(struct lzx_compressor * const restrict c,
  * c->costs.len), initialize the match cost array (c->costs.match_cost) which
  * directly provides the cost of every possible (length, offset slot) pair.
  */
-static void
-lzx_compute_match_costs(struct lzx_compressor *c)
+static forceinline void
+lzx_compute_match_costs(struct lzx_compressor *c, bool is_16_bit)
 {
-	unsigned num_offset_slots = (c->num_main_syms - LZX_NUM_CHARS) /
-					LZX_NUM_LEN_HEADERS;
+	unsigned num_offset_slots = (lzx_num_main_syms(c, is_16_bit) -
+				     LZX_NUM_CHARS) / LZX_NUM_LEN_HEADERS;
 	struct lzx_costs *costs = &c->costs;
 	unsigned main_symbol = LZX_NUM_CHARS;
 
@@ -1993,9 +2304,10 @@ static const u16 lzx_default_len_costs[LZX_LENCODE_NUM_SYMBOLS] = {
 };
 
 /* Set default costs to bootstrap the iterative optimization algorithm. */
-static void
-lzx_set_default_costs(struct lzx_compressor *c)
+static forceinline void
+lzx_set_default_costs(struct lzx_compressor *c, bool is_16_bit)
 {
+	const unsigned num_main_syms = lzx_num_main_syms(c, is_16_bit);
 	unsigned i;
 	u32 num_literals = 0;
 	u32 num_used_literals = 0;
@@ -2042,9 +2354,9 @@ lzx_set_default_costs(struct lzx_compressor *c)
 	 * match header vs. a literal depending on how common matches are
 	 * expected to be vs. literals. */
 	prob_match = max(prob_match, 0.15f);
-	match_cost = lzx_cost_for_probability(prob_match / (c->num_main_syms -
+	match_cost = lzx_cost_for_probability(prob_match / (num_main_syms -
 							    LZX_NUM_CHARS));
-	for (; i < c->num_main_syms; i++)
+	for (; i < num_main_syms; i++)
 		c->costs.main[i] = match_cost;
 
 	/* Length symbol costs.  These are just set to fixed values which
@@ -2074,13 +2386,14 @@ lzx_set_default_costs(struct lzx_compressor *c)
 }
 
 /* Update the current cost model to reflect the computed Huffman codes.  */
-static void
-lzx_set_costs_from_codes(struct lzx_compressor *c)
+static forceinline void
+lzx_set_costs_from_codes(struct lzx_compressor *c, bool is_16_bit)
 {
+	const unsigned num_main_syms = lzx_num_main_syms(c, is_16_bit);
 	unsigned i;
 	const struct lzx_lens *lens = &c->codes[c->codes_index].lens;
 
-	for (i = 0; i < c->num_main_syms; i++) {
+	for (i = 0; i < num_main_syms; i++) {
 		c->costs.main[i] = (lens->main[i] ? lens->main[i] :
 				    MAIN_CODEWORD_LIMIT) * BIT_COST;
 	}
@@ -2098,6 +2411,32 @@ lzx_set_costs_from_codes(struct lzx_compressor *c)
 #endif
 }
 
+/*
+ * Mix the costs implied by the codeword lengths in c->cost_hint into the
+ * default costs, which have already been set.  The hint has the larger weight,
+ * but the default costs still account for how this block differs, e.g. in
+ * which literals it uses.
+ */
+static forceinline void
+lzx_apply_cost_hint(struct lzx_compressor *c, bool is_16_bit)
+{
+	const unsigned num_main_syms = lzx_num_main_syms(c, is_16_bit);
+	const struct lzx_lens *lens = &c->cost_hint;
+	unsigned i;
+
+	for (i = 0; i < num_main_syms; i++) {
+		u32 cost = (lens->main[i] ? lens->main[i] :
+			    MAIN_CODEWORD_LIMIT) * BIT_COST;
+		c->costs.main[i] = (3 * cost + c->costs.main[i]) / 4;
+	}
+
+	for (i = 0; i < LZX_LENCODE_NUM_SYMBOLS; i++) {
+		u32 cost = (lens->len[i] ? lens->len[i] :
+			    LENGTH_CODEWORD_LIMIT) * BIT_COST;
+		c->costs.len[i] = (3 * cost + c->costs.len[i]) / 4;
+	}
+}
+
 /*
  * Choose a "near-optimal" literal/match sequence to use for the current block,
  * then flush the block.  Because the cost of each Huffman symbol is unknown
@@ -2107,6 +2446,35 @@ lzx_set_costs_from_codes(struct lzx_compressor *c)
  * for the block uses default costs; additional passes use costs derived from
  * the Huffman codes computed in the previous pass.
  */
+/*
+ * Instead of flushing a block, save its sequences in the segment which this
+ * helper compressor is parsing, so that the block can be written once the
+ * blocks before it have been.  The sequences are the ones in
+ * c->chosen_sequences starting at index @seq_idx, ending with the end-of-block
+ * sequence.
+ */
+static void
+lzx_save_parsed_block(struct lzx_compressor *c, const u8 *block_begin,
+		      u32 block_size, u32 seq_idx)
+{
+	struct lzx_segment *seg = c->segment;
+	u32 num_seqs = ARRAY_LEN(c->chosen_sequences) - seq_idx;
+	struct lzx_parsed_block *block;
+
+	if (seg->overflow || seg->num_blocks >= seg->max_blocks ||
+	    num_seqs > seg->max_seqs - seg->num_seqs) {
+		seg->overflow = true;
+		return;
+	}
+	block = &seg->blocks[seg->num_blocks++];
+	block->begin = block_begin;
+	block->size = block_size;
+	block->first_seq = seg->num_seqs;
+	memcpy(&seg->seqs[seg->num_seqs], &c->chosen_sequences[seq_idx],
+	       num_seqs * sizeof(seg->seqs[0]));
+	seg->num_seqs += num_seqs;
+}
+
 static forceinline struct lzx_lru_queue
 lzx_optimize_and_flush_block(struct lzx_compressor * const restrict c,
 			     struct lzx_output_bitstream * const restrict os,
@@ -2119,10 +2487,16 @@ lzx_optimize_and_flush_block(struct lzx_compressor * const restrict c,
 	struct lzx_lru_queue new_queue;
 	u32 seq_idx;
 
-	lzx_set_default_costs(c);
+	lzx_set_default_costs(c, is_16_bit);
+
+	/* With more than one pass, the passes themselves make up for the
+	 * default costs, and starting from the hint doesn't help.  */
+	if (c->cost_hint_valid && c->num_optim_passes == 1)
+		lzx_apply_cost_hint(c, is_16_bit);
+	c->cost_hint_valid = false;
 
 	for (;;) {
-		lzx_compute_match_costs(c);
+		lzx_compute_match_costs(c, is_16_bit);
 		new_queue = lzx_find_min_cost_path(c, block_begin, block_size,
 						   initial_queue, is_16_bit);
 
@@ -2132,14 +2506,19 @@ lzx_optimize_and_flush_block(struct lzx_compressor * const restrict c,
 		/* At least one optimization pass remains.  Update the costs. */
 		lzx_reset_symbol_frequencies(c);
 		lzx_tally_item_list(c, block_size, is_16_bit);
-		lzx_build_huffman_codes(c);
-		lzx_set_costs_from_codes(c);
+		lzx_build_huffman_codes(c, is_16_bit);
+		lzx_set_costs_from_codes(c, is_16_bit);
 	}
 
 	/* Done optimizing.  Generate the sequence list and flush the block. */
+	COMPRESSOR_STATS(c->stats.num_optimization_passes +=
+				 c->num_optim_passes);
 	lzx_reset_symbol_frequencies(c);
 	seq_idx = lzx_record_item_list(c, block_size, is_16_bit);
-	lzx_flush_block(c, os, block_begin, block_size, seq_idx);
+	if (unlikely(c->segment))
+		lzx_save_parsed_block(c, block_begin, block_size, seq_idx);
+	else
+		lzx_flush_block(c, os, block_begin, block_size, seq_idx);
 	return new_queue;
 }
 
@@ -2172,6 +2551,21 @@ lzx_compress_near_optimal(struct lzx_compressor * restrict c,
 	/* Initialize the matchfinder. */
 	CALL_BT_MF(is_16_bit, c, bt_matchfinder_init);
 
+	/* A helper compressor first runs the data preceding its segment through
+	 * the matchfinder, so that matches can refer to it. */
+	if (c->segment) {
+		const u8 * const dict_end = in_begin + c->segment->dict_size;
+
+		for (; in_next < dict_end; in_next++) {
+			CALL_BT_MF(is_16_bit, c, bt_matchfinder_skip_byte,
+				   in_begin,
+				   in_next - in_begin,
+				   nice_len,
+				   c->max_search_depth,
+				   next_hashes);
+		}
+	}
+
 	do {
 		/* Starting a new block */
 
@@ -2352,6 +2746,286 @@ lzx_compress_near_optimal_32(struct lzx_compressor *c, const u8 *in,
 	lzx_compress_near_optimal(c, in, in_nbytes, os, false);
 }
 
+/******************************************************************************/
+/*                 Parallel parsing of segments of one buffer                 */
+/*----------------------------------------------------------------------------*/
+
+/*
+ * With WIMLIB_COMPRESSOR_FLAG_PARALLEL, a large buffer is split into segments
+ * which helper compressors parse with the near-optimal algorithm in parallel,
+ * saving the blocks they choose instead of writing them.  The blocks are then
+ * written in order by the main compressor.  The result is a normal LZX stream,
+ * but matches can only refer back LZX_SEGMENT_DICT_SIZE bytes before the start
+ * of their segment, and each segment starts new blocks, so the compression
+ * ratio is slightly worse.
+ *
+ * Each helper has to parse its segment not knowing what the recent offsets
+ * queue will contain at the start of it, so it assumes the initial queue.  When
+ * writing the blocks, the main compressor replays the queue that the helper
+ * assumed to recover the actual offset of each repeat offset match, then
+ * re-encodes every offset against the actual queue, using a repeat offset
+ * whenever one matches.  Since this changes the symbols, the symbol frequencies
+ * are re-tallied before each block's Huffman codes are built.
+ */
+
+/* Free the segments and their helper compressors.  */
+static void
+lzx_free_segments(struct lzx_compressor *c)
+{
+	for (unsigned i = 0; i < c->num_segments; i++) {
+		struct lzx_segment *seg = &c->segments[i];
+
+		FREE(seg->helper);
+		FREE(seg->blocks);
+		FREE(seg->seqs);
+	}
+	FREE(c->segments);
+	c->segments = NULL;
+	c->num_segments = 0;
+}
+
+static int
+lzx_create_compressor(size_t max_bufsize, unsigned compression_level,
+		      bool destructive, bool parallel, void **c_ret);
+
+/* Prepare the compressor's Huffman codes for a new buffer.  Initially, the
+ * previous Huffman codeword lengths are all zeroes.  */
+static void
+lzx_reset_codes(struct lzx_compressor *c)
+{
+	c->codes_index = 0;
+	memset(&c->codes[1].lens, 0, sizeof(struct lzx_lens));
+}
+
+static void
+lzx_parse_segment(struct pool_task *task)
+{
+	struct lzx_segment *seg = container_of(task, struct lzx_segment, task);
+
+	seg->num_blocks = 0;
+	seg->num_seqs = 0;
+	seg->overflow = false;
+	/* The helper doesn't go through lzx_compress(), so it must be prepared
+	 * here, as if it were compressing its own buffer.  */
+	lzx_reset_codes(seg->helper);
+	(*seg->helper->impl)(seg->helper, seg->begin - seg->dict_size,
+			     seg->dict_size + seg->size, NULL);
+}
+
+/* Allocate at least @num_segments segments, if not already done.  Returns
+ * %false if out of memory.  */
+static bool
+lzx_alloc_segments(struct lzx_compressor *c, unsigned num_segments)
+{
+	/* No segment is longer than half the maximum buffer size, plus the
+	 * distance that its boundaries can be moved.  */
+	const size_t max_seg_size = c->max_bufsize / 2 +
+				    2 * LZX_SEGMENT_SPLIT_SEARCH;
+
+	if (c->num_segments >= num_segments)
+		return true;
+	lzx_free_segments(c);
+
+	c->segments = CALLOC(num_segments, sizeof(c->segments[0]));
+	if (!c->segments)
+		return false;
+	c->num_segments = num_segments;
+
+	for (unsigned i = 0; i < num_segments; i++) {
+		struct lzx_segment *seg = &c->segments[i];
+		void *helper;
+
+		if (lzx_create_compressor(LZX_SEGMENT_DICT_SIZE + max_seg_size,
+					  c->compression_level, true, false,
+					  &helper))
+			goto oom;
+		seg->helper = helper;
+		seg->helper->segment = seg;
+		/* Symbols must be chosen for the whole buffer's window.  */
+		seg->helper->window_order = c->window_order;
+		seg->helper->num_main_syms = c->num_main_syms;
+
+		/* The last block of a segment can be short, but the others
+		 * are never much shorter than MIN_BLOCK_SIZE, except if the
+		 * match cache fills up; lzx_save_parsed_block() checks for
+		 * overflow anyway.  */
+		seg->max_blocks = max_seg_size / 1024 + 16;
+		seg->max_seqs = max_seg_size / LZX_MIN_MATCH_LEN +
+				seg->max_blocks;
+		seg->blocks = MALLOC(seg->max_blocks * sizeof(seg->blocks[0]));
+		seg->seqs = MALLOC(seg->max_seqs * sizeof(seg->seqs[0]));
+		if (!seg->blocks || !seg->seqs)
+			goto oom;
+		seg->task.run = lzx_parse_segment;
+	}
+	return true;
+
+oom:
+	lzx_free_segments(c);
+	return false;
+}
+
+/*
+ * Choose where a segment should end, near @target.  Using the same statistics
+ * as the block splitting algorithm, look for a place within
+ * LZX_SEGMENT_SPLIT_SEARCH bytes after @target where the distribution of
+ * literals changes, since that is a place where a new block would be started
+ * anyway.  Just the raw bytes are observed, since the matches aren't known yet.
+ */
+static const u8 *
+lzx_choose_segment_end(const u8 *target)
+{
+	struct lzx_block_split_stats stats;
+	const u8 *p;
+
+	lzx_init_block_split_stats(&stats);
+	for (p = target - LZX_SEGMENT_SPLIT_SEARCH;
+	     p < target + LZX_SEGMENT_SPLIT_SEARCH; p++) {
+		lzx_observe_literal(&stats, *p);
+		if (stats.num_new_observations >=
+				NUM_OBSERVATIONS_PER_BLOCK_CHECK &&
+		    p >= target && lzx_should_end_block(&stats))
+			return p;
+	}
+	return target;
+}
+
+/*
+ * Write a block which a helper compressor parsed.  @assumed is the recent
+ * offsets queue which the helper had at this point, and @actual is the actual
+ * recent offsets queue.  Both are updated.
+ */
+static void
+lzx_write_parsed_block(struct lzx_compressor *c,
+		       struct lzx_output_bitstream *os,
+		       const struct lzx_segment *seg,
+		       const struct lzx_parsed_block *block,
+		       u32 assumed[LZX_NUM_RECENT_OFFSETS],
+		       u32 actual[LZX_NUM_RECENT_OFFSETS])
+{
+	const struct lzx_sequence *in_seq = &seg->seqs[block->first_seq];
+	struct lzx_sequence *out_seq = c->chosen_sequences;
+	const u8 *in_next = block->begin;
+
+	lzx_reset_symbol_frequencies(c);
+
+	for (;; in_seq++, out_seq++) {
+		u32 litrunlen = in_seq->litrunlen_and_matchlen >>
+				SEQ_MATCHLEN_BITS;
+		unsigned matchlen = in_seq->litrunlen_and_matchlen &
+				    SEQ_MATCHLEN_MASK;
+		u32 adjusted_offset;
+		unsigned offset_slot;
+		unsigned mainsym;
+		u32 offset;
+		unsigned idx;
+
+		while (litrunlen--)
+			c->freqs.main[*in_next++]++;
+		*out_seq = *in_seq;
+		if (matchlen == 0)
+			break;
+		in_next += matchlen;
+
+		/* Recover the match's actual offset.  */
+		adjusted_offset = in_seq->adjusted_offset_and_mainsym >>
+				  SEQ_MAINSYM_BITS;
+		mainsym = in_seq->adjusted_offset_and_mainsym &
+			  SEQ_MAINSYM_MASK;
+		offset_slot = (mainsym - LZX_NUM_CHARS) / LZX_NUM_LEN_HEADERS;
+		if (offset_slot < LZX_NUM_RECENT_OFFSETS) {
+			offset = assumed[offset_slot];
+			assumed[offset_slot] = assumed[0];
+		} else {
+			offset = adjusted_offset - LZX_OFFSET_ADJUSTMENT;
+			assumed[2] = assumed[1];
+			assumed[1] = assumed[0];
+		}
+		assumed[0] = offset;
+
+		/* Encode the offset against the actual queue.  */
+		for (idx = 0; idx < LZX_NUM_RECENT_OFFSETS; idx++)
+			if (actual[idx] == offset)
+				break;
+		if (idx < LZX_NUM_RECENT_OFFSETS) {
+			actual[idx] = actual[0];
+			adjusted_offset = idx;
+		} else {
+			actual[2] = actual[1];
+			actual[1] = actual[0];
+			adjusted_offset = offset + LZX_OFFSET_ADJUSTMENT;
+			if (adjusted_offset >= LZX_MIN_ALIGNED_OFFSET +
+					       LZX_OFFSET_ADJUSTMENT)
+				c->freqs.aligned[adjusted_offset &
+						 LZX_ALIGNED_OFFSET_BITMASK]++;
+		}
+		actual[0] = offset;
+
+		mainsym = lzx_tally_main_and_lensyms(c, matchlen,
+						     adjusted_offset, false);
+		out_seq->adjusted_offset_and_mainsym =
+			(adjusted_offset << SEQ_MAINSYM_BITS) | mainsym;
+	}
+
+	/* The helper which parsed this block did the optimization passes, but
+	 * only this compressor's statistics are reported, so count them here.  */
+	COMPRESSOR_STATS(c->stats.num_optimization_passes +=
+				 c->num_optim_passes);
+	lzx_flush_block(c, os, block->begin, block->size, 0);
+}
+
+/*
+ * Compress a buffer by parsing segments of it in parallel, if the buffer is
+ * large enough for this to be worthwhile.  Returns %false if the buffer wasn't
+ * compressed, in which case nothing has been written yet.
+ */
+static bool
+lzx_compress_parallel(struct lzx_compressor *c, const u8 *in, size_t in_nbytes,
+		      struct lzx_output_bitstream *os)
+{
+	struct pool_task *tasks[LZX_MAX_SEGMENTS];
+	unsigned num_segments;
+	const u8 *seg_begin = in;
+	u32 actual[LZX_NUM_RECENT_OFFSETS] = { 1, 1, 1 };
+
+	num_segments = min(in_nbytes / LZX_MIN_SEGMENT_SIZE,
+			   task_pool_num_threads());
+	num_segments = min(num_segments, LZX_MAX_SEGMENTS);
+	if (num_segments < 2 || !lzx_alloc_segments(c, num_segments))
+		return false;
+
+	for (unsigned i = 0; i < num_segments; i++) {
+		struct lzx_segment *seg = &c->segments[i];
+		const u8 *seg_end = in + in_nbytes;
+
+		if (i != num_segments - 1) {
+			seg_end = lzx_choose_segment_end(
+				in + (u64)in_nbytes * (i + 1) / num_segments);
+		}
+		seg->begin = seg_begin;
+		seg->size = seg_end - seg_begin;
+		seg->dict_size = min(seg_begin - in, LZX_SEGMENT_DICT_SIZE);
+		tasks[i] = &seg->task;
+		seg_begin = seg_end;
+	}
+
+	task_pool_run_batch(tasks, num_segments);
+
+	for (unsigned i = 0; i < num_segments; i++)
+		if (c->segments[i].overflow)
+			return false;
+
+	for (unsigned i = 0; i < num_segments; i++) {
+		const struct lzx_segment *seg = &c->segments[i];
+		u32 assumed[LZX_NUM_RECENT_OFFSETS] = { 1, 1, 1 };
+
+		for (u32 j = 0; j < seg->num_blocks; j++)
+			lzx_write_parsed_block(c, os, seg, &seg->blocks[j],
+					       assumed, actual);
+	}
+	return true;
+}
+
 /******************************************************************************/
 /*                     Faster ("lazy") compression algorithm                  */
 /*----------------------------------------------------------------------------*/
@@ -2505,7 +3179,9 @@ lzx_repeat_offset_match_score(unsigned rep_len, unsigned rep_idx)
  * This is the "lazy" LZX compressor.  The basic idea is that before it chooses
  * a match, it checks to see if there's a longer match at the next position.  If
  * yes, it chooses a literal and continues to the next position.  If no, it
- * chooses the match.
+ * chooses the match.  With c->lazy2, a match that survives this check is also
+ * compared with the best match two positions ahead, which has to be better by
+ * enough to pay for the two literals.
  *
  * Some additional heuristics are used as well.  Repeat offset matches are
  * considered favorably and sometimes are chosen immediately.  In addition, long
@@ -2697,8 +3373,66 @@ lzx_compress_lazy(struct lzx_compressor * restrict c,
 				}
 			}
 
-			/* The original match was better; choose it. */
+			/* The original match was better than the next one.  If
+			 * lazy2 parsing is enabled, see if there's a match at
+			 * the position after that which is better still. */
 			skip_len = cur_len - 2;
+			if (!c->lazy2 || cur_len < 4 || cur_len >= nice_len / 2)
+				goto choose_cur_match;
+
+			if (unlikely(max_len > in_end - in_next)) {
+				max_len = in_end - in_next;
+				nice_len = min(max_len, nice_len);
+			}
+
+			next_len = CALL_HC_MF(is_16_bit, c,
+					      hc_matchfinder_longest_match,
+					      in_begin,
+					      in_next,
+					      cur_len - 1,
+					      max_len,
+					      nice_len,
+					      c->max_search_depth / 4,
+					      next_hashes,
+					      &next_offset);
+			next_adjusted_offset = next_offset + LZX_OFFSET_ADJUSTMENT;
+			if (next_len > cur_len - 1)
+				next_score = lzx_explicit_offset_match_score(next_len,
+									     next_adjusted_offset);
+			else
+				next_score = 0;
+
+			best_rep_len = lzx_find_longest_repeat_offset_match(in_next,
+									    recent_offsets,
+									    max_len,
+									    &best_rep_idx);
+			if (best_rep_len != 0 &&
+			    (rep_score = lzx_repeat_offset_match_score(best_rep_len,
+								       best_rep_idx)) >= next_score)
+			{
+				next_len = best_rep_len;
+				next_adjusted_offset = best_rep_idx;
+				next_score = rep_score;
+			}
+			in_next++;
+
+			if (next_score > cur_score + 1) {
+				/* The match two positions ahead is better, even
+				 * after two literals; choose it. */
+				lzx_choose_literal(c, *(in_next - 3), &litrunlen);
+				lzx_choose_literal(c, *(in_next - 2), &litrunlen);
+				cur_len = next_len;
+				cur_adjusted_offset = next_adjusted_offset;
+				if (cur_adjusted_offset < LZX_NUM_RECENT_OFFSETS) {
+					skip_len = cur_len - 1;
+					goto choose_cur_match;
+				}
+				cur_score = next_score;
+				goto have_cur_match;
+			}
+
+			/* The original match was better; choose it. */
+			skip_len = cur_len - 3;
 
 		choose_cur_match:
 			/* Choose a match and have the matchfinder skip over its
@@ -2819,7 +3553,7 @@ lzx_get_needed_memory(size_t max_bufsize, unsigned compression_level,
 /* Allocate an LZX compressor. */
 static int
 lzx_create_compressor(size_t max_bufsize, unsigned compression_level,
-		      bool destructive, void **c_ret)
+		      bool destructive, bool parallel, void **c_ret)
 {
 	unsigned window_order;
 	struct lzx_compressor *c;
@@ -2830,13 +3564,23 @@ lzx_create_compressor(size_t max_bufsize, unsigned compression_level,
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	/* Allocate the compressor. */
-	c = MALLOC(lzx_get_compressor_size(max_bufsize, compression_level));
+	c = LARGE_MALLOC(lzx_get_compressor_size(max_bufsize, compression_level));
 	if (!c)
 		goto oom0;
 
 	c->window_order = window_order;
 	c->num_main_syms = lzx_get_num_main_syms(window_order);
+	wimlib_assert(!lzx_is_16_bit(max_bufsize) ||
+		      c->num_main_syms == LZX_MIN_WINDOW_NUM_MAIN_SYMS);
 	c->destructive = destructive;
+	c->parallel = parallel && compression_level > MAX_FAST_LEVEL;
+	c->segments = NULL;
+	c->num_segments = 0;
+	c->segment = NULL;
+	c->max_bufsize = max_bufsize;
+	c->compression_level = compression_level;
+	c->in_group = false;
+	c->cost_hint_valid = false;
 
 	/* Allocate the buffer for preprocessed data if needed. */
 	if (!c->destructive) {
@@ -2860,8 +3604,12 @@ lzx_create_compressor(size_t max_bufsize, unsigned compression_level,
 
 		/* lzx_compress_lazy() needs max_search_depth >= 2 because it
 		 * halves the max_search_depth when attempting a lazy match, and
-		 * max_search_depth must be at least 1. */
+		 * max_search_depth must be at least 1.  (The lazy2 search uses
+		 * a quarter of it, but lazy2 levels have much higher depths.)
+		 */
 		c->max_search_depth = max(c->max_search_depth, 2);
+
+		c->lazy2 = (compression_level >= MIN_LAZY2_LEVEL);
 	} else {
 
 		/* Normal / high compression: Use near-optimal parsing. */
@@ -2926,19 +3674,27 @@ lzx_compress(const void *restrict in, size_t in_nbytes,
 	/* Preprocess the input data. */
 	lzx_preprocess((void *)in, in_nbytes);
 
-	/* Initially, the previous Huffman codeword lengths are all zeroes. */
-	c->codes_index = 0;
-	memset(&c->codes[1].lens, 0, sizeof(struct lzx_lens));
+	/* Start without previous Huffman codes. */
+	lzx_reset_codes(c);
 
 	/* Initialize the output bitstream. */
 	lzx_init_output(&os, out, out_nbytes_avail);
 
-	/* Call the compression level-specific compress() function. */
-	(*c->impl)(c, in, in_nbytes, &os);
+	/* Call the compression level-specific compress() function, unless the
+	 * buffer is compressed by parsing segments of it in parallel. */
+	if (!c->parallel || !lzx_compress_parallel(c, in, in_nbytes, &os))
+		(*c->impl)(c, in, in_nbytes, &os);
 
 	/* Flush the output bitstream. */
 	result = lzx_flush_output(&os);
 
+	/* Pass the codes of the last block on to the next buffer in the group,
+	 * unless this one couldn't be compressed.  */
+	if (c->in_group && result) {
+		c->cost_hint = c->codes[c->codes_index ^ 1].lens;
+		c->cost_hint_valid = true;
+	}
+
 	/* If the data did not compress to less than its original size and we
 	 * preprocessed the original buffer, then postprocess it to restore it
 	 * to its original state. */
@@ -2950,20 +3706,45 @@ lzx_compress(const void *restrict in, size_t in_nbytes,
 	return result;
 }
 
+/* Start a new group of buffers, or with !@in_group, stop using groups.  */
+static void
+lzx_start_group(void *_c, bool in_group)
+{
+	struct lzx_compressor *c = _c;
+
+	c->in_group = in_group;
+	c->cost_hint_valid = false;
+}
+
 /* Free an LZX compressor. */
 static void
 lzx_free_compressor(void *_c)
 {
 	struct lzx_compressor *c = _c;
 
+	lzx_free_segments(c);
 	if (!c->destructive)
 		FREE(c->in_buffer);
 	FREE(c);
 }
 
+#ifdef ENABLE_COMPRESSOR_STATS
+static struct wimlib_compressor_stats *
+lzx_get_stats(void *_c)
+{
+	struct lzx_compressor *c = _c;
+
+	return &c->stats;
+}
+#endif
+
 const struct compressor_ops lzx_compressor_ops = {
 	.get_needed_memory  = lzx_get_needed_memory,
 	.create_compressor  = lzx_create_compressor,
 	.compress	    = lzx_compress,
+	.start_group	    = lzx_start_group,
 	.free_compressor    = lzx_free_compressor,
+#ifdef ENABLE_COMPRESSOR_STATS
+	.get_stats	    = lzx_get_stats,
+#endif
 };
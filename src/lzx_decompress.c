@@ -56,6 +56,7 @@
 
 #include <string.h>
 
+#include "wimlib/cpu_features.h"
 #include "wimlib/decompressor_ops.h"
 #include "wimlib/decompress_common.h"
 #include "wimlib/error.h"
@@ -330,11 +331,16 @@ lzx_read_block_header(struct lzx_decompressor *d, struct input_bitstream *is,
 	return 0;
 }
 
-/* Decompress a block of LZX-compressed data. */
+/*
+ * Decode the literals and matches of a compressed block, using the generic
+ * input bitstream.  The Huffman decode tables must already have been built.
+ */
 static int
-lzx_decompress_block(struct lzx_decompressor *d, struct input_bitstream *_is,
-		     int block_type, u32 block_size,
-		     u8 * const out_begin, u8 *out_next, u32 recent_offsets[])
+lzx_decode_symbols_generic(const struct lzx_decompressor *d,
+			   struct input_bitstream *_is,
+			   unsigned min_aligned_offset_slot,
+			   u8 * const out_begin, u8 *out_next, u8 * const block_end,
+			   u32 recent_offsets[])
 {
 	/*
 	 * Redeclare the input bitstream on the stack.  This shouldn't be
@@ -345,49 +351,6 @@ lzx_decompress_block(struct lzx_decompressor *d, struct input_bitstream *_is,
 	 */
 	struct input_bitstream is_onstack = *_is;
 	struct input_bitstream *is = &is_onstack;
-	u8 * const block_end = out_next + block_size;
-	unsigned min_aligned_offset_slot;
-
-	/*
-	 * Build the Huffman decode tables.  We always need to build the main
-	 * and length decode tables.  For aligned blocks we additionally need to
-	 * build the aligned offset decode table.
-	 */
-
-	if (make_huffman_decode_table(d->maincode_decode_table,
-				      d->num_main_syms,
-				      LZX_MAINCODE_TABLEBITS,
-				      d->maincode_lens,
-				      LZX_MAX_MAIN_CODEWORD_LEN,
-				      d->maincode_working_space))
-		return -1;
-
-	if (make_huffman_decode_table(d->lencode_decode_table,
-				      LZX_LENCODE_NUM_SYMBOLS,
-				      LZX_LENCODE_TABLEBITS,
-				      d->lencode_lens,
-				      LZX_MAX_LEN_CODEWORD_LEN,
-				      d->lencode_working_space))
-		return -1;
-
-	if (block_type == LZX_BLOCKTYPE_ALIGNED) {
-		if (make_huffman_decode_table(d->alignedcode_decode_table,
-					      LZX_ALIGNEDCODE_NUM_SYMBOLS,
-					      LZX_ALIGNEDCODE_TABLEBITS,
-					      d->alignedcode_lens,
-					      LZX_MAX_ALIGNED_CODEWORD_LEN,
-					      d->alignedcode_working_space))
-			return -1;
-		min_aligned_offset_slot = LZX_MIN_ALIGNED_OFFSET_SLOT;
-		memcpy(d->extra_offset_bits, d->extra_offset_bits_minus_aligned,
-		       sizeof(lzx_extra_offset_bits));
-	} else {
-		min_aligned_offset_slot = LZX_MAX_OFFSET_SLOTS;
-		memcpy(d->extra_offset_bits, lzx_extra_offset_bits,
-		       sizeof(lzx_extra_offset_bits));
-	}
-
-	/* Decode the literals and matches. */
 
 	do {
 		unsigned mainsym;
@@ -448,6 +411,328 @@ lzx_decompress_block(struct lzx_decompressor *d, struct input_bitstream *_is,
 	return 0;
 }
 
+#if defined(__x86_64__)
+/*
+ * A faster variant of the symbol decoding loop for x86_64 CPUs with BMI2.
+ *
+ * It reads the bitstream through a 64-bit bit buffer in which the next bits
+ * are right-justified, so that extracting a field is just a variable shift and
+ * a mask (SHRX and BZHI with BMI2), and consuming it is just a subtraction.
+ * The buffer is refilled 32 bits at a time, so for most symbols no refill is
+ * needed at all.  Matches whose offset is at least 16 are copied 16 bytes at a
+ * time when there is room for the overrun.
+ *
+ * Before and after the loop, the state is converted from and back to a
+ * 'struct input_bitstream', so this is interchangeable with
+ * lzx_decode_symbols_generic() on any block.
+ */
+
+struct lzx_bitreader64 {
+	/* The next 'bitsleft' bits of input are the low 'bitsleft' bits of
+	 * 'bitbuf', high bit first.  The bits above them are stale.  */
+	u64 bitbuf;
+	unsigned bitsleft;
+
+	/* Number of 16-bit coding units past the end of the input that have
+	 * been "read" as zeroes  */
+	unsigned overrun_units;
+
+	const u8 *next;
+	const u8 *end;
+};
+
+static forceinline void
+lzx_bitreader64_init(struct lzx_bitreader64 *r, const struct input_bitstream *is)
+{
+	r->bitbuf = (u64)is->bitbuf >> (32 - is->bitsleft);
+	r->bitsleft = is->bitsleft;
+	r->overrun_units = 0;
+	r->next = is->next;
+	r->end = is->end;
+}
+
+/* Convert the bit reader back to an input bitstream, giving back any whole
+ * coding units that don't fit in its 32-bit buffer.  */
+static forceinline void
+lzx_bitreader64_finish(struct lzx_bitreader64 *r, struct input_bitstream *is)
+{
+	while (r->bitsleft > 32) {
+		if (r->overrun_units)
+			r->overrun_units--;
+		else
+			r->next -= 2;
+		r->bitbuf >>= 16;
+		r->bitsleft -= 16;
+	}
+	is->bitbuf = (u32)(r->bitbuf << (32 - r->bitsleft));
+	is->bitsleft = r->bitsleft;
+	is->next = r->next;
+}
+
+static noinline void
+lzx_bitreader64_refill_slow(struct lzx_bitreader64 *r, unsigned num_bits)
+{
+	do {
+		r->bitbuf <<= 16;
+		if (r->end - r->next >= 2) {
+			r->bitbuf |= get_unaligned_le16(r->next);
+			r->next += 2;
+		} else {
+			r->overrun_units++;
+		}
+		r->bitsleft += 16;
+	} while (r->bitsleft < num_bits);
+}
+
+/* Ensure that at least @num_bits <= 32 bits are available.  */
+static forceinline void
+lzx_bitreader64_ensure(struct lzx_bitreader64 *r, unsigned num_bits)
+{
+	if (r->bitsleft >= num_bits)
+		return;
+	if (likely(r->end - r->next >= 4)) {
+		u32 v = get_unaligned_le32(r->next);
+
+		/* Two coding units, the first one in the high half  */
+		r->bitbuf = (r->bitbuf << 32) | (v << 16) | (v >> 16);
+		r->next += 4;
+		r->bitsleft += 32;
+	} else {
+		lzx_bitreader64_refill_slow(r, num_bits);
+	}
+}
+
+static forceinline u32
+lzx_bitreader64_peek(const struct lzx_bitreader64 *r, unsigned num_bits)
+{
+	return (r->bitbuf >> (r->bitsleft - num_bits)) &
+		(((u64)1 << num_bits) - 1);
+}
+
+static forceinline void
+lzx_bitreader64_remove(struct lzx_bitreader64 *r, unsigned num_bits)
+{
+	r->bitsleft -= num_bits;
+}
+
+static forceinline u32
+lzx_bitreader64_read(struct lzx_bitreader64 *r, unsigned num_bits)
+{
+	u32 bits;
+
+	lzx_bitreader64_ensure(r, num_bits);
+	bits = lzx_bitreader64_peek(r, num_bits);
+	lzx_bitreader64_remove(r, num_bits);
+	return bits;
+}
+
+/* Like read_huffsym(), but for a 'struct lzx_bitreader64', and the caller must
+ * have already ensured that at least @max_codeword_len bits are available.  */
+static forceinline unsigned
+lzx_bitreader64_decode_huffsym(struct lzx_bitreader64 *r,
+			       const u16 decode_table[], unsigned table_bits,
+			       unsigned max_codeword_len)
+{
+	unsigned entry;
+	unsigned symbol;
+	unsigned length;
+
+	entry = decode_table[lzx_bitreader64_peek(r, table_bits)];
+	symbol = entry >> DECODE_TABLE_SYMBOL_SHIFT;
+	length = entry & DECODE_TABLE_LENGTH_MASK;
+	if (max_codeword_len > table_bits &&
+	    entry >= (1U << (table_bits + DECODE_TABLE_SYMBOL_SHIFT)))
+	{
+		lzx_bitreader64_remove(r, table_bits);
+		entry = decode_table[symbol + lzx_bitreader64_peek(r, length)];
+		symbol = entry >> DECODE_TABLE_SYMBOL_SHIFT;
+		length = entry & DECODE_TABLE_LENGTH_MASK;
+	}
+	lzx_bitreader64_remove(r, length);
+	return symbol;
+}
+
+/* Like lz_copy(), but copy 16 bytes at a time when possible.  */
+static forceinline int
+lzx_copy_match_wide(u32 length, u32 offset, u8 *out_begin, u8 *out_next,
+		    u8 *out_end)
+{
+	const u8 *src = out_next - offset;
+	u8 *end = out_next + length;
+
+	if (likely(offset >= 16 && offset <= out_next - out_begin &&
+		   length <= out_end - out_next && out_end - end >= 15))
+	{
+		do {
+			memcpy(out_next, src, 16);
+			src += 16;
+			out_next += 16;
+		} while (out_next < end);
+		return 0;
+	}
+	return lz_copy(length, offset, out_begin, out_next, out_end,
+		       LZX_MIN_MATCH_LEN);
+}
+
+#define HAVE_LZX_DECODE_SYMBOLS_BMI2
+static int __attribute__((target("bmi2")))
+lzx_decode_symbols_bmi2(const struct lzx_decompressor *d,
+			struct input_bitstream *is,
+			unsigned min_aligned_offset_slot,
+			u8 * const out_begin, u8 *out_next, u8 * const block_end,
+			u32 recent_offsets[])
+{
+	struct lzx_bitreader64 r;
+
+	lzx_bitreader64_init(&r, is);
+	do {
+		unsigned mainsym;
+		unsigned length;
+		u32 offset;
+		unsigned offset_slot;
+
+		/* Get enough bits for both the main symbol and the length
+		 * symbol, so that both can be decoded without a refill check.  */
+		STATIC_ASSERT(LZX_MAX_MAIN_CODEWORD_LEN +
+			      LZX_MAX_LEN_CODEWORD_LEN <= 32);
+		lzx_bitreader64_ensure(&r, 32);
+
+		mainsym = lzx_bitreader64_decode_huffsym(&r,
+						d->maincode_decode_table,
+						LZX_MAINCODE_TABLEBITS,
+						LZX_MAX_MAIN_CODEWORD_LEN);
+		if (mainsym < LZX_NUM_CHARS) {
+			*out_next++ = mainsym;
+			continue;
+		}
+
+		length = mainsym % LZX_NUM_LEN_HEADERS;
+		offset_slot = (mainsym - LZX_NUM_CHARS) / LZX_NUM_LEN_HEADERS;
+
+		if (length == LZX_NUM_PRIMARY_LENS) {
+			length += lzx_bitreader64_decode_huffsym(&r,
+						d->lencode_decode_table,
+						LZX_LENCODE_TABLEBITS,
+						LZX_MAX_LEN_CODEWORD_LEN);
+		}
+		length += LZX_MIN_MATCH_LEN;
+
+		if (offset_slot < LZX_NUM_RECENT_OFFSETS) {
+			offset = recent_offsets[offset_slot];
+			recent_offsets[offset_slot] = recent_offsets[0];
+		} else {
+			offset = lzx_bitreader64_read(&r,
+					d->extra_offset_bits[offset_slot]);
+			if (offset_slot >= min_aligned_offset_slot) {
+				lzx_bitreader64_ensure(&r,
+						LZX_MAX_ALIGNED_CODEWORD_LEN);
+				offset = (offset << LZX_NUM_ALIGNED_OFFSET_BITS) |
+					 lzx_bitreader64_decode_huffsym(&r,
+						d->alignedcode_decode_table,
+						LZX_ALIGNEDCODE_TABLEBITS,
+						LZX_MAX_ALIGNED_CODEWORD_LEN);
+			}
+			offset += lzx_offset_slot_base[offset_slot];
+			recent_offsets[2] = recent_offsets[1];
+			recent_offsets[1] = recent_offsets[0];
+		}
+		recent_offsets[0] = offset;
+
+		if (unlikely(lzx_copy_match_wide(length, offset, out_begin,
+						 out_next, block_end)))
+			return -1;
+		out_next += length;
+	} while (out_next != block_end);
+
+	lzx_bitreader64_finish(&r, is);
+	return 0;
+}
+#endif /* __x86_64__ */
+
+typedef int (*lzx_decode_symbols_func_t)(const struct lzx_decompressor *d,
+					 struct input_bitstream *is,
+					 unsigned min_aligned_offset_slot,
+					 u8 * const out_begin, u8 *out_next,
+					 u8 * const block_end,
+					 u32 recent_offsets[]);
+
+static lzx_decode_symbols_func_t lzx_decode_symbols_func =
+	lzx_decode_symbols_generic;
+
+static const struct cpu_impl lzx_decode_impls[] = {
+#ifdef HAVE_LZX_DECODE_SYMBOLS_BMI2
+	{ "bmi2", (cpu_func_t)lzx_decode_symbols_bmi2, X86_CPU_FEATURE_BMI2 },
+#endif
+	{ "generic", (cpu_func_t)lzx_decode_symbols_generic, 0 },
+};
+
+static void
+lzx_decode_select(const struct cpu_impl *impl)
+{
+	lzx_decode_symbols_func = (lzx_decode_symbols_func_t)impl->func;
+}
+
+const struct cpu_kernel lzx_decode_kernel = {
+	.name = "lzx_decode",
+	.impls = lzx_decode_impls,
+	.num_impls = ARRAY_LEN(lzx_decode_impls),
+	.select = lzx_decode_select,
+};
+
+/* Decompress a block of LZX-compressed data. */
+static int
+lzx_decompress_block(struct lzx_decompressor *d, struct input_bitstream *is,
+		     int block_type, u32 block_size,
+		     u8 * const out_begin, u8 *out_next, u32 recent_offsets[])
+{
+	u8 * const block_end = out_next + block_size;
+	unsigned min_aligned_offset_slot;
+
+	/*
+	 * Build the Huffman decode tables.  We always need to build the main
+	 * and length decode tables.  For aligned blocks we additionally need to
+	 * build the aligned offset decode table.
+	 */
+
+	if (make_huffman_decode_table(d->maincode_decode_table,
+				      d->num_main_syms,
+				      LZX_MAINCODE_TABLEBITS,
+				      d->maincode_lens,
+				      LZX_MAX_MAIN_CODEWORD_LEN,
+				      d->maincode_working_space))
+		return -1;
+
+	if (make_huffman_decode_table(d->lencode_decode_table,
+				      LZX_LENCODE_NUM_SYMBOLS,
+				      LZX_LENCODE_TABLEBITS,
+				      d->lencode_lens,
+				      LZX_MAX_LEN_CODEWORD_LEN,
+				      d->lencode_working_space))
+		return -1;
+
+	if (block_type == LZX_BLOCKTYPE_ALIGNED) {
+		if (make_huffman_decode_table(d->alignedcode_decode_table,
+					      LZX_ALIGNEDCODE_NUM_SYMBOLS,
+					      LZX_ALIGNEDCODE_TABLEBITS,
+					      d->alignedcode_lens,
+					      LZX_MAX_ALIGNED_CODEWORD_LEN,
+					      d->alignedcode_working_space))
+			return -1;
+		min_aligned_offset_slot = LZX_MIN_ALIGNED_OFFSET_SLOT;
+		memcpy(d->extra_offset_bits, d->extra_offset_bits_minus_aligned,
+		       sizeof(lzx_extra_offset_bits));
+	} else {
+		min_aligned_offset_slot = LZX_MAX_OFFSET_SLOTS;
+		memcpy(d->extra_offset_bits, lzx_extra_offset_bits,
+		       sizeof(lzx_extra_offset_bits));
+	}
+
+	/* Decode the literals and matches. */
+	return (*lzx_decode_symbols_func)(d, is, min_aligned_offset_slot,
+					  out_begin, out_next, block_end,
+					  recent_offsets);
+}
+
 static int
 lzx_decompress(const void *restrict compressed_data, size_t compressed_size,
 	       void *restrict uncompressed_data, size_t uncompressed_size,
@@ -515,6 +800,12 @@ lzx_decompress(const void *restrict compressed_data, size_t compressed_size,
 	return 0;
 }
 
+static u64
+lzx_get_decompressor_needed_memory(size_t max_block_size)
+{
+	return sizeof(struct lzx_decompressor);
+}
+
 static int
 lzx_create_decompressor(size_t max_block_size, void **d_ret)
 {
@@ -557,6 +848,7 @@ lzx_free_decompressor(void *_d)
 }
 
 const struct decompressor_ops lzx_decompressor_ops = {
+	.get_needed_memory   = lzx_get_decompressor_needed_memory,
 	.create_decompressor = lzx_create_decompressor,
 	.decompress	     = lzx_decompress,
 	.free_decompressor   = lzx_free_decompressor,
@@ -0,0 +1,98 @@
+/*
+ * message_queue.c
+ *
+ * A simple blocking queue for passing messages between threads.
+ */
+
+/*
+ * Copyright (C) 2013-2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib/error.h"
+#include "wimlib/message_queue.h"
+
+int
+message_queue_init(struct message_queue *q)
+{
+	if (!mutex_init(&q->lock))
+		goto err;
+	if (!condvar_init(&q->msg_avail_cond))
+		goto err_destroy_lock;
+	if (!condvar_init(&q->space_avail_cond))
+		goto err_destroy_msg_avail_cond;
+	INIT_LIST_HEAD(&q->list);
+	return 0;
+
+err_destroy_msg_avail_cond:
+	condvar_destroy(&q->msg_avail_cond);
+err_destroy_lock:
+	mutex_destroy(&q->lock);
+err:
+	return WIMLIB_ERR_NOMEM;
+}
+
+/* Destroy a message queue.  This is a no-op if the queue is zero-initialized
+ * but message_queue_init() was never called on it (or failed).  */
+void
+message_queue_destroy(struct message_queue *q)
+{
+	if (q->list.next != NULL) {
+		mutex_destroy(&q->lock);
+		condvar_destroy(&q->msg_avail_cond);
+		condvar_destroy(&q->space_avail_cond);
+	}
+}
+
+void
+message_queue_put(struct message_queue *q, struct list_head *msg_node)
+{
+	mutex_lock(&q->lock);
+	list_add_tail(msg_node, &q->list);
+	condvar_signal(&q->msg_avail_cond);
+	mutex_unlock(&q->lock);
+}
+
+/* Remove the next message from the queue, waiting for one to become available
+ * if needed.  Returns NULL if the queue has been terminated.  */
+struct list_head *
+message_queue_get(struct message_queue *q)
+{
+	struct list_head *msg_node;
+
+	mutex_lock(&q->lock);
+	while (list_empty(&q->list) && !q->terminating)
+		condvar_wait(&q->msg_avail_cond, &q->lock);
+	if (!q->terminating) {
+		msg_node = q->list.next;
+		list_del(msg_node);
+	} else
+		msg_node = NULL;
+	mutex_unlock(&q->lock);
+	return msg_node;
+}
+
+void
+message_queue_terminate(struct message_queue *q)
+{
+	mutex_lock(&q->lock);
+	q->terminating = true;
+	condvar_broadcast(&q->msg_avail_cond);
+	mutex_unlock(&q->lock);
+}
@@ -25,11 +25,15 @@
 
 #include "wimlib/assert.h"
 #include "wimlib/blob_table.h"
+#include "wimlib/chunk_decompressor.h"
 #include "wimlib/dentry.h"
 #include "wimlib/error.h"
 #include "wimlib/metadata.h"
+#include "wimlib/open_wim_cache.h"
+#include "wimlib/perf_counters.h"
 #include "wimlib/resource.h"
 #include "wimlib/security.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/write.h"
 
 /* Fix the security ID for every inode to be either -1 or in bounds.  */
@@ -50,34 +54,15 @@ fix_security_ids(struct wim_image_metadata *imd, const u32 num_entries)
 		WARNING("%lu inodes had invalid security IDs", invalid_count);
 }
 
-/*
- * Reads and parses a metadata resource for an image in the WIM file.
- *
- * @imd:
- *	Pointer to the image metadata structure for the image whose metadata
- *	resource we are reading.  Its `metadata_blob' member specifies the blob
- *	table entry for the metadata resource.  The rest of the image metadata
- *	entry will be filled in by this function.
- *
- * Return values:
- *	WIMLIB_ERR_SUCCESS (0)
- *	WIMLIB_ERR_INVALID_METADATA_RESOURCE
- *	WIMLIB_ERR_NOMEM
- *	WIMLIB_ERR_READ
- *	WIMLIB_ERR_UNEXPECTED_END_OF_FILE
- *	WIMLIB_ERR_DECOMPRESSION
- */
-int
-read_metadata_resource(struct wim_image_metadata *imd)
+/* Read a metadata resource into memory and verify its SHA-1 message digest.  */
+static int
+read_verified_metadata_resource(const struct blob_descriptor *metadata_blob,
+				void **buf_ret)
 {
-	const struct blob_descriptor *metadata_blob;
+	const struct wim_resource_descriptor *rdesc = NULL;
 	void *buf;
-	int ret;
 	u8 hash[SHA1_HASH_SIZE];
-	struct wim_security_data *sd;
-	struct wim_dentry *root;
-
-	metadata_blob = imd->metadata_blob;
+	int ret;
 
 	/*
 	 * Prevent huge memory allocations when processing fuzzed files.  The
@@ -91,6 +76,16 @@ read_metadata_resource(struct wim_image_metadata *imd)
 	    metadata_blob->size / 512 > metadata_blob->rdesc->wim->file_size)
 		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
 
+	/* Take the metadata resource from the open WIM cache if another
+	 * WIMStruct for the same file already read it.  */
+	if (metadata_blob->blob_location == BLOB_IN_WIM) {
+		rdesc = metadata_blob->rdesc;
+		if (open_wim_cache_lookup(rdesc->wim, rdesc->offset_in_wim,
+					  rdesc->size_in_wim,
+					  metadata_blob->size, buf_ret))
+			return 0;
+	}
+
 	/* Read the metadata resource into memory.  (It may be compressed.)  */
 	ret = read_blob_into_alloc_buf(metadata_blob, &buf);
 	if (ret)
@@ -101,9 +96,34 @@ read_metadata_resource(struct wim_image_metadata *imd)
 	if (!hashes_equal(metadata_blob->hash, hash)) {
 		ERROR("Metadata resource is corrupted "
 		      "(invalid SHA-1 message digest)!");
-		ret = WIMLIB_ERR_INVALID_METADATA_RESOURCE;
-		goto out_free_buf;
+		FREE(buf);
+		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
 	}
+	if (rdesc) {
+		open_wim_cache_insert(rdesc->wim, rdesc->offset_in_wim,
+				      rdesc->size_in_wim, metadata_blob->size,
+				      buf);
+	}
+	*buf_ret = buf;
+	return 0;
+}
+
+/*
+ * Parse the uncompressed metadata resource @buf of @imd and fill in @imd from
+ * it.  @buf is freed, even on failure, unless @buf_ret is given, in which case
+ * it is returned there on success.  This doesn't touch any state shared with
+ * other images, so the metadata resources of different images may be parsed at
+ * the same time.
+ */
+static int
+parse_metadata_resource(struct wim_image_metadata *imd, void *buf,
+			const tchar * const *paths, size_t num_paths,
+			void **buf_ret, u64 start)
+{
+	const struct blob_descriptor *metadata_blob = imd->metadata_blob;
+	int ret;
+	struct wim_security_data *sd;
+	struct wim_dentry *root;
 
 	/* Parse the metadata resource.
 	 *
@@ -119,13 +139,17 @@ read_metadata_resource(struct wim_image_metadata *imd)
 	if (ret)
 		goto out_free_buf;
 
-	ret = read_dentry_tree(buf, metadata_blob->size, sd->total_length, &root);
+	ret = read_dentry_tree(buf, metadata_blob->size, sd->total_length,
+			       &imd->arena, paths, num_paths, &root);
 	if (ret)
 		goto out_free_security_data;
 
-	/* We have everything we need from the buffer now.  */
-	FREE(buf);
-	buf = NULL;
+	/* We have everything we need from the buffer now, unless the rest of
+	 * the tree is to be read later.  */
+	if (!buf_ret) {
+		FREE(buf);
+		buf = NULL;
+	}
 
 	/* Calculate and validate inodes.  */
 
@@ -139,11 +163,247 @@ read_metadata_resource(struct wim_image_metadata *imd)
 	imd->root_dentry = root;
 	imd->security_data = sd;
 	INIT_LIST_HEAD(&imd->unhashed_blobs);
+	if (buf_ret)
+		*buf_ret = buf;
+	perf_end(PERF_METADATA_READ, start, metadata_blob->size);
 	return 0;
 
 out_free_dentry_tree:
 	free_dentry_tree(root, NULL);
 out_free_security_data:
+	arena_destroy(&imd->arena);
+	free_wim_security_data(sd);
+out_free_buf:
+	FREE(buf);
+	return ret;
+}
+
+static int
+do_read_metadata_resource(struct wim_image_metadata *imd,
+			  const tchar * const *paths, size_t num_paths,
+			  void **buf_ret)
+{
+	void *buf;
+	int ret;
+	u64 start = perf_start();
+
+	ret = read_verified_metadata_resource(imd->metadata_blob, &buf);
+	if (ret)
+		return ret;
+	return parse_metadata_resource(imd, buf, paths, num_paths, buf_ret,
+				       start);
+}
+
+/*
+ * Reads and parses a metadata resource for an image in the WIM file.
+ *
+ * @imd:
+ *	Pointer to the image metadata structure for the image whose metadata
+ *	resource we are reading.  Its `metadata_blob' member specifies the blob
+ *	table entry for the metadata resource.  The rest of the image metadata
+ *	entry will be filled in by this function.
+ *
+ * @paths, @num_paths:
+ *	NULL and 0 to read the whole dentry tree, or canonicalized paths to read
+ *	only the parts of the tree needed to access those paths, as described
+ *	for read_dentry_tree().  The latter is much faster for a few paths in a
+ *	huge image, but the resulting image must not be used for anything else
+ *	and must be unloaded afterwards.
+ *
+ * Return values:
+ *	WIMLIB_ERR_SUCCESS (0)
+ *	WIMLIB_ERR_INVALID_METADATA_RESOURCE
+ *	WIMLIB_ERR_NOMEM
+ *	WIMLIB_ERR_READ
+ *	WIMLIB_ERR_UNEXPECTED_END_OF_FILE
+ *	WIMLIB_ERR_DECOMPRESSION
+ */
+int
+read_metadata_resource(struct wim_image_metadata *imd,
+		       const tchar * const *paths, size_t num_paths)
+{
+	return do_read_metadata_resource(imd, paths, num_paths, NULL);
+}
+
+/*
+ * Like read_metadata_resource(), but read only the root dentry, and return the
+ * uncompressed metadata resource in *buf_ret so that the rest of the dentry
+ * tree can be read on demand with read_dentry_subdir() and fixed up with
+ * dentry_children_fix_inodes().  The image must be unloaded before the buffer
+ * is freed, and must not be used for anything which needs the whole tree.
+ */
+int
+read_metadata_resource_lazily(struct wim_image_metadata *imd, void **buf_ret)
+{
+	static const tchar * const no_paths[1];
+
+	return do_read_metadata_resource(imd, no_paths, 0, buf_ret);
+}
+
+/* Maximum number of metadata resources which read_metadata_resources() parses
+ * at once  */
+#define MAX_PARSE_TASKS		16
+
+struct metadata_to_parse {
+	struct wim_image_metadata *imd;
+	void *buf;
+	u64 start;
+	int ret;
+};
+
+struct parse_metadata_task {
+	struct pool_task base;
+	struct metadata_to_parse *items;
+	size_t num_items;
+	size_t *next_item;
+};
+
+/*
+ * Read a metadata resource for read_metadata_resources().  Unless the WIM file
+ * was told otherwise with wimlib_set_decompression_threads(), decompress it
+ * with @num_threads threads, like the writes which recompress data do (see
+ * raise_decompression_threads()), since the task pool would otherwise be idle
+ * while it is read.
+ */
+static int
+read_metadata_resource_for_parse(const struct blob_descriptor *metadata_blob,
+				 unsigned num_threads, void **buf_ret)
+{
+	WIMStruct *wim = NULL;
+	int ret;
+
+	if (metadata_blob->blob_location == BLOB_IN_WIM) {
+		wim = metadata_blob->rdesc->wim;
+		if (wim->decompression_threads_set ||
+		    wim->decompression_threads_raised)
+			wim = NULL;
+	}
+	if (wim) {
+		wim->num_decompression_threads = num_threads;
+		wim->decompression_threads_raised = 1;
+	}
+
+	ret = read_verified_metadata_resource(metadata_blob, buf_ret);
+
+	if (wim) {
+		wim->num_decompression_threads = 1;
+		wim->decompression_threads_raised = 0;
+		if (wim->parallel_decompressor) {
+			wim->parallel_decompressor->destroy(
+						wim->parallel_decompressor);
+			wim->parallel_decompressor = NULL;
+		}
+	}
+	return ret;
+}
+
+static void
+parse_metadata_task_run(struct pool_task *_task)
+{
+	struct parse_metadata_task *task = (struct parse_metadata_task *)_task;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(task->next_item, 1, __ATOMIC_RELAXED)) <
+	       task->num_items)
+	{
+		struct metadata_to_parse *item = &task->items[i];
+
+		item->ret = parse_metadata_resource(item->imd, item->buf,
+						    NULL, 0, NULL, item->start);
+	}
+}
+
+/*
+ * Like read_metadata_resource() with no paths, but for each of the @num_imds
+ * images in @imds, none of which may be loaded yet.
+ *
+ * Reads from a WIM file can't be done concurrently, so the metadata resources
+ * are still read one at a time, though each is decompressed using multiple
+ * threads.  But for an image with many files, most of the time goes into
+ * building its dentry tree and inodes, and that is done for several images at
+ * the same time on the task pool.  The images are processed
+ * in groups of one per task, so that no more than that many uncompressed
+ * metadata resources are in memory at once.
+ *
+ * On failure, the images which were already parsed stay loaded.
+ */
+int
+read_metadata_resources(struct wim_image_metadata **imds, size_t num_imds)
+{
+	struct metadata_to_parse items[MAX_PARSE_TASKS];
+	struct parse_metadata_task tasks[MAX_PARSE_TASKS];
+	struct pool_task *task_ptrs[MAX_PARSE_TASKS];
+	size_t num_tasks;
+	int ret = 0;
+
+	num_tasks = min(min(num_imds, task_pool_num_threads()),
+			MAX_PARSE_TASKS);
+	if (num_tasks <= 1) {
+		for (size_t i = 0; i < num_imds && !ret; i++)
+			ret = read_metadata_resource(imds[i], NULL, 0);
+		return ret;
+	}
+
+	for (size_t i = 0; i < num_imds && !ret; i += num_tasks) {
+		size_t num_items = min(num_imds - i, num_tasks);
+		size_t next_item = 0;
+
+		for (size_t j = 0; j < num_items; j++) {
+			items[j].imd = imds[i + j];
+			items[j].start = perf_start();
+			ret = read_metadata_resource_for_parse(
+					items[j].imd->metadata_blob,
+					num_tasks, &items[j].buf);
+			if (ret) {
+				num_items = j;
+				break;
+			}
+		}
+
+		for (size_t j = 0; j < num_items; j++) {
+			tasks[j].base.run = parse_metadata_task_run;
+			tasks[j].items = items;
+			tasks[j].num_items = num_items;
+			tasks[j].next_item = &next_item;
+			task_ptrs[j] = &tasks[j].base;
+		}
+		task_pool_run_batch(task_ptrs, num_items);
+
+		for (size_t j = 0; j < num_items; j++)
+			if (items[j].ret && !ret)
+				ret = items[j].ret;
+	}
+	return ret;
+}
+
+/*
+ * Call @visitor on the SHA-1 message digest of each nonempty stream referenced
+ * by the image whose metadata resource is @metadata_blob, once per link, as if
+ * the image had been loaded and each of its inodes visited.  This is much
+ * faster than loading the image when only the referenced blobs are needed.
+ *
+ * Return values are as for read_metadata_resource(), plus any error returned
+ * by @visitor.
+ */
+int
+scan_metadata_resource_hashes(const struct blob_descriptor *metadata_blob,
+			      int (*visitor)(const u8 *hash, void *ctx),
+			      void *ctx)
+{
+	void *buf;
+	struct wim_security_data *sd;
+	int ret;
+
+	ret = read_verified_metadata_resource(metadata_blob, &buf);
+	if (ret)
+		return ret;
+
+	ret = read_wim_security_data(buf, metadata_blob->size, &sd);
+	if (ret)
+		goto out_free_buf;
+
+	ret = scan_dentry_tree_hashes(buf, metadata_blob->size,
+				      sd->total_length, visitor, ctx);
 	free_wim_security_data(sd);
 out_free_buf:
 	FREE(buf);
@@ -159,16 +419,22 @@ recalculate_security_data_length(struct wim_security_data *sd)
 	sd->total_length = ALIGN(total_length, 8);
 }
 
+/*
+ * Lay out the metadata resource of an image for writing: set the subdir offset
+ * of each dentry and the length of the security data, and return the total
+ * length of the resource.  The resource itself isn't built in memory; it is
+ * generated by read_generated_metadata() as many times as it's read, e.g.
+ * once to compute its SHA-1 message digest and then again while compressing
+ * it.  This way, for a huge image, the memory needed beyond the dentry tree
+ * itself is only a small window rather than the whole uncompressed resource.
+ */
 static int
 prepare_metadata_resource(WIMStruct *wim, int image,
-			  u8 **buf_ret, size_t *len_ret)
+			  struct wim_image_metadata **imd_ret, u64 *len_ret)
 {
-	u8 *buf;
-	u8 *p;
 	int ret;
 	u64 subdir_offset;
 	struct wim_dentry *root;
-	size_t len;
 	struct wim_security_data *sd;
 	struct wim_image_metadata *imd;
 
@@ -196,64 +462,258 @@ prepare_metadata_resource(WIMStruct *wim, int image,
 	recalculate_security_data_length(sd);
 	subdir_offset = sd->total_length + dentry_out_total_length(root) + 8;
 
-	/* Calculate the subdirectory offsets for the entire dentry tree.  */
+	/* Calculate the subdirectory offsets for the entire dentry tree.  The
+	 * total length of the metadata resource (uncompressed) is the end of
+	 * the last directory.  */
 	calculate_subdir_offsets(root, &subdir_offset);
 
-	/* Total length of the metadata resource (uncompressed).  */
-	len = subdir_offset;
+	*imd_ret = imd;
+	*len_ret = subdir_offset;
+	return 0;
+}
 
-	/* Allocate a buffer to contain the uncompressed metadata resource.  */
-	buf = NULL;
-	if (likely(len == subdir_offset))
-		buf = MALLOC(len);
-	if (!buf) {
-		ERROR("Failed to allocate %"PRIu64" bytes for "
-		      "metadata resource", subdir_offset);
-		return WIMLIB_ERR_NOMEM;
+/* Size of the window in which read_generated_metadata() builds the pieces of
+ * the metadata resource.  It grows if a dentry or the security data doesn't
+ * fit.  */
+#define METADATA_WINDOW_SIZE	(256U << 10)
+
+/* Result of the generation functions when @remaining reaches 0.  This is not a
+ * wimlib_error_code.  */
+#define METADATA_GEN_DONE	(-1)
+
+struct metadata_gen_ctx {
+	u8 *buf;
+	size_t buf_size;
+	size_t filled;
+
+	/* Number of bytes which still need to be passed to @cb  */
+	u64 remaining;
+	const struct consume_chunk_callback *cb;
+};
+
+static int
+metadata_gen_flush(struct metadata_gen_ctx *ctx)
+{
+	size_t n = min(ctx->filled, ctx->remaining);
+	int ret;
+
+	ctx->filled = 0;
+	if (n == 0)
+		return ctx->remaining ? 0 : METADATA_GEN_DONE;
+	ret = consume_chunk(ctx->cb, ctx->buf, n);
+	if (ret)
+		return ret;
+	ctx->remaining -= n;
+	return ctx->remaining ? 0 : METADATA_GEN_DONE;
+}
+
+/* Make room for @len more bytes in the window, and return a pointer to them in
+ * *p_ret.  */
+static int
+metadata_gen_reserve(struct metadata_gen_ctx *ctx, size_t len, u8 **p_ret)
+{
+	int ret;
+
+	if (ctx->buf_size - ctx->filled < len) {
+		ret = metadata_gen_flush(ctx);
+		if (ret)
+			return ret;
+		if (len > ctx->buf_size) {
+			u8 *new_buf = MALLOC(len);
+
+			if (!new_buf)
+				return WIMLIB_ERR_NOMEM;
+			FREE(ctx->buf);
+			ctx->buf = new_buf;
+			ctx->buf_size = len;
+		}
+	}
+	*p_ret = &ctx->buf[ctx->filled];
+	return 0;
+}
+
+static int
+metadata_gen_dentry(struct metadata_gen_ctx *ctx,
+		    const struct wim_dentry *dentry)
+{
+	u8 *p;
+	int ret;
+
+	ret = metadata_gen_reserve(ctx, dentry_out_total_length(dentry), &p);
+	if (ret)
+		return ret;
+	ctx->filled = write_dentry(dentry, p) - ctx->buf;
+	return 0;
+}
+
+static int
+metadata_gen_end_of_dir(struct metadata_gen_ctx *ctx)
+{
+	u8 *p;
+	int ret;
+
+	ret = metadata_gen_reserve(ctx, 8, &p);
+	if (ret)
+		return ret;
+	*(u64 *)p = 0;
+	ctx->filled += 8;
+	return 0;
+}
+
+/* Write the child dentries of a directory, in the same order as
+ * calculate_subdir_offsets() laid them out.  */
+static int
+metadata_gen_dir_dentries(struct wim_dentry *dir, void *_ctx)
+{
+	struct metadata_gen_ctx *ctx = _ctx;
+	struct wim_dentry *child;
+	int ret;
+
+	if (dir->d_subdir_offset == 0)
+		return 0;
+
+	for_dentry_child(child, dir) {
+		ret = metadata_gen_dentry(ctx, child);
+		if (ret)
+			return ret;
 	}
+	return metadata_gen_end_of_dir(ctx);
+}
 
-	/* Write the security data into the resource buffer.  */
-	p = write_wim_security_data(sd, buf);
+/*
+ * Generate the first @size bytes of the metadata resource of the image @imd,
+ * which must have been laid out by prepare_metadata_resource() and not changed
+ * since, and pass them to @cb in pieces.
+ */
+int
+read_generated_metadata(const struct wim_image_metadata *imd, u64 size,
+			const struct consume_chunk_callback *cb)
+{
+	struct metadata_gen_ctx ctx;
+	const struct wim_security_data *sd = imd->security_data;
+	u8 *p;
+	int ret;
 
-	/* Write the dentry tree into the resource buffer.  */
-	p = write_dentry_tree(root, p);
+	if (size == 0)
+		return 0;
 
-	/* We MUST have exactly filled the buffer; otherwise we calculated its
-	 * size incorrectly or wrote the data incorrectly.  */
-	wimlib_assert(p - buf == len);
+	ctx.buf = MALLOC(METADATA_WINDOW_SIZE);
+	if (!ctx.buf)
+		return WIMLIB_ERR_NOMEM;
+	ctx.buf_size = METADATA_WINDOW_SIZE;
+	ctx.filled = 0;
+	ctx.remaining = size;
+	ctx.cb = cb;
 
-	*buf_ret = buf;
-	*len_ret = len;
+	/* The security data  */
+	ret = metadata_gen_reserve(&ctx, sd->total_length, &p);
+	if (ret)
+		goto out;
+	ctx.filled = write_wim_security_data(sd, p) - ctx.buf;
+
+	/* The root dentry and the end-of-directory entry following it  */
+	ret = metadata_gen_dentry(&ctx, imd->root_dentry);
+	if (ret)
+		goto out;
+	ret = metadata_gen_end_of_dir(&ctx);
+	if (ret)
+		goto out;
+
+	/* The rest of the dentry tree  */
+	ret = for_dentry_in_tree(imd->root_dentry, metadata_gen_dir_dentries,
+				 &ctx);
+	if (ret)
+		goto out;
+
+	ret = metadata_gen_flush(&ctx);
+out:
+	FREE(ctx.buf);
+	if (ret == METADATA_GEN_DONE)
+		ret = 0;
+	/* We MUST have generated exactly the requested data; otherwise
+	 * prepare_metadata_resource() calculated the size incorrectly or the
+	 * data was generated incorrectly.  */
+	wimlib_assert(ret != 0 || ctx.remaining == 0);
+	return ret;
+}
+
+static int
+metadata_sha1_chunk(const void *chunk, size_t size, void *_sha_ctx)
+{
+	sha1_update(_sha_ctx, chunk, size);
 	return 0;
 }
 
+/*
+ * If the metadata resource the image was originally loaded from is still present
+ * in the WIM file being appended to and has the same contents as the new one,
+ * which has the SHA-1 message digest @hash and length @len, then set up the
+ * image's metadata blob to reuse it and return true.  This avoids recompressing
+ * the metadata when an image was "modified" in a way that didn't actually
+ * change it, e.g. by an update that replaced a file with an identical copy or
+ * by a read-write mount in which nothing was changed.
+ */
+static bool
+reuse_original_metadata_resource(WIMStruct *wim,
+				 struct wim_image_metadata *imd,
+				 const u8 hash[SHA1_HASH_SIZE], u64 len)
+{
+	if (imd->orig_metadata_wim != wim || !filedes_valid(&wim->in_fd) ||
+	    imd->orig_metadata_reshdr.uncompressed_size != len)
+		return false;
+
+	if (!hashes_equal(hash, imd->orig_metadata_hash))
+		return false;
+
+	imd->metadata_blob->out_reshdr = imd->orig_metadata_reshdr;
+	copy_hash(imd->metadata_blob->hash, hash);
+	return true;
+}
+
 int
-write_metadata_resource(WIMStruct *wim, int image, int write_resource_flags)
+write_metadata_resource(WIMStruct *wim, int image, int write_resource_flags,
+			unsigned num_threads, bool appending)
 {
 	int ret;
-	u8 *buf;
-	size_t len;
+	u64 len;
 	struct wim_image_metadata *imd;
+	struct sha1_ctx sha_ctx;
+	struct consume_chunk_callback cb;
+	u8 hash[SHA1_HASH_SIZE];
+	u64 start = perf_start();
 
-	ret = prepare_metadata_resource(wim, image, &buf, &len);
+	ret = prepare_metadata_resource(wim, image, &imd, &len);
 	if (ret)
 		return ret;
 
-	imd = wim->image_metadata[image - 1];
+	/* Compute the SHA-1 message digest of the metadata resource first, as
+	 * it's needed to check whether the original resource can be reused,
+	 * and as the data isn't hashed while it is written.  */
+	sha1_init(&sha_ctx);
+	cb.func = metadata_sha1_chunk;
+	cb.get_dest = NULL;
+	cb.ctx = &sha_ctx;
+	ret = read_generated_metadata(imd, len, &cb);
+	if (ret)
+		return ret;
+	sha1_final(&sha_ctx, hash);
+	perf_end(PERF_METADATA_WRITE, start, len);
+
+	if (appending && reuse_original_metadata_resource(wim, imd, hash, len))
+		return 0;
 
 	/* Write the metadata resource to the output WIM using the proper
 	 * compression type, in the process updating the blob descriptor for the
 	 * metadata resource.  */
-	ret = write_wim_resource_from_buffer(buf,
-					     len,
-					     true,
-					     &wim->out_fd,
-					     wim->out_compression_type,
-					     wim->out_chunk_size,
-					     &imd->metadata_blob->out_reshdr,
-					     imd->metadata_blob->hash,
-					     write_resource_flags);
-
-	FREE(buf);
-	return ret;
+	ret = write_generated_metadata_resource(imd, len, hash,
+						&wim->out_fd,
+						wim->out_compression_type,
+						wim->out_chunk_size,
+						&imd->metadata_blob->out_reshdr,
+						write_resource_flags,
+						num_threads);
+	if (ret)
+		return ret;
+	copy_hash(imd->metadata_blob->hash, hash);
+	return 0;
 }
@@ -54,15 +54,19 @@
 #include <utime.h>
 
 #include "wimlib/blob_table.h"
+#include "wimlib/chunk_cache.h"
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
 #include "wimlib/metadata.h"
 #include "wimlib/paths.h"
 #include "wimlib/progress.h"
 #include "wimlib/reparse.h"
+#include "wimlib/security.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/threads.h"
 #include "wimlib/timestamp.h"
 #include "wimlib/unix_data.h"
+#include "wimlib/util.h"
 #include "wimlib/write.h"
 #include "wimlib/xml.h"
 
@@ -128,10 +132,88 @@ struct wimfs_fd {
 	 * even if the indices of the inode's streams are changed by a deletion.
 	 */
 	u32 f_stream_id;
+
+	/* Offset just past the end of the last read through this file
+	 * descriptor, and offset up to which read-ahead has been requested.
+	 * Used to detect sequential reads; see maybe_read_ahead().  */
+	u64 f_next_read_offset;
+	u64 f_readahead_end;
+};
+
+/* A range of a blob in the WIM file to decompress into the chunk cache  */
+struct readahead_request {
+	const struct blob_descriptor *blob;
+	u64 offset;
+	u64 size;
 };
 
+/* Maximum number of pending read-ahead requests  */
+#define READAHEAD_QUEUE_LEN	16
+
+/* Minimum amount of data read ahead of a sequential reader.  At least one
+ * chunk is always read ahead, though.  */
+#define READAHEAD_SIZE		(4U << 20)
+
+/*
+ * In read-write mounts, a stream which is opened for writing or truncated is
+ * kept in memory, as an unhashed blob in an attached buffer, as long as it is no
+ * larger than this.  Creating and closing a staging file would cost far more
+ * than the writes to a small file such as a configuration file.  A stream which
+ * grows larger is moved to a staging file.
+ */
+#define MAX_MEMORY_STAGED_SIZE	65536
+
+/* Most memory to use for streams kept in memory.  Streams get staging files
+ * when this is used up.  Memory which is freed when a stream is deleted isn't
+ * counted as freed, so this errs on the side of using staging files.  */
+#define MEMORY_STAGING_BUDGET	(64U << 20)
+
 #define WIMFS_FD(fi) ((struct wimfs_fd *)(uintptr_t)((fi)->fh))
 
+/* Number of paths remembered by the lookup cache (a power of 2)  */
+#define LOOKUP_CACHE_SIZE	4096
+
+/* A path which was looked up in the mounted image, and its dentry.  The entry
+ * is valid only if its generation is the cache's current generation.  */
+struct lookup_cache_entry {
+	u64 hash;
+	u64 gen;
+	char *path;
+	struct wim_dentry *dentry;
+};
+
+/*
+ * A cache of recent path lookups.  FUSE identifies files by their full paths,
+ * and get_dentry() walks each path from the root, so tools like find and rsync
+ * which look up each path in a deep tree several times spend much of their time
+ * there.  This is a direct-mapped table keyed by the path.  Any removal or
+ * rename of a file invalidates the whole cache by advancing its generation,
+ * since a rename changes the paths of a whole subtree; this is cheap, and
+ * neither operation is done often by the tools which benefit from the cache.
+ * 'lock' is needed because read-only mounts are multithreaded.
+ */
+struct lookup_cache {
+	struct mutex lock;
+	u64 gen;
+	struct lookup_cache_entry entries[LOOKUP_CACHE_SIZE];
+};
+
+/*
+ * For a read-only mount of an image which wasn't loaded yet, the image is loaded
+ * lazily: at first only its root dentry is read, and each directory's children
+ * are read from the uncompressed metadata resource the first time they are
+ * looked up or listed.  That way the mount is ready at once, however many files
+ * the image has.  A directory whose children have been read has its
+ * d_subdir_offset set to 0, which is accessed atomically since read-only mounts
+ * are multithreaded; 'lock' serializes the reading of directories.
+ */
+struct lazy_tree {
+	struct mutex lock;
+	const void *buf;
+	size_t buf_len;
+	struct lazy_inode_fixup inode_fixup;
+};
+
 /* Context structure for a mounted WIM image.  */
 struct wimfs_context {
 	/* The WIMStruct containing the mounted image.  The mounted image is the
@@ -144,6 +226,13 @@ struct wimfs_context {
 	/* Default flags for path lookup in the WIM image.  */
 	int default_lookup_flags;
 
+	/* Cache of recent path lookups, or NULL if it couldn't be allocated */
+	struct lookup_cache *lookup_cache;
+
+	/* State for reading the dentry tree on demand, or NULL if the image
+	 * was loaded in full  */
+	struct lazy_tree *lazy_tree;
+
 	/* Information about the user who has mounted the WIM image  */
 	uid_t owner_uid;
 	gid_t owner_gid;
@@ -164,6 +253,10 @@ struct wimfs_context {
 	 * good enough to just generate inode numbers sequentially.  */
 	u64 next_ino;
 
+	/* For read-write mounts, the number of bytes used by streams kept in
+	 * memory; see MAX_MEMORY_STAGED_SIZE.  */
+	size_t memory_staged_bytes;
+
 	/* Number of file descriptors open to the mounted WIM image.  */
 	unsigned long num_open_fds;
 
@@ -174,6 +267,29 @@ struct wimfs_context {
 	/* Parameters for unmounting the image (can be set via extended
 	 * attribute "wimfs.unmount_info").  */
 	struct wimfs_unmount_info unmount_info;
+
+	/* Read-only mounts are multithreaded, so that files can be read by
+	 * multiple threads at once.  'fd_lock' protects the file descriptor
+	 * tables, including the open file descriptor counts.  'serial_read_lock'
+	 * serializes the reads of data which can't be read concurrently, such
+	 * as data in WIM files which have no chunk cache.  (Read-write mounts
+	 * are single-threaded, so these locks are never contended.)  */
+	struct mutex fd_lock;
+	struct mutex serial_read_lock;
+	bool locks_initialized;
+
+	/* Read-only mounts also have a read-ahead thread, which decompresses
+	 * the data that sequential readers will need next into the chunk cache
+	 * in the background.  Requests are queued in 'readahead_queue', which
+	 * is protected by 'readahead_lock'.  */
+	struct thread readahead_thread;
+	struct mutex readahead_lock;
+	struct condvar readahead_cond;
+	struct readahead_request readahead_queue[READAHEAD_QUEUE_LEN];
+	unsigned readahead_head;
+	unsigned readahead_count;
+	bool readahead_stop;
+	bool readahead_running;
 };
 
 #define WIMFS_CTX(fuse_ctx) ((struct wimfs_context*)(fuse_ctx)->private_data)
@@ -288,6 +404,8 @@ alloc_wimfs_fd(struct wim_inode *inode,
 	filedes_invalidate(&fd->f_staging_fd);
 	fd->f_idx       = i;
 	fd->f_stream_id	= strm->stream_id;
+	fd->f_next_read_offset = 0;
+	fd->f_readahead_end = 0;
 	*fd_ret         = fd;
 	inode->i_fds[i] = fd;
 	inode->i_num_opened_fds++;
@@ -330,6 +448,245 @@ close_wimfs_fd(struct wimfs_fd *fd)
 	return ret;
 }
 
+static struct lookup_cache *
+new_lookup_cache(void)
+{
+	struct lookup_cache *cache = CALLOC(1, sizeof(*cache));
+
+	if (!cache)
+		return NULL;
+	if (!mutex_init(&cache->lock)) {
+		FREE(cache);
+		return NULL;
+	}
+	/* Entries which have never been filled in have generation 0.  */
+	cache->gen = 1;
+	return cache;
+}
+
+static void
+free_lookup_cache(struct lookup_cache *cache)
+{
+	if (!cache)
+		return;
+	for (size_t i = 0; i < LOOKUP_CACHE_SIZE; i++)
+		FREE(cache->entries[i].path);
+	mutex_destroy(&cache->lock);
+	FREE(cache);
+}
+
+/* Forget all the cached lookups, since a dentry is being removed or moved.  */
+static void
+invalidate_lookup_cache(const struct wimfs_context *ctx)
+{
+	struct lookup_cache *cache = ctx->lookup_cache;
+
+	if (!cache)
+		return;
+	mutex_lock(&cache->lock);
+	cache->gen++;
+	mutex_unlock(&cache->lock);
+}
+
+static struct lazy_tree *
+new_lazy_tree(const void *buf, size_t buf_len, u64 next_ino)
+{
+	struct lazy_tree *tree = CALLOC(1, sizeof(*tree));
+
+	if (!tree)
+		return NULL;
+	if (!mutex_init(&tree->lock)) {
+		FREE(tree);
+		return NULL;
+	}
+	tree->buf = buf;
+	tree->buf_len = buf_len;
+	tree->inode_fixup.next_ino = next_ino;
+	return tree;
+}
+
+static void
+free_lazy_tree(struct lazy_tree *tree)
+{
+	if (!tree)
+		return;
+	lazy_inode_fixup_destroy(&tree->inode_fixup);
+	mutex_destroy(&tree->lock);
+	FREE(tree);
+}
+
+/*
+ * Read the children of the directory @dir if the image is loaded lazily and
+ * they haven't been read yet, and prepare their inodes for the mount as
+ * prepare_inodes() does.  Returns 0 or -EIO.  A directory which can't be read is
+ * left with the children read before the error, if any; it isn't retried.
+ */
+static int
+wimfs_read_subdir(const struct wimfs_context *ctx, struct wim_dentry *dir)
+{
+	struct lazy_tree *tree = ctx->lazy_tree;
+	struct wim_image_metadata *imd;
+	struct wim_dentry *child;
+	u64 first_new_ino;
+	int ret = 0;
+
+	if (!tree || __atomic_load_n(&dir->d_subdir_offset,
+				     __ATOMIC_ACQUIRE) == 0)
+		return 0;
+
+	mutex_lock(&tree->lock);
+	if (dir->d_subdir_offset == 0)
+		goto out_unlock;
+
+	imd = wim_get_current_image_metadata(ctx->wim);
+	if (read_dentry_subdir(tree->buf, tree->buf_len, &imd->arena, dir))
+		ret = -EIO;
+
+	first_new_ino = tree->inode_fixup.next_ino;
+	dentry_children_fix_inodes(dir, &tree->inode_fixup, &imd->inode_list);
+	for_dentry_child(child, dir) {
+		struct wim_inode *inode = child->d_inode;
+
+		if (inode->i_ino < first_new_ino)
+			continue;
+		inode->i_num_opened_fds = 0;
+		inode->i_num_allocated_fds = 0;
+		inode->i_fds = NULL;
+		if ((u32)inode->i_security_id >= imd->security_data->num_entries)
+			inode->i_security_id = -1;
+	}
+	__atomic_store_n(&dir->d_subdir_offset, 0, __ATOMIC_RELEASE);
+out_unlock:
+	mutex_unlock(&tree->lock);
+	return ret;
+}
+
+/* Look up a path in the mounted WIM image, like get_dentry() with
+ * WIMLIB_CASE_SENSITIVE, but reading the directories on the way if the image is
+ * loaded lazily.  Returns the dentry, or NULL with errno set.  */
+static struct wim_dentry *
+wimfs_lookup(const struct wimfs_context *ctx, const char *path)
+{
+	struct wim_dentry *dentry;
+	size_t len = strlen(path);
+	char buf[len + 1];
+	char *name = buf;
+
+	if (!ctx->lazy_tree)
+		return get_dentry(ctx->wim, path, WIMLIB_CASE_SENSITIVE);
+
+	memcpy(buf, path, len + 1);
+	dentry = wim_get_current_root_dentry(ctx->wim);
+	for (;;) {
+		char *end;
+		char c;
+
+		if (!dentry) {
+			errno = ENOENT;
+			return NULL;
+		}
+		while (*name == '/')
+			name++;
+		if (!*name)
+			return dentry;
+		if (!dentry_is_directory(dentry)) {
+			errno = ENOTDIR;
+			return NULL;
+		}
+		if (wimfs_read_subdir(ctx, dentry)) {
+			errno = EIO;
+			return NULL;
+		}
+		end = strchrnul(name, '/');
+		c = *end;
+		*end = '\0';
+		dentry = get_dentry_child_with_name(dentry, name,
+						    WIMLIB_CASE_SENSITIVE);
+		*end = c;
+		name = end;
+	}
+}
+
+static u64
+hash_path(const char *path, size_t len)
+{
+	u64 hash = 0;
+
+	for (size_t i = 0; i < len; i++)
+		hash = hash_u64(hash + (u8)path[i]);
+	return hash;
+}
+
+/*
+ * Look up a path in the mounted WIM image, like get_dentry() with
+ * WIMLIB_CASE_SENSITIVE but using the lookup cache.  Returns the dentry, or
+ * NULL with errno set.  Failed lookups aren't cached.
+ */
+static struct wim_dentry *
+wimfs_get_dentry(const struct wimfs_context *ctx, const char *path)
+{
+	struct lookup_cache *cache = ctx->lookup_cache;
+	struct lookup_cache_entry *entry;
+	struct wim_dentry *dentry;
+	size_t len;
+	u64 hash;
+	u64 gen;
+	char *path_copy;
+
+	if (!cache)
+		return wimfs_lookup(ctx, path);
+
+	len = strlen(path);
+	hash = hash_path(path, len);
+	entry = &cache->entries[hash & (LOOKUP_CACHE_SIZE - 1)];
+
+	mutex_lock(&cache->lock);
+	gen = cache->gen;
+	if (entry->gen == gen && entry->hash == hash &&
+	    !strcmp(entry->path, path)) {
+		dentry = entry->dentry;
+		mutex_unlock(&cache->lock);
+		return dentry;
+	}
+	mutex_unlock(&cache->lock);
+
+	/* The dentry tree only changes in read-write mounts, which are
+	 * single-threaded, and by the reading of directories of lazily loaded
+	 * images, which has its own lock, so the lookup itself needn't hold
+	 * the lock.  */
+	dentry = wimfs_lookup(ctx, path);
+	if (!dentry)
+		return NULL;
+
+	path_copy = memdup(path, len + 1);
+	if (!path_copy)
+		return dentry;
+	mutex_lock(&cache->lock);
+	FREE(entry->path);
+	entry->hash = hash;
+	entry->gen = gen;
+	entry->path = path_copy;
+	entry->dentry = dentry;
+	mutex_unlock(&cache->lock);
+	return dentry;
+}
+
+/* Look up the directory which would contain @path, like get_parent_dentry()
+ * but using the lookup cache.  The result is not necessarily a directory.  */
+static struct wim_dentry *
+wimfs_get_parent_dentry(const struct wimfs_context *ctx, const char *path)
+{
+	const char *p = strrchr(path, '/');
+	size_t len = (p && p != path) ? p - path : 1;
+	char buf[len + 1];
+
+	if (!p)
+		return get_parent_dentry(ctx->wim, path, WIMLIB_CASE_SENSITIVE);
+	memcpy(buf, path, len);
+	buf[len] = '\0';
+	return wimfs_get_dentry(ctx, buf);
+}
+
 /*
  * Translate a path into the corresponding inode in the mounted WIM image.
  *
@@ -338,11 +695,11 @@ close_wimfs_fd(struct wimfs_fd *fd)
  * Returns a pointer to the resulting inode, or NULL with errno set.
  */
 static struct wim_inode *
-wim_pathname_to_inode(WIMStruct *wim, const char *path)
+wim_pathname_to_inode(const struct wimfs_context *ctx, const char *path)
 {
 	struct wim_dentry *dentry;
 
-	dentry = get_dentry(wim, path, WIMLIB_CASE_SENSITIVE);
+	dentry = wimfs_get_dentry(ctx, path);
 	if (!dentry)
 		return NULL;
 	return dentry->d_inode;
@@ -407,7 +764,7 @@ wim_pathname_to_stream(const struct wimfs_context *ctx,
 		}
 	}
 
-	dentry = get_dentry(wim, path, WIMLIB_CASE_SENSITIVE);
+	dentry = wimfs_get_dentry(ctx, path);
 	if (p)
 		*p = ':';
 	if (!dentry)
@@ -471,7 +828,7 @@ create_file(struct fuse_context *fuse_ctx, const char *path,
 	struct wim_dentry *dentry;
 	struct wim_inode *inode;
 
-	parent = get_parent_dentry(wimfs_ctx->wim, path, WIMLIB_CASE_SENSITIVE);
+	parent = wimfs_get_parent_dentry(wimfs_ctx, path);
 	if (!parent)
 		return -errno;
 
@@ -525,10 +882,12 @@ create_file(struct fuse_context *fuse_ctx, const char *path,
  * inode.
  */
 static void
-remove_dentry(struct wim_dentry *dentry, struct blob_table *blob_table)
+remove_dentry(const struct wimfs_context *ctx, struct wim_dentry *dentry)
 {
+	invalidate_lookup_cache(ctx);
+
 	/* Drop blob references.  */
-	inode_unref_blobs(dentry->d_inode, blob_table);
+	inode_unref_blobs(dentry->d_inode, ctx->wim->blob_table);
 
 	/* Unlink the dentry from the image's dentry tree.  */
 	unlink_dentry(dentry);
@@ -668,6 +1027,21 @@ file_contents_changed(struct wim_inode *inode)
 	} /* Else, set[ug]id can't be set, so there's nothing to do. */
 }
 
+/* Is @blob the data of a modified stream which is being kept in memory?  */
+static inline bool
+blob_is_memory_staged(const struct blob_descriptor *blob)
+{
+	return blob->blob_location == BLOB_IN_ATTACHED_BUFFER && blob->unhashed;
+}
+
+/* Is @blob the data of a modified stream, which can be changed in place?  */
+static inline bool
+blob_is_staged(const struct blob_descriptor *blob)
+{
+	return blob && (blob->blob_location == BLOB_IN_STAGING_FILE ||
+			blob_is_memory_staged(blob));
+}
+
 /*
  * Create a new file in the staging directory for a read-write mounted image.
  *
@@ -705,10 +1079,188 @@ retry:
 	return fd;
 }
 
+/* Return true if the data of a stream which is becoming modified, which is
+ * @old_blob truncated or extended to @size bytes, can be kept in memory.  */
+static bool
+can_stage_in_memory(const struct wimfs_context *ctx,
+		    const struct blob_descriptor *old_blob, off_t size)
+{
+	return size <= MAX_MEMORY_STAGED_SIZE &&
+		ctx->memory_staged_bytes + size <= MEMORY_STAGING_BUDGET &&
+		(!old_blob || can_read_partial_blob(old_blob));
+}
+
+/* Like extract_blob_to_staging_dir(), but keep the data in memory.  This
+ * requires can_stage_in_memory().  */
+static int
+stage_blob_in_memory(struct wim_inode *inode, struct wim_inode_stream *strm,
+		     off_t size, struct wimfs_context *ctx)
+{
+	struct blob_descriptor *old_blob = stream_blob_resolved(strm);
+	struct blob_descriptor *new_blob;
+	const size_t copy_size = min(blob_size(old_blob), size);
+	u8 *buf;
+
+	buf = CALLOC(1, max(size, 1));
+	if (!buf)
+		return -ENOMEM;
+	if (copy_size) {
+		errno = 0;
+		if (read_partial_blob_into_buf(old_blob, 0, copy_size, buf)) {
+			FREE(buf);
+			return errno ? -errno : -EIO;
+		}
+	}
+	new_blob = new_blob_descriptor();
+	if (!new_blob) {
+		FREE(buf);
+		return -ENOMEM;
+	}
+	blob_set_is_located_in_attached_buffer(new_blob, buf, size);
+	ctx->memory_staged_bytes += size;
+
+	/* Switch the file descriptors which are already open to the stream to
+	 * the new blob, as in extract_blob_to_staging_dir().  */
+	for (u16 i = 0, j = 0; j < inode->i_num_opened_fds; i++) {
+		struct wimfs_fd *fd = inode->i_fds[i];
+
+		if (!fd)
+			continue;
+		j++;
+		if (fd->f_stream_id != strm->stream_id)
+			continue;
+		fd->f_blob = new_blob;
+		new_blob->num_opened_fds++;
+	}
+	if (old_blob)
+		old_blob->num_opened_fds -= new_blob->num_opened_fds;
+
+	prepare_unhashed_blob(new_blob, inode, strm->stream_id,
+			      &wim_get_current_image_metadata(ctx->wim)->unhashed_blobs);
+	inode_replace_stream_blob(inode, strm, new_blob, ctx->wim->blob_table);
+	if (size != blob_size(old_blob))
+		file_contents_changed(inode);
+	return 0;
+}
+
+/*
+ * Move the data of a stream which is kept in memory, @blob, to a new staging
+ * file, truncated or extended to @size bytes, and open the staging file for
+ * each file descriptor open to the stream.  The caller must update the blob's
+ * size.
+ *
+ * Returns 0 or a -errno code.  On failure the blob is unchanged.
+ */
+static int
+move_blob_to_staging_file(struct wim_inode *inode, struct blob_descriptor *blob,
+			  off_t size, struct wimfs_context *ctx)
+{
+	char *staging_file_name;
+	struct filedes staging_fd;
+	int raw_fd;
+	int ret = 0;
+
+	raw_fd = create_staging_file(ctx, &staging_file_name);
+	if (raw_fd < 0)
+		return -errno;
+	filedes_init(&staging_fd, raw_fd);
+	errno = 0;
+	if (full_pwrite(&staging_fd, blob->attached_buffer,
+			min(blob->size, size), 0) ||
+	    ftruncate(raw_fd, size))
+		ret = errno ? -errno : -EIO;
+	if (filedes_close(&staging_fd) && !ret)
+		ret = -errno;
+	if (ret)
+		goto out_delete_staging_file;
+
+	for (u16 i = 0, j = 0; j < inode->i_num_opened_fds; i++) {
+		struct wimfs_fd *fd = inode->i_fds[i];
+
+		if (!fd)
+			continue;
+		j++;
+		if (fd->f_blob != blob)
+			continue;
+		raw_fd = openat(ctx->staging_dir_fd, staging_file_name,
+				O_RDWR | O_NOFOLLOW);
+		if (raw_fd < 0) {
+			ret = -errno;
+			goto out_close_fds;
+		}
+		filedes_init(&fd->f_staging_fd, raw_fd);
+	}
+
+	ctx->memory_staged_bytes -= min(ctx->memory_staged_bytes, blob->size);
+	FREE(blob->attached_buffer);
+	blob->blob_location = BLOB_IN_STAGING_FILE;
+	blob->staging_file_name = staging_file_name;
+	blob->staging_dir_fd = ctx->staging_dir_fd;
+	blob->staging_origin = NULL;
+	return 0;
+
+out_close_fds:
+	for (u16 i = 0, j = 0; j < inode->i_num_opened_fds; i++) {
+		struct wimfs_fd *fd = inode->i_fds[i];
+
+		if (!fd)
+			continue;
+		j++;
+		if (fd->f_blob == blob && filedes_valid(&fd->f_staging_fd)) {
+			filedes_close(&fd->f_staging_fd);
+			filedes_invalidate(&fd->f_staging_fd);
+		}
+	}
+out_delete_staging_file:
+	unlinkat(ctx->staging_dir_fd, staging_file_name, 0);
+	FREE(staging_file_name);
+	return ret;
+}
+
+/*
+ * Truncate or extend a stream which is kept in memory, whose data is @blob, to
+ * @size bytes, zero-filling any new data.  If it would get too large, it is
+ * moved to a staging file instead.  Returns 0 or a -errno code.
+ */
+static int
+resize_memory_staged_blob(struct wim_inode *inode, struct blob_descriptor *blob,
+			  off_t size, struct wimfs_context *ctx)
+{
+	u8 *buf;
+	int ret;
+
+	if (size > MAX_MEMORY_STAGED_SIZE ||
+	    (size > blob->size && ctx->memory_staged_bytes + (size - blob->size) >
+				  MEMORY_STAGING_BUDGET))
+	{
+		ret = move_blob_to_staging_file(inode, blob, size, ctx);
+		if (ret)
+			return ret;
+	} else {
+		buf = REALLOC(blob->attached_buffer, max(size, 1));
+		if (!buf)
+			return -ENOMEM;
+		if (size > blob->size) {
+			memset(&buf[blob->size], 0, size - blob->size);
+			ctx->memory_staged_bytes += size - blob->size;
+		} else {
+			ctx->memory_staged_bytes -= min(ctx->memory_staged_bytes,
+							blob->size - size);
+		}
+		blob->attached_buffer = buf;
+	}
+	if (size != blob->size) {
+		blob->size = size;
+		file_contents_changed(inode);
+	}
+	return 0;
+}
+
 /*
  * Extract a blob to the staging directory.  This is necessary when a stream
  * using the blob is being opened for writing and the blob has not already been
- * extracted to the staging directory.
+ * extracted to the staging directory.  A small stream is kept in memory
+ * instead; see MAX_MEMORY_STAGED_SIZE.
  *
  * @inode
  *	The inode containing the stream being opened for writing.
@@ -726,10 +1278,11 @@ retry:
 static int
 extract_blob_to_staging_dir(struct wim_inode *inode,
 			    struct wim_inode_stream *strm,
-			    off_t size, const struct wimfs_context *ctx)
+			    off_t size, struct wimfs_context *ctx)
 {
 	struct blob_descriptor *old_blob;
 	struct blob_descriptor *new_blob;
+	struct staging_origin *origin = NULL;
 	char *staging_file_name;
 	int staging_fd;
 	off_t extract_size;
@@ -738,13 +1291,28 @@ extract_blob_to_staging_dir(struct wim_inode *inode,
 
 	old_blob = stream_blob_resolved(strm);
 
+	if (can_stage_in_memory(ctx, old_blob, size))
+		return stage_blob_in_memory(inode, strm, size, ctx);
+
 	/* Create the staging file.  */
 	staging_fd = create_staging_file(ctx, &staging_file_name);
 	if (unlikely(staging_fd < 0))
 		return -errno;
 
-	/* Extract the stream to the staging file (possibly truncated).  */
-	if (old_blob) {
+	/* Extract the stream to the staging file (possibly truncated).  If the
+	 * stream is in the WIM file, then just remember where its data is; the
+	 * extents of the staging file are filled only as they are overwritten.
+	 * See 'struct staging_origin'.  */
+	if (old_blob && old_blob->blob_location == BLOB_IN_WIM && size != 0) {
+		extract_size = 0;
+		origin = new_staging_origin(old_blob, min(old_blob->size, size));
+		if (origin) {
+			result = 0;
+		} else {
+			errno = ENOMEM;
+			result = -1;
+		}
+	} else if (old_blob) {
 		struct filedes fd;
 
 		filedes_init(&fd, staging_fd);
@@ -815,6 +1383,7 @@ extract_blob_to_staging_dir(struct wim_inode *inode,
 	new_blob->blob_location     = BLOB_IN_STAGING_FILE;
 	new_blob->staging_file_name = staging_file_name;
 	new_blob->staging_dir_fd    = ctx->staging_dir_fd;
+	new_blob->staging_origin    = origin;
 	new_blob->size              = size;
 
 	prepare_unhashed_blob(new_blob, inode, strm->stream_id,
@@ -838,11 +1407,72 @@ out_revert_fd_changes:
 	}
 	free_blob_descriptor(new_blob);
 out_delete_staging_file:
+	free_staging_origin(origin);
 	unlinkat(ctx->staging_dir_fd, staging_file_name, 0);
 	FREE(staging_file_name);
 	return ret;
 }
 
+/* Copy the original data of extent @idx of a lazily staged blob, which ends at
+ * @end, to the blob's staging file, which is open for writing as @fd.  */
+static int
+fill_staging_extent(struct wimfs_fd *fd, u64 idx, u64 end)
+{
+	struct staging_origin *origin = fd->f_blob->staging_origin;
+	const u64 start = idx * STAGING_EXTENT_SIZE;
+	u8 *buf;
+	int ret = 0;
+
+	buf = MALLOC(end - start);
+	if (!buf)
+		return -ENOMEM;
+	if (read_partial_wim_blob_into_buf(origin->blob, start, end - start,
+					   buf) ||
+	    full_pwrite(&fd->f_staging_fd, buf, end - start, start))
+		ret = errno ? -errno : -EIO;
+	else
+		set_staging_extent_filled(origin, idx);
+	FREE(buf);
+	return ret;
+}
+
+/*
+ * Prepare for a write of [@offset, @end) to a lazily staged blob, or account for
+ * it after it's done.  Each extent whose original data the write covers only
+ * partially must be filled before the write, while each extent which it covers
+ * completely becomes filled by the write itself.  Extents whose original data
+ * isn't touched at all, such as those past the original end of the stream when
+ * appending, are left alone.
+ */
+static int
+staging_write(struct wimfs_fd *fd, u64 offset, u64 end, bool done)
+{
+	struct staging_origin *origin = fd->f_blob->staging_origin;
+
+	for (u64 idx = offset / STAGING_EXTENT_SIZE;
+	     idx * STAGING_EXTENT_SIZE < min(end, origin->size); idx++)
+	{
+		const u64 ext_start = idx * STAGING_EXTENT_SIZE;
+		const u64 ext_end = min(ext_start + STAGING_EXTENT_SIZE,
+					origin->size);
+		int ret;
+
+		if (staging_extent_filled(origin, idx))
+			continue;
+		if (offset <= ext_start && end >= ext_end) {
+			if (done)
+				set_staging_extent_filled(origin, idx);
+			continue;
+		}
+		if (done)
+			continue;
+		ret = fill_staging_extent(fd, idx, ext_end);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
 /*
  * Create the staging directory for the WIM file.
  *
@@ -1010,6 +1640,158 @@ delete_empty_blobs(struct wimfs_context *ctx)
 	}
 }
 
+/* Maximum number of tasks which checksum staged blobs at commit time  */
+#define MAX_HASH_TASKS	16
+
+struct staged_blob {
+	struct blob_descriptor *blob;
+
+	/* Saved from the unhashed blob, since hashing overwrites them  */
+	struct blob_descriptor **back_ptr;
+	struct wim_inode *back_inode;
+
+	/* Result of sha1_blob(), or -1 if not hashed yet  */
+	int ret;
+};
+
+struct hash_staged_blobs_task {
+	struct pool_task base;
+	struct staged_blob *blobs;
+	size_t num_blobs;
+	size_t *next_blob;
+};
+
+/* Return true if the specified unhashed blob was staged lazily and then never
+ * changed, so its data is still exactly that of its original blob.  */
+static bool
+is_unmodified_staged_blob(const struct blob_descriptor *blob)
+{
+	const struct staging_origin *origin;
+
+	if (blob->blob_location != BLOB_IN_STAGING_FILE)
+		return false;
+	origin = blob->staging_origin;
+	return origin && !origin->modified &&
+		blob->size == origin->blob->size &&
+		origin->size == origin->blob->size;
+}
+
+/* Return true if sha1_blob() may be called on the specified unhashed blob while
+ * other blobs are being hashed by other threads.  A staging file is read
+ * through its own file descriptor, but the extents of a lazily staged blob
+ * which haven't been filled are read from the WIM file.  A stream kept in
+ * memory can always be hashed concurrently.  */
+static bool
+can_hash_blob_concurrently(const struct blob_descriptor *blob)
+{
+	if (blob_is_memory_staged(blob))
+		return true;
+	if (blob->blob_location != BLOB_IN_STAGING_FILE)
+		return false;
+	return !blob->staging_origin ||
+		can_read_partial_wim_blob_concurrently(
+					blob->staging_origin->blob);
+}
+
+static void
+hash_staged_blobs_task_run(struct pool_task *_task)
+{
+	struct hash_staged_blobs_task *task =
+		(struct hash_staged_blobs_task *)_task;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(task->next_blob, 1, __ATOMIC_RELAXED)) <
+	       task->num_blobs)
+	{
+		struct staged_blob *sb = &task->blobs[i];
+
+		if (sb->ret < 0 && can_hash_blob_concurrently(sb->blob))
+			sb->ret = sha1_blob(sb->blob);
+	}
+}
+
+/*
+ * Checksum the blobs of the streams which were written in the mounted image
+ * and move them to the blob table, before the image is committed.  Otherwise
+ * this would happen one blob at a time while the blobs are being written.  The
+ * staging files are read and checksummed by multiple threads.
+ *
+ * A stream which was opened for writing but never changed just gets the SHA-1
+ * message digest of its original blob.  The original blob is still in the blob
+ * table, since blobs in WIM files are retained even when unreferenced, so the
+ * stream is joined back with it and its data is neither read nor rewritten.
+ */
+static int
+hash_staged_blobs(struct wimfs_context *ctx)
+{
+	struct wim_image_metadata *imd = wim_get_current_image_metadata(ctx->wim);
+	struct hash_staged_blobs_task tasks[MAX_HASH_TASKS];
+	struct pool_task *task_ptrs[MAX_HASH_TASKS];
+	struct staged_blob *blobs;
+	struct blob_descriptor *blob;
+	size_t num_blobs = 0;
+	size_t next_blob = 0;
+	unsigned num_tasks;
+	int ret = 0;
+
+	image_for_each_unhashed_blob(blob, imd)
+		num_blobs++;
+	if (!num_blobs)
+		return 0;
+
+	blobs = MALLOC(num_blobs * sizeof(blobs[0]));
+	if (!blobs)
+		return WIMLIB_ERR_NOMEM;
+
+	num_blobs = 0;
+	image_for_each_unhashed_blob(blob, imd) {
+		struct staged_blob *sb = &blobs[num_blobs++];
+
+		sb->blob = blob;
+		sb->back_ptr = retrieve_pointer_to_unhashed_blob(blob);
+		sb->back_inode = blob->back_inode;
+		sb->ret = -1;
+		if (is_unmodified_staged_blob(blob)) {
+			copy_hash(blob->hash, blob->staging_origin->blob->hash);
+			sb->ret = 0;
+		}
+	}
+
+	num_tasks = min(min(num_blobs, task_pool_num_threads()),
+			MAX_HASH_TASKS);
+	if (num_tasks > 1) {
+		for (unsigned i = 0; i < num_tasks; i++) {
+			tasks[i].base.run = hash_staged_blobs_task_run;
+			tasks[i].blobs = blobs;
+			tasks[i].num_blobs = num_blobs;
+			tasks[i].next_blob = &next_blob;
+			task_ptrs[i] = &tasks[i].base;
+		}
+		task_pool_run_batch(task_ptrs, num_tasks);
+	}
+
+	/* Hash anything which couldn't be hashed concurrently, then add the
+	 * blobs to the blob table in their original order.  */
+	for (size_t i = 0; i < num_blobs; i++) {
+		struct staged_blob *sb = &blobs[i];
+		struct blob_descriptor *new_blob;
+
+		if (sb->ret < 0)
+			sb->ret = sha1_blob(sb->blob);
+		if (sb->ret) {
+			ret = sb->ret;
+			break;
+		}
+		new_blob = after_blob_hashed(sb->blob, sb->back_ptr,
+					     ctx->wim->blob_table,
+					     sb->back_inode);
+		if (new_blob != sb->blob)
+			free_blob_descriptor(sb->blob);
+	}
+	FREE(blobs);
+	return ret;
+}
+
 /* Close all file descriptors open to the specified inode.
  *
  * Note: closing the last file descriptor might free the inode.  */
@@ -1120,6 +1902,7 @@ static int
 commit_image(struct wimfs_context *ctx, int unmount_flags, mqd_t mq)
 {
 	int write_flags;
+	int ret;
 
 	if (unmount_flags & WIMLIB_UNMOUNT_FLAG_SEND_PROGRESS)
 		wimlib_register_progress_function(ctx->wim,
@@ -1128,12 +1911,16 @@ commit_image(struct wimfs_context *ctx, int unmount_flags, mqd_t mq)
 		wimlib_register_progress_function(ctx->wim, NULL, NULL);
 
 	if (unmount_flags & WIMLIB_UNMOUNT_FLAG_NEW_IMAGE) {
-		int ret = renew_current_image(ctx);
+		ret = renew_current_image(ctx);
 		if (ret)
 			return ret;
 	}
 	delete_empty_blobs(ctx);
 
+	ret = hash_staged_blobs(ctx);
+	if (ret)
+		return ret;
+
 	write_flags = 0;
 
 	if (unmount_flags & WIMLIB_UNMOUNT_FLAG_CHECK_INTEGRITY)
@@ -1183,6 +1970,7 @@ unmount_wimfs(void)
 		}
 	}
 
+	mutex_lock(&wimfs_ctx->fd_lock);
 	if (wimfs_ctx->num_open_fds) {
 
 		/* There are still open file descriptors to the image.  */
@@ -1193,6 +1981,7 @@ unmount_wimfs(void)
 				      WIMLIB_UNMOUNT_FLAG_FORCE))
 				 == WIMLIB_UNMOUNT_FLAG_COMMIT)
 		{
+			mutex_unlock(&wimfs_ctx->fd_lock);
 			ret = WIMLIB_ERR_MOUNTED_IMAGE_IS_BUSY;
 			goto out;
 		}
@@ -1200,6 +1989,7 @@ unmount_wimfs(void)
 		/* Force-close all file descriptors.  */
 		close_all_fds(wimfs_ctx);
 	}
+	mutex_unlock(&wimfs_ctx->fd_lock);
 
 	if (unmount_flags & WIMLIB_UNMOUNT_FLAG_COMMIT)
 		ret = commit_image(wimfs_ctx, unmount_flags, mq);
@@ -1220,9 +2010,117 @@ out:
 	return ret;
 }
 
+static void *
+readahead_thread_proc(void *_ctx)
+{
+	struct wimfs_context *ctx = _ctx;
+	struct readahead_request req;
+
+	mutex_lock(&ctx->readahead_lock);
+	for (;;) {
+		while (!ctx->readahead_count && !ctx->readahead_stop)
+			condvar_wait(&ctx->readahead_cond, &ctx->readahead_lock);
+		if (ctx->readahead_stop)
+			break;
+		req = ctx->readahead_queue[ctx->readahead_head];
+		ctx->readahead_head = (ctx->readahead_head + 1) %
+				      READAHEAD_QUEUE_LEN;
+		ctx->readahead_count--;
+		mutex_unlock(&ctx->readahead_lock);
+
+		/* Errors are ignored; the chunks will just be read again, and
+		 * the error reported, when they are actually needed.  */
+		prefetch_partial_wim_blob(req.blob, req.offset, req.size);
+
+		mutex_lock(&ctx->readahead_lock);
+	}
+	mutex_unlock(&ctx->readahead_lock);
+	return NULL;
+}
+
+/* Start the read-ahead thread of a read-only mount.  This must be done after
+ * FUSE has daemonized the process, since threads don't survive fork().  If the
+ * thread can't be started, the mount just works without read-ahead.  */
+static void
+start_read_ahead(struct wimfs_context *ctx)
+{
+	if (!ctx->wim->chunk_cache)
+		return;
+	ctx->readahead_running = thread_create(&ctx->readahead_thread,
+					       readahead_thread_proc, ctx);
+}
+
+static void
+stop_read_ahead(struct wimfs_context *ctx)
+{
+	if (!ctx->readahead_running)
+		return;
+	mutex_lock(&ctx->readahead_lock);
+	ctx->readahead_stop = true;
+	condvar_signal(&ctx->readahead_cond);
+	mutex_unlock(&ctx->readahead_lock);
+	thread_join(&ctx->readahead_thread);
+	ctx->readahead_running = false;
+}
+
+/*
+ * Note a read of @size bytes at @offset through the WIM file descriptor @fd,
+ * whose blob is located in the WIM file.  If the reads through @fd have been
+ * sequential, keep the read-ahead thread decompressing the data that comes
+ * next, so that streaming a file out of the mount with e.g. 'cp' doesn't wait on
+ * decompression in each read.  The read-ahead window is READAHEAD_SIZE or a
+ * chunk, whichever is larger, and is refilled once half of it has been read.
+ */
+static void
+maybe_read_ahead(struct wimfs_context *ctx, struct wimfs_fd *fd,
+		 u64 offset, size_t size)
+{
+	const struct blob_descriptor *blob = fd->f_blob;
+	const u64 end = offset + size;
+	const u64 window = max(READAHEAD_SIZE, blob->rdesc->chunk_size);
+	u64 ra_start, ra_end;
+
+	if (!ctx->readahead_running)
+		return;
+
+	mutex_lock(&ctx->fd_lock);
+	if (offset != fd->f_next_read_offset) {
+		/* Not sequential; forget about the previous read-ahead.  */
+		fd->f_next_read_offset = end;
+		fd->f_readahead_end = end;
+		mutex_unlock(&ctx->fd_lock);
+		return;
+	}
+	fd->f_next_read_offset = end;
+	ra_start = max(fd->f_readahead_end, end);
+	ra_end = min(end + window, blob->size);
+	if (fd->f_readahead_end >= end + window / 2 || ra_start >= ra_end) {
+		mutex_unlock(&ctx->fd_lock);
+		return;
+	}
+	fd->f_readahead_end = ra_end;
+	mutex_unlock(&ctx->fd_lock);
+
+	mutex_lock(&ctx->readahead_lock);
+	if (ctx->readahead_count < READAHEAD_QUEUE_LEN) {
+		ctx->readahead_queue[(ctx->readahead_head +
+				      ctx->readahead_count++) %
+				     READAHEAD_QUEUE_LEN] =
+			(struct readahead_request) {
+				.blob = blob,
+				.offset = ra_start,
+				.size = ra_end - ra_start,
+			};
+		condvar_signal(&ctx->readahead_cond);
+	}
+	mutex_unlock(&ctx->readahead_lock);
+}
+
 static void *
 wimfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
+	struct wimfs_context *ctx = wimfs_get_context();
+
 	/*
 	 * Cache positive name lookups indefinitely, since names can only be
 	 * added, removed, or modified through the mounted filesystem itself.
@@ -1275,7 +2173,10 @@ wimfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 	 */
 	cfg->nullpath_ok = 1;
 
-	return wimfs_get_context();
+	if (!(ctx->mount_flags & WIMLIB_MOUNT_FLAG_READWRITE))
+		start_read_ahead(ctx);
+
+	return ctx;
 }
 
 static int
@@ -1291,7 +2192,7 @@ wimfs_chmod(const char *path, mode_t mask, struct fuse_file_info *fi)
 	if (fi) {
 		inode = WIMFS_FD(fi)->f_inode;
 	} else {
-		inode = wim_pathname_to_inode(ctx->wim, path);
+		inode = wim_pathname_to_inode(ctx, path);
 		if (!inode)
 			return -errno;
 	}
@@ -1320,7 +2221,7 @@ wimfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
 	if (fi) {
 		inode = WIMFS_FD(fi)->f_inode;
 	} else {
-		inode = wim_pathname_to_inode(ctx->wim, path);
+		inode = wim_pathname_to_inode(ctx, path);
 		if (!inode)
 			return -errno;
 	}
@@ -1392,7 +2293,7 @@ static int
 wimfs_getxattr(const char *path, const char *name, char *value,
 	       size_t size)
 {
-	const struct wimfs_context *ctx = wimfs_get_context();
+	struct wimfs_context *ctx = wimfs_get_context();
 	const struct wim_inode *inode;
 	const struct wim_inode_stream *strm;
 	const struct blob_descriptor *blob;
@@ -1449,7 +2350,7 @@ wimfs_getxattr(const char *path, const char *name, char *value,
 
 	/* Querying a named data stream  */
 
-	inode = wim_pathname_to_inode(ctx->wim, path);
+	inode = wim_pathname_to_inode(ctx, path);
 	if (!inode)
 		return -errno;
 
@@ -1465,11 +2366,18 @@ wimfs_getxattr(const char *path, const char *name, char *value,
 		return -EFBIG;
 
 	if (size) {
+		int ret;
+
 		if (size < blob->size)
 			return -ERANGE;
 
-		if (read_blob_into_buf(blob, value))
-			return errno ? -errno : -EIO;
+		mutex_lock(&ctx->serial_read_lock);
+		ret = read_blob_into_buf(blob, value);
+		if (ret)
+			ret = errno ? -errno : -EIO;
+		mutex_unlock(&ctx->serial_read_lock);
+		if (ret)
+			return ret;
 	}
 	return blob->size;
 }
@@ -1477,13 +2385,13 @@ wimfs_getxattr(const char *path, const char *name, char *value,
 static int
 wimfs_link(const char *existing_path, const char *new_path)
 {
-	WIMStruct *wim = wimfs_get_WIMStruct();
+	const struct wimfs_context *ctx = wimfs_get_context();
 	const char *new_name;
 	struct wim_inode *inode;
 	struct wim_dentry *dir;
 	struct wim_dentry *new_alias;
 
-	inode = wim_pathname_to_inode(wim, existing_path);
+	inode = wim_pathname_to_inode(ctx, existing_path);
 	if (!inode)
 		return -errno;
 
@@ -1493,7 +2401,7 @@ wimfs_link(const char *existing_path, const char *new_path)
 
 	new_name = path_basename(new_path);
 
-	dir = get_parent_dentry(wim, new_path, WIMLIB_CASE_SENSITIVE);
+	dir = wimfs_get_parent_dentry(ctx, new_path);
 	if (!dir)
 		return -errno;
 
@@ -1525,7 +2433,7 @@ wimfs_listxattr(const char *path, char *list, size_t size)
 	/* List named data streams, or get the list size.  We report each named
 	 * data stream "X" as an extended attribute "user.X".  */
 
-	inode = wim_pathname_to_inode(ctx->wim, path);
+	inode = wim_pathname_to_inode(ctx, path);
 	if (!inode)
 		return -errno;
 
@@ -1603,7 +2511,7 @@ wimfs_mknod(const char *path, mode_t mode, dev_t rdev)
 		p = (char *)stream_name - 1;
 
 		*p = '\0';
-		inode = wim_pathname_to_inode(wimfs_ctx->wim, path);
+		inode = wim_pathname_to_inode(wimfs_ctx, path);
 		*p = ':';
 		if (!inode)
 			return -errno;
@@ -1668,8 +2576,7 @@ wimfs_open(const char *path, struct fuse_file_info *fi)
 	 * extract the data to the staging directory if we are opening it
 	 * writable.  */
 
-	if (flags_writable(fi->flags) &&
-            (!blob || blob->blob_location != BLOB_IN_STAGING_FILE)) {
+	if (flags_writable(fi->flags) && !blob_is_staged(blob)) {
 		ret = extract_blob_to_staging_dir(inode,
 						  strm,
 						  blob_size(blob),
@@ -1679,7 +2586,9 @@ wimfs_open(const char *path, struct fuse_file_info *fi)
 		blob = stream_blob_resolved(strm);
 	}
 
+	mutex_lock(&ctx->fd_lock);
 	ret = alloc_wimfs_fd(inode, strm, &fd);
+	mutex_unlock(&ctx->fd_lock);
 	if (ret)
 		return ret;
 
@@ -1690,14 +2599,26 @@ wimfs_open(const char *path, struct fuse_file_info *fi)
 				(fi->flags & (O_ACCMODE | O_TRUNC)) |
 				O_NOFOLLOW);
 		if (raw_fd < 0) {
+			ret = -errno;
+			mutex_lock(&ctx->fd_lock);
 			close_wimfs_fd(fd);
-			return -errno;
+			mutex_unlock(&ctx->fd_lock);
+			return ret;
 		}
 		filedes_init(&fd->f_staging_fd, raw_fd);
 		if (fi->flags & O_TRUNC) {
 			blob->size = 0;
 			file_contents_changed(inode);
 		}
+	} else if (blob && blob_is_memory_staged(blob) &&
+		   (fi->flags & O_TRUNC)) {
+		ret = resize_memory_staged_blob(inode, blob, 0, ctx);
+		if (ret) {
+			mutex_lock(&ctx->fd_lock);
+			close_wimfs_fd(fd);
+			mutex_unlock(&ctx->fd_lock);
+			return ret;
+		}
 	}
 	fi->fh = (uintptr_t)fd;
 	return 0;
@@ -1706,21 +2627,28 @@ wimfs_open(const char *path, struct fuse_file_info *fi)
 static int
 wimfs_opendir(const char *path, struct fuse_file_info *fi)
 {
-	WIMStruct *wim = wimfs_get_WIMStruct();
+	struct wimfs_context *ctx = wimfs_get_context();
+	struct wim_dentry *dentry;
 	struct wim_inode *inode;
 	struct wim_inode_stream *strm;
 	struct wimfs_fd *fd;
 	int ret;
 
-	inode = wim_pathname_to_inode(wim, path);
-	if (!inode)
+	dentry = wimfs_get_dentry(ctx, path);
+	if (!dentry)
 		return -errno;
+	inode = dentry->d_inode;
 	if (!inode_is_directory(inode))
 		return -ENOTDIR;
+	ret = wimfs_read_subdir(ctx, dentry);
+	if (ret)
+		return ret;
 	strm = inode_get_unnamed_data_stream(inode);
 	if (!strm)
 		return -ENOTDIR;
+	mutex_lock(&ctx->fd_lock);
 	ret = alloc_wimfs_fd(inode, strm, &fd);
+	mutex_unlock(&ctx->fd_lock);
 	if (ret)
 		return ret;
 	fi->fh = (uintptr_t)fd;
@@ -1749,13 +2677,31 @@ wimfs_read(const char *path, char *buf, size_t size,
 		return 0;
 
 	switch (blob->blob_location) {
-	case BLOB_IN_WIM:
+	case BLOB_IN_WIM: {
+		struct wimfs_context *ctx = wimfs_get_context();
+		bool serial = !can_read_partial_wim_blob_concurrently(blob);
+
+		if (serial)
+			mutex_lock(&ctx->serial_read_lock);
 		if (read_partial_wim_blob_into_buf(blob, offset, size, buf))
 			ret = errno ? -errno : -EIO;
 		else
 			ret = size;
+		if (serial)
+			mutex_unlock(&ctx->serial_read_lock);
+		else if (ret > 0)
+			maybe_read_ahead(ctx, fd, offset, size);
 		break;
+	}
 	case BLOB_IN_STAGING_FILE:
+		if (blob->staging_origin) {
+			if (read_partial_staging_blob(blob, &fd->f_staging_fd,
+						      offset, size, buf))
+				ret = errno ? -errno : -EIO;
+			else
+				ret = size;
+			break;
+		}
 		ret = pread(fd->f_staging_fd.fd, buf, size, offset);
 		if (ret < 0)
 			ret = -errno;
@@ -1771,6 +2717,109 @@ wimfs_read(const char *path, char *buf, size_t size,
 	return ret;
 }
 
+/* Return true if the extents of a lazily staged blob which contain the @size
+ * bytes at @offset have all been filled in the staging file.  */
+static bool
+staging_range_filled(const struct staging_origin *origin, u64 offset,
+		     size_t size)
+{
+	const u64 end = min(offset + size, origin->size);
+
+	for (u64 pos = offset; pos < end;
+	     pos = (pos / STAGING_EXTENT_SIZE + 1) * STAGING_EXTENT_SIZE)
+		if (!staging_extent_filled(origin, pos / STAGING_EXTENT_SIZE))
+			return false;
+	return true;
+}
+
+/*
+ * If the @size bytes at @offset of the data of @fd's blob are stored as is in
+ * a file, return a file descriptor to that file and set *pos_ret to their
+ * position in it.  This is the case for blobs in uncompressed WIM resources and
+ * for blobs in staging files.  Otherwise return -1.
+ */
+static int
+get_blob_data_fd(const struct wimfs_fd *fd, u64 offset, size_t size,
+		 u64 *pos_ret)
+{
+	const struct blob_descriptor *blob = fd->f_blob;
+	const struct wim_resource_descriptor *rdesc;
+
+	switch (blob->blob_location) {
+	case BLOB_IN_WIM:
+		rdesc = blob->rdesc;
+		if ((rdesc->flags & (WIM_RESHDR_FLAG_COMPRESSED |
+				     WIM_RESHDR_FLAG_SOLID)) ||
+		    rdesc->wim->in_fd.unbuffered)
+			return -1;
+		*pos_ret = rdesc->offset_in_wim + blob->offset_in_res + offset;
+		return rdesc->wim->in_fd.fd;
+	case BLOB_IN_STAGING_FILE:
+		if (blob->staging_origin &&
+		    !staging_range_filled(blob->staging_origin, offset, size))
+			return -1;
+		*pos_ret = offset;
+		return fd->f_staging_fd.fd;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Like wimfs_read(), but if the data is stored as is in a file, return a buffer
+ * which just refers to the file, so that libfuse can splice the data from it
+ * straight to the kernel rather than copying it through memory twice.
+ *
+ * libfuse frees the buffer vector, and the memory buffer in it if there is one,
+ * with free(), so they are allocated with malloc() rather than MALLOC().
+ */
+static int
+wimfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+	       off_t offset, struct fuse_file_info *fi)
+{
+	struct wimfs_fd *fd = WIMFS_FD(fi);
+	const struct blob_descriptor *blob = fd->f_blob;
+	struct fuse_bufvec *bv;
+	u64 pos;
+	int file;
+	int ret;
+
+	bv = malloc(sizeof(*bv));
+	if (!bv)
+		return -ENOMEM;
+	*bv = FUSE_BUFVEC_INIT(0);
+
+	if (!blob || offset >= blob->size || !size)
+		goto out;
+	if (size > blob->size - offset)
+		size = blob->size - offset;
+
+	file = get_blob_data_fd(fd, offset, size, &pos);
+	if (file >= 0) {
+		bv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK |
+				   FUSE_BUF_FD_RETRY;
+		bv->buf[0].fd = file;
+		bv->buf[0].pos = pos;
+		bv->buf[0].size = size;
+	} else {
+		bv->buf[0].mem = malloc(size);
+		if (!bv->buf[0].mem) {
+			free(bv);
+			return -ENOMEM;
+		}
+		ret = wimfs_read(path, bv->buf[0].mem, size, offset, fi);
+		if (ret < 0) {
+			free(bv->buf[0].mem);
+			free(bv);
+			return ret;
+		}
+		bv->buf[0].size = ret;
+	}
+out:
+	*bufp = bv;
+	return 0;
+}
+
 static int
 wimfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	      off_t offset, struct fuse_file_info *fi,
@@ -1813,14 +2862,16 @@ wimfs_readlink(const char *path, char *buf, size_t bufsize)
 	const struct wim_inode *inode;
 	int ret;
 
-	inode = wim_pathname_to_inode(ctx->wim, path);
+	inode = wim_pathname_to_inode(ctx, path);
 	if (!inode)
 		return -errno;
 	if (bufsize <= 0)
 		return -EINVAL;
+	mutex_lock(&ctx->serial_read_lock);
 	ret = wim_inode_readlink(inode, buf, bufsize - 1, NULL,
 				 ctx->mountpoint_abspath,
 				 ctx->mountpoint_abspath_nchars);
+	mutex_unlock(&ctx->serial_read_lock);
 	if (ret < 0)
 		return ret;
 	buf[ret] = '\0';
@@ -1832,7 +2883,13 @@ wimfs_readlink(const char *path, char *buf, size_t bufsize)
 static int
 wimfs_release(const char *path, struct fuse_file_info *fi)
 {
-	return close_wimfs_fd(WIMFS_FD(fi));
+	struct wimfs_context *ctx = wimfs_get_context();
+	int ret;
+
+	mutex_lock(&ctx->fd_lock);
+	ret = close_wimfs_fd(WIMFS_FD(fi));
+	mutex_unlock(&ctx->fd_lock);
+	return ret;
 }
 
 static int
@@ -1854,7 +2911,7 @@ wimfs_removexattr(const char *path, const char *name)
 
 	/* Removing a named data stream.  */
 
-	inode = wim_pathname_to_inode(ctx->wim, path);
+	inode = wim_pathname_to_inode(ctx, path);
 	if (!inode)
 		return -errno;
 
@@ -1871,6 +2928,7 @@ wimfs_rename(const char *from, const char *to, unsigned int flags)
 {
 	if (flags & RENAME_EXCHANGE)
 		return -EINVAL;
+	invalidate_lookup_cache(wimfs_get_context());
 	return rename_wim_path(wimfs_get_WIMStruct(), from, to,
 			       WIMLIB_CASE_SENSITIVE,
 			       (flags & RENAME_NOREPLACE), NULL);
@@ -1879,10 +2937,10 @@ wimfs_rename(const char *from, const char *to, unsigned int flags)
 static int
 wimfs_rmdir(const char *path)
 {
-	WIMStruct *wim = wimfs_get_WIMStruct();
+	const struct wimfs_context *ctx = wimfs_get_context();
 	struct wim_dentry *dentry;
 
-	dentry = get_dentry(wim, path, WIMLIB_CASE_SENSITIVE);
+	dentry = wimfs_get_dentry(ctx, path);
 	if (!dentry)
 		return -errno;
 
@@ -1893,7 +2951,7 @@ wimfs_rmdir(const char *path)
 		return -ENOTEMPTY;
 
 	touch_parent(dentry);
-	remove_dentry(dentry, wim->blob_table);
+	remove_dentry(ctx, dentry);
 	return 0;
 }
 
@@ -1937,7 +2995,7 @@ wimfs_setxattr(const char *path, const char *name,
 
 	/* Setting the contents of a named data stream.  */
 
-	inode = wim_pathname_to_inode(ctx->wim, path);
+	inode = wim_pathname_to_inode(ctx, path);
 	if (!inode)
 		return -errno;
 
@@ -1992,7 +3050,7 @@ wimfs_symlink(const char *to, const char *from)
 	ret = wim_inode_set_symlink(dentry->d_inode, to,
 				    wimfs_ctx->wim->blob_table);
 	if (ret) {
-		remove_dentry(dentry, wimfs_ctx->wim->blob_table);
+		remove_dentry(wimfs_ctx, dentry);
 		if (ret == WIMLIB_ERR_NOMEM)
 			ret = -ENOMEM;
 		else
@@ -2011,13 +3069,18 @@ do_truncate(int staging_fd, off_t size,
 		return -errno;
 	file_contents_changed(inode);
 	blob->size = size;
+	if (blob->staging_origin) {
+		blob->staging_origin->modified = true;
+		if (size < blob->staging_origin->size)
+			blob->staging_origin->size = size;
+	}
 	return 0;
 }
 
 static int
 wimfs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
 {
-	const struct wimfs_context *ctx = wimfs_get_context();
+	struct wimfs_context *ctx = wimfs_get_context();
 	struct wim_dentry *dentry;
 	struct wim_inode_stream *strm;
 	struct blob_descriptor *blob;
@@ -2027,6 +3090,9 @@ wimfs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
 	if (fi) {
 		struct wimfs_fd *fd = WIMFS_FD(fi);
 
+		if (blob_is_memory_staged(fd->f_blob))
+			return resize_memory_staged_blob(fd->f_inode,
+							 fd->f_blob, size, ctx);
 		return do_truncate(fd->f_staging_fd.fd, size, fd->f_inode,
 				   fd->f_blob);
 	}
@@ -2040,6 +3106,10 @@ wimfs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
 	if (!blob && !size)
 		return 0;
 
+	if (blob && blob_is_memory_staged(blob))
+		return resize_memory_staged_blob(dentry->d_inode, blob, size,
+						 ctx);
+
 	if (!blob || blob->blob_location != BLOB_IN_STAGING_FILE) {
 		return extract_blob_to_staging_dir(dentry->d_inode,
 						   strm, size, ctx);
@@ -2073,7 +3143,7 @@ wimfs_unlink(const char *path)
 				    ctx->wim->blob_table);
 	} else {
 		touch_parent(dentry);
-		remove_dentry(dentry, ctx->wim->blob_table);
+		remove_dentry(ctx, dentry);
 	}
 	return 0;
 }
@@ -2092,7 +3162,7 @@ wimfs_utimens(const char *path, const struct timespec tv[2],
 	if (fi) {
 		inode = WIMFS_FD(fi)->f_inode;
 	} else {
-		inode = wim_pathname_to_inode(wimfs_get_WIMStruct(), path);
+		inode = wim_pathname_to_inode(wimfs_get_context(), path);
 		if (!inode)
 			return -errno;
 	}
@@ -2117,12 +3187,41 @@ wimfs_write(const char *path, const char *buf, size_t size,
 	    off_t offset, struct fuse_file_info *fi)
 {
 	struct wimfs_fd *fd = WIMFS_FD(fi);
+	struct blob_descriptor *blob = fd->f_blob;
+	struct staging_origin *origin;
 	ssize_t ret;
 
+	if (blob_is_memory_staged(blob)) {
+		if (offset + size > blob->size) {
+			ret = resize_memory_staged_blob(fd->f_inode, blob,
+							offset + size,
+							wimfs_get_context());
+			if (ret)
+				return ret;
+		}
+		/* The blob may have been moved to a staging file.  */
+		if (blob_is_memory_staged(blob)) {
+			memcpy((u8 *)blob->attached_buffer + offset, buf, size);
+			file_contents_changed(fd->f_inode);
+			return size;
+		}
+	}
+
+	origin = blob->staging_origin;
+	if (origin && size) {
+		ret = staging_write(fd, offset, offset + size, false);
+		if (ret)
+			return ret;
+		origin->modified = true;
+	}
+
 	ret = pwrite(fd->f_staging_fd.fd, buf, size, offset);
 	if (ret < 0)
 		return -errno;
 
+	if (origin)
+		staging_write(fd, offset, offset + ret, true);
+
 	if (offset + size > fd->f_blob->size)
 		fd->f_blob->size = offset + size;
 
@@ -2143,6 +3242,7 @@ static const struct fuse_operations wimfs_operations = {
 	.open        = wimfs_open,
 	.opendir     = wimfs_opendir,
 	.read        = wimfs_read,
+	.read_buf    = wimfs_read_buf,
 	.readdir     = wimfs_readdir,
 	.readlink    = wimfs_readlink,
 	.release     = wimfs_release,
@@ -2169,6 +3269,7 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 	struct wimfs_context ctx;
 	char *fuse_argv[16];
 	int fuse_argc;
+	void *metadata_buf = NULL;
 
 	if (!wim || !dir || !*dir)
 		return WIMLIB_ERR_INVALID_PARAM;
@@ -2191,8 +3292,12 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 			return ret;
 	}
 
-	/* Select the image to mount.  */
-	ret = select_wim_image(wim, image);
+	/* Select the image to mount.  Unless it is already loaded, a read-only
+	 * mount only loads the image lazily; see 'struct lazy_tree'.  */
+	if (mount_flags & WIMLIB_MOUNT_FLAG_READWRITE)
+		ret = select_wim_image(wim, image);
+	else
+		ret = select_wim_image_lazily(wim, image, &metadata_buf);
 	if (ret)
 		return ret;
 
@@ -2233,6 +3338,29 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 	if (mount_flags & WIMLIB_MOUNT_FLAG_STREAM_INTERFACE_WINDOWS)
 		ctx.default_lookup_flags = LOOKUP_FLAG_ADS_OK;
 
+	/* Lookups work without the cache, just more slowly.  */
+	ctx.lookup_cache = new_lookup_cache();
+
+	ret = WIMLIB_ERR_NOMEM;
+	if (!mutex_init(&ctx.fd_lock))
+		goto out;
+	if (!mutex_init(&ctx.serial_read_lock))
+		goto out_destroy_fd_lock;
+	if (!mutex_init(&ctx.readahead_lock))
+		goto out_destroy_serial_read_lock;
+	if (!condvar_init(&ctx.readahead_cond))
+		goto out_destroy_readahead_lock;
+	ctx.locks_initialized = true;
+
+	/* Files in the mounted image are read in small pieces in no particular
+	 * order, so keep recently decompressed chunks in memory, as much as the
+	 * memory budget allows.  */
+	ret = new_chunk_cache(min(DEFAULT_CHUNK_CACHE_SIZE,
+				  get_available_memory() / 4),
+			      &wim->chunk_cache);
+	if (ret)
+		goto out;
+
 	/* For read-write mounts, create the staging directory, save a reference
 	 * to the image's metadata resource, and mark the image dirty.  */
 	if (mount_flags & WIMLIB_MOUNT_FLAG_READWRITE) {
@@ -2250,11 +3378,22 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 	ctx.owner_gid = getgid();
 
 	/* Number the inodes in the mounted image sequentially and initialize
-	 * the file descriptor arrays  */
+	 * the file descriptor arrays.  If the image is loaded lazily, this
+	 * is just the root directory; the other inodes are prepared as they
+	 * are read.  */
 	prepare_inodes(&ctx);
 
+	if (metadata_buf) {
+		ret = WIMLIB_ERR_NOMEM;
+		ctx.lazy_tree = new_lazy_tree(metadata_buf,
+					      imd->metadata_blob->size,
+					      ctx.next_ino);
+		if (!ctx.lazy_tree)
+			goto out;
+	}
+
 	/* Save the absolute path to the mountpoint directory.  */
-	ctx.mountpoint_abspath = realpath(dir, NULL);
+	ctx.mountpoint_abspath = wimlib_realpath(dir);
 	if (ctx.mountpoint_abspath)
 		ctx.mountpoint_abspath_nchars = strlen(ctx.mountpoint_abspath);
 
@@ -2264,8 +3403,11 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 	fuse_argv[fuse_argc++] = "wimlib";
 	fuse_argv[fuse_argc++] = (char *)dir;
 
-	/* Disable multi-threaded operation.  */
-	fuse_argv[fuse_argc++] = "-s";
+	/* Disable multi-threaded operation for read-write mounts.  Read-only
+	 * mounts are multi-threaded, so that concurrent reads of files can be
+	 * served in parallel; see 'struct wimfs_context'.  */
+	if (mount_flags & WIMLIB_MOUNT_FLAG_READWRITE)
+		fuse_argv[fuse_argc++] = "-s";
 
 	/* Enable FUSE debug mode (don't fork) if requested by the user.  */
 	if (mount_flags & WIMLIB_MOUNT_FLAG_DEBUG)
@@ -2297,13 +3439,37 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 	/* Cleanup and return.  */
 	if (ret)
 		ret = WIMLIB_ERR_FUSE;
+	stop_read_ahead(&ctx);
 out:
+	free_chunk_cache(wim->chunk_cache);
+	wim->chunk_cache = NULL;
+	if (ctx.locks_initialized) {
+		condvar_destroy(&ctx.readahead_cond);
+		mutex_destroy(&ctx.readahead_lock);
+		mutex_destroy(&ctx.serial_read_lock);
+		mutex_destroy(&ctx.fd_lock);
+	}
+	free_lookup_cache(ctx.lookup_cache);
+	free_lazy_tree(ctx.lazy_tree);
+	if (metadata_buf) {
+		/* A lazily loaded image must not stay selected.  */
+		deselect_current_wim_image(wim);
+		FREE(metadata_buf);
+	}
 	FREE(ctx.mountpoint_abspath);
 	free_blob_descriptor(ctx.metadata_resource);
 	if (ctx.staging_dir_name)
 		delete_staging_dir(&ctx);
 	unlock_wim_for_append(wim);
 	return ret;
+
+out_destroy_readahead_lock:
+	mutex_destroy(&ctx.readahead_lock);
+out_destroy_serial_read_lock:
+	mutex_destroy(&ctx.serial_read_lock);
+out_destroy_fd_lock:
+	mutex_destroy(&ctx.fd_lock);
+	goto out;
 }
 
 struct commit_progress_thread_args {
@@ -92,12 +92,35 @@ struct ntfs_3g_apply_ctx {
 	/* Whether is_sparse_attr[] is true for any currently open attribute  */
 	bool any_sparse_attrs;
 
+	/* Data of the current blob which hasn't been written to the open
+	 * attributes yet: 'write_buf_len' bytes starting at offset
+	 * 'write_buf_offset' in the blob.  Writes are batched to
+	 * 'write_buf_size' bytes, a multiple of the cluster size, because each
+	 * call to ntfs_attr_pwrite() has to look up and possibly extend the
+	 * attribute's runlist, which is expensive compared to copying the
+	 * small chunks that are decompressed from most WIM resources.  */
+	u8 *write_buf;
+	size_t write_buf_size;
+	size_t write_buf_len;
+	u64 write_buf_offset;
+
 	struct reparse_buffer_disk rpbuf;
 	u8 *reparse_ptr;
 
 	unsigned num_reparse_inodes;
 	ntfs_inode *ntfs_reparse_inodes[MAX_OPEN_FILES];
 	struct wim_inode *wim_reparse_inodes[MAX_OPEN_FILES];
+
+	/* For each security descriptor in the image's security data, the NTFS
+	 * security ID under which it is stored in the volume's $Secure index,
+	 * or 0 if not known yet.  Images typically have only a few thousand
+	 * unique security descriptors, so once a descriptor has been set on one
+	 * inode, later inodes using it are created with its security ID
+	 * directly.  This avoids ntfs_set_ntfs_acl() validating and hashing the
+	 * descriptor, looking it up in $Secure, and replacing the default
+	 * security descriptor of each new inode.  NULL if security descriptors
+	 * aren't being set, or if the volume is older than NTFS v3.0.  */
+	le32 *security_ids;
 };
 
 static int
@@ -297,11 +320,22 @@ ntfs_3g_create_empty_attributes(ntfs_inode *ni,
 	return 0;
 }
 
+/* Return the NTFS security ID with which to create the NTFS inode for @inode,
+ * or 0 if its security descriptor (if any) has to be set explicitly.  */
+static le32
+ntfs_3g_known_security_id(const struct wim_inode *inode,
+			  const struct ntfs_3g_apply_ctx *ctx)
+{
+	if (!ctx->security_ids || !inode_has_security_descriptor(inode))
+		return 0;
+	return ctx->security_ids[inode->i_security_id];
+}
+
 /* Set attributes, security descriptor, and timestamps on the NTFS inode @ni.
  */
 static int
 ntfs_3g_set_metadata(ntfs_inode *ni, const struct wim_inode *inode,
-		     const struct ntfs_3g_apply_ctx *ctx)
+		     struct ntfs_3g_apply_ctx *ctx)
 {
 	int extract_flags;
 	const struct wim_security_data *sd;
@@ -347,7 +381,9 @@ ntfs_3g_set_metadata(ntfs_inode *ni, const struct wim_inode *inode,
 
 	/* Security descriptor  */
 	if (inode_has_security_descriptor(inode)
-	    && !(extract_flags & WIMLIB_EXTRACT_FLAG_NO_ACLS))
+	    && !(extract_flags & WIMLIB_EXTRACT_FLAG_NO_ACLS)
+	    && (ni->security_id == 0 ||
+		ni->security_id != ntfs_3g_known_security_id(inode, ctx)))
 	{
 		struct SECURITY_CONTEXT sec_ctx = { ctx->vol };
 		const void *desc;
@@ -377,6 +413,9 @@ ntfs_3g_set_metadata(ntfs_inode *ni, const struct wim_inode *inode,
 			}
 			return WIMLIB_ERR_SET_SECURITY;
 		}
+		if (ctx->security_ids)
+			ctx->security_ids[inode->i_security_id] =
+				ni->security_id;
 	}
 
 	/* Timestamps  */
@@ -407,7 +446,9 @@ ntfs_3g_create_dirs_recursive(ntfs_inode *dir_ni, struct wim_dentry *dir,
 		if (!will_extract_dentry(child))
 			continue;
 
-		ni = ntfs_create(dir_ni, 0, child->d_extraction_name,
+		ni = ntfs_create(dir_ni,
+				 ntfs_3g_known_security_id(child->d_inode, ctx),
+				 child->d_extraction_name,
 				 child->d_extraction_name_nchars, S_IFDIR);
 		if (!ni) {
 			ERROR_WITH_ERRNO("Error creating \"%s\" in NTFS volume",
@@ -527,18 +568,29 @@ ntfs_3g_first_extraction_alias(struct wim_inode *inode)
  * Add a hard link for the NTFS inode @ni at the location corresponding to the
  * WIM dentry @dentry.
  *
- * The parent directory must have already been created on the NTFS volume.
+ * The parent directory must have already been created on the NTFS volume.  If
+ * it is @open_dir_ni, then that inode is used; otherwise it is opened
+ * temporarily.
  *
  * Returns 0 on success; returns WIMLIB_ERR_NTFS_3G and sets errno on failure.
  */
 static int
-ntfs_3g_add_link(ntfs_inode *ni, struct wim_dentry *dentry)
+ntfs_3g_add_link(ntfs_inode *ni, struct wim_dentry *dentry,
+		 ntfs_inode *open_dir_ni)
 {
+	u64 dir_mft_no = dentry->d_parent->d_inode->i_mft_no;
 	ntfs_inode *dir_ni;
 	int res;
 
+	if (open_dir_ni && open_dir_ni->mft_no == dir_mft_no) {
+		if (ntfs_link(ni, open_dir_ni, dentry->d_extraction_name,
+			      dentry->d_extraction_name_nchars))
+			goto fail;
+		return 0;
+	}
+
 	/* Open the inode of the parent directory.  */
-	dir_ni = ntfs_inode_open(ni->vol, dentry->d_parent->d_inode->i_mft_no);
+	dir_ni = ntfs_inode_open(ni->vol, dir_mft_no);
 	if (!dir_ni)
 		goto fail;
 
@@ -558,12 +610,61 @@ fail:
 	return WIMLIB_ERR_NTFS_3G;
 }
 
+/* Close the directory *@dir_ni_p, if any, which was kept open for creating
+ * nondirectory files in it.  */
+static int
+ntfs_3g_close_cur_dir(ntfs_inode **dir_ni_p)
+{
+	ntfs_inode *dir_ni = *dir_ni_p;
+
+	*dir_ni_p = NULL;
+	if (dir_ni && ntfs_inode_close(dir_ni)) {
+		ERROR_WITH_ERRNO("Failed to close directory in NTFS volume");
+		return WIMLIB_ERR_NTFS_3G;
+	}
+	return 0;
+}
+
+/*
+ * Make *@dir_ni_p the open parent directory of @dentry.  Files in the same
+ * directory are usually created one after another, so the directory is kept
+ * open until a file in a different directory is created.  This avoids opening
+ * the directory and writing its MFT record back for every file.
+ */
+static int
+ntfs_3g_open_parent_dir(struct wim_dentry *dentry, ntfs_inode **dir_ni_p,
+			struct ntfs_3g_apply_ctx *ctx)
+{
+	u64 dir_mft_no = dentry->d_parent->d_inode->i_mft_no;
+	int ret;
+
+	if (*dir_ni_p && (*dir_ni_p)->mft_no == dir_mft_no)
+		return 0;
+
+	ret = ntfs_3g_close_cur_dir(dir_ni_p);
+	if (ret)
+		return ret;
+
+	*dir_ni_p = ntfs_inode_open(ctx->vol, dir_mft_no);
+	if (!*dir_ni_p) {
+		ERROR_WITH_ERRNO("Can't open \"%s\" in NTFS volume",
+				 dentry_full_path(dentry->d_parent));
+		return WIMLIB_ERR_NTFS_3G;
+	}
+	return 0;
+}
+
+/*
+ * Create the nondirectory file @inode in the NTFS volume.  *@dir_ni_p is the
+ * open directory in which the previous file was created, or NULL; it is
+ * updated to the open directory in which this file was created, or NULL if
+ * none is open anymore.
+ */
 static int
-ntfs_3g_create_nondirectory(struct wim_inode *inode,
+ntfs_3g_create_nondirectory(struct wim_inode *inode, ntfs_inode **dir_ni_p,
 			    struct ntfs_3g_apply_ctx *ctx)
 {
 	struct wim_dentry *first_dentry;
-	ntfs_inode *dir_ni;
 	ntfs_inode *ni;
 	struct wim_dentry *dentry;
 	int ret;
@@ -572,20 +673,17 @@ ntfs_3g_create_nondirectory(struct wim_inode *inode,
 
 	/* Create first link.  */
 
-	dir_ni = ntfs_inode_open(ctx->vol, first_dentry->d_parent->d_inode->i_mft_no);
-	if (!dir_ni) {
-		ERROR_WITH_ERRNO("Can't open \"%s\" in NTFS volume",
-				 dentry_full_path(first_dentry->d_parent));
-		return WIMLIB_ERR_NTFS_3G;
-	}
+	ret = ntfs_3g_open_parent_dir(first_dentry, dir_ni_p, ctx);
+	if (ret)
+		return ret;
 
-	ni = ntfs_create(dir_ni, 0, first_dentry->d_extraction_name,
+	ni = ntfs_create(*dir_ni_p, ntfs_3g_known_security_id(inode, ctx),
+			 first_dentry->d_extraction_name,
 			 first_dentry->d_extraction_name_nchars, S_IFREG);
 
 	if (!ni) {
 		ERROR_WITH_ERRNO("Can't create \"%s\" in NTFS volume",
 				 dentry_full_path(first_dentry));
-		ntfs_inode_close(dir_ni);
 		return WIMLIB_ERR_NTFS_3G;
 	}
 
@@ -594,9 +692,11 @@ ntfs_3g_create_nondirectory(struct wim_inode *inode,
 	/* Set short name if present.  */
 	if (dentry_has_short_name(first_dentry)) {
 
-		ret = ntfs_3g_restore_dos_name(ni, dir_ni, first_dentry, ctx->vol);
+		ret = ntfs_3g_restore_dos_name(ni, *dir_ni_p, first_dentry,
+					       ctx->vol);
 
 		/* ntfs_3g_restore_dos_name() closed both 'ni' and 'dir_ni'.  */
+		*dir_ni_p = NULL;
 
 		if (ret)
 			return ret;
@@ -609,20 +709,12 @@ ntfs_3g_create_nondirectory(struct wim_inode *inode,
 					 dentry_full_path(first_dentry));
 			return WIMLIB_ERR_NTFS_3G;
 		}
-	} else {
-		/* Close the directory in which the first link was created.  */
-		if (ntfs_inode_close(dir_ni)) {
-			ERROR_WITH_ERRNO("Failed to close \"%s\" in NTFS volume",
-					 dentry_full_path(first_dentry->d_parent));
-			ret = WIMLIB_ERR_NTFS_3G;
-			goto out_close_ni;
-		}
 	}
 
 	/* Create additional links if present.  */
 	inode_for_each_extraction_alias(dentry, inode) {
 		if (dentry != first_dentry) {
-			ret = ntfs_3g_add_link(ni, dentry);
+			ret = ntfs_3g_add_link(ni, dentry, *dir_ni_p);
 			if (ret)
 				goto out_close_ni;
 		}
@@ -636,8 +728,11 @@ ntfs_3g_create_nondirectory(struct wim_inode *inode,
 	ret = ntfs_3g_create_empty_attributes(ni, inode, ctx);
 
 out_close_ni:
-	/* Close the inode.  */
-	if (ntfs_inode_close(ni) && !ret) {
+	/* Close the inode.  If its directory is still open, then the inode's
+	 * entry in it must be updated through the open directory inode.  */
+	if ((*dir_ni_p ? ntfs_inode_close_in_dir(ni, *dir_ni_p) :
+			 ntfs_inode_close(ni)) && !ret)
+	{
 		ERROR_WITH_ERRNO("Error closing \"%s\" in NTFS volume",
 				 dentry_full_path(first_dentry));
 		ret = WIMLIB_ERR_NTFS_3G;
@@ -655,22 +750,25 @@ ntfs_3g_create_nondirectories(struct list_head *dentry_list,
 {
 	struct wim_dentry *dentry;
 	struct wim_inode *inode;
-	int ret;
+	ntfs_inode *dir_ni = NULL;
+	int ret = 0;
 
 	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
 		inode = dentry->d_inode;
 		if (inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY)
 			continue;
 		if (dentry == inode_first_extraction_dentry(inode)) {
-			ret = ntfs_3g_create_nondirectory(inode, ctx);
+			ret = ntfs_3g_create_nondirectory(inode, &dir_ni, ctx);
 			if (ret)
-				return ret;
+				break;
 		}
 		ret = report_file_created(&ctx->common);
 		if (ret)
-			return ret;
+			break;
 	}
-	return 0;
+	if (ntfs_3g_close_cur_dir(&dir_ni) && !ret)
+		ret = WIMLIB_ERR_NTFS_3G;
+	return ret;
 }
 
 static int
@@ -748,7 +846,9 @@ ntfs_3g_begin_extract_blob_instance(struct blob_descriptor *blob,
 		if (inode->i_attributes & FILE_ATTRIBUTE_SPARSE_FILE) {
 			ctx->is_sparse_attr[ctx->num_open_attrs] = true;
 			ctx->any_sparse_attrs = true;
-		} else {
+		} else if (!(ctx->common.extract_flags &
+			     WIMLIB_EXTRACT_FLAG_NO_PREALLOCATE))
+		{
 			ntfs_attr_truncate_solid(na, blob->size);
 		}
 	}
@@ -775,6 +875,7 @@ ntfs_3g_cleanup_blob_extract(struct ntfs_3g_apply_ctx *ctx)
 	}
 	ctx->num_open_inodes = 0;
 
+	ctx->write_buf_len = 0;
 	ctx->any_sparse_attrs = false;
 	ctx->reparse_ptr = NULL;
 	ctx->num_reparse_inodes = 0;
@@ -860,13 +961,13 @@ ntfs_3g_full_pwrite(ntfs_attr *na, u64 offset, size_t size, const u8 *data)
 	return true;
 }
 
+/* Write the data in the write buffer to all the open attributes.  */
 static int
-ntfs_3g_extract_chunk(const struct blob_descriptor *blob, u64 offset,
-		      const void *chunk, size_t size, void *_ctx)
+ntfs_3g_flush_write_buf(struct ntfs_3g_apply_ctx *ctx)
 {
-	struct ntfs_3g_apply_ctx *ctx = _ctx;
-	const void * const end = chunk + size;
-	const void *p;
+	const u8 *p = ctx->write_buf;
+	const u8 * const end = p + ctx->write_buf_len;
+	u64 offset = ctx->write_buf_offset;
 	bool zeroes;
 	size_t len;
 	unsigned i;
@@ -875,7 +976,7 @@ ntfs_3g_extract_chunk(const struct blob_descriptor *blob, u64 offset,
 	 * For sparse attributes, only write nonzero regions.  This lets the
 	 * filesystem use holes to represent zero regions.
 	 */
-	for (p = chunk; p != end; p += len, offset += len) {
+	for (; p != end; p += len, offset += len) {
 		zeroes = maybe_detect_sparse_region(p, end - p, &len,
 						    ctx->any_sparse_attrs);
 		for (i = 0; i < ctx->num_open_attrs; i++) {
@@ -886,9 +987,8 @@ ntfs_3g_extract_chunk(const struct blob_descriptor *blob, u64 offset,
 			}
 		}
 	}
-
-	if (ctx->reparse_ptr)
-		ctx->reparse_ptr = mempcpy(ctx->reparse_ptr, chunk, size);
+	ctx->write_buf_offset = offset;
+	ctx->write_buf_len = 0;
 	return 0;
 
 err:
@@ -896,6 +996,49 @@ err:
 	return WIMLIB_ERR_NTFS_3G;
 }
 
+static int
+ntfs_3g_extract_chunk(const struct blob_descriptor *blob, u64 offset,
+		      const void *chunk, size_t size, void *_ctx)
+{
+	struct ntfs_3g_apply_ctx *ctx = _ctx;
+	const u8 *p = chunk;
+	size_t remaining = size;
+	int ret;
+
+	if (ctx->num_open_attrs) {
+		if (ctx->write_buf_len &&
+		    ctx->write_buf_offset + ctx->write_buf_len != offset) {
+			ret = ntfs_3g_flush_write_buf(ctx);
+			if (ret)
+				return ret;
+		}
+		if (!ctx->write_buf_len)
+			ctx->write_buf_offset = offset;
+
+		/* Fill the write buffer, writing it out each time it becomes
+		 * full.  Since blobs are written sequentially from offset 0,
+		 * each full buffer ends on a cluster boundary.  */
+		while (remaining) {
+			size_t n = min(remaining, ctx->write_buf_size -
+						  ctx->write_buf_len);
+
+			memcpy(&ctx->write_buf[ctx->write_buf_len], p, n);
+			ctx->write_buf_len += n;
+			p += n;
+			remaining -= n;
+			if (ctx->write_buf_len == ctx->write_buf_size) {
+				ret = ntfs_3g_flush_write_buf(ctx);
+				if (ret)
+					return ret;
+			}
+		}
+	}
+
+	if (ctx->reparse_ptr)
+		ctx->reparse_ptr = mempcpy(ctx->reparse_ptr, chunk, size);
+	return 0;
+}
+
 static int
 ntfs_3g_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 {
@@ -907,6 +1050,10 @@ ntfs_3g_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 		goto out;
 	}
 
+	ret = ntfs_3g_flush_write_buf(ctx);
+	if (ret)
+		goto out;
+
 	/* Extend sparse attributes to their final size. */
 	if (ctx->any_sparse_attrs) {
 		for (unsigned i = 0; i < ctx->num_open_attrs; i++) {
@@ -978,6 +1125,14 @@ ntfs_3g_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 	}
 	ctx->vol = vol;
 
+	/* Batch writes of data into 1 MiB, or at least one cluster.  */
+	ctx->write_buf_size = ALIGN(1 << 20, vol->cluster_size);
+	ctx->write_buf = MALLOC(ctx->write_buf_size);
+	if (!ctx->write_buf) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out_unmount;
+	}
+
 	/* Opening $Secure is required to set security descriptors in NTFS v3.0
 	 * format, where security descriptors are stored in a per-volume index
 	 * rather than being fully specified for each file.  */
@@ -988,6 +1143,22 @@ ntfs_3g_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 		goto out_unmount;
 	}
 
+	if (vol->secure_ni &&
+	    !(ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_NO_ACLS))
+	{
+		const struct wim_security_data *sd =
+			wim_get_current_security_data(ctx->common.wim);
+
+		if (sd->num_entries) {
+			ctx->security_ids = CALLOC(sd->num_entries,
+						   sizeof(ctx->security_ids[0]));
+			if (!ctx->security_ids) {
+				ret = WIMLIB_ERR_NOMEM;
+				goto out_unmount;
+			}
+		}
+	}
+
 	/* Create all inodes and aliases, including short names, and set
 	 * metadata (attributes, security descriptors, and timestamps).  */
 
@@ -1022,6 +1193,8 @@ ntfs_3g_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 	 * ntfs_set_ntfs_dos_name() does, but we handle this elsewhere).  */
 
 out_unmount:
+	FREE(ctx->security_ids);
+	FREE(ctx->write_buf);
 	if (vol->secure_ni) {
 		ntfs_index_ctx_put(vol->secure_xsii);
 		ntfs_index_ctx_put(vol->secure_xsdh);
@@ -29,6 +29,8 @@
 #ifdef WITH_NTFS_3G
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <ntfs-3g/attrib.h>
 #include <ntfs-3g/compat.h> /* for ENODATA, if needed */
@@ -629,11 +631,19 @@ destroy_dos_name_map(struct dos_name_map *map)
 		FREE(node);
 }
 
+/* A directory entry read by ntfs_readdir() which hasn't been scanned yet  */
+struct readdir_entry {
+	MFT_REF mref;
+	int name_type;
+	size_t name_nbytes;
+	ntfschar name[];
+};
+
 struct readdir_ctx {
-	struct wim_dentry *parent;
 	struct dos_name_map dos_name_map;
-	struct ntfs_volume_wrapper *volume;
-	struct scan_params *params;
+	struct readdir_entry **entries;
+	size_t num_entries;
+	size_t num_entries_allocated;
 	int ret;
 };
 
@@ -645,19 +655,18 @@ ntfs_3g_build_dentry_tree_recursive(struct wim_dentry **root_p,
 				    struct ntfs_volume_wrapper *volume,
 				    struct scan_params *params);
 
+/* Callback for ntfs_readdir().  DOS names are saved in the DOS name map, and
+ * all other entries are saved to be scanned after the whole directory has been
+ * read.  */
 static int
 filldir(void *_ctx, const ntfschar *name, const int name_nchars,
 	const int name_type, const s64 pos, const MFT_REF mref,
 	const unsigned dt_type)
 {
 	struct readdir_ctx *ctx = _ctx;
-	struct scan_params *params = ctx->params;
 	const size_t name_nbytes = name_nchars * sizeof(ntfschar);
-	char *mbs_name;
-	size_t mbs_name_nbytes;
-	size_t orig_path_nchars;
-	struct wim_dentry *child;
-	int ret;
+	struct readdir_entry *entry;
+	int ret = 0;
 
 	if (name_type & FILE_NAME_DOS) {
 		/* If this is the entry for a DOS name, store it for later. */
@@ -670,9 +679,60 @@ filldir(void *_ctx, const ntfschar *name, const int name_nchars,
 			goto out;
 	}
 
-	ret = utf16le_to_tstr(name, name_nbytes, &mbs_name, &mbs_name_nbytes);
-	if (ret)
+	if (ctx->num_entries == ctx->num_entries_allocated) {
+		size_t new_len = max(16, ctx->num_entries_allocated * 2);
+		struct readdir_entry **new_entries;
+
+		new_entries = REALLOC(ctx->entries,
+				      new_len * sizeof(new_entries[0]));
+		if (!new_entries) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto out;
+		}
+		ctx->entries = new_entries;
+		ctx->num_entries_allocated = new_len;
+	}
+
+	entry = MALLOC(sizeof(*entry) + name_nbytes);
+	if (!entry) {
+		ret = WIMLIB_ERR_NOMEM;
 		goto out;
+	}
+	entry->mref = mref;
+	entry->name_type = name_type;
+	entry->name_nbytes = name_nbytes;
+	memcpy(entry->name, name, name_nbytes);
+	ctx->entries[ctx->num_entries++] = entry;
+out:
+	ctx->ret = ret;
+	return ret;
+}
+
+static int
+cmp_readdir_entries_by_mft_no(const void *p1, const void *p2)
+{
+	const struct readdir_entry *entry1 = *(const struct readdir_entry **)p1;
+	const struct readdir_entry *entry2 = *(const struct readdir_entry **)p2;
+
+	return cmp_u64(MREF(entry1->mref), MREF(entry2->mref));
+}
+
+static int
+ntfs_3g_scan_readdir_entry(const struct readdir_entry *entry,
+			   struct wim_dentry *parent,
+			   struct ntfs_volume_wrapper *volume,
+			   struct scan_params *params)
+{
+	char *mbs_name;
+	size_t mbs_name_nbytes;
+	size_t orig_path_nchars;
+	struct wim_dentry *child;
+	int ret;
+
+	ret = utf16le_to_tstr(entry->name, entry->name_nbytes,
+			      &mbs_name, &mbs_name_nbytes);
+	if (ret)
+		return ret;
 
 	if (should_ignore_filename(mbs_name, mbs_name_nbytes))
 		goto out_free_mbs_name;
@@ -683,18 +743,27 @@ filldir(void *_ctx, const ntfschar *name, const int name_nchars,
 		goto out_free_mbs_name;
 
 	child = NULL;
-	ret = ntfs_3g_build_dentry_tree_recursive(&child, mref, mbs_name,
-						  name_type, ctx->volume,
+	ret = ntfs_3g_build_dentry_tree_recursive(&child, entry->mref, mbs_name,
+						  entry->name_type, volume,
 						  params);
 	pathbuf_truncate(params, orig_path_nchars);
-	attach_scanned_tree(ctx->parent, child, params->blob_table);
+	attach_scanned_tree(parent, child, params);
 out_free_mbs_name:
 	FREE(mbs_name);
-out:
-	ctx->ret = ret;
 	return ret;
 }
 
+/*
+ * Scan the children of the directory @ni.
+ *
+ * The whole directory is read before any of its children are scanned, and the
+ * children are then scanned in order of MFT record number rather than in the
+ * order of the directory index, which is sorted by name.  Files in the same
+ * directory were usually created around the same time and so tend to have
+ * nearby MFT records, so this turns what would be random reads from the MFT on
+ * a large volume into mostly sequential ones.  It also avoids recursing into
+ * subdirectories from inside ntfs_readdir().
+ */
 static int
 ntfs_3g_recurse_directory(ntfs_inode *ni, struct wim_dentry *parent,
 			  struct ntfs_volume_wrapper *volume,
@@ -703,10 +772,10 @@ ntfs_3g_recurse_directory(ntfs_inode *ni, struct wim_dentry *parent,
 	int ret;
 	s64 pos = 0;
 	struct readdir_ctx ctx = {
-		.parent          = parent,
 		.dos_name_map    = { .root = NULL },
-		.volume          = volume,
-		.params          = params,
+		.entries         = NULL,
+		.num_entries     = 0,
+		.num_entries_allocated = 0,
 		.ret		 = 0,
 	};
 	ret = ntfs_readdir(ni, &pos, &ctx, filldir);
@@ -723,13 +792,26 @@ ntfs_3g_recurse_directory(ntfs_inode *ni, struct wim_dentry *parent,
 	} else {
 		struct wim_dentry *child;
 
-		ret = 0;
+		qsort(ctx.entries, ctx.num_entries, sizeof(ctx.entries[0]),
+		      cmp_readdir_entries_by_mft_no);
+
+		for (size_t i = 0; i < ctx.num_entries; i++) {
+			ret = ntfs_3g_scan_readdir_entry(ctx.entries[i], parent,
+							 volume, params);
+			if (ret)
+				goto out;
+		}
+
 		for_dentry_child(child, parent) {
 			ret = set_dentry_dos_name(child, &ctx.dos_name_map);
 			if (ret)
 				break;
 		}
 	}
+out:
+	for (size_t i = 0; i < ctx.num_entries; i++)
+		FREE(ctx.entries[i]);
+	FREE(ctx.entries);
 	destroy_dos_name_map(&ctx.dos_name_map);
 	return ret;
 }
@@ -863,7 +945,7 @@ out:
 	if (ni)
 		ntfs_inode_close(ni);
 	if (unlikely(ret)) {
-		free_dentry_tree(root, params->blob_table);
+		discard_scanned_tree(params, root);
 		root = NULL;
 		ret = report_scan_error(params, ret);
 	}
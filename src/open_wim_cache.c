@@ -0,0 +1,276 @@
+/*
+ * open_wim_cache.c
+ *
+ * A library-wide cache of the uncompressed metadata of opened WIM files.
+ *
+ * A program that opens the same WIM files over and over, e.g. a server that
+ * opens a WIM file for each request, would read and decompress the same blob
+ * table, XML data, and metadata resources each time.  When the cache is
+ * enabled with wimlib_set_open_wim_cache_size(), the uncompressed contents of
+ * these resources are kept after they are read, and reading them through
+ * another WIMStruct for the same file copies them from the cache instead.  Each
+ * WIMStruct still parses its own copy, since the parsed blob table and image
+ * metadata are changed by almost every operation on the WIMStruct.
+ *
+ * The data is shared only between WIMStructs for the same file in the same
+ * state, as identified by a 'struct open_wim_id'.  The entries for a file whose
+ * state has since changed are freed when it is next looked up, and the least
+ * recently used entries are freed when the cache would exceed its size.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib.h"
+#include "wimlib/list.h"
+#include "wimlib/open_wim_cache.h"
+#include "wimlib/threads.h"
+#include "wimlib/timestamp.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
+
+struct cached_wim_data {
+	/* Link in 'cache_list', most recently used first  */
+	struct list_head list;
+
+	/* The file, and the resource in it, the data is from  */
+	struct open_wim_id id;
+	u64 offset_in_wim;
+	u64 size_in_wim;
+
+	/* The uncompressed data of the resource  */
+	u64 size;
+	u8 data[];
+};
+
+static struct mutex cache_lock = MUTEX_INITIALIZER;
+static LIST_HEAD(cache_list);
+static u64 cache_size;
+static u64 max_cache_size;
+
+static u64
+cached_wim_data_size(const struct cached_wim_data *entry)
+{
+	return sizeof(*entry) + entry->size;
+}
+
+/* Remove entries from 'cache_list', least recently used first, until at most
+ * @limit bytes are cached, and return them in @evicted.  Called with
+ * 'cache_lock' held.  */
+static void
+evict_cached_wim_data(u64 limit, struct list_head *evicted)
+{
+	while (cache_size > limit) {
+		struct cached_wim_data *entry =
+			list_last_entry(&cache_list, struct cached_wim_data,
+					list);
+
+		list_del(&entry->list);
+		cache_size -= cached_wim_data_size(entry);
+		list_add(&entry->list, evicted);
+	}
+}
+
+static void
+free_evicted_wim_data(struct list_head *evicted)
+{
+	struct cached_wim_data *entry, *tmp;
+
+	list_for_each_entry_safe(entry, tmp, evicted, list)
+		FREE(entry);
+}
+
+static bool
+same_file(const struct open_wim_id *id1, const struct open_wim_id *id2)
+{
+	return id1->dev == id2->dev && id1->ino == id2->ino;
+}
+
+static bool
+same_file_state(const struct open_wim_id *id1, const struct open_wim_id *id2)
+{
+	return same_file(id1, id2) && id1->size == id2->size &&
+		id1->mtime == id2->mtime && guids_equal(id1->guid, id2->guid);
+}
+
+/*
+ * Find the entry for the given resource of the file identified by @id.  The
+ * entries for older states of the same file are moved to @evicted along the
+ * way.  Called with 'cache_lock' held.
+ */
+static struct cached_wim_data *
+find_cached_wim_data(const struct open_wim_id *id, u64 offset_in_wim,
+		     u64 size_in_wim, u64 uncompressed_size,
+		     struct list_head *evicted)
+{
+	struct cached_wim_data *entry, *tmp, *found = NULL;
+
+	list_for_each_entry_safe(entry, tmp, &cache_list, list) {
+		if (!same_file(&entry->id, id))
+			continue;
+		if (!same_file_state(&entry->id, id)) {
+			list_del(&entry->list);
+			cache_size -= cached_wim_data_size(entry);
+			list_add(&entry->list, evicted);
+			continue;
+		}
+		if (entry->offset_in_wim == offset_in_wim &&
+		    entry->size_in_wim == size_in_wim &&
+		    entry->size == uncompressed_size)
+			found = entry;
+	}
+	return found;
+}
+
+/* Record the identity of the file backing @wim, whose header has been read and
+ * which was described by @stbuf when it was opened.  */
+void
+open_wim_cache_set_id(WIMStruct *wim, const struct stat *stbuf)
+{
+	struct open_wim_id *id = &wim->cache_id;
+
+	id->dev = stbuf->st_dev;
+	id->ino = stbuf->st_ino;
+	id->size = stbuf->st_size;
+#ifdef HAVE_STAT_NANOSECOND_PRECISION
+	id->mtime = timespec_to_wim_timestamp(&stbuf->st_mtim);
+#else
+	id->mtime = time_t_to_wim_timestamp(stbuf->st_mtime);
+#endif
+	copy_guid(id->guid, wim->hdr.guid);
+	id->valid = S_ISREG(stbuf->st_mode);
+}
+
+/*
+ * Look up the uncompressed data of the resource of @wim's file at
+ * @offset_in_wim.  If it is cached, return true and a copy of it in a newly
+ * allocated buffer in @buf_ret.  Otherwise return false.
+ */
+bool
+open_wim_cache_lookup(const WIMStruct *wim, u64 offset_in_wim, u64 size_in_wim,
+		      u64 uncompressed_size, void **buf_ret)
+{
+	struct cached_wim_data *entry;
+	LIST_HEAD(evicted);
+	void *buf = NULL;
+
+	if (!wim->cache_id.valid)
+		return false;
+
+	mutex_lock(&cache_lock);
+	if (max_cache_size == 0)
+		goto out_unlock;
+	entry = find_cached_wim_data(&wim->cache_id, offset_in_wim,
+				     size_in_wim, uncompressed_size, &evicted);
+	if (!entry)
+		goto out_unlock;
+	buf = MALLOC(max(entry->size, 1));
+	if (buf) {
+		memcpy(buf, entry->data, entry->size);
+		list_move(&entry->list, &cache_list);
+	}
+out_unlock:
+	mutex_unlock(&cache_lock);
+
+	free_evicted_wim_data(&evicted);
+	*buf_ret = buf;
+	return buf != NULL;
+}
+
+/* Return the most that may be cached right now: the cache's size limit, reduced
+ * if the memory budget doesn't allow it to grow that large.  Called with
+ * 'cache_lock' held.  */
+static u64
+effective_max_cache_size(void)
+{
+	u64 remaining = get_memory_budget_remaining();
+
+	if (remaining < max_cache_size - cache_size)
+		return cache_size + remaining;
+	return max_cache_size;
+}
+
+/* Offer the uncompressed data of the resource of @wim's file at @offset_in_wim,
+ * which was just read and validated, to the cache.  */
+void
+open_wim_cache_insert(const WIMStruct *wim, u64 offset_in_wim, u64 size_in_wim,
+		      u64 uncompressed_size, const void *buf)
+{
+	struct cached_wim_data *entry;
+	LIST_HEAD(evicted);
+	u64 size = sizeof(*entry) + uncompressed_size;
+	u64 limit;
+
+	if (!wim->cache_id.valid)
+		return;
+
+	mutex_lock(&cache_lock);
+	limit = effective_max_cache_size();
+	if (size > limit ||
+	    find_cached_wim_data(&wim->cache_id, offset_in_wim, size_in_wim,
+				 uncompressed_size, &evicted))
+		goto out_unlock;
+	if ((size_t)size != size)
+		goto out_unlock;
+	entry = MALLOC(size);
+	if (!entry)
+		goto out_unlock;
+	entry->id = wim->cache_id;
+	entry->offset_in_wim = offset_in_wim;
+	entry->size_in_wim = size_in_wim;
+	entry->size = uncompressed_size;
+	memcpy(entry->data, buf, uncompressed_size);
+
+	evict_cached_wim_data(limit - size, &evicted);
+	list_add(&entry->list, &cache_list);
+	cache_size += size;
+out_unlock:
+	mutex_unlock(&cache_lock);
+
+	free_evicted_wim_data(&evicted);
+}
+
+/* Free everything in the cache.  Called by wimlib_global_cleanup().  */
+void
+open_wim_cache_cleanup(void)
+{
+	LIST_HEAD(evicted);
+
+	mutex_lock(&cache_lock);
+	evict_cached_wim_data(0, &evicted);
+	mutex_unlock(&cache_lock);
+
+	free_evicted_wim_data(&evicted);
+}
+
+WIMLIBAPI int
+wimlib_set_open_wim_cache_size(uint64_t max_memory)
+{
+	LIST_HEAD(evicted);
+
+	mutex_lock(&cache_lock);
+	max_cache_size = max_memory;
+	evict_cached_wim_data(max_memory, &evicted);
+	mutex_unlock(&cache_lock);
+
+	free_evicted_wim_data(&evicted);
+	return 0;
+}
@@ -31,6 +31,8 @@
 #include "wimlib/encoding.h"
 #include "wimlib/paths.h"
 #include "wimlib/pattern.h"
+#include "wimlib/textfile.h"
+#include "wimlib/util.h"
 
 static bool
 string_matches_pattern(const tchar *string, const tchar * const string_end,
@@ -56,6 +58,16 @@ string_matches_pattern(const tchar *string, const tchar * const string_end,
 	return pattern == pattern_end;
 }
 
+/* Does the pattern component contain any wildcard characters?  */
+static bool
+component_has_wildcards(const tchar *p, const tchar * const end)
+{
+	for (; p != end; p++)
+		if (*p == T('*') || *p == T('?'))
+			return true;
+	return false;
+}
+
 /* Advance past zero or more path separators.  */
 static const tchar *
 advance_to_next_component(const tchar *p)
@@ -135,6 +147,167 @@ match_path(const tchar *path, const tchar *pattern, int match_flags)
 	}
 }
 
+/* Hash a path component, or a filename if @is_filename, consistently with how
+ * string_matches_pattern() compares characters.  */
+static u32
+hash_component(const tchar *p, const tchar * const end, bool is_filename)
+{
+	u32 hash = is_filename ? 0x9E3779B9 : 0;
+
+	for (; p != end; p++)
+		hash = (hash * 31) + (default_ignore_case ? totlower(*p) : *p);
+	return hash;
+}
+
+/*
+ * If @pattern can only match paths with a particular first component (if it
+ * starts with a path separator) or filename (otherwise), because that part of
+ * it is literal, then return true and set *hash_ret to the hash of that name.
+ */
+static bool
+get_pattern_key(const tchar *pattern, u32 *hash_ret)
+{
+	bool is_filename = (*pattern != WIM_PATH_SEPARATOR);
+	const tchar *end;
+
+	pattern = advance_to_next_component(pattern);
+	if (!*pattern)
+		return false;
+	end = advance_through_component(pattern);
+	if (component_has_wildcards(pattern, end))
+		return false;
+	/* A filename pattern with more components matches paths whose
+	 * filenames aren't the first component; don't bother with those.  */
+	if (is_filename && *advance_to_next_component(end))
+		return false;
+	*hash_ret = hash_component(pattern, end, is_filename);
+	return true;
+}
+
+/*
+ * Build an index of the path patterns in @list, for match_pattern_index().  The
+ * index refers to the strings in @list, which must outlive it.
+ */
+int
+build_pattern_index(const struct string_list *list,
+		    struct pattern_index *index)
+{
+	const size_t n = list->num_strings;
+	size_t num_buckets = 1;
+	size_t *pos;
+	u32 hash;
+
+	while (num_buckets < n)
+		num_buckets *= 2;
+
+	index->patterns = MALLOC(max(n, 1) * sizeof(index->patterns[0]));
+	index->bucket_start = CALLOC(num_buckets + 1,
+				     sizeof(index->bucket_start[0]));
+	pos = MALLOC((num_buckets + 1) * sizeof(pos[0]));
+	if (!index->patterns || !index->bucket_start || !pos) {
+		FREE(pos);
+		free_pattern_index(index);
+		return WIMLIB_ERR_NOMEM;
+	}
+	index->num_buckets = num_buckets;
+	index->num_patterns = n;
+
+	/* Counting sort the patterns by bucket, with the unindexed ones at the
+	 * end.  */
+	for (size_t i = 0; i < n; i++) {
+		if (get_pattern_key(list->strings[i], &hash))
+			index->bucket_start[hash & (num_buckets - 1)]++;
+		else
+			index->bucket_start[num_buckets]++;
+	}
+	for (size_t i = 0, total = 0; i <= num_buckets; i++) {
+		size_t count = index->bucket_start[i];
+
+		index->bucket_start[i] = pos[i] = total;
+		total += count;
+	}
+	for (size_t i = 0; i < n; i++) {
+		size_t b = num_buckets;
+
+		if (get_pattern_key(list->strings[i], &hash))
+			b = hash & (num_buckets - 1);
+		index->patterns[pos[b]++] = list->strings[i];
+	}
+	FREE(pos);
+	return 0;
+}
+
+void
+free_pattern_index(struct pattern_index *index)
+{
+	FREE(index->patterns);
+	FREE(index->bucket_start);
+	index->patterns = NULL;
+	index->bucket_start = NULL;
+	index->num_buckets = 0;
+	index->num_patterns = 0;
+}
+
+static bool
+match_pattern_range(const tchar *path, const struct pattern_index *index,
+		    size_t start, size_t end, int match_flags)
+{
+	for (size_t i = start; i < end; i++)
+		if (match_path(path, index->patterns[i], match_flags))
+			return true;
+	return false;
+}
+
+static bool
+match_pattern_bucket(const tchar *path, const struct pattern_index *index,
+		     u32 hash, int match_flags)
+{
+	size_t b = hash & (index->num_buckets - 1);
+
+	return match_pattern_range(path, index, index->bucket_start[b],
+				   index->bucket_start[b + 1], match_flags);
+}
+
+/*
+ * Determine whether @path matches any of the patterns in @index, like
+ * match_pattern_list() would for the list it was built from.  Only the patterns
+ * in the buckets for the first component and filename of @path, and those which
+ * couldn't be put in a bucket, need to be tried.
+ */
+bool
+match_pattern_index(const tchar *path, const struct pattern_index *index,
+		    int match_flags)
+{
+	const tchar *name = advance_to_next_component(path);
+	const tchar *name_end;
+
+	if (index->num_patterns == 0)
+		return false;
+
+	/* With no components, even a pattern's first component doesn't have to
+	 * match (given MATCH_ANCESTORS), so try all the patterns.  */
+	if (!*name)
+		return match_pattern_range(path, index, 0, index->num_patterns,
+					   match_flags);
+
+	name_end = advance_through_component(name);
+	if (match_pattern_bucket(path, index,
+				 hash_component(name, name_end, false),
+				 match_flags))
+		return true;
+
+	name = path_basename(path);
+	name_end = advance_through_component(name);
+	if (match_pattern_bucket(path, index,
+				 hash_component(name, name_end, true),
+				 match_flags))
+		return true;
+
+	return match_pattern_range(path, index,
+				   index->bucket_start[index->num_buckets],
+				   index->num_patterns, match_flags);
+}
+
 /*
  * Expand a path pattern in an in-memory tree of dentries.
  *
@@ -172,6 +345,27 @@ expand_path_pattern(struct wim_dentry *root, const tchar *pattern,
 
 	pattern_component_end = advance_through_component(pattern);
 
+	/* If the component has no wildcards and matching is case sensitive, it
+	 * can match at most one child, which can be looked up directly rather
+	 * than by comparing against every child.  This makes expanding literal
+	 * paths, and the literal prefixes of patterns, fast even in directories
+	 * with many entries.  */
+	if (!default_ignore_case &&
+	    !component_has_wildcards(pattern, pattern_component_end))
+	{
+		size_t len = pattern_component_end - pattern;
+		tchar name[len + 1];
+
+		tmemcpy(name, pattern, len);
+		name[len] = T('\0');
+		child = get_dentry_child_with_name(root, name,
+						   WIMLIB_CASE_SENSITIVE);
+		if (!child)
+			return 0;
+		return expand_path_pattern(child, pattern_component_end,
+					   consume_dentry, ctx);
+	}
+
 	/* For each child dentry that matches the current pattern component,
 	 * recurse with the remainder of the pattern.  */
 	for_dentry_child(child, root) {
@@ -0,0 +1,114 @@
+/*
+ * perf_counters.c
+ *
+ * Optional counters of the time spent in, and the amount of data processed by,
+ * each stage of the library's work: reading and writing files, hashing,
+ * compressing, decompressing, and reading and writing metadata resources.
+ *
+ * The counters are global, since the stages they measure are shared by
+ * everything in the process anyway (e.g. the compressor threads come from the
+ * library-wide task pool).  They are disabled by default.  While enabled, each
+ * measured piece of work, e.g. each read() or each compressed chunk, costs two
+ * reads of the monotonic clock and three atomic additions; the pieces are large
+ * enough that this is normally negligible.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef _WIN32
+#  include "wimlib/win32_common.h"
+#else
+#  include <time.h>
+#endif
+
+#include <string.h>
+
+#include "wimlib.h"
+#include "wimlib/perf_counters.h"
+
+bool perf_counters_enabled;
+struct perf_counter perf_counters[NUM_PERF_STAGES];
+
+/* Return the current time in nanoseconds, from a monotonic clock.  */
+u64
+perf_now(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (u64)now.QuadPart / freq.QuadPart * 1000000000 +
+	       (u64)now.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static void
+get_counter(enum perf_stage stage, struct wimlib_perf_counter *out)
+{
+	const struct perf_counter *c = &perf_counters[stage];
+
+	out->nanoseconds = __atomic_load_n(&c->ns, __ATOMIC_RELAXED);
+	out->bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+	out->count = __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_set_perf_counters_enabled(bool enable)
+{
+	__atomic_store_n(&perf_counters_enabled, enable, __ATOMIC_RELAXED);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_get_perf_counters(struct wimlib_perf_counters *counters)
+{
+	memset(counters, 0, sizeof(*counters));
+	get_counter(PERF_READ, &counters->read);
+	get_counter(PERF_WRITE, &counters->write);
+	get_counter(PERF_FSYNC, &counters->fsync);
+	get_counter(PERF_HASH, &counters->hash);
+	get_counter(PERF_COMPRESS, &counters->compress);
+	get_counter(PERF_DECOMPRESS, &counters->decompress);
+	get_counter(PERF_METADATA_READ, &counters->metadata_read);
+	get_counter(PERF_METADATA_WRITE, &counters->metadata_write);
+	get_counter(PERF_COMPRESS_WAIT, &counters->compress_wait);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_reset_perf_counters(void)
+{
+	for (int i = 0; i < NUM_PERF_STAGES; i++) {
+		__atomic_store_n(&perf_counters[i].ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&perf_counters[i].bytes, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&perf_counters[i].count, 0, __ATOMIC_RELAXED);
+	}
+}
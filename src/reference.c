@@ -29,6 +29,8 @@
 #include "wimlib/blob_table.h"
 #include "wimlib/error.h"
 #include "wimlib/glob.h"
+#include "wimlib/task_pool.h"
+#include "wimlib/util.h"
 #include "wimlib/wim.h"
 
 #define WIMLIB_REF_MASK_PUBLIC (WIMLIB_REF_FLAG_GLOB_ENABLE | \
@@ -140,6 +142,14 @@ blob_gift(struct blob_descriptor *blob, void *_info)
 	return 0;
 }
 
+static void
+gift_blobs(struct reference_info *info, WIMStruct *src_wim)
+{
+	info->src_table = src_wim->blob_table;
+	for_blob_in_table(src_wim->blob_table, blob_gift, info);
+	wimlib_free(src_wim);
+}
+
 static int
 reference_resource_path(struct reference_info *info, const tchar *path,
 			int open_flags)
@@ -153,23 +163,123 @@ reference_resource_path(struct reference_info *info, const tchar *path,
 	if (ret)
 		return ret;
 
-	info->src_table = src_wim->blob_table;
-	for_blob_in_table(src_wim->blob_table, blob_gift, info);
-	wimlib_free(src_wim);
+	gift_blobs(info, src_wim);
 	return 0;
 }
 
+/* Maximum number of tasks which open the referenced WIM files  */
+#define MAX_OPEN_TASKS	16
+
+struct opened_wim {
+	const tchar *path;
+	WIMStruct *wim;
+
+	/* Result of opening the WIM file, or -1 if not opened yet  */
+	int ret;
+};
+
+struct open_wims_task {
+	struct pool_task base;
+	struct opened_wim *wims;
+	unsigned num_wims;
+	unsigned *next_wim;
+	int open_flags;
+	bool *failed;
+};
+
+static void
+open_wims_task_run(struct pool_task *_task)
+{
+	struct open_wims_task *task = (struct open_wims_task *)_task;
+	unsigned i;
+
+	while ((i = __atomic_fetch_add(task->next_wim, 1, __ATOMIC_RELAXED)) <
+	       task->num_wims)
+	{
+		struct opened_wim *ow = &task->wims[i];
+
+		/* After a failure, the rest won't be needed.  */
+		if (__atomic_load_n(task->failed, __ATOMIC_RELAXED))
+			break;
+		ow->ret = wimlib_open_wim(ow->path, task->open_flags, &ow->wim);
+		if (ow->ret)
+			__atomic_store_n(task->failed, true, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Reference the resources in the WIM files at the specified paths.  When there
+ * are many of them, e.g. the parts of a split WIM on a network share, the time
+ * taken is mostly the latency of opening each file and reading its blob table.
+ * So the files are opened by multiple threads, and their blob tables are then
+ * merged into the destination's in the order of @paths, so the result is the
+ * same as when opening them one at a time.  This isn't done if integrity
+ * checks were requested and there is a progress function, since the progress
+ * function must not be called from multiple threads.
+ */
 static int
 reference_resource_paths(struct reference_info *info,
 			 const tchar * const *paths, unsigned num_paths,
 			 int open_flags)
 {
+	struct open_wims_task tasks[MAX_OPEN_TASKS];
+	struct pool_task *task_ptrs[MAX_OPEN_TASKS];
+	struct opened_wim *wims;
+	unsigned next_wim = 0;
+	bool failed = false;
+	unsigned num_tasks;
+	int ret = 0;
+
+	num_tasks = min(min(num_paths, task_pool_num_threads()),
+			MAX_OPEN_TASKS);
+	if ((open_flags & WIMLIB_OPEN_FLAG_CHECK_INTEGRITY) &&
+	    info->dest_wim->progfunc)
+		num_tasks = 1;
+
+	if (num_tasks <= 1 ||
+	    !(wims = MALLOC(num_paths * sizeof(wims[0])))) {
+		for (unsigned i = 0; i < num_paths; i++) {
+			ret = reference_resource_path(info, paths[i],
+						      open_flags);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
 	for (unsigned i = 0; i < num_paths; i++) {
-		int ret = reference_resource_path(info, paths[i], open_flags);
-		if (ret)
-			return ret;
+		wims[i].path = paths[i];
+		wims[i].wim = NULL;
+		wims[i].ret = -1;
 	}
-	return 0;
+	for (unsigned i = 0; i < num_tasks; i++) {
+		tasks[i].base.run = open_wims_task_run;
+		tasks[i].wims = wims;
+		tasks[i].num_wims = num_paths;
+		tasks[i].next_wim = &next_wim;
+		tasks[i].open_flags = open_flags;
+		tasks[i].failed = &failed;
+		task_ptrs[i] = &tasks[i].base;
+	}
+	task_pool_run_batch(task_ptrs, num_tasks);
+
+	for (unsigned i = 0; i < num_paths; i++) {
+		if (ret) {
+			wimlib_free(wims[i].wim);
+			continue;
+		}
+		if (wims[i].ret < 0) {
+			/* Skipped after a failure in a later file; open it now
+			 * to report the same error as opening in order would.  */
+			wims[i].ret = wimlib_open_wim(wims[i].path, open_flags,
+						      &wims[i].wim);
+		}
+		ret = wims[i].ret;
+		if (!ret)
+			gift_blobs(info, wims[i].wim);
+	}
+	FREE(wims);
+	return ret;
 }
 
 static int
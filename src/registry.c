@@ -2,6 +2,12 @@
  * registry.c
  *
  * Extract information from Windows NT registry hives.
+ *
+ * The hive file isn't loaded into memory.  Instead, the cells which are needed
+ * to look up the requested keys and values are read from it as they are
+ * visited, and are kept in memory until the hive is closed.  Getting a few
+ * values from a hive which is 100 MB in size thus only reads a small fraction of
+ * it.
  */
 
 /*
@@ -27,6 +33,7 @@
 
 #include <string.h>
 
+#include "wimlib/avl_tree.h"
 #include "wimlib/encoding.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
@@ -34,7 +41,7 @@
 #include "wimlib/util.h"
 
 /* Registry hive file header  */
-struct regf {
+struct regf_header {
 #define REGF_MAGIC		cpu_to_le32(0x66676572)	/* "regf" */
 	le32 magic;
 	le32 f1[4];
@@ -141,6 +148,35 @@ struct data_cell {
 	u8 data[0];
 };
 
+/* An open registry hive  */
+struct regf {
+	hive_read_t read;
+	void *read_ctx;
+
+	/* Offset of the root nk cell, and total size of all hbins  */
+	le32 root_key_offset;
+	u32 total_hbin_size;
+
+	/* The cells which have been read so far, indexed by offset  */
+	struct avl_tree_node *cells;
+
+	/* The error, if any, which occurred reading a cell during the current
+	 * operation.  It's reported instead of HIVE_CORRUPT.  */
+	enum hive_status read_status;
+};
+
+/* A cell which has been read from the hive file  */
+struct cached_cell {
+	struct avl_tree_node index_node;
+	u32 offset;
+	u32 size;
+	u8 data[] __attribute__((aligned(8)));
+};
+
+/* The amount of data read at the start of a cell whose size isn't known yet.
+ * Most cells are smaller than this, so they need only one read.  */
+#define CELL_FIRST_READ_SIZE	1024
+
 /* Arbitrary limits for safety  */
 #define MAX_VALUES		65536
 #define MAX_VALUE_SIZE		1048576
@@ -184,37 +220,125 @@ names_equal(const utf16lechar *name, size_t name_nchars,
 	}
 }
 
-/* Get a pointer to a cell, with alignment and bounds checking.  Returns NULL if
- * the requested information does not specify a properly aligned, sized, and
- * in-use cell.  */
-static const void *
-get_cell_pointer(const struct regf *regf, le32 offset, size_t wanted_size)
+#define CELL_OFFSET(node) \
+	avl_tree_entry((node), struct cached_cell, index_node)->offset
+
+static int
+_avl_cmp_cells(const struct avl_tree_node *node1,
+	       const struct avl_tree_node *node2)
 {
-	u32 total = le32_to_cpu(regf->total_hbin_size);
-	u32 offs = le32_to_cpu(offset);
-	const struct cell *cell;
+	return cmp_u32(CELL_OFFSET(node1), CELL_OFFSET(node2));
+}
+
+static int
+_avl_cmp_cell_to_offset(const void *offset,
+			const struct avl_tree_node *node)
+{
+	return cmp_u32(*(const u32 *)offset, CELL_OFFSET(node));
+}
+
+static bool
+read_hive(struct regf *regf, u64 offset, size_t size, void *buf)
+{
+	int ret = (*regf->read)(regf->read_ctx, offset, size, buf);
+
+	if (unlikely(ret)) {
+		if (regf->read_status == HIVE_OK)
+			regf->read_status = translate_wimlib_error(ret);
+		return false;
+	}
+	return true;
+}
+
+/* Read the in-use cell at offset @offs in the hbin area, which must be in
+ * bounds, and add it to the cells which have been read.  */
+static const struct cached_cell *
+read_cell(struct regf *regf, u32 offs)
+{
+	const u64 file_offset = sizeof(struct regf_header) + offs;
+	const u32 avail = regf->total_hbin_size - offs;
+	u8 first[CELL_FIRST_READ_SIZE] __attribute__((aligned(8)));
+	size_t first_size = min(avail, sizeof(first));
 	u32 actual_size;
+	struct cached_cell *cell;
 
-	if ((offs > total) || (offs & 7) || (wanted_size > total - offs))
+	if (first_size < sizeof(le32) ||
+	    !read_hive(regf, file_offset, first_size, first))
 		return NULL;
 
-	cell = (const struct cell *)&regf->hbin_area[offs];
-	actual_size = -le32_to_cpu(cell->size);
+	actual_size = -le32_to_cpu(((const struct cell *)first)->size);
 	if (actual_size > INT32_MAX) /* Cell unused, or size was INT32_MIN?  */
 		return NULL;
-	if (wanted_size > actual_size) /* Cell too small?  */
+
+	/* Nothing beyond the hbin area is ever needed.  */
+	actual_size = min(actual_size, avail);
+
+	cell = MALLOC(sizeof(*cell) + actual_size);
+	if (!cell) {
+		if (regf->read_status == HIVE_OK)
+			regf->read_status = HIVE_OUT_OF_MEMORY;
 		return NULL;
+	}
+	cell->offset = offs;
+	cell->size = actual_size;
+	memcpy(cell->data, first, min(actual_size, first_size));
+	if (actual_size > first_size &&
+	    !read_hive(regf, file_offset + first_size,
+		       actual_size - first_size, &cell->data[first_size]))
+	{
+		FREE(cell);
+		return NULL;
+	}
+	avl_tree_insert(&regf->cells, &cell->index_node, _avl_cmp_cells);
 	return cell;
 }
 
+/* Get a pointer to a cell, with alignment and bounds checking, reading it from
+ * the hive file if it hasn't been read yet.  Returns NULL if the requested
+ * information does not specify a properly aligned, sized, and in-use cell, or
+ * if the cell couldn't be read.  */
+static const void *
+get_cell_pointer(struct regf *regf, le32 offset, size_t wanted_size)
+{
+	u32 total = regf->total_hbin_size;
+	u32 offs = le32_to_cpu(offset);
+	const struct avl_tree_node *node;
+	const struct cached_cell *cell;
+
+	if ((offs > total) || (offs & 7) || (wanted_size > total - offs))
+		return NULL;
+
+	node = avl_tree_lookup(regf->cells, &offs, _avl_cmp_cell_to_offset);
+	if (node)
+		cell = avl_tree_entry(node, struct cached_cell, index_node);
+	else
+		cell = read_cell(regf, offs);
+	if (!cell)
+		return NULL;
+	if (wanted_size > cell->size) /* Cell too small?  */
+		return NULL;
+	return cell->data;
+}
+
 /* Revalidate the cell with its full length.  Returns true iff the cell is
  * valid.  */
 static bool
-revalidate_cell(const struct regf *regf, le32 offset, size_t wanted_size)
+revalidate_cell(struct regf *regf, le32 offset, size_t wanted_size)
 {
 	return get_cell_pointer(regf, offset, wanted_size) != NULL;
 }
 
+/* Finish an operation on the hive, reporting a read error instead of the
+ * HIVE_CORRUPT status it led to.  */
+static enum hive_status
+finish_hive_op(struct regf *regf, enum hive_status status)
+{
+	if (status == HIVE_CORRUPT && regf->read_status != HIVE_OK)
+		status = regf->read_status;
+	regf->read_status = HIVE_OK;
+	return status;
+}
+
 struct subkey_iteration_stats {
 
 	/* The number of additional levels of descendent subkey lists that may
@@ -234,9 +358,14 @@ struct subkey_iteration_stats {
 
 typedef enum hive_status (*subkey_cb_t)(const struct nk *, void *);
 
+/*
+ * Call @cb on each subkey cell referenced by the subkey list at
+ * @subkey_list_offset.  If @lh_hash is non-NULL, then subkeys in LH lists are
+ * skipped, without being read, unless the hash of their name is *lh_hash.
+ */
 static enum hive_status
-iterate_subkeys_recursive(const struct regf *regf, le32 subkey_list_offset,
-			  subkey_cb_t cb, void *cb_ctx,
+iterate_subkeys_recursive(struct regf *regf, le32 subkey_list_offset,
+			  const u32 *lh_hash, subkey_cb_t cb, void *cb_ctx,
 			  struct subkey_iteration_stats *stats)
 {
 	const struct subkey_list *list;
@@ -281,6 +410,12 @@ iterate_subkeys_recursive(const struct regf *regf, le32 subkey_list_offset,
 		while (num_offsets--) {
 			const struct nk *sub_nk;
 
+			if (lh_hash && list->base.magic == LH_MAGIC &&
+			    le32_to_cpu(list->elements[i + 1]) != *lh_hash) {
+				i += increment;
+				continue;
+			}
+
 			sub_nk = get_cell_pointer(regf, list->elements[i],
 						  sizeof(struct nk));
 			if (!sub_nk || sub_nk->base.magic != NK_MAGIC)
@@ -304,7 +439,7 @@ iterate_subkeys_recursive(const struct regf *regf, le32 subkey_list_offset,
 		while (num_offsets--) {
 			status = iterate_subkeys_recursive(regf,
 						list->elements[i++],
-						cb, cb_ctx, stats);
+						lh_hash, cb, cb_ctx, stats);
 			if (status != HIVE_OK)
 				break;
 		}
@@ -315,9 +450,10 @@ iterate_subkeys_recursive(const struct regf *regf, le32 subkey_list_offset,
 	}
 }
 
-/* Call @cb on each subkey cell of the key @nk.  */
+/* Call @cb on each subkey cell of the key @nk, or only on those which may have
+ * the name hash *@lh_hash if @lh_hash is non-NULL.  */
 static enum hive_status
-iterate_subkeys(const struct regf *regf, const struct nk *nk,
+iterate_subkeys(struct regf *regf, const struct nk *nk, const u32 *lh_hash,
 		subkey_cb_t cb, void *cb_ctx)
 {
 	u32 num_subkeys = le32_to_cpu(nk->num_subkeys);
@@ -335,7 +471,7 @@ iterate_subkeys(const struct regf *regf, const struct nk *nk,
 	stats.subkeys_remaining = num_subkeys;
 
 	status = iterate_subkeys_recursive(regf, nk->subkey_list_offset,
-					   cb, cb_ctx, &stats);
+					   lh_hash, cb, cb_ctx, &stats);
 	if (stats.subkeys_remaining != 0 && status == HIVE_OK)
 		status = HIVE_CORRUPT;
 	return status;
@@ -363,6 +499,29 @@ lookup_subkey_cb(const struct nk *sub_nk, void *_ctx)
 	return HIVE_OK;
 }
 
+/*
+ * Compute the hash which LH subkey lists store for a key name: the uppercased
+ * characters, combined as hash = hash * 37 + c.  Only do this for ASCII names,
+ * for which uppercasing is unambiguous; return false for other names.
+ */
+static bool
+get_lh_hash(const utf16lechar *name, size_t name_nchars, u32 *hash_ret)
+{
+	u32 hash = 0;
+
+	for (size_t i = 0; i < name_nchars; i++) {
+		u16 c = le16_to_cpu(name[i]);
+
+		if (c >= 0x80)
+			return false;
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		hash = (hash * 37) + c;
+	}
+	*hash_ret = hash;
+	return true;
+}
+
 /*
  * Given a registry key cell @nk, look up the next component of the key
  * *key_namep.  If found, return HIVE_OK, advance *key_namep past the key name
@@ -370,12 +529,13 @@ lookup_subkey_cb(const struct nk *sub_nk, void *_ctx)
  * another HIVE_* error code.
  */
 static enum hive_status
-lookup_subkey(const struct regf *regf, const utf16lechar **key_namep,
+lookup_subkey(struct regf *regf, const utf16lechar **key_namep,
 	      const struct nk *nk, const struct nk **sub_nk_ret)
 {
 	const utf16lechar *key_name = *key_namep;
 	size_t key_name_nchars = 0;
 	struct lookup_subkey_ctx ctx;
+	u32 lh_hash;
 	enum hive_status status;
 
 	while (key_name[key_name_nchars] != cpu_to_le16('\0') &&
@@ -386,7 +546,10 @@ lookup_subkey(const struct regf *regf, const utf16lechar **key_namep,
 	ctx.key_name_nchars = key_name_nchars;
 	ctx.result = NULL;
 
-	status = iterate_subkeys(regf, nk, lookup_subkey_cb, &ctx);
+	status = iterate_subkeys(regf, nk,
+				 get_lh_hash(key_name, key_name_nchars,
+					     &lh_hash) ? &lh_hash : NULL,
+				 lookup_subkey_cb, &ctx);
 	if (!ctx.result) {
 		if (status == HIVE_OK)
 			status = HIVE_KEY_NOT_FOUND;
@@ -403,7 +566,7 @@ lookup_subkey(const struct regf *regf, const utf16lechar **key_namep,
 
 /* Find the nk cell for the key named @key_name in the registry hive @regf.  */
 static enum hive_status
-lookup_key(const struct regf *regf, const tchar *key_name,
+lookup_key(struct regf *regf, const tchar *key_name,
 	   const struct nk **nk_ret)
 {
 	const struct nk *nk;
@@ -433,7 +596,7 @@ out:
 /* Find the vk cell for the value named @value_name of the key named @key_name
  * in the registry hive @regf.  */
 static enum hive_status
-lookup_value(const struct regf *regf, const tchar *key_name,
+lookup_value(struct regf *regf, const tchar *key_name,
 	     const tchar *value_name, const struct vk **vk_ret)
 {
 	enum hive_status status;
@@ -511,7 +674,7 @@ out:
  * @data_type_ret.  Otherwise, return another HIVE_* error code.
  */
 static enum hive_status
-retrieve_value(const struct regf *regf, const tchar *key_name,
+retrieve_value(struct regf *regf, const tchar *key_name,
 	       const tchar *value_name, void **data_ret,
 	       size_t *data_size_ret, le32 *data_type_ret)
 {
@@ -564,30 +727,77 @@ retrieve_value(const struct regf *regf, const tchar *key_name,
 	return HIVE_OK;
 }
 
-/* Validate the registry hive file given in memory as @hive_mem and @hive_size.
- * If valid, return HIVE_OK.  If invalid, return another HIVE_* error code.  */
+/*
+ * Open the registry hive file of size @hive_size which is read with @read.
+ * Cells are read from the file with @read as they are needed, until the hive is
+ * closed with hive_close().  If the hive is valid, return HIVE_OK and the hive
+ * in @regf_ret.  Otherwise, return another HIVE_* error code.
+ */
 enum hive_status
-hive_validate(const void *hive_mem, size_t hive_size)
+hive_open(hive_read_t read, void *read_ctx, u64 hive_size,
+	  struct regf **regf_ret)
 {
-	const struct regf *regf = hive_mem;
+	struct regf_header *hdr;
+	struct regf *regf;
+	enum hive_status status;
+	int ret;
 
-	STATIC_ASSERT(sizeof(struct regf) == 4096);
+	STATIC_ASSERT(sizeof(struct regf_header) == 4096);
 
-	if (hive_size < sizeof(struct regf))
+	if (hive_size < sizeof(struct regf_header))
 		return HIVE_CORRUPT;
 
-	if (regf->magic != REGF_MAGIC || regf->major_version != REGF_MAJOR)
-		return HIVE_UNSUPPORTED;
+	hdr = MALLOC(sizeof(*hdr));
+	if (!hdr)
+		return HIVE_OUT_OF_MEMORY;
+	ret = (*read)(read_ctx, 0, sizeof(*hdr), hdr);
+	if (ret) {
+		status = translate_wimlib_error(ret);
+		goto out;
+	}
 
-	if (le32_to_cpu(regf->total_hbin_size) > hive_size - sizeof(struct regf))
-		return HIVE_CORRUPT;
+	status = HIVE_UNSUPPORTED;
+	if (hdr->magic != REGF_MAGIC || hdr->major_version != REGF_MAJOR)
+		goto out;
+
+	status = HIVE_CORRUPT;
+	if (le32_to_cpu(hdr->total_hbin_size) >
+	    hive_size - sizeof(struct regf_header))
+		goto out;
+
+	status = HIVE_OUT_OF_MEMORY;
+	regf = CALLOC(1, sizeof(*regf));
+	if (!regf)
+		goto out;
+	regf->read = read;
+	regf->read_ctx = read_ctx;
+	regf->root_key_offset = hdr->root_key_offset;
+	regf->total_hbin_size = le32_to_cpu(hdr->total_hbin_size);
+	regf->read_status = HIVE_OK;
+	*regf_ret = regf;
+	status = HIVE_OK;
+out:
+	FREE(hdr);
+	return status;
+}
 
-	return HIVE_OK;
+/* Close a registry hive opened with hive_open().  */
+void
+hive_close(struct regf *regf)
+{
+	struct cached_cell *cell;
+
+	if (!regf)
+		return;
+	avl_tree_for_each_in_postorder(cell, regf->cells,
+				       struct cached_cell, index_node)
+		FREE(cell);
+	FREE(regf);
 }
 
 /* Get a string value from the registry hive file.  */
 enum hive_status
-hive_get_string(const struct regf *regf, const tchar *key_name,
+hive_get_string(struct regf *regf, const tchar *key_name,
 		const tchar *value_name, tchar **value_ret)
 {
 	void *data;
@@ -596,8 +806,9 @@ hive_get_string(const struct regf *regf, const tchar *key_name,
 	enum hive_status status;
 
 	/* Retrieve the raw value data.  */
-	status = retrieve_value(regf, key_name, value_name,
-				&data, &data_size, &data_type);
+	status = finish_hive_op(regf, retrieve_value(regf, key_name, value_name,
+						     &data, &data_size,
+						     &data_type));
 	if (status != HIVE_OK)
 		return status;
 
@@ -618,7 +829,7 @@ hive_get_string(const struct regf *regf, const tchar *key_name,
 
 /* Get a number value from the registry hive file.  */
 enum hive_status
-hive_get_number(const struct regf *regf, const tchar *key_name,
+hive_get_number(struct regf *regf, const tchar *key_name,
 		const tchar *value_name, s64 *value_ret)
 {
 	void *data;
@@ -627,8 +838,9 @@ hive_get_number(const struct regf *regf, const tchar *key_name,
 	enum hive_status status;
 
 	/* Retrieve the raw value data.  */
-	status = retrieve_value(regf, key_name, value_name,
-				&data, &data_size, &data_type);
+	status = finish_hive_op(regf, retrieve_value(regf, key_name, value_name,
+						     &data, &data_size,
+						     &data_type));
 	if (status != HIVE_OK)
 		return status;
 
@@ -698,7 +910,7 @@ append_subkey_name(const struct nk *sub_nk, void *_next_subkey_p)
 
 /* List the subkeys of the specified registry key.  */
 enum hive_status
-hive_list_subkeys(const struct regf *regf, const tchar *key_name,
+hive_list_subkeys(struct regf *regf, const tchar *key_name,
 		  tchar ***subkeys_ret)
 {
 	enum hive_status status;
@@ -706,7 +918,7 @@ hive_list_subkeys(const struct regf *regf, const tchar *key_name,
 	tchar **subkeys;
 	tchar **next_subkey;
 
-	status = lookup_key(regf, key_name, &nk);
+	status = finish_hive_op(regf, lookup_key(regf, key_name, &nk));
 	if (status != HIVE_OK)
 		return status;
 
@@ -718,7 +930,9 @@ hive_list_subkeys(const struct regf *regf, const tchar *key_name,
 		return HIVE_OUT_OF_MEMORY;
 
 	next_subkey = subkeys;
-	status = iterate_subkeys(regf, nk, append_subkey_name, &next_subkey);
+	status = iterate_subkeys(regf, nk, NULL, append_subkey_name,
+				 &next_subkey);
+	status = finish_hive_op(regf, status);
 	if (status == HIVE_OK)
 		*subkeys_ret = subkeys;
 	else
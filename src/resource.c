@@ -32,13 +32,19 @@
 #include "wimlib/alloca.h"
 #include "wimlib/assert.h"
 #include "wimlib/bitops.h"
+#include "wimlib/blob_reader_pool.h"
 #include "wimlib/blob_table.h"
+#include "wimlib/chunk_cache.h"
+#include "wimlib/chunk_decompressor.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
 #include "wimlib/file_io.h"
 #include "wimlib/ntfs_3g.h"
+#include "wimlib/open_wim_cache.h"
 #include "wimlib/resource.h"
 #include "wimlib/sha1.h"
+#include "wimlib/task_pool.h"
+#include "wimlib/trace.h"
 #include "wimlib/wim.h"
 #include "wimlib/win32.h"
 
@@ -83,6 +89,103 @@ struct data_range {
 	u64 size;
 };
 
+/* Current position in a sorted array of nonoverlapping data ranges  */
+struct data_range_cursor {
+	const struct data_range *cur_range;
+	const struct data_range *end_range;
+	u64 cur_range_pos;
+	u64 cur_range_end;
+};
+
+static void
+init_data_range_cursor(struct data_range_cursor *c,
+		       const struct data_range *ranges, size_t num_ranges)
+{
+	c->cur_range = ranges;
+	c->end_range = &ranges[num_ranges];
+	c->cur_range_pos = ranges[0].offset;
+	c->cur_range_end = ranges[0].offset + ranges[0].size;
+}
+
+/* The most spans of data which are passed to the callback function in one call
+ * when several decompressed chunks are ready at once  */
+#define MAX_BATCHED_SPANS	32
+
+/* Spans of uncompressed data waiting to be passed to the callback function  */
+struct chunk_batch {
+	struct chunk_span spans[MAX_BATCHED_SPANS];
+	size_t num_spans;
+};
+
+static int
+flush_chunk_batch(struct chunk_batch *batch,
+		  const struct consume_chunk_callback *cb)
+{
+	size_t num_spans = batch->num_spans;
+
+	if (num_spans == 0)
+		return 0;
+	batch->num_spans = 0;
+	return consume_chunks(cb, batch->spans, num_spans);
+}
+
+/*
+ * Feed the data in the uncompressed chunk @ubuf, which begins at
+ * @chunk_start_offset in the uncompressed resource and is @chunk_usize bytes
+ * long, to the callback function, taking into account that only the data
+ * covered by the ranges should be passed on and that the data passed in each
+ * call must not cross range boundaries.  The chunk must contain the current
+ * position of the range cursor, which is advanced past the chunk.
+ *
+ * If @batch is not NULL, the data is added to it instead, and the callback
+ * function is only called when it fills up.  The caller must keep @ubuf valid
+ * until it flushes the batch.
+ */
+static int
+consume_chunk_ranges(struct data_range_cursor *c, const u8 *ubuf,
+		     u64 chunk_start_offset, u32 chunk_usize,
+		     const struct consume_chunk_callback *cb,
+		     struct chunk_batch *batch)
+{
+	const u64 chunk_end_offset = chunk_start_offset + chunk_usize;
+	int ret;
+
+	do {
+		size_t start, end, size;
+
+		start = c->cur_range_pos - chunk_start_offset;
+		end = min(c->cur_range_end, chunk_end_offset) - chunk_start_offset;
+		size = end - start;
+
+		if (batch) {
+			if (batch->num_spans == MAX_BATCHED_SPANS) {
+				ret = flush_chunk_batch(batch, cb);
+				if (unlikely(ret))
+					return ret;
+			}
+			batch->spans[batch->num_spans++] =
+				(struct chunk_span) { &ubuf[start], size };
+		} else {
+			ret = consume_chunk(cb, &ubuf[start], size);
+			if (unlikely(ret))
+				return ret;
+		}
+
+		c->cur_range_pos += size;
+		if (c->cur_range_pos == c->cur_range_end) {
+			/* Advance to next range.  */
+			if (++c->cur_range == c->end_range) {
+				c->cur_range_pos = ~0ULL;
+			} else {
+				c->cur_range_pos = c->cur_range->offset;
+				c->cur_range_end = c->cur_range->offset +
+						   c->cur_range->size;
+			}
+		}
+	} while (c->cur_range_pos < chunk_end_offset);
+	return 0;
+}
+
 static int
 decompress_chunk(const void *cbuf, u32 chunk_csize, u8 *ubuf, u32 chunk_usize,
 		 struct wimlib_decompressor *decompressor, bool recover_data)
@@ -111,6 +214,323 @@ decompress_chunk(const void *cbuf, u32 chunk_csize, u8 *ubuf, u32 chunk_usize,
 	return WIMLIB_ERR_DECOMPRESSION;
 }
 
+/*
+ * Return the compressed size of chunk @i of a non-pipe-read compressed resource,
+ * given the offsets of the chunks starting at @read_start_chunk.
+ */
+static u32
+get_compressed_chunk_size(const struct wim_resource_descriptor *rdesc,
+			  const u64 *chunk_offsets, u64 i, u64 read_start_chunk,
+			  u64 num_chunks, u64 chunk_table_full_size)
+{
+	u32 chunk_csize;
+
+	if (i == num_chunks - 1) {
+		chunk_csize = rdesc->size_in_wim -
+			      chunk_table_full_size -
+			      chunk_offsets[i - read_start_chunk];
+		if (rdesc->is_pipable)
+			chunk_csize -= num_chunks * sizeof(struct pwm_chunk_hdr);
+	} else {
+		chunk_csize = chunk_offsets[i + 1 - read_start_chunk] -
+			      chunk_offsets[i - read_start_chunk];
+	}
+	return chunk_csize;
+}
+
+/* Get a decompressor for the specified compression type and chunk size, taking
+ * the one cached in the WIMStruct if it matches.  The caller takes ownership and
+ * must give it back with put_decompressor() when done.  */
+static int
+get_decompressor(WIMStruct *wim, int ctype, u32 chunk_size,
+		 struct wimlib_decompressor **decompressor_ret)
+{
+	if (likely(ctype == wim->decompressor_ctype &&
+		   chunk_size == wim->decompressor_max_block_size))
+	{
+		*decompressor_ret = wim->decompressor;
+		wim->decompressor_ctype = WIMLIB_COMPRESSION_TYPE_NONE;
+		wim->decompressor = NULL;
+		return 0;
+	}
+	return wimlib_create_decompressor(ctype, chunk_size, decompressor_ret);
+}
+
+/* Cache the specified decompressor in the WIMStruct, replacing any other.  */
+static void
+put_decompressor(WIMStruct *wim, int ctype, u32 chunk_size,
+		 struct wimlib_decompressor *decompressor)
+{
+	wimlib_free_decompressor(wim->decompressor);
+	wim->decompressor = decompressor;
+	wim->decompressor_ctype = ctype;
+	wim->decompressor_max_block_size = chunk_size;
+}
+
+/*
+ * Get a parallel chunk decompressor for the specified compression type and
+ * chunk size, using the number of threads configured for the WIM.  Like the
+ * serial decompressor, the most recently used one is cached in the WIMStruct;
+ * the caller takes ownership and must give it back when done.  Returns NULL if
+ * the data should be decompressed serially instead.
+ */
+static struct chunk_decompressor *
+get_parallel_decompressor(WIMStruct *wim, int ctype, u32 chunk_size)
+{
+	struct chunk_decompressor *parallel_decompressor;
+	int ret;
+
+	parallel_decompressor = wim->parallel_decompressor;
+	if (parallel_decompressor &&
+	    parallel_decompressor->in_ctype == ctype &&
+	    parallel_decompressor->in_chunk_size == chunk_size)
+	{
+		wim->parallel_decompressor = NULL;
+		return parallel_decompressor;
+	}
+
+	ret = new_parallel_chunk_decompressor(ctype, chunk_size,
+					      wim->num_decompression_threads, 0,
+					      &parallel_decompressor);
+	if (ret == 0)
+		return parallel_decompressor;
+	if (ret > 0) {
+		WARNING("Couldn't create parallel chunk decompressor: %"TS".\n"
+			"          Falling back to single-threaded decompression.",
+			wimlib_get_error_string(ret));
+		wim->num_decompression_threads = 1;
+	}
+	return NULL;
+}
+
+/*
+ * Retrieve the next chunk from the parallel chunk decompressor, along with any
+ * following chunks that are ready too, and feed the needed data from them to
+ * the callback function in one batch.  The first chunk is the one that
+ * contains the current position of the range cursor.
+ */
+static int
+consume_decompressed_chunks(struct chunk_decompressor *parallel_decompressor,
+			    struct data_range_cursor *cursor, u32 chunk_order,
+			    struct wimlib_decompressor *decompressor,
+			    const struct consume_chunk_callback *cb,
+			    bool recover_data)
+{
+	struct chunk_batch batch;
+	int ret;
+
+	batch.num_spans = 0;
+	do {
+		const void *cdata;
+		void *udata;
+		u32 csize, usize;
+		bool failed;
+		bool ok;
+
+		ok = parallel_decompressor->get_decompression_result(
+				parallel_decompressor, &cdata, &csize,
+				&udata, &usize, &failed);
+		wimlib_assert(ok);
+
+		if (unlikely(failed)) {
+			/* Retry serially, which also handles data recovery.  */
+			ret = decompress_chunk(cdata, csize, udata, usize,
+					       decompressor, recover_data);
+			if (ret)
+				return ret;
+		}
+
+		ret = consume_chunk_ranges(cursor, udata,
+					   cursor->cur_range_pos &
+						~(((u64)1 << chunk_order) - 1),
+					   usize, cb, &batch);
+		if (unlikely(ret))
+			return ret;
+	} while (parallel_decompressor->result_ready(parallel_decompressor));
+
+	return flush_chunk_batch(&batch, cb);
+}
+
+/* Return the file offset of the chunk table of a compressed resource.  */
+static u64
+get_chunk_table_offset(const struct wim_resource_descriptor *rdesc)
+{
+	if (rdesc->flags & WIM_RESHDR_FLAG_SOLID)
+		return rdesc->offset_in_wim +
+		       sizeof(struct alt_chunk_table_header_disk);
+	return rdesc->offset_in_wim;
+}
+
+/* Return the size in bytes of the chunk table of a compressed resource which
+ * has @num_chunks chunks.  */
+static u64
+get_chunk_table_size(const struct wim_resource_descriptor *rdesc,
+		     u64 num_chunks)
+{
+	const bool alt_chunk_table = (rdesc->flags & WIM_RESHDR_FLAG_SOLID);
+	const u64 num_chunk_entries = (alt_chunk_table ? num_chunks :
+						       num_chunks - 1);
+
+	return num_chunk_entries *
+	       get_chunk_entry_size(rdesc->uncompressed_size, alt_chunk_table);
+}
+
+/*
+ * Read the chunk table of a compressed resource that isn't pipable, and return
+ * it as an array of the file offsets of the chunks, followed by the file offset
+ * of the end of the last chunk.
+ */
+static int
+read_chunk_table_offsets(const struct wim_resource_descriptor *rdesc,
+			 u64 num_chunks, u64 **offsets_ret)
+{
+	const bool alt_chunk_table = (rdesc->flags & WIM_RESHDR_FLAG_SOLID);
+	const u64 chunk_entry_size = get_chunk_entry_size(rdesc->uncompressed_size,
+							  alt_chunk_table);
+	const u64 chunk_table_offset = get_chunk_table_offset(rdesc);
+	const u64 chunk_table_size = get_chunk_table_size(rdesc, num_chunks);
+	const u64 data_offset = chunk_table_offset + chunk_table_size;
+	const u64 res_end = rdesc->offset_in_wim + rdesc->size_in_wim;
+	u64 *offsets;
+	void *raw_entries;
+	int ret;
+
+	if (unlikely(data_offset > res_end)) {
+		ERROR("Invalid chunk table in compressed resource!");
+		errno = EINVAL;
+		return WIMLIB_ERR_DECOMPRESSION;
+	}
+
+	if (unlikely((size_t)((num_chunks + 1) * sizeof(offsets[0])) !=
+		     (num_chunks + 1) * sizeof(offsets[0])))
+		goto oom;
+	offsets = MALLOC((num_chunks + 1) * sizeof(offsets[0]));
+	raw_entries = MALLOC(max(chunk_table_size, 1));
+	if (unlikely(!offsets || !raw_entries)) {
+		FREE(raw_entries);
+		FREE(offsets);
+		goto oom;
+	}
+
+	ret = full_pread(&rdesc->wim->in_fd, raw_entries, chunk_table_size,
+			 chunk_table_offset);
+	if (unlikely(ret)) {
+		ERROR_WITH_ERRNO("Error reading data from WIM file");
+		FREE(raw_entries);
+		FREE(offsets);
+		return ret;
+	}
+
+	if (alt_chunk_table) {
+		const le32 *entries = raw_entries;
+		u64 cur_offset = data_offset;
+
+		for (u64 i = 0; i < num_chunks; i++) {
+			offsets[i] = cur_offset;
+			cur_offset += le32_to_cpu(entries[i]);
+		}
+		offsets[num_chunks] = cur_offset;
+	} else {
+		offsets[0] = data_offset;
+		if (chunk_entry_size == 4) {
+			const le32 *entries = raw_entries;
+
+			for (u64 i = 1; i < num_chunks; i++)
+				offsets[i] = data_offset +
+					     le32_to_cpu(entries[i - 1]);
+		} else {
+			const le64 *entries = raw_entries;
+
+			for (u64 i = 1; i < num_chunks; i++)
+				offsets[i] = data_offset +
+					     le64_to_cpu(entries[i - 1]);
+		}
+		offsets[num_chunks] = res_end;
+	}
+	FREE(raw_entries);
+	*offsets_ret = offsets;
+	return 0;
+
+oom:
+	ERROR("Out of memory while reading compressed WIM resource");
+	errno = ENOMEM;
+	return WIMLIB_ERR_NOMEM;
+}
+
+/*
+ * Get the offsets, from the start of the chunk data, of the chunks of a
+ * compressed resource that isn't pipable, followed by the offset of the end of
+ * the last chunk, if they are cached in the resource descriptor.  If they
+ * aren't, then if @may_cache is true and the WIMStruct's budget for cached
+ * chunk tables allows, read them and cache them first.  Otherwise return NULL
+ * in *offsets_ret.
+ *
+ * The cache saves reading and parsing the chunk table again for each read of
+ * part of the resource, which matters for random access to many small blobs
+ * in a large resource, especially a solid one, whose chunk table must be read
+ * from its start to find any chunk.  Since the offsets are relative to the
+ * resource, they stay valid if the resource is moved within the WIM file.
+ *
+ * Threads reading through the chunk cache may call this on the same resource
+ * at the same time, so the offsets are installed atomically.
+ */
+static int
+get_cached_chunk_offsets(struct wim_resource_descriptor *rdesc,
+			 u64 num_chunks, bool may_cache, u64 **offsets_ret)
+{
+	WIMStruct *wim = rdesc->wim;
+	const u64 size = (num_chunks + 1) * sizeof(u64);
+	u64 cached_size;
+	u64 *offsets;
+	u64 *prev_offsets = NULL;
+	u64 data_offset;
+	int ret;
+
+	*offsets_ret = __atomic_load_n(&rdesc->chunk_offsets, __ATOMIC_ACQUIRE);
+	if (*offsets_ret || !may_cache)
+		return 0;
+	cached_size = __atomic_load_n(&wim->cached_chunk_offsets_size,
+				      __ATOMIC_RELAXED);
+	if (cached_size > MAX_CACHED_CHUNK_OFFSETS_SIZE ||
+	    size > MAX_CACHED_CHUNK_OFFSETS_SIZE - cached_size)
+		return 0;
+
+	ret = read_chunk_table_offsets(rdesc, num_chunks, &offsets);
+	if (ret)
+		return ret;
+	data_offset = offsets[0];
+	for (u64 i = 0; i <= num_chunks; i++)
+		offsets[i] -= data_offset;
+	if (__atomic_compare_exchange_n(&rdesc->chunk_offsets, &prev_offsets,
+					offsets, false, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE)) {
+		__atomic_add_fetch(&wim->cached_chunk_offsets_size, size,
+				   __ATOMIC_RELAXED);
+	} else {
+		/* Another thread cached the offsets first.  */
+		FREE(offsets);
+		offsets = prev_offsets;
+	}
+	*offsets_ret = offsets;
+	return 0;
+}
+
+/* Free the chunk offsets cached in a resource descriptor, if any.  */
+void
+free_cached_chunk_offsets(struct wim_resource_descriptor *rdesc)
+{
+	if (rdesc->chunk_offsets) {
+		u64 num_chunks = DIV_ROUND_UP(rdesc->uncompressed_size,
+					      rdesc->chunk_size);
+
+		__atomic_sub_fetch(&rdesc->wim->cached_chunk_offsets_size,
+				   (num_chunks + 1) * sizeof(u64),
+				   __ATOMIC_RELAXED);
+		FREE(rdesc->chunk_offsets);
+		rdesc->chunk_offsets = NULL;
+	}
+}
+
 /*
  * Read data from a compressed WIM resource.
  *
@@ -142,7 +562,7 @@ decompress_chunk(const void *cbuf, u32 chunk_csize, u8 *ubuf, u32 chunk_usize,
  *	or other error code returned by the callback function.
  */
 static int
-read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
+read_compressed_wim_resource(struct wim_resource_descriptor * const rdesc,
 			     const struct data_range * const ranges,
 			     const size_t num_ranges,
 			     const struct consume_chunk_callback *cb,
@@ -156,6 +576,8 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	bool ubuf_malloced = false;
 	bool cbuf_malloced = false;
 	struct wimlib_decompressor *decompressor = NULL;
+	struct chunk_decompressor *parallel_decompressor = NULL;
+	u64 trace_start = trace_begin();
 
 	/* Sanity checks  */
 	wimlib_assert(num_ranges != 0);
@@ -203,21 +625,11 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	}
 
 	/* Get valid decompressor.  */
-	if (likely(ctype == rdesc->wim->decompressor_ctype &&
-		   chunk_size == rdesc->wim->decompressor_max_block_size))
-	{
-		/* Cached decompressor.  */
-		decompressor = rdesc->wim->decompressor;
-		rdesc->wim->decompressor_ctype = WIMLIB_COMPRESSION_TYPE_NONE;
-		rdesc->wim->decompressor = NULL;
-	} else {
-		ret = wimlib_create_decompressor(ctype, chunk_size,
-						 &decompressor);
-		if (unlikely(ret)) {
-			if (ret != WIMLIB_ERR_NOMEM)
-				errno = EINVAL;
-			goto out_cleanup;
-		}
+	ret = get_decompressor(rdesc->wim, ctype, chunk_size, &decompressor);
+	if (unlikely(ret)) {
+		if (ret != WIMLIB_ERR_NOMEM)
+			errno = EINVAL;
+		goto out_cleanup;
 	}
 
 	const u32 chunk_order = bsr32(chunk_size);
@@ -261,7 +673,23 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 		(alt_chunk_table) ? chunk_table_size + sizeof(struct alt_chunk_table_header_disk)
 				  : chunk_table_size;
 
-	if (!is_pipe_read) {
+	/* Use the chunk offsets cached in the resource descriptor, if any.
+	 * Otherwise, unless the whole resource is being read, cache them now,
+	 * since more reads of parts of the resource are likely to follow.  */
+	u64 *cached_chunk_offsets = NULL;
+	if (!is_pipe_read && !rdesc->is_pipable) {
+		ret = get_cached_chunk_offsets(rdesc, num_chunks,
+					       first_needed_chunk != 0 ||
+					       last_needed_chunk != num_chunks - 1,
+					       &cached_chunk_offsets);
+		if (unlikely(ret))
+			goto out_cleanup;
+	}
+
+	if (cached_chunk_offsets) {
+		chunk_offsets = &cached_chunk_offsets[read_start_chunk];
+		cur_read_offset += chunk_table_size + chunk_offsets[0];
+	} else if (!is_pipe_read) {
 		/* Read the needed chunk table entries into memory and use them
 		 * to initialize the chunk_offsets array.  */
 
@@ -372,8 +800,35 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 			cur_read_offset += chunk_table_size;
 	}
 
+	/* Keep the upcoming chunks requested from the OS as we go.  */
+	struct read_ahead ra;
+	read_ahead_init(&ra, cur_read_offset,
+			is_pipe_read ? 0 : rdesc->offset_in_wim +
+					   rdesc->size_in_wim - cur_read_offset);
+
+	/* Set current data range.  */
+	struct data_range_cursor cursor;
+	init_data_range_cursor(&cursor, ranges, num_ranges);
+	const struct data_range *next_needed_range = ranges;
+
+	/* Decompress the chunks in parallel, if enabled and worthwhile.  This
+	 * works for solid resources too, since their chunks are compressed
+	 * independently as well; the chunks are still consumed in order, so the
+	 * blobifier sees the same sequence of data either way.  It also works
+	 * for pipe reads, since the chunks are still read in order and the
+	 * chunks that aren't needed are skipped over by the next read.  */
+	if (last_needed_chunk > read_start_chunk &&
+	    rdesc->wim->num_decompression_threads != 1)
+	{
+		parallel_decompressor = get_parallel_decompressor(rdesc->wim,
+								  ctype,
+								  chunk_size);
+	}
+
 	/* Allocate buffer for holding the uncompressed data of each chunk.  */
-	if (chunk_size <= STACK_MAX) {
+	if (parallel_decompressor) {
+		/* The chunk decompressor has its own buffers.  */
+	} else if (chunk_size <= STACK_MAX) {
 		ubuf = alloca(chunk_size);
 	} else {
 		ubuf = MALLOC(chunk_size);
@@ -386,7 +841,9 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	 * which can be at most @chunk_size - 1 bytes.  This excludes compressed
 	 * chunks that are a full @chunk_size bytes, which are actually stored
 	 * uncompressed.  */
-	if (chunk_size - 1 <= STACK_MAX) {
+	if (parallel_decompressor) {
+		/* The chunk decompressor has its own buffers.  */
+	} else if (chunk_size - 1 <= STACK_MAX) {
 		cbuf = alloca(chunk_size - 1);
 	} else {
 		cbuf = MALLOC(chunk_size - 1);
@@ -395,12 +852,6 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 		cbuf_malloced = true;
 	}
 
-	/* Set current data range.  */
-	const struct data_range *cur_range = ranges;
-	const struct data_range * const end_range = &ranges[num_ranges];
-	u64 cur_range_pos = cur_range->offset;
-	u64 cur_range_end = cur_range->offset + cur_range->size;
-
 	/* Read and process each needed chunk.  */
 	for (u64 i = read_start_chunk; i <= last_needed_chunk; i++) {
 
@@ -422,16 +873,10 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 				goto read_error;
 			chunk_csize = le32_to_cpu(chunk_hdr.compressed_size);
 		} else {
-			if (i == num_chunks - 1) {
-				chunk_csize = rdesc->size_in_wim -
-					      chunk_table_full_size -
-					      chunk_offsets[i - read_start_chunk];
-				if (rdesc->is_pipable)
-					chunk_csize -= num_chunks * sizeof(struct pwm_chunk_hdr);
-			} else {
-				chunk_csize = chunk_offsets[i + 1 - read_start_chunk] -
-					      chunk_offsets[i - read_start_chunk];
-			}
+			chunk_csize = get_compressed_chunk_size(rdesc, chunk_offsets,
+								i, read_start_chunk,
+								num_chunks,
+								chunk_table_full_size);
 		}
 		if (unlikely(chunk_csize == 0 || chunk_csize > chunk_usize)) {
 			ERROR("Invalid chunk size in compressed resource!");
@@ -447,7 +892,50 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 		const u64 chunk_start_offset = i << chunk_order;
 		const u64 chunk_end_offset = chunk_start_offset + chunk_usize;
 
-		if (chunk_end_offset <= cur_range_pos) {
+		if (parallel_decompressor) {
+			void *chunk_buf;
+
+			/* Skip over any ranges that end before this chunk.
+			 * The range cursor can't be used for this, since it
+			 * lags behind while chunks are being decompressed.  */
+			while (next_needed_range != cursor.end_range &&
+			       next_needed_range->offset +
+					next_needed_range->size <= chunk_start_offset)
+				next_needed_range++;
+
+			if (next_needed_range == cursor.end_range ||
+			    next_needed_range->offset >= chunk_end_offset)
+			{
+				/* No range requires data in this chunk.  */
+				cur_read_offset += chunk_csize;
+				continue;
+			}
+
+			read_ahead_advance(in_fd, &ra, cur_read_offset);
+
+			/* Read the chunk and submit it for decompression,
+			 * first retrieving an earlier chunk if no buffer is
+			 * free.  */
+			while (!(chunk_buf = parallel_decompressor->get_chunk_buffer(
+							parallel_decompressor)))
+			{
+				ret = consume_decompressed_chunks(parallel_decompressor,
+								  &cursor,
+								  chunk_order,
+								  decompressor,
+								  cb, recover_data);
+				if (unlikely(ret))
+					goto out_cleanup;
+			}
+			ret = full_pread(in_fd, chunk_buf, chunk_csize,
+					 cur_read_offset);
+			if (unlikely(ret))
+				goto read_error;
+			parallel_decompressor->signal_chunk_filled(parallel_decompressor,
+								   chunk_csize,
+								   chunk_usize);
+			cur_read_offset += chunk_csize;
+		} else if (chunk_end_offset <= cursor.cur_range_pos) {
 
 			/* The next range does not require data in this chunk,
 			 * so skip it.  */
@@ -462,59 +950,78 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 		} else {
 
 			/* Read the chunk and feed data to the callback
-			 * function.  */
+			 * function.  If the WIM file is mapped into memory,
+			 * then the chunk is used directly from the mapping
+			 * instead of being read into a buffer.  If the chunk is
+			 * needed in full, then it is decompressed (or read, if
+			 * it's stored uncompressed) straight into the
+			 * callback's buffer, if it has one.  */
+			const u8 *chunk_data;
 			u8 *read_buf;
+			u8 *out_buf = ubuf;
+
+			if (cursor.cur_range_pos == chunk_start_offset &&
+			    cursor.cur_range_end >= chunk_end_offset)
+			{
+				void *dest;
+				size_t dest_size = chunk_usize;
+
+				ret = get_consume_chunk_dest(cb, &dest,
+							     &dest_size);
+				if (unlikely(ret))
+					goto out_cleanup;
+				if (dest && dest_size == chunk_usize)
+					out_buf = dest;
+			}
 
 			if (chunk_csize == chunk_usize)
-				read_buf = ubuf;
+				read_buf = out_buf;
 			else
 				read_buf = cbuf;
 
-			ret = full_pread(in_fd,
-					 read_buf,
-					 chunk_csize,
-					 cur_read_offset);
-			if (unlikely(ret))
-				goto read_error;
+			chunk_data = filedes_mapped_data(in_fd, cur_read_offset,
+							 chunk_csize);
+			if (!chunk_data) {
+				read_ahead_advance(in_fd, &ra, cur_read_offset);
+
+				ret = full_pread(in_fd,
+						 read_buf,
+						 chunk_csize,
+						 cur_read_offset);
+				if (unlikely(ret))
+					goto read_error;
+				chunk_data = read_buf;
+			}
 
 			if (read_buf == cbuf) {
-				ret = decompress_chunk(cbuf, chunk_csize,
-						       ubuf, chunk_usize,
+				ret = decompress_chunk(chunk_data, chunk_csize,
+						       out_buf, chunk_usize,
 						       decompressor,
 						       recover_data);
 				if (unlikely(ret))
 					goto out_cleanup;
+				chunk_data = out_buf;
 			}
 			cur_read_offset += chunk_csize;
 
 			/* At least one range requires data in this chunk.  */
-			do {
-				size_t start, end, size;
-
-				/* Calculate how many bytes of data should be
-				 * sent to the callback function, taking into
-				 * account that data sent to the callback
-				 * function must not overlap range boundaries.
-				 */
-				start = cur_range_pos - chunk_start_offset;
-				end = min(cur_range_end, chunk_end_offset) - chunk_start_offset;
-				size = end - start;
-
-				ret = consume_chunk(cb, &ubuf[start], size);
-				if (unlikely(ret))
-					goto out_cleanup;
+			ret = consume_chunk_ranges(&cursor, chunk_data,
+						   chunk_start_offset,
+						   chunk_usize, cb, NULL);
+			if (unlikely(ret))
+				goto out_cleanup;
+		}
+	}
 
-				cur_range_pos += size;
-				if (cur_range_pos == cur_range_end) {
-					/* Advance to next range.  */
-					if (++cur_range == end_range) {
-						cur_range_pos = ~0ULL;
-					} else {
-						cur_range_pos = cur_range->offset;
-						cur_range_end = cur_range->offset + cur_range->size;
-					}
-				}
-			} while (cur_range_pos < chunk_end_offset);
+	/* Retrieve any chunks still being decompressed.  */
+	if (parallel_decompressor) {
+		while (cursor.cur_range != cursor.end_range) {
+			ret = consume_decompressed_chunks(parallel_decompressor,
+							  &cursor, chunk_order,
+							  decompressor,
+							  cb, recover_data);
+			if (unlikely(ret))
+				goto out_cleanup;
 		}
 	}
 
@@ -535,11 +1042,24 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	ret = 0;
 
 out_cleanup:
-	if (decompressor) {
-		wimlib_free_decompressor(rdesc->wim->decompressor);
-		rdesc->wim->decompressor = decompressor;
-		rdesc->wim->decompressor_ctype = ctype;
-		rdesc->wim->decompressor_max_block_size = chunk_size;
+	if (decompressor)
+		put_decompressor(rdesc->wim, ctype, chunk_size, decompressor);
+	if (parallel_decompressor) {
+		/* On error, discard any chunks that are still pending so that
+		 * the chunk decompressor can be reused.  */
+		const void *cdata;
+		void *udata;
+		u32 csize, usize;
+		bool failed;
+
+		while (parallel_decompressor->get_decompression_result(
+				parallel_decompressor, &cdata, &csize,
+				&udata, &usize, &failed))
+			;
+		if (rdesc->wim->parallel_decompressor)
+			rdesc->wim->parallel_decompressor->destroy(
+					rdesc->wim->parallel_decompressor);
+		rdesc->wim->parallel_decompressor = parallel_decompressor;
 	}
 	if (chunk_offsets_malloced)
 		FREE(chunk_offsets);
@@ -547,6 +1067,7 @@ out_cleanup:
 		FREE(ubuf);
 	if (cbuf_malloced)
 		FREE(cbuf);
+	trace_end("read_compressed_wim_resource", trace_start);
 	return ret;
 
 oom:
@@ -559,6 +1080,186 @@ read_error:
 	goto out_cleanup;
 }
 
+/*
+ * Get the file offsets of the start and end of chunk @chunk_idx of a compressed
+ * resource that isn't pipable, using the chunk offsets cached in the resource
+ * descriptor.  If the budget for cached chunk tables is used up, the chunk
+ * table is read again instead.
+ */
+static int
+get_cached_chunk_location(struct wim_resource_descriptor *rdesc,
+			  u64 num_chunks, u64 chunk_idx,
+			  u64 *start_ret, u64 *end_ret)
+{
+	u64 *offsets;
+	u64 data_offset;
+	int ret;
+
+	ret = get_cached_chunk_offsets(rdesc, num_chunks, true, &offsets);
+	if (ret)
+		return ret;
+	if (offsets) {
+		data_offset = get_chunk_table_offset(rdesc) +
+			      get_chunk_table_size(rdesc, num_chunks);
+		*start_ret = data_offset + offsets[chunk_idx];
+		*end_ret = data_offset + offsets[chunk_idx + 1];
+		return 0;
+	}
+
+	ret = read_chunk_table_offsets(rdesc, num_chunks, &offsets);
+	if (ret)
+		return ret;
+	*start_ret = offsets[chunk_idx];
+	*end_ret = offsets[chunk_idx + 1];
+	FREE(offsets);
+	return 0;
+}
+
+/*
+ * Read data from a compressed WIM resource that isn't pipable into a buffer,
+ * using the WIMStruct's chunk cache.  Chunks which are cached are used
+ * directly; other chunks are read and decompressed, then added to the cache.
+ * This is meant for many small reads in random order, such as those done by a
+ * mounted image, where it avoids reading and decompressing the same chunks
+ * again and again.
+ *
+ * This may be called by multiple threads at the same time.  Each uses its own
+ * decompressor, taken from the chunk cache rather than from the WIMStruct.
+ *
+ * @buf may be NULL to only bring the chunks into the cache, as for read-ahead.
+ *
+ * Possible return values are the same as for read_compressed_wim_resource(),
+ * with errno set as well.
+ */
+static int
+read_cached_wim_resource(struct wim_resource_descriptor *rdesc,
+			 u64 offset, u64 size, void *buf)
+{
+	struct chunk_cache * const cache = rdesc->wim->chunk_cache;
+	struct filedes * const in_fd = &rdesc->wim->in_fd;
+	const int ctype = rdesc->compression_type;
+	const u32 chunk_size = rdesc->chunk_size;
+	struct wimlib_decompressor *decompressor = NULL;
+	u8 *cbuf = NULL;
+	u8 *udata;
+	u8 *p = buf;
+	u32 chunk_order;
+	u64 num_chunks;
+	int ret;
+
+	if (unlikely(!is_power_of_2(chunk_size))) {
+		ERROR("Invalid compressed resource: "
+		      "expected power-of-2 chunk size (got %"PRIu32")",
+		      chunk_size);
+		errno = EINVAL;
+		return WIMLIB_ERR_INVALID_CHUNK_SIZE;
+	}
+	chunk_order = bsr32(chunk_size);
+	num_chunks = (rdesc->uncompressed_size + chunk_size - 1) >> chunk_order;
+
+	for (u64 i = offset >> chunk_order; size != 0; i++) {
+		const u32 skip = offset - (i << chunk_order);
+		u32 chunk_usize = chunk_size;
+		u64 chunk_start, chunk_end;
+		u64 chunk_csize;
+		u32 n;
+
+		if (i == num_chunks - 1 &&
+		    (rdesc->uncompressed_size & (chunk_size - 1)))
+			chunk_usize = rdesc->uncompressed_size & (chunk_size - 1);
+
+		n = min(chunk_usize - skip, size);
+
+		if (chunk_cache_read_chunk(cache, rdesc->offset_in_wim, i,
+					   skip, n, p))
+			goto next_chunk;
+
+		ret = get_cached_chunk_location(rdesc, num_chunks, i,
+						&chunk_start, &chunk_end);
+		if (ret)
+			goto out;
+		chunk_csize = chunk_end - chunk_start;
+		if (unlikely(chunk_end < chunk_start || chunk_csize == 0 ||
+			     chunk_csize > chunk_usize))
+		{
+			ERROR("Invalid chunk size in compressed resource!");
+			errno = EINVAL;
+			ret = WIMLIB_ERR_DECOMPRESSION;
+			goto out;
+		}
+
+		udata = MALLOC(chunk_usize);
+		if (unlikely(!udata))
+			goto oom;
+
+		if (chunk_csize == chunk_usize) {
+			/* Chunk is stored uncompressed.  */
+			ret = full_pread(in_fd, udata, chunk_usize, chunk_start);
+			if (unlikely(ret))
+				goto read_error;
+		} else {
+			if (!decompressor) {
+				decompressor = chunk_cache_get_decompressor(
+						cache, ctype, chunk_size);
+			}
+			if (!decompressor) {
+				ret = wimlib_create_decompressor(ctype,
+								 chunk_size,
+								 &decompressor);
+				if (unlikely(ret)) {
+					FREE(udata);
+					if (ret != WIMLIB_ERR_NOMEM)
+						errno = EINVAL;
+					goto out;
+				}
+			}
+			if (!cbuf) {
+				cbuf = MALLOC(chunk_size - 1);
+				if (unlikely(!cbuf)) {
+					FREE(udata);
+					goto oom;
+				}
+			}
+			ret = full_pread(in_fd, cbuf, chunk_csize, chunk_start);
+			if (unlikely(ret))
+				goto read_error;
+			ret = decompress_chunk(cbuf, chunk_csize, udata,
+					       chunk_usize, decompressor, false);
+			if (unlikely(ret)) {
+				FREE(udata);
+				goto out;
+			}
+		}
+		if (p)
+			memcpy(p, &udata[skip], n);
+		chunk_cache_add_chunk(cache, rdesc->offset_in_wim, i,
+				      udata, chunk_usize);
+	next_chunk:
+		if (p)
+			p += n;
+		offset += n;
+		size -= n;
+	}
+	ret = 0;
+out:
+	if (decompressor)
+		chunk_cache_put_decompressor(cache, ctype, chunk_size,
+					     decompressor);
+	FREE(cbuf);
+	return ret;
+
+oom:
+	ERROR("Out of memory while reading compressed WIM resource");
+	errno = ENOMEM;
+	ret = WIMLIB_ERR_NOMEM;
+	goto out;
+
+read_error:
+	ERROR_WITH_ERRNO("Error reading data from WIM file");
+	FREE(udata);
+	goto out;
+}
+
 /* Read raw data from a file descriptor at the specified offset, feeding the
  * data in nonempty chunks into the specified callback function.  */
 static int
@@ -568,14 +1269,31 @@ read_raw_file_data(struct filedes *in_fd, u64 offset, u64 size,
 {
 	u8 buf[BUFFER_SIZE];
 	size_t bytes_to_read;
+	struct read_ahead ra;
 	int ret;
 
+	read_ahead_init(&ra, offset, size);
 	while (size) {
+		const void *data;
+		void *dest;
+
 		bytes_to_read = min(sizeof(buf), size);
-		ret = full_pread(in_fd, buf, bytes_to_read, offset);
-		if (unlikely(ret))
-			goto read_error;
-		ret = consume_chunk(cb, buf, bytes_to_read);
+		data = filedes_mapped_data(in_fd, offset, bytes_to_read);
+		if (!data) {
+			/* Read straight into the consumer's buffer, if it has
+			 * one, rather than into @buf.  */
+			ret = get_consume_chunk_dest(cb, &dest, &bytes_to_read);
+			if (unlikely(ret))
+				return ret;
+			if (!dest)
+				dest = buf;
+			read_ahead_advance(in_fd, &ra, offset);
+			ret = full_pread(in_fd, dest, bytes_to_read, offset);
+			if (unlikely(ret))
+				goto read_error;
+			data = dest;
+		}
+		ret = consume_chunk(cb, data, bytes_to_read);
 		if (unlikely(ret))
 			return ret;
 		size -= bytes_to_read;
@@ -617,7 +1335,7 @@ bufferer_cb(const void *chunk, size_t size, void *_ctx)
  * function; or a nonzero wimlib error code with errno set as well.
  */
 static int
-read_partial_wim_resource(const struct wim_resource_descriptor *rdesc,
+read_partial_wim_resource(struct wim_resource_descriptor *rdesc,
 			  const u64 offset, const u64 size,
 			  const struct consume_chunk_callback *cb,
 			  bool recover_data)
@@ -642,22 +1360,66 @@ read_partial_wim_resource(const struct wim_resource_descriptor *rdesc,
 				  size, cb, NULL);
 }
 
+static bool
+use_chunk_cache(const struct wim_resource_descriptor *rdesc)
+{
+	return rdesc->wim->chunk_cache && !rdesc->is_pipable &&
+		(rdesc->flags & (WIM_RESHDR_FLAG_COMPRESSED |
+				 WIM_RESHDR_FLAG_SOLID));
+}
+
+/* Return true if read_partial_wim_blob_into_buf() may be called on the
+ * specified blob, which must be located in a WIM file, by multiple threads at
+ * the same time.  This is the case if the blob is uncompressed or if it will be
+ * read through a chunk cache.  */
+bool
+can_read_partial_wim_blob_concurrently(const struct blob_descriptor *blob)
+{
+	const struct wim_resource_descriptor *rdesc = blob->rdesc;
+
+	return !(rdesc->flags & (WIM_RESHDR_FLAG_COMPRESSED |
+				 WIM_RESHDR_FLAG_SOLID)) ||
+		use_chunk_cache(rdesc);
+}
+
 /* Read the specified range of uncompressed data from the specified blob, which
  * must be located in a WIM file, into the specified buffer.  */
 int
 read_partial_wim_blob_into_buf(const struct blob_descriptor *blob,
 			       u64 offset, size_t size, void *buf)
 {
+	struct wim_resource_descriptor *rdesc = blob->rdesc;
 	struct consume_chunk_callback cb = {
 		.func	= bufferer_cb,
 		.ctx	= &buf,
 	};
-	return read_partial_wim_resource(blob->rdesc,
+
+	if (size != 0 && use_chunk_cache(rdesc))
+		return read_cached_wim_resource(rdesc,
+						blob->offset_in_res + offset,
+						size, buf);
+	return read_partial_wim_resource(rdesc,
 					 blob->offset_in_res + offset,
 					 size,
 					 &cb, false);
 }
 
+/* Decompress the chunks containing the specified range of uncompressed data from
+ * the specified blob, which must be located in a WIM file, into the WIMStruct's
+ * chunk cache, unless they are cached already.  This does nothing if the blob
+ * isn't read through a chunk cache.  */
+int
+prefetch_partial_wim_blob(const struct blob_descriptor *blob,
+			  u64 offset, u64 size)
+{
+	struct wim_resource_descriptor *rdesc = blob->rdesc;
+
+	if (size == 0 || !use_chunk_cache(rdesc))
+		return 0;
+	return read_cached_wim_resource(rdesc, blob->offset_in_res + offset,
+					size, NULL);
+}
+
 static int
 noop_cb(const void *chunk, size_t size, void *_ctx)
 {
@@ -666,7 +1428,7 @@ noop_cb(const void *chunk, size_t size, void *_ctx)
 
 /* Skip over the data of the specified WIM resource.  */
 int
-skip_wim_resource(const struct wim_resource_descriptor *rdesc)
+skip_wim_resource(struct wim_resource_descriptor *rdesc)
 {
 	static const struct consume_chunk_callback cb = {
 		.func = noop_cb,
@@ -683,6 +1445,84 @@ read_wim_blob_prefix(const struct blob_descriptor *blob, u64 size,
 					 size, cb, recover_data);
 }
 
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+/* Feed @size zero bytes into the specified callback function.  */
+static int
+consume_zeroes(u64 size, const struct consume_chunk_callback *cb)
+{
+	static const u8 zeroes[BUFFER_SIZE];
+	int ret;
+
+	while (size) {
+		const size_t n = min(sizeof(zeroes), size);
+
+		ret = consume_chunk(cb, zeroes, n);
+		if (unlikely(ret))
+			return ret;
+		size -= n;
+	}
+	return 0;
+}
+
+#endif /* SEEK_DATA && SEEK_HOLE */
+
+/*
+ * Read @size bytes at @offset of the file open as @fd.  If the file is sparse,
+ * i.e. it uses less disk space than its size as in unix_scan_regular_file(),
+ * then only its data extents are read; its holes, which would read as zeroes
+ * anyway, are fed from a buffer of zeroes without reading anything.
+ */
+static int
+read_file_data(struct filedes *fd, u64 offset, u64 size,
+	       const struct consume_chunk_callback *cb, const tchar *filename)
+{
+	const u64 end = offset + size;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	struct stat stbuf;
+	int ret;
+
+	if (fstat(fd->fd, &stbuf) != 0 ||
+	    stbuf.st_blocks >= DIV_ROUND_UP(stbuf.st_size, 512))
+		goto read_rest;
+
+	while (offset < end) {
+		off_t data_start, data_end;
+
+		data_start = lseek(fd->fd, offset, SEEK_DATA);
+		if (data_start < 0) {
+			if (errno != ENXIO)
+				break;
+			/* The rest is a hole, unless the file was truncated. */
+			if (fstat(fd->fd, &stbuf) == 0 && stbuf.st_size < end) {
+				ERROR("\"%"TS"\": File was concurrently truncated",
+				      filename);
+				return WIMLIB_ERR_CONCURRENT_MODIFICATION_DETECTED;
+			}
+			data_start = end;
+		}
+		data_start = min((u64)data_start, end);
+		ret = consume_zeroes(data_start - offset, cb);
+		if (ret)
+			return ret;
+		offset = data_start;
+		if (offset == end)
+			return 0;
+
+		data_end = lseek(fd->fd, offset, SEEK_HOLE);
+		if (data_end < 0)
+			break;
+		data_end = min((u64)data_end, end);
+		ret = read_raw_file_data(fd, offset, data_end - offset,
+					 cb, filename);
+		if (ret)
+			return ret;
+		offset = data_end;
+	}
+read_rest:
+#endif /* SEEK_DATA && SEEK_HOLE */
+	return read_raw_file_data(fd, offset, end - offset, cb, filename);
+}
+
 /* This function handles reading blob data that is located in an external file,
  * such as a file that has been added to the WIM image through execution of a
  * wimlib_add_command.
@@ -697,21 +1537,86 @@ read_file_on_disk_prefix(const struct blob_descriptor *blob, u64 size,
 			 bool recover_data)
 {
 	int ret;
-	int raw_fd;
-	struct filedes fd;
+	int raw_fd;
+	struct filedes fd;
+
+	raw_fd = topen(blob->file_on_disk, O_BINARY | O_RDONLY);
+	if (unlikely(raw_fd < 0)) {
+		ERROR_WITH_ERRNO("Can't open \"%"TS"\"", blob->file_on_disk);
+		return WIMLIB_ERR_OPEN;
+	}
+	filedes_init(&fd, raw_fd);
+	ret = read_file_data(&fd, blob->file_offset, size, cb,
+			     blob->file_on_disk);
+	filedes_close(&fd);
+	return ret;
+}
+
+#ifdef WITH_FUSE
+/*
+ * Read @size bytes at @offset of the data of a blob located in a staging file,
+ * which is open as @fd, into @buf.  If the blob was staged lazily, then the
+ * extents which haven't been filled yet are read from the original blob.
+ *
+ * Returns 0 or a wimlib error code, with errno set as well.
+ */
+int
+read_partial_staging_blob(const struct blob_descriptor *blob,
+			  struct filedes *fd, u64 offset, size_t size,
+			  void *buf)
+{
+	const struct staging_origin *origin = blob->staging_origin;
+	u8 *p = buf;
+	int ret;
+
+	while (size) {
+		const u64 idx = offset / STAGING_EXTENT_SIZE;
+		size_t n = min(size, (idx + 1) * STAGING_EXTENT_SIZE - offset);
+
+		if (origin && offset < origin->size &&
+		    !staging_extent_filled(origin, idx))
+		{
+			n = min(n, origin->size - offset);
+			ret = read_partial_wim_blob_into_buf(origin->blob,
+							     offset, n, p);
+		} else {
+			ret = full_pread(fd, p, n, offset);
+		}
+		if (unlikely(ret))
+			return ret;
+		p += n;
+		offset += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int
+read_lazily_staged_data(const struct blob_descriptor *blob, struct filedes *fd,
+			u64 size, const struct consume_chunk_callback *cb)
+{
+	u8 buf[BUFFER_SIZE];
+	u64 offset = 0;
+	int ret;
 
-	raw_fd = topen(blob->file_on_disk, O_BINARY | O_RDONLY);
-	if (unlikely(raw_fd < 0)) {
-		ERROR_WITH_ERRNO("Can't open \"%"TS"\"", blob->file_on_disk);
-		return WIMLIB_ERR_OPEN;
+	while (size) {
+		const size_t n = min(sizeof(buf), size);
+
+		ret = read_partial_staging_blob(blob, fd, offset, n, buf);
+		if (unlikely(ret)) {
+			ERROR_WITH_ERRNO("Error reading data of staging file "
+					 "\"%s\"", blob->staging_file_name);
+			return ret;
+		}
+		ret = consume_chunk(cb, buf, n);
+		if (unlikely(ret))
+			return ret;
+		offset += n;
+		size -= n;
 	}
-	filedes_init(&fd, raw_fd);
-	ret = read_raw_file_data(&fd, 0, size, cb, blob->file_on_disk);
-	filedes_close(&fd);
-	return ret;
+	return 0;
 }
 
-#ifdef WITH_FUSE
 static int
 read_staging_file_prefix(const struct blob_descriptor *blob, u64 size,
 			 const struct consume_chunk_callback *cb,
@@ -729,7 +1634,11 @@ read_staging_file_prefix(const struct blob_descriptor *blob, u64 size,
 		return WIMLIB_ERR_OPEN;
 	}
 	filedes_init(&fd, raw_fd);
-	ret = read_raw_file_data(&fd, 0, size, cb, blob->staging_file_name);
+	if (blob->staging_origin)
+		ret = read_lazily_staged_data(blob, &fd, size, cb);
+	else
+		ret = read_raw_file_data(&fd, 0, size, cb,
+					 blob->staging_file_name);
 	filedes_close(&fd);
 	return ret;
 }
@@ -747,6 +1656,14 @@ read_buffer_prefix(const struct blob_descriptor *blob,
 	return consume_chunk(cb, blob->attached_buffer, size);
 }
 
+static int
+read_generated_metadata_prefix(const struct blob_descriptor *blob,
+			       u64 size, const struct consume_chunk_callback *cb,
+			       bool recover_data)
+{
+	return read_generated_metadata(blob->generated_imd, size, cb);
+}
+
 typedef int (*read_blob_prefix_handler_t)(const struct blob_descriptor *blob,
 					  u64 size,
 					  const struct consume_chunk_callback *cb,
@@ -772,6 +1689,7 @@ read_blob_prefix(const struct blob_descriptor *blob, u64 size,
 		[BLOB_IN_WIM] = read_wim_blob_prefix,
 		[BLOB_IN_FILE_ON_DISK] = read_file_on_disk_prefix,
 		[BLOB_IN_ATTACHED_BUFFER] = read_buffer_prefix,
+		[BLOB_IN_GENERATED_METADATA] = read_generated_metadata_prefix,
 	#ifdef WITH_FUSE
 		[BLOB_IN_STAGING_FILE] = read_staging_file_prefix,
 	#endif
@@ -805,6 +1723,29 @@ consume_blob_chunk(const void *chunk, size_t size, void *_ctx)
 	return ret;
 }
 
+static int
+consume_blob_chunks(const struct chunk_span *spans, size_t num_spans,
+		    void *_ctx)
+{
+	struct blob_chunk_ctx *ctx = _ctx;
+	int ret;
+
+	ret = call_continue_blob_vec(ctx->blob, ctx->offset, spans, num_spans,
+				     ctx->cbs);
+	for (size_t i = 0; i < num_spans; i++)
+		ctx->offset += spans[i].size;
+	return ret;
+}
+
+static int
+get_blob_chunk_dest(void **buf_ret, size_t *size_ret, void *_ctx)
+{
+	struct blob_chunk_ctx *ctx = _ctx;
+
+	return call_get_chunk_dest(ctx->blob, ctx->offset, buf_ret, size_ret,
+				   ctx->cbs);
+}
+
 /* Read the full data of the specified blob, passing the data into the specified
  * callbacks (all of which are optional).  */
 int
@@ -819,6 +1760,8 @@ read_blob_with_cbs(struct blob_descriptor *blob,
 	};
 	struct consume_chunk_callback cb = {
 		.func = consume_blob_chunk,
+		.func_vec = consume_blob_chunks,
+		.get_dest = get_blob_chunk_dest,
 		.ctx = &ctx,
 	};
 
@@ -844,6 +1787,78 @@ read_blob_into_buf(const struct blob_descriptor *blob, void *buf)
 	return read_blob_prefix(blob, blob->size, &cb, false);
 }
 
+/* Read the first @size bytes of the uncompressed data of the specified blob into
+ * the specified buffer.  The SHA-1 message digest is *not* checked.  */
+int
+read_blob_prefix_into_buf(const struct blob_descriptor *blob, u64 size,
+			  void *buf)
+{
+	struct consume_chunk_callback cb = {
+		.func	= bufferer_cb,
+		.ctx	= &buf,
+	};
+	return read_blob_prefix(blob, size, &cb, false);
+}
+
+/* Return true if read_partial_blob_into_buf() can efficiently read arbitrary
+ * ranges of the specified blob.  */
+bool
+can_read_partial_blob(const struct blob_descriptor *blob)
+{
+	switch (blob->blob_location) {
+	case BLOB_IN_WIM:
+		/* Reading a range of a solid resource without the chunk cache
+		 * means decompressing everything before it, every time.  */
+		return !(blob->rdesc->flags & WIM_RESHDR_FLAG_SOLID) ||
+			use_chunk_cache(blob->rdesc);
+	case BLOB_IN_FILE_ON_DISK:
+	case BLOB_IN_ATTACHED_BUFFER:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Read @size bytes at @offset of the uncompressed data of the specified blob
+ * into the specified buffer.  Returns WIMLIB_ERR_UNSUPPORTED if
+ * can_read_partial_blob() is false for the blob.  The SHA-1 message digest is
+ * *not* checked.  */
+int
+read_partial_blob_into_buf(const struct blob_descriptor *blob,
+			   u64 offset, size_t size, void *buf)
+{
+	struct filedes fd;
+	int raw_fd;
+	int ret;
+
+	if (!can_read_partial_blob(blob))
+		return WIMLIB_ERR_UNSUPPORTED;
+
+	wimlib_assert(offset <= blob->size && size <= blob->size - offset);
+
+	switch (blob->blob_location) {
+	case BLOB_IN_WIM:
+		return read_partial_wim_blob_into_buf(blob, offset, size, buf);
+	case BLOB_IN_ATTACHED_BUFFER:
+		memcpy(buf, (const u8 *)blob->attached_buffer + offset, size);
+		return 0;
+	default:
+		raw_fd = topen(blob->file_on_disk, O_BINARY | O_RDONLY);
+		if (unlikely(raw_fd < 0)) {
+			ERROR_WITH_ERRNO("Can't open \"%"TS"\"",
+					 blob->file_on_disk);
+			return WIMLIB_ERR_OPEN;
+		}
+		filedes_init(&fd, raw_fd);
+		ret = full_pread(&fd, buf, size, blob->file_offset + offset);
+		if (unlikely(ret))
+			ERROR_WITH_ERRNO("Error reading \"%"TS"\"",
+					 blob->file_on_disk);
+		filedes_close(&fd);
+		return ret;
+	}
+}
+
 /* Retrieve the full uncompressed data of the specified blob.  A buffer large
  * enough hold the data is allocated and returned in @buf_ret.  The SHA-1
  * message digest is *not* checked.  */
@@ -881,10 +1896,21 @@ wim_reshdr_to_data(const struct wim_reshdr *reshdr, WIMStruct *wim,
 {
 	struct wim_resource_descriptor rdesc;
 	struct blob_descriptor blob;
+	int ret;
+
+	if (open_wim_cache_lookup(wim, reshdr->offset_in_wim,
+				  reshdr->size_in_wim,
+				  reshdr->uncompressed_size, buf_ret))
+		return 0;
 
 	wim_reshdr_to_desc_and_blob(reshdr, wim, &rdesc, &blob);
 
-	return read_blob_into_alloc_buf(&blob, buf_ret);
+	ret = read_blob_into_alloc_buf(&blob, buf_ret);
+	if (ret)
+		return ret;
+	open_wim_cache_insert(wim, reshdr->offset_in_wim, reshdr->size_in_wim,
+			      reshdr->uncompressed_size, *buf_ret);
+	return 0;
 }
 
 /* Calculate the SHA-1 message digest of the uncompressed data of the specified
@@ -927,58 +1953,287 @@ next_blob(struct blob_descriptor *blob, size_t list_head_offset)
 	return (struct blob_descriptor*)((u8*)cur->next - list_head_offset);
 }
 
+/* Finished reading all the data for the current blob; end it and advance to
+ * the next blob.  */
+static int
+blobifier_end_blob(struct blobifier_context *ctx)
+{
+	int ret;
+
+	ctx->cur_blob_offset = 0;
+
+	ret = call_end_blob(ctx->cur_blob, 0, &ctx->cbs);
+	if (ret)
+		return ret;
+
+	/* Advance to next blob.  */
+	ctx->cur_blob = ctx->next_blob;
+	if (ctx->cur_blob != NULL) {
+		if (ctx->cur_blob != ctx->final_blob)
+			ctx->next_blob = next_blob(ctx->cur_blob,
+						   ctx->list_head_offset);
+		else
+			ctx->next_blob = NULL;
+	}
+	return 0;
+}
+
 /*
- * A consume_chunk implementation that translates raw resource data into blobs,
- * calling the begin_blob, continue_blob, and end_blob callbacks as appropriate.
+ * A vectored consume_chunk implementation that translates raw resource data
+ * into blobs, calling the begin_blob, continue_blob, and end_blob callbacks as
+ * appropriate.  The spans of each blob are passed on together.
  */
 static int
-blobifier_cb(const void *chunk, size_t size, void *_ctx)
+blobifier_cb_vec(const struct chunk_span *spans, size_t num_spans, void *_ctx)
 {
 	struct blobifier_context *ctx = _ctx;
-	int ret;
 
-	wimlib_assert(ctx->cur_blob != NULL);
-	wimlib_assert(size <= ctx->cur_blob->size - ctx->cur_blob_offset);
+	while (num_spans) {
+		u64 remaining;
+		size_t n = 0;
+		u64 size = 0;
+		int ret;
+
+		wimlib_assert(ctx->cur_blob != NULL);
 
-	if (ctx->cur_blob_offset == 0) {
-		/* Starting a new blob.  */
-		ret = call_begin_blob(ctx->cur_blob, &ctx->cbs);
+		if (ctx->cur_blob_offset == 0) {
+			/* Starting a new blob.  */
+			ret = call_begin_blob(ctx->cur_blob, &ctx->cbs);
+			if (ret)
+				return ret;
+		}
+
+		/* Spans don't cross range boundaries, so they either belong
+		 * entirely to the current blob or come after it.  */
+		remaining = ctx->cur_blob->size - ctx->cur_blob_offset;
+		do {
+			size += spans[n++].size;
+		} while (n < num_spans && size < remaining);
+		wimlib_assert(size <= remaining);
+
+		ret = call_continue_blob_vec(ctx->cur_blob,
+					     ctx->cur_blob_offset,
+					     spans, n, &ctx->cbs);
+		ctx->cur_blob_offset += size;
 		if (ret)
 			return ret;
+		spans += n;
+		num_spans -= n;
+
+		if (ctx->cur_blob_offset == ctx->cur_blob->size) {
+			ret = blobifier_end_blob(ctx);
+			if (ret)
+				return ret;
+		}
 	}
+	return 0;
+}
 
-	ret = call_continue_blob(ctx->cur_blob, ctx->cur_blob_offset,
-				 chunk, size, &ctx->cbs);
-	ctx->cur_blob_offset += size;
-	if (ret)
-		return ret;
+/* A consume_chunk implementation that feeds one chunk to blobifier_cb_vec().  */
+static int
+blobifier_cb(const void *chunk, size_t size, void *_ctx)
+{
+	const struct chunk_span span = { chunk, size };
 
-	if (ctx->cur_blob_offset == ctx->cur_blob->size) {
-		/* Finished reading all the data for a blob.  */
+	return blobifier_cb_vec(&span, 1, _ctx);
+}
 
-		ctx->cur_blob_offset = 0;
+/*
+ * The hashing of the data of a large blob can be overlapped with the processing
+ * of the data by the callbacks (e.g. writing it to the files being extracted)
+ * by passing copies of the data to a worker on the task pool.  SHA-1 can't be
+ * parallelized within a blob, so there is just one worker, which hashes the
+ * data in order.  The data is copied into a ring of slots, so the hashing can
+ * lag behind the reading by at most all the slots.  The hashing of each blob is
+ * finished before its end_blob() callback is called, so the callbacks still
+ * find out about a SHA-1 mismatch before doing anything final with the blob,
+ * such as setting the metadata of the extracted files.
+ */
+#define HASH_PIPELINE_NUM_SLOTS		8
+#define HASH_PIPELINE_SLOT_SIZE		(1U << 20)
 
-		ret = call_end_blob(ctx->cur_blob, 0, &ctx->cbs);
-		if (ret)
-			return ret;
+/* Smaller blobs are hashed by the calling thread, since handing off their data
+ * would cost more than it saves.  */
+#define HASH_PIPELINE_MIN_BLOB_SIZE	HASH_PIPELINE_SLOT_SIZE
 
-		/* Advance to next blob.  */
-		ctx->cur_blob = ctx->next_blob;
-		if (ctx->cur_blob != NULL) {
-			if (ctx->cur_blob != ctx->final_blob)
-				ctx->next_blob = next_blob(ctx->cur_blob,
-							   ctx->list_head_offset);
-			else
-				ctx->next_blob = NULL;
+struct hash_pipeline;
+
+struct hash_pipeline_slot {
+	struct hash_pipeline *pipeline;
+	u8 *buf;
+	size_t size;
+	bool busy;
+};
+
+struct hash_pipeline {
+	struct sha1_ctx *sha_ctx;
+	struct worker_group worker;
+
+	/* The slot being filled by the calling thread, and the number of bytes
+	 * filled in it so far  */
+	unsigned cur_slot;
+	size_t cur_filled;
+
+	/* Protects 'busy' and 'num_busy'  */
+	struct mutex lock;
+	struct condvar done_cond;
+	unsigned num_busy;
+
+	struct hash_pipeline_slot slots[HASH_PIPELINE_NUM_SLOTS];
+};
+
+static void
+hash_pipeline_process(void *item, void *_ignored)
+{
+	struct hash_pipeline_slot *slot = item;
+	struct hash_pipeline *p = slot->pipeline;
+
+	sha1_update(p->sha_ctx, slot->buf, slot->size);
+
+	mutex_lock(&p->lock);
+	slot->busy = false;
+	p->num_busy--;
+	condvar_broadcast(&p->done_cond);
+	mutex_unlock(&p->lock);
+}
+
+/* Wait for all the data which was submitted to the pipeline to be hashed.  */
+void
+hash_pipeline_wait(struct hash_pipeline *p)
+{
+	mutex_lock(&p->lock);
+	while (p->num_busy)
+		condvar_wait(&p->done_cond, &p->lock);
+	mutex_unlock(&p->lock);
+}
+
+/*
+ * Create a pipeline which hashes data into @sha_ctx.  Returns NULL if there's
+ * only one thread, so that nothing could be gained, or if the pipeline couldn't
+ * be created.  The caller must then hash the data itself.
+ */
+struct hash_pipeline *
+new_hash_pipeline(struct sha1_ctx *sha_ctx)
+{
+	struct hash_pipeline *p;
+
+	if (task_pool_num_threads() < 2)
+		return NULL;
+
+	p = CALLOC(1, sizeof(*p));
+	if (!p)
+		return NULL;
+	if (!mutex_init(&p->lock))
+		goto err_free;
+	if (!condvar_init(&p->done_cond))
+		goto err_destroy_lock;
+	if (worker_group_init(&p->worker, 1, HASH_PIPELINE_NUM_SLOTS,
+			      hash_pipeline_process, NULL))
+		goto err_destroy_cond;
+	p->sha_ctx = sha_ctx;
+	for (unsigned i = 0; i < HASH_PIPELINE_NUM_SLOTS; i++)
+		p->slots[i].pipeline = p;
+	return p;
+
+err_destroy_cond:
+	condvar_destroy(&p->done_cond);
+err_destroy_lock:
+	mutex_destroy(&p->lock);
+err_free:
+	FREE(p);
+	return NULL;
+}
+
+void
+free_hash_pipeline(struct hash_pipeline *p)
+{
+	if (!p)
+		return;
+	hash_pipeline_wait(p);
+	worker_group_destroy(&p->worker);
+	condvar_destroy(&p->done_cond);
+	mutex_destroy(&p->lock);
+	for (unsigned i = 0; i < HASH_PIPELINE_NUM_SLOTS; i++)
+		FREE(p->slots[i].buf);
+	FREE(p);
+}
+
+/* Hand off the current slot to the worker.  */
+static void
+hash_pipeline_submit(struct hash_pipeline *p)
+{
+	struct hash_pipeline_slot *slot = &p->slots[p->cur_slot];
+
+	slot->size = p->cur_filled;
+	mutex_lock(&p->lock);
+	slot->busy = true;
+	p->num_busy++;
+	mutex_unlock(&p->lock);
+	worker_group_submit(&p->worker, slot);
+
+	p->cur_slot = (p->cur_slot + 1) % HASH_PIPELINE_NUM_SLOTS;
+	p->cur_filled = 0;
+}
+
+/* Add data to be hashed, first waiting for slots to be freed if the hashing has
+ * fallen too far behind.  */
+int
+hash_pipeline_update(struct hash_pipeline *p, const void *data, size_t size)
+{
+	const u8 *in = data;
+
+	while (size) {
+		struct hash_pipeline_slot *slot = &p->slots[p->cur_slot];
+		size_t n;
+
+		if (p->cur_filled == 0) {
+			mutex_lock(&p->lock);
+			while (slot->busy)
+				condvar_wait(&p->done_cond, &p->lock);
+			mutex_unlock(&p->lock);
+			if (!slot->buf) {
+				slot->buf = MALLOC(HASH_PIPELINE_SLOT_SIZE);
+				if (!slot->buf)
+					return WIMLIB_ERR_NOMEM;
+			}
 		}
+		n = min(size, HASH_PIPELINE_SLOT_SIZE - p->cur_filled);
+		memcpy(&slot->buf[p->cur_filled], in, n);
+		p->cur_filled += n;
+		in += n;
+		size -= n;
+		if (p->cur_filled == HASH_PIPELINE_SLOT_SIZE)
+			hash_pipeline_submit(p);
 	}
 	return 0;
 }
 
+/* Hand off any data not yet handed off to the worker, without waiting.  */
+void
+hash_pipeline_flush(struct hash_pipeline *p)
+{
+	if (p->cur_filled)
+		hash_pipeline_submit(p);
+}
+
+/* Hash any remaining data and wait for the hashing to finish.  */
+void
+hash_pipeline_finish(struct hash_pipeline *p)
+{
+	hash_pipeline_flush(p);
+	hash_pipeline_wait(p);
+}
+
 struct hasher_context {
 	struct sha1_ctx sha_ctx;
 	int flags;
 	struct read_blob_callbacks cbs;
+
+	/* If not NULL, the pipeline to use for hashing large blobs  */
+	struct hash_pipeline *pipeline;
+
+	/* Whether the current blob is being hashed by the pipeline  */
+	bool pipelined;
 };
 
 /* Callback for starting to read a blob while calculating its SHA-1 message
@@ -989,6 +2244,8 @@ hasher_begin_blob(struct blob_descriptor *blob, void *_ctx)
 	struct hasher_context *ctx = _ctx;
 
 	sha1_init(&ctx->sha_ctx);
+	ctx->pipelined = ctx->pipeline &&
+			 blob->size >= HASH_PIPELINE_MIN_BLOB_SIZE;
 	blob->corrupted = 0;
 
 	return call_begin_blob(blob, &ctx->cbs);
@@ -1006,12 +2263,56 @@ hasher_continue_blob(const struct blob_descriptor *blob, u64 offset,
 {
 	struct hasher_context *ctx = _ctx;
 
-	sha1_update(&ctx->sha_ctx, chunk, size);
+	if (ctx->pipelined) {
+		int ret = hash_pipeline_update(ctx->pipeline, chunk, size);
+		if (unlikely(ret))
+			return ret;
+	} else {
+		sha1_update(&ctx->sha_ctx, chunk, size);
+	}
 
 	return call_continue_blob(blob, offset, chunk, size, &ctx->cbs);
 }
 
+/* Like hasher_continue_blob(), but for several consecutive chunks.  */
+static int
+hasher_continue_blob_vec(const struct blob_descriptor *blob, u64 offset,
+			 const struct chunk_span *spans, size_t num_spans,
+			 void *_ctx)
+{
+	struct hasher_context *ctx = _ctx;
+
+	for (size_t i = 0; i < num_spans; i++) {
+		if (ctx->pipelined) {
+			int ret = hash_pipeline_update(ctx->pipeline,
+						       spans[i].data,
+						       spans[i].size);
+			if (unlikely(ret))
+				return ret;
+		} else {
+			sha1_update(&ctx->sha_ctx, spans[i].data,
+				    spans[i].size);
+		}
+	}
+
+	return call_continue_blob_vec(blob, offset, spans, num_spans,
+				      &ctx->cbs);
+}
+
+/* The data passes through the hasher unchanged, so the hasher's caller may as
+ * well choose where it goes.  */
 static int
+hasher_get_chunk_dest(const struct blob_descriptor *blob, u64 offset,
+		      void **buf_ret, size_t *size_ret, void *_ctx)
+{
+	struct hasher_context *ctx = _ctx;
+
+	return call_get_chunk_dest(blob, offset, buf_ret, size_ret, &ctx->cbs);
+}
+
+/* Report that the data of @blob didn't have the expected SHA-1 message digest,
+ * and return the appropriate error code (or 0 if @recover_data).  */
+int
 report_sha1_mismatch(struct blob_descriptor *blob,
 		     const u8 actual_hash[SHA1_HASH_SIZE], bool recover_data)
 {
@@ -1073,6 +2374,24 @@ report_sha1_mismatch(struct blob_descriptor *blob,
 	}
 }
 
+/* Set the SHA-1 message digest of the blob to the calculated value @hash, or
+ * compare it with the stored value, as requested by the hasher's flags.  */
+static int
+hasher_apply_hash(struct blob_descriptor *blob, const u8 hash[SHA1_HASH_SIZE],
+		  const struct hasher_context *ctx)
+{
+	if (blob->unhashed) {
+		if (ctx->flags & COMPUTE_MISSING_BLOB_HASHES)
+			copy_hash(blob->hash, hash);
+	} else if ((ctx->flags & VERIFY_BLOB_HASHES) &&
+		   unlikely(!hashes_equal(hash, blob->hash)))
+	{
+		return report_sha1_mismatch(blob, hash,
+					    ctx->flags & RECOVER_DATA);
+	}
+	return 0;
+}
+
 /* Callback for finishing reading a blob while calculating its SHA-1 message
  * digest.  */
 static int
@@ -1080,32 +2399,20 @@ hasher_end_blob(struct blob_descriptor *blob, int status, void *_ctx)
 {
 	struct hasher_context *ctx = _ctx;
 	u8 hash[SHA1_HASH_SIZE];
-	int ret;
 
-	if (unlikely(status)) {
-		/* Error occurred; the full blob may not have been read.  */
-		ret = status;
-		goto out_next_cb;
+	if (ctx->pipelined) {
+		hash_pipeline_finish(ctx->pipeline);
+		ctx->pipelined = false;
 	}
 
-	/* Retrieve the final SHA-1 message digest.  */
-	sha1_final(&ctx->sha_ctx, hash);
-
-	/* Set the SHA-1 message digest of the blob, or compare the calculated
-	 * value with stored value.  */
-	if (blob->unhashed) {
-		if (ctx->flags & COMPUTE_MISSING_BLOB_HASHES)
-			copy_hash(blob->hash, hash);
-	} else if ((ctx->flags & VERIFY_BLOB_HASHES) &&
-		   unlikely(!hashes_equal(hash, blob->hash)))
-	{
-		ret = report_sha1_mismatch(blob, hash,
-					   ctx->flags & RECOVER_DATA);
-		goto out_next_cb;
+	if (likely(!status)) {
+		/* Retrieve the final SHA-1 message digest.  */
+		sha1_final(&ctx->sha_ctx, hash);
+		status = hasher_apply_hash(blob, hash, ctx);
 	}
-	ret = 0;
-out_next_cb:
-	return call_end_blob(blob, ret, &ctx->cbs);
+	/* Else, an error occurred; the full blob may not have been read.  */
+
+	return call_end_blob(blob, status, &ctx->cbs);
 }
 
 /* Read the full data of the specified blob, passing the data into the specified
@@ -1123,7 +2430,9 @@ read_blob_with_sha1(struct blob_descriptor *blob,
 	struct read_blob_callbacks hasher_cbs = {
 		.begin_blob	= hasher_begin_blob,
 		.continue_blob	= hasher_continue_blob,
+		.continue_blob_vec = hasher_continue_blob_vec,
 		.end_blob	= hasher_end_blob,
+		.get_chunk_dest	= hasher_get_chunk_dest,
 		.ctx		= &hasher_ctx,
 	};
 	return read_blob_with_cbs(blob, &hasher_cbs, recover_data);
@@ -1180,8 +2489,9 @@ read_blobs_in_solid_resource(struct blob_descriptor *first_blob,
 		.list_head_offset	= list_head_offset,
 	};
 	struct consume_chunk_callback cb = {
-		.func	= blobifier_cb,
-		.ctx	= &blobifier_ctx,
+		.func		= blobifier_cb,
+		.func_vec	= blobifier_cb_vec,
+		.ctx		= &blobifier_ctx,
 	};
 
 	ret = read_compressed_wim_resource(first_blob->rdesc, ranges,
@@ -1201,12 +2511,154 @@ oom:
 	return WIMLIB_ERR_NOMEM;
 }
 
+/*
+ * State for prefetching the WIM resources containing the upcoming blobs in a
+ * blob list while the current blob is being read.  Up to READ_AHEAD_SIZE bytes
+ * of upcoming resources are kept requested from the OS; each resource counts
+ * for at most READ_AHEAD_SIZE bytes, since the reader of a resource keeps the
+ * rest of it requested by itself (see read_ahead_advance()).
+ *
+ * In addition, if a blob reader pool is in use, upcoming small blobs located in
+ * files are submitted to it, as many as it will accept.
+ */
+struct blob_list_prefetcher {
+	struct list_head *blob_list;
+	size_t list_head_offset;
+	struct blob_reader_pool *reader_pool;
+
+	/* The next list node to prefetch, and its index in the list  */
+	struct list_head *next;
+	size_t next_idx;
+
+	/* The last resource prefetched  */
+	const struct wim_resource_descriptor *last_rdesc;
+
+	/* The resource being read  */
+	const struct wim_resource_descriptor *cur_rdesc;
+
+	/* Total number of bytes prefetched, and the number of those bytes
+	 * belonging to resources already reached by the reader.  */
+	u64 prefetched_bytes;
+	u64 consumed_bytes;
+};
+
+static void
+init_blob_list_prefetcher(struct blob_list_prefetcher *p,
+			  struct list_head *blob_list, size_t list_head_offset,
+			  struct blob_reader_pool *reader_pool)
+{
+	p->blob_list = blob_list;
+	p->list_head_offset = list_head_offset;
+	p->reader_pool = reader_pool;
+	p->next = blob_list->next;
+	p->next_idx = 0;
+	p->last_rdesc = NULL;
+	p->cur_rdesc = NULL;
+	p->prefetched_bytes = 0;
+	p->consumed_bytes = 0;
+}
+
+static u64
+resource_prefetch_size(const struct wim_resource_descriptor *rdesc)
+{
+	return min(rdesc->size_in_wim, READ_AHEAD_SIZE);
+}
+
+/*
+ * Called when the reader is about to read @blob, which is at node @cur and
+ * index @cur_idx in the blob list, to prefetch the resources which follow it.
+ * Only nodes after @cur are ever accessed, since the read callbacks are allowed
+ * to delete the blob being read from the list.
+ */
+static void
+prefetch_blobs(struct blob_list_prefetcher *p, const struct blob_descriptor *blob,
+	       struct list_head *cur, size_t cur_idx)
+{
+	if (blob->blob_location == BLOB_IN_WIM && blob->rdesc != p->cur_rdesc) {
+		p->cur_rdesc = blob->rdesc;
+		p->consumed_bytes += resource_prefetch_size(blob->rdesc);
+	}
+
+	if (p->next_idx <= cur_idx) {
+		/* The reader caught up; restart right after it.  */
+		p->next = cur->next;
+		p->next_idx = cur_idx + 1;
+		p->last_rdesc = p->cur_rdesc;
+		p->prefetched_bytes = p->consumed_bytes;
+	}
+
+	while (p->next != p->blob_list &&
+	       p->prefetched_bytes < p->consumed_bytes + READ_AHEAD_SIZE)
+	{
+		const struct blob_descriptor *next_blob =
+			(const struct blob_descriptor *)
+				((u8 *)p->next - p->list_head_offset);
+
+		if (next_blob->blob_location == BLOB_IN_WIM &&
+		    next_blob->rdesc != p->last_rdesc)
+		{
+			const struct wim_resource_descriptor *rdesc =
+				next_blob->rdesc;
+
+			filedes_prefetch(&rdesc->wim->in_fd,
+					 rdesc->offset_in_wim,
+					 resource_prefetch_size(rdesc));
+			p->prefetched_bytes += resource_prefetch_size(rdesc);
+			p->last_rdesc = rdesc;
+		} else if (p->reader_pool &&
+			   blob_reader_pool_can_read(next_blob))
+		{
+			if (!blob_reader_pool_submit(p->reader_pool, next_blob,
+						     p->next_idx))
+				break;
+		}
+		p->next = p->next->next;
+		p->next_idx++;
+	}
+}
+
+/*
+ * Pass the data of a blob which a blob reader pool has read into @buf, or
+ * failed to read with error code @status, to the specified callbacks.
+ *
+ * If @hasher_ctx is not NULL, then @hash is the SHA-1 message digest of the
+ * data, which the pool already calculated, and it is used in place of passing
+ * the data through the hasher callbacks.  @cbs is ignored in that case.
+ */
+static int
+read_blob_from_pool_buf(struct blob_descriptor *blob, const void *buf,
+			int status, const u8 *hash,
+			struct hasher_context *hasher_ctx,
+			const struct read_blob_callbacks *cbs)
+{
+	int ret;
+
+	if (hasher_ctx) {
+		blob->corrupted = 0;
+		cbs = &hasher_ctx->cbs;
+	}
+
+	ret = call_begin_blob(blob, cbs);
+	if (unlikely(ret))
+		return ret;
+
+	if (likely(!status))
+		status = call_continue_blob(blob, 0, buf, blob->size, cbs);
+
+	if (likely(!status) && hasher_ctx)
+		status = hasher_apply_hash(blob, hash, hasher_ctx);
+
+	return call_end_blob(blob, status, cbs);
+}
+
 /*
  * Read a list of blobs, each of which may be in any supported location (e.g.
  * in a WIM or in an external file).  This function optimizes the case where
  * multiple blobs are combined into a single solid compressed WIM resource by
  * reading the blobs in sequential order, only decompressing the solid resource
- * one time.
+ * one time.  It also can use other threads to read small blobs located in files
+ * ahead of time, so that the latency of reading each file is overlapped with
+ * the processing of the earlier blobs.
  *
  * @blob_list
  *	List of blobs to read.
@@ -1235,6 +2687,10 @@ oom:
  *
  *	RECOVER_DATA
  *		Don't consider corrupted blob data to be an error.
+ * @num_reader_threads
+ *	Number of threads to use for reading small blobs located in files ahead
+ *	of time, or 0 to read all blobs in the calling thread.  The data of each
+ *	blob is still passed to the callbacks in the calling thread, in order.
  *
  * The callback functions are allowed to delete the current blob from the list
  * if necessary.
@@ -1245,13 +2701,17 @@ oom:
  */
 int
 read_blob_list(struct list_head *blob_list, size_t list_head_offset,
-	       const struct read_blob_callbacks *cbs, int flags)
+	       const struct read_blob_callbacks *cbs, int flags,
+	       unsigned num_reader_threads)
 {
 	int ret;
 	struct list_head *cur, *next;
 	struct blob_descriptor *blob;
 	struct hasher_context *hasher_ctx;
 	struct read_blob_callbacks *sink_cbs;
+	struct blob_list_prefetcher prefetcher;
+	struct blob_reader_pool *reader_pool = NULL;
+	size_t cur_idx;
 
 	if (!(flags & BLOB_LIST_ALREADY_SORTED)) {
 		ret = sort_blob_list_by_sequential_order(blob_list,
@@ -1266,23 +2726,62 @@ read_blob_list(struct list_head *blob_list, size_t list_head_offset,
 			.flags	= flags,
 			.cbs	= *cbs,
 		};
+		/* Hashing is only worth overlapping with something.  */
+		if (cbs->continue_blob || cbs->continue_blob_vec)
+			hasher_ctx->pipeline =
+				new_hash_pipeline(&hasher_ctx->sha_ctx);
 		sink_cbs = alloca(sizeof(*sink_cbs));
 		*sink_cbs = (struct read_blob_callbacks) {
 			.begin_blob	= hasher_begin_blob,
 			.continue_blob	= hasher_continue_blob,
+			.continue_blob_vec = hasher_continue_blob_vec,
 			.end_blob	= hasher_end_blob,
+			.get_chunk_dest	= hasher_get_chunk_dest,
 			.ctx		= hasher_ctx,
 		};
 	} else {
+		hasher_ctx = NULL;
 		sink_cbs = (struct read_blob_callbacks *)cbs;
 	}
 
-	for (cur = blob_list->next, next = cur->next;
+	if (num_reader_threads) {
+		ret = new_blob_reader_pool(num_reader_threads, &reader_pool);
+		if (ret) {
+			WARNING("Couldn't create threads for reading files: %"TS".\n"
+				"          Falling back to reading files with one thread.",
+				wimlib_get_error_string(ret));
+			reader_pool = NULL;
+		}
+	}
+
+	init_blob_list_prefetcher(&prefetcher, blob_list, list_head_offset,
+				  reader_pool);
+
+	for (cur = blob_list->next, next = cur->next, cur_idx = 0;
 	     cur != blob_list;
-	     cur = next, next = cur->next)
+	     cur = next, next = cur->next, cur_idx++)
 	{
+		void *buf;
+		int status;
+		u8 hash[SHA1_HASH_SIZE];
+
 		blob = (struct blob_descriptor*)((u8*)cur - list_head_offset);
 
+		prefetch_blobs(&prefetcher, blob, cur, cur_idx);
+
+		if (reader_pool &&
+		    blob_reader_pool_take(reader_pool, cur_idx, &buf, &status,
+					  hasher_ctx ? hash : NULL))
+		{
+			ret = read_blob_from_pool_buf(blob, buf, status, hash,
+						      hasher_ctx, sink_cbs);
+			if (!status)
+				FREE(buf);
+			if (unlikely(ret && ret != BEGIN_BLOB_STATUS_SKIP_BLOB))
+				goto out;
+			continue;
+		}
+
 		if (blob->blob_location == BLOB_IN_WIM &&
 		    blob->size != blob->rdesc->uncompressed_size)
 		{
@@ -1318,22 +2817,29 @@ read_blob_list(struct list_head *blob_list, size_t list_head_offset,
 				 * and @blob_last specifies the last blob in the
 				 * resource that needs to be read.  */
 				next = next2;
+				cur_idx += blob_count - 1;
 				ret = read_blobs_in_solid_resource(blob, blob_last,
 								   blob_count,
 								   list_head_offset,
 								   sink_cbs,
 								   flags & RECOVER_DATA);
 				if (ret)
-					return ret;
+					goto out;
 				continue;
 			}
 		}
 
 		ret = read_blob_with_cbs(blob, sink_cbs, flags & RECOVER_DATA);
 		if (unlikely(ret && ret != BEGIN_BLOB_STATUS_SKIP_BLOB))
-			return ret;
+			goto out;
 	}
-	return 0;
+	ret = 0;
+out:
+	if (reader_pool)
+		blob_reader_pool_destroy(reader_pool);
+	if (hasher_ctx)
+		free_hash_pipeline(hasher_ctx->pipeline);
+	return ret;
 }
 
 static int
@@ -1402,6 +2908,7 @@ wim_reshdr_to_desc(const struct wim_reshdr *reshdr, WIMStruct *wim,
 	rdesc->size_in_wim = reshdr->size_in_wim;
 	rdesc->uncompressed_size = reshdr->uncompressed_size;
 	INIT_LIST_HEAD(&rdesc->blob_list);
+	rdesc->chunk_offsets = NULL;
 	rdesc->flags = reshdr->flags;
 	rdesc->is_pipable = wim_is_pipable(wim);
 	if (rdesc->flags & WIM_RESHDR_FLAG_COMPRESSED) {
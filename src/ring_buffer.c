@@ -0,0 +1,212 @@
+/*
+ * ring_buffer.c
+ *
+ * A bounded lock-free queue of pointers for passing work between threads.
+ *
+ * This is the well-known bounded multi-producer multi-consumer queue design
+ * where each slot carries a sequence number.  A slot at position 'pos' is free
+ * for a producer when its sequence number equals 'pos', and holds an item for a
+ * consumer when it equals 'pos + 1'.  Producers and consumers claim positions
+ * by compare-and-swap on the tail and head respectively, then publish the slot
+ * by storing its next sequence number.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib/assert.h"
+#include "wimlib/error.h"
+#include "wimlib/ring_buffer.h"
+#include "wimlib/util.h"
+
+/* Initialize a ring buffer that can hold at least @capacity items.  */
+int
+ring_buffer_init(struct ring_buffer *rb, size_t capacity)
+{
+	size_t n = 2;
+
+	while (n < capacity)
+		n *= 2;
+
+	rb->slots = MALLOC(n * sizeof(rb->slots[0]));
+	if (!rb->slots)
+		return WIMLIB_ERR_NOMEM;
+	for (size_t i = 0; i < n; i++)
+		rb->slots[i].seq = i;
+	rb->mask = n - 1;
+	rb->head = 0;
+	rb->tail = 0;
+	if (!event_count_init(&rb->not_empty))
+		goto err_free_slots;
+	if (!event_count_init(&rb->not_full))
+		goto err_destroy_not_empty;
+	return 0;
+
+err_destroy_not_empty:
+	event_count_destroy(&rb->not_empty);
+err_free_slots:
+	FREE(rb->slots);
+	rb->slots = NULL;
+	return WIMLIB_ERR_NOMEM;
+}
+
+/* Destroy a ring buffer.  This is a no-op if the ring buffer is
+ * zero-initialized but ring_buffer_init() was never called on it (or failed).
+ * Any items still in the ring buffer are forgotten.  */
+void
+ring_buffer_destroy(struct ring_buffer *rb)
+{
+	if (rb->slots) {
+		event_count_destroy(&rb->not_full);
+		event_count_destroy(&rb->not_empty);
+		FREE(rb->slots);
+		rb->slots = NULL;
+	}
+}
+
+static bool
+do_try_put(struct ring_buffer *rb, void *item)
+{
+	size_t pos = __atomic_load_n(&rb->tail, __ATOMIC_RELAXED);
+	struct ring_slot *slot;
+
+	for (;;) {
+		ssize_t diff;
+
+		slot = &rb->slots[pos & rb->mask];
+		diff = (ssize_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+				 pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&rb->tail, &pos,
+							pos + 1, true,
+							__ATOMIC_SEQ_CST,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return false; /* full */
+		} else {
+			pos = __atomic_load_n(&rb->tail, __ATOMIC_RELAXED);
+		}
+	}
+	slot->item = item;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void *
+do_try_get(struct ring_buffer *rb)
+{
+	size_t pos = __atomic_load_n(&rb->head, __ATOMIC_RELAXED);
+	struct ring_slot *slot;
+	void *item;
+
+	for (;;) {
+		ssize_t diff;
+
+		slot = &rb->slots[pos & rb->mask];
+		diff = (ssize_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+				 (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&rb->head, &pos,
+							pos + 1, true,
+							__ATOMIC_SEQ_CST,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL; /* empty */
+		} else {
+			pos = __atomic_load_n(&rb->head, __ATOMIC_RELAXED);
+		}
+	}
+	item = slot->item;
+	__atomic_store_n(&slot->seq, pos + rb->mask + 1, __ATOMIC_RELEASE);
+	return item;
+}
+
+/* Put an item into the ring buffer if there is space for it.  Returns %true if
+ * the item was put, or %false if the ring buffer is full.  */
+bool
+ring_buffer_try_put(struct ring_buffer *rb, void *item)
+{
+	wimlib_assert(item != NULL);
+	if (!do_try_put(rb, item))
+		return false;
+	event_count_notify_all(&rb->not_empty);
+	return true;
+}
+
+/* Take the oldest item from the ring buffer.  Returns NULL if the ring buffer
+ * is empty.  */
+void *
+ring_buffer_try_get(struct ring_buffer *rb)
+{
+	void *item = do_try_get(rb);
+
+	if (item)
+		event_count_notify_all(&rb->not_full);
+	return item;
+}
+
+/* Put an item into the ring buffer, waiting for space if it is full.  */
+void
+ring_buffer_put(struct ring_buffer *rb, void *item)
+{
+	while (!ring_buffer_try_put(rb, item)) {
+		unsigned seq = event_count_prepare_wait(&rb->not_full);
+
+		if (ring_buffer_try_put(rb, item)) {
+			event_count_cancel_wait(&rb->not_full);
+			break;
+		}
+		event_count_wait(&rb->not_full, seq);
+	}
+}
+
+/* Take the oldest item from the ring buffer, waiting for one if it is empty.  */
+void *
+ring_buffer_get(struct ring_buffer *rb)
+{
+	void *item;
+
+	while (!(item = ring_buffer_try_get(rb))) {
+		unsigned seq = event_count_prepare_wait(&rb->not_empty);
+
+		item = ring_buffer_try_get(rb);
+		if (item) {
+			event_count_cancel_wait(&rb->not_empty);
+			break;
+		}
+		event_count_wait(&rb->not_empty, seq);
+	}
+	return item;
+}
+
+/* Return %true if no item has been put into the ring buffer that hasn't been
+ * taken.  An item whose put is still in progress counts as being in the ring
+ * buffer, even though ring_buffer_try_get() can't take it yet.  */
+bool
+ring_buffer_empty(const struct ring_buffer *rb)
+{
+	size_t head = __atomic_load_n(&rb->head, __ATOMIC_SEQ_CST);
+	size_t tail = __atomic_load_n(&rb->tail, __ATOMIC_SEQ_CST);
+
+	return head == tail;
+}
@@ -23,20 +23,337 @@
 #  include "config.h"
 #endif
 
+#include <fcntl.h>
 #include <string.h>
 
 #include "wimlib/blob_table.h"
 #include "wimlib/dentry.h"
+#include "wimlib/blob_table.h"
 #include "wimlib/error.h"
+#include "wimlib/file_io.h"
 #include "wimlib/paths.h"
 #include "wimlib/pattern.h"
 #include "wimlib/progress.h"
 #include "wimlib/scan.h"
+#include "wimlib/sha1.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/textfile.h"
 
+/*
+ * Background hashing of scanned files
+ *
+ * The blobs of scanned files are left unhashed, and the ones whose size is
+ * unique don't need to be hashed at all.  The others are normally read and
+ * hashed one at a time when they are written, ahead of their compression, to
+ * find out whether they are duplicates.  To overlap that with the scan, files
+ * whose size turns out to be the same as another scanned file's are read and
+ * hashed by the task pool while the scan continues, and the results are
+ * merged into the blob table when the scan is done.
+ *
+ * The scan never waits for the hashing: files for which the queue is full are
+ * left unhashed, and the files which haven't been hashed by the end of the
+ * scan are left unhashed too, to be hashed when they are written as before.
+ * As the blobs may be freed if the scan fails, the workers only use their own
+ * copies of the paths and sizes.  Only files read through a path, i.e. blobs
+ * in BLOB_IN_FILE_ON_DISK, are hashed in the background.
+ */
+
+/* Maximum number of threads which hash scanned files  */
+#define MAX_SCAN_HASH_WORKERS	8
+
+/* Maximum number of files waiting to be hashed  */
+#define MAX_QUEUED_SCAN_HASHES	4096
+
+/* Size of the buffer through which each thread reads the files  */
+#define SCAN_HASH_BUFFER_SIZE	(256U << 10)
+
+enum scan_hash_status {
+	SCAN_HASH_QUEUED,
+	SCAN_HASH_DONE,
+	SCAN_HASH_FAILED,
+};
+
+struct scan_hash_job {
+	/* Link in the hasher's list of jobs, in the order they were queued  */
+	struct list_head list;
+
+	/* The blob and its back pointer, used only by the scanning thread */
+	struct blob_descriptor *blob;
+	struct wim_inode *back_inode;
+
+	/* A copy of the path of the file, and its size when it was scanned  */
+	tchar *path;
+	u64 size;
+
+	/* The result, valid if the status is SCAN_HASH_DONE  */
+	u8 hash[SHA1_HASH_SIZE];
+	int status;
+};
+
+/* A scanned size, and the blob of the first file found with that size if it
+ * hasn't been queued for hashing yet  */
+struct scan_size_slot {
+	u64 size;
+	struct blob_descriptor *blob;
+};
+
+struct scan_hasher;
+
+/* The context of a thread which hashes scanned files  */
+struct scan_hash_worker {
+	struct scan_hasher *hasher;
+	u8 buf[SCAN_HASH_BUFFER_SIZE];
+};
+
+struct scan_hasher {
+	struct worker_group workers;
+	struct scan_hash_worker *worker_ctxs[MAX_SCAN_HASH_WORKERS];
+	unsigned num_workers;
+	struct list_head jobs;
+	bool stop;
+
+	/* Set if some blobs found by the scan may have been freed, so the
+	 * blobs referenced by the jobs and the size table can't be used  */
+	bool abandoned;
+
+	/* Open-addressed table of the sizes of the blobs scanned so far  */
+	struct scan_size_slot *slots;
+	size_t num_slots;
+	size_t num_used_slots;
+};
+
+/* Read and hash the file of a job.  This runs on the task pool.  */
+static void
+scan_hash_job_run(void *item, void *_worker)
+{
+	struct scan_hash_job *job = item;
+	struct scan_hash_worker *worker = _worker;
+	struct sha1_ctx sha_ctx;
+	struct filedes fd;
+	u64 remaining = job->size;
+	int status = SCAN_HASH_FAILED;
+	int raw_fd;
+
+	raw_fd = topen(job->path, O_BINARY | O_RDONLY);
+	if (raw_fd < 0)
+		goto out;
+	filedes_init(&fd, raw_fd);
+	sha1_init(&sha_ctx);
+	while (remaining) {
+		size_t n = min(remaining, SCAN_HASH_BUFFER_SIZE);
+
+		if (__atomic_load_n(&worker->hasher->stop, __ATOMIC_RELAXED) ||
+		    full_read(&fd, worker->buf, n))
+			goto out_close;
+		sha1_update(&sha_ctx, worker->buf, n);
+		remaining -= n;
+	}
+	sha1_final(&sha_ctx, job->hash);
+	status = SCAN_HASH_DONE;
+out_close:
+	filedes_close(&fd);
+out:
+	job->status = status;
+}
+
+/* Start hashing the files found by the scan with @params in the background.
+ * This is only an optimization, so if it can't be started, nothing is done. */
+void
+start_scan_hasher(struct scan_params *params)
+{
+	struct scan_hasher *hasher;
+	unsigned num_workers;
+
+	num_workers = min(task_pool_num_threads(), MAX_SCAN_HASH_WORKERS);
+
+	hasher = CALLOC(1, sizeof(*hasher));
+	if (!hasher)
+		return;
+	INIT_LIST_HEAD(&hasher->jobs);
+	while (hasher->num_workers < num_workers) {
+		struct scan_hash_worker *worker = MALLOC(sizeof(*worker));
+
+		if (!worker)
+			goto err;
+		worker->hasher = hasher;
+		hasher->worker_ctxs[hasher->num_workers++] = worker;
+	}
+	if (worker_group_init(&hasher->workers, num_workers,
+			      MAX_QUEUED_SCAN_HASHES, scan_hash_job_run,
+			      (void **)hasher->worker_ctxs))
+		goto err;
+	params->hasher = hasher;
+	return;
+
+err:
+	for (unsigned i = 0; i < hasher->num_workers; i++)
+		FREE(hasher->worker_ctxs[i]);
+	FREE(hasher);
+}
+
+static void
+queue_scan_hash(struct scan_hasher *hasher, struct blob_descriptor *blob)
+{
+	struct scan_hash_job *job;
+
+	job = MALLOC(sizeof(*job));
+	if (!job)
+		return;
+	job->blob = blob;
+	job->back_inode = blob->back_inode;
+	job->path = TSTRDUP(blob->file_on_disk);
+	job->size = blob->size;
+	job->status = SCAN_HASH_QUEUED;
+	if (!job->path || !worker_group_try_submit(&hasher->workers, job)) {
+		FREE(job->path);
+		FREE(job);
+		return;
+	}
+	list_add_tail(&job->list, &hasher->jobs);
+}
+
+static struct scan_size_slot *
+find_scan_size_slot(struct scan_size_slot *slots, size_t num_slots, u64 size)
+{
+	size_t i = (size * 0x9E3779B97F4A7C15ULL) & (num_slots - 1);
+
+	while (slots[i].size != 0 && slots[i].size != size)
+		i = (i + 1) & (num_slots - 1);
+	return &slots[i];
+}
+
+static bool
+grow_scan_size_table(struct scan_hasher *hasher)
+{
+	size_t num_slots = max(hasher->num_slots * 2, 1024);
+	struct scan_size_slot *slots;
+
+	slots = CALLOC(num_slots, sizeof(slots[0]));
+	if (!slots)
+		return false;
+	for (size_t i = 0; i < hasher->num_slots; i++) {
+		if (hasher->slots[i].size != 0)
+			*find_scan_size_slot(slots, num_slots,
+					     hasher->slots[i].size) =
+				hasher->slots[i];
+	}
+	FREE(hasher->slots);
+	hasher->slots = slots;
+	hasher->num_slots = num_slots;
+	return true;
+}
+
+/* Queue the unhashed blobs of the file @inode, which has just been scanned, to
+ * be hashed in the background if another scanned blob has the same size.  */
+static void
+scan_hasher_add_inode(struct scan_hasher *hasher,
+		      const struct wim_inode *inode)
+{
+	for (unsigned i = 0; i < inode->i_num_streams; i++) {
+		struct blob_descriptor *blob =
+			stream_blob_resolved(&inode->i_streams[i]);
+		struct scan_size_slot *slot;
+
+		if (hasher->abandoned)
+			return;
+		if (!blob || !blob->unhashed ||
+		    blob->blob_location != BLOB_IN_FILE_ON_DISK ||
+		    blob->file_offset != 0)
+			continue;
+
+		if (hasher->num_used_slots >= hasher->num_slots / 2 &&
+		    !grow_scan_size_table(hasher))
+			return;
+		slot = find_scan_size_slot(hasher->slots, hasher->num_slots,
+					   blob->size);
+		if (slot->size == 0) {
+			slot->size = blob->size;
+			slot->blob = blob;
+			hasher->num_used_slots++;
+			continue;
+		}
+		if (slot->blob) {
+			queue_scan_hash(hasher, slot->blob);
+			slot->blob = NULL;
+		}
+		queue_scan_hash(hasher, blob);
+	}
+}
+
+/*
+ * Stop the background hashing of the files found by the scan with @params.  If
+ * @scan_succeeded, then merge the blobs which were hashed into the blob table,
+ * in the order they were queued, as if they had been hashed by
+ * hash_unhashed_blob().  Otherwise the blobs may already have been freed, so
+ * the results are just discarded.
+ */
+void
+finish_scan_hasher(struct scan_params *params, bool scan_succeeded)
+{
+	struct scan_hasher *hasher = params->hasher;
+	struct scan_hash_job *job, *tmp;
+
+	if (!hasher)
+		return;
+	params->hasher = NULL;
+
+	__atomic_store_n(&hasher->stop, true, __ATOMIC_RELAXED);
+	worker_group_destroy(&hasher->workers);
+
+	if (hasher->abandoned)
+		scan_succeeded = false;
+	list_for_each_entry_safe(job, tmp, &hasher->jobs, list) {
+		struct blob_descriptor *blob = job->blob;
+
+		if (scan_succeeded && job->status == SCAN_HASH_DONE &&
+		    blob->unhashed && blob->size == job->size)
+		{
+			struct blob_descriptor **back_ptr =
+				retrieve_pointer_to_unhashed_blob(blob);
+
+			copy_hash(blob->hash, job->hash);
+			if (after_blob_hashed(blob, back_ptr, params->blob_table,
+					      job->back_inode) != blob)
+				free_blob_descriptor(blob);
+		}
+		FREE(job->path);
+		FREE(job);
+	}
+	for (unsigned i = 0; i < hasher->num_workers; i++)
+		FREE(hasher->worker_ctxs[i]);
+	FREE(hasher->slots);
+	FREE(hasher);
+}
+
+/*
+ * If a file that has just been scanned matches [CompressionExclusionList] in
+ * the capture configuration file, then mark its data to be stored uncompressed.
+ * As with exclusions, a pattern that matches a directory applies to everything
+ * in it.
+ */
+static void
+apply_compression_exclusions(const struct scan_params *params,
+			     const struct wim_inode *inode)
+{
+	if (!params->config || inode->i_nlink != 1)
+		return;
+	if (!match_pattern_index(params->cur_path + params->root_path_nchars,
+				 &params->config->compression_exclusion_index,
+				 MATCH_RECURSIVELY))
+		return;
+
+	for (unsigned i = 0; i < inode->i_num_streams; i++) {
+		struct blob_descriptor *blob =
+			stream_blob_resolved(&inode->i_streams[i]);
+		if (blob)
+			blob->compression_excluded = 1;
+	}
+}
+
 /*
  * Tally a file (or directory) that has been scanned for a capture operation,
  * and possibly call the progress function provided by the library user.
+ * Also apply any compression exclusions and the template image to the file.
  *
  * @params
  *	Current path, flags, optional progress function, and progress data for
@@ -51,14 +368,20 @@
  */
 int
 do_scan_progress(struct scan_params *params, int status,
-		 const struct wim_inode *inode)
+		 struct wim_inode *inode)
 {
 	int ret;
 	tchar *cookie;
 
 	switch (status) {
 	case WIMLIB_SCAN_DENTRY_OK:
-		if (!(params->add_flags & WIMLIB_ADD_FLAG_VERBOSE))
+		if (params->template)
+			apply_capture_template(params, inode);
+		apply_compression_exclusions(params, inode);
+		if (params->hasher && inode->i_nlink == 1)
+			scan_hasher_add_inode(params->hasher, inode);
+		if (!(params->add_flags & WIMLIB_ADD_FLAG_VERBOSE) &&
+		    !progress_throttle_enabled(&params->progress_throttle))
 			return 0;
 		break;
 	case WIMLIB_SCAN_DENTRY_UNSUPPORTED:
@@ -96,11 +419,29 @@ do_scan_progress(struct scan_params *params, int status,
 			params->progress.scan.num_nondirs_scanned++;
 	}
 
-	/* Call the user-provided progress function.  */
+	/* Call the user-provided progress function: for every file if verbose
+	 * messages were requested, and otherwise just now and then to report
+	 * the totals so far.  */
 
 	cookie = progress_get_win32_path(params->progress.scan.cur_path);
-	ret = call_progress(params->progfunc, WIMLIB_PROGRESS_MSG_SCAN_DENTRY,
-			     &params->progress, params->progctx);
+	if (status != WIMLIB_SCAN_DENTRY_OK ||
+	    (params->add_flags & WIMLIB_ADD_FLAG_VERBOSE))
+	{
+		ret = call_progress(params->progfunc,
+				    WIMLIB_PROGRESS_MSG_SCAN_DENTRY,
+				    &params->progress, params->progctx);
+		if (ret)
+			goto out;
+	}
+	ret = 0;
+	if (progress_throttle_enabled(&params->progress_throttle) &&
+	    progress_throttle_due(&params->progress_throttle, false))
+	{
+		ret = call_progress(params->progfunc,
+				    WIMLIB_PROGRESS_MSG_SCAN_PROGRESS,
+				    &params->progress, params->progctx);
+	}
+out:
 	progress_put_win32_path(cookie);
 	return ret;
 }
@@ -192,12 +533,10 @@ read_capture_config(const tchar *config_file, const void *buf,
 	 * understand it, recognize it, thereby avoiding the unrecognized
 	 * section warning, but discard the resulting strings.
 	 *
-	 * We currently ignore [CompressionExclusionList] and
-	 * [CompressionFolderList].  This is a known issue that doesn't seem to
-	 * have any real consequences, so don't issue warnings about not
-	 * recognizing those sections.  */
+	 * We currently ignore [CompressionFolderList].  This is a known issue
+	 * that doesn't seem to have any real consequences, so don't issue
+	 * warnings about not recognizing it.  */
 	STRING_LIST(prepopulate_pats);
-	STRING_LIST(compression_exclusion_pats);
 	STRING_LIST(compression_folder_pats);
 
 	struct text_file_section sections[] = {
@@ -208,7 +547,7 @@ read_capture_config(const tchar *config_file, const void *buf,
 		{T("PrepopulateList"),
 			&prepopulate_pats},
 		{T("CompressionExclusionList"),
-			&compression_exclusion_pats},
+			&config->compression_exclusion_pats},
 		{T("CompressionFolderList"),
 			&compression_folder_pats},
 	};
@@ -238,11 +577,21 @@ read_capture_config(const tchar *config_file, const void *buf,
 	}
 
 	FREE(prepopulate_pats.strings);
-	FREE(compression_exclusion_pats.strings);
 	FREE(compression_folder_pats.strings);
 
 	config->buf = mem;
-	return 0;
+
+	ret = build_pattern_index(&config->exclusion_pats,
+				  &config->exclusion_index);
+	if (!ret)
+		ret = build_pattern_index(&config->exclusion_exception_pats,
+					  &config->exclusion_exception_index);
+	if (!ret)
+		ret = build_pattern_index(&config->compression_exclusion_pats,
+					  &config->compression_exclusion_index);
+	if (ret)
+		destroy_capture_config(config);
+	return ret;
 }
 
 void
@@ -250,6 +599,10 @@ destroy_capture_config(struct capture_config *config)
 {
 	FREE(config->exclusion_pats.strings);
 	FREE(config->exclusion_exception_pats.strings);
+	FREE(config->compression_exclusion_pats.strings);
+	free_pattern_index(&config->exclusion_index);
+	free_pattern_index(&config->exclusion_exception_index);
+	free_pattern_index(&config->compression_exclusion_index);
 	FREE(config->buf);
 }
 
@@ -293,10 +646,11 @@ try_exclude(const struct scan_params *params)
 
 	if (params->config) {
 		const tchar *path = params->cur_path + params->root_path_nchars;
-		if (match_pattern_list(path, &params->config->exclusion_pats,
-				       MATCH_RECURSIVELY) &&
-		    !match_pattern_list(path, &params->config->exclusion_exception_pats,
-					MATCH_RECURSIVELY | MATCH_ANCESTORS))
+		if (match_pattern_index(path, &params->config->exclusion_index,
+					MATCH_RECURSIVELY) &&
+		    !match_pattern_index(path,
+					 &params->config->exclusion_exception_index,
+					 MATCH_RECURSIVELY | MATCH_ANCESTORS))
 			return -1;
 	}
 
@@ -357,18 +711,34 @@ should_ignore_filename(const tchar *name, const int name_nchars)
 	return false;
 }
 
+/*
+ * Free a directory tree which has been scanned, but which is being discarded
+ * after all, e.g. due to an error which is being ignored.  Its blobs may have
+ * been queued for hashing in the background, so the background hashing of the
+ * scan is abandoned.
+ */
+void
+discard_scanned_tree(struct scan_params *params, struct wim_dentry *tree)
+{
+	if (tree && params->hasher) {
+		params->hasher->abandoned = true;
+		__atomic_store_n(&params->hasher->stop, true, __ATOMIC_RELAXED);
+	}
+	free_dentry_tree(tree, params->blob_table);
+}
+
 /* Attach a newly scanned directory tree to its parent directory, with duplicate
  * handling.  */
 void
 attach_scanned_tree(struct wim_dentry *parent, struct wim_dentry *child,
-		    struct blob_table *blob_table)
+		    struct scan_params *params)
 {
 	struct wim_dentry *duplicate;
 
 	if (child && (duplicate = dentry_add_child(parent, child))) {
 		WARNING("Duplicate file path: \"%"TS"\".  Only capturing "
 			"the first version.", dentry_full_path(duplicate));
-		free_dentry_tree(child, blob_table);
+		discard_scanned_tree(params, child);
 	}
 }
 
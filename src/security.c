@@ -26,11 +26,10 @@
 #endif
 
 #include "wimlib/assert.h"
-#include "wimlib/avl_tree.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
 #include "wimlib/security.h"
-#include "wimlib/sha1.h"
+#include "wimlib/unaligned.h"
 #include "wimlib/util.h"
 
 struct wim_security_data_disk {
@@ -219,25 +218,106 @@ free_wim_security_data(struct wim_security_data *sd)
 	}
 }
 
-struct sd_node {
-	s32 security_id;
-	u8 hash[SHA1_HASH_SIZE];
-	struct avl_tree_node index_node;
+struct sd_set_slot {
+	u32 hash;
+	s32 security_id;	/* -1 if the slot is empty */
 };
 
-#define SD_NODE(avl_node) \
-	avl_tree_entry(avl_node, struct sd_node, index_node)
+/* A fast non-cryptographic hash of a security descriptor.  Lookups compare the
+ * descriptors themselves, so there is no need to use SHA-1 here. */
+static u32
+hash_sd(const u8 *p, size_t size)
+{
+	u64 h = hash_u64(size);
+
+	for (; size >= 8; p += 8, size -= 8) {
+		h = hash_u64(h ^ load_u64_unaligned(p));
+		h ^= h >> 32;
+	}
+	while (size--)
+		h = hash_u64(h ^ *p++);
+	return h >> 32;
+}
 
-static void
-free_sd_tree(struct avl_tree_node *node)
+/* Returns the slot for a descriptor with the given hash and contents: either
+ * the slot holding its security ID, or the empty slot where it belongs. */
+static struct sd_set_slot *
+find_sd_slot(const struct wim_sd_set *set, u32 hash,
+	     const u8 *descriptor, size_t size)
 {
-	if (node) {
-		free_sd_tree(node->left);
-		free_sd_tree(node->right);
-		FREE(SD_NODE(node));
+	const struct wim_security_data *sd = set->sd;
+	u32 i = hash & (set->capacity - 1);
+
+	for (;;) {
+		struct sd_set_slot *slot = &set->slots[i];
+		s32 id = slot->security_id;
+
+		if (id < 0 ||
+		    (slot->hash == hash && sd->sizes[id] == size &&
+		     !memcmp(sd->descriptors[id], descriptor, size)))
+			return slot;
+		i = (i + 1) & (set->capacity - 1);
 	}
 }
 
+static int
+grow_sd_set(struct wim_sd_set *set)
+{
+	u32 new_capacity = max(set->capacity * 2, 64);
+	struct sd_set_slot *new_slots;
+
+	new_slots = MALLOC(new_capacity * sizeof(new_slots[0]));
+	if (!new_slots)
+		return WIMLIB_ERR_NOMEM;
+	for (u32 i = 0; i < new_capacity; i++)
+		new_slots[i].security_id = -1;
+	for (u32 i = 0; i < set->capacity; i++) {
+		struct sd_set_slot *slot = &set->slots[i];
+		u32 j;
+
+		if (slot->security_id < 0)
+			continue;
+		j = slot->hash & (new_capacity - 1);
+		while (new_slots[j].security_id >= 0)
+			j = (j + 1) & (new_capacity - 1);
+		new_slots[j] = *slot;
+	}
+	FREE(set->slots);
+	set->slots = new_slots;
+	set->capacity = new_capacity;
+	return 0;
+}
+
+/* Index the descriptors which haven't been yet.  Of identical descriptors, the
+ * first one is the one which is found. */
+static int
+index_sd_set(struct wim_sd_set *set)
+{
+	const struct wim_security_data *sd = set->sd;
+	int ret;
+
+	while (set->num_indexed < sd->num_entries) {
+		u32 id = set->num_indexed;
+		struct sd_set_slot *slot;
+		u32 hash;
+
+		if ((id + 1) * 2 > set->capacity) {
+			ret = grow_sd_set(set);
+			if (ret)
+				return ret;
+		}
+		hash = hash_sd(sd->descriptors[id], sd->sizes[id]);
+		slot = find_sd_slot(set, hash, sd->descriptors[id],
+				    sd->sizes[id]);
+		if (slot->security_id < 0) {
+			slot->hash = hash;
+			slot->security_id = id;
+		}
+		set->num_indexed++;
+	}
+	return 0;
+}
+
 void
 rollback_new_security_descriptors(struct wim_sd_set *sd_set)
 {
@@ -247,45 +327,20 @@ rollback_new_security_descriptors(struct wim_sd_set *sd_set)
 	for (i = sd_set->orig_num_entries; i < sd->num_entries; i++)
 		FREE(sd->descriptors[i]);
 	sd->num_entries = sd_set->orig_num_entries;
+
+	/* The index now refers to freed descriptors.  */
+	FREE(sd_set->slots);
+	sd_set->slots = NULL;
+	sd_set->capacity = 0;
+	sd_set->num_indexed = 0;
+	sd_set->last_id = -1;
 }
 
 /* Frees a security descriptor index set. */
 void
 destroy_sd_set(struct wim_sd_set *sd_set)
 {
-	free_sd_tree(sd_set->root);
-}
-
-static int
-_avl_cmp_nodes_by_hash(const struct avl_tree_node *n1,
-		       const struct avl_tree_node *n2)
-{
-	return hashes_cmp(SD_NODE(n1)->hash, SD_NODE(n2)->hash);
-}
-
-/* Inserts a new node into the security descriptor index tree.  Returns true
- * if successful (not a duplicate).  */
-static bool
-insert_sd_node(struct wim_sd_set *set, struct sd_node *new)
-{
-	return NULL == avl_tree_insert(&set->root, &new->index_node,
-				       _avl_cmp_nodes_by_hash);
-}
-
-/* Returns the index of the security descriptor having a SHA1 message digest of
- * @hash.  If not found, return -1. */
-static s32
-lookup_sd(struct wim_sd_set *set, const u8 hash[SHA1_HASH_SIZE])
-{
-	struct avl_tree_node *res;
-	struct sd_node dummy;
-
-	copy_hash(dummy.hash, hash);
-	res = avl_tree_lookup_node(set->root, &dummy.index_node,
-				   _avl_cmp_nodes_by_hash);
-	if (!res)
-		return -1;
-	return SD_NODE(res)->security_id;
+	FREE(sd_set->slots);
 }
 
 /*
@@ -298,35 +353,35 @@ lookup_sd(struct wim_sd_set *set, const u8 hash[SHA1_HASH_SIZE])
 s32
 sd_set_add_sd(struct wim_sd_set *sd_set, const char *descriptor, size_t size)
 {
-	u8 hash[SHA1_HASH_SIZE];
-	s32 security_id;
-	struct sd_node *new;
+	struct wim_security_data *sd = sd_set->sd;
+	struct sd_set_slot *slot;
+	u32 hash;
 	u8 **descriptors;
 	u64 *sizes;
 	u8 *descr_copy;
-	struct wim_security_data *sd;
-	bool bret;
-
-	sha1(descriptor, size, hash);
+	s32 id = sd_set->last_id;
 
-	security_id = lookup_sd(sd_set, hash);
-	if (security_id >= 0) /* Identical descriptor already exists */
-		goto out;
+	/* Files in the same directory usually have the same descriptor.  */
+	if (id >= 0 && sd->sizes[id] == size &&
+	    !memcmp(sd->descriptors[id], descriptor, size))
+		return id;
 
-	/* Need to add a new security descriptor */
-	security_id = -1;
+	/* Index the existing descriptors, and make room for a new one.  */
+	if (index_sd_set(sd_set))
+		return -1;
+	if ((sd->num_entries + 1) * 2 > sd_set->capacity &&
+	    grow_sd_set(sd_set))
+		return -1;
 
-	new = MALLOC(sizeof(*new));
-	if (!new)
+	hash = hash_sd((const u8 *)descriptor, size);
+	slot = find_sd_slot(sd_set, hash, (const u8 *)descriptor, size);
+	if (slot->security_id >= 0) /* Identical descriptor already exists */
 		goto out;
 
+	/* Need to add a new security descriptor */
 	descr_copy = memdup(descriptor, size);
 	if (!descr_copy)
-		goto out_free_node;
-
-	sd = sd_set->sd;
-	new->security_id = sd->num_entries;
-	copy_hash(new->hash, hash);
+		return -1;
 
 	/* There typically are only a few dozen security descriptors in a
 	 * directory tree, so expanding the array of security descriptors by
@@ -343,50 +398,33 @@ sd_set_add_sd(struct wim_sd_set *sd_set, const char *descriptor, size_t size)
 	sd->sizes = sizes;
 	sd->descriptors[sd->num_entries] = descr_copy;
 	sd->sizes[sd->num_entries] = size;
-	sd->num_entries++;
-	bret = insert_sd_node(sd_set, new);
-	wimlib_assert(bret);
-	security_id = new->security_id;
-	goto out;
+	slot->hash = hash;
+	slot->security_id = sd->num_entries++;
+	sd_set->num_indexed++;
+out:
+	sd_set->last_id = slot->security_id;
+	return slot->security_id;
+
 out_free_descr:
 	FREE(descr_copy);
-out_free_node:
-	FREE(new);
-out:
-	return security_id;
+	return -1;
 }
 
-/* Initialize a `struct sd_set' mapping from SHA1 message digests of security
- * descriptors to indices into the security descriptors table of the WIM image
- * (security IDs).  */
+/* Initialize a `struct sd_set' mapping from security descriptors to indices
+ * into the security descriptors table of the WIM image (security IDs).  The
+ * existing descriptors aren't indexed until a descriptor is added, so this
+ * can't fail.  */
 int
 init_sd_set(struct wim_sd_set *sd_set, struct wim_security_data *sd)
 {
-	int ret;
-
 	sd_set->sd = sd;
-	sd_set->root = NULL;
+	sd_set->slots = NULL;
+	sd_set->capacity = 0;
+	sd_set->num_indexed = 0;
+	sd_set->last_id = -1;
 
 	/* Remember the original number of security descriptors so that newly
 	 * added ones can be rolled back if needed. */
 	sd_set->orig_num_entries = sd->num_entries;
-	for (u32 i = 0; i < sd->num_entries; i++) {
-		struct sd_node *new;
-
-		new = MALLOC(sizeof(struct sd_node));
-		if (!new) {
-			ret = WIMLIB_ERR_NOMEM;
-			goto out_destroy_sd_set;
-		}
-		sha1(sd->descriptors[i], sd->sizes[i], new->hash);
-		new->security_id = i;
-		if (!insert_sd_node(sd_set, new))
-			FREE(new); /* Ignore duplicate security descriptor */
-	}
-	ret = 0;
-	goto out;
-out_destroy_sd_set:
-	destroy_sd_set(sd_set);
-out:
-	return ret;
+	return 0;
 }
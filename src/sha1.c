@@ -31,8 +31,10 @@
 
 #include "wimlib/cpu_features.h"
 #include "wimlib/endianness.h"
+#include "wimlib/perf_counters.h"
 #include "wimlib/sha1.h"
 #include "wimlib/unaligned.h"
+#include "wimlib/util.h"
 
 /*----------------------------------------------------------------------------*
  *                              Shared helpers                                *
@@ -509,31 +511,322 @@ sha1_blocks_arm_ce(u32 h[5], const void *data, size_t num_blocks)
 #endif /* ARMv8 Crypto Extensions implementation */
 
 /*----------------------------------------------------------------------------*
- *                              Everything else                               *
+ *                 x86 AVX2 and AVX-512 multi-buffer implementation           *
  *----------------------------------------------------------------------------*/
 
-static void
-sha1_blocks(u32 h[5], const void *data, size_t num_blocks)
+/*
+ * This is SHA-1 computed on several independent messages at once, with each
+ * 32-bit lane of a vector register holding the state of a different message:
+ * 8 messages with AVX2, or 16 messages with AVX-512.  Unlike the single-buffer
+ * SSSE3 implementation, this vectorizes the SHA itself and not just the message
+ * schedule, so it is much faster in aggregate, at the cost of requiring
+ * multiple messages to be available at the same time.
+ *
+ * The message words are loaded for 8 messages at a time with 8x8 transposes.
+ * For AVX-512 this is done twice, and the two halves are combined.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+
+#define SHA1_MB_ROUND(i, a, b, c, d, e)					\
+	if ((i) >= 16)							\
+		w[(i) % 16] = V_ROL(V_XOR4(w[((i) - 16) % 16],		\
+					   w[((i) - 14) % 16],		\
+					   w[((i) -  8) % 16],		\
+					   w[((i) -  3) % 16]), 1);	\
+	e = V_ADD(V_ADD(e, V_ADD(w[(i) % 16], V_SET1(SHA1_K(i)))),	\
+		  V_ADD(V_ROL(a, 5), V_F((i), b, c, d)));		\
+	b = V_ROL(b, 30);
+	/* implicit: the new (a, b, c, d, e) is the old (e, a, b, c, d) */
+
+#define V_F(i, b, c, d)						\
+	(((i) < 20) ? V_CH(b, c, d) :				\
+	 ((i) < 40) ? V_PARITY(b, c, d) :			\
+	 ((i) < 60) ? V_MAJ(b, c, d) :				\
+		      V_PARITY(b, c, d))
+
+#define SHA1_MB_5ROUNDS(i)				\
+	SHA1_MB_ROUND((i) + 0, a, b, c, d, e);		\
+	SHA1_MB_ROUND((i) + 1, e, a, b, c, d);		\
+	SHA1_MB_ROUND((i) + 2, d, e, a, b, c);		\
+	SHA1_MB_ROUND((i) + 3, c, d, e, a, b);		\
+	SHA1_MB_ROUND((i) + 4, b, c, d, e, a);
+
+#define SHA1_MB_20ROUNDS(i)	\
+	SHA1_MB_5ROUNDS((i) +  0);	\
+	SHA1_MB_5ROUNDS((i) +  5);	\
+	SHA1_MB_5ROUNDS((i) + 10);	\
+	SHA1_MB_5ROUNDS((i) + 15);
+
+#define SHA1_MB_BODY(LOAD_W)						\
+	V state[5];							\
+	size_t offset = 0;						\
+									\
+	for (int j = 0; j < 5; j++)					\
+		state[j] = V_LOAD(h[j]);				\
+	do {								\
+		V a = state[0];						\
+		V b = state[1];						\
+		V c = state[2];						\
+		V d = state[3];						\
+		V e = state[4];						\
+		V w[16];						\
+									\
+		LOAD_W(w, data, offset);				\
+									\
+		SHA1_MB_20ROUNDS(0);					\
+		SHA1_MB_20ROUNDS(20);					\
+		SHA1_MB_20ROUNDS(40);					\
+		SHA1_MB_20ROUNDS(60);					\
+									\
+		state[0] = V_ADD(state[0], a);				\
+		state[1] = V_ADD(state[1], b);				\
+		state[2] = V_ADD(state[2], c);				\
+		state[3] = V_ADD(state[3], d);				\
+		state[4] = V_ADD(state[4], e);				\
+		offset += SHA1_BLOCK_SIZE;				\
+	} while (--num_blocks);						\
+	for (int j = 0; j < 5; j++)					\
+		V_STORE(h[j], state[j]);
+
+/*
+ * Load 8 message words, starting at @offset, from each of the 8 messages
+ * @data[0..7], and transpose them so that w[j] contains word j of each message
+ * (converted from big endian).
+ */
+static forceinline __attribute__((target("avx2"))) void
+sha1_mb_load8x8_avx2(__m256i w[8], const u8 *const data[8], size_t offset)
+{
+	const __m256i bswap32_mask =
+		_mm256_setr_epi8( 3,  2,  1,  0,  7,  6,  5,  4,
+				 11, 10,  9,  8, 15, 14, 13, 12,
+				  3,  2,  1,  0,  7,  6,  5,  4,
+				 11, 10,  9,  8, 15, 14, 13, 12);
+	__m256i r[8], t[8], u[8];
+
+	for (int l = 0; l < 8; l++)
+		r[l] = _mm256_loadu_si256((const void *)(data[l] + offset));
+
+	for (int l = 0; l < 8; l += 2) {
+		t[l + 0] = _mm256_unpacklo_epi32(r[l], r[l + 1]);
+		t[l + 1] = _mm256_unpackhi_epi32(r[l], r[l + 1]);
+	}
+	for (int l = 0; l < 8; l += 4) {
+		u[l + 0] = _mm256_unpacklo_epi64(t[l + 0], t[l + 2]);
+		u[l + 1] = _mm256_unpackhi_epi64(t[l + 0], t[l + 2]);
+		u[l + 2] = _mm256_unpacklo_epi64(t[l + 1], t[l + 3]);
+		u[l + 3] = _mm256_unpackhi_epi64(t[l + 1], t[l + 3]);
+	}
+	for (int j = 0; j < 4; j++) {
+		w[j + 0] = _mm256_shuffle_epi8(
+			_mm256_permute2x128_si256(u[j], u[j + 4], 0x20),
+			bswap32_mask);
+		w[j + 4] = _mm256_shuffle_epi8(
+			_mm256_permute2x128_si256(u[j], u[j + 4], 0x31),
+			bswap32_mask);
+	}
+}
+
+#define V			__m256i
+#define V_LOAD(p)		_mm256_loadu_si256((const void *)(p))
+#define V_STORE(p, v)		_mm256_storeu_si256((void *)(p), (v))
+#define V_SET1(x)		_mm256_set1_epi32(x)
+#define V_ADD(a, b)		_mm256_add_epi32((a), (b))
+#define V_ROL(a, n)		(_mm256_slli_epi32((a), (n)) |	\
+				 _mm256_srli_epi32((a), 32 - (n)))
+#define V_XOR4(a, b, c, d)	((a) ^ (b) ^ (c) ^ (d))
+#define V_CH(b, c, d)		(((b) & ((c) ^ (d))) ^ (d))
+#define V_PARITY(b, c, d)	((b) ^ (c) ^ (d))
+#define V_MAJ(b, c, d)		(((c) & (d)) | ((b) & ((c) | (d))))
+
+#define SHA1_MB_LOAD_W_AVX2(w, data, offset)				\
+	sha1_mb_load8x8_avx2(&w[0], data, (offset));			\
+	sha1_mb_load8x8_avx2(&w[8], data, (offset) + 32);
+
+#define HAVE_SHA1_BLOCKS_X86_AVX2_X8
+static void __attribute__((target("avx2")))
+sha1_blocks_x86_avx2_x8(u32 h[5][16], const u8 *const data[16],
+			size_t num_blocks)
+{
+	SHA1_MB_BODY(SHA1_MB_LOAD_W_AVX2);
+}
+
+#undef V
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_ROL
+#undef V_XOR4
+#undef V_CH
+#undef V_PARITY
+#undef V_MAJ
+
+#define V			__m512i
+#define V_LOAD(p)		_mm512_loadu_si512((const void *)(p))
+#define V_STORE(p, v)		_mm512_storeu_si512((void *)(p), (v))
+#define V_SET1(x)		_mm512_set1_epi32(x)
+#define V_ADD(a, b)		_mm512_add_epi32((a), (b))
+#define V_ROL(a, n)		_mm512_rol_epi32((a), (n))
+#define V_XOR4(a, b, c, d)	_mm512_ternarylogic_epi32((a), (b), (c) ^ (d), 0x96)
+#define V_CH(b, c, d)		_mm512_ternarylogic_epi32((b), (c), (d), 0xCA)
+#define V_PARITY(b, c, d)	_mm512_ternarylogic_epi32((b), (c), (d), 0x96)
+#define V_MAJ(b, c, d)		_mm512_ternarylogic_epi32((b), (c), (d), 0xE8)
+
+#define SHA1_MB_LOAD_W_AVX512(w, data, offset)				\
+	for (int half = 0; half < 2; half++) {				\
+		__m256i lo[8], hi[8];					\
+									\
+		sha1_mb_load8x8_avx2(lo, &data[0], (offset) + half * 32); \
+		sha1_mb_load8x8_avx2(hi, &data[8], (offset) + half * 32); \
+		for (int j = 0; j < 8; j++)				\
+			w[half * 8 + j] = _mm512_inserti64x4(		\
+				_mm512_castsi256_si512(lo[j]), hi[j], 1); \
+	}
+
+#define HAVE_SHA1_BLOCKS_X86_AVX512_X16
+static void __attribute__((target("avx512f")))
+sha1_blocks_x86_avx512_x16(u32 h[5][16], const u8 *const data[16],
+			   size_t num_blocks)
 {
+	SHA1_MB_BODY(SHA1_MB_LOAD_W_AVX512);
+}
+
+#undef V
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_ROL
+#undef V_XOR4
+#undef V_CH
+#undef V_PARITY
+#undef V_MAJ
+#endif /* x86 AVX2 and AVX-512 multi-buffer implementation */
+
+/*----------------------------------------------------------------------------*
+ *                              Everything else                               *
+ *----------------------------------------------------------------------------*/
+
+typedef void (*sha1_blocks_func_t)(u32 h[5], const void *data,
+				   size_t num_blocks);
+typedef void (*sha1_blocks_multi_func_t)(u32 h[5][16], const u8 *const data[16],
+					 size_t num_blocks);
+
+static sha1_blocks_func_t sha1_blocks_func = sha1_blocks_generic;
+
+static const struct cpu_impl sha1_blocks_impls[] = {
 #ifdef HAVE_SHA1_BLOCKS_X86_SHA
-	if ((cpu_features & (X86_CPU_FEATURE_SHA | X86_CPU_FEATURE_SSE4_1)) ==
-	    (X86_CPU_FEATURE_SHA | X86_CPU_FEATURE_SSE4_1))
-		return sha1_blocks_x86_sha(h, data, num_blocks);
+	{ "sha-ni", (cpu_func_t)sha1_blocks_x86_sha,
+	  X86_CPU_FEATURE_SHA | X86_CPU_FEATURE_SSE4_1 },
 #endif
 #ifdef HAVE_SHA1_BLOCKS_X86_AVX_BMI2
-	if ((cpu_features & (X86_CPU_FEATURE_AVX | X86_CPU_FEATURE_BMI2)) ==
-	    (X86_CPU_FEATURE_AVX | X86_CPU_FEATURE_BMI2))
-		return sha1_blocks_x86_avx_bmi2(h, data, num_blocks);
+	{ "avx-bmi2", (cpu_func_t)sha1_blocks_x86_avx_bmi2,
+	  X86_CPU_FEATURE_AVX | X86_CPU_FEATURE_BMI2 },
 #endif
 #ifdef HAVE_SHA1_BLOCKS_X86_SSSE3
-	if (cpu_features & X86_CPU_FEATURE_SSSE3)
-		return sha1_blocks_x86_ssse3(h, data, num_blocks);
+	{ "ssse3", (cpu_func_t)sha1_blocks_x86_ssse3, X86_CPU_FEATURE_SSSE3 },
 #endif
 #ifdef HAVE_SHA1_BLOCKS_ARM_CE
-	if (cpu_features & ARM_CPU_FEATURE_SHA1)
-		return sha1_blocks_arm_ce(h, data, num_blocks);
+	{ "arm-ce", (cpu_func_t)sha1_blocks_arm_ce, ARM_CPU_FEATURE_SHA1 },
 #endif
-	return sha1_blocks_generic(h, data, num_blocks);
+	{ "generic", (cpu_func_t)sha1_blocks_generic, 0 },
+};
+
+static void
+sha1_blocks_select(const struct cpu_impl *impl)
+{
+	sha1_blocks_func = (sha1_blocks_func_t)impl->func;
+}
+
+const struct cpu_kernel sha1_blocks_kernel = {
+	.name = "sha1",
+	.impls = sha1_blocks_impls,
+	.num_impls = ARRAY_LEN(sha1_blocks_impls),
+	.select = sha1_blocks_select,
+};
+
+static void
+sha1_blocks(u32 h[5], const void *data, size_t num_blocks)
+{
+	u64 start = perf_start();
+
+	(*sha1_blocks_func)(h, data, num_blocks);
+	perf_end(PERF_HASH, start, num_blocks * SHA1_BLOCK_SIZE);
+}
+
+/*
+ * The multi-buffer implementation, if any, and the number of messages it
+ * processes at once.  With no multi-buffer implementation, sha1_multi_lanes
+ * is 1 and messages are hashed one at a time.
+ *
+ * The multi-buffer implementations are preferred even over the SHA extensions,
+ * since with enough messages their aggregate throughput is higher.
+ */
+static sha1_blocks_multi_func_t sha1_blocks_multi_func;
+static unsigned sha1_multi_lanes = 1;
+
+static const struct cpu_impl sha1_blocks_multi_impls[] = {
+#ifdef HAVE_SHA1_BLOCKS_X86_AVX512_X16
+	{ "avx512", (cpu_func_t)sha1_blocks_x86_avx512_x16,
+	  X86_CPU_FEATURE_AVX512F },
+#endif
+#ifdef HAVE_SHA1_BLOCKS_X86_AVX2_X8
+	{ "avx2", (cpu_func_t)sha1_blocks_x86_avx2_x8, X86_CPU_FEATURE_AVX2 },
+#endif
+	{ "none", NULL, 0 },
+};
+
+static void
+sha1_blocks_multi_select(const struct cpu_impl *impl)
+{
+	sha1_blocks_multi_func = (sha1_blocks_multi_func_t)impl->func;
+	sha1_multi_lanes = 1;
+#ifdef HAVE_SHA1_BLOCKS_X86_AVX512_X16
+	if (impl->func == (cpu_func_t)sha1_blocks_x86_avx512_x16)
+		sha1_multi_lanes = 16;
+#endif
+#ifdef HAVE_SHA1_BLOCKS_X86_AVX2_X8
+	if (impl->func == (cpu_func_t)sha1_blocks_x86_avx2_x8)
+		sha1_multi_lanes = 8;
+#endif
+}
+
+const struct cpu_kernel sha1_blocks_multi_kernel = {
+	.name = "sha1_multi",
+	.impls = sha1_blocks_multi_impls,
+	.num_impls = ARRAY_LEN(sha1_blocks_multi_impls),
+	.select = sha1_blocks_multi_select,
+};
+
+/*
+ * Process @num_blocks blocks from each of the @n buffers @data[0..n-1] into the
+ * SHA-1 states of the contexts @ctxs[0..n-1], where 2 <= @n <=
+ * sha1_multi_lanes.  Unused lanes just duplicate the first message.
+ */
+static void
+sha1_blocks_multi(struct sha1_ctx *const ctxs[], const void *const data[],
+		  unsigned n, size_t num_blocks)
+{
+	u32 h[5][SHA1_MAX_LANES] __attribute__((aligned(64)));
+	const u8 *ptrs[SHA1_MAX_LANES];
+	unsigned lanes = sha1_multi_lanes;
+	u64 start = perf_start();
+
+	for (unsigned l = 0; l < lanes; l++) {
+		unsigned src = (l < n) ? l : 0;
+
+		ptrs[l] = data[src];
+		for (int j = 0; j < 5; j++)
+			h[j][l] = ctxs[src]->h[j];
+	}
+
+	(*sha1_blocks_multi_func)(h, ptrs, num_blocks);
+
+	for (unsigned l = 0; l < n; l++)
+		for (int j = 0; j < 5; j++)
+			ctxs[l]->h[j] = h[j][l];
+	perf_end(PERF_HASH, start, n * num_blocks * SHA1_BLOCK_SIZE);
 }
 
 /*
@@ -622,6 +915,100 @@ sha1(const void *data, size_t len, u8 hash[SHA1_HASH_SIZE])
 	sha1_final(&ctx, hash);
 }
 
+/*
+ * Update each of the @num SHA-1 contexts @ctxs[i] with @len bytes of data from
+ * its own buffer @data[i].  This gives the same results as separate calls to
+ * sha1_update(), but it is faster when a multi-buffer implementation is
+ * available and the contexts are at a block boundary, e.g. when all of them
+ * have been updated only with whole blocks so far.
+ */
+void
+sha1_update_multi(struct sha1_ctx *const ctxs[], const void *const data[],
+		  unsigned num, size_t len)
+{
+	unsigned lanes = sha1_multi_lanes;
+	size_t blocks = len / SHA1_BLOCK_SIZE;
+	size_t tail = len % SHA1_BLOCK_SIZE;
+
+	for (unsigned i = 0; i < num; ) {
+		unsigned n = min(lanes, num - i);
+		bool aligned = (n >= 2 && blocks != 0);
+
+		for (unsigned l = 0; l < n && aligned; l++)
+			aligned = (ctxs[i + l]->bytecount % SHA1_BLOCK_SIZE == 0);
+
+		if (aligned) {
+			sha1_blocks_multi(&ctxs[i], &data[i], n, blocks);
+			for (unsigned l = 0; l < n; l++) {
+				struct sha1_ctx *ctx = ctxs[i + l];
+
+				ctx->bytecount += len;
+				memcpy(ctx->buffer, (const u8 *)data[i + l] +
+				       blocks * SHA1_BLOCK_SIZE, tail);
+			}
+		} else {
+			for (unsigned l = 0; l < n; l++)
+				sha1_update(ctxs[i + l], data[i + l], len);
+		}
+		i += n;
+	}
+}
+
+/*
+ * Calculate the SHA-1 message digests of the @num messages @data[i] of lengths
+ * @lens[i], storing them in @hashes[i].  The messages are hashed in parallel
+ * with sha1_update_multi() for as long as at least two of them have a whole
+ * block remaining; only the remainders are hashed one at a time.
+ */
+void
+sha1_multi(const void *const data[], const size_t lens[], unsigned num,
+	   u8 hashes[][SHA1_HASH_SIZE])
+{
+	for (unsigned i = 0; i < num; i += SHA1_MAX_LANES) {
+		unsigned n = min(SHA1_MAX_LANES, num - i);
+		struct sha1_ctx ctxs[SHA1_MAX_LANES];
+		size_t done[SHA1_MAX_LANES];
+
+		for (unsigned l = 0; l < n; l++) {
+			sha1_init(&ctxs[l]);
+			done[l] = 0;
+		}
+
+		for (;;) {
+			struct sha1_ctx *active_ctxs[SHA1_MAX_LANES];
+			const void *active_data[SHA1_MAX_LANES];
+			unsigned active_lanes[SHA1_MAX_LANES];
+			unsigned num_active = 0;
+			size_t len = SIZE_MAX;
+
+			for (unsigned l = 0; l < n; l++) {
+				size_t remaining = lens[i + l] - done[l];
+
+				if (remaining >= SHA1_BLOCK_SIZE) {
+					active_ctxs[num_active] = &ctxs[l];
+					active_data[num_active] =
+						(const u8 *)data[i + l] + done[l];
+					active_lanes[num_active++] = l;
+					len = min(len, remaining);
+				}
+			}
+			if (num_active < 2)
+				break;
+			len -= len % SHA1_BLOCK_SIZE;
+			sha1_update_multi(active_ctxs, active_data, num_active,
+					  len);
+			for (unsigned k = 0; k < num_active; k++)
+				done[active_lanes[k]] += len;
+		}
+
+		for (unsigned l = 0; l < n; l++) {
+			sha1_update(&ctxs[l], (const u8 *)data[i + l] + done[l],
+				    lens[i + l] - done[l]);
+			sha1_final(&ctxs[l], hashes[i + l]);
+		}
+	}
+}
+
 /* "Null" SHA-1 message digest containing all 0's */
 const u8 zero_hash[SHA1_HASH_SIZE];
 
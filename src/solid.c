@@ -25,14 +25,19 @@
 #  include "config.h"
 #endif
 
+#include <stdlib.h>
+
 #include "wimlib/blob_table.h"
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
 #include "wimlib/endianness.h"
 #include "wimlib/metadata.h"
 #include "wimlib/paths.h"
+#include "wimlib/resource.h"
 #include "wimlib/solid.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/unaligned.h"
+#include "wimlib/util.h"
 
 static const utf16lechar *
 get_extension(const utf16lechar *name, size_t nbytes)
@@ -160,8 +165,223 @@ image_fill_in_solid_sort_names(WIMStruct *wim)
 				  wim->private);
 }
 
+/*
+ * Ordering by similarity of contents (WIMLIB_WRITE_FLAG_SOLID_SORT_SIMILARITY)
+ *
+ * The names don't tell whether two files are similar, e.g. different versions
+ * of a library may have different names.  So, after the blobs have been sorted
+ * by name, a sketch of the contents of each is computed: the MinHash, under two
+ * different hash functions, of the set of 8-byte substrings of the blob's first
+ * SKETCH_SAMPLE_SIZE bytes.  Two blobs have the same MinHash under a hash
+ * function with a probability equal to the fraction of their substrings which
+ * they share, so they are likely to have the same sketch if they are very
+ * similar, but unlikely to if they merely contain some common phrases.  Each
+ * set of blobs with the same sketch is then moved to where the first of them is
+ * in the name order, so that they are compressed together.  The order of the
+ * other blobs is unchanged.
+ *
+ * Reading the start of each blob costs an extra read, but it's done in
+ * parallel, and the data is usually still cached when the blobs are written.
+ * Blobs in WIM resources aren't read, since they may have to be decompressed.
+ */
+
+/* Number of bytes at the start of each blob from which its sketch is computed */
+#define SKETCH_SAMPLE_SIZE	65536
+
+/* Blobs smaller than this aren't given a sketch  */
+#define SKETCH_MIN_BLOB_SIZE	4096
+
+/* Maximum number of tasks which read the starts of blobs for the sketches  */
+#define MAX_SKETCH_TASKS	16
+
+struct sketch_entry {
+	struct blob_descriptor *blob;
+
+	/* Position of the blob in the name order, and the position of the set
+	 * of similar blobs it belongs to  */
+	size_t name_pos;
+	size_t set_pos;
+
+	u32 minhash[2];
+
+	/* 0 if the sketch is valid, otherwise nonzero (-1 if not computed)  */
+	int ret;
+};
+
+struct sketch_task {
+	struct pool_task base;
+	struct sketch_entry *entries;
+	size_t num_entries;
+	size_t *next_entry;
+};
+
+static void
+compute_sketch(struct sketch_entry *e, const u8 *p, size_t n)
+{
+	u64 min0 = UINT64_MAX;
+	u64 min1 = UINT64_MAX;
+
+	/* Both hash functions are bijections, so the minimum identifies the
+	 * substring, and its low bits are as good an identifier as any.  */
+	for (size_t i = 0; i + 8 <= n; i++) {
+		u64 h = load_u64_unaligned(&p[i]) * 0x9E3779B97F4A7C15;
+		u64 h0 = h ^ (h >> 29);
+		u64 h1 = (h0 ^ 0x5851F42D4C957F2D) * 0xBF58476D1CE4E5B9;
+
+		min0 = min(min0, h0);
+		min1 = min(min1, h1 ^ (h1 >> 31));
+	}
+	e->minhash[0] = (u32)min0;
+	e->minhash[1] = (u32)min1;
+}
+
+static void
+read_sketch_entry(struct sketch_entry *e, u8 *buf)
+{
+	size_t size = min(e->blob->size, SKETCH_SAMPLE_SIZE);
+
+	e->ret = read_blob_prefix_into_buf(e->blob, size, buf);
+	if (e->ret == 0)
+		compute_sketch(e, buf, size);
+}
+
+static void
+sketch_task_run(struct pool_task *_task)
+{
+	struct sketch_task *task = (struct sketch_task *)_task;
+	u8 *buf = MALLOC(SKETCH_SAMPLE_SIZE);
+	size_t i;
+
+	if (!buf)
+		return;
+	while ((i = __atomic_fetch_add(task->next_entry, 1, __ATOMIC_RELAXED)) <
+	       task->num_entries)
+		read_sketch_entry(&task->entries[i], buf);
+	FREE(buf);
+}
+
+/* Sort the blobs with a valid sketch first, by sketch, then by name.  */
+static int
+cmp_sketch_entries_by_sketch(const void *p1, const void *p2)
+{
+	const struct sketch_entry *e1 = p1;
+	const struct sketch_entry *e2 = p2;
+
+	if ((e1->ret != 0) != (e2->ret != 0))
+		return (e1->ret != 0) - (e2->ret != 0);
+	if (e1->ret == 0 && e1->minhash[0] != e2->minhash[0])
+		return cmp_u32(e1->minhash[0], e2->minhash[0]);
+	if (e1->ret == 0 && e1->minhash[1] != e2->minhash[1])
+		return cmp_u32(e1->minhash[1], e2->minhash[1]);
+	return cmp_u64(e1->name_pos, e2->name_pos);
+}
+
+static int
+cmp_sketch_entries_by_set(const void *p1, const void *p2)
+{
+	const struct sketch_entry *e1 = p1;
+	const struct sketch_entry *e2 = p2;
+
+	if (e1->set_pos != e2->set_pos)
+		return cmp_u64(e1->set_pos, e2->set_pos);
+	return cmp_u64(e1->name_pos, e2->name_pos);
+}
+
+static bool
+should_sketch_blob(const struct blob_descriptor *blob)
+{
+	return blob->size >= SKETCH_MIN_BLOB_SIZE &&
+	       blob_can_be_read_concurrently(blob);
+}
+
+/* Gather the blobs in @blob_list, which are sorted by name, into sets of
+ * similar blobs as described above.  */
+static int
+sort_blob_list_by_similarity(struct list_head *blob_list, size_t num_blobs)
+{
+	struct sketch_task tasks[MAX_SKETCH_TASKS];
+	struct pool_task *task_ptrs[MAX_SKETCH_TASKS];
+	struct sketch_entry *entries;
+	struct blob_descriptor *blob;
+	size_t num_sketched = 0;
+	size_t next_entry = 0;
+	size_t pos = 0;
+	size_t i, j;
+	unsigned num_tasks;
+	u8 *buf;
+
+	entries = MALLOC(num_blobs * sizeof(entries[0]));
+	buf = MALLOC(SKETCH_SAMPLE_SIZE);
+	if (!entries || !buf) {
+		FREE(entries);
+		FREE(buf);
+		return WIMLIB_ERR_NOMEM;
+	}
+
+	/* Put the entries of the blobs to sketch first.  */
+	list_for_each_entry(blob, blob_list, write_blobs_list)
+		if (should_sketch_blob(blob))
+			num_sketched++;
+	i = 0;
+	j = num_sketched;
+	list_for_each_entry(blob, blob_list, write_blobs_list) {
+		struct sketch_entry *e = should_sketch_blob(blob) ?
+					 &entries[i++] : &entries[j++];
+
+		e->blob = blob;
+		e->name_pos = pos++;
+		e->minhash[0] = 0;
+		e->minhash[1] = 0;
+		e->ret = -1;
+	}
+
+	num_tasks = min(min(num_sketched, task_pool_num_threads()),
+			MAX_SKETCH_TASKS);
+	if (num_tasks > 1) {
+		for (unsigned k = 0; k < num_tasks; k++) {
+			tasks[k].base.run = sketch_task_run;
+			tasks[k].entries = entries;
+			tasks[k].num_entries = num_sketched;
+			tasks[k].next_entry = &next_entry;
+			task_ptrs[k] = &tasks[k].base;
+		}
+		task_pool_run_batch(task_ptrs, num_tasks);
+	}
+	for (i = 0; i < num_sketched; i++)
+		if (entries[i].ret < 0)
+			read_sketch_entry(&entries[i], buf);
+
+	/* Each set of similar blobs goes where its first blob by name is.  An
+	 * error reading a blob just leaves it where it is; it will be reported
+	 * when the blob is read in full.  */
+	qsort(entries, num_blobs, sizeof(entries[0]),
+	      cmp_sketch_entries_by_sketch);
+	for (i = 0; i < num_blobs; i = j) {
+		j = i + 1;
+		if (entries[i].ret == 0) {
+			while (j < num_blobs && entries[j].ret == 0 &&
+			       entries[j].minhash[0] == entries[i].minhash[0] &&
+			       entries[j].minhash[1] == entries[i].minhash[1])
+				j++;
+		}
+		for (size_t k = i; k < j; k++)
+			entries[k].set_pos = entries[i].name_pos;
+	}
+	qsort(entries, num_blobs, sizeof(entries[0]),
+	      cmp_sketch_entries_by_set);
+
+	INIT_LIST_HEAD(blob_list);
+	for (i = 0; i < num_blobs; i++)
+		list_add_tail(&entries[i].blob->write_blobs_list, blob_list);
+
+	FREE(entries);
+	FREE(buf);
+	return 0;
+}
+
 int
-sort_blob_list_for_solid_compression(struct list_head *blob_list)
+sort_blob_list_for_solid_compression(struct list_head *blob_list,
+				     bool by_similarity)
 {
 	size_t num_blobs = 0;
 	struct temp_blob_table blob_table;
@@ -233,6 +453,8 @@ sort_blob_list_for_solid_compression(struct list_head *blob_list)
 	ret = sort_blob_list(blob_list,
 			     offsetof(struct blob_descriptor, write_blobs_list),
 			     cmp_blobs_by_solid_sort_name);
+	if (!ret && by_similarity && num_blobs > 1)
+		ret = sort_blob_list_by_similarity(blob_list, num_blobs);
 
 out:
 	list_for_each_entry(blob, blob_list, write_blobs_list)
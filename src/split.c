@@ -34,6 +34,7 @@
 #include "wimlib/paths.h"
 #include "wimlib/progress.h"
 #include "wimlib/resource.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/wim.h"
 #include "wimlib/write.h"
 
@@ -57,34 +58,231 @@ struct swm_info {
 	u64 max_part_size;
 };
 
+/* Maximum number of parts written at the same time with
+ * WIMLIB_WRITE_FLAG_CONCURRENT_PARTS  */
+#define MAX_CONCURRENT_PARTS	8
+
+struct part_name_info {
+	const tchar *swm_name;
+	size_t base_name_len;
+	const tchar *suffix;
+};
+
+static void
+init_part_name_info(struct part_name_info *info, const tchar *swm_name)
+{
+	const tchar *dot = tstrrchr(path_basename(swm_name), T('.'));
+
+	info->swm_name = swm_name;
+	if (dot) {
+		info->base_name_len = dot - swm_name;
+		info->suffix = dot;
+	} else {
+		info->base_name_len = tstrlen(swm_name);
+		info->suffix = T("");
+	}
+}
+
+/* Get the name of the specified part, in a buffer of at least
+ * tstrlen(swm_name) + 20 characters.  */
+static void
+get_part_name(const struct part_name_info *info, unsigned part_number,
+	      tchar *buf)
+{
+	if (part_number == 1) {
+		tstrcpy(buf, info->swm_name);
+	} else {
+		tmemcpy(buf, info->swm_name, info->base_name_len);
+		tsprintf(&buf[info->base_name_len], T("%u%"TS),
+			 part_number, info->suffix);
+	}
+}
+
+static int
+write_split_wim_part(WIMStruct *orig_wim, const tchar *part_name,
+		     struct swm_info *swm_info, unsigned part_number,
+		     int write_flags, const u8 *guid)
+{
+	write_flags |= WIMLIB_WRITE_FLAG_USE_EXISTING_TOTALBYTES;
+	if (part_number != 1)
+		write_flags |= WIMLIB_WRITE_FLAG_NO_METADATA;
+
+	return write_wim_part(orig_wim,
+			      part_name,
+			      WIMLIB_ALL_IMAGES,
+			      write_flags,
+			      1,
+			      part_number,
+			      swm_info->num_parts,
+			      &swm_info->parts[part_number - 1].blob_list,
+			      guid);
+}
+
+/*
+ * Return true if the parts of the split WIM can be written concurrently.
+ *
+ * Each concurrent part is written through its own copy of the WIMStruct, which
+ * only holds the state of the output file.  That is only safe if writing the
+ * parts just copies resources from WIM files and reads uncompressed data, since
+ * decompressing data uses the decompressors cached in the WIMStruct being read
+ * from.
+ */
+static bool
+can_write_parts_concurrently(const WIMStruct *wim,
+			     const struct swm_info *swm_info, int write_flags)
+{
+	const struct blob_descriptor *blob;
+
+	if (!(write_flags & WIMLIB_WRITE_FLAG_CONCURRENT_PARTS) ||
+	    swm_info->num_parts < 2 ||
+	    (write_flags & (WIMLIB_WRITE_FLAG_RECOMPRESS |
+			    WIMLIB_WRITE_FLAG_PIPABLE)) ||
+	    wim_is_pipable(wim))
+		return false;
+
+	for (unsigned i = 0; i < wim->hdr.image_count; i++) {
+		blob = wim->image_metadata[i]->metadata_blob;
+		if (!(blob->rdesc->flags & WIM_RESHDR_FLAG_COMPRESSED) ||
+		    blob->rdesc->compression_type != wim->out_compression_type ||
+		    blob->rdesc->chunk_size != wim->out_chunk_size)
+			return false;
+	}
+
+	for (unsigned i = 0; i < swm_info->num_parts; i++) {
+		list_for_each_entry(blob, &swm_info->parts[i].blob_list,
+				    write_blobs_list)
+		{
+			const struct wim_resource_descriptor *rdesc;
+
+			if (blob->blob_location != BLOB_IN_WIM)
+				return false;
+			rdesc = blob->rdesc;
+			if (rdesc->is_pipable)
+				return false;
+			if ((rdesc->flags & WIM_RESHDR_FLAG_COMPRESSED) &&
+			    (rdesc->compression_type != wim->out_compression_type ||
+			     rdesc->chunk_size != wim->out_chunk_size))
+				return false;
+		}
+	}
+	return true;
+}
+
+struct part_write_task {
+	struct pool_task task;
+	WIMStruct part_wim;
+	tchar *part_name;
+	struct swm_info *swm_info;
+	unsigned part_number;
+	int write_flags;
+	const u8 *guid;
+	int ret;
+};
+
+static void
+run_part_write_task(struct pool_task *_task)
+{
+	struct part_write_task *task =
+		container_of(_task, struct part_write_task, task);
+
+	task->ret = write_split_wim_part(&task->part_wim, task->part_name,
+					 task->swm_info, task->part_number,
+					 task->write_flags, task->guid);
+}
+
+/* Write up to MAX_CONCURRENT_PARTS parts at a time, each by a task on the
+ * task pool.  The progress messages for the parts being written together are
+ * sent before and after the whole batch.  */
+static int
+write_split_wim_concurrently(WIMStruct *orig_wim,
+			     const struct part_name_info *name_info,
+			     struct swm_info *swm_info, int write_flags,
+			     const u8 *guid,
+			     union wimlib_progress_info *progress)
+{
+	struct part_write_task *tasks;
+	struct pool_task *task_ptrs[MAX_CONCURRENT_PARTS];
+	size_t name_size = tstrlen(name_info->swm_name) + 20;
+	unsigned num_tasks;
+	int ret;
+
+	num_tasks = min(swm_info->num_parts, MAX_CONCURRENT_PARTS);
+	tasks = CALLOC(num_tasks, sizeof(tasks[0]) + name_size * sizeof(tchar));
+	if (!tasks)
+		return WIMLIB_ERR_NOMEM;
+	for (unsigned i = 0; i < num_tasks; i++) {
+		tasks[i].part_name = (tchar *)&tasks[num_tasks] + i * name_size;
+		tasks[i].task.run = run_part_write_task;
+		task_ptrs[i] = &tasks[i].task;
+	}
+
+	for (unsigned first = 1; first <= swm_info->num_parts;
+	     first += num_tasks)
+	{
+		unsigned n = min(num_tasks, swm_info->num_parts - first + 1);
+
+		for (unsigned i = 0; i < n; i++) {
+			struct part_write_task *task = &tasks[i];
+
+			task->part_wim = *orig_wim;
+			task->part_wim.progfunc = NULL;
+			task->part_wim.progctx = NULL;
+			task->swm_info = swm_info;
+			task->part_number = first + i;
+			task->write_flags = write_flags;
+			task->guid = guid;
+			get_part_name(name_info, first + i, task->part_name);
+
+			progress->split.cur_part_number = first + i;
+			progress->split.part_name = task->part_name;
+			ret = call_progress(orig_wim->progfunc,
+					    WIMLIB_PROGRESS_MSG_SPLIT_BEGIN_PART,
+					    progress, orig_wim->progctx);
+			if (ret)
+				goto out;
+		}
+
+		task_pool_run_batch(task_ptrs, n);
+
+		for (unsigned i = 0; i < n; i++) {
+			ret = tasks[i].ret;
+			if (ret)
+				goto out;
+		}
+
+		for (unsigned i = 0; i < n; i++) {
+			unsigned part_number = first + i;
+
+			progress->split.completed_bytes +=
+				swm_info->parts[part_number - 1].size;
+			progress->split.cur_part_number = part_number;
+			progress->split.part_name = tasks[i].part_name;
+			ret = call_progress(orig_wim->progfunc,
+					    WIMLIB_PROGRESS_MSG_SPLIT_END_PART,
+					    progress, orig_wim->progctx);
+			if (ret)
+				goto out;
+		}
+	}
+	ret = 0;
+out:
+	FREE(tasks);
+	return ret;
+}
+
 static int
 write_split_wim(WIMStruct *orig_wim, const tchar *swm_name,
 		struct swm_info *swm_info, int write_flags)
 {
-	size_t swm_name_len;
-	tchar *swm_name_buf;
-	const tchar *dot;
-	tchar *swm_suffix;
-	size_t swm_base_name_len;
-
+	struct part_name_info name_info;
+	tchar *part_name;
 	union wimlib_progress_info progress;
 	unsigned part_number;
 	int ret;
 	u8 guid[GUID_SIZE];
 
-	swm_name_len = tstrlen(swm_name);
-	swm_name_buf = alloca((swm_name_len + 20) * sizeof(tchar));
-	tstrcpy(swm_name_buf, swm_name);
-	dot = tstrrchr(path_basename(swm_name_buf), T('.'));
-	if (dot) {
-		swm_base_name_len = dot - swm_name_buf;
-		swm_suffix = alloca((tstrlen(dot) + 1) * sizeof(tchar));
-		tstrcpy(swm_suffix, dot);
-	} else {
-		swm_base_name_len = swm_name_len;
-		swm_suffix = alloca(1 * sizeof(tchar));
-		swm_suffix[0] = T('\0');
-	}
+	init_part_name_info(&name_info, swm_name);
+	part_name = alloca((tstrlen(swm_name) + 20) * sizeof(tchar));
 
 	progress.split.completed_bytes = 0;
 	progress.split.total_bytes = 0;
@@ -94,16 +292,16 @@ write_split_wim(WIMStruct *orig_wim, const tchar *swm_name,
 
 	generate_guid(guid);
 
-	for (part_number = 1; part_number <= swm_info->num_parts; part_number++) {
-		int part_write_flags;
+	if (can_write_parts_concurrently(orig_wim, swm_info, write_flags))
+		return write_split_wim_concurrently(orig_wim, &name_info,
+						    swm_info, write_flags, guid,
+						    &progress);
 
-		if (part_number != 1) {
-			tsprintf(swm_name_buf + swm_base_name_len,
-				 T("%u%"TS), part_number, swm_suffix);
-		}
+	for (part_number = 1; part_number <= swm_info->num_parts; part_number++) {
+		get_part_name(&name_info, part_number, part_name);
 
 		progress.split.cur_part_number = part_number;
-		progress.split.part_name = swm_name_buf;
+		progress.split.part_name = part_name;
 
 		ret = call_progress(orig_wim->progfunc,
 				    WIMLIB_PROGRESS_MSG_SPLIT_BEGIN_PART,
@@ -112,20 +310,8 @@ write_split_wim(WIMStruct *orig_wim, const tchar *swm_name,
 		if (ret)
 			return ret;
 
-		part_write_flags = write_flags;
-		part_write_flags |= WIMLIB_WRITE_FLAG_USE_EXISTING_TOTALBYTES;
-		if (part_number != 1)
-			part_write_flags |= WIMLIB_WRITE_FLAG_NO_METADATA;
-
-		ret = write_wim_part(orig_wim,
-				     progress.split.part_name,
-				     WIMLIB_ALL_IMAGES,
-				     part_write_flags,
-				     1,
-				     part_number,
-				     swm_info->num_parts,
-				     &swm_info->parts[part_number - 1].blob_list,
-				     guid);
+		ret = write_split_wim_part(orig_wim, part_name, swm_info,
+					   part_number, write_flags, guid);
 		if (ret)
 			return ret;
 
@@ -0,0 +1,932 @@
+/*
+ * tar_apply.c
+ *
+ * Extract files from a WIM image to a tar archive, without creating them on
+ * the filesystem first.
+ *
+ * The archive is written from start to end exactly once, so it can be a pipe.
+ * The empty files and special files come first, since they have no data to
+ * read.  Then each regular file and symbolic link is written when its blob is
+ * read from the WIM archive, so the data of the files is read in the same order
+ * as when extracting them to a directory, and is streamed to the archive rather
+ * than held in memory.  The additional names of a file with hard links are
+ * written as hard link members just after the file itself.  The directories
+ * come last, so that extracting the archive gives them the right timestamps.
+ *
+ * The archive is in the POSIX pax format: each member has a ustar header,
+ * preceded by a pax extended header if the member has a long name, a large
+ * size or ID, a timestamp that isn't a whole number of seconds, or extended
+ * attributes.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _WIN32
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+#  include <sys/sysmacros.h>
+#endif
+#include <unistd.h>
+
+#include "wimlib/apply.h"
+#include "wimlib/assert.h"
+#include "wimlib/blob_table.h"
+#include "wimlib/dentry.h"
+#include "wimlib/error.h"
+#include "wimlib/file_io.h"
+#include "wimlib/inode.h"
+#include "wimlib/reparse.h"
+#include "wimlib/tar.h"
+#include "wimlib/timestamp.h"
+#include "wimlib/unix_data.h"
+#include "wimlib/xattr.h"
+
+/* Size of the buffer in which the archive is built before it's written out  */
+#define TAR_OUTPUT_BUFFER_SIZE	(1U << 18)
+
+struct tar_apply_ctx {
+	/* Extract flags, the pointer to the WIMStruct, etc.  */
+	struct apply_ctx common;
+
+	/* The archive being written, and whether it's standard output  */
+	struct filedes out_fd;
+	bool out_is_stdout;
+
+	/* The data not yet written to the archive  */
+	u8 *buf;
+	size_t buf_filled;
+
+	/* Buffers for building member names, one for the member itself and one
+	 * for the target of a hard link member (allocated)  */
+	char *namebuf;
+	char *linkbuf;
+
+	/* The records of the pax extended header of the next member  */
+	char *pax;
+	size_t pax_len;
+	size_t pax_alloc;
+
+	/* Buffer for the reparse data of the symbolic link being read, and how
+	 * far it has been filled, or NULL if the blob being read isn't the
+	 * reparse data of a symbolic link  */
+	u8 reparse_data[REPARSE_DATA_MAX_SIZE];
+	u8 *reparse_ptr;
+
+	/* Number of special files skipped, e.g. sockets, which tar archives
+	 * can't contain  */
+	unsigned long num_special_files_ignored;
+};
+
+static int
+tar_get_supported_features(const char *target,
+			   struct wim_features *supported_features)
+{
+	supported_features->hard_links = 1;
+	supported_features->symlink_reparse_points = 1;
+	supported_features->unix_data = 1;
+	supported_features->timestamps = 1;
+	supported_features->case_sensitive_filenames = 1;
+	supported_features->xattrs = 1;
+	return 0;
+}
+
+/* Should the specified file be archived as a directory?  Like on UNIX, this is
+ * the case if it's a directory and not a symlink or junction.  */
+static inline bool
+should_extract_as_directory(const struct wim_inode *inode)
+{
+	return (inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY) &&
+		!inode_is_symlink(inode);
+}
+
+/* Is @dentry the first alias of an empty regular file or a special file?  */
+static bool
+is_empty_file_to_extract(const struct wim_dentry *dentry)
+{
+	const struct wim_inode *inode = dentry->d_inode;
+
+	return dentry == inode_first_extraction_dentry(inode) &&
+		!should_extract_as_directory(inode) &&
+		!inode_is_symlink(inode) &&
+		!inode_get_blob_for_unnamed_data_stream_resolved(inode);
+}
+
+/* Returns the number of characters in the path to @dentry relative to the
+ * extraction root, plus one for a leading slash.  */
+static size_t
+tar_dentry_path_length(const struct wim_dentry *dentry)
+{
+	size_t len = 0;
+	const struct wim_dentry *d;
+
+	d = dentry;
+	do {
+		len += d->d_extraction_name_nchars + 1;
+		d = d->d_parent;
+	} while (!dentry_is_root(d) && will_extract_dentry(d));
+
+	return len;
+}
+
+/* Builds in @buf and returns the name of the member for @dentry.  Directories
+ * get a trailing slash, and the root directory is named "./".  */
+static const char *
+tar_build_member_name(const struct wim_dentry *dentry, char *buf)
+{
+	char *p;
+	const struct wim_dentry *d;
+
+	if (dentry_is_root(dentry))
+		return "./";
+
+	p = &buf[tar_dentry_path_length(dentry)];
+	if (should_extract_as_directory(dentry->d_inode)) {
+		p[0] = '/';
+		p[1] = '\0';
+	} else {
+		p[0] = '\0';
+	}
+	d = dentry;
+	do {
+		p -= d->d_extraction_name_nchars;
+		memcpy(p, d->d_extraction_name, d->d_extraction_name_nchars);
+		*--p = '/';
+		d = d->d_parent;
+	} while (!dentry_is_root(d) && will_extract_dentry(d));
+
+	return buf + 1;
+}
+
+static int
+tar_flush(struct tar_apply_ctx *ctx)
+{
+	int ret;
+
+	if (!ctx->buf_filled)
+		return 0;
+	ret = full_write(&ctx->out_fd, ctx->buf, ctx->buf_filled);
+	if (ret) {
+		ERROR_WITH_ERRNO("Error writing tar archive \"%s\"",
+				 ctx->common.target);
+		return ret;
+	}
+	ctx->buf_filled = 0;
+	return 0;
+}
+
+/* Append @size bytes to the archive, or zeroes if @data is NULL.  */
+static int
+tar_write(struct tar_apply_ctx *ctx, const void *data, size_t size)
+{
+	while (size) {
+		size_t n;
+
+		if (ctx->buf_filled == TAR_OUTPUT_BUFFER_SIZE) {
+			int ret = tar_flush(ctx);
+			if (ret)
+				return ret;
+		}
+		n = min(size, TAR_OUTPUT_BUFFER_SIZE - ctx->buf_filled);
+		if (data) {
+			memcpy(&ctx->buf[ctx->buf_filled], data, n);
+			data += n;
+		} else {
+			memset(&ctx->buf[ctx->buf_filled], 0, n);
+		}
+		ctx->buf_filled += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/* Pad the data of a member, which has @size bytes, to a whole block.  */
+static int
+tar_write_padding(struct tar_apply_ctx *ctx, u64 size)
+{
+	return tar_write(ctx, NULL, -size & (TAR_BLOCK_SIZE - 1));
+}
+
+/* Store @value in the numeric field @field, which has @len bytes, in octal
+ * ASCII if it fits, else in the GNU base-256 format.  Returns true if it fit in
+ * octal, which is all that POSIX readers are required to understand.  */
+static bool
+tar_format_number(char *field, size_t len, u64 value)
+{
+	if ((len - 1) * 3 >= 64 || value < ((u64)1 << ((len - 1) * 3))) {
+		field[len - 1] = '\0';
+		for (size_t i = len - 1; i-- > 0; value >>= 3)
+			field[i] = '0' + (value & 7);
+		return true;
+	}
+	for (size_t i = len; i-- > 1; value >>= 8)
+		field[i] = value & 0xFF;
+	field[0] = 0x80;
+	return false;
+}
+
+static size_t
+count_digits(size_t n)
+{
+	size_t digits = 1;
+
+	while (n >= 10) {
+		n /= 10;
+		digits++;
+	}
+	return digits;
+}
+
+/* Append a record "<length> <key>=<value>\n" to the pax extended header of the
+ * next member.  The length includes itself.  */
+static int
+tar_add_pax_record(struct tar_apply_ctx *ctx, const char *key,
+		   const void *value, size_t value_len)
+{
+	size_t base = strlen(key) + value_len + 3;
+	size_t len = base + count_digits(base);
+	char *p;
+
+	len = base + count_digits(len);
+
+	if (ctx->pax_len + len > ctx->pax_alloc) {
+		size_t new_alloc = max(ctx->pax_len + len, ctx->pax_alloc * 2);
+		char *new_pax = REALLOC(ctx->pax, new_alloc);
+
+		if (!new_pax)
+			return WIMLIB_ERR_NOMEM;
+		ctx->pax = new_pax;
+		ctx->pax_alloc = new_alloc;
+	}
+	p = &ctx->pax[ctx->pax_len];
+	p += sprintf(p, "%zu %s=", len, key);
+	p = mempcpy(p, value, value_len);
+	*p = '\n';
+	ctx->pax_len += len;
+	return 0;
+}
+
+static int
+tar_add_pax_number(struct tar_apply_ctx *ctx, const char *key, u64 value)
+{
+	char buf[32];
+
+	return tar_add_pax_record(ctx, key, buf,
+				  sprintf(buf, "%"PRIu64, value));
+}
+
+/* Add a pax record for a timestamp in seconds since the UNIX epoch, with as
+ * many decimal places as needed.  */
+static int
+tar_add_pax_time(struct tar_apply_ctx *ctx, const char *key,
+		 const struct timespec *ts)
+{
+	char buf[64];
+	s64 sec = ts->tv_sec;
+	long nsec = ts->tv_nsec;
+	const char *sign = "";
+	int len;
+
+	if (sec < 0) {
+		sign = "-";
+		sec = -sec;
+		if (nsec) {
+			sec--;
+			nsec = 1000000000 - nsec;
+		}
+	}
+	len = sprintf(buf, "%s%"PRIu64".%09ld", sign, (u64)sec, nsec);
+	while (buf[len - 1] == '0')
+		len--;
+	if (buf[len - 1] == '.')
+		len--;
+	return tar_add_pax_record(ctx, key, buf, len);
+}
+
+/* Add pax records for the extended attributes of @inode.  */
+static int
+tar_add_pax_xattrs(struct tar_apply_ctx *ctx, const struct wim_inode *inode,
+		   const char *name)
+{
+	const void *entries;
+	const void *entries_end;
+	u32 entries_size;
+	bool is_old_format;
+	char key[sizeof("SCHILY.xattr.") + WIM_XATTR_NAME_MAX];
+
+	entries = inode_get_linux_xattrs(inode, &entries_size, &is_old_format);
+	if (!entries)
+		return 0;
+	entries_end = entries + entries_size;
+
+	for (const void *entry = entries;
+	     entry < entries_end;
+	     entry = is_old_format ? (const void *)old_xattr_entry_next(entry) :
+				     (const void *)xattr_entry_next(entry))
+	{
+		bool valid;
+		u16 name_len;
+		const void *value;
+		u32 value_len;
+		int ret;
+
+		if (is_old_format) {
+			valid = old_valid_xattr_entry(entry,
+						      entries_end - entry);
+		} else {
+			valid = valid_xattr_entry(entry, entries_end - entry);
+		}
+		if (!valid) {
+			ERROR("\"%s\": extended attribute is corrupt or unsupported",
+			      name);
+			return WIMLIB_ERR_INVALID_XATTR;
+		}
+		if (is_old_format) {
+			const struct wimlib_xattr_entry_old *e = entry;
+
+			name_len = le16_to_cpu(e->name_len);
+			memcpy(key + 13, e->name, name_len);
+			value = e->name + name_len;
+			value_len = le32_to_cpu(e->value_len);
+		} else {
+			const struct wim_xattr_entry *e = entry;
+
+			name_len = e->name_len;
+			memcpy(key + 13, e->name, name_len);
+			value = e->name + name_len + 1;
+			value_len = le16_to_cpu(e->value_len);
+		}
+		memcpy(key, "SCHILY.xattr.", 13);
+		key[13 + name_len] = '\0';
+
+		ret = tar_add_pax_record(ctx, key, value, value_len);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Store the path @name in the 'name' and 'prefix' fields of @hdr, split at a
+ * slash if needed.  Returns false if it doesn't fit.  */
+static bool
+tar_set_header_name(struct tar_header *hdr, const char *name, size_t len)
+{
+	if (len <= sizeof(hdr->name)) {
+		memcpy(hdr->name, name, len);
+		return true;
+	}
+	for (size_t i = min(len - 1, sizeof(hdr->prefix)); i > 0; i--) {
+		if (name[i] != '/' || i == len - 1)
+			continue;
+		if (len - i - 1 > sizeof(hdr->name))
+			break;
+		memcpy(hdr->prefix, name, i);
+		memcpy(hdr->name, &name[i + 1], len - i - 1);
+		return true;
+	}
+	return false;
+}
+
+/* Finish the header @hdr and write it, so that @typeflag is the member's type.
+ */
+static int
+tar_write_header(struct tar_apply_ctx *ctx, struct tar_header *hdr,
+		 char typeflag)
+{
+	const u8 *p = (const u8 *)hdr;
+	u32 sum = 0;
+
+	STATIC_ASSERT(sizeof(*hdr) == TAR_BLOCK_SIZE);
+
+	hdr->typeflag = typeflag;
+	memcpy(hdr->magic, "ustar", 6);
+	memcpy(hdr->version, "00", 2);
+	memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+	for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+		sum += p[i];
+	tar_format_number(hdr->chksum, 7, sum);
+	return tar_write(ctx, hdr, sizeof(*hdr));
+}
+
+/*
+ * Write the header of a member of the archive for the file @inode, preceded by
+ * a pax extended header if needed.
+ *
+ * @name is the member's name, @typeflag its type, @size the size of its data,
+ * and @linkname the target of a symbolic link or hard link member, or NULL.
+ */
+static int
+tar_write_member_header(struct tar_apply_ctx *ctx,
+			const struct wim_inode *inode, const char *name,
+			char typeflag, u64 size, const char *linkname)
+{
+	struct tar_header hdr = {};
+	struct wimlib_unix_data unix_data;
+	struct timespec mtime;
+	u32 mode;
+	int ret;
+
+	ctx->pax_len = 0;
+
+	if (!tar_set_header_name(&hdr, name, strlen(name))) {
+		memcpy(hdr.name, name, sizeof(hdr.name));
+		ret = tar_add_pax_record(ctx, "path", name, strlen(name));
+		if (ret)
+			return ret;
+	}
+	if (linkname) {
+		size_t len = strlen(linkname);
+
+		memcpy(hdr.linkname, linkname, min(len, sizeof(hdr.linkname)));
+		if (len > sizeof(hdr.linkname)) {
+			ret = tar_add_pax_record(ctx, "linkpath",
+						 linkname, len);
+			if (ret)
+				return ret;
+		}
+	}
+
+	if (typeflag == '5')
+		mode = 0755;
+	else if (typeflag == '2')
+		mode = 0777;
+	else
+		mode = 0644;
+	unix_data.uid = 0;
+	unix_data.gid = 0;
+	if ((ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA) &&
+	    inode_get_unix_data(inode, &unix_data))
+	{
+		if (typeflag != '2')
+			mode = unix_data.mode & 07777;
+		if (typeflag == '3' || typeflag == '4') {
+			tar_format_number(hdr.devmajor, sizeof(hdr.devmajor),
+					  major(unix_data.rdev));
+			tar_format_number(hdr.devminor, sizeof(hdr.devminor),
+					  minor(unix_data.rdev));
+		}
+	}
+	tar_format_number(hdr.mode, sizeof(hdr.mode), mode);
+	if (!tar_format_number(hdr.uid, sizeof(hdr.uid), unix_data.uid)) {
+		ret = tar_add_pax_number(ctx, "uid", unix_data.uid);
+		if (ret)
+			return ret;
+	}
+	if (!tar_format_number(hdr.gid, sizeof(hdr.gid), unix_data.gid)) {
+		ret = tar_add_pax_number(ctx, "gid", unix_data.gid);
+		if (ret)
+			return ret;
+	}
+	if (!tar_format_number(hdr.size, sizeof(hdr.size), size)) {
+		ret = tar_add_pax_number(ctx, "size", size);
+		if (ret)
+			return ret;
+	}
+
+	/* The header can only hold a whole number of seconds since the UNIX
+	 * epoch, up to the year 6429.  */
+	mtime = wim_timestamp_to_timespec(inode->i_last_write_time);
+	if (mtime.tv_sec >= 0 && mtime.tv_sec <= 077777777777)
+		tar_format_number(hdr.mtime, sizeof(hdr.mtime), mtime.tv_sec);
+	else
+		tar_format_number(hdr.mtime, sizeof(hdr.mtime), 0);
+	if (mtime.tv_nsec || mtime.tv_sec < 0 || mtime.tv_sec > 077777777777) {
+		ret = tar_add_pax_time(ctx, "mtime", &mtime);
+		if (ret)
+			return ret;
+	}
+
+	/* A hard link member gets its extended attributes from its target.  */
+	if ((ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA) &&
+	    typeflag != '1')
+	{
+		ret = tar_add_pax_xattrs(ctx, inode, name);
+		if (ret)
+			return ret;
+	}
+
+	if (ctx->pax_len) {
+		struct tar_header pax_hdr = {};
+
+		memcpy(pax_hdr.name, "././@PaxHeader",
+		       sizeof("././@PaxHeader") - 1);
+		memcpy(pax_hdr.mode, hdr.mode, sizeof(hdr.mode));
+		memcpy(pax_hdr.uid, hdr.uid, sizeof(hdr.uid));
+		memcpy(pax_hdr.gid, hdr.gid, sizeof(hdr.gid));
+		memcpy(pax_hdr.mtime, hdr.mtime, sizeof(hdr.mtime));
+		tar_format_number(pax_hdr.size, sizeof(pax_hdr.size),
+				  ctx->pax_len);
+		ret = tar_write_header(ctx, &pax_hdr, 'x');
+		if (!ret)
+			ret = tar_write(ctx, ctx->pax, ctx->pax_len);
+		if (!ret)
+			ret = tar_write_padding(ctx, ctx->pax_len);
+		if (ret)
+			return ret;
+	}
+
+	return tar_write_header(ctx, &hdr, typeflag);
+}
+
+/* Write hard link members for the aliases of @inode other than the first,
+ * which has already been written.  */
+static int
+tar_write_hard_links(struct tar_apply_ctx *ctx, const struct wim_inode *inode)
+{
+	const struct wim_dentry *first_dentry;
+	const struct wim_dentry *dentry;
+	const char *linkname = NULL;
+	int ret;
+
+	first_dentry = inode_first_extraction_dentry(inode);
+	inode_for_each_extraction_alias(dentry, inode) {
+		if (dentry == first_dentry)
+			continue;
+		if (!linkname)
+			linkname = tar_build_member_name(first_dentry,
+							 ctx->linkbuf);
+		ret = tar_write_member_header(ctx, inode,
+					      tar_build_member_name(dentry,
+								    ctx->namebuf),
+					      '1', 0, linkname);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Write the member for the empty regular file or special file whose first
+ * alias is @dentry, and any hard links to it.  */
+static int
+tar_write_empty_file(const struct wim_dentry *dentry,
+		     struct tar_apply_ctx *ctx)
+{
+	const struct wim_inode *inode = dentry->d_inode;
+	struct wimlib_unix_data unix_data;
+	const char *name;
+	char typeflag = '0';
+	int ret;
+
+	name = tar_build_member_name(dentry, ctx->namebuf);
+
+	/* Recognize special files in UNIX_DATA mode  */
+	if ((ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA) &&
+	    inode_get_unix_data(inode, &unix_data) &&
+	    !S_ISREG(unix_data.mode))
+	{
+		if (S_ISCHR(unix_data.mode)) {
+			typeflag = '3';
+		} else if (S_ISBLK(unix_data.mode)) {
+			typeflag = '4';
+		} else if (S_ISFIFO(unix_data.mode)) {
+			typeflag = '6';
+		} else {
+			WARNING("Can't archive special file \"%s\"", name);
+			ctx->num_special_files_ignored++;
+			return 0;
+		}
+	}
+
+	ret = tar_write_member_header(ctx, inode, name, typeflag, 0, NULL);
+	if (ret)
+		return ret;
+	return tar_write_hard_links(ctx, inode);
+}
+
+/* Write the members for the empty files and special files, which have no
+ * representatives in the blob list.  */
+static int
+tar_write_empty_files(const struct list_head *dentry_list,
+		      struct tar_apply_ctx *ctx)
+{
+	const struct wim_dentry *dentry;
+	u64 count = 0;
+	int ret;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
+		if (is_empty_file_to_extract(dentry))
+			count++;
+
+	ret = start_file_structure_phase(&ctx->common, count);
+	if (ret)
+		return ret;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		if (!is_empty_file_to_extract(dentry))
+			continue;
+		ret = tar_write_empty_file(dentry, ctx);
+		if (ret)
+			return ret;
+		ret = report_file_created(&ctx->common);
+		if (ret)
+			return ret;
+	}
+
+	return end_file_structure_phase(&ctx->common);
+}
+
+/*
+ * Write the members for the directories.  They come last, after all the files
+ * in them, for the same reason that directory metadata is set last when
+ * extracting to a directory: tar programs create the directories they need for
+ * a file if they don't exist yet, but they set a directory's timestamps when
+ * extracting its member, and then creating more files in it would change them.
+ */
+static int
+tar_write_dirs(const struct list_head *dentry_list, struct tar_apply_ctx *ctx)
+{
+	const struct wim_dentry *dentry;
+	u64 count = 0;
+	int ret;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
+		if (should_extract_as_directory(dentry->d_inode))
+			count++;
+
+	ret = start_file_metadata_phase(&ctx->common, count);
+	if (ret)
+		return ret;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		if (!should_extract_as_directory(dentry->d_inode))
+			continue;
+		ret = tar_write_member_header(ctx, dentry->d_inode,
+					      tar_build_member_name(dentry,
+								    ctx->namebuf),
+					      '5', 0, NULL);
+		if (ret)
+			return ret;
+		ret = report_file_metadata_applied(&ctx->common);
+		if (ret)
+			return ret;
+	}
+
+	return end_file_metadata_phase(&ctx->common);
+}
+
+/* Called when starting to read a blob for extraction.  Since a tar archive
+ * holds a separate copy of the data of each file, each blob is given to us for
+ * one file at a time.  */
+static int
+tar_begin_extract_blob(struct blob_descriptor *blob, void *_ctx)
+{
+	struct tar_apply_ctx *ctx = _ctx;
+	const struct blob_extraction_target *target =
+		&blob_extraction_targets(blob)[0];
+	const struct wim_inode *inode = target->inode;
+
+	wimlib_assert(blob->out_refcnt == 1);
+
+	if (unlikely(target->stream->stream_type == STREAM_TYPE_REPARSE_POINT)) {
+		/* The symbolic link's member can only be written once its
+		 * target is known.  */
+		if (blob->size > REPARSE_DATA_MAX_SIZE) {
+			ERROR("Reparse data of \"%s\" has size "
+			      "%"PRIu64" bytes (exceeds %u bytes)",
+			      inode_any_full_path(inode),
+			      blob->size, REPARSE_DATA_MAX_SIZE);
+			return WIMLIB_ERR_INVALID_REPARSE_DATA;
+		}
+		ctx->reparse_ptr = ctx->reparse_data;
+		return 0;
+	}
+
+	wimlib_assert(stream_is_unnamed_data_stream(target->stream));
+
+	return tar_write_member_header(ctx, inode,
+				       tar_build_member_name(inode_first_extraction_dentry(inode),
+							     ctx->namebuf),
+				       '0', blob->size, NULL);
+}
+
+/* Called when the reader could place the next chunk of a blob straight into a
+ * buffer of ours.  File data goes right into the output buffer.  */
+static int
+tar_get_chunk_dest(const struct blob_descriptor *blob, u64 offset,
+		   void **buf_ret, size_t *size_ret, void *_ctx)
+{
+	struct tar_apply_ctx *ctx = _ctx;
+
+	if (ctx->reparse_ptr)
+		return 0;
+
+	if (TAR_OUTPUT_BUFFER_SIZE - ctx->buf_filled < *size_ret) {
+		int ret = tar_flush(ctx);
+		if (ret)
+			return ret;
+	}
+	*buf_ret = &ctx->buf[ctx->buf_filled];
+	*size_ret = min(*size_ret, TAR_OUTPUT_BUFFER_SIZE - ctx->buf_filled);
+	return 0;
+}
+
+/* Called when the next chunk of a blob has been read for extraction  */
+static int
+tar_extract_chunk(const struct blob_descriptor *blob, u64 offset,
+		  const void *chunk, size_t size, void *_ctx)
+{
+	struct tar_apply_ctx *ctx = _ctx;
+
+	if (ctx->reparse_ptr) {
+		ctx->reparse_ptr = mempcpy(ctx->reparse_ptr, chunk, size);
+		return 0;
+	}
+
+	/* The data is already in place if the reader used the buffer from
+	 * tar_get_chunk_dest().  */
+	if (chunk == &ctx->buf[ctx->buf_filled]) {
+		ctx->buf_filled += size;
+		return 0;
+	}
+	return tar_write(ctx, chunk, size);
+}
+
+/* Write the member for the symbolic link @inode, whose reparse data has been
+ * read.  */
+static int
+tar_write_symlink(struct tar_apply_ctx *ctx, const struct wim_inode *inode,
+		  size_t rpdatalen)
+{
+	char target[REPARSE_POINT_MAX_SIZE];
+	struct blob_descriptor blob_override;
+	const char *name;
+	int ret;
+
+	name = tar_build_member_name(inode_first_extraction_dentry(inode),
+				     ctx->namebuf);
+
+	blob_set_is_located_in_attached_buffer(&blob_override,
+					       ctx->reparse_data, rpdatalen);
+
+	/* An absolute link is made relative to the root of the archive's
+	 * directory tree, which with reparse point fixups is the root of the
+	 * image.  */
+	ret = wim_inode_readlink(inode, target, sizeof(target) - 1,
+				 &blob_override, NULL, 0);
+	if (unlikely(ret < 0)) {
+		errno = -ret;
+		ERROR_WITH_ERRNO("Can't get the target of symbolic link \"%s\"",
+				 name);
+		return WIMLIB_ERR_READLINK;
+	}
+	target[ret] = '\0';
+
+	return tar_write_member_header(ctx, inode, name, '2', 0, target);
+}
+
+/* Called when a blob has been fully read for extraction  */
+static int
+tar_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
+{
+	struct tar_apply_ctx *ctx = _ctx;
+	const struct wim_inode *inode = blob_extraction_targets(blob)[0].inode;
+	bool is_symlink = (ctx->reparse_ptr != NULL);
+	int ret;
+
+	ctx->reparse_ptr = NULL;
+
+	if (status)
+		return status;
+
+	if (is_symlink)
+		ret = tar_write_symlink(ctx, inode, blob->size);
+	else
+		ret = tar_write_padding(ctx, blob->size);
+	if (ret)
+		return ret;
+
+	return tar_write_hard_links(ctx, inode);
+}
+
+static int
+tar_open_output(struct tar_apply_ctx *ctx)
+{
+	const char *target = ctx->common.target;
+	int fd;
+
+	if (!strcmp(target, "-")) {
+		filedes_init(&ctx->out_fd, STDOUT_FILENO);
+		ctx->out_is_stdout = true;
+		return 0;
+	}
+
+	fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ERROR_WITH_ERRNO("Can't open \"%s\" for writing", target);
+		return WIMLIB_ERR_OPEN;
+	}
+	filedes_init(&ctx->out_fd, fd);
+	return 0;
+}
+
+static int
+tar_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
+{
+	struct tar_apply_ctx *ctx = (struct tar_apply_ctx *)_ctx;
+	const struct wim_dentry *dentry;
+	size_t path_max = 0;
+	int ret;
+
+	filedes_invalidate(&ctx->out_fd);
+
+	/* Each file's data must be written out separately, unless the files
+	 * are hard links of each other.  So have a blob with several targets
+	 * extracted through a temporary file, then passed to us once for each
+	 * target, rather than holding the data of possibly huge blobs in
+	 * memory.  */
+	ctx->common.max_open_files = 1;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
+		path_max = max(path_max, tar_dentry_path_length(dentry));
+	path_max += 2;
+
+	ctx->buf = MALLOC(TAR_OUTPUT_BUFFER_SIZE);
+	ctx->namebuf = MALLOC(path_max);
+	ctx->linkbuf = MALLOC(path_max);
+	if (!ctx->buf || !ctx->namebuf || !ctx->linkbuf) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out;
+	}
+
+	ret = tar_open_output(ctx);
+	if (ret)
+		goto out;
+
+	ret = tar_write_empty_files(dentry_list, ctx);
+	if (ret)
+		goto out;
+
+	struct read_blob_callbacks cbs = {
+		.begin_blob	= tar_begin_extract_blob,
+		.continue_blob	= tar_extract_chunk,
+		.end_blob	= tar_end_extract_blob,
+		.get_chunk_dest	= tar_get_chunk_dest,
+		.ctx		= ctx,
+	};
+	ret = extract_blob_list(&ctx->common, &cbs);
+	if (ret)
+		goto out;
+
+	ret = tar_write_dirs(dentry_list, ctx);
+	if (ret)
+		goto out;
+
+	/* The end of the archive is marked by two blocks of zeroes.  */
+	ret = tar_write(ctx, NULL, 2 * TAR_BLOCK_SIZE);
+	if (!ret)
+		ret = tar_flush(ctx);
+	if (ret)
+		goto out;
+
+	if (ctx->num_special_files_ignored) {
+		WARNING("%lu special files were not extracted, since tar "
+			"archives can't contain them!",
+			ctx->num_special_files_ignored);
+	}
+out:
+	if (filedes_valid(&ctx->out_fd) && !ctx->out_is_stdout &&
+	    filedes_close(&ctx->out_fd) && !ret)
+	{
+		ERROR_WITH_ERRNO("Error closing \"%s\"", ctx->common.target);
+		ret = WIMLIB_ERR_WRITE;
+	}
+	FREE(ctx->pax);
+	FREE(ctx->linkbuf);
+	FREE(ctx->namebuf);
+	FREE(ctx->buf);
+	return ret;
+}
+
+const struct apply_operations tar_apply_ops = {
+	.name			= "tar",
+	.get_supported_features = tar_get_supported_features,
+	.extract                = tar_extract,
+	.context_size           = sizeof(struct tar_apply_ctx),
+};
+
+#endif /* !_WIN32 */
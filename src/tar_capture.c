@@ -0,0 +1,1073 @@
+/*
+ * tar_capture.c
+ *
+ * Capture a WIM image from a tar archive, without unpacking it first.
+ *
+ * The archive is read from start to end exactly once, so it can be a pipe.  If
+ * it's a regular file, then the data of each archived file is referenced in
+ * place, as a blob located in the archive at an offset, and is read when the
+ * WIM archive is written, in the order it's stored in the tar archive.  If it's
+ * a pipe, the data can't be read again, so it's read into memory as the archive
+ * is scanned.  Either way, the image's directory tree must be complete before
+ * any data is written, as the blobs are deduplicated and sorted first.
+ *
+ * The archive formats understood are POSIX ustar and pax, including pax
+ * extended headers for long paths, large files, and precise timestamps, and
+ * the GNU format with its long name records.  Multi-volume archives and sparse
+ * files, which only GNU tar creates, aren't supported.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _WIN32
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+#  include <sys/sysmacros.h>
+#endif
+#include <unistd.h>
+
+#include "wimlib/blob_table.h"
+#include "wimlib/dentry.h"
+#include "wimlib/error.h"
+#include "wimlib/file_io.h"
+#include "wimlib/inode.h"
+#include "wimlib/reparse.h"
+#include "wimlib/scan.h"
+#include "wimlib/tar.h"
+#include "wimlib/timestamp.h"
+#include "wimlib/unix_data.h"
+
+/* The largest pax extended header or GNU long name record that is accepted.
+ * Real ones hold a few paths at most.  */
+#define TAR_MAX_EXTENDED_HEADER_SIZE	(1U << 20)
+
+/* Flags for which fields of a 'struct tar_member' were set by a pax extended
+ * header or GNU long name record, and so override the member's header.  */
+#define TAR_HAVE_PATH		0x01
+#define TAR_HAVE_LINKPATH	0x02
+#define TAR_HAVE_SIZE		0x04
+#define TAR_HAVE_MTIME		0x08
+#define TAR_HAVE_ATIME		0x10
+#define TAR_HAVE_UID		0x20
+#define TAR_HAVE_GID		0x40
+#define TAR_HAVE_SPARSE		0x80
+
+/* A member of the archive, as described by its header and any preceding
+ * extended headers  */
+struct tar_member {
+	int have;
+	char typeflag;
+	char *path;
+	char *linkpath;
+	u64 size;
+	struct timespec mtime;
+	struct timespec atime;
+	u32 mode;
+	u32 uid;
+	u32 gid;
+	u32 devmajor;
+	u32 devminor;
+};
+
+struct tar_scan_ctx {
+	struct scan_params *params;
+	const char *tar_path;
+	struct filedes fd;
+
+	/* true if the archive is a regular file, whose members' data can be
+	 * read from it again later; false if it's a pipe  */
+	bool in_file;
+
+	/* The size of the archive, if it's a regular file  */
+	u64 file_size;
+
+	/* The offset in the archive of the next header  */
+	u64 offset;
+
+	/* The root directory of the image being built  */
+	struct wim_dentry *root;
+};
+
+static void
+tar_member_destroy(struct tar_member *m)
+{
+	FREE(m->path);
+	FREE(m->linkpath);
+	memset(m, 0, sizeof(*m));
+}
+
+static int
+tar_read_error(struct tar_scan_ctx *ctx, int ret)
+{
+	if (ret == WIMLIB_ERR_UNEXPECTED_END_OF_FILE) {
+		ERROR("\"%s\": Unexpected end of tar archive", ctx->tar_path);
+		return WIMLIB_ERR_INVALID_TAR_ARCHIVE;
+	}
+	ERROR_WITH_ERRNO("\"%s\": Error reading tar archive", ctx->tar_path);
+	return ret;
+}
+
+/* Read @size bytes at @offset in the archive.  On a pipe, reads can only go
+ * forwards, which they always do here.  */
+static int
+tar_pread(struct tar_scan_ctx *ctx, void *buf, size_t size, u64 offset)
+{
+	int ret = full_pread(&ctx->fd, buf, size, offset);
+
+	if (unlikely(ret))
+		ret = tar_read_error(ctx, ret);
+	return ret;
+}
+
+/*
+ * Parse a numeric header field, which is in octal ASCII optionally surrounded
+ * by spaces and null characters, or in the GNU base-256 format if its first
+ * byte has the high bit set.  Negative numbers aren't supported.
+ */
+static bool
+parse_tar_number(const char *field, size_t len, u64 *value_ret)
+{
+	const u8 *p = (const u8 *)field;
+	const u8 *end = p + len;
+	u64 v = 0;
+
+	if (*p & 0x80) {
+		if (*p != 0x80)
+			return false;
+		while (++p < end) {
+			if (v >> 56)
+				return false;
+			v = (v << 8) | *p;
+		}
+		*value_ret = v;
+		return true;
+	}
+
+	while (p < end && (*p == ' ' || *p == '\0'))
+		p++;
+	for (; p < end && *p >= '0' && *p <= '7'; p++) {
+		if (v >> 61)
+			return false;
+		v = (v << 3) | (*p - '0');
+	}
+	if (p < end && *p != ' ' && *p != '\0')
+		return false;
+	*value_ret = v;
+	return true;
+}
+
+static bool
+parse_tar_u32(const char *field, size_t len, u32 *value_ret)
+{
+	u64 v;
+
+	if (!parse_tar_number(field, len, &v) || v > UINT32_MAX)
+		return false;
+	*value_ret = v;
+	return true;
+}
+
+/* Verify the checksum of a header, which is the sum of its bytes with the
+ * checksum field taken to be spaces.  Some old archivers summed signed chars.
+ */
+static bool
+tar_checksum_valid(const struct tar_header *hdr)
+{
+	const u8 *p = (const u8 *)hdr;
+	const size_t chksum_start = offsetof(struct tar_header, chksum);
+	const size_t chksum_end = chksum_start + sizeof(hdr->chksum);
+	u64 chksum;
+	u32 usum = 0;
+	s32 ssum = 0;
+
+	if (!parse_tar_number(hdr->chksum, sizeof(hdr->chksum), &chksum))
+		return false;
+	for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+		u8 c = (i >= chksum_start && i < chksum_end) ? ' ' : p[i];
+
+		usum += c;
+		ssum += (s8)c;
+	}
+	return chksum == usum || chksum == (u32)ssum;
+}
+
+/* Parse a pax timestamp, which is a decimal number of seconds with an optional
+ * fractional part.  */
+static bool
+parse_pax_time(const char *value, struct timespec *ts)
+{
+	char *end;
+	unsigned long long sec;
+	long nsec = 0;
+
+	if (*value < '0' || *value > '9')
+		return false;
+	errno = 0;
+	sec = strtoull(value, &end, 10);
+	if (errno || (time_t)sec < 0 || (unsigned long long)(time_t)sec != sec)
+		return false;
+	if (*end == '.') {
+		long scale = 100000000;
+
+		while (*++end >= '0' && *end <= '9') {
+			nsec += (*end - '0') * scale;
+			scale /= 10;
+		}
+	}
+	if (*end != '\0')
+		return false;
+	ts->tv_sec = sec;
+	ts->tv_nsec = nsec;
+	return true;
+}
+
+static bool
+parse_pax_u64(const char *value, u64 *value_ret)
+{
+	char *end;
+	unsigned long long v;
+
+	if (*value < '0' || *value > '9')
+		return false;
+	errno = 0;
+	v = strtoull(value, &end, 10);
+	if (errno || *end != '\0')
+		return false;
+	*value_ret = v;
+	return true;
+}
+
+static bool
+parse_pax_u32(const char *value, u32 *value_ret)
+{
+	u64 v;
+
+	if (!parse_pax_u64(value, &v) || v > UINT32_MAX)
+		return false;
+	*value_ret = v;
+	return true;
+}
+
+/* Replace *@field with a copy of @value.  */
+static int
+set_tar_string(char **field, const char *value, size_t len)
+{
+	char *s = MALLOC(len + 1);
+
+	if (!s)
+		return WIMLIB_ERR_NOMEM;
+	memcpy(s, value, len);
+	s[len] = '\0';
+	FREE(*field);
+	*field = s;
+	return 0;
+}
+
+/*
+ * Parse the records of a pax extended header, each of which has the form
+ * "<length> <keyword>=<value>\n", into @m.  Keywords which don't affect
+ * the capture, such as the names of the owners, are ignored.
+ */
+static int
+parse_pax_header(struct tar_scan_ctx *ctx, char *data, size_t size,
+		 struct tar_member *m)
+{
+	char *p = data;
+	char *end = data + size;
+	int ret;
+
+	while (p < end && *p != '\0') {
+		char *rec_end, *key, *value, *eq;
+		unsigned long len;
+		bool ok = true;
+
+		errno = 0;
+		len = strtoul(p, &key, 10);
+		if (errno || *key != ' ' || len > end - p || key >= p + len ||
+		    p[len - 1] != '\n')
+			goto invalid;
+		rec_end = p + len - 1;
+		key++;
+		eq = memchr(key, '=', rec_end - key);
+		if (!eq)
+			goto invalid;
+		*eq = '\0';
+		*rec_end = '\0';
+		value = eq + 1;
+
+		if (!strcmp(key, "path")) {
+			ret = set_tar_string(&m->path, value, rec_end - value);
+			if (ret)
+				return ret;
+			m->have |= TAR_HAVE_PATH;
+		} else if (!strcmp(key, "linkpath")) {
+			ret = set_tar_string(&m->linkpath, value,
+					     rec_end - value);
+			if (ret)
+				return ret;
+			m->have |= TAR_HAVE_LINKPATH;
+		} else if (!strcmp(key, "size")) {
+			ok = parse_pax_u64(value, &m->size);
+			m->have |= TAR_HAVE_SIZE;
+		} else if (!strcmp(key, "mtime")) {
+			ok = parse_pax_time(value, &m->mtime);
+			m->have |= TAR_HAVE_MTIME;
+		} else if (!strcmp(key, "atime")) {
+			ok = parse_pax_time(value, &m->atime);
+			m->have |= TAR_HAVE_ATIME;
+		} else if (!strcmp(key, "uid")) {
+			ok = parse_pax_u32(value, &m->uid);
+			m->have |= TAR_HAVE_UID;
+		} else if (!strcmp(key, "gid")) {
+			ok = parse_pax_u32(value, &m->gid);
+			m->have |= TAR_HAVE_GID;
+		} else if (!strncmp(key, "GNU.sparse.", 11)) {
+			m->have |= TAR_HAVE_SPARSE;
+		}
+		if (!ok)
+			goto invalid;
+		p = rec_end + 1;
+	}
+	return 0;
+
+invalid:
+	ERROR("\"%s\": Invalid pax extended header in tar archive",
+	      ctx->tar_path);
+	return WIMLIB_ERR_INVALID_TAR_ARCHIVE;
+}
+
+/* Read the data of the extended header or long name record at @offset, which
+ * is @size bytes, into a null-terminated buffer.  */
+static int
+read_tar_extended_header(struct tar_scan_ctx *ctx, u64 offset, u64 size,
+			 char **data_ret)
+{
+	char *data;
+	int ret;
+
+	if (size > TAR_MAX_EXTENDED_HEADER_SIZE) {
+		ERROR("\"%s\": Extended header in tar archive is too large",
+		      ctx->tar_path);
+		return WIMLIB_ERR_INVALID_TAR_ARCHIVE;
+	}
+	data = MALLOC(size + 1);
+	if (!data)
+		return WIMLIB_ERR_NOMEM;
+	ret = tar_pread(ctx, data, size, offset);
+	if (ret) {
+		FREE(data);
+		return ret;
+	}
+	data[size] = '\0';
+	*data_ret = data;
+	return 0;
+}
+
+/*
+ * Fill in @m from the header @hdr, except for the fields which were already
+ * set by extended headers.  The path of a ustar header is split between the
+ * 'prefix' and 'name' fields; GNU headers use the space of 'prefix' for other
+ * things.
+ */
+static int
+parse_tar_header(struct tar_scan_ctx *ctx, const struct tar_header *hdr,
+		 struct tar_member *m)
+{
+	u64 mtime;
+	int ret;
+
+	m->typeflag = hdr->typeflag;
+
+	if (!(m->have & TAR_HAVE_PATH)) {
+		size_t name_len = strnlen(hdr->name, sizeof(hdr->name));
+		size_t prefix_len = 0;
+		char *path;
+
+		if (!memcmp(hdr->magic, "ustar", sizeof(hdr->magic)))
+			prefix_len = strnlen(hdr->prefix, sizeof(hdr->prefix));
+		path = MALLOC(prefix_len + 1 + name_len + 1);
+		if (!path)
+			return WIMLIB_ERR_NOMEM;
+		memcpy(path, hdr->prefix, prefix_len);
+		if (prefix_len)
+			path[prefix_len++] = '/';
+		memcpy(&path[prefix_len], hdr->name, name_len);
+		path[prefix_len + name_len] = '\0';
+		FREE(m->path);
+		m->path = path;
+	}
+	if (!(m->have & TAR_HAVE_LINKPATH)) {
+		ret = set_tar_string(&m->linkpath, hdr->linkname,
+				     strnlen(hdr->linkname,
+					     sizeof(hdr->linkname)));
+		if (ret)
+			return ret;
+	}
+
+	if ((!(m->have & TAR_HAVE_SIZE) &&
+	     !parse_tar_number(hdr->size, sizeof(hdr->size), &m->size)) ||
+	    !parse_tar_number(hdr->mtime, sizeof(hdr->mtime), &mtime) ||
+	    !parse_tar_u32(hdr->mode, sizeof(hdr->mode), &m->mode) ||
+	    (!(m->have & TAR_HAVE_UID) &&
+	     !parse_tar_u32(hdr->uid, sizeof(hdr->uid), &m->uid)) ||
+	    (!(m->have & TAR_HAVE_GID) &&
+	     !parse_tar_u32(hdr->gid, sizeof(hdr->gid), &m->gid)) ||
+	    !parse_tar_u32(hdr->devmajor, sizeof(hdr->devmajor),
+			   &m->devmajor) ||
+	    !parse_tar_u32(hdr->devminor, sizeof(hdr->devminor),
+			   &m->devminor))
+	{
+		ERROR("\"%s\": Invalid header in tar archive at offset %"PRIu64,
+		      ctx->tar_path, ctx->offset);
+		return WIMLIB_ERR_INVALID_TAR_ARCHIVE;
+	}
+	if (!(m->have & TAR_HAVE_MTIME)) {
+		m->mtime.tv_sec = mtime;
+		m->mtime.tv_nsec = 0;
+	}
+	if (!(m->have & TAR_HAVE_ATIME))
+		m->atime = m->mtime;
+	return 0;
+}
+
+/*
+ * Normalize the path of a member in place: strip leading slashes, and remove
+ * empty and "." components, leaving an empty string for the root directory.
+ * Return false if the path has a ".." component, since such a path might not
+ * be in the archive's directory tree at all.
+ */
+static bool
+normalize_tar_path(char *path)
+{
+	const char *p = path;
+	char *out = path;
+
+	while (*p) {
+		const char *end = strchr(p, '/');
+		size_t len;
+
+		if (!end)
+			end = p + strlen(p);
+		len = end - p;
+
+		if (len == 2 && p[0] == '.' && p[1] == '.')
+			return false;
+		if (len != 0 && !(len == 1 && p[0] == '.')) {
+			if (out != path)
+				*out++ = '/';
+			memmove(out, p, len);
+			out += len;
+		}
+		p = *end ? end + 1 : end;
+	}
+	*out = '\0';
+	return true;
+}
+
+/* Create an unnamed directory, or one named @name, which the archive doesn't
+ * describe.  */
+static int
+new_tar_filler_directory(struct tar_scan_ctx *ctx, const char *name,
+			 struct wim_dentry **dentry_ret)
+{
+	struct wim_dentry *dentry;
+	int ret;
+
+	ret = inode_table_new_dentry(ctx->params->inode_table, name, 0, 0,
+				     true, &dentry);
+	if (ret)
+		return ret;
+	dentry->d_inode->i_attributes = FILE_ATTRIBUTE_DIRECTORY;
+	dentry->d_inode->i_creation_time = now_as_wim_timestamp();
+	dentry->d_inode->i_last_write_time = dentry->d_inode->i_creation_time;
+	dentry->d_inode->i_last_access_time = dentry->d_inode->i_creation_time;
+	*dentry_ret = dentry;
+	return 0;
+}
+
+/*
+ * Look up the directory which is to contain the member whose normalized path
+ * is @path, and return the last component of the path in *name_ret.  Unless
+ * @create is false, the directories on the way which don't exist yet are
+ * created, since archives needn't list every directory, or list them first.
+ */
+static int
+lookup_tar_parent(struct tar_scan_ctx *ctx, char *path, bool create,
+		  struct wim_dentry **parent_ret, const char **name_ret)
+{
+	struct wim_dentry *dir = ctx->root;
+	char *p = path;
+	char *slash;
+	int ret;
+
+	while ((slash = strchr(p, '/'))) {
+		struct wim_dentry *child;
+
+		*slash = '\0';
+		child = get_dentry_child_with_name(dir, p,
+						   WIMLIB_CASE_SENSITIVE);
+		if (!child && create) {
+			ret = new_tar_filler_directory(ctx, p, &child);
+			if (ret) {
+				*slash = '/';
+				return ret;
+			}
+			dentry_add_child(dir, child);
+		}
+		*slash = '/';
+		if (!child)
+			return WIMLIB_ERR_PATH_DOES_NOT_EXIST;
+		if (!dentry_is_directory(child))
+			return WIMLIB_ERR_NOTDIR;
+		dir = child;
+		p = slash + 1;
+	}
+	*parent_ret = dir;
+	*name_ret = p;
+	return 0;
+}
+
+static u32
+tar_member_file_type(char typeflag)
+{
+	switch (typeflag) {
+	case '2':
+		return S_IFLNK;
+	case '3':
+		return S_IFCHR;
+	case '4':
+		return S_IFBLK;
+	case '5':
+	case 'D':
+		return S_IFDIR;
+	case '6':
+		return S_IFIFO;
+	default:
+		return S_IFREG;
+	}
+}
+
+/* Set the timestamps, and if requested the UNIX owner and mode, of @inode from
+ * those of the member @m.  */
+static int
+set_tar_member_metadata(struct tar_scan_ctx *ctx, struct wim_inode *inode,
+			const struct tar_member *m)
+{
+	inode->i_creation_time = timespec_to_wim_timestamp(&m->mtime);
+	inode->i_last_write_time = inode->i_creation_time;
+	inode->i_last_access_time = timespec_to_wim_timestamp(&m->atime);
+
+	if (ctx->params->add_flags & WIMLIB_ADD_FLAG_UNIX_DATA) {
+		struct wimlib_unix_data unix_data;
+
+		unix_data.uid = m->uid;
+		unix_data.gid = m->gid;
+		unix_data.mode = tar_member_file_type(m->typeflag) |
+				 (m->mode & 07777);
+		unix_data.rdev = makedev(m->devmajor, m->devminor);
+		if (!inode_set_unix_data(inode, &unix_data, UNIX_DATA_ALL))
+			return WIMLIB_ERR_NOMEM;
+	}
+	return 0;
+}
+
+/* Give @inode the data of the regular file member @m, whose data is at
+ * @data_offset in the archive.  */
+static int
+tar_scan_regular_file(struct tar_scan_ctx *ctx, const struct tar_member *m,
+		      u64 data_offset, struct wim_inode *inode)
+{
+	struct blob_descriptor *blob = NULL;
+	struct wim_inode_stream *strm;
+	int ret;
+
+	inode->i_attributes = FILE_ATTRIBUTE_NORMAL;
+
+	if (m->size) {
+		blob = new_blob_descriptor();
+		if (unlikely(!blob))
+			goto err_nomem;
+		if (ctx->in_file) {
+			blob->file_on_disk = STRDUP(ctx->tar_path);
+			if (unlikely(!blob->file_on_disk))
+				goto err_nomem;
+			blob->blob_location = BLOB_IN_FILE_ON_DISK;
+			blob->file_offset = data_offset;
+			blob->file_inode = inode;
+			blob->size = m->size;
+		} else {
+			void *buf;
+
+			if ((size_t)m->size != m->size)
+				goto err_nomem;
+			buf = MALLOC(m->size);
+			if (unlikely(!buf))
+				goto err_nomem;
+			ret = tar_pread(ctx, buf, m->size, data_offset);
+			if (ret) {
+				FREE(buf);
+				free_blob_descriptor(blob);
+				return ret;
+			}
+			blob_set_is_located_in_attached_buffer(blob, buf,
+							       m->size);
+		}
+	}
+
+	strm = inode_add_stream(inode, STREAM_TYPE_DATA, NO_STREAM_NAME, blob);
+	if (unlikely(!strm))
+		goto err_nomem;
+
+	prepare_unhashed_blob(blob, inode, strm->stream_id,
+			      ctx->params->unhashed_blobs);
+	return 0;
+
+err_nomem:
+	free_blob_descriptor(blob);
+	return WIMLIB_ERR_NOMEM;
+}
+
+static int
+tar_scan_symlink(struct tar_scan_ctx *ctx, const struct tar_member *m,
+		 struct wim_inode *inode)
+{
+	struct scan_params *params = ctx->params;
+	int ret;
+
+	ret = wim_inode_set_symlink(inode, m->linkpath, params->blob_table);
+	if (unlikely(ret)) {
+		if (ret == WIMLIB_ERR_INVALID_UTF8_STRING) {
+			ERROR("\"%s\": target of symbolic link is not valid "
+			      "UTF-8.  This is not supported.",
+			      params->cur_path);
+		}
+		return ret;
+	}
+
+	/* An absolute link in the archive is already relative to the root of
+	 * the archive's directory tree, so there is nothing to fix up.  */
+	if (m->linkpath[0] == '/' && (params->add_flags & WIMLIB_ADD_FLAG_RPFIX)) {
+		inode->i_rp_flags &= ~WIM_RP_FLAG_NOT_FIXED;
+		params->progress.scan.symlink_target = m->linkpath;
+		return do_scan_progress(params, WIMLIB_SCAN_DENTRY_FIXED_SYMLINK,
+					NULL);
+	}
+	return 0;
+}
+
+/* Add a hard link named @name to the file at @m->linkpath, which the archive
+ * described earlier.  */
+static int
+tar_scan_hard_link(struct tar_scan_ctx *ctx, struct tar_member *m,
+		   const char *name, struct wim_dentry **dentry_ret)
+{
+	struct wim_dentry *parent, *target = NULL;
+	const char *target_name;
+
+	if (normalize_tar_path(m->linkpath) &&
+	    lookup_tar_parent(ctx, m->linkpath, false, &parent,
+			      &target_name) == 0)
+		target = get_dentry_child_with_name(parent, target_name,
+						    WIMLIB_CASE_SENSITIVE);
+	if (!target || dentry_is_directory(target)) {
+		ERROR("\"%s\": Target of hard link \"%s\" isn't a file "
+		      "earlier in the tar archive",
+		      ctx->params->cur_path, m->linkpath);
+		return WIMLIB_ERR_INVALID_TAR_ARCHIVE;
+	}
+	return new_dentry_with_existing_inode(name, target->d_inode,
+					      dentry_ret);
+}
+
+/* Add the member @m, whose data is at @data_offset, to the image.  */
+static int
+tar_scan_member(struct tar_scan_ctx *ctx, struct tar_member *m,
+		u64 data_offset)
+{
+	struct scan_params *params = ctx->params;
+	struct wim_dentry *parent, *dentry = NULL;
+	struct wim_inode *inode = NULL;
+	const char *name;
+	size_t orig_path_nchars;
+	int ret;
+
+	if (!normalize_tar_path(m->path)) {
+		WARNING("\"%s\": Skipping \"%s\" in tar archive, since its "
+			"path contains \"..\"", ctx->tar_path, m->path);
+		return 0;
+	}
+
+	if (!pathbuf_append_name(params, m->path, strlen(m->path),
+				 &orig_path_nchars))
+		return WIMLIB_ERR_NOMEM;
+
+	if (m->path[0] == '\0') {
+		/* The root directory  */
+		if (tar_member_file_type(m->typeflag) == S_IFDIR)
+			ret = set_tar_member_metadata(ctx, ctx->root->d_inode,
+						      m);
+		else
+			ret = 0;
+		goto out;
+	}
+
+	ret = try_exclude(params);
+	if (unlikely(ret < 0)) { /* Excluded? */
+		ret = do_scan_progress(params, WIMLIB_SCAN_DENTRY_EXCLUDED,
+				       NULL);
+		goto out;
+	}
+	if (unlikely(ret > 0)) /* Error? */
+		goto out_report;
+
+	ret = lookup_tar_parent(ctx, m->path, true, &parent, &name);
+	if (ret) {
+		if (ret == WIMLIB_ERR_NOTDIR) {
+			ERROR("\"%s\": A parent directory of this file in the "
+			      "tar archive isn't a directory", params->cur_path);
+		}
+		goto out_report;
+	}
+
+	if (m->have & TAR_HAVE_SPARSE) {
+		ERROR("\"%s\": Sparse files in tar archives aren't supported",
+		      params->cur_path);
+		ret = WIMLIB_ERR_UNSUPPORTED_FILE;
+		goto out_report;
+	}
+
+	switch (m->typeflag) {
+	case '1':
+		ret = tar_scan_hard_link(ctx, m, name, &dentry);
+		if (ret)
+			goto out_report;
+		inode = dentry->d_inode;
+		goto out_progress;
+	case '5':
+	case 'D':
+		/* The directory may have been created already for the members
+		 * in it; if so, just set its metadata.  */
+		dentry = get_dentry_child_with_name(parent, name,
+						    WIMLIB_CASE_SENSITIVE);
+		if (dentry && dentry_is_directory(dentry)) {
+			inode = dentry->d_inode;
+			ret = set_tar_member_metadata(ctx, inode, m);
+			if (!ret)
+				ret = do_scan_progress(params,
+						       WIMLIB_SCAN_DENTRY_OK,
+						       inode);
+			dentry = NULL;
+			goto out_report;
+		}
+		dentry = NULL;
+		break;
+	case '0':
+	case '\0':
+	case '7':
+	case '2':
+		break;
+	case '3':
+	case '4':
+	case '6':
+		if (params->add_flags & WIMLIB_ADD_FLAG_UNIX_DATA)
+			break;
+		/* fall through */
+	default:
+		if (params->add_flags & WIMLIB_ADD_FLAG_NO_UNSUPPORTED_EXCLUDE) {
+			ERROR("\"%s\": File type is unsupported",
+			      params->cur_path);
+			ret = WIMLIB_ERR_UNSUPPORTED_FILE;
+			goto out_report;
+		}
+		ret = do_scan_progress(params, WIMLIB_SCAN_DENTRY_UNSUPPORTED,
+				       NULL);
+		goto out;
+	}
+
+	ret = inode_table_new_dentry(params->inode_table, name, 0, 0, true,
+				     &dentry);
+	if (unlikely(ret)) {
+		if (ret == WIMLIB_ERR_INVALID_UTF8_STRING) {
+			ERROR("\"%s\": filename is not valid UTF-8.  "
+			      "This is not supported.", params->cur_path);
+		}
+		goto out_report;
+	}
+	inode = dentry->d_inode;
+
+	ret = set_tar_member_metadata(ctx, inode, m);
+	if (ret)
+		goto out_report;
+
+	switch (tar_member_file_type(m->typeflag)) {
+	case S_IFREG:
+		ret = tar_scan_regular_file(ctx, m, data_offset, inode);
+		break;
+	case S_IFDIR:
+		inode->i_attributes = FILE_ATTRIBUTE_DIRECTORY;
+		break;
+	case S_IFLNK:
+		ret = tar_scan_symlink(ctx, m, inode);
+		break;
+	default:
+		inode->i_attributes = FILE_ATTRIBUTE_NORMAL;
+		break;
+	}
+	if (ret)
+		goto out_report;
+
+out_progress:
+	ret = do_scan_progress(params, WIMLIB_SCAN_DENTRY_OK, inode);
+	if (ret)
+		goto out_report;
+	attach_scanned_tree(parent, dentry, params);
+	dentry = NULL;
+out_report:
+	if (unlikely(ret)) {
+		discard_scanned_tree(params, dentry);
+		ret = report_scan_error(params, ret);
+	}
+out:
+	pathbuf_truncate(params, orig_path_nchars);
+	return ret;
+}
+
+/*
+ * Read the header of the next member at ctx->offset.  Return 0 with
+ * *end_ret = true at the end of the archive, which is marked by a block of
+ * zeroes.  GNU tar also accepts an archive that just ends without one.
+ */
+static int
+read_tar_header(struct tar_scan_ctx *ctx, struct tar_header *hdr,
+		bool *end_ret)
+{
+	int ret;
+
+	*end_ret = false;
+	if (ctx->in_file && ctx->offset >= ctx->file_size) {
+		*end_ret = true;
+		return 0;
+	}
+	ret = full_pread(&ctx->fd, hdr, sizeof(*hdr), ctx->offset);
+	if (unlikely(ret)) {
+		/* At the end of a pipe, nothing of the header was read.  */
+		if (ret == WIMLIB_ERR_UNEXPECTED_END_OF_FILE && !ctx->in_file &&
+		    ctx->fd.offset == ctx->offset) {
+			*end_ret = true;
+			return 0;
+		}
+		return tar_read_error(ctx, ret);
+	}
+	if (is_all_zeroes((const u8 *)hdr, sizeof(*hdr))) {
+		*end_ret = true;
+		return 0;
+	}
+	if (!tar_checksum_valid(hdr)) {
+		ERROR("\"%s\": Invalid header checksum in tar archive at "
+		      "offset %"PRIu64, ctx->tar_path, ctx->offset);
+		return WIMLIB_ERR_INVALID_TAR_ARCHIVE;
+	}
+	return 0;
+}
+
+static int
+tar_scan_members(struct tar_scan_ctx *ctx)
+{
+	struct tar_member m = { 0 };
+	struct tar_header hdr;
+	int ret;
+
+	for (;;) {
+		u64 data_offset, size;
+		char *data;
+		bool end;
+
+		ret = read_tar_header(ctx, &hdr, &end);
+		if (ret || end)
+			break;
+
+		data_offset = ctx->offset + TAR_BLOCK_SIZE;
+		if (!parse_tar_number(hdr.size, sizeof(hdr.size), &size)) {
+			ERROR("\"%s\": Invalid header in tar archive at "
+			      "offset %"PRIu64, ctx->tar_path, ctx->offset);
+			ret = WIMLIB_ERR_INVALID_TAR_ARCHIVE;
+			break;
+		}
+
+		switch (hdr.typeflag) {
+		case 'x':
+			/* pax extended header for the next member  */
+			ret = read_tar_extended_header(ctx, data_offset, size,
+						       &data);
+			if (ret)
+				break;
+			ret = parse_pax_header(ctx, data, size, &m);
+			FREE(data);
+			break;
+		case 'g':
+			/* pax global header: nothing in it matters here  */
+			break;
+		case 'L':
+		case 'K':
+			/* GNU long name or link name of the next member  */
+			ret = read_tar_extended_header(ctx, data_offset, size,
+						       &data);
+			if (ret)
+				break;
+			if (hdr.typeflag == 'L') {
+				FREE(m.path);
+				m.path = data;
+				m.have |= TAR_HAVE_PATH;
+			} else {
+				FREE(m.linkpath);
+				m.linkpath = data;
+				m.have |= TAR_HAVE_LINKPATH;
+			}
+			break;
+		case 'M':
+			ERROR("\"%s\": Multi-volume tar archives aren't "
+			      "supported", ctx->tar_path);
+			ret = WIMLIB_ERR_INVALID_TAR_ARCHIVE;
+			break;
+		case 'V':
+			/* GNU volume label  */
+			break;
+		default:
+			ret = parse_tar_header(ctx, &hdr, &m);
+			if (ret)
+				break;
+			size = m.size;
+			/* Catch truncation now rather than when writing.  */
+			if (ctx->in_file &&
+			    (data_offset > ctx->file_size ||
+			     size > ctx->file_size - data_offset)) {
+				ERROR("\"%s\": Unexpected end of tar archive",
+				      ctx->tar_path);
+				ret = WIMLIB_ERR_INVALID_TAR_ARCHIVE;
+				break;
+			}
+			ret = tar_scan_member(ctx, &m, data_offset);
+			tar_member_destroy(&m);
+			break;
+		}
+		if (ret)
+			break;
+		if (size > UINT64_MAX - data_offset - TAR_BLOCK_SIZE) {
+			ret = WIMLIB_ERR_INVALID_TAR_ARCHIVE;
+			break;
+		}
+		ctx->offset = data_offset + ALIGN(size, TAR_BLOCK_SIZE);
+	}
+	tar_member_destroy(&m);
+	return ret;
+}
+
+/* Read the rest of a pipe, so that the program writing the archive to it
+ * doesn't fail as it writes the padding after the end of the archive.  */
+static void
+drain_tar_pipe(struct tar_scan_ctx *ctx)
+{
+	u8 buf[BUFFER_SIZE];
+
+	while (read(ctx->fd.fd, buf, sizeof(buf)) > 0 || errno == EINTR)
+		;
+}
+
+/*
+ * tar_build_dentry_tree():
+ *	Builds a tree of WIM dentries from the members of a tar archive.
+ *
+ * @root_ret:   Place to return a pointer to the root of the dentry tree, a
+ *		directory which contains the archived files.
+ *
+ * @tar_path:	The path to the tar archive, which may be a regular file or a
+ *		pipe, e.g. "/dev/stdin".
+ *
+ * @params:     See doc for `struct scan_params'.
+ *
+ * @return:	0 on success, nonzero on failure.  It is a failure if the
+ *		archive can't be read or is invalid.
+ */
+int
+tar_build_dentry_tree(struct wim_dentry **root_ret, const char *tar_path,
+		      struct scan_params *params)
+{
+	struct tar_scan_ctx ctx = {
+		.params = params,
+		.tar_path = tar_path,
+	};
+	struct stat stbuf;
+	int raw_fd;
+	int ret;
+
+	*root_ret = NULL;
+
+	ret = pathbuf_init(params, tar_path);
+	if (ret)
+		return ret;
+
+	raw_fd = open(tar_path, O_RDONLY);
+	if (raw_fd < 0) {
+		ERROR_WITH_ERRNO("\"%s\": Can't open tar archive", tar_path);
+		return WIMLIB_ERR_OPEN;
+	}
+	if (fstat(raw_fd, &stbuf)) {
+		ERROR_WITH_ERRNO("\"%s\": Can't read metadata", tar_path);
+		close(raw_fd);
+		return WIMLIB_ERR_STAT;
+	}
+	filedes_init(&ctx.fd, raw_fd);
+	ctx.in_file = S_ISREG(stbuf.st_mode);
+	ctx.file_size = stbuf.st_size;
+	ctx.fd.is_pipe = !ctx.in_file;
+
+	ret = new_tar_filler_directory(&ctx, NULL, &ctx.root);
+	if (ret)
+		goto out;
+	params->add_flags &= ~WIMLIB_ADD_FLAG_ROOT;
+
+	ret = tar_scan_members(&ctx);
+	if (ret)
+		goto out;
+
+	ret = do_scan_progress(params, WIMLIB_SCAN_DENTRY_OK,
+			       ctx.root->d_inode);
+	if (ret)
+		goto out;
+
+	if (!ctx.in_file)
+		drain_tar_pipe(&ctx);
+	*root_ret = ctx.root;
+	ctx.root = NULL;
+out:
+	discard_scanned_tree(params, ctx.root);
+	filedes_close(&ctx.fd);
+	return ret;
+}
+
+#endif /* !_WIN32 */
@@ -0,0 +1,581 @@
+/*
+ * task_pool.c
+ *
+ * A library-wide pool of threads which runs tasks in parallel.
+ *
+ * Everything in the library that does work in parallel (compressing chunks,
+ * decompressing chunks, calculating integrity checksums) submits its work to
+ * this one pool rather than creating threads of its own.  That way, running
+ * several such operations in one process at the same time, e.g. capturing one
+ * WIM while verifying another, doesn't start more threads than there are
+ * processors.
+ *
+ * Each thread of the pool has its own queue of tasks.  Submitted tasks are
+ * distributed among the queues in turn.  A thread takes the newest task from
+ * its own queue, or if its own queue is empty, steals the oldest task from
+ * another thread's queue; it only sleeps when all queues are empty.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib.h"
+#include "wimlib/error.h"
+#include "wimlib/task_pool.h"
+#include "wimlib/util.h"
+
+/* Upper limit on the number of threads in the task pool  */
+#define MAX_POOL_THREADS	1024
+
+struct pool_thread {
+	struct thread thread;
+	struct task_pool *pool;
+	unsigned idx;
+
+	/* This thread's queue of tasks, oldest first  */
+	struct mutex queue_lock;
+	struct list_head queue;
+};
+
+struct task_pool {
+	/* Protects the fields below  */
+	struct mutex lock;
+
+	/* Signaled when a task is submitted or the pool is terminating  */
+	struct condvar task_avail_cond;
+
+	/* Number of submitted tasks not yet taken by a thread.  This can
+	 * temporarily go negative, since a task can be taken from a queue
+	 * before its submission has been counted.  */
+	long num_queued;
+
+	/* Index of the thread whose queue the next task is added to  */
+	unsigned next_queue;
+
+	bool terminating;
+
+	unsigned num_threads;
+	struct pool_thread threads[];
+};
+
+static struct mutex task_pool_lock = MUTEX_INITIALIZER;
+static struct task_pool *task_pool;
+static bool task_pool_started;
+static unsigned requested_num_threads;
+
+static struct pool_task *
+take_task(struct task_pool *pool, struct pool_thread *self)
+{
+	struct pool_task *task = NULL;
+
+	mutex_lock(&self->queue_lock);
+	if (!list_empty(&self->queue)) {
+		task = list_last_entry(&self->queue, struct pool_task, list);
+		list_del_init(&task->list);
+	}
+	mutex_unlock(&self->queue_lock);
+
+	for (unsigned i = 1; !task && i < pool->num_threads; i++) {
+		struct pool_thread *victim =
+			&pool->threads[(self->idx + i) % pool->num_threads];
+
+		mutex_lock(&victim->queue_lock);
+		if (!list_empty(&victim->queue)) {
+			task = list_first_entry(&victim->queue,
+						struct pool_task, list);
+			list_del_init(&task->list);
+		}
+		mutex_unlock(&victim->queue_lock);
+	}
+	return task;
+}
+
+/* A set of tasks being run by task_pool_run_batch()  */
+struct task_batch {
+	struct mutex lock;
+
+	/* Signaled when 'num_pending' reaches 0  */
+	struct condvar done_cond;
+
+	/* Number of the tasks which haven't finished yet  */
+	unsigned num_pending;
+};
+
+static void
+task_batch_task_done(struct task_batch *batch)
+{
+	mutex_lock(&batch->lock);
+	if (--batch->num_pending == 0)
+		condvar_broadcast(&batch->done_cond);
+	mutex_unlock(&batch->lock);
+}
+
+static void
+run_task(struct pool_task *task)
+{
+	/* The task may be freed as soon as it has run, unless it's part of a
+	 * batch, so look at its batch first.  */
+	struct task_batch *batch = task->batch;
+
+	task->run(task);
+	if (batch)
+		task_batch_task_done(batch);
+}
+
+static void *
+pool_thread_proc(void *arg)
+{
+	struct pool_thread *self = arg;
+	struct task_pool *pool = self->pool;
+
+	/* Wait for new_task_pool() to finish starting the threads, so that
+	 * pool->num_threads is final before take_task() looks at it.  */
+	mutex_lock(&pool->lock);
+	mutex_unlock(&pool->lock);
+
+	for (;;) {
+		struct pool_task *task = take_task(pool, self);
+		bool done;
+
+		if (task) {
+			mutex_lock(&pool->lock);
+			pool->num_queued--;
+			mutex_unlock(&pool->lock);
+			run_task(task);
+			continue;
+		}
+
+		mutex_lock(&pool->lock);
+		while (pool->num_queued <= 0 && !pool->terminating)
+			condvar_wait(&pool->task_avail_cond, &pool->lock);
+		done = (pool->num_queued <= 0);
+		mutex_unlock(&pool->lock);
+		if (done)
+			break;
+	}
+	return NULL;
+}
+
+static void
+destroy_task_pool(struct task_pool *pool)
+{
+	unsigned i;
+
+	mutex_lock(&pool->lock);
+	pool->terminating = true;
+	condvar_broadcast(&pool->task_avail_cond);
+	mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->num_threads; i++)
+		thread_join(&pool->threads[i].thread);
+	for (i = 0; i < pool->num_threads; i++)
+		mutex_destroy(&pool->threads[i].queue_lock);
+	condvar_destroy(&pool->task_avail_cond);
+	mutex_destroy(&pool->lock);
+	FREE(pool);
+}
+
+static struct task_pool *
+new_task_pool(unsigned num_threads)
+{
+	struct task_pool *pool;
+	unsigned n;
+
+	pool = CALLOC(1, sizeof(*pool) + num_threads * sizeof(pool->threads[0]));
+	if (!pool)
+		goto err;
+	if (!mutex_init(&pool->lock))
+		goto err_free_pool;
+	if (!condvar_init(&pool->task_avail_cond))
+		goto err_destroy_lock;
+
+	/* The threads wait for the lock before doing anything, so they only
+	 * see the number of threads once it's final.  */
+	mutex_lock(&pool->lock);
+	for (n = 0; n < num_threads; n++) {
+		struct pool_thread *t = &pool->threads[n];
+
+		t->pool = pool;
+		t->idx = n;
+		INIT_LIST_HEAD(&t->queue);
+		if (!mutex_init(&t->queue_lock))
+			break;
+		if (!thread_create(&t->thread, pool_thread_proc, t)) {
+			mutex_destroy(&t->queue_lock);
+			break;
+		}
+	}
+	pool->num_threads = n;
+	mutex_unlock(&pool->lock);
+
+	if (pool->num_threads == 0) {
+		condvar_destroy(&pool->task_avail_cond);
+		goto err_destroy_lock;
+	}
+	if (pool->num_threads < num_threads) {
+		WARNING("Wanted to start %u threads, but only started %u",
+			num_threads, pool->num_threads);
+	}
+	return pool;
+
+err_destroy_lock:
+	mutex_destroy(&pool->lock);
+err_free_pool:
+	FREE(pool);
+err:
+	WARNING("Couldn't start threads; running all tasks in the calling "
+		"thread");
+	return NULL;
+}
+
+/* Return the task pool, starting it if it hasn't been started yet.  Returns
+ * NULL if the pool couldn't be started.  */
+static struct task_pool *
+get_task_pool(void)
+{
+	struct task_pool *pool;
+
+	mutex_lock(&task_pool_lock);
+	if (!task_pool_started) {
+		unsigned num_threads = requested_num_threads;
+
+		if (num_threads == 0)
+			num_threads = get_available_cpus();
+		task_pool = new_task_pool(min(num_threads, MAX_POOL_THREADS));
+		task_pool_started = true;
+	}
+	pool = task_pool;
+	mutex_unlock(&task_pool_lock);
+	return pool;
+}
+
+/*
+ * Submit a task to be run by the task pool.  The task structure must remain
+ * valid until the task has run, and the submitter is responsible for finding
+ * out when that is.  If the task pool couldn't be started, then the task is run
+ * immediately by the calling thread.
+ */
+static void
+submit_task(struct task_pool *pool, struct pool_task *task)
+{
+	struct pool_thread *t;
+
+	if (!pool) {
+		task->queue_thread = NULL;
+		run_task(task);
+		return;
+	}
+
+	mutex_lock(&pool->lock);
+	t = &pool->threads[pool->next_queue];
+	pool->next_queue = (pool->next_queue + 1) % pool->num_threads;
+	mutex_unlock(&pool->lock);
+
+	task->queue_thread = t;
+	mutex_lock(&t->queue_lock);
+	list_add_tail(&task->list, &t->queue);
+	mutex_unlock(&t->queue_lock);
+
+	mutex_lock(&pool->lock);
+	pool->num_queued++;
+	condvar_signal(&pool->task_avail_cond);
+	mutex_unlock(&pool->lock);
+}
+
+/* Take back a task that was submitted by the calling thread, if no thread of
+ * the pool has taken it yet.  Returns %true if the task was taken back.  */
+static bool
+take_back_task(struct task_pool *pool, struct pool_task *task)
+{
+	struct pool_thread *t = task->queue_thread;
+	bool queued;
+
+	if (!t)
+		return false;
+
+	mutex_lock(&t->queue_lock);
+	queued = !list_empty(&task->list);
+	if (queued)
+		list_del_init(&task->list);
+	mutex_unlock(&t->queue_lock);
+
+	if (queued) {
+		mutex_lock(&pool->lock);
+		pool->num_queued--;
+		mutex_unlock(&pool->lock);
+	}
+	return queued;
+}
+
+void
+task_pool_submit(struct pool_task *task)
+{
+	task->batch = NULL;
+	submit_task(get_task_pool(), task);
+}
+
+/*
+ * Run a batch of tasks in parallel, and return when all of them have finished.
+ *
+ * The calling thread runs the first task itself.  Afterwards, it also runs
+ * every other task which no thread of the pool has started yet, and only waits
+ * for the tasks which are already running elsewhere.  So, unlike
+ * task_pool_submit() followed by waiting, this may be called from a task: the
+ * wait never depends on a pool thread becoming free, provided that the tasks of
+ * the batch don't wait for anything themselves.  If a pool thread couldn't be
+ * spared, the batch just degrades to running serially.
+ */
+void
+task_pool_run_batch(struct pool_task *tasks[], unsigned num_tasks)
+{
+	struct task_pool *pool = get_task_pool();
+	struct task_batch batch;
+
+	if (num_tasks == 0)
+		return;
+	if (!pool || num_tasks == 1 || !mutex_init(&batch.lock))
+		goto run_serially;
+	if (!condvar_init(&batch.done_cond)) {
+		mutex_destroy(&batch.lock);
+		goto run_serially;
+	}
+
+	batch.num_pending = num_tasks - 1;
+	for (unsigned i = 1; i < num_tasks; i++) {
+		tasks[i]->batch = &batch;
+		submit_task(pool, tasks[i]);
+	}
+
+	tasks[0]->run(tasks[0]);
+
+	/* Take back the tasks which are still queued, newest first since those
+	 * are the least likely to have been started.  */
+	for (unsigned i = num_tasks - 1; i >= 1; i--) {
+		if (take_back_task(pool, tasks[i])) {
+			tasks[i]->run(tasks[i]);
+			task_batch_task_done(&batch);
+		}
+	}
+
+	mutex_lock(&batch.lock);
+	while (batch.num_pending != 0)
+		condvar_wait(&batch.done_cond, &batch.lock);
+	mutex_unlock(&batch.lock);
+
+	condvar_destroy(&batch.done_cond);
+	mutex_destroy(&batch.lock);
+	return;
+
+run_serially:
+	for (unsigned i = 0; i < num_tasks; i++)
+		tasks[i]->run(tasks[i]);
+}
+
+/* Return the number of threads in the task pool, starting it if needed.  This
+ * is the most tasks that can run at the same time.  */
+unsigned
+task_pool_num_threads(void)
+{
+	struct task_pool *pool = get_task_pool();
+
+	return pool ? pool->num_threads : 1;
+}
+
+/* Stop the task pool, if it was started.  All tasks must have finished.  The
+ * pool is started again if more tasks are submitted.  */
+void
+task_pool_cleanup(void)
+{
+	mutex_lock(&task_pool_lock);
+	if (task_pool)
+		destroy_task_pool(task_pool);
+	task_pool = NULL;
+	task_pool_started = false;
+	mutex_unlock(&task_pool_lock);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_thread_pool_size(unsigned num_threads)
+{
+	if (num_threads > MAX_POOL_THREADS)
+		return WIMLIB_ERR_INVALID_PARAM;
+	mutex_lock(&task_pool_lock);
+	requested_num_threads = num_threads;
+	mutex_unlock(&task_pool_lock);
+	return 0;
+}
+
+static void
+group_worker_run(struct pool_task *task)
+{
+	struct group_worker *worker =
+		container_of(task, struct group_worker, task);
+	struct worker_group *group = worker->group;
+	void *item;
+
+	for (;;) {
+		while ((item = ring_buffer_try_get(&group->items)) != NULL)
+			(*group->process)(item, worker->ctx);
+
+		/* Go idle, unless an item was submitted after we found none.
+		 * The submitter only takes the lock if it sees an idle worker,
+		 * so we must become idle before checking for items again.  */
+		mutex_lock(&group->lock);
+		list_add(&worker->idle_list, &group->idle_workers);
+		__atomic_store_n(&group->num_idle_workers,
+				 group->num_idle_workers + 1, __ATOMIC_SEQ_CST);
+		if (!ring_buffer_empty(&group->items)) {
+			list_del(&worker->idle_list);
+			__atomic_store_n(&group->num_idle_workers,
+					 group->num_idle_workers - 1,
+					 __ATOMIC_RELAXED);
+			mutex_unlock(&group->lock);
+			continue;
+		}
+		if (--group->num_busy_workers == 0)
+			condvar_broadcast(&group->idle_cond);
+		mutex_unlock(&group->lock);
+		return;
+	}
+}
+
+/*
+ * Initialize a worker group with @num_workers workers, which can have up to
+ * @max_items items submitted but not yet started at once.  Each submitted item
+ * is passed to @process along with the context of the worker processing it,
+ * which is the corresponding entry of @worker_ctxs, or NULL if @worker_ctxs is
+ * NULL.
+ */
+int
+worker_group_init(struct worker_group *group, unsigned num_workers,
+		  size_t max_items,
+		  void (*process)(void *item, void *worker_ctx),
+		  void *const worker_ctxs[])
+{
+	int ret;
+
+	group->workers = CALLOC(num_workers, sizeof(group->workers[0]));
+	if (!group->workers)
+		return WIMLIB_ERR_NOMEM;
+	ret = ring_buffer_init(&group->items, max_items);
+	if (ret)
+		goto err_free_workers;
+	ret = WIMLIB_ERR_NOMEM;
+	if (!mutex_init(&group->lock))
+		goto err_destroy_items;
+	if (!condvar_init(&group->idle_cond))
+		goto err_destroy_lock;
+
+	group->process = process;
+	group->num_workers = num_workers;
+	group->num_busy_workers = 0;
+	group->num_idle_workers = num_workers;
+	INIT_LIST_HEAD(&group->idle_workers);
+	for (unsigned i = 0; i < num_workers; i++) {
+		struct group_worker *worker = &group->workers[i];
+
+		worker->task.run = group_worker_run;
+		worker->group = group;
+		worker->ctx = worker_ctxs ? worker_ctxs[i] : NULL;
+		list_add_tail(&worker->idle_list, &group->idle_workers);
+	}
+	return 0;
+
+err_destroy_lock:
+	mutex_destroy(&group->lock);
+err_destroy_items:
+	ring_buffer_destroy(&group->items);
+err_free_workers:
+	FREE(group->workers);
+	group->workers = NULL;
+	return ret;
+}
+
+/* Make sure that a worker will take the item which was just submitted.  */
+static void
+worker_group_wake(struct worker_group *group)
+{
+	struct group_worker *worker = NULL;
+
+	/* If all workers are busy, then one of them will take the item.  This
+	 * pairs with the check for items in group_worker_run().  */
+	if (__atomic_load_n(&group->num_idle_workers, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	mutex_lock(&group->lock);
+	if (!list_empty(&group->idle_workers)) {
+		worker = list_first_entry(&group->idle_workers,
+					  struct group_worker, idle_list);
+		list_del(&worker->idle_list);
+		__atomic_store_n(&group->num_idle_workers,
+				 group->num_idle_workers - 1, __ATOMIC_RELAXED);
+		group->num_busy_workers++;
+	}
+	mutex_unlock(&group->lock);
+
+	if (worker)
+		task_pool_submit(&worker->task);
+}
+
+/* Submit an item to be processed by one of the workers of the group.  Items are
+ * started in the order they are submitted, but can finish in any order.  */
+void
+worker_group_submit(struct worker_group *group, void *item)
+{
+	ring_buffer_put(&group->items, item);
+	worker_group_wake(group);
+}
+
+/* Like worker_group_submit(), but if the maximum number of items are already
+ * waiting to be started, return false instead of waiting.  */
+bool
+worker_group_try_submit(struct worker_group *group, void *item)
+{
+	if (!ring_buffer_try_put(&group->items, item))
+		return false;
+	worker_group_wake(group);
+	return true;
+}
+
+/* Destroy a worker group.  Items which haven't been started are discarded;
+ * items being processed are waited for.  This is a no-op if the group is
+ * zero-initialized but worker_group_init() was never called on it (or
+ * failed).  */
+void
+worker_group_destroy(struct worker_group *group)
+{
+	if (!group->workers)
+		return;
+
+	while (ring_buffer_try_get(&group->items))
+		;
+	mutex_lock(&group->lock);
+	while (group->num_busy_workers)
+		condvar_wait(&group->idle_cond, &group->lock);
+	mutex_unlock(&group->lock);
+
+	condvar_destroy(&group->idle_cond);
+	mutex_destroy(&group->lock);
+	ring_buffer_destroy(&group->items);
+	FREE(group->workers);
+	group->workers = NULL;
+}
@@ -31,6 +31,8 @@
 #include "wimlib/dentry.h"
 #include "wimlib/error.h"
 #include "wimlib/metadata.h"
+#include "wimlib/paths.h"
+#include "wimlib/scan.h"
 #include "wimlib/util.h"
 
 static u64
@@ -85,14 +87,17 @@ inode_metadata_consistent(const struct wim_inode *inode,
 /**
  * Given an inode @inode that has been determined to be "the same" as another
  * inode @template_inode in either the same WIM or another WIM, copy stream
- * checksums from @template_inode to @inode.
+ * checksums from @template_inode to @inode.  Returns the number of bytes of
+ * data which turned out to be already present in @blob_table.
  */
-static void
+static u64
 inode_copy_checksums(struct wim_inode *inode,
 		     struct wim_inode *template_inode,
 		     struct blob_table *blob_table,
 		     struct blob_table *template_blob_table)
 {
+	u64 dup_bytes = 0;
+
 	for (unsigned i = 0; i < inode->i_num_streams; i++) {
 		const struct wim_inode_stream *strm, *template_strm;
 		struct blob_descriptor *blob, *template_blob, **back_ptr;
@@ -115,9 +120,12 @@ inode_copy_checksums(struct wim_inode *inode,
 		back_ptr = retrieve_pointer_to_unhashed_blob(blob);
 		copy_hash(blob->hash, template_blob->hash);
 		if (after_blob_hashed(blob, back_ptr, blob_table,
-				      inode) != blob)
+				      inode) != blob) {
+			dup_bytes += blob->size;
 			free_blob_descriptor(blob);
+		}
 	}
+	return dup_bytes;
 }
 
 static int
@@ -188,3 +196,168 @@ wimlib_reference_template_image(WIMStruct *wim, int new_image,
 
 	return 0;
 }
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_capture_template(WIMStruct *wim, WIMStruct *template_wim,
+			    int template_image)
+{
+	if (!wim)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (template_wim) {
+		if (template_image < 1 ||
+		    template_image > template_wim->hdr.image_count)
+			return WIMLIB_ERR_INVALID_IMAGE;
+		if (!wim_has_metadata(template_wim))
+			return WIMLIB_ERR_METADATA_NOT_FOUND;
+	}
+
+	wim->capture_template_wim = template_wim;
+	wim->capture_template_image = template_image;
+	return 0;
+}
+
+/* Look up the dentry at the relative path @path, which is @path_nchars long
+ * and uses OS_PREFERRED_PATH_SEPARATOR (which on every supported platform is
+ * also the WIM path separator), starting from @dentry.  */
+static struct wim_dentry *
+lookup_template_path(struct wim_dentry *dentry, const tchar *path,
+		     size_t path_nchars)
+{
+	const tchar *end = path + path_nchars;
+
+	STATIC_ASSERT(OS_PREFERRED_PATH_SEPARATOR == WIM_PATH_SEPARATOR);
+
+	while (dentry) {
+		const tchar *name;
+		size_t name_nchars;
+
+		while (path != end && *path == OS_PREFERRED_PATH_SEPARATOR)
+			path++;
+		if (path == end)
+			break;
+		name = path;
+		while (path != end && *path != OS_PREFERRED_PATH_SEPARATOR)
+			path++;
+		name_nchars = path - name;
+
+		tchar name_buf[name_nchars + 1];
+		tmemcpy(name_buf, name, name_nchars);
+		name_buf[name_nchars] = T('\0');
+		dentry = get_dentry_child_with_name(dentry, name_buf,
+						    WIMLIB_CASE_SENSITIVE);
+	}
+	return dentry;
+}
+
+/*
+ * Prepare to compare files being scanned into @wim at @wim_target_path with the
+ * template image of @wim.  On success, end_capture_template() must be called
+ * when the scan is done.
+ */
+int
+begin_capture_template(struct capture_template *template, WIMStruct *wim,
+		       const tchar *wim_target_path)
+{
+	WIMStruct *template_wim = wim->capture_template_wim;
+	int ret;
+
+	memset(template, 0, sizeof(*template));
+
+	ret = hold_wim_image(template_wim, wim->capture_template_image,
+			     &template->imd);
+	if (ret)
+		return ret;
+	template->blob_table = template_wim->blob_table;
+	template->root = lookup_template_path(template->imd->root_dentry,
+					      wim_target_path,
+					      tstrlen(wim_target_path));
+	return 0;
+}
+
+void
+end_capture_template(struct capture_template *template)
+{
+	release_wim_image(template->imd);
+	FREE(template->dir_path);
+}
+
+/* Find the directory in the template image which contains the file which has
+ * the relative path @path, which is @dir_nchars long up to its last separator.
+ */
+static struct wim_dentry *
+get_template_dir(struct capture_template *template, const tchar *path,
+		 size_t dir_nchars)
+{
+	if (template->dir_path && dir_nchars == template->dir_path_nchars &&
+	    !tmemcmp(path, template->dir_path, dir_nchars))
+		return template->dir;
+
+	if (dir_nchars + 1 > template->dir_path_alloc_nchars) {
+		size_t alloc_nchars = max(dir_nchars + 1,
+					  template->dir_path_alloc_nchars * 2);
+		tchar *dir_path = REALLOC(template->dir_path,
+					  alloc_nchars * sizeof(tchar));
+		if (!dir_path)	/* Just don't cache it  */
+			return lookup_template_path(template->root, path,
+						    dir_nchars);
+		template->dir_path = dir_path;
+		template->dir_path_alloc_nchars = alloc_nchars;
+	}
+	tmemcpy(template->dir_path, path, dir_nchars);
+	template->dir_path_nchars = dir_nchars;
+	template->dir = lookup_template_path(template->root, path, dir_nchars);
+	return template->dir;
+}
+
+/*
+ * Compare a file which has just been scanned with the file at the same path in
+ * the template image, and if it appears to be unchanged, take the checksums of
+ * its streams from the template.  Then its data needn't be read to be
+ * checksummed, and if it is already present, it needn't be read at all.
+ */
+void
+apply_capture_template(struct scan_params *params, struct wim_inode *inode)
+{
+	struct capture_template *template = params->template;
+	const tchar *path = params->cur_path + params->root_path_nchars;
+	size_t path_nchars = params->cur_path_nchars - params->root_path_nchars;
+	size_t dir_nchars = path_nchars;
+	struct wim_dentry *template_dentry;
+
+	/* Only the first link to each inode needs to be compared.  */
+	if (inode->i_nlink != 1 || !template->root)
+		return;
+
+	while (dir_nchars && path[dir_nchars - 1] == OS_PREFERRED_PATH_SEPARATOR)
+		dir_nchars--;
+	if (dir_nchars == 0) {
+		/* The root of the scan  */
+		template_dentry = template->root;
+	} else {
+		size_t name_start;
+
+		path_nchars = dir_nchars;
+		while (dir_nchars &&
+		       path[dir_nchars - 1] != OS_PREFERRED_PATH_SEPARATOR)
+			dir_nchars--;
+		name_start = dir_nchars;
+		while (dir_nchars &&
+		       path[dir_nchars - 1] == OS_PREFERRED_PATH_SEPARATOR)
+			dir_nchars--;
+		template_dentry = lookup_template_path(
+				get_template_dir(template, path, dir_nchars),
+				path + name_start, path_nchars - name_start);
+	}
+
+	if (template_dentry &&
+	    inode_metadata_consistent(inode, template_dentry->d_inode,
+				      params->blob_table, template->blob_table))
+	{
+		params->progress.scan.num_bytes_unchanged +=
+			inode_copy_checksums(inode, template_dentry->d_inode,
+					     params->blob_table,
+					     template->blob_table);
+	}
+}
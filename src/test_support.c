@@ -25,6 +25,7 @@
  *
  *	- Random directory tree generation
  *	- Directory tree comparison
+ *	- Running the matchfinders on their own, for benchmarking
  */
 
 #ifdef HAVE_CONFIG_H
@@ -50,6 +51,7 @@
 #include "wimlib/metadata.h"
 #include "wimlib/dentry.h"
 #include "wimlib/inode.h"
+#include "wimlib/lcpit_matchfinder.h"
 #include "wimlib/object_id.h"
 #include "wimlib/reparse.h"
 #include "wimlib/scan.h"
@@ -59,6 +61,11 @@
 #include "wimlib/unix_data.h"
 #include "wimlib/xattr.h"
 
+#define mf_pos_t	u32
+#define MF_SUFFIX
+#include "wimlib/bt_matchfinder.h"
+#include "wimlib/hc_matchfinder.h"
+
 /*----------------------------------------------------------------------------*
  *                            File tree generation                            *
  *----------------------------------------------------------------------------*/
@@ -67,16 +74,43 @@ struct generation_context {
 	struct scan_params *params;
 	struct wim_dentry *used_short_names[256];
 	bool metadata_only;
+
+	/* The parameters of a tree of a requested size (only used if
+	 * test_data_params.num_files != 0)  */
+	u32 max_dir_entries;
+	u32 max_name_len;
+	u64 max_stream_size;
+	u32 dedup_percent;
 };
 
+/* The number of distinct streams which duplicated streams are copies of  */
+#define NUM_DEDUP_STREAMS	64
+
 static u64 random_state;
 
+static struct wimlib_test_data_params test_data_params;
+
 WIMLIBAPI void
 wimlib_seed_random(u64 seed)
 {
 	random_state = seed;
 }
 
+/* Set the parameters of the trees which WIMLIB_ADD_FLAG_GENERATE_TEST_DATA
+ * generates, or restore the default random trees if @params is NULL.  */
+WIMLIBAPI int
+wimlib_set_test_data_params(const struct wimlib_test_data_params *params)
+{
+	if (!params) {
+		memset(&test_data_params, 0, sizeof(test_data_params));
+		return 0;
+	}
+	if (params->dedup_percent > 100)
+		return WIMLIB_ERR_INVALID_PARAM;
+	test_data_params = *params;
+	return 0;
+}
+
 static u32
 rand32(void)
 {
@@ -638,6 +672,12 @@ select_stream_size(struct generation_context *ctx)
 	if (ctx->metadata_only)
 		return 0;
 
+	if (ctx->max_stream_size) {
+		if (ctx->max_stream_size == UINT64_MAX)
+			return rand64();
+		return rand64() % (ctx->max_stream_size + 1);
+	}
+
 	switch (rand32() % 2048) {
 	default:
 		/* Empty  */
@@ -773,13 +813,26 @@ add_random_data_stream(struct wim_inode *inode, struct generation_context *ctx,
 {
 	void *buffer = NULL;
 	size_t size;
+	u64 saved_random_state = 0;
+	bool duplicate = false;
 	int ret;
 
+	/* To duplicate a stream, generate one of a fixed set of streams from
+	 * its own seed, then resume the main random sequence.  */
+	if (ctx->dedup_percent && rand32() % 100 < ctx->dedup_percent) {
+		duplicate = true;
+		saved_random_state = random_state;
+		random_state = (1 + rand32() % NUM_DEDUP_STREAMS) *
+			       0x9E3779B97F4A7C15;
+	}
+
 	size = select_stream_size(ctx);
 	if (size) {
 		buffer = MALLOC(size);
-		if (!buffer)
-			return WIMLIB_ERR_NOMEM;
+		if (!buffer) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto out;
+		}
 		generate_data(buffer, size, ctx);
 	}
 
@@ -787,6 +840,9 @@ add_random_data_stream(struct wim_inode *inode, struct generation_context *ctx,
 	if (!inode_add_stream_with_data(inode, STREAM_TYPE_DATA, stream_name,
 					buffer, size, ctx->params->blob_table))
 		ret = WIMLIB_ERR_NOMEM;
+out:
+	if (duplicate)
+		random_state = saved_random_state;
 	FREE(buffer);
 	return ret;
 }
@@ -963,118 +1019,199 @@ inode_has_short_name(const struct wim_inode *inode)
 	return false;
 }
 
+/*
+ * Generate a new child dentry of @dir, which is a directory if @is_directory,
+ * and which is sometimes a reparse point if @allow_reparse.  If the child is a new directory whose contents should be generated too, set
+ * *subdir_ret to it; otherwise set *subdir_ret to NULL.
+ */
 static int
-generate_dentry_tree_recursive(struct wim_dentry *dir, u32 depth,
-			       struct generation_context *ctx)
+generate_child(struct wim_dentry *dir, bool is_directory, bool allow_reparse,
+	       struct generation_context *ctx, struct wim_dentry **subdir_ret)
 {
-	u32 num_children = select_num_children(depth, ctx);
 	struct wim_dentry *child;
+	struct wim_inode *inode;
+	u64 ino;
+	bool is_reparse = (rand32() % 8 == 0) && allow_reparse;
+	utf16lechar name[63 + 1]; /* for UNIX extraction: 63 * 4 <= 255 */
+	int max_name_len = ARRAY_LEN(name) - 1;
+	int name_len;
+	struct wim_dentry *duplicate;
 	int ret;
 
-	memset(ctx->used_short_names, 0, sizeof(ctx->used_short_names));
+	*subdir_ret = NULL;
 
-	/* Generate 'num_children' dentries within 'dir'.  Some may be
-	 * directories themselves.  */
+	if (ctx->max_name_len)
+		max_name_len = min(max_name_len, ctx->max_name_len);
 
-	for (u32 i = 0; i < num_children; i++) {
+	/*
+	 * Select an inode number for the new file.  Sometimes choose an
+	 * existing inode number (i.e. create a hard link).  However,
+	 * wimlib intentionally doesn't honor directory hard links, and
+	 * reparse points cannot be represented in the WIM file format
+	 * at all; so don't create hard links for such files.
+	 */
+	if (is_directory || is_reparse)
+		ino = 0;
+	else
+		ino = select_inode_number(ctx);
 
-		/* Generate the next child dentry.  */
-		struct wim_inode *inode;
-		u64 ino;
-		bool is_directory = (rand32() % 16 <= 6);
-		bool is_reparse = (rand32() % 8 == 0);
-		utf16lechar name[63 + 1]; /* for UNIX extraction: 63 * 4 <= 255 */
-		int name_len;
-		struct wim_dentry *duplicate;
-
-		/*
-		 * Select an inode number for the new file.  Sometimes choose an
-		 * existing inode number (i.e. create a hard link).  However,
-		 * wimlib intentionally doesn't honor directory hard links, and
-		 * reparse points cannot be represented in the WIM file format
-		 * at all; so don't create hard links for such files.
-		 */
-		if (is_directory || is_reparse)
-			ino = 0;
-		else
-			ino = select_inode_number(ctx);
+	/* Create the dentry. */
+	ret = inode_table_new_dentry(ctx->params->inode_table, NULL,
+				     ino, 0, ino == 0, &child);
+	if (ret)
+		return ret;
 
-		/* Create the dentry. */
-		ret = inode_table_new_dentry(ctx->params->inode_table, NULL,
-					     ino, 0, ino == 0, &child);
-		if (ret)
-			return ret;
+	/* Choose a filename that is unique within the directory.*/
+	do {
+		name_len = generate_random_filename(name, max_name_len, ctx);
+	} while (get_dentry_child_with_utf16le_name(dir, name, name_len * 2,
+						    WIMLIB_CASE_PLATFORM_DEFAULT));
 
-		/* Choose a filename that is unique within the directory.*/
-		do {
-			name_len = generate_random_filename(name,
-							    ARRAY_LEN(name) - 1,
-							    ctx);
-		} while (get_dentry_child_with_utf16le_name(dir, name, name_len * 2,
-							    WIMLIB_CASE_PLATFORM_DEFAULT));
+	ret = dentry_set_name_utf16le(child, name, name_len * 2);
+	if (ret) {
+		free_dentry(child);
+		return ret;
+	}
 
-		ret = dentry_set_name_utf16le(child, name, name_len * 2);
-		if (ret) {
-			free_dentry(child);
-			return ret;
-		}
+	/* Add the dentry to the directory. */
+	duplicate = dentry_add_child(dir, child);
+	wimlib_assert(!duplicate);
 
-		/* Add the dentry to the directory. */
-		duplicate = dentry_add_child(dir, child);
-		wimlib_assert(!duplicate);
+	inode = child->d_inode;
 
-		inode = child->d_inode;
+	if (inode->i_nlink > 1)  /* Existing inode?  */
+		return 0;
 
-		if (inode->i_nlink > 1)  /* Existing inode?  */
-			continue;
+	/* New inode; set attributes, metadata, and data.  */
 
-		/* New inode; set attributes, metadata, and data.  */
+	if (is_directory)
+		inode->i_attributes |= FILE_ATTRIBUTE_DIRECTORY;
+	if (is_reparse)
+		inode->i_attributes |= FILE_ATTRIBUTE_REPARSE_POINT;
 
-		if (is_directory)
-			inode->i_attributes |= FILE_ATTRIBUTE_DIRECTORY;
-		if (is_reparse)
-			inode->i_attributes |= FILE_ATTRIBUTE_REPARSE_POINT;
+	ret = set_random_streams(inode, ctx);
+	if (ret)
+		return ret;
 
-		ret = set_random_streams(inode, ctx);
-		if (ret)
-			return ret;
+	ret = set_random_metadata(inode, ctx);
+	if (ret)
+		return ret;
+
+	if (is_directory && !is_reparse)
+		*subdir_ret = child;
+	return 0;
+}
+
+static int
+set_random_short_names(struct wim_dentry *dir, struct generation_context *ctx)
+{
+	struct wim_dentry *child;
+	int ret;
+
+	memset(ctx->used_short_names, 0, sizeof(ctx->used_short_names));
+
+	for_dentry_child(child, dir) {
+		/* sometimes generate a unique short name  */
+		if (randbool() && !inode_has_short_name(child->d_inode)) {
+			ret = set_random_short_name(dir, child, ctx);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
 
-		ret = set_random_metadata(inode, ctx);
+static int
+generate_dentry_tree_recursive(struct wim_dentry *dir, u32 depth,
+			       struct generation_context *ctx)
+{
+	u32 num_children = select_num_children(depth, ctx);
+	struct wim_dentry *subdir;
+	int ret;
+
+	/* Generate 'num_children' dentries within 'dir'.  Some may be
+	 * directories themselves.  */
+
+	for (u32 i = 0; i < num_children; i++) {
+		bool is_directory = (rand32() % 16 <= 6);
+
+		ret = generate_child(dir, is_directory, true, ctx, &subdir);
 		if (ret)
 			return ret;
 
 		/* Recurse if it's a directory.  */
-		if (is_directory && !is_reparse) {
-			ret = generate_dentry_tree_recursive(child, depth + 1,
+		if (subdir) {
+			ret = generate_dentry_tree_recursive(subdir, depth + 1,
 							     ctx);
 			if (ret)
 				return ret;
 		}
 	}
 
-	for_dentry_child(child, dir) {
-		/* sometimes generate a unique short name  */
-		if (randbool() && !inode_has_short_name(child->d_inode)) {
-			ret = set_random_short_name(dir, child, ctx);
+	return set_random_short_names(dir, ctx);
+}
+
+/*
+ * Generate exactly @count dentries within @dir, with at most
+ * ctx->max_dir_entries in any one directory.  If they don't fit in @dir itself,
+ * then @dir gets the maximum number of subdirectories and the rest are divided
+ * evenly among them, so the depth of the tree grows only logarithmically.
+ */
+static int
+generate_sized_tree(struct wim_dentry *dir, u64 count,
+		    struct generation_context *ctx)
+{
+	u32 max_entries = ctx->max_dir_entries;
+	struct wim_dentry *subdir;
+	int ret;
+
+	if (count <= max_entries) {
+		for (u32 i = 0; i < count; i++) {
+			ret = generate_child(dir, false, true, ctx, &subdir);
+			if (ret)
+				return ret;
+		}
+	} else {
+		u64 remaining = count - max_entries;
+
+		for (u32 i = 0; i < max_entries; i++) {
+			u64 share = remaining / (max_entries - i);
+
+			/* No reparse points, since they can't have children */
+			ret = generate_child(dir, true, false, ctx, &subdir);
+			if (ret)
+				return ret;
+			ret = generate_sized_tree(subdir, share, ctx);
 			if (ret)
 				return ret;
+			remaining -= share;
 		}
 	}
 
-	return 0;
+	return set_random_short_names(dir, ctx);
 }
 
 int
 generate_dentry_tree(struct wim_dentry **root_ret, const tchar *_ignored,
 		     struct scan_params *params)
 {
+	const struct wimlib_test_data_params *tparams = &test_data_params;
 	int ret;
 	struct wim_dentry *root = NULL;
 	struct generation_context ctx = {
 		.params = params,
 	};
 
-	ctx.metadata_only = ((rand32() % 8) != 0); /* usually metadata only  */
+	if (tparams->num_files) {
+		ctx.max_dir_entries = tparams->max_dir_entries ?: 64;
+		ctx.max_name_len = tparams->max_name_len;
+		ctx.max_stream_size = tparams->max_stream_size;
+		ctx.dedup_percent = tparams->dedup_percent;
+		ctx.metadata_only = (tparams->max_stream_size == 0);
+	} else {
+		/* usually metadata only  */
+		ctx.metadata_only = ((rand32() % 8) != 0);
+	}
 
 	ret = inode_table_new_dentry(params->inode_table, NULL, 0, 0, true, &root);
 	if (!ret) {
@@ -1083,8 +1220,13 @@ generate_dentry_tree(struct wim_dentry **root_ret, const tchar *_ignored,
 	}
 	if (!ret)
 		ret = set_random_metadata(root->d_inode, &ctx);
-	if (!ret)
-		ret = generate_dentry_tree_recursive(root, 1, &ctx);
+	if (!ret) {
+		if (tparams->num_files)
+			ret = generate_sized_tree(root, tparams->num_files,
+						  &ctx);
+		else
+			ret = generate_dentry_tree_recursive(root, 1, &ctx);
+	}
 	if (!ret)
 		*root_ret = root;
 	else
@@ -1096,23 +1238,6 @@ generate_dentry_tree(struct wim_dentry **root_ret, const tchar *_ignored,
  *                            File tree comparison                            *
  *----------------------------------------------------------------------------*/
 
-#define INDEX_NODE_TO_DENTRY(node)	\
-	((node) ? avl_tree_entry((node), struct wim_dentry, d_index_node) : NULL)
-
-static struct wim_dentry *
-dentry_first_child(struct wim_dentry *dentry)
-{
-	return INDEX_NODE_TO_DENTRY(
-			avl_tree_first_in_order(dentry->d_inode->i_children));
-}
-
-static struct wim_dentry *
-dentry_next_sibling(struct wim_dentry *dentry)
-{
-	return INDEX_NODE_TO_DENTRY(
-			avl_tree_next_in_order(&dentry->d_index_node));
-}
-
 /*
  * Verify that the dentries in the tree 'd1' exactly match the dentries in the
  * tree 'd2', considering long and short filenames.  In addition, set
@@ -1779,4 +1904,158 @@ wimlib_compare_images(WIMStruct *wim1, int image1,
 	return ret;
 }
 
+/*----------------------------------------------------------------------------*
+ *                           Matchfinder benchmarking                         *
+ *----------------------------------------------------------------------------*/
+
+WIMLIBAPI u64
+wimlib_get_matchfinder_needed_memory(int matchfinder, size_t max_bufsize)
+{
+	switch (matchfinder) {
+	case WIMLIB_MATCHFINDER_HC:
+		return hc_matchfinder_size(max_bufsize);
+	case WIMLIB_MATCHFINDER_BT:
+		return bt_matchfinder_size(max_bufsize);
+	case WIMLIB_MATCHFINDER_LCPIT:
+		return lcpit_matchfinder_get_needed_memory(max_bufsize);
+	}
+	return 0;
+}
+
+/* Do a greedy parse with the hash chains matchfinder, like the fastest levels
+ * of the XPRESS and LZX compressors do.  */
+static void
+run_hc_matchfinder(struct hc_matchfinder *mf, const u8 *in, size_t in_nbytes,
+		   u32 nice_len, u32 max_search_depth,
+		   u64 *num_matches_ret, u64 *total_len_ret)
+{
+	const u8 *in_next = in;
+	const u8 * const in_end = in + in_nbytes;
+	u32 next_hashes[2] = { 0, 0 };
+
+	hc_matchfinder_init(mf);
+	while (in_next != in_end) {
+		u32 max_len = min(in_end - in_next, 258);
+		u32 offset;
+		u32 len = hc_matchfinder_longest_match(mf, in, in_next, 2,
+						       max_len,
+						       min(max_len, nice_len),
+						       max_search_depth,
+						       next_hashes, &offset);
+		if (len > 2) {
+			(*num_matches_ret)++;
+			*total_len_ret += len;
+			hc_matchfinder_skip_bytes(mf, in, in_next + 1, in_end,
+						  len - 1, next_hashes);
+			in_next += len;
+		} else {
+			in_next++;
+		}
+	}
+}
+
+/* Find all matches at every position with the binary trees matchfinder, like
+ * the near-optimal parsers of the XPRESS and LZX compressors do.  */
+static void
+run_bt_matchfinder(struct bt_matchfinder *mf, const u8 *in, size_t in_nbytes,
+		   u32 nice_len, u32 max_search_depth, struct lz_match *matches,
+		   u64 *num_matches_ret, u64 *total_len_ret)
+{
+	u32 next_hashes[2] = { 0, 0 };
+
+	bt_matchfinder_init(mf);
+	for (size_t pos = 0; pos < in_nbytes; pos++) {
+		u32 max_len = min(in_nbytes - pos, 258);
+		struct lz_match *end;
+		u32 best_len;
+
+		if (max_len < BT_MATCHFINDER_REQUIRED_NBYTES)
+			break;
+		end = bt_matchfinder_get_matches(mf, in, pos, max_len,
+						 min(max_len, nice_len),
+						 max_search_depth, next_hashes,
+						 &best_len, matches);
+		*num_matches_ret += end - matches;
+		for (struct lz_match *m = matches; m != end; m++)
+			*total_len_ret += m->length;
+	}
+}
+
+/* Find all matches at every position with the LCP-interval tree matchfinder,
+ * like the near-optimal parser of the LZMS compressor does.  */
+static void
+run_lcpit_matchfinder(struct lcpit_matchfinder *mf, const u8 *in,
+		      size_t in_nbytes, struct lz_match *matches,
+		      u64 *num_matches_ret, u64 *total_len_ret)
+{
+	lcpit_matchfinder_load_buffer(mf, in, in_nbytes);
+	for (size_t pos = 0; pos < in_nbytes; pos++) {
+		u32 num_matches = lcpit_matchfinder_get_matches(mf, matches);
+
+		*num_matches_ret += num_matches;
+		for (u32 i = 0; i < num_matches; i++)
+			*total_len_ret += matches[i].length;
+	}
+}
+
+/*
+ * Run the specified matchfinder (WIMLIB_MATCHFINDER_*) over a buffer the way
+ * the compressors use it, and return the number of matches it found and their
+ * total length.  @max_search_depth is ignored by the lcpit_matchfinder.
+ */
+WIMLIBAPI int
+wimlib_run_matchfinder(int matchfinder, const void *in, size_t in_nbytes,
+		       u32 nice_len, u32 max_search_depth,
+		       u64 *num_matches_ret, u64 *total_len_ret)
+{
+	void *mf;
+	struct lz_match *matches;
+	int ret = 0;
+
+	*num_matches_ret = 0;
+	*total_len_ret = 0;
+
+	if (in_nbytes == 0 || in_nbytes > 0x7FFFFFFF ||
+	    nice_len < 3 || nice_len > 258 || max_search_depth == 0 ||
+	    wimlib_get_matchfinder_needed_memory(matchfinder, in_nbytes) == 0)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (matchfinder == WIMLIB_MATCHFINDER_LCPIT)
+		mf = MALLOC(sizeof(struct lcpit_matchfinder));
+	else
+		mf = MALLOC(wimlib_get_matchfinder_needed_memory(matchfinder,
+								 in_nbytes));
+	matches = MALLOC((nice_len + 1) * sizeof(matches[0]));
+	if (!mf || !matches) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out;
+	}
+
+	switch (matchfinder) {
+	case WIMLIB_MATCHFINDER_HC:
+		run_hc_matchfinder(mf, in, in_nbytes, nice_len,
+				   max_search_depth, num_matches_ret,
+				   total_len_ret);
+		break;
+	case WIMLIB_MATCHFINDER_BT:
+		run_bt_matchfinder(mf, in, in_nbytes, nice_len,
+				   max_search_depth, matches, num_matches_ret,
+				   total_len_ret);
+		break;
+	case WIMLIB_MATCHFINDER_LCPIT:
+		if (!lcpit_matchfinder_init(mf, in_nbytes, 2, nice_len, false)) {
+			ret = WIMLIB_ERR_NOMEM;
+			break;
+		}
+		run_lcpit_matchfinder(mf, in, in_nbytes, matches,
+				      num_matches_ret, total_len_ret);
+		lcpit_matchfinder_destroy(mf);
+		break;
+	}
+out:
+	FREE(matches);
+	FREE(mf);
+	return ret;
+}
+
 #endif /* ENABLE_TEST_SUPPORT */
@@ -1,6 +1,6 @@
 /*
- * threads.c - Thread, mutex, and condition variable support.  Wraps around
- *             pthreads or Windows native threads.
+ * threads.c - Thread, mutex, condition variable, and event count support.
+ *             Wraps around pthreads or Windows native threads.
  */
 
 /*
@@ -30,6 +30,12 @@
 #  include <errno.h>
 #  include <pthread.h>
 #endif
+#ifdef __linux__
+#  include <limits.h>
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
 
 #include "wimlib/assert.h"
 #include "wimlib/error.h"
@@ -242,3 +248,77 @@ void condvar_broadcast(struct condvar *c)
 }
 
 #endif /* !_WIN32 */
+
+bool event_count_init(struct event_count *ec)
+{
+	ec->seq = 0;
+	ec->num_waiters = 0;
+#ifndef __linux__
+	if (!mutex_init(&ec->lock))
+		return false;
+	if (!condvar_init(&ec->cond)) {
+		mutex_destroy(&ec->lock);
+		return false;
+	}
+#endif
+	return true;
+}
+
+void event_count_destroy(struct event_count *ec)
+{
+#ifndef __linux__
+	condvar_destroy(&ec->cond);
+	mutex_destroy(&ec->lock);
+#endif
+}
+
+/* Announce that the calling thread is about to wait on the event count, and
+ * return the value to pass to event_count_wait().  The caller must re-check its
+ * condition after this, since it may have become true just before.  */
+unsigned event_count_prepare_wait(struct event_count *ec)
+{
+	__atomic_fetch_add(&ec->num_waiters, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ec->seq, __ATOMIC_SEQ_CST);
+}
+
+/* Undo event_count_prepare_wait() without waiting.  */
+void event_count_cancel_wait(struct event_count *ec)
+{
+	__atomic_fetch_sub(&ec->num_waiters, 1, __ATOMIC_RELAXED);
+}
+
+/* Sleep until event_count_notify_all() has been called since the
+ * event_count_prepare_wait() which returned @seq.  This can also return
+ * spuriously, so the caller must re-check its condition afterwards.  */
+void event_count_wait(struct event_count *ec, unsigned seq)
+{
+#ifdef __linux__
+	syscall(SYS_futex, &ec->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+#else
+	mutex_lock(&ec->lock);
+	while (__atomic_load_n(&ec->seq, __ATOMIC_RELAXED) == seq)
+		condvar_wait(&ec->cond, &ec->lock);
+	mutex_unlock(&ec->lock);
+#endif
+	__atomic_fetch_sub(&ec->num_waiters, 1, __ATOMIC_RELAXED);
+}
+
+/* Wake all threads waiting on the event count.  The caller must have made its
+ * condition true before calling this.  */
+void event_count_notify_all(struct event_count *ec)
+{
+	/* Pairs with event_count_prepare_wait(): either the waiter sees the
+	 * condition when it re-checks it, or we see the waiter here.  */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ec->num_waiters, __ATOMIC_RELAXED) == 0)
+		return;
+#ifdef __linux__
+	__atomic_fetch_add(&ec->seq, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &ec->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+	mutex_lock(&ec->lock);
+	__atomic_fetch_add(&ec->seq, 1, __ATOMIC_RELAXED);
+	condvar_broadcast(&ec->cond);
+	mutex_unlock(&ec->lock);
+#endif
+}
@@ -0,0 +1,139 @@
+/*
+ * trace.c
+ *
+ * Optional tracing of the library's main operations, as a timeline.
+ *
+ * If the environment variable WIMLIB_TRACE is set to a file path when the
+ * library is initialized, then an event is written to that file for each
+ * traced operation, e.g. each batch of chunks compressed by a thread of the
+ * task pool, giving the thread it ran on and when it began and ended.  The file
+ * is in the JSON format of the Chrome trace viewer (chrome://tracing), which
+ * other tools such as Perfetto can also read.  This shows at a glance, e.g.,
+ * whether the compressor threads were kept busy during a write.
+ *
+ * The file is completed by wimlib_global_cleanup(), but since the format allows
+ * the closing bracket to be missing, a file left incomplete because the program
+ * exited without cleaning up is still usable.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#  include "wimlib/win32_common.h"
+#else
+#  include <pthread.h>
+#  include <unistd.h>
+#endif
+#ifdef __linux__
+#  include <sys/syscall.h>
+#endif
+
+#include "wimlib/threads.h"
+#include "wimlib/trace.h"
+
+bool trace_enabled;
+
+/* Protects everything below  */
+static struct mutex trace_lock = MUTEX_INITIALIZER;
+
+static FILE *trace_file;
+static unsigned long trace_num_events;
+
+static unsigned long
+get_pid(void)
+{
+#ifdef _WIN32
+	return GetCurrentProcessId();
+#else
+	return getpid();
+#endif
+}
+
+static unsigned long
+get_thread_id(void)
+{
+#if defined(_WIN32)
+	return GetCurrentThreadId();
+#elif defined(__linux__)
+	return syscall(SYS_gettid);
+#else
+	return (unsigned long)(uintptr_t)pthread_self();
+#endif
+}
+
+/* Start tracing if requested by the environment.  Called when the library is
+ * initialized.  */
+void
+trace_init(void)
+{
+	const char *path = getenv("WIMLIB_TRACE");
+
+	if (!path || !*path)
+		return;
+
+	mutex_lock(&trace_lock);
+	if (!trace_file) {
+		trace_file = fopen(path, "w");
+		if (trace_file) {
+			fputs("[", trace_file);
+			trace_num_events = 0;
+			trace_enabled = true;
+		}
+	}
+	mutex_unlock(&trace_lock);
+}
+
+/* Finish the trace file, if any.  Called when the library is cleaned up.  */
+void
+trace_cleanup(void)
+{
+	mutex_lock(&trace_lock);
+	trace_enabled = false;
+	if (trace_file) {
+		fputs("\n]\n", trace_file);
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+	mutex_unlock(&trace_lock);
+}
+
+/* Record that the operation @name ran on the calling thread from @start, as
+ * returned by perf_now(), until now.  */
+void
+trace_event(const char *name, u64 start)
+{
+	u64 end = perf_now();
+	unsigned long tid = get_thread_id();
+
+	mutex_lock(&trace_lock);
+	if (trace_file) {
+		fprintf(trace_file,
+			"%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%lu,"
+			"\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+			(trace_num_events++ ? "," : ""), name, get_pid(), tid,
+			start / 1000.0, (end - start) / 1000.0);
+	}
+	mutex_unlock(&trace_lock);
+}
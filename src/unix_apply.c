@@ -26,6 +26,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#ifdef __linux__
+#  include <linux/fs.h>
+#  include <sys/ioctl.h>
+#endif
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -34,15 +39,21 @@
 #endif
 #include <unistd.h>
 
+#include "wimlib/alloca.h"
 #include "wimlib/apply.h"
 #include "wimlib/assert.h"
 #include "wimlib/blob_table.h"
 #include "wimlib/dentry.h"
 #include "wimlib/error.h"
 #include "wimlib/file_io.h"
+#include "wimlib/io_uring.h"
 #include "wimlib/reparse.h"
+#include "wimlib/resource.h"
+#include "wimlib/ring_buffer.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/timestamp.h"
 #include "wimlib/unix_data.h"
+#include "wimlib/wim.h"
 #include "wimlib/xattr.h"
 
 /* We don't require O_NOFOLLOW, but the advantage of having it is that if we
@@ -54,6 +65,10 @@
 #  define O_NOFOLLOW 0
 #endif
 
+#ifndef O_DIRECTORY
+#  define O_DIRECTORY 0
+#endif
+
 static int
 unix_get_supported_features(const char *target,
 			    struct wim_features *supported_features)
@@ -72,6 +87,45 @@ unix_get_supported_features(const char *target,
 
 #define NUM_PATHBUFS 2  /* We need 2 when creating hard links  */
 
+/* Number of directories which each context keeps open; see unix_dentry_at() */
+#define DIR_CACHE_SIZE 16
+
+/* Regular files whose data is at most this many bytes are handed off to the
+ * writers rather than being written as their data is read.  */
+#define WRITE_JOB_MAX_SIZE	(1U << 20)
+
+/* Maximum number of writers, and number of write jobs per writer  */
+#define MAX_WRITERS		8
+#define WRITE_JOBS_PER_WRITER	4
+
+struct unix_apply_ctx;
+
+/* An extracted directory which is being kept open  */
+struct unix_cached_dir {
+	const struct wim_dentry *dentry;
+	int fd;
+	u64 last_used;
+};
+
+/*
+ * The data of a blob being extracted to one or more regular files, buffered in
+ * memory so that a writer can create the files, write the data to them, set
+ * their metadata, and close them, while the main thread goes on reading the
+ * next blobs.  Creating and closing many small files is dominated by latency
+ * rather than by bandwidth, so this can be much faster than doing everything
+ * from the thread that reads the blobs.
+ */
+struct unix_write_job {
+	struct unix_apply_ctx *ctx;
+	struct list_head free_list;
+	u8 *data;
+	size_t data_alloc;
+	u64 size;
+	u32 num_inodes;
+	int ret;
+	const struct wim_inode *inodes[MAX_OPEN_FILES];
+};
+
 struct unix_apply_ctx {
 	/* Extract flags, the pointer to the WIMStruct, etc.  */
 	struct apply_ctx common;
@@ -82,20 +136,49 @@ struct unix_apply_ctx {
 	/* Index of next pathbuf to use  */
 	unsigned which_pathbuf;
 
-	/* Currently open file descriptors for extraction  */
-	struct filedes open_fds[MAX_OPEN_FILES];
+	/* The target directory, or -1 if it hasn't been opened yet  */
+	int target_fd;
+
+	/* The most recently used extracted directories, and the counter which
+	 * orders their uses  */
+	struct unix_cached_dir dir_cache[DIR_CACHE_SIZE];
+	u64 dir_cache_clock;
+
+	/* Currently open file descriptors for extraction (allocated array of
+	 * common.max_open_files)  */
+	struct filedes *open_fds;
 
 	/* Number of currently open file descriptors in open_fds, starting from
 	 * the beginning of the array.  */
 	unsigned num_open_fds;
 
 	/* For each currently open file, whether we're writing to it in "sparse"
-	 * mode or not.  */
-	bool is_sparse_file[MAX_OPEN_FILES];
+	 * mode or not (allocated array of common.max_open_files)  */
+	bool *is_sparse_file;
 
 	/* Whether is_sparse_file[] is true for any currently open file  */
 	bool any_sparse_files;
 
+	/* Whether the blob currently being read can be, or has been, copied
+	 * directly from the WIM file to all currently open files  */
+	bool can_copy_blob;
+	bool blob_copied;
+
+	/* Whether FICLONERANGE or copy_file_range() have been found to be
+	 * unsupported between the WIM file and the target  */
+	bool clone_unsupported;
+	bool copy_file_range_unsupported;
+
+	/* Whether the data of the blob currently being read is written only to
+	 * the first open file, to be cloned into the others once it's all
+	 * there; see unix_clone_blob_targets()  */
+	bool clone_targets;
+
+	/* Whether FICLONE or copy_file_range() have been found to be
+	 * unsupported between files in the target  */
+	bool target_clone_unsupported;
+	bool target_copy_file_range_unsupported;
+
 	/* Buffer for reading reparse point data into memory  */
 	u8 reparse_data[REPARSE_DATA_MAX_SIZE];
 
@@ -111,8 +194,65 @@ struct unix_apply_ctx {
 
 	/* Number of special files we couldn't create due to EPERM  */
 	unsigned long num_special_files_ignored;
+
+	/* Size of each path buffer  */
+	size_t path_max;
+
+	/* The directories to extract, sorted by depth, and for each depth, the
+	 * index in @dirs just past the directories at that depth  */
+	const struct wim_dentry **dirs;
+	size_t num_dirs;
+	size_t *dir_level_ends;
+	unsigned num_dir_levels;
+
+	/* The first alias of each empty regular file and special file to
+	 * extract  */
+	const struct wim_dentry **empty_files;
+	size_t num_empty_files;
+
+	/* Writers, if any, and the context of each.  A writer's context has a
+	 * copy of 'common' and its own path buffers and open directories, and
+	 * it is used only to find the files and to look at the extraction
+	 * options.  The writers'
+	 * contexts are also used to create the directories and empty files and
+	 * to set the directories' metadata in parallel.  */
+	struct worker_group writers;
+	struct unix_apply_ctx *writer_ctxs[MAX_WRITERS];
+	unsigned num_writers;
+
+	/* Each write job is either free, being filled by the main thread,
+	 * submitted to the writers, or finished but not yet collected.  */
+	struct unix_write_job *write_jobs;
+	unsigned num_write_jobs;
+	struct list_head free_write_jobs;
+	struct ring_buffer finished_write_jobs;
+	unsigned num_submitted_write_jobs;
+
+	/* The write job which the blob currently being read is going to, or
+	 * NULL if the blob is being written directly to its targets.  */
+	struct unix_write_job *cur_write_job;
+
+	/* First error reported by a write job  */
+	int write_error;
+
+	/* If non-NULL, the finished files are closed in batches on this ring
+	 * rather than one close() at a time; see unix_close_file().  */
+	struct io_ring *close_ring;
+	struct pending_close *pending_closes;
+	unsigned num_pending_closes;
+	int close_error;
+	const struct wim_inode *close_error_inode;
 };
 
+/* A file whose close is pending on the close ring  */
+struct pending_close {
+	int fd;
+	const struct wim_inode *inode;
+};
+
+/* Maximum number of closes pending at once  */
+#define CLOSE_BATCH_SIZE	64
+
 /* Returns the number of characters needed to represent the path to the
  * specified @dentry when extracted, not including the null terminator or the
  * path to the target directory itself.  */
@@ -198,6 +338,101 @@ unix_build_inode_extraction_path(const struct wim_inode *inode,
 	return unix_build_extraction_path(inode_first_extraction_dentry(inode), ctx);
 }
 
+/* Return a file descriptor for the target directory, or -1 if it can't be
+ * opened.  */
+static int
+unix_get_target_fd(struct unix_apply_ctx *ctx)
+{
+	if (ctx->target_fd < 0)
+		ctx->target_fd = open(ctx->common.target, O_RDONLY | O_DIRECTORY);
+	return ctx->target_fd;
+}
+
+/*
+ * Return a file descriptor for the extracted directory @dir, or -1 if it can't
+ * be opened.  The file descriptor belongs to the cache, which keeps the
+ * DIR_CACHE_SIZE most recently used directories open.  Since each lookup adds
+ * at most one directory to the cache, the file descriptor stays valid at least
+ * until the cache has been used for one other directory.
+ */
+static int
+unix_get_dir_fd(const struct wim_dentry *dir, struct unix_apply_ctx *ctx)
+{
+	struct unix_cached_dir *victim = &ctx->dir_cache[0];
+	int fd;
+
+	for (unsigned i = 0; i < DIR_CACHE_SIZE; i++) {
+		struct unix_cached_dir *cd = &ctx->dir_cache[i];
+
+		if (cd->dentry == dir) {
+			cd->last_used = ++ctx->dir_cache_clock;
+			return cd->fd;
+		}
+		if (cd->last_used < victim->last_used)
+			victim = cd;
+	}
+
+	fd = open(unix_build_extraction_path(dir, ctx), O_RDONLY | O_DIRECTORY);
+	unix_reuse_pathbuf(ctx);
+	if (fd < 0)
+		return -1;
+	if (victim->dentry)
+		close(victim->fd);
+	victim->dentry = dir;
+	victim->fd = fd;
+	victim->last_used = ++ctx->dir_cache_clock;
+	return fd;
+}
+
+/* Close the directories which are open in the context.  */
+static void
+unix_close_dirs(struct unix_apply_ctx *ctx)
+{
+	for (unsigned i = 0; i < DIR_CACHE_SIZE; i++) {
+		if (ctx->dir_cache[i].dentry) {
+			close(ctx->dir_cache[i].fd);
+			ctx->dir_cache[i].dentry = NULL;
+			ctx->dir_cache[i].last_used = 0;
+		}
+	}
+	if (ctx->target_fd >= 0) {
+		close(ctx->target_fd);
+		ctx->target_fd = -1;
+	}
+}
+
+/*
+ * Get the name by which to refer to the extracted file @dentry relative to the
+ * directory file descriptor returned in *dirfd_ret, for use with the *at()
+ * system calls.  The name is usually just the file's own name, relative to its
+ * parent directory, which is kept open.  Then the kernel has to look up only
+ * one component rather than the whole path, which matters for deep trees on
+ * network and FUSE filesystems.  If the parent directory can't be opened, the
+ * full path is returned with AT_FDCWD.  In that case, the name is in one of the
+ * path buffers.
+ */
+static const char *
+unix_dentry_at(const struct wim_dentry *dentry, struct unix_apply_ctx *ctx,
+	       int *dirfd_ret)
+{
+	const struct wim_dentry *parent = dentry->d_parent;
+	int dirfd;
+
+	if (dentry_is_root(dentry))
+		dirfd = -1; /* The target directory itself  */
+	else if (dentry_is_root(parent) || !will_extract_dentry(parent))
+		dirfd = unix_get_target_fd(ctx);
+	else
+		dirfd = unix_get_dir_fd(parent, ctx);
+
+	if (dirfd < 0) {
+		*dirfd_ret = AT_FDCWD;
+		return unix_build_extraction_path(dentry, ctx);
+	}
+	*dirfd_ret = dirfd;
+	return dentry->d_extraction_name;
+}
+
 /* Should the specified file be extracted as a directory on UNIX?  We extract
  * the file as a directory if FILE_ATTRIBUTE_DIRECTORY is set and the file does
  * not have a symlink or junction reparse point.  It *may* have a different type
@@ -209,12 +444,38 @@ should_extract_as_directory(const struct wim_inode *inode)
 		!inode_is_symlink(inode);
 }
 
-/* Sets the timestamps on a file being extracted.
- *
- * Either @fd or @path must be specified (not -1 and not NULL, respectively).
+/*
+ * A file whose metadata is being set.  It's specified either by @fd, an open
+ * file descriptor to it, or else by @name relative to the directory file
+ * descriptor @dirfd.  @path is the full path to the file, which is only built
+ * if it's needed; see unix_file_path().
  */
+struct unix_file_ref {
+	int fd;
+	int dirfd;
+	const char *name;
+	const char *path;
+	const struct wim_inode *inode;
+};
+
+/* Return the full path to the file, e.g. for a message.  */
+static const char *
+unix_file_path(struct unix_file_ref *file, struct unix_apply_ctx *ctx)
+{
+	if (!file->path) {
+		if (file->fd < 0 && file->dirfd == AT_FDCWD)
+			file->path = file->name;
+		else
+			file->path = unix_build_inode_extraction_path(file->inode,
+								      ctx);
+	}
+	return file->path;
+}
+
+/* Sets the timestamps on a file being extracted.  */
 static int
-unix_set_timestamps(int fd, const char *path, u64 atime, u64 mtime)
+unix_set_timestamps(struct unix_file_ref *file, u64 atime, u64 mtime,
+		    struct unix_apply_ctx *ctx)
 {
 	{
 		struct timespec times[2];
@@ -224,11 +485,12 @@ unix_set_timestamps(int fd, const char *path, u64 atime, u64 mtime)
 
 		errno = ENOSYS;
 #ifdef HAVE_FUTIMENS
-		if (fd >= 0 && !futimens(fd, times))
+		if (file->fd >= 0 && !futimens(file->fd, times))
 			return 0;
 #endif
 #ifdef HAVE_UTIMENSAT
-		if (fd < 0 && !utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW))
+		if (file->fd < 0 && !utimensat(file->dirfd, file->name, times,
+					       AT_SYMLINK_NOFOLLOW))
 			return 0;
 #endif
 		if (errno != ENOSYS)
@@ -240,30 +502,31 @@ unix_set_timestamps(int fd, const char *path, u64 atime, u64 mtime)
 		times[0] = wim_timestamp_to_timeval(atime);
 		times[1] = wim_timestamp_to_timeval(mtime);
 
-		if (fd >= 0 && !futimes(fd, times))
+		if (file->fd >= 0 && !futimes(file->fd, times))
 			return 0;
-		if (fd < 0 && !lutimes(path, times))
+		if (file->fd < 0 && !lutimes(unix_file_path(file, ctx), times))
 			return 0;
 		return WIMLIB_ERR_SET_TIMESTAMPS;
 	}
 }
 
 static int
-unix_set_owner_and_group(int fd, const char *path, uid_t uid, gid_t gid)
+unix_set_owner_and_group(const struct unix_file_ref *file, uid_t uid, gid_t gid)
 {
-	if (fd >= 0 && !fchown(fd, uid, gid))
+	if (file->fd >= 0 && !fchown(file->fd, uid, gid))
 		return 0;
-	if (fd < 0 && !lchown(path, uid, gid))
+	if (file->fd < 0 &&
+	    !fchownat(file->dirfd, file->name, uid, gid, AT_SYMLINK_NOFOLLOW))
 		return 0;
 	return WIMLIB_ERR_SET_SECURITY;
 }
 
 static int
-unix_set_mode(int fd, const char *path, mode_t mode)
+unix_set_mode(const struct unix_file_ref *file, mode_t mode)
 {
-	if (fd >= 0 && !fchmod(fd, mode))
+	if (file->fd >= 0 && !fchmod(file->fd, mode))
 		return 0;
-	if (fd < 0 && !chmod(path, mode))
+	if (file->fd < 0 && !fchmodat(file->dirfd, file->name, mode, 0))
 		return 0;
 	return WIMLIB_ERR_SET_SECURITY;
 }
@@ -271,8 +534,7 @@ unix_set_mode(int fd, const char *path, mode_t mode)
 #ifdef HAVE_LINUX_XATTR_SUPPORT
 /* Apply extended attributes to a file */
 static int
-apply_linux_xattrs(int fd, const struct wim_inode *inode,
-		   const char *path, struct unix_apply_ctx *ctx,
+apply_linux_xattrs(struct unix_file_ref *file, struct unix_apply_ctx *ctx,
 		   const void *entries, size_t entries_size, bool is_old_format)
 {
 	const void * const entries_end = entries + entries_size;
@@ -296,12 +558,8 @@ apply_linux_xattrs(int fd, const struct wim_inode *inode,
 			valid = valid_xattr_entry(entry, entries_end - entry);
 		}
 		if (!valid) {
-			if (!path) {
-				path = unix_build_inode_extraction_path(inode,
-									ctx);
-			}
 			ERROR("\"%s\": extended attribute is corrupt or unsupported",
-			      path);
+			      unix_file_path(file, ctx));
 			return WIMLIB_ERR_INVALID_XATTR;
 		}
 		if (is_old_format) {
@@ -321,26 +579,24 @@ apply_linux_xattrs(int fd, const struct wim_inode *inode,
 		}
 		name[name_len] = '\0';
 
-		if (fd >= 0)
-			res = fsetxattr(fd, name, value, value_len, 0);
+		/* There is no lsetxattrat(), so this needs the full path.  */
+		if (file->fd >= 0)
+			res = fsetxattr(file->fd, name, value, value_len, 0);
 		else
-			res = lsetxattr(path, name, value, value_len, 0);
+			res = lsetxattr(unix_file_path(file, ctx), name,
+					value, value_len, 0);
 
 		if (unlikely(res != 0)) {
-			if (!path) {
-				path = unix_build_inode_extraction_path(inode,
-									ctx);
-			}
 			if (is_linux_security_xattr(name) &&
 			    (ctx->common.extract_flags &
 			     WIMLIB_EXTRACT_FLAG_STRICT_ACLS))
 			{
 				ERROR_WITH_ERRNO("\"%s\": unable to set extended attribute \"%s\"",
-						 path, name);
+						 unix_file_path(file, ctx), name);
 				return WIMLIB_ERR_SET_XATTR;
 			}
 			WARNING_WITH_ERRNO("\"%s\": unable to set extended attribute \"%s\"",
-					   path, name);
+					   unix_file_path(file, ctx), name);
 		}
 	}
 	return 0;
@@ -358,14 +614,15 @@ apply_linux_xattrs(int fd, const struct wim_inode *inode,
  * restrictions result in the following ordering which we follow: chown(),
  * setxattr(), then chmod().
  *
- * N.B. the file may be specified by either 'fd' (for regular files) or 'path',
- * and it may be a symlink.  For symlinks we need lchown() and lsetxattr() but
- * need to skip the chmod(), since mode bits are not meaningful for symlinks.
+ * N.B. the file may be specified by either a file descriptor (for regular
+ * files) or a name, and it may be a symlink.  For symlinks we need
+ * AT_SYMLINK_NOFOLLOW and lsetxattr() but need to skip the chmod(), since mode
+ * bits are not meaningful for symlinks.
  */
 static int
-apply_unix_metadata(int fd, const struct wim_inode *inode,
-		    const char *path, struct unix_apply_ctx *ctx)
+apply_unix_metadata(struct unix_file_ref *file, struct unix_apply_ctx *ctx)
 {
+	const struct wim_inode *inode = file->inode;
 	bool have_dat;
 	struct wimlib_unix_data dat;
 #ifdef HAVE_LINUX_XATTR_SUPPORT
@@ -378,46 +635,45 @@ apply_unix_metadata(int fd, const struct wim_inode *inode,
 	have_dat = inode_get_unix_data(inode, &dat);
 
 	if (have_dat) {
-		ret = unix_set_owner_and_group(fd, path, dat.uid, dat.gid);
+		ret = unix_set_owner_and_group(file, dat.uid, dat.gid);
 		if (ret) {
-			if (!path)
-				path = unix_build_inode_extraction_path(inode, ctx);
 			if (ctx->common.extract_flags &
 			    WIMLIB_EXTRACT_FLAG_STRICT_ACLS)
 			{
 				ERROR_WITH_ERRNO("\"%s\": unable to set uid=%"PRIu32" and gid=%"PRIu32,
-						 path, dat.uid, dat.gid);
+						 unix_file_path(file, ctx),
+						 dat.uid, dat.gid);
 				return ret;
 			}
 			WARNING_WITH_ERRNO("\"%s\": unable to set uid=%"PRIu32" and gid=%"PRIu32,
-					   path, dat.uid, dat.gid);
+					   unix_file_path(file, ctx),
+					   dat.uid, dat.gid);
 		}
 	}
 
 #ifdef HAVE_LINUX_XATTR_SUPPORT
 	entries = inode_get_linux_xattrs(inode, &entries_size, &is_old_format);
 	if (entries) {
-		ret = apply_linux_xattrs(fd, inode, path, ctx,
-					 entries, entries_size, is_old_format);
+		ret = apply_linux_xattrs(file, ctx, entries, entries_size,
+					 is_old_format);
 		if (ret)
 			return ret;
 	}
 #endif
 
 	if (have_dat && !inode_is_symlink(inode)) {
-		ret = unix_set_mode(fd, path, dat.mode);
+		ret = unix_set_mode(file, dat.mode);
 		if (ret) {
-			if (!path)
-				path = unix_build_inode_extraction_path(inode, ctx);
 			if (ctx->common.extract_flags &
 			    WIMLIB_EXTRACT_FLAG_STRICT_ACLS)
 			{
 				ERROR_WITH_ERRNO("\"%s\": unable to set mode=0%"PRIo32,
-						 path, dat.mode);
+						 unix_file_path(file, ctx),
+						 dat.mode);
 				return ret;
 			}
 			WARNING_WITH_ERRNO("\"%s\": unable to set mode=0%"PRIo32,
-					   path, dat.mode);
+					   unix_file_path(file, ctx), dat.mode);
 		}
 	}
 
@@ -427,100 +683,144 @@ apply_unix_metadata(int fd, const struct wim_inode *inode,
 /*
  * Set metadata on an extracted file.
  *
- * @fd is an open file descriptor to the extracted file, or -1.  @path is the
- * path to the extracted file, or NULL.  If valid, this function uses @fd.
- * Otherwise, if valid, it uses @path.  Otherwise, it calculates the path to one
- * alias of the extracted file and uses it.
+ * @fd is an open file descriptor to the extracted file, or -1.  If valid, this
+ * function uses @fd.  Otherwise, it uses the name of one alias of the extracted
+ * file relative to its parent directory.
  */
 static int
 unix_set_metadata(int fd, const struct wim_inode *inode,
-		  const char *path, struct unix_apply_ctx *ctx)
+		  struct unix_apply_ctx *ctx)
 {
+	struct unix_file_ref file = {
+		.fd = fd,
+		.dirfd = AT_FDCWD,
+		.inode = inode,
+	};
 	int ret;
 
-	if (fd < 0 && !path)
-		path = unix_build_inode_extraction_path(inode, ctx);
+	if (fd < 0)
+		file.name = unix_dentry_at(inode_first_extraction_dentry(inode),
+					   ctx, &file.dirfd);
 
 	if (ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA) {
-		ret = apply_unix_metadata(fd, inode, path, ctx);
+		ret = apply_unix_metadata(&file, ctx);
 		if (ret)
 			return ret;
 	}
 
-	ret = unix_set_timestamps(fd, path, inode->i_last_access_time,
-				  inode->i_last_write_time);
+	ret = unix_set_timestamps(&file, inode->i_last_access_time,
+				  inode->i_last_write_time, ctx);
 	if (ret) {
-		if (!path)
-			path = unix_build_inode_extraction_path(inode, ctx);
 		if (ctx->common.extract_flags &
 		    WIMLIB_EXTRACT_FLAG_STRICT_TIMESTAMPS)
 		{
-			ERROR_WITH_ERRNO("\"%s\": unable to set timestamps", path);
+			ERROR_WITH_ERRNO("\"%s\": unable to set timestamps",
+					 unix_file_path(&file, ctx));
 			return ret;
 		}
-		WARNING_WITH_ERRNO("\"%s\": unable to set timestamps", path);
+		WARNING_WITH_ERRNO("\"%s\": unable to set timestamps",
+				   unix_file_path(&file, ctx));
 	}
 
 	return 0;
 }
 
+/* Create the regular file @dentry, replacing any existing file, and return a
+ * file descriptor open for writing to it, or -1 with errno set on failure.  */
+static int
+unix_create_regular_file(const struct wim_dentry *dentry,
+			 struct unix_apply_ctx *ctx)
+{
+	const char *name;
+	int dirfd;
+	int fd;
+
+	name = unix_dentry_at(dentry, ctx, &dirfd);
+retry_create:
+	fd = openat(dirfd, name, O_EXCL | O_CREAT | O_WRONLY | O_NOFOLLOW, 0644);
+	if (fd < 0 && errno == EEXIST && !unlinkat(dirfd, name, 0))
+		goto retry_create;
+	return fd;
+}
+
 /* Extract all needed aliases of the @inode, where one alias, corresponding to
- * @first_dentry, has already been extracted to @first_path.  */
+ * @first_dentry, has already been extracted.  */
 static int
 unix_create_hardlinks(const struct wim_inode *inode,
 		      const struct wim_dentry *first_dentry,
-		      const char *first_path, struct unix_apply_ctx *ctx)
+		      struct unix_apply_ctx *ctx)
 {
 	const struct wim_dentry *dentry;
-	const char *newpath;
+	const char *first_name;
+	const char *new_name;
+	int first_dirfd;
+	int new_dirfd;
 
 	inode_for_each_extraction_alias(dentry, inode) {
 		if (dentry == first_dentry)
 			continue;
 
-		newpath = unix_build_extraction_path(dentry, ctx);
+		/* Looking up the first alias adds at most one directory to the
+		 * cache, so it can't evict the just-used directory of the new
+		 * alias.  */
+		new_name = unix_dentry_at(dentry, ctx, &new_dirfd);
+		first_name = unix_dentry_at(first_dentry, ctx, &first_dirfd);
 	retry_link:
-		if (link(first_path, newpath)) {
-			if (errno == EEXIST && !unlink(newpath))
+		if (linkat(first_dirfd, first_name, new_dirfd, new_name, 0)) {
+			if (errno == EEXIST && !unlinkat(new_dirfd, new_name, 0))
 				goto retry_link;
 			ERROR_WITH_ERRNO("Can't create hard link "
-					 "\"%s\" => \"%s\"", newpath, first_path);
+					 "\"%s\" => \"%s\"",
+					 unix_build_extraction_path(dentry, ctx),
+					 unix_build_extraction_path(first_dentry,
+								    ctx));
 			return WIMLIB_ERR_LINK;
 		}
-		unix_reuse_pathbuf(ctx);
 	}
 	return 0;
 }
 
-/* If @dentry represents a directory, create it.  */
+/* Create the directory @dentry.  */
 static int
-unix_create_if_directory(const struct wim_dentry *dentry,
-			 struct unix_apply_ctx *ctx)
+unix_create_directory(const struct wim_dentry *dentry,
+		      struct unix_apply_ctx *ctx)
 {
-	const char *path;
+	const char *name;
+	int dirfd;
 	struct stat stbuf;
 
-	if (!should_extract_as_directory(dentry->d_inode))
-		return 0;
-
-	path = unix_build_extraction_path(dentry, ctx);
-	if (mkdir(path, 0755) &&
+	name = unix_dentry_at(dentry, ctx, &dirfd);
+	if (mkdirat(dirfd, name, 0755) &&
 	    /* It's okay if the path already exists, as long as it's a
 	     * directory.  */
-	    !(errno == EEXIST && !lstat(path, &stbuf) && S_ISDIR(stbuf.st_mode)))
+	    !(errno == EEXIST &&
+	      !fstatat(dirfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) &&
+	      S_ISDIR(stbuf.st_mode)))
 	{
-		ERROR_WITH_ERRNO("Can't create directory \"%s\"", path);
+		ERROR_WITH_ERRNO("Can't create directory \"%s\"",
+				 unix_build_extraction_path(dentry, ctx));
 		return WIMLIB_ERR_MKDIR;
 	}
+	return 0;
+}
+
+/* Is @dentry the first alias of an empty regular file or a special file?  */
+static bool
+is_empty_file_to_extract(const struct wim_dentry *dentry)
+{
+	const struct wim_inode *inode = dentry->d_inode;
 
-	return report_file_created(&ctx->common);
+	return dentry == inode_first_extraction_dentry(inode) &&
+		!should_extract_as_directory(inode) &&
+		!inode_is_symlink(inode) &&
+		!inode_get_blob_for_unnamed_data_stream_resolved(inode);
 }
 
-/* If @dentry represents an empty regular file or a special file, create it, set
- * its metadata, and create any needed hard links.  */
+/* Create the empty regular file or special file whose first alias is @dentry,
+ * set its metadata, and create any needed hard links.  */
 static int
-unix_extract_if_empty_file(const struct wim_dentry *dentry,
-			   struct unix_apply_ctx *ctx)
+unix_create_empty_file(const struct wim_dentry *dentry,
+		       struct unix_apply_ctx *ctx)
 {
 	const struct wim_inode *inode;
 	struct wimlib_unix_data unix_data;
@@ -529,16 +829,6 @@ unix_extract_if_empty_file(const struct wim_dentry *dentry,
 
 	inode = dentry->d_inode;
 
-	/* Extract all aliases only when the "first" comes up.  */
-	if (dentry != inode_first_extraction_dentry(inode))
-		return 0;
-
-	/* Is this a directory, a symbolic link, or any type of nonempty file?
-	 */
-	if (should_extract_as_directory(inode) || inode_is_symlink(inode) ||
-	    inode_get_blob_for_unnamed_data_stream_resolved(inode))
-		return 0;
-
 	/* Recognize special files in UNIX_DATA mode  */
 	if ((ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA) &&
 	    inode_get_unix_data(inode, &unix_data) &&
@@ -561,105 +851,155 @@ unix_extract_if_empty_file(const struct wim_dentry *dentry,
 		}
 		/* On special files, we can set timestamps immediately because
 		 * we don't need to write any data to them.  */
-		ret = unix_set_metadata(-1, inode, path, ctx);
+		ret = unix_set_metadata(-1, inode, ctx);
 	} else {
 		int fd;
 
-		path = unix_build_extraction_path(dentry, ctx);
-	retry_create:
-		fd = open(path, O_EXCL | O_CREAT | O_WRONLY | O_NOFOLLOW, 0644);
+		fd = unix_create_regular_file(dentry, ctx);
 		if (fd < 0) {
-			if (errno == EEXIST && !unlink(path))
-				goto retry_create;
-			ERROR_WITH_ERRNO("Can't create regular file \"%s\"", path);
+			ERROR_WITH_ERRNO("Can't create regular file \"%s\"",
+					 unix_build_extraction_path(dentry, ctx));
 			return WIMLIB_ERR_OPEN;
 		}
 		/* On empty files, we can set timestamps immediately because we
 		 * don't need to write any data to them.  */
-		ret = unix_set_metadata(fd, inode, path, ctx);
+		ret = unix_set_metadata(fd, inode, ctx);
 		if (close(fd) && !ret) {
-			ERROR_WITH_ERRNO("Error closing \"%s\"", path);
+			ERROR_WITH_ERRNO("Error closing \"%s\"",
+					 unix_build_extraction_path(dentry, ctx));
 			ret = WIMLIB_ERR_WRITE;
 		}
 	}
 	if (ret)
 		return ret;
 
-	ret = unix_create_hardlinks(inode, dentry, path, ctx);
-	if (ret)
-		return ret;
-
-	return report_file_created(&ctx->common);
+	return unix_create_hardlinks(inode, dentry, ctx);
 }
 
-static int
-unix_create_dirs_and_empty_files(const struct list_head *dentry_list,
-				 struct unix_apply_ctx *ctx)
+/* Returns the number of components in the path to the specified @dentry when
+ * extracted, not counting the path to the target directory itself.  */
+static unsigned
+unix_dentry_depth(const struct wim_dentry *dentry)
 {
-	const struct wim_dentry *dentry;
-	int ret;
+	unsigned depth = 0;
+	const struct wim_dentry *d;
 
-	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
-		ret = unix_create_if_directory(dentry, ctx);
-		if (ret)
-			return ret;
-	}
-	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
-		ret = unix_extract_if_empty_file(dentry, ctx);
-		if (ret)
-			return ret;
-	}
-	return 0;
+	d = dentry;
+	do {
+		depth++;
+		d = d->d_parent;
+	} while (!dentry_is_root(d) && will_extract_dentry(d));
+
+	return depth;
 }
 
-static void
-unix_count_dentries(const struct list_head *dentry_list,
-		    u64 *dir_count_ret, u64 *empty_file_count_ret)
+/*
+ * Find the directories and the empty files in @dentry_list.  The directories
+ * are sorted by depth, keeping the order of the list within each depth, so that
+ * all directories at the same depth can be created at the same time once the
+ * directories above them exist.
+ */
+static int
+unix_collect_dirs_and_empty_files(const struct list_head *dentry_list,
+				  struct unix_apply_ctx *ctx)
 {
 	const struct wim_dentry *dentry;
-	u64 dir_count = 0;
-	u64 empty_file_count = 0;
+	const struct wim_dentry **unsorted_dirs = NULL;
+	unsigned *depths = NULL;
+	size_t num_dentries = 0;
+	unsigned max_depth = 0;
+	int ret = WIMLIB_ERR_NOMEM;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
+		num_dentries++;
+
+	unsorted_dirs = MALLOC(num_dentries * sizeof(unsorted_dirs[0]));
+	depths = MALLOC(num_dentries * sizeof(depths[0]));
+	ctx->dirs = MALLOC(num_dentries * sizeof(ctx->dirs[0]));
+	ctx->empty_files = MALLOC(num_dentries * sizeof(ctx->empty_files[0]));
+	if (!unsorted_dirs || !depths || !ctx->dirs || !ctx->empty_files)
+		goto out;
 
 	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		if (should_extract_as_directory(dentry->d_inode)) {
+			unsigned depth = unix_dentry_depth(dentry);
 
-		const struct wim_inode *inode = dentry->d_inode;
-
-		if (should_extract_as_directory(inode))
-			dir_count++;
-		else if ((dentry == inode_first_extraction_dentry(inode)) &&
-			 !inode_is_symlink(inode) &&
-			 !inode_get_blob_for_unnamed_data_stream_resolved(inode))
-			empty_file_count++;
+			max_depth = max(max_depth, depth);
+			depths[ctx->num_dirs] = depth;
+			unsorted_dirs[ctx->num_dirs++] = dentry;
+		} else if (is_empty_file_to_extract(dentry)) {
+			ctx->empty_files[ctx->num_empty_files++] = dentry;
+		}
 	}
 
-	*dir_count_ret = dir_count;
-	*empty_file_count_ret = empty_file_count;
+	/* Counting sort.  Afterwards, dir_level_ends[depth] is the index just
+	 * past the last directory at each depth.  */
+	ctx->num_dir_levels = max_depth + 1;
+	ctx->dir_level_ends = CALLOC(ctx->num_dir_levels,
+				     sizeof(ctx->dir_level_ends[0]));
+	if (!ctx->dir_level_ends)
+		goto out;
+	for (size_t i = 0; i < ctx->num_dirs; i++)
+		ctx->dir_level_ends[depths[i]]++;
+	for (size_t depth = 0, start = 0; depth < ctx->num_dir_levels; depth++) {
+		size_t count = ctx->dir_level_ends[depth];
+
+		ctx->dir_level_ends[depth] = start;
+		start += count;
+	}
+	for (size_t i = 0; i < ctx->num_dirs; i++)
+		ctx->dirs[ctx->dir_level_ends[depths[i]]++] = unsorted_dirs[i];
+	ret = 0;
+out:
+	FREE(depths);
+	FREE(unsorted_dirs);
+	return ret;
 }
 
 static int
-unix_create_symlink(const struct wim_inode *inode, const char *path,
-		    size_t rpdatalen, struct unix_apply_ctx *ctx)
+unix_create_symlink(const struct wim_inode *inode, size_t rpdatalen,
+		    struct unix_apply_ctx *ctx)
 {
+	const char *name;
+	int dirfd;
 	char target[REPARSE_POINT_MAX_SIZE];
 	struct blob_descriptor blob_override;
+	const char *altroot = ctx->target_abspath;
+	size_t altroot_nchars = ctx->target_abspath_nchars;
 	int ret;
 
 	blob_set_is_located_in_attached_buffer(&blob_override,
 					       ctx->reparse_data, rpdatalen);
 
+	/* When extracting all images, fix up absolute targets to point into
+	 * the directory of the image containing the link.  */
+	if (altroot && ctx->common.all_images) {
+		const struct wim_dentry *d = inode_first_extraction_dentry(inode);
+		char *buf;
+
+		while (!dentry_is_root(d->d_parent) &&
+		       will_extract_dentry(d->d_parent))
+			d = d->d_parent;
+		altroot_nchars += 1 + d->d_extraction_name_nchars;
+		buf = alloca(altroot_nchars + 1);
+		sprintf(buf, "%s/%.*s", ctx->target_abspath,
+			(int)d->d_extraction_name_nchars,
+			(const char *)d->d_extraction_name);
+		altroot = buf;
+	}
+
 	ret = wim_inode_readlink(inode, target, sizeof(target) - 1,
-				 &blob_override,
-				 ctx->target_abspath,
-				 ctx->target_abspath_nchars);
+				 &blob_override, altroot, altroot_nchars);
 	if (unlikely(ret < 0)) {
 		errno = -ret;
 		return WIMLIB_ERR_READLINK;
 	}
 	target[ret] = '\0';
 
+	name = unix_dentry_at(inode_first_extraction_dentry(inode), ctx, &dirfd);
 retry_symlink:
-	if (symlink(target, path)) {
-		if (errno == EEXIST && !unlink(path))
+	if (symlinkat(target, dirfd, name)) {
+		if (errno == EEXIST && !unlinkat(dirfd, name, 0))
 			goto retry_symlink;
 		return WIMLIB_ERR_LINK;
 	}
@@ -673,6 +1013,709 @@ unix_cleanup_open_fds(struct unix_apply_ctx *ctx, unsigned offset)
 		filedes_close(&ctx->open_fds[i]);
 	ctx->num_open_fds = 0;
 	ctx->any_sparse_files = false;
+	ctx->can_copy_blob = false;
+	ctx->blob_copied = false;
+	ctx->clone_targets = false;
+}
+
+#ifdef WITH_IO_URING
+static void
+unix_close_done(void *_ctx, u64 i, int res)
+{
+	struct unix_apply_ctx *ctx = _ctx;
+	struct pending_close *pc = &ctx->pending_closes[i];
+
+	if (res < 0 && !ctx->close_error) {
+		ctx->close_error = -res;
+		ctx->close_error_inode = pc->inode;
+	}
+	pc->fd = -1;
+}
+#endif
+
+/* Finish the closes pending on the close ring.  */
+static int
+unix_flush_closes(struct unix_apply_ctx *ctx)
+{
+	if (!ctx->num_pending_closes)
+		return 0;
+#ifdef WITH_IO_URING
+	io_ring_run(ctx->close_ring, unix_close_done, ctx);
+#endif
+	/* Close any files the ring didn't take ourselves.  */
+	for (unsigned i = 0; i < ctx->num_pending_closes; i++) {
+		struct pending_close *pc = &ctx->pending_closes[i];
+
+		if (pc->fd >= 0 && close(pc->fd) && !ctx->close_error) {
+			ctx->close_error = errno;
+			ctx->close_error_inode = pc->inode;
+		}
+	}
+	ctx->num_pending_closes = 0;
+
+	if (ctx->close_error) {
+		errno = ctx->close_error;
+		ERROR_WITH_ERRNO("Error closing \"%s\"",
+				 unix_build_inode_extraction_path(
+					ctx->close_error_inode, ctx));
+		ctx->close_error = 0;
+		return WIMLIB_ERR_WRITE;
+	}
+	return 0;
+}
+
+/*
+ * Close the file @fd for @inode, which has been completely extracted.  On a
+ * local filesystem, close() is one of the main system calls made for each file,
+ * so where possible the closes are queued up and then done in a batch with one
+ * system call.  An error from a queued close is reported when the batch is
+ * flushed, so it may be reported for a later file than the one it occurred for.
+ */
+static int
+unix_close_file(struct filedes *fd, const struct wim_inode *inode,
+		struct unix_apply_ctx *ctx)
+{
+#ifdef WITH_IO_URING
+	if (ctx->close_ring) {
+		int ret = 0;
+		struct pending_close *pc;
+
+		if (ctx->num_pending_closes == CLOSE_BATCH_SIZE)
+			ret = unix_flush_closes(ctx);
+
+		pc = &ctx->pending_closes[ctx->num_pending_closes];
+		pc->fd = fd->fd;
+		pc->inode = inode;
+		io_ring_prep_close(ctx->close_ring, fd->fd,
+				   ctx->num_pending_closes++);
+		return ret;
+	}
+#endif
+	if (filedes_close(fd)) {
+		ERROR_WITH_ERRNO("Error closing \"%s\"",
+				 unix_build_inode_extraction_path(inode, ctx));
+		return WIMLIB_ERR_WRITE;
+	}
+	return 0;
+}
+
+/*
+ * Can the blob's data be copied directly from the file containing it to its
+ * targets?  This requires that the blob be stored uncompressed in a WIM file
+ * which isn't being read from a pipe or through an I/O provider, or be in a
+ * file on disk such as a file in the blob cache, and that it be extracted only
+ * to regular files which aren't sparse, since copying would fill in their
+ * holes.
+ */
+static bool
+unix_can_copy_blob(const struct blob_descriptor *blob,
+		   const struct unix_apply_ctx *ctx)
+{
+	const struct blob_extraction_target *targets = blob_extraction_targets(blob);
+	const struct wim_resource_descriptor *rdesc;
+
+	if (ctx->clone_unsupported && ctx->copy_file_range_unsupported)
+		return false;
+	if (blob->blob_location == BLOB_IN_WIM) {
+		rdesc = blob->rdesc;
+		if ((rdesc->flags & (WIM_RESHDR_FLAG_COMPRESSED |
+				     WIM_RESHDR_FLAG_SOLID)) ||
+		    rdesc->is_pipable || rdesc->wim->in_fd.io ||
+		    rdesc->wim->in_fd.unbuffered ||
+		    !filedes_is_seekable(&rdesc->wim->in_fd))
+			return false;
+	} else if (blob->blob_location != BLOB_IN_FILE_ON_DISK) {
+		return false;
+	}
+	for (u32 i = 0; i < blob->out_refcnt; i++) {
+		if (targets[i].stream->stream_type != STREAM_TYPE_DATA ||
+		    (targets[i].inode->i_attributes & FILE_ATTRIBUTE_SPARSE_FILE))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Copy @size bytes at @in_offset in @in_fd to the beginning of @out_fd without
+ * passing them through user space.  If the offset is aligned to the block size
+ * of @in_fd, then the blocks are first cloned with FICLONERANGE, which on
+ * filesystems such as btrfs and XFS makes the files share them.  Whatever
+ * remains is copied with copy_file_range(), which such filesystems may also
+ * implement by cloning.  Returns false if the data couldn't be copied.
+ */
+static bool
+unix_copy_file_data(int in_fd, u64 in_offset, int out_fd, u64 size,
+		    struct unix_apply_ctx *ctx)
+{
+	u64 done = 0;
+
+#ifdef FICLONERANGE
+	struct stat stbuf;
+
+	if (!ctx->clone_unsupported && !fstat(in_fd, &stbuf) &&
+	    stbuf.st_blksize > 0 && in_offset % stbuf.st_blksize == 0 &&
+	    size >= stbuf.st_blksize)
+	{
+		struct file_clone_range range = {
+			.src_fd = in_fd,
+			.src_offset = in_offset,
+			.src_length = size - (size % stbuf.st_blksize),
+			.dest_offset = 0,
+		};
+
+		if (!ioctl(out_fd, FICLONERANGE, &range))
+			done = range.src_length;
+		else if (errno != EINVAL)
+			ctx->clone_unsupported = true;
+	}
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (done < size && !ctx->copy_file_range_unsupported) {
+		off_t in_pos = in_offset + done;
+		off_t out_pos = done;
+		ssize_t ret;
+
+		ret = copy_file_range(in_fd, &in_pos, out_fd, &out_pos,
+				      min(size - done, (u64)1 << 30), 0);
+		if (ret <= 0) {
+			if (ret < 0 && (errno == ENOSYS || errno == EXDEV ||
+					errno == EOPNOTSUPP || errno == EINVAL))
+				ctx->copy_file_range_unsupported = true;
+			break;
+		}
+		done += ret;
+	}
+#endif
+	return done == size;
+}
+
+/* Try to copy the blob's data directly from the file containing it to each
+ * open file.  Returns true if it was copied to all of them.  */
+static bool
+unix_copy_blob(const struct blob_descriptor *blob, struct unix_apply_ctx *ctx)
+{
+	int in_fd;
+	u64 in_offset;
+	bool copied = true;
+
+	if (blob->blob_location == BLOB_IN_WIM) {
+		in_fd = blob->rdesc->wim->in_fd.fd;
+		in_offset = blob->rdesc->offset_in_wim + blob->offset_in_res;
+	} else {
+		in_fd = open(blob->file_on_disk, O_RDONLY);
+		if (in_fd < 0)
+			return false;
+		in_offset = blob->file_offset;
+	}
+
+	for (unsigned i = 0; i < ctx->num_open_fds && copied; i++) {
+		copied = unix_copy_file_data(in_fd, in_offset,
+					     ctx->open_fds[i].fd, blob->size,
+					     ctx);
+	}
+	if (blob->blob_location != BLOB_IN_WIM)
+		close(in_fd);
+	return copied;
+}
+
+/*
+ * Make the file open as @out_fd, which is empty, a copy of the @size bytes of
+ * the file open for reading as @in_fd.  The copy is made with FICLONE if the
+ * filesystem supports it, so that the files share their blocks, otherwise with
+ * copy_file_range(), and otherwise through a buffer.  If @sparse, then the
+ * zero regions aren't written, as unix_extract_chunk() does, since
+ * copy_file_range() would fill them in.
+ */
+static int
+unix_clone_file(int in_fd, struct filedes *out_fd, u64 size, bool sparse,
+		struct unix_apply_ctx *ctx)
+{
+	u8 buf[BUFFER_SIZE];
+	u64 done = 0;
+
+#ifdef FICLONE
+	if (!ctx->target_clone_unsupported) {
+		if (!ioctl(out_fd->fd, FICLONE, in_fd))
+			return 0;
+		if (errno == EOPNOTSUPP || errno == ENOTTY ||
+		    errno == EXDEV || errno == EINVAL)
+			ctx->target_clone_unsupported = true;
+	}
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (done < size && !sparse &&
+	       !ctx->target_copy_file_range_unsupported) {
+		off_t in_pos = done;
+		off_t out_pos = done;
+		ssize_t ret;
+
+		ret = copy_file_range(in_fd, &in_pos, out_fd->fd, &out_pos,
+				      min(size - done, (u64)1 << 30), 0);
+		if (ret <= 0) {
+			if (ret < 0 && (errno == ENOSYS || errno == EXDEV ||
+					errno == EOPNOTSUPP || errno == EINVAL))
+				ctx->target_copy_file_range_unsupported = true;
+			break;
+		}
+		done += ret;
+	}
+#endif
+
+	while (done < size) {
+		ssize_t ret = pread(in_fd, buf, min(size - done, sizeof(buf)),
+				    done);
+		size_t len;
+
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EIO;
+			return WIMLIB_ERR_READ;
+		}
+		for (size_t pos = 0; pos < ret; pos += len, done += len) {
+			if (!maybe_detect_sparse_region(&buf[pos], ret - pos,
+							&len, sparse) &&
+			    full_pwrite(out_fd, &buf[pos], len, done))
+				return WIMLIB_ERR_WRITE;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The blob's data has been written to the first open file only.  Make each of
+ * the other open files a clone of it.
+ */
+static int
+unix_clone_blob_targets(const struct blob_descriptor *blob,
+			struct unix_apply_ctx *ctx)
+{
+	const struct blob_extraction_target *targets = blob_extraction_targets(blob);
+	const struct wim_dentry *first_dentry = NULL;
+	const char *first_name;
+	int dirfd;
+	int in_fd;
+	int ret = 0;
+
+	for (u32 i = 0; i < blob->out_refcnt && !first_dentry; i++)
+		if (!inode_is_symlink(targets[i].inode))
+			first_dentry = inode_first_extraction_dentry(
+						targets[i].inode);
+
+	/* The holes at the end of a sparse file must be there to be cloned. */
+	if (ctx->is_sparse_file[0] && ftruncate(ctx->open_fds[0].fd, blob->size)) {
+		ERROR_WITH_ERRNO("Error extending \"%s\" to final size",
+				 unix_build_extraction_path(first_dentry, ctx));
+		return WIMLIB_ERR_WRITE;
+	}
+
+	first_name = unix_dentry_at(first_dentry, ctx, &dirfd);
+	in_fd = openat(dirfd, first_name, O_RDONLY | O_NOFOLLOW);
+	if (in_fd < 0) {
+		ERROR_WITH_ERRNO("Can't open \"%s\" for reading",
+				 unix_build_extraction_path(first_dentry, ctx));
+		return WIMLIB_ERR_OPEN;
+	}
+	for (unsigned i = 1; i < ctx->num_open_fds && !ret; i++) {
+		ret = unix_clone_file(in_fd, &ctx->open_fds[i], blob->size,
+				      ctx->is_sparse_file[i], ctx);
+		if (ret)
+			ERROR_WITH_ERRNO("Error copying data from \"%s\"",
+					 unix_build_extraction_path(first_dentry,
+								    ctx));
+	}
+	close(in_fd);
+	return ret;
+}
+
+/* Create the regular file @inode with all its aliases, write @size bytes of
+ * @data to it, set its metadata, and close it.  */
+static int
+unix_write_file(const struct wim_inode *inode, const u8 *data, u64 size,
+		struct unix_apply_ctx *ctx)
+{
+	const struct wim_dentry *first_dentry;
+	const u8 * const end = data + size;
+	bool sparse = (inode->i_attributes & FILE_ATTRIBUTE_SPARSE_FILE);
+	struct filedes fd;
+	const u8 *p;
+	u64 offset;
+	size_t len;
+	int raw_fd;
+	int ret;
+
+	first_dentry = inode_first_extraction_dentry(inode);
+	raw_fd = unix_create_regular_file(first_dentry, ctx);
+	if (raw_fd < 0) {
+		ERROR_WITH_ERRNO("Can't create regular file \"%s\"",
+				 unix_build_extraction_path(first_dentry, ctx));
+		return WIMLIB_ERR_OPEN;
+	}
+	filedes_init(&fd, raw_fd);
+
+	ret = unix_create_hardlinks(inode, first_dentry, ctx);
+	if (ret)
+		goto out_close;
+
+	/* For sparse files, only write nonzero regions.  */
+	for (p = data, offset = 0; p != end; p += len, offset += len) {
+		if (!maybe_detect_sparse_region(p, end - p, &len, sparse)) {
+			ret = full_pwrite(&fd, p, len, offset);
+			if (ret) {
+				ERROR_WITH_ERRNO("Error writing data to \"%s\"",
+						 unix_build_extraction_path(
+							first_dentry, ctx));
+				goto out_close;
+			}
+		}
+	}
+	if (sparse && ftruncate(fd.fd, size)) {
+		ERROR_WITH_ERRNO("Error extending \"%s\" to final size",
+				 unix_build_extraction_path(first_dentry, ctx));
+		ret = WIMLIB_ERR_WRITE;
+		goto out_close;
+	}
+
+	ret = unix_set_metadata(fd.fd, inode, ctx);
+	if (ret)
+		goto out_close;
+
+	if (filedes_close(&fd)) {
+		ERROR_WITH_ERRNO("Error closing \"%s\"",
+				 unix_build_inode_extraction_path(inode, ctx));
+		return WIMLIB_ERR_WRITE;
+	}
+	return 0;
+
+out_close:
+	filedes_close(&fd);
+	return ret;
+}
+
+/* Run a write job on the task pool, using the writer's context.  */
+static void
+unix_writer_process(void *item, void *writer_ctx)
+{
+	struct unix_write_job *job = item;
+
+	job->ret = 0;
+	for (u32 i = 0; i < job->num_inodes && !job->ret; i++)
+		job->ret = unix_write_file(job->inodes[i], job->data, job->size,
+					   writer_ctx);
+	ring_buffer_put(&job->ctx->finished_write_jobs, job);
+}
+
+static int
+unix_alloc_pathbufs(struct unix_apply_ctx *ctx)
+{
+	for (unsigned i = 0; i < NUM_PATHBUFS; i++) {
+		ctx->pathbufs[i] = MALLOC(ctx->path_max);
+		if (!ctx->pathbufs[i])
+			return WIMLIB_ERR_NOMEM;
+		/* Pre-fill the target in each path buffer.  We'll just append
+		 * the rest of the paths after this.  */
+		memcpy(ctx->pathbufs[i],
+		       ctx->common.target, ctx->common.target_nchars);
+	}
+	return 0;
+}
+
+static void
+unix_free_pathbufs(struct unix_apply_ctx *ctx)
+{
+	for (unsigned i = 0; i < NUM_PATHBUFS; i++)
+		FREE(ctx->pathbufs[i]);
+}
+
+static void
+unix_free_writers(struct unix_apply_ctx *ctx)
+{
+	for (unsigned i = 0; i < ctx->num_writers; i++) {
+		unix_close_dirs(ctx->writer_ctxs[i]);
+		unix_free_pathbufs(ctx->writer_ctxs[i]);
+		FREE(ctx->writer_ctxs[i]);
+	}
+	ctx->num_writers = 0;
+}
+
+/*
+ * Set up writers for the regular files, one per thread of the task pool up to
+ * MAX_WRITERS.  If this fails, the files are just written by the main thread.
+ */
+static void
+unix_start_writers(struct unix_apply_ctx *ctx)
+{
+	unsigned num_writers = min(task_pool_num_threads(), MAX_WRITERS);
+	unsigned num_jobs = num_writers * WRITE_JOBS_PER_WRITER;
+
+	for (unsigned i = 0; i < num_writers; i++) {
+		struct unix_apply_ctx *wctx = CALLOC(1, sizeof(*wctx));
+
+		if (!wctx) {
+			unix_free_writers(ctx);
+			return;
+		}
+		ctx->writer_ctxs[ctx->num_writers++] = wctx;
+		wctx->common = ctx->common;
+		wctx->target_fd = -1;
+		wctx->path_max = ctx->path_max;
+		if (unix_alloc_pathbufs(wctx)) {
+			unix_free_writers(ctx);
+			return;
+		}
+	}
+
+	/* Without the write jobs, the writers' contexts can still be used for
+	 * the files which don't have any data.  */
+	ctx->write_jobs = CALLOC(num_jobs, sizeof(ctx->write_jobs[0]));
+	if (!ctx->write_jobs)
+		return;
+	ctx->num_write_jobs = num_jobs;
+	INIT_LIST_HEAD(&ctx->free_write_jobs);
+	for (unsigned i = 0; i < num_jobs; i++) {
+		ctx->write_jobs[i].ctx = ctx;
+		list_add_tail(&ctx->write_jobs[i].free_list,
+			      &ctx->free_write_jobs);
+	}
+
+	/* Every job can be finished at the same time, so putting a job in the
+	 * queue of finished jobs never has to wait.  */
+	if (ring_buffer_init(&ctx->finished_write_jobs, num_jobs))
+		goto err;
+	if (worker_group_init(&ctx->writers, num_writers, num_jobs,
+			      unix_writer_process, (void *const *)ctx->writer_ctxs))
+	{
+		ring_buffer_destroy(&ctx->finished_write_jobs);
+		goto err;
+	}
+	return;
+
+err:
+	FREE(ctx->write_jobs);
+	ctx->write_jobs = NULL;
+	ctx->num_write_jobs = 0;
+}
+
+/* Take back a job which a writer has finished, waiting for one if @wait is
+ * true.  Returns false if no job was collected.  */
+static bool
+unix_collect_write_job(struct unix_apply_ctx *ctx, bool wait)
+{
+	struct unix_write_job *job;
+
+	if (wait)
+		job = ring_buffer_get(&ctx->finished_write_jobs);
+	else
+		job = ring_buffer_try_get(&ctx->finished_write_jobs);
+	if (!job)
+		return false;
+	ctx->num_submitted_write_jobs--;
+	if (job->ret && !ctx->write_error)
+		ctx->write_error = job->ret;
+	list_add(&job->free_list, &ctx->free_write_jobs);
+	return true;
+}
+
+/* Wait for all submitted write jobs to finish, then free the write jobs.
+ * Returns the first error reported by any write job.  */
+static int
+unix_finish_write_jobs(struct unix_apply_ctx *ctx)
+{
+	if (!ctx->num_write_jobs)
+		return ctx->write_error;
+
+	while (ctx->num_submitted_write_jobs)
+		unix_collect_write_job(ctx, true);
+
+	worker_group_destroy(&ctx->writers);
+	ring_buffer_destroy(&ctx->finished_write_jobs);
+	for (unsigned i = 0; i < ctx->num_write_jobs; i++)
+		FREE(ctx->write_jobs[i].data);
+	FREE(ctx->write_jobs);
+	ctx->write_jobs = NULL;
+	ctx->num_write_jobs = 0;
+	return ctx->write_error;
+}
+
+/* Minimum number of files for which it's worthwhile to use the task pool  */
+#define MIN_PARALLEL_FILES	16
+
+/* Files which can be processed in any order, and the next one to process  */
+struct unix_file_batch {
+	const struct wim_dentry * const *dentries;
+	size_t num_dentries;
+	int (*process)(const struct wim_dentry *dentry,
+		       struct unix_apply_ctx *ctx);
+	size_t next;
+	int ret;
+};
+
+struct unix_file_task {
+	struct pool_task base;
+	struct unix_file_batch *batch;
+	struct unix_apply_ctx *ctx;
+};
+
+static void
+unix_file_task_run(struct pool_task *_task)
+{
+	struct unix_file_task *task =
+		container_of(_task, struct unix_file_task, base);
+	struct unix_file_batch *batch = task->batch;
+	size_t i;
+	int ret;
+
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+	       batch->num_dentries &&
+	       !__atomic_load_n(&batch->ret, __ATOMIC_RELAXED))
+	{
+		ret = (*batch->process)(batch->dentries[i], task->ctx);
+		if (ret) {
+			int zero = 0;
+
+			__atomic_compare_exchange_n(&batch->ret, &zero, ret,
+						    false, __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*
+ * Call @process on each of the @num_dentries files in @dentries, none of which
+ * may depend on another, using the main thread together with the writers.  Each
+ * thread uses its own context, so the files are processed in no particular
+ * order.  Returns 0 or the first error that occurred, in which case some of the
+ * files may not have been processed.
+ */
+static int
+unix_process_files(const struct wim_dentry * const *dentries,
+		   size_t num_dentries,
+		   int (*process)(const struct wim_dentry *dentry,
+				  struct unix_apply_ctx *ctx),
+		   struct unix_apply_ctx *ctx)
+{
+	struct unix_file_batch batch = {
+		.dentries	= dentries,
+		.num_dentries	= num_dentries,
+		.process	= process,
+	};
+	struct unix_file_task tasks[1 + MAX_WRITERS];
+	struct pool_task *task_ptrs[1 + MAX_WRITERS];
+	unsigned num_tasks = 1;
+
+	if (num_dentries >= MIN_PARALLEL_FILES)
+		num_tasks += ctx->num_writers;
+
+	for (unsigned i = 0; i < num_tasks; i++) {
+		tasks[i].base.run = unix_file_task_run;
+		tasks[i].batch = &batch;
+		tasks[i].ctx = (i == 0) ? ctx : ctx->writer_ctxs[i - 1];
+		task_ptrs[i] = &tasks[i].base;
+	}
+	task_pool_run_batch(task_ptrs, num_tasks);
+	return batch.ret;
+}
+
+/*
+ * Create the directories and the empty files.  Directories are created one
+ * depth at a time, so that each is created after its parent but all the
+ * directories at the same depth can be created at the same time.  This matters
+ * on filesystems where each mkdir() or open() takes a round trip to a server.
+ */
+static int
+unix_create_dirs_and_empty_files(struct unix_apply_ctx *ctx)
+{
+	size_t start = 0;
+	int ret;
+
+	for (unsigned depth = 0; depth < ctx->num_dir_levels; depth++) {
+		size_t end = ctx->dir_level_ends[depth];
+
+		ret = unix_process_files(&ctx->dirs[start], end - start,
+					 unix_create_directory, ctx);
+		if (ret)
+			return ret;
+		for (; start < end; start++) {
+			ret = report_file_created(&ctx->common);
+			if (ret)
+				return ret;
+		}
+	}
+
+	ret = unix_process_files(ctx->empty_files, ctx->num_empty_files,
+				 unix_create_empty_file, ctx);
+	if (ret)
+		return ret;
+	for (size_t i = 0; i < ctx->num_empty_files; i++) {
+		ret = report_file_created(&ctx->common);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * If the blob is small and is only being extracted to regular files, then
+ * prepare a write job for it and return 0 with ctx->cur_write_job set.  This
+ * waits for a writer to finish a job if none is free.  Otherwise, or if a write
+ * job has failed, leave ctx->cur_write_job NULL.
+ */
+static int
+unix_begin_write_job(const struct blob_descriptor *blob,
+		     struct unix_apply_ctx *ctx)
+{
+	const struct blob_extraction_target *targets = blob_extraction_targets(blob);
+	struct unix_write_job *job;
+
+	if (!ctx->num_write_jobs || blob->size > WRITE_JOB_MAX_SIZE ||
+	    blob->out_refcnt > ARRAY_LEN(ctx->write_jobs[0].inodes))
+		return 0;
+	for (u32 i = 0; i < blob->out_refcnt; i++)
+		if (targets[i].stream->stream_type != STREAM_TYPE_DATA)
+			return 0;
+
+	/* Collect the jobs which have finished, so that errors are noticed
+	 * early, waiting for one if no job is free.  */
+	while (unix_collect_write_job(ctx, list_empty(&ctx->free_write_jobs)))
+		;
+	if (ctx->write_error)
+		return ctx->write_error;
+
+	job = list_first_entry(&ctx->free_write_jobs, struct unix_write_job,
+			       free_list);
+	if (blob->size > job->data_alloc) {
+		u8 *data = REALLOC(job->data, blob->size);
+
+		if (!data)
+			return 0;
+		job->data = data;
+		job->data_alloc = blob->size;
+	}
+	list_del(&job->free_list);
+	job->size = blob->size;
+	job->num_inodes = blob->out_refcnt;
+	for (u32 i = 0; i < blob->out_refcnt; i++)
+		job->inodes[i] = targets[i].inode;
+	ctx->cur_write_job = job;
+	return 0;
+}
+
+/* Submit the current write job to the writers, or discard it if reading its
+ * blob failed.  */
+static int
+unix_end_write_job(struct unix_apply_ctx *ctx, int status)
+{
+	struct unix_write_job *job = ctx->cur_write_job;
+
+	ctx->cur_write_job = NULL;
+	if (status) {
+		list_add(&job->free_list, &ctx->free_write_jobs);
+		return status;
+	}
+	ctx->num_submitted_write_jobs++;
+	worker_group_submit(&ctx->writers, job);
+	return 0;
 }
 
 static int
@@ -682,7 +1725,6 @@ unix_begin_extract_blob_instance(const struct blob_descriptor *blob,
 				 struct unix_apply_ctx *ctx)
 {
 	const struct wim_dentry *first_dentry;
-	const char *first_path;
 	int fd;
 
 	if (unlikely(strm->stream_type == STREAM_TYPE_REPARSE_POINT)) {
@@ -704,16 +1746,13 @@ unix_begin_extract_blob_instance(const struct blob_descriptor *blob,
 	/* Unnamed data stream of "regular" file  */
 
 	/* This should be ensured by extract_blob_list()  */
-	wimlib_assert(ctx->num_open_fds < MAX_OPEN_FILES);
+	wimlib_assert(ctx->num_open_fds < ctx->common.max_open_files);
 
 	first_dentry = inode_first_extraction_dentry(inode);
-	first_path = unix_build_extraction_path(first_dentry, ctx);
-retry_create:
-	fd = open(first_path, O_EXCL | O_CREAT | O_WRONLY | O_NOFOLLOW, 0644);
+	fd = unix_create_regular_file(first_dentry, ctx);
 	if (fd < 0) {
-		if (errno == EEXIST && !unlink(first_path))
-			goto retry_create;
-		ERROR_WITH_ERRNO("Can't create regular file \"%s\"", first_path);
+		ERROR_WITH_ERRNO("Can't create regular file \"%s\"",
+				 unix_build_extraction_path(first_dentry, ctx));
 		return WIMLIB_ERR_OPEN;
 	}
 	if (inode->i_attributes & FILE_ATTRIBUTE_SPARSE_FILE) {
@@ -722,11 +1761,16 @@ retry_create:
 	} else {
 		ctx->is_sparse_file[ctx->num_open_fds] = false;
 #ifdef HAVE_POSIX_FALLOCATE
-		posix_fallocate(fd, 0, blob->size);
+		/* Don't allocate blocks which cloning would replace.  */
+		if (!ctx->can_copy_blob &&
+		    !(ctx->clone_targets && ctx->num_open_fds > 0) &&
+		    !(ctx->common.extract_flags &
+		      WIMLIB_EXTRACT_FLAG_NO_PREALLOCATE))
+			posix_fallocate(fd, 0, blob->size);
 #endif
 	}
 	filedes_init(&ctx->open_fds[ctx->num_open_fds++], fd);
-	return unix_create_hardlinks(inode, first_dentry, first_path, ctx);
+	return unix_create_hardlinks(inode, first_dentry, ctx);
 }
 
 /* Called when starting to read a blob for extraction  */
@@ -735,18 +1779,46 @@ unix_begin_extract_blob(struct blob_descriptor *blob, void *_ctx)
 {
 	struct unix_apply_ctx *ctx = _ctx;
 	const struct blob_extraction_target *targets = blob_extraction_targets(blob);
+	int ret;
 
+	ret = unix_begin_write_job(blob, ctx);
+	if (ret || ctx->cur_write_job)
+		return ret;
+
+	ctx->can_copy_blob = unix_can_copy_blob(blob, ctx);
+	ctx->clone_targets = !ctx->can_copy_blob && blob->out_refcnt > 1 &&
+			     (ctx->common.extract_flags &
+			      WIMLIB_EXTRACT_FLAG_CLONE_DUPLICATES);
 	for (u32 i = 0; i < blob->out_refcnt; i++) {
-		int ret = unix_begin_extract_blob_instance(blob,
-							   targets[i].inode,
-							   targets[i].stream,
-							   ctx);
+		ret = unix_begin_extract_blob_instance(blob, targets[i].inode,
+						       targets[i].stream, ctx);
 		if (ret) {
 			ctx->reparse_ptr = NULL;
 			unix_cleanup_open_fds(ctx, 0);
 			return ret;
 		}
 	}
+	/* Symbolic links don't get a file descriptor, so there may be no
+	 * files to clone the data into after all.  */
+	if (ctx->num_open_fds < 2)
+		ctx->clone_targets = false;
+	if (ctx->can_copy_blob)
+		ctx->blob_copied = unix_copy_blob(blob, ctx);
+	return 0;
+}
+
+/* Called when the reader could place the next chunk of a blob straight into a
+ * buffer of ours.  Only the data of a write job has one.  */
+static int
+unix_get_chunk_dest(const struct blob_descriptor *blob, u64 offset,
+		    void **buf_ret, size_t *size_ret, void *_ctx)
+{
+	struct unix_apply_ctx *ctx = _ctx;
+
+	if (ctx->cur_write_job) {
+		*buf_ret = &ctx->cur_write_job->data[offset];
+		*size_ret = min(*size_ret, ctx->cur_write_job->size - offset);
+	}
 	return 0;
 }
 
@@ -763,6 +1835,18 @@ unix_extract_chunk(const struct blob_descriptor *blob, u64 offset,
 	unsigned i;
 	int ret;
 
+	if (ctx->cur_write_job) {
+		void *dest = &ctx->cur_write_job->data[offset];
+
+		if (chunk != dest)
+			memcpy(dest, chunk, size);
+		return 0;
+	}
+
+	/* If the data was already copied, it's only being read to verify it. */
+	if (ctx->blob_copied)
+		return 0;
+
 	/*
 	 * For sparse files, only write nonzero regions.  This lets the
 	 * filesystem use holes to represent zero regions.
@@ -770,7 +1854,8 @@ unix_extract_chunk(const struct blob_descriptor *blob, u64 offset,
 	for (p = chunk; p != end; p += len, offset += len) {
 		zeroes = maybe_detect_sparse_region(p, end - p, &len,
 						    ctx->any_sparse_files);
-		for (i = 0; i < ctx->num_open_fds; i++) {
+		for (i = 0; i < (ctx->clone_targets ? 1 : ctx->num_open_fds);
+		     i++) {
 			if (!zeroes || !ctx->is_sparse_file[i]) {
 				ret = full_pwrite(&ctx->open_fds[i],
 						  p, len, offset);
@@ -789,6 +1874,41 @@ err:
 	return ret;
 }
 
+/* Called when several consecutive chunks of a blob have been read for
+ * extraction.  In the common case, they are written to each of the open files
+ * with vectored writes, rather than with one write per chunk.  */
+static int
+unix_extract_chunks(const struct blob_descriptor *blob, u64 offset,
+		    const struct chunk_span *spans, size_t num_spans,
+		    void *_ctx)
+{
+	struct unix_apply_ctx *ctx = _ctx;
+	unsigned i;
+	int ret;
+
+	if (ctx->cur_write_job || ctx->blob_copied || ctx->any_sparse_files ||
+	    ctx->reparse_ptr)
+	{
+		for (size_t j = 0; j < num_spans; j++) {
+			ret = unix_extract_chunk(blob, offset, spans[j].data,
+						 spans[j].size, ctx);
+			if (ret)
+				return ret;
+			offset += spans[j].size;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < (ctx->clone_targets ? 1 : ctx->num_open_fds); i++) {
+		ret = full_pwritev(&ctx->open_fds[i], spans, num_spans, offset);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error writing data to filesystem");
+			return ret;
+		}
+	}
+	return 0;
+}
+
 /* Called when a blob has been fully read for extraction  */
 static int
 unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
@@ -798,8 +1918,14 @@ unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 	unsigned j;
 	const struct blob_extraction_target *targets = blob_extraction_targets(blob);
 
+	if (ctx->cur_write_job)
+		return unix_end_write_job(ctx, status);
+
 	ctx->reparse_ptr = NULL;
 
+	if (!status && ctx->clone_targets && ctx->num_open_fds > 1)
+		status = unix_clone_blob_targets(blob, ctx);
+
 	if (status) {
 		unix_cleanup_open_fds(ctx, 0);
 		return status;
@@ -813,16 +1939,15 @@ unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 		if (inode_is_symlink(inode)) {
 			/* We finally have the symlink data, so we can create
 			 * the symlink.  */
-			const char *path;
-
-			path = unix_build_inode_extraction_path(inode, ctx);
-			ret = unix_create_symlink(inode, path, blob->size, ctx);
+			ret = unix_create_symlink(inode, blob->size, ctx);
 			if (ret) {
 				ERROR_WITH_ERRNO("Can't create symbolic link "
-						 "\"%s\"", path);
+						 "\"%s\"",
+						 unix_build_inode_extraction_path(
+							inode, ctx));
 				break;
 			}
-			ret = unix_set_metadata(-1, inode, path, ctx);
+			ret = unix_set_metadata(-1, inode, ctx);
 			if (ret)
 				break;
 		} else {
@@ -837,17 +1962,14 @@ unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 			}
 
 			/* Set metadata on regular file just before closing.  */
-			ret = unix_set_metadata(fd->fd, inode, NULL, ctx);
+			ret = unix_set_metadata(fd->fd, inode, ctx);
 			if (ret)
 				break;
 
-			if (filedes_close(fd)) {
-				ERROR_WITH_ERRNO("Error closing \"%s\"",
-						 unix_build_inode_extraction_path(inode, ctx));
-				ret = WIMLIB_ERR_WRITE;
-				break;
-			}
 			j++;
+			ret = unix_close_file(fd, inode, ctx);
+			if (ret)
+				break;
 		}
 	}
 	unix_cleanup_open_fds(ctx, j);
@@ -855,16 +1977,28 @@ unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 }
 
 static int
-unix_set_dir_metadata(struct list_head *dentry_list, struct unix_apply_ctx *ctx)
+unix_set_dir_metadata_one(const struct wim_dentry *dentry,
+			  struct unix_apply_ctx *ctx)
 {
-	const struct wim_dentry *dentry;
+	return unix_set_metadata(-1, dentry->d_inode, ctx);
+}
+
+/* Set the metadata of the directories, one depth at a time starting with the
+ * deepest, so that each directory is done before its parent.  */
+static int
+unix_set_dir_metadata(struct unix_apply_ctx *ctx)
+{
+	size_t end = ctx->num_dirs;
 	int ret;
 
-	list_for_each_entry_reverse(dentry, dentry_list, d_extraction_list_node) {
-		if (should_extract_as_directory(dentry->d_inode)) {
-			ret = unix_set_metadata(-1, dentry->d_inode, NULL, ctx);
-			if (ret)
-				return ret;
+	for (unsigned depth = ctx->num_dir_levels; depth-- > 0; ) {
+		size_t start = depth ? ctx->dir_level_ends[depth - 1] : 0;
+
+		ret = unix_process_files(&ctx->dirs[start], end - start,
+					 unix_set_dir_metadata_one, ctx);
+		if (ret)
+			return ret;
+		for (; end > start; end--) {
 			ret = report_file_metadata_applied(&ctx->common);
 			if (ret)
 				return ret;
@@ -873,43 +2007,75 @@ unix_set_dir_metadata(struct list_head *dentry_list, struct unix_apply_ctx *ctx)
 	return 0;
 }
 
+/*
+ * Allocate the arrays for the files open for extraction.  Usually a blob's
+ * targets can all be open at once only if it has at most MAX_OPEN_FILES of
+ * them; a blob with more is extracted through a temporary file, which doubles
+ * the I/O for it.  But if the limit on file descriptors allows it, let up to as
+ * many files be open at once as the blob with the most targets needs, leaving
+ * half of the file descriptors for everything else.  This helps with images in
+ * which the same file has been duplicated thousands of times.
+ */
+static int
+unix_alloc_open_fds(struct unix_apply_ctx *ctx)
+{
+	const struct blob_descriptor *blob;
+	u64 max_refcnt = 0;
+	u64 max_open_files = MAX_OPEN_FILES;
+	struct rlimit rlim;
+
+	list_for_each_entry(blob, &ctx->common.blob_list, extraction_list)
+		max_refcnt = max(max_refcnt, (u64)blob->out_refcnt);
+
+	if (max_refcnt > MAX_OPEN_FILES && !getrlimit(RLIMIT_NOFILE, &rlim)) {
+		u64 avail = max_refcnt;
+
+		if (rlim.rlim_cur != RLIM_INFINITY)
+			avail = min(avail, (u64)rlim.rlim_cur / 2);
+		max_open_files = max(max_open_files, avail);
+	}
+
+	ctx->open_fds = MALLOC(max_open_files * sizeof(ctx->open_fds[0]));
+	ctx->is_sparse_file = MALLOC(max_open_files *
+				     sizeof(ctx->is_sparse_file[0]));
+	if (!ctx->open_fds || !ctx->is_sparse_file)
+		return WIMLIB_ERR_NOMEM;
+	ctx->common.max_open_files = max_open_files;
+	return 0;
+}
+
 static int
 unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 {
 	int ret;
 	struct unix_apply_ctx *ctx = (struct unix_apply_ctx *)_ctx;
-	size_t path_max;
-	u64 dir_count;
-	u64 empty_file_count;
+
+	ctx->target_fd = -1;
 
 	/* Compute the maximum path length that will be needed, then allocate
 	 * some path buffers.  */
-	path_max = unix_compute_path_max(dentry_list, ctx);
-
-	for (unsigned i = 0; i < NUM_PATHBUFS; i++) {
-		ctx->pathbufs[i] = MALLOC(path_max);
-		if (!ctx->pathbufs[i]) {
-			ret = WIMLIB_ERR_NOMEM;
-			goto out;
-		}
-		/* Pre-fill the target in each path buffer.  We'll just append
-		 * the rest of the paths after this.  */
-		memcpy(ctx->pathbufs[i],
-		       ctx->common.target, ctx->common.target_nchars);
-	}
+	ctx->path_max = unix_compute_path_max(dentry_list, ctx);
+	ret = unix_alloc_pathbufs(ctx);
+	if (ret)
+		goto out;
 
 	/* Extract directories and empty regular files.  Directories are needed
 	 * because we can't extract any other files until their directories
 	 * exist.  Empty files are needed because they don't have
 	 * representatives in the blob list.  */
 
-	unix_count_dentries(dentry_list, &dir_count, &empty_file_count);
+	ret = unix_collect_dirs_and_empty_files(dentry_list, ctx);
+	if (ret)
+		goto out;
 
-	ret = start_file_structure_phase(&ctx->common, dir_count + empty_file_count);
+	unix_start_writers(ctx);
+
+	ret = start_file_structure_phase(&ctx->common,
+					 ctx->num_dirs + ctx->num_empty_files);
 	if (ret)
 		goto out;
 
-	ret = unix_create_dirs_and_empty_files(dentry_list, ctx);
+	ret = unix_create_dirs_and_empty_files(ctx);
 	if (ret)
 		goto out;
 
@@ -921,7 +2087,7 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 	if ((ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_RPFIX) &&
 	    ctx->common.required_features.symlink_reparse_points)
 	{
-		ctx->target_abspath = realpath(ctx->common.target, NULL);
+		ctx->target_abspath = wimlib_realpath(ctx->common.target);
 		if (!ctx->target_abspath) {
 			ret = WIMLIB_ERR_NOMEM;
 			goto out;
@@ -931,24 +2097,43 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 
 	/* Extract nonempty regular files and symbolic links.  */
 
+	ret = unix_alloc_open_fds(ctx);
+	if (ret)
+		goto out;
+
 	struct read_blob_callbacks cbs = {
 		.begin_blob	= unix_begin_extract_blob,
 		.continue_blob	= unix_extract_chunk,
+		.continue_blob_vec = unix_extract_chunks,
 		.end_blob	= unix_end_extract_blob,
+		.get_chunk_dest	= unix_get_chunk_dest,
 		.ctx		= ctx,
 	};
+	ctx->close_ring = io_ring_create(CLOSE_BATCH_SIZE, IO_RING_OP_CLOSE);
+	if (ctx->close_ring) {
+		ctx->pending_closes = MALLOC(CLOSE_BATCH_SIZE *
+					     sizeof(ctx->pending_closes[0]));
+		if (!ctx->pending_closes) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto out;
+		}
+	}
+
 	ret = extract_blob_list(&ctx->common, &cbs);
+	if (!ret)
+		ret = unix_flush_closes(ctx);
+	if (!ret)
+		ret = unix_finish_write_jobs(ctx);
 	if (ret)
 		goto out;
 
-
 	/* Set directory metadata.  We do this last so that we get the right
 	 * directory timestamps.  */
-	ret = start_file_metadata_phase(&ctx->common, dir_count);
+	ret = start_file_metadata_phase(&ctx->common, ctx->num_dirs);
 	if (ret)
 		goto out;
 
-	ret = unix_set_dir_metadata(dentry_list, ctx);
+	ret = unix_set_dir_metadata(ctx);
 	if (ret)
 		goto out;
 
@@ -956,13 +2141,27 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 	if (ret)
 		goto out;
 
+	for (unsigned i = 0; i < ctx->num_writers; i++) {
+		ctx->num_special_files_ignored +=
+			ctx->writer_ctxs[i]->num_special_files_ignored;
+	}
 	if (ctx->num_special_files_ignored) {
 		WARNING("%lu special files were not extracted due to EPERM!",
 			ctx->num_special_files_ignored);
 	}
 out:
-	for (unsigned i = 0; i < NUM_PATHBUFS; i++)
-		FREE(ctx->pathbufs[i]);
+	unix_flush_closes(ctx);
+	io_ring_destroy(ctx->close_ring);
+	FREE(ctx->pending_closes);
+	unix_finish_write_jobs(ctx);
+	unix_free_writers(ctx);
+	FREE(ctx->dirs);
+	FREE(ctx->dir_level_ends);
+	FREE(ctx->empty_files);
+	FREE(ctx->open_fds);
+	FREE(ctx->is_sparse_file);
+	unix_close_dirs(ctx);
+	unix_free_pathbufs(ctx);
 	FREE(ctx->target_abspath);
 	return ret;
 }
@@ -972,4 +2171,5 @@ const struct apply_operations unix_apply_ops = {
 	.get_supported_features = unix_get_supported_features,
 	.extract                = unix_extract,
 	.context_size           = sizeof(struct unix_apply_ctx),
+	.supports_all_images	= true,
 };
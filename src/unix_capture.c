@@ -28,7 +28,16 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#ifdef HAVE_LINUX_FIEMAP_H
+#  include <linux/fiemap.h>
+#  include <linux/fs.h>
+#  include <sys/ioctl.h>
+#endif
+#include <stdlib.h>
 #include <sys/stat.h>
+#ifdef HAVE_STATX
+#  include <sys/sysmacros.h>
+#endif
 #include <sys/types.h>
 #ifdef HAVE_SYS_XATTR_H
 #  include <sys/xattr.h>
@@ -38,8 +47,11 @@
 #include "wimlib/blob_table.h"
 #include "wimlib/dentry.h"
 #include "wimlib/error.h"
+#include "wimlib/hash_cache.h"
+#include "wimlib/io_uring.h"
 #include "wimlib/reparse.h"
 #include "wimlib/scan.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/timestamp.h"
 #include "wimlib/unix_data.h"
 #include "wimlib/xattr.h"
@@ -278,9 +290,52 @@ out:
 }
 #endif /* HAVE_LINUX_XATTR_SUPPORT */
 
+#ifdef HAVE_LINUX_FIEMAP_H
+/*
+ * Return where the data of the regular file @relpath starts on disk, in bytes,
+ * or 0 if this can't be determined.  Only the file's first extent matters,
+ * since the purpose is just to read files in roughly the order in which they
+ * are stored.  FIEMAP is tried first, then FIBMAP, which works on more
+ * filesystems but usually requires CAP_SYS_RAWIO.
+ */
+static noinline_for_stack u64
+unix_get_disk_offset(int dirfd, const char *relpath, int stat_flags,
+		     const struct stat *stbuf, struct scan_params *params)
+{
+	union {
+		struct fiemap fm;
+		u8 bytes[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} buf;
+	int open_flags = O_RDONLY | O_NONBLOCK;
+	u64 offset = 0;
+	int block = 0;
+	int fd;
+
+	if (stat_flags & AT_SYMLINK_NOFOLLOW)
+		open_flags |= O_NOFOLLOW;
+	fd = my_openat(params->cur_path, dirfd, relpath, open_flags);
+	if (fd < 0)
+		return 0;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.fm.fm_length = FIEMAP_MAX_OFFSET;
+	buf.fm.fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, &buf.fm) == 0) {
+		/* Delayed-allocation extents have no location yet.  */
+		if (buf.fm.fm_mapped_extents != 0 &&
+		    !(buf.fm.fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN))
+			offset = buf.fm.fm_extents[0].fe_physical;
+	} else if (ioctl(fd, FIBMAP, &block) == 0 && block > 0) {
+		offset = (u64)block * stbuf->st_blksize;
+	}
+	close(fd);
+	return offset;
+}
+#endif /* HAVE_LINUX_FIEMAP_H */
+
 static int
 unix_scan_regular_file(const char *path, u64 blocks, u64 size,
-		       struct wim_inode *inode,
+		       u64 disk_offset, struct wim_inode *inode,
 		       struct list_head *unhashed_blobs)
 {
 	struct blob_descriptor *blob = NULL;
@@ -305,6 +360,7 @@ unix_scan_regular_file(const char *path, u64 blocks, u64 size,
 		blob->blob_location = BLOB_IN_FILE_ON_DISK;
 		blob->size = size;
 		blob->file_inode = inode;
+		blob->file_disk_offset = disk_offset;
 	}
 
 	strm = inode_add_stream(inode, STREAM_TYPE_DATA, NO_STREAM_NAME, blob);
@@ -319,10 +375,289 @@ err_nomem:
 	return WIMLIB_ERR_NOMEM;
 }
 
+/* Look up the regular file @inode, which was scanned from the file described by
+ * @stbuf, in the hash cache.  */
+static int
+unix_apply_hash_cache(struct scan_params *params, struct wim_inode *inode,
+		      const struct stat *stbuf)
+{
+	struct hash_cache_key key;
+
+	key.dev = stbuf->st_dev;
+	key.ino = stbuf->st_ino;
+	key.size = stbuf->st_size;
+#ifdef HAVE_STAT_NANOSECOND_PRECISION
+	key.last_write_time = timespec_to_wim_timestamp(&stbuf->st_mtim);
+	key.change_time = timespec_to_wim_timestamp(&stbuf->st_ctim);
+#else
+	key.last_write_time = time_t_to_wim_timestamp(stbuf->st_mtime);
+	key.change_time = time_t_to_wim_timestamp(stbuf->st_ctime);
+#endif
+	return apply_capture_hash_cache(params, inode, &key);
+}
+
+/* The result of stat()ing a directory entry ahead of time  */
+struct prestat {
+	struct stat stbuf;
+	int err;	/* 0 if 'stbuf' is valid, otherwise the errno value */
+};
+
 static int
 unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 				 int dirfd, const char *relpath,
-				 struct scan_params *params);
+				 struct scan_params *params,
+				 const struct prestat *prestat);
+
+static int
+cmp_names(const void *p1, const void *p2)
+{
+	return strcmp(*(const char * const *)p1, *(const char * const *)p2);
+}
+
+/*
+ * Read the names of all entries of a directory, other than "." and "..", and
+ * sort them.  Sorting makes the resulting image independent of the order in
+ * which the filesystem happens to return the entries.  The names are returned
+ * in *names_ret, which must be freed along with *names_buf_ret.
+ */
+static int
+read_sorted_dir_entries(DIR *dir, struct scan_params *params,
+			char **names_buf_ret, char ***names_ret,
+			size_t *num_names_ret)
+{
+	char *buf = NULL;
+	size_t buf_used = 0;
+	size_t buf_alloc = 0;
+	size_t num_names = 0;
+	char **names;
+	size_t pos;
+
+	for (;;) {
+		struct dirent *entry;
+		size_t name_len;
+
+		errno = 0;
+		entry = readdir(dir);
+		if (!entry) {
+			if (errno) {
+				ERROR_WITH_ERRNO("\"%s\": Error reading directory",
+						 params->cur_path);
+				FREE(buf);
+				return WIMLIB_ERR_READ;
+			}
+			break;
+		}
+
+		name_len = strlen(entry->d_name);
+
+		if (should_ignore_filename(entry->d_name, name_len))
+			continue;
+
+		if (buf_alloc - buf_used < name_len + 1) {
+			size_t new_alloc = max(buf_alloc * 2, 4096);
+			char *new_buf;
+
+			new_alloc = max(new_alloc, buf_used + name_len + 1);
+			new_buf = REALLOC(buf, new_alloc);
+			if (!new_buf) {
+				FREE(buf);
+				return WIMLIB_ERR_NOMEM;
+			}
+			buf = new_buf;
+			buf_alloc = new_alloc;
+		}
+		memcpy(&buf[buf_used], entry->d_name, name_len + 1);
+		buf_used += name_len + 1;
+		num_names++;
+	}
+
+	names = MALLOC(max(num_names, 1) * sizeof(names[0]));
+	if (!names) {
+		FREE(buf);
+		return WIMLIB_ERR_NOMEM;
+	}
+	pos = 0;
+	for (size_t i = 0; i < num_names; i++) {
+		names[i] = &buf[pos];
+		pos += strlen(&buf[pos]) + 1;
+	}
+	qsort(names, num_names, sizeof(names[0]), cmp_names);
+
+	*names_buf_ret = buf;
+	*names_ret = names;
+	*num_names_ret = num_names;
+	return 0;
+}
+
+#ifdef HAVE_FSTATAT
+
+/*
+ * On network filesystems, the time to scan a directory tree is dominated by the
+ * latency of the stat() of each file.  So, the entries of a directory are
+ * processed in windows of up to PRESTAT_WINDOW_SIZE entries, and before each
+ * window is processed, its entries are stat()ed in parallel on the task pool.
+ * Everything else, including building the dentry tree, calling the progress
+ * function, and detecting hard links, is still done by the scanning thread in
+ * order, so the result is the same as that of a serial scan.
+ */
+#define PRESTAT_WINDOW_SIZE		256
+#define MIN_ENTRIES_PER_PRESTAT_TASK	16
+#define MAX_PRESTAT_TASKS		(PRESTAT_WINDOW_SIZE / \
+					 MIN_ENTRIES_PER_PRESTAT_TASK)
+
+struct prestat_task {
+	struct pool_task base;
+	int dirfd;
+	int stat_flags;
+	char **names;
+	struct prestat *results;
+	size_t count;
+};
+
+static void
+prestat_task_run(struct pool_task *_task)
+{
+	struct prestat_task *task = (struct prestat_task *)_task;
+
+	for (size_t i = 0; i < task->count; i++) {
+		struct prestat *res = &task->results[i];
+
+		res->err = 0;
+		if (fstatat(task->dirfd, task->names[i], &res->stbuf,
+			    task->stat_flags))
+			res->err = errno ? errno : EIO;
+	}
+}
+
+#ifdef WITH_IO_URING
+
+/*
+ * Where io_uring is available, the entries of a window are instead stat()ed
+ * with a single batch of statx operations.  This runs them in parallel too
+ * (the kernel punts them to its own worker threads), but it doesn't take any
+ * threads from the task pool, and it takes one system call per window rather
+ * than one per entry.
+ */
+
+struct prestat_batch {
+	struct statx *bufs;
+	struct prestat *results;
+};
+
+static void
+statx_to_stat(const struct statx *stx, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	stbuf->st_ino = stx->stx_ino;
+	stbuf->st_mode = stx->stx_mode;
+	stbuf->st_nlink = stx->stx_nlink;
+	stbuf->st_uid = stx->stx_uid;
+	stbuf->st_gid = stx->stx_gid;
+	stbuf->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	stbuf->st_size = stx->stx_size;
+	stbuf->st_blksize = stx->stx_blksize;
+	stbuf->st_blocks = stx->stx_blocks;
+	stbuf->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	stbuf->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	stbuf->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	stbuf->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	stbuf->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	stbuf->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+static void
+prestat_statx_done(void *_batch, u64 i, int res)
+{
+	struct prestat_batch *batch = _batch;
+	struct prestat *res_p = &batch->results[i];
+
+	res_p->err = -res;
+	if (res == 0)
+		statx_to_stat(&batch->bufs[i], &res_p->stbuf);
+}
+
+static bool
+prestat_dir_entries_io_uring(int dirfd, char **names, size_t count,
+			     struct prestat *results,
+			     const struct scan_params *params)
+{
+	struct statx *bufs;
+	struct prestat_batch batch;
+	int flags = (params->add_flags & WIMLIB_ADD_FLAG_DEREFERENCE) ?
+			0 : AT_SYMLINK_NOFOLLOW;
+	int ret;
+
+	bufs = MALLOC(count * sizeof(bufs[0]));
+	if (!bufs)
+		return false;
+	for (size_t i = 0; i < count; i++)
+		io_ring_prep_statx(params->io_ring, dirfd, names[i], flags,
+				   &bufs[i], i);
+	batch.bufs = bufs;
+	batch.results = results;
+	ret = io_ring_run(params->io_ring, prestat_statx_done, &batch);
+	FREE(bufs);
+	return ret == 0;
+}
+
+#endif /* WITH_IO_URING */
+
+/* stat() the specified entries of the directory @dirfd in parallel.  Return
+ * false if this isn't worthwhile, in which case the caller should stat() the
+ * entries itself when it gets to them.  */
+static bool
+prestat_dir_entries(int dirfd, char **names, size_t count,
+		    struct prestat *results, const struct scan_params *params)
+{
+	struct prestat_task tasks[MAX_PRESTAT_TASKS];
+	struct pool_task *task_ptrs[MAX_PRESTAT_TASKS];
+	unsigned num_tasks;
+	size_t start = 0;
+
+	wimlib_assert(count <= PRESTAT_WINDOW_SIZE);
+
+#ifdef WITH_IO_URING
+	if (params->io_ring &&
+	    prestat_dir_entries_io_uring(dirfd, names, count, results, params))
+		return true;
+#endif
+
+	num_tasks = min(count / MIN_ENTRIES_PER_PRESTAT_TASK,
+			task_pool_num_threads());
+	if (num_tasks <= 1)
+		return false;
+
+	for (unsigned i = 0; i < num_tasks; i++) {
+		size_t end = count * (i + 1) / num_tasks;
+
+		tasks[i].base.run = prestat_task_run;
+		tasks[i].dirfd = dirfd;
+		tasks[i].stat_flags =
+			(params->add_flags & WIMLIB_ADD_FLAG_DEREFERENCE) ?
+				0 : AT_SYMLINK_NOFOLLOW;
+		tasks[i].names = &names[start];
+		tasks[i].results = &results[start];
+		tasks[i].count = end - start;
+		task_ptrs[i] = &tasks[i].base;
+		start = end;
+	}
+	task_pool_run_batch(task_ptrs, num_tasks);
+	return true;
+}
+
+#else /* HAVE_FSTATAT */
+
+#define PRESTAT_WINDOW_SIZE		256
+
+static bool
+prestat_dir_entries(int dirfd, char **names, size_t count,
+		    struct prestat *results, const struct scan_params *params)
+{
+	return false;
+}
+
+#endif /* !HAVE_FSTATAT */
 
 static int
 unix_scan_directory(struct wim_dentry *dir_dentry,
@@ -333,6 +668,11 @@ unix_scan_directory(struct wim_dentry *dir_dentry,
 	int dirfd;
 	DIR *dir;
 	int ret;
+	char *names_buf;
+	char **names;
+	size_t num_names;
+	struct prestat *prestats = NULL;
+	bool have_prestats = false;
 
 	dirfd = my_openat(params->cur_path, parent_dirfd, dir_relpath, O_RDONLY);
 	if (dirfd < 0) {
@@ -350,40 +690,52 @@ unix_scan_directory(struct wim_dentry *dir_dentry,
 		return WIMLIB_ERR_OPENDIR;
 	}
 
-	ret = 0;
-	for (;;) {
-		struct dirent *entry;
-		struct wim_dentry *child;
-		size_t name_len;
-		size_t orig_path_len;
+	ret = read_sorted_dir_entries(dir, params, &names_buf, &names,
+				      &num_names);
+	if (ret)
+		goto out_closedir;
 
-		errno = 0;
-		entry = readdir(dir);
-		if (!entry) {
-			if (errno) {
-				ret = WIMLIB_ERR_READ;
-				ERROR_WITH_ERRNO("\"%s\": Error reading directory",
-						 params->cur_path);
-			}
-			break;
+	if (num_names > 1) {
+		prestats = MALLOC(min(num_names, PRESTAT_WINDOW_SIZE) *
+				  sizeof(prestats[0]));
+		if (!prestats) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto out_free_names;
 		}
+	}
 
-		name_len = strlen(entry->d_name);
+	for (size_t i = 0; i < num_names; i++) {
+		const char *name = names[i];
+		size_t window_idx = i % PRESTAT_WINDOW_SIZE;
+		struct wim_dentry *child;
+		size_t orig_path_len;
 
-		if (should_ignore_filename(entry->d_name, name_len))
-			continue;
+		if (prestats && window_idx == 0) {
+			have_prestats = prestat_dir_entries(
+				dirfd, &names[i],
+				min(num_names - i, PRESTAT_WINDOW_SIZE),
+				prestats, params);
+		}
 
 		ret = WIMLIB_ERR_NOMEM;
-		if (!pathbuf_append_name(params, entry->d_name, name_len,
+		if (!pathbuf_append_name(params, name, strlen(name),
 					 &orig_path_len))
 			break;
-		ret = unix_build_dentry_tree_recursive(&child, dirfd,
-						       entry->d_name, params);
+		ret = unix_build_dentry_tree_recursive(&child, dirfd, name,
+						       params,
+						       have_prestats ?
+						       &prestats[window_idx] :
+						       NULL);
 		pathbuf_truncate(params, orig_path_len);
 		if (ret)
 			break;
-		attach_scanned_tree(dir_dentry, child, params->blob_table);
+		attach_scanned_tree(dir_dentry, child, params);
 	}
+	FREE(prestats);
+out_free_names:
+	FREE(names);
+	FREE(names_buf);
+out_closedir:
 	closedir(dir);
 	return ret;
 }
@@ -529,7 +881,8 @@ unix_scan_symlink(int dirfd, const char *relpath,
 static int
 unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 				 int dirfd, const char *relpath,
-				 struct scan_params *params)
+				 struct scan_params *params,
+				 const struct prestat *prestat)
 {
 	struct wim_dentry *tree = NULL;
 	struct wim_inode *inode = NULL;
@@ -549,7 +902,15 @@ unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 	else
 		stat_flags = AT_SYMLINK_NOFOLLOW;
 
-	ret = my_fstatat(params->cur_path, dirfd, relpath, &stbuf, stat_flags);
+	if (prestat) {
+		/* Already stat()ed by prestat_dir_entries()  */
+		stbuf = prestat->stbuf;
+		ret = prestat->err;
+		errno = prestat->err;
+	} else {
+		ret = my_fstatat(params->cur_path, dirfd, relpath, &stbuf,
+				 stat_flags);
+	}
 
 	if (ret) {
 		ERROR_WITH_ERRNO("\"%s\": Can't read metadata",
@@ -628,9 +989,20 @@ unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 	}
 
 	if (S_ISREG(stbuf.st_mode)) {
+		u64 disk_offset = 0;
+
+	#ifdef HAVE_LINUX_FIEMAP_H
+		if ((params->add_flags & WIMLIB_ADD_FLAG_DISK_ORDER) &&
+		    stbuf.st_size != 0)
+			disk_offset = unix_get_disk_offset(dirfd, relpath,
+							   stat_flags, &stbuf,
+							   params);
+	#endif
 		ret = unix_scan_regular_file(params->cur_path, stbuf.st_blocks,
-					     stbuf.st_size, inode,
+					     stbuf.st_size, disk_offset, inode,
 					     params->unhashed_blobs);
+		if (!ret && params->hash_cache)
+			ret = unix_apply_hash_cache(params, inode, &stbuf);
 	} else if (S_ISDIR(stbuf.st_mode)) {
 		ret = unix_scan_directory(tree, dirfd, relpath, params);
 	} else if (S_ISLNK(stbuf.st_mode)) {
@@ -647,7 +1019,7 @@ out_progress:
 		ret = do_scan_progress(params, WIMLIB_SCAN_DENTRY_EXCLUDED, NULL);
 out:
 	if (unlikely(ret)) {
-		free_dentry_tree(tree, params->blob_table);
+		discard_scanned_tree(params, tree);
 		tree = NULL;
 		ret = report_scan_error(params, ret);
 	}
@@ -684,8 +1056,14 @@ unix_build_dentry_tree(struct wim_dentry **root_ret,
 	if (ret)
 		return ret;
 
-	return unix_build_dentry_tree_recursive(root_ret, AT_FDCWD,
-						root_disk_path, params);
+#ifdef HAVE_FSTATAT
+	params->io_ring = io_ring_create(PRESTAT_WINDOW_SIZE, IO_RING_OP_STATX);
+#endif
+	ret = unix_build_dentry_tree_recursive(root_ret, AT_FDCWD,
+					       root_disk_path, params, NULL);
+	io_ring_destroy(params->io_ring);
+	params->io_ring = NULL;
+	return ret;
 }
 
 #endif /* !_WIN32 */
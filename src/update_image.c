@@ -64,7 +64,9 @@
 #include "wimlib/paths.h"
 #include "wimlib/progress.h"
 #include "wimlib/scan.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/test_support.h"
+#include "wimlib/win32.h" /* vss_release_cached_snapshots() */
 #include "wimlib/xml_windows.h"
 
 /* Saved specification of a "primitive" update operation that was performed.  */
@@ -110,8 +112,7 @@ struct update_primitive {
 	};
 };
 
-/* Chronological list of primitive operations that were executed for a single
- * logical update command, such as 'add', 'delete', or 'rename'.  */
+/* Chronological list of primitive operations that were executed.  */
 struct update_primitive_list {
 	struct update_primitive *entries;
 	struct update_primitive inline_entries[4];
@@ -121,14 +122,10 @@ struct update_primitive_list {
 
 /* Journal for managing the executing of zero or more logical update commands,
  * such as 'add', 'delete', or 'rename'.  This allows either committing or
- * rolling back the commands.  */
+ * rolling back the commands.  Rolling back the commands in reverse order is the
+ * same as rolling back all their primitive operations in reverse order, so
+ * only the latter are logged.  */
 struct update_command_journal {
-	/* Number of update commands this journal contains.  */
-	size_t num_cmds;
-
-	/* Index of currently executing update command.  */
-	size_t cur_cmd;
-
 	/* Location of the WIM image's root pointer.  */
 	struct wim_dentry **root_p;
 
@@ -139,8 +136,16 @@ struct update_command_journal {
 	 * These must be freed when no longer needed for commit or rollback.  */
 	struct list_head orphans;
 
-	/* Per-command logs.  */
-	struct update_primitive_list cmd_prims[];
+	/* Log of the primitive operations of all the commands.  */
+	struct update_primitive_list prims;
+
+	/* The directory into which the last branch was attached, and the path
+	 * which led to it, or NULL if a dentry has been unlinked since.
+	 * Commands which add files to the same directory are common, and the
+	 * directory is looked up only once for them.  */
+	struct wim_dentry *last_parent;
+	utf16lechar *last_parent_path;
+	size_t last_parent_nbytes;
 };
 
 static void
@@ -151,23 +156,22 @@ init_update_primitive_list(struct update_primitive_list *l)
 	l->num_alloc_entries = ARRAY_LEN(l->inline_entries);
 }
 
-/* Allocates a new journal for managing the execution of up to @num_cmds update
- * commands.  */
+/* Allocates a new journal for managing the execution of update commands.  */
 static struct update_command_journal *
-new_update_command_journal(size_t num_cmds, struct wim_dentry **root_p,
+new_update_command_journal(struct wim_dentry **root_p,
 			   struct blob_table *blob_table)
 {
 	struct update_command_journal *j;
 
-	j = MALLOC(sizeof(*j) + num_cmds * sizeof(j->cmd_prims[0]));
+	j = MALLOC(sizeof(*j));
 	if (j) {
-		j->num_cmds = num_cmds;
-		j->cur_cmd = 0;
 		j->root_p = root_p;
 		j->blob_table = blob_table;
 		INIT_LIST_HEAD(&j->orphans);
-		for (size_t i = 0; i < num_cmds; i++)
-			init_update_primitive_list(&j->cmd_prims[i]);
+		init_update_primitive_list(&j->prims);
+		j->last_parent = NULL;
+		j->last_parent_path = NULL;
+		j->last_parent_nbytes = 0;
 	}
 	return j;
 }
@@ -187,9 +191,9 @@ free_update_command_journal(struct update_command_journal *j)
 		free_dentry_tree(orphan, j->blob_table);
 	}
 
-	for (size_t i = 0; i < j->num_cmds; i++)
-		if (j->cmd_prims[i].entries != j->cmd_prims[i].inline_entries)
-			FREE(j->cmd_prims[i].entries);
+	if (j->prims.entries != j->prims.inline_entries)
+		FREE(j->prims.entries);
+	FREE(j->last_parent_path);
 	FREE(j);
 }
 
@@ -200,7 +204,7 @@ record_update_primitive(struct update_command_journal *j,
 {
 	struct update_primitive_list *l;
 
-	l = &j->cmd_prims[j->cur_cmd];
+	l = &j->prims;
 
 	if (l->num_entries == l->num_alloc_entries) {
 		struct update_primitive *new_entries;
@@ -327,19 +331,6 @@ rollback_update_primitive(const struct update_primitive *prim,
 	}
 }
 
-/* Rollback a logical update command  */
-static void
-rollback_update_command(const struct update_primitive_list *l,
-			struct wim_dentry **root_p,
-			struct list_head *orphans)
-{
-	size_t i = l->num_entries;
-
-	/* Rollback each primitive operation, in reverse order.  */
-	while (i--)
-		rollback_update_primitive(&l->entries[i], root_p, orphans);
-}
-
 /****************************************************************************/
 
 /* Link @subject into the directory @parent; or, if @parent is NULL, set
@@ -395,6 +386,9 @@ journaled_unlink(struct update_command_journal *j, struct wim_dentry *subject)
 
 	do_unlink(subject, parent, j->root_p);
 
+	/* The cached directory might have been in the unlinked tree.  */
+	j->last_parent = NULL;
+
 	list_add(&subject->d_tmp_list, &j->orphans);
 	subject->d_is_orphan = 1;
 	return 0;
@@ -419,6 +413,13 @@ journaled_change_name(struct update_command_journal *j,
 	if (ret)
 		return ret;
 
+	/* The journal takes ownership of the old names.  */
+	ret = dentry_move_names_to_heap(dentry);
+	if (ret) {
+		FREE(new_name);
+		return ret;
+	}
+
 	prim.type = CHANGE_FILE_NAME;
 	prim.name.subject = dentry;
 	prim.name.old_name = dentry->d_name;
@@ -444,25 +445,13 @@ journaled_change_name(struct update_command_journal *j,
 	return 0;
 }
 
-static void
-next_command(struct update_command_journal *j)
-{
-	j->cur_cmd++;
-}
-
 static void
 commit_update(struct update_command_journal *j)
 {
-	for (size_t i = 0; i < j->num_cmds; i++)
-	{
-		for (size_t k = 0; k < j->cmd_prims[i].num_entries; k++)
-		{
-			if (j->cmd_prims[i].entries[k].type == CHANGE_FILE_NAME ||
-			    j->cmd_prims[i].entries[k].type == CHANGE_SHORT_NAME)
-			{
-				FREE(j->cmd_prims[i].entries[k].name.old_name);
-			}
-		}
+	for (size_t i = 0; i < j->prims.num_entries; i++) {
+		if (j->prims.entries[i].type == CHANGE_FILE_NAME ||
+		    j->prims.entries[i].type == CHANGE_SHORT_NAME)
+			FREE(j->prims.entries[i].name.old_name);
 	}
 	free_update_command_journal(j);
 }
@@ -470,12 +459,12 @@ commit_update(struct update_command_journal *j)
 static void
 rollback_update(struct update_command_journal *j)
 {
-	/* Rollback each logical update command, in reverse order.  */
-	size_t i = j->cur_cmd;
-	if (i < j->num_cmds)
-		i++;
+	/* Rollback each primitive operation, in reverse order.  */
+	size_t i = j->prims.num_entries;
+
 	while (i--)
-		rollback_update_command(&j->cmd_prims[i], j->root_p, &j->orphans);
+		rollback_update_primitive(&j->prims.entries[i], j->root_p,
+					  &j->orphans);
 	free_update_command_journal(j);
 }
 
@@ -567,6 +556,28 @@ handle_conflict(struct wim_dentry *branch, struct wim_dentry *existing,
 	}
 }
 
+/* Remember the directory @parent, reached by the path from @target to @end, for
+ * the next branch to be attached.  This is only an optimization, so failing to
+ * allocate memory isn't an error.  */
+static void
+remember_parent(struct update_command_journal *j, struct wim_dentry *parent,
+		const utf16lechar *target, const utf16lechar *end)
+{
+	size_t nbytes = (end - target) * sizeof(utf16lechar);
+
+	if (nbytes > j->last_parent_nbytes || !j->last_parent_path) {
+		FREE(j->last_parent_path);
+		j->last_parent_path = MALLOC(max(nbytes, 1));
+		j->last_parent = NULL;
+		j->last_parent_nbytes = 0;
+		if (!j->last_parent_path)
+			return;
+	}
+	memcpy(j->last_parent_path, target, nbytes);
+	j->last_parent_nbytes = nbytes;
+	j->last_parent = parent;
+}
+
 static int
 do_attach_branch(struct wim_dentry *branch, const utf16lechar *target,
 		 struct update_command_journal *j,
@@ -587,6 +598,30 @@ do_attach_branch(struct wim_dentry *branch, const utf16lechar *target,
 	cur_component_name = empty_name;
 	cur_component_nbytes = 0;
 
+	/* If the parent directory is the same as last time, start there.  */
+	if (j->last_parent) {
+		const utf16lechar *last = target + utf16le_len_chars(target);
+
+		while (last != target &&
+		       last[-1] != cpu_to_le16(WIM_PATH_SEPARATOR))
+			last--;
+		if ((last - target) * sizeof(utf16lechar) ==
+				j->last_parent_nbytes &&
+		    !memcmp(target, j->last_parent_path,
+			    j->last_parent_nbytes))
+		{
+			parent = j->last_parent;
+			cur_component_name = last;
+			cur_component_nbytes = utf16le_len_bytes(last);
+			existing = get_dentry_child_with_utf16le_name(
+						parent,
+						cur_component_name,
+						cur_component_nbytes,
+						WIMLIB_CASE_PLATFORM_DEFAULT);
+			goto last_component;
+		}
+	}
+
 	/* Skip leading slashes  */
 	next_component_name = target;
 	while (*next_component_name == cpu_to_le16(WIM_PATH_SEPARATOR))
@@ -652,6 +687,10 @@ do_attach_branch(struct wim_dentry *branch, const utf16lechar *target,
 					WIMLIB_CASE_PLATFORM_DEFAULT);
 	}
 
+	if (parent)
+		remember_parent(j, parent, target, cur_component_name);
+
+last_component:
 	/* Last component  */
 	if (existing) {
 		return handle_conflict(branch, existing, j, add_flags,
@@ -779,117 +818,211 @@ get_capture_config(const tchar *config_file, struct capture_config *config,
 	return ret;
 }
 
+/* The capture configuration loaded for the last add command, which the next
+ * ones usually share.  */
+struct cached_capture_config {
+	bool valid;
+	const tchar *config_file;
+	int add_flags;
+	struct capture_config config;
+};
+
+/* Load the capture configuration for an add command, or reuse the one loaded
+ * for the previous add command if it's the same.  */
 static int
-execute_add_command(struct update_command_journal *j,
-		    WIMStruct *wim,
-		    const struct wimlib_update_command *add_cmd,
-		    struct wim_inode_table *inode_table,
-		    struct wim_sd_set *sd_set,
-		    struct list_head *unhashed_blobs)
+load_capture_config(struct cached_capture_config *cache,
+		    const tchar *config_file, int add_flags,
+		    const tchar *fs_source_path, struct capture_config **config_ret)
 {
 	int ret;
-	int add_flags;
-	tchar *fs_source_path;
-	tchar *wim_target_path;
-	const tchar *config_file;
-	struct scan_params params;
-	struct capture_config config;
-	scan_tree_t scan_tree = platform_default_scan_tree;
-	struct wim_dentry *branch;
 
-	add_flags = add_cmd->add.add_flags;
-	fs_source_path = add_cmd->add.fs_source_path;
-	wim_target_path = add_cmd->add.wim_target_path;
-	config_file = add_cmd->add.config_file;
+	add_flags &= WIMLIB_ADD_FLAG_WINCONFIG | WIMLIB_ADD_FLAG_WIMBOOT;
 
-	memset(&params, 0, sizeof(params));
+	/* The default configuration for WIMBoot depends on the source.  */
+	if (cache->valid && cache->add_flags == add_flags &&
+	    !(config_file == NULL && (add_flags & WIMLIB_ADD_FLAG_WIMBOOT)) &&
+	    (config_file == cache->config_file ||
+	     (config_file && cache->config_file &&
+	      !tstrcmp(config_file, cache->config_file))))
+	{
+		*config_ret = &cache->config;
+		return 0;
+	}
 
-#ifdef WITH_NTFS_3G
-	if (add_flags & WIMLIB_ADD_FLAG_NTFS)
-		scan_tree = ntfs_3g_build_dentry_tree;
-#endif
+	if (cache->valid) {
+		destroy_capture_config(&cache->config);
+		cache->valid = false;
+	}
+	ret = get_capture_config(config_file, &cache->config,
+				 add_flags, fs_source_path);
+	if (ret)
+		return ret;
+	cache->valid = true;
+	cache->config_file = config_file;
+	cache->add_flags = add_flags;
+	*config_ret = &cache->config;
+	return 0;
+}
 
+/* Return the function which scans the source of add commands with the flags
+ * @add_flags.  */
+static scan_tree_t
+get_scan_tree(int add_flags)
+{
 #ifdef ENABLE_TEST_SUPPORT
 	if (add_flags & WIMLIB_ADD_FLAG_GENERATE_TEST_DATA)
-		scan_tree = generate_dentry_tree;
+		return generate_dentry_tree;
 #endif
 
-	ret = get_capture_config(config_file, &config,
-				 add_flags, fs_source_path);
-	if (ret)
-		goto out;
+#ifndef _WIN32
+	if (add_flags & WIMLIB_ADD_FLAG_TAR)
+		return tar_build_dentry_tree;
+#endif
 
-	params.blob_table = wim->blob_table;
-	params.unhashed_blobs = unhashed_blobs;
-	params.inode_table = inode_table;
-	params.sd_set = sd_set;
-	params.config = &config;
-	params.add_flags = add_flags;
-
-	params.progfunc = wim->progfunc;
-	params.progctx = wim->progctx;
-	params.progress.scan.source = fs_source_path;
-	params.progress.scan.wim_target_path = wim_target_path;
-	ret = call_progress(params.progfunc, WIMLIB_PROGRESS_MSG_SCAN_BEGIN,
-			    &params.progress, params.progctx);
-	if (ret)
-		goto out_destroy_config;
+#ifdef WITH_NTFS_3G
+	if (add_flags & WIMLIB_ADD_FLAG_NTFS)
+		return ntfs_3g_build_dentry_tree;
+#endif
+	return platform_default_scan_tree;
+}
 
-	if (WIMLIB_IS_WIM_ROOT_PATH(wim_target_path))
-		params.add_flags |= WIMLIB_ADD_FLAG_ROOT;
-	ret = (*scan_tree)(&branch, fs_source_path, &params);
-	if (ret)
-		goto out_destroy_config;
+/* Prepare @params for scanning the source of the add command @add_cmd, except
+ * for the capture configuration.  */
+static void
+init_add_scan_params(struct scan_params *params, WIMStruct *wim,
+		     const struct wimlib_update_command *add_cmd,
+		     struct blob_table *blob_table,
+		     struct wim_inode_table *inode_table,
+		     struct wim_sd_set *sd_set,
+		     struct list_head *unhashed_blobs)
+{
+	memset(params, 0, sizeof(*params));
+
+	params->blob_table = blob_table;
+	params->unhashed_blobs = unhashed_blobs;
+	params->inode_table = inode_table;
+	params->sd_set = sd_set;
+	params->hash_cache = wim->hash_cache;
+	params->add_flags = add_cmd->add.add_flags;
+
+	params->progfunc = wim->progfunc;
+	params->progctx = wim->progctx;
+	if (params->progfunc)
+		progress_throttle_init(&params->progress_throttle,
+				       wim->progress_interval_ms);
+	params->progress.scan.source = add_cmd->add.fs_source_path;
+	params->progress.scan.wim_target_path = add_cmd->add.wim_target_path;
+
+	if (WIMLIB_IS_WIM_ROOT_PATH(add_cmd->add.wim_target_path))
+		params->add_flags |= WIMLIB_ADD_FLAG_ROOT;
+}
 
-	ret = call_progress(params.progfunc, WIMLIB_PROGRESS_MSG_SCAN_END,
-			    &params.progress, params.progctx);
-	if (ret) {
-		free_dentry_tree(branch, wim->blob_table);
-		goto out_destroy_config;
-	}
+/* Finish the add command @add_cmd, whose source has been scanned into @branch
+ * with @params, by attaching the branch to the image.  */
+static int
+attach_added_branch(struct update_command_journal *j, WIMStruct *wim,
+		    const struct wimlib_update_command *add_cmd,
+		    struct wim_dentry *branch, struct scan_params *params)
+{
+	int add_flags = add_cmd->add.add_flags;
+	const tchar *fs_source_path = add_cmd->add.fs_source_path;
+	const tchar *wim_target_path = add_cmd->add.wim_target_path;
+	const tchar *config_file = add_cmd->add.config_file;
+	int ret;
 
 	if (WIMLIB_IS_WIM_ROOT_PATH(wim_target_path) &&
 	    branch && !dentry_is_directory(branch))
 	{
 		ERROR("\"%"TS"\" is not a directory!", fs_source_path);
-		ret = WIMLIB_ERR_NOTDIR;
 		free_dentry_tree(branch, wim->blob_table);
-		goto out_destroy_config;
+		return WIMLIB_ERR_NOTDIR;
 	}
 
 	ret = attach_branch(branch, wim_target_path, j,
-			    add_flags, params.progfunc, params.progctx);
+			    add_flags, params->progfunc, params->progctx);
 	if (ret)
-		goto out_destroy_config;
+		return ret;
 
 	if (config_file && (add_flags & WIMLIB_ADD_FLAG_WIMBOOT) &&
 	    WIMLIB_IS_WIM_ROOT_PATH(wim_target_path))
 	{
-		params.add_flags = 0;
-		params.progfunc = NULL;
-		params.config = NULL;
+		params->add_flags = 0;
+		params->progfunc = NULL;
+		params->config = NULL;
 
 		/* If a capture configuration file was explicitly specified when
 		 * capturing an image in WIMBoot mode, save it as
 		 * /Windows/System32/WimBootCompress.ini in the WIM image. */
-		ret = platform_default_scan_tree(&branch, config_file, &params);
+		ret = platform_default_scan_tree(&branch, config_file, params);
 		if (ret)
-			goto out_destroy_config;
+			return ret;
 
 		ret = attach_branch(branch, wimboot_cfgfile, j, 0, NULL, NULL);
 		if (ret)
-			goto out_destroy_config;
+			return ret;
 	}
 
-	if (WIMLIB_IS_WIM_ROOT_PATH(wim_target_path)) {
-		ret = set_windows_specific_info(wim);
+	if (WIMLIB_IS_WIM_ROOT_PATH(wim_target_path))
+		return set_windows_specific_info(wim);
+	return 0;
+}
+
+static int
+execute_add_command(struct update_command_journal *j,
+		    WIMStruct *wim,
+		    const struct wimlib_update_command *add_cmd,
+		    struct wim_inode_table *inode_table,
+		    struct wim_sd_set *sd_set,
+		    struct list_head *unhashed_blobs,
+		    struct cached_capture_config *config_cache)
+{
+	int ret;
+	struct scan_params params;
+	struct capture_template template;
+	struct wim_dentry *branch;
+
+	init_add_scan_params(&params, wim, add_cmd, wim->blob_table,
+			     inode_table, sd_set, unhashed_blobs);
+
+	ret = load_capture_config(config_cache, add_cmd->add.config_file,
+				  add_cmd->add.add_flags,
+				  add_cmd->add.fs_source_path, &params.config);
+	if (ret)
+		goto out;
+
+	ret = call_progress(params.progfunc, WIMLIB_PROGRESS_MSG_SCAN_BEGIN,
+			    &params.progress, params.progctx);
+	if (ret)
+		goto out;
+
+	if (wim->capture_template_wim) {
+		ret = begin_capture_template(&template, wim,
+					     add_cmd->add.wim_target_path);
 		if (ret)
-			goto out_destroy_config;
+			goto out;
+		params.template = &template;
 	}
 
-	ret = 0;
-out_destroy_config:
-	destroy_capture_config(&config);
+	start_scan_hasher(&params);
+	ret = (*get_scan_tree(add_cmd->add.add_flags))(&branch,
+						      add_cmd->add.fs_source_path,
+						      &params);
+	finish_scan_hasher(&params, ret == 0);
+	if (params.template) {
+		end_capture_template(&template);
+		params.template = NULL;
+	}
+	if (ret)
+		goto out;
+
+	ret = call_progress(params.progfunc, WIMLIB_PROGRESS_MSG_SCAN_END,
+			    &params.progress, params.progctx);
+	if (ret) {
+		free_dentry_tree(branch, wim->blob_table);
+		goto out;
+	}
+
+	ret = attach_added_branch(j, wim, add_cmd, branch, &params);
 out:
 	FREE(params.cur_path);
 	return ret;
@@ -929,14 +1062,6 @@ execute_delete_command(struct update_command_journal *j,
 	return journaled_unlink(j, tree);
 }
 
-static int
-free_dentry_full_path(struct wim_dentry *dentry, void *_ignore)
-{
-	FREE(dentry->d_full_path);
-	dentry->d_full_path = NULL;
-	return 0;
-}
-
 /* Is @d1 a (possibly nonproper) ancestor of @d2?  */
 static bool
 is_ancestor(const struct wim_dentry *d1, const struct wim_dentry *d2)
@@ -1033,8 +1158,6 @@ rename_wim_path(WIMStruct *wim, const tchar *from, const tchar *to,
 		unlink_dentry(src);
 		dentry_add_child(parent_of_dst, src);
 	}
-	if (src->d_full_path)
-		for_dentry_in_tree(src, free_dentry_full_path, NULL);
 	return 0;
 }
 
@@ -1080,6 +1203,390 @@ execute_rename_command(struct update_command_journal *j,
 	return ret;
 }
 
+/*
+ * Scanning the sources of add commands in parallel
+ *
+ * An image may be built from many sources, e.g. directories on different
+ * volumes and network shares, and scanning them one at a time is mostly waiting
+ * for each filesystem in turn.  So if all the update commands are add commands
+ * like the ones made by wimlib_add_image_multisource(), the sources are scanned
+ * by the task pool, with one task per filesystem at a time.  Sources on the
+ * same filesystem are scanned in order by the same task, with the same inode
+ * table, so that the hard links between them are still detected.
+ *
+ * Each filesystem also gets its own blob table and list of unhashed blobs.
+ * These are merged into the shared ones in the order of the commands, just
+ * before the first branch from the filesystem is attached, and the branches are
+ * attached one by one as usual.  So the image is the same as when the sources
+ * are scanned one at a time, except that the files aren't hashed in the
+ * background while scanning, as the hashing needs the task pool too.  The
+ * progress function is called from the scanning threads, but never by two of
+ * them at the same time.
+ *
+ * This is only done for sources scanned with the platform's default scan, with
+ * no capture template or hash cache, as those are shared by all the sources.
+ */
+
+/* Maximum number of sources which are scanned at the same time  */
+#define MAX_SCAN_TASKS		16
+
+struct source_group;
+
+/* The scan of the source of one add command  */
+struct source_scan {
+	const struct wimlib_update_command *cmd;
+	struct scan_params params;
+	struct wim_dentry *branch;
+
+	/* The sources on the same filesystem, in the order of the commands */
+	struct source_group *group;
+	struct source_scan *next_in_group;
+
+	/* The result of the scan, or -1 if it wasn't done  */
+	int ret;
+};
+
+/* The sources on one filesystem, and the tables which they are scanned into
+ * until they are merged into the shared ones  */
+struct source_group {
+	dev_t dev;
+	bool dev_valid;
+	struct source_scan *first;
+	struct source_scan *last;
+	struct blob_table *blob_table;
+	struct wim_inode_table inode_table;
+	struct list_head unhashed_blobs;
+	bool merged;
+};
+
+struct parallel_scan {
+	struct source_group *groups;
+	size_t num_groups;
+	size_t next_group;
+	bool failed;
+
+	/* The user's progress function, which the scans call through
+	 * locked_progress_func()  */
+	wimlib_progress_func_t progfunc;
+	void *progctx;
+	struct mutex progress_lock;
+};
+
+struct scan_task {
+	struct pool_task base;
+	struct parallel_scan *ps;
+};
+
+static enum wimlib_progress_status
+locked_progress_func(enum wimlib_progress_msg msg,
+		     union wimlib_progress_info *info, void *_ps)
+{
+	struct parallel_scan *ps = _ps;
+	enum wimlib_progress_status status;
+
+	mutex_lock(&ps->progress_lock);
+	status = (*ps->progfunc)(msg, info, ps->progctx);
+	mutex_unlock(&ps->progress_lock);
+	return status;
+}
+
+/* Return true if the sources of @cmds should be scanned in parallel.  */
+static bool
+should_scan_in_parallel(const WIMStruct *wim,
+			const struct wimlib_update_command *cmds,
+			size_t num_cmds, int update_flags)
+{
+#ifdef _WIN32
+	/* VSS snapshots and security descriptors are shared by the scans.  */
+	return false;
+#else
+	const tchar *config_file = cmds[0].add.config_file;
+	int config_flags;
+
+	if (num_cmds < 2 || (update_flags & WIMLIB_UPDATE_FLAG_SEND_PROGRESS) ||
+	    wim->capture_template_wim || wim->hash_cache)
+		return false;
+
+	/* All the commands must share the same capture configuration, which
+	 * load_capture_config() chooses from these flags.  */
+	config_flags = cmds[0].add.add_flags & WIMLIB_ADD_FLAG_WINCONFIG;
+	for (size_t i = 0; i < num_cmds; i++) {
+		int add_flags = cmds[i].add.add_flags;
+
+		if (cmds[i].op != WIMLIB_UPDATE_OP_ADD ||
+		    (add_flags & WIMLIB_ADD_FLAG_WIMBOOT) ||
+		    (add_flags & WIMLIB_ADD_FLAG_WINCONFIG) != config_flags ||
+		    get_scan_tree(add_flags) != platform_default_scan_tree)
+			return false;
+		if (cmds[i].add.config_file != config_file &&
+		    (!cmds[i].add.config_file || !config_file ||
+		     tstrcmp(cmds[i].add.config_file, config_file)))
+			return false;
+	}
+
+	return task_pool_num_threads() > 1;
+#endif
+}
+
+/* Scan the source of an add command, and send the progress messages which
+ * execute_add_command() sends around the scan.  */
+static int
+scan_source(struct source_scan *scan)
+{
+	struct scan_params *params = &scan->params;
+	int ret;
+
+	ret = call_progress(params->progfunc, WIMLIB_PROGRESS_MSG_SCAN_BEGIN,
+			    &params->progress, params->progctx);
+	if (ret)
+		return ret;
+
+	ret = platform_default_scan_tree(&scan->branch,
+					 scan->cmd->add.fs_source_path, params);
+	if (ret)
+		return ret;
+
+	ret = call_progress(params->progfunc, WIMLIB_PROGRESS_MSG_SCAN_END,
+			    &params->progress, params->progctx);
+	if (ret) {
+		free_dentry_tree(scan->branch, params->blob_table);
+		scan->branch = NULL;
+	}
+	return ret;
+}
+
+static void
+scan_task_run(struct pool_task *_task)
+{
+	struct parallel_scan *ps = ((struct scan_task *)_task)->ps;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&ps->next_group, 1, __ATOMIC_RELAXED)) <
+	       ps->num_groups)
+	{
+		struct source_scan *scan;
+
+		for (scan = ps->groups[i].first; scan; scan = scan->next_in_group) {
+			/* After a failure, the rest won't be needed.  */
+			if (__atomic_load_n(&ps->failed, __ATOMIC_RELAXED))
+				return;
+			scan->ret = scan_source(scan);
+			if (scan->ret)
+				__atomic_store_n(&ps->failed, true,
+						 __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* Move the hashed blobs of @inode from the table @from to the table @to,
+ * replacing them with the blobs already in @to that have the same data.  */
+static void
+move_inode_blobs(struct wim_inode *inode, struct blob_table *from,
+		 struct blob_table *to)
+{
+	for (unsigned i = 0; i < inode->i_num_streams; i++) {
+		struct wim_inode_stream *strm = &inode->i_streams[i];
+		struct blob_descriptor *blob = stream_blob_resolved(strm);
+		struct blob_descriptor *existing;
+
+		if (!blob || blob->unhashed)
+			continue;
+		existing = lookup_blob(to, blob->hash);
+		if (existing == blob)
+			continue;
+		if (existing) {
+			inode_replace_stream_blob(inode, strm, existing, from);
+		} else {
+			blob_table_unlink(from, blob);
+			blob_table_insert(to, blob);
+		}
+	}
+}
+
+/* Merge the tables which the sources of @group were scanned into into the
+ * shared ones, which their scans then use from now on.  */
+static void
+merge_source_group(struct source_group *group, WIMStruct *wim,
+		   struct wim_inode_table *inode_table,
+		   struct list_head *unhashed_blobs)
+{
+	struct wim_inode_table *table = &group->inode_table;
+	struct wim_inode *inode;
+
+	for (size_t i = 0; i < table->capacity; i++)
+		hlist_for_each_entry(inode, &table->array[i], i_hlist_node)
+			move_inode_blobs(inode, group->blob_table,
+					 wim->blob_table);
+	hlist_for_each_entry(inode, &table->extra_inodes, i_hlist_node)
+		move_inode_blobs(inode, group->blob_table, wim->blob_table);
+	inode_table_move_inodes(inode_table, table);
+	list_splice_tail(&group->unhashed_blobs, unhashed_blobs);
+	INIT_LIST_HEAD(&group->unhashed_blobs);
+	free_blob_table(group->blob_table);
+	group->blob_table = NULL;
+
+	for (struct source_scan *scan = group->first; scan;
+	     scan = scan->next_in_group)
+	{
+		scan->params.blob_table = wim->blob_table;
+		scan->params.inode_table = inode_table;
+		scan->params.unhashed_blobs = unhashed_blobs;
+	}
+	group->merged = true;
+}
+
+/* Add each source to the group of the sources on its filesystem, starting a
+ * new group if needed.  A source that can't be stat'ed gets a group to itself,
+ * and the error is reported by its scan.  */
+static int
+group_sources(struct parallel_scan *ps, struct source_scan *scans,
+	      size_t num_scans)
+{
+	for (size_t i = 0; i < num_scans; i++) {
+		struct source_scan *scan = &scans[i];
+		struct source_group *group = NULL;
+		struct stat stbuf;
+		bool dev_valid;
+
+		dev_valid = (tstat(scan->cmd->add.fs_source_path, &stbuf) == 0);
+		for (size_t k = 0; dev_valid && k < ps->num_groups; k++) {
+			if (ps->groups[k].dev_valid &&
+			    ps->groups[k].dev == stbuf.st_dev) {
+				group = &ps->groups[k];
+				break;
+			}
+		}
+		if (!group) {
+			group = &ps->groups[ps->num_groups];
+			group->blob_table = new_blob_table(64);
+			if (!group->blob_table)
+				return WIMLIB_ERR_NOMEM;
+			if (init_inode_table(&group->inode_table, 64)) {
+				free_blob_table(group->blob_table);
+				return WIMLIB_ERR_NOMEM;
+			}
+			INIT_LIST_HEAD(&group->unhashed_blobs);
+			group->dev = dev_valid ? stbuf.st_dev : 0;
+			group->dev_valid = dev_valid;
+			group->first = scan;
+			ps->num_groups++;
+		} else {
+			group->last->next_in_group = scan;
+		}
+		group->last = scan;
+		scan->group = group;
+	}
+	return 0;
+}
+
+/* Execute the add commands @cmds, which should_scan_in_parallel() accepted, by
+ * scanning their sources in parallel and then attaching the branches in order.
+ */
+static int
+execute_add_commands_in_parallel(struct update_command_journal *j,
+				 WIMStruct *wim,
+				 const struct wimlib_update_command *cmds,
+				 size_t num_cmds,
+				 struct wim_inode_table *inode_table,
+				 struct list_head *unhashed_blobs,
+				 struct cached_capture_config *config_cache)
+{
+	struct parallel_scan ps = {
+		.progfunc = wim->progfunc,
+		.progctx = wim->progctx,
+	};
+	struct scan_task tasks[MAX_SCAN_TASKS];
+	struct pool_task *task_ptrs[MAX_SCAN_TASKS];
+	struct source_scan *scans;
+	struct capture_config *config;
+	unsigned num_tasks;
+	int ret;
+
+	ret = load_capture_config(config_cache, cmds[0].add.config_file,
+				  cmds[0].add.add_flags,
+				  cmds[0].add.fs_source_path, &config);
+	if (ret)
+		return ret;
+
+	if (!mutex_init(&ps.progress_lock))
+		return WIMLIB_ERR_NOMEM;
+	ret = WIMLIB_ERR_NOMEM;
+	scans = CALLOC(num_cmds, sizeof(scans[0]));
+	ps.groups = CALLOC(num_cmds, sizeof(ps.groups[0]));
+	if (!scans || !ps.groups)
+		goto out;
+
+	for (size_t i = 0; i < num_cmds; i++)
+		scans[i].cmd = &cmds[i];
+	ret = group_sources(&ps, scans, num_cmds);
+	if (ret)
+		goto out;
+
+	for (size_t i = 0; i < num_cmds; i++) {
+		struct source_scan *scan = &scans[i];
+		struct source_group *group = scan->group;
+
+		init_add_scan_params(&scan->params, wim, scan->cmd,
+				     group->blob_table, &group->inode_table,
+				     NULL, &group->unhashed_blobs);
+		scan->params.config = config;
+		if (scan->params.progfunc) {
+			scan->params.progfunc = locked_progress_func;
+			scan->params.progctx = &ps;
+		}
+		scan->ret = -1;
+	}
+
+	num_tasks = min(min(ps.num_groups, task_pool_num_threads()),
+			MAX_SCAN_TASKS);
+	for (unsigned i = 0; i < num_tasks; i++) {
+		tasks[i].base.run = scan_task_run;
+		tasks[i].ps = &ps;
+		task_ptrs[i] = &tasks[i].base;
+	}
+	task_pool_run_batch(task_ptrs, num_tasks);
+
+	ret = 0;
+	for (size_t i = 0; i < num_cmds; i++) {
+		struct source_scan *scan = &scans[i];
+
+		scan->params.progfunc = wim->progfunc;
+		scan->params.progctx = wim->progctx;
+		if (ret) {
+			free_dentry_tree(scan->branch, scan->params.blob_table);
+			continue;
+		}
+		if (!scan->group->merged)
+			merge_source_group(scan->group, wim, inode_table,
+					   unhashed_blobs);
+		if (scan->ret < 0) {
+			/* Skipped after a failure in a later source; scan it
+			 * now to report the same error as scanning in order
+			 * would.  */
+			scan->ret = scan_source(scan);
+		}
+		ret = scan->ret;
+		if (!ret)
+			ret = attach_added_branch(j, wim, scan->cmd,
+						  scan->branch, &scan->params);
+	}
+out:
+	if (ps.groups) {
+		for (size_t i = 0; i < ps.num_groups; i++) {
+			destroy_inode_table(&ps.groups[i].inode_table);
+			free_blob_table(ps.groups[i].blob_table);
+		}
+		FREE(ps.groups);
+	}
+	if (scans) {
+		for (size_t i = 0; i < num_cmds; i++)
+			FREE(scans[i].params.cur_path);
+		FREE(scans);
+	}
+	mutex_destroy(&ps.progress_lock);
+	return ret;
+}
+
 static bool
 have_command_type(const struct wimlib_update_command *cmds, size_t num_cmds,
 		  enum wimlib_update_op op)
@@ -1100,6 +1607,7 @@ execute_update_commands(WIMStruct *wim,
 	struct wim_sd_set *sd_set;
 	struct list_head unhashed_blobs;
 	struct update_command_journal *j;
+	struct cached_capture_config config_cache = { .valid = false };
 	union wimlib_progress_info info;
 	int ret;
 
@@ -1126,14 +1634,23 @@ execute_update_commands(WIMStruct *wim,
 
 	/* Start an in-memory journal to allow rollback if something goes wrong
 	 */
-	j = new_update_command_journal(num_cmds,
-				       &wim_get_current_image_metadata(wim)->root_dentry,
+	j = new_update_command_journal(&wim_get_current_image_metadata(wim)->root_dentry,
 				       wim->blob_table);
 	if (!j) {
 		ret = WIMLIB_ERR_NOMEM;
 		goto out_destroy_sd_set;
 	}
 
+	if (should_scan_in_parallel(wim, cmds, num_cmds, update_flags)) {
+		ret = execute_add_commands_in_parallel(j, wim, cmds, num_cmds,
+						       inode_table,
+						       &unhashed_blobs,
+						       &config_cache);
+		if (ret)
+			goto rollback;
+		num_cmds = 0;
+	}
+
 	info.update.completed_commands = 0;
 	info.update.total_commands = num_cmds;
 	ret = 0;
@@ -1150,7 +1667,8 @@ execute_update_commands(WIMStruct *wim,
 		switch (cmds[i].op) {
 		case WIMLIB_UPDATE_OP_ADD:
 			ret = execute_add_command(j, wim, &cmds[i], inode_table,
-						  sd_set, &unhashed_blobs);
+						  sd_set, &unhashed_blobs,
+						  &config_cache);
 			break;
 		case WIMLIB_UPDATE_OP_DELETE:
 			ret = execute_delete_command(j, wim, &cmds[i]);
@@ -1169,7 +1687,6 @@ execute_update_commands(WIMStruct *wim,
 			if (ret)
 				goto rollback;
 		}
-		next_command(j);
 	}
 
 	commit_update(j);
@@ -1194,6 +1711,13 @@ out_destroy_inode_table:
 	if (inode_table)
 		destroy_inode_table(inode_table);
 out:
+	if (config_cache.valid)
+		destroy_capture_config(&config_cache.config);
+#ifdef _WIN32
+	/* Sources on the same volume share a snapshot only within one update
+	 * operation, so that later ones see a fresh snapshot.  */
+	vss_release_cached_snapshots();
+#endif
 	return ret;
 }
 
@@ -1224,7 +1748,14 @@ check_add_command(struct wimlib_update_command *cmd,
 		#ifdef ENABLE_TEST_SUPPORT
 			  WIMLIB_ADD_FLAG_GENERATE_TEST_DATA |
 		#endif
-			  WIMLIB_ADD_FLAG_FILE_PATHS_UNNEEDED))
+			  WIMLIB_ADD_FLAG_FILE_PATHS_UNNEEDED |
+			  WIMLIB_ADD_FLAG_OVERLAPPED_READS |
+			  WIMLIB_ADD_FLAG_TAR |
+			  WIMLIB_ADD_FLAG_DISK_ORDER))
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if ((add_flags & (WIMLIB_ADD_FLAG_NTFS | WIMLIB_ADD_FLAG_TAR)) ==
+	    (WIMLIB_ADD_FLAG_NTFS | WIMLIB_ADD_FLAG_TAR))
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	bool is_entire_image = WIMLIB_IS_WIM_ROOT_PATH(cmd->add.wim_target_path);
@@ -1247,6 +1778,10 @@ check_add_command(struct wimlib_update_command *cmd,
 		ERROR("Dereferencing symbolic links is not supported on Windows");
 		return WIMLIB_ERR_UNSUPPORTED;
 	}
+	if (add_flags & WIMLIB_ADD_FLAG_TAR) {
+		ERROR("Capturing tar archives is not supported on Windows");
+		return WIMLIB_ERR_UNSUPPORTED;
+	}
 #else
 	/* Check for flags only supported on Windows.  */
 
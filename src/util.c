@@ -26,6 +26,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#if defined(HAVE_MALLOC_USABLE_SIZE) || defined(_WIN32)
+#  include <malloc.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,12 +39,23 @@
 #ifdef HAVE_SYS_SYSCALL_H
 #  include <sys/syscall.h>
 #endif
+#ifdef HAVE_MMAP
+#  include <sys/mman.h>
+#endif
 #include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#  include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_SVE)
+#  include <arm_sve.h>
+#endif
 
 #include "wimlib.h"
 #include "wimlib/assert.h"
+#include "wimlib/cpu_features.h"
 #include "wimlib/error.h"
 #include "wimlib/timestamp.h"
+#include "wimlib/unaligned.h"
 #include "wimlib/util.h"
 
 /*******************
@@ -52,6 +66,55 @@ static void *(*wimlib_malloc_func) (size_t)	    = malloc;
 static void  (*wimlib_free_func)   (void *)	    = free;
 static void *(*wimlib_realloc_func)(void *, size_t) = realloc;
 
+/*
+ * The number of bytes currently allocated through the functions below, and the
+ * limit set by wimlib_set_memory_budget() (0 if none).  The usage can only be
+ * tracked if the C library can report the size of an allocation, and only
+ * while the default allocator is in use, since other allocators can't be asked
+ * about the sizes of their allocations.
+ */
+#if defined(HAVE_MALLOC_USABLE_SIZE) || defined(_WIN32)
+#  define TRACK_MEMORY_USAGE 1
+#endif
+static u64 memory_usage;
+static u64 memory_budget;
+#ifdef TRACK_MEMORY_USAGE
+static bool memory_usage_tracked = true;
+#else
+static const bool memory_usage_tracked = false;
+#endif
+
+#ifdef TRACK_MEMORY_USAGE
+static size_t
+malloc_size_of(void *ptr)
+{
+#ifdef _WIN32
+	return _msize(ptr);
+#else
+	return malloc_usable_size(ptr);
+#endif
+}
+
+static void
+account_alloc(void *ptr)
+{
+	if (ptr && memory_usage_tracked)
+		__atomic_fetch_add(&memory_usage, malloc_size_of(ptr),
+				   __ATOMIC_RELAXED);
+}
+
+static void
+account_free(void *ptr)
+{
+	if (ptr && memory_usage_tracked)
+		__atomic_fetch_sub(&memory_usage, malloc_size_of(ptr),
+				   __ATOMIC_RELAXED);
+}
+#else
+static inline void account_alloc(void *ptr) { }
+static inline void account_free(void *ptr) { }
+#endif
+
 void *
 wimlib_malloc(size_t size)
 {
@@ -65,21 +128,37 @@ retry:
 			goto retry;
 		}
 	}
+	account_alloc(ptr);
 	return ptr;
 }
 
 void
 wimlib_free_memory(void *ptr)
 {
+	account_free(ptr);
 	(*wimlib_free_func)(ptr);
 }
 
 void *
 wimlib_realloc(void *ptr, size_t size)
 {
+	size_t old_size = 0;
+	void *new_ptr;
+
 	if (size == 0)
 		size = 1;
-	return (*wimlib_realloc_func)(ptr, size);
+#ifdef TRACK_MEMORY_USAGE
+	if (ptr && memory_usage_tracked)
+		old_size = malloc_size_of(ptr);
+#endif
+	new_ptr = (*wimlib_realloc_func)(ptr, size);
+	if (new_ptr) {
+		if (old_size)
+			__atomic_fetch_sub(&memory_usage, old_size,
+					   __ATOMIC_RELAXED);
+		account_alloc(new_ptr);
+	}
+	return new_ptr;
 }
 
 void *
@@ -134,6 +213,33 @@ wimlib_aligned_free(void *ptr)
 		FREE(((void **)ptr)[-1]);
 }
 
+#define HUGE_PAGE_SIZE	((uintptr_t)2 << 20)
+
+/*
+ * Allocate memory for a large table that is accessed randomly, such as a
+ * matchfinder's hash table or suffix array.  This is the same as MALLOC(),
+ * except that the kernel is advised to back the huge-page-aligned part of the
+ * memory with transparent huge pages where supported, which saves many TLB
+ * misses.  Whether this is honored is up to the system's transparent huge page
+ * setting.  The memory is freed with FREE() as usual.
+ */
+void *
+wimlib_large_malloc(size_t size)
+{
+	void *ptr = MALLOC(size);
+
+#if defined(HAVE_MMAP) && defined(MADV_HUGEPAGE)
+	if (ptr && size >= HUGE_PAGE_SIZE) {
+		uintptr_t start = ALIGN((uintptr_t)ptr, HUGE_PAGE_SIZE);
+		uintptr_t end = ((uintptr_t)ptr + size) & ~(HUGE_PAGE_SIZE - 1);
+
+		if (end > start)
+			(void)madvise((void *)start, end - start, MADV_HUGEPAGE);
+	}
+#endif
+	return ptr;
+}
+
 void *
 memdup(const void *mem, size_t size)
 {
@@ -143,6 +249,25 @@ memdup(const void *mem, size_t size)
 	return ptr;
 }
 
+#ifndef _WIN32
+/* Like realpath(@path, NULL), but the result is allocated with MALLOC(), so it
+ * must be freed with FREE().  */
+char *
+wimlib_realpath(const char *path)
+{
+	char *p = realpath(path, NULL);
+	char *ret;
+
+	if (!p)
+		return NULL;
+	ret = STRDUP(p);
+	free(p);
+	if (!ret)
+		errno = ENOMEM;
+	return ret;
+}
+#endif
+
 /* API function documented in wimlib.h  */
 WIMLIBAPI int
 wimlib_set_memory_allocator(void *(*malloc_func)(size_t),
@@ -152,9 +277,53 @@ wimlib_set_memory_allocator(void *(*malloc_func)(size_t),
 	wimlib_malloc_func  = malloc_func  ? malloc_func  : malloc;
 	wimlib_free_func    = free_func    ? free_func    : free;
 	wimlib_realloc_func = realloc_func ? realloc_func : realloc;
+
+	/* Memory from a custom allocator can't be measured.  Once one has been
+	 * used, the count is permanently unreliable, since memory allocated
+	 * before the switch may be freed after it.  */
+#ifdef TRACK_MEMORY_USAGE
+	if (malloc_func || free_func || realloc_func)
+		memory_usage_tracked = false;
+#endif
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_memory_budget(uint64_t max_memory)
+{
+	__atomic_store_n(&memory_budget, max_memory, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_get_memory_usage(uint64_t *usage_ret)
+{
+	if (!memory_usage_tracked)
+		return WIMLIB_ERR_UNSUPPORTED;
+	*usage_ret = __atomic_load_n(&memory_usage, __ATOMIC_RELAXED);
 	return 0;
 }
 
+/*
+ * Return how many more bytes may be allocated before the memory budget set by
+ * wimlib_set_memory_budget() is reached, or UINT64_MAX if there is no budget or
+ * the memory usage isn't being tracked.  This is only a hint for choosing the
+ * sizes of buffers and caches; allocations beyond the budget still succeed.
+ */
+u64
+get_memory_budget_remaining(void)
+{
+	u64 budget = __atomic_load_n(&memory_budget, __ATOMIC_RELAXED);
+	u64 usage;
+
+	if (budget == 0 || !memory_usage_tracked)
+		return UINT64_MAX;
+	usage = __atomic_load_n(&memory_usage, __ATOMIC_RELAXED);
+	return (usage < budget) ? budget - usage : 0;
+}
+
 /*******************
  * String utilities
  *******************/
@@ -166,6 +335,151 @@ void *mempcpy(void *dst, const void *src, size_t n)
 }
 #endif
 
+/*
+ * Return true if all bytes in the buffer are zero.  This is used on whole
+ * chunks of data, e.g. to find the holes of sparse files, so it checks 64 bytes
+ * at a time, which is still fine-grained enough to give up quickly on data that
+ * isn't all zeroes.  The implementation is selected by the "zero_scan" kernel.
+ */
+
+static bool
+is_all_zeroes_tail(const u8 *p, const u8 *end)
+{
+	for (; p != end; p++)
+		if (*p)
+			return false;
+	return true;
+}
+
+static bool
+is_all_zeroes_generic(const u8 *p, size_t size)
+{
+	const u8 * const end = p + size;
+
+	for (; end - p >= 8 * WORDBYTES; p += 8 * WORDBYTES) {
+		machine_word_t v = 0;
+
+		for (int i = 0; i < 8; i++)
+			v |= load_word_unaligned(&p[i * WORDBYTES]);
+		if (v)
+			return false;
+	}
+	return is_all_zeroes_tail(p, end);
+}
+
+#ifdef __SSE2__
+static bool
+is_all_zeroes_sse2(const u8 *p, size_t size)
+{
+	const u8 * const end = p + size;
+
+	for (; end - p >= 64; p += 64) {
+		__m128i v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)&p[0]),
+				     _mm_loadu_si128((const __m128i *)&p[16])),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)&p[32]),
+				     _mm_loadu_si128((const __m128i *)&p[48])));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) !=
+		    0xFFFF)
+			return false;
+	}
+	return is_all_zeroes_tail(p, end);
+}
+#endif /* __SSE2__ */
+
+#if defined(__i386__) || defined(__x86_64__)
+static bool __attribute__((target("avx2")))
+is_all_zeroes_avx2(const u8 *p, size_t size)
+{
+	const u8 * const end = p + size;
+
+	for (; end - p >= 64; p += 64) {
+		__m256i v = _mm256_or_si256(
+				_mm256_loadu_si256((const __m256i *)&p[0]),
+				_mm256_loadu_si256((const __m256i *)&p[32]));
+
+		if (!_mm256_testz_si256(v, v))
+			return false;
+	}
+	return is_all_zeroes_tail(p, end);
+}
+
+static bool __attribute__((target("avx512f")))
+is_all_zeroes_avx512(const u8 *p, size_t size)
+{
+	const u8 * const end = p + size;
+
+	for (; end - p >= 64; p += 64) {
+		__m512i v = _mm512_loadu_si512(p);
+
+		if (_mm512_test_epi64_mask(v, v))
+			return false;
+	}
+	return is_all_zeroes_tail(p, end);
+}
+#endif /* x86 */
+
+/*
+ * SVE isn't detected at runtime when the compiler doesn't target it, since the
+ * SVE intrinsics can only be used then.
+ */
+#if defined(__aarch64__) && defined(__ARM_FEATURE_SVE)
+static bool
+is_all_zeroes_sve(const u8 *p, size_t size)
+{
+	for (size_t i = 0; i < size; i += svcntb()) {
+		svbool_t pg = svwhilelt_b8_u64(i, size);
+
+		if (svptest_any(pg, svcmpne_n_u8(pg, svld1_u8(pg, &p[i]), 0)))
+			return false;
+	}
+	return true;
+}
+#endif
+
+typedef bool (*is_all_zeroes_func_t)(const u8 *p, size_t size);
+
+static is_all_zeroes_func_t is_all_zeroes_func =
+#ifdef __SSE2__
+	is_all_zeroes_sse2;
+#else
+	is_all_zeroes_generic;
+#endif
+
+static const struct cpu_impl zero_scan_impls[] = {
+#if defined(__i386__) || defined(__x86_64__)
+	{ "avx512", (cpu_func_t)is_all_zeroes_avx512, X86_CPU_FEATURE_AVX512F },
+	{ "avx2", (cpu_func_t)is_all_zeroes_avx2, X86_CPU_FEATURE_AVX2 },
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_SVE)
+	{ "sve", (cpu_func_t)is_all_zeroes_sve, ARM_CPU_FEATURE_SVE },
+#endif
+#ifdef __SSE2__
+	{ "sse2", (cpu_func_t)is_all_zeroes_sse2, 0 },
+#endif
+	{ "generic", (cpu_func_t)is_all_zeroes_generic, 0 },
+};
+
+static void
+zero_scan_select(const struct cpu_impl *impl)
+{
+	is_all_zeroes_func = (is_all_zeroes_func_t)impl->func;
+}
+
+const struct cpu_kernel zero_scan_kernel = {
+	.name = "zero_scan",
+	.impls = zero_scan_impls,
+	.num_impls = ARRAY_LEN(zero_scan_impls),
+	.select = zero_scan_select,
+};
+
+bool
+is_all_zeroes(const u8 *p, size_t size)
+{
+	return (*is_all_zeroes_func)(p, size);
+}
+
 /**************************
  * Random number generation
  **************************/
@@ -286,7 +600,7 @@ get_available_cpus(void)
 
 #ifndef _WIN32
 u64
-get_available_memory(void)
+get_physical_memory(void)
 {
 #if defined(_SC_PAGESIZE) && defined(_SC_PHYS_PAGES)
 	long page_size = sysconf(_SC_PAGESIZE);
@@ -308,3 +622,23 @@ default_size:
 	return (u64)1 << 30;
 }
 #endif /* !_WIN32 */
+
+/* Minimum amount of memory which get_available_memory() reports, so that an
+ * exhausted budget still lets operations run, just without extra buffers.  */
+#define MIN_AVAILABLE_MEMORY	((u64)16 << 20)
+
+/*
+ * Return the amount of memory which an operation may plan to use for buffers,
+ * threads, and caches: the physical memory, limited by what is left of the
+ * memory budget, if one was set with wimlib_set_memory_budget().
+ */
+u64
+get_available_memory(void)
+{
+	u64 avail = get_physical_memory();
+	u64 remaining = get_memory_budget_remaining();
+
+	if (remaining < avail)
+		avail = max(remaining, MIN_AVAILABLE_MEMORY);
+	return avail;
+}
@@ -30,7 +30,15 @@
 #include "wimlib/error.h"
 #include "wimlib/metadata.h"
 #include "wimlib/progress.h"
+#include "wimlib/resource.h"
 #include "wimlib/security.h"
+#include "wimlib/sha1.h"
+#include "wimlib/util.h"
+#include "wimlib/verify_cache.h"
+
+/* Maximum number of blobs whose SHA-1 message digests are computed at the same
+ * time  */
+#define MAX_HASHERS	8
 
 static int
 append_blob_to_list(struct blob_descriptor *blob, void *_list)
@@ -39,13 +47,118 @@ append_blob_to_list(struct blob_descriptor *blob, void *_list)
 	return 0;
 }
 
+/*
+ * When verifying with multiple threads, the SHA-1 message digests are computed
+ * on the task pool, while the calling thread only reads (and, with the WIM's
+ * parallel decompressor, decompresses) the data.  SHA-1 can't be parallelized
+ * within a blob, so the blobs are assigned to hashers in turn, each of which
+ * hashes one blob at a time through a hash pipeline.  A blob's digest is only
+ * checked when its hasher is needed again, or at the end.
+ */
+struct verify_hasher {
+	struct hash_pipeline *pipeline;
+	struct sha1_ctx sha_ctx;
+
+	/* The blob being hashed, or NULL  */
+	struct blob_descriptor *blob;
+};
+
 struct verify_blob_list_ctx {
 	wimlib_progress_func_t progfunc;
 	void *progctx;
 	union wimlib_progress_info *progress;
 	u64 next_progress;
+	struct progress_throttle throttle;
+	struct verify_hasher hashers[MAX_HASHERS];
+	unsigned num_hashers;
+	unsigned next_hasher;
+	struct verify_hasher *cur_hasher;
 };
 
+/* Wait for the hasher to finish its blob, if any, and check the blob's SHA-1
+ * message digest.  */
+static int
+finish_verify_hasher(struct verify_hasher *h)
+{
+	struct blob_descriptor *blob = h->blob;
+	u8 hash[SHA1_HASH_SIZE];
+
+	if (!blob)
+		return 0;
+	h->blob = NULL;
+	hash_pipeline_wait(h->pipeline);
+	sha1_final(&h->sha_ctx, hash);
+	if (!hashes_equal(hash, blob->hash))
+		return report_sha1_mismatch(blob, hash, false);
+	return 0;
+}
+
+/* Create up to @num_hashers hashers.  Returns false if fewer than two could be
+ * created, in which case the caller should just hash the data itself.  */
+static bool
+init_verify_hashers(struct verify_blob_list_ctx *ctx, unsigned num_hashers)
+{
+	num_hashers = min(num_hashers, MAX_HASHERS);
+	ctx->num_hashers = 0;
+	ctx->next_hasher = 0;
+	while (ctx->num_hashers < num_hashers) {
+		struct verify_hasher *h = &ctx->hashers[ctx->num_hashers];
+
+		h->pipeline = new_hash_pipeline(&h->sha_ctx);
+		if (!h->pipeline)
+			break;
+		h->blob = NULL;
+		ctx->num_hashers++;
+	}
+	return ctx->num_hashers >= 2;
+}
+
+/* Free the hashers.  With @check, first check the digests of the blobs which
+ * are still being hashed, and return the status of that.  */
+static int
+destroy_verify_hashers(struct verify_blob_list_ctx *ctx, bool check)
+{
+	int ret = 0;
+
+	for (unsigned i = 0; i < ctx->num_hashers; i++) {
+		struct verify_hasher *h = &ctx->hashers[i];
+
+		if (check && !ret)
+			ret = finish_verify_hasher(h);
+		free_hash_pipeline(h->pipeline);
+	}
+	ctx->num_hashers = 0;
+	return ret;
+}
+
+static int
+verify_begin_blob(struct blob_descriptor *blob, void *_ctx)
+{
+	struct verify_blob_list_ctx *ctx = _ctx;
+	struct verify_hasher *h = &ctx->hashers[ctx->next_hasher];
+	int ret;
+
+	ctx->next_hasher = (ctx->next_hasher + 1) % ctx->num_hashers;
+	ret = finish_verify_hasher(h);
+	if (ret)
+		return ret;
+	sha1_init(&h->sha_ctx);
+	h->blob = blob;
+	ctx->cur_hasher = h;
+	return 0;
+}
+
+static int
+verify_end_blob(struct blob_descriptor *blob, int status, void *_ctx)
+{
+	struct verify_blob_list_ctx *ctx = _ctx;
+
+	if (status)
+		return status;
+	hash_pipeline_flush(ctx->cur_hasher->pipeline);
+	return 0;
+}
+
 static int
 verify_continue_blob(const struct blob_descriptor *blob, u64 offset,
 		     const void *chunk, size_t size, void *_ctx)
@@ -53,13 +166,23 @@ verify_continue_blob(const struct blob_descriptor *blob, u64 offset,
 	struct verify_blob_list_ctx *ctx = _ctx;
 	union wimlib_progress_info *progress = ctx->progress;
 
+	if (ctx->num_hashers) {
+		int ret = hash_pipeline_update(ctx->cur_hasher->pipeline,
+					       chunk, size);
+		if (ret)
+			return ret;
+	}
+
 	if (offset + size == blob->size)
 		progress->verify_streams.completed_streams++;
 
 	progress->verify_streams.completed_bytes += size;
 
-	if (progress->verify_streams.completed_bytes >= ctx->next_progress) {
-
+	if (progress->verify_streams.completed_bytes >= ctx->next_progress &&
+	    progress_throttle_due(&ctx->throttle,
+				  progress->verify_streams.completed_bytes >=
+				  progress->verify_streams.total_bytes))
+	{
 		int ret = call_progress(ctx->progfunc,
 					WIMLIB_PROGRESS_MSG_VERIFY_STREAMS,
 					progress, ctx->progctx);
@@ -96,7 +219,9 @@ wimlib_verify_wim(WIMStruct *wim, int verify_flags)
 	LIST_HEAD(blob_list);
 	union wimlib_progress_info progress;
 	struct verify_blob_list_ctx ctx;
-	struct blob_descriptor *blob;
+	struct blob_descriptor *blob, *tmp;
+	struct verify_cache cache;
+	unsigned num_threads;
 	struct read_blob_callbacks cbs = {
 		.continue_blob	= verify_continue_blob,
 		.ctx		= &ctx,
@@ -107,7 +232,8 @@ wimlib_verify_wim(WIMStruct *wim, int verify_flags)
 	if (!wim)
 		return WIMLIB_ERR_INVALID_PARAM;
 
-	if (verify_flags)
+	if (verify_flags & ~(WIMLIB_VERIFY_FLAG_USE_CACHE |
+			     WIMLIB_VERIFY_FLAG_FORCE))
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	/* Verify the images  */
@@ -127,6 +253,11 @@ wimlib_verify_wim(WIMStruct *wim, int verify_flags)
 			if (ret)
 				return ret;
 
+			ret = load_wim_images_ahead(wim, i,
+						    wim->hdr.image_count);
+			if (ret)
+				return ret;
+
 			ret = select_wim_image(wim, i);
 			if (ret)
 				return ret;
@@ -162,13 +293,58 @@ wimlib_verify_wim(WIMStruct *wim, int verify_flags)
 	ctx.progctx = wim->progctx;
 	ctx.progress = &progress;
 	ctx.next_progress = 0;
+	progress_throttle_init(&ctx.throttle, wim->progress_interval_ms);
+
+	/* Skip the blobs which an earlier verification found to be intact  */
+	if (verify_flags & WIMLIB_VERIFY_FLAG_USE_CACHE) {
+		ret = load_verify_cache(&cache, wim,
+					verify_flags & WIMLIB_VERIFY_FLAG_FORCE);
+		if (ret)
+			return ret;
+		list_for_each_entry_safe(blob, tmp, &blob_list, extraction_list) {
+			if (verify_cache_contains(&cache, blob, wim)) {
+				list_del(&blob->extraction_list);
+				progress.verify_streams.completed_streams++;
+				progress.verify_streams.completed_bytes += blob->size;
+			}
+		}
+	}
 
 	ret = call_progress(ctx.progfunc, WIMLIB_PROGRESS_MSG_VERIFY_STREAMS,
 			    ctx.progress, ctx.progctx);
 	if (ret)
-		return ret;
+		goto out;
+
+	/* Compute the SHA-1 message digests in other threads if the WIM is set
+	 * up to decompress data with multiple threads.  */
+	num_threads = wim->num_decompression_threads;
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+	ctx.num_hashers = 0;
+	if (num_threads > 1 && init_verify_hashers(&ctx, num_threads)) {
+		int status;
+
+		cbs.begin_blob = verify_begin_blob;
+		cbs.end_blob = verify_end_blob;
+		ret = read_blob_list(&blob_list,
+				     offsetof(struct blob_descriptor,
+					      extraction_list),
+				     &cbs, 0, 0);
+		status = destroy_verify_hashers(&ctx, !ret);
+		if (!ret)
+			ret = status;
+	} else {
+		destroy_verify_hashers(&ctx, false);
+		ret = read_blob_list(&blob_list,
+				     offsetof(struct blob_descriptor,
+					      extraction_list),
+				     &cbs, VERIFY_BLOB_HASHES, 0);
+	}
 
-	return read_blob_list(&blob_list,
-			      offsetof(struct blob_descriptor, extraction_list),
-			      &cbs, VERIFY_BLOB_HASHES);
+	if (!ret && (verify_flags & WIMLIB_VERIFY_FLAG_USE_CACHE))
+		save_verify_cache(&cache, wim);
+out:
+	if (verify_flags & WIMLIB_VERIFY_FLAG_USE_CACHE)
+		destroy_verify_cache(&cache);
+	return ret;
 }
@@ -0,0 +1,314 @@
+/*
+ * verify_cache.c
+ *
+ * A record of the blobs of a WIM file which have already been verified, so
+ * that wimlib_verify_wim() with WIMLIB_VERIFY_FLAG_USE_CACHE can skip them.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wimlib/blob_table.h"
+#include "wimlib/endianness.h"
+#include "wimlib/error.h"
+#include "wimlib/file_io.h"
+#include "wimlib/resource.h"
+#include "wimlib/sha1.h"
+#include "wimlib/util.h"
+#include "wimlib/verify_cache.h"
+#include "wimlib/wim.h"
+#include "wimlib/win32.h" /* win32_rename_replacement() */
+
+/*
+ * The cache file is named after the WIM file, with VERIFY_CACHE_SUFFIX
+ * appended.  It consists of a header followed by one entry for each blob that
+ * was verified.
+ *
+ * An entry identifies a blob by its SHA-1 message digest together with the
+ * location of its data: the resource header of the resource containing it and
+ * its offset in that resource.  The blob is only skipped if all of these are
+ * unchanged, so appending to the WIM doesn't invalidate the entries of the
+ * blobs that were already there.  But rewriting the WIM usually creates a new
+ * file, which the device and inode numbers in the header detect; then the whole
+ * cache is ignored.  Corruption of data which wasn't otherwise modified can't be
+ * detected this way, of course, which is why the cache is only used on request.
+ */
+
+#define VERIFY_CACHE_SUFFIX	T(".verify-cache")
+#define VERIFY_CACHE_MAGIC	0x45484341434656ULL	/* "VFCACHE" */
+#define VERIFY_CACHE_VERSION	1
+
+struct verify_cache_header {
+	le64 magic;
+	le32 version;
+	le32 entry_size;
+	le64 dev;
+	le64 ino;
+	le64 num_entries;
+} __attribute__((packed));
+
+struct verify_cache_entry {
+	le64 res_offset_in_wim;
+	le64 res_size_in_wim;
+	le64 res_uncompressed_size;
+	le64 offset_in_res;
+	le64 size;
+	le32 res_flags;
+	u8 hash[SHA1_HASH_SIZE];
+} __attribute__((packed));
+
+static int
+cmp_verify_cache_entries(const void *p1, const void *p2)
+{
+	return memcmp(p1, p2, sizeof(struct verify_cache_entry));
+}
+
+/* Returns false if the blob's data isn't in the WIM file itself.  */
+static bool
+make_verify_cache_entry(struct verify_cache_entry *entry,
+			const struct blob_descriptor *blob, const WIMStruct *wim)
+{
+	const struct wim_resource_descriptor *rdesc;
+
+	if (blob->blob_location != BLOB_IN_WIM || blob->rdesc->wim != wim)
+		return false;
+	rdesc = blob->rdesc;
+	entry->res_offset_in_wim = cpu_to_le64(rdesc->offset_in_wim);
+	entry->res_size_in_wim = cpu_to_le64(rdesc->size_in_wim);
+	entry->res_uncompressed_size = cpu_to_le64(rdesc->uncompressed_size);
+	entry->offset_in_res = cpu_to_le64(blob->offset_in_res);
+	entry->size = cpu_to_le64(blob->size);
+	entry->res_flags = cpu_to_le32(rdesc->flags);
+	copy_hash(entry->hash, blob->hash);
+	return true;
+}
+
+static void
+read_verify_cache_file(struct verify_cache *cache)
+{
+	struct verify_cache_header hdr;
+	struct filedes fd;
+	struct stat st;
+	int raw_fd;
+	u64 num_entries;
+
+	raw_fd = topen(cache->path, O_RDONLY | O_BINARY);
+	if (raw_fd < 0) {
+		if (errno != ENOENT)
+			WARNING_WITH_ERRNO("Can't open \"%"TS"\"", cache->path);
+		return;
+	}
+	filedes_init(&fd, raw_fd);
+
+	if (fstat(raw_fd, &st) || full_read(&fd, &hdr, sizeof(hdr)))
+		goto bad_cache;
+	if (le64_to_cpu(hdr.magic) != VERIFY_CACHE_MAGIC ||
+	    le32_to_cpu(hdr.version) != VERIFY_CACHE_VERSION ||
+	    le32_to_cpu(hdr.entry_size) != sizeof(struct verify_cache_entry))
+		goto bad_cache;
+
+	/* A cache for a different file is stale, not invalid.  */
+	if (le64_to_cpu(hdr.dev) != cache->dev ||
+	    le64_to_cpu(hdr.ino) != cache->ino)
+		goto out_close;
+
+	num_entries = le64_to_cpu(hdr.num_entries);
+	if (num_entries > ((u64)st.st_size - sizeof(hdr)) /
+			  sizeof(struct verify_cache_entry))
+		goto bad_cache;
+	cache->entries = MALLOC(num_entries * sizeof(cache->entries[0]));
+	if (!cache->entries) {
+		WARNING("Not enough memory to load \"%"TS"\"", cache->path);
+		goto out_close;
+	}
+	if (full_read(&fd, cache->entries,
+		      num_entries * sizeof(cache->entries[0]))) {
+		FREE(cache->entries);
+		cache->entries = NULL;
+		goto bad_cache;
+	}
+	cache->num_entries = num_entries;
+	qsort(cache->entries, num_entries, sizeof(cache->entries[0]),
+	      cmp_verify_cache_entries);
+	goto out_close;
+
+bad_cache:
+	WARNING("Ignoring invalid verification cache \"%"TS"\"", cache->path);
+out_close:
+	filedes_close(&fd);
+}
+
+/*
+ * Prepare the verification cache for @wim.  Unless @ignore_old is set, the
+ * entries recorded by earlier verifications of the same file are loaded.
+ *
+ * Problems with the cache file itself aren't errors, since at worst they cause
+ * more blobs to be verified; the only error returned is WIMLIB_ERR_NOMEM.
+ */
+int
+load_verify_cache(struct verify_cache *cache, WIMStruct *wim, bool ignore_old)
+{
+	struct stat st;
+	size_t len;
+
+	memset(cache, 0, sizeof(*cache));
+
+	if (!wim->filename || !filedes_valid(&wim->in_fd) ||
+	    wim->in_fd.fd < 0 || wim->in_fd.is_pipe ||
+	    fstat(wim->in_fd.fd, &st))
+		return 0;
+
+	len = tstrlen(wim->filename);
+	cache->path = MALLOC((len + ARRAY_LEN(VERIFY_CACHE_SUFFIX)) *
+			     sizeof(tchar));
+	if (!cache->path)
+		return WIMLIB_ERR_NOMEM;
+	tmemcpy(cache->path, wim->filename, len);
+	tmemcpy(cache->path + len, VERIFY_CACHE_SUFFIX,
+		ARRAY_LEN(VERIFY_CACHE_SUFFIX));
+	cache->dev = st.st_dev;
+	cache->ino = st.st_ino;
+
+	if (!ignore_old)
+		read_verify_cache_file(cache);
+	return 0;
+}
+
+/* Returns true if @blob, in @wim, was verified by an earlier verification.  */
+bool
+verify_cache_contains(const struct verify_cache *cache,
+		      const struct blob_descriptor *blob, const WIMStruct *wim)
+{
+	struct verify_cache_entry key;
+
+	if (!cache->num_entries || !make_verify_cache_entry(&key, blob, wim))
+		return false;
+	return bsearch(&key, cache->entries, cache->num_entries,
+		       sizeof(cache->entries[0]), cmp_verify_cache_entries);
+}
+
+struct save_verify_cache_ctx {
+	WIMStruct *wim;
+	struct verify_cache_entry *entries;
+	size_t num_entries;
+};
+
+static int
+count_blob(struct blob_descriptor *blob, void *_count)
+{
+	(*(size_t *)_count)++;
+	return 0;
+}
+
+static int
+add_verify_cache_entry(struct blob_descriptor *blob, void *_ctx)
+{
+	struct save_verify_cache_ctx *ctx = _ctx;
+
+	if (make_verify_cache_entry(&ctx->entries[ctx->num_entries], blob,
+				    ctx->wim))
+		ctx->num_entries++;
+	return 0;
+}
+
+/*
+ * Record all blobs of @wim as verified, replacing the cache file.  This must
+ * only be called after all the blobs have been verified successfully.  Failing
+ * to write the cache isn't an error, since the verification itself succeeded.
+ */
+void
+save_verify_cache(const struct verify_cache *cache, WIMStruct *wim)
+{
+	struct save_verify_cache_ctx ctx;
+	struct verify_cache_header hdr;
+	struct filedes fd;
+	size_t path_len;
+	int raw_fd;
+	int ret;
+
+	if (!cache->path)
+		return;
+
+	ctx.wim = wim;
+	ctx.num_entries = 0;
+	for_blob_in_table(wim->blob_table, count_blob, &ctx.num_entries);
+	ctx.entries = MALLOC(ctx.num_entries * sizeof(ctx.entries[0]));
+	if (!ctx.entries) {
+		WARNING("Not enough memory to save \"%"TS"\"", cache->path);
+		return;
+	}
+	ctx.num_entries = 0;
+	for_blob_in_table(wim->blob_table, add_verify_cache_entry, &ctx);
+
+	hdr.magic = cpu_to_le64(VERIFY_CACHE_MAGIC);
+	hdr.version = cpu_to_le32(VERIFY_CACHE_VERSION);
+	hdr.entry_size = cpu_to_le32(sizeof(struct verify_cache_entry));
+	hdr.dev = cpu_to_le64(cache->dev);
+	hdr.ino = cpu_to_le64(cache->ino);
+	hdr.num_entries = cpu_to_le64(ctx.num_entries);
+
+	/* Write a temporary file and rename it over the old cache, so that an
+	 * interrupted write can't leave a truncated cache behind.  */
+	path_len = tstrlen(cache->path);
+	tchar tmpfile[path_len + 10];
+	tmemcpy(tmpfile, cache->path, path_len);
+	get_random_alnum_chars(tmpfile + path_len, 9);
+	tmpfile[path_len + 9] = T('\0');
+
+	raw_fd = topen(tmpfile, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644);
+	if (raw_fd < 0) {
+		WARNING_WITH_ERRNO("Can't create \"%"TS"\"", tmpfile);
+		goto out_free_entries;
+	}
+	filedes_init(&fd, raw_fd);
+	ret = full_write(&fd, &hdr, sizeof(hdr));
+	if (!ret)
+		ret = full_write(&fd, ctx.entries,
+				 ctx.num_entries * sizeof(ctx.entries[0]));
+	if (filedes_close(&fd) && !ret)
+		ret = WIMLIB_ERR_WRITE;
+	if (ret) {
+		WARNING_WITH_ERRNO("Error writing \"%"TS"\"", tmpfile);
+		tunlink(tmpfile);
+		goto out_free_entries;
+	}
+	if (trename(tmpfile, cache->path)) {
+		WARNING_WITH_ERRNO("Failed to rename \"%"TS"\" to \"%"TS"\"",
+				   tmpfile, cache->path);
+		tunlink(tmpfile);
+	}
+out_free_entries:
+	FREE(ctx.entries);
+}
+
+void
+destroy_verify_cache(struct verify_cache *cache)
+{
+	FREE(cache->entries);
+	FREE(cache->path);
+}
@@ -31,15 +31,25 @@
 
 #include "wimlib.h"
 #include "wimlib/assert.h"
+#include "wimlib/async.h"
+#include "wimlib/blob_cache.h"
 #include "wimlib/blob_table.h"
+#include "wimlib/chunk_cache.h"
+#include "wimlib/chunk_decompressor.h"
+#include "wimlib/codec_cache.h"
 #include "wimlib/cpu_features.h"
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
 #include "wimlib/file_io.h"
+#include "wimlib/hash_cache.h"
 #include "wimlib/integrity.h"
 #include "wimlib/metadata.h"
+#include "wimlib/open_wim_cache.h"
+#include "wimlib/resource.h"
 #include "wimlib/security.h"
+#include "wimlib/task_pool.h"
 #include "wimlib/threads.h"
+#include "wimlib/trace.h"
 #include "wimlib/wim.h"
 #include "wimlib/xml.h"
 #include "wimlib/win32.h"
@@ -82,6 +92,12 @@ static const struct {
 	},
 };
 
+/* Default minimum uncompressed size of each solid resource when the solid data
+ * is split so that several resources can be compressed in parallel.  The split
+ * depends on the number of threads, so it's off by default, to keep the output
+ * the same on every machine.  */
+#define DEFAULT_SOLID_MIN_RESOURCE_SIZE	0
+
 /* Is the specified compression type valid?  */
 static bool
 wim_compression_type_valid(enum wimlib_compression_type ctype)
@@ -147,9 +163,11 @@ new_wim_struct(void)
 	wim->refcnt = 1;
 	filedes_invalidate(&wim->in_fd);
 	filedes_invalidate(&wim->out_fd);
+	wim->num_decompression_threads = 1;
 	wim->out_solid_compression_type = wim_default_solid_compression_type();
 	wim->out_solid_chunk_size = wim_default_solid_chunk_size(
 					wim->out_solid_compression_type);
+	wim->out_solid_min_res_size = DEFAULT_SOLID_MIN_RESOURCE_SIZE;
 	return wim;
 }
 
@@ -202,11 +220,37 @@ unload_image_metadata(struct wim_image_metadata *imd)
 {
 	free_dentry_tree(imd->root_dentry, NULL);
 	imd->root_dentry = NULL;
+	arena_destroy(&imd->arena);
 	free_wim_security_data(imd->security_data);
 	imd->security_data = NULL;
 	INIT_HLIST_HEAD(&imd->inode_list);
 }
 
+/* Mark the metadata for the specified WIM image "dirty" following changes to
+ * the image's directory tree.  This records that the metadata no longer matches
+ * the version in the WIM file (if any) and that its stats are out of date.  */
+void
+mark_image_dirty(struct wim_image_metadata *imd)
+{
+	struct blob_descriptor *blob = imd->metadata_blob;
+
+	if (blob->blob_location == BLOB_IN_WIM) {
+		const struct wim_resource_descriptor *rdesc = blob->rdesc;
+
+		wimlib_assert(!imd->orig_metadata_wim);
+		imd->orig_metadata_wim = rdesc->wim;
+		imd->orig_metadata_wim->refcnt++;
+		imd->orig_metadata_reshdr.offset_in_wim = rdesc->offset_in_wim;
+		imd->orig_metadata_reshdr.size_in_wim = rdesc->size_in_wim;
+		imd->orig_metadata_reshdr.uncompressed_size =
+						rdesc->uncompressed_size;
+		imd->orig_metadata_reshdr.flags = rdesc->flags;
+		copy_hash(imd->orig_metadata_hash, blob->hash);
+	}
+	blob_release_location(blob);
+	imd->stats_outdated = true;
+}
+
 /* Release a reference to the specified image metadata.  This assumes that no
  * WIMStruct has the image selected.  */
 void
@@ -224,6 +268,8 @@ put_image_metadata(struct wim_image_metadata *imd)
 	list_for_each_entry_safe(blob, tmp, &imd->unhashed_blobs, unhashed_list)
 		free_blob_descriptor(blob);
 	free_blob_descriptor(imd->metadata_blob);
+	if (imd->orig_metadata_wim)
+		wim_decrement_refcnt(imd->orig_metadata_wim);
 	FREE(imd);
 }
 
@@ -318,8 +364,10 @@ new_unloaded_image_metadata(struct blob_descriptor *metadata_blob)
  * On failure, WIMLIB_ERR_INVALID_IMAGE, WIMLIB_ERR_METADATA_NOT_FOUND,
  * or another error code will be returned.
  */
-int
-select_wim_image(WIMStruct *wim, int image)
+static int
+do_select_wim_image(WIMStruct *wim, int image,
+		    const tchar * const *paths, size_t num_paths,
+		    bool *partial_ret, void **lazy_buf_ret)
 {
 	struct wim_image_metadata *imd;
 	int ret;
@@ -340,15 +388,65 @@ select_wim_image(WIMStruct *wim, int image)
 
 	imd = wim->image_metadata[image - 1];
 	if (!is_image_loaded(imd)) {
-		ret = read_metadata_resource(imd);
+		if (lazy_buf_ret)
+			ret = read_metadata_resource_lazily(imd, lazy_buf_ret);
+		else
+			ret = read_metadata_resource(imd, paths, num_paths);
 		if (ret)
 			return ret;
+		if (paths)
+			*partial_ret = true;
 	}
 	wim->current_image = image;
 	imd->selected_refcnt++;
 	return 0;
 }
 
+int
+select_wim_image(WIMStruct *wim, int image)
+{
+	return do_select_wim_image(wim, image, NULL, 0, NULL, NULL);
+}
+
+/*
+ * Like select_wim_image(), but if the image isn't loaded yet, only load the
+ * parts of its dentry tree needed to access the given paths, which must have
+ * been canonicalized with canonicalize_wim_path().  For a few paths in an image
+ * with a huge directory tree this saves most of the time needed to load it.
+ *
+ * *partial_ret is set to true if the image was partially loaded.  In that case
+ * only the given paths may be looked up in it, and the caller must call
+ * deselect_current_wim_image() as soon as it is done with them, which unloads
+ * the partial tree.
+ */
+int
+select_wim_image_for_paths(WIMStruct *wim, int image,
+			   const tchar * const *paths, size_t num_paths,
+			   bool *partial_ret)
+{
+	*partial_ret = false;
+	return do_select_wim_image(wim, image, paths, num_paths, partial_ret,
+				   NULL);
+}
+
+/*
+ * Like select_wim_image(), but if the image isn't loaded yet, only read its
+ * root dentry, as described for read_metadata_resource_lazily().  This is
+ * nearly as fast for an image with millions of files as for an empty one.
+ *
+ * *buf_ret is set to the uncompressed metadata resource if the image was loaded
+ * lazily, otherwise to NULL.  In the former case, the caller must read each
+ * directory with read_dentry_subdir() before looking at its children, and must
+ * call deselect_current_wim_image() when done with the image, which unloads
+ * it, before freeing the buffer.
+ */
+int
+select_wim_image_lazily(WIMStruct *wim, int image, void **buf_ret)
+{
+	*buf_ret = NULL;
+	return do_select_wim_image(wim, image, NULL, 0, NULL, buf_ret);
+}
+
 /*
  * Deselect the WIMStruct's currently selected image, if any.  To reduce memory
  * usage, possibly unload the newly deselected image's metadata from memory.
@@ -371,6 +469,107 @@ deselect_current_wim_image(WIMStruct *wim)
 	}
 }
 
+/*
+ * Load the metadata of the specified image if it isn't already loaded, and keep
+ * it loaded until release_wim_image() is called, but without selecting it.
+ * This allows reading one image's dentry tree while another image of the same
+ * WIMStruct is selected.
+ */
+int
+hold_wim_image(WIMStruct *wim, int image, struct wim_image_metadata **imd_ret)
+{
+	struct wim_image_metadata *imd;
+	int ret;
+
+	if (image < 1 || image > wim->hdr.image_count)
+		return WIMLIB_ERR_INVALID_IMAGE;
+
+	if (!wim_has_metadata(wim))
+		return WIMLIB_ERR_METADATA_NOT_FOUND;
+
+	imd = wim->image_metadata[image - 1];
+	if (!is_image_loaded(imd)) {
+		ret = read_metadata_resource(imd, NULL, 0);
+		if (ret)
+			return ret;
+	}
+	imd->selected_refcnt++;
+	*imd_ret = imd;
+	return 0;
+}
+
+/*
+ * Load the metadata of the images @first_image through @last_image which
+ * aren't loaded yet, without selecting them, parsing the metadata resources of
+ * several images at the same time; see read_metadata_resources().  This is for
+ * operations which go on to select or hold each of the images in turn.  The
+ * images stay loaded until they are selected or held and then released.
+ */
+int
+load_wim_images(WIMStruct *wim, int first_image, int last_image)
+{
+	struct wim_image_metadata **imds;
+	size_t num_imds = 0;
+	int ret;
+
+	if (first_image < 1 || first_image > last_image ||
+	    last_image > wim->hdr.image_count)
+		return WIMLIB_ERR_INVALID_IMAGE;
+
+	if (!wim_has_metadata(wim))
+		return WIMLIB_ERR_METADATA_NOT_FOUND;
+
+	imds = MALLOC((last_image - first_image + 1) * sizeof(imds[0]));
+	if (!imds)
+		return WIMLIB_ERR_NOMEM;
+	for (int i = first_image; i <= last_image; i++) {
+		struct wim_image_metadata *imd = wim->image_metadata[i - 1];
+
+		if (!is_image_loaded(imd))
+			imds[num_imds++] = imd;
+	}
+	ret = read_metadata_resources(imds, num_imds);
+	FREE(imds);
+	return ret;
+}
+
+/* The most images which load_wim_images_ahead() loads at once  */
+#define MAX_IMAGES_LOADED_AHEAD	8
+
+/*
+ * For an operation which selects each of the images @image through @last_image
+ * in turn: if @image isn't loaded yet, load it along with the following images,
+ * as many as there are threads in the task pool, using load_wim_images().
+ * Only a few images are loaded ahead, since they all stay in memory until they
+ * are reached.
+ */
+int
+load_wim_images_ahead(WIMStruct *wim, int image, int last_image)
+{
+	unsigned num_ahead;
+
+	if (image < 1 || image > wim->hdr.image_count || !wim_has_metadata(wim) ||
+	    is_image_loaded(wim->image_metadata[image - 1]))
+		return 0;
+
+	num_ahead = min(task_pool_num_threads(), MAX_IMAGES_LOADED_AHEAD);
+	return load_wim_images(wim, image,
+			       min(last_image, image + (int)num_ahead - 1));
+}
+
+/* Release a hold on an image taken with hold_wim_image().  */
+void
+release_wim_image(struct wim_image_metadata *imd)
+{
+	wimlib_assert(imd->selected_refcnt > 0);
+	imd->selected_refcnt--;
+
+	if (can_unload_image(imd)) {
+		wimlib_assert(list_empty(&imd->unhashed_blobs));
+		unload_image_metadata(imd);
+	}
+}
+
 /*
  * Calls a function on images in the WIM.  If @image is WIMLIB_ALL_IMAGES,
  * @visitor is called on the WIM once for each image, with each image selected
@@ -395,6 +594,9 @@ for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *))
 		return WIMLIB_ERR_INVALID_IMAGE;
 	}
 	for (i = start; i <= end; i++) {
+		ret = load_wim_images_ahead(wim, i, end);
+		if (ret != 0)
+			return ret;
 		ret = select_wim_image(wim, i);
 		if (ret != 0)
 			return ret;
@@ -597,6 +799,51 @@ wimlib_set_output_pack_chunk_size(WIMStruct *wim, u32 chunk_size)
 	return 0;
 }
 
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_output_pack_min_resource_size(WIMStruct *wim, u64 size)
+{
+	wim->out_solid_min_res_size = size;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_output_pack_max_blob_size(WIMStruct *wim, u64 size)
+{
+	wim->out_solid_max_blob_size = size;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_output_compression_workers(WIMStruct *wim, const tchar *workers)
+{
+	tchar *dup = NULL;
+
+	if (workers && *workers) {
+#ifdef _WIN32
+		return WIMLIB_ERR_UNSUPPORTED;
+#else
+		dup = TSTRDUP(workers);
+		if (!dup)
+			return WIMLIB_ERR_NOMEM;
+#endif
+	}
+	FREE(wim->out_compression_workers);
+	wim->out_compression_workers = dup;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_decompression_threads(WIMStruct *wim, unsigned num_threads)
+{
+	wim->num_decompression_threads = num_threads;
+	wim->decompression_threads_set = 1;
+	return 0;
+}
+
 /* API function documented in wimlib.h  */
 WIMLIBAPI const tchar *
 wimlib_get_compression_type_string(enum wimlib_compression_type ctype)
@@ -616,20 +863,37 @@ wimlib_register_progress_function(WIMStruct *wim,
 	wim->progctx = progctx;
 }
 
-static int
-open_wim_file(const tchar *filename, struct filedes *fd_ret)
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_progress_interval(WIMStruct *wim, unsigned int interval_ms)
 {
-	int raw_fd;
+	wim->progress_interval_ms = interval_ms;
+	return 0;
+}
 
-	raw_fd = topen(filename, O_RDONLY | O_BINARY);
-	if (raw_fd < 0) {
+static int
+open_wim_file(const tchar *filename, struct filedes *fd_ret, int open_flags)
+{
+	if (filedes_open(fd_ret, filename, O_RDONLY, 0,
+			 open_flags & WIMLIB_OPEN_FLAG_UNBUFFERED))
+	{
 		ERROR_WITH_ERRNO("Can't open \"%"TS"\" read-only", filename);
 		return WIMLIB_ERR_OPEN;
 	}
-	filedes_init(fd_ret, raw_fd);
 	return 0;
 }
 
+/* If a WIM file provided through wimlib_open_wim_with_io() won't be used after
+ * all, then tell the library user.  */
+static void
+close_unused_io(const void *wim_filename_or_fd, int open_flags)
+{
+	const struct wimlib_io_provider *io = wim_filename_or_fd;
+
+	if ((open_flags & WIMLIB_OPEN_FLAG_FROM_IO) && io->close)
+		io->close(io->ctx);
+}
+
 /*
  * Begins the reading of a WIM file; opens the file and reads its header and
  * blob table, and optionally checks the integrity.
@@ -639,22 +903,39 @@ begin_read(WIMStruct *wim, const void *wim_filename_or_fd, int open_flags)
 {
 	int ret;
 	const tchar *wimfile;
+	struct stat stbuf;
+	bool have_stbuf = false;
 
 	if (open_flags & WIMLIB_OPEN_FLAG_FROM_PIPE) {
 		wimfile = NULL;
 		filedes_init(&wim->in_fd, *(const int*)wim_filename_or_fd);
 		wim->in_fd.is_pipe = 1;
+	} else if (open_flags & WIMLIB_OPEN_FLAG_FROM_IO) {
+		wimfile = NULL;
+		ret = filedes_init_io(&wim->in_fd, wim_filename_or_fd);
+		if (ret) {
+			close_unused_io(wim_filename_or_fd, open_flags);
+			return ret;
+		}
+		wim->file_size = wim->in_fd.io->size;
 	} else {
-		struct stat stbuf;
-
 		wimfile = wim_filename_or_fd;
-		ret = open_wim_file(wimfile, &wim->in_fd);
+		ret = open_wim_file(wimfile, &wim->in_fd, open_flags);
 		if (ret)
 			return ret;
 
 		/* The file size is needed for enforcing some limits later. */
-		if (fstat(wim->in_fd.fd, &stbuf) == 0)
+		if (fstat(wim->in_fd.fd, &stbuf) == 0) {
 			wim->file_size = stbuf.st_size;
+			have_stbuf = true;
+		}
+
+		/* Map the file into memory if requested.  This is only done
+		 * for regular files, and if it fails then the file is just
+		 * read normally.  */
+		if ((open_flags & WIMLIB_OPEN_FLAG_MMAP) &&
+		    have_stbuf && wim->file_size != 0 && S_ISREG(stbuf.st_mode))
+			(void)filedes_map(&wim->in_fd, wim->file_size);
 
 		/* The absolute path to the WIM is requested so that
 		 * wimlib_overwrite() still works even if the process changes
@@ -668,7 +949,7 @@ begin_read(WIMStruct *wim, const void *wim_filename_or_fd, int open_flags)
 		 * Warning: in Windows native builds, realpath() calls the
 		 * replacement function in win32_replacements.c.
 		 */
-		wim->filename = realpath(wimfile, NULL);
+		wim->filename = wimlib_realpath(wimfile);
 		if (!wim->filename) {
 			ERROR_WITH_ERRNO("Failed to get full path to file "
 					 "\"%"TS"\"", wimfile);
@@ -683,6 +964,9 @@ begin_read(WIMStruct *wim, const void *wim_filename_or_fd, int open_flags)
 	if (ret)
 		return ret;
 
+	if (have_stbuf)
+		open_wim_cache_set_id(wim, &stbuf);
+
 	if (wim->hdr.flags & WIM_HDR_FLAG_WRITE_IN_PROGRESS) {
 		WARNING("The WIM_HDR_FLAG_WRITE_IN_PROGRESS flag is set in the header of\n"
 			"          \"%"TS"\".  It may be being changed by another process,\n"
@@ -789,12 +1073,16 @@ open_wim_as_WIMStruct(const void *wim_filename_or_fd, int open_flags,
 	int ret;
 
 	ret = wimlib_global_init(0);
-	if (ret)
+	if (ret) {
+		close_unused_io(wim_filename_or_fd, open_flags);
 		return ret;
+	}
 
 	wim = new_wim_struct();
-	if (!wim)
+	if (!wim) {
+		close_unused_io(wim_filename_or_fd, open_flags);
 		return WIMLIB_ERR_NOMEM;
+	}
 
 	wim->progfunc = progfunc;
 	wim->progctx = progctx;
@@ -817,7 +1105,9 @@ wimlib_open_wim_with_progress(const tchar *wimfile, int open_flags,
 {
 	if (open_flags & ~(WIMLIB_OPEN_FLAG_CHECK_INTEGRITY |
 			   WIMLIB_OPEN_FLAG_ERROR_IF_SPLIT |
-			   WIMLIB_OPEN_FLAG_WRITE_ACCESS))
+			   WIMLIB_OPEN_FLAG_WRITE_ACCESS |
+			   WIMLIB_OPEN_FLAG_MMAP |
+			   WIMLIB_OPEN_FLAG_UNBUFFERED))
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	if (!wimfile || !*wimfile || !wim_ret)
@@ -835,29 +1125,145 @@ wimlib_open_wim(const tchar *wimfile, int open_flags, WIMStruct **wim_ret)
 					     NULL, NULL);
 }
 
-/* Checksum all blobs that are unhashed (other than the metadata blobs), merging
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_open_wim_with_io(const struct wimlib_io_provider *io, int open_flags,
+			WIMStruct **wim_ret,
+			wimlib_progress_func_t progfunc, void *progctx)
+{
+	if (open_flags & ~(WIMLIB_OPEN_FLAG_CHECK_INTEGRITY |
+			   WIMLIB_OPEN_FLAG_ERROR_IF_SPLIT))
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (!io || !io->read_at || !wim_ret)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	return open_wim_as_WIMStruct(io, open_flags | WIMLIB_OPEN_FLAG_FROM_IO,
+				     wim_ret, progfunc, progctx);
+}
+
+/* Maximum number of tasks which checksum unhashed blobs  */
+#define MAX_HASH_TASKS	16
+
+struct unhashed_blob {
+	struct blob_descriptor *blob;
+
+	/* Saved from the unhashed blob, since hashing overwrites them  */
+	struct blob_descriptor **back_ptr;
+	struct wim_inode *back_inode;
+
+	/* Result of sha1_blob(), or -1 if not hashed yet  */
+	int ret;
+};
+
+struct hash_unhashed_blobs_task {
+	struct pool_task base;
+	struct unhashed_blob *blobs;
+	size_t num_blobs;
+	size_t *next_blob;
+};
+
+static void
+hash_unhashed_blobs_task_run(struct pool_task *_task)
+{
+	struct hash_unhashed_blobs_task *task =
+		(struct hash_unhashed_blobs_task *)_task;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(task->next_blob, 1, __ATOMIC_RELAXED)) <
+	       task->num_blobs)
+	{
+		struct unhashed_blob *ub = &task->blobs[i];
+
+		if (blob_can_be_read_concurrently(ub->blob))
+			ub->ret = sha1_blob(ub->blob);
+	}
+}
+
+/*
+ * Checksum all blobs that are unhashed (other than the metadata blobs), merging
  * them into the blob table as needed.  This is a no-op unless files have been
- * added to an image in the same WIMStruct.  */
+ * added to an image in the same WIMStruct.
+ *
+ * This is needed before writing a pipable WIM, whose metadata resources come
+ * before the file data, and before exporting or extracting, so for a new
+ * capture it means reading all the file data once before it is even written.
+ * So the files are read and checksummed by multiple threads.  The blobs are
+ * still merged into the blob table in their original order, so the result is
+ * the same as when checksumming them one at a time.
+ */
 int
 wim_checksum_unhashed_blobs(WIMStruct *wim)
 {
-	int ret;
+	struct hash_unhashed_blobs_task tasks[MAX_HASH_TASKS];
+	struct pool_task *task_ptrs[MAX_HASH_TASKS];
+	struct unhashed_blob *blobs;
+	struct blob_descriptor *blob;
+	size_t num_blobs = 0;
+	size_t next_blob = 0;
+	unsigned num_tasks;
+	int ret = 0;
 
 	if (!wim_has_metadata(wim))
 		return 0;
+
+	for (int i = 0; i < wim->hdr.image_count; i++)
+		image_for_each_unhashed_blob(blob, wim->image_metadata[i])
+			num_blobs++;
+	if (!num_blobs)
+		return 0;
+
+	blobs = MALLOC(num_blobs * sizeof(blobs[0]));
+	if (!blobs)
+		return WIMLIB_ERR_NOMEM;
+
+	num_blobs = 0;
 	for (int i = 0; i < wim->hdr.image_count; i++) {
-		struct blob_descriptor *blob, *tmp;
-		struct wim_image_metadata *imd = wim->image_metadata[i];
-		image_for_each_unhashed_blob_safe(blob, tmp, imd) {
-			struct blob_descriptor *new_blob;
-			ret = hash_unhashed_blob(blob, wim->blob_table, &new_blob);
-			if (ret)
-				return ret;
-			if (new_blob != blob)
-				free_blob_descriptor(blob);
+		image_for_each_unhashed_blob(blob, wim->image_metadata[i]) {
+			struct unhashed_blob *ub = &blobs[num_blobs++];
+
+			ub->blob = blob;
+			ub->back_ptr = retrieve_pointer_to_unhashed_blob(blob);
+			ub->back_inode = blob->back_inode;
+			ub->ret = -1;
 		}
 	}
-	return 0;
+
+	num_tasks = min(min(num_blobs, task_pool_num_threads()),
+			MAX_HASH_TASKS);
+	if (num_tasks > 1) {
+		for (unsigned i = 0; i < num_tasks; i++) {
+			tasks[i].base.run = hash_unhashed_blobs_task_run;
+			tasks[i].blobs = blobs;
+			tasks[i].num_blobs = num_blobs;
+			tasks[i].next_blob = &next_blob;
+			task_ptrs[i] = &tasks[i].base;
+		}
+		task_pool_run_batch(task_ptrs, num_tasks);
+	}
+
+	/* Hash anything which couldn't be hashed concurrently, then merge the
+	 * blobs into the blob table in their original order.  After an error,
+	 * the blobs which were already hashed must still be merged, since
+	 * hashing overwrote their back pointers.  */
+	for (size_t i = 0; i < num_blobs; i++) {
+		struct unhashed_blob *ub = &blobs[i];
+		struct blob_descriptor *new_blob;
+
+		if (ub->ret < 0 && !ret)
+			ub->ret = sha1_blob(ub->blob);
+		if (ub->ret) {
+			if (ub->ret > 0 && !ret)
+				ret = ub->ret;
+			continue;
+		}
+		new_blob = after_blob_hashed(ub->blob, ub->back_ptr,
+					     wim->blob_table, ub->back_inode);
+		if (new_blob != ub->blob)
+			free_blob_descriptor(ub->blob);
+	}
+	FREE(blobs);
+	return ret;
 }
 
 /*
@@ -905,8 +1311,12 @@ wim_decrement_refcnt(WIMStruct *wim)
 	if (filedes_valid(&wim->out_fd))
 		filedes_close(&wim->out_fd);
 	wimlib_free_decompressor(wim->decompressor);
+	free_chunk_cache(wim->chunk_cache);
+	if (wim->parallel_decompressor)
+		wim->parallel_decompressor->destroy(wim->parallel_decompressor);
 	xml_free_info_struct(wim->xml_info);
 	FREE(wim->filename);
+	FREE(wim->out_compression_workers);
 	FREE(wim);
 }
 
@@ -923,6 +1333,10 @@ wimlib_free(WIMStruct *wim)
 
 	free_blob_table(wim->blob_table);
 	wim->blob_table = NULL;
+	free_capture_hash_cache(wim->hash_cache);
+	wim->hash_cache = NULL;
+	free_blob_cache(wim->blob_cache);
+	wim->blob_cache = NULL;
 	if (wim->image_metadata != NULL) {
 		deselect_current_wim_image(wim);
 		for (int i = 0; i < wim->hdr.image_count; i++)
@@ -986,12 +1400,14 @@ wimlib_global_init(int init_flags)
 		goto out_unlock;
 
 	init_cpu_features();
+	init_cpu_dispatch();
 #ifdef _WIN32
 	ret = win32_global_init(init_flags);
 	if (ret)
 		goto out_unlock;
 #endif
 	init_upcase();
+	trace_init();
 	if (init_flags & WIMLIB_INIT_FLAG_DEFAULT_CASE_SENSITIVE)
 		default_ignore_case = false;
 	else if (init_flags & WIMLIB_INIT_FLAG_DEFAULT_CASE_INSENSITIVE)
@@ -1011,6 +1427,9 @@ wimlib_global_cleanup(void)
 	if (!lib_initialized)
 		return;
 
+	/* Asynchronous operations may still be using the library.  */
+	async_cleanup();
+
 	mutex_lock(&lib_initialization_mutex);
 
 	if (!lib_initialized)
@@ -1020,6 +1439,10 @@ wimlib_global_cleanup(void)
 	win32_global_cleanup();
 #endif
 
+	task_pool_cleanup();
+	codec_cache_cleanup();
+	open_wim_cache_cleanup();
+	trace_cleanup();
 	wimlib_set_error_file(NULL);
 	lib_initialized = false;
 
@@ -39,12 +39,55 @@
 #include "wimlib/pattern.h"
 #include "wimlib/reparse.h"
 #include "wimlib/scan.h" /* for mangle_pat() and match_pattern_list()  */
+#include "wimlib/task_pool.h"
 #include "wimlib/textfile.h"
 #include "wimlib/wimboot.h"
 #include "wimlib/wof.h"
 #include "wimlib/xattr.h"
 #include "wimlib/xml.h"
 
+/* Maximum number of writes to target streams which may be in progress at once
+ */
+#define MAX_PENDING_WRITES	64
+
+/* Number of buffers holding copies of data chunks being written.  This limits
+ * how far reading and decompressing can get ahead of the target volume.  */
+#define NUM_WRITE_BUFFERS	16
+
+/* Maximum number of extracted files, and maximum total size of their data,
+ * which are compressed with System Compression in one batch  */
+#define MAX_COMPACT_BATCH_FILES	64
+#define MAX_COMPACT_BATCH_SIZE	((u64)128 << 20)
+
+/* Maximum number of threads which compress files with System Compression at
+ * the same time  */
+#define MAX_COMPACT_THREADS	8
+
+/* Maximum number of created files whose WIMBoot pointers are set in one batch,
+ * and maximum number of threads which set them at the same time  */
+#define MAX_WIMBOOT_BATCH_FILES	256
+#define MAX_WIMBOOT_THREADS	8
+
+/* A copy of a data chunk, which is referenced by the writes of it that are in
+ * progress  */
+struct write_buffer {
+	u8 *data;
+	size_t size;
+	unsigned refcnt;
+};
+
+/* A write to a target stream which has been issued with NtWriteFile() and whose
+ * completion will be reported to the I/O completion port  */
+struct pending_write {
+	IO_STATUS_BLOCK iosb;
+	HANDLE h;
+	struct write_buffer *buf;
+	const u8 *data;
+	size_t size;
+	u64 offset;
+	struct pending_write *next_free;
+};
+
 struct win32_apply_ctx {
 
 	/* Extract flags, the pointer to the WIMStruct, etc.  */
@@ -67,6 +110,16 @@ struct win32_apply_ctx {
 		bool have_uncompressed_wims;
 		bool have_unsupported_compressed_resources;
 		bool have_huge_resources;
+
+		/* The created files which are waiting for their WIMBoot
+		 * pointers to be set, still open; see set_backed_from_wim()  */
+		struct {
+			HANDLE handles[MAX_WIMBOOT_BATCH_FILES];
+			struct wim_inode *inodes[MAX_WIMBOOT_BATCH_FILES];
+			DWORD errors[MAX_WIMBOOT_BATCH_FILES];
+			unsigned num_files;
+			unsigned next;
+		} pending;
 	} wimboot;
 
 	/* External backing information  */
@@ -133,6 +186,25 @@ struct win32_apply_ctx {
 	/* Whether is_sparse_stream[] is true for any currently open stream  */
 	bool any_sparse_streams;
 
+	/* I/O completion port with which the handles in @open_handles are
+	 * associated, or NULL if it hasn't been created yet.  Data is written to
+	 * these handles asynchronously, so that the next chunks can be read and
+	 * decompressed while the target volume (and any filter drivers above
+	 * it) is still processing the previous ones.  */
+	HANDLE iocp;
+
+	/* The writes that can be in progress, the unused ones being linked
+	 * together starting at @free_writes  */
+	struct pending_write pending_writes[MAX_PENDING_WRITES];
+	struct pending_write *free_writes;
+
+	/* Number of writes in progress  */
+	unsigned num_pending_writes;
+
+	/* Buffers for the data of the writes in progress, used round-robin  */
+	struct write_buffer write_buffers[NUM_WRITE_BUFFERS];
+	unsigned next_write_buffer;
+
 	/* List of dentries, joined by @d_tmp_list, that need to have reparse
 	 * data extracted as soon as the whole blob has been read into
 	 * @data_buffer.  */
@@ -167,6 +239,23 @@ struct win32_apply_ctx {
 	 * [PrepopulateList].  */
 	unsigned long num_system_compression_exclusions;
 
+	/* The extracted files which are waiting to be compressed with System
+	 * Compression, in the order in which their data was extracted; see
+	 * queue_system_compression()  */
+	struct {
+		struct wim_inode *inodes[MAX_COMPACT_BATCH_FILES];
+		int formats[MAX_COMPACT_BATCH_FILES];
+		NTSTATUS statuses[MAX_COMPACT_BATCH_FILES];
+		unsigned num_files;
+		unsigned next;
+		u64 total_size;
+
+		/* The contexts through which the threads compress the files.
+		 * The first is the main context itself.  */
+		struct win32_apply_ctx *ctxs[MAX_COMPACT_THREADS];
+		unsigned num_ctxs;
+	} compact;
+
 	/* Number of files for which we couldn't set the object ID.  */
 	unsigned long num_object_id_failures;
 
@@ -180,6 +269,20 @@ struct win32_apply_ctx {
 	/* Have we tried to enable short name support on the target volume yet?
 	 */
 	bool tried_to_enable_short_names;
+
+	/* Did the last attempt to set or remove a short name fail because short
+	 * names are disabled on the target volume?  While this is true, no more
+	 * attempts are made unless they might succeed after enabling short
+	 * names, which saves a failed system call on every file.  */
+	bool short_names_disabled;
+
+	/* Access rights, and parts of security descriptors, that have been
+	 * found to require a privilege which the process doesn't hold.  Since
+	 * privileges don't depend on the file, these aren't requested again
+	 * when applying metadata to the remaining files, which saves failed
+	 * system calls on every file when not running as Administrator.  */
+	ACCESS_MASK perms_not_held;
+	SECURITY_INFORMATION sd_info_not_held;
 };
 
 /* Get the drive letter from a Windows path, or return the null character if the
@@ -251,6 +354,12 @@ static void
 build_extraction_path(const struct wim_dentry *dentry,
 		      struct win32_apply_ctx *ctx);
 
+static struct win32_apply_ctx *
+new_metadata_ctx(const struct win32_apply_ctx *ctx);
+
+static void
+merge_metadata_ctx(struct win32_apply_ctx *ctx, struct win32_apply_ctx *mctx);
+
 static int
 report_dentry_apply_error(const struct wim_dentry *dentry,
 			  struct win32_apply_ctx *ctx, int ret)
@@ -624,13 +733,111 @@ find_wimboot_wim(WIMStruct *wim_to_find, struct win32_apply_ctx *ctx)
 	return NULL;
 }
 
+struct wimboot_task {
+	struct pool_task base;
+	struct win32_apply_ctx *ctx;
+};
+
+static void
+wimboot_task_run(struct pool_task *_task)
+{
+	struct wimboot_task *task =
+		container_of(_task, struct wimboot_task, base);
+	struct win32_apply_ctx *ctx = task->ctx;
+	unsigned i;
+
+	while ((i = __atomic_fetch_add(&ctx->wimboot.pending.next, 1,
+				       __ATOMIC_RELAXED)) <
+	       ctx->wimboot.pending.num_files)
+	{
+		const struct blob_descriptor *blob;
+		const struct wimboot_wim *wimboot_wim;
+
+		blob = inode_get_blob_for_unnamed_data_stream_resolved(
+					ctx->wimboot.pending.inodes[i]);
+		wimboot_wim = find_wimboot_wim(blob->rdesc->wim, ctx);
+		if (wimboot_set_pointer(ctx->wimboot.pending.handles[i],
+					blob,
+					wimboot_wim->data_source_id,
+					wimboot_wim->blob_table_hash,
+					ctx->wimboot.wof_running))
+			ctx->wimboot.pending.errors[i] = ERROR_SUCCESS;
+		else
+			ctx->wimboot.pending.errors[i] = GetLastError();
+	}
+}
+
+static void
+close_pending_wimboot_files(struct win32_apply_ctx *ctx)
+{
+	for (unsigned i = 0; i < ctx->wimboot.pending.num_files; i++)
+		NtClose(ctx->wimboot.pending.handles[i]);
+	ctx->wimboot.pending.num_files = 0;
+}
+
+/*
+ * Set the WIMBoot pointers of the files queued by set_backed_from_wim() and
+ * close them, then report any failures in the order of the files.
+ *
+ * Setting a pointer is a single synchronous ioctl to WOF, which takes a while
+ * but hardly uses the CPU, so the files are spread over several threads.  The
+ * files don't depend on each other.
+ */
+static int
+flush_wimboot_pointers(struct win32_apply_ctx *ctx)
+{
+	struct wimboot_task tasks[MAX_WIMBOOT_THREADS];
+	struct pool_task *task_ptrs[MAX_WIMBOOT_THREADS];
+	unsigned num_files = ctx->wimboot.pending.num_files;
+	unsigned n;
+	int ret;
+
+	if (num_files == 0)
+		return 0;
+
+	n = min(min(task_pool_num_threads(), MAX_WIMBOOT_THREADS), num_files);
+	ctx->wimboot.pending.next = 0;
+	for (unsigned i = 0; i < n; i++) {
+		tasks[i].base.run = wimboot_task_run;
+		tasks[i].ctx = ctx;
+		task_ptrs[i] = &tasks[i].base;
+	}
+	task_pool_run_batch(task_ptrs, n);
+
+	close_pending_wimboot_files(ctx);
+
+	for (unsigned i = 0; i < num_files; i++) {
+		const struct wim_dentry *dentry;
+		DWORD err = ctx->wimboot.pending.errors[i];
+
+		if (likely(err == ERROR_SUCCESS))
+			continue;
+
+		dentry = inode_first_extraction_dentry(
+					ctx->wimboot.pending.inodes[i]);
+		build_extraction_path(dentry, ctx);
+		win32_error(err, L"\"%ls\": Couldn't set WIMBoot pointer data",
+			    current_path(ctx));
+		ret = check_apply_error(dentry, ctx, WIMLIB_ERR_WIMBOOT);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * "WIMBoot" extraction: if the file @inode, which was just created and is open
+ * as *@h_p, is to be externally backed by its WIM file, queue it to have its
+ * WIMBoot pointer set by flush_wimboot_pointers().  The queued file stays open
+ * until then, and *@h_p is set to NULL.
+ */
 static int
-set_backed_from_wim(HANDLE h, struct wim_inode *inode, struct win32_apply_ctx *ctx)
+set_backed_from_wim(HANDLE *h_p, struct wim_inode *inode,
+		    struct win32_apply_ctx *ctx)
 {
 	int ret;
 	const struct wim_dentry *excluded_dentry;
-	const struct blob_descriptor *blob;
-	const struct wimboot_wim *wimboot_wim;
+	unsigned n;
 
 	ret = will_externally_back_inode(inode, ctx, &excluded_dentry, true);
 	if (ret > 0) /* Error.  */
@@ -655,22 +862,12 @@ set_backed_from_wim(HANDLE h, struct wim_inode *inode, struct win32_apply_ctx *c
 
 	/* Externally backing.  */
 
-	blob = inode_get_blob_for_unnamed_data_stream_resolved(inode);
-	wimboot_wim = find_wimboot_wim(blob->rdesc->wim, ctx);
-
-	if (unlikely(!wimboot_set_pointer(h,
-					  blob,
-					  wimboot_wim->data_source_id,
-					  wimboot_wim->blob_table_hash,
-					  ctx->wimboot.wof_running)))
-	{
-		const DWORD err = GetLastError();
-
-		build_extraction_path(inode_first_extraction_dentry(inode), ctx);
-		win32_error(err, L"\"%ls\": Couldn't set WIMBoot pointer data",
-			    current_path(ctx));
-		return WIMLIB_ERR_WIMBOOT;
-	}
+	n = ctx->wimboot.pending.num_files++;
+	ctx->wimboot.pending.handles[n] = *h_p;
+	ctx->wimboot.pending.inodes[n] = inode;
+	*h_p = NULL;
+	if (ctx->wimboot.pending.num_files == MAX_WIMBOOT_BATCH_FILES)
+		return flush_wimboot_pointers(ctx);
 	return 0;
 }
 
@@ -1293,24 +1490,70 @@ out:
 	return status;
 }
 
+/*
+ * Returns true if the name of @dentry is a valid uppercase DOS (8.3) name.  The
+ * filesystem doesn't generate a short name when a file is created with such a
+ * name, since the long name already serves as the short name.
+ *
+ * This is conservative: lowercase and non-ASCII characters are treated as
+ * making the name not DOS-compatible.
+ */
+static bool
+name_is_dos_compatible(const struct wim_dentry *dentry)
+{
+	const wchar_t *name = dentry->d_name;
+	size_t len = dentry->d_name_nbytes / sizeof(wchar_t);
+	size_t base_len = 0;
+	size_t ext_len = 0;
+	bool have_dot = false;
+
+	for (size_t i = 0; i < len; i++) {
+		wchar_t c = name[i];
+
+		if (c == L'.') {
+			if (have_dot)
+				return false;
+			have_dot = true;
+			continue;
+		}
+		if (!((c >= L'A' && c <= L'Z') || (c >= L'0' && c <= L'9') ||
+		      (c != L'\0' && wcschr(L"!#$%&'()-@^_`{}~", c))))
+			return false;
+		if (have_dot)
+			ext_len++;
+		else
+			base_len++;
+	}
+	return base_len >= 1 && base_len <= 8 && ext_len <= 3 &&
+	       (!have_dot || ext_len >= 1);
+}
+
 /* Set the short name on the open file @h which has been created at the location
  * indicated by @dentry.
  *
  * Note that this may add, change, or remove the short name.
  *
- * @h must be opened with DELETE access.
+ * @h must be opened with DELETE access.  @newly_created must be true only if
+ * the file was just created by us (as opposed to being an existing file that
+ * was opened), in which case removing a short name that can't exist is skipped.
  *
  * Returns 0 or WIMLIB_ERR_SET_SHORT_NAME.  The latter only happens in
  * STRICT_SHORT_NAMES mode.
  */
 static int
-set_short_name(HANDLE h, const struct wim_dentry *dentry,
+set_short_name(HANDLE h, const struct wim_dentry *dentry, bool newly_created,
 	       struct win32_apply_ctx *ctx)
 {
 
 	if (!ctx->common.supported_features.short_names)
 		return 0;
 
+	/* A new file whose name is already a DOS name has no separate short
+	 * name, so there is nothing to remove.  */
+	if (dentry->d_short_name_nbytes == 0 && newly_created &&
+	    name_is_dos_compatible(dentry))
+		return 0;
+
 	/*
 	 * Note: The size of the FILE_NAME_INFORMATION buffer must be such that
 	 * FileName contains at least 2 wide characters (4 bytes).  Otherwise,
@@ -1337,10 +1580,20 @@ set_short_name(HANDLE h, const struct wim_dentry *dentry,
 	memcpy(info->FileName, dentry->d_short_name, dentry->d_short_name_nbytes);
 
 retry:
-	status = NtSetInformationFile(h, &ctx->iosb, info, bufsize,
-				      FileShortNameInformation);
-	if (NT_SUCCESS(status))
-		return 0;
+	if (ctx->short_names_disabled &&
+	    (dentry->d_short_name_nbytes == 0 ||
+	     ctx->tried_to_enable_short_names))
+	{
+		/* We already know what the result would be.  */
+		status = STATUS_SHORT_NAMES_NOT_ENABLED_ON_VOLUME;
+	} else {
+		status = NtSetInformationFile(h, &ctx->iosb, info, bufsize,
+					      FileShortNameInformation);
+		if (NT_SUCCESS(status))
+			return 0;
+		if (status == STATUS_SHORT_NAMES_NOT_ENABLED_ON_VOLUME)
+			ctx->short_names_disabled = true;
+	}
 
 	if (status == STATUS_SHORT_NAMES_NOT_ENABLED_ON_VOLUME) {
 		if (dentry->d_short_name_nbytes == 0)
@@ -1355,8 +1608,10 @@ retry:
 						   volume);
 			if (ret)
 				return ret;
-			if (try_to_enable_short_names(volume))
+			if (try_to_enable_short_names(volume)) {
+				ctx->short_names_disabled = false;
 				goto retry;
+			}
 		}
 	}
 
@@ -1682,6 +1937,7 @@ create_directory(const struct wim_dentry *dentry, struct win32_apply_ctx *ctx)
 	DWORD perms;
 	NTSTATUS status;
 	HANDLE h;
+	bool newly_created;
 	int ret;
 
 	/* DELETE is needed for set_short_name(); GENERIC_READ and GENERIC_WRITE
@@ -1716,7 +1972,9 @@ create_directory(const struct wim_dentry *dentry, struct win32_apply_ctx *ctx)
 		return WIMLIB_ERR_MKDIR;
 	}
 
-	if (ctx->iosb.Information == FILE_OPENED) {
+	newly_created = (ctx->iosb.Information != FILE_OPENED);
+
+	if (!newly_created) {
 		/* If we opened an existing directory, try to clear its file
 		 * attributes.  As far as I know, this only actually makes a
 		 * difference in the case where a FILE_ATTRIBUTE_READONLY
@@ -1735,7 +1993,7 @@ create_directory(const struct wim_dentry *dentry, struct win32_apply_ctx *ctx)
 	}
 
 	if (!dentry_is_root(dentry)) {
-		ret = set_short_name(h, dentry, ctx);
+		ret = set_short_name(h, dentry, newly_created, ctx);
 		if (ret)
 			goto out;
 	}
@@ -1927,8 +2185,9 @@ create_nondirectory(struct wim_inode *inode, struct win32_apply_ctx *ctx)
 	if (ret)
 		return ret;
 
-	/* Set short name.  */
-	ret = set_short_name(h, first_dentry, ctx);
+	/* Set short name.  (create_nondirectory_inode() always creates a new
+	 * file, replacing any existing one.)  */
+	ret = set_short_name(h, first_dentry, true, ctx);
 
 	/* Create additional links, OR if hard links are not supported just
 	 * create more files.  */
@@ -1937,9 +2196,10 @@ create_nondirectory(struct wim_inode *inode, struct win32_apply_ctx *ctx)
 
 	/* "WIMBoot" extraction: set external backing by the WIM file if needed.  */
 	if (!ret && unlikely(ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_WIMBOOT))
-		ret = set_backed_from_wim(h, inode, ctx);
+		ret = set_backed_from_wim(&h, inode, ctx);
 
-	NtClose(h);
+	if (h)
+		NtClose(h);
 	return ret;
 }
 
@@ -1967,7 +2227,7 @@ create_nondirectories(struct list_head *dentry_list, struct win32_apply_ctx *ctx
 		if (ret)
 			return ret;
 	}
-	return 0;
+	return flush_wimboot_pointers(ctx);
 }
 
 static void
@@ -1977,6 +2237,28 @@ close_handles(struct win32_apply_ctx *ctx)
 		NtClose(ctx->open_handles[i]);
 }
 
+/* Create the I/O completion port through which data is written, if it hasn't
+ * been created yet.  */
+static int
+init_async_writes(struct win32_apply_ctx *ctx)
+{
+	if (ctx->iocp)
+		return 0;
+
+	ctx->iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (!ctx->iocp) {
+		win32_error(GetLastError(),
+			    L"Can't create I/O completion port");
+		return WIMLIB_ERR_NOMEM;
+	}
+	ctx->free_writes = NULL;
+	for (unsigned i = 0; i < MAX_PENDING_WRITES; i++) {
+		ctx->pending_writes[i].next_free = ctx->free_writes;
+		ctx->free_writes = &ctx->pending_writes[i];
+	}
+	return 0;
+}
+
 /* Prepare to read the next blob, which has size @blob_size, into an in-memory
  * buffer.  */
 static bool
@@ -2008,6 +2290,7 @@ begin_extract_blob_instance(const struct blob_descriptor *blob,
 {
 	HANDLE h;
 	NTSTATUS status;
+	int ret;
 
 	if (unlikely(strm->stream_type == STREAM_TYPE_REPARSE_POINT)) {
 		/* We can't write the reparse point stream directly; we must set
@@ -2040,6 +2323,10 @@ begin_extract_blob_instance(const struct blob_descriptor *blob,
 	/* It's a data stream (may be unnamed or named).  */
 	wimlib_assert(strm->stream_type == STREAM_TYPE_DATA);
 
+	ret = init_async_writes(ctx);
+	if (ret)
+		return ret;
+
 	if (ctx->num_open_handles == MAX_OPEN_FILES) {
 		/* XXX: Fix this.  But because of the checks in
 		 * extract_blob_list(), this can now only happen on a filesystem
@@ -2058,12 +2345,12 @@ begin_extract_blob_instance(const struct blob_descriptor *blob,
 	}
 
 
-	/* Open a new handle  */
+	/* Open a new handle.  It's opened for asynchronous I/O so that the data
+	 * can be written through the I/O completion port.  */
 	status = do_create_file(&h,
 				FILE_WRITE_DATA | SYNCHRONIZE,
 				NULL, 0, FILE_OPEN_IF,
-				FILE_SEQUENTIAL_ONLY |
-					FILE_SYNCHRONOUS_IO_NONALERT,
+				FILE_SEQUENTIAL_ONLY,
 				ctx);
 	if (!NT_SUCCESS(status)) {
 		winnt_error(status, L"Can't open \"%ls\" for writing",
@@ -2077,7 +2364,7 @@ begin_extract_blob_instance(const struct blob_descriptor *blob,
 		 * set when the file was created.  But if the stream is named,
 		 * then we need to set the sparse flag here. */
 		if (unlikely(stream_is_named(strm))) {
-			int ret = set_sparse_flag(h, ctx);
+			ret = set_sparse_flag(h, ctx);
 			if (ret) {
 				NtClose(h);
 				return ret;
@@ -2085,17 +2372,186 @@ begin_extract_blob_instance(const struct blob_descriptor *blob,
 		}
 		ctx->is_sparse_stream[ctx->num_open_handles] = true;
 		ctx->any_sparse_streams = true;
-	} else {
+	} else if (!(ctx->common.extract_flags &
+		     WIMLIB_EXTRACT_FLAG_NO_PREALLOCATE))
+	{
 		/* Allocate space for the data.  */
 		FILE_ALLOCATION_INFORMATION info =
 			{ .AllocationSize = { .QuadPart = blob->size }};
 		NtSetInformationFile(h, &ctx->iosb, &info, sizeof(info),
 				     FileAllocationInformation);
 	}
+
+	/* Associate the handle with the I/O completion port.  This is done
+	 * last so that the above operations don't queue completion packets.  */
+	if (!CreateIoCompletionPort(h, ctx->iocp, 0, 0)) {
+		win32_error(GetLastError(),
+			    L"Can't associate \"%ls\" with I/O completion port",
+			    current_path(ctx));
+		NtClose(h);
+		return WIMLIB_ERR_OPEN;
+	}
 	ctx->open_handles[ctx->num_open_handles++] = h;
 	return 0;
 }
 
+/* Issue (or reissue, after a partial write) the write @req.  */
+static int
+issue_write(struct pending_write *req, struct win32_apply_ctx *ctx)
+{
+	LARGE_INTEGER offs = { .QuadPart = req->offset };
+	NTSTATUS status;
+
+	status = NtWriteFile(req->h, NULL, NULL, req, &req->iosb,
+			     (void *)req->data, min(INT32_MAX, req->size),
+			     &offs, NULL);
+	if (!NT_SUCCESS(status)) {
+		winnt_error(status, L"Error writing data to target volume");
+		return WIMLIB_ERR_WRITE;
+	}
+	/* Even if the write completed synchronously, a completion packet has
+	 * been queued for it.  */
+	ctx->num_pending_writes++;
+	return 0;
+}
+
+static void
+release_write(struct pending_write *req, struct win32_apply_ctx *ctx)
+{
+	req->buf->refcnt--;
+	req->next_free = ctx->free_writes;
+	ctx->free_writes = req;
+}
+
+/* Wait for one of the writes in progress to complete.  */
+static int
+wait_for_write(struct win32_apply_ctx *ctx)
+{
+	DWORD bytes;
+	ULONG_PTR key;
+	OVERLAPPED *ov;
+	struct pending_write *req;
+	int ret;
+
+	if (!GetQueuedCompletionStatus(ctx->iocp, &bytes, &key, &ov,
+				       INFINITE) && !ov)
+	{
+		/* The completion port itself failed.  This shouldn't happen;
+		 * don't wait for anything else.  */
+		win32_error(GetLastError(),
+			    L"Error waiting for write to complete");
+		ctx->num_pending_writes = 0;
+		return WIMLIB_ERR_WRITE;
+	}
+
+	/* The completion context is the pending_write, whose status block was
+	 * filled in before the packet was queued.  */
+	req = (struct pending_write *)ov;
+	ctx->num_pending_writes--;
+
+	if (!NT_SUCCESS(req->iosb.Status)) {
+		winnt_error(req->iosb.Status,
+			    L"Error writing data to target volume");
+		ret = WIMLIB_ERR_WRITE;
+	} else if (req->iosb.Information < req->size) {
+		if (req->iosb.Information == 0) {
+			ERROR("Write to target volume made no progress");
+			ret = WIMLIB_ERR_WRITE;
+		} else {
+			req->data += req->iosb.Information;
+			req->offset += req->iosb.Information;
+			req->size -= req->iosb.Information;
+			ret = issue_write(req, ctx);
+			if (!ret)
+				return 0;
+		}
+	} else {
+		ret = 0;
+	}
+	release_write(req, ctx);
+	return ret;
+}
+
+/* Wait for all writes in progress to complete.  This must be done before the
+ * handles they use are closed or the data is otherwise depended on.  */
+static int
+wait_for_all_writes(struct win32_apply_ctx *ctx)
+{
+	int ret = 0;
+
+	while (ctx->num_pending_writes) {
+		int ret2 = wait_for_write(ctx);
+		if (!ret)
+			ret = ret2;
+	}
+	return ret;
+}
+
+/* Copy the next data chunk into a write buffer.  */
+static int
+get_write_buffer(const void *chunk, size_t size, struct win32_apply_ctx *ctx,
+		 struct write_buffer **buf_ret)
+{
+	struct write_buffer *buf = &ctx->write_buffers[ctx->next_write_buffer];
+	int ret;
+
+	while (buf->refcnt) {
+		ret = wait_for_write(ctx);
+		if (ret)
+			return ret;
+	}
+	if (size > buf->size) {
+		FREE(buf->data);
+		buf->data = MALLOC(size);
+		if (!buf->data) {
+			buf->size = 0;
+			return WIMLIB_ERR_NOMEM;
+		}
+		buf->size = size;
+	}
+	memcpy(buf->data, chunk, size);
+	ctx->next_write_buffer = (ctx->next_write_buffer + 1) %
+				 NUM_WRITE_BUFFERS;
+	*buf_ret = buf;
+	return 0;
+}
+
+/* Start writing @size bytes at @data, which is in @buf, to the stream @h at
+ * @offset.  */
+static int
+start_write(HANDLE h, struct write_buffer *buf, const u8 *data, size_t size,
+	    u64 offset, struct win32_apply_ctx *ctx)
+{
+	struct pending_write *req;
+	int ret;
+
+	while (!ctx->free_writes) {
+		ret = wait_for_write(ctx);
+		if (ret)
+			return ret;
+	}
+	req = ctx->free_writes;
+	ctx->free_writes = req->next_free;
+	req->h = h;
+	req->buf = buf;
+	req->data = data;
+	req->size = size;
+	req->offset = offset;
+	buf->refcnt++;
+
+	ret = issue_write(req, ctx);
+	if (ret)
+		release_write(req, ctx);
+	return ret;
+}
+
+static void
+free_write_buffers(struct win32_apply_ctx *ctx)
+{
+	for (unsigned i = 0; i < NUM_WRITE_BUFFERS; i++)
+		FREE(ctx->write_buffers[i].data);
+}
+
 /* Given a Windows NT namespace path, such as \??\e:\Windows\System32, return a
  * pointer to the suffix of the path that begins with the device directly, such
  * as e:\Windows\System32.  */
@@ -2367,31 +2823,6 @@ fail:
 	return ret;
 }
 
-static int
-pwrite_to_handle(HANDLE h, const void *data, size_t size, u64 offset)
-{
-	const void * const end = data + size;
-	const void *p;
-	IO_STATUS_BLOCK iosb;
-	NTSTATUS status;
-
-	for (p = data; p != end; p += iosb.Information,
-				 offset += iosb.Information)
-	{
-		LARGE_INTEGER offs = { .QuadPart = offset };
-
-		status = NtWriteFile(h, NULL, NULL, NULL, &iosb,
-				     (void *)p, min(INT32_MAX, end - p),
-				     &offs, NULL);
-		if (!NT_SUCCESS(status)) {
-			winnt_error(status,
-				    L"Error writing data to target volume");
-			return WIMLIB_ERR_WRITE;
-		}
-	}
-	return 0;
-}
-
 /* Called when the next chunk of a blob has been read for extraction */
 static int
 win32_extract_chunk(const struct blob_descriptor *blob, u64 offset,
@@ -2400,6 +2831,7 @@ win32_extract_chunk(const struct blob_descriptor *blob, u64 offset,
 	struct win32_apply_ctx *ctx = _ctx;
 	const void * const end = chunk + size;
 	const void *p;
+	struct write_buffer *buf = NULL;
 	bool zeroes;
 	size_t len;
 	unsigned i;
@@ -2408,14 +2840,25 @@ win32_extract_chunk(const struct blob_descriptor *blob, u64 offset,
 	/*
 	 * For sparse streams, only write nonzero regions.  This lets the
 	 * filesystem use holes to represent zero regions.
+	 *
+	 * The writes are asynchronous, so the caller's buffer can't be written
+	 * from directly; a copy of the chunk is made as soon as it's known that
+	 * any of it needs to be written.
 	 */
 	for (p = chunk; p != end; p += len, offset += len) {
 		zeroes = maybe_detect_sparse_region(p, end - p, &len,
 						    ctx->any_sparse_streams);
 		for (i = 0; i < ctx->num_open_handles; i++) {
 			if (!zeroes || !ctx->is_sparse_stream[i]) {
-				ret = pwrite_to_handle(ctx->open_handles[i],
-						       p, len, offset);
+				if (!buf) {
+					ret = get_write_buffer(chunk, size,
+							       ctx, &buf);
+					if (ret)
+						return ret;
+				}
+				ret = start_write(ctx->open_handles[i], buf,
+						  buf->data + (p - chunk), len,
+						  offset, ctx);
 				if (ret)
 					return ret;
 			}
@@ -2547,71 +2990,84 @@ bootloader_supports_compression_format(struct win32_apply_ctx *ctx, int format)
 	return ctx->windows_build_number >= 18362;
 }
 
+/*
+ * Choose the System Compression format for @inode, given that @format was
+ * requested.  If it may be needed for compatibility with the Windows
+ * bootloader, the file is forced to XPRESS4K format or left uncompressed, the
+ * latter being indicated by setting *format to -1.
+ */
 static NTSTATUS
-set_system_compression_on_inode(struct wim_inode *inode, int format,
-				struct win32_apply_ctx *ctx)
+choose_system_compression_format(struct wim_inode *inode, int *format,
+				 struct win32_apply_ctx *ctx)
 {
-	bool retried = false;
-	NTSTATUS status;
-	HANDLE h;
+	struct wim_dentry *dentry;
 
-	/* If it may be needed for compatibility with the Windows bootloader,
-	 * force this file to XPRESS4K or uncompressed format.  */
-	if (!bootloader_supports_compression_format(ctx, format)) {
-		/* We need to check the patterns against every name of the
-		 * inode, in case any of them match.  */
-		struct wim_dentry *dentry;
-		inode_for_each_extraction_alias(dentry, inode) {
-			bool incompatible;
-			bool warned;
+	if (bootloader_supports_compression_format(ctx, *format))
+		return STATUS_SUCCESS;
 
-			if (calculate_dentry_full_path(dentry)) {
-				ERROR("Unable to compute file path!");
-				return STATUS_NO_MEMORY;
-			}
+	/* We need to check the patterns against every name of the inode, in
+	 * case any of them match.  */
+	inode_for_each_extraction_alias(dentry, inode) {
+		bool incompatible;
+		bool warned;
 
-			incompatible = match_pattern_list(dentry->d_full_path,
-							  &bootloader_patterns,
-							  MATCH_RECURSIVELY);
-			FREE(dentry->d_full_path);
-			dentry->d_full_path = NULL;
+		if (calculate_dentry_full_path(dentry)) {
+			ERROR("Unable to compute file path!");
+			return STATUS_NO_MEMORY;
+		}
 
-			if (!incompatible)
-				continue;
+		incompatible = match_pattern_list(dentry->d_full_path,
+						  &bootloader_patterns,
+						  MATCH_RECURSIVELY);
+		FREE(dentry->d_full_path);
+		dentry->d_full_path = NULL;
 
-			warned = (ctx->num_system_compression_exclusions++ > 0);
-
-			if (bootloader_supports_compression_format(ctx,
-				   FILE_PROVIDER_COMPRESSION_XPRESS4K))
-			{
-				/* Force to XPRESS4K  */
-				if (!warned) {
-					WARNING("For compatibility with the "
-						"Windows bootloader, some "
-						"files are being\n"
-						"          compacted "
-						"using the XPRESS4K format "
-						"instead of the %"TS" format\n"
-						"          you requested.",
-						get_system_compression_format_string(format));
-				}
-				format = FILE_PROVIDER_COMPRESSION_XPRESS4K;
-				break;
-			} else {
-				/* Force to uncompressed  */
-				if (!warned) {
-					WARNING("For compatibility with the "
-						"Windows bootloader, some "
-						"files will not\n"
-						"          be compressed with"
-						" system compression "
-						"(\"compacted\").");
-				}
-				return STATUS_SUCCESS;
-			}
+		if (!incompatible)
+			continue;
+
+		warned = (ctx->num_system_compression_exclusions++ > 0);
 
+		if (bootloader_supports_compression_format(ctx,
+			   FILE_PROVIDER_COMPRESSION_XPRESS4K))
+		{
+			/* Force to XPRESS4K  */
+			if (!warned) {
+				WARNING("For compatibility with the "
+					"Windows bootloader, some "
+					"files are being\n"
+					"          compacted "
+					"using the XPRESS4K format "
+					"instead of the %"TS" format\n"
+					"          you requested.",
+					get_system_compression_format_string(*format));
+			}
+			*format = FILE_PROVIDER_COMPRESSION_XPRESS4K;
+		} else {
+			/* Force to uncompressed  */
+			if (!warned) {
+				WARNING("For compatibility with the "
+					"Windows bootloader, some "
+					"files will not\n"
+					"          be compressed with"
+					" system compression "
+					"(\"compacted\").");
+			}
+			*format = -1;
 		}
+		break;
 	}
+	return STATUS_SUCCESS;
+}
+
+/* Compress the extracted file @inode using System Compression.  This may be
+ * called from any thread, as long as @ctx is only used by that thread.  */
+static NTSTATUS
+set_system_compression_on_inode(struct wim_inode *inode, int format,
+				struct win32_apply_ctx *ctx)
+{
+	bool retried = false;
+	NTSTATUS status;
+	HANDLE h;
 
 	/* Open the extracted file.  */
 	status = create_file(&h, GENERIC_READ | GENERIC_WRITE, NULL,
@@ -2637,41 +3093,74 @@ retry:
 	return status;
 }
 
+struct compact_task {
+	struct pool_task base;
+	struct win32_apply_ctx *ctx;
+	struct win32_apply_ctx *thread_ctx;
+};
+
+static void
+compact_task_run(struct pool_task *_task)
+{
+	struct compact_task *task =
+		container_of(_task, struct compact_task, base);
+	struct win32_apply_ctx *ctx = task->ctx;
+	unsigned i;
+
+	while ((i = __atomic_fetch_add(&ctx->compact.next, 1,
+				       __ATOMIC_RELAXED)) <
+	       ctx->compact.num_files)
+		ctx->compact.statuses[i] = set_system_compression_on_inode(
+						ctx->compact.inodes[i],
+						ctx->compact.formats[i],
+						task->thread_ctx);
+}
+
 /*
- * This function is called when doing a "compact-mode" extraction and we just
- * finished extracting a blob to one or more locations.  For each location that
- * was the unnamed data stream of a file, this function compresses the
- * corresponding file using System Compression, if allowed.
- *
- * Note: we're doing the compression immediately after extracting the data
- * rather than during a separate compression pass.  This way should be faster
- * since the operating system should still have the file's data cached.
+ * Compress the files queued by queue_system_compression(), then report any
+ * failures in the order of the files.
  *
- * Note: we're having the operating system do the compression, which is not
- * ideal because wimlib could create the compressed data faster and more
- * efficiently (the compressed data format is identical to a WIM resource).  But
- * we seemingly don't have a choice because WOF prevents applications from
- * creating its reparse points.
+ * The compression is done by the operating system, synchronously in the thread
+ * which requests it, so requesting it for several files from different threads
+ * is what makes it run in parallel.  The files don't depend on each other.
  */
 static void
-handle_system_compression(struct blob_descriptor *blob, struct win32_apply_ctx *ctx)
+flush_system_compression(struct win32_apply_ctx *ctx)
 {
-	const struct blob_extraction_target *targets = blob_extraction_targets(blob);
+	struct compact_task tasks[MAX_COMPACT_THREADS];
+	struct pool_task *task_ptrs[MAX_COMPACT_THREADS];
+	unsigned num_files = ctx->compact.num_files;
+	unsigned n;
 
-	const int format = get_system_compression_format(ctx->common.extract_flags);
+	if (num_files == 0)
+		return;
 
-	for (u32 i = 0; i < blob->out_refcnt; i++) {
-		struct wim_inode *inode = targets[i].inode;
-		struct wim_inode_stream *strm = targets[i].stream;
-		NTSTATUS status;
+	if (ctx->compact.num_ctxs == 0) {
+		ctx->compact.ctxs[0] = ctx;
+		ctx->compact.num_ctxs = 1;
+		n = min(task_pool_num_threads(), MAX_COMPACT_THREADS);
+		while (ctx->compact.num_ctxs < n &&
+		       (ctx->compact.ctxs[ctx->compact.num_ctxs] =
+				new_metadata_ctx(ctx)) != NULL)
+			ctx->compact.num_ctxs++;
+	}
 
-		if (!stream_is_unnamed_data_stream(strm))
-			continue;
+	n = min(ctx->compact.num_ctxs, num_files);
+	ctx->compact.next = 0;
+	for (unsigned i = 0; i < n; i++) {
+		tasks[i].base.run = compact_task_run;
+		tasks[i].ctx = ctx;
+		tasks[i].thread_ctx = ctx->compact.ctxs[i];
+		task_ptrs[i] = &tasks[i].base;
+	}
+	task_pool_run_batch(task_ptrs, n);
 
-		if (will_externally_back_inode(inode, ctx, NULL, false) != 0)
-			continue;
+	ctx->compact.num_files = 0;
+	ctx->compact.total_size = 0;
+
+	for (unsigned i = 0; i < num_files; i++) {
+		NTSTATUS status = ctx->compact.statuses[i];
 
-		status = set_system_compression_on_inode(inode, format, ctx);
 		if (likely(NT_SUCCESS(status)))
 			continue;
 
@@ -2687,6 +3176,8 @@ handle_system_compression(struct blob_descriptor *blob, struct win32_apply_ctx *
 
 		ctx->num_system_compression_failures++;
 		if (ctx->num_system_compression_failures < 10) {
+			build_extraction_path(inode_first_extraction_dentry(
+						ctx->compact.inodes[i]), ctx);
 			winnt_warning(status, L"\"%ls\": Failed to compress "
 				      "extracted file using System Compression",
 				      current_path(ctx));
@@ -2697,6 +3188,76 @@ handle_system_compression(struct blob_descriptor *blob, struct win32_apply_ctx *
 	}
 }
 
+static void
+free_system_compression_ctxs(struct win32_apply_ctx *ctx)
+{
+	for (unsigned i = 1; i < ctx->compact.num_ctxs; i++)
+		merge_metadata_ctx(ctx, ctx->compact.ctxs[i]);
+	ctx->compact.num_ctxs = 0;
+}
+
+/*
+ * This function is called when doing a "compact-mode" extraction and we just
+ * finished extracting a blob to one or more locations.  For each location that
+ * was the unnamed data stream of a file, this function queues the
+ * corresponding file to be compressed using System Compression, if allowed.
+ * The queued files are compressed in batches by flush_system_compression().
+ *
+ * Note: we're doing the compression soon after extracting the data rather than
+ * during a separate compression pass.  This way should be faster since the
+ * operating system should still have the files' data cached; this is also why
+ * the total size of a batch is limited.
+ *
+ * Note: we're having the operating system do the compression, which is not
+ * ideal because wimlib could create the compressed data faster and more
+ * efficiently (the compressed data format is identical to a WIM resource).  But
+ * we seemingly don't have a choice because WOF prevents applications from
+ * creating its reparse points.
+ */
+static void
+queue_system_compression(struct blob_descriptor *blob,
+			 struct win32_apply_ctx *ctx)
+{
+	const struct blob_extraction_target *targets = blob_extraction_targets(blob);
+
+	const int requested_format =
+		get_system_compression_format(ctx->common.extract_flags);
+
+	for (u32 i = 0; i < blob->out_refcnt; i++) {
+		struct wim_inode *inode = targets[i].inode;
+		struct wim_inode_stream *strm = targets[i].stream;
+		int format = requested_format;
+		unsigned n;
+
+		if (!stream_is_unnamed_data_stream(strm))
+			continue;
+
+		if (will_externally_back_inode(inode, ctx, NULL, false) != 0)
+			continue;
+
+		if (!NT_SUCCESS(choose_system_compression_format(inode, &format,
+								 ctx)))
+		{
+			ctx->num_system_compression_failures++;
+			continue;
+		}
+		if (format < 0)
+			continue;
+
+		n = ctx->compact.num_files++;
+		ctx->compact.inodes[n] = inode;
+		ctx->compact.formats[n] = format;
+		ctx->compact.total_size += blob->size;
+		if (ctx->compact.num_files == MAX_COMPACT_BATCH_FILES ||
+		    ctx->compact.total_size >= MAX_COMPACT_BATCH_SIZE)
+		{
+			flush_system_compression(ctx);
+			if (!(ctx->common.extract_flags & COMPACT_FLAGS))
+				return;
+		}
+	}
+}
+
 /* Called when a blob has been fully read for extraction */
 static int
 win32_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
@@ -2705,6 +3266,11 @@ win32_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 	int ret;
 	const struct wim_dentry *dentry;
 
+	/* Finish writing the data.  */
+	ret = wait_for_all_writes(ctx);
+	if (!status)
+		status = ret;
+
 	/* Extend sparse streams to their final size. */
 	if (ctx->any_sparse_streams && !status) {
 		for (unsigned i = 0; i < ctx->num_open_handles; i++) {
@@ -2734,7 +3300,7 @@ win32_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 		return status;
 
 	if (unlikely(ctx->common.extract_flags & COMPACT_FLAGS))
-		handle_system_compression(blob, ctx);
+		queue_system_compression(blob, ctx);
 
 	if (likely(!ctx->data_buffer_ptr))
 		return 0;
@@ -3014,6 +3580,12 @@ set_security_descriptor(HANDLE h, const void *_desc,
 	       DACL_SECURITY_INFORMATION | SACL_SECURITY_INFORMATION |
 	       LABEL_SECURITY_INFORMATION | BACKUP_SECURITY_INFORMATION;
 
+	/* Don't bother trying to set the SACL if an earlier file showed that we
+	 * don't have the privilege to do so.  */
+	if (ctx->sd_info_not_held & SACL_SECURITY_INFORMATION) {
+		info &= ~ctx->sd_info_not_held;
+		ctx->partial_security_descriptors++;
+	}
 
 	/*
 	 * It's also worth noting that SetFileSecurity() is unusable because it
@@ -3041,6 +3613,11 @@ retry:
 			info &= ~(SACL_SECURITY_INFORMATION |
 				  LABEL_SECURITY_INFORMATION |
 				  BACKUP_SECURITY_INFORMATION);
+			if (status == STATUS_PRIVILEGE_NOT_HELD)
+				ctx->sd_info_not_held |=
+					SACL_SECURITY_INFORMATION |
+					LABEL_SECURITY_INFORMATION |
+					BACKUP_SECURITY_INFORMATION;
 			ctx->partial_security_descriptors++;
 			goto retry;
 		}
@@ -3152,8 +3729,8 @@ apply_metadata_to_file(const struct wim_dentry *dentry,
 	NTSTATUS status;
 	int ret;
 
-	perms = FILE_WRITE_ATTRIBUTES | FILE_WRITE_EA | WRITE_DAC |
-		WRITE_OWNER | ACCESS_SYSTEM_SECURITY;
+	perms = (FILE_WRITE_ATTRIBUTES | FILE_WRITE_EA | WRITE_DAC |
+		 WRITE_OWNER | ACCESS_SYSTEM_SECURITY) & ~ctx->perms_not_held;
 
 	build_extraction_path(dentry, ctx);
 
@@ -3166,6 +3743,9 @@ apply_metadata_to_file(const struct wim_dentry *dentry,
 		{
 			if (perms & ACCESS_SYSTEM_SECURITY) {
 				perms &= ~ACCESS_SYSTEM_SECURITY;
+				if (status == STATUS_PRIVILEGE_NOT_HELD)
+					ctx->perms_not_held |=
+						ACCESS_SYSTEM_SECURITY;
 				continue;
 			}
 			if (perms & WRITE_DAC) {
@@ -3189,19 +3769,124 @@ apply_metadata_to_file(const struct wim_dentry *dentry,
 	return ret;
 }
 
+/* Maximum number of threads which apply metadata at the same time  */
+#define MAX_METADATA_THREADS	8
+
+/* Minimum number of files in a batch for it to be processed in parallel  */
+#define MIN_PARALLEL_FILES	16
+
+struct metadata_batch {
+	const struct wim_dentry **dentries;
+	int *rets;
+	size_t num_dentries;
+	size_t next;
+};
+
+struct metadata_task {
+	struct pool_task base;
+	struct metadata_batch *batch;
+	struct win32_apply_ctx *ctx;
+};
+
+static void
+metadata_task_run(struct pool_task *_task)
+{
+	struct metadata_task *task =
+		container_of(_task, struct metadata_task, base);
+	struct metadata_batch *batch = task->batch;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+	       batch->num_dentries)
+		batch->rets[i] = apply_metadata_to_file(batch->dentries[i],
+							task->ctx);
+}
+
+/* Create a copy of @ctx through which another thread can apply metadata.  It
+ * gets its own path buffers and its own counts of failures, which
+ * merge_metadata_ctx() adds back to @ctx.  */
+static struct win32_apply_ctx *
+new_metadata_ctx(const struct win32_apply_ctx *ctx)
+{
+	struct win32_apply_ctx *mctx;
+	size_t path_max = ctx->pathbuf.MaximumLength / sizeof(wchar_t);
+
+	mctx = MALLOC(sizeof(*mctx));
+	if (!mctx)
+		return NULL;
+	memcpy(mctx, ctx, sizeof(*mctx));
+	mctx->attr.ObjectName = &mctx->pathbuf;
+	mctx->pathbuf.Buffer = MALLOC(ctx->pathbuf.MaximumLength);
+	mctx->print_buffer = MALLOC((ctx->common.target_nchars + 1 +
+				     path_max + 1) * sizeof(wchar_t));
+	if (!mctx->pathbuf.Buffer || !mctx->print_buffer) {
+		FREE(mctx->pathbuf.Buffer);
+		FREE(mctx->print_buffer);
+		FREE(mctx);
+		return NULL;
+	}
+	mctx->partial_security_descriptors = 0;
+	mctx->no_security_descriptors = 0;
+	mctx->num_object_id_failures = 0;
+	mctx->num_xattr_failures = 0;
+	return mctx;
+}
+
+static void
+merge_metadata_ctx(struct win32_apply_ctx *ctx, struct win32_apply_ctx *mctx)
+{
+	ctx->partial_security_descriptors += mctx->partial_security_descriptors;
+	ctx->no_security_descriptors += mctx->no_security_descriptors;
+	ctx->num_object_id_failures += mctx->num_object_id_failures;
+	ctx->num_xattr_failures += mctx->num_xattr_failures;
+	if (!mctx->common.supported_features.xattrs)
+		ctx->common.supported_features.xattrs = 0;
+	FREE(mctx->pathbuf.Buffer);
+	FREE(mctx->print_buffer);
+	FREE(mctx);
+}
+
+static unsigned
+dentry_depth(const struct wim_dentry *dentry)
+{
+	unsigned depth = 0;
+
+	while (!dentry_is_root(dentry)) {
+		dentry = dentry->d_parent;
+		depth++;
+	}
+	return depth;
+}
+
+/*
+ * Apply metadata to the files in @batch, using the threads of @mctxs[0..n-1] if
+ * the batch is large enough, then handle the errors and report progress in the
+ * order of the files.  Since the applications of the metadata don't depend on
+ * each other, an error only takes effect after the whole batch is done.
+ */
 static int
-apply_metadata(struct list_head *dentry_list, struct win32_apply_ctx *ctx)
+apply_metadata_batch(struct metadata_batch *batch,
+		     struct win32_apply_ctx **mctxs, unsigned n,
+		     struct win32_apply_ctx *ctx)
 {
-	const struct wim_dentry *dentry;
+	struct metadata_task tasks[MAX_METADATA_THREADS];
+	struct pool_task *task_ptrs[MAX_METADATA_THREADS];
 	int ret;
 
-	/* We go in reverse so that metadata is set on all a directory's
-	 * children before the directory itself.  This avoids any potential
-	 * problems with attributes, timestamps, or security descriptors.  */
-	list_for_each_entry_reverse(dentry, dentry_list, d_extraction_list_node)
-	{
-		ret = apply_metadata_to_file(dentry, ctx);
-		ret = check_apply_error(dentry, ctx, ret);
+	if (batch->num_dentries < MIN_PARALLEL_FILES)
+		n = 1;
+	batch->next = 0;
+	for (unsigned i = 0; i < n; i++) {
+		tasks[i].base.run = metadata_task_run;
+		tasks[i].batch = batch;
+		tasks[i].ctx = mctxs[i];
+		task_ptrs[i] = &tasks[i].base;
+	}
+	task_pool_run_batch(task_ptrs, n);
+
+	for (size_t i = 0; i < batch->num_dentries; i++) {
+		ret = check_apply_error(batch->dentries[i], ctx,
+					batch->rets[i]);
 		if (ret)
 			return ret;
 		ret = report_file_metadata_applied(&ctx->common);
@@ -3211,6 +3896,105 @@ apply_metadata(struct list_head *dentry_list, struct win32_apply_ctx *ctx)
 	return 0;
 }
 
+/*
+ * Apply metadata to the extracted files.  Metadata must be set on all a
+ * directory's children before the directory itself, to avoid any potential
+ * problems with attributes, timestamps, or security descriptors.  So, first
+ * the nondirectories are done, then the directories from the deepest to the
+ * shallowest.  The files in each of these groups don't depend on each other,
+ * so they're done by multiple threads; applying metadata is mostly waiting for
+ * system calls, which take a while each when filter drivers are involved.
+ */
+static int
+apply_metadata(struct list_head *dentry_list, struct win32_apply_ctx *ctx)
+{
+	const struct wim_dentry *dentry;
+	const struct wim_dentry **dentries;
+	struct win32_apply_ctx *mctxs[MAX_METADATA_THREADS];
+	unsigned num_mctxs;
+	size_t *level_counts = NULL;
+	unsigned num_levels = 0;
+	size_t num_dentries = 0;
+	size_t num_nondirs = 0;
+	size_t pos;
+	struct metadata_batch batch;
+	int *rets;
+	int ret;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		num_dentries++;
+		if (dentry_is_directory(dentry))
+			num_levels = max(num_levels, dentry_depth(dentry) + 1);
+		else
+			num_nondirs++;
+	}
+	if (num_dentries == 0)
+		return 0;
+
+	dentries = MALLOC(num_dentries * sizeof(dentries[0]));
+	rets = MALLOC(num_dentries * sizeof(rets[0]));
+	level_counts = CALLOC(num_levels + 1, sizeof(level_counts[0]));
+	if (!dentries || !rets || !level_counts) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out_free;
+	}
+
+	/* Order the files: the nondirectories, then the directories sorted by
+	 * decreasing depth.  */
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
+		if (dentry_is_directory(dentry))
+			level_counts[num_levels - 1 - dentry_depth(dentry)]++;
+	pos = num_nondirs;
+	for (unsigned i = 0; i <= num_levels; i++) {
+		size_t count = level_counts[i];
+
+		level_counts[i] = pos;
+		pos += count;
+	}
+	num_nondirs = 0;
+	list_for_each_entry_reverse(dentry, dentry_list,
+				    d_extraction_list_node)
+	{
+		if (dentry_is_directory(dentry))
+			dentries[level_counts[num_levels - 1 -
+					      dentry_depth(dentry)]++] = dentry;
+		else
+			dentries[num_nondirs++] = dentry;
+	}
+	/* Now level_counts[i] is the end of level i.  */
+
+	mctxs[0] = ctx;
+	num_mctxs = 1;
+	if (num_dentries >= MIN_PARALLEL_FILES) {
+		unsigned n = min(task_pool_num_threads(), MAX_METADATA_THREADS);
+
+		while (num_mctxs < n &&
+		       (mctxs[num_mctxs] = new_metadata_ctx(ctx)) != NULL)
+			num_mctxs++;
+	}
+
+	batch.dentries = dentries;
+	batch.rets = rets;
+	batch.num_dentries = num_nondirs;
+	ret = apply_metadata_batch(&batch, mctxs, num_mctxs, ctx);
+	for (unsigned i = 0; i < num_levels && !ret; i++) {
+		batch.dentries = &dentries[batch.dentries - dentries +
+					   batch.num_dentries];
+		batch.rets = &rets[batch.dentries - dentries];
+		batch.num_dentries = level_counts[i] -
+				     (batch.dentries - dentries);
+		ret = apply_metadata_batch(&batch, mctxs, num_mctxs, ctx);
+	}
+
+	for (unsigned i = 1; i < num_mctxs; i++)
+		merge_metadata_ctx(ctx, mctxs[i]);
+out_free:
+	FREE(level_counts);
+	FREE(rets);
+	FREE(dentries);
+	return ret;
+}
+
 /* Issue warnings about problems during the extraction for which warnings were
  * not already issued (due to the high number of potential warnings if we issued
  * them per-file).  */
@@ -3316,6 +4100,9 @@ win32_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 	if (ret)
 		goto out;
 
+	if (unlikely(ctx->common.extract_flags & COMPACT_FLAGS))
+		flush_system_compression(ctx);
+
 	ret = start_file_metadata_phase(&ctx->common, dentry_count);
 	if (ret)
 		goto out;
@@ -3336,6 +4123,8 @@ win32_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 
 	do_warnings(ctx);
 out:
+	close_pending_wimboot_files(ctx);
+	free_system_compression_ctxs(ctx);
 	close_target_directory(ctx);
 	if (ctx->target_ntpath.Buffer)
 		HeapFree(GetProcessHeap(), 0, ctx->target_ntpath.Buffer);
@@ -3348,6 +4137,11 @@ out:
 	}
 	FREE(ctx->mem_prepopulate_pats);
 	FREE(ctx->data_buffer);
+	if (ctx->iocp) {
+		wait_for_all_writes(ctx);
+		CloseHandle(ctx->iocp);
+	}
+	free_write_buffers(ctx);
 	return ret;
 }
 
@@ -35,6 +35,7 @@
 #include "wimlib/encoding.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
+#include "wimlib/hash_cache.h"
 #include "wimlib/object_id.h"
 #include "wimlib/paths.h"
 #include "wimlib/reparse.h"
@@ -56,6 +57,14 @@ struct winnt_scan_ctx {
 
 	/* A reference to the VSS snapshot being used, or NULL if none  */
 	struct vss_snapshot *snapshot;
+
+	/* True if the fast MFT scan is capturing a directory other than the
+	 * root directory of the volume  */
+	bool mft_scan_of_subdir;
+
+	/* True if the filesystem doesn't support enumerating directories with
+	 * FileIdBothDirectoryInformation  */
+	bool dir_entry_info_unsupported;
 };
 
 static inline const wchar_t *
@@ -75,9 +84,13 @@ struct windows_file {
 	 * path"?  "Open by file ID" uses resources more efficiently.  */
 	u64 is_file_id : 1;
 
+	/* Should the data be read with several overlapped reads in flight
+	 * (WIMLIB_ADD_FLAG_OVERLAPPED_READS)?  */
+	u64 overlapped_reads : 1;
+
 	/* The file's LCN (logical cluster number) for sorting, or 0 if unknown.
 	 */
-	u64 sort_key : 62;
+	u64 sort_key : 61;
 
 	/* Length of the path in bytes, excluding the null terminator if
 	 * present.  */
@@ -116,6 +129,7 @@ alloc_windows_file(const wchar_t *path, size_t path_nchars,
 
 	file->is_encrypted = is_encrypted;
 	file->is_file_id = 0;
+	file->overlapped_reads = 0;
 	file->sort_key = 0;
 	file->path_nbytes = full_path_nbytes;
 	file->snapshot = vss_get_snapshot(snapshot);
@@ -148,6 +162,7 @@ alloc_windows_file_for_file_id(u64 file_id, const wchar_t *root_path,
 
 	file->is_encrypted = 0;
 	file->is_file_id = 1;
+	file->overlapped_reads = 0;
 	file->sort_key = 0;
 	file->path_nbytes = full_path_nbytes;
 	file->snapshot = vss_get_snapshot(snapshot);
@@ -161,7 +176,7 @@ alloc_windows_file_for_file_id(u64 file_id, const wchar_t *root_path,
 static int
 add_stream(struct wim_inode *inode, struct windows_file *windows_file,
 	   u64 stream_size, int stream_type, const utf16lechar *stream_name,
-	   struct list_head *unhashed_blobs)
+	   const struct winnt_scan_ctx *ctx)
 {
 	struct blob_descriptor *blob = NULL;
 	struct wim_inode_stream *strm;
@@ -170,6 +185,10 @@ add_stream(struct wim_inode *inode, struct windows_file *windows_file,
 	if (!windows_file)
 		goto err_nomem;
 
+	if ((ctx->params->add_flags & WIMLIB_ADD_FLAG_OVERLAPPED_READS) &&
+	    !windows_file->is_encrypted)
+		windows_file->overlapped_reads = 1;
+
 	/* If the stream is nonempty, create a blob descriptor for it.  */
 	if (stream_size) {
 		blob = new_blob_descriptor();
@@ -186,7 +205,8 @@ add_stream(struct wim_inode *inode, struct windows_file *windows_file,
 	if (!strm)
 		goto err_nomem;
 
-	prepare_unhashed_blob(blob, inode, strm->stream_id, unhashed_blobs);
+	prepare_unhashed_blob(blob, inode, strm->stream_id,
+			      ctx->params->unhashed_blobs);
 	ret = 0;
 out:
 	if (windows_file)
@@ -314,9 +334,12 @@ windows_file_to_string(const struct windows_file *file, u8 *buf, size_t bufsize)
 	return (wchar_t *)buf;
 }
 
+/* Open the stream described by @file for reading its data, either for
+ * synchronous reads from the current position or, if @overlapped is true, for
+ * asynchronous reads at explicit offsets.  */
 static int
-read_winnt_stream_prefix(const struct windows_file *file,
-			 u64 size, const struct consume_chunk_callback *cb)
+open_windows_file_for_read(const struct windows_file *file, bool overlapped,
+			   HANDLE *h_ret)
 {
 	IO_STATUS_BLOCK iosb;
 	UNICODE_STRING name = {
@@ -328,18 +351,15 @@ read_winnt_stream_prefix(const struct windows_file *file,
 		.Length = sizeof(attr),
 		.ObjectName = &name,
 	};
-	HANDLE h;
 	NTSTATUS status;
 	u8 buf[BUFFER_SIZE] __attribute__((aligned(8)));
-	u64 bytes_remaining;
-	int ret;
 
-	status = NtOpenFile(&h, FILE_READ_DATA | SYNCHRONIZE,
+	status = NtOpenFile(h_ret, FILE_READ_DATA | SYNCHRONIZE,
 			    &attr, &iosb,
 			    FILE_SHARE_VALID_FLAGS,
 			    FILE_OPEN_REPARSE_POINT |
 				FILE_OPEN_FOR_BACKUP_INTENT |
-				FILE_SYNCHRONOUS_IO_NONALERT |
+				(overlapped ? 0 : FILE_SYNCHRONOUS_IO_NONALERT) |
 				FILE_SEQUENTIAL_ONLY |
 				(file->is_file_id ? FILE_OPEN_BY_FILE_ID : 0));
 	if (unlikely(!NT_SUCCESS(status))) {
@@ -354,8 +374,147 @@ read_winnt_stream_prefix(const struct windows_file *file,
 		}
 		return WIMLIB_ERR_OPEN;
 	}
+	return 0;
+}
+
+/* With WIMLIB_ADD_FLAG_OVERLAPPED_READS, the number of reads of a file kept in
+ * flight at once, and the size of each read.  Files no larger than one read are
+ * read synchronously.  */
+#define OVERLAPPED_READ_DEPTH	8
+#define OVERLAPPED_READ_SIZE	(256U << 10)
+
+static int
+overlapped_read_error(const struct windows_file *file, NTSTATUS status)
+{
+	u8 buf[BUFFER_SIZE] __attribute__((aligned(8)));
+
+	if (status == STATUS_END_OF_FILE) {
+		ERROR("%ls: File was concurrently truncated",
+		      windows_file_to_string(file, buf, sizeof(buf)));
+		return WIMLIB_ERR_CONCURRENT_MODIFICATION_DETECTED;
+	}
+	winnt_error(status, L"Error reading data from %ls",
+		    windows_file_to_string(file, buf, sizeof(buf)));
+	return WIMLIB_ERR_READ;
+}
+
+/*
+ * Read the first @size bytes of the stream described by @file, keeping up to
+ * OVERLAPPED_READ_DEPTH reads in flight.  The reads are issued in order of
+ * increasing offset and their data is consumed in the same order, so that
+ * devices which can process several requests at once (SSDs, RAID arrays,
+ * network storage) are kept busy while the access pattern stays sequential.
+ * Unlike read_winnt_stream_prefix(), failed reads aren't retried.
+ */
+static int
+read_winnt_stream_prefix_overlapped(const struct windows_file *file,
+				    u64 size,
+				    const struct consume_chunk_callback *cb)
+{
+	struct {
+		IO_STATUS_BLOCK iosb;
+		HANDLE event;
+		ULONG len;
+	} reads[OVERLAPPED_READ_DEPTH];
+	u8 *bufs;
+	HANDLE h;
+	NTSTATUS status;
+	u64 next_offset = 0;
+	unsigned head = 0;
+	unsigned num_pending = 0;
+	int ret;
+
+	ret = open_windows_file_for_read(file, true, &h);
+	if (ret)
+		return ret;
+
+	for (unsigned i = 0; i < OVERLAPPED_READ_DEPTH; i++)
+		reads[i].event = NULL;
+	ret = WIMLIB_ERR_NOMEM;
+	bufs = MALLOC(OVERLAPPED_READ_DEPTH * OVERLAPPED_READ_SIZE);
+	if (!bufs)
+		goto out;
+	for (unsigned i = 0; i < OVERLAPPED_READ_DEPTH; i++) {
+		reads[i].event = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (!reads[i].event)
+			goto out;
+	}
 
 	ret = 0;
+	for (;;) {
+		/* Keep the queue full, unless an error occurred, in which case
+		 * only the reads in flight are waited for.  */
+		while (!ret && num_pending < OVERLAPPED_READ_DEPTH &&
+		       next_offset < size)
+		{
+			unsigned i = (head + num_pending) %
+				     OVERLAPPED_READ_DEPTH;
+			LARGE_INTEGER offs = { .QuadPart = next_offset };
+
+			reads[i].len = min(OVERLAPPED_READ_SIZE,
+					   size - next_offset);
+			status = NtReadFile(h, reads[i].event, NULL, NULL,
+					    &reads[i].iosb,
+					    &bufs[i * OVERLAPPED_READ_SIZE],
+					    reads[i].len, &offs, NULL);
+			if (unlikely(!NT_SUCCESS(status))) {
+				ret = overlapped_read_error(file, status);
+				break;
+			}
+			num_pending++;
+			next_offset += reads[i].len;
+		}
+
+		if (num_pending == 0)
+			break;
+
+		/* Consume the oldest read once it has completed.  */
+		unsigned i = head;
+
+		NtWaitForSingleObject(reads[i].event, FALSE, NULL);
+		head = (head + 1) % OVERLAPPED_READ_DEPTH;
+		num_pending--;
+		if (ret)
+			continue;
+		status = reads[i].iosb.Status;
+		if (unlikely(!NT_SUCCESS(status))) {
+			ret = overlapped_read_error(file, status);
+			continue;
+		}
+		if (unlikely(reads[i].iosb.Information != reads[i].len)) {
+			/* Only reads past the end of the file come up short. */
+			ret = overlapped_read_error(file, STATUS_END_OF_FILE);
+			continue;
+		}
+		ret = consume_chunk(cb, &bufs[i * OVERLAPPED_READ_SIZE],
+				    reads[i].len);
+	}
+out:
+	for (unsigned i = 0; i < OVERLAPPED_READ_DEPTH; i++)
+		if (reads[i].event)
+			CloseHandle(reads[i].event);
+	FREE(bufs);
+	NtClose(h);
+	return ret;
+}
+
+static int
+read_winnt_stream_prefix(const struct windows_file *file,
+			 u64 size, const struct consume_chunk_callback *cb)
+{
+	HANDLE h;
+	NTSTATUS status;
+	u8 buf[BUFFER_SIZE] __attribute__((aligned(8)));
+	u64 bytes_remaining;
+	int ret;
+
+	if (file->overlapped_reads && size > OVERLAPPED_READ_SIZE)
+		return read_winnt_stream_prefix_overlapped(file, size, cb);
+
+	ret = open_windows_file_for_read(file, false, &h);
+	if (ret)
+		return ret;
+
 	bytes_remaining = size;
 	while (bytes_remaining) {
 		IO_STATUS_BLOCK iosb;
@@ -501,6 +660,16 @@ read_windows_file_prefix(const struct blob_descriptor *blob, u64 size,
 	return read_winnt_stream_prefix(file, size, cb);
 }
 
+static NTSTATUS
+set_short_name(struct wim_dentry *dentry, const wchar_t *name, size_t nbytes)
+{
+	dentry->d_short_name = utf16le_dupz(name, nbytes);
+	if (!dentry->d_short_name)
+		return STATUS_NO_MEMORY;
+	dentry->d_short_name_nbytes = nbytes;
+	return STATUS_SUCCESS;
+}
+
 /*
  * Load the short name of a file into a WIM dentry.
  */
@@ -518,13 +687,9 @@ winnt_get_short_name(HANDLE h, struct wim_dentry *dentry)
 	status = NtQueryInformationFile(h, &iosb, buf, sizeof(buf),
 					FileAlternateNameInformation);
 	info = (const FILE_NAME_INFORMATION *)buf;
-	if (NT_SUCCESS(status) && info->FileNameLength != 0) {
-		dentry->d_short_name = utf16le_dupz(info->FileName,
-						    info->FileNameLength);
-		if (!dentry->d_short_name)
-			return STATUS_NO_MEMORY;
-		dentry->d_short_name_nbytes = info->FileNameLength;
-	}
+	if (NT_SUCCESS(status) && info->FileNameLength != 0)
+		status = set_short_name(dentry, info->FileName,
+					info->FileNameLength);
 	return status;
 }
 
@@ -803,6 +968,66 @@ out:
 	return ret;
 }
 
+struct file_info {
+	u32 attributes;
+	u32 num_links;
+	u64 creation_time;
+	u64 last_write_time;
+	u64 last_access_time;
+	u64 change_time;
+	u64 ino;
+	u64 end_of_file;
+	u32 ea_size;
+};
+
+/* What the directory enumeration returned about a file  */
+struct dir_entry_info {
+	struct file_info info;	/* except for num_links, which is unknown */
+	const wchar_t *short_name;
+	size_t short_name_nbytes;
+};
+
+/* The FileIdBothDirectoryInformation class of NtQueryDirectoryFile(), in
+ * which each entry has the file's ID, short name, and basic information  */
+#define FileIdBothDirectoryInformation_	((FILE_INFORMATION_CLASS)37)
+
+typedef struct {
+	u32 NextEntryOffset;
+	u32 FileIndex;
+	s64 CreationTime;
+	s64 LastAccessTime;
+	s64 LastWriteTime;
+	s64 ChangeTime;
+	s64 EndOfFile;
+	s64 AllocationSize;
+	u32 FileAttributes;
+	u32 FileNameLength;
+	u32 EaSize;
+	s8 ShortNameLength;
+	wchar_t ShortName[12];
+	s64 FileId;
+	wchar_t FileName[1];
+} FILE_ID_BOTH_DIR_ENTRY;
+
+static void
+load_dir_entry_info(const FILE_ID_BOTH_DIR_ENTRY *info,
+		    struct dir_entry_info *entry)
+{
+	entry->info.attributes = info->FileAttributes;
+	entry->info.num_links = 0;
+	entry->info.creation_time = info->CreationTime;
+	entry->info.last_write_time = info->LastWriteTime;
+	entry->info.last_access_time = info->LastAccessTime;
+	entry->info.change_time = info->ChangeTime;
+	entry->info.ino = info->FileId;
+	entry->info.end_of_file = info->EndOfFile;
+	/* For reparse points, this field is the reparse tag instead  */
+	entry->info.ea_size = (info->FileAttributes &
+			       FILE_ATTRIBUTE_REPARSE_POINT) ? 0 : info->EaSize;
+	entry->short_name = info->ShortName;
+	entry->short_name_nbytes = (u8)info->ShortNameLength;
+}
+
 static int
 winnt_build_dentry_tree(struct wim_dentry **root_ret,
 			HANDLE cur_dir,
@@ -810,7 +1035,8 @@ winnt_build_dentry_tree(struct wim_dentry **root_ret,
 			size_t relative_path_nchars,
 			const wchar_t *filename,
 			struct winnt_scan_ctx *ctx,
-			bool recursive);
+			bool recursive,
+			const struct dir_entry_info *entry);
 
 static int
 winnt_recurse_directory(HANDLE h,
@@ -821,6 +1047,7 @@ winnt_recurse_directory(HANDLE h,
 	const size_t bufsize = 8192;
 	IO_STATUS_BLOCK iosb;
 	NTSTATUS status;
+	FILE_INFORMATION_CLASS info_class;
 	int ret;
 
 	buf = MALLOC(bufsize);
@@ -828,26 +1055,63 @@ winnt_recurse_directory(HANDLE h,
 		return WIMLIB_ERR_NOMEM;
 
 	/* Using NtQueryDirectoryFile() we can re-use the same open handle,
-	 * which we opened with FILE_FLAG_BACKUP_SEMANTICS.  */
+	 * which we opened with FILE_FLAG_BACKUP_SEMANTICS.  Ask for the
+	 * information about each file along with its name if the filesystem
+	 * supports it, since some files then don't need to be opened at all.  */
 
-	while (NT_SUCCESS(status = NtQueryDirectoryFile(h, NULL, NULL, NULL,
-							&iosb, buf, bufsize,
-							FileNamesInformation,
-							FALSE, NULL, FALSE)))
-	{
-		const FILE_NAMES_INFORMATION *info = buf;
+	info_class = ctx->dir_entry_info_unsupported ?
+			FileNamesInformation : FileIdBothDirectoryInformation_;
+	for (;;) {
+		const u8 *p = buf;
+
+		status = NtQueryDirectoryFile(h, NULL, NULL, NULL, &iosb,
+					      buf, bufsize, info_class,
+					      FALSE, NULL, FALSE);
+		if (!NT_SUCCESS(status)) {
+			if (info_class == FileNamesInformation ||
+			    (status != STATUS_INVALID_INFO_CLASS &&
+			     status != STATUS_INVALID_PARAMETER &&
+			     status != STATUS_NOT_IMPLEMENTED &&
+			     status != STATUS_NOT_SUPPORTED))
+				break;
+			ctx->dir_entry_info_unsupported = true;
+			info_class = FileNamesInformation;
+			continue;
+		}
 		for (;;) {
-			if (!should_ignore_filename(info->FileName,
-						    info->FileNameLength / 2))
-			{
+			const wchar_t *name;
+			size_t name_nchars;
+			u32 next_entry_offset;
+			struct dir_entry_info entry;
+			const struct dir_entry_info *entry_p = NULL;
+
+			if (info_class == FileNamesInformation) {
+				const FILE_NAMES_INFORMATION *info =
+					(const void *)p;
+
+				name = info->FileName;
+				name_nchars = info->FileNameLength / 2;
+				next_entry_offset = info->NextEntryOffset;
+			} else {
+				const FILE_ID_BOTH_DIR_ENTRY *info =
+					(const void *)p;
+
+				name = info->FileName;
+				name_nchars = info->FileNameLength / 2;
+				next_entry_offset = info->NextEntryOffset;
+				load_dir_entry_info(info, &entry);
+				entry_p = &entry;
+			}
+
+			if (!should_ignore_filename(name, name_nchars)) {
 				struct wim_dentry *child;
 				size_t orig_path_nchars;
 				const wchar_t *filename;
 
 				ret = WIMLIB_ERR_NOMEM;
 				filename = pathbuf_append_name(ctx->params,
-							       info->FileName,
-							       info->FileNameLength / 2,
+							       name,
+							       name_nchars,
 							       &orig_path_nchars);
 				if (!filename)
 					goto out_free_buf;
@@ -856,25 +1120,25 @@ winnt_recurse_directory(HANDLE h,
 							&child,
 							h,
 							filename,
-							info->FileNameLength / 2,
+							name_nchars,
 							filename,
 							ctx,
-							true);
+							true,
+							entry_p);
 
 				pathbuf_truncate(ctx->params, orig_path_nchars);
 
 				if (ret)
 					goto out_free_buf;
-				attach_scanned_tree(parent, child,
-						    ctx->params->blob_table);
+				attach_scanned_tree(parent, child, ctx->params);
 			}
-			if (info->NextEntryOffset == 0)
+			if (next_entry_offset == 0)
 				break;
-			info = (const FILE_NAMES_INFORMATION *)
-					((const u8 *)info + info->NextEntryOffset);
+			p += next_entry_offset;
 		}
 	}
 
+	ret = 0;
 	if (unlikely(status != STATUS_NO_MORE_FILES)) {
 		winnt_error(status, L"\"%ls\": Can't read directory",
 			    printable_path(ctx));
@@ -1251,7 +1515,7 @@ winnt_scan_efsrpc_raw_data(struct wim_inode *inode,
 	windows_file = alloc_windows_file(path, path_nchars, NULL, 0,
 					  ctx->snapshot, true);
 	ret = add_stream(inode, windows_file, size, STREAM_TYPE_EFSRPC_RAW_DATA,
-			 NO_STREAM_NAME, ctx->params->unhashed_blobs);
+			 NO_STREAM_NAME, ctx);
 out:
 	path[1] = L'?';
 	return ret;
@@ -1314,7 +1578,7 @@ winnt_scan_data_stream(wchar_t *raw_stream_name, size_t raw_stream_name_nchars,
 					  stream_name, stream_name_nchars,
 					  ctx->snapshot, false);
 	return add_stream(inode, windows_file, stream_size, STREAM_TYPE_DATA,
-			  stream_name, ctx->params->unhashed_blobs);
+			  stream_name, ctx);
 }
 
 /*
@@ -1616,17 +1880,6 @@ try_to_use_wimboot_hash(HANDLE h, struct wim_inode *inode,
 	return 0;
 }
 
-struct file_info {
-	u32 attributes;
-	u32 num_links;
-	u64 creation_time;
-	u64 last_write_time;
-	u64 last_access_time;
-	u64 ino;
-	u64 end_of_file;
-	u32 ea_size;
-};
-
 static noinline_for_stack NTSTATUS
 get_file_info(HANDLE h, struct file_info *info)
 {
@@ -1645,12 +1898,29 @@ get_file_info(HANDLE h, struct file_info *info)
 	info->creation_time = all_info.BasicInformation.CreationTime.QuadPart;
 	info->last_write_time = all_info.BasicInformation.LastWriteTime.QuadPart;
 	info->last_access_time = all_info.BasicInformation.LastAccessTime.QuadPart;
+	info->change_time = all_info.BasicInformation.ChangeTime.QuadPart;
 	info->ino = all_info.InternalInformation.IndexNumber.QuadPart;
 	info->end_of_file = all_info.StandardInformation.EndOfFile.QuadPart;
 	info->ea_size = all_info.EaInformation.EaSize;
 	return STATUS_SUCCESS;
 }
 
+/* Look up the file @inode, which has the file ID @ino on the volume being
+ * scanned, in the hash cache.  @size is the size of its unnamed data stream.  */
+static int
+winnt_apply_hash_cache(struct winnt_scan_ctx *ctx, struct wim_inode *inode,
+		       u64 ino, u64 size, u64 change_time)
+{
+	struct hash_cache_key key;
+
+	key.dev = ctx->params->capture_root_dev;
+	key.ino = ino;
+	key.size = size;
+	key.last_write_time = inode->i_last_write_time;
+	key.change_time = change_time;
+	return apply_capture_hash_cache(ctx->params, inode, &key);
+}
+
 static void
 get_volume_information(HANDLE h, struct winnt_scan_ctx *ctx)
 {
@@ -1700,6 +1970,46 @@ get_volume_information(HANDLE h, struct winnt_scan_ctx *ctx)
 	}
 }
 
+/*
+ * Return true if the directory entry @entry includes everything that needs to
+ * be captured from the file, so that the file doesn't need to be opened.
+ * Opening each file is by far the most expensive part of the scan, especially
+ * with antivirus software installed.
+ *
+ * The directory entry doesn't include the file's security descriptor, named
+ * data streams, object ID, or link count, so this is only the case for files
+ * on volumes which don't support them, such as FAT and exFAT volumes, and for
+ * files which have no extended attributes and aren't reparse points, encrypted
+ * files, or directories.  (NTFS volumes are normally scanned by the fast MFT
+ * scan instead, which doesn't open the files either.)
+ */
+static bool
+can_scan_without_opening(const struct dir_entry_info *entry,
+			 const struct winnt_scan_ctx *ctx)
+{
+	if (entry->info.attributes & (FILE_ATTRIBUTE_DIRECTORY |
+				      FILE_ATTRIBUTE_REPARSE_POINT |
+				      FILE_ATTRIBUTE_ENCRYPTED))
+		return false;
+
+	if (entry->info.ea_size != 0)
+		return false;
+
+	if (!(ctx->params->add_flags & WIMLIB_ADD_FLAG_NO_ACLS) &&
+	    (ctx->vol_flags & FILE_PERSISTENT_ACLS))
+		return false;
+
+	if (ctx->is_ntfs ||
+	    (ctx->vol_flags & (FILE_NAMED_STREAMS |
+			       FILE_SUPPORTS_OBJECT_IDS |
+			       FILE_SUPPORTS_HARD_LINKS)))
+		return false;
+
+	/* The check for WIM-backed files needs a handle until it has been found
+	 * that WOF isn't attached.  */
+	return ctx->wof_not_attached;
+}
+
 static int
 winnt_build_dentry_tree(struct wim_dentry **root_ret,
 			HANDLE cur_dir,
@@ -1707,7 +2017,8 @@ winnt_build_dentry_tree(struct wim_dentry **root_ret,
 			size_t relative_path_nchars,
 			const wchar_t *filename,
 			struct winnt_scan_ctx *ctx,
-			bool recursive)
+			bool recursive,
+			const struct dir_entry_info *entry)
 {
 	struct wim_dentry *root = NULL;
 	struct wim_inode *inode = NULL;
@@ -1723,6 +2034,12 @@ winnt_build_dentry_tree(struct wim_dentry **root_ret,
 	if (unlikely(ret > 0)) /* Error? */
 		goto out;
 
+	if (entry && can_scan_without_opening(entry, ctx)) {
+		file_info = entry->info;
+		file_info.num_links = 1;
+		goto have_file_info;
+	}
+
 	/* Open the file with permission to read metadata.  Although we will
 	 * later need a handle with FILE_LIST_DIRECTORY permission (or,
 	 * equivalently, FILE_READ_DATA; they're the same numeric value) if the
@@ -1766,6 +2083,7 @@ winnt_build_dentry_tree(struct wim_dentry **root_ret,
 		goto out;
 	}
 
+have_file_info:
 	/* Create a WIM dentry with an associated inode, which may be shared.
 	 *
 	 * However, we need to explicitly check for directories and files with
@@ -1788,7 +2106,13 @@ winnt_build_dentry_tree(struct wim_dentry **root_ret,
 		goto out;
 
 	/* Get the short (DOS) name of the file.  */
-	status = winnt_get_short_name(h, root);
+	if (h)
+		status = winnt_get_short_name(h, root);
+	else if (entry->short_name_nbytes)
+		status = set_short_name(root, entry->short_name,
+					entry->short_name_nbytes);
+	else
+		status = STATUS_SUCCESS;
 
 	/* If we can't read the short filename for any reason other than
 	 * out-of-memory, just ignore the error and assume the file has no short
@@ -1841,7 +2165,7 @@ winnt_build_dentry_tree(struct wim_dentry **root_ret,
 			goto out;
 	}
 
-	sort_key = get_sort_key(h);
+	sort_key = h ? get_sort_key(h) : 0;
 
 	if (unlikely(inode->i_attributes & FILE_ATTRIBUTE_ENCRYPTED)) {
 		/* Load information about the raw encrypted data.  This is
@@ -1882,6 +2206,14 @@ winnt_build_dentry_tree(struct wim_dentry **root_ret,
 			goto out;
 	}
 
+	if (ctx->params->hash_cache) {
+		ret = winnt_apply_hash_cache(ctx, inode, file_info.ino,
+					     file_info.end_of_file,
+					     file_info.change_time);
+		if (ret)
+			goto out;
+	}
+
 	set_sort_key(inode, sort_key);
 
 	if (inode_is_directory(inode) && recursive) {
@@ -1922,7 +2254,7 @@ out:
 	if (likely(h))
 		NtClose(h);
 	if (unlikely(ret)) {
-		free_dentry_tree(root, ctx->params->blob_table);
+		discard_scanned_tree(ctx->params, root);
 		root = NULL;
 		ret = report_scan_error(ctx->params, ret);
 	}
@@ -2079,6 +2411,10 @@ typedef struct {
  * occupies MFT record 5.  */
 #define NTFS_IS_ROOT_FILE(ino)	(NTFS_MFT_NO(ino) == 5)
 
+/* The full inode number (file reference number) of the root directory, with
+ * its fixed sequence number  */
+#define NTFS_ROOT_FILE_REFERENCE	(((u64)5 << 48) | 5)
+
 /* Is the file a special NTFS file, other than the root directory?  The special
  * files are the first 16 records in the MFT.  */
 #define NTFS_IS_SPECIAL_FILE(ino)			\
@@ -2096,6 +2432,7 @@ struct ntfs_inode {
 	u64 creation_time;
 	u64 last_access_time;
 	u64 last_write_time;
+	u64 change_time;
 	u64 starting_lcn;
 	u32 attributes;
 	u32 security_id;
@@ -2192,6 +2529,119 @@ ntfs_inode_map_remove(struct ntfs_inode_map *map, struct ntfs_inode *ni)
 	FREE(ni);
 }
 
+/*
+ * When the directory being captured isn't the root directory of the volume, the
+ * MFT listing still includes every file on the volume.  To only keep the files
+ * in the directory tree being captured, all directories are first loaded into
+ * a map of 'ntfs_dir' in a separate pass over the MFT, which only needs their
+ * parent directories.  Then a file is in the tree if one of its names is in a
+ * directory whose parent chain leads to the root of the tree.
+ */
+struct ntfs_dir {
+	struct avl_tree_node index_node;
+	u64 ino;
+	u64 parent_ino;
+#define NTFS_DIR_UNKNOWN	0
+#define NTFS_DIR_VISITING	1
+#define NTFS_DIR_IN_SCOPE	2
+#define NTFS_DIR_OUT_OF_SCOPE	3
+	int state;
+};
+
+/* The directory tree being captured by the fast MFT scan  */
+struct ntfs_scan_scope {
+	/* Inode number of the root of the tree  */
+	u64 root_ino;
+
+	/* True if the root of the tree is the root directory of the volume,
+	 * so that all files are in scope; otherwise the map of all
+	 * directories on the volume  */
+	bool whole_volume;
+	struct avl_tree_node *dirs;
+};
+
+#define NTFS_DIR(node)	avl_tree_entry((node), struct ntfs_dir, index_node)
+
+static int
+_avl_cmp_ntfs_dirs(const struct avl_tree_node *node1,
+		   const struct avl_tree_node *node2)
+{
+	return cmp_u64(NTFS_DIR(node1)->ino, NTFS_DIR(node2)->ino);
+}
+
+static struct ntfs_dir *
+ntfs_dir_lookup(const struct ntfs_scan_scope *scope, u64 ino)
+{
+	struct ntfs_dir tmp;
+	struct avl_tree_node *res;
+
+	tmp.ino = ino;
+	res = avl_tree_lookup_node(scope->dirs, &tmp.index_node,
+				   _avl_cmp_ntfs_dirs);
+	if (!res)
+		return NULL;
+	return NTFS_DIR(res);
+}
+
+/* Return true if the directory with inode number @ino is in the tree being
+ * captured.  The answer is cached for each directory along the way.  */
+static bool
+dir_in_scope(struct ntfs_scan_scope *scope, u64 ino)
+{
+	struct ntfs_dir *dir;
+	bool in_scope = false;
+
+	if (scope->whole_volume || ino == scope->root_ino)
+		return true;
+
+	/* Walk up until reaching the root of the tree, a directory already
+	 * known to be in or out of the tree, or the root of the volume.  A
+	 * directory that is already being visited means the parent chain has
+	 * a cycle, which shouldn't happen; such directories are considered out
+	 * of the tree.  */
+	for (dir = ntfs_dir_lookup(scope, ino); dir != NULL;
+	     dir = ntfs_dir_lookup(scope, dir->parent_ino))
+	{
+		if (dir->ino == scope->root_ino) {
+			in_scope = true;
+			break;
+		}
+		if (dir->state != NTFS_DIR_UNKNOWN) {
+			in_scope = (dir->state == NTFS_DIR_IN_SCOPE);
+			break;
+		}
+		if (NTFS_IS_ROOT_FILE(dir->ino))
+			break;
+		dir->state = NTFS_DIR_VISITING;
+	}
+
+	for (dir = ntfs_dir_lookup(scope, ino);
+	     dir != NULL && dir->state == NTFS_DIR_VISITING;
+	     dir = ntfs_dir_lookup(scope, dir->parent_ino))
+		dir->state = in_scope ? NTFS_DIR_IN_SCOPE :
+					NTFS_DIR_OUT_OF_SCOPE;
+	return in_scope;
+}
+
+/* Return true if @ino is the root of the tree being captured.  */
+static bool
+is_scope_root(const struct ntfs_scan_scope *scope, u64 ino)
+{
+	if (scope->whole_volume)
+		return NTFS_IS_ROOT_FILE(ino);
+	return ino == scope->root_ino;
+}
+
+static void
+ntfs_scan_scope_destroy(struct ntfs_scan_scope *scope)
+{
+	struct ntfs_dir *dir;
+
+	avl_tree_for_each_in_postorder(dir, scope->dirs, struct ntfs_dir,
+				       index_node)
+		FREE(dir);
+}
+
 /* Free all ntfs_inodes in the map.  */
 static void
 ntfs_inode_map_destroy(struct ntfs_inode_map *map)
@@ -2220,10 +2670,11 @@ is_valid_name_entry(const FILE_LAYOUT_NAME_ENTRY *name)
 }
 
 /* Validate the FILE_LAYOUT_NAME_ENTRYs of the specified file and compute the
- * total length in bytes of the ntfs_dentry structures needed to hold the name
- * information.  */
+ * total length in bytes of the ntfs_dentry structures needed to hold the
+ * information of the names that are in the tree being captured.  */
 static int
 validate_names_and_compute_total_length(const FILE_LAYOUT_ENTRY *file,
+					struct ntfs_scan_scope *scope,
 					size_t *total_length_ret)
 {
 	const FILE_LAYOUT_NAME_ENTRY *name =
@@ -2245,9 +2696,11 @@ validate_names_and_compute_total_length(const FILE_LAYOUT_ENTRY *file,
 		}
 		if (name->Flags != FILE_LAYOUT_NAME_ENTRY_DOS) {
 			num_long_names++;
-			total += ALIGN(sizeof(struct ntfs_dentry) +
-				       name->FileNameLength + sizeof(wchar_t),
-				       8);
+			if (dir_in_scope(scope,
+					 name->ParentFileReferenceNumber))
+				total += ALIGN(sizeof(struct ntfs_dentry) +
+					       name->FileNameLength +
+					       sizeof(wchar_t), 8);
 		}
 		if (name->NextNameOffset == 0)
 			break;
@@ -2361,7 +2814,8 @@ validate_streams_and_compute_total_length(const FILE_LAYOUT_ENTRY *file,
 }
 
 static void *
-load_name_information(const FILE_LAYOUT_ENTRY *file, struct ntfs_inode *ni,
+load_name_information(const FILE_LAYOUT_ENTRY *file,
+		      struct ntfs_scan_scope *scope, struct ntfs_inode *ni,
 		      void *p)
 {
 	const FILE_LAYOUT_NAME_ENTRY *name =
@@ -2373,6 +2827,8 @@ load_name_information(const FILE_LAYOUT_ENTRY *file, struct ntfs_inode *ni,
 		 * short name, one name should also be marked as "primary" to
 		 * indicate which long name the short name is associated with.
 		 * Also, there should be at most one short name per inode.  */
+		if (!dir_in_scope(scope, name->ParentFileReferenceNumber))
+			goto next_name;
 		if (name->Flags & FILE_LAYOUT_NAME_ENTRY_DOS) {
 			memcpy(ni->short_name,
 			       name->FileName, name->FileNameLength);
@@ -2389,6 +2845,7 @@ load_name_information(const FILE_LAYOUT_ENTRY *file, struct ntfs_inode *ni,
 			p += ALIGN(sizeof(struct ntfs_dentry) +
 				   name->FileNameLength + sizeof(wchar_t), 8);
 		}
+	next_name:
 		if (name->NextNameOffset == 0)
 			break;
 		name = (const void *)name + name->NextNameOffset;
@@ -2444,7 +2901,8 @@ load_stream_information(const FILE_LAYOUT_ENTRY *file, struct ntfs_inode *ni,
 
 /* Process the information for a file given by FSCTL_QUERY_FILE_LAYOUT.  */
 static int
-load_one_file(const FILE_LAYOUT_ENTRY *file, struct ntfs_inode_map *inode_map)
+load_one_file(const FILE_LAYOUT_ENTRY *file, struct ntfs_scan_scope *scope,
+	      struct ntfs_inode_map *inode_map)
 {
 	const FILE_LAYOUT_INFO_ENTRY *info =
 		(const void *)file + file->ExtraInfoOffset;
@@ -2459,13 +2917,17 @@ load_one_file(const FILE_LAYOUT_ENTRY *file, struct ntfs_inode_map *inode_map)
 
 	/* The root file should have no names, and all other files should have
 	 * at least one name.  But just in case, we ignore the names of the root
-	 * file, and we ignore any non-root file with no names.  */
-	if (!NTFS_IS_ROOT_FILE(file->FileReferenceNumber)) {
+	 * file, and we ignore any non-root file with no names.  The same goes
+	 * for the root of the tree being captured, whose names are outside the
+	 * tree, and for files that have no names inside the tree.  */
+	if (!is_scope_root(scope, file->FileReferenceNumber)) {
 		if (file->FirstNameOffset == 0)
 			return 0;
-		ret = validate_names_and_compute_total_length(file, &n);
+		ret = validate_names_and_compute_total_length(file, scope, &n);
 		if (ret)
 			return ret;
+		if (n == 0)
+			return 0;
 		inode_size += n;
 	}
 
@@ -2488,13 +2950,14 @@ load_one_file(const FILE_LAYOUT_ENTRY *file, struct ntfs_inode_map *inode_map)
 	ni->creation_time = info->BasicInformation.CreationTime;
 	ni->last_write_time = info->BasicInformation.LastWriteTime;
 	ni->last_access_time = info->BasicInformation.LastAccessTime;
+	ni->change_time = info->BasicInformation.ChangeTime;
 	ni->security_id = info->SecurityId;
 	ni->special_streams = special_streams;
 
 	p = FIRST_DENTRY(ni);
 
-	if (!NTFS_IS_ROOT_FILE(file->FileReferenceNumber))
-		p = load_name_information(file, ni, p);
+	if (!is_scope_root(scope, file->FileReferenceNumber))
+		p = load_name_information(file, scope, ni, p);
 
 	if (file_has_streams(file))
 		p = load_stream_information(file, ni, p);
@@ -2505,25 +2968,58 @@ load_one_file(const FILE_LAYOUT_ENTRY *file, struct ntfs_inode_map *inode_map)
 	return 0;
 }
 
+/* Process the information for a directory given by FSCTL_QUERY_FILE_LAYOUT
+ * when only the parent directories are needed.  */
+static int
+load_one_dir(const FILE_LAYOUT_ENTRY *file, struct ntfs_scan_scope *scope,
+	     struct ntfs_inode_map *inode_map)
+{
+	const FILE_LAYOUT_NAME_ENTRY *name;
+	struct ntfs_dir *dir;
+
+	if (!(file->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+	    file->FirstNameOffset == 0)
+		return 0;
+
+	/* Directories can't have hard links, so any long name gives the
+	 * parent directory.  */
+	name = (const void *)file + file->FirstNameOffset;
+	while (name->Flags == FILE_LAYOUT_NAME_ENTRY_DOS) {
+		if (name->NextNameOffset == 0)
+			return 0;
+		name = (const void *)name + name->NextNameOffset;
+	}
+
+	dir = MALLOC(sizeof(*dir));
+	if (!dir)
+		return WIMLIB_ERR_NOMEM;
+	dir->ino = file->FileReferenceNumber;
+	dir->parent_ino = name->ParentFileReferenceNumber;
+	dir->state = NTFS_DIR_UNKNOWN;
+	if (avl_tree_insert(&scope->dirs, &dir->index_node, _avl_cmp_ntfs_dirs))
+		FREE(dir);
+	return 0;
+}
+
 /*
- * Quickly find all files on an NTFS volume by using FSCTL_QUERY_FILE_LAYOUT to
- * scan the MFT.  The NTFS volume is specified by the NT namespace path @path.
- * For each file, allocate an 'ntfs_inode' structure for each file and add it to
- * 'inode_map' keyed by inode number.  Include NTFS special files such as
+ * Quickly enumerate all files on an NTFS volume by using
+ * FSCTL_QUERY_FILE_LAYOUT to scan the MFT.  @h is an open handle to the volume
+ * or to its root directory, and @path is the path used to open it.  The ioctl
+ * is issued with the QUERY_FILE_LAYOUT_INCLUDE_* flags @include_flags, and
+ * @load_file is called for each file, including NTFS special files such as
  * $Bitmap (they will be removed later).
  */
 static int
-load_files_from_mft(const wchar_t *path, struct ntfs_inode_map *inode_map)
+query_file_layout(HANDLE h, const wchar_t *path, u32 include_flags,
+		  int (*load_file)(const FILE_LAYOUT_ENTRY *file,
+				   struct ntfs_scan_scope *scope,
+				   struct ntfs_inode_map *inode_map),
+		  struct ntfs_scan_scope *scope,
+		  struct ntfs_inode_map *inode_map)
 {
-	HANDLE h = NULL;
 	QUERY_FILE_LAYOUT_INPUT in = (QUERY_FILE_LAYOUT_INPUT) {
 		.NumberOfPairs = 0,
-		.Flags = QUERY_FILE_LAYOUT_RESTART |
-			 QUERY_FILE_LAYOUT_INCLUDE_NAMES |
-			 QUERY_FILE_LAYOUT_INCLUDE_STREAMS |
-			 QUERY_FILE_LAYOUT_INCLUDE_EXTENTS |
-			 QUERY_FILE_LAYOUT_INCLUDE_EXTRA_INFO |
-			 QUERY_FILE_LAYOUT_INCLUDE_STREAMS_WITH_NO_CLUSTERS_ALLOCATED,
+		.Flags = QUERY_FILE_LAYOUT_RESTART | include_flags,
 		.FilterType = QUERY_FILE_LAYOUT_FILTER_TYPE_NONE,
 	};
 	size_t outsize = 32768;
@@ -2531,13 +3027,6 @@ load_files_from_mft(const wchar_t *path, struct ntfs_inode_map *inode_map)
 	int ret;
 	NTSTATUS status;
 
-	status = winnt_open(path, wcslen(path),
-			    FILE_READ_DATA | FILE_READ_ATTRIBUTES, &h);
-	if (!NT_SUCCESS(status)) {
-		ret = -1; /* Silently try standard recursive scan instead  */
-		goto out;
-	}
-
 	for (;;) {
 		/* Allocate a buffer for the output of the ioctl.  */
 		out = MALLOC(outsize);
@@ -2555,7 +3044,7 @@ load_files_from_mft(const wchar_t *path, struct ntfs_inode_map *inode_map)
 			const FILE_LAYOUT_ENTRY *file =
 				(const void *)out + out->FirstFileOffset;
 			for (;;) {
-				ret = load_one_file(file, inode_map);
+				ret = (*load_file)(file, scope, inode_map);
 				if (ret)
 					goto out;
 				if (file->NextFileOffset == 0)
@@ -2593,6 +3082,111 @@ load_files_from_mft(const wchar_t *path, struct ntfs_inode_map *inode_map)
 	ret = 0;
 out:
 	FREE(out);
+	return ret;
+}
+
+/* Open the root directory of the volume containing the open file @h.  */
+static NTSTATUS
+open_volume_root(HANDLE h, HANDLE *root_ret)
+{
+	u64 root_ino = NTFS_ROOT_FILE_REFERENCE;
+	UNICODE_STRING name = {
+		.Length = sizeof(root_ino),
+		.MaximumLength = sizeof(root_ino),
+		.Buffer = (wchar_t *)&root_ino,
+	};
+	OBJECT_ATTRIBUTES attr = {
+		.Length = sizeof(attr),
+		.RootDirectory = h,
+		.ObjectName = &name,
+	};
+	IO_STATUS_BLOCK iosb;
+
+	return NtOpenFile(root_ret,
+			  FILE_READ_DATA | FILE_READ_ATTRIBUTES | SYNCHRONIZE,
+			  &attr, &iosb, FILE_SHARE_VALID_FLAGS,
+			  FILE_OPEN_BY_FILE_ID | FILE_OPEN_FOR_BACKUP_INTENT |
+			  FILE_SYNCHRONOUS_IO_NONALERT);
+}
+
+/*
+ * Find all files in the directory tree @path on an NTFS volume by scanning the
+ * MFT.  For each file, allocate an 'ntfs_inode' structure and add it to
+ * 'inode_map' keyed by inode number.
+ *
+ * If @path is the root directory of the volume, then the volume is opened and
+ * all files are loaded.  Otherwise the directories are loaded into @scope
+ * first, then only the files in the tree are loaded, so the memory used is
+ * proportional to the size of the tree rather than of the volume (apart from
+ * the small 'ntfs_dir' per directory).
+ */
+static int
+load_files_from_mft(wchar_t *path, size_t path_nchars,
+		    struct ntfs_scan_scope *scope,
+		    struct ntfs_inode_map *inode_map)
+{
+	const u32 include_flags =
+		QUERY_FILE_LAYOUT_INCLUDE_NAMES |
+		QUERY_FILE_LAYOUT_INCLUDE_STREAMS |
+		QUERY_FILE_LAYOUT_INCLUDE_EXTENTS |
+		QUERY_FILE_LAYOUT_INCLUDE_EXTRA_INFO |
+		QUERY_FILE_LAYOUT_INCLUDE_STREAMS_WITH_NO_CLUSTERS_ALLOCATED;
+	HANDLE h = NULL;
+	HANDLE h_root = NULL;
+	struct file_info info;
+	NTSTATUS status;
+	int ret;
+
+	status = winnt_open(path, path_nchars, FILE_READ_ATTRIBUTES, &h);
+	if (!NT_SUCCESS(status))
+		return -1; /* Silently try standard recursive scan instead  */
+	status = get_file_info(h, &info);
+	if (!NT_SUCCESS(status) ||
+	    !(info.attributes & FILE_ATTRIBUTE_DIRECTORY) ||
+	    (info.attributes & FILE_ATTRIBUTE_REPARSE_POINT))
+	{
+		ret = -1; /* Silently try standard recursive scan instead  */
+		goto out;
+	}
+	scope->root_ino = info.ino;
+	scope->whole_volume = NTFS_IS_ROOT_FILE(info.ino);
+
+	if (scope->whole_volume) {
+		/* Open the volume itself, by leaving off the trailing
+		 * backslash of the root directory's path.  */
+		wchar_t *p = &path[path_nchars - 1];
+		bool adjust_path = (*p == L'\\');
+
+		NtClose(h);
+		h = NULL;
+		if (adjust_path)
+			*p = L'\0';
+		status = winnt_open(path, wcslen(path),
+				    FILE_READ_DATA | FILE_READ_ATTRIBUTES, &h);
+		if (NT_SUCCESS(status))
+			ret = query_file_layout(h, path, include_flags,
+						load_one_file, scope,
+						inode_map);
+		else
+			ret = -1;
+		if (adjust_path)
+			*p = L'\\';
+		goto out;
+	}
+
+	status = open_volume_root(h, &h_root);
+	if (!NT_SUCCESS(status)) {
+		ret = -1; /* Silently try standard recursive scan instead  */
+		goto out;
+	}
+	ret = query_file_layout(h_root, path, QUERY_FILE_LAYOUT_INCLUDE_NAMES,
+				load_one_dir, scope, inode_map);
+	if (ret)
+		goto out;
+	ret = query_file_layout(h_root, path, include_flags,
+				load_one_file, scope, inode_map);
+out:
+	NtClose(h_root);
 	NtClose(h);
 	return ret;
 }
@@ -2602,7 +3196,9 @@ out:
  * children list.  Note that every name should have a parent, i.e. should belong
  * to some directory.  The root directory does not have any names.  */
 static int
-build_children_lists(struct ntfs_inode_map *map, struct ntfs_inode **root_ret)
+build_children_lists(struct ntfs_inode_map *map,
+		     const struct ntfs_scan_scope *scope,
+		     struct ntfs_inode **root_ret)
 {
 	struct ntfs_inode *ni;
 
@@ -2611,7 +3207,7 @@ build_children_lists(struct ntfs_inode_map *map, struct ntfs_inode **root_ret)
 		struct ntfs_dentry *nd;
 		u32 n;
 
-		if (NTFS_IS_ROOT_FILE(ni->ino)) {
+		if (is_scope_root(scope, ni->ino)) {
 			*root_ret = ni;
 			continue;
 		}
@@ -2734,6 +3330,7 @@ generate_wim_structures_recursive(struct wim_dentry **root_ret,
 	struct wim_dentry *root = NULL;
 	struct wim_inode *inode = NULL;
 	const struct ntfs_stream *ns;
+	u64 unnamed_data_size = 0;
 
 	/* Completely ignore NTFS special files.  */
 	if (NTFS_IS_SPECIAL_FILE(ni->ino))
@@ -2750,7 +3347,7 @@ generate_wim_structures_recursive(struct wim_dentry **root_ret,
 		ret = winnt_build_dentry_tree(&root, NULL,
 					      ctx->params->cur_path,
 					      ctx->params->cur_path_nchars,
-					      filename, ctx, false);
+					      filename, ctx, false, NULL);
 		if (ret) /* Error? */
 			goto out;
 		if (!root) /* Excluded? */
@@ -2848,7 +3445,8 @@ generate_wim_structures_recursive(struct wim_dentry **root_ret,
 		 * Otherwise, only save the inode number (file ID).  */
 		if (*ns->name ||
 		    !(ctx->vol_flags & FILE_SUPPORTS_OPEN_BY_FILE_ID) ||
-		    !(ctx->params->add_flags & WIMLIB_ADD_FLAG_FILE_PATHS_UNNEEDED))
+		    !(ctx->params->add_flags & WIMLIB_ADD_FLAG_FILE_PATHS_UNNEEDED) ||
+		    ctx->mft_scan_of_subdir)
 		{
 			windows_file = alloc_windows_file(ctx->params->cur_path,
 							  ctx->params->cur_path_nchars,
@@ -2864,13 +3462,22 @@ generate_wim_structures_recursive(struct wim_dentry **root_ret,
 		}
 
 		ret = add_stream(inode, windows_file, ns->size,
-				 STREAM_TYPE_DATA, ns->name,
-				 ctx->params->unhashed_blobs);
+				 STREAM_TYPE_DATA, ns->name, ctx);
 		if (ret)
 			goto out;
+		if (!*ns->name)
+			unnamed_data_size = ns->size;
 		ns = NEXT_STREAM(ns);
 	}
 
+	if (ctx->params->hash_cache) {
+		ret = winnt_apply_hash_cache(ctx, inode, ni->ino,
+					     unnamed_data_size,
+					     ni->change_time);
+		if (ret)
+			goto out;
+	}
+
 	set_sort_key(inode, ni->starting_lcn);
 
 	/* If processing a directory, then recurse to its children.  In this
@@ -2905,7 +3512,7 @@ process_children:
 			if (ret)
 				goto out;
 
-			attach_scanned_tree(root, child, ctx->params->blob_table);
+			attach_scanned_tree(root, child, ctx->params);
 			nd = next;
 		}
 	}
@@ -2922,7 +3529,7 @@ out:
 		ntfs_inode_map_remove(inode_map, ni);
 	}
 	if (unlikely(ret)) {
-		free_dentry_tree(root, ctx->params->blob_table);
+		discard_scanned_tree(ctx->params, root);
 		root = NULL;
 	}
 	*root_ret = root;
@@ -2935,36 +3542,34 @@ winnt_build_dentry_tree_fast(struct wim_dentry **root_ret,
 {
 	struct ntfs_inode_map inode_map = { .root = NULL };
 	struct security_map security_map = { .root = NULL };
+	struct ntfs_scan_scope scope = { .dirs = NULL };
 	struct ntfs_inode *root = NULL;
 	wchar_t *path = ctx->params->cur_path;
 	size_t path_nchars = ctx->params->cur_path_nchars;
-	bool adjust_path;
 	int ret;
 
-	adjust_path = (path[path_nchars - 1] == L'\\');
-	if (adjust_path)
-		path[path_nchars - 1] = L'\0';
-
-	ret = load_files_from_mft(path, &inode_map);
+	ret = load_files_from_mft(path, path_nchars, &scope, &inode_map);
 
-	if (adjust_path)
-		path[path_nchars - 1] = L'\\';
+	/* The directories were only needed to decide which files to load.  */
+	ntfs_scan_scope_destroy(&scope);
+	scope.dirs = NULL;
 
 	if (ret)
 		goto out;
 
-	ret = build_children_lists(&inode_map, &root);
+	ret = build_children_lists(&inode_map, &scope, &root);
 	if (ret)
 		goto out;
 
 	if (!root) {
-		ERROR("The MFT listing for volume \"%ls\" did not include a "
-		      "root directory!", path);
+		ERROR("The MFT listing for volume \"%ls\" did not include the "
+		      "root of the directory tree!", path);
 		ret = WIMLIB_ERR_UNSUPPORTED;
 		goto out;
 	}
 
 	root->num_aliases = 1;
+	ctx->mft_scan_of_subdir = !scope.whole_volume;
 
 	ret = generate_wim_structures_recursive(root_ret, L"", false, root, ctx,
 						&inode_map, &security_map);
@@ -3039,7 +3644,8 @@ win32_build_dentry_tree(struct wim_dentry **root_ret,
 	}
 #endif
 	ret = winnt_build_dentry_tree(root_ret, NULL, params->cur_path,
-				      params->cur_path_nchars, L"", &ctx, true);
+				      params->cur_path_nchars, L"", &ctx, true,
+				      NULL);
 out:
 	vss_put_snapshot(ctx.snapshot);
 	if (ret == 0)
@@ -348,7 +348,7 @@ get_available_cpus(void)
 
 /* Use the Win32 API to get the amount of available memory.  */
 u64
-get_available_memory(void)
+get_physical_memory(void)
 {
 	MEMORYSTATUSEX status = {
 		.dwLength = sizeof(status),
@@ -29,6 +29,7 @@
 #include "wimlib/win32_common.h"
 
 #include <cguid.h>
+#include <string.h>
 
 #include "wimlib/error.h"
 #include "wimlib/threads.h"
@@ -303,6 +304,8 @@ vss_global_cleanup(void)
 	if (!vss_initialized)
 		return;
 
+	vss_release_cached_snapshots();
+
 	mutex_lock(&vss_initialization_mutex);
 	if (vss_initialized) {
 		(*func_CoUninitialize)();
@@ -323,6 +326,16 @@ struct vss_snapshot_internal {
 	VSS_SNAPSHOT_PROP props;
 };
 
+/*
+ * Creating a VSS snapshot can take many seconds, so when one update operation
+ * adds several sources from the same volume, e.g. with
+ * wimlib_add_image_multisource(), they all share one snapshot of it.  For this,
+ * a reference to the most recent snapshot of each volume is kept here until
+ * vss_release_cached_snapshots() is called at the end of the operation.
+ */
+static struct vss_snapshot_internal *cached_snapshots[26];
+static struct mutex cached_snapshots_mutex = MUTEX_INITIALIZER;
+
 /* Delete the specified VSS snapshot.  */
 void
 vss_delete_snapshot(struct vss_snapshot *snapshot)
@@ -420,10 +433,29 @@ is_wow64(void)
 	return wow64;
 }
 
+/* Release the references to the snapshots kept for reuse by later sources of
+ * the same update operation.  Each snapshot is deleted once the files captured
+ * from it no longer need it.  */
+void
+vss_release_cached_snapshots(void)
+{
+	struct vss_snapshot_internal *to_put[ARRAY_LEN(cached_snapshots)];
+
+	mutex_lock(&cached_snapshots_mutex);
+	memcpy(to_put, cached_snapshots, sizeof(to_put));
+	memset(cached_snapshots, 0, sizeof(cached_snapshots));
+	mutex_unlock(&cached_snapshots_mutex);
+
+	for (size_t i = 0; i < ARRAY_LEN(to_put); i++)
+		if (to_put[i])
+			vss_put_snapshot(&to_put[i]->base);
+}
+
 /*
- * Create a VSS snapshot of the specified @volume.  Return the NT namespace path
- * to the snapshot root directory in @vss_path_ret and a handle to the snapshot
- * in @snapshot_ret.
+ * Create a VSS snapshot of the volume containing @source, or reuse the one
+ * already created for it during the current update operation.  Return the NT
+ * namespace path to @source in the snapshot in @vss_path_ret and a handle to
+ * the snapshot in @snapshot_ret.
  */
 int
 vss_create_snapshot(const wchar_t *source, UNICODE_STRING *vss_path_ret,
@@ -435,6 +467,7 @@ vss_create_snapshot(const wchar_t *source, UNICODE_STRING *vss_path_ret,
 	struct vss_snapshot_internal *snapshot = NULL;
 	IVssBackupComponents *vss;
 	HRESULT res;
+	unsigned vol_idx;
 	int ret;
 
 	source_abspath = realpath(source, NULL);
@@ -453,6 +486,17 @@ vss_create_snapshot(const wchar_t *source, UNICODE_STRING *vss_path_ret,
 
 	wsprintf(volume, L"%lc:\\", source_abspath[0]);
 
+	vol_idx = (source_abspath[0] | 0x20) - L'a';
+	if (vol_idx < ARRAY_LEN(cached_snapshots)) {
+		mutex_lock(&cached_snapshots_mutex);
+		snapshot = cached_snapshots[vol_idx];
+		if (snapshot)
+			vss_get_snapshot(&snapshot->base);
+		mutex_unlock(&cached_snapshots_mutex);
+		if (snapshot)
+			goto have_snapshot;
+	}
+
 	snapshot = CALLOC(1, sizeof(*snapshot));
 	if (!snapshot) {
 		ret = WIMLIB_ERR_NOMEM;
@@ -486,6 +530,20 @@ vss_create_snapshot(const wchar_t *source, UNICODE_STRING *vss_path_ret,
 		goto vss_err;
 	}
 
+	snapshot->base.refcnt = 1;
+	if (vol_idx < ARRAY_LEN(cached_snapshots)) {
+		struct vss_snapshot_internal *old;
+
+		vss_get_snapshot(&snapshot->base);
+		mutex_lock(&cached_snapshots_mutex);
+		old = cached_snapshots[vol_idx];
+		cached_snapshots[vol_idx] = snapshot;
+		mutex_unlock(&cached_snapshots_mutex);
+		if (old)
+			vss_put_snapshot(&old->base);
+	}
+
+have_snapshot:
 	vss_path_ret->MaximumLength = sizeof(wchar_t) *
 		(wcslen(snapshot->props.m_pwszSnapshotDeviceObject) +
 		 1 + wcslen(&source_abspath[3]) + 1);
@@ -493,15 +551,15 @@ vss_create_snapshot(const wchar_t *source, UNICODE_STRING *vss_path_ret,
 	vss_path_ret->Buffer = HeapAlloc(GetProcessHeap(), 0,
 					 vss_path_ret->MaximumLength);
 	if (!vss_path_ret->Buffer) {
+		vss_put_snapshot(&snapshot->base);
 		ret = WIMLIB_ERR_NOMEM;
-		goto err;
+		goto out;
 	}
 
 	wsprintf(vss_path_ret->Buffer, L"\\??\\%ls\\%ls",
 		 &snapshot->props.m_pwszSnapshotDeviceObject[4],
 		 &source_abspath[3]);
 	*snapshot_ret = &snapshot->base;
-	snapshot->base.refcnt = 1;
 	ret = 0;
 	goto out;
 
@@ -41,17 +41,25 @@
 #include "wimlib/assert.h"
 #include "wimlib/blob_table.h"
 #include "wimlib/chunk_compressor.h"
+#include "wimlib/chunk_decompressor.h"
+#include "wimlib/compressor_ops.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
 #include "wimlib/file_io.h"
+#include "wimlib/hash_cache.h"
 #include "wimlib/header.h"
 #include "wimlib/inode.h"
 #include "wimlib/integrity.h"
 #include "wimlib/metadata.h"
 #include "wimlib/paths.h"
+#include "wimlib/perf_counters.h"
 #include "wimlib/progress.h"
 #include "wimlib/resource.h"
 #include "wimlib/solid.h"
+#include "wimlib/task_pool.h"
+#include "wimlib/threads.h"
+#include "wimlib/trace.h"
+#include "wimlib/unaligned.h"
 #include "wimlib/win32.h" /* win32_rename_replacement() */
 #include "wimlib/write.h"
 #include "wimlib/xml.h"
@@ -63,6 +71,8 @@
 #define WRITE_RESOURCE_FLAG_SOLID		0x00000004
 #define WRITE_RESOURCE_FLAG_SEND_DONE_WITH_FILE	0x00000008
 #define WRITE_RESOURCE_FLAG_SOLID_SORT		0x00000010
+#define WRITE_RESOURCE_FLAG_SKIP_INCOMPRESSIBLE	0x00000020
+#define WRITE_RESOURCE_FLAG_SOLID_SORT_SIMILARITY	0x00000040
 
 static int
 write_flags_to_resource_flags(int write_flags)
@@ -86,14 +96,36 @@ write_flags_to_resource_flags(int write_flags)
 	    WIMLIB_WRITE_FLAG_SOLID)
 		write_resource_flags |= WRITE_RESOURCE_FLAG_SOLID_SORT;
 
+	if ((write_resource_flags & WRITE_RESOURCE_FLAG_SOLID_SORT) &&
+	    (write_flags & WIMLIB_WRITE_FLAG_SOLID_SORT_SIMILARITY))
+		write_resource_flags |= WRITE_RESOURCE_FLAG_SOLID_SORT_SIMILARITY;
+
+	if (write_flags & WIMLIB_WRITE_FLAG_SKIP_INCOMPRESSIBLE)
+		write_resource_flags |= WRITE_RESOURCE_FLAG_SKIP_INCOMPRESSIBLE;
+
 	return write_resource_flags;
 }
 
 struct filter_context {
 	int write_flags;
 	WIMStruct *wim;
+
+	/* For wimlib_write_delta(): the blob table of the base WIM, whose blobs
+	 * are omitted from the output, and the statistics to update  */
+	const struct blob_table *base_blob_table;
+	struct wimlib_delta_stats *delta_stats;
 };
 
+/* Return true if @blob is omitted from a delta WIM because the base WIM already
+ * contains it.  */
+static inline bool
+blob_in_delta_base(const struct blob_descriptor *blob,
+		   const struct filter_context *ctx)
+{
+	return ctx && ctx->base_blob_table && !blob->unhashed &&
+		lookup_blob(ctx->base_blob_table, blob->hash);
+}
+
 /*
  * Determine whether the specified blob should be filtered out from the write.
  *
@@ -128,6 +160,9 @@ blob_filtered(const struct blob_descriptor *blob,
 	    blob->rdesc->wim != wim)
 		return -1;
 
+	if (blob_in_delta_base(blob, ctx))
+		return -1;
+
 	return 0;
 }
 
@@ -147,7 +182,8 @@ may_soft_filter_blobs(const struct filter_context *ctx)
 static inline bool
 may_hard_filter_blobs(const struct filter_context *ctx)
 {
-	return ctx && (ctx->write_flags & WIMLIB_WRITE_FLAG_SKIP_EXTERNAL_WIMS);
+	return ctx && ((ctx->write_flags & WIMLIB_WRITE_FLAG_SKIP_EXTERNAL_WIMS) ||
+		       ctx->base_blob_table);
 }
 
 static inline bool
@@ -156,6 +192,24 @@ may_filter_blobs(const struct filter_context *ctx)
 	return (may_soft_filter_blobs(ctx) || may_hard_filter_blobs(ctx));
 }
 
+/* Return true if, according to the compression fingerprint of the WIM file
+ * containing it, the specified resource was written by wimlib with the same
+ * compression settings that file data is about to be written with.  */
+static bool
+resource_matches_fingerprint(const struct wim_resource_descriptor *rdesc,
+			     int write_resource_flags,
+			     int out_ctype, u32 out_chunk_size)
+{
+	const struct wim_compression_fingerprint *fp = &rdesc->wim->compression_fp;
+
+	return fp->valid &&
+		rdesc->offset_in_wim + rdesc->size_in_wim <= fp->end_offset &&
+		fp->ctype == out_ctype &&
+		fp->chunk_size == out_chunk_size &&
+		fp->level == get_default_compression_level(out_ctype) &&
+		fp->solid == !!(write_resource_flags & WRITE_RESOURCE_FLAG_SOLID);
+}
+
 /* Return true if the specified blob is located in a WIM resource which can be
  * reused in the output WIM file, without being recompressed.  */
 static bool
@@ -164,8 +218,12 @@ can_raw_copy(const struct blob_descriptor *blob, int write_resource_flags,
 {
 	const struct wim_resource_descriptor *rdesc;
 
-	/* Recompress everything if requested.  */
-	if (write_resource_flags & WRITE_RESOURCE_FLAG_RECOMPRESS)
+	/* Recompress everything if requested, except resources that would just
+	 * be compressed again to the same data.  */
+	if ((write_resource_flags & WRITE_RESOURCE_FLAG_RECOMPRESS) &&
+	    (blob->blob_location != BLOB_IN_WIM ||
+	     !resource_matches_fingerprint(blob->rdesc, write_resource_flags,
+					   out_ctype, out_chunk_size)))
 		return false;
 
 	/* A blob not located in a WIM resource cannot be reused.  */
@@ -268,28 +326,25 @@ blob_set_out_reshdr_for_reuse(struct blob_descriptor *blob)
 }
 
 
-/* Write the header for a blob in a pipable WIM.  */
-static int
-write_pwm_blob_header(const struct blob_descriptor *blob,
-		      struct filedes *out_fd, bool compressed)
-{
-	struct pwm_blob_hdr blob_hdr;
-	u32 reshdr_flags;
-	int ret;
+/* The combined progress of several writers writing blobs in parallel, i.e. the
+ * solid resources of write_parallel_solid_resources(), or raw copies done while
+ * other data is being compressed (see start_raw_copy_thread())  */
+struct parallel_write_progress {
+	u64 completed_bytes;
+	u64 completed_compressed_bytes;
+	u64 completed_streams;
 
-	wimlib_assert(!blob->unhashed);
+	/* The first error of any of the writers, which makes the others stop  */
+	int status;
+};
 
-	blob_hdr.magic = cpu_to_le64(PWM_BLOB_MAGIC);
-	blob_hdr.uncompressed_size = cpu_to_le64(blob->size);
-	copy_hash(blob_hdr.hash, blob->hash);
-	reshdr_flags = reshdr_flags_for_blob(blob);
-	if (compressed)
-		reshdr_flags |= WIM_RESHDR_FLAG_COMPRESSED;
-	blob_hdr.flags = cpu_to_le32(reshdr_flags);
-	ret = full_write(out_fd, &blob_hdr, sizeof(blob_hdr));
-	if (ret)
-		ERROR_WITH_ERRNO("Error writing blob header to WIM file");
-	return ret;
+static void
+set_parallel_write_status(struct parallel_write_progress *shared, int status)
+{
+	int expected = 0;
+
+	__atomic_compare_exchange_n(&shared->status, &expected, status, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
 }
 
 struct write_blobs_progress_data {
@@ -297,6 +352,12 @@ struct write_blobs_progress_data {
 	void *progctx;
 	union wimlib_progress_info progress;
 	u64 next_progress;
+	struct progress_throttle throttle;
+
+	/* If not NULL, the blobs are being written by one of several parallel
+	 * writers, whose progress is combined here.  Only the writer which has
+	 * @progfunc set reports it.  */
+	struct parallel_write_progress *shared;
 };
 
 static int
@@ -315,6 +376,23 @@ do_write_blobs_progress(struct write_blobs_progress_data *progress_data,
 		{
 			progress_data->next_progress = progress->write_streams.total_bytes;
 		}
+	} else if (progress_data->shared) {
+		struct parallel_write_progress *shared = progress_data->shared;
+
+		/* If another writer failed, stop too.  */
+		ret = __atomic_load_n(&shared->status, __ATOMIC_RELAXED);
+		if (ret)
+			return ret;
+		progress->write_streams.completed_bytes =
+			__atomic_add_fetch(&shared->completed_bytes,
+					   complete_size, __ATOMIC_RELAXED);
+		progress->write_streams.completed_compressed_bytes =
+			__atomic_add_fetch(&shared->completed_compressed_bytes,
+					   complete_compressed_size,
+					   __ATOMIC_RELAXED);
+		progress->write_streams.completed_streams =
+			__atomic_add_fetch(&shared->completed_streams,
+					   complete_count, __ATOMIC_RELAXED);
 	} else {
 		progress->write_streams.completed_bytes += complete_size;
 		progress->write_streams.completed_compressed_bytes +=
@@ -322,8 +400,11 @@ do_write_blobs_progress(struct write_blobs_progress_data *progress_data,
 		progress->write_streams.completed_streams += complete_count;
 	}
 
-	if (progress->write_streams.completed_bytes >= progress_data->next_progress) {
-
+	if (progress->write_streams.completed_bytes >= progress_data->next_progress &&
+	    progress_throttle_due(&progress_data->throttle,
+				  progress->write_streams.completed_bytes >=
+				  progress->write_streams.total_bytes))
+	{
 		ret = call_progress(progress_data->progfunc,
 				    WIMLIB_PROGRESS_MSG_WRITE_STREAMS,
 				    progress,
@@ -365,6 +446,10 @@ struct write_blobs_ctx {
 	 * uncompressed.  */
 	struct chunk_compressor *compressor;
 
+	/* Comma-separated list of the compression workers to send the data to
+	 * be compressed to, or NULL to compress it locally  */
+	const tchar *compression_workers;
+
 	/* A buffer of size @out_chunk_size that has been loaned out from the
 	 * chunk compressor and is currently being filled with the uncompressed
 	 * data of the next chunk.  */
@@ -399,8 +484,110 @@ struct write_blobs_ctx {
 	/* Offset in the output file of the start of the chunks of the resource
 	 * currently being written.  */
 	u64 chunks_start_offset;
+
+	/* Buffer of size OUT_BUFFER_SIZE, or NULL if not allocated yet, holding
+	 * data which goes at the current offset of @out_fd but hasn't actually
+	 * been written yet, and the number of bytes in it  */
+	u8 *out_buf;
+	size_t out_buf_filled;
 };
 
+/* Size of the buffer in which the writes of chunks, chunk headers, and chunk
+ * tables are combined.  With small chunks, e.g. XPRESS, and with resources for
+ * many small files, there would otherwise be a system call for each.  */
+#define OUT_BUFFER_SIZE		(4U << 20)
+
+/* Return the offset in the output file at which the next data written by
+ * out_write() goes.  */
+static inline u64
+out_offset(const struct write_blobs_ctx *ctx)
+{
+	return ctx->out_fd->offset + ctx->out_buf_filled;
+}
+
+/* Write the buffered data to the output file.  This must be done before the
+ * output file is used other than through out_write() and out_pwrite().  */
+static int
+flush_out_buf(struct write_blobs_ctx *ctx)
+{
+	size_t n = ctx->out_buf_filled;
+
+	if (n == 0)
+		return 0;
+	ctx->out_buf_filled = 0;
+	return full_write(ctx->out_fd, ctx->out_buf, n);
+}
+
+/* Write data to the output file, through the buffer unless it's large.  */
+static int
+out_write(struct write_blobs_ctx *ctx, const void *buf, size_t size)
+{
+	int ret;
+
+	/* The buffer is only an optimization, so do without it if it can't be
+	 * allocated.  */
+	if (!ctx->out_buf && size < OUT_BUFFER_SIZE)
+		ctx->out_buf = MALLOC(OUT_BUFFER_SIZE);
+
+	if (!ctx->out_buf || size > OUT_BUFFER_SIZE - ctx->out_buf_filled) {
+		ret = flush_out_buf(ctx);
+		if (ret)
+			return ret;
+		if (!ctx->out_buf || size >= OUT_BUFFER_SIZE)
+			return full_write(ctx->out_fd, buf, size);
+	}
+	memcpy(&ctx->out_buf[ctx->out_buf_filled], buf, size);
+	ctx->out_buf_filled += size;
+	return 0;
+}
+
+/* Write data at @offset in the output file, which must be before out_offset().
+ * The part of it that is still in the buffer is simply updated there.  */
+static int
+out_pwrite(struct write_blobs_ctx *ctx, const void *buf, size_t size,
+	   u64 offset)
+{
+	u64 buf_offset = ctx->out_fd->offset;
+
+	wimlib_assert(offset + size <= out_offset(ctx));
+
+	if (offset + size > buf_offset) {
+		u64 start = max(offset, buf_offset);
+		size_t n = offset + size - start;
+
+		memcpy(&ctx->out_buf[start - buf_offset],
+		       (const u8 *)buf + (start - offset), n);
+		size -= n;
+	}
+	if (size == 0)
+		return 0;
+	return full_pwrite(ctx->out_fd, buf, size, offset);
+}
+
+/* Write the header for a blob in a pipable WIM.  */
+static int
+write_pwm_blob_header(const struct blob_descriptor *blob,
+		      struct write_blobs_ctx *ctx, bool compressed)
+{
+	struct pwm_blob_hdr blob_hdr;
+	u32 reshdr_flags;
+	int ret;
+
+	wimlib_assert(!blob->unhashed);
+
+	blob_hdr.magic = cpu_to_le64(PWM_BLOB_MAGIC);
+	blob_hdr.uncompressed_size = cpu_to_le64(blob->size);
+	copy_hash(blob_hdr.hash, blob->hash);
+	reshdr_flags = reshdr_flags_for_blob(blob);
+	if (compressed)
+		reshdr_flags |= WIM_RESHDR_FLAG_COMPRESSED;
+	blob_hdr.flags = cpu_to_le32(reshdr_flags);
+	ret = out_write(ctx, &blob_hdr, sizeof(blob_hdr));
+	if (ret)
+		ERROR_WITH_ERRNO("Error writing blob header to WIM file");
+	return ret;
+}
+
 /* Reserve space for the chunk table and prepare to accumulate the chunk table
  * in memory.  */
 static int
@@ -457,7 +644,7 @@ begin_chunk_table(struct write_blobs_ctx *ctx, u64 res_expected_size)
 		if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID)
 			reserve_size += sizeof(struct alt_chunk_table_header_disk);
 		memset(ctx->chunk_csizes, 0, reserve_size);
-		ret = full_write(ctx->out_fd, ctx->chunk_csizes, reserve_size);
+		ret = out_write(ctx, ctx->chunk_csizes, reserve_size);
 		if (ret) {
 			ERROR_WITH_ERRNO("Error reserving space for chunk "
 					 "table in WIM file");
@@ -482,7 +669,7 @@ begin_write_resource(struct write_blobs_ctx *ctx, u64 res_expected_size)
 
 	/* Output file descriptor is now positioned at the offset at which to
 	 * write the first chunk of the resource.  */
-	ctx->chunks_start_offset = ctx->out_fd->offset;
+	ctx->chunks_start_offset = out_offset(ctx);
 	ctx->cur_write_blob_offset = 0;
 	ctx->cur_write_res_size = res_expected_size;
 	return 0;
@@ -544,13 +731,13 @@ end_chunk_table(struct write_blobs_ctx *ctx, u64 res_actual_size,
 	u64 res_end_offset;
 
 	if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_PIPABLE) {
-		ret = full_write(ctx->out_fd, ctx->chunk_csizes, chunk_table_size);
+		ret = out_write(ctx, ctx->chunk_csizes, chunk_table_size);
 		if (ret)
 			goto write_error;
-		res_end_offset = ctx->out_fd->offset;
+		res_end_offset = out_offset(ctx);
 		res_start_offset = ctx->chunks_start_offset;
 	} else {
-		res_end_offset = ctx->out_fd->offset;
+		res_end_offset = out_offset(ctx);
 
 		u64 chunk_table_offset;
 
@@ -567,8 +754,8 @@ end_chunk_table(struct write_blobs_ctx *ctx, u64 res_actual_size,
 			STATIC_ASSERT(WIMLIB_COMPRESSION_TYPE_LZX == 2);
 			STATIC_ASSERT(WIMLIB_COMPRESSION_TYPE_LZMS == 3);
 
-			ret = full_pwrite(ctx->out_fd, &hdr, sizeof(hdr),
-					  chunk_table_offset - sizeof(hdr));
+			ret = out_pwrite(ctx, &hdr, sizeof(hdr),
+					 chunk_table_offset - sizeof(hdr));
 			if (ret)
 				goto write_error;
 			res_start_offset = chunk_table_offset - sizeof(hdr);
@@ -576,8 +763,8 @@ end_chunk_table(struct write_blobs_ctx *ctx, u64 res_actual_size,
 			res_start_offset = chunk_table_offset;
 		}
 
-		ret = full_pwrite(ctx->out_fd, ctx->chunk_csizes,
-				  chunk_table_size, chunk_table_offset);
+		ret = out_pwrite(ctx, ctx->chunk_csizes, chunk_table_size,
+				 chunk_table_offset);
 		if (ret)
 			goto write_error;
 	}
@@ -613,7 +800,7 @@ end_write_resource(struct write_blobs_ctx *ctx, struct wim_reshdr *out_reshdr)
 			return ret;
 	} else {
 		res_offset_in_wim = ctx->chunks_start_offset;
-		res_size_in_wim = ctx->out_fd->offset - res_offset_in_wim;
+		res_size_in_wim = out_offset(ctx) - res_offset_in_wim;
 	}
 	out_reshdr->uncompressed_size = res_uncompressed_size;
 	out_reshdr->size_in_wim = res_size_in_wim;
@@ -677,6 +864,91 @@ done_with_blob(struct blob_descriptor *blob, struct write_blobs_ctx *ctx)
 				 ctx->progress_data.progctx);
 }
 
+/*
+ * Check whether @blob, which must be unhashed, is a duplicate of another blob.
+ * If it's a duplicate which doesn't need to be written, it is removed from the
+ * list of blobs to write and freed, and BEGIN_BLOB_STATUS_SKIP_BLOB is
+ * returned.  If it's a duplicate of a blob which isn't being written yet, that
+ * blob takes its place and is returned in *blob_p; freeing the original blob
+ * is left to the caller.
+ */
+static int
+dedup_unhashed_blob(struct blob_descriptor **blob_p,
+		    struct write_blobs_ctx *ctx)
+{
+	struct blob_descriptor *blob = *blob_p;
+	struct blob_descriptor *new_blob;
+	int ret;
+
+	ret = hash_unhashed_blob(blob, ctx->blob_table, &new_blob);
+	if (ret)
+		return ret;
+	if (new_blob == blob) {
+		struct wimlib_delta_stats *stats;
+
+		if (!blob_in_delta_base(blob, ctx->filter_ctx))
+			return 0;
+
+		/* The blob is new to this WIM, but the base of the delta WIM
+		 * being written already has it.  */
+		stats = ctx->filter_ctx->delta_stats;
+		stats->num_blobs_omitted++;
+		stats->bytes_omitted += blob->size;
+		stats->num_blobs_written--;
+		stats->bytes_written -= blob->size;
+		ret = do_write_blobs_progress(&ctx->progress_data,
+					      blob->size, blob->size, 1, true);
+		list_del(&blob->write_blobs_list);
+		list_del(&blob->blob_table_list);
+		blob->will_be_in_output_wim = 0;
+		if (!ret)
+			ret = done_with_blob(blob, ctx);
+		if (ret)
+			return ret;
+		return BEGIN_BLOB_STATUS_SKIP_BLOB;
+	}
+
+	/* Duplicate blob detected.  */
+
+	if (new_blob->will_be_in_output_wim ||
+	    blob_filtered(new_blob, ctx->filter_ctx))
+	{
+		/* The duplicate blob is already being included in the output
+		 * WIM, or it would be filtered out if it had been.  Skip
+		 * writing this blob (and reading it again) entirely, passing
+		 * its output reference count to the duplicate blob in the
+		 * former case.  */
+		if (ctx->filter_ctx && ctx->filter_ctx->delta_stats) {
+			ctx->filter_ctx->delta_stats->num_blobs_written--;
+			ctx->filter_ctx->delta_stats->bytes_written -=
+				blob->size;
+		}
+		ret = do_write_blobs_progress(&ctx->progress_data,
+					      blob->size, blob->size, 1, true);
+		list_del(&blob->write_blobs_list);
+		list_del(&blob->blob_table_list);
+		if (new_blob->will_be_in_output_wim)
+			new_blob->out_refcnt += blob->out_refcnt;
+		if (!ret)
+			ret = done_with_blob(blob, ctx);
+		free_blob_descriptor(blob);
+		if (ret)
+			return ret;
+		return BEGIN_BLOB_STATUS_SKIP_BLOB;
+	}
+
+	/* The duplicate blob can validly be written, but was not marked as
+	 * such.  Discard the current blob descriptor and use the duplicate.  */
+	list_replace(&blob->write_blobs_list, &new_blob->write_blobs_list);
+	list_replace(&blob->blob_table_list, &new_blob->blob_table_list);
+	blob->will_be_in_output_wim = 0;
+	new_blob->out_refcnt = blob->out_refcnt;
+	new_blob->will_be_in_output_wim = 1;
+	new_blob->may_send_done_with_file = 0;
+	*blob_p = new_blob;
+	return 0;
+}
+
 /* Begin processing a blob for writing.  */
 static int
 write_blob_begin_read(struct blob_descriptor *blob, void *_ctx)
@@ -695,61 +967,20 @@ write_blob_begin_read(struct blob_descriptor *blob, void *_ctx)
 	 * read and checksum the blob in this function, thereby advancing ahead
 	 * of read_blob_list(), which will still provide the data again to
 	 * write_blob_process_chunk().  This is okay because an unhashed blob
-	 * cannot be in a WIM resource, which might be costly to decompress.  */
+	 * cannot be in a WIM resource, which might be costly to decompress.
+	 *
+	 * If the blob is replaced by a duplicate, actually freeing the current
+	 * blob descriptor must wait until read_blob_list() has finished reading
+	 * its data; see write_blob_end_read().  */
 	if (ctx->blob_table != NULL && blob->unhashed && !blob->unique_size) {
+		u64 size = blob->size;
 
-		struct blob_descriptor *new_blob;
-
-		ret = hash_unhashed_blob(blob, ctx->blob_table, &new_blob);
+		ret = dedup_unhashed_blob(&blob, ctx);
+		if (ret == BEGIN_BLOB_STATUS_SKIP_BLOB &&
+		    (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID))
+			ctx->cur_write_res_size -= size;
 		if (ret)
 			return ret;
-		if (new_blob != blob) {
-			/* Duplicate blob detected.  */
-
-			if (new_blob->will_be_in_output_wim ||
-			    blob_filtered(new_blob, ctx->filter_ctx))
-			{
-				/* The duplicate blob is already being included
-				 * in the output WIM, or it would be filtered
-				 * out if it had been.  Skip writing this blob
-				 * (and reading it again) entirely, passing its
-				 * output reference count to the duplicate blob
-				 * in the former case.  */
-				ret = do_write_blobs_progress(&ctx->progress_data,
-							      blob->size,
-							      blob->size,
-							      1, true);
-				list_del(&blob->write_blobs_list);
-				list_del(&blob->blob_table_list);
-				if (new_blob->will_be_in_output_wim)
-					new_blob->out_refcnt += blob->out_refcnt;
-				if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID)
-					ctx->cur_write_res_size -= blob->size;
-				if (!ret)
-					ret = done_with_blob(blob, ctx);
-				free_blob_descriptor(blob);
-				if (ret)
-					return ret;
-				return BEGIN_BLOB_STATUS_SKIP_BLOB;
-			} else {
-				/* The duplicate blob can validly be written,
-				 * but was not marked as such.  Discard the
-				 * current blob descriptor and use the
-				 * duplicate, but actually freeing the current
-				 * blob descriptor must wait until
-				 * read_blob_list() has finished reading its
-				 * data.  */
-				list_replace(&blob->write_blobs_list,
-					     &new_blob->write_blobs_list);
-				list_replace(&blob->blob_table_list,
-					     &new_blob->blob_table_list);
-				blob->will_be_in_output_wim = 0;
-				new_blob->out_refcnt = blob->out_refcnt;
-				new_blob->will_be_in_output_wim = 1;
-				new_blob->may_send_done_with_file = 0;
-				blob = new_blob;
-			}
-		}
 	}
 	list_move_tail(&blob->write_blobs_list, &ctx->blobs_being_compressed);
 	return 0;
@@ -846,6 +1077,8 @@ static int
 maybe_rewrite_blob_uncompressed(struct write_blobs_ctx *ctx,
 				struct blob_descriptor *blob)
 {
+	int ret;
+
 	if (!should_rewrite_blob_uncompressed(ctx, blob))
 		return 0;
 
@@ -861,6 +1094,11 @@ maybe_rewrite_blob_uncompressed(struct write_blobs_ctx *ctx,
 		return 0;
 	}
 
+	ret = flush_out_buf(ctx);
+	if (ret) {
+		ERROR_WITH_ERRNO("Error writing chunk data to WIM file");
+		return ret;
+	}
 	return write_blob_uncompressed(blob, ctx->out_fd);
 }
 
@@ -883,7 +1121,7 @@ write_chunk(struct write_blobs_ctx *ctx, const void *cchunk,
 		/* Starting to write a new blob in non-solid mode.  */
 
 		if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_PIPABLE) {
-			ret = write_pwm_blob_header(blob, ctx->out_fd,
+			ret = write_pwm_blob_header(blob, ctx,
 						    ctx->compressor != NULL);
 			if (ret)
 				return ret;
@@ -905,15 +1143,14 @@ write_chunk(struct write_blobs_ctx *ctx, const void *cchunk,
 			struct pwm_chunk_hdr chunk_hdr = {
 				.compressed_size = cpu_to_le32(csize),
 			};
-			ret = full_write(ctx->out_fd, &chunk_hdr,
-					 sizeof(chunk_hdr));
+			ret = out_write(ctx, &chunk_hdr, sizeof(chunk_hdr));
 			if (ret)
 				goto write_error;
 		}
 	}
 
 	/* Write the chunk data.  */
-	ret = full_write(ctx->out_fd, cchunk, csize);
+	ret = out_write(ctx, cchunk, csize);
 	if (ret)
 		goto write_error;
 
@@ -1010,6 +1247,42 @@ prepare_chunk_buffer(struct write_blobs_ctx *ctx)
 	return 0;
 }
 
+/* Return the number of bytes the current chunk buffer must hold before it is
+ * submitted for compression, given that the next data to be added to it is at
+ * @offset in @blob.  */
+static size_t
+needed_chunk_size(const struct write_blobs_ctx *ctx,
+		  const struct blob_descriptor *blob, u64 offset)
+{
+	if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID)
+		return ctx->out_chunk_size;
+	return min(ctx->out_chunk_size,
+		   ctx->cur_chunk_buf_filled + (blob->size - offset));
+}
+
+/* Let the reader place the next data of @blob, at @offset, straight into the
+ * current chunk buffer, saving write_blob_process_chunk() from copying it.  */
+static int
+write_blob_get_chunk_dest(const struct blob_descriptor *blob, u64 offset,
+			  void **buf_ret, size_t *size_ret, void *_ctx)
+{
+	struct write_blobs_ctx *ctx = _ctx;
+
+	if (ctx->compressor == NULL)
+		return 0;
+
+	if (!ctx->cur_chunk_buf) {
+		int ret = prepare_chunk_buffer(ctx);
+		if (ret)
+			return ret;
+	}
+
+	*buf_ret = &ctx->cur_chunk_buf[ctx->cur_chunk_buf_filled];
+	*size_ret = min(*size_ret, needed_chunk_size(ctx, blob, offset) -
+				   ctx->cur_chunk_buf_filled);
+	return 0;
+}
+
 /* Process the next chunk of data to be written to a WIM resource.  */
 static int
 write_blob_process_chunk(const struct blob_descriptor *blob, u64 offset,
@@ -1022,7 +1295,10 @@ write_blob_process_chunk(const struct blob_descriptor *blob, u64 offset,
 	wimlib_assert(size != 0);
 
 	if (ctx->compressor == NULL) {
-		/* Write chunk uncompressed.  */
+		/* Write chunk uncompressed.  If compression is enabled, this is
+		 * a blob from write_compression_excluded_blobs().  */
+		if (ctx->out_ctype != WIMLIB_COMPRESSION_TYPE_NONE)
+			ctx->progress_data.progress.write_streams.completed_excluded_bytes += size;
 		 ret = write_chunk(ctx, chunk, size, size);
 		 if (ret)
 			 return ret;
@@ -1035,8 +1311,9 @@ write_blob_process_chunk(const struct blob_descriptor *blob, u64 offset,
 	chunkptr = chunk;
 	chunkend = chunkptr + size;
 	do {
-		size_t needed_chunk_size;
+		size_t needed;
 		size_t bytes_consumed;
+		u8 *dest;
 
 		if (!ctx->cur_chunk_buf) {
 			ret = prepare_chunk_buffer(ctx);
@@ -1044,25 +1321,22 @@ write_blob_process_chunk(const struct blob_descriptor *blob, u64 offset,
 				return ret;
 		}
 
-		if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) {
-			needed_chunk_size = ctx->out_chunk_size;
-		} else {
-			needed_chunk_size = min(ctx->out_chunk_size,
-						ctx->cur_chunk_buf_filled +
-							(blob->size - offset));
-		}
+		needed = needed_chunk_size(ctx, blob, offset);
 
 		bytes_consumed = min(chunkend - chunkptr,
-				     needed_chunk_size - ctx->cur_chunk_buf_filled);
+				     needed - ctx->cur_chunk_buf_filled);
 
-		memcpy(&ctx->cur_chunk_buf[ctx->cur_chunk_buf_filled],
-		       chunkptr, bytes_consumed);
+		/* The data is already in place if the reader used the buffer
+		 * from write_blob_get_chunk_dest().  */
+		dest = &ctx->cur_chunk_buf[ctx->cur_chunk_buf_filled];
+		if (chunkptr != dest)
+			memcpy(dest, chunkptr, bytes_consumed);
 
 		chunkptr += bytes_consumed;
 		offset += bytes_consumed;
 		ctx->cur_chunk_buf_filled += bytes_consumed;
 
-		if (ctx->cur_chunk_buf_filled == needed_chunk_size) {
+		if (ctx->cur_chunk_buf_filled == needed) {
 			ctx->compressor->signal_chunk_filled(ctx->compressor,
 							     ctx->cur_chunk_buf_filled);
 			ctx->cur_chunk_buf = NULL;
@@ -1115,18 +1389,17 @@ write_blob_end_read(struct blob_descriptor *blob, int status, void *_ctx)
  * really should be checked earlier, but for now it's easiest to check here.
  */
 static int
-compute_blob_list_stats(struct list_head *blob_list,
+compute_blob_list_stats(struct blob_descriptor **blobs, size_t num_blobs,
 			struct write_blobs_ctx *ctx)
 {
-	struct blob_descriptor *blob;
 	u64 total_bytes = 0;
-	u64 num_blobs = 0;
 	u64 total_parts = 0;
 	WIMStruct *prev_wim_part = NULL;
 	const struct wim_resource_descriptor *prev_rdesc = NULL;
 
-	list_for_each_entry(blob, blob_list, write_blobs_list) {
-		num_blobs++;
+	for (size_t i = 0; i < num_blobs; i++) {
+		const struct blob_descriptor *blob = blobs[i];
+
 		total_bytes += blob->size;
 		if (blob->blob_location == BLOB_IN_WIM) {
 			const struct wim_resource_descriptor *rdesc = blob->rdesc;
@@ -1162,59 +1435,154 @@ compute_blob_list_stats(struct list_head *blob_list,
 	return 0;
 }
 
-/* Find blobs in @blob_list that can be copied to the output WIM in raw form
- * rather than compressed.  Delete these blobs from @blob_list and move them to
- * @raw_copy_blobs.  Return the total uncompressed size of the blobs that need
- * to be compressed.  */
+/*
+ * Split the @num_blobs blobs in @blobs, in order, into three lists:
+ *
+ * - @raw_copy_blobs: the blobs which can be copied to the output WIM in raw
+ *   form rather than compressed
+ * - @excluded_blobs: the blobs which are to be stored uncompressed due to
+ *   [CompressionExclusionList] in the capture configuration file
+ * - @blob_list: the remaining blobs, which need to be compressed
+ *
+ * Return the total uncompressed size of the blobs in @blob_list.
+ */
 static u64
-find_raw_copy_blobs(struct list_head *blob_list, int write_resource_flags,
-		    int out_ctype, u32 out_chunk_size,
-		    struct list_head *raw_copy_blobs)
+split_blobs_for_write(struct blob_descriptor **blobs, size_t num_blobs,
+		      int write_resource_flags, int out_ctype,
+		      u32 out_chunk_size, struct list_head *blob_list,
+		      struct list_head *raw_copy_blobs,
+		      struct list_head *excluded_blobs)
 {
-	struct blob_descriptor *blob, *tmp;
 	u64 num_nonraw_bytes = 0;
 
+	INIT_LIST_HEAD(blob_list);
 	INIT_LIST_HEAD(raw_copy_blobs);
+	INIT_LIST_HEAD(excluded_blobs);
 
 	/* Initialize temporary raw_copy_ok flag.  */
-	list_for_each_entry(blob, blob_list, write_blobs_list)
-		if (blob->blob_location == BLOB_IN_WIM)
-			blob->rdesc->raw_copy_ok = 0;
+	for (size_t i = 0; i < num_blobs; i++)
+		if (blobs[i]->blob_location == BLOB_IN_WIM)
+			blobs[i]->rdesc->raw_copy_ok = 0;
+
+	for (size_t i = 0; i < num_blobs; i++) {
+		struct blob_descriptor *blob = blobs[i];
+
+		if (i + 8 < num_blobs)
+			prefetchw(&blobs[i + 8]->write_blobs_list);
 
-	list_for_each_entry_safe(blob, tmp, blob_list, write_blobs_list) {
 		if (can_raw_copy(blob, write_resource_flags,
 				 out_ctype, out_chunk_size))
 		{
 			blob->rdesc->raw_copy_ok = 1;
-			list_move_tail(&blob->write_blobs_list, raw_copy_blobs);
+			list_add_tail(&blob->write_blobs_list, raw_copy_blobs);
+		} else if (blob->compression_excluded &&
+			   out_ctype != WIMLIB_COMPRESSION_TYPE_NONE)
+		{
+			list_add_tail(&blob->write_blobs_list, excluded_blobs);
 		} else {
+			list_add_tail(&blob->write_blobs_list, blob_list);
 			num_nonraw_bytes += blob->size;
 		}
 	}
-
 	return num_nonraw_bytes;
 }
 
+/* Size of the buffer through which raw data is copied from one WIM file to
+ * another.  It's large so that few system calls are needed; the input file is
+ * also read ahead (see read_ahead_advance()), so that reading the next part of
+ * the data overlaps with writing the current one.  */
+#define RAW_COPY_BUFFER_SIZE	(1U << 20)
+
+struct raw_copy_ctx {
+	u8 *buf;
+	bool copy_file_range_unsupported;
+
+	/* If not NULL, the data is written at this offset, which is advanced,
+	 * rather than at the current position of the output file  */
+	u64 *out_pos;
+};
+
+static int
+raw_copy_write(struct filedes *out_fd, const void *buf, size_t n,
+	       struct raw_copy_ctx *ctx)
+{
+	int ret;
+
+	if (!ctx->out_pos)
+		return full_write(out_fd, buf, n);
+	ret = full_pwrite(out_fd, buf, n, *ctx->out_pos);
+	if (!ret)
+		*ctx->out_pos += n;
+	return ret;
+}
+
+/*
+ * Try to copy @size bytes at @offset in @in_fd to the current position of
+ * @out_fd inside the kernel with copy_file_range(), which on some filesystems
+ * and network filesystems avoids moving the data at all.  This isn't done when
+ * the data written must be seen by an integrity stream, when either file is
+ * accessed with unbuffered I/O, or when the input and output are the same file.  Returns the number of bytes copied, which may be
+ * less than @size if copy_file_range() isn't supported for these files, in
+ * which case the caller must copy the rest.
+ */
+static u64
+raw_copy_in_kernel(struct filedes *in_fd, u64 offset, u64 size,
+		   struct filedes *out_fd, struct raw_copy_ctx *ctx)
+{
+	u64 done = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	if (out_fd->is_pipe || out_fd->integrity_stream || out_fd->unbuffered ||
+	    in_fd->io || in_fd->unbuffered)
+		return 0;
+
+	while (done < size && !ctx->copy_file_range_unsupported) {
+		off_t in_pos = offset + done;
+		off_t out_pos;
+		ssize_t ret;
+
+		/* Passing NULL for the output offset makes the file position
+		 * advance as with write(), which out_fd->offset tracks.  */
+		if (ctx->out_pos)
+			out_pos = *ctx->out_pos;
+		ret = copy_file_range(in_fd->fd, &in_pos, out_fd->fd,
+				      ctx->out_pos ? &out_pos : NULL,
+				      min(size - done, (u64)1 << 30), 0);
+		if (ret <= 0) {
+			if (ret < 0 && errno != EINTR)
+				ctx->copy_file_range_unsupported = true;
+			break;
+		}
+		done += ret;
+		if (ctx->out_pos)
+			*ctx->out_pos += ret;
+		else
+			out_fd->offset += ret;
+	}
+#endif
+	return done;
+}
+
 /* Copy a raw compressed resource located in another WIM file to the WIM file
  * being written.  */
 static int
 write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
-			struct filedes *out_fd)
+			struct filedes *out_fd, struct raw_copy_ctx *ctx)
 {
 	u64 cur_read_offset;
 	u64 end_read_offset;
-	u8 buf[BUFFER_SIZE];
 	size_t bytes_to_read;
 	int ret;
 	struct filedes *in_fd;
 	struct blob_descriptor *blob;
 	u64 out_offset_in_wim;
+	struct read_ahead ra;
 
 	/* Copy the raw data.  */
 	cur_read_offset = in_rdesc->offset_in_wim;
 	end_read_offset = cur_read_offset + in_rdesc->size_in_wim;
 
-	out_offset_in_wim = out_fd->offset;
+	out_offset_in_wim = ctx->out_pos ? *ctx->out_pos : out_fd->offset;
 
 	if (in_rdesc->is_pipable) {
 		if (cur_read_offset < sizeof(struct pwm_blob_hdr))
@@ -1227,11 +1595,40 @@ write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
 
 	if (likely(!in_rdesc->wim->being_compacted) ||
 	    in_rdesc->offset_in_wim > out_fd->offset) {
-		do {
-			bytes_to_read = min(sizeof(buf),
+		const void *mapped;
+
+		if (!in_rdesc->wim->being_compacted)
+			cur_read_offset += raw_copy_in_kernel(in_fd,
+						cur_read_offset,
+						end_read_offset - cur_read_offset,
+						out_fd, ctx);
+
+		/* If the WIM file is mapped into memory, then write the data
+		 * directly from the mapping.  */
+		mapped = filedes_mapped_data(in_fd, cur_read_offset,
+					     end_read_offset - cur_read_offset);
+		if (mapped) {
+			ret = raw_copy_write(out_fd, mapped,
+					     end_read_offset - cur_read_offset,
+					     ctx);
+			if (ret) {
+				ERROR_WITH_ERRNO("Error writing raw data "
+						 "to WIM file");
+				return ret;
+			}
+			cur_read_offset = end_read_offset;
+		}
+
+		read_ahead_init(&ra, cur_read_offset,
+				end_read_offset - cur_read_offset);
+
+		while (cur_read_offset != end_read_offset) {
+			bytes_to_read = min(RAW_COPY_BUFFER_SIZE,
 					    end_read_offset - cur_read_offset);
 
-			ret = full_pread(in_fd, buf, bytes_to_read,
+			read_ahead_advance(in_fd, &ra, cur_read_offset);
+
+			ret = full_pread(in_fd, ctx->buf, bytes_to_read,
 					 cur_read_offset);
 			if (ret) {
 				ERROR_WITH_ERRNO("Error reading raw data "
@@ -1239,7 +1636,8 @@ write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
 				return ret;
 			}
 
-			ret = full_write(out_fd, buf, bytes_to_read);
+			ret = raw_copy_write(out_fd, ctx->buf, bytes_to_read,
+					     ctx);
 			if (ret) {
 				ERROR_WITH_ERRNO("Error writing raw data "
 						 "to WIM file");
@@ -1247,8 +1645,7 @@ write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
 			}
 
 			cur_read_offset += bytes_to_read;
-
-		} while (cur_read_offset != end_read_offset);
+		}
 	} else {
 		/* Optimization: the WIM file is being compacted and the
 		 * resource being written is already in the desired location.
@@ -1275,16 +1672,106 @@ write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
 	return 0;
 }
 
+/*
+ * Find the region of the WIM file containing @first_blob's resource which is
+ * read by the run of raw copies starting at @first_blob, i.e. from that
+ * resource through the last resource in the same WIM file before the list moves
+ * on to a different one.  Return the first blob in @raw_copy_blobs that is in a
+ * different WIM file, or NULL if there is none.
+ */
+static struct blob_descriptor *
+get_raw_copy_span(struct blob_descriptor *first_blob,
+		  struct list_head *raw_copy_blobs,
+		  u64 *start_ret, u64 *end_ret)
+{
+	WIMStruct *wim = first_blob->rdesc->wim;
+	struct blob_descriptor *blob = first_blob;
+	u64 end = 0;
+
+	*start_ret = first_blob->rdesc->offset_in_wim;
+	for (;;) {
+		end = max(end, blob->rdesc->offset_in_wim +
+			       blob->rdesc->size_in_wim);
+		if (blob->write_blobs_list.next == raw_copy_blobs) {
+			blob = NULL;
+			break;
+		}
+		blob = list_next_entry(blob, write_blobs_list);
+		if (blob->rdesc->wim != wim)
+			break;
+	}
+	*end_ret = end;
+	return blob;
+}
+
+/*
+ * State for reading ahead across the whole list of raw copies rather than only
+ * within each resource.  The list is sorted by sequential order, so it consists
+ * of one run of resources per WIM file, e.g. one per part when joining a split
+ * WIM.  Each run is read ahead as a whole, which matters when it consists of
+ * many small resources, and once all of the current run has been requested the
+ * start of the next WIM file's run is too, so that reading it overlaps with
+ * writing the end of the current one.
+ */
+struct raw_copy_read_ahead {
+	WIMStruct *wim;
+	struct read_ahead ra;
+	struct blob_descriptor *next_blob;
+	bool next_prefetched;
+};
+
+static void
+raw_copy_read_ahead(struct raw_copy_read_ahead *rra,
+		    struct blob_descriptor *blob,
+		    struct list_head *raw_copy_blobs)
+{
+	struct wim_resource_descriptor *rdesc = blob->rdesc;
+	u64 start, end;
+
+	if (rdesc->wim != rra->wim) {
+		rra->wim = rdesc->wim;
+		rra->next_blob = get_raw_copy_span(blob, raw_copy_blobs,
+						   &start, &end);
+		rra->next_prefetched = false;
+		read_ahead_init(&rra->ra, start, end - start);
+	}
+
+	read_ahead_advance(&rdesc->wim->in_fd, &rra->ra, rdesc->offset_in_wim);
+
+	if (rra->ra.next_offset >= rra->ra.end_offset &&
+	    rra->next_blob && !rra->next_prefetched)
+	{
+		get_raw_copy_span(rra->next_blob, raw_copy_blobs, &start, &end);
+		filedes_prefetch(&rra->next_blob->rdesc->wim->in_fd, start,
+				 min(end - start, (u64)READ_AHEAD_SIZE));
+		rra->next_prefetched = true;
+	}
+}
+
 /* Copy a list of raw compressed resources located in other WIM file(s) to the
- * WIM file being written.  */
+ * WIM file being written, at *@out_pos if @out_pos isn't NULL.  */
 static int
 write_raw_copy_resources(struct list_head *raw_copy_blobs,
-			 struct filedes *out_fd,
+			 struct filedes *out_fd, u64 *out_pos,
 			 struct write_blobs_progress_data *progress_data)
 {
 	struct blob_descriptor *blob;
+	struct raw_copy_ctx ctx = {
+		.copy_file_range_unsupported = false,
+		.out_pos = out_pos,
+	};
+	struct raw_copy_read_ahead rra = {
+		.wim = NULL,
+	};
 	int ret;
 
+	if (list_empty(raw_copy_blobs))
+		return 0;
+
+	ctx.buf = MALLOC(RAW_COPY_BUFFER_SIZE);
+	if (!ctx.buf)
+		return WIMLIB_ERR_NOMEM;
+
 	list_for_each_entry(blob, raw_copy_blobs, write_blobs_list)
 		blob->rdesc->raw_copy_ok = 1;
 
@@ -1292,28 +1779,221 @@ write_raw_copy_resources(struct list_head *raw_copy_blobs,
 		u64 compressed_size = 0;
 
 		if (blob->rdesc->raw_copy_ok) {
+			if (!blob->rdesc->wim->being_compacted)
+				raw_copy_read_ahead(&rra, blob, raw_copy_blobs);
+
 			/* Write each solid resource only one time.  */
-			ret = write_raw_copy_resource(blob->rdesc, out_fd);
+			ret = write_raw_copy_resource(blob->rdesc, out_fd,
+						      &ctx);
 			if (ret)
-				return ret;
+				goto out;
 			blob->rdesc->raw_copy_ok = 0;
 			compressed_size = blob->rdesc->size_in_wim;
 		}
 		ret = do_write_blobs_progress(progress_data, blob->size,
 					      compressed_size, 1, false);
 		if (ret)
-			return ret;
+			goto out;
 	}
-	return 0;
+	ret = 0;
+out:
+	FREE(ctx.buf);
+	return ret;
 }
 
-/* Wait for and write all chunks pending in the compressor.  */
-static int
-finish_remaining_chunks(struct write_blobs_ctx *ctx)
-{
-	const void *cdata;
-	u32 csize;
-	u32 usize;
+/*
+ * Raw copies done by a thread of their own while the other blobs are being
+ * compressed, overlapping the reading and writing with the compression.  The
+ * copies are written to a region reserved for them at the position of the
+ * output file when they start, and the other blobs are written after it.
+ */
+struct raw_copy_thread {
+	struct thread thread;
+	struct list_head *raw_copy_blobs;
+	struct filedes *out_fd;
+	u64 out_pos;
+	u64 out_end;
+	struct write_blobs_progress_data progress_data;
+	struct parallel_write_progress shared;
+};
+
+/* Don't bother with a thread for raw copies smaller than this.  */
+#define MIN_BACKGROUND_RAW_COPY_SIZE	RAW_COPY_BUFFER_SIZE
+
+/* Return the number of bytes that copying @raw_copy_blobs writes, or 0 if the
+ * WIM files they are in can't be read while other data is being read.  */
+static u64
+get_background_raw_copy_size(struct list_head *raw_copy_blobs)
+{
+	struct blob_descriptor *blob;
+	u64 size = 0;
+
+	list_for_each_entry(blob, raw_copy_blobs, write_blobs_list) {
+		const WIMStruct *wim = blob->rdesc->wim;
+
+		if (wim->in_fd.is_pipe || wim->in_fd.io || wim->being_compacted)
+			return 0;
+		blob->rdesc->raw_copy_ok = 1;
+	}
+	list_for_each_entry(blob, raw_copy_blobs, write_blobs_list) {
+		struct wim_resource_descriptor *rdesc = blob->rdesc;
+
+		if (rdesc->raw_copy_ok) {
+			size += rdesc->size_in_wim;
+			if (rdesc->is_pipable)
+				size += sizeof(struct pwm_blob_hdr);
+			rdesc->raw_copy_ok = 0;
+		}
+	}
+	return size;
+}
+
+static void *
+raw_copy_thread_proc(void *arg)
+{
+	struct raw_copy_thread *rc = arg;
+	int ret;
+
+	ret = write_raw_copy_resources(rc->raw_copy_blobs, rc->out_fd,
+				       &rc->out_pos, &rc->progress_data);
+	if (ret)
+		set_parallel_write_status(&rc->shared, ret);
+	return NULL;
+}
+
+/* Start copying @raw_copy_blobs, which write @size bytes, in a thread of its
+ * own.  Returns false if they must be copied the usual way instead.  */
+static bool
+start_raw_copy_thread(struct raw_copy_thread *rc,
+		      struct list_head *raw_copy_blobs,
+		      struct write_blobs_ctx *ctx, u64 size)
+{
+	const union wimlib_progress_info *progress = &ctx->progress_data.progress;
+
+	rc->raw_copy_blobs = raw_copy_blobs;
+	rc->out_fd = ctx->out_fd;
+	rc->out_pos = ctx->out_fd->offset;
+	rc->out_end = rc->out_pos + size;
+	rc->shared = (struct parallel_write_progress) {
+		.completed_bytes = progress->write_streams.completed_bytes,
+		.completed_compressed_bytes =
+			progress->write_streams.completed_compressed_bytes,
+		.completed_streams = progress->write_streams.completed_streams,
+	};
+
+	/* Only this thread reports the progress.  */
+	rc->progress_data = ctx->progress_data;
+	rc->progress_data.progfunc = NULL;
+	rc->progress_data.shared = &rc->shared;
+
+	if (filedes_seek(ctx->out_fd, rc->out_end) == -1)
+		return false;
+	if (!thread_create(&rc->thread, raw_copy_thread_proc, rc)) {
+		filedes_seek(ctx->out_fd, rc->out_pos);
+		return false;
+	}
+	ctx->progress_data.shared = &rc->shared;
+	return true;
+}
+
+/* Wait for the raw copies started by start_raw_copy_thread().  @status is the
+ * result of writing the other blobs, which is combined with theirs.  */
+static int
+finish_raw_copy_thread(struct raw_copy_thread *rc, struct write_blobs_ctx *ctx,
+		       int status)
+{
+	union wimlib_progress_info *progress = &ctx->progress_data.progress;
+
+	if (status)
+		set_parallel_write_status(&rc->shared, status);
+	thread_join(&rc->thread);
+	ctx->progress_data.shared = NULL;
+	if (status)
+		return status;
+	if (rc->shared.status)
+		return rc->shared.status;
+	wimlib_assert(rc->out_pos == rc->out_end);
+
+	progress->write_streams.completed_bytes = rc->shared.completed_bytes;
+	progress->write_streams.completed_compressed_bytes =
+		rc->shared.completed_compressed_bytes;
+	progress->write_streams.completed_streams =
+		rc->shared.completed_streams;
+	return do_write_blobs_progress(&ctx->progress_data, 0, 0, 0, false);
+}
+
+/* Write the blobs that split_blobs_for_write() found to be excluded from
+ * compression, each as an uncompressed non-solid resource.  This must be done
+ * after all other data has been written, since it uses the same context with
+ * the compressor freed.  */
+static int
+write_compression_excluded_blobs(struct write_blobs_ctx *ctx,
+				 struct list_head *excluded_blobs)
+{
+	struct read_blob_callbacks cbs = {
+		.begin_blob	= write_blob_begin_read,
+		.continue_blob	= write_blob_process_chunk,
+		.end_blob	= write_blob_end_read,
+		.ctx		= ctx,
+	};
+
+	if (list_empty(excluded_blobs))
+		return 0;
+
+	if (ctx->compressor) {
+		ctx->compressor->destroy(ctx->compressor);
+		ctx->compressor = NULL;
+	}
+	ctx->write_resource_flags &= ~WRITE_RESOURCE_FLAG_SOLID;
+	INIT_LIST_HEAD(&ctx->blobs_being_compressed);
+
+	return read_blob_list(excluded_blobs,
+			      offsetof(struct blob_descriptor, write_blobs_list),
+			      &cbs,
+			      BLOB_LIST_ALREADY_SORTED |
+				VERIFY_BLOB_HASHES |
+				COMPUTE_MISSING_BLOB_HASHES,
+			      0);
+}
+
+/* Move the blobs in @blobs which are larger than @max_size to @large_blobs,
+ * keeping both them and the remaining blobs in the same order.  Return the
+ * number of blobs remaining in @blobs.  */
+static size_t
+find_large_blobs(struct blob_descriptor **blobs, size_t num_blobs,
+		 u64 max_size, struct list_head *large_blobs)
+{
+	size_t num_remaining = 0;
+
+	INIT_LIST_HEAD(large_blobs);
+
+	for (size_t i = 0; i < num_blobs; i++) {
+		if (blobs[i]->size > max_size)
+			list_add_tail(&blobs[i]->write_blobs_list, large_blobs);
+		else
+			blobs[num_remaining++] = blobs[i];
+	}
+	return num_remaining;
+}
+
+/* Write out the data still buffered once all blobs have been written.  */
+static int
+finish_blob_writes(struct write_blobs_ctx *ctx)
+{
+	int ret = flush_out_buf(ctx);
+
+	if (ret)
+		ERROR_WITH_ERRNO("Error writing chunk data to WIM file");
+	return ret;
+}
+
+/* Wait for and write all chunks pending in the compressor.  */
+static int
+finish_remaining_chunks(struct write_blobs_ctx *ctx)
+{
+	const void *cdata;
+	u32 csize;
+	u32 usize;
 	int ret;
 
 	if (ctx->compressor == NULL)
@@ -1335,23 +2015,24 @@ finish_remaining_chunks(struct write_blobs_ctx *ctx)
 }
 
 static void
-validate_blob_list(struct list_head *blob_list)
+validate_blobs(struct blob_descriptor **blobs, size_t num_blobs)
 {
-	struct blob_descriptor *blob;
-
-	list_for_each_entry(blob, blob_list, write_blobs_list) {
-		wimlib_assert(blob->will_be_in_output_wim);
-		wimlib_assert(blob->size != 0);
+	for (size_t i = 0; i < num_blobs; i++) {
+		wimlib_assert(blobs[i]->will_be_in_output_wim);
+		wimlib_assert(blobs[i]->size != 0);
 	}
 }
 
 static void
-init_done_with_file_info(struct list_head *blob_list)
+init_done_with_file_info(struct blob_descriptor **blobs, size_t num_blobs)
 {
-	struct blob_descriptor *blob;
+	for (size_t i = 0; i < num_blobs; i++) {
+		struct blob_descriptor *blob = blobs[i];
 
-	list_for_each_entry(blob, blob_list, write_blobs_list) {
-		if (blob_is_in_file(blob)) {
+		/* The members of an archive aren't files of their own.  */
+		if (blob_is_in_file(blob) &&
+		    !(blob->blob_location == BLOB_IN_FILE_ON_DISK &&
+		      blob->file_offset != 0)) {
 			blob->file_inode->i_num_remaining_streams = 0;
 			blob->may_send_done_with_file = 1;
 		} else {
@@ -1359,9 +2040,618 @@ init_done_with_file_info(struct list_head *blob_list)
 		}
 	}
 
-	list_for_each_entry(blob, blob_list, write_blobs_list)
-		if (blob->may_send_done_with_file)
-			blob->file_inode->i_num_remaining_streams++;
+	for (size_t i = 0; i < num_blobs; i++)
+		if (blobs[i]->may_send_done_with_file)
+			blobs[i]->file_inode->i_num_remaining_streams++;
+}
+
+/* Allocate the chunk_compressor with which @ctx compresses data: if @parallel,
+ * a remote one if compression workers were given and any of them can be
+ * reached, or else a parallel one using up to @num_threads threads, in both
+ * cases using up to @max_memory bytes of memory (0 for a default amount);
+ * otherwise, or if that isn't possible, a serial one.  */
+static int
+new_chunk_compressor_for_write(struct write_blobs_ctx *ctx, bool parallel,
+			       unsigned num_threads, u64 max_memory)
+{
+	bool skip_incompressible = (ctx->write_resource_flags &
+				    WRITE_RESOURCE_FLAG_SKIP_INCOMPRESSIBLE);
+	int ret;
+
+	if (parallel && ctx->compression_workers) {
+		ret = new_remote_chunk_compressor(ctx->out_ctype,
+						  ctx->out_chunk_size,
+						  ctx->compression_workers,
+						  max_memory,
+						  skip_incompressible,
+						  &ctx->compressor);
+		if (ret) {
+			WARNING("Couldn't use the compression workers: %"TS".\n"
+				"          Compressing locally instead.",
+				wimlib_get_error_string(ret));
+		}
+	}
+
+	if (parallel && ctx->compressor == NULL) {
+		ret = new_parallel_chunk_compressor(ctx->out_ctype,
+						    ctx->out_chunk_size,
+						    num_threads, max_memory,
+						    skip_incompressible,
+						    &ctx->compressor);
+		if (ret > 0) {
+			WARNING("Couldn't create parallel chunk compressor: %"TS".\n"
+				"          Falling back to single-threaded compression.",
+				wimlib_get_error_string(ret));
+		}
+	}
+
+	if (ctx->compressor == NULL) {
+		ret = new_serial_chunk_compressor(ctx->out_ctype,
+						  ctx->out_chunk_size,
+						  num_threads != 1,
+						  skip_incompressible,
+						  &ctx->compressor);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Set the output locations of the blobs which were written to the solid
+ * resource described by @reshdr, in the order in which they were written.  */
+static void
+set_solid_blob_reshdrs(struct list_head *blobs_in_solid_resource,
+		       const struct wim_reshdr *reshdr)
+{
+	struct blob_descriptor *blob;
+	u64 offset_in_res = 0;
+
+	list_for_each_entry(blob, blobs_in_solid_resource, write_blobs_list) {
+		blob->out_reshdr.size_in_wim = blob->size;
+		blob->out_reshdr.flags = reshdr_flags_for_blob(blob) |
+					 WIM_RESHDR_FLAG_SOLID;
+		blob->out_reshdr.uncompressed_size = 0;
+		blob->out_reshdr.offset_in_wim = offset_in_res;
+		blob->out_res_offset_in_wim = reshdr->offset_in_wim;
+		blob->out_res_size_in_wim = reshdr->size_in_wim;
+		blob->out_res_uncompressed_size = reshdr->uncompressed_size;
+		offset_in_res += blob->size;
+	}
+	wimlib_assert(offset_in_res == reshdr->uncompressed_size);
+}
+
+/* Return the number of threads that compressing with @num_threads threads (0
+ * for the default) will actually use at most.  */
+static unsigned
+get_num_compression_threads(unsigned num_threads)
+{
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+	return max(1, min(num_threads, task_pool_num_threads()));
+}
+
+/* Maximum number of solid resources which are written in parallel  */
+#define MAX_PARALLEL_SOLID_RESOURCES	4
+
+/*
+ * Decide into how many solid resources to split the @num_bytes bytes of blobs
+ * in @blob_list, which are to be compressed with up to @num_threads threads.
+ * Returns 1 if they should be written as a single solid resource as usual.
+ *
+ * Each resource gets at least two compression threads.  Since the chunks of a
+ * solid resource are compressed independently anyway, the compression ratio
+ * only suffers where a resource ends in a partial chunk and where similar
+ * files end up in different resources, so each resource is made at least
+ * @min_solid_res_size bytes and at least four chunks long.
+ */
+static unsigned
+choose_num_solid_resources(const struct list_head *blob_list,
+			   int write_resource_flags, u32 out_chunk_size,
+			   u64 num_bytes, unsigned num_threads,
+			   u64 min_solid_res_size)
+{
+	const struct blob_descriptor *blob;
+	u64 num_resources;
+
+	if (!(write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) ||
+	    (write_resource_flags & WRITE_RESOURCE_FLAG_SEND_DONE_WITH_FILE) ||
+	    min_solid_res_size == 0)
+		return 1;
+
+	num_resources = num_bytes / max(min_solid_res_size,
+					(u64)out_chunk_size * 4);
+	num_resources = min(num_resources,
+			    get_num_compression_threads(num_threads) / 2);
+	num_resources = min(num_resources, MAX_PARALLEL_SOLID_RESOURCES);
+	if (num_resources <= 1)
+		return 1;
+
+	/* The resources are written by separate threads, which read their
+	 * blobs at the same time.  */
+	list_for_each_entry(blob, blob_list, write_blobs_list)
+		if (!blob_can_be_read_concurrently(blob))
+			return 1;
+
+	return num_resources;
+}
+
+/* One of the solid resources being written by
+ * write_parallel_solid_resources()  */
+struct solid_resource_writer {
+	struct write_blobs_ctx ctx;
+
+	/* The blobs to write, and their total size  */
+	struct list_head blob_list;
+	u64 size;
+
+	unsigned num_threads;
+	unsigned num_reader_threads;
+	u64 max_memory;
+
+	/* Temporary file into which the resource is written, unless it's the
+	 * first resource, which is written to the WIM file directly  */
+	struct filedes tmp_fd;
+	tchar *tmp_name;
+
+	/* Location of the resource in its output file, once written  */
+	struct wim_reshdr reshdr;
+
+	struct thread thread;
+	bool thread_started;
+};
+
+static int
+do_write_solid_resource(struct solid_resource_writer *w)
+{
+	struct write_blobs_ctx *ctx = &w->ctx;
+	struct read_blob_callbacks cbs = {
+		.begin_blob	= write_blob_begin_read,
+		.continue_blob	= write_blob_process_chunk,
+		.end_blob	= write_blob_end_read,
+		.get_chunk_dest	= write_blob_get_chunk_dest,
+		.ctx		= ctx,
+	};
+	int ret;
+
+	ret = new_chunk_compressor_for_write(ctx, true, w->num_threads,
+					     w->max_memory);
+	if (ret)
+		return ret;
+
+	INIT_LIST_HEAD(&ctx->blobs_being_compressed);
+	INIT_LIST_HEAD(&ctx->blobs_in_solid_resource);
+
+	ret = begin_write_resource(ctx, w->size);
+	if (ret)
+		return ret;
+
+	ret = read_blob_list(&w->blob_list,
+			     offsetof(struct blob_descriptor, write_blobs_list),
+			     &cbs,
+			     BLOB_LIST_ALREADY_SORTED |
+				VERIFY_BLOB_HASHES |
+				COMPUTE_MISSING_BLOB_HASHES,
+			     w->num_reader_threads);
+	if (ret)
+		return ret;
+
+	ret = finish_remaining_chunks(ctx);
+	if (ret)
+		return ret;
+
+	ret = end_write_resource(ctx, &w->reshdr);
+	if (ret)
+		return ret;
+
+	return finish_blob_writes(ctx);
+}
+
+/* Write one of the solid resources, then free its chunk_compressor so that its
+ * memory is available to the writers still running.  */
+static void
+write_solid_resource(struct solid_resource_writer *w)
+{
+	int ret;
+
+	ret = do_write_solid_resource(w);
+	if (ret)
+		set_parallel_write_status(w->ctx.progress_data.shared, ret);
+	if (w->ctx.compressor) {
+		w->ctx.compressor->destroy(w->ctx.compressor);
+		w->ctx.compressor = NULL;
+	}
+	FREE(w->ctx.chunk_csizes);
+	w->ctx.chunk_csizes = NULL;
+	FREE(w->ctx.out_buf);
+	w->ctx.out_buf = NULL;
+}
+
+static void *
+solid_resource_writer_thread_proc(void *arg)
+{
+	write_solid_resource(arg);
+	return NULL;
+}
+
+/* Append the resource which @w wrote to its temporary file to @out_fd.  */
+static int
+append_solid_resource(struct solid_resource_writer *w, struct filedes *out_fd)
+{
+	struct raw_copy_ctx rc = { .copy_file_range_unsupported = false };
+	u64 size = w->tmp_fd.offset;
+	u64 base = out_fd->offset;
+	u64 offset;
+	int ret;
+
+	offset = raw_copy_in_kernel(&w->tmp_fd, 0, size, out_fd, &rc);
+	if (offset < size) {
+		rc.buf = MALLOC(RAW_COPY_BUFFER_SIZE);
+		if (!rc.buf)
+			return WIMLIB_ERR_NOMEM;
+	}
+	while (offset < size) {
+		size_t n = min(size - offset, RAW_COPY_BUFFER_SIZE);
+
+		ret = full_pread(&w->tmp_fd, rc.buf, n, offset);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error reading temporary file "
+					 "\"%"TS"\"", w->tmp_name);
+			goto out;
+		}
+		ret = full_write(out_fd, rc.buf, n);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error writing solid resource to "
+					 "WIM file");
+			goto out;
+		}
+		offset += n;
+	}
+	w->reshdr.offset_in_wim += base;
+	ret = 0;
+out:
+	FREE(rc.buf);
+	return ret;
+}
+
+/*
+ * Write the @num_bytes bytes of blobs in @blob_list, which are in the order
+ * they are to be written in, as @num_resources solid resources instead of
+ * one.  Each resource is a contiguous part of the list, and is read and
+ * compressed by its own writer, each with its share of the threads and memory.
+ * The writers run in parallel, so that the compression threads aren't limited
+ * by the speed at which a single thread can read and checksum the data.  The
+ * first resource is written directly to the WIM file, and each of the others
+ * to a temporary file, which is appended to the WIM file once all are done.
+ *
+ * The writers can't modify the blob table, so the blobs which may be
+ * duplicates are checksummed first, and the unhashed blobs are inserted into
+ * the blob table only after the writers have finished.  Only the first writer,
+ * which runs in the calling thread, sends progress messages.
+ */
+static int
+write_parallel_solid_resources(struct write_blobs_ctx *ctx,
+			       struct list_head *blob_list, u64 num_bytes,
+			       unsigned num_resources, unsigned num_threads,
+			       unsigned num_reader_threads)
+{
+	union wimlib_progress_info *progress = &ctx->progress_data.progress;
+	struct parallel_write_progress shared = {
+		.completed_bytes = progress->write_streams.completed_bytes,
+		.completed_compressed_bytes =
+			progress->write_streams.completed_compressed_bytes,
+		.completed_streams = progress->write_streams.completed_streams,
+	};
+	struct solid_resource_writer *writers;
+	struct blob_descriptor *blob, *tmp;
+	unsigned num_writers;
+	u64 target_size;
+	u64 max_memory;
+	int ret;
+
+	if (ctx->blob_table) {
+		list_for_each_entry_safe(blob, tmp, blob_list, write_blobs_list) {
+			struct blob_descriptor *orig_blob = blob;
+			u64 size = blob->size;
+
+			if (!blob->unhashed || blob->unique_size)
+				continue;
+			ret = dedup_unhashed_blob(&blob, ctx);
+			if (ret == BEGIN_BLOB_STATUS_SKIP_BLOB) {
+				num_bytes -= size;
+				continue;
+			}
+			if (ret)
+				return ret;
+			if (blob != orig_blob)
+				free_blob_descriptor(orig_blob);
+		}
+	}
+
+	if (list_empty(blob_list))
+		return 0;
+
+	writers = CALLOC(num_resources, sizeof(writers[0]));
+	if (!writers)
+		return WIMLIB_ERR_NOMEM;
+
+	/* Split the list into parts of about equal size.  A large blob can make
+	 * a part larger, in which case there may be fewer parts, but no part
+	 * is smaller than the target size unless all the data is.  */
+	target_size = num_bytes / num_resources;
+	num_writers = 0;
+	INIT_LIST_HEAD(&writers[0].blob_list);
+	list_for_each_entry_safe(blob, tmp, blob_list, write_blobs_list) {
+		struct solid_resource_writer *w = &writers[num_writers];
+
+		if (w->size >= target_size && num_bytes >= target_size &&
+		    num_writers < num_resources - 1)
+		{
+			w = &writers[++num_writers];
+			INIT_LIST_HEAD(&w->blob_list);
+		}
+		list_move_tail(&blob->write_blobs_list, &w->blob_list);
+		w->size += blob->size;
+		num_bytes -= blob->size;
+	}
+	num_writers++;
+
+	num_threads = get_num_compression_threads(num_threads);
+	max_memory = get_available_memory() / num_writers;
+	for (unsigned i = 0; i < num_writers; i++) {
+		struct solid_resource_writer *w = &writers[i];
+
+		w->ctx.out_fd = (i == 0) ? ctx->out_fd : &w->tmp_fd;
+		w->ctx.out_ctype = ctx->out_ctype;
+		w->ctx.out_chunk_size = ctx->out_chunk_size;
+		w->ctx.write_resource_flags = ctx->write_resource_flags;
+		w->ctx.filter_ctx = ctx->filter_ctx;
+		w->ctx.progress_data = ctx->progress_data;
+		w->ctx.progress_data.shared = &shared;
+		if (i != 0)
+			w->ctx.progress_data.progfunc = NULL;
+		w->num_threads = num_threads / num_writers +
+				 (i < num_threads % num_writers);
+		w->num_reader_threads = DIV_ROUND_UP(num_reader_threads,
+						     num_writers);
+		if (w->num_reader_threads == 1)
+			w->num_reader_threads = 0;
+		w->max_memory = max_memory;
+		filedes_invalidate(&w->tmp_fd);
+	}
+
+	for (unsigned i = 1; i < num_writers; i++) {
+		ret = create_temporary_file(&writers[i].tmp_fd,
+					    &writers[i].tmp_name);
+		if (ret)
+			goto out;
+	}
+
+	/* Start the other writers in threads of their own, since a writer
+	 * waits for its compressors, which run on the task pool.  If a thread
+	 * can't be created, its writer runs in this thread afterwards.  */
+	for (unsigned i = 1; i < num_writers; i++) {
+		writers[i].thread_started =
+			thread_create(&writers[i].thread,
+				      solid_resource_writer_thread_proc,
+				      &writers[i]);
+	}
+	write_solid_resource(&writers[0]);
+	for (unsigned i = 1; i < num_writers; i++) {
+		if (writers[i].thread_started)
+			thread_join(&writers[i].thread);
+		else
+			write_solid_resource(&writers[i]);
+	}
+	ret = shared.status;
+	if (ret)
+		goto out;
+
+	progress->write_streams.completed_bytes = shared.completed_bytes;
+	progress->write_streams.completed_compressed_bytes =
+		shared.completed_compressed_bytes;
+	progress->write_streams.completed_streams = shared.completed_streams;
+	ctx->progress_data.next_progress =
+		writers[0].ctx.progress_data.next_progress;
+
+	for (unsigned i = 0; i < num_writers; i++) {
+		struct solid_resource_writer *w = &writers[i];
+
+		if (i != 0) {
+			ret = append_solid_resource(w, ctx->out_fd);
+			if (ret)
+				goto out;
+		}
+		set_solid_blob_reshdrs(&w->ctx.blobs_in_solid_resource,
+				       &w->reshdr);
+		list_for_each_entry(blob, &w->ctx.blobs_in_solid_resource,
+				    write_blobs_list)
+		{
+			if (blob->unhashed && ctx->blob_table) {
+				list_del(&blob->unhashed_list);
+				blob_table_insert(ctx->blob_table, blob);
+				blob->unhashed = 0;
+			}
+		}
+	}
+
+	/* Report the progress of the writers which finished after the first.  */
+	ret = do_write_blobs_progress(&ctx->progress_data, 0, 0, 0, false);
+out:
+	for (unsigned i = 1; i < num_writers; i++) {
+		if (writers[i].tmp_name) {
+			filedes_close(&writers[i].tmp_fd);
+			tunlink(writers[i].tmp_name);
+			FREE(writers[i].tmp_name);
+		}
+	}
+	FREE(writers);
+	return ret;
+}
+
+/*
+ * When data from WIM files is recompressed, e.g. by an export which changes the
+ * compression type, the reading thread also has to decompress it, and by
+ * default it does so by itself, so most compressors can be left waiting on the
+ * decompression.  So, for the duration of the write, let each WIM file from
+ * which data is being read, unless it was told otherwise with
+ * wimlib_set_decompression_threads(), decompress with as many threads as will
+ * do the compression.  The decompression then runs on the same task pool as
+ * the compression, and the reading thread just passes the chunks along in
+ * order.  The WIMStructs whose settings were changed are returned in
+ * @wims_ret, for restore_decompression_threads().
+ */
+static int
+raise_decompression_threads(struct list_head *blob_list, unsigned num_threads,
+			    WIMStruct ***wims_ret, size_t *num_wims_ret)
+{
+	struct blob_descriptor *blob;
+	WIMStruct **wims = NULL;
+	size_t num_wims = 0;
+
+	*wims_ret = NULL;
+	*num_wims_ret = 0;
+
+	num_threads = get_num_compression_threads(num_threads);
+	if (num_threads <= 1)
+		return 0;
+
+	list_for_each_entry(blob, blob_list, write_blobs_list) {
+		WIMStruct *wim;
+
+		if (blob->blob_location != BLOB_IN_WIM)
+			continue;
+		wim = blob->rdesc->wim;
+		if (wim->decompression_threads_set ||
+		    wim->decompression_threads_raised)
+			continue;
+		if (num_wims == 0 || is_power_of_2(num_wims)) {
+			WIMStruct **new_wims = REALLOC(wims,
+				max(num_wims * 2, 1) * sizeof(wims[0]));
+			if (!new_wims) {
+				*wims_ret = wims;
+				*num_wims_ret = num_wims;
+				return WIMLIB_ERR_NOMEM;
+			}
+			wims = new_wims;
+		}
+		wims[num_wims++] = wim;
+		wim->num_decompression_threads = num_threads;
+		wim->decompression_threads_raised = 1;
+	}
+	*wims_ret = wims;
+	*num_wims_ret = num_wims;
+	return 0;
+}
+
+/* Undo raise_decompression_threads().  The parallel decompressors are freed,
+ * since they won't be used again with the default settings.  */
+static void
+restore_decompression_threads(WIMStruct **wims, size_t num_wims)
+{
+	for (size_t i = 0; i < num_wims; i++) {
+		WIMStruct *wim = wims[i];
+
+		wim->num_decompression_threads = 1;
+		wim->decompression_threads_raised = 0;
+		if (wim->parallel_decompressor) {
+			wim->parallel_decompressor->destroy(
+						wim->parallel_decompressor);
+			wim->parallel_decompressor = NULL;
+		}
+	}
+	FREE(wims);
+}
+
+/*
+ * Write the blobs which were found by find_large_blobs() in non-solid resources
+ * compressed with @out_ctype and @out_chunk_size, after the solid resources.
+ * Like write_blob_list() itself, raw copies are made of the blobs whose
+ * resources can be reused.  Blobs which are excluded from compression are moved
+ * to @excluded_blobs, to be written along with the other excluded blobs.
+ */
+static int
+write_large_blobs(struct write_blobs_ctx *ctx, struct list_head *large_blobs,
+		  int out_ctype, u32 out_chunk_size, unsigned num_threads,
+		  unsigned num_reader_threads, struct list_head *excluded_blobs)
+{
+	struct list_head raw_copy_blobs;
+	struct list_head large_excluded_blobs;
+	struct blob_descriptor **blobs;
+	size_t num_blobs;
+	u64 num_nonraw_bytes;
+	int ret;
+
+	if (list_empty(large_blobs))
+		return 0;
+
+	ret = blob_list_to_array(large_blobs,
+				 offsetof(struct blob_descriptor,
+					  write_blobs_list),
+				 &blobs, &num_blobs);
+	if (ret)
+		return ret;
+
+	if (ctx->compressor) {
+		ctx->compressor->destroy(ctx->compressor);
+		ctx->compressor = NULL;
+	}
+	ctx->cur_chunk_buf = NULL;
+	ctx->cur_chunk_buf_filled = 0;
+	ctx->write_resource_flags &= ~WRITE_RESOURCE_FLAG_SOLID;
+	ctx->out_ctype = out_ctype;
+	ctx->out_chunk_size = out_chunk_size;
+	INIT_LIST_HEAD(&ctx->blobs_being_compressed);
+
+	num_nonraw_bytes = split_blobs_for_write(blobs, num_blobs,
+						 ctx->write_resource_flags,
+						 out_ctype, out_chunk_size,
+						 large_blobs, &raw_copy_blobs,
+						 &large_excluded_blobs);
+	FREE(blobs);
+	list_splice_tail(&large_excluded_blobs, excluded_blobs);
+
+	if (!list_empty(&raw_copy_blobs)) {
+		ret = flush_out_buf(ctx);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error writing chunk data to WIM file");
+			return ret;
+		}
+		ret = write_raw_copy_resources(&raw_copy_blobs, ctx->out_fd,
+					       NULL, &ctx->progress_data);
+		if (ret)
+			return ret;
+	}
+
+	if (num_nonraw_bytes == 0)
+		return 0;
+
+	if (out_ctype != WIMLIB_COMPRESSION_TYPE_NONE) {
+		ret = new_chunk_compressor_for_write(
+				ctx, num_nonraw_bytes > max(2000000, out_chunk_size),
+				num_threads, 0);
+		if (ret)
+			return ret;
+	}
+
+	struct read_blob_callbacks cbs = {
+		.begin_blob	= write_blob_begin_read,
+		.continue_blob	= write_blob_process_chunk,
+		.end_blob	= write_blob_end_read,
+		.get_chunk_dest	= write_blob_get_chunk_dest,
+		.ctx		= ctx,
+	};
+
+	ret = read_blob_list(large_blobs,
+			     offsetof(struct blob_descriptor, write_blobs_list),
+			     &cbs,
+			     BLOB_LIST_ALREADY_SORTED |
+				VERIFY_BLOB_HASHES |
+				COMPUTE_MISSING_BLOB_HASHES,
+			     num_reader_threads);
+	if (ret)
+		return ret;
+
+	return finish_remaining_chunks(ctx);
 }
 
 /*
@@ -1407,7 +2697,30 @@ init_done_with_file_info(struct list_head *blob_list)
  * @num_threads
  *	Number of threads to use to compress data.  If 0, a default number of
  *	threads will be chosen.  The number of threads still may be decreased
- *	from the specified value if insufficient memory is detected.
+ *	from the specified value if insufficient memory is detected.  The same
+ *	number of threads is used to read small files ahead of time.
+ *
+ * @min_solid_res_size
+ *	With WRITE_RESOURCE_FLAG_SOLID, the minimum uncompressed size of each
+ *	solid resource if the blobs are split into several solid resources which
+ *	are written in parallel, or 0 if they must be written as a single solid
+ *	resource.  See write_parallel_solid_resources().
+ *
+ * @solid_max_blob_size
+ *	With WRITE_RESOURCE_FLAG_SOLID, the size above which blobs are written
+ *	in non-solid resources after the solid resources rather than in the
+ *	solid resources, or 0 if all blobs go in the solid resources.
+ *
+ * @nonsolid_ctype
+ * @nonsolid_chunk_size
+ *	The compression format and chunk size for the blobs which are larger
+ *	than @solid_max_blob_size.
+ *
+ * @compression_workers
+ *	Comma-separated list of the compression workers to have the data
+ *	compressed by (see new_remote_chunk_compressor()), or NULL to compress
+ *	it locally.  The solid data is then always written as a single solid
+ *	resource, since the workers are what compress it in parallel.
  *
  * @blob_table
  *	If on-the-fly deduplication of unhashed blobs is desired, this parameter
@@ -1474,15 +2787,32 @@ write_blob_list(struct list_head *blob_list,
 		int out_ctype,
 		u32 out_chunk_size,
 		unsigned num_threads,
+		u64 min_solid_res_size,
+		u64 solid_max_blob_size,
+		int nonsolid_ctype,
+		u32 nonsolid_chunk_size,
+		const tchar *compression_workers,
 		struct blob_table *blob_table,
 		struct filter_context *filter_ctx,
 		wimlib_progress_func_t progfunc,
-		void *progctx)
+		void *progctx,
+		u32 progress_interval_ms)
 {
 	int ret;
 	struct write_blobs_ctx ctx;
 	struct list_head raw_copy_blobs;
+	struct list_head excluded_blobs;
+	struct list_head large_blobs;
+	struct raw_copy_thread raw_copy_thread;
+	bool raw_copy_thread_started = false;
+	unsigned num_reader_threads;
+	unsigned num_solid_resources;
 	u64 num_nonraw_bytes;
+	WIMStruct **raised_wims = NULL;
+	size_t num_raised_wims = 0;
+	struct blob_descriptor **blobs;
+	size_t num_blobs;
+	u64 trace_start = trace_begin();
 
 	wimlib_assert((write_resource_flags &
 		       (WRITE_RESOURCE_FLAG_SOLID |
@@ -1490,15 +2820,26 @@ write_blob_list(struct list_head *blob_list,
 				(WRITE_RESOURCE_FLAG_SOLID |
 				 WRITE_RESOURCE_FLAG_PIPABLE));
 
-	validate_blob_list(blob_list);
+	/* The blobs are gathered into an array once, and the passes over them
+	 * that follow are made over the array rather than the list.  */
+	ret = blob_list_to_array(blob_list,
+				 offsetof(struct blob_descriptor,
+					  write_blobs_list),
+				 &blobs, &num_blobs);
+	if (ret)
+		return ret;
+
+	validate_blobs(blobs, num_blobs);
 
-	if (list_empty(blob_list))
+	if (num_blobs == 0) {
+		FREE(blobs);
 		return 0;
+	}
 
 	/* If needed, set auxiliary information so that we can detect when the
 	 * library has finished using each external file.  */
 	if (unlikely(write_resource_flags & WRITE_RESOURCE_FLAG_SEND_DONE_WITH_FILE))
-		init_done_with_file_info(blob_list);
+		init_done_with_file_info(blobs, num_blobs);
 
 	memset(&ctx, 0, sizeof(ctx));
 
@@ -1508,6 +2849,7 @@ write_blob_list(struct list_head *blob_list,
 	ctx.out_chunk_size = out_chunk_size;
 	ctx.write_resource_flags = write_resource_flags;
 	ctx.filter_ctx = filter_ctx;
+	ctx.compression_workers = compression_workers;
 
 	/*
 	 * We normally sort the blobs to write by a "sequential" order that is
@@ -1522,56 +2864,92 @@ write_blob_list(struct list_head *blob_list,
 	 * measure of similarity of their actual contents.
 	 */
 
-	ret = sort_blob_list_by_sequential_order(blob_list,
-						 offsetof(struct blob_descriptor,
-							  write_blobs_list));
-	if (ret)
-		return ret;
+	sort_blobs_by_sequential_order(blobs, num_blobs);
 
-	ret = compute_blob_list_stats(blob_list, &ctx);
-	if (ret)
+	ret = compute_blob_list_stats(blobs, num_blobs, &ctx);
+	if (ret) {
+		FREE(blobs);
 		return ret;
+	}
+
+	/* Take out the blobs too large to go in the solid resources, if any.
+	 * They are written last, so that the solid data stays together.  */
+	INIT_LIST_HEAD(&large_blobs);
+	if ((write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) &&
+	    solid_max_blob_size != 0)
+		num_blobs = find_large_blobs(blobs, num_blobs,
+					     solid_max_blob_size, &large_blobs);
 
 	if (write_resource_flags & WRITE_RESOURCE_FLAG_SOLID_SORT) {
-		ret = sort_blob_list_for_solid_compression(blob_list);
+		struct list_head *cur;
+		size_t i = 0;
+
+		blob_array_to_list(blobs, num_blobs, blob_list,
+				   offsetof(struct blob_descriptor,
+					    write_blobs_list));
+		ret = sort_blob_list_for_solid_compression(
+				blob_list,
+				write_resource_flags &
+					WRITE_RESOURCE_FLAG_SOLID_SORT_SIMILARITY);
 		if (unlikely(ret))
 			WARNING("Failed to sort blobs for solid compression. Continuing anyways.");
+		list_for_each(cur, blob_list)
+			blobs[i++] = list_entry(cur, struct blob_descriptor,
+						write_blobs_list);
 	}
 
 	ctx.progress_data.progfunc = progfunc;
+	progress_throttle_init(&ctx.progress_data.throttle, progress_interval_ms);
 	ctx.progress_data.progctx = progctx;
 
-	num_nonraw_bytes = find_raw_copy_blobs(blob_list, write_resource_flags,
-					       out_ctype, out_chunk_size,
-					       &raw_copy_blobs);
+	num_nonraw_bytes = split_blobs_for_write(blobs, num_blobs,
+						 write_resource_flags,
+						 out_ctype, out_chunk_size,
+						 blob_list, &raw_copy_blobs,
+						 &excluded_blobs);
+	FREE(blobs);
+
+	/* When reading many small files, e.g. when capturing a directory tree,
+	 * the time taken is mostly the latency of opening and reading each file
+	 * rather than compression.  So, unless only a little data needs to be
+	 * written, also read upcoming small files using multiple threads.  */
+	num_reader_threads = 0;
+	if (num_nonraw_bytes > 2000000) {
+		num_reader_threads = num_threads;
+		if (num_reader_threads == 0)
+			num_reader_threads = get_available_cpus();
+		if (num_reader_threads == 1)
+			num_reader_threads = 0;
+	}
 
 	/* Unless no data needs to be compressed, allocate a chunk_compressor to
 	 * do compression.  There are serial and parallel implementations of the
 	 * chunk_compressor interface.  We default to parallel using the
 	 * specified number of threads, unless the upper bound on the number
-	 * bytes needing to be compressed is less than a heuristic value.  */
+	 * bytes needing to be compressed is less than a heuristic value.  But
+	 * if the solid data will be split into resources written in parallel,
+	 * each of them gets its own chunk_compressor instead.  */
+	num_solid_resources = 1;
 	if (num_nonraw_bytes != 0 && out_ctype != WIMLIB_COMPRESSION_TYPE_NONE) {
-		if (num_nonraw_bytes > max(2000000, out_chunk_size)) {
-			ret = new_parallel_chunk_compressor(out_ctype,
-							    out_chunk_size,
-							    num_threads, 0,
-							    &ctx.compressor);
-			if (ret > 0) {
-				WARNING("Couldn't create parallel chunk compressor: %"TS".\n"
-					"          Falling back to single-threaded compression.",
-					wimlib_get_error_string(ret));
-			}
-		}
-
-		if (ctx.compressor == NULL) {
-			ret = new_serial_chunk_compressor(out_ctype, out_chunk_size,
-							  &ctx.compressor);
+		if (!compression_workers)
+			num_solid_resources = choose_num_solid_resources(
+						blob_list, write_resource_flags,
+						out_chunk_size, num_nonraw_bytes,
+						num_threads, min_solid_res_size);
+		if (num_solid_resources == 1) {
+			ret = new_chunk_compressor_for_write(
+					&ctx,
+					num_nonraw_bytes > max(2000000, out_chunk_size),
+					num_threads, 0);
 			if (ret)
 				goto out_destroy_context;
 		}
 	}
 
-	if (ctx.compressor)
+	if (num_solid_resources > 1)
+		ctx.progress_data.progress.write_streams.num_threads =
+			get_num_compression_threads(num_threads);
+	else if (ctx.compressor)
 		ctx.progress_data.progress.write_streams.num_threads = ctx.compressor->num_threads;
 	else
 		ctx.progress_data.progress.write_streams.num_threads = 1;
@@ -1584,12 +2962,42 @@ write_blob_list(struct list_head *blob_list,
 		goto out_destroy_context;
 
 	/* Copy any compressed resources for which the raw data can be reused
-	 * without decompression.  */
-	ret = write_raw_copy_resources(&raw_copy_blobs, ctx.out_fd,
-				       &ctx.progress_data);
+	 * without decompression.  If other data is being compressed in the same
+	 * (seekable) file, then the copying is done by a thread of its own,
+	 * unless only one thread may be used.  */
+	if (num_nonraw_bytes != 0 && num_solid_resources == 1 &&
+	    num_threads != 1 && !ctx.out_fd->is_pipe &&
+	    !ctx.out_fd->integrity_stream &&
+	    !(write_resource_flags & WRITE_RESOURCE_FLAG_PIPABLE))
+	{
+		u64 raw_size = get_background_raw_copy_size(&raw_copy_blobs);
 
-	if (ret || num_nonraw_bytes == 0)
-		goto out_destroy_context;
+		if (raw_size >= MIN_BACKGROUND_RAW_COPY_SIZE)
+			raw_copy_thread_started =
+				start_raw_copy_thread(&raw_copy_thread,
+						      &raw_copy_blobs, &ctx,
+						      raw_size);
+	}
+	if (!raw_copy_thread_started) {
+		ret = write_raw_copy_resources(&raw_copy_blobs, ctx.out_fd,
+					       NULL, &ctx.progress_data);
+		if (ret)
+			goto out_destroy_context;
+	}
+
+	if (num_nonraw_bytes == 0)
+		goto write_large_blobs;
+
+	if (num_solid_resources > 1) {
+		ret = write_parallel_solid_resources(&ctx, blob_list,
+						     num_nonraw_bytes,
+						     num_solid_resources,
+						     num_threads,
+						     num_reader_threads);
+		if (ret)
+			goto out_destroy_context;
+		goto write_large_blobs;
+	}
 
 	INIT_LIST_HEAD(&ctx.blobs_being_compressed);
 
@@ -1602,6 +3010,11 @@ write_blob_list(struct list_head *blob_list,
 			goto out_destroy_context;
 	}
 
+	ret = raise_decompression_threads(blob_list, num_threads,
+					  &raised_wims, &num_raised_wims);
+	if (ret)
+		goto out_destroy_context;
+
 	/* Read the list of blobs needing to be compressed, using the specified
 	 * callbacks to execute processing of the data.  */
 
@@ -1609,6 +3022,7 @@ write_blob_list(struct list_head *blob_list,
 		.begin_blob	= write_blob_begin_read,
 		.continue_blob	= write_blob_process_chunk,
 		.end_blob	= write_blob_end_read,
+		.get_chunk_dest	= write_blob_get_chunk_dest,
 		.ctx		= &ctx,
 	};
 
@@ -1617,7 +3031,8 @@ write_blob_list(struct list_head *blob_list,
 			     &cbs,
 			     BLOB_LIST_ALREADY_SORTED |
 				VERIFY_BLOB_HASHES |
-				COMPUTE_MISSING_BLOB_HASHES);
+				COMPUTE_MISSING_BLOB_HASHES,
+			     num_reader_threads);
 
 	if (ret)
 		goto out_destroy_context;
@@ -1628,36 +3043,142 @@ write_blob_list(struct list_head *blob_list,
 
 	if (write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) {
 		struct wim_reshdr reshdr;
-		struct blob_descriptor *blob;
-		u64 offset_in_res;
 
 		ret = end_write_resource(&ctx, &reshdr);
 		if (ret)
 			goto out_destroy_context;
 
-		offset_in_res = 0;
-		list_for_each_entry(blob, &ctx.blobs_in_solid_resource, write_blobs_list) {
-			blob->out_reshdr.size_in_wim = blob->size;
-			blob->out_reshdr.flags = reshdr_flags_for_blob(blob) |
-						 WIM_RESHDR_FLAG_SOLID;
-			blob->out_reshdr.uncompressed_size = 0;
-			blob->out_reshdr.offset_in_wim = offset_in_res;
-			blob->out_res_offset_in_wim = reshdr.offset_in_wim;
-			blob->out_res_size_in_wim = reshdr.size_in_wim;
-			blob->out_res_uncompressed_size = reshdr.uncompressed_size;
-			offset_in_res += blob->size;
-		}
-		wimlib_assert(offset_in_res == reshdr.uncompressed_size);
+		set_solid_blob_reshdrs(&ctx.blobs_in_solid_resource, &reshdr);
 	}
 
+write_large_blobs:
+	ret = write_large_blobs(&ctx, &large_blobs, nonsolid_ctype,
+				nonsolid_chunk_size, num_threads,
+				num_reader_threads, &excluded_blobs);
+	if (ret)
+		goto out_destroy_context;
+
+	ret = write_compression_excluded_blobs(&ctx, &excluded_blobs);
+	if (ret)
+		goto out_destroy_context;
+
+	ret = finish_blob_writes(&ctx);
+
 out_destroy_context:
+	if (raw_copy_thread_started)
+		ret = finish_raw_copy_thread(&raw_copy_thread, &ctx, ret);
+	restore_decompression_threads(raised_wims, num_raised_wims);
+	FREE(ctx.out_buf);
 	FREE(ctx.chunk_csizes);
 	if (ctx.compressor)
 		ctx.compressor->destroy(ctx.compressor);
+	trace_end("write_blob_list", trace_start);
 	return ret;
 }
 
 
+/*
+ * Set up the compression fingerprint of the file data about to be written.  It
+ * is only valid if all the file data will be compressed with the current
+ * settings, so not if any blob is going to be copied from a resource that
+ * wasn't compressed with the same settings.  Whether it is recorded in the WIM
+ * file is decided later by finish_compression_fingerprint().
+ */
+static void
+set_up_compression_fingerprint(WIMStruct *wim, struct list_head *blob_list,
+			       const struct filter_context *filter_ctx,
+			       int write_resource_flags,
+			       int out_ctype, u32 out_chunk_size)
+{
+	struct wim_compression_fingerprint *fp = &wim->out_compression_fp;
+	struct blob_descriptor *blob;
+
+	fp->valid = (out_ctype != WIMLIB_COMPRESSION_TYPE_NONE &&
+		     !(write_resource_flags & WRITE_RESOURCE_FLAG_PIPABLE));
+	fp->solid = !!(write_resource_flags & WRITE_RESOURCE_FLAG_SOLID);
+	fp->appendable = true;
+	fp->ctype = out_ctype;
+	fp->chunk_size = out_chunk_size;
+	fp->level = get_default_compression_level(out_ctype);
+	fp->end_offset = 0;
+
+	if (!fp->valid)
+		return;
+
+	list_for_each_entry(blob, blob_list, write_blobs_list) {
+		if (blob_filtered(blob, filter_ctx))
+			continue;
+		if (can_raw_copy(blob, write_resource_flags,
+				 out_ctype, out_chunk_size) &&
+		    !resource_matches_fingerprint(blob->rdesc,
+						  write_resource_flags,
+						  out_ctype, out_chunk_size))
+		{
+			fp->valid = false;
+			return;
+		}
+	}
+}
+
+/*
+ * For WIMLIB_WRITE_FLAG_AUTO_SOLID_CHUNK_SIZE: choose the largest solid chunk
+ * size, up to 1 GiB, with which the data can be compressed without running
+ * short of memory.  @min_chunk_size, the chunk size that was set for the WIM,
+ * is used if no larger size fits, or if it's already enough to hold all the
+ * data.  Also reduce *num_threads_p to the number of compressors that fit in
+ * memory alongside each other with the chosen size, since bigger chunks are
+ * worth more than more threads here and the LZMS compressors build their
+ * suffix arrays in parallel anyway.
+ */
+static u32
+choose_auto_solid_chunk_size(int ctype, u32 min_chunk_size,
+			     const struct list_head *blob_list,
+			     unsigned *num_threads_p)
+{
+	const struct blob_descriptor *blob;
+	unsigned num_threads = *num_threads_p;
+	u64 total_size = 0;
+	u64 avail_memory;
+	u32 chunk_size;
+
+	list_for_each_entry(blob, blob_list, write_blobs_list)
+		total_size += blob->size;
+
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+	num_threads = min(num_threads, task_pool_num_threads());
+
+	avail_memory = get_available_memory();
+
+	for (chunk_size = (u32)1 << 30; chunk_size > min_chunk_size;
+	     chunk_size >>= 1)
+	{
+		u64 fixed_mem, per_thread_mem, needed;
+		u64 max_threads;
+
+		if (chunk_size / 2 >= total_size)
+			continue;
+		/* This is 0 if the chunk size is too large for the format.  */
+		needed = wimlib_get_compressor_needed_memory(ctype, chunk_size, 0);
+		if (needed == 0)
+			continue;
+
+		/* Like new_parallel_chunk_compressor(), count a buffer for each
+		 * compressor and one more for the chunk being filled.  Only
+		 * accept a size for which a single compressor takes at most
+		 * half the available memory.  */
+		fixed_mem = (u64)chunk_size + 1000000;
+		per_thread_mem = chunk_size + needed;
+		if (fixed_mem + per_thread_mem > avail_memory / 2)
+			continue;
+
+		max_threads = (avail_memory - fixed_mem) / per_thread_mem;
+		*num_threads_p = max(1, min(num_threads, max_threads));
+		return chunk_size;
+	}
+	return min_chunk_size;
+}
+
 static int
 write_file_data_blobs(WIMStruct *wim,
 		      struct list_head *blob_list,
@@ -1668,36 +3189,71 @@ write_file_data_blobs(WIMStruct *wim,
 	int out_ctype;
 	u32 out_chunk_size;
 	int write_resource_flags;
+	int ret;
 
 	write_resource_flags = write_flags_to_resource_flags(write_flags);
 
 	if (write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) {
 		out_chunk_size = wim->out_solid_chunk_size;
 		out_ctype = wim->out_solid_compression_type;
+		if (write_flags & WIMLIB_WRITE_FLAG_AUTO_SOLID_CHUNK_SIZE) {
+			out_chunk_size = choose_auto_solid_chunk_size(
+						out_ctype, out_chunk_size,
+						blob_list, &num_threads);
+		}
 	} else {
 		out_chunk_size = wim->out_chunk_size;
 		out_ctype = wim->out_compression_type;
 	}
 
-	return write_blob_list(blob_list,
-			       &wim->out_fd,
-			       write_resource_flags,
-			       out_ctype,
-			       out_chunk_size,
-			       num_threads,
-			       wim->blob_table,
-			       filter_ctx,
-			       wim->progfunc,
-			       wim->progctx);
+	set_up_compression_fingerprint(wim, blob_list, filter_ctx,
+				       write_resource_flags,
+				       out_ctype, out_chunk_size);
+
+	/* The fingerprint can only describe one set of compression settings,
+	 * so it isn't valid if some blobs are written in non-solid resources
+	 * instead.  */
+	if ((write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) &&
+	    wim->out_solid_max_blob_size != 0) {
+		struct blob_descriptor *blob;
+
+		list_for_each_entry(blob, blob_list, write_blobs_list) {
+			if (blob->size > wim->out_solid_max_blob_size &&
+			    !blob_filtered(blob, filter_ctx))
+				wim->out_compression_fp.valid = false;
+		}
+	}
+
+	ret = write_blob_list(blob_list,
+			      &wim->out_fd,
+			      write_resource_flags,
+			      out_ctype,
+			      out_chunk_size,
+			      num_threads,
+			      wim->out_solid_min_res_size,
+			      wim->out_solid_max_blob_size,
+			      wim->out_compression_type,
+			      wim->out_chunk_size,
+			      wim->out_compression_workers,
+			      wim->blob_table,
+			      filter_ctx,
+			      wim->progfunc,
+			      wim->progctx,
+			      wim->progress_interval_ms);
+
+	wim->out_compression_fp.end_offset = wim->out_fd.offset;
+	return ret;
 }
 
-/* Write the contents of the specified blob as a WIM resource.  */
+/* Write the contents of the specified blob as a WIM resource, compressing it
+ * with up to @num_threads threads if it is large.  */
 static int
 write_wim_resource(struct blob_descriptor *blob,
 		   struct filedes *out_fd,
 		   int out_ctype,
 		   u32 out_chunk_size,
-		   int write_resource_flags)
+		   int write_resource_flags,
+		   unsigned num_threads)
 {
 	LIST_HEAD(blob_list);
 	list_add(&blob->write_blobs_list, &blob_list);
@@ -1707,11 +3263,17 @@ write_wim_resource(struct blob_descriptor *blob,
 			       write_resource_flags & ~WRITE_RESOURCE_FLAG_SOLID,
 			       out_ctype,
 			       out_chunk_size,
-			       1,
+			       num_threads,
+			       0,
+			       0,
+			       out_ctype,
+			       out_chunk_size,
 			       NULL,
 			       NULL,
 			       NULL,
-			       NULL);
+			       NULL,
+			       NULL,
+			       0);
 }
 
 /* Write the contents of the specified buffer as a WIM resource.  */
@@ -1724,7 +3286,8 @@ write_wim_resource_from_buffer(const void *buf,
 			       u32 out_chunk_size,
 			       struct wim_reshdr *out_reshdr,
 			       u8 *hash_ret,
-			       int write_resource_flags)
+			       int write_resource_flags,
+			       unsigned num_threads)
 {
 	int ret;
 	struct blob_descriptor blob;
@@ -1740,9 +3303,10 @@ write_wim_resource_from_buffer(const void *buf,
 	sha1(buf, buf_size, blob.hash);
 	blob.unhashed = 0;
 	blob.is_metadata = is_metadata;
+	blob.compression_excluded = 0;
 
 	ret = write_wim_resource(&blob, out_fd, out_ctype, out_chunk_size,
-				 write_resource_flags);
+				 write_resource_flags, num_threads);
 	if (ret)
 		return ret;
 
@@ -1753,6 +3317,39 @@ write_wim_resource_from_buffer(const void *buf,
 	return 0;
 }
 
+/* Write the metadata resource of the image @imd, which
+ * prepare_metadata_resource() laid out as @size bytes with the SHA-1 message
+ * digest @hash, as a WIM resource.  The data is generated as it's compressed.  */
+int
+write_generated_metadata_resource(struct wim_image_metadata *imd,
+				  u64 size, const u8 *hash,
+				  struct filedes *out_fd,
+				  int out_ctype,
+				  u32 out_chunk_size,
+				  struct wim_reshdr *out_reshdr,
+				  int write_resource_flags,
+				  unsigned num_threads)
+{
+	int ret;
+	struct blob_descriptor blob;
+
+	blob.blob_location = BLOB_IN_GENERATED_METADATA;
+	blob.generated_imd = imd;
+	blob.size = size;
+	copy_hash(blob.hash, hash);
+	blob.unhashed = 0;
+	blob.is_metadata = 1;
+	blob.compression_excluded = 0;
+
+	ret = write_wim_resource(&blob, out_fd, out_ctype, out_chunk_size,
+				 write_resource_flags, num_threads);
+	if (ret)
+		return ret;
+
+	copy_reshdr(out_reshdr, &blob.out_reshdr);
+	return 0;
+}
+
 struct blob_size_table {
 	struct hlist_head *array;
 	size_t num_entries;
@@ -1798,6 +3395,197 @@ blob_size_table_insert(struct blob_descriptor *blob, void *_tab)
 	return 0;
 }
 
+/* Number of bytes at the start of each blob which prefilter_same_size_blobs()
+ * hashes to tell blobs of the same size apart  */
+#define PREFILTER_SIZE		65536
+
+/* Maximum number of tasks which read the starts of blobs for the prefilter  */
+#define MAX_PREFILTER_TASKS	16
+
+struct prefilter_entry {
+	struct blob_descriptor *blob;
+	u64 prefix_hash;
+
+	/* Result of reading the start of the blob, or -1 if not read yet  */
+	int ret;
+};
+
+struct prefilter_task {
+	struct pool_task base;
+	struct prefilter_entry *entries;
+	size_t num_entries;
+	size_t *next_entry;
+};
+
+/* A fast hash of a blob's first bytes.  It needn't be cryptographic, since
+ * blobs with equal hashes are then compared by SHA-1 message digest anyway.  */
+static u64
+hash_blob_prefix(const u8 *p, size_t n)
+{
+	u64 h = n;
+
+	for (; n >= 8; p += 8, n -= 8)
+		h = hash_u64(h ^ load_u64_unaligned(p)) ^ (h >> 29);
+	for (; n; p++, n--)
+		h = hash_u64(h ^ *p) ^ (h >> 29);
+	return h;
+}
+
+static void
+read_prefilter_entry(struct prefilter_entry *e, u8 *buf)
+{
+	size_t size = min(e->blob->size, PREFILTER_SIZE);
+
+	e->ret = read_blob_prefix_into_buf(e->blob, size, buf);
+	if (!e->ret)
+		e->prefix_hash = hash_blob_prefix(buf, size);
+}
+
+static void
+prefilter_task_run(struct pool_task *_task)
+{
+	struct prefilter_task *task = (struct prefilter_task *)_task;
+	u8 *buf = MALLOC(PREFILTER_SIZE);
+	size_t i;
+
+	if (!buf)
+		return;
+	while ((i = __atomic_fetch_add(task->next_entry, 1, __ATOMIC_RELAXED)) <
+	       task->num_entries)
+	{
+		struct prefilter_entry *e = &task->entries[i];
+
+		if (blob_can_be_read_concurrently(e->blob))
+			read_prefilter_entry(e, buf);
+	}
+	FREE(buf);
+}
+
+/* Sort by size, then the entries that couldn't be read last, then by hash.  */
+static int
+cmp_prefilter_entries(const void *p1, const void *p2)
+{
+	const struct prefilter_entry *e1 = p1;
+	const struct prefilter_entry *e2 = p2;
+
+	if (e1->blob->size != e2->blob->size)
+		return cmp_u64(e1->blob->size, e2->blob->size);
+	if ((e1->ret != 0) != (e2->ret != 0))
+		return (e1->ret != 0) - (e2->ret != 0);
+	return cmp_u64(e1->prefix_hash, e2->prefix_hash);
+}
+
+/*
+ * Blobs which are unhashed but not of unique size have to be checksummed before
+ * it's known whether they need to be written at all, which means reading them
+ * one extra time.  Same-size blobs are common, though, and usually differ near
+ * the start.  So, among each set of blobs of the same size, hash the first
+ * PREFILTER_SIZE bytes of each with a fast hash, and set @unique_size on the
+ * blobs whose hash is unique in the set, since they can't be duplicates either.
+ *
+ * This is only done for sets which contain an unhashed blob and no blob in a
+ * WIM resource, which would be costly to decompress.  If the start of any blob
+ * in a set can't be read, nothing is concluded about the set; the error will
+ * be reported when the blob is read in full.
+ */
+static int
+prefilter_same_size_blobs(struct blob_size_table *tab)
+{
+	struct prefilter_task tasks[MAX_PREFILTER_TASKS];
+	struct pool_task *task_ptrs[MAX_PREFILTER_TASKS];
+	struct prefilter_entry *entries;
+	struct blob_descriptor *blob;
+	size_t num_entries = 0;
+	size_t next_entry = 0;
+	size_t i, j, n;
+	unsigned num_tasks;
+	u8 *buf;
+
+	for (i = 0; i < tab->capacity; i++)
+		hlist_for_each_entry(blob, &tab->array[i], hash_list_2)
+			if (!blob->unique_size)
+				num_entries++;
+	if (num_entries == 0)
+		return 0;
+
+	entries = MALLOC(num_entries * sizeof(entries[0]));
+	buf = MALLOC(PREFILTER_SIZE);
+	if (!entries || !buf) {
+		FREE(entries);
+		FREE(buf);
+		return WIMLIB_ERR_NOMEM;
+	}
+	num_entries = 0;
+	for (i = 0; i < tab->capacity; i++) {
+		hlist_for_each_entry(blob, &tab->array[i], hash_list_2) {
+			if (!blob->unique_size) {
+				entries[num_entries].blob = blob;
+				entries[num_entries].ret = 0;
+				num_entries++;
+			}
+		}
+	}
+	qsort(entries, num_entries, sizeof(entries[0]), cmp_prefilter_entries);
+
+	/* Keep only the sets which are worth prefiltering.  */
+	n = 0;
+	for (i = 0; i < num_entries; i = j) {
+		bool any_unhashed = false;
+		bool any_in_wim = false;
+
+		for (j = i; j < num_entries &&
+			    entries[j].blob->size == entries[i].blob->size; j++)
+		{
+			any_unhashed |= entries[j].blob->unhashed;
+			any_in_wim |= (entries[j].blob->blob_location ==
+				       BLOB_IN_WIM);
+		}
+		if (any_unhashed && !any_in_wim) {
+			for (; i < j; i++) {
+				entries[n] = entries[i];
+				entries[n++].ret = -1;
+			}
+		}
+	}
+
+	num_tasks = min(min(n, task_pool_num_threads()), MAX_PREFILTER_TASKS);
+	if (num_tasks > 1) {
+		for (unsigned k = 0; k < num_tasks; k++) {
+			tasks[k].base.run = prefilter_task_run;
+			tasks[k].entries = entries;
+			tasks[k].num_entries = n;
+			tasks[k].next_entry = &next_entry;
+			task_ptrs[k] = &tasks[k].base;
+		}
+		task_pool_run_batch(task_ptrs, num_tasks);
+	}
+	for (i = 0; i < n; i++)
+		if (entries[i].ret < 0)
+			read_prefilter_entry(&entries[i], buf);
+
+	qsort(entries, n, sizeof(entries[0]), cmp_prefilter_entries);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i; j < n && entries[j].blob->size == entries[i].blob->size;
+		     j++)
+			;
+		/* The entries that couldn't be read are last in the set.  */
+		if (entries[j - 1].ret != 0)
+			continue;
+		for (size_t k = i; k < j; k++) {
+			if ((k == i || entries[k - 1].prefix_hash !=
+				       entries[k].prefix_hash) &&
+			    (k == j - 1 || entries[k + 1].prefix_hash !=
+					   entries[k].prefix_hash))
+				entries[k].blob->unique_size = 1;
+		}
+	}
+
+	FREE(entries);
+	FREE(buf);
+	return 0;
+}
+
 struct find_blobs_ctx {
 	WIMStruct *wim;
 	int write_flags;
@@ -1963,8 +3751,10 @@ determine_blob_size_uniquity(struct list_head *blob_list,
 	list_for_each_entry(blob, blob_list, write_blobs_list)
 		blob_size_table_insert(blob, &tab);
 
+	ret = prefilter_same_size_blobs(&tab);
+
 	destroy_blob_size_table(&tab);
-	return 0;
+	return ret;
 }
 
 static void
@@ -1978,8 +3768,18 @@ filter_blob_list_for_write(struct list_head *blob_list,
 
 		if (status == 0) {
 			/* Not filtered.  */
+			if (filter_ctx->delta_stats) {
+				filter_ctx->delta_stats->num_blobs_written++;
+				filter_ctx->delta_stats->bytes_written +=
+					blob->size;
+			}
 			continue;
 		} else {
+			if (blob_in_delta_base(blob, filter_ctx)) {
+				filter_ctx->delta_stats->num_blobs_omitted++;
+				filter_ctx->delta_stats->bytes_omitted +=
+					blob->size;
+			}
 			if (status > 0) {
 				/* Soft filtered.  */
 			} else {
@@ -2069,6 +3869,12 @@ prepare_blob_list_for_write(WIMStruct *wim, int image,
 
 	filter_ctx_ret->write_flags = write_flags;
 	filter_ctx_ret->wim = wim;
+	filter_ctx_ret->base_blob_table = NULL;
+	filter_ctx_ret->delta_stats = NULL;
+	if (wim->out_delta_base) {
+		filter_ctx_ret->base_blob_table = wim->out_delta_base->blob_table;
+		filter_ctx_ret->delta_stats = wim->out_delta_stats;
+	}
 
 	ret = prepare_unfiltered_list_of_blobs_in_output_wim(
 				wim,
@@ -2140,7 +3946,8 @@ write_file_data(WIMStruct *wim, int image, int write_flags,
 }
 
 static int
-write_metadata_resources(WIMStruct *wim, int image, int write_flags)
+write_metadata_resources(WIMStruct *wim, int image, int write_flags,
+			 unsigned num_threads)
 {
 	int ret;
 	int start_image;
@@ -2177,7 +3984,10 @@ write_metadata_resources(WIMStruct *wim, int image, int write_flags)
 			 * newly added, so we have to build and write a new
 			 * metadata resource.  */
 			ret = write_metadata_resource(wim, i,
-						      write_resource_flags);
+						      write_resource_flags,
+						      num_threads,
+						      write_flags &
+						      WIMLIB_WRITE_FLAG_APPEND);
 		} else if (is_image_unchanged_from_wim(imd, wim) &&
 			   (write_flags & (WIMLIB_WRITE_FLAG_UNSAFE_COMPACT |
 					   WIMLIB_WRITE_FLAG_APPEND)))
@@ -2198,7 +4008,8 @@ write_metadata_resources(WIMStruct *wim, int image, int write_flags)
 						 &wim->out_fd,
 						 wim->out_compression_type,
 						 wim->out_chunk_size,
-						 write_resource_flags);
+						 write_resource_flags,
+						 num_threads);
 		}
 		if (ret)
 			return ret;
@@ -2210,14 +4021,15 @@ write_metadata_resources(WIMStruct *wim, int image, int write_flags)
 }
 
 static int
-open_wim_writable(WIMStruct *wim, const tchar *path, int open_flags)
+open_wim_writable(WIMStruct *wim, const tchar *path, int open_flags,
+		  int write_flags)
 {
-	int raw_fd = topen(path, open_flags | O_BINARY, 0644);
-	if (raw_fd < 0) {
+	if (filedes_open(&wim->out_fd, path, open_flags, 0644,
+			 write_flags & WIMLIB_WRITE_FLAG_UNBUFFERED))
+	{
 		ERROR_WITH_ERRNO("Failed to open \"%"TS"\" for writing", path);
 		return WIMLIB_ERR_OPEN;
 	}
-	filedes_init(&wim->out_fd, raw_fd);
 	return 0;
 }
 
@@ -2230,10 +4042,25 @@ close_wim_writable(WIMStruct *wim, int write_flags)
 		if (filedes_valid(&wim->out_fd))
 			if (filedes_close(&wim->out_fd))
 				ret = WIMLIB_ERR_WRITE;
+	free_integrity_stream(wim->out_fd.integrity_stream);
 	filedes_invalidate(&wim->out_fd);
 	return ret;
 }
 
+/* If an integrity table will be written, then start passing the data written to
+ * the WIM file to an integrity stream, so that most of the integrity table can
+ * be calculated without reading the file back.  Failure to allocate the stream
+ * isn't an error; the table is then calculated by reading the file.  */
+static void
+begin_integrity_stream(WIMStruct *wim, int write_flags)
+{
+	if ((write_flags & (WIMLIB_WRITE_FLAG_CHECK_INTEGRITY |
+			    WIMLIB_WRITE_FLAG_NO_NEW_BLOBS)) !=
+	    WIMLIB_WRITE_FLAG_CHECK_INTEGRITY || wim->out_fd.is_pipe)
+		return;
+	(void)new_integrity_stream(&wim->out_fd.integrity_stream);
+}
+
 static int
 cmp_blobs_by_out_rdesc(const void *p1, const void *p2)
 {
@@ -2258,6 +4085,94 @@ cmp_blobs_by_out_rdesc(const void *p1, const void *p2)
 		       blob2->out_reshdr.offset_in_wim);
 }
 
+static inline bool
+blob_is_in_this_wim(const struct blob_descriptor *blob, const WIMStruct *wim)
+{
+	return blob->blob_location == BLOB_IN_WIM && blob->rdesc->wim == wim;
+}
+
+/*
+ * Sort the blob table list for an append to @wim into the order of
+ * cmp_blobs_by_out_rdesc().  wimlib wrote the old blob table in that order, so
+ * the blobs already in the WIM file are just put back in the order of their
+ * entries in it, and only the new blobs, which are usually few, are sorted and
+ * then merged in.  If the old blobs turn out not to be in order, for example
+ * because the old blob table was written by other software, then all the blobs
+ * are sorted.
+ */
+static int
+sort_appended_blob_table_list(WIMStruct *wim, struct list_head *blob_table_list)
+{
+	struct blob_descriptor **old_blobs;
+	struct blob_descriptor *blob, *tmp, *prev = NULL;
+	LIST_HEAD(new_blobs);
+	u32 max_pos = 0;
+	int ret;
+
+	list_for_each_entry_safe(blob, tmp, blob_table_list, blob_table_list) {
+		if (blob_is_in_this_wim(blob, wim))
+			max_pos = max(max_pos, blob->blob_table_pos);
+		else
+			list_move_tail(&blob->blob_table_list, &new_blobs);
+	}
+	if (list_empty(blob_table_list))
+		goto sort_all;
+
+	old_blobs = CALLOC((size_t)max_pos + 1, sizeof(old_blobs[0]));
+	if (!old_blobs) {
+		list_splice_tail(&new_blobs, blob_table_list);
+		return WIMLIB_ERR_NOMEM;
+	}
+	list_for_each_entry(blob, blob_table_list, blob_table_list) {
+		if (old_blobs[blob->blob_table_pos])
+			goto free_and_sort_all;
+		old_blobs[blob->blob_table_pos] = blob;
+	}
+	for (size_t i = 0; i <= max_pos; i++) {
+		if (!old_blobs[i])
+			continue;
+		if (prev && cmp_blobs_by_out_rdesc(&prev, &old_blobs[i]) > 0)
+			goto free_and_sort_all;
+		prev = old_blobs[i];
+	}
+
+	ret = sort_blob_list(&new_blobs,
+			     offsetof(struct blob_descriptor, blob_table_list),
+			     cmp_blobs_by_out_rdesc);
+	if (ret) {
+		FREE(old_blobs);
+		list_splice_tail(&new_blobs, blob_table_list);
+		return ret;
+	}
+
+	INIT_LIST_HEAD(blob_table_list);
+	for (size_t i = 0; i <= max_pos; i++) {
+		if (!old_blobs[i])
+			continue;
+		while (!list_empty(&new_blobs)) {
+			blob = list_first_entry(&new_blobs,
+						struct blob_descriptor,
+						blob_table_list);
+			if (cmp_blobs_by_out_rdesc(&blob, &old_blobs[i]) > 0)
+				break;
+			list_move_tail(&blob->blob_table_list,
+				       blob_table_list);
+		}
+		list_add_tail(&old_blobs[i]->blob_table_list, blob_table_list);
+	}
+	list_splice_tail(&new_blobs, blob_table_list);
+	FREE(old_blobs);
+	return 0;
+
+free_and_sort_all:
+	FREE(old_blobs);
+sort_all:
+	list_splice_tail(&new_blobs, blob_table_list);
+	return sort_blob_list(blob_table_list,
+			      offsetof(struct blob_descriptor, blob_table_list),
+			      cmp_blobs_by_out_rdesc);
+}
+
 static int
 write_blob_table(WIMStruct *wim, int image, int write_flags,
 		 struct list_head *blob_table_list)
@@ -2268,17 +4183,16 @@ write_blob_table(WIMStruct *wim, int image, int write_flags,
 	if (write_flags & WIMLIB_WRITE_FLAG_APPEND) {
 		struct blob_descriptor *blob;
 		list_for_each_entry(blob, blob_table_list, blob_table_list) {
-			if (blob->blob_location == BLOB_IN_WIM &&
-			    blob->rdesc->wim == wim)
-			{
+			if (blob_is_in_this_wim(blob, wim))
 				blob_set_out_reshdr_for_reuse(blob);
-			}
 		}
+		ret = sort_appended_blob_table_list(wim, blob_table_list);
+	} else {
+		ret = sort_blob_list(blob_table_list,
+				     offsetof(struct blob_descriptor,
+					      blob_table_list),
+				     cmp_blobs_by_out_rdesc);
 	}
-
-	ret = sort_blob_list(blob_table_list,
-			     offsetof(struct blob_descriptor, blob_table_list),
-			     cmp_blobs_by_out_rdesc);
 	if (ret)
 		return ret;
 
@@ -2322,6 +4236,47 @@ write_blob_table(WIMStruct *wim, int image, int write_flags,
  * The output file descriptor is closed on success, except when writing to a
  * user-specified file descriptor (WIMLIB_WRITE_FLAG_FILE_DESCRIPTOR set).
  */
+/*
+ * Decide which compression fingerprint, if any, to record in the WIM file being
+ * written, given the one set up by set_up_compression_fingerprint() for the
+ * file data just written.
+ *
+ * When appending, the fingerprint of the existing file data still applies to
+ * it.  It is extended to cover the new file data only if that was compressed
+ * with the same settings and directly follows the covered data, apart from
+ * metadata resources and tables.
+ */
+static void
+finish_compression_fingerprint(WIMStruct *wim, int write_flags)
+{
+	struct wim_compression_fingerprint *fp = &wim->out_compression_fp;
+	const struct wim_compression_fingerprint *old_fp = &wim->compression_fp;
+
+	if ((write_flags & WIMLIB_WRITE_FLAG_PIPABLE) ||
+	    wim->out_hdr.total_parts != 1) {
+		fp->valid = false;
+		return;
+	}
+
+	if (!(write_flags & WIMLIB_WRITE_FLAG_APPEND))
+		return;
+
+	if (!old_fp->valid) {
+		fp->valid = false;
+	} else if (!(write_flags & WIMLIB_WRITE_FLAG_NO_NEW_BLOBS) &&
+		   fp->valid && old_fp->appendable &&
+		   fp->solid == old_fp->solid &&
+		   fp->ctype == old_fp->ctype &&
+		   fp->chunk_size == old_fp->chunk_size &&
+		   fp->level == old_fp->level) {
+		/* Extend the old fingerprint to the new data.  */
+	} else {
+		*fp = *old_fp;
+		if (!(write_flags & WIMLIB_WRITE_FLAG_NO_NEW_BLOBS))
+			fp->appendable = false;
+	}
+}
+
 static int
 finish_write(WIMStruct *wim, int image, int write_flags,
 	     struct list_head *blob_table_list)
@@ -2329,9 +4284,11 @@ finish_write(WIMStruct *wim, int image, int write_flags,
 	int write_resource_flags;
 	off_t old_blob_table_end = 0;
 	struct integrity_table *old_integrity_table = NULL;
+	struct integrity_stream *integrity_stream = NULL;
 	off_t new_blob_table_end;
 	u64 xml_totalbytes;
 	int ret;
+	u64 trace_start = trace_begin();
 
 	write_resource_flags = write_flags_to_resource_flags(write_flags);
 
@@ -2376,11 +4333,22 @@ finish_write(WIMStruct *wim, int image, int write_flags,
 			goto out;
 	}
 
+	/* The integrity table only covers the data up to the end of the blob
+	 * table, so that's all the integrity stream (if any) needs.  */
+	integrity_stream = wim->out_fd.integrity_stream;
+	wim->out_fd.integrity_stream = NULL;
+	if (integrity_stream)
+		integrity_stream_finish(integrity_stream,
+					wim->out_hdr.blob_table_reshdr.offset_in_wim +
+					wim->out_hdr.blob_table_reshdr.size_in_wim);
+
 	/* Write XML data.  */
 	xml_totalbytes = wim->out_fd.offset;
 	if (write_flags & WIMLIB_WRITE_FLAG_USE_EXISTING_TOTALBYTES)
 		xml_totalbytes = WIM_TOTALBYTES_USE_EXISTING;
+	finish_compression_fingerprint(wim, write_flags);
 	ret = write_wim_xml_data(wim, image, xml_totalbytes,
+				 &wim->out_compression_fp,
 				 &wim->out_hdr.xml_data_reshdr,
 				 write_resource_flags);
 	if (ret)
@@ -2410,7 +4378,8 @@ finish_write(WIMStruct *wim, int image, int write_flags,
 		ret = write_integrity_table(wim,
 					    new_blob_table_end,
 					    old_blob_table_end,
-					    old_integrity_table);
+					    old_integrity_table,
+					    integrity_stream);
 		if (ret)
 			goto out;
 	} else {
@@ -2421,8 +4390,22 @@ finish_write(WIMStruct *wim, int image, int write_flags,
 	/* Now that all information in the WIM header has been determined, the
 	 * preliminary header written earlier can be overwritten, the header of
 	 * the existing WIM file can be overwritten, or the final header can be
-	 * written to the end of the pipable WIM.  */
+	 * written to the end of the pipable WIM.  When syncing, everything the
+	 * new header refers to is synced first, so that it can't reach the
+	 * disk before the data does.  */
 	wim->out_hdr.flags &= ~WIM_HDR_FLAG_WRITE_IN_PROGRESS;
+	if ((write_flags & (WIMLIB_WRITE_FLAG_FSYNC |
+			    WIMLIB_WRITE_FLAG_PIPABLE)) ==
+	    WIMLIB_WRITE_FLAG_FSYNC) {
+		u64 start = perf_start();
+
+		if (filedes_sync(&wim->out_fd)) {
+			ERROR_WITH_ERRNO("Error syncing data to WIM file");
+			ret = WIMLIB_ERR_WRITE;
+			goto out;
+		}
+		perf_end(PERF_FSYNC, start, 0);
+	}
 	if (write_flags & WIMLIB_WRITE_FLAG_PIPABLE)
 		ret = write_wim_header(&wim->out_hdr, &wim->out_fd, wim->out_fd.offset);
 	else
@@ -2433,7 +4416,7 @@ finish_write(WIMStruct *wim, int image, int write_flags,
 	ret = WIMLIB_ERR_WRITE;
 	if (unlikely(write_flags & WIMLIB_WRITE_FLAG_UNSAFE_COMPACT)) {
 		/* Truncate any data the compaction freed up.  */
-		if (ftruncate(wim->out_fd.fd, wim->out_fd.offset) &&
+		if (filedes_truncate(&wim->out_fd, wim->out_fd.offset) &&
 		    errno != EINVAL) /* allow compaction on untruncatable files,
 					e.g. block devices  */
 		{
@@ -2450,10 +4433,13 @@ finish_write(WIMStruct *wim, int image, int write_flags,
 	 */
 	ret = WIMLIB_ERR_WRITE;
 	if (write_flags & WIMLIB_WRITE_FLAG_FSYNC) {
-		if (fsync(wim->out_fd.fd)) {
+		u64 start = perf_start();
+
+		if (filedes_sync(&wim->out_fd)) {
 			ERROR_WITH_ERRNO("Error syncing data to WIM file");
 			goto out;
 		}
+		perf_end(PERF_FSYNC, start, 0);
 	}
 
 	ret = WIMLIB_ERR_WRITE;
@@ -2464,7 +4450,9 @@ finish_write(WIMStruct *wim, int image, int write_flags,
 
 	ret = 0;
 out:
+	free_integrity_stream(integrity_stream);
 	free_integrity_table(old_integrity_table);
+	trace_end("finish_write", trace_start);
 	return ret;
 }
 
@@ -2607,14 +4595,14 @@ write_pipable_wim(WIMStruct *wim, int image, int write_flags,
 		return ret;
 
 	/* Write extra copy of the XML data.  */
-	ret = write_wim_xml_data(wim, image, WIM_TOTALBYTES_OMIT,
+	ret = write_wim_xml_data(wim, image, WIM_TOTALBYTES_OMIT, NULL,
 				 &xml_reshdr, WRITE_RESOURCE_FLAG_PIPABLE);
 	if (ret)
 		return ret;
 
 	/* Write metadata resources for the image(s) being included in the
 	 * output WIM.  */
-	ret = write_metadata_resources(wim, image, write_flags);
+	ret = write_metadata_resources(wim, image, write_flags, num_threads);
 	if (ret)
 		return ret;
 
@@ -2702,8 +4690,9 @@ write_wim_part(WIMStruct *wim,
 				    WIMLIB_WRITE_FLAG_NOT_PIPABLE))
 		return WIMLIB_ERR_INVALID_PARAM;
 
-	/* Only wimlib_overwrite() accepts UNSAFE_COMPACT.  */
-	if (write_flags & WIMLIB_WRITE_FLAG_UNSAFE_COMPACT)
+	/* Only wimlib_overwrite() accepts UNSAFE_COMPACT and SAFE_COMPACT.  */
+	if (write_flags & (WIMLIB_WRITE_FLAG_UNSAFE_COMPACT |
+			   WIMLIB_WRITE_FLAG_SAFE_COMPACT))
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	/* Include an integrity table by default if no preference was given and
@@ -2827,7 +4816,7 @@ write_wim_part(WIMStruct *wim,
 		/* Filename of WIM to write was provided; open file descriptor
 		 * to it.  */
 		ret = open_wim_writable(wim, (const tchar*)path_or_fd,
-					O_TRUNC | O_CREAT | O_RDWR);
+					O_TRUNC | O_CREAT | O_RDWR, write_flags);
 		if (ret)
 			goto out_cleanup;
 	}
@@ -2842,6 +4831,10 @@ write_wim_part(WIMStruct *wim,
 	if (ret)
 		goto out_cleanup;
 
+	begin_integrity_stream(wim, write_flags);
+	if (write_flags & WIMLIB_WRITE_FLAG_FSYNC)
+		filedes_start_write_behind(&wim->out_fd);
+
 	/* Write file data and metadata resources.  */
 	if (!(write_flags & WIMLIB_WRITE_FLAG_PIPABLE)) {
 		/* Default case: create a normal (non-pipable) WIM.  */
@@ -2852,7 +4845,8 @@ write_wim_part(WIMStruct *wim,
 		if (ret)
 			goto out_cleanup;
 
-		ret = write_metadata_resources(wim, image, write_flags);
+		ret = write_metadata_resources(wim, image, write_flags,
+					       num_threads);
 		if (ret)
 			goto out_cleanup;
 	} else {
@@ -2866,6 +4860,10 @@ write_wim_part(WIMStruct *wim,
 
 	/* Write blob table, XML data, and (optional) integrity table.  */
 	ret = finish_write(wim, image, write_flags, &blob_table_list);
+	if (ret)
+		goto out_cleanup;
+
+	save_capture_hash_cache(wim);
 out_cleanup:
 	(void)close_wim_writable(wim, write_flags);
 	return ret;
@@ -2894,6 +4892,31 @@ wimlib_write(WIMStruct *wim, const tchar *path,
 	return write_standalone_wim(wim, path, image, write_flags, num_threads);
 }
 
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_write_delta(WIMStruct *wim, WIMStruct *base_wim, const tchar *path,
+		   int image, int write_flags, unsigned num_threads,
+		   struct wimlib_delta_stats *stats_ret)
+{
+	struct wimlib_delta_stats stats = { 0 };
+	int ret;
+
+	if (!base_wim || base_wim == wim)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	/* The blobs of the base WIM are looked up by hash, so it needs to
+	 * remain unmodified, and not be written, while this runs.  */
+	wim->out_delta_base = base_wim;
+	wim->out_delta_stats = &stats;
+	ret = wimlib_write(wim, path, image, write_flags, num_threads);
+	wim->out_delta_base = NULL;
+	wim->out_delta_stats = NULL;
+
+	if (!ret && stats_ret)
+		*stats_ret = stats;
+	return ret;
+}
+
 /* API function documented in wimlib.h  */
 WIMLIBAPI int
 wimlib_write_to_fd(WIMStruct *wim, int fd,
@@ -2902,12 +4925,783 @@ wimlib_write_to_fd(WIMStruct *wim, int fd,
 	if (write_flags & ~WIMLIB_WRITE_MASK_PUBLIC)
 		return WIMLIB_ERR_INVALID_PARAM;
 
-	if (fd < 0)
+	if (fd < 0)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	write_flags |= WIMLIB_WRITE_FLAG_FILE_DESCRIPTOR;
+
+	return write_standalone_wim(wim, &fd, image, write_flags, num_threads);
+}
+
+/*
+ * Estimating the size of a write
+ *
+ * wimlib_estimate_write() prepares the list of blobs to write exactly as a
+ * write would, including the deduplication and filtering, then adds up the
+ * sizes of the blobs that would be copied without being recompressed and
+ * estimates the compressed size of the rest by compressing a sample of their
+ * chunks.  The samples are spread evenly over the data to compress, so that
+ * e.g. a directory of already-compressed files among text files is
+ * represented in proportion to its size.
+ */
+
+/* Largest piece of data compressed as one sample  */
+#define ESTIMATE_MAX_SAMPLE_SIZE	(256 << 10)
+
+/* About 1/ESTIMATE_SAMPLE_FRACTION of the data to compress is sampled, but at
+ * least ESTIMATE_MIN_SAMPLE_BYTES  */
+#define ESTIMATE_SAMPLE_FRACTION	64
+#define ESTIMATE_MIN_SAMPLE_BYTES	(8 << 20)
+
+/* Size of an entry in the on-disk blob table  */
+#define ESTIMATE_BLOB_TABLE_ENTRY_SIZE	50
+
+/* The data to be compressed with one set of compression settings  */
+struct estimate_group {
+	int ctype;
+	u32 chunk_size;
+	int write_resource_flags;
+	u64 num_bytes;
+	u64 num_chunks;
+
+	/* Totals over the samples compressed so far.  When the data is only
+	 * sampled, each sample stands for the same amount of data, even if it
+	 * was cut short by the end of a blob; so the results are weighted by
+	 * that amount rather than by the sizes of the samples.  */
+	u64 sampled_usize;
+	double weight;
+	double weighted_csize;
+	double weighted_ns;
+};
+
+/* Return the group whose settings @blob would be written with, or NULL if it
+ * would be copied without being recompressed.  */
+static struct estimate_group *
+estimate_group_for_blob(const struct blob_descriptor *blob,
+			struct estimate_group groups[2], u64 max_solid_blob_size)
+{
+	struct estimate_group *g = &groups[0];
+
+	if ((g->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) &&
+	    max_solid_blob_size != 0 && blob->size > max_solid_blob_size)
+		g = &groups[1];
+	if (can_raw_copy(blob, g->write_resource_flags, g->ctype,
+			 g->chunk_size))
+		return NULL;
+	return g;
+}
+
+static int
+estimate_compress_sample(const struct blob_descriptor *blob, u64 offset,
+			 size_t size, double weight, struct estimate_group *g,
+			 struct wimlib_compressor *c, u8 *in, u8 *out)
+{
+	size_t csize;
+	u64 start;
+	int ret;
+
+	ret = read_partial_blob_into_buf(blob, offset, size, in);
+	if (ret)
+		return ret;
+	start = perf_now();
+	csize = wimlib_compress(in, size, out, size - 1, c);
+	g->weighted_ns += (double)(perf_now() - start) / size * weight;
+	g->weighted_csize += (double)(csize ? csize : size) / size * weight;
+	g->weight += weight;
+	g->sampled_usize += size;
+	return 0;
+}
+
+/* Compress samples of the data in group @g.  */
+static int
+estimate_sample_group(struct list_head *blob_list, struct estimate_group *g,
+		      struct estimate_group groups[2], u64 max_solid_blob_size)
+{
+	size_t sample_size = min(g->chunk_size, ESTIMATE_MAX_SAMPLE_SIZE);
+	u64 target = max(g->num_bytes / ESTIMATE_SAMPLE_FRACTION,
+			 ESTIMATE_MIN_SAMPLE_BYTES);
+	u64 num_samples = DIV_ROUND_UP(min(target, g->num_bytes), sample_size);
+	u64 stride = max(g->num_bytes / num_samples, sample_size);
+	bool sample_all = (stride == sample_size);
+	u64 next_sample = sample_all ? 0 : stride / 2;
+	u64 pos = 0;
+	struct wimlib_compressor *c;
+	struct blob_descriptor *blob;
+	u8 *in, *out;
+	int ret;
+
+	ret = wimlib_create_compressor(g->ctype, sample_size, 0, &c);
+	if (ret)
+		return ret;
+	in = MALLOC(sample_size);
+	out = MALLOC(sample_size);
+	if (!in || !out) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out;
+	}
+
+	list_for_each_entry(blob, blob_list, write_blobs_list) {
+		if (estimate_group_for_blob(blob, groups,
+					    max_solid_blob_size) != g)
+			continue;
+		if (can_read_partial_blob(blob)) {
+			while (next_sample < pos + blob->size) {
+				u64 offset = next_sample - pos;
+				size_t size;
+
+				offset -= offset % sample_size;
+				size = min(sample_size, blob->size - offset);
+				ret = estimate_compress_sample(
+						blob, offset, size,
+						sample_all ? size : stride,
+						g, c, in, out);
+				if (ret)
+					goto out;
+				if (sample_all)
+					next_sample = pos + offset + size;
+				else
+					next_sample += stride;
+			}
+		}
+		pos += blob->size;
+		/* Samples that fall in blobs which can't be read in pieces
+		 * are skipped, not moved to the next blob.  */
+		while (next_sample < pos)
+			next_sample += stride;
+	}
+	ret = 0;
+out:
+	FREE(out);
+	FREE(in);
+	wimlib_free_compressor(c);
+	return ret;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_estimate_write(WIMStruct *wim, int image, int write_flags,
+		      unsigned num_threads,
+		      struct wimlib_write_estimate *estimate_ret)
+{
+	struct wimlib_write_estimate est = { 0 };
+	struct estimate_group groups[2];
+	struct list_head blob_list;
+	struct list_head blob_table_list;
+	struct filter_context filter_ctx;
+	struct blob_descriptor *blob;
+	u64 max_solid_blob_size = 0;
+	double compressed_size = 0;
+	double compress_ns = 0;
+	u64 size;
+	int ret;
+
+	if (write_flags & ~WIMLIB_WRITE_MASK_PUBLIC)
+		return WIMLIB_ERR_INVALID_PARAM;
+	if (!estimate_ret)
+		return WIMLIB_ERR_INVALID_PARAM;
+	if (image != WIMLIB_ALL_IMAGES &&
+	    (image < 1 || image > wim->hdr.image_count))
+		return WIMLIB_ERR_INVALID_IMAGE;
+	if (!wim_has_metadata(wim))
+		return WIMLIB_ERR_METADATA_NOT_FOUND;
+
+	/* Apply the same defaults as write_wim_part().  */
+	if (!(write_flags & (WIMLIB_WRITE_FLAG_CHECK_INTEGRITY |
+			     WIMLIB_WRITE_FLAG_NO_CHECK_INTEGRITY)) &&
+	    wim_has_integrity_table(wim))
+		write_flags |= WIMLIB_WRITE_FLAG_CHECK_INTEGRITY;
+	if (!(write_flags & (WIMLIB_WRITE_FLAG_PIPABLE |
+			     WIMLIB_WRITE_FLAG_NOT_PIPABLE)) &&
+	    wim_is_pipable(wim))
+		write_flags |= WIMLIB_WRITE_FLAG_PIPABLE;
+	if ((write_flags & WIMLIB_WRITE_FLAG_PIPABLE) &&
+	    (write_flags & WIMLIB_WRITE_FLAG_SOLID))
+		return WIMLIB_ERR_INVALID_PARAM;
+	if (wim->out_compression_type == WIMLIB_COMPRESSION_TYPE_LZMS &&
+	    !(write_flags & WIMLIB_WRITE_FLAG_PIPABLE) &&
+	    wim_has_solid_resources(wim))
+		write_flags |= WIMLIB_WRITE_FLAG_SOLID;
+
+	ret = prepare_blob_list_for_write(wim, image, write_flags, &blob_list,
+					  &blob_table_list, &filter_ctx);
+	if (ret)
+		return ret;
+
+	groups[0] = (struct estimate_group) {
+		.ctype = wim->out_compression_type,
+		.chunk_size = wim->out_chunk_size,
+		.write_resource_flags =
+			write_flags_to_resource_flags(write_flags),
+	};
+	groups[1] = groups[0];
+	groups[1].write_resource_flags &= ~WRITE_RESOURCE_FLAG_SOLID;
+	if (groups[0].write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) {
+		groups[0].ctype = wim->out_solid_compression_type;
+		groups[0].chunk_size = wim->out_solid_chunk_size;
+		if (write_flags & WIMLIB_WRITE_FLAG_AUTO_SOLID_CHUNK_SIZE) {
+			unsigned n = num_threads;
+
+			groups[0].chunk_size = choose_auto_solid_chunk_size(
+						groups[0].ctype,
+						groups[0].chunk_size,
+						&blob_list, &n);
+		}
+		max_solid_blob_size = wim->out_solid_max_blob_size;
+	}
+
+	/* Add up the data that would be copied as-is, and find how much would
+	 * be compressed with each set of settings.  */
+	list_for_each_entry(blob, &blob_list, write_blobs_list) {
+		struct estimate_group *g;
+
+		est.num_blobs++;
+		est.uncompressed_bytes += blob->size;
+		g = estimate_group_for_blob(blob, groups, max_solid_blob_size);
+		if (!g) {
+			const struct wim_resource_descriptor *rdesc =
+				blob->rdesc;
+
+			if (rdesc->flags & WIM_RESHDR_FLAG_SOLID)
+				size = (double)blob->size * rdesc->size_in_wim /
+				       max(rdesc->uncompressed_size, 1);
+			else
+				size = rdesc->size_in_wim;
+			est.raw_copy_bytes += size;
+			compressed_size += size;
+		} else if (g->ctype == WIMLIB_COMPRESSION_TYPE_NONE) {
+			compressed_size += blob->size;
+		} else {
+			u64 num_chunks = DIV_ROUND_UP(blob->size,
+						      g->chunk_size);
+
+			g->num_bytes += blob->size;
+			g->num_chunks += num_chunks;
+			/* Chunk table of a non-solid resource  */
+			if (!(g->write_resource_flags &
+			      WRITE_RESOURCE_FLAG_SOLID) && num_chunks > 1)
+				compressed_size += (num_chunks - 1) *
+					(blob->size > UINT32_MAX ? 8 : 4);
+		}
+	}
+
+	for (int i = 0; i < 2; i++) {
+		struct estimate_group *g = &groups[i];
+
+		if (g->num_bytes == 0)
+			continue;
+		est.bytes_to_compress += g->num_bytes;
+		ret = estimate_sample_group(&blob_list, g, groups,
+					    max_solid_blob_size);
+		if (ret)
+			return ret;
+		est.sampled_bytes += g->sampled_usize;
+		if (g->weight == 0) {
+			compressed_size += g->num_bytes;
+			continue;
+		}
+		compressed_size += g->num_bytes * g->weighted_csize / g->weight;
+		compress_ns += g->num_bytes * g->weighted_ns / g->weight;
+		/* Chunk table and header of the solid resource(s)  */
+		if (g->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID)
+			compressed_size += 16 + g->num_chunks * 8;
+	}
+
+	/* Metadata resources of unmodified images keep their current size.
+	 * New and modified images aren't counted.  */
+	for (int i = 1; i <= wim->hdr.image_count; i++) {
+		const struct wim_image_metadata *imd =
+			wim->image_metadata[i - 1];
+
+		if (image != WIMLIB_ALL_IMAGES && i != image)
+			continue;
+		if (!is_image_dirty(imd) &&
+		    imd->metadata_blob->blob_location == BLOB_IN_WIM)
+			compressed_size += imd->metadata_blob->rdesc->size_in_wim;
+		compressed_size += ESTIMATE_BLOB_TABLE_ENTRY_SIZE;
+	}
+
+	size = WIM_HEADER_DISK_SIZE + (u64)compressed_size;
+	list_for_each_entry(blob, &blob_table_list, blob_table_list)
+		size += ESTIMATE_BLOB_TABLE_ENTRY_SIZE;
+	/* The integrity table has a SHA-1 message digest per 10 MiB.  */
+	if (write_flags & WIMLIB_WRITE_FLAG_CHECK_INTEGRITY)
+		size += 12 + SHA1_HASH_SIZE * DIV_ROUND_UP(size, 10485760);
+	est.estimated_size = size;
+	est.estimated_compression_ms =
+		compress_ns / get_num_compression_threads(num_threads) /
+		1000000;
+	*estimate_ret = est;
+	return 0;
+}
+
+/*
+ * Writing multiple WIMs at once
+ *
+ * When several WIMs share file data, e.g. because images were exported into
+ * each of them from the same source WIM, writing them one by one would read,
+ * decompress, and compress each shared blob once per WIM.  Instead, the blobs
+ * which must be compressed and which are needed by two or more of the WIMs are
+ * first written to temporary "pool" WIM files, using the output compression
+ * settings of the WIMs.  Those blobs are then relocated to the pool files in
+ * each WIMStruct, so that writing each WIM just copies their compressed data.
+ * Blobs which only one WIM needs, or which can be copied from their current
+ * location without being recompressed, are written as usual.
+ *
+ * Solid resources can only be reused as a whole, so in solid mode there is one
+ * pool for each set of WIMs that shares blobs, and sets that share too little
+ * data to be worth a separate solid resource aren't pooled at all.
+ */
+
+/* Maximum number of WIMs which wimlib_write_multiple() can share blobs between;
+ * each blob's set of WIMs is a bitmask.  */
+#define MAX_MULTIPLE_WIMS	64
+
+/* Minimum amount of data shared by a set of WIMs for it to be written to its
+ * own solid resources  */
+#define MIN_SOLID_POOL_SIZE	(1U << 20)
+
+struct shared_blob {
+	/* The representative of the blob, in multiple_write_ctx.blob_table  */
+	struct blob_descriptor *blob;
+
+	/* Bitmask of the WIMs which need the blob  */
+	u64 wim_mask;
+
+	/* The pool the blob is written to, if any  */
+	struct blob_pool *pool;
+};
+
+struct blob_pool {
+	/* The set of WIMs which all the pooled blobs are shared by, or 0 if the
+	 * pool is for all shared blobs (non-solid mode)  */
+	u64 wim_mask;
+	u64 total_size;
+	struct list_head blob_list;
+	tchar *path;
+	WIMStruct *wim;
+};
+
+struct moved_blob {
+	/* A blob of one of the WIMs being written, now located in a pool  */
+	struct blob_descriptor *blob;
+
+	/* A copy of the blob's original location, to restore afterwards  */
+	struct blob_descriptor *orig;
+};
+
+struct multiple_write_ctx {
+	WIMStruct * const *wims;
+	unsigned num_wims;
+	unsigned cur_wim;
+	int write_flags;
+	int write_resource_flags;
+	int out_ctype;
+	u32 out_chunk_size;
+
+	struct blob_table *blob_table;
+	struct shared_blob *shared_blobs;
+	size_t num_shared_blobs;
+	size_t alloc_shared_blobs;
+
+	struct blob_pool *pools;
+	size_t num_pools;
+
+	struct moved_blob *moved_blobs;
+	size_t num_moved_blobs;
+};
+
+static bool
+write_is_pipable(const WIMStruct *wim, int write_flags)
+{
+	return (write_flags & WIMLIB_WRITE_FLAG_PIPABLE) ||
+		(!(write_flags & WIMLIB_WRITE_FLAG_NOT_PIPABLE) &&
+		 wim_is_pipable(wim));
+}
+
+/* Return the write flags which write_wim_part() will end up using for the
+ * file data of @wim, as far as they matter when writing multiple WIMs.  */
+static int
+effective_write_flags(WIMStruct *wim, int write_flags)
+{
+	if (!(write_flags & WIMLIB_WRITE_FLAG_SOLID) &&
+	    wim->out_compression_type == WIMLIB_COMPRESSION_TYPE_LZMS &&
+	    wim_has_solid_resources(wim))
+		write_flags |= WIMLIB_WRITE_FLAG_SOLID;
+	return write_flags;
+}
+
+/* Return true if all the WIMs will write their file data with the same
+ * compression settings, so that a blob compressed for one can be copied into
+ * all of them.  */
+static bool
+output_settings_match(WIMStruct * const *wims, unsigned num_wims,
+		      int write_flags)
+{
+	const WIMStruct *w0 = wims[0];
+	int flags0 = effective_write_flags(wims[0], write_flags);
+
+	for (unsigned i = 1; i < num_wims; i++) {
+		const WIMStruct *w = wims[i];
+
+		if (effective_write_flags(wims[i], write_flags) != flags0 ||
+		    w->out_compression_type != w0->out_compression_type ||
+		    w->out_chunk_size != w0->out_chunk_size)
+			return false;
+		if ((flags0 & WIMLIB_WRITE_FLAG_SOLID) &&
+		    (w->out_solid_compression_type !=
+				w0->out_solid_compression_type ||
+		     w->out_solid_chunk_size != w0->out_solid_chunk_size ||
+		     w->out_solid_max_blob_size != w0->out_solid_max_blob_size))
+			return false;
+	}
+	return true;
+}
+
+/* Return true if writing the blob to a WIM would require compressing it, as
+ * opposed to copying its existing data.  Solid resources are assumed to be
+ * only partially needed by each WIM, since that is the usual case when several
+ * WIMs share blobs.  */
+static bool
+blob_needs_compression(const struct blob_descriptor *blob,
+		       const struct multiple_write_ctx *ctx)
+{
+	if (blob->blob_location != BLOB_IN_WIM || blob->size == 0 ||
+	    blob->refcnt == 0 ||
+	    ctx->out_ctype == WIMLIB_COMPRESSION_TYPE_NONE)
+		return false;
+	if (blob->rdesc->flags & WIM_RESHDR_FLAG_SOLID)
+		return true;
+	return !can_raw_copy(blob, ctx->write_resource_flags,
+			     ctx->out_ctype, ctx->out_chunk_size);
+}
+
+static int
+find_shared_blob(struct blob_descriptor *blob, void *_ctx)
+{
+	struct multiple_write_ctx *ctx = _ctx;
+	struct blob_descriptor *rep;
+
+	if (!blob_needs_compression(blob, ctx))
+		return 0;
+
+	rep = lookup_blob(ctx->blob_table, blob->hash);
+	if (!rep) {
+		if (ctx->num_shared_blobs == ctx->alloc_shared_blobs) {
+			size_t new_alloc = max(ctx->alloc_shared_blobs * 2, 64);
+			struct shared_blob *new_blobs;
+
+			new_blobs = REALLOC(ctx->shared_blobs,
+					    new_alloc * sizeof(new_blobs[0]));
+			if (!new_blobs)
+				return WIMLIB_ERR_NOMEM;
+			ctx->shared_blobs = new_blobs;
+			ctx->alloc_shared_blobs = new_alloc;
+		}
+		rep = clone_blob_descriptor(blob);
+		if (!rep)
+			return WIMLIB_ERR_NOMEM;
+		/* Until the pools are written, out_refcnt is the index of the
+		 * blob in ctx->shared_blobs.  */
+		rep->out_refcnt = ctx->num_shared_blobs;
+		blob_table_insert(ctx->blob_table, rep);
+		ctx->shared_blobs[ctx->num_shared_blobs].blob = rep;
+		ctx->shared_blobs[ctx->num_shared_blobs].wim_mask = 0;
+		ctx->shared_blobs[ctx->num_shared_blobs].pool = NULL;
+		ctx->num_shared_blobs++;
+	}
+	ctx->shared_blobs[rep->out_refcnt].wim_mask |= (u64)1 << ctx->cur_wim;
+	return 0;
+}
+
+static inline bool
+mask_has_multiple_wims(u64 wim_mask)
+{
+	return (wim_mask & (wim_mask - 1)) != 0;
+}
+
+/* Assign each shared blob to a pool.  */
+static int
+assign_blobs_to_pools(struct multiple_write_ctx *ctx)
+{
+	bool solid = (ctx->write_flags & WIMLIB_WRITE_FLAG_SOLID);
+
+	ctx->pools = CALLOC(max(ctx->num_shared_blobs, 1),
+			    sizeof(ctx->pools[0]));
+	if (!ctx->pools)
+		return WIMLIB_ERR_NOMEM;
+
+	for (size_t i = 0; i < ctx->num_shared_blobs; i++) {
+		struct shared_blob *sb = &ctx->shared_blobs[i];
+		u64 key = solid ? sb->wim_mask : 0;
+		struct blob_pool *pool = NULL;
+
+		if (!mask_has_multiple_wims(sb->wim_mask))
+			continue;
+		for (size_t j = 0; j < ctx->num_pools; j++) {
+			if (ctx->pools[j].wim_mask == key) {
+				pool = &ctx->pools[j];
+				break;
+			}
+		}
+		if (!pool) {
+			pool = &ctx->pools[ctx->num_pools++];
+			pool->wim_mask = key;
+			INIT_LIST_HEAD(&pool->blob_list);
+		}
+		list_add_tail(&sb->blob->write_blobs_list, &pool->blob_list);
+		pool->total_size += sb->blob->size;
+		sb->pool = pool;
+	}
+
+	/* Don't split off solid resources which would be too small to compress
+	 * well; their blobs are just compressed along with the other data of
+	 * each WIM.  */
+	if (solid) {
+		for (size_t j = 0; j < ctx->num_pools; j++) {
+			struct blob_pool *pool = &ctx->pools[j];
+
+			if (pool->total_size < MIN_SOLID_POOL_SIZE) {
+				INIT_LIST_HEAD(&pool->blob_list);
+				pool->total_size = 0;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+write_blob_pool(struct multiple_write_ctx *ctx, struct blob_pool *pool,
+		const tchar *base_path, unsigned num_threads)
+{
+	const WIMStruct *w0 = ctx->wims[0];
+	size_t path_len = tstrlen(base_path);
+	WIMStruct *wim;
+	int ret;
+
+	pool->path = MALLOC((path_len + 10) * sizeof(tchar));
+	if (!pool->path)
+		return WIMLIB_ERR_NOMEM;
+	tmemcpy(pool->path, base_path, path_len);
+	get_random_alnum_chars(pool->path + path_len, 9);
+	pool->path[path_len + 9] = T('\0');
+
+	ret = wimlib_create_new_wim(w0->out_compression_type, &wim);
+	if (ret)
+		goto out_free_path;
+	wim->out_chunk_size = w0->out_chunk_size;
+	wim->out_solid_compression_type = w0->out_solid_compression_type;
+	wim->out_solid_chunk_size = w0->out_solid_chunk_size;
+	wim->out_solid_min_res_size = w0->out_solid_min_res_size;
+	wim->out_solid_max_blob_size = w0->out_solid_max_blob_size;
+	wim->progfunc = w0->progfunc;
+	wim->progctx = w0->progctx;
+	ret = wimlib_set_output_compression_workers(wim,
+						    w0->out_compression_workers);
+	if (ret) {
+		wimlib_free(wim);
+		goto out_free_path;
+	}
+
+	ret = write_wim_part(wim, pool->path, WIMLIB_ALL_IMAGES,
+			     (ctx->write_flags &
+			      (WIMLIB_WRITE_FLAG_RECOMPRESS |
+			       WIMLIB_WRITE_FLAG_SOLID |
+			       WIMLIB_WRITE_FLAG_NO_SOLID_SORT |
+			       WIMLIB_WRITE_FLAG_SKIP_INCOMPRESSIBLE |
+			       WIMLIB_WRITE_FLAG_AUTO_SOLID_CHUNK_SIZE |
+			       WIMLIB_WRITE_FLAG_SOLID_SORT_SIMILARITY)) |
+				WIMLIB_WRITE_FLAG_NOT_PIPABLE |
+				WIMLIB_WRITE_FLAG_NO_CHECK_INTEGRITY |
+				WIMLIB_WRITE_FLAG_NO_METADATA,
+			     num_threads, 1, 1, &pool->blob_list, NULL);
+	wimlib_free(wim);
+	if (ret)
+		goto out_unlink;
+
+	ret = wimlib_open_wim(pool->path, 0, &pool->wim);
+	if (ret)
+		goto out_unlink;
+	return 0;
+
+out_unlink:
+	tunlink(pool->path);
+out_free_path:
+	FREE(pool->path);
+	pool->path = NULL;
+	return ret;
+}
+
+/* Point the blobs of the WIMs being written which are copies of @sb to the copy
+ * of it in its pool WIM file.  */
+static int
+move_shared_blob(struct multiple_write_ctx *ctx, const struct shared_blob *sb)
+{
+	const struct blob_descriptor *pool_blob;
+
+	pool_blob = lookup_blob(sb->pool->wim->blob_table, sb->blob->hash);
+	if (!pool_blob || pool_blob->blob_location != BLOB_IN_WIM)
+		return WIMLIB_ERR_RESOURCE_NOT_FOUND;
+
+	for (unsigned i = 0; i < ctx->num_wims; i++) {
+		struct blob_descriptor *blob;
+		struct moved_blob *mb;
+
+		if (!(sb->wim_mask & ((u64)1 << i)))
+			continue;
+		blob = lookup_blob(ctx->wims[i]->blob_table, sb->blob->hash);
+		mb = &ctx->moved_blobs[ctx->num_moved_blobs];
+		mb->orig = clone_blob_descriptor(blob);
+		if (!mb->orig)
+			return WIMLIB_ERR_NOMEM;
+		mb->blob = blob;
+		ctx->num_moved_blobs++;
+		blob_release_location(blob);
+		blob_set_is_located_in_wim_resource(blob, pool_blob->rdesc,
+						    pool_blob->offset_in_res);
+	}
+	return 0;
+}
+
+static void
+restore_moved_blobs(struct multiple_write_ctx *ctx)
+{
+	for (size_t i = 0; i < ctx->num_moved_blobs; i++) {
+		struct moved_blob *mb = &ctx->moved_blobs[i];
+
+		blob_release_location(mb->blob);
+		blob_set_is_located_in_wim_resource(mb->blob, mb->orig->rdesc,
+						    mb->orig->offset_in_res);
+		free_blob_descriptor(mb->orig);
+	}
+	ctx->num_moved_blobs = 0;
+}
+
+static int
+write_wims_one_by_one(WIMStruct * const *wims, const tchar * const *paths,
+		      unsigned num_wims, int write_flags, unsigned num_threads)
+{
+	for (unsigned i = 0; i < num_wims; i++) {
+		int ret = wimlib_write(wims[i], paths[i], WIMLIB_ALL_IMAGES,
+				       write_flags, num_threads);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_write_multiple(WIMStruct * const *wims, const tchar * const *paths,
+		      unsigned num_wims, int write_flags, unsigned num_threads)
+{
+	struct multiple_write_ctx ctx = { 0 };
+	size_t num_moved = 0;
+	int ret;
+
+	if (write_flags & ~WIMLIB_WRITE_MASK_PUBLIC)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (!wims || !paths || num_wims == 0 || num_wims > MAX_MULTIPLE_WIMS)
 		return WIMLIB_ERR_INVALID_PARAM;
 
-	write_flags |= WIMLIB_WRITE_FLAG_FILE_DESCRIPTOR;
+	for (unsigned i = 0; i < num_wims; i++) {
+		if (!wims[i] || !paths[i] || paths[i][0] == T('\0'))
+			return WIMLIB_ERR_INVALID_PARAM;
+		for (unsigned j = 0; j < i; j++)
+			if (wims[j] == wims[i])
+				return WIMLIB_ERR_INVALID_PARAM;
+		if (write_is_pipable(wims[i], write_flags))
+			return write_wims_one_by_one(wims, paths, num_wims,
+						     write_flags, num_threads);
+	}
 
-	return write_standalone_wim(wim, &fd, image, write_flags, num_threads);
+	if (num_wims == 1 || !output_settings_match(wims, num_wims, write_flags))
+		return write_wims_one_by_one(wims, paths, num_wims,
+					     write_flags, num_threads);
+
+	ctx.wims = wims;
+	ctx.num_wims = num_wims;
+	ctx.write_flags = effective_write_flags(wims[0], write_flags);
+	ctx.write_resource_flags =
+		write_flags_to_resource_flags(ctx.write_flags);
+	if (ctx.write_flags & WIMLIB_WRITE_FLAG_SOLID) {
+		ctx.out_ctype = wims[0]->out_solid_compression_type;
+		ctx.out_chunk_size = wims[0]->out_solid_chunk_size;
+	} else {
+		ctx.out_ctype = wims[0]->out_compression_type;
+		ctx.out_chunk_size = wims[0]->out_chunk_size;
+	}
+
+	ctx.blob_table = new_blob_table(64);
+	if (!ctx.blob_table)
+		return WIMLIB_ERR_NOMEM;
+
+	for (ctx.cur_wim = 0; ctx.cur_wim < num_wims; ctx.cur_wim++) {
+		ret = for_blob_in_table(wims[ctx.cur_wim]->blob_table,
+					find_shared_blob, &ctx);
+		if (ret)
+			goto out;
+	}
+
+	ret = assign_blobs_to_pools(&ctx);
+	if (ret)
+		goto out;
+
+	for (size_t i = 0; i < ctx.num_shared_blobs; i++)
+		if (ctx.shared_blobs[i].pool)
+			for (u64 m = ctx.shared_blobs[i].wim_mask; m; m &= m - 1)
+				num_moved++;
+	ctx.moved_blobs = MALLOC(max(num_moved, 1) *
+				 sizeof(ctx.moved_blobs[0]));
+	ret = WIMLIB_ERR_NOMEM;
+	if (!ctx.moved_blobs)
+		goto out;
+
+	for (size_t j = 0; j < ctx.num_pools; j++) {
+		struct blob_pool *pool = &ctx.pools[j];
+
+		if (list_empty(&pool->blob_list))
+			continue;
+		ret = write_blob_pool(&ctx, pool, paths[0], num_threads);
+		if (ret)
+			goto out;
+	}
+
+	for (size_t i = 0; i < ctx.num_shared_blobs; i++) {
+		const struct shared_blob *sb = &ctx.shared_blobs[i];
+
+		if (sb->pool && sb->pool->wim) {
+			ret = move_shared_blob(&ctx, sb);
+			if (ret)
+				goto out;
+		}
+	}
+
+	/* The representatives are still in the lists of blobs in the original
+	 * resources, where they would affect whether those resources are
+	 * reused, so free them before writing the WIMs.  */
+	free_blob_table(ctx.blob_table);
+	ctx.blob_table = NULL;
+
+	ret = write_wims_one_by_one(wims, paths, num_wims, write_flags,
+				    num_threads);
+out:
+	restore_moved_blobs(&ctx);
+	for (size_t j = 0; j < ctx.num_pools; j++) {
+		struct blob_pool *pool = &ctx.pools[j];
+
+		if (pool->wim)
+			wimlib_free(pool->wim);
+		if (pool->path) {
+			tunlink(pool->path);
+			FREE(pool->path);
+		}
+	}
+	FREE(ctx.pools);
+	FREE(ctx.moved_blobs);
+	FREE(ctx.shared_blobs);
+	free_blob_table(ctx.blob_table);
+	return ret;
 }
 
 /* Have there been any changes to images in the specified WIM, including updates
@@ -2959,6 +5753,25 @@ check_resource_offsets(WIMStruct *wim, off_t end_offset)
 	return 0;
 }
 
+/* Forget the original metadata resources of modified images that are located
+ * after @end_offset in the WIM file, since they won't survive the overwrite and
+ * therefore can't be reused.  */
+static void
+forget_original_metadata_resources(WIMStruct *wim, off_t end_offset)
+{
+	for (unsigned i = 0; i < wim->hdr.image_count; i++) {
+		struct wim_image_metadata *imd = wim->image_metadata[i];
+
+		if (imd->orig_metadata_wim == wim &&
+		    imd->orig_metadata_reshdr.offset_in_wim +
+		    imd->orig_metadata_reshdr.size_in_wim > end_offset)
+		{
+			imd->orig_metadata_wim = NULL;
+			wim_decrement_refcnt(wim);
+		}
+	}
+}
+
 static int
 free_blob_if_invalidated(struct blob_descriptor *blob, void *_wim)
 {
@@ -3082,6 +5895,7 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 			"          corrupted!", wim->filename);
 		wim->being_compacted = 1;
 		old_wim_end = WIM_HEADER_DISK_SIZE;
+		forget_original_metadata_resources(wim, old_wim_end);
 
 		ret = prepare_blob_list_for_write(wim, WIMLIB_ALL_IMAGES,
 						  write_flags, &blob_list,
@@ -3108,9 +5922,12 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 	} else {
 		u64 old_blob_table_end, old_xml_begin, old_xml_end;
 
-		/* Set additional flags for append.  */
-		write_flags |= WIMLIB_WRITE_FLAG_APPEND |
-			       WIMLIB_WRITE_FLAG_STREAMS_OK;
+		/* Set additional flags for append.  Before a safe compaction,
+		 * drop the blobs which are no longer referenced from the blob
+		 * table, so that the compaction can reclaim their space.  */
+		write_flags |= WIMLIB_WRITE_FLAG_APPEND;
+		if (!(write_flags & WIMLIB_WRITE_FLAG_SAFE_COMPACT))
+			write_flags |= WIMLIB_WRITE_FLAG_STREAMS_OK;
 
 		/* Make sure there is no data after the XML data, except
 		 * possibily an integrity table.  If this were the case, then
@@ -3164,6 +5981,8 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 		if (ret)
 			goto out;
 
+		forget_original_metadata_resources(wim, old_wim_end);
+
 		ret = prepare_blob_list_for_write(wim, WIMLIB_ALL_IMAGES,
 						  write_flags, &blob_list,
 						  &blob_table_list, &filter_ctx);
@@ -3179,7 +5998,13 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 	if (ret)
 		goto out;
 
-	ret = open_wim_writable(wim, wim->filename, O_RDWR);
+	/* The WIM file may be truncated below, so stop reading it through a
+	 * memory mapping; otherwise, touching a page beyond the new end of the
+	 * file would raise SIGBUS rather than returning an error.  Likewise, any
+	 * of its data held for unbuffered reads becomes stale.  */
+	filedes_forget_cached_data(&wim->in_fd);
+
+	ret = open_wim_writable(wim, wim->filename, O_RDWR, write_flags);
 	if (ret)
 		goto out;
 
@@ -3202,12 +6027,17 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 		goto out_restore_hdr;
 	}
 
+	begin_integrity_stream(wim, write_flags);
+	if (write_flags & WIMLIB_WRITE_FLAG_FSYNC)
+		filedes_start_write_behind(&wim->out_fd);
+
 	ret = write_file_data_blobs(wim, &blob_list, write_flags,
 				    num_threads, &filter_ctx);
 	if (ret)
 		goto out_truncate;
 
-	ret = write_metadata_resources(wim, WIMLIB_ALL_IMAGES, write_flags);
+	ret = write_metadata_resources(wim, WIMLIB_ALL_IMAGES, write_flags,
+				       num_threads);
 	if (ret)
 		goto out_truncate;
 
@@ -3216,7 +6046,10 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 	if (ret)
 		goto out_truncate;
 
+	wim->compression_fp = wim->out_compression_fp;
 	unlock_wim_for_append(wim);
+	filedes_forget_cached_data(&wim->in_fd);
+	save_capture_hash_cache(wim);
 	return 0;
 
 out_truncate:
@@ -3224,7 +6057,7 @@ out_truncate:
 			     WIMLIB_WRITE_FLAG_UNSAFE_COMPACT))) {
 		WARNING("Truncating \"%"TS"\" to its original size "
 			"(%"PRIu64" bytes)", wim->filename, old_wim_end);
-		if (ftruncate(wim->out_fd.fd, old_wim_end))
+		if (filedes_truncate(&wim->out_fd, old_wim_end))
 			WARNING_WITH_ERRNO("Failed to truncate WIM file!");
 	}
 out_restore_hdr:
@@ -3233,6 +6066,7 @@ out_unlock_wim:
 	unlock_wim_for_append(wim);
 out_close_wim:
 	(void)close_wim_writable(wim, write_flags);
+	filedes_forget_cached_data(&wim->in_fd);
 out:
 	wim->being_compacted = 0;
 	return ret;
@@ -3290,6 +6124,518 @@ overwrite_wim_via_tmpfile(WIMStruct *wim, int write_flags, unsigned num_threads)
 			     &progress, wim->progctx);
 }
 
+/*
+ * Safe compaction (WIMLIB_WRITE_FLAG_SAFE_COMPACT)
+ *
+ * After the changes have been appended to the WIM file as usual, the holes in
+ * the file are filled in a series of steps, each of which moves resources from
+ * the end of the file into the first holes before them that they fit into.  A
+ * step only writes to space which the WIM file, as last committed, doesn't use;
+ * then it commits the new locations by writing new tables after all the data
+ * and overwriting the header, with the data synced to disk both before and
+ * after the header is written.  So an interrupted compaction leaves the WIM
+ * file as it was after the last step, and compacting it again continues from
+ * there.  Once no more resources can be moved, the tables are moved down to
+ * just after the data, and the file is truncated.
+ *
+ * Extra disk space is only needed for one copy of the tables.  On the other
+ * hand, a hole is left if none of the resources after it fit into it, and the
+ * integrity table, if any, is only written by the last step, since calculating
+ * it requires reading the whole file.
+ */
+
+/* The maximum amount of data that each step of a safe compaction moves  */
+#define SAFE_COMPACT_STEP_SIZE	((u64)256 << 20)
+
+struct compact_extent {
+	u64 start;
+	u64 end;
+};
+
+struct safe_compaction {
+	/* The WIM file being compacted, opened anew  */
+	WIMStruct *wim;
+
+	/* The resources in the WIM file, sorted by location  */
+	struct wim_resource_descriptor **rdescs;
+	size_t num_rdescs;
+
+	/* The space not used by the WIM file as last committed, sorted  */
+	struct compact_extent *holes;
+	size_t num_holes;
+
+	bool want_integrity;
+	u8 *buf;
+};
+
+static int
+cmp_rdescs_by_offset(const void *p1, const void *p2)
+{
+	const struct wim_resource_descriptor *rdesc1 =
+		*(const struct wim_resource_descriptor **)p1;
+	const struct wim_resource_descriptor *rdesc2 =
+		*(const struct wim_resource_descriptor **)p2;
+
+	if (rdesc1->offset_in_wim != rdesc2->offset_in_wim)
+		return cmp_u64(rdesc1->offset_in_wim, rdesc2->offset_in_wim);
+	return cmp_u64((uintptr_t)rdesc1, (uintptr_t)rdesc2);
+}
+
+static int
+count_compact_blob(struct blob_descriptor *blob, void *_count)
+{
+	(*(size_t *)_count)++;
+	return 0;
+}
+
+static int
+add_compact_rdesc(struct blob_descriptor *blob, void *_c)
+{
+	struct safe_compaction *c = _c;
+
+	if (blob->blob_location != BLOB_IN_WIM || blob->rdesc->wim != c->wim)
+		return WIMLIB_ERR_RESOURCE_ORDER;
+	c->rdescs[c->num_rdescs++] = blob->rdesc;
+	return 0;
+}
+
+/* The region of the WIM file used by the blob table, XML data, and integrity
+ * table, which are normally together at the end.  */
+static struct compact_extent
+get_tables_extent(const struct wim_header *hdr)
+{
+	const struct wim_reshdr *reshdrs[] = {
+		&hdr->blob_table_reshdr,
+		&hdr->xml_data_reshdr,
+		&hdr->integrity_table_reshdr,
+	};
+	struct compact_extent ext = { .start = UINT64_MAX, .end = 0 };
+
+	for (size_t i = 0; i < ARRAY_LEN(reshdrs); i++) {
+		if (reshdrs[i]->offset_in_wim == 0)
+			continue;
+		ext.start = min(ext.start, reshdrs[i]->offset_in_wim);
+		ext.end = max(ext.end, reshdrs[i]->offset_in_wim +
+				       reshdrs[i]->size_in_wim);
+	}
+	return ext;
+}
+
+/* Return the end of the data in the WIM file, excluding the tables.  */
+static u64
+get_compact_data_end(const struct safe_compaction *c)
+{
+	u64 end = WIM_HEADER_DISK_SIZE;
+
+	for (size_t i = 0; i < c->num_rdescs; i++)
+		end = max(end, c->rdescs[i]->offset_in_wim +
+			       c->rdescs[i]->size_in_wim);
+	return end;
+}
+
+/*
+ * Collect the resources of the WIM file, and check that neither they nor the
+ * tables overlap each other, since then moving them could corrupt the file.
+ */
+static int
+load_compact_rdescs(struct safe_compaction *c)
+{
+	WIMStruct *wim = c->wim;
+	struct compact_extent tables = get_tables_extent(&wim->hdr);
+	size_t count = 0;
+	size_t n = 0;
+	u64 end = WIM_HEADER_DISK_SIZE;
+	int ret;
+
+	for_blob_in_table(wim->blob_table, count_compact_blob, &count);
+	c->rdescs = MALLOC((count + wim->hdr.image_count) * sizeof(c->rdescs[0]));
+	c->holes = MALLOC((count + wim->hdr.image_count + 2) *
+			  sizeof(c->holes[0]));
+	if (!c->rdescs || !c->holes)
+		return WIMLIB_ERR_NOMEM;
+
+	ret = for_blob_in_table(wim->blob_table, add_compact_rdesc, c);
+	if (ret)
+		return ret;
+	for (int i = 0; i < wim->hdr.image_count; i++) {
+		ret = add_compact_rdesc(wim->image_metadata[i]->metadata_blob, c);
+		if (ret)
+			return ret;
+	}
+
+	/* Blobs in a solid resource share its descriptor.  */
+	qsort(c->rdescs, c->num_rdescs, sizeof(c->rdescs[0]),
+	      cmp_rdescs_by_offset);
+	for (size_t i = 0; i < c->num_rdescs; i++) {
+		struct wim_resource_descriptor *rdesc = c->rdescs[i];
+
+		if (n && rdesc == c->rdescs[n - 1])
+			continue;
+		if (rdesc->offset_in_wim < end ||
+		    (rdesc->offset_in_wim < tables.end &&
+		     rdesc->offset_in_wim + rdesc->size_in_wim > tables.start))
+			return WIMLIB_ERR_RESOURCE_ORDER;
+		end = rdesc->offset_in_wim + rdesc->size_in_wim;
+		c->rdescs[n++] = rdesc;
+	}
+	c->num_rdescs = n;
+	return 0;
+}
+
+/* Return an upper bound on the size of the tables written after data ending at
+ * @data_end, given the tables of the WIM file as last committed.  This allows
+ * for the XML data getting a bit longer and for an integrity table (20 bytes
+ * per 10 MiB of file).  */
+static u64
+get_tables_size_bound(struct compact_extent tables, u64 data_end)
+{
+	return tables.end - tables.start + 4096 + (data_end >> 19);
+}
+
+/* Find the space between the header, resources, and tables of the WIM file as
+ * last committed.  */
+static void
+find_compact_holes(struct safe_compaction *c)
+{
+	struct compact_extent tables = get_tables_extent(&c->wim->hdr);
+	u64 pos = WIM_HEADER_DISK_SIZE;
+	bool tables_done = (tables.end == 0);
+	size_t i = 0;
+
+	c->num_holes = 0;
+	while (i < c->num_rdescs || !tables_done) {
+		struct compact_extent ext;
+
+		if (!tables_done && (i == c->num_rdescs ||
+				     tables.start < c->rdescs[i]->offset_in_wim)) {
+			ext = tables;
+			tables_done = true;
+		} else {
+			ext.start = c->rdescs[i]->offset_in_wim;
+			ext.end = ext.start + c->rdescs[i]->size_in_wim;
+			i++;
+		}
+		if (ext.start > pos) {
+			c->holes[c->num_holes].start = pos;
+			c->holes[c->num_holes].end = ext.start;
+			c->num_holes++;
+		}
+		pos = max(pos, ext.end);
+	}
+}
+
+/* Copy a resource to a location in the WIM file that doesn't overlap it.  */
+static int
+move_compact_rdesc(struct safe_compaction *c,
+		   struct wim_resource_descriptor *rdesc, u64 new_offset)
+{
+	WIMStruct *wim = c->wim;
+	u64 offset = 0;
+	int ret;
+
+	while (offset < rdesc->size_in_wim) {
+		size_t n = min(RAW_COPY_BUFFER_SIZE, rdesc->size_in_wim - offset);
+
+		ret = full_pread(&wim->in_fd, c->buf, n,
+				 rdesc->offset_in_wim + offset);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error reading data from WIM file");
+			return ret;
+		}
+		ret = full_pwrite(&wim->out_fd, c->buf, n, new_offset + offset);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error writing data to WIM file");
+			return ret;
+		}
+		offset += n;
+	}
+	rdesc->offset_in_wim = new_offset;
+	return 0;
+}
+
+static int
+add_blob_to_compact_blob_table(struct blob_descriptor *blob,
+			       void *_blob_table_list)
+{
+	blob_set_out_reshdr_for_reuse(blob);
+	blob->out_refcnt = blob->refcnt;
+	list_add_tail(&blob->blob_table_list, _blob_table_list);
+	return 0;
+}
+
+/*
+ * Commit the current locations of the resources by writing the tables at
+ * @tables_offset and then the header.  With @final, the integrity table is
+ * written too, and the file is truncated after the tables.
+ */
+static int
+commit_compaction_step(struct safe_compaction *c, u64 tables_offset,
+		       bool final)
+{
+	WIMStruct *wim = c->wim;
+	struct list_head blob_table_list;
+	int write_flags = WIMLIB_WRITE_FLAG_FSYNC;
+	int raw_fd = wim->out_fd.fd;
+	u64 end;
+	int ret;
+
+	if (final && c->want_integrity)
+		write_flags |= WIMLIB_WRITE_FLAG_CHECK_INTEGRITY;
+
+	INIT_LIST_HEAD(&blob_table_list);
+	for_blob_in_table(wim->blob_table, add_blob_to_compact_blob_table,
+			  &blob_table_list);
+	for (int i = 0; i < wim->hdr.image_count; i++)
+		blob_set_out_reshdr_for_reuse(wim->image_metadata[i]->metadata_blob);
+
+	memcpy(&wim->out_hdr, &wim->hdr, sizeof(wim->out_hdr));
+	wim->out_compression_fp = wim->compression_fp;
+
+	if (filedes_seek(&wim->out_fd, tables_offset) == -1) {
+		ERROR_WITH_ERRNO("Can't seek in WIM file");
+		return WIMLIB_ERR_WRITE;
+	}
+
+	/* Keep the file open for the next step.  */
+	ret = finish_write(wim, WIMLIB_ALL_IMAGES,
+			   write_flags | WIMLIB_WRITE_FLAG_FILE_DESCRIPTOR,
+			   &blob_table_list);
+	filedes_init(&wim->out_fd, raw_fd);
+	if (ret)
+		return ret;
+	memcpy(&wim->hdr, &wim->out_hdr, sizeof(wim->hdr));
+
+	/* The data after the new tables can only be dropped now that the new
+	 * header has reached the disk.  */
+	end = get_tables_extent(&wim->hdr).end;
+	if (final && ftruncate(raw_fd, end) &&
+	    errno != EINVAL) /* allow untruncatable files, e.g. block devices */
+		WARNING_WITH_ERRNO("Failed to truncate \"%"TS"\"",
+				   wim->filename);
+	return 0;
+}
+
+/*
+ * Do one step of the compaction: move up to SAFE_COMPACT_STEP_SIZE bytes of
+ * resources, taken from the end of the file, into the holes, then commit.
+ * Set *@moved_ret to whether anything was moved.
+ */
+static int
+do_compaction_step(struct safe_compaction *c, bool *moved_ret)
+{
+	struct compact_extent tables = get_tables_extent(&c->wim->hdr);
+	u64 tables_offset = max(get_compact_data_end(c), tables.end);
+	size_t first_hole = 0;
+	u64 moved = 0;
+	u64 data_end;
+	u64 needed;
+	int ret;
+
+	find_compact_holes(c);
+
+	for (size_t i = c->num_rdescs; i-- > 0 && moved < SAFE_COMPACT_STEP_SIZE; ) {
+		struct wim_resource_descriptor *rdesc = c->rdescs[i];
+		struct compact_extent *hole = NULL;
+
+		for (size_t j = first_hole; j < c->num_holes &&
+		     c->holes[j].end <= rdesc->offset_in_wim; j++) {
+			if (c->holes[j].end - c->holes[j].start >=
+			    rdesc->size_in_wim) {
+				hole = &c->holes[j];
+				break;
+			}
+		}
+		/* The file can't get any shorter than this resource's end.  */
+		if (!hole)
+			break;
+
+		ret = move_compact_rdesc(c, rdesc, hole->start);
+		if (ret)
+			return ret;
+		hole->start += rdesc->size_in_wim;
+		moved += rdesc->size_in_wim;
+		while (first_hole < c->num_holes &&
+		       c->holes[first_hole].start == c->holes[first_hole].end)
+			first_hole++;
+	}
+
+	*moved_ret = (moved != 0);
+	if (!moved)
+		return 0;
+
+	/* Write the tables in the first hole after the data that is large
+	 * enough, which is usually the space the previous step freed, so that
+	 * the file doesn't grow with each step.  */
+	data_end = get_compact_data_end(c);
+	needed = get_tables_size_bound(tables, data_end);
+	for (size_t j = 0; j < c->num_holes; j++) {
+		if (c->holes[j].start >= data_end &&
+		    c->holes[j].end - c->holes[j].start >= needed) {
+			tables_offset = c->holes[j].start;
+			break;
+		}
+	}
+	ret = commit_compaction_step(c, tables_offset, false);
+	qsort(c->rdescs, c->num_rdescs, sizeof(c->rdescs[0]),
+	      cmp_rdescs_by_offset);
+	return ret;
+}
+
+/*
+ * Move the tables down to just after the data and truncate the file.  If the
+ * space before the tables is too small for the new tables, they are first
+ * moved to after the old ones, which enlarges the space each time.
+ */
+static int
+finish_compaction(struct safe_compaction *c, bool moved_any)
+{
+	for (int tries = 0; ; tries++) {
+		struct compact_extent tables = get_tables_extent(&c->wim->hdr);
+		u64 data_end = get_compact_data_end(c);
+		u64 needed;
+		int ret;
+
+		if (!moved_any && tables.start == data_end &&
+		    c->want_integrity == wim_has_integrity_table(c->wim)) {
+			/* Just drop anything left after the tables, e.g. by an
+			 * interrupted append.  */
+			if (ftruncate(c->wim->out_fd.fd, tables.end) &&
+			    errno != EINVAL)
+				WARNING_WITH_ERRNO("Failed to truncate \"%"TS"\"",
+						   c->wim->filename);
+			return 0;
+		}
+
+		needed = get_tables_size_bound(tables, data_end);
+
+		if (tables.start >= data_end &&
+		    tables.start - data_end >= needed)
+			return commit_compaction_step(c, data_end, true);
+
+		ret = commit_compaction_step(c, max(data_end, tables.end),
+					     tries >= 3);
+		if (ret || tries >= 3)
+			return ret;
+		moved_any = true;
+	}
+}
+
+struct compaction_sync_ctx {
+	WIMStruct *orig_wim;
+	const WIMStruct *compact_wim;
+};
+
+static int
+sync_compacted_blob(struct blob_descriptor *blob, void *_ctx)
+{
+	const struct compaction_sync_ctx *ctx = _ctx;
+	const struct blob_descriptor *moved;
+
+	if (blob->blob_location != BLOB_IN_WIM ||
+	    blob->rdesc->wim != ctx->orig_wim)
+		return 0;
+	moved = lookup_blob(ctx->compact_wim->blob_table, blob->hash);
+	if (moved && moved->blob_location == BLOB_IN_WIM)
+		blob->rdesc->offset_in_wim = moved->rdesc->offset_in_wim;
+	return 0;
+}
+
+/*
+ * The compaction was done through a separate WIMStruct, so update the locations
+ * of the resources of the caller's WIMStruct, and its header, to match the WIM
+ * file.  Resources which were moved but not committed are still intact at both
+ * locations, so the new ones can be used either way.
+ */
+static void
+sync_compacted_wim(WIMStruct *orig_wim, const WIMStruct *compact_wim)
+{
+	struct compaction_sync_ctx ctx = {
+		.orig_wim = orig_wim,
+		.compact_wim = compact_wim,
+	};
+
+	for_blob_in_table(orig_wim->blob_table, sync_compacted_blob, &ctx);
+	for (int i = 0; i < orig_wim->hdr.image_count &&
+			i < compact_wim->hdr.image_count; i++) {
+		struct blob_descriptor *blob =
+			orig_wim->image_metadata[i]->metadata_blob;
+		const struct blob_descriptor *moved =
+			compact_wim->image_metadata[i]->metadata_blob;
+
+		if (blob->blob_location == BLOB_IN_WIM &&
+		    blob->rdesc->wim == orig_wim)
+			blob->rdesc->offset_in_wim = moved->rdesc->offset_in_wim;
+	}
+	memcpy(&orig_wim->hdr, &compact_wim->hdr, sizeof(orig_wim->hdr));
+}
+
+/*
+ * Compact the WIM file which wimlib_overwrite() has just appended to.  Failure
+ * to compact because of the layout of the file isn't an error, since the file
+ * has already been successfully updated.
+ */
+static int
+compact_wim_safely(WIMStruct *orig_wim, int write_flags)
+{
+	struct safe_compaction c = {};
+	bool moved_any = false;
+	bool moved;
+	int ret;
+
+	ret = wimlib_open_wim_with_progress(orig_wim->filename, 0, &c.wim,
+					    orig_wim->progfunc,
+					    orig_wim->progctx);
+	if (ret)
+		return ret;
+	filedes_unmap(&c.wim->in_fd);
+
+	if (write_flags & WIMLIB_WRITE_FLAG_CHECK_INTEGRITY)
+		c.want_integrity = true;
+	else if (!(write_flags & WIMLIB_WRITE_FLAG_NO_CHECK_INTEGRITY))
+		c.want_integrity = wim_has_integrity_table(c.wim);
+
+	ret = load_compact_rdescs(&c);
+	if (ret == WIMLIB_ERR_RESOURCE_ORDER) {
+		WARNING("The WIM file \"%"TS"\" has overlapping resources, so "
+			"it can't be compacted", orig_wim->filename);
+		ret = 0;
+		goto out;
+	}
+	if (ret)
+		goto out;
+
+	ret = WIMLIB_ERR_NOMEM;
+	c.buf = MALLOC(RAW_COPY_BUFFER_SIZE);
+	if (!c.buf)
+		goto out;
+
+	ret = open_wim_writable(c.wim, c.wim->filename, O_RDWR, 0);
+	if (ret)
+		goto out;
+	ret = lock_wim_for_append(c.wim);
+	if (ret)
+		goto out_close;
+
+	do {
+		ret = do_compaction_step(&c, &moved);
+		moved_any |= moved;
+	} while (!ret && moved);
+	if (!ret)
+		ret = finish_compaction(&c, moved_any);
+
+	unlock_wim_for_append(c.wim);
+out_close:
+	(void)close_wim_writable(c.wim, 0);
+	sync_compacted_wim(orig_wim, c.wim);
+out:
+	FREE(c.buf);
+	FREE(c.holes);
+	FREE(c.rdescs);
+	wimlib_free(c.wim);
+	filedes_forget_cached_data(&orig_wim->in_fd);
+	return ret;
+}
+
 /* Determine if the specified WIM file may be updated in-place rather than by
  * writing and replacing it with an entirely new file.  */
 static bool
@@ -3333,6 +6679,10 @@ wimlib_overwrite(WIMStruct *wim, int write_flags, unsigned num_threads)
 	if (!wim->filename)
 		return WIMLIB_ERR_NO_FILENAME;
 
+	/* The file is about to change, so this WIMStruct can no longer share
+	 * data with others through the open WIM cache.  */
+	wim->cache_id.valid = false;
+
 	if (unlikely(write_flags & WIMLIB_WRITE_FLAG_UNSAFE_COMPACT)) {
 		/*
 		 * In UNSAFE_COMPACT mode:
@@ -3347,6 +6697,24 @@ wimlib_overwrite(WIMStruct *wim, int write_flags, unsigned num_threads)
 		write_flags |= WIMLIB_WRITE_FLAG_NO_SOLID_SORT;
 	}
 
+	if (write_flags & WIMLIB_WRITE_FLAG_SAFE_COMPACT) {
+		/*
+		 * In SAFE_COMPACT mode:
+		 *	- UNSAFE_COMPACT and RECOMPRESS are forbidden
+		 *	- REBUILD is ignored
+		 *	- SOFT_DELETE is implied
+		 *	- FSYNC is implied, since the compaction overwrites the
+		 *	  space that the update frees
+		 */
+		if (write_flags & WIMLIB_WRITE_FLAG_UNSAFE_COMPACT)
+			return WIMLIB_ERR_INVALID_PARAM;
+		if (write_flags & WIMLIB_WRITE_FLAG_RECOMPRESS)
+			return WIMLIB_ERR_COMPACTION_NOT_POSSIBLE;
+		write_flags &= ~WIMLIB_WRITE_FLAG_REBUILD;
+		write_flags |= WIMLIB_WRITE_FLAG_SOFT_DELETE |
+			       WIMLIB_WRITE_FLAG_FSYNC;
+	}
+
 	orig_hdr_flags = wim->hdr.flags;
 	if (write_flags & WIMLIB_WRITE_FLAG_IGNORE_READONLY_FLAG)
 		wim->hdr.flags &= ~WIM_HDR_FLAG_READONLY;
@@ -3357,11 +6725,14 @@ wimlib_overwrite(WIMStruct *wim, int write_flags, unsigned num_threads)
 
 	if (can_overwrite_wim_inplace(wim, write_flags)) {
 		ret = overwrite_wim_inplace(wim, write_flags, num_threads);
+		if (!ret && (write_flags & WIMLIB_WRITE_FLAG_SAFE_COMPACT))
+			return compact_wim_safely(wim, write_flags);
 		if (ret != WIMLIB_ERR_RESOURCE_ORDER)
 			return ret;
 		WARNING("Falling back to re-building entire WIM");
 	}
-	if (write_flags & WIMLIB_WRITE_FLAG_UNSAFE_COMPACT)
+	if (write_flags & (WIMLIB_WRITE_FLAG_UNSAFE_COMPACT |
+			   WIMLIB_WRITE_FLAG_SAFE_COMPACT))
 		return WIMLIB_ERR_COMPACTION_NOT_POSSIBLE;
 	return overwrite_wim_via_tmpfile(wim, write_flags, num_threads);
 }
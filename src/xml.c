@@ -51,7 +51,10 @@ struct wim_xml_info {
 	/* A malloc()ed array containing a pointer to the IMAGE element for each
 	 * WIM image.  The image with 1-based index 'i' is at index 'i - 1' in
 	 * this array.  Note: these pointers are cached values, since they could
-	 * also be found by searching the document.  */
+	 * also be found by searching the document.  The serialized form of
+	 * each IMAGE element is cached, so that rewriting the document after
+	 * changing only some images, or only the rest of the WIM file, doesn't
+	 * need to serialize the unchanged images again.  */
 	struct xml_node **images;
 
 	/* The number of WIM images (the length of 'images')  */
@@ -362,6 +365,7 @@ append_image_node(struct wim_xml_info *info, struct xml_node *image_node)
 		return WIMLIB_ERR_NOMEM;
 	info->images = images;
 	images[info->image_count++] = image_node;
+	xml_element_cache_output(image_node);
 
 	/* Add the IMAGE element to the document.  */
 	xml_add_child(info->root, image_node);
@@ -865,6 +869,7 @@ setup_images(struct wim_xml_info *info, struct xml_node *root)
 		if (unlikely(info->images[index - 1]))
 			goto err_indices;
 		info->images[index - 1] = child;
+		xml_element_cache_output(child);
 	}
 	return 0;
 
@@ -892,6 +897,61 @@ parse_wim_xml_document(const utf16lechar *raw_doc, size_t raw_doc_size,
 	return ret;
 }
 
+/*
+ * The WIMLIB_COMPRESSION element holds the compression fingerprint of the WIM
+ * file; see struct wim_compression_fingerprint.  It is taken out of the document
+ * when the WIM file is read, and a new one is put in each time the document is
+ * written, so that it never ends up describing a file other than its own.
+ */
+static void
+read_compression_fingerprint(struct xml_node *root,
+			     struct wim_compression_fingerprint *fp)
+{
+	struct xml_node *element;
+
+	memset(fp, 0, sizeof(*fp));
+	while ((element = xml_get_element_by_path(root,
+						  T("WIMLIB_COMPRESSION"))))
+	{
+		fp->ctype = xml_get_number_by_path(element, T("TYPE"));
+		fp->chunk_size = xml_get_number_by_path(element, T("CHUNKSIZE"));
+		fp->level = xml_get_number_by_path(element, T("LEVEL"));
+		fp->solid = xml_get_number_by_path(element, T("SOLID"));
+		fp->appendable = xml_get_number_by_path(element,
+							T("APPENDABLE"));
+		fp->end_offset = xml_get_number_by_path(element, T("ENDOFFSET"));
+		fp->valid = (fp->ctype != WIMLIB_COMPRESSION_TYPE_NONE &&
+			     fp->chunk_size != 0 && fp->level != 0 &&
+			     fp->end_offset != 0);
+		xml_unlink_node(element);
+		xml_free_node(element);
+	}
+}
+
+static struct xml_node *
+new_compression_fingerprint_element(const struct wim_compression_fingerprint *fp)
+{
+	struct xml_node *element;
+
+	element = xml_new_element(NULL, T("WIMLIB_COMPRESSION"));
+	if (!element)
+		return NULL;
+	if (!xml_new_element_with_u64(element, T("TYPE"), fp->ctype) ||
+	    !xml_new_element_with_u64(element, T("CHUNKSIZE"),
+				      fp->chunk_size) ||
+	    !xml_new_element_with_u64(element, T("LEVEL"), fp->level) ||
+	    !xml_new_element_with_u64(element, T("SOLID"), fp->solid) ||
+	    !xml_new_element_with_u64(element, T("APPENDABLE"),
+				      fp->appendable) ||
+	    !xml_new_element_with_u64(element, T("ENDOFFSET"),
+				      fp->end_offset))
+	{
+		xml_free_node(element);
+		return NULL;
+	}
+	return element;
+}
+
 /* Reads the XML data from a WIM file.  */
 int
 read_wim_xml_data(WIMStruct *wim)
@@ -938,6 +998,8 @@ read_wim_xml_data(WIMStruct *wim)
 		goto err;
 	}
 
+	read_compression_fingerprint(root, &wim->compression_fp);
+
 	/* Validate the image elements and set up the images[] array.  */
 	ret = setup_images(info, root);
 	if (ret)
@@ -1041,14 +1103,19 @@ restore_document_after_write(struct wim_xml_info *info, int image,
  * 'total_bytes' is the number to use in the top-level TOTALBYTES element, or
  * WIM_TOTALBYTES_USE_EXISTING to use the existing value from the XML document
  * (if any), or WIM_TOTALBYTES_OMIT to omit the TOTALBYTES element entirely.
+ *
+ * 'fp' is the compression fingerprint to record, or NULL or an invalid
+ * fingerprint to record none.
  */
 int
 write_wim_xml_data(WIMStruct *wim, int image, u64 total_bytes,
+		   const struct wim_compression_fingerprint *fp,
 		   struct wim_reshdr *out_reshdr, int write_resource_flags)
 {
 	struct wim_xml_info *info = wim->xml_info;
 	int ret;
 	struct xml_node *orig_totalbytes_element;
+	struct xml_node *fp_element = NULL;
 	struct xml_out_buf buf = {};
 	const utf16lechar *raw_doc;
 	size_t raw_doc_size;
@@ -1059,6 +1126,15 @@ write_wim_xml_data(WIMStruct *wim, int image, u64 total_bytes,
 	if (ret)
 		goto out;
 
+	if (fp && fp->valid) {
+		fp_element = new_compression_fingerprint_element(fp);
+		if (!fp_element) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto out_restore_document;
+		}
+		xml_add_child(info->root, fp_element);
+	}
+
 	ret = xml_write_document(info->root, &buf);
 	if (ret)
 		goto out_restore_document;
@@ -1076,10 +1152,15 @@ write_wim_xml_data(WIMStruct *wim, int image, u64 total_bytes,
 					     0,
 					     out_reshdr,
 					     NULL,
-					     write_resource_flags);
+					     write_resource_flags,
+					     1);
 	tstr_put_utf16le(raw_doc);
 out_restore_document:
 	/* Revert any temporary changes we made to the document.  */
+	if (fp_element) {
+		xml_unlink_node(fp_element);
+		xml_free_node(fp_element);
+	}
 	restore_document_after_write(info, image, orig_totalbytes_element);
 	FREE(buf.buf);
 out:
@@ -1095,7 +1176,8 @@ wimlib_get_xml_data(WIMStruct *wim, void **buf_ret, size_t *bufsize_ret)
 {
 	const struct wim_reshdr *xml_reshdr;
 
-	if (wim->filename == NULL && filedes_is_seekable(&wim->in_fd))
+	if (wim->filename == NULL && !wim->in_fd.io &&
+	    filedes_is_seekable(&wim->in_fd))
 		return WIMLIB_ERR_NO_FILENAME;
 
 	if (buf_ret == NULL || bufsize_ret == NULL)
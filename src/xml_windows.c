@@ -94,17 +94,7 @@ check_hive_status(struct windows_info_ctx *ctx, enum hive_status status,
 }
 
 static bool
-is_registry_valid(struct windows_info_ctx *ctx, const void *hive_mem,
-		  size_t hive_size)
-{
-	enum hive_status status;
-
-	status = hive_validate(hive_mem, hive_size);
-	return check_hive_status(ctx, status, NULL, NULL);
-}
-
-static bool
-get_string_from_registry(struct windows_info_ctx *ctx, const struct regf *regf,
+get_string_from_registry(struct windows_info_ctx *ctx, struct regf *regf,
 			 const tchar *key_name, const tchar *value_name,
 			 tchar **value_ret)
 {
@@ -115,7 +105,7 @@ get_string_from_registry(struct windows_info_ctx *ctx, const struct regf *regf,
 }
 
 static bool
-get_number_from_registry(struct windows_info_ctx *ctx, const struct regf *regf,
+get_number_from_registry(struct windows_info_ctx *ctx, struct regf *regf,
 			 const tchar *key_name, const tchar *value_name,
 			 s64 *value_ret)
 {
@@ -126,7 +116,7 @@ get_number_from_registry(struct windows_info_ctx *ctx, const struct regf *regf,
 }
 
 static bool
-list_subkeys_in_registry(struct windows_info_ctx *ctx, const struct regf *regf,
+list_subkeys_in_registry(struct windows_info_ctx *ctx, struct regf *regf,
 			 const tchar *key_name, tchar ***subkeys_ret)
 {
 	enum hive_status status;
@@ -137,7 +127,7 @@ list_subkeys_in_registry(struct windows_info_ctx *ctx, const struct regf *regf,
 
 /* Copy a string value from a registry hive to the XML document.  */
 static void
-copy_registry_string(struct windows_info_ctx *ctx, const struct regf *regf,
+copy_registry_string(struct windows_info_ctx *ctx, struct regf *regf,
 		     const tchar *key_name, const tchar *value_name,
 		     const tchar *property_name)
 {
@@ -427,7 +417,7 @@ invalid:
 /* Gather information from the SOFTWARE registry hive.  */
 static void
 set_info_from_software_hive(struct windows_info_ctx *ctx,
-			    const struct regf *regf)
+			    struct regf *regf)
 {
 	const tchar *version_key = T("Microsoft\\Windows NT\\CurrentVersion");
 	s64 major_version = -1;
@@ -522,7 +512,7 @@ set_info_from_software_hive(struct windows_info_ctx *ctx,
 
 /* Gather the default language from the SYSTEM registry hive.  */
 static void
-set_default_language(struct windows_info_ctx *ctx, const struct regf *regf)
+set_default_language(struct windows_info_ctx *ctx, struct regf *regf)
 {
 	tchar *string;
 	unsigned language_id;
@@ -551,7 +541,7 @@ set_default_language(struct windows_info_ctx *ctx, const struct regf *regf)
 
 /* Gather information from the SYSTEM registry hive.  */
 static void
-set_info_from_system_hive(struct windows_info_ctx *ctx, const struct regf *regf)
+set_info_from_system_hive(struct windows_info_ctx *ctx, struct regf *regf)
 {
 	const tchar *windows_key = T("ControlSet001\\Control\\Windows");
 	const tchar *uilanguages_key = T("ControlSet001\\Control\\MUI\\UILanguages");
@@ -635,21 +625,62 @@ load_file_contents(struct windows_info_ctx *ctx,
 	return contents;
 }
 
-/* Load and validate a registry hive file.  */
-static void *
-load_hive(struct windows_info_ctx *ctx, const struct wim_dentry *dentry,
-	  const char *filename)
+struct hive_reader {
+	const struct blob_descriptor *blob;
+	void *mem; /* the whole file, if it can't be read in pieces  */
+};
+
+static int
+read_hive_file(void *_reader, u64 offset, size_t size, void *buf)
+{
+	const struct hive_reader *reader = _reader;
+
+	if (reader->mem) {
+		memcpy(buf, (const u8 *)reader->mem + offset, size);
+		return 0;
+	}
+	return read_partial_blob_into_buf(reader->blob, offset, size, buf);
+}
+
+/*
+ * Open and validate a registry hive file.  Usually only a small part of a hive
+ * is needed, so its cells are read from the blob as they are needed, unless the
+ * blob can't be read in pieces efficiently, in which case the whole file is
+ * loaded into memory.
+ */
+static struct regf *
+open_hive(struct windows_info_ctx *ctx, const struct wim_dentry *dentry,
+	  const char *filename, struct hive_reader *reader)
 {
-	void *hive_mem;
-	size_t hive_size;
+	struct regf *regf;
+	size_t size;
+	enum hive_status status;
+
+	reader->blob = NULL;
+	reader->mem = NULL;
+	if (dentry)
+		reader->blob = inode_get_blob_for_unnamed_data_stream(
+					dentry->d_inode, ctx->wim->blob_table);
+	if (!reader->blob || !can_read_partial_blob(reader->blob)) {
+		reader->mem = load_file_contents(ctx, dentry, filename, &size);
+		if (!reader->mem)
+			return NULL;
+	}
 
-	hive_mem = load_file_contents(ctx, dentry, filename, &hive_size);
-	if (hive_mem && !is_registry_valid(ctx, hive_mem, hive_size)) {
+	status = hive_open(read_hive_file, reader, reader->blob->size, &regf);
+	if (!check_hive_status(ctx, status, NULL, NULL)) {
 		XML_WARN("%s is not a valid registry hive!", filename);
-		FREE(hive_mem);
-		hive_mem = NULL;
+		FREE(reader->mem);
+		return NULL;
 	}
-	return hive_mem;
+	return regf;
+}
+
+static void
+close_hive(struct regf *regf, struct hive_reader *reader)
+{
+	hive_close(regf);
+	FREE(reader->mem);
 }
 
 /* Set the WINDOWS/SYSTEMROOT property to the name of the directory specified by
@@ -696,6 +727,8 @@ do_set_windows_specific_info(WIMStruct *wim,
 {
 	void *contents;
 	size_t size;
+	struct regf *regf;
+	struct hive_reader reader;
 	struct windows_info_ctx _ctx = {
 		.wim = wim,
 		.image = wim->current_image,
@@ -710,14 +743,14 @@ do_set_windows_specific_info(WIMStruct *wim,
 		FREE(contents);
 	}
 
-	if ((contents = load_hive(ctx, software, "SOFTWARE"))) {
-		set_info_from_software_hive(ctx, contents);
-		FREE(contents);
+	if ((regf = open_hive(ctx, software, "SOFTWARE", &reader))) {
+		set_info_from_software_hive(ctx, regf);
+		close_hive(regf, &reader);
 	}
 
-	if ((contents = load_hive(ctx, system, "SYSTEM"))) {
-		set_info_from_system_hive(ctx, contents);
-		FREE(contents);
+	if ((regf = open_hive(ctx, system, "SYSTEM", &reader))) {
+		set_info_from_system_hive(ctx, regf);
+		close_hive(regf, &reader);
 	}
 
 	if (ctx->oom_encountered) {
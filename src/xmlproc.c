@@ -48,22 +48,38 @@ tstrdupz(const tchar *str, size_t len)
 	return new_str;
 }
 
+/*
+ * Allocate a new node.  The name, which never changes, is stored in the same
+ * allocation as the node itself, since most nodes in a parsed document are
+ * elements that have no other data of their own.
+ */
 static struct xml_node *
-xml_new_node(struct xml_node *parent, enum xml_node_type type,
-	     const tchar *name, size_t name_len,
-	     const tchar *value, size_t value_len)
+xml_alloc_node(enum xml_node_type type, const tchar *name, size_t name_len)
 {
-	struct xml_node *node = CALLOC(1, sizeof(*node));
+	struct xml_node *node;
 
+	node = CALLOC(1, sizeof(*node) +
+			 (name ? (name_len + 1) * sizeof(name[0]) : 0));
 	if (!node)
 		return NULL;
 	node->type = type;
 	INIT_LIST_HEAD(&node->children);
 	if (name) {
-		node->name = tstrdupz(name, name_len);
-		if (!node->name)
-			goto oom;
+		node->name = (tchar *)(node + 1);
+		tmemcpy(node->name, name, name_len);
 	}
+	return node;
+}
+
+static struct xml_node *
+xml_new_node(struct xml_node *parent, enum xml_node_type type,
+	     const tchar *name, size_t name_len,
+	     const tchar *value, size_t value_len)
+{
+	struct xml_node *node = xml_alloc_node(type, name, name_len);
+
+	if (!node)
+		return NULL;
 	if (value) {
 		node->value = tstrdupz(value, value_len);
 		if (!node->value)
@@ -106,11 +122,23 @@ xml_new_element_with_text(struct xml_node *parent, const tchar *name,
 	return element;
 }
 
+/* Discard the cached output of @node and of all its ancestors, since @node has
+ * been changed.  */
+static void
+xml_node_changed(struct xml_node *node)
+{
+	for (; node; node = node->parent) {
+		FREE(node->cached_output);
+		node->cached_output = NULL;
+	}
+}
+
 /* Append @child to the children list of @parent. */
 void
 xml_add_child(struct xml_node *parent, struct xml_node *child)
 {
 	xml_unlink_node(child);	/* Shouldn't be needed, but be safe. */
+	xml_node_changed(parent);
 	child->parent = parent;
 	list_add_tail(&child->sibling_link, &parent->children);
 }
@@ -120,6 +148,7 @@ void
 xml_unlink_node(struct xml_node *node)
 {
 	if (node->parent) {
+		xml_node_changed(node->parent);
 		list_del(&node->sibling_link);
 		node->parent = NULL;
 	}
@@ -141,8 +170,8 @@ xml_free_node(struct xml_node *node)
 	if (node) {
 		xml_unlink_node(node);
 		xml_free_children(node);
-		FREE(node->name);
 		FREE(node->value);
+		FREE(node->cached_output);
 		FREE(node);
 	}
 }
@@ -202,6 +231,7 @@ xml_element_append_text(struct xml_node *element,
 		tmemcpy(&new_value[old_len], text, text_len);
 		FREE(last_child->value);
 		last_child->value = new_value;
+		xml_node_changed(element);
 		return 0;
 	}
 	if (!xml_new_node(element, XML_TEXT_NODE, NULL, 0, text, text_len))
@@ -250,6 +280,7 @@ xml_replace_child(struct xml_node *parent, struct xml_node *replacement)
 	xml_node_for_each_child(parent, child) {
 		if (child->type == replacement->type &&
 		    !tstrcmp(child->name, replacement->name)) {
+			xml_node_changed(parent);
 			list_replace(&child->sibling_link,
 				     &replacement->sibling_link);
 			replacement->parent = parent;
@@ -434,7 +465,11 @@ get_escape_seq(tchar c)
 	return NULL;
 }
 
-/* Note: 'str' must be NUL-terminated, but only 'len' chars are used. */
+/*
+ * Unescape the @len characters at @str, which must be followed by a NUL
+ * terminator somewhere, into a new NUL-terminated string.  Strings without
+ * escape sequences, which are most of them, are just copied.
+ */
 static int
 unescape_string(const tchar *str, size_t len, tchar **unescaped_ret)
 {
@@ -444,6 +479,11 @@ unescape_string(const tchar *str, size_t len, tchar **unescaped_ret)
 	unescaped = CALLOC(len + 1, sizeof(str[0]));
 	if (!unescaped)
 		return WIMLIB_ERR_NOMEM;
+	if (!tmemchr(str, '&', len)) {
+		tmemcpy(unescaped, str, len);
+		*unescaped_ret = unescaped;
+		return 0;
+	}
 	out_p = unescaped;
 	while (in_p < &str[len]) {
 		if (*in_p != '&')
@@ -472,6 +512,31 @@ bad:
 	return WIMLIB_ERR_XML;
 }
 
+/*
+ * Create a new TEXT or ATTRIBUTE node under @parent whose value is the result
+ * of unescaping the @len characters at @raw.  The unescaped string becomes the
+ * node's value directly, without being copied again.
+ */
+static int
+xml_new_node_unescaped(struct xml_node *parent, enum xml_node_type type,
+		       const tchar *name, size_t name_len,
+		       const tchar *raw, size_t len)
+{
+	struct xml_node *node;
+	int ret;
+
+	node = xml_alloc_node(type, name, name_len);
+	if (!node)
+		return WIMLIB_ERR_NOMEM;
+	ret = unescape_string(raw, len, &node->value);
+	if (ret) {
+		FREE(node);
+		return ret;
+	}
+	xml_add_child(parent, node);
+	return 0;
+}
+
 static int
 parse_element(const tchar **pp, struct xml_node *parent, int depth,
 	      struct xml_node **node_ret);
@@ -486,11 +551,21 @@ parse_contents(const tchar **pp, struct xml_node *element, int depth)
 		const tchar *raw_text = p;
 		tchar *text;
 
-		for (; *p != '<'; p++) {
-			if (*p == '\0')
-				return WIMLIB_ERR_XML;
-		}
-		if (p > raw_text) {
+		p = tstrchr(p, '<');
+		if (!p)
+			return WIMLIB_ERR_XML;
+		if (p > raw_text && (list_empty(&element->children) ||
+				     list_last_entry(&element->children,
+						     struct xml_node,
+						     sibling_link)->type !=
+						XML_TEXT_NODE)) {
+			/* The usual case: text which becomes a new node  */
+			ret = xml_new_node_unescaped(element, XML_TEXT_NODE,
+						     NULL, 0, raw_text,
+						     p - raw_text);
+			if (ret)
+				return ret;
+		} else if (p > raw_text) {
 			ret = unescape_string(raw_text, p - raw_text, &text);
 			if (ret)
 				return ret;
@@ -562,8 +637,7 @@ parse_element(const tchar **pp, struct xml_node *parent, int depth,
 	/* Parse the attributes list within the start tag. */
 	while (is_whitespace(*p)) {
 		const tchar *attr_name_start, *attr_value_start;
-		size_t attr_name_len, attr_value_len;
-		tchar *attr_value;
+		size_t attr_name_len;
 		tchar quote;
 
 		skip_whitespace(&p);
@@ -580,22 +654,15 @@ parse_element(const tchar **pp, struct xml_node *parent, int depth,
 		quote = *p;
 		CHECK(quote == '\'' || quote == '"');
 		attr_value_start = ++p;
-		while (*p != quote && *p != '\0')
-			p++;
-		CHECK(*p == quote);
-		attr_value_len = p - attr_value_start;
-		p++;
-		ret = unescape_string(attr_value_start, attr_value_len,
-				      &attr_value);
-		if (ret)
-			goto error;
-		ret = xml_new_node(element, XML_ATTRIBUTE_NODE,
-				   attr_name_start, attr_name_len,
-				   attr_value, tstrlen(attr_value))
-			? 0 : WIMLIB_ERR_NOMEM;
-		FREE(attr_value);
+		p = tstrchr(p, quote);
+		CHECK(p != NULL);
+		ret = xml_new_node_unescaped(element, XML_ATTRIBUTE_NODE,
+					     attr_name_start, attr_name_len,
+					     attr_value_start,
+					     p - attr_value_start);
 		if (ret)
 			goto error;
+		p++;
 	}
 	if (*p == '/') {
 		/* Closing an empty element tag */
@@ -686,25 +753,32 @@ xml_puts(struct xml_out_buf *buf, const tchar *str)
 	xml_write(buf, str, tstrlen(str));
 }
 
+/* Write @str, escaping the characters which need it.  The runs of characters
+ * which don't are found with tstrpbrk(), which the C library optimizes.  */
 static void
 xml_escape_and_puts(struct xml_out_buf *buf, const tchar *str)
 {
-	const tchar *p = str, *saved, *seq = NULL;
+	const tchar *p;
 
-	for (;; p++) {
-		for (saved = p; *p && (seq = get_escape_seq(*p)) == NULL; p++)
-			;
-		xml_write(buf, saved, p - saved);
-		if (!*p)
-			return;
-		xml_puts(buf, seq);
+	while ((p = tstrpbrk(str, T("<>&'\""))) != NULL) {
+		xml_write(buf, str, p - str);
+		xml_puts(buf, get_escape_seq(*p));
+		str = p + 1;
 	}
+	xml_puts(buf, str);
 }
 
 static void
 xml_write_element(struct xml_node *element, struct xml_out_buf *buf)
 {
 	struct xml_node *child;
+	size_t start = buf->count;
+
+	if (element->cached_output) {
+		xml_write(buf, element->cached_output,
+			  element->cached_output_len);
+		return;
+	}
 
 	/* Write the start tag. */
 	xml_puts(buf, T("<"));
@@ -732,6 +806,15 @@ xml_write_element(struct xml_node *element, struct xml_out_buf *buf)
 	xml_puts(buf, T("</"));
 	xml_puts(buf, element->name);
 	xml_puts(buf, T(">"));
+
+	/* Cache the output if requested.  This is only an optimization, so
+	 * failing to allocate memory for it is fine.  */
+	if (element->cache_output && !buf->oom) {
+		element->cached_output_len = buf->count - start;
+		element->cached_output =
+			memdup(&buf->buf[start], element->cached_output_len *
+						 sizeof(buf->buf[0]));
+	}
 }
 
 /*
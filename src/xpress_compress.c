@@ -51,6 +51,16 @@
 #define mf_pos_t	u16
 #define MF_SUFFIX
 
+/*
+ * Buffers of at most this size, such as the 4096-byte chunks used in WIMBoot
+ * WIMs, use a hash chains matchfinder with smaller hash tables.  With the
+ * default tables, just clearing them costs about as much as writing the
+ * compressed data of such a chunk, and the tables are larger than needed.
+ */
+#define MAX_SMALL_BUFSIZE	4096
+#define SMALL_HASH3_ORDER	13
+#define SMALL_HASH4_ORDER	14
+
 /*
  * Note: although XPRESS can potentially use a sliding window, it isn't well
  * suited for large buffers of data because there is no way to reset the Huffman
@@ -62,6 +72,8 @@
 #include "wimlib/bitops.h"
 #include "wimlib/compress_common.h"
 #include "wimlib/compressor_ops.h"
+#include "wimlib/compressor_stats.h"
+#include "wimlib/cpu_features.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
 #include "wimlib/hc_matchfinder.h"
@@ -69,6 +81,24 @@
 #include "wimlib/util.h"
 #include "wimlib/xpress_constants.h"
 
+#if defined(__i386__) || defined(__x86_64__)
+#  include <immintrin.h>
+#endif
+
+#undef MF_SUFFIX
+#undef HC_MATCHFINDER_HASH3_ORDER
+#undef HC_MATCHFINDER_HASH4_ORDER
+#define MF_SUFFIX			_small
+#define HC_MATCHFINDER_HASH3_ORDER	SMALL_HASH3_ORDER
+#define HC_MATCHFINDER_HASH4_ORDER	SMALL_HASH4_ORDER
+#include "wimlib/hc_matchfinder.h"
+#undef MF_SUFFIX
+#define MF_SUFFIX
+
+#define CALL_HC_MF(small, c, funcname, ...)				     \
+	((small) ? CONCAT(funcname, _small)(&(c)->hc_mf_small, ##__VA_ARGS__) : \
+		   funcname(&(c)->hc_mf, ##__VA_ARGS__))
+
 #if SUPPORT_NEAR_OPTIMAL_PARSING
 
 /*
@@ -116,12 +146,19 @@ struct xpress_compressor {
 	 * matches at each position.  */
 	unsigned max_search_depth;
 
+#ifdef ENABLE_COMPRESSOR_STATS
+	struct wimlib_compressor_stats stats;
+#endif
+
 	union {
 		/* Data for greedy or lazy parsing  */
 		struct {
 			struct xpress_item *chosen_items;
-			struct hc_matchfinder hc_mf;
-			/* hc_mf must be last!  */
+			union {
+				struct hc_matchfinder hc_mf;
+				struct hc_matchfinder_small hc_mf_small;
+			};
+			/* hc_mf and hc_mf_small must be last!  */
 		};
 
 	#if SUPPORT_NEAR_OPTIMAL_PARSING
@@ -427,6 +464,51 @@ xpress_write_item_list(struct xpress_output_bitstream *os,
 }
 #endif /* SUPPORT_NEAR_OPTIMAL_PARSING */
 
+#ifdef ENABLE_COMPRESSOR_STATS
+/* Record the chosen matches and literals in the compressor's statistics.  The
+ * items are taken from the same place as in xpress_write().  */
+static void
+xpress_update_stats(struct xpress_compressor *c, size_t count,
+		    bool near_optimal)
+{
+	struct wimlib_compressor_stats *stats = &c->stats;
+
+	stats->num_blocks++;
+#if SUPPORT_NEAR_OPTIMAL_PARSING
+	if (near_optimal) {
+		struct xpress_optimum_node *cur_node = c->optimum_nodes;
+		struct xpress_optimum_node *end_node = c->optimum_nodes + count;
+
+		stats->num_optimization_passes += c->num_optim_passes;
+		do {
+			unsigned length = cur_node->item & OPTIMUM_LEN_MASK;
+			unsigned offset = cur_node->item >> OPTIMUM_OFFSET_SHIFT;
+
+			if (length == 1)
+				stats_add_literals(stats, 1);
+			else
+				stats_add_match(stats, length, offset);
+			cur_node += length;
+		} while (cur_node != end_node);
+		return;
+	}
+#endif
+	for (size_t i = 0; i < count; i++) {
+		u64 data = c->chosen_items[i].data;
+		unsigned log2_offset;
+
+		if ((data & 0x1FF) < XPRESS_NUM_CHARS) {
+			stats_add_literals(stats, 1);
+			continue;
+		}
+		log2_offset = (data >> 25) & 0xF;
+		stats_add_match(stats,
+				((data >> 9) & 0xFFFF) + XPRESS_MIN_MATCH_LEN,
+				(1U << log2_offset) | (data >> 29));
+	}
+}
+#endif /* ENABLE_COMPRESSOR_STATS */
+
 /*
  * Output the XPRESS-compressed data, given the sequence of match/literal
  * "items" that was chosen to represent the input data.
@@ -469,6 +551,8 @@ xpress_write(struct xpress_compressor *c, void *out, size_t out_nbytes_avail,
 				   c->codewords, c->lens);
 	}
 
+	COMPRESSOR_STATS(xpress_update_stats(c, count, near_optimal));
+
 	/* Write the end-of-data symbol (needed for MS compatibility)  */
 	xpress_write_bits(&os, c->codewords[XPRESS_END_OF_DATA],
 			  c->lens[XPRESS_END_OF_DATA]);
@@ -519,10 +603,10 @@ xpress_record_match(struct xpress_compressor *c, unsigned length, unsigned offse
  * (Exception: as a heuristic, we pass up length 3 matches that have large
  * offsets.)
  */
-static size_t
+static forceinline size_t
 xpress_compress_greedy(struct xpress_compressor * restrict c,
 		       const void * restrict in, size_t in_nbytes,
-		       void * restrict out, size_t out_nbytes_avail)
+		       void * restrict out, size_t out_nbytes_avail, bool small)
 {
 	const u8 * const in_begin = in;
 	const u8 *	 in_next = in_begin;
@@ -536,21 +620,17 @@ xpress_compress_greedy(struct xpress_compressor * restrict c,
 	else
 		len_3_too_far = 4096;
 
-	hc_matchfinder_init(&c->hc_mf);
+	CALL_HC_MF(small, c, hc_matchfinder_init);
 
 	do {
 		unsigned length;
 		unsigned offset;
 
-		length = hc_matchfinder_longest_match(&c->hc_mf,
-						      in_begin,
-						      in_next,
-						      XPRESS_MIN_MATCH_LEN - 1,
-						      in_end - in_next,
-						      min(in_end - in_next, c->nice_match_length),
-						      c->max_search_depth,
-						      next_hashes,
-						      &offset);
+		length = CALL_HC_MF(small, c, hc_matchfinder_longest_match,
+				    in_begin, in_next, XPRESS_MIN_MATCH_LEN - 1,
+				    in_end - in_next,
+				    min(in_end - in_next, c->nice_match_length),
+				    c->max_search_depth, next_hashes, &offset);
 		if (length >= XPRESS_MIN_MATCH_LEN &&
 		    !(length == XPRESS_MIN_MATCH_LEN && offset >= len_3_too_far))
 		{
@@ -558,12 +638,9 @@ xpress_compress_greedy(struct xpress_compressor * restrict c,
 			*next_chosen_item++ =
 				xpress_record_match(c, length, offset);
 			in_next += 1;
-			hc_matchfinder_skip_bytes(&c->hc_mf,
-						  in_begin,
-						  in_next,
-						  in_end,
-						  length - 1,
-						  next_hashes);
+			CALL_HC_MF(small, c, hc_matchfinder_skip_bytes,
+				   in_begin, in_next, in_end, length - 1,
+				   next_hashes);
 			in_next += length - 1;
 		} else {
 			/* No match found  */
@@ -577,15 +654,31 @@ xpress_compress_greedy(struct xpress_compressor * restrict c,
 			    next_chosen_item - c->chosen_items, false);
 }
 
+static size_t
+xpress_compress_greedy_small(struct xpress_compressor * restrict c,
+			     const void * restrict in, size_t in_nbytes,
+			     void * restrict out, size_t out_nbytes_avail)
+{
+	return xpress_compress_greedy(c, in, in_nbytes, out, out_nbytes_avail, true);
+}
+
+static size_t
+xpress_compress_greedy_large(struct xpress_compressor * restrict c,
+			     const void * restrict in, size_t in_nbytes,
+			     void * restrict out, size_t out_nbytes_avail)
+{
+	return xpress_compress_greedy(c, in, in_nbytes, out, out_nbytes_avail, false);
+}
+
 /*
  * This is the "lazy" XPRESS compressor.  Before choosing a match, it checks to
  * see if there's a longer match at the next position.  If yes, it outputs a
  * literal and continues to the next position.  If no, it outputs the match.
  */
-static size_t
+static forceinline size_t
 xpress_compress_lazy(struct xpress_compressor * restrict c,
 		     const void * restrict in, size_t in_nbytes,
-		     void * restrict out, size_t out_nbytes_avail)
+		     void * restrict out, size_t out_nbytes_avail, bool small)
 {
 	const u8 * const in_begin = in;
 	const u8 *	 in_next = in_begin;
@@ -599,7 +692,7 @@ xpress_compress_lazy(struct xpress_compressor * restrict c,
 	else
 		len_3_too_far = 4096;
 
-	hc_matchfinder_init(&c->hc_mf);
+	CALL_HC_MF(small, c, hc_matchfinder_init);
 
 	do {
 		unsigned cur_len;
@@ -608,15 +701,12 @@ xpress_compress_lazy(struct xpress_compressor * restrict c,
 		unsigned next_offset;
 
 		/* Find the longest match at the current position.  */
-		cur_len = hc_matchfinder_longest_match(&c->hc_mf,
-						       in_begin,
-						       in_next,
-						       XPRESS_MIN_MATCH_LEN - 1,
-						       in_end - in_next,
-						       min(in_end - in_next, c->nice_match_length),
-						       c->max_search_depth,
-						       next_hashes,
-						       &cur_offset);
+		cur_len = CALL_HC_MF(small, c, hc_matchfinder_longest_match,
+				     in_begin, in_next,
+				     XPRESS_MIN_MATCH_LEN - 1, in_end - in_next,
+				     min(in_end - in_next, c->nice_match_length),
+				     c->max_search_depth, next_hashes,
+				     &cur_offset);
 		in_next += 1;
 
 		if (cur_len < XPRESS_MIN_MATCH_LEN ||
@@ -638,12 +728,9 @@ xpress_compress_lazy(struct xpress_compressor * restrict c,
 			*next_chosen_item++ =
 				xpress_record_match(c, cur_len, cur_offset);
 
-			hc_matchfinder_skip_bytes(&c->hc_mf,
-						  in_begin,
-						  in_next,
-						  in_end,
-						  cur_len - 1,
-						  next_hashes);
+			CALL_HC_MF(small, c, hc_matchfinder_skip_bytes,
+				   in_begin, in_next, in_end, cur_len - 1,
+				   next_hashes);
 			in_next += cur_len - 1;
 			continue;
 		}
@@ -664,15 +751,12 @@ xpress_compress_lazy(struct xpress_compressor * restrict c,
 		 * cases.  However, it is faster to have two call sites, with
 		 * longest_match() inlined at each.
 		 */
-		next_len = hc_matchfinder_longest_match(&c->hc_mf,
-							in_begin,
-							in_next,
-							cur_len,
-						        in_end - in_next,
-						        min(in_end - in_next, c->nice_match_length),
-							c->max_search_depth / 2,
-							next_hashes,
-							&next_offset);
+		next_len = CALL_HC_MF(small, c, hc_matchfinder_longest_match,
+				      in_begin, in_next, cur_len,
+				      in_end - in_next,
+				      min(in_end - in_next, c->nice_match_length),
+				      c->max_search_depth / 2, next_hashes,
+				      &next_offset);
 		in_next += 1;
 
 		if (next_len > cur_len) {
@@ -688,12 +772,9 @@ xpress_compress_lazy(struct xpress_compressor * restrict c,
 			 * output the current match.  */
 			*next_chosen_item++ =
 				xpress_record_match(c, cur_len, cur_offset);
-			hc_matchfinder_skip_bytes(&c->hc_mf,
-						  in_begin,
-						  in_next,
-						  in_end,
-						  cur_len - 2,
-						  next_hashes);
+			CALL_HC_MF(small, c, hc_matchfinder_skip_bytes,
+				   in_begin, in_next, in_end, cur_len - 2,
+				   next_hashes);
 			in_next += cur_len - 2;
 			continue;
 		}
@@ -703,6 +784,22 @@ xpress_compress_lazy(struct xpress_compressor * restrict c,
 			    next_chosen_item - c->chosen_items, false);
 }
 
+static size_t
+xpress_compress_lazy_small(struct xpress_compressor * restrict c,
+			   const void * restrict in, size_t in_nbytes,
+			   void * restrict out, size_t out_nbytes_avail)
+{
+	return xpress_compress_lazy(c, in, in_nbytes, out, out_nbytes_avail, true);
+}
+
+static size_t
+xpress_compress_lazy_large(struct xpress_compressor * restrict c,
+			   const void * restrict in, size_t in_nbytes,
+			   void * restrict out, size_t out_nbytes_avail)
+{
+	return xpress_compress_lazy(c, in, in_nbytes, out, out_nbytes_avail, false);
+}
+
 #if SUPPORT_NEAR_OPTIMAL_PARSING
 
 /*
@@ -765,6 +862,109 @@ xpress_tally_item_list(struct xpress_compressor *c,
 	} while (cur_node != end_node);
 }
 
+/*
+ * Return the minimum 'cost_to_end' of the nodes 'len' through 'end_len' bytes
+ * after 'cur_node', and set *min_len_ret to the first length at which it
+ * occurs.  This is the vectorized part of xpress_consider_lengths(), selected
+ * by the "xpress_parse" kernel.  At least XPRESS_MIN_COST_WIDE_MIN_LENS lengths
+ * must be given.
+ */
+typedef u32 (*xpress_min_cost_wide_func_t)(
+			const struct xpress_optimum_node *cur_node,
+			unsigned len, unsigned end_len, unsigned *min_len_ret);
+
+static xpress_min_cost_wide_func_t xpress_min_cost_wide;
+
+#if defined(__i386__) || defined(__x86_64__)
+#define XPRESS_MIN_COST_WIDE_MIN_LENS	8
+
+/*
+ * Each 256-bit vector holds 4 nodes.  The items are set to all 1's so that only
+ * the costs matter.  The last, partial vector is handled by loading the last 4
+ * nodes again, like lz_extend_avx2() does.
+ */
+static u32 __attribute__((target("avx2")))
+xpress_min_cost_avx2(const struct xpress_optimum_node *cur_node,
+		     unsigned len, unsigned end_len, unsigned *min_len_ret)
+{
+	const __m256i items = _mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+	const unsigned last = end_len - 3;
+	__m256i vmin = _mm256_set1_epi32(-1);
+	__m256i target;
+	__m128i m;
+	u32 min_cost;
+	unsigned i;
+
+	STATIC_ASSERT(sizeof(*cur_node) == 8);
+	for (i = len; i < last; i += 4)
+		vmin = _mm256_min_epu32(vmin, _mm256_or_si256(items,
+				_mm256_loadu_si256((const void *)&cur_node[i])));
+	vmin = _mm256_min_epu32(vmin, _mm256_or_si256(items,
+				_mm256_loadu_si256((const void *)&cur_node[last])));
+	m = _mm_min_epu32(_mm256_castsi256_si128(vmin),
+			  _mm256_extracti128_si256(vmin, 1));
+	m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+	min_cost = _mm_cvtsi128_si32(m);
+
+	/* Find the first node which has the minimum cost.  */
+	target = _mm256_setr_epi32(min_cost, 0, min_cost, 0,
+				   min_cost, 0, min_cost, 0);
+	for (i = len; ; i += 4) {
+		u32 mask;
+
+		if (i > last)
+			i = last;
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi32(target,
+				_mm256_or_si256(items, _mm256_loadu_si256(
+					(const void *)&cur_node[i]))));
+		if (mask != 0) {
+			*min_len_ret = i + bsf32(mask) / sizeof(*cur_node);
+			return min_cost;
+		}
+	}
+}
+#endif /* x86 */
+
+/*
+ * Consider the match lengths 'len' through 'end_len' at 'cur_node', which all
+ * have the offset 'offset' and cost 'match_cost'.  The lowest-cost length is the
+ * one whose end node has the lowest cost to end, so only it needs to be
+ * compared with the best item found so far.  Like considering each length in
+ * turn, this prefers the shortest length when there is a tie.
+ */
+static forceinline void
+xpress_consider_lengths(const struct xpress_optimum_node *cur_node,
+			u32 match_cost, unsigned offset,
+			unsigned len, unsigned end_len,
+			u32 *best_cost_to_end, u32 *best_item)
+{
+	unsigned min_len = len;
+	u32 min_cost;
+
+	if (len > end_len)
+		return;
+#ifdef XPRESS_MIN_COST_WIDE_MIN_LENS
+	if (end_len + 1 - len >= XPRESS_MIN_COST_WIDE_MIN_LENS &&
+	    xpress_min_cost_wide != NULL) {
+		min_cost = (*xpress_min_cost_wide)(cur_node, len, end_len,
+						   &min_len);
+	} else
+#endif
+	{
+		min_cost = (cur_node + len)->cost_to_end;
+		while (++len <= end_len) {
+			if ((cur_node + len)->cost_to_end < min_cost) {
+				min_cost = (cur_node + len)->cost_to_end;
+				min_len = len;
+			}
+		}
+	}
+	if (match_cost + min_cost < *best_cost_to_end) {
+		*best_cost_to_end = match_cost + min_cost;
+		*best_item = ((u32)offset << OPTIMUM_OFFSET_SHIFT) | min_len;
+	}
+}
+
 /*
  * Find a new minimum cost path through the graph of possible match/literal
  * choices.  We find the minimum cost path from 'c->optimum_nodes[0]', which
@@ -859,34 +1059,54 @@ xpress_find_min_cost_path(struct xpress_compressor *c, size_t in_nbytes,
 				unsigned log2_offset;
 				u32 offset_cost;
 
+				u32 big_len_cost;
+
 				offset = match->offset;
 				log2_offset = bsr32(offset);
 				offset_cost = log2_offset;
-				do {
-					unsigned adjusted_len;
+				for (; len <= match->length &&
+				       len < 0xF + XPRESS_MIN_MATCH_LEN; len++) {
 					unsigned len_hdr;
 					unsigned sym;
 					u32 cost_to_end;
 
-					adjusted_len = len - XPRESS_MIN_MATCH_LEN;
-					len_hdr = min(adjusted_len, 0xF);
+					len_hdr = len - XPRESS_MIN_MATCH_LEN;
 					sym = XPRESS_NUM_CHARS +
 					      ((log2_offset << 4) | len_hdr);
 					cost_to_end =
 						offset_cost + c->costs[sym] +
 						(cur_node + len)->cost_to_end;
-					if (adjusted_len >= 0xF) {
-						cost_to_end += 8;
-						if (adjusted_len - 0xF >= 0xFF)
-							cost_to_end += 16;
-					}
 					if (cost_to_end < best_cost_to_end) {
 						best_cost_to_end = cost_to_end;
 						best_item =
 							((u32)offset <<
 							 OPTIMUM_OFFSET_SHIFT) | len;
 					}
-				} while (++len <= match->length);
+				}
+
+				/*
+				 * The longer lengths all have the length header
+				 * 0xF, so their cost only depends on whether
+				 * they need 8 or 24 extra bits.
+				 */
+				big_len_cost = offset_cost + 8 +
+					       c->costs[XPRESS_NUM_CHARS +
+							((log2_offset << 4) | 0xF)];
+				xpress_consider_lengths(cur_node, big_len_cost,
+							offset, len,
+							min(match->length,
+							    0xF + 0xFF +
+							    XPRESS_MIN_MATCH_LEN - 1),
+							&best_cost_to_end,
+							&best_item);
+				xpress_consider_lengths(cur_node, big_len_cost + 16,
+							offset,
+							max(len, 0xF + 0xFF +
+								 XPRESS_MIN_MATCH_LEN),
+							match->length,
+							&best_cost_to_end,
+							&best_item);
+				len = match->length + 1;
 			} while (++match != cache_ptr);
 		}
 		cache_ptr -= num_matches;
@@ -895,6 +1115,26 @@ xpress_find_min_cost_path(struct xpress_compressor *c, size_t in_nbytes,
 	} while (cur_node != c->optimum_nodes);
 }
 
+static const struct cpu_impl xpress_parse_impls[] = {
+#if defined(__i386__) || defined(__x86_64__)
+	{ "avx2", (cpu_func_t)xpress_min_cost_avx2, X86_CPU_FEATURE_AVX2 },
+#endif
+	{ "generic", NULL, 0 },
+};
+
+static void
+xpress_parse_select(const struct cpu_impl *impl)
+{
+	xpress_min_cost_wide = (xpress_min_cost_wide_func_t)impl->func;
+}
+
+const struct cpu_kernel xpress_parse_kernel = {
+	.name = "xpress_parse",
+	.impls = xpress_parse_impls,
+	.num_impls = ARRAY_LEN(xpress_parse_impls),
+	.select = xpress_parse_select,
+};
+
 /*
  * This routine finds matches at each position in the buffer in[0...in_nbytes].
  * The matches are cached in the array c->match_cache, and the return value is a
@@ -1035,6 +1275,9 @@ xpress_get_compressor_size(size_t max_bufsize, unsigned compression_level)
 			bt_matchfinder_size(max_bufsize);
 #endif
 
+	if (max_bufsize <= MAX_SMALL_BUFSIZE)
+		return offsetof(struct xpress_compressor, hc_mf_small) +
+			hc_matchfinder_size_small(max_bufsize);
 	return offsetof(struct xpress_compressor, hc_mf) +
 		hc_matchfinder_size(max_bufsize);
 }
@@ -1070,7 +1313,7 @@ xpress_get_needed_memory(size_t max_bufsize, unsigned compression_level,
 
 static int
 xpress_create_compressor(size_t max_bufsize, unsigned compression_level,
-			 bool destructive, void **c_ret)
+			 bool destructive, bool parallel, void **c_ret)
 {
 	struct xpress_compressor *c;
 
@@ -1090,11 +1333,15 @@ xpress_create_compressor(size_t max_bufsize, unsigned compression_level,
 			goto oom1;
 
 		if (compression_level < 30) {
-			c->impl = xpress_compress_greedy;
+			c->impl = (max_bufsize <= MAX_SMALL_BUFSIZE) ?
+				  xpress_compress_greedy_small :
+				  xpress_compress_greedy_large;
 			c->max_search_depth = (compression_level * 30) / 16;
 			c->nice_match_length = (compression_level * 60) / 16;
 		} else {
-			c->impl = xpress_compress_lazy;
+			c->impl = (max_bufsize <= MAX_SMALL_BUFSIZE) ?
+				  xpress_compress_lazy_small :
+				  xpress_compress_lazy_large;
 			c->max_search_depth = (compression_level * 30) / 32;
 			c->nice_match_length = (compression_level * 60) / 32;
 
@@ -1175,9 +1422,22 @@ xpress_free_compressor(void *_c)
 	FREE(c);
 }
 
+#ifdef ENABLE_COMPRESSOR_STATS
+static struct wimlib_compressor_stats *
+xpress_get_stats(void *_c)
+{
+	struct xpress_compressor *c = _c;
+
+	return &c->stats;
+}
+#endif
+
 const struct compressor_ops xpress_compressor_ops = {
 	.get_needed_memory  = xpress_get_needed_memory,
 	.create_compressor  = xpress_create_compressor,
 	.compress	    = xpress_compress,
 	.free_compressor    = xpress_free_compressor,
+#ifdef ENABLE_COMPRESSOR_STATS
+	.get_stats	    = xpress_get_stats,
+#endif
 };
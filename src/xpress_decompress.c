@@ -67,6 +67,7 @@
 #  include "config.h"
 #endif
 
+#include "wimlib/cpu_features.h"
 #include "wimlib/decompressor_ops.h"
 #include "wimlib/decompress_common.h"
 #include "wimlib/error.h"
@@ -84,39 +85,21 @@ struct xpress_decompressor {
 	};
 	DECODE_TABLE_WORKING_SPACE(working_space, XPRESS_NUM_SYMBOLS,
 				   XPRESS_MAX_CODEWORD_LEN);
+
+	/* The packed codeword lengths from which 'decode_table' was built.
+	 * When decompressing many small chunks, consecutive chunks often use
+	 * the same code, and then the decode table can just be reused.  */
+	u8 prev_header[XPRESS_NUM_SYMBOLS / 2];
+	bool have_prev_header;
 } __attribute__((aligned(DECODE_TABLE_ALIGNMENT)));
 
-static int
-xpress_decompress(const void *restrict compressed_data, size_t compressed_size,
-		  void *restrict uncompressed_data, size_t uncompressed_size,
-		  void *restrict _d)
+/* Decode the matches and literals.  */
+static forceinline int
+xpress_decode_symbols_template(const struct xpress_decompressor *d,
+			       struct input_bitstream *is,
+			       u8 * const out_begin, u8 * const out_end)
 {
-	struct xpress_decompressor *d  = _d;
-	const u8 * const in_begin = compressed_data;
-	u8 * const out_begin = uncompressed_data;
 	u8 *out_next = out_begin;
-	u8 * const out_end = out_begin + uncompressed_size;
-	struct input_bitstream is;
-
-	/* Read the Huffman codeword lengths.  */
-	if (compressed_size < XPRESS_NUM_SYMBOLS / 2)
-		return -1;
-	for (int i = 0; i < XPRESS_NUM_SYMBOLS / 2; i++) {
-		d->lens[2 * i + 0] = in_begin[i] & 0xf;
-		d->lens[2 * i + 1] = in_begin[i] >> 4;
-	}
-
-	/* Build a decoding table for the Huffman code.  */
-	if (make_huffman_decode_table(d->decode_table, XPRESS_NUM_SYMBOLS,
-				      XPRESS_TABLEBITS, d->lens,
-				      XPRESS_MAX_CODEWORD_LEN,
-				      d->working_space))
-		return -1;
-
-	/* Decode the matches and literals.  */
-
-	init_input_bitstream(&is, in_begin + XPRESS_NUM_SYMBOLS / 2,
-			     compressed_size - XPRESS_NUM_SYMBOLS / 2);
 
 	while (out_next != out_end) {
 		unsigned sym;
@@ -124,7 +107,7 @@ xpress_decompress(const void *restrict compressed_data, size_t compressed_size,
 		u32 length;
 		u32 offset;
 
-		sym = read_huffsym(&is, d->decode_table,
+		sym = read_huffsym(is, d->decode_table,
 				   XPRESS_TABLEBITS, XPRESS_MAX_CODEWORD_LEN);
 		if (sym < XPRESS_NUM_CHARS) {
 			/* Literal  */
@@ -134,15 +117,15 @@ xpress_decompress(const void *restrict compressed_data, size_t compressed_size,
 			length = sym & 0xf;
 			log2_offset = (sym >> 4) & 0xf;
 
-			bitstream_ensure_bits(&is, 16);
+			bitstream_ensure_bits(is, 16);
 
 			offset = ((u32)1 << log2_offset) |
-				 bitstream_pop_bits(&is, log2_offset);
+				 bitstream_pop_bits(is, log2_offset);
 
 			if (length == 0xf) {
-				length += bitstream_read_byte(&is);
+				length += bitstream_read_byte(is);
 				if (length == 0xf + 0xff)
-					length = bitstream_read_u16(&is);
+					length = bitstream_read_u16(is);
 			}
 			length += XPRESS_MIN_MATCH_LEN;
 
@@ -157,6 +140,111 @@ xpress_decompress(const void *restrict compressed_data, size_t compressed_size,
 	return 0;
 }
 
+static int
+xpress_decode_symbols_generic(const struct xpress_decompressor *d,
+			      struct input_bitstream *is,
+			      u8 * const out_begin, u8 * const out_end)
+{
+	return xpress_decode_symbols_template(d, is, out_begin, out_end);
+}
+
+#if defined(__x86_64__)
+/*
+ * The same loop, compiled to use the BMI2 instructions.  Since the XPRESS
+ * format interleaves literal bytes with the bitstream, the exact refill
+ * behavior of 'struct input_bitstream' is part of the format, so this variant
+ * keeps it; it only benefits from the variable shifts (SHLX and SHRX) and bit
+ * field extraction (BZHI) not having to go through the CL register.
+ */
+#define HAVE_XPRESS_DECODE_SYMBOLS_BMI2
+static int __attribute__((target("bmi2")))
+xpress_decode_symbols_bmi2(const struct xpress_decompressor *d,
+			   struct input_bitstream *is,
+			   u8 * const out_begin, u8 * const out_end)
+{
+	return xpress_decode_symbols_template(d, is, out_begin, out_end);
+}
+#endif /* __x86_64__ */
+
+typedef int (*xpress_decode_symbols_func_t)(const struct xpress_decompressor *d,
+					    struct input_bitstream *is,
+					    u8 * const out_begin,
+					    u8 * const out_end);
+
+static xpress_decode_symbols_func_t xpress_decode_symbols_func =
+	xpress_decode_symbols_generic;
+
+static const struct cpu_impl xpress_decode_impls[] = {
+#ifdef HAVE_XPRESS_DECODE_SYMBOLS_BMI2
+	{ "bmi2", (cpu_func_t)xpress_decode_symbols_bmi2,
+	  X86_CPU_FEATURE_BMI2 },
+#endif
+	{ "generic", (cpu_func_t)xpress_decode_symbols_generic, 0 },
+};
+
+static void
+xpress_decode_select(const struct cpu_impl *impl)
+{
+	xpress_decode_symbols_func = (xpress_decode_symbols_func_t)impl->func;
+}
+
+const struct cpu_kernel xpress_decode_kernel = {
+	.name = "xpress_decode",
+	.impls = xpress_decode_impls,
+	.num_impls = ARRAY_LEN(xpress_decode_impls),
+	.select = xpress_decode_select,
+};
+
+static int
+xpress_decompress(const void *restrict compressed_data, size_t compressed_size,
+		  void *restrict uncompressed_data, size_t uncompressed_size,
+		  void *restrict _d)
+{
+	struct xpress_decompressor *d  = _d;
+	const u8 * const in_begin = compressed_data;
+	struct input_bitstream is;
+
+	if (compressed_size < XPRESS_NUM_SYMBOLS / 2)
+		return -1;
+
+	/* Build a decoding table for the Huffman code, unless it's the same
+	 * code that the previous chunk used.  */
+	if (!d->have_prev_header ||
+	    memcmp(d->prev_header, in_begin, XPRESS_NUM_SYMBOLS / 2) != 0)
+	{
+		/* Read the Huffman codeword lengths.  */
+		for (int i = 0; i < XPRESS_NUM_SYMBOLS / 2; i++) {
+			d->lens[2 * i + 0] = in_begin[i] & 0xf;
+			d->lens[2 * i + 1] = in_begin[i] >> 4;
+		}
+
+		if (make_huffman_decode_table(d->decode_table,
+					      XPRESS_NUM_SYMBOLS,
+					      XPRESS_TABLEBITS, d->lens,
+					      XPRESS_MAX_CODEWORD_LEN,
+					      d->working_space))
+		{
+			d->have_prev_header = false;
+			return -1;
+		}
+		memcpy(d->prev_header, in_begin, XPRESS_NUM_SYMBOLS / 2);
+		d->have_prev_header = true;
+	}
+
+	init_input_bitstream(&is, in_begin + XPRESS_NUM_SYMBOLS / 2,
+			     compressed_size - XPRESS_NUM_SYMBOLS / 2);
+
+	return (*xpress_decode_symbols_func)(d, &is, uncompressed_data,
+					     (u8 *)uncompressed_data +
+					     uncompressed_size);
+}
+
+static u64
+xpress_get_decompressor_needed_memory(size_t max_block_size)
+{
+	return sizeof(struct xpress_decompressor);
+}
+
 static int
 xpress_create_decompressor(size_t max_block_size, void **d_ret)
 {
@@ -168,6 +256,7 @@ xpress_create_decompressor(size_t max_block_size, void **d_ret)
 	d = ALIGNED_MALLOC(sizeof(*d), DECODE_TABLE_ALIGNMENT);
 	if (!d)
 		return WIMLIB_ERR_NOMEM;
+	d->have_prev_header = false;
 
 	*d_ret = d;
 	return 0;
@@ -180,6 +269,7 @@ xpress_free_decompressor(void *_d)
 }
 
 const struct decompressor_ops xpress_decompressor_ops = {
+	.get_needed_memory   = xpress_get_decompressor_needed_memory,
 	.create_decompressor = xpress_create_decompressor,
 	.decompress	     = xpress_decompress,
 	.free_decompressor   = xpress_free_decompressor,
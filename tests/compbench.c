@@ -0,0 +1,643 @@
+/*
+ * compbench.c - Benchmark the compressors and the capture/apply/export paths
+ */
+
+/*
+ * Copyright 2023 Eric Biggers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This program measures the library's compression ratio and performance on a
+ * corpus of files and directories, and prints the results as CSV or JSON so
+ * that they can be compared between versions.  It is run by 'make benchmark'.
+ *
+ * For every combination of compression type, compression level and chunk size,
+ * it splits each corpus file into chunks, compresses them with
+ * wimlib_compress(), then decompresses them with wimlib_decompress() and checks
+ * the result.  The best time of several iterations is reported for each.  Then,
+ * unless -E is given, it captures the corpus into a WIM file with the same
+ * settings, opens the WIM file again, applies the image to a temporary
+ * directory, and exports the image to another WIM file, timing each step once.
+ *
+ * Unlike tools/run_compression_benchmarks.c, which compares against WIMGAPI and
+ * so only runs on Windows, this only uses POSIX interfaces besides the library.
+ */
+
+#include <errno.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wimlib.h"
+
+#define ARRAY_LEN(A)	(sizeof(A) / sizeof((A)[0]))
+
+#define DEFAULT_LEVELS		"20,50,100"
+#define DEFAULT_CHUNK_SIZES	"32768,65536,1048576"
+#define DEFAULT_ITERATIONS	3
+
+static const struct {
+	const char *name;
+	enum wimlib_compression_type ctype;
+} all_ctypes[] = {
+	{ "xpress",	WIMLIB_COMPRESSION_TYPE_XPRESS, },
+	{ "lzx",	WIMLIB_COMPRESSION_TYPE_LZX, },
+	{ "lzms",	WIMLIB_COMPRESSION_TYPE_LZMS, },
+};
+
+struct corpus_file {
+	void *data;
+	size_t size;
+};
+
+static struct corpus_file *files;
+static size_t num_files;
+static unsigned long long corpus_size;
+
+static char **corpus_paths;
+static size_t num_corpus_paths;
+
+static bool json;
+static bool first_result = true;
+static FILE *out;
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+report(const char *test, const char *ctype, unsigned level,
+       unsigned long chunk_size, unsigned long long usize,
+       unsigned long long csize, unsigned long long ns)
+{
+	const char *version = wimlib_get_version_string();
+
+	if (json) {
+		fprintf(out, "%s\n    { \"version\": \"%s\", \"test\": \"%s\", "
+			"\"ctype\": \"%s\", \"level\": %u, \"chunk_size\": %lu, "
+			"\"uncompressed_bytes\": %llu, "
+			"\"compressed_bytes\": %llu, \"time_ns\": %llu }",
+			first_result ? "" : ",", version, test, ctype,
+			level, chunk_size, usize, csize, ns);
+	} else {
+		if (first_result) {
+			fprintf(out, "version,test,ctype,level,chunk_size,"
+				"uncompressed_bytes,compressed_bytes,time_ns\n");
+		}
+		fprintf(out, "%s,%s,%s,%u,%lu,%llu,%llu,%llu\n",
+			version, test, ctype, level, chunk_size,
+			usize, csize, ns);
+	}
+	first_result = false;
+	fflush(out);
+}
+
+/*----------------------------------------------------------------------------*
+ *                              Loading the corpus                            *
+ *----------------------------------------------------------------------------*/
+
+static int
+load_file(const char *path, off_t size)
+{
+	struct corpus_file *new_files;
+	void *data;
+	FILE *fp;
+
+	if (size == 0)
+		return 0;
+	fp = fopen(path, "rb");
+	if (!fp) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	data = malloc(size);
+	if (!data || fread(data, 1, size, fp) != (size_t)size) {
+		fprintf(stderr, "%s: %s\n", path,
+			data ? "read error" : "out of memory");
+		free(data);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	new_files = realloc(files, (num_files + 1) * sizeof(files[0]));
+	if (!new_files) {
+		free(data);
+		return -1;
+	}
+	files = new_files;
+	files[num_files].data = data;
+	files[num_files].size = size;
+	num_files++;
+	corpus_size += size;
+	return 0;
+}
+
+static int
+load_corpus_file(const char *path, const struct stat *stbuf, int type,
+		 struct FTW *ftw)
+{
+	if (type == FTW_F && S_ISREG(stbuf->st_mode))
+		return load_file(path, stbuf->st_size);
+	return 0;
+}
+
+static int
+remove_file(const char *path, const struct stat *stbuf, int type,
+	    struct FTW *ftw)
+{
+	if (remove(path)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+remove_tree(const char *path)
+{
+	if (access(path, F_OK))
+		return 0;
+	return nftw(path, remove_file, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*----------------------------------------------------------------------------*
+ *                          Compressor benchmarks                             *
+ *----------------------------------------------------------------------------*/
+
+struct chunk {
+	const void *data;
+	size_t usize;
+	void *cdata;
+	size_t csize;	/* 0 if the chunk didn't compress */
+};
+
+static int
+bench_codec(const char *name, enum wimlib_compression_type ctype,
+	    unsigned level, size_t chunk_size, int iterations)
+{
+	struct wimlib_compressor *c;
+	struct wimlib_decompressor *d;
+	struct chunk *chunks = NULL;
+	size_t num_chunks = 0;
+	unsigned long long csize = 0;
+	unsigned long long best_c = ~0ULL, best_d = ~0ULL;
+	void *buf = NULL;
+	int ret;
+
+	ret = wimlib_create_compressor(ctype, chunk_size, level, &c);
+	if (ret)
+		goto out_unsupported;
+	ret = wimlib_create_decompressor(ctype, chunk_size, &d);
+	if (ret) {
+		wimlib_free_compressor(c);
+		goto out_unsupported;
+	}
+
+	for (size_t i = 0; i < num_files; i++)
+		num_chunks += (files[i].size + chunk_size - 1) / chunk_size;
+	chunks = calloc(num_chunks, sizeof(chunks[0]));
+	buf = malloc(chunk_size);
+	if (!chunks || !buf)
+		goto out_nomem;
+	num_chunks = 0;
+	for (size_t i = 0; i < num_files; i++) {
+		for (size_t pos = 0; pos < files[i].size; pos += chunk_size) {
+			struct chunk *chunk = &chunks[num_chunks++];
+
+			chunk->data = (const char *)files[i].data + pos;
+			chunk->usize = files[i].size - pos;
+			if (chunk->usize > chunk_size)
+				chunk->usize = chunk_size;
+			chunk->cdata = malloc(chunk->usize);
+			if (!chunk->cdata)
+				goto out_nomem;
+		}
+	}
+
+	for (int iter = 0; iter < iterations; iter++) {
+		unsigned long long t = now_ns();
+
+		for (size_t i = 0; i < num_chunks; i++) {
+			chunks[i].csize = wimlib_compress(chunks[i].data,
+							  chunks[i].usize,
+							  chunks[i].cdata,
+							  chunks[i].usize - 1,
+							  c);
+		}
+		t = now_ns() - t;
+		if (t < best_c)
+			best_c = t;
+	}
+	for (size_t i = 0; i < num_chunks; i++)
+		csize += chunks[i].csize ? chunks[i].csize : chunks[i].usize;
+
+	for (int iter = 0; iter < iterations; iter++) {
+		unsigned long long t = now_ns();
+
+		for (size_t i = 0; i < num_chunks; i++) {
+			if (chunks[i].csize == 0)
+				continue;
+			if (wimlib_decompress(chunks[i].cdata, chunks[i].csize,
+					      buf, chunks[i].usize, d) ||
+			    (iter == 0 &&
+			     memcmp(buf, chunks[i].data, chunks[i].usize)))
+			{
+				fprintf(stderr, "%s level %u chunk size %zu: "
+					"chunk %zu did not round-trip!\n",
+					name, level, chunk_size, i);
+				ret = -1;
+				goto out;
+			}
+		}
+		t = now_ns() - t;
+		if (t < best_d)
+			best_d = t;
+	}
+
+	report("compress", name, level, chunk_size, corpus_size, csize, best_c);
+	report("decompress", name, level, chunk_size, corpus_size, csize, best_d);
+	ret = 0;
+	goto out;
+
+out_nomem:
+	fprintf(stderr, "out of memory\n");
+	ret = -1;
+out:
+	for (size_t i = 0; i < num_chunks; i++)
+		free(chunks[i].cdata);
+	free(chunks);
+	free(buf);
+	wimlib_free_decompressor(d);
+	wimlib_free_compressor(c);
+	return ret;
+
+out_unsupported:
+	fprintf(stderr, "Skipping %s level %u chunk size %zu: %s\n",
+		name, level, chunk_size, wimlib_get_error_string(ret));
+	return 1;
+}
+
+/*----------------------------------------------------------------------------*
+ *                          End-to-end benchmarks                             *
+ *----------------------------------------------------------------------------*/
+
+static unsigned long long
+file_size(const char *path)
+{
+	struct stat stbuf;
+
+	return stat(path, &stbuf) ? 0 : stbuf.st_size;
+}
+
+static int
+new_wim(enum wimlib_compression_type ctype, size_t chunk_size, WIMStruct **wim_ret)
+{
+	int ret;
+
+	ret = wimlib_create_new_wim(ctype, wim_ret);
+	if (ret)
+		return ret;
+	ret = wimlib_set_output_chunk_size(*wim_ret, chunk_size);
+	if (ret)
+		wimlib_free(*wim_ret);
+	return ret;
+}
+
+static int
+bench_end_to_end(const char *name, enum wimlib_compression_type ctype,
+		 unsigned level, size_t chunk_size, const char *workdir,
+		 unsigned num_threads)
+{
+	struct wimlib_capture_source *sources;
+	char *wimfile, *exportfile, *applydir;
+	WIMStruct *wim = NULL, *dest_wim = NULL;
+	unsigned long long t;
+	int ret;
+
+	sources = calloc(num_corpus_paths, sizeof(sources[0]));
+	if (!sources ||
+	    asprintf(&wimfile, "%s/capture.wim", workdir) < 0 ||
+	    asprintf(&exportfile, "%s/export.wim", workdir) < 0 ||
+	    asprintf(&applydir, "%s/apply", workdir) < 0)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (size_t i = 0; i < num_corpus_paths; i++) {
+		char *p = corpus_paths[i];
+		char *slash;
+		size_t len = strlen(p);
+
+		while (len > 1 && p[len - 1] == '/')
+			len--;
+		slash = memrchr(p, '/', len);
+		sources[i].fs_source_path = p;
+		sources[i].wim_target_path = strndup(slash ? slash + 1 : p,
+						     slash ? len - (slash + 1 - p) : len);
+		if (!sources[i].wim_target_path) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+
+	wimlib_set_default_compression_level(ctype, level);
+
+	ret = new_wim(ctype, chunk_size, &wim);
+	if (ret)
+		goto out_unsupported;
+	t = now_ns();
+	ret = wimlib_add_image_multisource(wim, sources, num_corpus_paths,
+					   "benchmark", NULL, 0);
+	if (ret == 0)
+		ret = wimlib_write(wim, wimfile, WIMLIB_ALL_IMAGES, 0,
+				   num_threads);
+	t = now_ns() - t;
+	wimlib_free(wim);
+	wim = NULL;
+	if (ret)
+		goto out_failed;
+	report("capture", name, level, chunk_size, corpus_size,
+	       file_size(wimfile), t);
+
+	t = now_ns();
+	ret = wimlib_open_wim(wimfile, 0, &wim);
+	t = now_ns() - t;
+	if (ret)
+		goto out_failed;
+	report("open", name, level, chunk_size, corpus_size,
+	       file_size(wimfile), t);
+
+	remove_tree(applydir);
+	t = now_ns();
+	ret = wimlib_extract_image(wim, 1, applydir, 0);
+	t = now_ns() - t;
+	if (ret)
+		goto out_failed;
+	report("apply", name, level, chunk_size, corpus_size,
+	       file_size(wimfile), t);
+	remove_tree(applydir);
+
+	ret = new_wim(ctype, chunk_size, &dest_wim);
+	if (ret)
+		goto out_failed;
+	t = now_ns();
+	ret = wimlib_export_image(wim, 1, dest_wim, NULL, NULL, 0);
+	if (ret == 0)
+		ret = wimlib_write(dest_wim, exportfile, WIMLIB_ALL_IMAGES, 0,
+				   num_threads);
+	t = now_ns() - t;
+	if (ret)
+		goto out_failed;
+	report("export", name, level, chunk_size, corpus_size,
+	       file_size(exportfile), t);
+	ret = 0;
+	goto out;
+
+out_unsupported:
+	fprintf(stderr, "Skipping end-to-end %s level %u chunk size %zu: %s\n",
+		name, level, chunk_size, wimlib_get_error_string(ret));
+	ret = 1;
+	goto out;
+out_failed:
+	fprintf(stderr, "End-to-end %s level %u chunk size %zu failed: %s\n",
+		name, level, chunk_size, wimlib_get_error_string(ret));
+	ret = -1;
+out:
+	wimlib_free(dest_wim);
+	wimlib_free(wim);
+	unlink(wimfile);
+	unlink(exportfile);
+	for (size_t i = 0; i < num_corpus_paths; i++)
+		free(sources[i].wim_target_path);
+	free(sources);
+	free(wimfile);
+	free(exportfile);
+	free(applydir);
+	return ret;
+}
+
+/*----------------------------------------------------------------------------*
+ *                                   main                                     *
+ *----------------------------------------------------------------------------*/
+
+static int
+parse_list(const char *str, unsigned long *vals, int max_vals)
+{
+	int n = 0;
+	char *end;
+
+	do {
+		if (n == max_vals)
+			return -1;
+		vals[n++] = strtoul(str, &end, 0);
+		if (end == str || (*end != ',' && *end != '\0'))
+			return -1;
+		str = end + 1;
+	} while (*end == ',');
+	return n;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"Usage: compbench [-f csv|json] [-o OUTFILE] [-t TYPE,...] [-l LEVEL,...]\n"
+"                 [-c CHUNK_SIZE,...] [-i ITERATIONS] [-j THREADS] [-E]\n"
+"                 [-w WORKDIR] CORPUS...\n"
+"\n"
+"CORPUS is one or more files or directories.  TYPE is xpress, lzx, or lzms.\n"
+"The defaults are all types, levels " DEFAULT_LEVELS ", and chunk sizes\n"
+DEFAULT_CHUNK_SIZES ".  -E skips the end-to-end capture/apply/export\n"
+"benchmarks.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	bool use_ctype[ARRAY_LEN(all_ctypes)];
+	unsigned long levels[32], chunk_sizes[32];
+	int num_levels, num_chunk_sizes;
+	int iterations = DEFAULT_ITERATIONS;
+	unsigned num_threads = 0;
+	bool end_to_end = true;
+	const char *outfile = NULL;
+	char *workdir = NULL;
+	bool remove_workdir = false;
+	int opt;
+	int ret = 0;
+
+	num_levels = parse_list(DEFAULT_LEVELS, levels, ARRAY_LEN(levels));
+	num_chunk_sizes = parse_list(DEFAULT_CHUNK_SIZES, chunk_sizes,
+				     ARRAY_LEN(chunk_sizes));
+	for (size_t i = 0; i < ARRAY_LEN(all_ctypes); i++)
+		use_ctype[i] = true;
+
+	while ((opt = getopt(argc, argv, "f:o:t:l:c:i:j:Ew:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (!strcmp(optarg, "json")) {
+				json = true;
+			} else if (strcmp(optarg, "csv")) {
+				usage();
+				return 2;
+			}
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 't':
+			for (size_t i = 0; i < ARRAY_LEN(all_ctypes); i++)
+				use_ctype[i] = false;
+			for (char *tok = strtok(optarg, ","); tok;
+			     tok = strtok(NULL, ","))
+			{
+				size_t i;
+
+				for (i = 0; i < ARRAY_LEN(all_ctypes); i++)
+					if (!strcmp(tok, all_ctypes[i].name))
+						break;
+				if (i == ARRAY_LEN(all_ctypes)) {
+					usage();
+					return 2;
+				}
+				use_ctype[i] = true;
+			}
+			break;
+		case 'l':
+			num_levels = parse_list(optarg, levels,
+						ARRAY_LEN(levels));
+			break;
+		case 'c':
+			num_chunk_sizes = parse_list(optarg, chunk_sizes,
+						     ARRAY_LEN(chunk_sizes));
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'j':
+			num_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'E':
+			end_to_end = false;
+			break;
+		case 'w':
+			workdir = optarg;
+			break;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (optind >= argc || num_levels <= 0 || num_chunk_sizes <= 0 ||
+	    iterations <= 0) {
+		usage();
+		return 2;
+	}
+	corpus_paths = &argv[optind];
+	num_corpus_paths = argc - optind;
+
+	for (size_t i = 0; i < num_corpus_paths; i++) {
+		if (nftw(corpus_paths[i], load_corpus_file, 16, FTW_PHYS)) {
+			fprintf(stderr, "%s: failed to load corpus\n",
+				corpus_paths[i]);
+			return 1;
+		}
+	}
+	if (corpus_size == 0) {
+		fprintf(stderr, "The corpus is empty!\n");
+		return 1;
+	}
+
+	if (end_to_end && !workdir) {
+		const char *tmpdir = getenv("TMPDIR") ?: P_tmpdir;
+
+		if (asprintf(&workdir, "%s/compbench.XXXXXX", tmpdir) < 0 ||
+		    !mkdtemp(workdir)) {
+			fprintf(stderr, "failed to create temporary directory: "
+				"%s\n", strerror(errno));
+			return 1;
+		}
+		remove_workdir = true;
+	}
+
+	out = stdout;
+	if (outfile && !(out = fopen(outfile, "w"))) {
+		fprintf(stderr, "%s: %s\n", outfile, strerror(errno));
+		ret = 1;
+		goto out;
+	}
+	if (json)
+		fprintf(out, "[");
+
+	wimlib_set_print_errors(true);
+
+	for (size_t i = 0; i < ARRAY_LEN(all_ctypes) && ret == 0; i++) {
+		if (!use_ctype[i])
+			continue;
+		for (int j = 0; j < num_levels && ret == 0; j++) {
+			for (int k = 0; k < num_chunk_sizes && ret == 0; k++) {
+				ret = bench_codec(all_ctypes[i].name,
+						  all_ctypes[i].ctype,
+						  levels[j], chunk_sizes[k],
+						  iterations);
+				if (ret > 0) {
+					/* unsupported chunk size */
+					ret = 0;
+					continue;
+				}
+				if (ret == 0 && end_to_end) {
+					ret = bench_end_to_end(all_ctypes[i].name,
+							       all_ctypes[i].ctype,
+							       levels[j],
+							       chunk_sizes[k],
+							       workdir,
+							       num_threads);
+					if (ret > 0)
+						ret = 0;
+				}
+			}
+		}
+	}
+	if (ret)
+		ret = 1;
+
+	if (json)
+		fprintf(out, "\n]\n");
+	if (out != stdout && fclose(out)) {
+		fprintf(stderr, "%s: %s\n", outfile, strerror(errno));
+		ret = 1;
+	}
+out:
+	if (remove_workdir) {
+		remove_tree(workdir);
+		free(workdir);
+	}
+	for (size_t i = 0; i < num_files; i++)
+		free(files[i].data);
+	free(files);
+	wimlib_global_cleanup();
+	return ret;
+}
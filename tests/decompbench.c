@@ -0,0 +1,251 @@
+/*
+ * decompbench.c - Benchmark the decompressors on the chunks of real files
+ */
+
+/*
+ * Copyright 2023 Eric Biggers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This program splits the given files into chunks, compresses each chunk with
+ * the library's compressor, then repeatedly decompresses all the chunks and
+ * prints the best decompression throughput.  The first time, every
+ * decompressed chunk is also checked against the original data.
+ *
+ * By default the chunks are compressed the way ESD files are, i.e. with LZMS in
+ * 64 MiB chunks; use -t and -c to choose a different compression type and chunk
+ * size, e.g. '-t xpress -c 32768' for the chunks of a default non-solid WIM.
+ *
+ * CPU features can be disabled with the WIMLIB_DISABLE_CPU_FEATURES
+ * environmental variable, or implementations selected with WIMLIB_CPU_FEATURES
+ * (e.g. WIMLIB_CPU_FEATURES=lzx_decode=generic), to compare the different code
+ * paths.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wimlib.h"
+
+#define NUM_ITERATIONS	5
+
+struct chunk {
+	void *data;
+	size_t usize;
+	void *cdata;
+	size_t csize;	/* 0 if the chunk didn't compress */
+};
+
+static struct chunk *chunks;
+static size_t num_chunks;
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double
+mb_per_sec(unsigned long long bytes, unsigned long long ns)
+{
+	return (double)bytes / (1 << 20) / ((double)ns / 1000000000);
+}
+
+static int
+add_chunk(void *data, size_t usize, struct wimlib_compressor *c)
+{
+	struct chunk *new_chunks;
+	struct chunk *chunk;
+
+	new_chunks = realloc(chunks, (num_chunks + 1) * sizeof(chunks[0]));
+	if (!new_chunks) {
+		free(data);
+		return -1;
+	}
+	chunks = new_chunks;
+	chunk = &chunks[num_chunks++];
+	chunk->data = data;
+	chunk->usize = usize;
+	chunk->cdata = malloc(usize);
+	if (!chunk->cdata)
+		return -1;
+	chunk->csize = wimlib_compress(data, usize, chunk->cdata, usize - 1, c);
+	return 0;
+}
+
+static int
+load_file(const char *path, size_t chunk_size, struct wimlib_compressor *c)
+{
+	FILE *fp = fopen(path, "rb");
+	int ret = 0;
+
+	if (!fp) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	for (;;) {
+		void *data = malloc(chunk_size);
+		size_t n;
+
+		if (!data) {
+			ret = -1;
+			break;
+		}
+		n = fread(data, 1, chunk_size, fp);
+		if (n == 0) {
+			free(data);
+			break;
+		}
+		if (add_chunk(data, n, c)) {
+			ret = -1;
+			break;
+		}
+		if (n < chunk_size)
+			break;
+	}
+	if (ferror(fp)) {
+		fprintf(stderr, "%s: read error\n", path);
+		ret = -1;
+	}
+	fclose(fp);
+	return ret;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"Usage: decompbench [-t xpress|lzx|lzms] [-c CHUNK_SIZE] [-l LEVEL] FILE...\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	enum wimlib_compression_type ctype = WIMLIB_COMPRESSION_TYPE_LZMS;
+	size_t chunk_size = 1 << 26;
+	unsigned level = 0;
+	struct wimlib_compressor *c;
+	struct wimlib_decompressor *d;
+	unsigned long long usize = 0, csize = 0;
+	unsigned long long best_ns = ~0ULL;
+	void *out;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "t:c:l:h")) != -1) {
+		switch (opt) {
+		case 't':
+			if (!strcmp(optarg, "xpress")) {
+				ctype = WIMLIB_COMPRESSION_TYPE_XPRESS;
+			} else if (!strcmp(optarg, "lzx")) {
+				ctype = WIMLIB_COMPRESSION_TYPE_LZX;
+			} else if (!strcmp(optarg, "lzms")) {
+				ctype = WIMLIB_COMPRESSION_TYPE_LZMS;
+			} else {
+				usage();
+				return 2;
+			}
+			break;
+		case 'c':
+			chunk_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			level = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (optind >= argc) {
+		usage();
+		return 2;
+	}
+
+	ret = wimlib_create_compressor(ctype, chunk_size, level, &c);
+	if (ret == 0) {
+		ret = wimlib_create_decompressor(ctype, chunk_size, &d);
+		if (ret)
+			wimlib_free_compressor(c);
+	}
+	if (ret) {
+		fprintf(stderr, "Failed to create (de)compressor: %s\n",
+			wimlib_get_error_string(ret));
+		return 1;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (load_file(argv[i], chunk_size, c)) {
+			ret = 1;
+			goto out;
+		}
+	}
+
+	out = malloc(chunk_size);
+	if (!out) {
+		ret = 1;
+		goto out;
+	}
+	for (int it = 0; it < NUM_ITERATIONS; it++) {
+		unsigned long long t = now_ns();
+
+		for (size_t i = 0; i < num_chunks; i++) {
+			const struct chunk *chunk = &chunks[i];
+
+			if (!chunk->csize)
+				continue;
+			if (wimlib_decompress(chunk->cdata, chunk->csize,
+					      out, chunk->usize, d) ||
+			    (it == 0 &&
+			     memcmp(out, chunk->data, chunk->usize))) {
+				fprintf(stderr, "Chunk %zu failed to "
+					"decompress correctly!\n", i);
+				ret = 1;
+				goto out_free;
+			}
+		}
+		t = now_ns() - t;
+		if (t < best_ns)
+			best_ns = t;
+	}
+
+	for (size_t i = 0; i < num_chunks; i++) {
+		if (chunks[i].csize) {
+			usize += chunks[i].usize;
+			csize += chunks[i].csize;
+		}
+	}
+	printf("%zu chunks, %llu => %llu bytes: decompressed at %.1f MB/s\n",
+	       num_chunks, usize, csize, mb_per_sec(usize, best_ns));
+out_free:
+	free(out);
+out:
+	for (size_t i = 0; i < num_chunks; i++) {
+		free(chunks[i].data);
+		free(chunks[i].cdata);
+	}
+	free(chunks);
+	wimlib_free_decompressor(d);
+	wimlib_free_compressor(c);
+	return ret;
+}
@@ -0,0 +1,495 @@
+/*
+ * imagebench.c - Benchmark the library's scalability to images with many files
+ */
+
+/*
+ * Copyright 2023 Eric Biggers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This program measures how the time taken by the library's operations on an
+ * image grows with the number of files in it, so that operations which are
+ * superlinear in the number of files can be found before they are hit by real
+ * images.  It must be linked against a build of the library compiled with
+ * --enable-test-support.
+ *
+ * For each requested number of files, it generates a synthetic image with
+ * WIMLIB_ADD_FLAG_GENERATE_TEST_DATA (using random names, metadata, and file
+ * data as configured by the options), writes it to a WIM file, opens the WIM
+ * file again, loads the image's metadata, iterates through all the files,
+ * renames some of them, extracts the image to a temporary directory unless -E
+ * is given, and writes the updated image to another WIM file, timing each step
+ * once.  The results are printed as CSV or JSON, like compbench's.  Comparing
+ * the time per file for e.g. 1M, 10M, and 50M files shows which steps don't
+ * scale linearly.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifndef ENABLE_TEST_SUPPORT
+#  error "This program requires that wimlib was configured with --enable-test-support."
+#endif
+
+#include <errno.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wimlib.h"
+#include "wimlib/test_support.h"
+
+#define ARRAY_LEN(A)	(sizeof(A) / sizeof((A)[0]))
+
+#define DEFAULT_NUM_FILES	"1000000"
+#define DEFAULT_SEED		1
+
+/* The number of files which are renamed by the update step  */
+#define NUM_RENAMES		1000
+
+static const struct {
+	const char *name;
+	enum wimlib_compression_type ctype;
+} all_ctypes[] = {
+	{ "none",	WIMLIB_COMPRESSION_TYPE_NONE, },
+	{ "xpress",	WIMLIB_COMPRESSION_TYPE_XPRESS, },
+	{ "lzx",	WIMLIB_COMPRESSION_TYPE_LZX, },
+	{ "lzms",	WIMLIB_COMPRESSION_TYPE_LZMS, },
+};
+
+static struct wimlib_test_data_params params;
+
+static bool json;
+static bool first_result = true;
+static FILE *out;
+
+/* The files which the iteration step chose to be renamed  */
+static char *rename_paths[NUM_RENAMES];
+static size_t num_rename_paths;
+static unsigned long long num_iterated;
+static unsigned long long rename_interval;
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+report(const char *test, unsigned long long wim_bytes, unsigned long long ns)
+{
+	const char *version = wimlib_get_version_string();
+
+	if (json) {
+		fprintf(out, "%s\n    { \"version\": \"%s\", \"test\": \"%s\", "
+			"\"num_files\": %llu, \"max_dir_entries\": %u, "
+			"\"max_name_len\": %u, \"max_stream_size\": %llu, "
+			"\"dedup_percent\": %u, \"wim_bytes\": %llu, "
+			"\"time_ns\": %llu }",
+			first_result ? "" : ",", version, test,
+			(unsigned long long)params.num_files,
+			params.max_dir_entries, params.max_name_len,
+			(unsigned long long)params.max_stream_size,
+			params.dedup_percent, wim_bytes, ns);
+	} else {
+		if (first_result) {
+			fprintf(out, "version,test,num_files,max_dir_entries,"
+				"max_name_len,max_stream_size,dedup_percent,"
+				"wim_bytes,time_ns\n");
+		}
+		fprintf(out, "%s,%s,%llu,%u,%u,%llu,%u,%llu,%llu\n",
+			version, test, (unsigned long long)params.num_files,
+			params.max_dir_entries, params.max_name_len,
+			(unsigned long long)params.max_stream_size,
+			params.dedup_percent, wim_bytes, ns);
+	}
+	first_result = false;
+	fflush(out);
+}
+
+static unsigned long long
+file_size(const char *path)
+{
+	struct stat stbuf;
+
+	return stat(path, &stbuf) ? 0 : stbuf.st_size;
+}
+
+static int
+remove_file(const char *path, const struct stat *stbuf, int type,
+	    struct FTW *ftw)
+{
+	if (remove(path)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+remove_tree(const char *path)
+{
+	if (access(path, F_OK))
+		return 0;
+	return nftw(path, remove_file, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int
+count_dentry(const struct wimlib_dir_entry *dentry, void *_ignored)
+{
+	return 0;
+}
+
+/* Count the files, and choose every rename_interval'th nondirectory to be
+ * renamed by the update step.  */
+static int
+visit_dentry(const struct wimlib_dir_entry *dentry, void *_ignored)
+{
+	if (num_iterated++ % rename_interval == 0 &&
+	    !(dentry->attributes & WIMLIB_FILE_ATTRIBUTE_DIRECTORY) &&
+	    num_rename_paths < NUM_RENAMES)
+	{
+		rename_paths[num_rename_paths] = strdup(dentry->full_path);
+		if (!rename_paths[num_rename_paths])
+			return WIMLIB_ERR_NOMEM;
+		num_rename_paths++;
+	}
+	return 0;
+}
+
+static int
+rename_files(WIMStruct *wim)
+{
+	struct wimlib_update_command cmds[NUM_RENAMES];
+	char *new_paths[NUM_RENAMES];
+	int ret = WIMLIB_ERR_NOMEM;
+	size_t i;
+
+	memset(cmds, 0, sizeof(cmds));
+	for (i = 0; i < num_rename_paths; i++) {
+		if (asprintf(&new_paths[i], "%s~", rename_paths[i]) < 0)
+			goto out;
+		cmds[i].op = WIMLIB_UPDATE_OP_RENAME;
+		cmds[i].rename.wim_source_path = rename_paths[i];
+		cmds[i].rename.wim_target_path = new_paths[i];
+	}
+	ret = wimlib_update_image(wim, 1, cmds, num_rename_paths, 0);
+out:
+	while (i--)
+		free(new_paths[i]);
+	return ret;
+}
+
+static int
+bench_image(enum wimlib_compression_type ctype, const char *workdir,
+	    unsigned num_threads, bool extract, u64 seed)
+{
+	char *wimfile, *updatedfile, *applydir;
+	WIMStruct *wim = NULL;
+	unsigned long long t;
+	int ret;
+
+	if (asprintf(&wimfile, "%s/image.wim", workdir) < 0 ||
+	    asprintf(&updatedfile, "%s/updated.wim", workdir) < 0 ||
+	    asprintf(&applydir, "%s/apply", workdir) < 0)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	wimlib_seed_random(seed);
+	ret = wimlib_set_test_data_params(&params);
+	if (ret)
+		goto out_failed;
+
+	ret = wimlib_create_new_wim(ctype, &wim);
+	if (ret)
+		goto out_failed;
+	t = now_ns();
+	ret = wimlib_add_image(wim, NULL, "benchmark", NULL,
+			       WIMLIB_ADD_FLAG_GENERATE_TEST_DATA |
+			       WIMLIB_ADD_FLAG_NORPFIX);
+	t = now_ns() - t;
+	if (ret)
+		goto out_failed;
+	report("generate", 0, t);
+
+	t = now_ns();
+	ret = wimlib_write(wim, wimfile, WIMLIB_ALL_IMAGES, 0, num_threads);
+	t = now_ns() - t;
+	if (ret)
+		goto out_failed;
+	report("write", file_size(wimfile), t);
+
+	/* Freeing the generated image can be expensive too.  */
+	t = now_ns();
+	wimlib_free(wim);
+	wim = NULL;
+	t = now_ns() - t;
+	report("free", file_size(wimfile), t);
+
+	t = now_ns();
+	ret = wimlib_open_wim(wimfile, 0, &wim);
+	t = now_ns() - t;
+	if (ret)
+		goto out_failed;
+	report("open", file_size(wimfile), t);
+
+	/* Iterating on just the root directory loads the image's metadata.  */
+	t = now_ns();
+	ret = wimlib_iterate_dir_tree(wim, 1, WIMLIB_WIM_ROOT_PATH, 0,
+				      count_dentry, NULL);
+	t = now_ns() - t;
+	if (ret)
+		goto out_failed;
+	report("load_metadata", file_size(wimfile), t);
+
+	num_iterated = 0;
+	rename_interval = params.num_files / NUM_RENAMES ?: 1;
+	t = now_ns();
+	ret = wimlib_iterate_dir_tree(wim, 1, WIMLIB_WIM_ROOT_PATH,
+				      WIMLIB_ITERATE_DIR_TREE_FLAG_RECURSIVE,
+				      visit_dentry, NULL);
+	t = now_ns() - t;
+	if (ret)
+		goto out_failed;
+	report("iterate", file_size(wimfile), t);
+
+	t = now_ns();
+	ret = rename_files(wim);
+	t = now_ns() - t;
+	if (ret)
+		goto out_failed;
+	report("update", file_size(wimfile), t);
+
+	if (extract) {
+		remove_tree(applydir);
+		t = now_ns();
+		ret = wimlib_extract_image(wim, 1, applydir,
+					   WIMLIB_EXTRACT_FLAG_NORPFIX);
+		t = now_ns() - t;
+		if (ret)
+			goto out_failed;
+		report("extract", file_size(wimfile), t);
+		remove_tree(applydir);
+	}
+
+	t = now_ns();
+	ret = wimlib_write(wim, updatedfile, WIMLIB_ALL_IMAGES, 0, num_threads);
+	t = now_ns() - t;
+	if (ret)
+		goto out_failed;
+	report("write_updated", file_size(updatedfile), t);
+	ret = 0;
+	goto out;
+
+out_failed:
+	fprintf(stderr, "Benchmark with %llu files failed: %s\n",
+		(unsigned long long)params.num_files,
+		wimlib_get_error_string(ret));
+	ret = -1;
+out:
+	wimlib_free(wim);
+	unlink(wimfile);
+	unlink(updatedfile);
+	for (size_t i = 0; i < num_rename_paths; i++)
+		free(rename_paths[i]);
+	num_rename_paths = 0;
+	free(wimfile);
+	free(updatedfile);
+	free(applydir);
+	return ret;
+}
+
+/*----------------------------------------------------------------------------*
+ *                                   main                                     *
+ *----------------------------------------------------------------------------*/
+
+static int
+parse_list(const char *str, unsigned long long *vals, int max_vals)
+{
+	int n = 0;
+	char *end;
+
+	do {
+		if (n == max_vals)
+			return -1;
+		vals[n++] = strtoull(str, &end, 0);
+		if (end == str || (*end != ',' && *end != '\0'))
+			return -1;
+		str = end + 1;
+	} while (*end == ',');
+	return n;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"Usage: imagebench [-f csv|json] [-o OUTFILE] [-n NUM_FILES,...]\n"
+"                  [-d MAX_DIR_ENTRIES] [-l MAX_NAME_LEN] [-s MAX_STREAM_SIZE]\n"
+"                  [-D DEDUP_PERCENT] [-t TYPE] [-j THREADS] [-r SEED] [-E]\n"
+"                  [-w WORKDIR]\n"
+"\n"
+"TYPE is none, xpress, lzx, or lzms (default xpress).  The default is\n"
+DEFAULT_NUM_FILES " files with 64 entries per directory, the default\n"
+"filename lengths, and no file data.  Each stream's size is chosen uniformly\n"
+"from 0 to MAX_STREAM_SIZE bytes.  -E skips the extraction benchmark.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	enum wimlib_compression_type ctype = WIMLIB_COMPRESSION_TYPE_XPRESS;
+	unsigned long long num_files[32];
+	int num_sizes;
+	unsigned num_threads = 0;
+	u64 seed = DEFAULT_SEED;
+	bool extract = true;
+	const char *outfile = NULL;
+	char *workdir = NULL;
+	bool remove_workdir = false;
+	int opt;
+	int ret = 0;
+
+	num_sizes = parse_list(DEFAULT_NUM_FILES, num_files,
+			       ARRAY_LEN(num_files));
+
+	while ((opt = getopt(argc, argv, "f:o:n:d:l:s:D:t:j:r:Ew:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (!strcmp(optarg, "json")) {
+				json = true;
+			} else if (strcmp(optarg, "csv")) {
+				usage();
+				return 2;
+			}
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 'n':
+			num_sizes = parse_list(optarg, num_files,
+					       ARRAY_LEN(num_files));
+			break;
+		case 'd':
+			params.max_dir_entries = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			params.max_name_len = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			params.max_stream_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'D':
+			params.dedup_percent = strtoul(optarg, NULL, 0);
+			break;
+		case 't': {
+			size_t i;
+
+			for (i = 0; i < ARRAY_LEN(all_ctypes); i++)
+				if (!strcmp(optarg, all_ctypes[i].name))
+					break;
+			if (i == ARRAY_LEN(all_ctypes)) {
+				usage();
+				return 2;
+			}
+			ctype = all_ctypes[i].ctype;
+			break;
+		}
+		case 'j':
+			num_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'E':
+			extract = false;
+			break;
+		case 'w':
+			workdir = optarg;
+			break;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (optind != argc || num_sizes <= 0 || params.dedup_percent > 100) {
+		usage();
+		return 2;
+	}
+	if (params.max_dir_entries == 0)
+		params.max_dir_entries = 64;
+	for (int i = 0; i < num_sizes; i++) {
+		if (num_files[i] == 0) {
+			usage();
+			return 2;
+		}
+	}
+
+	if (!workdir) {
+		const char *tmpdir = getenv("TMPDIR") ?: P_tmpdir;
+
+		if (asprintf(&workdir, "%s/imagebench.XXXXXX", tmpdir) < 0 ||
+		    !mkdtemp(workdir)) {
+			fprintf(stderr, "failed to create temporary directory: "
+				"%s\n", strerror(errno));
+			return 1;
+		}
+		remove_workdir = true;
+	}
+
+	out = stdout;
+	if (outfile && !(out = fopen(outfile, "w"))) {
+		fprintf(stderr, "%s: %s\n", outfile, strerror(errno));
+		ret = 1;
+		goto out;
+	}
+	if (json)
+		fprintf(out, "[");
+
+	wimlib_set_print_errors(true);
+
+	for (int i = 0; i < num_sizes && ret == 0; i++) {
+		params.num_files = num_files[i];
+		ret = bench_image(ctype, workdir, num_threads, extract, seed);
+	}
+	if (ret)
+		ret = 1;
+
+	if (json)
+		fprintf(out, "\n]\n");
+	if (out != stdout && fclose(out)) {
+		fprintf(stderr, "%s: %s\n", outfile, strerror(errno));
+		ret = 1;
+	}
+out:
+	if (remove_workdir) {
+		remove_tree(workdir);
+		free(workdir);
+	}
+	wimlib_global_cleanup();
+	return ret;
+}
@@ -0,0 +1,272 @@
+/*
+ * matchbench.c - Benchmark the matchfinders on the chunks of real files
+ */
+
+/*
+ * Copyright 2023 Eric Biggers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This program must be linked against a build of the library compiled with
+ * --enable-test-support, since the matchfinders are not part of the API.
+ *
+ * It splits the given files into chunks, then runs each matchfinder over all
+ * the chunks the way the compressors use it: a greedy parse for the hash chains
+ * matchfinder, and finding all matches at every position for the binary trees
+ * and LCP-interval tree matchfinders.  For each one it prints the throughput,
+ * the number of matches found, and the memory needed for one chunk.  Then it
+ * compresses the chunks with each compression type at several levels, which
+ * use the different matchfinders with their real parsers, and prints the
+ * compressed size and throughput of each.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wimlib.h"
+#include "wimlib/test_support.h"
+
+static const struct {
+	const char *name;
+	int matchfinder;
+} matchfinders[] = {
+	{ "hc_matchfinder",	WIMLIB_MATCHFINDER_HC, },
+	{ "bt_matchfinder",	WIMLIB_MATCHFINDER_BT, },
+	{ "lcpit_matchfinder",	WIMLIB_MATCHFINDER_LCPIT, },
+};
+
+static const struct {
+	const char *name;
+	enum wimlib_compression_type ctype;
+} ctypes[] = {
+	{ "XPRESS",	WIMLIB_COMPRESSION_TYPE_XPRESS, },
+	{ "LZX",	WIMLIB_COMPRESSION_TYPE_LZX, },
+	{ "LZMS",	WIMLIB_COMPRESSION_TYPE_LZMS, },
+};
+
+static const unsigned levels[] = { 20, 50, 100 };
+
+struct chunk {
+	void *data;
+	size_t size;
+};
+
+static struct chunk *chunks;
+static size_t num_chunks;
+static unsigned long long total_size;
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double
+mb_per_sec(unsigned long long bytes, unsigned long long ns)
+{
+	return (double)bytes / (1 << 20) / ((double)ns / 1000000000);
+}
+
+static int
+load_file(const char *path, size_t chunk_size)
+{
+	FILE *fp = fopen(path, "rb");
+	int ret = 0;
+
+	if (!fp) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	for (;;) {
+		struct chunk *new_chunks;
+		void *data = malloc(chunk_size);
+		size_t n;
+
+		if (!data) {
+			ret = -1;
+			break;
+		}
+		n = fread(data, 1, chunk_size, fp);
+		if (n == 0) {
+			free(data);
+			break;
+		}
+		new_chunks = realloc(chunks, (num_chunks + 1) * sizeof(chunks[0]));
+		if (!new_chunks) {
+			free(data);
+			ret = -1;
+			break;
+		}
+		chunks = new_chunks;
+		chunks[num_chunks].data = data;
+		chunks[num_chunks].size = n;
+		num_chunks++;
+		total_size += n;
+		if (n < chunk_size)
+			break;
+	}
+	if (ferror(fp)) {
+		fprintf(stderr, "%s: read error\n", path);
+		ret = -1;
+	}
+	fclose(fp);
+	return ret;
+}
+
+static int
+bench_matchfinder(int i, size_t chunk_size, unsigned nice_len, unsigned depth)
+{
+	unsigned long long num_matches = 0, total_len = 0;
+	unsigned long long t = now_ns();
+
+	for (size_t j = 0; j < num_chunks; j++) {
+		uint64_t n, len;
+		int ret = wimlib_run_matchfinder(matchfinders[i].matchfinder,
+						 chunks[j].data, chunks[j].size,
+						 nice_len, depth, &n, &len);
+		if (ret) {
+			fprintf(stderr, "%s failed: %s\n", matchfinders[i].name,
+				wimlib_get_error_string(ret));
+			return -1;
+		}
+		num_matches += n;
+		total_len += len;
+	}
+	t = now_ns() - t;
+	printf("%-18s %8.1f MB/s %8.2f Mmatches/s %6.2f matches/byte "
+	       "avg len %6.1f  memory %llu\n",
+	       matchfinders[i].name, mb_per_sec(total_size, t),
+	       num_matches / ((double)t / 1000)  /* per us = M per s */,
+	       (double)num_matches / total_size,
+	       num_matches ? (double)total_len / num_matches : 0.0,
+	       (unsigned long long)wimlib_get_matchfinder_needed_memory(
+				matchfinders[i].matchfinder, chunk_size));
+	return 0;
+}
+
+static int
+bench_compressor(int i, unsigned level, size_t chunk_size, void *cdata)
+{
+	struct wimlib_compressor *c;
+	unsigned long long csize = 0;
+	unsigned long long t;
+	int ret;
+
+	ret = wimlib_create_compressor(ctypes[i].ctype, chunk_size, level, &c);
+	if (ret) {
+		printf("%-6s level %3u: %s\n", ctypes[i].name, level,
+		       wimlib_get_error_string(ret));
+		return 0;
+	}
+	t = now_ns();
+	for (size_t j = 0; j < num_chunks; j++) {
+		size_t n = wimlib_compress(chunks[j].data, chunks[j].size,
+					   cdata, chunks[j].size - 1, c);
+		csize += n ? n : chunks[j].size;
+	}
+	t = now_ns() - t;
+	wimlib_free_compressor(c);
+	printf("%-6s level %3u: %llu => %llu bytes (%.3f%%) at %.1f MB/s\n",
+	       ctypes[i].name, level, total_size, csize,
+	       100.0 * csize / total_size, mb_per_sec(total_size, t));
+	return 0;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"Usage: matchbench [-c CHUNK_SIZE] [-n NICE_LEN] [-d MAX_SEARCH_DEPTH] FILE...\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t chunk_size = 1 << 15;
+	unsigned nice_len = 64;
+	unsigned depth = 50;
+	void *cdata = NULL;
+	int opt;
+	int ret = 0;
+
+	while ((opt = getopt(argc, argv, "c:n:d:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			chunk_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nice_len = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (optind >= argc || chunk_size == 0) {
+		usage();
+		return 2;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (load_file(argv[i], chunk_size)) {
+			ret = 1;
+			goto out;
+		}
+	}
+	if (total_size == 0)
+		goto out;
+
+	printf("%zu chunks of up to %zu bytes, %llu bytes total\n",
+	       num_chunks, chunk_size, total_size);
+	printf("Matchfinders (nice_len=%u, max_search_depth=%u):\n",
+	       nice_len, depth);
+	for (int i = 0; i < (int)(sizeof(matchfinders) / sizeof(matchfinders[0])); i++) {
+		if (bench_matchfinder(i, chunk_size, nice_len, depth)) {
+			ret = 1;
+			goto out;
+		}
+	}
+
+	cdata = malloc(chunk_size);
+	if (!cdata) {
+		ret = 1;
+		goto out;
+	}
+	printf("Compressors:\n");
+	for (int i = 0; i < (int)(sizeof(ctypes) / sizeof(ctypes[0])); i++)
+		for (int j = 0; j < (int)(sizeof(levels) / sizeof(levels[0])); j++)
+			bench_compressor(i, levels[j], chunk_size, cdata);
+out:
+	free(cdata);
+	for (size_t i = 0; i < num_chunks; i++)
+		free(chunks[i].data);
+	free(chunks);
+	return ret;
+}
@@ -0,0 +1,135 @@
+/*
+ * sha1bench.c - Check and benchmark the multi-buffer SHA-1 implementation
+ */
+
+/*
+ * Copyright 2023 Eric Biggers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This program is built directly from the library's SHA-1 source files, since
+ * the SHA-1 functions are not part of the library's API.  For each of several
+ * message sizes, it hashes a batch of random messages one at a time with
+ * sha1(), and all at once with sha1_multi(), then checks that the results are
+ * the same and prints the throughput of each.
+ *
+ * CPU features can be disabled with the WIMLIB_DISABLE_CPU_FEATURES
+ * environmental variable, e.g. WIMLIB_DISABLE_CPU_FEATURES=avx512f,avx2 to
+ * benchmark the single-buffer code against itself.  Specific implementations
+ * can be selected with WIMLIB_CPU_FEATURES, e.g.
+ * WIMLIB_CPU_FEATURES=sha1=ssse3,sha1_multi=avx2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wimlib/cpu_features.h"
+#include "wimlib/sha1.h"
+
+#define NUM_MSGS	64
+#define TOTAL_BYTES	(256U << 20)
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double
+mb_per_sec(size_t bytes, unsigned long long ns)
+{
+	return (double)bytes / (1 << 20) / ((double)ns / 1000000000);
+}
+
+static int
+bench_size(size_t msg_size, u8 *buf)
+{
+	const void *data[NUM_MSGS];
+	size_t lens[NUM_MSGS];
+	u8 hashes1[NUM_MSGS][SHA1_HASH_SIZE];
+	u8 hashes2[NUM_MSGS][SHA1_HASH_SIZE];
+	size_t iters = TOTAL_BYTES / (NUM_MSGS * msg_size) + 1;
+	unsigned long long t1, t2;
+
+	for (int i = 0; i < NUM_MSGS; i++) {
+		data[i] = buf + i * msg_size;
+		/* Vary the lengths a bit, like file sizes would.  */
+		lens[i] = msg_size - (rand() % (msg_size / 4 + 1));
+	}
+
+	t1 = now_ns();
+	for (size_t it = 0; it < iters; it++)
+		for (int i = 0; i < NUM_MSGS; i++)
+			sha1(data[i], lens[i], hashes1[i]);
+	t1 = now_ns() - t1;
+
+	t2 = now_ns();
+	for (size_t it = 0; it < iters; it++)
+		sha1_multi(data, lens, NUM_MSGS, hashes2);
+	t2 = now_ns() - t2;
+
+	if (memcmp(hashes1, hashes2, sizeof(hashes1)) != 0) {
+		fprintf(stderr, "sha1_multi() gave wrong results for "
+			"messages of up to %zu bytes!\n", msg_size);
+		return 1;
+	}
+
+	size_t bytes = 0;
+	for (int i = 0; i < NUM_MSGS; i++)
+		bytes += lens[i];
+	bytes *= iters;
+
+	printf("%8zu bytes: sha1() %8.1f MB/s, sha1_multi() %8.1f MB/s\n",
+	       msg_size, mb_per_sec(bytes, t1), mb_per_sec(bytes, t2));
+	return 0;
+}
+
+int
+main(void)
+{
+	static const size_t sizes[] = { 64, 1000, 4096, 16384, 65536, 1 << 20 };
+	size_t max_size = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+	u8 *buf;
+	int ret = 0;
+
+	init_cpu_features();
+	resolve_cpu_kernel(&sha1_blocks_kernel);
+	resolve_cpu_kernel(&sha1_blocks_multi_kernel);
+
+	buf = malloc(NUM_MSGS * max_size);
+	if (!buf) {
+		fprintf(stderr, "Out of memory!\n");
+		return 1;
+	}
+	srand(0);
+	for (size_t i = 0; i < NUM_MSGS * max_size; i++)
+		buf[i] = rand();
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		ret |= bench_size(sizes[i], buf);
+
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,1040 @@
+/*
+ * test-lib.c - Regression tests which call the library directly
+ *
+ * Unlike the test-imagex scripts, these tests use parts of the API that
+ * wimlib-imagex can't reach, e.g. providing a WIM file through callbacks which
+ * fail on purpose.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wimlib.h"
+
+/* Number of threads to use in the library's thread pool.  This is more than
+ * most test machines have CPUs, so that the parallel code paths are taken
+ * regardless.  */
+#define NUM_THREADS	8
+
+static char tmpdir[] = "test-lib.XXXXXX";
+
+static void __attribute__((noreturn, format(printf, 1, 2)))
+fail(const char *format, ...)
+{
+	va_list va;
+
+	va_start(va, format);
+	fputs("test-lib: ", stderr);
+	vfprintf(stderr, format, va);
+	fputc('\n', stderr);
+	va_end(va);
+	exit(1);
+}
+
+#define CHECK_RET(expr)							\
+do {									\
+	int ret_ = (expr);						\
+	if (ret_ != 0)							\
+		fail("%s failed: %s", #expr,				\
+		     wimlib_get_error_string(ret_));			\
+} while (0)
+
+static uint32_t rand_state = 1;
+
+static uint32_t
+rand32(void)
+{
+	/* A simple linear congruential generator  */
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 8;
+}
+
+/* Fill @buf with data which compresses somewhat, but not too well.  */
+static void
+fill_with_test_data(uint8_t *buf, size_t size)
+{
+	size_t i = 0;
+
+	while (i < size) {
+		if (i >= 64 && rand32() % 4 == 0) {
+			/* Repeat some earlier data.  */
+			size_t dist = 1 + rand32() % (i < 65536 ? i : 65536);
+			size_t len = 3 + rand32() % 60;
+
+			for (; len && i < size; len--, i++)
+				buf[i] = buf[i - dist];
+		} else {
+			buf[i++] = 'a' + rand32() % 26;
+		}
+	}
+}
+
+static char *
+tmp_path(const char *name)
+{
+	static char path[256];
+
+	snprintf(path, sizeof(path), "%s/%s", tmpdir, name);
+	return path;
+}
+
+static void
+write_file(const char *path, const void *data, size_t size)
+{
+	FILE *fp = fopen(path, "wb");
+
+	if (!fp || fwrite(data, 1, size, fp) != size || fclose(fp))
+		fail("can't write \"%s\": %s", path, strerror(errno));
+}
+
+static uint8_t *
+read_file(const char *path, size_t *size_ret)
+{
+	FILE *fp = fopen(path, "rb");
+	uint8_t *data;
+	long size;
+
+	if (!fp || fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 ||
+	    fseek(fp, 0, SEEK_SET))
+		fail("can't read \"%s\": %s", path, strerror(errno));
+	data = malloc(size);
+	if (!data || fread(data, 1, size, fp) != (size_t)size)
+		fail("can't read \"%s\"", path);
+	fclose(fp);
+	*size_ret = size;
+	return data;
+}
+
+/*----------------------------------------------------------------------------*
+ *           Read errors while chunks are decompressed in parallel            *
+ *----------------------------------------------------------------------------*/
+
+/* A WIM file in memory, provided through wimlib_open_wim_with_io(), whose reads
+ * of the region [fail_start, fail_end) fail once @reads_until_failure of them
+ * have succeeded.  */
+struct failing_wim {
+	const uint8_t *data;
+	uint64_t size;
+	uint64_t fail_start;
+	uint64_t fail_end;
+	int reads_until_failure;
+};
+
+static int
+failing_wim_read_at(void *ctx, void *buf, size_t size, uint64_t offset)
+{
+	struct failing_wim *f = ctx;
+
+	if (offset > f->size || size > f->size - offset)
+		return -1;
+	if (offset < f->fail_end && offset + size > f->fail_start &&
+	    f->reads_until_failure-- <= 0) {
+		errno = EIO;
+		return -1;
+	}
+	memcpy(buf, f->data + offset, size);
+	return 0;
+}
+
+/* Find the largest resource, whose chunks are read in parallel.  */
+static int
+find_largest_resource(const struct wimlib_resource_entry *entry, void *ctx)
+{
+	struct failing_wim *f = ctx;
+
+	if (!entry->is_metadata &&
+	    entry->compressed_size > f->fail_end - f->fail_start) {
+		f->fail_start = entry->offset;
+		f->fail_end = entry->offset + entry->compressed_size;
+	}
+	return 0;
+}
+
+static WIMStruct *
+open_failing_wim(struct failing_wim *f)
+{
+	struct wimlib_io_provider io = {
+		.read_at = failing_wim_read_at,
+		.size = f->size,
+		.ctx = f,
+	};
+	WIMStruct *wim;
+
+	CHECK_RET(wimlib_open_wim_with_io(&io, 0, &wim, NULL, NULL));
+	CHECK_RET(wimlib_set_decompression_threads(wim, NUM_THREADS));
+	return wim;
+}
+
+static void
+check_read_error(int ret, const char *operation, int reads_until_failure)
+{
+	if (ret != WIMLIB_ERR_READ)
+		fail("%s with a read error after %d reads returned %d (%s), "
+		     "not WIMLIB_ERR_READ", operation, reads_until_failure,
+		     ret, wimlib_get_error_string(ret));
+}
+
+static void
+test_read_error_during_parallel_decompression(void)
+{
+	static const int reads_until_failure[] = { 0, 1, 17, 40 };
+	const size_t file_size = 4 << 20;
+	uint8_t *file_data = malloc(file_size);
+	struct failing_wim f = {};
+	uint8_t *wim_data;
+	size_t wim_size;
+	WIMStruct *wim;
+
+	if (!file_data)
+		fail("out of memory");
+	fill_with_test_data(file_data, file_size);
+	if (mkdir(tmp_path("src"), 0755))
+		fail("can't create directory: %s", strerror(errno));
+	write_file(tmp_path("src/file"), file_data, file_size);
+	free(file_data);
+
+	CHECK_RET(wimlib_create_new_wim(WIMLIB_COMPRESSION_TYPE_LZX, &wim));
+	CHECK_RET(wimlib_add_image(wim, tmp_path("src"), NULL, NULL, 0));
+	CHECK_RET(wimlib_write(wim, tmp_path("src.wim"), WIMLIB_ALL_IMAGES,
+			       0, 0));
+	wimlib_free(wim);
+
+	wim_data = read_file(tmp_path("src.wim"), &wim_size);
+	f.data = wim_data;
+	f.size = wim_size;
+
+	wim = open_failing_wim(&f);
+	CHECK_RET(wimlib_iterate_lookup_table(wim, 0, find_largest_resource,
+					      &f));
+	wimlib_free(wim);
+	if (f.fail_end == 0)
+		fail("no file resource found");
+
+	for (size_t i = 0; i < sizeof(reads_until_failure) /
+			       sizeof(reads_until_failure[0]); i++) {
+		int n = reads_until_failure[i];
+
+		wim = open_failing_wim(&f);
+		f.reads_until_failure = n;
+		check_read_error(wimlib_extract_image(wim, 1, tmp_path("out"),
+						      0),
+				 "wimlib_extract_image()", n);
+		f.reads_until_failure = n;
+		check_read_error(wimlib_verify_wim(wim, 0),
+				 "wimlib_verify_wim()", n);
+		/* Change the compression type, so that the data is really
+		 * decompressed and compressed again.  */
+		CHECK_RET(wimlib_set_output_compression_type(
+				wim, WIMLIB_COMPRESSION_TYPE_XPRESS));
+		f.reads_until_failure = n;
+		check_read_error(wimlib_write(wim, tmp_path("out.wim"),
+					      WIMLIB_ALL_IMAGES,
+					      WIMLIB_WRITE_FLAG_RECOMPRESS,
+					      NUM_THREADS),
+				 "recompressing wimlib_write()", n);
+		wimlib_free(wim);
+	}
+	free(wim_data);
+}
+
+/*----------------------------------------------------------------------------*
+ *              Compressing segments of one buffer in parallel                *
+ *----------------------------------------------------------------------------*/
+
+static void
+test_parallel_lzx_round_trip(void)
+{
+	/* 512 KiB is the smallest size that is split into segments; 700001
+	 * gives segments of odd sizes; 2 MiB is the largest LZX buffer.  */
+	static const size_t sizes[] = { 524288, 2097152, 700001 };
+	static const unsigned levels[] = { 0, 100 };
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		const size_t size = sizes[i];
+		uint8_t *in = malloc(size);
+		uint8_t *cbuf = malloc(size);
+		uint8_t *out = malloc(size);
+		struct wimlib_decompressor *d;
+
+		if (!in || !cbuf || !out)
+			fail("out of memory");
+		CHECK_RET(wimlib_create_decompressor(WIMLIB_COMPRESSION_TYPE_LZX,
+						     size, &d));
+		for (size_t j = 0; j < sizeof(levels) / sizeof(levels[0]); j++) {
+			struct wimlib_compressor *c;
+
+			CHECK_RET(wimlib_create_compressor(
+					WIMLIB_COMPRESSION_TYPE_LZX, size,
+					levels[j] |
+					WIMLIB_COMPRESSOR_FLAG_PARALLEL, &c));
+			/* Compress more than one buffer with the compressor,
+			 * so that its helpers get reused.  */
+			for (int k = 0; k < 3; k++) {
+				size_t csize;
+
+				fill_with_test_data(in, size);
+				csize = wimlib_compress(in, size, cbuf, size - 1,
+							c);
+				if (csize == 0)
+					fail("%zu bytes didn't compress", size);
+				if (wimlib_decompress(cbuf, csize, out, size, d))
+					fail("%zu bytes compressed in parallel "
+					     "can't be decompressed", size);
+				if (memcmp(in, out, size))
+					fail("%zu bytes compressed in parallel "
+					     "decompressed incorrectly", size);
+			}
+			wimlib_free_compressor(c);
+		}
+		wimlib_free_decompressor(d);
+		free(out);
+		free(cbuf);
+		free(in);
+	}
+}
+
+/*----------------------------------------------------------------------------*
+ *                 Compressing and decompressing in batches                   *
+ *----------------------------------------------------------------------------*/
+
+#define BATCH_NUM_ITEMS		64
+#define BATCH_MAX_SIZE		32768
+
+static void
+test_codec_batches(void)
+{
+	static const enum wimlib_compression_type ctypes[] = {
+		WIMLIB_COMPRESSION_TYPE_XPRESS,
+		WIMLIB_COMPRESSION_TYPE_LZX,
+		WIMLIB_COMPRESSION_TYPE_LZMS,
+	};
+	uint8_t *in = malloc(BATCH_NUM_ITEMS * BATCH_MAX_SIZE);
+	uint8_t *cbuf = malloc(BATCH_NUM_ITEMS * BATCH_MAX_SIZE);
+	uint8_t *expected = malloc(BATCH_MAX_SIZE);
+	uint8_t *out = malloc(BATCH_NUM_ITEMS * BATCH_MAX_SIZE);
+	struct wimlib_codec_batch_item items[BATCH_NUM_ITEMS];
+	size_t sizes[BATCH_NUM_ITEMS];
+
+	if (!in || !cbuf || !expected || !out)
+		fail("out of memory");
+
+	/* Items of various sizes, some of them random so that they don't
+	 * compress, and some with too little space for the compressed data  */
+	for (size_t i = 0; i < BATCH_NUM_ITEMS; i++) {
+		uint8_t *data = &in[i * BATCH_MAX_SIZE];
+
+		sizes[i] = (i % 8 == 0) ? BATCH_MAX_SIZE :
+			   1 + rand32() % BATCH_MAX_SIZE;
+		if (i % 7 == 3) {
+			for (size_t j = 0; j < sizes[i]; j++)
+				data[j] = rand32();
+		} else {
+			fill_with_test_data(data, sizes[i]);
+		}
+	}
+
+	for (size_t t = 0; t < sizeof(ctypes) / sizeof(ctypes[0]); t++) {
+		struct wimlib_compressor *c;
+		struct wimlib_decompressor *d;
+		size_t num_compressed = 0;
+
+		CHECK_RET(wimlib_create_compressor(ctypes[t], BATCH_MAX_SIZE,
+						   0, &c));
+		CHECK_RET(wimlib_create_decompressor(ctypes[t], BATCH_MAX_SIZE,
+						     &d));
+		for (size_t i = 0; i < BATCH_NUM_ITEMS; i++) {
+			items[i].in_data = &in[i * BATCH_MAX_SIZE];
+			items[i].in_size = sizes[i];
+			items[i].out_data = &cbuf[i * BATCH_MAX_SIZE];
+			items[i].out_size = (i % 5 == 4) ? sizes[i] / 8 :
+					    sizes[i] - 1;
+			items[i].result = 12345;
+		}
+		CHECK_RET(wimlib_compress_batch(items, BATCH_NUM_ITEMS,
+						NUM_THREADS, c));
+
+		/* The result must be what compressing each item by itself
+		 * gives, byte for byte.  */
+		for (size_t i = 0; i < BATCH_NUM_ITEMS; i++) {
+			size_t csize = wimlib_compress(items[i].in_data,
+						       items[i].in_size,
+						       expected,
+						       items[i].out_size, c);
+
+			if (items[i].result != csize ||
+			    memcmp(items[i].out_data, expected, csize))
+				fail("batch compression of item %zu (ctype %d) "
+				     "differs from wimlib_compress()", i,
+				     ctypes[t]);
+			if (csize)
+				num_compressed++;
+		}
+		if (num_compressed == 0 || num_compressed == BATCH_NUM_ITEMS)
+			fail("batch compression test data is unsuitable");
+
+		/* Decompress the items which compressed.  */
+		for (size_t i = 0, j = 0; i < BATCH_NUM_ITEMS; i++) {
+			if (items[i].result == 0)
+				continue;
+			items[j].in_data = &cbuf[i * BATCH_MAX_SIZE];
+			items[j].in_size = items[i].result;
+			items[j].out_data = &out[i * BATCH_MAX_SIZE];
+			items[j].out_size = sizes[i];
+			items[j].result = 12345;
+			j++;
+		}
+		CHECK_RET(wimlib_decompress_batch(items, num_compressed,
+						  NUM_THREADS, d));
+		for (size_t j = 0; j < num_compressed; j++) {
+			size_t i = ((const uint8_t *)items[j].out_data - out) /
+				   BATCH_MAX_SIZE;
+
+			if (items[j].result != 0 ||
+			    memcmp(items[j].out_data, &in[i * BATCH_MAX_SIZE],
+				   sizes[i]))
+				fail("batch decompression of item %zu "
+				     "(ctype %d) failed", i, ctypes[t]);
+		}
+		wimlib_free_decompressor(d);
+		wimlib_free_compressor(c);
+	}
+	free(out);
+	free(expected);
+	free(cbuf);
+	free(in);
+}
+
+/*----------------------------------------------------------------------------*
+ *                    Incremental decompression of chunks                     *
+ *----------------------------------------------------------------------------*/
+
+#define CHUNKED_CHUNK_SIZE	32768
+#define CHUNKED_NUM_CHUNKS	9
+#define CHUNKED_USIZE		((CHUNKED_NUM_CHUNKS - 1) * CHUNKED_CHUNK_SIZE + 1234)
+#define CHUNKED_TABLE_SIZE	((CHUNKED_NUM_CHUNKS - 1) * 4)
+
+static void
+set_chunk_table_entry(uint8_t *cbuf, size_t idx, uint32_t value)
+{
+	cbuf[idx * 4 + 0] = value;
+	cbuf[idx * 4 + 1] = value >> 8;
+	cbuf[idx * 4 + 2] = value >> 16;
+	cbuf[idx * 4 + 3] = value >> 24;
+}
+
+/* Fill @in with test data, and compress it in the chunked format into @cbuf,
+ * which must have room for CHUNKED_TABLE_SIZE + CHUNKED_USIZE bytes.  Chunk 2
+ * and the last chunk are random, so they are stored uncompressed.  Returns the
+ * compressed size.  */
+static size_t
+make_chunked_data(uint8_t *in, uint8_t *cbuf)
+{
+	struct wimlib_compressor *c;
+	size_t offset = 0;
+
+	fill_with_test_data(in, CHUNKED_USIZE);
+	for (size_t i = 2 * CHUNKED_CHUNK_SIZE; i < 3 * CHUNKED_CHUNK_SIZE; i++)
+		in[i] = rand32();
+	for (size_t i = (CHUNKED_NUM_CHUNKS - 1) * CHUNKED_CHUNK_SIZE;
+	     i < CHUNKED_USIZE; i++)
+		in[i] = rand32();
+
+	CHECK_RET(wimlib_create_compressor(WIMLIB_COMPRESSION_TYPE_LZX,
+					   CHUNKED_CHUNK_SIZE, 0, &c));
+	for (size_t i = 0; i < CHUNKED_NUM_CHUNKS; i++) {
+		const uint8_t *chunk = &in[i * CHUNKED_CHUNK_SIZE];
+		uint8_t *out = &cbuf[CHUNKED_TABLE_SIZE + offset];
+		size_t usize = CHUNKED_CHUNK_SIZE;
+		size_t csize;
+
+		if (i == CHUNKED_NUM_CHUNKS - 1)
+			usize = CHUNKED_USIZE - i * CHUNKED_CHUNK_SIZE;
+		csize = wimlib_compress(chunk, usize, out, usize - 1, c);
+		if (csize == 0) {
+			if (i != 2 && i != CHUNKED_NUM_CHUNKS - 1)
+				fail("chunk %zu didn't compress", i);
+			memcpy(out, chunk, usize);
+			csize = usize;
+		} else if (i == 2 || i == CHUNKED_NUM_CHUNKS - 1) {
+			fail("random chunk %zu compressed", i);
+		}
+		offset += csize;
+		if (i != CHUNKED_NUM_CHUNKS - 1)
+			set_chunk_table_entry(cbuf, i, offset);
+	}
+	wimlib_free_compressor(c);
+	return CHUNKED_TABLE_SIZE + offset;
+}
+
+/* Decompress @csize bytes of chunked data from @cbuf into @out, passing the
+ * input and output in pieces of random sizes from 1 to 7000 bytes.  Returns the
+ * result of the decompression, and the amount of data written in
+ * *out_pos_ret.  */
+static int
+chunked_decompress_in_pieces(const uint8_t *cbuf, size_t csize,
+			     uint8_t *out, size_t *out_pos_ret)
+{
+	struct wimlib_chunked_decompressor *cd;
+	size_t in_pos = 0;
+	size_t out_pos = 0;
+	int ret;
+
+	CHECK_RET(wimlib_create_chunked_decompressor(WIMLIB_COMPRESSION_TYPE_LZX,
+						     CHUNKED_CHUNK_SIZE, csize,
+						     CHUNKED_USIZE, &cd));
+	do {
+		size_t in_size = 1 + rand32() % 7000;
+		size_t out_size = 1 + rand32() % 7000;
+		size_t in_used, out_written;
+
+		if (in_size > csize - in_pos)
+			in_size = csize - in_pos;
+		if (out_size > CHUNKED_USIZE - out_pos)
+			out_size = CHUNKED_USIZE - out_pos;
+		ret = wimlib_chunked_decompress(cd, &cbuf[in_pos], in_size,
+						&in_used, &out[out_pos],
+						out_size, &out_written);
+		if (in_used > in_size || out_written > out_size)
+			fail("chunked decompressor used too much space");
+		if (!ret && in_used == 0 && out_written == 0 && in_pos == csize)
+			fail("chunked decompressor wants more input than exists");
+		in_pos += in_used;
+		out_pos += out_written;
+	} while (!ret && out_pos != CHUNKED_USIZE);
+
+	wimlib_free_chunked_decompressor(cd);
+	*out_pos_ret = out_pos;
+	return ret;
+}
+
+static void
+test_chunked_decompression(void)
+{
+	uint8_t *in = malloc(CHUNKED_USIZE);
+	uint8_t *cbuf = malloc(CHUNKED_TABLE_SIZE + CHUNKED_USIZE);
+	uint8_t *bad = malloc(CHUNKED_TABLE_SIZE + CHUNKED_USIZE);
+	uint8_t *out = malloc(CHUNKED_USIZE);
+	struct wimlib_chunked_decompressor *cd;
+	size_t csize, in_used, out_written;
+
+	if (!in || !cbuf || !bad || !out)
+		fail("out of memory");
+	csize = make_chunked_data(in, cbuf);
+
+	/* Round trip, including the uncompressed chunks  */
+	for (int i = 0; i < 20; i++) {
+		memset(out, 0, CHUNKED_USIZE);
+		CHECK_RET(chunked_decompress_in_pieces(cbuf, csize, out,
+						       &out_written));
+		if (memcmp(in, out, CHUNKED_USIZE))
+			fail("chunked data decompressed incorrectly");
+	}
+
+	/* A compressed size too small to hold the chunk table  */
+	if (wimlib_create_chunked_decompressor(WIMLIB_COMPRESSION_TYPE_LZX,
+					       CHUNKED_CHUNK_SIZE,
+					       CHUNKED_TABLE_SIZE - 1,
+					       CHUNKED_USIZE, &cd) !=
+	    WIMLIB_ERR_INVALID_PARAM)
+		fail("chunked decompressor accepted a truncated chunk table");
+
+	/* Input which ends in the middle of the chunk table  */
+	CHECK_RET(wimlib_create_chunked_decompressor(WIMLIB_COMPRESSION_TYPE_LZX,
+						     CHUNKED_CHUNK_SIZE, csize,
+						     CHUNKED_USIZE, &cd));
+	CHECK_RET(wimlib_chunked_decompress(cd, cbuf, CHUNKED_TABLE_SIZE - 3,
+					    &in_used, out, CHUNKED_USIZE,
+					    &out_written));
+	if (in_used != CHUNKED_TABLE_SIZE - 3 || out_written != 0)
+		fail("partial chunk table was handled incorrectly");
+	wimlib_free_chunked_decompressor(cd);
+
+	/* A chunk offset beyond the end of the data: the chunks before it must
+	 * still be written.  */
+	memcpy(bad, cbuf, csize);
+	set_chunk_table_entry(bad, 4, csize - CHUNKED_TABLE_SIZE + 1);
+	if (chunked_decompress_in_pieces(bad, csize, out, &out_written) !=
+	    WIMLIB_ERR_DECOMPRESSION)
+		fail("out-of-range chunk offset was accepted");
+	if (out_written != 4 * CHUNKED_CHUNK_SIZE || memcmp(in, out, out_written))
+		fail("data before an out-of-range chunk offset was lost");
+
+	/* A chunk offset which doesn't increase  */
+	memcpy(bad, cbuf, csize);
+	set_chunk_table_entry(bad, 1, bad[0] | (bad[1] << 8) |
+				      (bad[2] << 16) | ((uint32_t)bad[3] << 24));
+	if (chunked_decompress_in_pieces(bad, csize, out, &out_written) !=
+	    WIMLIB_ERR_DECOMPRESSION)
+		fail("non-increasing chunk offset was accepted");
+	if (out_written != CHUNKED_CHUNK_SIZE || memcmp(in, out, out_written))
+		fail("data before a non-increasing chunk offset was lost");
+
+	free(out);
+	free(bad);
+	free(cbuf);
+	free(in);
+}
+
+/*----------------------------------------------------------------------------*
+ *                Using a WIMStruct after a safe compaction                   *
+ *----------------------------------------------------------------------------*/
+
+/* Write a file of @size bytes of test data, and return the data.  */
+static uint8_t *
+make_test_file(const char *name, size_t size)
+{
+	uint8_t *data = malloc(size);
+
+	if (!data)
+		fail("out of memory");
+	fill_with_test_data(data, size);
+	write_file(tmp_path(name), data, size);
+	return data;
+}
+
+static void
+check_file_contents(const char *name, const uint8_t *expected, size_t size)
+{
+	size_t actual_size;
+	uint8_t *actual = read_file(tmp_path(name), &actual_size);
+
+	if (actual_size != size || memcmp(actual, expected, size))
+		fail("\"%s\" has the wrong contents", name);
+	free(actual);
+}
+
+static void
+test_safe_compact_keeps_handle_usable(void)
+{
+	const size_t size1 = 3 << 20, size2 = 1 << 20;
+	uint8_t *data1, *data2;
+	WIMStruct *wim;
+
+	if (mkdir(tmp_path("compact1"), 0755) ||
+	    mkdir(tmp_path("compact2"), 0755))
+		fail("can't create directory: %s", strerror(errno));
+	data1 = make_test_file("compact1/file", size1);
+	data2 = make_test_file("compact2/file", size2);
+
+	CHECK_RET(wimlib_create_new_wim(WIMLIB_COMPRESSION_TYPE_XPRESS, &wim));
+	CHECK_RET(wimlib_add_image(wim, tmp_path("compact1"), "1", NULL, 0));
+	CHECK_RET(wimlib_add_image(wim, tmp_path("compact2"), "2", NULL, 0));
+	CHECK_RET(wimlib_write(wim, tmp_path("compact.wim"), WIMLIB_ALL_IMAGES,
+			       0, 0));
+	wimlib_free(wim);
+
+	/* Deleting the first image leaves a hole at the start of the file, so
+	 * the compaction moves the second image's resources.  */
+	CHECK_RET(wimlib_open_wim(tmp_path("compact.wim"), 0, &wim));
+	CHECK_RET(wimlib_delete_image(wim, 1));
+	CHECK_RET(wimlib_overwrite(wim, WIMLIB_WRITE_FLAG_SAFE_COMPACT, 1));
+	CHECK_RET(wimlib_extract_image(wim, 1, tmp_path("compact_out1"), 0));
+	check_file_contents("compact_out1/file", data2, size2);
+
+	/* Appending to the file again must use the compacted file's tables.  */
+	CHECK_RET(wimlib_add_image(wim, tmp_path("compact1"), "3", NULL, 0));
+	CHECK_RET(wimlib_overwrite(wim, 0, 1));
+	wimlib_free(wim);
+
+	CHECK_RET(wimlib_open_wim(tmp_path("compact.wim"), 0, &wim));
+	CHECK_RET(wimlib_verify_wim(wim, 0));
+	CHECK_RET(wimlib_extract_image(wim, 1, tmp_path("compact_out2"), 0));
+	CHECK_RET(wimlib_extract_image(wim, 2, tmp_path("compact_out3"), 0));
+	wimlib_free(wim);
+	check_file_contents("compact_out2/file", data2, size2);
+	check_file_contents("compact_out3/file", data1, size1);
+	free(data2);
+	free(data1);
+}
+
+/*----------------------------------------------------------------------------*
+ *                    Writing several WIMs at once                            *
+ *----------------------------------------------------------------------------*/
+
+/* Count the temporary files which wimlib_write_multiple() writes the shared
+ * data to, which are named after "multi/out1.wim" plus 9 characters.  */
+static int
+count_pool_files(void)
+{
+	DIR *dir = opendir(tmp_path("multi"));
+	struct dirent *ent;
+	int count = 0;
+
+	if (!dir)
+		fail("can't open directory: %s", strerror(errno));
+	while ((ent = readdir(dir)) != NULL)
+		if (!strncmp(ent->d_name, "out1.wim", 8) &&
+		    strlen(ent->d_name) == 8 + 9)
+			count++;
+	closedir(dir);
+	return count;
+}
+
+static enum wimlib_progress_status
+multiple_write_progress(enum wimlib_progress_msg msg,
+			union wimlib_progress_info *info, void *ctx)
+{
+	if (msg == WIMLIB_PROGRESS_MSG_WRITE_STREAMS && count_pool_files() > 0)
+		*(bool *)ctx = true;
+	return WIMLIB_PROGRESS_STATUS_CONTINUE;
+}
+
+static void
+test_write_multiple(void)
+{
+	static const int modes[] = { 0, WIMLIB_WRITE_FLAG_SOLID };
+	const size_t shared_size = 2 << 20, own_size = 256 << 10;
+	uint8_t *shared, *own[2];
+	WIMStruct *src;
+
+	if (mkdir(tmp_path("multi"), 0755) ||
+	    mkdir(tmp_path("multi_src1"), 0755) ||
+	    mkdir(tmp_path("multi_src2"), 0755))
+		fail("can't create directory: %s", strerror(errno));
+	shared = make_test_file("multi_src1/shared", shared_size);
+	write_file(tmp_path("multi_src2/shared"), shared, shared_size);
+	own[0] = make_test_file("multi_src1/own", own_size);
+	own[1] = make_test_file("multi_src2/own", own_size);
+
+	/* The outputs use a different compression type than the source, so
+	 * that the shared data must be compressed again.  */
+	CHECK_RET(wimlib_create_new_wim(WIMLIB_COMPRESSION_TYPE_XPRESS, &src));
+	CHECK_RET(wimlib_add_image(src, tmp_path("multi_src1"), "1", NULL, 0));
+	CHECK_RET(wimlib_add_image(src, tmp_path("multi_src2"), "2", NULL, 0));
+	CHECK_RET(wimlib_write(src, tmp_path("multi_src.wim"),
+			       WIMLIB_ALL_IMAGES, 0, 0));
+	wimlib_free(src);
+
+	for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		char paths[2][256];
+		const char *path_ptrs[2] = { paths[0], paths[1] };
+		WIMStruct *dst[2];
+		bool saw_pool = false;
+
+		CHECK_RET(wimlib_open_wim(tmp_path("multi_src.wim"), 0, &src));
+		for (int i = 0; i < 2; i++) {
+			CHECK_RET(wimlib_create_new_wim(
+					WIMLIB_COMPRESSION_TYPE_LZX, &dst[i]));
+			CHECK_RET(wimlib_export_image(src, i + 1, dst[i],
+						      NULL, NULL, 0));
+			snprintf(paths[i], sizeof(paths[i]),
+				 "%s/multi/out%d.wim", tmpdir, i + 1);
+			unlink(paths[i]);
+		}
+		wimlib_register_progress_function(dst[0],
+						  multiple_write_progress,
+						  &saw_pool);
+
+		CHECK_RET(wimlib_write_multiple(dst, path_ptrs, 2, modes[m], 0));
+		if (!saw_pool)
+			fail("wimlib_write_multiple() (mode %zu) didn't share "
+			     "any data", m);
+		if (count_pool_files() != 0)
+			fail("wimlib_write_multiple() (mode %zu) left "
+			     "temporary files behind", m);
+
+		for (int i = 0; i < 2; i++) {
+			char name[64];
+			WIMStruct *out;
+
+			CHECK_RET(wimlib_open_wim(paths[i], 0, &out));
+			CHECK_RET(wimlib_verify_wim(out, 0));
+			snprintf(name, sizeof(name), "multi_out%zu_%d", m, i);
+			CHECK_RET(wimlib_extract_image(out, 1, tmp_path(name),
+						       0));
+			wimlib_free(out);
+			snprintf(name, sizeof(name), "multi_out%zu_%d/shared",
+				 m, i);
+			check_file_contents(name, shared, shared_size);
+			snprintf(name, sizeof(name), "multi_out%zu_%d/own",
+				 m, i);
+			check_file_contents(name, own[i], own_size);
+
+			/* The blobs of the handles which were moved to the
+			 * temporary files must have been moved back.  */
+			snprintf(name, sizeof(name), "multi_again%zu_%d", m, i);
+			CHECK_RET(wimlib_extract_image(dst[i], 1,
+						       tmp_path(name), 0));
+			snprintf(name, sizeof(name), "multi_again%zu_%d/shared",
+				 m, i);
+			check_file_contents(name, shared, shared_size);
+			snprintf(name, sizeof(name), "multi_again%zu_%d/own",
+				 m, i);
+			check_file_contents(name, own[i], own_size);
+			CHECK_RET(wimlib_write(dst[i],
+					       tmp_path("multi_again.wim"),
+					       WIMLIB_ALL_IMAGES, 0, 0));
+			wimlib_free(dst[i]);
+			CHECK_RET(wimlib_open_wim(tmp_path("multi_again.wim"),
+						  0, &out));
+			CHECK_RET(wimlib_verify_wim(out, 0));
+			wimlib_free(out);
+			unlink(tmp_path("multi_again.wim"));
+		}
+		wimlib_free(src);
+	}
+	free(own[1]);
+	free(own[0]);
+	free(shared);
+}
+
+/*----------------------------------------------------------------------------*
+ *                Opening a WIM file again after it changed                   *
+ *----------------------------------------------------------------------------*/
+
+static int
+get_image_count(WIMStruct *wim)
+{
+	struct wimlib_wim_info info;
+
+	CHECK_RET(wimlib_get_wim_info(wim, &info));
+	return info.image_count;
+}
+
+static void
+test_open_wim_cache_sees_changes(void)
+{
+	const size_t size1 = 300 << 10, size2 = 200 << 10;
+	uint8_t *data1, *data2;
+	WIMStruct *wim;
+
+	CHECK_RET(wimlib_set_open_wim_cache_size(64 << 20));
+
+	if (mkdir(tmp_path("cached1"), 0755) ||
+	    mkdir(tmp_path("cached2"), 0755))
+		fail("can't create directory: %s", strerror(errno));
+	data1 = make_test_file("cached1/file", size1);
+	data2 = make_test_file("cached2/file", size2);
+
+	CHECK_RET(wimlib_create_new_wim(WIMLIB_COMPRESSION_TYPE_XPRESS, &wim));
+	CHECK_RET(wimlib_add_image(wim, tmp_path("cached1"), "1", NULL, 0));
+	CHECK_RET(wimlib_write(wim, tmp_path("cached.wim"), WIMLIB_ALL_IMAGES,
+			       0, 0));
+	wimlib_free(wim);
+
+	/* Fill the cache with the file's metadata.  */
+	CHECK_RET(wimlib_open_wim(tmp_path("cached.wim"), 0, &wim));
+	if (get_image_count(wim) != 1)
+		fail("wrong image count in the new WIM file");
+	CHECK_RET(wimlib_extract_image(wim, 1, tmp_path("cached_out1"), 0));
+	check_file_contents("cached_out1/file", data1, size1);
+
+	/* Append an image through the same WIMStruct.  */
+	CHECK_RET(wimlib_add_image(wim, tmp_path("cached2"), "2", NULL, 0));
+	CHECK_RET(wimlib_overwrite(wim, 0, 0));
+	wimlib_free(wim);
+
+	/* Opening the file again must not use the stale cached data.  */
+	CHECK_RET(wimlib_open_wim(tmp_path("cached.wim"), 0, &wim));
+	if (get_image_count(wim) != 2)
+		fail("the open WIM cache hid an appended image");
+	CHECK_RET(wimlib_verify_wim(wim, 0));
+	CHECK_RET(wimlib_extract_image(wim, 1, tmp_path("cached_out2"), 0));
+	CHECK_RET(wimlib_extract_image(wim, 2, tmp_path("cached_out3"), 0));
+	wimlib_free(wim);
+	check_file_contents("cached_out2/file", data1, size1);
+	check_file_contents("cached_out3/file", data2, size2);
+
+	/* Replace the file with an uncompressed WIM twice.  The second time,
+	 * the resources have the same offsets and sizes as before, so only the
+	 * state of the file tells the old metadata apart from the new.  */
+	for (int i = 0; i < 2; i++) {
+		free(data1);
+		data1 = make_test_file("cached1/file", size1);
+		CHECK_RET(wimlib_create_new_wim(WIMLIB_COMPRESSION_TYPE_NONE,
+						&wim));
+		CHECK_RET(wimlib_add_image(wim, tmp_path("cached1"), "1",
+					   NULL, 0));
+		CHECK_RET(wimlib_write(wim, tmp_path("cached.wim"),
+				       WIMLIB_ALL_IMAGES, 0, 0));
+		wimlib_free(wim);
+
+		CHECK_RET(wimlib_open_wim(tmp_path("cached.wim"), 0, &wim));
+		CHECK_RET(wimlib_extract_image(wim, 1,
+					       tmp_path(i ? "cached_out5" :
+							    "cached_out4"), 0));
+		wimlib_free(wim);
+		check_file_contents(i ? "cached_out5/file" : "cached_out4/file",
+				    data1, size1);
+	}
+
+	CHECK_RET(wimlib_set_open_wim_cache_size(0));
+	free(data2);
+	free(data1);
+}
+
+/*----------------------------------------------------------------------------*
+ *                        Asynchronous operations                             *
+ *----------------------------------------------------------------------------*/
+
+struct async_test_op {
+	WIMStruct *wim;
+	struct wimlib_operation *op;
+	/* Set by the progress function when the operation starts running  */
+	bool started;
+	/* The progress function waits until this is set  */
+	bool released;
+	/* The result passed to the completion function, or -1  */
+	int completion_result;
+};
+
+static bool
+load_flag(const bool *flag)
+{
+	return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+}
+
+static void
+store_flag(bool *flag)
+{
+	__atomic_store_n(flag, true, __ATOMIC_RELEASE);
+}
+
+/* Wait up to 10 seconds for @flag to be set.  */
+static bool
+wait_for_flag(const bool *flag)
+{
+	for (int i = 0; i < 10000 && !load_flag(flag); i++)
+		usleep(1000);
+	return load_flag(flag);
+}
+
+static enum wimlib_progress_status
+async_test_progress(enum wimlib_progress_msg msg,
+		    union wimlib_progress_info *info, void *ctx)
+{
+	struct async_test_op *t = ctx;
+
+	if (!load_flag(&t->started)) {
+		store_flag(&t->started);
+		wait_for_flag(&t->released);
+	}
+	return WIMLIB_PROGRESS_STATUS_CONTINUE;
+}
+
+static void
+async_test_completion(struct wimlib_operation *op, int result, void *ctx)
+{
+	struct async_test_op *t = ctx;
+
+	t->completion_result = result;
+}
+
+static void
+start_async_extraction(struct async_test_op *t, const char *target)
+{
+	t->completion_result = -1;
+	CHECK_RET(wimlib_open_wim(tmp_path("async.wim"), 0, &t->wim));
+	wimlib_register_progress_function(t->wim, async_test_progress, t);
+	CHECK_RET(wimlib_extract_image_async(t->wim, 1, tmp_path(target), 0,
+					     async_test_completion, t,
+					     &t->op));
+}
+
+static void
+test_async_operations(void)
+{
+	struct async_test_op t1 = {}, t2 = {};
+	uint8_t *data;
+	size_t size;
+	WIMStruct *wim;
+	int result;
+
+	if (mkdir(tmp_path("async"), 0755))
+		fail("can't create directory: %s", strerror(errno));
+	free(make_test_file("async/file", 1 << 20));
+	CHECK_RET(wimlib_create_new_wim(WIMLIB_COMPRESSION_TYPE_XPRESS, &wim));
+	CHECK_RET(wimlib_add_image(wim, tmp_path("async"), NULL, NULL, 0));
+	CHECK_RET(wimlib_write(wim, tmp_path("async.wim"), WIMLIB_ALL_IMAGES,
+			       0, 0));
+	wimlib_free(wim);
+
+	/* Two operations submitted back to back must run at the same time,
+	 * since at least two run at once.  The first one waits in its progress
+	 * function until the second one has started.  */
+	start_async_extraction(&t1, "async_out1");
+	start_async_extraction(&t2, "async_out2");
+	if (!wait_for_flag(&t1.started) || !wait_for_flag(&t2.started))
+		fail("the second asynchronous operation didn't start while "
+		     "the first one was running");
+	if (wimlib_poll_operation(t1.op, &result) ||
+	    wimlib_poll_operation(t2.op, &result))
+		fail("an asynchronous operation completed too early");
+	store_flag(&t2.released);
+	store_flag(&t1.released);
+	CHECK_RET(wimlib_wait_operation(t1.op));
+	CHECK_RET(wimlib_wait_operation(t2.op));
+	result = -1;
+	if (!wimlib_poll_operation(t1.op, &result) || result != 0 ||
+	    t1.completion_result != 0 || t2.completion_result != 0)
+		fail("completed asynchronous operations reported the wrong "
+		     "result");
+	wimlib_free_operation(t1.op);
+	wimlib_free_operation(t2.op);
+	wimlib_free(t1.wim);
+	wimlib_free(t2.wim);
+	data = read_file(tmp_path("async/file"), &size);
+	check_file_contents("async_out1/file", data, size);
+	check_file_contents("async_out2/file", data, size);
+	free(data);
+
+	/* Cancel a running operation.  It's aborted at its next progress
+	 * message.  */
+	memset(&t1, 0, sizeof(t1));
+	start_async_extraction(&t1, "async_out3");
+	if (!wait_for_flag(&t1.started))
+		fail("asynchronous operation didn't start");
+	wimlib_cancel_operation(t1.op);
+	store_flag(&t1.released);
+	result = wimlib_wait_operation(t1.op);
+	if (result != WIMLIB_ERR_ABORTED_BY_PROGRESS ||
+	    t1.completion_result != WIMLIB_ERR_ABORTED_BY_PROGRESS)
+		fail("cancelled asynchronous operation returned %d", result);
+	wimlib_free_operation(t1.op);
+	wimlib_free(t1.wim);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void
+delete_tree(const char *path)
+{
+	char cmd[512];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", path);
+	if (system(cmd))
+		fprintf(stderr, "test-lib: can't delete \"%s\"\n", path);
+}
+
+int
+main(void)
+{
+	CHECK_RET(wimlib_global_init(0));
+	CHECK_RET(wimlib_set_thread_pool_size(NUM_THREADS));
+	wimlib_set_print_errors(false);
+	if (!mkdtemp(tmpdir))
+		fail("can't create temporary directory: %s", strerror(errno));
+
+	test_read_error_during_parallel_decompression();
+	test_parallel_lzx_round_trip();
+	test_codec_batches();
+	test_chunked_decompression();
+	test_safe_compact_keeps_handle_usable();
+	test_write_multiple();
+	test_open_wim_cache_sees_changes();
+	test_async_operations();
+
+	delete_tree(tmpdir);
+	wimlib_global_cleanup();
+	return 0;
+}
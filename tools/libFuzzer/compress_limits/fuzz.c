@@ -0,0 +1,92 @@
+#include "../fuzzer.h"
+
+/* Upper bounds, per byte of data, on the CPU time that creating a compressor and
+ * compressing the data may take; and likewise for decompression.  These are far
+ * above the normal speeds so that only superlinear behavior is caught, even
+ * when the library was built with sanitizers.  */
+#define COMPRESS_NS_PER_BYTE	4000
+#define DECOMPRESS_NS_PER_BYTE	400
+#define BASE_NS			100000000
+
+/* How much more memory than wimlib_get_compressor_needed_memory() estimates
+ * compression may use, besides the buffers for all-zero data  */
+#define COMPRESSOR_MEM_SLACK	65536
+
+/*
+ * Check that compressing and decompressing take time and memory linear in the
+ * data size, even for the data which is the worst case for the matchfinders and
+ * parsers, e.g. data that is highly repetitive or that makes hash values
+ * collide.  Since the worst cases tend to need large buffers but libFuzzer's
+ * inputs are small, the input gives the compression type, the compression
+ * level, and the size of the buffer (up to the maximum for the compression type
+ * or 1 MiB, whichever is less), and the rest of it is a pattern which is
+ * repeated to fill the buffer.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *in, size_t insize)
+{
+	int ctype;
+	int level;
+	size_t size;
+	struct wimlib_compressor *c;
+	struct wimlib_decompressor *d;
+	uint8_t *data;
+	uint8_t *cbuf;
+	uint8_t *decompressed;
+	size_t csize;
+	uint64_t needed_mem;
+	int ret;
+
+	if (insize < 5)
+		return 0;
+	ctype = 1 + ((uint8_t)(in[0] - 1) % 3); /* 1-3 */
+	level = 1 + (in[1] % 100); /* 1-100 */
+	size = 1 + (((size_t)in[2] << 16 | in[3] << 8 | in[4]) %
+		    max_buffer_size(ctype));
+	in += 5;
+	insize -= 5;
+
+	data = malloc(size);
+	cbuf = malloc(size);
+	decompressed = malloc(size);
+	if (insize == 0) {
+		memset(data, 0, size);
+	} else {
+		for (size_t i = 0; i < size; i++)
+			data[i] = in[i % insize];
+	}
+
+	needed_mem = wimlib_get_compressor_needed_memory(ctype, size, level);
+	begin_resource_measurement();
+	ret = wimlib_create_compressor(ctype, size, level, &c);
+	if (ret == 0) {
+		csize = wimlib_compress(data, size, cbuf, size, c);
+		/* Besides the compressor itself, compressing all zeroes
+		 * allocates two buffers; see compress_zeroes().  */
+		check_resource_usage("Compression",
+				     BASE_NS + COMPRESS_NS_PER_BYTE * size,
+				     needed_mem + COMPRESSOR_MEM_SLACK +
+				     2 * size);
+		wimlib_free_compressor(c);
+
+		ret = wimlib_create_decompressor(ctype, size, &d);
+		assert(ret == 0);
+		if (csize) {
+			begin_resource_measurement();
+			ret = wimlib_decompress(cbuf, csize,
+						decompressed, size, d);
+			/* Only a copy of the compressed data of an all-zero
+			 * buffer may be allocated; see remember_zero_chunk() */
+			check_resource_usage("Decompression",
+					     BASE_NS +
+					     DECOMPRESS_NS_PER_BYTE * size,
+					     csize);
+			assert(ret == 0);
+			assert(memcmp(data, decompressed, size) == 0);
+		}
+		wimlib_free_decompressor(d);
+	}
+	free(data);
+	free(cbuf);
+	free(decompressed);
+	return 0;
+}
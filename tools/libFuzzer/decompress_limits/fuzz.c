@@ -0,0 +1,50 @@
+#include "../fuzzer.h"
+
+/* Upper bound, per byte of compressed and uncompressed data, on the CPU time
+ * that creating a decompressor and decompressing may take.  This is far above
+ * the normal speed so that only superlinear behavior is caught, even when the
+ * library was built with sanitizers.  */
+#define DECOMPRESS_NS_PER_BYTE	400
+#define BASE_NS			100000000
+
+/* Upper bound on the memory which a decompressor may use, besides a copy of the
+ * compressed data; see remember_zero_chunk().  */
+#define DECOMPRESSOR_MAX_MEM	1048576
+
+/*
+ * Check that decompressing crafted data takes time and memory linear in the
+ * sizes of the compressed and uncompressed data, so that a WIM file can't make
+ * a reader spend much more time on it than it takes to read it.  The input
+ * gives the compression type and the uncompressed size, and the rest of it is
+ * the compressed data.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *in, size_t insize)
+{
+	int ctype;
+	size_t usize;
+	struct wimlib_decompressor *d;
+	uint8_t *out;
+	int ret;
+
+	if (insize < 4)
+		return 0;
+	ctype = 1 + ((uint8_t)(in[0] - 1) % 3); /* 1-3 */
+	usize = 1 + (((size_t)in[1] << 16 | in[2] << 8 | in[3]) %
+		     max_buffer_size(ctype));
+	in += 4;
+	insize -= 4;
+
+	out = malloc(usize);
+	begin_resource_measurement();
+	ret = wimlib_create_decompressor(ctype, usize, &d);
+	if (ret == 0) {
+		wimlib_decompress(in, insize, out, usize, d);
+		check_resource_usage("Decompression",
+				     BASE_NS + DECOMPRESS_NS_PER_BYTE *
+					       (insize + usize),
+				     DECOMPRESSOR_MAX_MEM + insize);
+		wimlib_free_decompressor(d);
+	}
+	free(out);
+	return 0;
+}
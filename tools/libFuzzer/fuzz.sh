@@ -125,12 +125,13 @@ run_cmd make "-j$(getconf _NPROCESSORS_ONLN)"
 cd "$SCRIPTDIR"
 if [ -n "$INPUT" ]; then
 	run_cmd clang -g -O1 -fsanitize=fuzzer-no-link$EXTRA_SANITIZERS -Wall -Werror \
-		-I "$TOPDIR/include" "$TARGET/fuzz.c" test-one-input.c fault-injection.c \
-		"$TOPDIR/.libs/libwim.a" -o test-one-input
+		-I "$TOPDIR/include" "$TARGET/fuzz.c" test-one-input.c \
+		fault-injection.c resource-limits.c "$TOPDIR/.libs/libwim.a" \
+		-o test-one-input
 	run_cmd ./test-one-input "$INPUT"
 else
 	run_cmd clang -g -O1 -fsanitize=fuzzer$EXTRA_SANITIZERS -Wall -Werror \
 		-I "$TOPDIR/include" "$TARGET/fuzz.c" fault-injection.c \
-		"$TOPDIR/.libs/libwim.a" -o "$TARGET/fuzz"
+		resource-limits.c "$TOPDIR/.libs/libwim.a" -o "$TARGET/fuzz"
 	run_cmd "$TARGET/fuzz" "${EXTRA_FUZZER_ARGS[@]}" "$TARGET/corpus"
 fi
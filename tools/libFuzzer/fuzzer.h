@@ -11,3 +11,16 @@
 
 bool
 setup_fault_nth(const uint8_t **in, size_t *insize, uint16_t *fault_nth);
+
+void
+begin_resource_measurement(void);
+
+void
+check_resource_usage(const char *what, uint64_t max_ns, size_t max_mem);
+
+/* The buffer size up to which the limits fuzz targets test (de)compression  */
+static inline size_t
+max_buffer_size(int ctype)
+{
+	return ctype == WIMLIB_COMPRESSION_TYPE_XPRESS ? 65536 : 1048576;
+}
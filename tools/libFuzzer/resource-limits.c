@@ -0,0 +1,124 @@
+#include "fuzzer.h"
+
+#include <time.h>
+
+/*
+ * Measure the CPU time and the memory which the library uses for some
+ * operation, so that fuzz targets can check that they are bounded by a linear
+ * function of the size of the data.  This finds inputs which would let the
+ * sender of a WIM file make us spend far more resources than the size of the
+ * file justifies.  CPU time of the calling thread is measured rather than
+ * wall-clock time so that other processes don't cause false positives.
+ */
+
+/* Each allocation is preceded by a header which records its size.  */
+#define HEADER_SIZE	16
+
+static size_t allocated_bytes;
+static size_t peak_allocated_bytes;
+static size_t start_allocated_bytes;
+static uint64_t start_ns;
+
+static void
+account(size_t added, size_t removed)
+{
+	allocated_bytes += added;
+	allocated_bytes -= removed;
+	if (allocated_bytes > peak_allocated_bytes)
+		peak_allocated_bytes = allocated_bytes;
+}
+
+static void *
+counting_malloc(size_t size)
+{
+	uint8_t *p = malloc(HEADER_SIZE + size);
+
+	if (!p)
+		return NULL;
+	memcpy(p, &size, sizeof(size));
+	account(size, 0);
+	return p + HEADER_SIZE;
+}
+
+static void
+counting_free(void *ptr)
+{
+	uint8_t *p = ptr;
+	size_t size;
+
+	if (!p)
+		return;
+	p -= HEADER_SIZE;
+	memcpy(&size, p, sizeof(size));
+	account(0, size);
+	free(p);
+}
+
+static void *
+counting_realloc(void *ptr, size_t size)
+{
+	uint8_t *p = ptr;
+	size_t old_size = 0;
+
+	if (p) {
+		p -= HEADER_SIZE;
+		memcpy(&old_size, p, sizeof(old_size));
+	}
+	p = realloc(p, HEADER_SIZE + size);
+	if (!p)
+		return NULL;
+	memcpy(p, &size, sizeof(size));
+	account(size, old_size);
+	return p + HEADER_SIZE;
+}
+
+static uint64_t
+cpu_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Start measuring.  This must be called before any memory is allocated by the
+ * library, since it installs the memory allocator which does the counting.  */
+void
+begin_resource_measurement(void)
+{
+	static bool installed;
+
+	if (!installed) {
+		wimlib_set_memory_allocator(counting_malloc, counting_free,
+					    counting_realloc);
+		installed = true;
+	}
+	start_allocated_bytes = allocated_bytes;
+	peak_allocated_bytes = allocated_bytes;
+	start_ns = cpu_time_ns();
+}
+
+/*
+ * Abort if more than @max_ns nanoseconds of CPU time have passed since
+ * begin_resource_measurement(), or if the library's memory usage has exceeded
+ * its usage at that time by more than @max_mem bytes.  @what describes the
+ * operation.
+ */
+void
+check_resource_usage(const char *what, uint64_t max_ns, size_t max_mem)
+{
+	uint64_t ns = cpu_time_ns() - start_ns;
+	size_t mem = peak_allocated_bytes - start_allocated_bytes;
+
+	if (ns > max_ns) {
+		fprintf(stderr, "%s took %llu ns, but the limit is %llu ns\n",
+			what, (unsigned long long)ns,
+			(unsigned long long)max_ns);
+		abort();
+	}
+	if (mem > max_mem) {
+		fprintf(stderr, "%s used %zu bytes, but the limit is %zu bytes\n",
+			what, mem, max_mem);
+		abort();
+	}
+}